@@ -54,6 +54,9 @@ function rspamd_parse_redis_server(module_name)
     if options['password'] and not result['password'] then
       result['password'] = options['password']
     end
+    if options['batch'] ~= nil and result['batch'] == nil then
+      result['batch'] = options['batch']
+    end
 
     if upstreams_write and upstreams_read then
       result.read_servers = upstreams_read
@@ -125,11 +128,13 @@ end
 -- args - table of arguments
 function rspamd_redis_make_request(task, redis_params, key, is_write, callback, command, args)
   local addr
+  local rspamd_util = require "rspamd_util"
+  local start = rspamd_util.get_ticks()
   local function rspamd_redis_make_request_cb(err, data)
     if err then
       addr:fail()
     else
-      addr:ok()
+      addr:ok(rspamd_util.get_ticks() - start)
     end
     callback(err, data, addr)
   end
@@ -174,6 +179,10 @@ function rspamd_redis_make_request(task, redis_params, key, is_write, callback,
     options['dbname'] = redis_params['db']
   end
 
+  if redis_params['batch'] then
+    options['batch'] = true
+  end
+
   local ret,conn = rspamd_redis.make_request(options)
   return ret,conn,addr
 end
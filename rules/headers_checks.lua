@@ -380,10 +380,10 @@ rspamd_config.PREVIOUSLY_DELIVERED = {
   callback = function(task)
     if not task:has_recipients(2) then return false end
     local to = task:get_recipients(2)
-    local rcvds = task:get_header_full('Received')
+    local rcvds = task:get_received_headers()
     if not rcvds then return false end
     for _, rcvd in ipairs(rcvds) do
-      local _,_,addr = rcvd['decoded']:lower():find("%sfor%s<(.-)>")
+      local addr = rcvd['for'] and rcvd['for']:lower():match('^<?([^>]+)>?$')
       if addr then
         for _, toa in ipairs(to) do
           if toa and toa.addr:lower() == addr then
@@ -263,10 +263,10 @@ rspamd_config.RCVD_HELO_USER = {
       return true
     end
     -- Check Received headers
-    local rcvds = task:get_header_full('Received')
+    local rcvds = task:get_received_headers()
     if not rcvds then return false end
     for _, rcvd in ipairs(rcvds) do
-      local r = rcvd['decoded']:lower()
+      local r = (rcvd['raw'] or ''):lower()
       if (r:find("^%s*from%suser%s")) then return true end
       if (r:find("helo[%s=]user[%s%)]")) then return true end
     end
@@ -46,6 +46,13 @@ static gint flag = 0;
 static gchar *fuzzy_symbol = NULL;
 static gchar *dictionary = NULL;
 static gint max_requests = 8;
+static gboolean keepalive = FALSE;
+/* Requests queued per persistent connection before waiting for replies */
+#define RSPAMC_KEEPALIVE_DEPTH 4
+#define RSPAMC_BATCH_SIZE() (keepalive ? max_requests * RSPAMC_KEEPALIVE_DEPTH : \
+		max_requests)
+static struct rspamd_client_connection **keepalive_conns = NULL;
+static guint keepalive_cur = 0;
 static gdouble timeout = 10.0;
 static gboolean pass_all;
 static gboolean tty = FALSE;
@@ -59,6 +66,7 @@ static gboolean extended_urls = FALSE;
 static gboolean mime_output = FALSE;
 static gboolean empty_input = FALSE;
 static gboolean compressed = FALSE;
+static gboolean binary = FALSE;
 static gboolean profile = FALSE;
 static gboolean skip_images = FALSE;
 static gboolean skip_attachments = FALSE;
@@ -125,6 +133,8 @@ static GOptionEntry entries[] =
 	  NULL },
 	{ "max-requests", 'n', 0, G_OPTION_ARG_INT, &max_requests,
 	  "Maximum count of parallel requests to rspamd", NULL },
+	{ "keepalive", 0, 0, G_OPTION_ARG_NONE, &keepalive,
+	  "Reuse connections for files, sending requests one by one over each of them", NULL },
 	{ "extended-urls", 0, 0, G_OPTION_ARG_NONE, &extended_urls,
 	   "Output urls in extended format", NULL },
 	{ "key", 0, 0, G_OPTION_ARG_STRING, &key,
@@ -143,6 +153,8 @@ static GOptionEntry entries[] =
 	   "Learn the specified fuzzy symbol", NULL },
 	{ "compressed", 'z', 0, G_OPTION_ARG_NONE, &compressed,
 	   "Enable zstd compression", NULL },
+	{ "binary", '\0', 0, G_OPTION_ARG_NONE, &binary,
+	   "Send scan requests using the binary envelope", NULL },
 	{ "profile", '\0', 0, G_OPTION_ARG_NONE, &profile,
 	   "Profile symbols execution time", NULL },
 	{ "dictionary", 'D', 0, G_OPTION_ARG_FILENAME, &dictionary,
@@ -324,6 +336,7 @@ struct rspamc_command {
 struct rspamc_callback_data {
 	struct rspamc_command *cmd;
 	gchar *filename;
+	gboolean persistent;
 };
 
 gboolean
@@ -1476,7 +1489,10 @@ rspamc_client_cb (struct rspamd_client_connection *conn,
 		fflush (out);
 	}
 
-	rspamd_client_destroy (conn);
+	if (!cbdata->persistent) {
+		rspamd_client_destroy (conn);
+	}
+
 	g_free (cbdata->filename);
 	g_slice_free1 (sizeof (struct rspamc_callback_data), cbdata);
 }
@@ -1490,6 +1506,7 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 	guint16 port;
 	GError *err = NULL;
 	struct rspamc_callback_data *cbdata;
+	gboolean persistent;
 
 	if (connect_str[0] == '[') {
 		p = strrchr (connect_str, ']');
@@ -1526,16 +1543,42 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 		}
 	}
 
-	conn = rspamd_client_init (ev_base, hostbuf, port, timeout, key);
+	/* Files are spread over max_requests persistent connections */
+	persistent = keepalive && cmd->need_input && in != NULL;
+
+	if (persistent) {
+		if (keepalive_conns == NULL) {
+			keepalive_conns = g_malloc0 (sizeof (*keepalive_conns) *
+					MAX (max_requests, 1));
+		}
+
+		conn = keepalive_conns[keepalive_cur];
+
+		if (conn == NULL) {
+			conn = rspamd_client_init (ev_base, hostbuf, port, timeout, key);
+
+			if (conn != NULL) {
+				rspamd_client_set_keepalive (conn, TRUE);
+				keepalive_conns[keepalive_cur] = conn;
+			}
+		}
+
+		keepalive_cur = (keepalive_cur + 1) % MAX (max_requests, 1);
+	}
+	else {
+		conn = rspamd_client_init (ev_base, hostbuf, port, timeout, key);
+	}
 
 	if (conn != NULL) {
 		cbdata = g_slice_alloc (sizeof (struct rspamc_callback_data));
 		cbdata->cmd = cmd;
 		cbdata->filename = g_strdup (name);
+		cbdata->persistent = persistent;
 
 		if (cmd->need_input) {
 			rspamd_client_command (conn, cmd->path, attrs, in, rspamc_client_cb,
-				cbdata, compressed, dictionary, &err);
+				cbdata, compressed, dictionary,
+				binary && !cmd->is_controller, &err);
 		}
 		else {
 			rspamd_client_command (conn,
@@ -1546,6 +1589,7 @@ rspamc_process_input (struct event_base *ev_base, struct rspamc_command *cmd,
 				cbdata,
 				compressed,
 				dictionary,
+				FALSE,
 				&err);
 		}
 	}
@@ -1673,7 +1717,7 @@ rspamc_process_dir (struct event_base *ev_base, struct rspamc_command *cmd,
 				cur_req++;
 				fclose (in);
 
-				if (cur_req >= max_requests) {
+				if (cur_req >= RSPAMC_BATCH_SIZE ()) {
 					cur_req = 0;
 					/* Wait for completion */
 					event_base_loop (ev_base, 0);
@@ -1809,7 +1853,7 @@ main (gint argc, gchar **argv, gchar **env)
 					cur_req++;
 					fclose (in);
 				}
-				if (cur_req >= max_requests) {
+				if (cur_req >= RSPAMC_BATCH_SIZE ()) {
 					cur_req = 0;
 					/* Wait for completion */
 					event_base_loop (ev_base, 0);
@@ -1824,6 +1868,16 @@ main (gint argc, gchar **argv, gchar **env)
 
 	event_base_loop (ev_base, 0);
 
+	if (keepalive_conns != NULL) {
+		for (i = 0; i < MAX (max_requests, 1); i ++) {
+			if (keepalive_conns[i] != NULL) {
+				rspamd_client_destroy (keepalive_conns[i]);
+			}
+		}
+
+		g_free (keepalive_conns);
+	}
+
 	g_queue_free_full (kwattrs, g_free);
 
 	/* Wait for children processes */
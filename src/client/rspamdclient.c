@@ -17,6 +17,7 @@
 #include "libutil/util.h"
 #include "libutil/http.h"
 #include "libutil/http_private.h"
+#include "libserver/protocol.h"
 #include "unix-std.h"
 #include "contrib/zstd/zstd.h"
 #include "contrib/zstd/zdict.h"
@@ -30,10 +31,17 @@
 struct rspamd_client_request;
 
 /*
- * Since rspamd uses untagged HTTP we can pass a single message per socket
+ * Since rspamd uses untagged HTTP we can pass a single message per socket at
+ * a time, persistent connections queue the next requests
  */
 struct rspamd_client_connection {
 	gint fd;
+	gchar *host;
+	guint16 port;
+	gboolean keepalive;
+	gboolean need_reconnect;
+	GQueue *queue;
+	struct event next_ev;
 	GString *server_name;
 	struct rspamd_cryptobox_pubkey *key;
 	struct rspamd_cryptobox_keypair *keypair;
@@ -50,6 +58,7 @@ struct rspamd_client_connection {
 struct rspamd_client_request {
 	struct rspamd_client_connection *conn;
 	struct rspamd_http_message *msg;
+	const gchar *mime_type;
 	GString *input;
 	rspamd_client_callback cb;
 	gpointer ud;
@@ -62,21 +71,175 @@ rspamd_client_error_quark (void)
 	return g_quark_from_static_string ("rspamd-client-error");
 }
 
+/* Attributes that have their own fields in the binary envelope */
+static const struct {
+	const gchar *name;
+	enum rspamd_protocol_tlv_type type;
+} rspamd_client_tlv_fields[] = {
+	{"IP", RSPAMD_PROTOCOL_TLV_IP},
+	{"Helo", RSPAMD_PROTOCOL_TLV_HELO},
+	{"From", RSPAMD_PROTOCOL_TLV_FROM},
+	{"Rcpt", RSPAMD_PROTOCOL_TLV_RCPT},
+	{"User", RSPAMD_PROTOCOL_TLV_USER},
+	{"Queue-ID", RSPAMD_PROTOCOL_TLV_QUEUE_ID},
+	{"Hostname", RSPAMD_PROTOCOL_TLV_HOSTNAME},
+	{"Deliver-To", RSPAMD_PROTOCOL_TLV_DELIVER_TO},
+	{"Subject", RSPAMD_PROTOCOL_TLV_SUBJECT},
+	{"Settings-ID", RSPAMD_PROTOCOL_TLV_SETTINGS_ID},
+	{"MTA-Tag", RSPAMD_PROTOCOL_TLV_MTA_TAG},
+};
+
+static rspamd_fstring_t *
+rspamd_client_tlv_envelope (GQueue *attrs)
+{
+	struct rspamd_http_client_header *nh;
+	rspamd_fstring_t *env, *hdr;
+	GList *cur;
+	guint32 flags = 0;
+	gsize vlen;
+	guint i;
+
+	env = rspamd_fstring_sized_new (256);
+
+	for (cur = attrs->head; cur != NULL; cur = g_list_next (cur)) {
+		nh = cur->data;
+		vlen = strlen (nh->value);
+
+		for (i = 0; i < G_N_ELEMENTS (rspamd_client_tlv_fields); i ++) {
+			if (g_ascii_strcasecmp (nh->name,
+					rspamd_client_tlv_fields[i].name) == 0) {
+				break;
+			}
+		}
+
+		if (i < G_N_ELEMENTS (rspamd_client_tlv_fields)) {
+			rspamd_protocol_tlv_append (&env, rspamd_client_tlv_fields[i].type,
+					nh->value, vlen);
+		}
+		else if (g_ascii_strcasecmp (nh->name, "Pass") == 0 &&
+				g_ascii_strcasecmp (nh->value, "all") == 0) {
+			flags |= RSPAMD_PROTOCOL_TLV_FLAG_PASS_ALL;
+		}
+		else if (g_ascii_strcasecmp (nh->name, "Log") == 0 &&
+				g_ascii_strcasecmp (nh->value, "no") == 0) {
+			flags |= RSPAMD_PROTOCOL_TLV_FLAG_NO_LOG;
+		}
+		else if (g_ascii_strcasecmp (nh->name, "URL-Format") == 0 &&
+				g_ascii_strcasecmp (nh->value, "extended") == 0) {
+			flags |= RSPAMD_PROTOCOL_TLV_FLAG_EXT_URLS;
+		}
+		else if (g_ascii_strcasecmp (nh->name, "Profile") == 0) {
+			flags |= RSPAMD_PROTOCOL_TLV_FLAG_PROFILE;
+		}
+		else {
+			/* Name including its terminating zero followed by value */
+			hdr = rspamd_fstring_new_init (nh->name, strlen (nh->name) + 1);
+			hdr = rspamd_fstring_append (hdr, nh->value, vlen);
+			rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_HEADER,
+					hdr->str, hdr->len);
+			rspamd_fstring_free (hdr);
+		}
+	}
+
+	if (flags != 0) {
+		flags = GUINT32_TO_BE (flags);
+		rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_FLAGS,
+				&flags, sizeof (flags));
+	}
+
+	rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_END, NULL, 0);
+
+	return env;
+}
+
 static void
 rspamd_client_request_free (struct rspamd_client_request *req)
 {
 	if (req != NULL) {
-		if (req->conn) {
+		if (req->conn && req->conn->req == req) {
 			req->conn->req = NULL;
 		}
 		if (req->input) {
 			g_string_free (req->input, TRUE);
 		}
+		if (req->msg) {
+			/* Not yet passed to the http connection */
+			rspamd_http_message_unref (req->msg);
+		}
 
 		g_slice_free1 (sizeof (*req), req);
 	}
 }
 
+static void
+rspamd_client_request_start (struct rspamd_client_connection *conn,
+		struct rspamd_client_request *req)
+{
+	struct rspamd_http_message *msg = req->msg;
+
+	conn->req = req;
+	conn->req_sent = FALSE;
+	conn->send_time = 0;
+	conn->start_time = rspamd_get_ticks ();
+	/* Owned by the http connection from now */
+	req->msg = NULL;
+
+	rspamd_http_connection_write_message (conn->http_conn, msg, NULL,
+			req->mime_type, req, conn->fd, &conn->timeout, conn->ev_base);
+}
+
+static void
+rspamd_client_next_request (gint fd, short what, gpointer ud)
+{
+	struct rspamd_client_connection *conn = ud;
+	struct rspamd_client_request *req;
+	gint nfd;
+
+	if (conn->req != NULL) {
+		rspamd_client_request_free (conn->req);
+	}
+
+	rspamd_http_connection_reset (conn->http_conn);
+	req = g_queue_pop_head (conn->queue);
+
+	if (req == NULL) {
+		return;
+	}
+
+	if (conn->need_reconnect) {
+		/* Server has closed the previous connection */
+		nfd = rspamd_socket (conn->host, conn->port, SOCK_STREAM, TRUE,
+				FALSE, TRUE);
+
+		if (nfd != -1) {
+			close (conn->fd);
+			conn->fd = nfd;
+			conn->need_reconnect = FALSE;
+		}
+	}
+
+	rspamd_client_request_start (conn, req);
+}
+
+/*
+ * Called after the callback of a persistent connection: the next request
+ * is started from the event loop, as the current one is still being
+ * processed by the http code
+ */
+static void
+rspamd_client_request_done (struct rspamd_client_connection *conn,
+		gboolean reuse)
+{
+	struct timeval tv = {0, 0};
+
+	if (!reuse) {
+		conn->need_reconnect = TRUE;
+	}
+
+	event_del (&conn->next_ev);
+	evtimer_add (&conn->next_ev, &tv);
+}
+
 static gint
 rspamd_client_body_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg,
@@ -92,149 +255,191 @@ rspamd_client_error_handler (struct rspamd_http_connection *conn, GError *err)
 	struct rspamd_client_request *req =
 		(struct rspamd_client_request *)conn->ud;
 	struct rspamd_client_connection *c;
+	gboolean keepalive;
 
 	c = req->conn;
+	keepalive = c->keepalive;
 	req->cb (c, NULL, c->server_name->str, NULL,
 			req->input, req->ud,
 			c->start_time, c->send_time, err);
+
+	if (keepalive) {
+		rspamd_client_request_done (c, FALSE);
+	}
 }
 
-static gint
-rspamd_client_finish_handler (struct rspamd_http_connection *conn,
-	struct rspamd_http_message *msg)
+static ucl_object_t *
+rspamd_client_parse_reply (struct rspamd_http_message *msg,
+		const guchar *data, gsize len, GError **err)
 {
-	struct rspamd_client_request *req =
-		(struct rspamd_client_request *)conn->ud;
-	struct rspamd_client_connection *c;
+	const rspamd_ftok_t *ctype;
 	struct ucl_parser *parser;
-	GError *err;
-	const rspamd_ftok_t *tok;
+	ucl_object_t *obj;
 
-	c = req->conn;
+	ctype = rspamd_http_message_find_header (msg, "Content-Type");
 
-	if (!c->req_sent) {
-		c->req_sent = TRUE;
-		c->send_time = rspamd_get_ticks ();
-		rspamd_http_connection_reset (c->http_conn);
-		rspamd_http_connection_read_message (c->http_conn,
-			c->req,
-			c->fd,
-			&c->timeout,
-			c->ev_base);
-		return 0;
+	if (ctype && ctype->len == sizeof (RSPAMD_PROTOCOL_TLV_CTYPE) - 1 &&
+			rspamd_lc_cmp (ctype->begin, RSPAMD_PROTOCOL_TLV_CTYPE,
+					ctype->len) == 0) {
+		return rspamd_protocol_tlv_reply_to_ucl (data, len, err);
 	}
-	else {
-		if (rspamd_http_message_get_body (msg, NULL) == NULL || msg->code != 200) {
-			err = g_error_new (RCLIENT_ERROR, msg->code, "HTTP error: %d, %.*s",
-					msg->code,
-					(gint)msg->status->len, msg->status->str);
-			req->cb (c, msg, c->server_name->str, NULL, req->input, req->ud,
-					c->start_time, c->send_time, err);
-			g_error_free (err);
 
-			return 0;
-		}
+	parser = ucl_parser_new (0);
 
-		tok = rspamd_http_message_find_header (msg, "compression");
+	if (!ucl_parser_add_chunk (parser, data, len)) {
+		g_set_error (err, RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
+				ucl_parser_get_error (parser));
+		ucl_parser_free (parser);
 
-		if (tok) {
-			/* Need to uncompress */
-			rspamd_ftok_t t;
+		return NULL;
+	}
 
-			t.begin = "zstd";
-			t.len = 4;
+	obj = ucl_parser_get_object (parser);
+	ucl_parser_free (parser);
 
-			if (rspamd_ftok_casecmp (tok, &t) == 0) {
-				ZSTD_DStream *zstream;
-				ZSTD_inBuffer zin;
-				ZSTD_outBuffer zout;
-				guchar *out;
-				gsize outlen, r;
+	return obj;
+}
 
-				zstream = ZSTD_createDStream ();
-				ZSTD_initDStream (zstream);
+static void
+rspamd_client_process_reply (struct rspamd_client_connection *c,
+		struct rspamd_client_request *req,
+		struct rspamd_http_message *msg)
+{
+	ucl_object_t *result;
+	GError *err = NULL;
+	const rspamd_ftok_t *tok;
 
-				zin.pos = 0;
-				zin.src = msg->body_buf.begin;
-				zin.size = msg->body_buf.len;
+	if (rspamd_http_message_get_body (msg, NULL) == NULL || msg->code != 200) {
+		err = g_error_new (RCLIENT_ERROR, msg->code, "HTTP error: %d, %.*s",
+				msg->code,
+				(gint)msg->status->len, msg->status->str);
+		req->cb (c, msg, c->server_name->str, NULL, req->input, req->ud,
+				c->start_time, c->send_time, err);
+		g_error_free (err);
 
-				if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-					outlen = ZSTD_DStreamOutSize ();
-				}
+		return;
+	}
 
-				out = g_malloc (outlen);
-				zout.dst = out;
-				zout.pos = 0;
-				zout.size = outlen;
-
-				while (zin.pos < zin.size) {
-					r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-					if (ZSTD_isError (r)) {
-						err = g_error_new (RCLIENT_ERROR, 500,
-								"Decompression error: %s",
-								ZSTD_getErrorName (r));
-						req->cb (c, msg, c->server_name->str, NULL,
-								req->input, req->ud, c->start_time,
-								c->send_time, err);
-						g_error_free (err);
-						ZSTD_freeDStream (zstream);
-						g_free (out);
-
-						return 0;
-					}
-
-					if (zout.pos == zout.size) {
-						/* We need to extend output buffer */
-						zout.size = zout.size * 1.5 + 1.0;
-						zout.dst = g_realloc (zout.dst, zout.size);
-					}
-				}
+	tok = rspamd_http_message_find_header (msg, "compression");
 
-				ZSTD_freeDStream (zstream);
+	if (tok) {
+		/* Need to uncompress */
+		rspamd_ftok_t t;
 
-				parser = ucl_parser_new (0);
-				if (!ucl_parser_add_chunk (parser, zout.dst, zout.pos)) {
-					err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
-							ucl_parser_get_error (parser));
-					ucl_parser_free (parser);
-					req->cb (c, msg, c->server_name->str, NULL, req->input,
-							req->ud, c->start_time, c->send_time, err);
+		t.begin = "zstd";
+		t.len = 4;
+
+		if (rspamd_ftok_casecmp (tok, &t) == 0) {
+			ZSTD_DStream *zstream;
+			ZSTD_inBuffer zin;
+			ZSTD_outBuffer zout;
+			guchar *out;
+			gsize outlen, r;
+
+			zstream = ZSTD_createDStream ();
+			ZSTD_initDStream (zstream);
+
+			zin.pos = 0;
+			zin.src = msg->body_buf.begin;
+			zin.size = msg->body_buf.len;
+
+			if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
+				outlen = ZSTD_DStreamOutSize ();
+			}
+
+			out = g_malloc (outlen);
+			zout.dst = out;
+			zout.pos = 0;
+			zout.size = outlen;
+
+			while (zin.pos < zin.size) {
+				r = ZSTD_decompressStream (zstream, &zout, &zin);
+
+				if (ZSTD_isError (r)) {
+					err = g_error_new (RCLIENT_ERROR, 500,
+							"Decompression error: %s",
+							ZSTD_getErrorName (r));
+					req->cb (c, msg, c->server_name->str, NULL,
+							req->input, req->ud, c->start_time,
+							c->send_time, err);
 					g_error_free (err);
-					g_free (zout.dst);
+					ZSTD_freeDStream (zstream);
+					g_free (out);
 
-					return 0;
+					return;
 				}
 
-				g_free (zout.dst);
-			}
-			else {
-				err = g_error_new (RCLIENT_ERROR, 500,
-						"Invalid compression method");
-				req->cb (c, msg, c->server_name->str, NULL,
-						req->input, req->ud, c->start_time, c->send_time, err);
-				g_error_free (err);
-
-				return 0;
+				if (zout.pos == zout.size) {
+					/* We need to extend output buffer */
+					zout.size = zout.size * 1.5 + 1.0;
+					zout.dst = g_realloc (zout.dst, zout.size);
+				}
 			}
+
+			ZSTD_freeDStream (zstream);
+
+			result = rspamd_client_parse_reply (msg, zout.dst, zout.pos,
+					&err);
+			g_free (zout.dst);
 		}
 		else {
-			parser = ucl_parser_new (0);
-			if (!ucl_parser_add_chunk (parser, msg->body_buf.begin, msg->body_buf.len)) {
-				err = g_error_new (RCLIENT_ERROR, msg->code, "Cannot parse UCL: %s",
-						ucl_parser_get_error (parser));
-				ucl_parser_free (parser);
-				req->cb (c, msg, c->server_name->str, NULL,
-						req->input, req->ud, c->start_time, c->send_time, err);
-				g_error_free (err);
-
-				return 0;
-			}
+			err = g_error_new (RCLIENT_ERROR, 500,
+					"Invalid compression method");
+			req->cb (c, msg, c->server_name->str, NULL,
+					req->input, req->ud, c->start_time, c->send_time, err);
+			g_error_free (err);
+
+			return;
 		}
+	}
+	else {
+		result = rspamd_client_parse_reply (msg,
+				(const guchar *)msg->body_buf.begin, msg->body_buf.len,
+				&err);
+	}
 
-		req->cb (c, msg, c->server_name->str, ucl_parser_get_object (
-				parser), req->input, req->ud, c->start_time, c->send_time, NULL);
-		ucl_parser_free (parser);
+	if (result == NULL) {
+		req->cb (c, msg, c->server_name->str, NULL,
+				req->input, req->ud, c->start_time, c->send_time, err);
+		g_error_free (err);
+
+		return;
+	}
+
+	req->cb (c, msg, c->server_name->str, result, req->input, req->ud,
+			c->start_time, c->send_time, NULL);
+}
+
+static gint
+rspamd_client_finish_handler (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_client_request *req =
+		(struct rspamd_client_request *)conn->ud;
+	struct rspamd_client_connection *c;
+	gboolean keepalive, reuse;
+
+	c = req->conn;
+
+	if (!c->req_sent) {
+		c->req_sent = TRUE;
+		c->send_time = rspamd_get_ticks ();
+		rspamd_http_connection_reset (c->http_conn);
+		rspamd_http_connection_read_message (c->http_conn,
+			c->req,
+			c->fd,
+			&c->timeout,
+			c->ev_base);
+		return 0;
+	}
+
+	/* Connection might be destroyed by callback unless it is persistent */
+	keepalive = c->keepalive;
+	reuse = rspamd_http_message_is_keepalive (msg);
+	rspamd_client_process_reply (c, req, msg);
+
+	if (keepalive) {
+		rspamd_client_request_done (c, reuse);
 	}
 
 	return 0;
@@ -255,6 +460,11 @@ rspamd_client_init (struct event_base *ev_base, const gchar *name,
 	conn = g_slice_alloc0 (sizeof (struct rspamd_client_connection));
 	conn->ev_base = ev_base;
 	conn->fd = fd;
+	conn->host = g_strdup (name);
+	conn->port = port;
+	conn->queue = g_queue_new ();
+	evtimer_set (&conn->next_ev, rspamd_client_next_request, conn);
+	event_base_set (ev_base, &conn->next_ev);
 	conn->req_sent = FALSE;
 	conn->keys_cache = rspamd_keypair_cache_new (32);
 	conn->http_conn = rspamd_http_connection_new (rspamd_client_body_handler,
@@ -296,6 +506,7 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 		FILE *in, rspamd_client_callback cb,
 		gpointer ud, gboolean compressed,
 		const gchar *comp_dictionary,
+		gboolean binary,
 		GError **err)
 {
 	struct rspamd_client_request *req;
@@ -304,7 +515,7 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	gsize remain, old_len;
 	GList *cur;
 	GString *input = NULL;
-	rspamd_fstring_t *body;
+	rspamd_fstring_t *body, *envelope;
 	guint dict_id = 0;
 	gsize dict_len = 0;
 	void *dict = NULL;
@@ -365,7 +576,7 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 					return FALSE;
 				}
 
-				dict_id = ZDICT_getDictID (comp_dictionary, dict_len);
+				dict_id = ZDICT_getDictID (dict, dict_len);
 
 				if (dict_id == 0) {
 					g_set_error (err, RCLIENT_ERROR, errno,
@@ -403,20 +614,37 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 			ZSTD_freeCCtx (zctx);
 		}
 
-		rspamd_http_message_set_body_from_fstring_steal (req->msg, body);
 		req->input = input;
 	}
 	else {
+		body = NULL;
 		req->input = NULL;
 	}
 
-	/* Convert headers */
-	cur = attrs->head;
-	while (cur != NULL) {
-		nh = cur->data;
+	if (binary) {
+		/* Attributes are sent in the envelope before the message */
+		envelope = rspamd_client_tlv_envelope (attrs);
+
+		if (body) {
+			envelope = rspamd_fstring_append (envelope, body->str, body->len);
+			rspamd_fstring_free (body);
+		}
 
-		rspamd_http_message_add_header (req->msg, nh->name, nh->value);
-		cur = g_list_next (cur);
+		body = envelope;
+	}
+	else {
+		/* Convert headers */
+		cur = attrs->head;
+		while (cur != NULL) {
+			nh = cur->data;
+
+			rspamd_http_message_add_header (req->msg, nh->name, nh->value);
+			cur = g_list_next (cur);
+		}
+	}
+
+	if (body) {
+		rspamd_http_message_set_body_from_fstring_steal (req->msg, body);
 	}
 
 	if (compressed) {
@@ -433,30 +661,51 @@ rspamd_client_command (struct rspamd_client_connection *conn,
 	req->msg->url = rspamd_fstring_append (req->msg->url, "/", 1);
 	req->msg->url = rspamd_fstring_append (req->msg->url, command, strlen (command));
 
-	conn->req = req;
-	conn->start_time = rspamd_get_ticks ();
-
-	if (compressed) {
-		rspamd_http_connection_write_message (conn->http_conn, req->msg, NULL,
-				"application/x-compressed", req, conn->fd,
-				&conn->timeout, conn->ev_base);
+	if (binary) {
+		req->mime_type = RSPAMD_PROTOCOL_TLV_CTYPE;
+	}
+	else if (compressed) {
+		req->mime_type = "application/x-compressed";
 	}
 	else {
-		rspamd_http_connection_write_message (conn->http_conn, req->msg, NULL,
-				"text/plain", req, conn->fd, &conn->timeout, conn->ev_base);
+		req->mime_type = "text/plain";
 	}
 
+	if (conn->keepalive) {
+		req->msg->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+
+		if (conn->req != NULL || g_queue_get_length (conn->queue) > 0) {
+			/* Sent when the previous replies are received */
+			g_queue_push_tail (conn->queue, req);
+
+			return TRUE;
+		}
+	}
+
+	rspamd_client_request_start (conn, req);
+
 	return TRUE;
 }
 
+void
+rspamd_client_set_keepalive (struct rspamd_client_connection *conn,
+		gboolean keepalive)
+{
+	conn->keepalive = keepalive;
+}
+
 void
 rspamd_client_destroy (struct rspamd_client_connection *conn)
 {
 	if (conn != NULL) {
+		event_del (&conn->next_ev);
 		rspamd_http_connection_unref (conn->http_conn);
 		if (conn->req != NULL) {
 			rspamd_client_request_free (conn->req);
 		}
+		g_queue_free_full (conn->queue,
+				(GDestroyNotify)rspamd_client_request_free);
+		g_free (conn->host);
 		close (conn->fd);
 		if (conn->key) {
 			rspamd_pubkey_unref (conn->key);
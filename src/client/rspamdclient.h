@@ -70,6 +70,7 @@ struct rspamd_client_connection * rspamd_client_init (
  * @param in input file or NULL if no input required
  * @param cb callback to be called on command completion
  * @param ud opaque user data
+ * @param binary send attributes in the binary envelope instead of headers
  * @return
  */
 gboolean rspamd_client_command (
@@ -81,8 +82,20 @@ gboolean rspamd_client_command (
 	gpointer ud,
 	gboolean compressed,
 	const gchar *comp_dictionary,
+	gboolean binary,
 	GError **err);
 
+/**
+ * Make connection persistent: commands issued while a request is in flight
+ * are queued and sent over the same socket one by one, reconnecting if the
+ * server does not keep the connection. Persistent connection must not be
+ * destroyed from the callback
+ * @param conn
+ * @param keepalive
+ */
+void rspamd_client_set_keepalive (struct rspamd_client_connection *conn,
+		gboolean keepalive);
+
 /**
  * Destroy a connection to rspamd
  * @param conn
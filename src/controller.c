@@ -27,6 +27,7 @@
 #include "ottery.h"
 #include "fuzzy_wire.h"
 #include "libutil/rrd.h"
+#include "libutil/shm_counters.h"
 #include "unix-std.h"
 #include "utlist.h"
 #include <math.h>
@@ -59,6 +60,7 @@
 #define PATH_ERRORS "/errors"
 #define PATH_NEIGHBOURS "/neighbours"
 #define PATH_PLUGINS "/plugins"
+#define PATH_METRICS "/metrics"
 
 #define msg_err_session(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL, \
         session->pool->tag.tagname, session->pool->tag.uid, \
@@ -107,6 +109,13 @@ const struct timeval rrd_update_time = {
 
 const guint64 rspamd_controller_ctx_magic = 0xf72697805e6941faULL;
 
+/* Upper bounds of Lua GC pauses buckets in /stat */
+static const gchar *lua_gc_pause_buckets[RSPAMD_LUA_GC_PAUSE_BUCKETS] = {
+		"0.1ms", "0.5ms", "1ms", "2ms", "5ms", "10ms", "50ms", "inf"
+};
+static const gdouble lua_gc_pause_bounds[RSPAMD_LUA_GC_PAUSE_BUCKETS - 1] =
+		RSPAMD_LUA_GC_PAUSE_BOUNDS;
+
 extern void fuzzy_stat_command (struct rspamd_task *task);
 
 gpointer init_controller_worker (struct rspamd_config *cfg);
@@ -120,6 +129,17 @@ worker_t controller_worker = {
 	RSPAMD_WORKER_SOCKET_TCP,       /* TCP socket */
 	RSPAMD_WORKER_VER       /* Version info */
 };
+/* Statistics shared between controllers, serialized as JSON */
+#define CONTROLLER_STAT_CACHE_SIZE (64 * 1024)
+#define DEFAULT_STATS_REFRESH 10.0
+
+struct rspamd_controller_stat_cache {
+	rspamd_mempool_rwlock_t *lock;
+	gdouble updated;
+	gsize len;
+	gchar data[CONTROLLER_STAT_CACHE_SIZE];
+};
+
 /*
  * Worker's context
  */
@@ -176,6 +196,16 @@ struct rspamd_controller_worker_ctx {
 
 	struct event *rrd_event;
 	struct rspamd_rrd_file *rrd;
+	/* Graphs JSON for each rra, valid until the next rrd update */
+	unsigned char *graph_cache[4];
+	gdouble graph_cache_update[4];
+
+	/* Statistics refreshed on timer */
+	gdouble stats_refresh;
+	struct rspamd_controller_stat_cache *stat_cache;
+	struct event stat_refresh_ev;
+	struct timeval stat_refresh_tv;
+	gboolean stat_refreshing;
 };
 
 struct rspamd_controller_plugin_cbdata {
@@ -675,7 +705,7 @@ rspamd_controller_handle_auth (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
-	struct rspamd_stat *st;
+	struct rspamd_stat *st, stat_copy;
 	int64_t uptime;
 	gulong data[5];
 	ucl_object_t *obj;
@@ -685,7 +715,8 @@ rspamd_controller_handle_auth (struct rspamd_http_connection_entry *conn_ent,
 	}
 
 	obj = ucl_object_typed_new (UCL_OBJECT);
-	st = session->ctx->srv->stat;
+	rspamd_main_stat_copy (session->ctx->srv, &stat_copy);
+	st = &stat_copy;
 	data[0] = st->actions_stat[METRIC_ACTION_NOACTION];
 	data[1] = st->actions_stat[METRIC_ACTION_ADD_HEADER] +
 		st->actions_stat[METRIC_ACTION_REWRITE_SUBJECT];
@@ -1091,6 +1122,7 @@ rspamd_controller_handle_pie_chart (
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_stat stat;
 	gdouble data[5], total;
 	ucl_object_t *top;
 
@@ -1101,15 +1133,16 @@ rspamd_controller_handle_pie_chart (
 	}
 
 	top = ucl_object_typed_new (UCL_ARRAY);
-	total = ctx->srv->stat->messages_scanned;
+	rspamd_main_stat_copy (ctx->srv, &stat);
+	total = stat.messages_scanned;
 	if (total != 0) {
 
-		data[0] = ctx->srv->stat->actions_stat[METRIC_ACTION_NOACTION];
-		data[1] = ctx->srv->stat->actions_stat[METRIC_ACTION_SOFT_REJECT];
-		data[2] = (ctx->srv->stat->actions_stat[METRIC_ACTION_ADD_HEADER] +
-			ctx->srv->stat->actions_stat[METRIC_ACTION_REWRITE_SUBJECT]);
-		data[3] = ctx->srv->stat->actions_stat[METRIC_ACTION_GREYLIST];
-		data[4] = ctx->srv->stat->actions_stat[METRIC_ACTION_REJECT];
+		data[0] = stat.actions_stat[METRIC_ACTION_NOACTION];
+		data[1] = stat.actions_stat[METRIC_ACTION_SOFT_REJECT];
+		data[2] = (stat.actions_stat[METRIC_ACTION_ADD_HEADER] +
+			stat.actions_stat[METRIC_ACTION_REWRITE_SUBJECT]);
+		data[3] = stat.actions_stat[METRIC_ACTION_GREYLIST];
+		data[4] = stat.actions_stat[METRIC_ACTION_REJECT];
 	}
 	else {
 		memset (data, 0, sizeof (data));
@@ -1262,6 +1295,16 @@ rspamd_controller_handle_graph (
 		return 0;
 	}
 
+	if (ctx->graph_cache[rra_num] != NULL &&
+			ctx->graph_cache_update[rra_num] == rrd_result->last_update) {
+		/* Rrd has not been updated since the last request */
+		rspamd_controller_send_string (conn_ent,
+				(const gchar *)ctx->graph_cache[rra_num]);
+		g_slice_free1 (sizeof (*rrd_result), rrd_result);
+
+		return 0;
+	}
+
 	g_assert (rrd_result->ds_count == G_N_ELEMENTS (elt));
 
 	res = ucl_object_typed_new (UCL_ARRAY);
@@ -1318,13 +1361,87 @@ rspamd_controller_handle_graph (
 		ucl_array_append (res, elt[i]);
 	}
 
-	rspamd_controller_send_ucl (conn_ent, res);
+	if (ctx->graph_cache[rra_num] != NULL) {
+		free (ctx->graph_cache[rra_num]);
+	}
+
+	ctx->graph_cache[rra_num] = ucl_object_emit (res, UCL_EMIT_JSON_COMPACT);
+	ctx->graph_cache_update[rra_num] = rrd_result->last_update;
+	rspamd_controller_send_string (conn_ent,
+			(const gchar *)ctx->graph_cache[rra_num]);
 	ucl_object_unref (res);
 	g_free (acc);
+	g_slice_free1 (sizeof (*rrd_result), rrd_result);
 
 	return 0;
 }
 
+static ucl_object_t *
+rspamd_controller_history_row_to_ucl (struct roll_history_row *row)
+{
+	struct tm *tm;
+	gchar timebuf[32];
+	ucl_object_t *obj;
+
+	tm = localtime (&row->tv.tv_sec);
+	strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (
+			timebuf),		  "time", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (
+			row->tv.tv_sec), "unix_time", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (
+			row->id), "seq", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (
+			row->message_id), "id",	  0, false);
+	ucl_object_insert_key (obj, ucl_object_fromstring (row->from_addr),
+			"ip", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromstring (rspamd_action_to_str (
+					row->action)), "action", 0, false);
+
+	if (!isnan (row->score)) {
+		ucl_object_insert_key (obj, ucl_object_fromdouble (
+				row->score),		  "score",			0, false);
+	}
+	else {
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (0.0), "score", 0, false);
+	}
+
+	if (!isnan (row->required_score)) {
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (
+						row->required_score), "required_score", 0, false);
+	}
+	else {
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (0.0), "required_score", 0, false);
+	}
+
+	ucl_object_insert_key (obj, ucl_object_fromstring (
+			row->symbols),		  "symbols",		0, false);
+	ucl_object_insert_key (obj,	   ucl_object_fromint (
+			row->len),			  "size",			0, false);
+	ucl_object_insert_key (obj,	   ucl_object_fromdouble (
+			row->scan_time),	  "scan_time",		0, false);
+	if (row->user[0] != '\0') {
+		ucl_object_insert_key (obj, ucl_object_fromstring (
+				row->user), "user", 0, false);
+	}
+	if (row->from_addr[0] != '\0') {
+		ucl_object_insert_key (obj, ucl_object_fromstring (
+				row->from_addr), "from", 0, false);
+	}
+
+	return obj;
+}
+
+/*
+ * Rows are emitted from the oldest one. If `since` query argument is
+ * specified, then only rows with larger `seq` are returned in `rows` along
+ * with `last` cursor to be used in the next request
+ */
 static void
 rspamd_controller_handle_legacy_history (
 		struct rspamd_controller_session *session,
@@ -1332,82 +1449,52 @@ rspamd_controller_handle_legacy_history (
 		struct rspamd_http_connection_entry *conn_ent,
 		struct rspamd_http_message *msg)
 {
-	struct roll_history_row *row, *copied_rows;
-	guint i, rows_proc, row_num;
-	struct tm *tm;
-	gchar timebuf[32];
-	ucl_object_t *top, *obj;
+	struct roll_history *history = ctx->srv->history;
+	struct roll_history_row row;
+	GHashTable *query;
+	rspamd_ftok_t srch, *found;
+	gulong since = 0;
+	gboolean incremental = FALSE;
+	guint64 id, last;
+	ucl_object_t *top, *rows;
 
-	top = ucl_object_typed_new (UCL_ARRAY);
+	query = rspamd_http_message_parse_query (msg);
 
-	/* Set lock on history */
-	copied_rows = g_slice_alloc (sizeof (*copied_rows) * ctx->srv->history->nrows);
-	memcpy (copied_rows, ctx->srv->history->rows,
-			sizeof (*copied_rows) * ctx->srv->history->nrows);
-
-	/* Go through all rows */
-	row_num = ctx->srv->history->cur_row;
-
-	for (i = 0, rows_proc = 0; i < ctx->srv->history->nrows; i++, row_num++) {
-		if (row_num == ctx->srv->history->nrows) {
-			row_num = 0;
-		}
-		row = &copied_rows[row_num];
-		/* Get only completed rows */
-		if (row->completed) {
-			tm = localtime (&row->tv.tv_sec);
-			strftime (timebuf, sizeof (timebuf) - 1, "%Y-%m-%d %H:%M:%S", tm);
-			obj = ucl_object_typed_new (UCL_OBJECT);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					timebuf),		  "time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromint (
-					row->tv.tv_sec), "unix_time", 0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->message_id), "id",	  0, false);
-			ucl_object_insert_key (obj, ucl_object_fromstring (row->from_addr),
-					"ip", 0, false);
-			ucl_object_insert_key (obj,
-					ucl_object_fromstring (rspamd_action_to_str (
-							row->action)), "action", 0, false);
+	if (query) {
+		RSPAMD_FTOK_ASSIGN (&srch, "since");
+		found = g_hash_table_lookup (query, &srch);
 
-			if (!isnan (row->score)) {
-				ucl_object_insert_key (obj, ucl_object_fromdouble (
-						row->score),		  "score",			0, false);
-			}
-			else {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (0.0), "score", 0, false);
-			}
+		if (found && rspamd_strtoul (found->begin, found->len, &since)) {
+			incremental = TRUE;
+		}
 
-			if (!isnan (row->required_score)) {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (
-								row->required_score), "required_score", 0, false);
-			}
-			else {
-				ucl_object_insert_key (obj,
-						ucl_object_fromdouble (0.0), "required_score", 0, false);
-			}
+		g_hash_table_unref (query);
+	}
 
-			ucl_object_insert_key (obj, ucl_object_fromstring (
-					row->symbols),		  "symbols",		0, false);
-			ucl_object_insert_key (obj,	   ucl_object_fromint (
-					row->len),			  "size",			0, false);
-			ucl_object_insert_key (obj,	   ucl_object_fromdouble (
-					row->scan_time),	  "scan_time",		0, false);
-			if (row->user[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (
-						row->user), "user", 0, false);
-			}
-			if (row->from_addr[0] != '\0') {
-				ucl_object_insert_key (obj, ucl_object_fromstring (
-						row->from_addr), "from", 0, false);
-			}
-			ucl_array_append (top, obj);
-			rows_proc++;
+	rows = ucl_object_typed_new (UCL_ARRAY);
+	last = rspamd_roll_history_last_id (history);
+	id = last > history->nrows ? last - history->nrows + 1 : 1;
+
+	if (incremental && since >= id) {
+		id = since + 1;
+	}
+
+	for (; id <= last; id ++) {
+		/* Skip rows that are being written or have been overwritten */
+		if (rspamd_roll_history_get_row (history, id, &row)) {
+			ucl_array_append (rows, rspamd_controller_history_row_to_ucl (&row));
 		}
 	}
 
+	if (incremental) {
+		top = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (top, ucl_object_fromint (last), "last", 0, false);
+		ucl_object_insert_key (top, rows, "rows", 0, false);
+	}
+	else {
+		top = rows;
+	}
+
 	rspamd_controller_send_ucl (conn_ent, top);
 	ucl_object_unref (top);
 }
@@ -1621,8 +1708,6 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
-	struct roll_history_row *row;
-	guint start_row, i, t;
 	lua_State *L;
 
 	ctx = session->ctx;
@@ -1633,26 +1718,7 @@ rspamd_controller_handle_history_reset (struct rspamd_http_connection_entry *con
 	}
 
 	if (!ctx->srv->history->disabled) {
-		/* Clean from start to the current row */
-		start_row = g_atomic_int_get (&ctx->srv->history->cur_row);
-
-		for (i = 0; i < start_row; i ++) {
-			t = g_atomic_int_get (&ctx->srv->history->cur_row);
-
-			/* We somehow come to the race condition */
-			if (i >= t) {
-				break;
-			}
-
-			row = &ctx->srv->history->rows[i];
-			memset (row, 0, sizeof (*row));
-		}
-
-		start_row = g_atomic_int_get (&ctx->srv->history->cur_row);
-		/* Optimistically set all bytes to zero (might cause race) */
-		memset (ctx->srv->history->rows,
-				0,
-				sizeof (*row) * (ctx->srv->history->nrows - start_row));
+		rspamd_roll_history_reset (ctx->srv->history);
 
 		msg_info_session ("<%s> reseted history",
 				rspamd_inet_address_to_string (session->from_addr));
@@ -1879,7 +1945,9 @@ rspamd_controller_scan_reply (struct rspamd_task *task)
 	rspamd_protocol_http_reply (msg, task);
 	rspamd_http_connection_reset (conn_ent->conn);
 	rspamd_http_connection_write_message (conn_ent->conn, msg, NULL,
-			"application/json", conn_ent, conn_ent->conn->fd, conn_ent->rt->ptv,
+			(task->flags & RSPAMD_TASK_FLAG_MSGPACK) ?
+					"application/msgpack" : "application/json",
+			conn_ent, conn_ent->conn->fd, conn_ent->rt->ptv,
 			conn_ent->rt->ev_base);
 	conn_ent->is_reply = TRUE;
 }
@@ -2467,29 +2535,28 @@ rspamd_controller_handle_savemap (struct rspamd_http_connection_entry *conn_ent,
 
 struct rspamd_stat_cbdata {
 	struct rspamd_http_connection_entry *conn_ent;
+	struct rspamd_controller_worker_ctx *ctx;
 	ucl_object_t *top;
 	ucl_object_t *stat;
 	struct rspamd_task *task;
 	guint64 learned;
 };
 
-static gboolean
-rspamd_controller_stat_fin_task (void *ud)
+/* Inserts data collected by a stat task: statfiles and fuzzy hashes */
+static void
+rspamd_controller_stat_task_data (struct rspamd_stat_cbdata *cbdata,
+		ucl_object_t *top)
 {
-	struct rspamd_stat_cbdata *cbdata = ud;
-	struct rspamd_http_connection_entry *conn_ent;
-	ucl_object_t *top, *ar;
+	ucl_object_t *ar;
 	GList *fuzzy_elts, *cur;
 	struct rspamd_fuzzy_stat_entry *entry;
 
-	conn_ent = cbdata->conn_ent;
-	top = cbdata->top;
-
 	ucl_object_insert_key (top,
 			ucl_object_fromint (cbdata->learned), "total_learns", 0, false);
 
 	if (cbdata->stat) {
 		ucl_object_insert_key (top, cbdata->stat, "statfiles", 0, false);
+		cbdata->stat = NULL;
 	}
 
 	fuzzy_elts = rspamd_mempool_get_variable (cbdata->task->task_pool, "fuzzy_stat");
@@ -2508,9 +2575,15 @@ rspamd_controller_stat_fin_task (void *ud)
 
 		ucl_object_insert_key (top, ar, "fuzzy_hashes", 0, false);
 	}
+}
 
-	rspamd_controller_send_ucl (conn_ent, top);
+static gboolean
+rspamd_controller_stat_fin_task (void *ud)
+{
+	struct rspamd_stat_cbdata *cbdata = ud;
 
+	rspamd_controller_stat_task_data (cbdata, cbdata->top);
+	rspamd_controller_send_ucl (cbdata->conn_ent, cbdata->top);
 
 	return TRUE;
 }
@@ -2524,6 +2597,122 @@ rspamd_controller_stat_cleanup_task (void *ud)
 	ucl_object_unref (cbdata->top);
 }
 
+/* Stores results of a refresh task in the shared cache */
+static gboolean
+rspamd_controller_stat_refresh_fin (void *ud)
+{
+	struct rspamd_stat_cbdata *cbdata = ud;
+	struct rspamd_controller_stat_cache *cache = cbdata->ctx->stat_cache;
+	struct rspamd_controller_worker_ctx *ctx = cbdata->ctx;
+	rspamd_fstring_t *out;
+
+	rspamd_controller_stat_task_data (cbdata, cbdata->top);
+	out = rspamd_fstring_sized_new (BUFSIZ);
+	rspamd_ucl_emit_fstring (cbdata->top, UCL_EMIT_JSON_COMPACT, &out);
+
+	rspamd_mempool_wlock_rwlock (cache->lock);
+
+	if (out->len < sizeof (cache->data)) {
+		memcpy (cache->data, out->str, out->len);
+		cache->len = out->len;
+		cache->updated = rspamd_get_calendar_ticks ();
+	}
+	else {
+		/* Requests would be served by tasks as before */
+		msg_err_ctx ("statistics are too large to be cached: %z bytes",
+				out->len);
+		cache->len = 0;
+	}
+
+	rspamd_mempool_wunlock_rwlock (cache->lock);
+	rspamd_fstring_free (out);
+	ctx->stat_refreshing = FALSE;
+	rspamd_session_destroy (cbdata->task->s);
+
+	return TRUE;
+}
+
+static void
+rspamd_controller_stat_refresh_cleanup (void *ud)
+{
+	struct rspamd_stat_cbdata *cbdata = ud;
+	ucl_object_t *top = cbdata->top;
+
+	if (cbdata->stat) {
+		ucl_object_unref (cbdata->stat);
+	}
+
+	rspamd_task_free (cbdata->task);
+	ucl_object_unref (top);
+}
+
+/*
+ * Statfiles and fuzzy storages are polled by a single task on a timer, so
+ * /stat and /metrics requests are served without creating tasks
+ */
+static void
+rspamd_controller_stat_refresh (gint fd, short what, void *arg)
+{
+	struct rspamd_controller_worker_ctx *ctx = arg;
+	struct rspamd_task *task;
+	struct rspamd_stat_cbdata *cbdata;
+
+	if (!ctx->stat_refreshing) {
+		task = rspamd_task_new (ctx->worker, ctx->cfg);
+		task->resolver = ctx->resolver;
+		task->ev_base = ctx->ev_base;
+		cbdata = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbdata));
+		cbdata->ctx = ctx;
+		cbdata->task = task;
+		cbdata->top = ucl_object_typed_new (UCL_OBJECT);
+		task->s = rspamd_session_create (task->task_pool,
+				rspamd_controller_stat_refresh_fin,
+				NULL,
+				rspamd_controller_stat_refresh_cleanup,
+				cbdata);
+		ctx->stat_refreshing = TRUE;
+
+		fuzzy_stat_command (task);
+		rspamd_stat_statistics (task, ctx->cfg, &cbdata->learned,
+				&cbdata->stat);
+		rspamd_session_pending (task->s);
+	}
+
+	event_del (&ctx->stat_refresh_ev);
+	evtimer_add (&ctx->stat_refresh_ev, &ctx->stat_refresh_tv);
+}
+
+/*
+ * Returns a copy of cached statistics or NULL if they are not available
+ */
+static ucl_object_t *
+rspamd_controller_stat_cached (struct rspamd_controller_worker_ctx *ctx)
+{
+	struct rspamd_controller_stat_cache *cache = ctx->stat_cache;
+	struct ucl_parser *parser;
+	ucl_object_t *obj = NULL;
+
+	if (cache == NULL || ctx->stats_refresh <= 0) {
+		return NULL;
+	}
+
+	rspamd_mempool_rlock_rwlock (cache->lock);
+
+	if (cache->len > 0) {
+		parser = ucl_parser_new (0);
+
+		if (ucl_parser_add_chunk (parser, cache->data, cache->len)) {
+			obj = ucl_parser_get_object (parser);
+		}
+
+		ucl_parser_free (parser);
+	}
+
+	rspamd_mempool_runlock_rwlock (cache->lock);
+
+	return obj;
+}
+
 /*
  * Stat command handler:
  * request: /stat (/resetstat)
@@ -2537,7 +2726,9 @@ rspamd_controller_handle_stat_common (
 	gboolean do_reset)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
-	ucl_object_t *top, *sub;
+	ucl_object_t *top, *sub, *cached;
+	const ucl_object_t *cur;
+	ucl_object_iter_t it = NULL;
 	gint i;
 	guint64 spam = 0, ham = 0;
 	rspamd_mempool_stat_t mem_st;
@@ -2548,27 +2739,10 @@ rspamd_controller_handle_stat_common (
 
 	memset (&mem_st, 0, sizeof (mem_st));
 	rspamd_mempool_stat (&mem_st);
-	memcpy (&stat_copy, session->ctx->worker->srv->stat, sizeof (stat_copy));
+	rspamd_main_stat_copy (session->ctx->worker->srv, &stat_copy);
 	stat = &stat_copy;
-	task = rspamd_task_new (session->ctx->worker, session->cfg);
-
 	ctx = session->ctx;
-	task->resolver = ctx->resolver;
-	task->ev_base = ctx->ev_base;
-	cbdata = rspamd_mempool_alloc0 (session->pool, sizeof (*cbdata));
-	cbdata->conn_ent = conn_ent;
-	cbdata->task = task;
 	top = ucl_object_typed_new (UCL_OBJECT);
-	cbdata->top = top;
-
-	task->s = rspamd_session_create (session->pool,
-			rspamd_controller_stat_fin_task,
-			NULL,
-			rspamd_controller_stat_cleanup_task,
-			cbdata);
-	task->fin_arg = cbdata;
-	task->http_conn = rspamd_http_connection_ref (conn_ent->conn);;
-	task->sock = conn_ent->conn->fd;
 
 	ucl_object_insert_key (top, ucl_object_frombool (!session->is_enable),
 			"read_only", 0, false);
@@ -2589,14 +2763,6 @@ rspamd_controller_handle_stat_common (
 			else {
 				ham += stat->actions_stat[i];
 			}
-			if (do_reset) {
-#ifndef HAVE_ATOMIC_BUILTINS
-				session->ctx->worker->srv->stat->actions_stat[i] = 0;
-#else
-				__atomic_store_n(&session->ctx->worker->srv->stat->actions_stat[i],
-						0, __ATOMIC_RELEASE);
-#endif
-			}
 		}
 		ucl_object_insert_key (top, sub, "actions", 0, false);
 	}
@@ -2611,6 +2777,18 @@ rspamd_controller_handle_stat_common (
 		ucl_object_fromint (stat->control_connections_count),
 		"control_connections", 0, false);
 
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->lua_heap_size), "lua_heap_size", 0, false);
+	sub = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < RSPAMD_LUA_GC_PAUSE_BUCKETS; i ++) {
+		ucl_object_insert_key (sub,
+			ucl_object_fromint (stat->lua_gc_pauses[i]),
+			lua_gc_pause_buckets[i], 0, false);
+	}
+
+	ucl_object_insert_key (top, sub, "lua_gc_pauses", 0, false);
+
 	ucl_object_insert_key (top,
 		ucl_object_fromint (mem_st.pools_allocated), "pools_allocated", 0,
 		false);
@@ -2630,15 +2808,82 @@ rspamd_controller_handle_stat_common (
 	ucl_object_insert_key (top,
 		ucl_object_fromint (
 			mem_st.oversized_chunks), "chunks_oversized", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (
+			mem_st.chunks_reused), "chunks_reused", 0, false);
+
+	sub = NULL;
+
+	for (i = 0; i < (gint)G_N_ELEMENTS (mem_st.tags); i ++) {
+		if (mem_st.tags[i].used == 2) {
+			if (sub == NULL) {
+				sub = ucl_object_typed_new (UCL_OBJECT);
+			}
+			/* Tags could be duplicated due to races, keep the largest peak */
+			cur = ucl_object_lookup (sub, mem_st.tags[i].tag);
+
+			if (cur == NULL ||
+					ucl_object_toint (cur) < mem_st.tags[i].peak) {
+				ucl_object_replace_key (sub,
+						ucl_object_fromint (mem_st.tags[i].peak),
+						mem_st.tags[i].tag, 0, true);
+			}
+		}
+	}
+
+	if (sub) {
+		ucl_object_insert_key (top, sub, "pools_peak", 0, false);
+	}
 
 	if (do_reset) {
-		session->ctx->srv->stat->messages_scanned = 0;
-		session->ctx->srv->stat->messages_learned = 0;
-		session->ctx->srv->stat->connections_count = 0;
-		session->ctx->srv->stat->control_connections_count = 0;
+		if (session->ctx->srv->counters) {
+			/* Custom counters registered by plugins are reset as well */
+			for (i = 0; i < (gint)rspamd_shm_counters_count (
+					session->ctx->srv->counters); i ++) {
+				rspamd_shm_counters_set (session->ctx->srv->counters, i, 0);
+			}
+		}
+
+		memset (session->ctx->srv->stat->lua_gc_pauses, 0,
+				sizeof (session->ctx->srv->stat->lua_gc_pauses));
+		session->ctx->srv->stat->lua_gc_pauses_usec = 0;
 		rspamd_mempool_stat_reset ();
 	}
 
+
+	cached = rspamd_controller_stat_cached (ctx);
+
+	if (cached) {
+		while ((cur = ucl_object_iterate (cached, &it, true)) != NULL) {
+			ucl_object_insert_key (top, ucl_object_copy (cur),
+					ucl_object_key (cur), 0, true);
+		}
+
+		ucl_object_unref (cached);
+		rspamd_controller_send_ucl (conn_ent, top);
+		ucl_object_unref (top);
+
+		return 0;
+	}
+
+	task = rspamd_task_new (session->ctx->worker, session->cfg);
+	task->resolver = ctx->resolver;
+	task->ev_base = ctx->ev_base;
+	cbdata = rspamd_mempool_alloc0 (session->pool, sizeof (*cbdata));
+	cbdata->conn_ent = conn_ent;
+	cbdata->ctx = ctx;
+	cbdata->task = task;
+	cbdata->top = top;
+
+	task->s = rspamd_session_create (session->pool,
+			rspamd_controller_stat_fin_task,
+			NULL,
+			rspamd_controller_stat_cleanup_task,
+			cbdata);
+	task->fin_arg = cbdata;
+	task->http_conn = rspamd_http_connection_ref (conn_ent->conn);;
+	task->sock = conn_ent->conn->fd;
+
 	fuzzy_stat_command (task);
 
 	/* Now write statistics for each statfile */
@@ -2679,6 +2924,235 @@ rspamd_controller_handle_statreset (
 	return rspamd_controller_handle_stat_common (conn_ent, msg, TRUE);
 }
 
+static void
+rspamd_controller_metrics_statfiles (rspamd_fstring_t **out,
+		const ucl_object_t *statfiles)
+{
+	static const gchar *fields[] = {"revision", "users", "used", "total",
+			"size"};
+	const ucl_object_t *cur, *elt, *sym;
+	ucl_object_iter_t it;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (fields); i ++) {
+		rspamd_printf_fstring (out, "# TYPE rspamd_statfile_%s gauge\n",
+				fields[i]);
+		it = NULL;
+
+		while ((cur = ucl_object_iterate (statfiles, &it, true)) != NULL) {
+			sym = ucl_object_lookup (cur, "symbol");
+			elt = ucl_object_lookup (cur, fields[i]);
+
+			if (sym == NULL || elt == NULL) {
+				continue;
+			}
+
+			rspamd_printf_fstring (out, "rspamd_statfile_%s{symbol=\"",
+					fields[i]);
+			rspamd_prometheus_escape_label (out, ucl_object_tostring (sym));
+			rspamd_printf_fstring (out, "\"} %L\n", ucl_object_toint (elt));
+		}
+	}
+}
+
+static void
+rspamd_controller_metrics_upstream (const gchar *name,
+		const struct rspamd_histogram *h, gpointer ud)
+{
+	rspamd_fstring_t **out = ud;
+
+	if (rspamd_histogram_count (h) > 0) {
+		rspamd_histogram_write_prometheus (out,
+				"rspamd_upstream_latency_seconds", "upstream", name, h);
+	}
+}
+
+static void
+rspamd_controller_metrics_latency (rspamd_fstring_t **out,
+		struct rspamd_controller_worker_ctx *ctx,
+		const struct rspamd_stat *stat)
+{
+	const struct rspamd_histogram *h;
+	const gchar *sym;
+	guint i, nsyms;
+
+	rspamd_printf_fstring (out,
+			"# TYPE rspamd_task_stage_seconds histogram\n");
+
+	for (i = 0; i < RSPAMD_TASK_STAGES_COUNT; i ++) {
+		if (rspamd_histogram_count (&stat->stage_latency[i]) > 0) {
+			rspamd_histogram_write_prometheus (out,
+					"rspamd_task_stage_seconds", "stage",
+					rspamd_task_stage_name (1 << i), &stat->stage_latency[i]);
+		}
+	}
+
+	if (ctx->cfg->cache) {
+		rspamd_printf_fstring (out,
+				"# TYPE rspamd_symbol_latency_seconds histogram\n");
+		nsyms = rspamd_symbols_cache_symbols_count (ctx->cfg->cache);
+
+		for (i = 0; i < nsyms; i ++) {
+			sym = rspamd_symbols_cache_symbol_by_id (ctx->cfg->cache, i);
+			h = rspamd_symbols_cache_symbol_latency (ctx->cfg->cache, i);
+
+			if (sym && h && rspamd_histogram_count (h) > 0) {
+				rspamd_histogram_write_prometheus (out,
+						"rspamd_symbol_latency_seconds", "symbol", sym, h);
+			}
+		}
+	}
+
+	if (ctx->cfg->ups_ctx) {
+		rspamd_printf_fstring (out,
+				"# TYPE rspamd_upstream_latency_seconds histogram\n");
+		rspamd_upstreams_foreach_latency (ctx->cfg->ups_ctx,
+				rspamd_controller_metrics_upstream, out);
+	}
+}
+
+/*
+ * Metrics command handler:
+ * request: /metrics
+ * headers: Password
+ * reply: statistics in Prometheus text format
+ */
+static int
+rspamd_controller_handle_metrics (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx = session->ctx;
+	struct rspamd_stat *stat, stat_copy;
+	struct rspamd_http_message *reply;
+	ucl_object_t *cached;
+	const ucl_object_t *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	rspamd_fstring_t *out;
+	guint64 cumulative = 0;
+	gint i;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	rspamd_main_stat_copy (ctx->srv, &stat_copy);
+	stat = &stat_copy;
+	out = rspamd_fstring_sized_new (BUFSIZ);
+
+	rspamd_printf_fstring (&out, "# TYPE rspamd_scanned_total counter\n"
+			"rspamd_scanned_total %ud\n", stat->messages_scanned);
+	rspamd_printf_fstring (&out, "# TYPE rspamd_learned_total counter\n"
+			"rspamd_learned_total %ud\n", stat->messages_learned);
+	rspamd_printf_fstring (&out, "# TYPE rspamd_actions_total counter\n");
+
+	for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i++) {
+		rspamd_printf_fstring (&out, "rspamd_actions_total{action=\"%s\"} %ud\n",
+				rspamd_action_to_str (i), stat->actions_stat[i]);
+	}
+
+	rspamd_printf_fstring (&out, "# TYPE rspamd_connections_total counter\n"
+			"rspamd_connections_total %ud\n", stat->connections_count);
+	rspamd_printf_fstring (&out,
+			"# TYPE rspamd_control_connections_total counter\n"
+			"rspamd_control_connections_total %ud\n",
+			stat->control_connections_count);
+
+	if (ctx->srv->counters &&
+			rspamd_shm_counters_count (ctx->srv->counters) >
+			RSPAMD_COUNTER_BUILTIN_MAX) {
+		rspamd_printf_fstring (&out, "# TYPE rspamd_counter_total counter\n");
+
+		for (i = RSPAMD_COUNTER_BUILTIN_MAX;
+				i < (gint)rspamd_shm_counters_count (ctx->srv->counters); i ++) {
+			rspamd_printf_fstring (&out, "rspamd_counter_total{name=\"");
+			rspamd_prometheus_escape_label (&out,
+					rspamd_shm_counters_name (ctx->srv->counters, i));
+			rspamd_printf_fstring (&out, "\"} %uL\n",
+					rspamd_shm_counters_get (ctx->srv->counters, i));
+		}
+	}
+
+	rspamd_printf_fstring (&out, "# TYPE rspamd_uptime_seconds gauge\n"
+			"rspamd_uptime_seconds %L\n",
+			(gint64)(time (NULL) - ctx->start_time));
+	rspamd_printf_fstring (&out, "# TYPE rspamd_lua_heap_bytes gauge\n"
+			"rspamd_lua_heap_bytes %uL\n", stat->lua_heap_size);
+	rspamd_printf_fstring (&out,
+			"# TYPE rspamd_lua_gc_pause_seconds histogram\n");
+
+	for (i = 0; i < RSPAMD_LUA_GC_PAUSE_BUCKETS; i ++) {
+		cumulative += stat->lua_gc_pauses[i];
+
+		if (i < RSPAMD_LUA_GC_PAUSE_BUCKETS - 1) {
+			rspamd_printf_fstring (&out,
+					"rspamd_lua_gc_pause_seconds_bucket{le=\"%.4f\"} %uL\n",
+					lua_gc_pause_bounds[i] / 1000.0, cumulative);
+		}
+		else {
+			rspamd_printf_fstring (&out,
+					"rspamd_lua_gc_pause_seconds_bucket{le=\"+Inf\"} %uL\n",
+					cumulative);
+		}
+	}
+
+	rspamd_printf_fstring (&out, "rspamd_lua_gc_pause_seconds_sum %.6f\n"
+			"rspamd_lua_gc_pause_seconds_count %uL\n",
+			stat->lua_gc_pauses_usec / 1e6, cumulative);
+	rspamd_controller_metrics_latency (&out, ctx, stat);
+
+	cached = rspamd_controller_stat_cached (ctx);
+
+	if (cached) {
+		elt = ucl_object_lookup (cached, "total_learns");
+
+		if (elt) {
+			rspamd_printf_fstring (&out, "# TYPE rspamd_total_learns gauge\n"
+					"rspamd_total_learns %L\n", ucl_object_toint (elt));
+		}
+
+		elt = ucl_object_lookup (cached, "statfiles");
+
+		if (elt) {
+			rspamd_controller_metrics_statfiles (&out, elt);
+		}
+
+		elt = ucl_object_lookup (cached, "fuzzy_hashes");
+
+		if (elt) {
+			rspamd_printf_fstring (&out, "# TYPE rspamd_fuzzy_hashes gauge\n");
+
+			while ((cur = ucl_object_iterate (elt, &it, true)) != NULL) {
+				rspamd_printf_fstring (&out, "rspamd_fuzzy_hashes{storage=\"");
+				rspamd_prometheus_escape_label (&out, ucl_object_key (cur));
+				rspamd_printf_fstring (&out, "\"} %L\n", ucl_object_toint (cur));
+			}
+		}
+
+		ucl_object_unref (cached);
+	}
+
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->date = time (NULL);
+	reply->code = 200;
+	reply->status = rspamd_fstring_new_init ("OK", 2);
+	rspamd_http_message_set_body_from_fstring_steal (reply, out);
+	rspamd_http_connection_reset (conn_ent->conn);
+	rspamd_http_router_insert_headers (conn_ent->rt, reply);
+	rspamd_http_connection_write_message (conn_ent->conn,
+		reply,
+		NULL,
+		"text/plain; version=0.0.4",
+		conn_ent,
+		conn_ent->conn->fd,
+		conn_ent->rt->ptv,
+		conn_ent->rt->ev_base);
+	conn_ent->is_reply = TRUE;
+
+	return 0;
+}
+
 
 /*
  * Counters command handler:
@@ -2946,7 +3420,8 @@ rspamd_controller_finish_handler (struct rspamd_http_connection_entry *conn_ent)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 
-	session->ctx->worker->srv->stat->control_connections_count++;
+	rspamd_main_counter_add (session->ctx->worker->srv,
+			RSPAMD_COUNTER_CONTROL_CONNECTIONS, 1);
 
 	if (session->task != NULL) {
 		rspamd_session_destroy (session->task->s);
@@ -3003,17 +3478,17 @@ static void
 rspamd_controller_rrd_update (gint fd, short what, void *arg)
 {
 	struct rspamd_controller_worker_ctx *ctx = arg;
-	struct rspamd_stat *stat;
+	struct rspamd_stat stat;
 	GArray ar;
 	gdouble points[METRIC_ACTION_MAX];
 	GError *err = NULL;
 	guint i;
 
 	g_assert (ctx->rrd != NULL);
-	stat = ctx->srv->stat;
+	rspamd_main_stat_copy (ctx->srv, &stat);
 
 	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
-		points[i] = stat->actions_stat[i];
+		points[i] = stat.actions_stat[i];
 	}
 
 	ar.data = (gchar *)points;
@@ -3036,7 +3511,7 @@ rspamd_controller_load_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 	struct ucl_parser *parser;
 	ucl_object_t *obj;
 	const ucl_object_t *elt, *subelt;
-	struct rspamd_stat *stat, stat_copy;
+	struct rspamd_stat stat_copy;
 	gint i;
 
 	g_assert (ctx->saved_stats_path != NULL);
@@ -3060,8 +3535,7 @@ rspamd_controller_load_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 	obj = ucl_parser_get_object (parser);
 	ucl_parser_free (parser);
 
-	stat = ctx->srv->stat;
-	memcpy (&stat_copy, stat, sizeof (stat_copy));
+	rspamd_main_stat_copy (ctx->srv, &stat_copy);
 
 	elt = ucl_object_lookup (obj, "scanned");
 
@@ -3100,13 +3574,13 @@ rspamd_controller_load_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 	}
 
 	ucl_object_unref (obj);
-	memcpy (stat, &stat_copy, sizeof (stat_copy));
+	rspamd_main_stat_restore (ctx->srv, &stat_copy);
 }
 
 static void
 rspamd_controller_store_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 {
-	struct rspamd_stat *stat;
+	struct rspamd_stat *stat, stat_copy;
 	ucl_object_t *top, *sub;
 	gint i, fd;
 
@@ -3128,7 +3602,8 @@ rspamd_controller_store_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 		return;
 	}
 
-	stat = ctx->srv->stat;
+	rspamd_main_stat_copy (ctx->srv, &stat_copy);
+	stat = &stat_copy;
 
 	top = ucl_object_typed_new (UCL_OBJECT);
 	ucl_object_insert_key (top, ucl_object_fromint (
@@ -3196,6 +3671,7 @@ init_controller_worker (struct rspamd_config *cfg)
 
 	ctx->magic = rspamd_controller_ctx_magic;
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
+	ctx->stats_refresh = DEFAULT_STATS_REFRESH;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -3300,6 +3776,24 @@ init_controller_worker (struct rspamd_config *cfg)
 			0,
 			"Directory where controller saves server's statistics between restarts");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"stats_refresh",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_controller_worker_ctx,
+					stats_refresh),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Interval of statfiles and fuzzy statistics refresh, 0 to query "
+			"them on each request, default: "
+					G_STRINGIFY(DEFAULT_STATS_REFRESH)
+					" seconds");
+
+	/* Allocated before fork, so all controllers share it */
+	ctx->stat_cache = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*ctx->stat_cache));
+	ctx->stat_cache->lock = rspamd_mempool_get_rwlock (cfg->cfg_pool);
+
 	return ctx;
 }
 
@@ -3432,6 +3926,7 @@ static gboolean
 rspamd_controller_on_terminate (struct rspamd_worker *worker)
 {
 	struct rspamd_controller_worker_ctx *ctx = worker->ctx;
+	guint i;
 
 	rspamd_controller_store_saved_stats (ctx);
 
@@ -3439,6 +3934,16 @@ rspamd_controller_on_terminate (struct rspamd_worker *worker)
 		msg_info ("closing rrd file: %s", ctx->rrd->filename);
 		event_del (ctx->rrd_event);
 		rspamd_rrd_close (ctx->rrd);
+
+		for (i = 0; i < G_N_ELEMENTS (ctx->graph_cache); i ++) {
+			if (ctx->graph_cache[i]) {
+				free (ctx->graph_cache[i]);
+			}
+		}
+	}
+
+	if (ctx->stats_refresh > 0 && worker->index == 0) {
+		event_del (&ctx->stat_refresh_ev);
 	}
 
 	return FALSE;
@@ -3622,6 +4127,8 @@ start_controller_worker (struct rspamd_worker *worker)
 
 	/* Accept event */
 	cache = rspamd_keypair_cache_new (256);
+	rspamd_keypair_cache_set_shared (cache,
+			worker->srv->cfg->keypair_shared_cache);
 	ctx->http = rspamd_http_router_new (rspamd_controller_error_handler,
 			rspamd_controller_finish_handler, &ctx->io_tv, ctx->ev_base,
 			ctx->static_files_dir, cache);
@@ -3693,6 +4200,9 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_PLUGINS,
 			rspamd_controller_handle_plugins);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_METRICS,
+			rspamd_controller_handle_metrics);
 	rspamd_controller_register_plugins_paths (ctx);
 
 #if 0
@@ -3743,6 +4253,14 @@ start_controller_worker (struct rspamd_worker *worker)
 			worker);
 	rspamd_stat_init (worker->srv->cfg, ctx->ev_base);
 
+	/* The first controller refreshes statistics for all of them */
+	if (ctx->stats_refresh > 0 && worker->index == 0) {
+		double_to_tv (ctx->stats_refresh, &ctx->stat_refresh_tv);
+		evtimer_set (&ctx->stat_refresh_ev, rspamd_controller_stat_refresh, ctx);
+		event_base_set (ctx->ev_base, &ctx->stat_refresh_ev);
+		rspamd_controller_stat_refresh (-1, EV_TIMEOUT, ctx);
+	}
+
 	event_base_loop (ctx->ev_base, 0);
 	rspamd_worker_block_signals ();
 
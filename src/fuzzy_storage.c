@@ -35,12 +35,18 @@
 #include "libutil/hash.h"
 #include "libutil/http_private.h"
 #include "unix-std.h"
+#include "contrib/zstd/zstd.h"
 
 /* Resync value in seconds */
 #define DEFAULT_SYNC_TIMEOUT 60.0
 #define DEFAULT_KEYPAIR_CACHE_SIZE 512
 #define DEFAULT_MASTER_TIMEOUT 10.0
 #define DEFAULT_UPDATES_MAXFAIL 3
+#define DEFAULT_LOOKUP_CACHE_SIZE 8192
+#define DEFAULT_LOOKUP_CACHE_TTL 30.0
+#define DEFAULT_MIRROR_BACKLOG 32
+/* Maximum size of a decompressed update from the master */
+#define RSPAMD_FUZZY_MAX_UPDATE_SIZE (64 * 1024 * 1024)
 #define COOKIE_SIZE 128
 
 static const gchar *local_db_name = "local";
@@ -103,6 +109,8 @@ struct fuzzy_global_stat {
 	guint64 fuzzy_hashes_found[RSPAMD_FUZZY_EPOCH_MAX];
 	/**< amount of hashes found by epoch				*/
 	guint64 invalid_requests;
+	guint64 lookup_cache_hits;
+	/**< checks answered from the lookup cache			*/
 };
 
 struct fuzzy_key_stat {
@@ -118,6 +126,15 @@ struct rspamd_fuzzy_mirror {
 	gchar *name;
 	struct upstream_list *u;
 	struct rspamd_cryptobox_pubkey *key;
+	/* The newest revision confirmed by the mirror */
+	guint32 acked_rev;
+	gboolean compress;
+};
+
+/* Serialized updates of a single transaction, kept to resend missed ones */
+struct fuzzy_mirror_block {
+	guint32 rev;
+	rspamd_fstring_t *data;
 };
 
 static const guint64 rspamd_fuzzy_storage_magic = 0x291a3253eb1b3ea5ULL;
@@ -135,6 +152,10 @@ struct rspamd_fuzzy_storage_ctx {
 	struct timeval master_io_tv;
 	gdouble master_timeout;
 	GPtrArray *mirrors;
+	GQueue *mirror_backlog;
+	guint mirror_backlog_size;
+	/* Last revision applied from each master source */
+	GHashTable *master_revs;
 	const ucl_object_t *update_map;
 	const ucl_object_t *masters_map;
 	GHashTable *master_flags;
@@ -165,13 +186,52 @@ struct rspamd_fuzzy_storage_ctx {
 	struct rspamd_worker *worker;
 	struct rspamd_http_connection_router *collection_rt;
 	guchar cookie[COOKIE_SIZE];
+	/* Batched datagrams I/O */
+	guchar *recv_bufs;
+	GPtrArray *pending_replies;
+	gboolean defer_replies;
+	/* Per worker SO_REUSEPORT sockets */
+	gboolean reuseport;
+	GArray *reuseport_fds;
+	/* Cache of recent check results */
+	rspamd_lru_hash_t *lookup_cache;
+	guint lookup_cache_size;
+	gdouble lookup_cache_ttl;
 };
 
+/* Maximum size of a request datagram */
+#define RSPAMD_FUZZY_MAX_DATAGRAM (sizeof (struct rspamd_fuzzy_encrypted_req_hdr) + \
+		sizeof (struct rspamd_fuzzy_batch_hdr) + \
+		RSPAMD_FUZZY_BATCH_MAX * sizeof (struct rspamd_fuzzy_shingle_cmd))
+/* Number of datagrams read per recvmmsg call */
+#define RSPAMD_FUZZY_MMSG_BATCH 32
+
 enum fuzzy_cmd_type {
 	CMD_NORMAL,
 	CMD_SHINGLE,
 	CMD_ENCRYPTED_NORMAL,
-	CMD_ENCRYPTED_SHINGLE
+	CMD_ENCRYPTED_SHINGLE,
+	CMD_BATCH,
+	CMD_ENCRYPTED_BATCH
+};
+
+/* Encrypted datagrams received together are decrypted before processing */
+enum fuzzy_decrypt_state {
+	FUZZY_DECRYPT_NONE = 0,
+	FUZZY_DECRYPT_OK,
+	FUZZY_DECRYPT_FAILED
+};
+
+struct fuzzy_session;
+
+struct fuzzy_batch_cmd {
+	union {
+		struct rspamd_fuzzy_cmd normal;
+		struct rspamd_fuzzy_shingle_cmd shingle;
+	} cmd;
+	struct rspamd_fuzzy_reply rep;
+	struct fuzzy_session *session;
+	gboolean is_shingle;
 };
 
 struct fuzzy_session {
@@ -187,6 +247,11 @@ struct fuzzy_session {
 	} cmd;
 
 	struct rspamd_fuzzy_encrypted_reply reply;
+	struct fuzzy_batch_cmd *batch;
+	guint nbatch;
+	guint batch_pending;
+	guchar *batch_reply;
+	gsize batch_reply_len;
 	struct fuzzy_key_stat *ip_stat;
 
 	enum rspamd_fuzzy_epoch epoch;
@@ -196,6 +261,7 @@ struct fuzzy_session {
 	struct event io;
 	ref_entry_t ref;
 	struct fuzzy_key_stat *key_stat;
+	enum fuzzy_decrypt_state decrypt_state;
 	guchar nm[rspamd_cryptobox_MAX_NMBYTES];
 };
 
@@ -275,6 +341,7 @@ struct fuzzy_slave_connection {
 	struct upstream *up;
 	struct rspamd_http_connection *http_conn;
 	struct rspamd_fuzzy_mirror *mirror;
+	guint32 sent_rev;
 	gint sock;
 };
 
@@ -293,52 +360,65 @@ fuzzy_mirror_close_connection (struct fuzzy_slave_connection *conn)
 	}
 }
 
-struct rspamd_fuzzy_updates_cbdata {
-	struct rspamd_fuzzy_storage_ctx *ctx;
-	struct rspamd_http_message *msg;
-	struct fuzzy_slave_connection *conn;
-	struct rspamd_fuzzy_mirror *m;
-};
+static void
+fuzzy_mirror_block_free (struct fuzzy_mirror_block *blk)
+{
+	rspamd_fstring_free (blk->data);
+	g_slice_free1 (sizeof (*blk), blk);
+}
 
 static void
-fuzzy_mirror_updates_version_cb (guint64 rev64, void *ud)
+fuzzy_mirror_backlog_free (gpointer p)
 {
-	struct rspamd_fuzzy_updates_cbdata *cbdata = ud;
+	GQueue *q = p;
+	GList *cur;
+
+	for (cur = q->head; cur != NULL; cur = g_list_next (cur)) {
+		fuzzy_mirror_block_free (cur->data);
+	}
+
+	g_queue_free (q);
+}
+
+/*
+ * Block format:
+ * <uint32_le> - revision (filled when the backend version is known)
+ * <uint32_le> - size of the next element
+ * <data> - command data
+ * ...
+ * <0> - end of block
+ */
+static struct fuzzy_mirror_block *
+fuzzy_mirror_block_new (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_mirror_block *blk;
 	GList *cur;
 	struct fuzzy_peer_cmd *io_cmd;
-	guint32 rev32 = rev64, len;
+	guint32 len;
+	gsize total;
 	const gchar *p;
-	rspamd_fstring_t *reply;
-	struct fuzzy_slave_connection *conn;
-	struct rspamd_fuzzy_storage_ctx *ctx;
-	struct rspamd_http_message *msg;
-	struct rspamd_fuzzy_mirror *m;
-	struct timeval tv;
 
-	conn = cbdata->conn;
-	ctx = cbdata->ctx;
-	msg = cbdata->msg;
-	m = cbdata->m;
-	g_slice_free1 (sizeof (*cbdata), cbdata);
-	rev32 = GUINT32_TO_LE (rev32);
-	len = sizeof (guint32) * 2; /* revision + last chunk */
+	total = sizeof (guint32) * 2; /* revision + last chunk */
 
 	for (cur = ctx->updates_pending->head; cur != NULL; cur = g_list_next (cur)) {
 		io_cmd = cur->data;
 
 		if (io_cmd->is_shingle) {
-			len += sizeof (guint32) + sizeof (guint32) +
+			total += sizeof (guint32) + sizeof (guint32) +
 					sizeof (struct rspamd_fuzzy_shingle_cmd);
 		}
 		else {
-			len += sizeof (guint32) + sizeof (guint32) +
+			total += sizeof (guint32) + sizeof (guint32) +
 					sizeof (struct rspamd_fuzzy_cmd);
 		}
 	}
 
-	reply = rspamd_fstring_sized_new (len);
-	reply = rspamd_fstring_append (reply, (const char *)&rev32,
-			sizeof (rev32));
+	blk = g_slice_alloc (sizeof (*blk));
+	blk->rev = 0;
+	blk->data = rspamd_fstring_sized_new (total);
+	len = 0;
+	blk->data = rspamd_fstring_append (blk->data, (const char *)&len,
+			sizeof (len));
 
 	for (cur = ctx->updates_pending->head; cur != NULL; cur = g_list_next (cur)) {
 		io_cmd = cur->data;
@@ -354,20 +434,17 @@ fuzzy_mirror_updates_version_cb (guint64 rev64, void *ud)
 
 		p = (const char *)io_cmd;
 		len = GUINT32_TO_LE (len);
-		reply = rspamd_fstring_append (reply, (const char *)&len, sizeof (len));
-		reply = rspamd_fstring_append (reply, p, len);
+		blk->data = rspamd_fstring_append (blk->data, (const char *)&len,
+				sizeof (len));
+		blk->data = rspamd_fstring_append (blk->data, p, len);
 	}
 
 	/* Last chunk */
 	len = 0;
-	reply = rspamd_fstring_append (reply, (const char *)&len, sizeof (len));
-	rspamd_http_message_set_body_from_fstring_steal (msg, reply);
-	double_to_tv (ctx->sync_timeout, &tv);
-	rspamd_http_connection_write_message (conn->http_conn,
-			msg, NULL, NULL, conn,
-			conn->sock,
-			&tv, ctx->ev_base);
-	msg_info ("send update request to %s", m->name);
+	blk->data = rspamd_fstring_append (blk->data, (const char *)&len,
+			sizeof (len));
+
+	return blk;
 }
 
 static void
@@ -376,16 +453,74 @@ fuzzy_mirror_updates_to_http (struct rspamd_fuzzy_mirror *m,
 		struct rspamd_fuzzy_storage_ctx *ctx,
 		struct rspamd_http_message *msg)
 {
+	GList *cur, *first;
+	struct fuzzy_mirror_block *blk;
+	rspamd_fstring_t *reply, *compressed;
+	gsize len = 0;
+	guint nblocks = 0;
+	size_t r;
+	struct timeval tv;
 
-	struct rspamd_fuzzy_updates_cbdata *cbdata;
+	/*
+	 * Send all blocks that the mirror has not confirmed yet, oldest first.
+	 * A mirror that has never replied gets the newest block only.
+	 */
+	first = ctx->mirror_backlog->tail;
+
+	if (m->acked_rev != 0) {
+		for (cur = g_list_previous (first); cur != NULL;
+				cur = g_list_previous (cur)) {
+			blk = cur->data;
+
+			if (blk->rev <= m->acked_rev) {
+				break;
+			}
+
+			first = cur;
+		}
+	}
+
+	for (cur = first; cur != NULL; cur = g_list_next (cur)) {
+		blk = cur->data;
+		len += blk->data->len;
+	}
+
+	reply = rspamd_fstring_sized_new (len);
 
-	cbdata = g_slice_alloc (sizeof (*cbdata));
-	cbdata->ctx = ctx;
-	cbdata->msg = msg;
-	cbdata->conn = conn;
-	cbdata->m = m;
-	rspamd_fuzzy_backend_version (ctx->backend, local_db_name,
-			fuzzy_mirror_updates_version_cb, cbdata);
+	for (cur = first; cur != NULL; cur = g_list_next (cur)) {
+		blk = cur->data;
+		reply = rspamd_fstring_append (reply, blk->data->str, blk->data->len);
+		conn->sent_rev = blk->rev;
+		nblocks ++;
+	}
+
+	if (m->compress) {
+		compressed = rspamd_fstring_sized_new (ZSTD_compressBound (reply->len));
+		r = ZSTD_compress (compressed->str, compressed->allocated,
+				reply->str, reply->len, 1);
+
+		if (ZSTD_isError (r)) {
+			msg_err ("cannot compress update for %s: %s", m->name,
+					ZSTD_getErrorName (r));
+			rspamd_fstring_free (compressed);
+		}
+		else {
+			compressed->len = r;
+			rspamd_fstring_free (reply);
+			reply = compressed;
+			rspamd_http_message_add_header (msg, "Content-Encoding", "zstd");
+		}
+	}
+
+	rspamd_http_message_set_body_from_fstring_steal (msg, reply);
+	double_to_tv (ctx->sync_timeout, &tv);
+	rspamd_http_connection_write_message (conn->http_conn,
+			msg, NULL, NULL, conn,
+			conn->sock,
+			&tv, ctx->ev_base);
+	msg_info ("send update request to %s: %ud revisions (%ud..%ud)", m->name,
+			nblocks, ((struct fuzzy_mirror_block *)first->data)->rev,
+			conn->sent_rev);
 }
 
 static void
@@ -407,7 +542,18 @@ fuzzy_mirror_finish_handler (struct rspamd_http_connection *conn,
 {
 	struct fuzzy_slave_connection *bk_conn = conn->ud;
 
-	msg_info ("finished mirror connection to %s", bk_conn->mirror->name);
+	if (msg->code == 200) {
+		if (bk_conn->sent_rev > bk_conn->mirror->acked_rev) {
+			bk_conn->mirror->acked_rev = bk_conn->sent_rev;
+		}
+
+		msg_info ("finished mirror connection to %s", bk_conn->mirror->name);
+	}
+	else {
+		msg_err ("mirror %s has refused update: %d", bk_conn->mirror->name,
+				msg->code);
+	}
+
 	fuzzy_mirror_close_connection (bk_conn);
 
 	return 0;
@@ -420,6 +566,10 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 	struct fuzzy_slave_connection *conn;
 	struct rspamd_http_message *msg;
 
+	if (g_queue_get_length (ctx->mirror_backlog) == 0) {
+		return;
+	}
+
 	conn = g_slice_alloc0 (sizeof (*conn));
 	conn->up = rspamd_upstream_get (m->u,
 			RSPAMD_UPSTREAM_MASTER_SLAVE, NULL, 0);
@@ -462,6 +612,39 @@ struct rspamd_updates_cbdata {
 	gchar *source;
 };
 
+struct rspamd_fuzzy_updates_cbdata {
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	struct fuzzy_mirror_block *blk;
+};
+
+static void
+fuzzy_mirror_updates_version_cb (guint64 rev64, void *ud)
+{
+	struct rspamd_fuzzy_updates_cbdata *cbdata = ud;
+	struct rspamd_fuzzy_storage_ctx *ctx = cbdata->ctx;
+	struct fuzzy_mirror_block *blk = cbdata->blk;
+	struct rspamd_fuzzy_mirror *m;
+	guint32 rev32;
+	guint i;
+
+	g_slice_free1 (sizeof (*cbdata), cbdata);
+	blk->rev = rev64;
+	rev32 = GUINT32_TO_LE (blk->rev);
+	memcpy (blk->data->str, &rev32, sizeof (rev32));
+	g_queue_push_tail (ctx->mirror_backlog, blk);
+
+	while (g_queue_get_length (ctx->mirror_backlog) >
+			MAX (ctx->mirror_backlog_size, 1)) {
+		fuzzy_mirror_block_free (g_queue_pop_head (ctx->mirror_backlog));
+	}
+
+	for (i = 0; i < ctx->mirrors->len; i ++) {
+		m = g_ptr_array_index (ctx->mirrors, i);
+
+		rspamd_fuzzy_send_update_mirror (ctx, m);
+	}
+}
+
 static void
 fuzzy_update_version_callback (guint64 ver, void *ud)
 {
@@ -492,8 +675,7 @@ static void
 rspamd_fuzzy_updates_cb (gboolean success, void *ud)
 {
 	struct rspamd_updates_cbdata *cbdata = ud;
-	struct rspamd_fuzzy_mirror *m;
-	guint i;
+	struct rspamd_fuzzy_updates_cbdata *mcbdata;
 	struct rspamd_fuzzy_storage_ctx *ctx;
 	const gchar *source;
 	GList *cur;
@@ -505,12 +687,14 @@ rspamd_fuzzy_updates_cb (gboolean success, void *ud)
 	if (success) {
 		rspamd_fuzzy_backend_count (ctx->backend, fuzzy_count_callback, ctx);
 
-		if (g_queue_get_length (ctx->updates_pending) > 0) {
-			for (i = 0; i < ctx->mirrors->len; i ++) {
-				m = g_ptr_array_index (ctx->mirrors, i);
-
-				rspamd_fuzzy_send_update_mirror (ctx, m);
-			}
+		if (g_queue_get_length (ctx->updates_pending) > 0 &&
+				ctx->mirrors->len > 0) {
+			/* Serialize now as the queue is cleared before version is known */
+			mcbdata = g_slice_alloc (sizeof (*mcbdata));
+			mcbdata->ctx = ctx;
+			mcbdata->blk = fuzzy_mirror_block_new (ctx);
+			rspamd_fuzzy_backend_version (ctx->backend, local_db_name,
+					fuzzy_mirror_updates_version_cb, mcbdata);
 		}
 
 		/* Clear updates */
@@ -566,15 +750,156 @@ rspamd_fuzzy_updates_cb (gboolean success, void *ud)
 	g_slice_free1 (sizeof (*cbdata), cbdata);
 }
 
+/*
+ * Lookup cache key is a digest followed by the command kind: shingle
+ * commands can match near duplicates whilst normal ones match exact digest
+ */
+#define FUZZY_CACHE_KEY_LEN (rspamd_cryptobox_HASHBYTES + 1)
+
+static guint
+fuzzy_digest_hash (gconstpointer p)
+{
+	guint h;
+
+	/* Digest is already a hash */
+	memcpy (&h, p, sizeof (h));
+
+	return h;
+}
+
+static gboolean
+fuzzy_digest_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, FUZZY_CACHE_KEY_LEN) == 0;
+}
+
+static void
+fuzzy_digest_free (gpointer p)
+{
+	g_slice_free1 (FUZZY_CACHE_KEY_LEN, p);
+}
+
+static inline void
+fuzzy_cache_key (guchar *key, const gchar *digest, gboolean is_shingle)
+{
+	memcpy (key, digest, rspamd_cryptobox_HASHBYTES);
+	key[rspamd_cryptobox_HASHBYTES] = is_shingle ? 1 : 0;
+}
+
+static void
+fuzzy_cached_reply_free (gpointer p)
+{
+	g_slice_free1 (sizeof (struct rspamd_fuzzy_reply), p);
+}
+
+static struct rspamd_fuzzy_reply *
+rspamd_fuzzy_cache_lookup (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_cmd *cmd, gboolean is_shingle,
+		guint64 now)
+{
+	guchar key[FUZZY_CACHE_KEY_LEN];
+
+	fuzzy_cache_key (key, cmd->digest, is_shingle);
+
+	return rspamd_lru_hash_lookup (ctx->lookup_cache, key, now);
+}
+
+static void
+rspamd_fuzzy_cache_result (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_fuzzy_cmd *cmd, gboolean is_shingle,
+		const struct rspamd_fuzzy_reply *result,
+		guint64 now)
+{
+	struct rspamd_fuzzy_reply *cached;
+	guchar *key;
+	gdouble ttl;
+
+	/*
+	 * Only matches are cached: misses and backend errors could be changed
+	 * by adding any near duplicate, so we could not invalidate them
+	 */
+	if (ctx->lookup_cache == NULL || result->prob <= 0.5 || result->value == 0) {
+		return;
+	}
+
+	ttl = ctx->lookup_cache_ttl;
+
+	if (ctx->backend) {
+		ttl = MIN (ttl, rspamd_fuzzy_backend_get_expire (ctx->backend));
+	}
+
+	if (ttl < 1.0) {
+		return;
+	}
+
+	key = g_slice_alloc (FUZZY_CACHE_KEY_LEN);
+	fuzzy_cache_key (key, cmd->digest, is_shingle);
+	cached = g_slice_alloc (sizeof (*cached));
+	memcpy (cached, result, sizeof (*cached));
+	rspamd_lru_hash_insert (ctx->lookup_cache, key, cached, now, ttl);
+}
+
+static void
+rspamd_fuzzy_cache_invalidate (struct rspamd_fuzzy_storage_ctx *ctx,
+		const gchar *digest, guint cmd)
+{
+	guchar key[FUZZY_CACHE_KEY_LEN];
+	GHashTableIter it;
+	GPtrArray *stale;
+	rspamd_lru_element_t *elt;
+	gpointer k, v;
+	guint i;
+
+	if (ctx->lookup_cache == NULL) {
+		return;
+	}
+
+	fuzzy_cache_key (key, digest, FALSE);
+	rspamd_lru_hash_remove (ctx->lookup_cache, key);
+	fuzzy_cache_key (key, digest, TRUE);
+	rspamd_lru_hash_remove (ctx->lookup_cache, key);
+
+	if (cmd == FUZZY_DEL) {
+		/* Other digests could have matched the removed one by shingles */
+		stale = g_ptr_array_new ();
+		g_hash_table_iter_init (&it,
+				rspamd_lru_hash_get_htable (ctx->lookup_cache));
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			elt = v;
+
+			if (((guchar *)elt->key)[rspamd_cryptobox_HASHBYTES]) {
+				g_ptr_array_add (stale, elt->key);
+			}
+		}
+
+		for (i = 0; i < stale->len; i ++) {
+			rspamd_lru_hash_remove (ctx->lookup_cache,
+					g_ptr_array_index (stale, i));
+		}
+
+		g_ptr_array_free (stale, TRUE);
+	}
+}
+
 static void
 rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx,
 		const gchar *source, gboolean forced)
 {
 
 	struct rspamd_updates_cbdata *cbdata;
+	struct fuzzy_peer_cmd *up_cmd;
+	GList *cur;
 
 	if (ctx->updates_pending &&
 			(forced || g_queue_get_length (ctx->updates_pending) > 0)) {
+		/* Local, peer and mirror updates are all flushed from here */
+		for (cur = ctx->updates_pending->head; cur != NULL; cur = g_list_next (cur)) {
+			up_cmd = cur->data;
+			rspamd_fuzzy_cache_invalidate (ctx, up_cmd->cmd.normal.digest,
+					up_cmd->cmd.normal.cmd);
+		}
+
 		cbdata = g_slice_alloc (sizeof (*cbdata));
 		cbdata->ctx = ctx;
 		cbdata->source = g_strdup (source);
@@ -592,14 +917,17 @@ rspamd_fuzzy_reply_io (gint fd, gshort what, gpointer d)
 	REF_RELEASE (session);
 }
 
-static void
-rspamd_fuzzy_write_reply (struct fuzzy_session *session)
+static gconstpointer
+rspamd_fuzzy_reply_data (struct fuzzy_session *session, gsize *plen)
 {
-	gssize r;
 	gsize len;
 	gconstpointer data;
 
-	if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
+	if (session->batch_reply) {
+		data = session->batch_reply;
+		len = session->batch_reply_len;
+	}
+	else if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
 				session->cmd_type == CMD_ENCRYPTED_SHINGLE) {
 		/* Encrypted reply */
 		data = &session->reply;
@@ -610,6 +938,27 @@ rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 		len = sizeof (session->reply.rep);
 	}
 
+	*plen = len;
+
+	return data;
+}
+
+static void
+rspamd_fuzzy_write_reply (struct fuzzy_session *session)
+{
+	gssize r;
+	gsize len;
+	gconstpointer data;
+
+	if (session->ctx->defer_replies) {
+		/* Will be sent by rspamd_fuzzy_flush_replies */
+		REF_RETAIN (session);
+		g_ptr_array_add (session->ctx->pending_replies, session);
+
+		return;
+	}
+
+	data = rspamd_fuzzy_reply_data (session, &len);
 	r = rspamd_inet_address_sendto (session->fd, data, len, 0,
 			session->addr);
 
@@ -628,6 +977,52 @@ rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 	}
 }
 
+/*
+ * Send replies collected while processing a burst of datagrams
+ */
+static void
+rspamd_fuzzy_flush_replies (struct rspamd_fuzzy_storage_ctx *ctx, gint fd)
+{
+	struct iovec iov[RSPAMD_INET_ADDRESS_MMSG_MAX];
+	rspamd_inet_addr_t *addrs[RSPAMD_INET_ADDRESS_MMSG_MAX];
+	struct fuzzy_session *session;
+	gsize len;
+	guint i, j, n;
+	gint r;
+
+	ctx->defer_replies = FALSE;
+
+	for (i = 0; i < ctx->pending_replies->len; i += n) {
+		n = MIN (ctx->pending_replies->len - i, G_N_ELEMENTS (iov));
+
+		for (j = 0; j < n; j ++) {
+			session = g_ptr_array_index (ctx->pending_replies, i + j);
+			iov[j].iov_base = (gpointer)rspamd_fuzzy_reply_data (session, &len);
+			iov[j].iov_len = len;
+			addrs[j] = session->addr;
+		}
+
+		r = rspamd_inet_address_sendmmsg (fd, iov, addrs, n, 0);
+
+		if (r == -1) {
+			r = 0;
+		}
+
+		/* Retry the rest one by one to handle errors properly */
+		for (j = r; j < n; j ++) {
+			session = g_ptr_array_index (ctx->pending_replies, i + j);
+			rspamd_fuzzy_write_reply (session);
+		}
+	}
+
+	for (i = 0; i < ctx->pending_replies->len; i ++) {
+		session = g_ptr_array_index (ctx->pending_replies, i);
+		REF_RELEASE (session);
+	}
+
+	g_ptr_array_set_size (ctx->pending_replies, 0);
+}
+
 static void
 fuzzy_peer_send_io (gint fd, gshort what, gpointer d)
 {
@@ -705,16 +1100,70 @@ rspamd_fuzzy_update_stats (struct rspamd_fuzzy_storage_ctx *ctx,
 	}
 }
 
+static void
+rspamd_fuzzy_make_batch_reply (struct fuzzy_session *session)
+{
+	struct rspamd_fuzzy_encrypted_rep_hdr *hdr = NULL;
+	struct rspamd_fuzzy_batch_hdr *bhdr;
+	guchar *p, *payload;
+	guint i;
+
+	session->batch_reply_len = sizeof (*bhdr) +
+			session->nbatch * sizeof (struct rspamd_fuzzy_reply);
+
+	if (session->cmd_type == CMD_ENCRYPTED_BATCH) {
+		session->batch_reply_len += sizeof (*hdr);
+	}
+
+	session->batch_reply = g_malloc (session->batch_reply_len);
+	p = session->batch_reply;
+
+	if (session->cmd_type == CMD_ENCRYPTED_BATCH) {
+		hdr = (struct rspamd_fuzzy_encrypted_rep_hdr *)p;
+		p += sizeof (*hdr);
+	}
+
+	payload = p;
+	bhdr = (struct rspamd_fuzzy_batch_hdr *)p;
+	memcpy (bhdr->magic, fuzzy_batch_magic, sizeof (bhdr->magic));
+	bhdr->version = RSPAMD_FUZZY_BATCH_VERSION;
+	bhdr->ncmds = session->nbatch;
+	bhdr->reserved = 0;
+	p += sizeof (*bhdr);
+
+	for (i = 0; i < session->nbatch; i ++) {
+		memcpy (p, &session->batch[i].rep, sizeof (session->batch[i].rep));
+		p += sizeof (session->batch[i].rep);
+	}
+
+	if (hdr) {
+		/* All replies are encrypted at once */
+		ottery_rand_bytes (hdr->nonce, sizeof (hdr->nonce));
+		rspamd_cryptobox_encrypt_nm_inplace (payload,
+				p - payload,
+				hdr->nonce,
+				session->nm,
+				hdr->mac,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+	}
+}
+
 static void
 rspamd_fuzzy_make_reply (struct rspamd_fuzzy_cmd *cmd,
 		struct rspamd_fuzzy_reply *result,
 		struct fuzzy_session *session,
-		gboolean encrypted, gboolean is_shingle)
+		gboolean encrypted, gboolean is_shingle,
+		struct fuzzy_batch_cmd *bcmd)
 {
 	if (cmd) {
 		result->tag = cmd->tag;
 
-		memcpy (&session->reply.rep, result, sizeof (*result));
+		if (bcmd) {
+			memcpy (&bcmd->rep, result, sizeof (*result));
+		}
+		else {
+			memcpy (&session->reply.rep, result, sizeof (*result));
+		}
 
 		rspamd_fuzzy_update_stats (session->ctx,
 				session->epoch,
@@ -725,7 +1174,17 @@ rspamd_fuzzy_make_reply (struct rspamd_fuzzy_cmd *cmd,
 				cmd->cmd,
 				result->value);
 
-		if (encrypted) {
+		if (bcmd) {
+			/* Reply once all commands in a batch are processed */
+			g_assert (session->batch_pending > 0);
+
+			if (--session->batch_pending > 0) {
+				return;
+			}
+
+			rspamd_fuzzy_make_batch_reply (session);
+		}
+		else if (encrypted) {
 			/* We need also to encrypt reply */
 			ottery_rand_bytes (session->reply.hdr.nonce,
 					sizeof (session->reply.hdr.nonce));
@@ -765,60 +1224,52 @@ rspamd_fuzzy_check_callback (struct rspamd_fuzzy_reply *result, void *ud)
 		encrypted = TRUE;
 		is_shingle = TRUE;
 		break;
+	default:
+		break;
+	}
+
+	if (cmd) {
+		rspamd_fuzzy_cache_result (session->ctx, cmd, is_shingle, result,
+				session->time);
 	}
 
-	rspamd_fuzzy_make_reply (cmd, result, session, encrypted, is_shingle);
+	rspamd_fuzzy_make_reply (cmd, result, session, encrypted, is_shingle, NULL);
 	REF_RELEASE (session);
 }
 
 static void
-rspamd_fuzzy_process_command (struct fuzzy_session *session)
+rspamd_fuzzy_batch_check_callback (struct rspamd_fuzzy_reply *result, void *ud)
+{
+	struct fuzzy_batch_cmd *bcmd = ud;
+	struct fuzzy_session *session = bcmd->session;
+
+	rspamd_fuzzy_cache_result (session->ctx, &bcmd->cmd.normal,
+			bcmd->is_shingle, result, session->time);
+	rspamd_fuzzy_make_reply (&bcmd->cmd.normal, result, session,
+			session->cmd_type == CMD_ENCRYPTED_BATCH, bcmd->is_shingle, bcmd);
+	REF_RELEASE (session);
+}
+
+static void
+rspamd_fuzzy_process_cmd (struct fuzzy_session *session,
+		struct rspamd_fuzzy_cmd *cmd, gsize up_len,
+		gboolean encrypted, gboolean is_shingle,
+		struct fuzzy_batch_cmd *bcmd)
 {
-	gboolean encrypted = FALSE, is_shingle = FALSE;
-	struct rspamd_fuzzy_cmd *cmd = NULL;
 	struct rspamd_fuzzy_reply result;
 	struct fuzzy_peer_cmd *up_cmd;
 	struct fuzzy_peer_request *up_req;
 	struct fuzzy_key_stat *ip_stat = NULL;
+	struct rspamd_fuzzy_reply *cached;
 	rspamd_inet_addr_t *naddr;
 	gpointer ptr;
-	gsize up_len = 0;
-
-	switch (session->cmd_type) {
-	case CMD_NORMAL:
-		cmd = &session->cmd.normal;
-		up_len = sizeof (session->cmd.normal);
-		break;
-	case CMD_SHINGLE:
-		cmd = &session->cmd.shingle.basic;
-		up_len = sizeof (session->cmd.shingle);
-		is_shingle = TRUE;
-		break;
-	case CMD_ENCRYPTED_NORMAL:
-		cmd = &session->cmd.enc_normal.cmd;
-		up_len = sizeof (session->cmd.normal);
-		encrypted = TRUE;
-		break;
-	case CMD_ENCRYPTED_SHINGLE:
-		cmd = &session->cmd.enc_shingle.cmd.basic;
-		up_len = sizeof (session->cmd.shingle);
-		encrypted = TRUE;
-		is_shingle = TRUE;
-		break;
-	}
-
-	if (G_UNLIKELY (cmd == NULL || up_len == 0)) {
-		result.value = 500;
-		result.prob = 0.0;
-		rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle);
-		return;
-	}
 
 	if (session->ctx->encrypted_only && !encrypted) {
 		/* Do not accept unencrypted commands */
 		result.value = 403;
 		result.prob = 0.0;
-		rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle);
+		rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle,
+				bcmd);
 		return;
 	}
 
@@ -843,12 +1294,28 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 			result.prob = 0;
 			result.value = 500;
 			result.flag = 0;
-			rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle);
+			rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle,
+					bcmd);
+		}
+		else if (session->ctx->lookup_cache &&
+				(cached = rspamd_fuzzy_cache_lookup (session->ctx, cmd,
+						is_shingle, session->time)) != NULL) {
+			session->ctx->stat.lookup_cache_hits ++;
+			memcpy (&result, cached, sizeof (result));
+			rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle,
+					bcmd);
 		}
 		else {
 			REF_RETAIN (session);
-			rspamd_fuzzy_backend_check (session->ctx->backend, cmd,
-					rspamd_fuzzy_check_callback, session);
+
+			if (bcmd) {
+				rspamd_fuzzy_backend_check (session->ctx->backend, cmd,
+						rspamd_fuzzy_batch_check_callback, bcmd);
+			}
+			else {
+				rspamd_fuzzy_backend_check (session->ctx->backend, cmd,
+						rspamd_fuzzy_check_callback, session);
+			}
 		}
 	}
 	else if (cmd->cmd == FUZZY_STAT) {
@@ -856,17 +1323,20 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 			result.prob = 0;
 			result.value = 500;
 			result.flag = 0;
-			rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle);
+			rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle,
+					bcmd);
 		}
 		else {
 			result.prob = 1.0;
 			result.value = 0;
 			result.flag = session->ctx->stat.fuzzy_hashes;
-			rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle);
+			rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle,
+					bcmd);
 		}
 	}
 	else {
 		if (rspamd_fuzzy_check_client (session)) {
+			rspamd_fuzzy_cache_invalidate (session->ctx, cmd->digest, cmd->cmd);
 
 			if (session->worker->index == 0 || session->ctx->peer_fd == -1) {
 				/* Just add to the queue */
@@ -900,10 +1370,76 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 			result.prob = 0.0;
 		}
 
-		rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle);
+		rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle,
+				bcmd);
 	}
 }
 
+static void
+rspamd_fuzzy_process_batch (struct fuzzy_session *session)
+{
+	struct fuzzy_batch_cmd *bcmd;
+	gboolean encrypted;
+	guint i;
+
+	encrypted = session->cmd_type == CMD_ENCRYPTED_BATCH;
+	session->batch_pending = session->nbatch;
+
+	for (i = 0; i < session->nbatch; i ++) {
+		bcmd = &session->batch[i];
+		rspamd_fuzzy_process_cmd (session, &bcmd->cmd.normal,
+				bcmd->is_shingle ? sizeof (bcmd->cmd.shingle) :
+						sizeof (bcmd->cmd.normal),
+				encrypted, bcmd->is_shingle, bcmd);
+	}
+}
+
+static void
+rspamd_fuzzy_process_command (struct fuzzy_session *session)
+{
+	gboolean encrypted = FALSE, is_shingle = FALSE;
+	struct rspamd_fuzzy_cmd *cmd = NULL;
+	struct rspamd_fuzzy_reply result;
+	gsize up_len = 0;
+
+	switch (session->cmd_type) {
+	case CMD_NORMAL:
+		cmd = &session->cmd.normal;
+		up_len = sizeof (session->cmd.normal);
+		break;
+	case CMD_SHINGLE:
+		cmd = &session->cmd.shingle.basic;
+		up_len = sizeof (session->cmd.shingle);
+		is_shingle = TRUE;
+		break;
+	case CMD_ENCRYPTED_NORMAL:
+		cmd = &session->cmd.enc_normal.cmd;
+		up_len = sizeof (session->cmd.normal);
+		encrypted = TRUE;
+		break;
+	case CMD_ENCRYPTED_SHINGLE:
+		cmd = &session->cmd.enc_shingle.cmd.basic;
+		up_len = sizeof (session->cmd.shingle);
+		encrypted = TRUE;
+		is_shingle = TRUE;
+		break;
+	case CMD_BATCH:
+	case CMD_ENCRYPTED_BATCH:
+		rspamd_fuzzy_process_batch (session);
+		return;
+	}
+
+	if (G_UNLIKELY (cmd == NULL || up_len == 0)) {
+		result.value = 500;
+		result.prob = 0.0;
+		rspamd_fuzzy_make_reply (cmd, &result, session, encrypted, is_shingle,
+				NULL);
+		return;
+	}
+
+	rspamd_fuzzy_process_cmd (session, cmd, up_len, encrypted, is_shingle, NULL);
+}
+
 
 static enum rspamd_fuzzy_epoch
 rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
@@ -944,70 +1480,177 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 	return ret;
 }
 
+/* Finds the key for an encrypted request and derives the shared secret */
 static gboolean
-rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
+rspamd_fuzzy_decrypt_prepare (struct fuzzy_session *s,
+		struct rspamd_fuzzy_encrypted_req_hdr *hdr,
+		const guchar *magic)
 {
-	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
-	guchar *payload;
-	gsize payload_len;
 	struct rspamd_cryptobox_pubkey *rk;
 	struct fuzzy_key *key;
 
-	if (s->ctx->default_key == NULL) {
-		msg_warn ("received encrypted request when encryption is not enabled");
-		return FALSE;
-	}
+	if (s->ctx->default_key == NULL) {
+		msg_warn ("received encrypted request when encryption is not enabled");
+		return FALSE;
+	}
+
+	/* Compare magic */
+	if (memcmp (hdr->magic, magic, sizeof (hdr->magic)) != 0) {
+		msg_debug ("invalid magic for the encrypted packet");
+		return FALSE;
+	}
+
+	/* Try to find the desired key */
+	key = g_hash_table_lookup (s->ctx->keys, hdr->key_id);
+
+	if (key == NULL) {
+		/* Unknown key, assume default one */
+		key = s->ctx->default_key;
+	}
+
+	s->key_stat = key->stat;
+
+	/* Now process keypair */
+	rk = rspamd_pubkey_from_bin (hdr->pubkey, sizeof (hdr->pubkey),
+			RSPAMD_KEYPAIR_KEX, RSPAMD_CRYPTOBOX_MODE_25519);
+
+	if (rk == NULL) {
+		msg_err ("bad key");
+		return FALSE;
+	}
+
+	rspamd_keypair_cache_process (s->ctx->keypair_cache, key->key, rk);
+	memcpy (s->nm, rspamd_pubkey_get_nm (rk), sizeof (s->nm));
+	rspamd_pubkey_unref (rk);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_decrypt_payload (struct fuzzy_session *s,
+		struct rspamd_fuzzy_encrypted_req_hdr *hdr,
+		guchar *payload, gsize payload_len,
+		const guchar *magic)
+{
+	if (!rspamd_fuzzy_decrypt_prepare (s, hdr, magic)) {
+		return FALSE;
+	}
+
+	/* Now decrypt request */
+	if (!rspamd_cryptobox_decrypt_nm_inplace (payload, payload_len, hdr->nonce,
+			s->nm, hdr->mac, RSPAMD_CRYPTOBOX_MODE_25519)) {
+		msg_err ("decryption failed");
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
+{
+	if (s->decrypt_state != FUZZY_DECRYPT_NONE) {
+		/* Already decrypted with the whole datagrams batch */
+		return s->decrypt_state == FUZZY_DECRYPT_OK;
+	}
+
+	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
+		return rspamd_fuzzy_decrypt_payload (s, &s->cmd.enc_normal.hdr,
+				(guchar *)&s->cmd.enc_normal.cmd,
+				sizeof (s->cmd.enc_normal.cmd),
+				fuzzy_encrypted_magic);
+	}
+
+	return rspamd_fuzzy_decrypt_payload (s, &s->cmd.enc_shingle.hdr,
+			(guchar *)&s->cmd.enc_shingle.cmd,
+			sizeof (s->cmd.enc_shingle.cmd),
+			fuzzy_encrypted_magic);
+}
+
+static gboolean
+rspamd_fuzzy_batch_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
+{
+	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
+	struct rspamd_fuzzy_batch_hdr *bhdr;
+	struct rspamd_fuzzy_cmd *cmd;
+	struct fuzzy_batch_cmd *bcmd;
+	guint i, cmdlen;
+
+	if (memcmp (buf, fuzzy_encrypted_batch_magic,
+			sizeof (fuzzy_encrypted_batch_magic)) == 0) {
+		if (buflen < sizeof (*hdr) + sizeof (*bhdr)) {
+			return FALSE;
+		}
+
+		s->cmd_type = CMD_ENCRYPTED_BATCH;
+		hdr = (struct rspamd_fuzzy_encrypted_req_hdr *)buf;
+		buf += sizeof (*hdr);
+		buflen -= sizeof (*hdr);
 
-	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
-		hdr = &s->cmd.enc_normal.hdr;
-		payload = (guchar *)&s->cmd.enc_normal.cmd;
-		payload_len = sizeof (s->cmd.enc_normal.cmd);
+		/* The whole batch is decrypted in place */
+		if (!rspamd_fuzzy_decrypt_payload (s, hdr, buf, buflen,
+				fuzzy_encrypted_batch_magic)) {
+			return FALSE;
+		}
 	}
 	else {
-		hdr = &s->cmd.enc_shingle.hdr;
-		payload = (guchar *) &s->cmd.enc_shingle.cmd;
-		payload_len = sizeof (s->cmd.enc_shingle.cmd);
+		s->cmd_type = CMD_BATCH;
 	}
 
-	/* Compare magic */
-	if (memcmp (hdr->magic, fuzzy_encrypted_magic, sizeof (hdr->magic)) != 0) {
-		msg_debug ("invalid magic for the encrypted packet");
+	if (buflen < sizeof (*bhdr)) {
 		return FALSE;
 	}
 
-	/* Try to find the desired key */
-	key = g_hash_table_lookup (s->ctx->keys, hdr->key_id);
+	bhdr = (struct rspamd_fuzzy_batch_hdr *)buf;
 
-	if (key == NULL) {
-		/* Unknown key, assume default one */
-		key = s->ctx->default_key;
+	if (memcmp (bhdr->magic, fuzzy_batch_magic, sizeof (bhdr->magic)) != 0 ||
+			bhdr->version != RSPAMD_FUZZY_BATCH_VERSION ||
+			bhdr->ncmds == 0 || bhdr->ncmds > RSPAMD_FUZZY_BATCH_MAX) {
+		msg_debug ("invalid fuzzy batch header");
+		return FALSE;
 	}
 
-	s->key_stat = key->stat;
+	buf += sizeof (*bhdr);
+	buflen -= sizeof (*bhdr);
+	s->nbatch = bhdr->ncmds;
+	s->batch = g_malloc0 (sizeof (*s->batch) * s->nbatch);
 
-	/* Now process keypair */
-	rk = rspamd_pubkey_from_bin (hdr->pubkey, sizeof (hdr->pubkey),
-			RSPAMD_KEYPAIR_KEX, RSPAMD_CRYPTOBOX_MODE_25519);
+	for (i = 0; i < s->nbatch; i ++) {
+		if (buflen < sizeof (*cmd)) {
+			return FALSE;
+		}
 
-	if (rk == NULL) {
-		msg_err ("bad key");
-		return FALSE;
-	}
+		cmd = (struct rspamd_fuzzy_cmd *)buf;
+		bcmd = &s->batch[i];
+		bcmd->session = s;
+		bcmd->is_shingle = cmd->shingles_count > 0;
+		cmdlen = bcmd->is_shingle ? sizeof (bcmd->cmd.shingle) :
+				sizeof (bcmd->cmd.normal);
 
-	rspamd_keypair_cache_process (s->ctx->keypair_cache, key->key, rk);
+		if (buflen < cmdlen) {
+			return FALSE;
+		}
 
-	/* Now decrypt request */
-	if (!rspamd_cryptobox_decrypt_nm_inplace (payload, payload_len, hdr->nonce,
-			rspamd_pubkey_get_nm (rk),
-			hdr->mac, RSPAMD_CRYPTOBOX_MODE_25519)) {
-		msg_err ("decryption failed");
-		rspamd_pubkey_unref (rk);
+		memcpy (&bcmd->cmd, buf, cmdlen);
+
+		/* Batches are only supported by the current protocol version */
+		if (bcmd->cmd.normal.version != RSPAMD_FUZZY_VERSION ||
+				rspamd_fuzzy_command_valid (&bcmd->cmd.normal, cmdlen) ==
+				RSPAMD_FUZZY_EPOCH_MAX) {
+			return FALSE;
+		}
+
+		buf += cmdlen;
+		buflen -= cmdlen;
+	}
 
+	if (buflen != 0) {
+		msg_debug ("garbage after fuzzy batch: %d bytes", buflen);
 		return FALSE;
 	}
 
-	memcpy (s->nm, rspamd_pubkey_get_nm (rk), sizeof (s->nm));
-	rspamd_pubkey_unref (rk);
+	s->epoch = RSPAMD_FUZZY_EPOCH10;
 
 	return TRUE;
 }
@@ -1017,6 +1660,13 @@ rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 {
 	enum rspamd_fuzzy_epoch epoch;
 
+	if (buflen >= sizeof (fuzzy_batch_magic) &&
+			(memcmp (buf, fuzzy_batch_magic, sizeof (fuzzy_batch_magic)) == 0 ||
+			memcmp (buf, fuzzy_encrypted_batch_magic,
+					sizeof (fuzzy_encrypted_batch_magic)) == 0)) {
+		return rspamd_fuzzy_batch_from_wire (buf, buflen, s);
+	}
+
 	/* For now, we assume that recvfrom returns a complete datagramm */
 	switch (buflen) {
 	case sizeof (struct rspamd_fuzzy_cmd):
@@ -1088,56 +1738,104 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 		struct rspamd_http_message *msg, guint our_rev)
 {
 	const guchar *p;
+	guchar *decompressed = NULL;
+	const rspamd_ftok_t *enc;
 	gsize remain;
-	gint32 revision;
-	guint32 len = 0, cnt = 0;
+	unsigned long long dlen;
+	size_t r;
+	gint32 revision = 0, last_rev;
+	guint32 len = 0, cnt = 0, nblocks = 0, napplied = 0;
 	struct fuzzy_peer_cmd cmd, *pcmd;
 	enum {
-		read_len = 0,
-		read_data,
-		finish_processing
-	} state = read_len;
+		read_rev = 0,
+		read_len,
+		read_data
+	} state = read_rev;
 	GList *updates = NULL, *cur;
-	gpointer flag_ptr;
+	gpointer flag_ptr, rev_ptr;
+	gboolean skip = FALSE;
 
 	/*
-	 * Message format:
+	 * Message format (optionally compressed with zstd):
 	 * <uint32_le> - revision
 	 * <uint32_le> - size of the next element
 	 * <data> - command data
 	 * ...
-	 * <0> - end of data
-	 * ... - ignored
+	 * <0> - end of block
+	 * ... - more blocks with newer revisions in the same format
 	 */
 	p = rspamd_http_message_get_body (msg, &remain);
+	enc = rspamd_http_message_find_header (msg, "Content-Encoding");
 
-	if (p && remain >= sizeof (gint32) * 2) {
-		memcpy (&revision, p, sizeof (gint32));
-		revision = GINT32_TO_LE (revision);
+	if (p && enc && rspamd_ftok_cstr_equal (enc, "zstd", TRUE)) {
+		dlen = ZSTD_getDecompressedSize (p, remain);
 
-		if (revision <= our_rev) {
-			msg_err_fuzzy_update ("remote revision: %d is older than ours: %d, "
-					"refusing update",
-					revision, our_rev);
-
-			return;
+		if (dlen == 0 || dlen > RSPAMD_FUZZY_MAX_UPDATE_SIZE) {
+			msg_err_fuzzy_update ("invalid decompressed size of update: %L",
+					(gint64)dlen);
+			goto err;
 		}
-		else if (revision - our_rev > 1) {
-			msg_warn_fuzzy_update ("remote revision: %d is newer more than one revision "
-					"than ours: %d, cold sync is recommended",
-								revision, our_rev);
+
+		decompressed = g_malloc (dlen);
+		r = ZSTD_decompress (decompressed, dlen, p, remain);
+
+		if (ZSTD_isError (r)) {
+			msg_err_fuzzy_update ("cannot decompress update: %s",
+					ZSTD_getErrorName (r));
+			goto err;
 		}
 
-		remain -= sizeof (gint32);
-		p += sizeof (gint32);
+		p = decompressed;
+		remain = r;
 	}
-	else {
+
+	if (!p || remain < sizeof (gint32) * 2) {
 		msg_err_fuzzy_update ("short update message, not processing");
 		goto err;
 	}
 
+	/* Local revision drifts from the master's one when blocks are batched */
+	last_rev = our_rev;
+
+	if ((rev_ptr = g_hash_table_lookup (session->ctx->master_revs,
+			session->src)) != NULL) {
+		last_rev = MAX (last_rev, (gint32)GPOINTER_TO_UINT (rev_ptr));
+	}
+
 	while (remain > 0) {
 		switch (state) {
+		case read_rev:
+			if (remain < sizeof (gint32) * 2) {
+				/* Trailing garbage */
+				remain = 0;
+				break;
+			}
+
+			memcpy (&revision, p, sizeof (gint32));
+			revision = GINT32_TO_LE (revision);
+			remain -= sizeof (gint32);
+			p += sizeof (gint32);
+			nblocks ++;
+
+			if (revision <= last_rev) {
+				/* Already applied, master has not seen our reply */
+				skip = TRUE;
+			}
+			else {
+				if (revision - last_rev > 1) {
+					msg_warn_fuzzy_update ("remote revision: %d is newer more "
+							"than one revision than ours: %d, cold sync is "
+							"recommended",
+							revision, last_rev);
+				}
+
+				skip = FALSE;
+				last_rev = revision;
+				napplied ++;
+			}
+
+			state = read_len;
+			break;
 		case read_len:
 			if (remain < sizeof (guint32)) {
 				msg_err_fuzzy_update ("short update message while reading "
@@ -1151,8 +1849,7 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 			p += sizeof (guint32);
 
 			if (len == 0) {
-				remain = 0;
-				state = finish_processing;
+				state = read_rev;
 			}
 			else {
 				state = read_data;
@@ -1163,7 +1860,7 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 				msg_err_fuzzy_update ("short update message while reading data, "
 						"not processing"
 						" (%zd is available, %d is required)", remain, len);
-				return;
+				goto err;
 			}
 
 			if (len < sizeof (struct rspamd_fuzzy_cmd) + sizeof (guint32) ||
@@ -1184,23 +1881,28 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 				goto err;
 			}
 
-			pcmd = g_slice_alloc (sizeof (cmd));
-			memcpy (pcmd, &cmd, len);
-			updates = g_list_prepend (updates, pcmd);
+			if (!skip) {
+				pcmd = g_slice_alloc (sizeof (cmd));
+				memcpy (pcmd, &cmd, len);
+				updates = g_list_prepend (updates, pcmd);
+				cnt ++;
+			}
 
 			p += len;
 			remain -= len;
 			len = 0;
 			state = read_len;
-			cnt ++;
-			break;
-		case finish_processing:
-			/* Do nothing */
-			remain = 0;
 			break;
 		}
 	}
 
+	if (napplied == 0) {
+		msg_err_fuzzy_update ("remote revision: %d is older than ours: %d, "
+				"refusing update",
+				revision, last_rev);
+		goto err;
+	}
+
 	/* Insert elements to the updates from head */
 	for (cur = updates; cur != NULL; cur = g_list_next (cur)) {
 		pcmd = cur->data;
@@ -1223,12 +1925,15 @@ rspamd_fuzzy_mirror_process_update (struct fuzzy_master_update_session *session,
 		cur->data = NULL;
 	}
 
+	/* All revisions are applied in a single backend transaction */
 	rspamd_fuzzy_process_updates_queue (session->ctx, session->src, TRUE);
+	g_hash_table_replace (session->ctx->master_revs, g_strdup (session->src),
+			GUINT_TO_POINTER ((guint32)last_rev));
 	msg_info_fuzzy_update ("processed updates from the master %s, "
-			"%ud operations processed,"
+			"%ud operations processed from %ud of %ud revisions,"
 			" revision: %d (local revision: %d)",
 			rspamd_inet_address_to_string (session->addr),
-			cnt, revision, our_rev);
+			cnt, napplied, nblocks, last_rev, our_rev);
 
 err:
 	if (updates) {
@@ -1241,8 +1946,11 @@ err:
 
 		g_list_free (updates);
 	}
-}
 
+	if (decompressed) {
+		g_free (decompressed);
+	}
+}
 
 static void
 fuzzy_session_destroy (gpointer d)
@@ -1251,6 +1959,15 @@ fuzzy_session_destroy (gpointer d)
 
 	rspamd_inet_address_destroy (session->addr);
 	rspamd_explicit_memzero (session->nm, sizeof (session->nm));
+
+	if (session->batch) {
+		g_free (session->batch);
+	}
+
+	if (session->batch_reply) {
+		g_free (session->batch_reply);
+	}
+
 	session->worker->nconns--;
 	g_slice_free1 (sizeof (*session), session);
 }
@@ -1445,12 +2162,8 @@ rspamd_fuzzy_collection_send_error (struct rspamd_http_connection_entry *entry,
 	entry->is_reply = TRUE;
 }
 
-/*
- * Note: this function steals fstring
- */
-void
-rspamd_fuzzy_collection_send_fstring (struct rspamd_http_connection_entry *entry,
-	rspamd_fstring_t *fstr)
+static struct rspamd_http_message *
+rspamd_fuzzy_collection_reply_message (rspamd_fstring_t *fstr)
 {
 	struct rspamd_http_message *msg;
 
@@ -1459,6 +2172,14 @@ rspamd_fuzzy_collection_send_fstring (struct rspamd_http_connection_entry *entry
 	msg->date = time (NULL);
 	msg->code = 200;
 	rspamd_http_message_set_body_from_fstring_steal (msg, fstr);
+
+	return msg;
+}
+
+static void
+rspamd_fuzzy_collection_write_reply (struct rspamd_http_connection_entry *entry,
+	struct rspamd_http_message *msg)
+{
 	rspamd_http_connection_reset (entry->conn);
 	rspamd_http_router_insert_headers (entry->rt, msg);
 	rspamd_http_connection_write_message (entry->conn,
@@ -1472,6 +2193,17 @@ rspamd_fuzzy_collection_send_fstring (struct rspamd_http_connection_entry *entry
 	entry->is_reply = TRUE;
 }
 
+/*
+ * Note: this function steals fstring
+ */
+void
+rspamd_fuzzy_collection_send_fstring (struct rspamd_http_connection_entry *entry,
+	rspamd_fstring_t *fstr)
+{
+	rspamd_fuzzy_collection_write_reply (entry,
+			rspamd_fuzzy_collection_reply_message (fstr));
+}
+
 static int
 rspamd_fuzzy_collection_cookie (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
@@ -1491,15 +2223,18 @@ rspamd_fuzzy_collection_data (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_fuzzy_collection_session *session = conn_ent->ud;
-	const rspamd_ftok_t *sign_header;
+	const rspamd_ftok_t *sign_header, *limit_header;
 	struct rspamd_fuzzy_storage_ctx *ctx;
 	GList *cur;
 	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_http_message *reply_msg;
 	rspamd_fstring_t *reply;
 	GError *err = NULL;
 	guchar *decoded_signature;
-	gsize dec_len;
-	guint32 cmdlen, nupdates = 0;
+	gsize dec_len, reply_len;
+	gulong limit = 0;
+	guint32 cmdlen, nupdates = 0, i;
+	gchar numbuf[32];
 
 	sign_header = rspamd_http_message_find_header (msg, "Signature");
 
@@ -1543,9 +2278,18 @@ rspamd_fuzzy_collection_data (struct rspamd_http_connection_entry *conn_ent,
 	/* Generate new cookie */
 	ottery_rand_bytes (ctx->cookie, sizeof (ctx->cookie));
 
-	/* Send&Clear updates */
-	cur = ctx->updates_pending->head;
-	reply = rspamd_fstring_sized_new (8192);
+	/*
+	 * Collector may limit the number of updates in a single chunk, the rest
+	 * is left for the next request signed with the new cookie
+	 */
+	limit_header = rspamd_http_message_find_header (msg, "Limit");
+
+	if (limit_header == NULL || !rspamd_strtoul (limit_header->begin,
+			limit_header->len, &limit) || limit == 0 ||
+			limit > g_queue_get_length (ctx->updates_pending)) {
+		limit = g_queue_get_length (ctx->updates_pending);
+	}
+
 	/*
 	 * Message format:
 	 * <uint32_le> - revision
@@ -1555,12 +2299,23 @@ rspamd_fuzzy_collection_data (struct rspamd_http_connection_entry *conn_ent,
 	 * <0> - end of data
 	 * ... - ignored
 	 */
+	reply_len = sizeof (ctx->collection_id) + sizeof (cmdlen);
+
+	for (i = 0, cur = ctx->updates_pending->head; i < limit && cur != NULL;
+			i ++, cur = g_list_next (cur)) {
+		io_cmd = cur->data;
+		reply_len += sizeof (cmdlen) + sizeof (guint32) +
+				(io_cmd->is_shingle ? sizeof (io_cmd->cmd.shingle) :
+						sizeof (io_cmd->cmd.normal));
+	}
+
+	reply = rspamd_fstring_sized_new (reply_len);
 	reply = rspamd_fstring_append (reply, (const gchar *)&ctx->collection_id,
 					sizeof (ctx->collection_id));
-	cur = ctx->updates_pending->head;
 
-	while (cur) {
-		io_cmd = cur->data;
+	/* Send&Clear updates */
+	while (nupdates < limit &&
+			(io_cmd = g_queue_pop_head (ctx->updates_pending)) != NULL) {
 
 		if (io_cmd->is_shingle) {
 			cmdlen = sizeof (io_cmd->cmd.shingle) + sizeof (guint32);
@@ -1577,21 +2332,25 @@ rspamd_fuzzy_collection_data (struct rspamd_http_connection_entry *conn_ent,
 				cmdlen);
 		g_slice_free1 (sizeof (*io_cmd), io_cmd);
 		nupdates ++;
-		cur = g_list_next (cur);
 	}
 
-	msg_info_fuzzy_collection ("collection %d done, send %d updates",
-			ctx->collection_id, nupdates);
+	msg_info_fuzzy_collection ("collection %d done, send %d updates, "
+			"%d updates left",
+			ctx->collection_id, nupdates,
+			g_queue_get_length (ctx->updates_pending));
 	/* Last command */
 	cmdlen = 0;
 	reply = rspamd_fstring_append (reply, (const gchar *)&cmdlen,
 			sizeof (cmdlen));
 
-	g_queue_clear (ctx->updates_pending);
 	/* Clear failed attempts counter */
 	ctx->updates_failed = 0;
 	ctx->collection_id ++;
-	rspamd_fuzzy_collection_send_fstring (conn_ent, reply);
+	reply_msg = rspamd_fuzzy_collection_reply_message (reply);
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%ud",
+			g_queue_get_length (ctx->updates_pending));
+	rspamd_http_message_add_header (reply_msg, "Remaining", numbuf);
+	rspamd_fuzzy_collection_write_reply (conn_ent, reply_msg);
 
 	return 0;
 }
@@ -1757,6 +2516,99 @@ accept_fuzzy_mirror_socket (gint fd, short what, void *arg)
 			ctx->ev_base);
 }
 
+static struct fuzzy_session *
+rspamd_fuzzy_session_new (struct rspamd_worker *worker, gint fd,
+		rspamd_inet_addr_t *addr)
+{
+	struct fuzzy_session *session;
+
+	worker->nconns++;
+	session = g_slice_alloc0 (sizeof (*session));
+	REF_INIT_RETAIN (session, fuzzy_session_destroy);
+	session->worker = worker;
+	session->fd = fd;
+	session->ctx = worker->ctx;
+	session->time = (guint64) time (NULL);
+	session->addr = addr;
+
+	return session;
+}
+
+/*
+ * Adds single encrypted command to the decryption batch, the payload is
+ * decrypted inplace so it is copied from the datagram later as usual
+ */
+static gboolean
+rspamd_fuzzy_batch_decrypt_add (struct fuzzy_session *s,
+		guchar *buf, gsize len,
+		struct rspamd_cryptobox_batch_elt *elt)
+{
+	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
+
+	if (len != sizeof (struct rspamd_fuzzy_encrypted_cmd) &&
+			len != sizeof (struct rspamd_fuzzy_encrypted_shingle_cmd)) {
+		return FALSE;
+	}
+
+	if (memcmp (buf, fuzzy_batch_magic, sizeof (fuzzy_batch_magic)) == 0 ||
+			memcmp (buf, fuzzy_encrypted_batch_magic,
+					sizeof (fuzzy_encrypted_batch_magic)) == 0) {
+		/* Batches are decrypted as a whole */
+		return FALSE;
+	}
+
+	hdr = (struct rspamd_fuzzy_encrypted_req_hdr *)buf;
+
+	if (!rspamd_fuzzy_decrypt_prepare (s, hdr, fuzzy_encrypted_magic)) {
+		s->decrypt_state = FUZZY_DECRYPT_FAILED;
+
+		return FALSE;
+	}
+
+	elt->data = buf + sizeof (*hdr);
+	elt->len = len - sizeof (*hdr);
+	elt->nonce = hdr->nonce;
+	elt->nm = s->nm;
+	elt->sig = hdr->mac;
+	elt->ok = FALSE;
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_process_datagram (struct fuzzy_session *session,
+		guchar *buf, gsize len)
+{
+	rspamd_inet_addr_t *addr = session->addr;
+	guint64 *nerrors;
+
+	if (rspamd_fuzzy_cmd_from_wire (buf, len, session)) {
+		/* Check shingles count sanity */
+		rspamd_fuzzy_process_command (session);
+	}
+	else {
+		/* Discard input */
+		session->ctx->stat.invalid_requests ++;
+		msg_debug ("invalid fuzzy command of size %z received", len);
+
+		nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
+				addr, -1);
+
+		if (nerrors == NULL) {
+			nerrors = g_malloc (sizeof (*nerrors));
+			*nerrors = 1;
+			rspamd_lru_hash_insert (session->ctx->errors_ips,
+					rspamd_inet_address_copy (addr),
+					nerrors, -1, -1);
+		}
+		else {
+			*nerrors = *nerrors + 1;
+		}
+	}
+
+	REF_RELEASE (session);
+}
+
 /*
  * Accept new connection and construct task
  */
@@ -1764,23 +2616,26 @@ static void
 accept_fuzzy_socket (gint fd, short what, void *arg)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
-	struct fuzzy_session *session;
-	rspamd_inet_addr_t *addr;
-	gssize r;
-	guint8 buf[512];
-	guint64 *nerrors;
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	struct iovec iov[RSPAMD_FUZZY_MMSG_BATCH];
+	gsize lens[RSPAMD_FUZZY_MMSG_BATCH];
+	rspamd_inet_addr_t *addrs[RSPAMD_FUZZY_MMSG_BATCH];
+	struct fuzzy_session *sessions[RSPAMD_FUZZY_MMSG_BATCH],
+			*enc_sessions[RSPAMD_FUZZY_MMSG_BATCH];
+	struct rspamd_cryptobox_batch_elt elts[RSPAMD_FUZZY_MMSG_BATCH];
+	gint r, i, nenc;
 
 	/* Got some data */
 	if (what == EV_READ) {
 
 		for (;;) {
-			worker->nconns++;
+			for (i = 0; i < RSPAMD_FUZZY_MMSG_BATCH; i ++) {
+				iov[i].iov_base = ctx->recv_bufs + i * RSPAMD_FUZZY_MAX_DATAGRAM;
+				iov[i].iov_len = RSPAMD_FUZZY_MAX_DATAGRAM;
+			}
 
-			r = rspamd_inet_address_recvfrom (fd,
-					buf,
-					sizeof (buf),
-					0,
-					&addr);
+			r = rspamd_inet_address_recvmmsg (fd, iov, lens,
+					RSPAMD_FUZZY_MMSG_BATCH, 0, addrs);
 
 			if (r == -1) {
 				if (errno == EINTR) {
@@ -1797,39 +2652,46 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 				return;
 			}
 
-			session = g_slice_alloc0 (sizeof (*session));
-			REF_INIT_RETAIN (session, fuzzy_session_destroy);
-			session->worker = worker;
-			session->fd = fd;
-			session->ctx = worker->ctx;
-			session->time = (guint64) time (NULL);
-			session->addr = addr;
-
-			if (rspamd_fuzzy_cmd_from_wire (buf, r, session)) {
-				/* Check shingles count sanity */
-				rspamd_fuzzy_process_command (session);
-			}
-			else {
-				/* Discard input */
-				session->ctx->stat.invalid_requests ++;
-				msg_debug ("invalid fuzzy command of size %z received", r);
-
-				nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
-						addr, -1);
-
-				if (nerrors == NULL) {
-					nerrors = g_malloc (sizeof (*nerrors));
-					*nerrors = 1;
-					rspamd_lru_hash_insert (session->ctx->errors_ips,
-							rspamd_inet_address_copy (addr),
-							nerrors, -1, -1);
+			/* Replies produced synchronously are sent all at once */
+			ctx->defer_replies = TRUE;
+
+			nenc = 0;
+
+			for (i = 0; i < r; i ++) {
+				sessions[i] = rspamd_fuzzy_session_new (worker, fd, addrs[i]);
+
+				if (ctx->default_key && rspamd_fuzzy_batch_decrypt_add (
+						sessions[i], iov[i].iov_base, lens[i], &elts[nenc])) {
+					enc_sessions[nenc ++] = sessions[i];
 				}
-				else {
-					*nerrors = *nerrors + 1;
+			}
+
+			if (nenc > 0) {
+				rspamd_cryptobox_decrypt_nm_batch (elts, nenc,
+						RSPAMD_CRYPTOBOX_MODE_25519);
+
+				for (i = 0; i < nenc; i ++) {
+					if (elts[i].ok) {
+						enc_sessions[i]->decrypt_state = FUZZY_DECRYPT_OK;
+					}
+					else {
+						msg_err ("decryption failed");
+						enc_sessions[i]->decrypt_state = FUZZY_DECRYPT_FAILED;
+					}
 				}
 			}
 
-			REF_RELEASE (session);
+			for (i = 0; i < r; i ++) {
+				rspamd_fuzzy_process_datagram (sessions[i], iov[i].iov_base,
+						lens[i]);
+			}
+
+			rspamd_fuzzy_flush_replies (ctx, fd);
+
+			if (r < RSPAMD_FUZZY_MMSG_BATCH) {
+				/* Socket is likely drained */
+				return;
+			}
 		}
 	}
 }
@@ -1858,6 +2720,8 @@ rspamd_fuzzy_storage_sync (struct rspamd_main *rspamd_main,
 	struct rspamd_fuzzy_storage_ctx *ctx = ud;
 	struct rspamd_control_reply rep;
 
+	memset (&rep, 0, sizeof (rep));
+	rep.type = RSPAMD_CONTROL_FUZZY_SYNC;
 	rep.reply.fuzzy_sync.status = 0;
 
 	if (ctx->backend && worker->index == 0) {
@@ -2007,6 +2871,11 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			"invalid_requests",
 			0,
 			false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (ctx->stat.lookup_cache_hits),
+			"lookup_cache_hits",
+			0,
+			false);
 
 	if (ctx->errors_ips && ip_stat) {
 		ip_hash = rspamd_lru_hash_get_htable (ctx->errors_ips);
@@ -2085,7 +2954,7 @@ rspamd_fuzzy_storage_stat (struct rspamd_main *rspamd_main,
 	gchar tmppath[PATH_MAX];
 
 	memset (&rep, 0, sizeof (rep));
-	rep.type = RSPAMD_CONTROL_RELOAD;
+	rep.type = RSPAMD_CONTROL_FUZZY_STAT;
 
 	rspamd_snprintf (tmppath, sizeof (tmppath), "%s%c%s-XXXXXXXXXX",
 			rspamd_main->cfg->temp_dir, G_DIR_SEPARATOR, "fuzzy-stat");
@@ -2192,6 +3061,12 @@ fuzzy_storage_parse_mirror (rspamd_mempool_t *pool,
 		goto err;
 	}
 
+	elt = ucl_object_lookup (obj, "compression");
+
+	if (elt != NULL) {
+		up->compress = ucl_object_toboolean (elt);
+	}
+
 	elt = ucl_object_lookup (obj, "hosts");
 
 	if (elt == NULL) {
@@ -2358,6 +3233,8 @@ init_fuzzy (struct rspamd_config *cfg)
 	ctx->sync_timeout = DEFAULT_SYNC_TIMEOUT;
 	ctx->master_timeout = DEFAULT_MASTER_TIMEOUT;
 	ctx->keypair_cache_size = DEFAULT_KEYPAIR_CACHE_SIZE;
+	ctx->lookup_cache_size = DEFAULT_LOOKUP_CACHE_SIZE;
+	ctx->lookup_cache_ttl = DEFAULT_LOOKUP_CACHE_TTL;
 	ctx->keys = g_hash_table_new_full (fuzzy_kp_hash, fuzzy_kp_equal,
 			NULL, fuzzy_key_dtor);
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
@@ -2374,6 +3251,15 @@ init_fuzzy (struct rspamd_config *cfg)
 	ctx->mirrors = g_ptr_array_new ();
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
 			(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard, ctx->mirrors);
+	ctx->mirror_backlog = g_queue_new ();
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)fuzzy_mirror_backlog_free,
+			ctx->mirror_backlog);
+	ctx->mirror_backlog_size = DEFAULT_MIRROR_BACKLOG;
+	ctx->master_revs = g_hash_table_new_full (g_str_hash, g_str_equal,
+			g_free, NULL);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, ctx->master_revs);
 	ctx->updates_maxfail = DEFAULT_UPDATES_MAXFAIL;
 	ctx->collection_id_file = RSPAMD_DBDIR "/fuzzy_collection.id";
 
@@ -2543,6 +3429,14 @@ init_fuzzy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, updates_maxfail),
 			RSPAMD_CL_FLAG_UINT,
 			"Maximum number of updates to be failed before discarding");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"mirror_backlog",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, mirror_backlog_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of recent update revisions kept to resend to lagging mirrors");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"collection_only",
@@ -2575,6 +3469,30 @@ init_fuzzy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, collection_id_file),
 			RSPAMD_CL_FLAG_STRING_PATH,
 			"Store collection epoch in the desired file");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"lookup_cache_size",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, lookup_cache_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of recent check results cached by each worker (0 to disable)");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"lookup_cache_ttl",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, lookup_cache_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to keep cached check results (limited by expire)");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"reuseport",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, reuseport),
+			0,
+			"Bind a separate SO_REUSEPORT UDP socket in each worker");
 
 	return ctx;
 }
@@ -2604,6 +3522,50 @@ rspamd_fuzzy_peer_io (gint fd, gshort what, gpointer d)
 	}
 }
 
+static void
+rspamd_fuzzy_listen_udp (struct rspamd_worker *worker,
+		struct rspamd_fuzzy_storage_ctx *ctx, gint fd)
+{
+	struct event *accept_events;
+
+	accept_events = g_slice_alloc0 (sizeof (struct event) * 2);
+	event_set (&accept_events[0], fd, EV_READ | EV_PERSIST,
+			accept_fuzzy_socket, worker);
+	event_base_set (ctx->ev_base, &accept_events[0]);
+	event_add (&accept_events[0], NULL);
+	worker->accept_events = g_list_prepend (worker->accept_events,
+			accept_events);
+}
+
+/*
+ * Bind a worker specific socket to the same address, so the kernel
+ * distributes flows between workers instead of waking all of them.
+ * The inherited socket is still served as it is a member of the same group.
+ */
+static void
+rspamd_fuzzy_listen_reuseport (struct rspamd_worker *worker,
+		struct rspamd_fuzzy_storage_ctx *ctx,
+		struct rspamd_worker_listen_socket *ls)
+{
+	gint fd;
+
+	if (ls->addr == NULL) {
+		return;
+	}
+
+	fd = rspamd_inet_address_listen (ls->addr, SOCK_DGRAM, TRUE);
+
+	if (fd == -1) {
+		msg_warn ("cannot bind reuseport socket to %s: %s",
+				rspamd_inet_address_to_string_pretty (ls->addr),
+				strerror (errno));
+		return;
+	}
+
+	g_array_append_val (ctx->reuseport_fds, fd);
+	rspamd_fuzzy_listen_udp (worker, ctx, fd);
+}
+
 static void
 fuzzy_peer_rep (struct rspamd_worker *worker,
 		struct rspamd_srv_reply *rep, gint rep_fd,
@@ -2631,13 +3593,11 @@ fuzzy_peer_rep (struct rspamd_worker *worker,
 
 		if (ls->fd != -1) {
 			if (ls->type == RSPAMD_WORKER_SOCKET_UDP) {
-				accept_events = g_slice_alloc0 (sizeof (struct event) * 2);
-				event_set (&accept_events[0], ls->fd, EV_READ | EV_PERSIST,
-						accept_fuzzy_socket, worker);
-				event_base_set (ctx->ev_base, &accept_events[0]);
-				event_add (&accept_events[0], NULL);
-				worker->accept_events = g_list_prepend (worker->accept_events,
-						accept_events);
+				rspamd_fuzzy_listen_udp (worker, ctx, ls->fd);
+
+				if (ctx->reuseport) {
+					rspamd_fuzzy_listen_reuseport (worker, ctx, ls);
+				}
 			}
 			else if (worker->index == 0) {
 				/* We allow TCP listeners only for a update worker */
@@ -2680,6 +3640,7 @@ start_fuzzy (struct rspamd_worker *worker)
 	GError *err = NULL;
 	struct rspamd_srv_command srv_cmd;
 	struct rspamd_config *cfg = worker->srv->cfg;
+	guint i;
 
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"fuzzy",
@@ -2688,6 +3649,11 @@ start_fuzzy (struct rspamd_worker *worker)
 	ctx->peer_fd = -1;
 	ctx->worker = worker;
 	ctx->cfg = worker->srv->cfg;
+	ctx->recv_bufs = g_malloc (RSPAMD_FUZZY_MMSG_BATCH *
+			RSPAMD_FUZZY_MAX_DATAGRAM);
+	ctx->pending_replies = g_ptr_array_sized_new (RSPAMD_FUZZY_MMSG_BATCH);
+	ctx->defer_replies = FALSE;
+	ctx->reuseport_fds = g_array_new (FALSE, FALSE, sizeof (gint));
 	double_to_tv (ctx->master_timeout, &ctx->master_io_tv);
 
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
@@ -2698,6 +3664,14 @@ start_fuzzy (struct rspamd_worker *worker)
 	if (ctx->keypair_cache_size > 0) {
 		/* Create keypairs cache */
 		ctx->keypair_cache = rspamd_keypair_cache_new (ctx->keypair_cache_size);
+		rspamd_keypair_cache_set_shared (ctx->keypair_cache,
+				worker->srv->cfg->keypair_shared_cache);
+	}
+
+	if (!ctx->collection_mode && ctx->lookup_cache_size > 0) {
+		ctx->lookup_cache = rspamd_lru_hash_new_full (ctx->lookup_cache_size,
+				fuzzy_digest_free, fuzzy_cached_reply_free,
+				fuzzy_digest_hash, fuzzy_digest_equal);
 	}
 
 	if (!ctx->collection_mode) {
@@ -2892,6 +3866,17 @@ start_fuzzy (struct rspamd_worker *worker)
 		rspamd_keypair_cache_destroy (ctx->keypair_cache);
 	}
 
+	if (ctx->lookup_cache) {
+		rspamd_lru_hash_destroy (ctx->lookup_cache);
+	}
+
+	for (i = 0; i < ctx->reuseport_fds->len; i ++) {
+		close (g_array_index (ctx->reuseport_fds, gint, i));
+	}
+
+	g_array_free (ctx->reuseport_fds, TRUE);
+	g_ptr_array_free (ctx->pending_replies, TRUE);
+	g_free (ctx->recv_bufs);
 	REF_RELEASE (ctx->cfg);
 
 	exit (EXIT_SUCCESS);
@@ -32,13 +32,15 @@ worker_t hs_helper_worker = {
 		"hs_helper",                /* Name */
 		init_hs_helper,             /* Init function */
 		start_hs_helper,            /* Start function */
-		RSPAMD_WORKER_UNIQUE|RSPAMD_WORKER_KILLABLE|RSPAMD_WORKER_ALWAYS_START,
+		RSPAMD_WORKER_UNIQUE|RSPAMD_WORKER_KILLABLE|RSPAMD_WORKER_ALWAYS_START|
+				RSPAMD_WORKER_LOW_PRIORITY,
 		RSPAMD_WORKER_SOCKET_NONE,  /* No socket */
 		RSPAMD_WORKER_VER           /* Version info */
 };
 
 static const gdouble default_max_time = 1.0;
 static const gdouble default_recompile_time = 60.0;
+static const gint default_notify_timeout = 5000;
 static const guint64 rspamd_hs_helper_magic = 0x22d310157a2288a0ULL;
 
 /*
@@ -50,6 +52,8 @@ struct hs_helper_ctx {
 	gboolean loaded;
 	gdouble max_time;
 	gdouble recompile_time;
+	guint max_procs;
+	struct rspamd_worker *worker;
 	struct rspamd_config *cfg;
 	struct event recompile_timer;
 	struct event_base *ev_base;
@@ -94,6 +98,15 @@ init_hs_helper (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct hs_helper_ctx, recompile_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Time between recompilation checks");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"max_procs",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct hs_helper_ctx, max_procs),
+			RSPAMD_CL_FLAG_INT_32,
+			"Number of processes to compile classes in parallel "
+			"(number of CPUs by default)");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"timeout",
@@ -127,7 +140,7 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 	}
 
 	globbuf.gl_offs = 0;
-	len = strlen (ctx->hs_dir) + 1 + sizeof ("*.hs.new") + 2;
+	len = strlen (ctx->hs_dir) + 1 + sizeof ("*.hsmap*") + 2;
 	pattern = g_malloc (len);
 	rspamd_snprintf (pattern, len, "%s%c%s", ctx->hs_dir, G_DIR_SEPARATOR, "*.hs");
 
@@ -167,12 +180,80 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 		ret = FALSE;
 	}
 
+	globfree (&globbuf);
+
+	/* Mapped databases are removed if forced or if their source is gone */
+	memset (&globbuf, 0, sizeof (globbuf));
+	rspamd_snprintf (pattern, len, "%s%c%s", ctx->hs_dir, G_DIR_SEPARATOR, "*.hsmap*");
+	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			gchar *src;
+			gsize plen = strlen (globbuf.gl_pathv[i]);
+			gboolean need_unlink = forced;
+
+			if (!need_unlink) {
+				if (plen > sizeof (".hsmap") - 1 &&
+						strcmp (globbuf.gl_pathv[i] + plen - (sizeof (".hsmap") - 1),
+								".hsmap") == 0) {
+					/* Strip `map` to get the source file name */
+					src = g_strndup (globbuf.gl_pathv[i], plen - 3);
+					need_unlink = access (src, R_OK) == -1;
+					g_free (src);
+				}
+				else {
+					/* Temporary file */
+					need_unlink = TRUE;
+				}
+			}
+
+			if (need_unlink && unlink (globbuf.gl_pathv[i]) == -1) {
+				msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
+						strerror (errno));
+				ret = FALSE;
+			}
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err ("glob %s failed: %s", pattern, strerror (errno));
+		ret = FALSE;
+	}
+
 	globfree (&globbuf);
 	g_free (pattern);
 
 	return ret;
 }
 
+/*
+ * Tells workers to load a class as soon as it is compiled, we are blocked in
+ * compilation here, so the command is sent synchronously
+ */
+static void
+rspamd_rs_class_compiled (struct rspamd_re_cache *cache,
+		const gchar *class_hash, gint nregexps, gpointer ud)
+{
+	struct hs_helper_ctx *ctx = ud;
+	struct rspamd_srv_command srv_cmd;
+	struct rspamd_srv_reply srv_rep;
+
+	/*
+	 * Workers that are not started yet load all classes themselves, and they
+	 * all reload the whole cache when compilation is finished
+	 */
+	memset (&srv_cmd, 0, sizeof (srv_cmd));
+	srv_cmd.type = RSPAMD_SRV_HYPERSCAN_LOADED;
+	rspamd_strlcpy (srv_cmd.cmd.hs_loaded.cache_dir, ctx->hs_dir,
+			sizeof (srv_cmd.cmd.hs_loaded.cache_dir));
+	rspamd_strlcpy (srv_cmd.cmd.hs_loaded.re_class, class_hash,
+			sizeof (srv_cmd.cmd.hs_loaded.re_class));
+	srv_cmd.cmd.hs_loaded.forced = TRUE;
+
+	if (!rspamd_srv_send_command_sync (ctx->worker, &srv_cmd, &srv_rep,
+			default_notify_timeout)) {
+		msg_warn ("cannot notify workers about class %s", class_hash);
+	}
+}
+
 static gboolean
 rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 		gboolean forced)
@@ -191,8 +272,10 @@ rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 		msg_warn ("cannot cleanup cache dir '%s'", ctx->hs_dir);
 	}
 
-	if ((ncompiled = rspamd_re_cache_compile_hyperscan (ctx->cfg->re_cache,
+	if ((ncompiled = rspamd_re_cache_compile_hyperscan_parallel (
+			ctx->cfg->re_cache,
 			ctx->hs_dir, ctx->max_time, !forced,
+			ctx->max_procs, rspamd_rs_class_compiled, ctx,
 			&err)) == -1) {
 		msg_err ("failed to compile re cache: %e", err);
 		g_error_free (err);
@@ -275,6 +358,11 @@ start_hs_helper (struct rspamd_worker *worker)
 	double tim;
 
 	ctx->cfg = worker->srv->cfg;
+	ctx->worker = worker;
+
+	if (ctx->max_procs == 0) {
+		ctx->max_procs = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+	}
 
 	if (ctx->hs_dir == NULL) {
 		ctx->hs_dir = ctx->cfg->hs_cache_dir;
@@ -0,0 +1,244 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Multi-buffer blake2b: four independent messages are hashed at once, each
+ * 64 bit lane of AVX2 registers holds the state of one message
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "blake2.h"
+#include "blake2-internal.h"
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __SSE4_2__
+#define __SSE4_2__
+#endif
+#ifndef __SSE4_1__
+#define __SSE4_1__
+#endif
+#ifndef __SSEE3__
+#define __SSEE3__
+#endif
+#ifndef __AVX__
+#define __AVX__
+#endif
+#ifndef __AVX2__
+#define __AVX2__
+#endif
+
+#include <immintrin.h>
+
+#define BLAKE2B_LANES 4
+
+static const uint8_t blake2b_sigma_avx2[12][16] = {
+		{0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15},
+		{14, 10, 4,  8,  9,  15, 13, 6,  1,  12, 0,  2,  11, 7,  5,  3},
+		{11, 8,  12, 0,  5,  2,  15, 13, 10, 14, 3,  6,  7,  1,  9,  4},
+		{7,  9,  3,  1,  13, 12, 11, 14, 2,  6,  5,  10, 4,  0,  15, 8},
+		{9,  0,  5,  7,  2,  4,  10, 15, 14, 1,  11, 12, 6,  8,  3,  13},
+		{2,  12, 6,  10, 0,  11, 8,  3,  4,  13, 7,  5,  15, 14, 1,  9},
+		{12, 5,  1,  15, 14, 13, 4,  10, 0,  7,  6,  3,  9,  2,  8,  11},
+		{13, 11, 7,  14, 12, 1,  3,  9,  5,  0,  15, 4,  8,  6,  2,  10},
+		{6,  15, 14, 9,  11, 3,  0,  8,  12, 2,  13, 7,  1,  4,  10, 5},
+		{10, 2,  8,  4,  7,  6,  1,  5,  15, 11, 9,  14, 3,  12, 13, 0},
+		{0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15},
+		{14, 10, 4,  8,  9,  15, 13, 6,  1,  12, 0,  2,  11, 7,  5,  3}
+};
+
+static const uint64_t blake2b_iv_avx2[8] = {
+		0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull,
+		0x3c6ef372fe94f82bull, 0xa54ff53a5f1d36f1ull,
+		0x510e527fade682d1ull, 0x9b05688c2b3e6c1full,
+		0x1f83d9abfb41bd6bull, 0x5be0cd19137e2179ull,
+};
+
+/* Transposes 4x4 matrix of 64 bit words */
+#define TRANSPOSE4(r0, r1, r2, r3, o0, o1, o2, o3) do { \
+	__m256i _t0 = _mm256_unpacklo_epi64 ((r0), (r1)); \
+	__m256i _t1 = _mm256_unpackhi_epi64 ((r0), (r1)); \
+	__m256i _t2 = _mm256_unpacklo_epi64 ((r2), (r3)); \
+	__m256i _t3 = _mm256_unpackhi_epi64 ((r2), (r3)); \
+	(o0) = _mm256_permute2x128_si256 (_t0, _t2, 0x20); \
+	(o1) = _mm256_permute2x128_si256 (_t1, _t3, 0x20); \
+	(o2) = _mm256_permute2x128_si256 (_t0, _t2, 0x31); \
+	(o3) = _mm256_permute2x128_si256 (_t1, _t3, 0x31); \
+} while (0)
+
+#define ROTR32(x) _mm256_shuffle_epi32 ((x), _MM_SHUFFLE (2, 3, 0, 1))
+#define ROTR24(x) _mm256_shuffle_epi8 ((x), r24)
+#define ROTR16(x) _mm256_shuffle_epi8 ((x), r16)
+#define ROTR63(x) _mm256_xor_si256 (_mm256_srli_epi64 ((x), 63), \
+		_mm256_add_epi64 ((x), (x)))
+
+#define G(r, i, a, b, c, d) do { \
+	a = _mm256_add_epi64 (a, _mm256_add_epi64 (b, \
+			m[blake2b_sigma_avx2[r][2 * i + 0]])); \
+	d = ROTR32 (_mm256_xor_si256 (d, a)); \
+	c = _mm256_add_epi64 (c, d); \
+	b = ROTR24 (_mm256_xor_si256 (b, c)); \
+	a = _mm256_add_epi64 (a, _mm256_add_epi64 (b, \
+			m[blake2b_sigma_avx2[r][2 * i + 1]])); \
+	d = ROTR16 (_mm256_xor_si256 (d, a)); \
+	c = _mm256_add_epi64 (c, d); \
+	b = ROTR63 (_mm256_xor_si256 (b, c)); \
+} while (0)
+
+void blake2b_multi_avx2 (const blake2b_state_internal *S,
+		unsigned char **out,
+		const unsigned char **in,
+		const size_t *inlen) __attribute__((__target__("avx2")));
+
+/*
+ * Hashes up to 4 messages starting from the common state `S` that must have
+ * no pending data. Lanes with `in` set to NULL are not processed, other lanes
+ * must have non-zero length
+ */
+void
+blake2b_multi_avx2 (const blake2b_state_internal *S,
+		unsigned char **out,
+		const unsigned char **in,
+		const size_t *inlen)
+{
+	const __m256i r24 = _mm256_setr_epi8 (
+			3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+			3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+	const __m256i r16 = _mm256_setr_epi8 (
+			2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+			2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+	unsigned char RSPAMD_ALIGNED(32) last[BLAKE2B_LANES][BLAKE2B_BLOCKBYTES];
+	static const unsigned char RSPAMD_ALIGNED(32) zero[BLAKE2B_BLOCKBYTES];
+	const unsigned char *blk[BLAKE2B_LANES];
+	uint64_t RSPAMD_ALIGNED(32) t[BLAKE2B_LANES], f[BLAKE2B_LANES],
+			act[BLAKE2B_LANES], hw[BLAKE2B_LANES * 8];
+	size_t nblocks[BLAKE2B_LANES], maxblocks = 0, b;
+	uint64_t t0;
+	__m256i h[8], m[16], v[16], mask, r0, r1, r2, r3;
+	unsigned int i, j;
+
+	memcpy (&t0, S->t, sizeof (t0));
+
+	for (i = 0; i < BLAKE2B_LANES; i++) {
+		nblocks[i] = in[i] ? (inlen[i] + BLAKE2B_BLOCKBYTES - 1) /
+				BLAKE2B_BLOCKBYTES : 0;
+
+		if (nblocks[i] > maxblocks) {
+			maxblocks = nblocks[i];
+		}
+	}
+
+	for (j = 0; j < 8; j++) {
+		uint64_t w;
+
+		memcpy (&w, &S->h[j * 8], sizeof (w));
+		h[j] = _mm256_set1_epi64x (w);
+	}
+
+	for (b = 0; b < maxblocks; b++) {
+		for (i = 0; i < BLAKE2B_LANES; i++) {
+			if (b + 1 < nblocks[i]) {
+				blk[i] = in[i] + b * BLAKE2B_BLOCKBYTES;
+				t[i] = t0 + (b + 1) * BLAKE2B_BLOCKBYTES;
+				f[i] = 0;
+				act[i] = ~0ULL;
+			}
+			else if (b + 1 == nblocks[i]) {
+				/* Final block is padded with zeroes */
+				memset (last[i], 0, sizeof (last[i]));
+				memcpy (last[i], in[i] + b * BLAKE2B_BLOCKBYTES,
+						inlen[i] - b * BLAKE2B_BLOCKBYTES);
+				blk[i] = last[i];
+				t[i] = t0 + inlen[i];
+				f[i] = ~0ULL;
+				act[i] = ~0ULL;
+			}
+			else {
+				blk[i] = zero;
+				t[i] = 0;
+				f[i] = 0;
+				act[i] = 0;
+			}
+		}
+
+		for (j = 0; j < 16; j += 4) {
+			r0 = _mm256_loadu_si256 ((const __m256i *)(blk[0] + j * 8));
+			r1 = _mm256_loadu_si256 ((const __m256i *)(blk[1] + j * 8));
+			r2 = _mm256_loadu_si256 ((const __m256i *)(blk[2] + j * 8));
+			r3 = _mm256_loadu_si256 ((const __m256i *)(blk[3] + j * 8));
+			TRANSPOSE4 (r0, r1, r2, r3, m[j], m[j + 1], m[j + 2], m[j + 3]);
+		}
+
+		for (j = 0; j < 8; j++) {
+			v[j] = h[j];
+			v[j + 8] = _mm256_set1_epi64x (blake2b_iv_avx2[j]);
+		}
+
+		v[12] = _mm256_xor_si256 (v[12],
+				_mm256_load_si256 ((const __m256i *)t));
+		v[14] = _mm256_xor_si256 (v[14],
+				_mm256_load_si256 ((const __m256i *)f));
+		mask = _mm256_load_si256 ((const __m256i *)act);
+
+		for (j = 0; j < 12; j++) {
+			G (j, 0, v[0], v[4], v[8], v[12]);
+			G (j, 1, v[1], v[5], v[9], v[13]);
+			G (j, 2, v[2], v[6], v[10], v[14]);
+			G (j, 3, v[3], v[7], v[11], v[15]);
+			G (j, 4, v[0], v[5], v[10], v[15]);
+			G (j, 5, v[1], v[6], v[11], v[12]);
+			G (j, 6, v[2], v[7], v[8], v[13]);
+			G (j, 7, v[3], v[4], v[9], v[14]);
+		}
+
+		/* Finished lanes keep their state */
+		for (j = 0; j < 8; j++) {
+			h[j] = _mm256_blendv_epi8 (h[j],
+					_mm256_xor_si256 (h[j], _mm256_xor_si256 (v[j], v[j + 8])),
+					mask);
+		}
+	}
+
+	TRANSPOSE4 (h[0], h[1], h[2], h[3], r0, r1, r2, r3);
+	_mm256_store_si256 ((__m256i *)&hw[0], r0);
+	_mm256_store_si256 ((__m256i *)&hw[8], r1);
+	_mm256_store_si256 ((__m256i *)&hw[16], r2);
+	_mm256_store_si256 ((__m256i *)&hw[24], r3);
+	TRANSPOSE4 (h[4], h[5], h[6], h[7], r0, r1, r2, r3);
+	_mm256_store_si256 ((__m256i *)&hw[4], r0);
+	_mm256_store_si256 ((__m256i *)&hw[12], r1);
+	_mm256_store_si256 ((__m256i *)&hw[20], r2);
+	_mm256_store_si256 ((__m256i *)&hw[28], r3);
+
+	for (i = 0; i < BLAKE2B_LANES; i++) {
+		if (in[i] != NULL) {
+			memcpy (out[i], &hw[i * 8], BLAKE2B_OUTBYTES);
+		}
+	}
+
+	rspamd_explicit_memzero (last, sizeof (last));
+}
+
+#pragma GCC pop_options
+#endif
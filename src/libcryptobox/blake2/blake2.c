@@ -77,6 +77,24 @@ static const blake2b_impl_t blake2b_list[] = {
 
 static const blake2b_impl_t *blake2b_opt = &blake2b_list[0];
 
+/* Multi-buffer implementation, hashes BLAKE2B_MULTI_LANES messages at once */
+typedef void (*blake2b_multi_func) (const blake2b_state_internal *state,
+		unsigned char **out,
+		const unsigned char **in,
+		const size_t *inlen);
+
+#define BLAKE2B_MULTI_LANES 4
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2)
+void blake2b_multi_avx2 (const blake2b_state_internal *state,
+		unsigned char **out,
+		const unsigned char **in,
+		const size_t *inlen) __attribute__((__target__("avx2")));
+#define BLAKE2B_MULTI_AVX2 blake2b_multi_avx2
+#endif
+
+static blake2b_multi_func blake2b_multi_opt = NULL;
+
 
 /* is the pointer not aligned on a word boundary? */
 static int
@@ -266,6 +284,109 @@ blake2b (unsigned char *hash, const unsigned char *in, size_t inlen)
 	blake2b_store_hash (state, hash);
 }
 
+/* sort lanes by length, so messages hashed together have similar sizes */
+static gint
+blake2b_multi_cmp (gconstpointer a, gconstpointer b, gpointer ud)
+{
+	const size_t *inlen = ud;
+	const size_t la = inlen[*(const guint *)a], lb = inlen[*(const guint *)b];
+
+	return (la > lb) - (la < lb);
+}
+
+void
+blake2b_multi (unsigned char **hash,
+		const unsigned char **in,
+		const size_t *inlen,
+		size_t n,
+		const unsigned char *key,
+		size_t keylen)
+{
+	blake2b_state S, Sc, tmp;
+	blake2b_state_internal *state = (blake2b_state_internal *)&Sc;
+	unsigned char *lane_out[BLAKE2B_MULTI_LANES];
+	const unsigned char *lane_in[BLAKE2B_MULTI_LANES];
+	size_t lane_len[BLAKE2B_MULTI_LANES], i, j, nlanes;
+	guint *order;
+
+	if (key != NULL && keylen > 0) {
+		blake2b_keyed_init (&S, key, keylen);
+	}
+	else {
+		blake2b_init (&S);
+	}
+
+	if (blake2b_multi_opt == NULL || n < 2) {
+		for (i = 0; i < n; i++) {
+			memcpy (&tmp, &S, sizeof (S));
+			blake2b_update (&tmp, in[i], inlen[i]);
+			blake2b_final (&tmp, hash[i]);
+		}
+
+		rspamd_explicit_memzero (&S, sizeof (S));
+
+		return;
+	}
+
+	/* Compress the key block, as all lanes have more data to follow */
+	memcpy (&Sc, &S, sizeof (S));
+
+	if (state->leftover == BLAKE2B_BLOCKBYTES) {
+		blake2b_opt->blake2b_blocks (state, state->buffer, BLAKE2B_BLOCKBYTES,
+				BLAKE2B_STRIDE_NONE);
+		state->leftover = 0;
+	}
+
+	order = g_malloc (n * sizeof (*order));
+
+	for (i = 0; i < n; i++) {
+		order[i] = i;
+	}
+
+	g_qsort_with_data (order, n, sizeof (*order), blake2b_multi_cmp,
+			(gpointer)inlen);
+
+	i = 0;
+
+	while (i < n) {
+		nlanes = 0;
+
+		while (i < n && nlanes < BLAKE2B_MULTI_LANES) {
+			j = order[i++];
+
+			if (inlen[j] == 0) {
+				/* Empty messages are finalized from the initial state */
+				memcpy (&tmp, &S, sizeof (S));
+				blake2b_final (&tmp, hash[j]);
+				continue;
+			}
+
+			lane_out[nlanes] = hash[j];
+			lane_in[nlanes] = in[j];
+			lane_len[nlanes] = inlen[j];
+			nlanes ++;
+		}
+
+		if (nlanes == 1) {
+			memcpy (&tmp, &S, sizeof (S));
+			blake2b_update (&tmp, lane_in[0], lane_len[0]);
+			blake2b_final (&tmp, lane_out[0]);
+		}
+		else if (nlanes > 1) {
+			for (j = nlanes; j < BLAKE2B_MULTI_LANES; j++) {
+				lane_in[j] = NULL;
+				lane_len[j] = 0;
+			}
+
+			blake2b_multi_opt (state, lane_out, lane_in, lane_len);
+		}
+	}
+
+	g_free (order);
+	rspamd_explicit_memzero (&S, sizeof (S));
+	rspamd_explicit_memzero (&Sc, sizeof (Sc));
+}
+
 void
 blake2b_keyed (unsigned char *hash,
 		const unsigned char *in,
@@ -291,6 +412,12 @@ blake2b_load (void)
 				break;
 			}
 		}
+
+#ifdef BLAKE2B_MULTI_AVX2
+		if (cpu_config & CPUID_AVX2) {
+			blake2b_multi_opt = BLAKE2B_MULTI_AVX2;
+		}
+#endif
 	}
 
 	return blake2b_opt->desc;
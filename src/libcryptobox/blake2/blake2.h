@@ -56,6 +56,17 @@ void blake2b_keyed (unsigned char *hash,
 		const unsigned char *key,
 		size_t keylen);
 
+/*
+ * Hashes `n` independent messages, the same as calling blake2b_keyed for each
+ * of them, several messages are processed in parallel when CPU allows it
+ */
+void blake2b_multi (unsigned char **hash,
+		const unsigned char **in,
+		const size_t *inlen,
+		size_t n,
+		const unsigned char *key,
+		size_t keylen);
+
 const char* blake2b_load (void);
 
 #if defined(__cplusplus)
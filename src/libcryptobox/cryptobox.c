@@ -1166,6 +1166,49 @@ rspamd_cryptobox_decrypt_nm_inplace (guchar *data, gsize len,
 	return ret;
 }
 
+guint
+rspamd_cryptobox_decrypt_nm_batch (struct rspamd_cryptobox_batch_elt *elts,
+		gsize cnt,
+		enum rspamd_cryptobox_mode mode)
+{
+	struct rspamd_cryptobox_batch_elt *elt;
+	gsize r, i;
+	guint nok = 0;
+	void *enc_buf, *auth_buf, *enc_ctx, *auth_ctx;
+
+	/* Contexts are allocated once and reinitialised for each element */
+	enc_buf = g_alloca (rspamd_cryptobox_encrypt_ctx_len (mode));
+	auth_buf = g_alloca (rspamd_cryptobox_auth_ctx_len (mode));
+
+	for (i = 0; i < cnt; i ++) {
+		elt = &elts[i];
+		r = 0;
+		enc_ctx = rspamd_cryptobox_decrypt_init (enc_buf, elt->nonce, elt->nm,
+				mode);
+		auth_ctx = rspamd_cryptobox_auth_verify_init (auth_buf, enc_ctx, mode);
+
+		rspamd_cryptobox_auth_verify_update (auth_ctx, elt->data, elt->len, mode);
+
+		if (!rspamd_cryptobox_auth_verify_final (auth_ctx, elt->sig, mode)) {
+			elt->ok = FALSE;
+		}
+		else {
+			rspamd_cryptobox_decrypt_update (enc_ctx, elt->data, elt->len,
+					elt->data, &r, mode);
+			elt->ok = rspamd_cryptobox_decrypt_final (enc_ctx, elt->data + r,
+					elt->len - r, mode);
+		}
+
+		if (elt->ok) {
+			nok ++;
+		}
+
+		rspamd_cryptobox_cleanup (enc_ctx, auth_ctx, mode);
+	}
+
+	return nok;
+}
+
 gboolean
 rspamd_cryptobox_decrypt_inplace (guchar *data, gsize len,
 		const rspamd_nonce_t nonce,
@@ -1435,6 +1478,19 @@ void rspamd_cryptobox_hash (guchar *out,
 	rspamd_cryptobox_hash_final (&st, out);
 }
 
+void
+rspamd_cryptobox_hash_multi (guchar **out,
+		const guchar **data,
+		const gsize *len,
+		guint nbufs,
+		const guchar *key,
+		gsize keylen)
+{
+	G_STATIC_ASSERT (sizeof (gsize) == sizeof (size_t));
+
+	blake2b_multi (out, data, (const size_t *)len, nbufs, key, keylen);
+}
+
 /* MUST be 64 bytes at maximum */
 struct rspamd_cryptobox_fast_hash_state_real {
 	guint64 h;  /* current hash value */
@@ -1537,6 +1593,12 @@ rspamd_cryptobox_fast_hash (const void *data,
 	return rspamd_cryptobox_fast_hash_machdep (data, len, seed);
 }
 
+guint64
+rspamd_cryptobox_fast_hash_u64 (guint64 v, guint64 seed)
+{
+	return mum_hash64 (v, seed);
+}
+
 guint64
 rspamd_cryptobox_fast_hash_specific (
 		enum rspamd_cryptobox_fast_hash_type type,
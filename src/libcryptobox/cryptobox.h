@@ -23,6 +23,16 @@ struct rspamd_cryptobox_segment {
 	gsize len;
 };
 
+/* Element of a batch that is decrypted by a single call */
+struct rspamd_cryptobox_batch_elt {
+	guchar *data;
+	gsize len;
+	const guchar *nonce;
+	const guchar *nm;
+	const guchar *sig;
+	gboolean ok;
+};
+
 #if defined(__GNUC__) && ((__GNUC__ == 4) &&  (__GNUC_MINOR__ >= 8) || (__GNUC__ > 4))
 #define RSPAMD_HAS_TARGET_ATTR
 #endif
@@ -180,6 +190,17 @@ gboolean rspamd_cryptobox_decrypt_nm_inplace (guchar *data, gsize len,
 		 const rspamd_nm_t nm, const rspamd_mac_t sig,
 		 enum rspamd_cryptobox_mode mode);
 
+/**
+ * Decrypt and verify many data chunks inplace, `ok` field of each element is
+ * set to TRUE if it has been verified successfully
+ * @param elts elements to decrypt
+ * @param cnt count of elements
+ * @return number of elements verified successfully
+ */
+guint rspamd_cryptobox_decrypt_nm_batch (struct rspamd_cryptobox_batch_elt *elts,
+		gsize cnt,
+		enum rspamd_cryptobox_mode mode);
+
 /**
  * Generate shared secret from local sk and remote pk
  * @param nm shared secret
@@ -330,6 +351,18 @@ void rspamd_cryptobox_hash (guchar *out,
 		const guchar *key,
 		gsize keylen);
 
+/**
+ * Hash `nbufs` independent buffers with the same key, output is the same as
+ * calling rspamd_cryptobox_hash for each buffer but several buffers are
+ * hashed in parallel if CPU supports it (AVX2)
+ */
+void rspamd_cryptobox_hash_multi (guchar **out,
+		const guchar **data,
+		const gsize *len,
+		guint nbufs,
+		const guchar *key,
+		gsize keylen);
+
 /* Non crypto hash IUF interface */
 typedef struct RSPAMD_ALIGNED(32) rspamd_cryptobox_fast_hash_state_s  {
 	unsigned char opaque[64];
@@ -360,6 +393,13 @@ guint64 rspamd_cryptobox_fast_hash_final (rspamd_cryptobox_fast_hash_state_t *st
 guint64 rspamd_cryptobox_fast_hash (const void *data,
 		gsize len, guint64 seed);
 
+/**
+ * Hash of a single 64-bit value, such as a token or an id. It is about twice
+ * faster than rspamd_cryptobox_fast_hash over the same 8 bytes. Strings of any
+ * length and bulk data should use rspamd_cryptobox_fast_hash
+ */
+guint64 rspamd_cryptobox_fast_hash_u64 (guint64 v, guint64 seed);
+
 enum rspamd_cryptobox_fast_hash_type {
 	RSPAMD_CRYPTOBOX_XXHASH64 = 0,
 	RSPAMD_CRYPTOBOX_XXHASH32,
@@ -18,6 +18,10 @@
 #include "keypairs_cache.h"
 #include "keypair_private.h"
 #include "hash.h"
+#include "shared_cache.h"
+
+/* Shared secrets are kept in the shared cache during a day */
+#define RSPAMD_KEYPAIR_SHARED_TTL 86400
 
 struct rspamd_keypair_elt {
 	struct rspamd_cryptobox_nm *nm;
@@ -26,6 +30,7 @@ struct rspamd_keypair_elt {
 
 struct rspamd_keypair_cache {
 	rspamd_lru_hash_t *hash;
+	struct rspamd_shared_cache *shared;
 };
 
 static void
@@ -62,19 +67,40 @@ rspamd_keypair_cache_new (guint max_items)
 
 	g_assert (max_items > 0);
 
-	c = g_slice_alloc (sizeof (*c));
+	c = g_slice_alloc0 (sizeof (*c));
 	c->hash = rspamd_lru_hash_new_full (max_items, NULL,
 			rspamd_keypair_destroy, rspamd_keypair_hash, rspamd_keypair_equal);
 
 	return c;
 }
 
+struct rspamd_shared_cache *
+rspamd_keypair_shared_cache_new (rspamd_mempool_t *pool, guint max_items)
+{
+	return rspamd_shared_cache_new (pool, max_items,
+			rspamd_cryptobox_MAX_NMBYTES, RSPAMD_KEYPAIR_SHARED_TTL);
+}
+
+void
+rspamd_keypair_cache_set_shared (struct rspamd_keypair_cache *c,
+		struct rspamd_shared_cache *sc)
+{
+	g_assert (c != NULL);
+	/* Shared values are copied directly to nm */
+	g_assert (sc == NULL ||
+			rspamd_shared_cache_max_value (sc) == rspamd_cryptobox_MAX_NMBYTES);
+
+	c->shared = sc;
+}
+
 void
 rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		struct rspamd_cryptobox_keypair *lk,
 		struct rspamd_cryptobox_pubkey *rk)
 {
 	struct rspamd_keypair_elt search, *new;
+	gboolean cached = FALSE;
+	gsize nmlen;
 
 	g_assert (lk != NULL);
 	g_assert (rk != NULL);
@@ -106,7 +132,17 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 		memcpy (&new->pair[rspamd_cryptobox_HASHBYTES], lk->id,
 				rspamd_cryptobox_HASHBYTES);
 
-		if (rk->alg == RSPAMD_CRYPTOBOX_MODE_25519) {
+		if (c->shared) {
+			cached = rspamd_shared_cache_lookup (c->shared,
+					(const gchar *)new->pair, sizeof (new->pair),
+					(gchar *)new->nm->nm, &nmlen, time (NULL)) &&
+					nmlen == sizeof (new->nm->nm);
+		}
+
+		if (cached) {
+			/* Computed by another worker */
+		}
+		else if (rk->alg == RSPAMD_CRYPTOBOX_MODE_25519) {
 			struct rspamd_cryptobox_pubkey_25519 *rk_25519 =
 					RSPAMD_CRYPTOBOX_PUBKEY_25519(rk);
 			struct rspamd_cryptobox_keypair_25519 *sk_25519 =
@@ -123,6 +159,13 @@ rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
 			rspamd_cryptobox_nm (new->nm->nm, rk_nist->pk, sk_nist->sk, rk->alg);
 		}
 
+		if (c->shared && !cached) {
+			rspamd_shared_cache_insert (c->shared,
+					(const gchar *)new->pair, sizeof (new->pair),
+					(const gchar *)new->nm->nm, sizeof (new->nm->nm),
+					time (NULL), 0);
+		}
+
 		rspamd_lru_hash_insert (c->hash, new, new, time (NULL), -1);
 	}
 
@@ -18,8 +18,10 @@
 
 #include "config.h"
 #include "keypair.h"
+#include "mem_pool.h"
 
 struct rspamd_keypair_cache;
+struct rspamd_shared_cache;
 
 /**
  * Create new keypair cache of the specified size
@@ -45,5 +47,24 @@ void rspamd_keypair_cache_process (struct rspamd_keypair_cache *c,
  */
 void rspamd_keypair_cache_destroy (struct rspamd_keypair_cache *c);
 
+/**
+ * Create cache of shared secrets placed in shared memory, it must be created
+ * before forking workers so all of them could use the same cache
+ * @param pool pool used to allocate shared memory
+ * @param max_items defines maximum count of elements in the cache
+ * @return new shared cache
+ */
+struct rspamd_shared_cache * rspamd_keypair_shared_cache_new (
+		rspamd_mempool_t *pool, guint max_items);
+
+/**
+ * Use shared cache to lookup and store shared secrets missing in
+ * the local cache
+ * @param c cache of keypairs
+ * @param sc shared cache (or NULL to disable it)
+ */
+void rspamd_keypair_cache_set_shared (struct rspamd_keypair_cache *c,
+		struct rspamd_shared_cache *sc);
+
 
 #endif /* KEYPAIRS_CACHE_H_ */
@@ -16,9 +16,14 @@
 
 #include "config.h"
 #include "message.h"
+#include "mime_parser.h"
 #include "task.h"
 #include "archives.h"
 
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
 static void
 rspamd_archive_dtor (gpointer p)
 {
@@ -38,38 +43,77 @@ rspamd_archive_dtor (gpointer p)
 	g_ptr_array_free (arch->files, TRUE);
 }
 
+static struct rspamd_archive *
+rspamd_archive_new (struct rspamd_task *task, enum rspamd_archive_type type)
+{
+	struct rspamd_archive *arch;
+
+	arch = rspamd_mempool_alloc0 (task->task_pool, sizeof (*arch));
+	arch->files = g_ptr_array_new ();
+	arch->type = type;
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_archive_dtor,
+			arch);
+
+	return arch;
+}
+
+static void
+rspamd_archive_attach (struct rspamd_mime_part *part,
+		struct rspamd_archive *arch, gsize size)
+{
+	part->flags |= RSPAMD_MIME_PART_ARCHIVE;
+	part->specific.arch = arch;
+
+	if (part->cd) {
+		arch->archive_name = &part->cd->filename;
+	}
+
+	arch->size = size;
+}
+
 static void
 rspamd_archive_process_zip (struct rspamd_task *task,
-		struct rspamd_mime_part *part)
+		struct rspamd_mime_part *part, struct rspamd_mime_part_reader *r)
 {
-	const guchar *p, *start, *end, *eocd = NULL, *cd;
+	const guchar *p, *eocd = NULL, *cd, *cd_end;
 	const guint32 eocd_magic = 0x06054b50, cd_basic_len = 46;
 	const guchar cd_magic[] = {0x50, 0x4b, 0x01, 0x02};
-	const guint max_processed = 1024;
+	const guint max_processed = 1024, max_cd_size = 16 * 1024 * 1024;
+	guchar tail[1024 + 22], *cd_buf = NULL;
 	guint32 cd_offset, cd_size, comp_size, uncomp_size, processed = 0;
 	guint16 extra_len, fname_len, comment_len;
+	gsize size, tail_len, tail_off;
 	struct rspamd_archive *arch;
 	struct rspamd_archive_file *f;
 
-	/* Zip files have interesting data at the end of archive */
-	p = part->parsed_data.begin + part->parsed_data.len - 1;
-	start = part->parsed_data.begin;
-	end = p;
+	/*
+	 * Zip files have interesting data at the end of archive, so we read
+	 * just the tail to find EOCD and then the central directory itself
+	 */
+	size = rspamd_mime_part_reader_size (r);
+	tail_len = MIN (size, sizeof (tail));
+	tail_off = size - tail_len;
+
+	if (tail_len < 22 ||
+			rspamd_mime_part_reader_read (r, tail_off, tail, tail_len) != tail_len) {
+		msg_debug_task ("zip archive is invalid (too short)");
+
+		return;
+	}
 
-	/* Search for EOCD:
-	 * 22 bytes is a typical size of eocd without a comment and
-	 * end points one byte after the last character
+	/*
+	 * Search for EOCD:
+	 * 22 bytes is a typical size of eocd without a comment
 	 */
-	p -= 21;
+	p = tail + tail_len - 22;
 
-	while (p > start + sizeof (guint32)) {
+	while (p >= tail) {
 		guint32 t;
 
 		if (processed > max_processed) {
 			break;
 		}
 
-		/* XXX: not an efficient approach */
 		memcpy (&t, p, sizeof (t));
 
 		if (GUINT32_FROM_LE (t) == eocd_magic) {
@@ -81,7 +125,6 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 		processed ++;
 	}
 
-
 	if (eocd == NULL) {
 		/* Not a zip file */
 		msg_debug_task ("zip archive is invalid (no EOCD)");
@@ -89,38 +132,43 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 		return;
 	}
 
-	if (end - eocd < 21) {
-		msg_debug_task ("zip archive is invalid (short EOCD)");
-
-		return;
-	}
-
-
 	memcpy (&cd_size, eocd + 12, sizeof (cd_size));
 	cd_size = GUINT32_FROM_LE (cd_size);
 	memcpy (&cd_offset, eocd + 16, sizeof (cd_offset));
 	cd_offset = GUINT32_FROM_LE (cd_offset);
 
 	/* We need to check sanity as well */
-	if (cd_offset + cd_size != (guint)(eocd - start)) {
+	if ((guint64)cd_offset + cd_size != tail_off + (eocd - tail)) {
 		msg_debug_task ("zip archive is invalid (bad size/offset for CD)");
 
 		return;
 	}
 
-	cd = start + cd_offset;
+	if (cd_size > max_cd_size) {
+		msg_debug_task ("zip archive is invalid (too large CD: %ud)", cd_size);
 
-	arch = rspamd_mempool_alloc0 (task->task_pool, sizeof (*arch));
-	arch->files = g_ptr_array_new ();
-	arch->type = RSPAMD_ARCHIVE_ZIP;
-	rspamd_mempool_add_destructor (task->task_pool, rspamd_archive_dtor,
-			arch);
+		return;
+	}
+
+	cd_buf = g_malloc (cd_size + 1);
+
+	if (rspamd_mime_part_reader_read (r, cd_offset, cd_buf, cd_size) != cd_size) {
+		msg_debug_task ("zip archive is invalid (truncated CD)");
+		g_free (cd_buf);
+
+		return;
+	}
+
+	cd = cd_buf;
+	cd_end = cd_buf + cd_size;
+	arch = rspamd_archive_new (task, RSPAMD_ARCHIVE_ZIP);
 
-	while (cd < eocd) {
+	while (cd < cd_end) {
 		/* Read central directory record */
-		if (eocd - cd < cd_basic_len ||
+		if (cd_end - cd < cd_basic_len ||
 				memcmp (cd, cd_magic, sizeof (cd_magic)) != 0) {
 			msg_debug_task ("zip archive is invalid (bad cd record)");
+			g_free (cd_buf);
 
 			return;
 		}
@@ -136,8 +184,9 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 		memcpy (&comment_len, cd + 32, sizeof (comment_len));
 		comment_len = GUINT16_FROM_LE (comment_len);
 
-		if (cd + fname_len + comment_len + extra_len + cd_basic_len > eocd) {
+		if (cd + fname_len + comment_len + extra_len + cd_basic_len > cd_end) {
 			msg_debug_task ("zip archive is invalid (too large cd record)");
+			g_free (cd_buf);
 
 			return;
 		}
@@ -152,14 +201,8 @@ rspamd_archive_process_zip (struct rspamd_task *task,
 		cd += fname_len + comment_len + extra_len + cd_basic_len;
 	}
 
-	part->flags |= RSPAMD_MIME_PART_ARCHIVE;
-	part->specific.arch = arch;
-
-	if (part->cd) {
-		arch->archive_name = &part->cd->filename;
-	}
-
-	arch->size = part->parsed_data.len;
+	g_free (cd_buf);
+	rspamd_archive_attach (part, arch, size);
 }
 
 static inline gint
@@ -558,85 +601,1287 @@ part->flags |= RSPAMD_MIME_PART_ARCHIVE;
 	arch->size = part->parsed_data.len;
 }
 
+#define RSPAMD_TAR_BLOCK 512
+
+struct rspamd_archive_tar {
+	guchar hdr[RSPAMD_TAR_BLOCK];
+	gsize hdr_pos;
+	/* Bytes to append to the long name */
+	guint64 collect;
+	/* Bytes to skip after the current header */
+	guint64 skip;
+	GString *long_name;
+	struct rspamd_archive *arch;
+	gboolean done;
+	gboolean valid;
+};
+
+static guint64
+rspamd_archive_tar_number (const guchar *p, gsize len)
+{
+	guint64 res = 0;
+	gsize i;
+
+	if (p[0] & 0x80) {
+		/* GNU base-256 encoding for large values */
+		for (i = 1; i < len; i ++) {
+			res = (res << 8) | p[i];
+		}
+
+		return res;
+	}
+
+	for (i = 0; i < len && (p[i] == ' ' || p[i] == '\0'); i ++);
+
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; i ++) {
+		res = (res << 3) | (p[i] - '0');
+	}
+
+	return res;
+}
+
 static gboolean
-rspamd_archive_cheat_detect (struct rspamd_mime_part *part, const gchar *str,
-		const guchar *magic_start, gsize magic_len)
+rspamd_archive_tar_check_header (const guchar *hdr)
 {
-	struct rspamd_content_type *ct;
-	const gchar *p;
-	rspamd_ftok_t srch, *fname;
+	guint64 expected, sum = 0;
+	guint i;
 
-	ct = part->ct;
-	RSPAMD_FTOK_ASSIGN (&srch, "application");
+	expected = rspamd_archive_tar_number (hdr + 148, 8);
 
-	if (ct && ct->type.len && ct->subtype.len > 0 && rspamd_ftok_cmp (&ct->type,
-			&srch) == 0) {
-		if (rspamd_substring_search_caseless (ct->subtype.begin, ct->subtype.len,
-				str, strlen (str)) != -1) {
-			return TRUE;
+	for (i = 0; i < RSPAMD_TAR_BLOCK; i ++) {
+		/* Checksum field itself is counted as spaces */
+		sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+	}
+
+	return sum == expected;
+}
+
+static void
+rspamd_archive_tar_header (struct rspamd_task *task,
+		struct rspamd_archive_tar *st)
+{
+	const guint max_files = 1024, max_long_name = 4096;
+	const guchar *hdr = st->hdr;
+	struct rspamd_archive_file *f;
+	guint64 sz, padded;
+	gsize i;
+
+	for (i = 0; i < RSPAMD_TAR_BLOCK && hdr[i] == 0; i ++);
+
+	if (i == RSPAMD_TAR_BLOCK) {
+		/* Zero block marks the end of archive */
+		st->done = TRUE;
+
+		return;
+	}
+
+	if (!rspamd_archive_tar_check_header (hdr)) {
+		msg_debug_task ("tar archive is invalid (bad header checksum)");
+		st->done = TRUE;
+
+		if (st->arch->files->len == 0) {
+			st->valid = FALSE;
 		}
+
+		return;
 	}
 
-	if (part->cd) {
-		fname = &part->cd->filename;
+	st->valid = TRUE;
+	sz = rspamd_archive_tar_number (hdr + 124, 12);
+	padded = (sz + RSPAMD_TAR_BLOCK - 1) / RSPAMD_TAR_BLOCK * RSPAMD_TAR_BLOCK;
 
-		if (fname && fname->len > strlen (str)) {
-			p = fname->begin + fname->len - strlen (str);
+	switch (hdr[156]) {
+	case 'L':
+		/* GNU long name for the next entry */
+		if (sz == 0 || sz > max_long_name) {
+			msg_debug_task ("tar archive is invalid (bad long name)");
+			st->done = TRUE;
 
-			if (rspamd_lc_cmp (p, str, strlen (str)) == 0) {
-				if (*(p - 1) == '.') {
-					return TRUE;
-				}
-			}
+			return;
 		}
 
-		if (magic_start != NULL) {
-			if (part->parsed_data.len > magic_len && memcmp (part->parsed_data.begin,
-					magic_start, magic_len) == 0) {
-				return TRUE;
+		if (st->long_name) {
+			g_string_free (st->long_name, TRUE);
+		}
+
+		st->long_name = g_string_sized_new (sz);
+		st->collect = sz;
+		st->skip = padded - sz;
+		return;
+	case 'x':
+	case 'g':
+	case 'K':
+		/* Extended headers and long link names */
+		st->skip = padded;
+		return;
+	default:
+		break;
+	}
+
+	f = g_slice_alloc0 (sizeof (*f));
+
+	if (st->long_name) {
+		f->fname = st->long_name;
+		/* Long name is NUL padded */
+		g_string_truncate (f->fname, strnlen (f->fname->str, f->fname->len));
+		st->long_name = NULL;
+	}
+	else {
+		f->fname = g_string_sized_new (100);
+
+		if (memcmp (hdr + 257, "ustar", 5) == 0 && hdr[345] != '\0') {
+			g_string_append_len (f->fname, hdr + 345,
+					strnlen ((const gchar *)hdr + 345, 155));
+			g_string_append_c (f->fname, '/');
+		}
+
+		g_string_append_len (f->fname, hdr, strnlen ((const gchar *)hdr, 100));
+	}
+
+	f->compressed_size = sz;
+	f->uncompressed_size = sz;
+	g_ptr_array_add (st->arch->files, f);
+	msg_debug_task ("found file in tar archive: %v", f->fname);
+
+	if (st->arch->files->len >= max_files) {
+		st->done = TRUE;
+	}
+
+	st->skip = padded;
+}
+
+/*
+ * Feeds tar parser with a chunk of data, returns number of bytes consumed
+ */
+static gsize
+rspamd_archive_tar_feed (struct rspamd_task *task,
+		struct rspamd_archive_tar *st, const guchar *data, gsize len)
+{
+	const guchar *p = data, *end = data + len;
+	gsize n;
+
+	while (p < end && !st->done) {
+		if (st->collect > 0) {
+			n = MIN (st->collect, (gsize)(end - p));
+			g_string_append_len (st->long_name, p, n);
+			st->collect -= n;
+			p += n;
+		}
+		else if (st->skip > 0) {
+			n = MIN (st->skip, (gsize)(end - p));
+			st->skip -= n;
+			p += n;
+		}
+		else {
+			n = MIN (RSPAMD_TAR_BLOCK - st->hdr_pos, (gsize)(end - p));
+			memcpy (st->hdr + st->hdr_pos, p, n);
+			st->hdr_pos += n;
+			p += n;
+
+			if (st->hdr_pos == RSPAMD_TAR_BLOCK) {
+				st->hdr_pos = 0;
+				rspamd_archive_tar_header (task, st);
 			}
 		}
 	}
 
-	return FALSE;
+	return p - data;
 }
 
-void
-rspamd_archives_process (struct rspamd_task *task)
+static void
+rspamd_archive_tar_init (struct rspamd_task *task,
+		struct rspamd_archive_tar *st, enum rspamd_archive_type type)
 {
-	guint i;
-	struct rspamd_mime_part *part;
-	const guchar rar_magic[] = {0x52, 0x61, 0x72, 0x21, 0x1A, 0x07};
-	const guchar zip_magic[] = {0x50, 0x4b, 0x03, 0x04};
+	memset (st, 0, sizeof (*st));
+	st->arch = rspamd_archive_new (task, type);
+}
 
-	for (i = 0; i < task->parts->len; i ++) {
-		part = g_ptr_array_index (task->parts, i);
+static void
+rspamd_archive_tar_fin (struct rspamd_archive_tar *st)
+{
+	if (st->long_name) {
+		g_string_free (st->long_name, TRUE);
+		st->long_name = NULL;
+	}
+}
 
-		if (part->parsed_data.len > 0) {
-			if (rspamd_archive_cheat_detect (part, "zip",
-					zip_magic, sizeof (zip_magic))) {
-				rspamd_archive_process_zip (task, part);
-			}
-			else if (rspamd_archive_cheat_detect (part, "rar",
-					rar_magic, sizeof (rar_magic))) {
-				rspamd_archive_process_rar (task, part);
+static void
+rspamd_archive_process_tar (struct rspamd_task *task,
+		struct rspamd_mime_part *part, struct rspamd_mime_part_reader *r)
+{
+	guchar buf[RSPAMD_TAR_BLOCK];
+	struct rspamd_archive_tar st;
+	gsize offset = 0, size, n;
+
+	size = rspamd_mime_part_reader_size (r);
+	rspamd_archive_tar_init (task, &st, RSPAMD_ARCHIVE_TAR);
+
+	while (offset < size && !st.done) {
+		if (st.collect == 0 && st.skip > 0) {
+			/* Skip file content without decoding it */
+			offset += st.skip;
+			st.skip = 0;
+			continue;
+		}
+
+		n = st.collect > 0 ? MIN (st.collect, sizeof (buf)) :
+				RSPAMD_TAR_BLOCK - st.hdr_pos;
+		n = rspamd_mime_part_reader_read (r, offset, buf, n);
+
+		if (n == 0) {
+			break;
+		}
+
+		offset += rspamd_archive_tar_feed (task, &st, buf, n);
+	}
+
+	rspamd_archive_tar_fin (&st);
+
+	if (st.valid) {
+		rspamd_archive_attach (part, st.arch, size);
+	}
+}
+
+static void
+rspamd_archive_process_gzip (struct rspamd_task *task,
+		struct rspamd_mime_part *part, struct rspamd_mime_part_reader *r)
+{
+	guchar hdr[1024], trailer[4];
+	const guchar *p, *end, *fname = NULL;
+	gsize size, hlen, fname_len = 0;
+	guint32 isize;
+	guint16 xlen;
+	guint8 flags;
+	struct rspamd_archive_tar st;
+	struct rspamd_archive_file *f;
+
+	size = rspamd_mime_part_reader_size (r);
+	hlen = rspamd_mime_part_reader_read (r, 0, hdr, sizeof (hdr));
+
+	if (size < 18 || hlen < 10 || hdr[0] != 0x1f || hdr[1] != 0x8b ||
+			hdr[2] != 8) {
+		msg_debug_task ("gzip archive is invalid (bad header)");
+
+		return;
+	}
+
+	flags = hdr[3];
+	p = hdr + 10;
+	end = hdr + hlen;
+
+	if (flags & 0x4) {
+		/* FEXTRA */
+		if (end - p < 2) {
+			msg_debug_task ("gzip archive is invalid (bad extra)");
+
+			return;
+		}
+
+		xlen = p[0] + (p[1] << 8);
+		p += 2 + xlen;
+	}
+
+	if ((flags & 0x8) && p < end) {
+		/* FNAME */
+		fname = p;
+
+		while (p < end && *p != '\0') {
+			p ++;
+		}
+
+		fname_len = p - fname;
+	}
+
+	/* Uncompressed size modulo 2^32 is stored in the last 4 bytes */
+	if (rspamd_mime_part_reader_read (r, size - 4, trailer, 4) != 4) {
+		return;
+	}
+
+	isize = (guint)trailer[0] + ((guint)trailer[1] << 8) +
+			((guint)trailer[2] << 16) + ((guint)trailer[3] << 24);
+
+	rspamd_archive_tar_init (task, &st, RSPAMD_ARCHIVE_GZIP);
+
+#ifdef WITH_ZLIB
+	{
+		/* Inflate the stream incrementally looking for a tar archive */
+		const gsize max_inflated = 64 * 1024 * 1024;
+		guchar in[4096], out[16384];
+		gsize offset = 0, inflated = 0, n;
+		z_stream strm;
+		gint rc = Z_OK;
+
+		memset (&strm, 0, sizeof (strm));
+
+		if (inflateInit2 (&strm, 16 + MAX_WBITS) == Z_OK) {
+			while (rc == Z_OK && !st.done && inflated < max_inflated) {
+				if (strm.avail_in == 0) {
+					n = rspamd_mime_part_reader_read (r, offset, in, sizeof (in));
+
+					if (n == 0) {
+						break;
+					}
+
+					offset += n;
+					strm.next_in = in;
+					strm.avail_in = n;
+				}
+
+				strm.next_out = out;
+				strm.avail_out = sizeof (out);
+				rc = inflate (&strm, Z_NO_FLUSH);
+
+				if (rc != Z_OK && rc != Z_STREAM_END) {
+					msg_debug_task ("gzip archive is invalid (inflate error %d)",
+							rc);
+					break;
+				}
+
+				n = sizeof (out) - strm.avail_out;
+				inflated += n;
+				rspamd_archive_tar_feed (task, &st, out, n);
 			}
+
+			inflateEnd (&strm);
+		}
+	}
+#endif
+
+	rspamd_archive_tar_fin (&st);
+
+	if (!st.valid) {
+		/* Not a tarball, so list the single compressed file */
+		f = g_slice_alloc0 (sizeof (*f));
+
+		if (fname) {
+			f->fname = g_string_new_len (fname, fname_len);
 		}
+		else if (part->cd && part->cd->filename.len > 3 &&
+				rspamd_lc_cmp (part->cd->filename.begin +
+						part->cd->filename.len - 3, ".gz", 3) == 0) {
+			f->fname = g_string_new_len (part->cd->filename.begin,
+					part->cd->filename.len - 3);
+		}
+		else {
+			f->fname = g_string_new ("");
+		}
+
+		f->compressed_size = size;
+		f->uncompressed_size = isize;
+		g_ptr_array_add (st.arch->files, f);
+		msg_debug_task ("found file in gzip archive: %v", f->fname);
 	}
+
+	rspamd_archive_attach (part, st.arch, size);
 }
 
+/* 7zip property ids */
+enum rspamd_7zip_id {
+	RSPAMD_7ZIP_END = 0x00,
+	RSPAMD_7ZIP_HEADER = 0x01,
+	RSPAMD_7ZIP_ARCHIVE_PROPERTIES = 0x02,
+	RSPAMD_7ZIP_ADDITIONAL_STREAMS_INFO = 0x03,
+	RSPAMD_7ZIP_MAIN_STREAMS_INFO = 0x04,
+	RSPAMD_7ZIP_FILES_INFO = 0x05,
+	RSPAMD_7ZIP_PACK_INFO = 0x06,
+	RSPAMD_7ZIP_UNPACK_INFO = 0x07,
+	RSPAMD_7ZIP_SUBSTREAMS_INFO = 0x08,
+	RSPAMD_7ZIP_SIZE = 0x09,
+	RSPAMD_7ZIP_CRC = 0x0A,
+	RSPAMD_7ZIP_FOLDER = 0x0B,
+	RSPAMD_7ZIP_CODERS_UNPACK_SIZE = 0x0C,
+	RSPAMD_7ZIP_NUM_UNPACK_STREAM = 0x0D,
+	RSPAMD_7ZIP_EMPTY_STREAM = 0x0E,
+	RSPAMD_7ZIP_NAME = 0x11,
+	RSPAMD_7ZIP_ENCODED_HEADER = 0x17,
+};
+
+struct rspamd_7zip_folder {
+	guint64 nouts;
+	guint64 main_out;
+	guint64 unpack_size;
+	guint64 nstreams;
+	gboolean crc_defined;
+};
+
+struct rspamd_7zip_ctx {
+	GArray *folders; /* struct rspamd_7zip_folder */
+	GArray *sizes; /* guint64 unpacked sizes of all streams */
+	gboolean encrypted;
+};
+
+#define SZ_MAX_ITEMS 65536
+#define SZ_MAX_CODERS 64
+
+#define SZ_READ_NUM(n) do { \
+	p = rspamd_7zip_read_number (p, end, &(n)); \
+	if (p == NULL) { \
+		msg_debug_task ("7zip archive is invalid (bad number)"); \
+		return NULL; \
+	} \
+} while (0)
 
-const gchar *
-rspamd_archive_type_str (enum rspamd_archive_type type)
+#define SZ_READ_BYTE(n) do { \
+	if (p >= end) { \
+		msg_debug_task ("7zip archive is invalid (truncated)"); \
+		return NULL; \
+	} \
+	(n) = *p++; \
+} while (0)
+
+#define SZ_SKIP_BYTES(n) do { \
+	if ((guint64)(end - p) < (guint64)(n)) { \
+		msg_debug_task ("7zip archive is invalid (truncated)"); \
+		return NULL; \
+	} \
+	p += (n); \
+} while (0)
+
+static const guchar *
+rspamd_7zip_read_number (const guchar *p, const guchar *end, guint64 *res)
 {
-	const gchar *ret = "unknown";
+	/*
+	 * The first byte defines how many extra bytes follow: each leading
+	 * one bit means one extra byte, the rest bits are the high part
+	 */
+	guchar first, mask = 0x80;
+	guint64 value = 0;
+	guint i;
 
-	switch (type) {
-	case RSPAMD_ARCHIVE_ZIP:
-		ret = "zip";
-		break;
-	case RSPAMD_ARCHIVE_RAR:
-		ret = "rar";
+	if (p >= end) {
+		return NULL;
+	}
+
+	first = *p++;
+
+	for (i = 0; i < 8; i ++) {
+		if ((first & mask) == 0) {
+			value |= ((guint64)(first & (mask - 1))) << (8 * i);
+			*res = value;
+
+			return p;
+		}
+
+		if (p >= end) {
+			return NULL;
+		}
+
+		value |= ((guint64)*p++) << (8 * i);
+		mask >>= 1;
+	}
+
+	*res = value;
+
+	return p;
+}
+
+/*
+ * Reads bit vector of `n` elements (optionally preceded by `all defined`
+ * byte), fills `bits` if not NULL and returns number of set bits
+ */
+static const guchar *
+rspamd_7zip_read_bits (struct rspamd_task *task, const guchar *p,
+		const guchar *end, guint64 n, gboolean check_all,
+		gboolean *bits, guint64 *nset)
+{
+	guint64 i;
+	guchar all = 0, cur = 0;
+
+	*nset = 0;
+
+	if (check_all) {
+		SZ_READ_BYTE (all);
+	}
+
+	if (all) {
+		for (i = 0; i < n; i ++) {
+			if (bits) {
+				bits[i] = TRUE;
+			}
+		}
+
+		*nset = n;
+
+		return p;
+	}
+
+	for (i = 0; i < n; i ++) {
+		if (i % 8 == 0) {
+			SZ_READ_BYTE (cur);
+		}
+
+		if (cur & (0x80 >> (i % 8))) {
+			(*nset) ++;
+
+			if (bits) {
+				bits[i] = TRUE;
+			}
+		}
+	}
+
+	return p;
+}
+
+static const guchar *
+rspamd_7zip_read_digests (struct rspamd_task *task, const guchar *p,
+		const guchar *end, guint64 n, gboolean *defined)
+{
+	guint64 ndefined;
+
+	p = rspamd_7zip_read_bits (task, p, end, n, TRUE, defined, &ndefined);
+
+	if (p == NULL) {
+		return NULL;
+	}
+
+	/* Crc32 values */
+	SZ_SKIP_BYTES (ndefined * sizeof (guint32));
+
+	return p;
+}
+
+static const guchar *
+rspamd_7zip_read_pack_info (struct rspamd_task *task, const guchar *p,
+		const guchar *end)
+{
+	guint64 pack_pos, npack, i, sz;
+	guchar id;
+
+	SZ_READ_NUM (pack_pos);
+	SZ_READ_NUM (npack);
+
+	if (npack > SZ_MAX_ITEMS) {
+		msg_debug_task ("7zip archive is invalid (too many pack streams)");
+
+		return NULL;
+	}
+
+	for (;;) {
+		SZ_READ_BYTE (id);
+
+		if (id == RSPAMD_7ZIP_END) {
+			break;
+		}
+		else if (id == RSPAMD_7ZIP_SIZE) {
+			for (i = 0; i < npack; i ++) {
+				SZ_READ_NUM (sz);
+			}
+		}
+		else if (id == RSPAMD_7ZIP_CRC) {
+			p = rspamd_7zip_read_digests (task, p, end, npack, NULL);
+
+			if (p == NULL) {
+				return NULL;
+			}
+		}
+		else {
+			msg_debug_task ("7zip archive is invalid (bad pack info)");
+
+			return NULL;
+		}
+	}
+
+	return p;
+}
+
+static const guchar *
+rspamd_7zip_read_folder (struct rspamd_task *task, const guchar *p,
+		const guchar *end, struct rspamd_7zip_ctx *ctx,
+		struct rspamd_7zip_folder *folder)
+{
+	const guchar aes_id[] = {0x06, 0xF1, 0x07, 0x01};
+	guint64 ncoders, nin, nout, total_in = 0, total_out = 0, i, idx, npacked,
+			bound = 0, sz;
+	guchar flags, id_len;
+
+	SZ_READ_NUM (ncoders);
+
+	if (ncoders == 0 || ncoders > SZ_MAX_CODERS) {
+		msg_debug_task ("7zip archive is invalid (bad coders count)");
+
+		return NULL;
+	}
+
+	for (i = 0; i < ncoders; i ++) {
+		SZ_READ_BYTE (flags);
+		id_len = flags & 0xF;
+
+		if ((guint)(end - p) < id_len || (flags & 0x80)) {
+			msg_debug_task ("7zip archive is invalid (bad coder)");
+
+			return NULL;
+		}
+
+		if (id_len == sizeof (aes_id) && memcmp (p, aes_id, id_len) == 0) {
+			ctx->encrypted = TRUE;
+		}
+
+		p += id_len;
+
+		if (flags & 0x10) {
+			SZ_READ_NUM (nin);
+			SZ_READ_NUM (nout);
+		}
+		else {
+			nin = 1;
+			nout = 1;
+		}
+
+		if (flags & 0x20) {
+			/* Coder properties */
+			SZ_READ_NUM (sz);
+			SZ_SKIP_BYTES (sz);
+		}
+
+		total_in += nin;
+		total_out += nout;
+
+		if (total_in > SZ_MAX_CODERS || total_out > SZ_MAX_CODERS) {
+			msg_debug_task ("7zip archive is invalid (too many streams)");
+
+			return NULL;
+		}
+	}
+
+	if (total_out == 0 || total_in < total_out - 1) {
+		msg_debug_task ("7zip archive is invalid (bad streams count)");
+
+		return NULL;
+	}
+
+	/* Bind pairs */
+	for (i = 0; i < total_out - 1; i ++) {
+		SZ_READ_NUM (idx);
+		SZ_READ_NUM (idx);
+
+		if (idx < 64) {
+			bound |= G_GUINT64_CONSTANT (1) << idx;
+		}
+	}
+
+	npacked = total_in - (total_out - 1);
+
+	if (npacked > 1) {
+		for (i = 0; i < npacked; i ++) {
+			SZ_READ_NUM (idx);
+		}
+	}
+
+	/* Output stream that is not bound to anything is the folder's result */
+	folder->nouts = total_out;
+	folder->nstreams = 1;
+
+	for (i = 0; i < total_out; i ++) {
+		if (!(bound & (G_GUINT64_CONSTANT (1) << i))) {
+			folder->main_out = i;
+			break;
+		}
+	}
+
+	return p;
+}
+
+static const guchar *
+rspamd_7zip_read_unpack_info (struct rspamd_task *task, const guchar *p,
+		const guchar *end, struct rspamd_7zip_ctx *ctx)
+{
+	struct rspamd_7zip_folder *folder;
+	guint64 nfolders, i, j, sz;
+	gboolean *defined;
+	guchar id;
+
+	SZ_READ_BYTE (id);
+
+	if (id != RSPAMD_7ZIP_FOLDER) {
+		msg_debug_task ("7zip archive is invalid (no folders)");
+
+		return NULL;
+	}
+
+	SZ_READ_NUM (nfolders);
+	SZ_READ_BYTE (id);
+
+	if (nfolders > SZ_MAX_ITEMS || id != 0) {
+		/* External folders are not supported */
+		msg_debug_task ("7zip archive is invalid (bad folders)");
+
+		return NULL;
+	}
+
+	g_array_set_size (ctx->folders, nfolders);
+
+	for (i = 0; i < nfolders; i ++) {
+		folder = &g_array_index (ctx->folders, struct rspamd_7zip_folder, i);
+		memset (folder, 0, sizeof (*folder));
+		p = rspamd_7zip_read_folder (task, p, end, ctx, folder);
+
+		if (p == NULL) {
+			return NULL;
+		}
+	}
+
+	SZ_READ_BYTE (id);
+
+	if (id != RSPAMD_7ZIP_CODERS_UNPACK_SIZE) {
+		msg_debug_task ("7zip archive is invalid (no unpack sizes)");
+
+		return NULL;
+	}
+
+	for (i = 0; i < nfolders; i ++) {
+		folder = &g_array_index (ctx->folders, struct rspamd_7zip_folder, i);
+
+		for (j = 0; j < folder->nouts; j ++) {
+			SZ_READ_NUM (sz);
+
+			if (j == folder->main_out) {
+				folder->unpack_size = sz;
+			}
+		}
+	}
+
+	for (;;) {
+		SZ_READ_BYTE (id);
+
+		if (id == RSPAMD_7ZIP_END) {
+			break;
+		}
+		else if (id == RSPAMD_7ZIP_CRC) {
+			defined = g_malloc0 (sizeof (*defined) * (nfolders + 1));
+			p = rspamd_7zip_read_digests (task, p, end, nfolders, defined);
+
+			if (p != NULL) {
+				for (i = 0; i < nfolders; i ++) {
+					folder = &g_array_index (ctx->folders,
+							struct rspamd_7zip_folder, i);
+					folder->crc_defined = defined[i];
+				}
+			}
+
+			g_free (defined);
+
+			if (p == NULL) {
+				return NULL;
+			}
+		}
+		else {
+			msg_debug_task ("7zip archive is invalid (bad unpack info)");
+
+			return NULL;
+		}
+	}
+
+	return p;
+}
+
+static void
+rspamd_7zip_fill_sizes (struct rspamd_7zip_ctx *ctx)
+{
+	struct rspamd_7zip_folder *folder;
+	guint i;
+
+	/* Each folder has a single stream */
+	for (i = 0; i < ctx->folders->len; i ++) {
+		folder = &g_array_index (ctx->folders, struct rspamd_7zip_folder, i);
+
+		if (folder->nstreams > 0) {
+			g_array_append_val (ctx->sizes, folder->unpack_size);
+		}
+	}
+}
+
+static const guchar *
+rspamd_7zip_read_substreams_info (struct rspamd_task *task, const guchar *p,
+		const guchar *end, struct rspamd_7zip_ctx *ctx)
+{
+	struct rspamd_7zip_folder *folder;
+	guint64 i, j, sz, sum, total = 0, ndigests;
+	gboolean sizes_read = FALSE;
+	guchar id;
+
+	for (;;) {
+		SZ_READ_BYTE (id);
+
+		if (id == RSPAMD_7ZIP_END) {
+			break;
+		}
+		else if (id == RSPAMD_7ZIP_NUM_UNPACK_STREAM) {
+			for (i = 0; i < ctx->folders->len; i ++) {
+				folder = &g_array_index (ctx->folders,
+						struct rspamd_7zip_folder, i);
+				SZ_READ_NUM (folder->nstreams);
+				total += folder->nstreams;
+
+				if (total > SZ_MAX_ITEMS) {
+					msg_debug_task ("7zip archive is invalid (too many streams)");
+
+					return NULL;
+				}
+			}
+		}
+		else if (id == RSPAMD_7ZIP_SIZE) {
+			for (i = 0; i < ctx->folders->len; i ++) {
+				folder = &g_array_index (ctx->folders,
+						struct rspamd_7zip_folder, i);
+
+				if (folder->nstreams == 0) {
+					continue;
+				}
+
+				sum = 0;
+
+				for (j = 0; j < folder->nstreams - 1; j ++) {
+					SZ_READ_NUM (sz);
+					g_array_append_val (ctx->sizes, sz);
+					sum += sz;
+				}
+
+				/* The last stream takes the rest of the folder */
+				sz = folder->unpack_size > sum ? folder->unpack_size - sum : 0;
+				g_array_append_val (ctx->sizes, sz);
+			}
+
+			sizes_read = TRUE;
+		}
+		else if (id == RSPAMD_7ZIP_CRC) {
+			ndigests = 0;
+
+			for (i = 0; i < ctx->folders->len; i ++) {
+				folder = &g_array_index (ctx->folders,
+						struct rspamd_7zip_folder, i);
+
+				if (!(folder->nstreams == 1 && folder->crc_defined)) {
+					ndigests += folder->nstreams;
+				}
+			}
+
+			p = rspamd_7zip_read_digests (task, p, end, ndigests, NULL);
+
+			if (p == NULL) {
+				return NULL;
+			}
+		}
+		else {
+			msg_debug_task ("7zip archive is invalid (bad substreams info)");
+
+			return NULL;
+		}
+	}
+
+	if (!sizes_read) {
+		rspamd_7zip_fill_sizes (ctx);
+	}
+
+	return p;
+}
+
+static const guchar *
+rspamd_7zip_read_streams_info (struct rspamd_task *task, const guchar *p,
+		const guchar *end, struct rspamd_7zip_ctx *ctx)
+{
+	gboolean have_substreams = FALSE;
+	guchar id;
+
+	g_array_set_size (ctx->folders, 0);
+	g_array_set_size (ctx->sizes, 0);
+
+	for (;;) {
+		SZ_READ_BYTE (id);
+
+		if (id == RSPAMD_7ZIP_END) {
+			break;
+		}
+		else if (id == RSPAMD_7ZIP_PACK_INFO) {
+			p = rspamd_7zip_read_pack_info (task, p, end);
+		}
+		else if (id == RSPAMD_7ZIP_UNPACK_INFO) {
+			p = rspamd_7zip_read_unpack_info (task, p, end, ctx);
+		}
+		else if (id == RSPAMD_7ZIP_SUBSTREAMS_INFO) {
+			p = rspamd_7zip_read_substreams_info (task, p, end, ctx);
+			have_substreams = TRUE;
+		}
+		else {
+			msg_debug_task ("7zip archive is invalid (bad streams info)");
+
+			return NULL;
+		}
+
+		if (p == NULL) {
+			return NULL;
+		}
+	}
+
+	if (!have_substreams) {
+		rspamd_7zip_fill_sizes (ctx);
+	}
+
+	return p;
+}
+
+static GString *
+rspamd_7zip_utf16_name (const guchar *p, gsize nchars)
+{
+	gunichar2 *ucs;
+	gchar *utf;
+	GString *res;
+	gsize i;
+
+	ucs = g_malloc (sizeof (*ucs) * (nchars + 1));
+
+	for (i = 0; i < nchars; i ++) {
+		ucs[i] = p[i * 2] + (p[i * 2 + 1] << 8);
+	}
+
+	utf = g_utf16_to_utf8 (ucs, nchars, NULL, NULL, NULL);
+	g_free (ucs);
+
+	if (utf == NULL) {
+		return g_string_new ("");
+	}
+
+	res = g_string_new (utf);
+	g_free (utf);
+
+	return res;
+}
+
+static const guchar *
+rspamd_7zip_read_files_info (struct rspamd_task *task, const guchar *p,
+		const guchar *end, struct rspamd_7zip_ctx *ctx,
+		struct rspamd_archive *arch)
+{
+	const guint max_files = 1024;
+	const guchar *prop, *names = NULL, *names_end = NULL, *q;
+	guint64 nfiles, type, sz, nset, i, stream = 0;
+	gboolean *empty;
+	struct rspamd_archive_file *f;
+
+	SZ_READ_NUM (nfiles);
+
+	if (nfiles > SZ_MAX_ITEMS) {
+		msg_debug_task ("7zip archive is invalid (too many files)");
+
+		return NULL;
+	}
+
+	empty = g_malloc0 (sizeof (*empty) * (nfiles + 1));
+
+	for (;;) {
+		p = rspamd_7zip_read_number (p, end, &type);
+
+		if (p == NULL || type == RSPAMD_7ZIP_END) {
+			break;
+		}
+
+		p = rspamd_7zip_read_number (p, end, &sz);
+
+		if (p == NULL || (guint64)(end - p) < sz) {
+			p = NULL;
+			break;
+		}
+
+		prop = p;
+		p += sz;
+
+		if (type == RSPAMD_7ZIP_EMPTY_STREAM) {
+			if (rspamd_7zip_read_bits (task, prop, p, nfiles, FALSE,
+					empty, &nset) == NULL) {
+				p = NULL;
+				break;
+			}
+		}
+		else if (type == RSPAMD_7ZIP_NAME && sz > 0 && prop[0] == 0) {
+			/* Not external names */
+			names = prop + 1;
+			names_end = p;
+		}
+	}
+
+	if (p == NULL) {
+		msg_debug_task ("7zip archive is invalid (bad files info)");
+		g_free (empty);
+
+		return NULL;
+	}
+
+	for (i = 0; i < nfiles && i < max_files; i ++) {
+		f = g_slice_alloc0 (sizeof (*f));
+
+		if (names && names_end - names >= 2) {
+			/* Names are NUL terminated UTF16-LE strings */
+			for (q = names; names_end - q >= 2 && (q[0] || q[1]); q += 2);
+
+			f->fname = rspamd_7zip_utf16_name (names, (q - names) / 2);
+			names = names_end - q >= 2 ? q + 2 : names_end;
+		}
+		else {
+			f->fname = g_string_new ("");
+		}
+
+		if (!empty[i] && stream < ctx->sizes->len) {
+			f->uncompressed_size = g_array_index (ctx->sizes, guint64, stream);
+			stream ++;
+		}
+
+		if (ctx->encrypted) {
+			f->flags |= RSPAMD_ARCHIVE_FILE_ENCRYPTED;
+		}
+
+		g_ptr_array_add (arch->files, f);
+		msg_debug_task ("found file in 7zip archive: %v", f->fname);
+	}
+
+	g_free (empty);
+
+	return p;
+}
+
+static const guchar *
+rspamd_7zip_read_header (struct rspamd_task *task, const guchar *p,
+		const guchar *end, struct rspamd_7zip_ctx *ctx,
+		struct rspamd_archive *arch)
+{
+	guint64 type, sz;
+	guchar id;
+
+	for (;;) {
+		SZ_READ_BYTE (id);
+
+		switch (id) {
+		case RSPAMD_7ZIP_END:
+			return p;
+		case RSPAMD_7ZIP_ARCHIVE_PROPERTIES:
+			for (;;) {
+				SZ_READ_NUM (type);
+
+				if (type == RSPAMD_7ZIP_END) {
+					break;
+				}
+
+				SZ_READ_NUM (sz);
+				SZ_SKIP_BYTES (sz);
+			}
+			break;
+		case RSPAMD_7ZIP_ADDITIONAL_STREAMS_INFO:
+		case RSPAMD_7ZIP_MAIN_STREAMS_INFO:
+			p = rspamd_7zip_read_streams_info (task, p, end, ctx);
+			break;
+		case RSPAMD_7ZIP_FILES_INFO:
+			p = rspamd_7zip_read_files_info (task, p, end, ctx, arch);
+			break;
+		default:
+			msg_debug_task ("7zip archive is invalid (bad header)");
+
+			return NULL;
+		}
+
+		if (p == NULL) {
+			return NULL;
+		}
+	}
+}
+
+static void
+rspamd_archive_process_7zip (struct rspamd_task *task,
+		struct rspamd_mime_part *part, struct rspamd_mime_part_reader *r)
+{
+	const guchar sz_magic[] = {0x37, 0x7A, 0xBC, 0xAF, 0x27, 0x1C};
+	const guint64 max_header = 4 * 1024 * 1024;
+	guchar start[32], *hdr;
+	const guchar *p, *end;
+	guint64 next_off, next_size;
+	gsize size;
+	struct rspamd_7zip_ctx ctx;
+	struct rspamd_archive *arch;
+
+	size = rspamd_mime_part_reader_size (r);
+
+	if (rspamd_mime_part_reader_read (r, 0, start, sizeof (start)) !=
+			sizeof (start) || memcmp (start, sz_magic, sizeof (sz_magic)) != 0) {
+		msg_debug_task ("7zip archive is invalid (no 7zip magic)");
+
+		return;
+	}
+
+	memcpy (&next_off, start + 12, sizeof (next_off));
+	next_off = GUINT64_FROM_LE (next_off);
+	memcpy (&next_size, start + 20, sizeof (next_size));
+	next_size = GUINT64_FROM_LE (next_size);
+
+	if (next_size == 0 || next_size > max_header ||
+			next_off > size || size - next_off < sizeof (start) + next_size) {
+		msg_debug_task ("7zip archive is invalid (bad next header)");
+
+		return;
+	}
+
+	/* Only the header at the end of archive is decoded */
+	hdr = g_malloc (next_size);
+
+	if (rspamd_mime_part_reader_read (r, sizeof (start) + next_off, hdr,
+			next_size) != next_size) {
+		msg_debug_task ("7zip archive is invalid (truncated header)");
+		g_free (hdr);
+
+		return;
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.folders = g_array_new (FALSE, TRUE, sizeof (struct rspamd_7zip_folder));
+	ctx.sizes = g_array_new (FALSE, FALSE, sizeof (guint64));
+	arch = rspamd_archive_new (task, RSPAMD_ARCHIVE_7ZIP);
+	p = hdr;
+	end = hdr + next_size;
+
+	if (*p == RSPAMD_7ZIP_HEADER) {
+		p = rspamd_7zip_read_header (task, p + 1, end, &ctx, arch);
+	}
+	else if (*p == RSPAMD_7ZIP_ENCODED_HEADER) {
+		/*
+		 * Packed header describes just how the real header is compressed,
+		 * we cannot list files without unpacking it but we can still
+		 * detect header encryption
+		 */
+		p = rspamd_7zip_read_streams_info (task, p + 1, end, &ctx);
+	}
+	else {
+		msg_debug_task ("7zip archive is invalid (bad header type)");
+		p = NULL;
+	}
+
+	if (p != NULL) {
+		if (ctx.encrypted) {
+			arch->flags |= RSPAMD_ARCHIVE_ENCRYPTED;
+		}
+
+		rspamd_archive_attach (part, arch, size);
+	}
+
+	g_array_free (ctx.folders, TRUE);
+	g_array_free (ctx.sizes, TRUE);
+	g_free (hdr);
+}
+
+#undef SZ_READ_NUM
+#undef SZ_READ_BYTE
+#undef SZ_SKIP_BYTES
+
+static gboolean
+rspamd_archive_cheat_detect (struct rspamd_mime_part *part, const gchar *str,
+		const guchar *magic_start, gsize magic_len)
+{
+	struct rspamd_content_type *ct;
+	const gchar *p;
+	rspamd_ftok_t srch, *fname;
+	guchar magic_buf[RSPAMD_MIME_PEEK_MAX];
+
+	ct = part->ct;
+	RSPAMD_FTOK_ASSIGN (&srch, "application");
+
+	if (ct && ct->type.len && ct->subtype.len > 0 && rspamd_ftok_cmp (&ct->type,
+			&srch) == 0) {
+		if (rspamd_substring_search_caseless (ct->subtype.begin, ct->subtype.len,
+				str, strlen (str)) != -1) {
+			return TRUE;
+		}
+	}
+
+	if (part->cd) {
+		fname = &part->cd->filename;
+
+		if (fname && fname->len > strlen (str)) {
+			p = fname->begin + fname->len - strlen (str);
+
+			if (rspamd_lc_cmp (p, str, strlen (str)) == 0) {
+				if (*(p - 1) == '.') {
+					return TRUE;
+				}
+			}
+		}
+
+		if (magic_start != NULL && magic_len < sizeof (magic_buf)) {
+			/* Avoid decoding of the whole part just to check its magic */
+			if (rspamd_mime_part_peek (part, magic_buf, magic_len + 1) > magic_len &&
+					memcmp (magic_buf, magic_start, magic_len) == 0) {
+				return TRUE;
+			}
+		}
+	}
+
+	return FALSE;
+}
+
+void
+rspamd_archives_process (struct rspamd_task *task)
+{
+	guint i;
+	struct rspamd_mime_part *part;
+	const guchar rar_magic[] = {0x52, 0x61, 0x72, 0x21, 0x1A, 0x07};
+	const guchar zip_magic[] = {0x50, 0x4b, 0x03, 0x04};
+	const guchar sz_magic[] = {0x37, 0x7A, 0xBC, 0xAF, 0x27, 0x1C};
+	const guchar gz_magic[] = {0x1F, 0x8B};
+	struct rspamd_mime_part_reader *r;
+
+	for (i = 0; i < task->parts->len; i ++) {
+		part = g_ptr_array_index (task->parts, i);
+
+		if (part->raw_data.len > 0) {
+			if (rspamd_archive_cheat_detect (part, "zip",
+					zip_magic, sizeof (zip_magic))) {
+				r = rspamd_mime_part_reader_new (part);
+
+				if (rspamd_mime_part_reader_size (r) > 0) {
+					rspamd_archive_process_zip (task, part, r);
+				}
+			}
+			else if (rspamd_archive_cheat_detect (part, "rar",
+					rar_magic, sizeof (rar_magic))) {
+				rspamd_mime_part_decode (part);
+
+				if (part->parsed_data.len > 0) {
+					rspamd_archive_process_rar (task, part);
+				}
+			}
+			else if (rspamd_archive_cheat_detect (part, "7z",
+					sz_magic, sizeof (sz_magic))) {
+				r = rspamd_mime_part_reader_new (part);
+				rspamd_archive_process_7zip (task, part, r);
+			}
+			else if (rspamd_archive_cheat_detect (part, "gz",
+					gz_magic, sizeof (gz_magic))) {
+				r = rspamd_mime_part_reader_new (part);
+				rspamd_archive_process_gzip (task, part, r);
+			}
+			else if (rspamd_archive_cheat_detect (part, "tar", NULL, 0)) {
+				r = rspamd_mime_part_reader_new (part);
+				rspamd_archive_process_tar (task, part, r);
+			}
+		}
+	}
+}
+
+
+const gchar *
+rspamd_archive_type_str (enum rspamd_archive_type type)
+{
+	const gchar *ret = "unknown";
+
+	switch (type) {
+	case RSPAMD_ARCHIVE_ZIP:
+		ret = "zip";
+		break;
+	case RSPAMD_ARCHIVE_RAR:
+		ret = "rar";
+		break;
+	case RSPAMD_ARCHIVE_7ZIP:
+		ret = "7z";
+		break;
+	case RSPAMD_ARCHIVE_GZIP:
+		ret = "gz";
+		break;
+	case RSPAMD_ARCHIVE_TAR:
+		ret = "tar";
 		break;
 	}
 
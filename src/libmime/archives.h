@@ -21,6 +21,9 @@
 enum rspamd_archive_type {
 	RSPAMD_ARCHIVE_ZIP,
 	RSPAMD_ARCHIVE_RAR,
+	RSPAMD_ARCHIVE_7ZIP,
+	RSPAMD_ARCHIVE_GZIP,
+	RSPAMD_ARCHIVE_TAR,
 };
 
 enum rspamd_archive_flags {
@@ -19,6 +19,9 @@
 #include "message.h"
 #include "printf.h"
 #include "smtp_parsers.h"
+#include "cryptobox.h"
+
+#define EMAIL_ADDR_CACHE_VAR "email_addr_cache"
 
 static void
 rspamd_email_addr_dtor (struct rspamd_email_address *addr)
@@ -222,6 +225,15 @@ rspamd_email_address_from_mime (rspamd_mempool_t *pool,
 	while (p < end) {
 		switch (state) {
 		case parse_name:
+			/* Fast forward to the next character that matters */
+			while (p < end && *p != '"' && *p != '<' && *p != ',' && *p != '@') {
+				p ++;
+			}
+
+			if (p == end) {
+				break;
+			}
+
 			if (*p == '"') {
 				/* We need to strip last spaces and update `ns` */
 				if (p > c) {
@@ -294,6 +306,15 @@ rspamd_email_address_from_mime (rspamd_mempool_t *pool,
 			p ++;
 			break;
 		case parse_quoted:
+			t = memchr (p, '"', end - p);
+
+			if (t == NULL) {
+				p = end;
+				break;
+			}
+
+			p = t;
+
 			if (*p == '"') {
 				if (p > c) {
 					g_string_append_len (ns, c, p - c);
@@ -305,6 +326,15 @@ rspamd_email_address_from_mime (rspamd_mempool_t *pool,
 			p ++;
 			break;
 		case parse_addr:
+			t = memchr (p, '>', end - p);
+
+			if (t == NULL) {
+				p = end;
+				break;
+			}
+
+			p = t;
+
 			if (*p == '>') {
 				rspamd_smtp_addr_parse (c, p - c + 1, &addr);
 
@@ -406,6 +436,59 @@ rspamd_email_address_from_mime (rspamd_mempool_t *pool,
 	return res;
 }
 
+static guint
+rspamd_email_addr_cache_hash (gconstpointer key)
+{
+	const rspamd_ftok_t *tok = key;
+
+	return rspamd_cryptobox_fast_hash (tok->begin, tok->len,
+			rspamd_hash_seed ());
+}
+
+static gboolean
+rspamd_email_addr_cache_equal (gconstpointer v1, gconstpointer v2)
+{
+	const rspamd_ftok_t *t1 = v1, *t2 = v2;
+
+	return t1->len == t2->len && memcmp (t1->begin, t2->begin, t1->len) == 0;
+}
+
+GPtrArray *
+rspamd_email_address_from_mime_cached (rspamd_mempool_t *pool,
+		const gchar *hdr, guint len)
+{
+	GHashTable *cache;
+	GPtrArray *res;
+	rspamd_ftok_t srch, *key;
+	gchar *copy;
+
+	cache = rspamd_mempool_get_variable (pool, EMAIL_ADDR_CACHE_VAR);
+
+	if (cache == NULL) {
+		cache = g_hash_table_new (rspamd_email_addr_cache_hash,
+				rspamd_email_addr_cache_equal);
+		rspamd_mempool_set_variable (pool, EMAIL_ADDR_CACHE_VAR, cache,
+				(rspamd_mempool_destruct_t)g_hash_table_unref);
+	}
+
+	srch.begin = hdr;
+	srch.len = len;
+	res = g_hash_table_lookup (cache, &srch);
+
+	if (res == NULL) {
+		res = rspamd_email_address_from_mime (pool, hdr, len, NULL);
+		copy = rspamd_mempool_alloc (pool, len + 1);
+		memcpy (copy, hdr, len);
+		copy[len] = '\0';
+		key = rspamd_mempool_alloc (pool, sizeof (*key));
+		key->begin = copy;
+		key->len = len;
+		g_hash_table_insert (cache, key, res);
+	}
+
+	return res;
+}
+
 void
 rspamd_email_address_list_destroy (gpointer ptr)
 {
@@ -77,6 +77,19 @@ GPtrArray *rspamd_email_address_from_mime (rspamd_mempool_t *pool,
 		guint len,
 		GPtrArray *src);
 
+/**
+ * The same as rspamd_email_address_from_mime with `src` equal to NULL, but
+ * the same header parsed with the same pool returns the same array, so it
+ * must not be modified by callers
+ * @param pool
+ * @param hdr
+ * @param len
+ * @return
+ */
+GPtrArray *rspamd_email_address_from_mime_cached (rspamd_mempool_t *pool,
+		const gchar *hdr,
+		guint len);
+
 /**
  * Destroys list of email addresses
  * @param ptr
@@ -32,7 +32,7 @@ rspamd_create_metric_result (struct rspamd_task *task, const gchar *name)
 	struct rspamd_metric *metric;
 	guint i;
 
-	metric_res = g_hash_table_lookup (task->results, name);
+	metric_res = rspamd_mempool_hash_lookup (task->results, name);
 
 	if (metric_res != NULL) {
 		return metric_res;
@@ -51,6 +51,12 @@ rspamd_create_metric_result (struct rspamd_task *task, const gchar *name)
 	rspamd_mempool_add_destructor (task->task_pool,
 			(rspamd_mempool_destruct_t) g_hash_table_unref,
 			metric_res->symbols);
+	/* Dense view of results for lookups by id */
+	metric_res->nsymbols_by_id = task->cfg->cache ?
+			rspamd_symbols_cache_symbols_count (task->cfg->cache) : 0;
+	metric_res->symbols_by_id = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (*metric_res->symbols_by_id) *
+			MAX (metric_res->nsymbols_by_id, 1));
 	metric_res->sym_groups = g_hash_table_new (g_direct_hash, g_direct_equal);
 	rspamd_mempool_add_destructor (task->task_pool,
 			(rspamd_mempool_destruct_t) g_hash_table_unref,
@@ -64,7 +70,7 @@ rspamd_create_metric_result (struct rspamd_task *task, const gchar *name)
 	}
 
 	metric_res->action = METRIC_ACTION_MAX;
-	g_hash_table_insert (task->results, (gpointer) metric->name,
+	rspamd_mempool_hash_insert (task->results, (gpointer) metric->name,
 			metric_res);
 
 	return metric_res;
@@ -96,6 +102,7 @@ static struct rspamd_symbol_result *
 insert_metric_result (struct rspamd_task *task,
 	struct rspamd_metric *metric,
 	const gchar *symbol,
+	gint id,
 	double flag,
 	const gchar *opt,
 	gboolean single)
@@ -142,7 +149,14 @@ insert_metric_result (struct rspamd_task *task,
 	}
 
 	/* Add metric score */
-	if ((s = g_hash_table_lookup (metric_res->symbols, symbol)) != NULL) {
+	if (id >= 0) {
+		s = rspamd_metric_result_find_symbol_id (metric_res, id);
+	}
+	else {
+		s = g_hash_table_lookup (metric_res->symbols, symbol);
+	}
+
+	if (s != NULL) {
 		if (single) {
 			max_shots = 1;
 		}
@@ -226,6 +240,7 @@ insert_metric_result (struct rspamd_task *task,
 		s->name = symbol;
 		s->sym = sdef;
 		s->nshots = 1;
+		s->id = id;
 
 		w = rspamd_check_group_score (task, symbol, gr, gr_score, w);
 
@@ -245,6 +260,10 @@ insert_metric_result (struct rspamd_task *task,
 
 		rspamd_task_add_result_option (task, s, opt);
 		g_hash_table_insert (metric_res->symbols, (gpointer) symbol, s);
+
+		if (id >= 0 && (guint)id < metric_res->nsymbols_by_id) {
+			metric_res->symbols_by_id[id] = s;
+		}
 	}
 
 	msg_debug_task ("symbol %s, score %.2f, metric %s, factor: %f",
@@ -266,6 +285,11 @@ insert_result_common (struct rspamd_task *task,
 	struct rspamd_metric *metric;
 	GList *cur, *metric_list;
 	struct rspamd_symbol_result *s = NULL;
+	gint id = -1;
+
+	if (task->cfg->cache) {
+		id = rspamd_symbols_cache_find_symbol (task->cfg->cache, symbol);
+	}
 
 	metric_list = g_hash_table_lookup (task->cfg->metrics_symbols, symbol);
 	if (metric_list) {
@@ -273,7 +297,8 @@ insert_result_common (struct rspamd_task *task,
 
 		while (cur) {
 			metric = cur->data;
-			s = insert_metric_result (task, metric, symbol, flag, opt, single);
+			s = insert_metric_result (task, metric, symbol, id, flag, opt,
+					single);
 			cur = g_list_next (cur);
 		}
 	}
@@ -282,14 +307,15 @@ insert_result_common (struct rspamd_task *task,
 		s = insert_metric_result (task,
 			task->cfg->default_metric,
 			symbol,
+			id,
 			flag,
 			opt,
 			single);
 	}
 
 	/* Process cache item */
-	if (task->cfg->cache) {
-		rspamd_symbols_cache_inc_frequency (task->cfg->cache, symbol);
+	if (task->cfg->cache && id >= 0) {
+		rspamd_symbols_cache_inc_frequency_id (task->cfg->cache, id);
 	}
 
 	return s;
@@ -316,6 +342,29 @@ rspamd_task_insert_result_single (struct rspamd_task *task,
 	return insert_result_common (task, symbol, flag, opt, TRUE);
 }
 
+struct rspamd_symbol_result *
+rspamd_metric_result_find_symbol_id (struct rspamd_metric_result *mres,
+		gint id)
+{
+	if (id < 0 || (guint)id >= mres->nsymbols_by_id) {
+		return NULL;
+	}
+
+	return mres->symbols_by_id[id];
+}
+
+void
+rspamd_metric_result_remove_symbol (struct rspamd_metric_result *mres,
+		struct rspamd_symbol_result *s)
+{
+	if (s->id >= 0 && (guint)s->id < mres->nsymbols_by_id &&
+			mres->symbols_by_id[s->id] == s) {
+		mres->symbols_by_id[s->id] = NULL;
+	}
+
+	g_hash_table_remove (mres->symbols, s->name);
+}
+
 gboolean
 rspamd_task_add_result_option (struct rspamd_task *task,
 		struct rspamd_symbol_result *s, const gchar *val)
@@ -29,6 +29,7 @@ struct rspamd_symbol_result {
 	const gchar *name;
 	struct rspamd_symbol *sym;						/**< symbol configuration					*/
 	guint nshots;
+	gint id;										/**< symbols cache id or -1					*/
 };
 
 /**
@@ -39,6 +40,8 @@ struct rspamd_metric_result {
 	double score;                                   /**< total score							*/
 	double grow_factor;								/**< current grow factor					*/
 	GHashTable *symbols;                            /**< symbols of metric						*/
+	struct rspamd_symbol_result **symbols_by_id;	/**< symbols indexed by symbols cache id	*/
+	guint nsymbols_by_id;
 	GHashTable *sym_groups;							/**< groups of symbols						*/
 	gdouble actions_limits[METRIC_ACTION_MAX];		/**< set of actions for this metric			*/
 	enum rspamd_metric_action action;               /**< the current action						*/
@@ -80,6 +83,19 @@ struct rspamd_symbol_result* rspamd_task_insert_result_single (struct rspamd_tas
 	const gchar *opts);
 
 
+/**
+ * Find result of a symbol by its symbols cache id
+ * @return symbol result or NULL if the symbol has not been inserted
+ */
+struct rspamd_symbol_result* rspamd_metric_result_find_symbol_id (
+		struct rspamd_metric_result *mres, gint id);
+
+/**
+ * Remove symbol from metric result, its score is not changed
+ */
+void rspamd_metric_result_remove_symbol (struct rspamd_metric_result *mres,
+		struct rspamd_symbol_result *s);
+
 /**
  * Adds new option to symbol
  * @param task
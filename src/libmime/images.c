@@ -22,9 +22,12 @@
 #ifdef USABLE_GD
 #include "gd.h"
 #include "hash.h"
+#include "shared_cache.h"
 #include <math.h>
 
 #define RSPAMD_NORMALIZED_DIM 64
+/* DCT data is kept in the shared cache during a day */
+#define RSPAMD_IMAGE_SHARED_TTL 86400
 
 static rspamd_lru_hash_t *images_hash = NULL;
 #endif
@@ -379,6 +382,9 @@ rspamd_image_create_cache (struct rspamd_config *cfg)
 			rspamd_image_dct_hash, rspamd_image_dct_equal);
 }
 
+static void rspamd_image_save_local (struct rspamd_task *task,
+		struct rspamd_image *img);
+
 static gboolean
 rspamd_image_check_hash (struct rspamd_task *task, struct rspamd_image *img)
 {
@@ -403,24 +409,58 @@ rspamd_image_check_hash (struct rspamd_task *task, struct rspamd_image *img)
 		return TRUE;
 	}
 
+	if (task->cfg->images_shared_cache) {
+		guchar dct[RSPAMD_DCT_LEN / NBBY];
+		gsize dctlen;
+
+		if (rspamd_shared_cache_lookup (task->cfg->images_shared_cache,
+				(const gchar *)img->parent->digest, sizeof (img->parent->digest),
+				(gchar *)dct, &dctlen, task->tv.tv_sec) &&
+				dctlen == sizeof (dct)) {
+			/* Normalized by another worker */
+			img->dct = g_malloc (RSPAMD_DCT_LEN / NBBY);
+			rspamd_mempool_add_destructor (task->task_pool, g_free,
+					img->dct);
+			memcpy (img->dct, dct, RSPAMD_DCT_LEN / NBBY);
+			img->is_normalized = TRUE;
+			rspamd_image_save_local (task, img);
+
+			return TRUE;
+		}
+	}
+
 	return FALSE;
 }
 
 static void
-rspamd_image_save_hash (struct rspamd_task *task, struct rspamd_image *img)
+rspamd_image_save_local (struct rspamd_task *task, struct rspamd_image *img)
 {
 	struct rspamd_image_cache_entry *found;
 
-	if (img->is_normalized) {
-		found = rspamd_lru_hash_lookup (images_hash, img->parent->digest,
-				task->tv.tv_sec);
+	found = rspamd_lru_hash_lookup (images_hash, img->parent->digest,
+			task->tv.tv_sec);
+
+	if (!found) {
+		found = g_slice_alloc0 (sizeof (*found));
+		memcpy (found->dct, img->dct, RSPAMD_DCT_LEN / NBBY);
+		memcpy (found->digest, img->parent->digest, sizeof (found->digest));
+
+		rspamd_lru_hash_insert (images_hash, found->digest, found,
+				task->tv.tv_sec, 0);
+	}
+}
 
-		if (!found) {
-			found = g_slice_alloc0 (sizeof (*found));
-			memcpy (found->dct, img->dct, RSPAMD_DCT_LEN / NBBY);
-			memcpy (found->digest, img->parent->digest, sizeof (found->digest));
+static void
+rspamd_image_save_hash (struct rspamd_task *task, struct rspamd_image *img)
+{
+	if (img->is_normalized) {
+		rspamd_image_save_local (task, img);
 
-			rspamd_lru_hash_insert (images_hash, found->digest, found,
+		if (task->cfg->images_shared_cache) {
+			rspamd_shared_cache_insert (task->cfg->images_shared_cache,
+					(const gchar *)img->parent->digest,
+					sizeof (img->parent->digest),
+					(const gchar *)img->dct, RSPAMD_DCT_LEN / NBBY,
 					task->tv.tv_sec, 0);
 		}
 	}
@@ -428,6 +468,17 @@ rspamd_image_save_hash (struct rspamd_task *task, struct rspamd_image *img)
 
 #endif
 
+struct rspamd_shared_cache *
+rspamd_image_shared_cache_new (rspamd_mempool_t *pool, guint max_items)
+{
+#ifdef USABLE_GD
+	return rspamd_shared_cache_new (pool, max_items, RSPAMD_DCT_LEN / NBBY,
+			RSPAMD_IMAGE_SHARED_TTL);
+#else
+	return NULL;
+#endif
+}
+
 void
 rspamd_image_normalize (struct rspamd_task *task, struct rspamd_image *img)
 {
@@ -608,7 +659,7 @@ process_image (struct rspamd_task *task, struct rspamd_mime_part *part)
 
 		if (ar != NULL && ar->len > 0) {
 			rh = g_ptr_array_index (ar, 0);
-			cid = rh->decoded;
+			cid = rspamd_mime_header_get_decoded (rh);
 
 			if (*cid == '<') {
 				cid ++;
@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include "fstring.h"
+#include "mem_pool.h"
 
 struct html_image;
 struct rspamd_task;
@@ -42,4 +43,16 @@ const gchar * rspamd_image_type_str (enum rspamd_image_type type);
 
 void rspamd_image_normalize (struct rspamd_task *task, struct rspamd_image *img);
 
+struct rspamd_shared_cache;
+
+/**
+ * Create cache of DCT data in shared memory, it must be created before
+ * forking so all workers normalize the same image once
+ * @param pool pool to allocate shared memory from
+ * @param max_items number of images to keep
+ * @return cache or NULL if images normalization is not supported
+ */
+struct rspamd_shared_cache *rspamd_image_shared_cache_new (
+		rspamd_mempool_t *pool, guint max_items);
+
 #endif /* IMAGES_H_ */
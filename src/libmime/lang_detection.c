@@ -0,0 +1,236 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "lang_detection.h"
+
+/* Minimum number of known trigrams to trust the result */
+#define RSPAMD_LANG_MIN_HITS 16
+
+/*
+ * The most frequent trigrams of each language ordered by frequency,
+ * space stands for a word boundary
+ */
+static const struct rspamd_lang_model {
+	const gchar *code;
+	const gchar *name;
+	const gchar *trigrams[40];
+} lang_models[] = {
+	{"en", "english", {
+		" th", "the", "he ", " an", "and", "nd ", "ing", "ng ", " to", "to ",
+		" of", "of ", "ion", "ed ", " in", "er ", "tio", "is ", " is", "ent",
+		"for", " fo", "at ", "re ", "es ", " yo", "you", "ou ", "hat", "tha",
+		" wi", "wit", "ith", "our", "his", "all", "ly ", " be", "are", "ve ",
+	}},
+	{"de", "german", {
+		"en ", "er ", " de", "der", "ie ", "ich", "ein", "sch", "die", " di",
+		"ch ", "und", " un", "nd ", "den", "cht", " ei", "ine", "in ", "gen",
+		"te ", "ten", " zu", "ung", "ist", "das", " da", "eit", "sie", " si",
+		"auf", "mit", " mi", "nic", "ber", "für", "ür ", " ge", "ne ", "hen",
+	}},
+	{"fr", "french", {
+		" de", "de ", "es ", "le ", " le", "ent", " la", "la ", "les", " et",
+		"et ", "ion", "tio", "re ", "que", "ue ", " qu", " pa", "par", " co",
+		"ons", "ous", "vou", " vo", "nt ", "our", " po", "pou", "des", "est",
+		" un", "une", "men", "ée ", "té ", " d'", "ait", "eur", "ès ", " à ",
+	}},
+	{"es", "spanish", {
+		" de", "de ", "os ", " la", "la ", "el ", " el", "es ", "en ", " en",
+		"que", " qu", "ue ", "as ", "ión", "ón ", "ado", "ent", " co", "con",
+		"ien", " lo", "los", " pa", "par", "ara", "por", " po", "nte", "do ",
+		"ció", "una", " un", " se", " es", "est", "ero", "nto", "ía ", " su",
+	}},
+	{"it", "italian", {
+		" di", "di ", "re ", "la ", " la", "che", " ch", "he ", "to ", "ell",
+		"lla", "del", " de", "ion", "zio", "one", "ne ", " il", "il ", "per",
+		" pe", "ent", "ato", "no ", "are", " co", "con", "ti ", "nto", "sta",
+		" un", "non", " no", "gli", "e d", "iam", "ll ", "ri ", "ere", "tà ",
+	}},
+	{"pt", "portuguese", {
+		" de", "de ", "os ", "do ", " do", "que", " qu", "ue ", " co", "ção",
+		"ão ", "da ", " da", "as ", "ent", "com", " pa", "par", "em ", " em",
+		"nte", "ara", "uma", " um", "não", " nã", "ões", "es ", "ado", "men",
+		"ra ", "ida", "ess", " se", "ém ", " é ", "ica", "ros", "sso", "voc",
+	}},
+	{"nl", "dutch", {
+		"en ", " de", "de ", "an ", "het", " he", "et ", "van", " va", "een",
+		" ee", "ij ", "and", "er ", " in", "in ", "ver", "aar", "oor", " ge",
+		"gen", "ing", "cht", "zij", " zi", "ijn", " vo", "voo", " da", "dat",
+		"ter", "nde", " te", " me", "met", " ni", "nie", "ie ", "oe ", "jk ",
+	}},
+};
+
+struct rspamd_lang_trigram {
+	guint64 key;
+	guint lang;
+	guint weight;
+};
+
+static struct rspamd_lang_trigram *lang_trigrams = NULL;
+static guint lang_ntrigrams = 0;
+
+static inline guint64
+rspamd_lang_trigram_key (gunichar c1, gunichar c2, gunichar c3)
+{
+	return ((guint64)c1 << 42) | ((guint64)c2 << 21) | (guint64)c3;
+}
+
+static gint
+rspamd_lang_trigram_cmp (const void *a, const void *b)
+{
+	const struct rspamd_lang_trigram *t1 = a, *t2 = b;
+
+	if (t1->key < t2->key) {
+		return -1;
+	}
+	else if (t1->key > t2->key) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+rspamd_language_models_init (void)
+{
+	const struct rspamd_lang_model *m;
+	const gchar *p;
+	gunichar c[3];
+	guint i, j, k, n = 0;
+
+	lang_trigrams = g_malloc (sizeof (*lang_trigrams) *
+			G_N_ELEMENTS (lang_models) * G_N_ELEMENTS (lang_models[0].trigrams));
+
+	for (i = 0; i < G_N_ELEMENTS (lang_models); i ++) {
+		m = &lang_models[i];
+
+		for (j = 0; j < G_N_ELEMENTS (m->trigrams) && m->trigrams[j]; j ++) {
+			p = m->trigrams[j];
+
+			for (k = 0; k < 3 && *p; k ++) {
+				c[k] = g_utf8_get_char (p);
+				p = g_utf8_next_char (p);
+			}
+
+			if (k != 3 || *p != '\0') {
+				/* Not a trigram */
+				continue;
+			}
+
+			lang_trigrams[n].key = rspamd_lang_trigram_key (c[0], c[1], c[2]);
+			lang_trigrams[n].lang = i;
+			/* More frequent trigrams have more weight */
+			lang_trigrams[n].weight = G_N_ELEMENTS (m->trigrams) - j;
+			n ++;
+		}
+	}
+
+	qsort (lang_trigrams, n, sizeof (*lang_trigrams), rspamd_lang_trigram_cmp);
+	lang_ntrigrams = n;
+}
+
+static void
+rspamd_language_score_trigram (guint64 key, guint *scores, guint *hits)
+{
+	struct rspamd_lang_trigram srch, *found;
+
+	srch.key = key;
+	found = bsearch (&srch, lang_trigrams, lang_ntrigrams,
+			sizeof (*lang_trigrams), rspamd_lang_trigram_cmp);
+
+	if (found == NULL) {
+		return;
+	}
+
+	/* Several languages can share the same trigram */
+	while (found > lang_trigrams && (found - 1)->key == key) {
+		found --;
+	}
+
+	(*hits) ++;
+
+	while (found < lang_trigrams + lang_ntrigrams && found->key == key) {
+		scores[found->lang] += found->weight;
+		found ++;
+	}
+}
+
+const gchar *
+rspamd_language_detect_latin (const gchar *text, gsize len,
+		const gchar **code)
+{
+	guint scores[G_N_ELEMENTS (lang_models)], hits = 0, i, best = 0;
+	const gchar *p, *end;
+	gunichar c, w[3] = {' ', ' ', ' '};
+
+	if (lang_trigrams == NULL) {
+		rspamd_language_models_init ();
+	}
+
+	memset (scores, 0, sizeof (scores));
+	p = text;
+	end = text + MIN (len, RSPAMD_LANG_DETECT_MAX_TEXT);
+
+	while (p < end) {
+		c = g_utf8_get_char_validated (p, end - p);
+
+		if (c == (gunichar) -2 || c == (gunichar) -1) {
+			break;
+		}
+
+		p = g_utf8_next_char (p);
+
+		if (g_unichar_isalpha (c)) {
+			c = g_unichar_tolower (c);
+		}
+		else if (c == '\'') {
+			/* Keep elisions like d' and l' */
+		}
+		else {
+			if (w[2] == ' ') {
+				/* Collapse multiple boundaries */
+				continue;
+			}
+
+			c = ' ';
+		}
+
+		w[0] = w[1];
+		w[1] = w[2];
+		w[2] = c;
+
+		if (w[1] != ' ' || w[0] != ' ') {
+			rspamd_language_score_trigram (
+					rspamd_lang_trigram_key (w[0], w[1], w[2]),
+					scores, &hits);
+		}
+	}
+
+	if (hits < RSPAMD_LANG_MIN_HITS) {
+		return NULL;
+	}
+
+	for (i = 1; i < G_N_ELEMENTS (lang_models); i ++) {
+		if (scores[i] > scores[best]) {
+			best = i;
+		}
+	}
+
+	if (code) {
+		*code = lang_models[best].code;
+	}
+
+	return lang_models[best].name;
+}
@@ -0,0 +1,35 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBMIME_LANG_DETECTION_H_
+#define SRC_LIBMIME_LANG_DETECTION_H_
+
+#include "config.h"
+
+/* Maximum number of bytes of text examined by the detector */
+#define RSPAMD_LANG_DETECT_MAX_TEXT 4096
+
+/**
+ * Detects language of a latin script text using trigrams frequencies,
+ * only the first RSPAMD_LANG_DETECT_MAX_TEXT bytes are examined
+ * @param text utf8 text
+ * @param len length of text
+ * @param code output language code (e.g. "de")
+ * @return language name usable for stemmers or NULL if language is unknown
+ */
+const gchar * rspamd_language_detect_latin (const gchar *text, gsize len,
+		const gchar **code);
+
+#endif /* SRC_LIBMIME_LANG_DETECTION_H_ */
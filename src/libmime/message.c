@@ -24,6 +24,7 @@
 #include "smtp_parsers.h"
 #include "mime_parser.h"
 #include "mime_encoding.h"
+#include "lang_detection.h"
 
 #ifdef WITH_SNOWBALL
 #include "libstemmer.h"
@@ -186,29 +187,73 @@ detect_text_language (struct rspamd_mime_text_part *part)
 				part->lang_code = lm->code;
 				part->language = lm->name;
 			}
+
+			if (sel == G_UNICODE_SCRIPT_LATIN) {
+				/* Script is not enough to distinguish latin languages */
+				const gchar *lang, *code;
+
+				lang = rspamd_language_detect_latin (part->content->data,
+						part->content->len, &code);
+
+				if (lang != NULL) {
+					part->lang_code = code;
+					part->language = lang;
+				}
+			}
 		}
 	}
 }
 
+#ifdef WITH_SNOWBALL
+/*
+ * Stemmers are quite expensive to create, so we keep one per language for
+ * the whole process lifetime. Languages with no stemmer are cached as NULL.
+ */
+static struct sb_stemmer *
+rspamd_stemmer_get (struct rspamd_task *task, const gchar *lang)
+{
+	static GHashTable *stemmers = NULL;
+	struct sb_stemmer *stem = NULL;
+	gpointer found;
+
+	if (stemmers == NULL) {
+		stemmers = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	}
+
+	if (g_hash_table_lookup_extended (stemmers, lang, NULL, &found)) {
+		return found;
+	}
+
+	stem = sb_stemmer_new (lang, "UTF_8");
+
+	if (stem == NULL) {
+		msg_debug_task ("<%s> cannot create lemmatizer for %s language",
+				task->message_id, lang);
+	}
+
+	g_hash_table_insert (stemmers, g_strdup (lang), stem);
+
+	return stem;
+}
+#endif
+
 static void
 rspamd_extract_words (struct rspamd_task *task,
 		struct rspamd_mime_text_part *part)
 {
 #ifdef WITH_SNOWBALL
 	struct sb_stemmer *stem = NULL;
+	const guchar *r;
+	guint nlen;
 #endif
 	rspamd_stat_token_t *w;
 	gchar *temp_word;
-	const guchar *r;
-	guint i, nlen;
+	guint i;
+	guint64 h;
 
 #ifdef WITH_SNOWBALL
 	if (part->language && part->language[0] != '\0' && IS_PART_UTF (part)) {
-		stem = sb_stemmer_new (part->language, "UTF_8");
-		if (stem == NULL) {
-			msg_debug_task ("<%s> cannot create lemmatizer for %s language",
-					task->message_id, part->language);
-		}
+		stem = rspamd_stemmer_get (task, part->language);
 	}
 #endif
 	/* Ugly workaround */
@@ -217,62 +262,60 @@ rspamd_extract_words (struct rspamd_task *task,
 			part->exceptions, FALSE,
 			NULL);
 
-	if (part->normalized_words) {
-		part->normalized_hashes = g_array_sized_new (FALSE, FALSE,
-				sizeof (guint64), part->normalized_words->len);
+	if (part->normalized_words == NULL) {
+		return;
+	}
 
-		for (i = 0; i < part->normalized_words->len; i ++) {
-			guint64 h;
+	part->normalized_hashes = g_array_sized_new (FALSE, FALSE,
+			sizeof (guint64), part->normalized_words->len);
 
-			w = &g_array_index (part->normalized_words, rspamd_stat_token_t, i);
-			r = NULL;
+	/*
+	 * Words are lowercased, stemmed and hashed in a single pass: stemmed
+	 * form is never longer than the original word so it is stored in the
+	 * same buffer
+	 */
+	for (i = 0; i < part->normalized_words->len; i ++) {
+		w = &g_array_index (part->normalized_words, rspamd_stat_token_t, i);
+
+		if (w->len == 0) {
+			continue;
+		}
+
+		if (w->flags & RSPAMD_STAT_TOKEN_FLAG_TEXT) {
+			temp_word = rspamd_mempool_alloc (task->task_pool, w->len);
+			memcpy (temp_word, w->begin, w->len);
+
+			if (IS_PART_UTF (part)) {
+				rspamd_str_lc_utf8 (temp_word, w->len);
+			}
+			else {
+				rspamd_str_lc (temp_word, w->len);
+			}
+
+			w->begin = temp_word;
 #ifdef WITH_SNOWBALL
 			if (stem) {
-				r = sb_stemmer_stem (stem, w->begin, w->len);
-			}
-#endif
+				r = sb_stemmer_stem (stem, temp_word, w->len);
 
-			if (w->len > 0 && (w->flags & RSPAMD_STAT_TOKEN_FLAG_TEXT)) {
 				if (r != NULL) {
-					nlen = strlen (r);
+					nlen = sb_stemmer_length (stem);
 					nlen = MIN (nlen, w->len);
-					temp_word = rspamd_mempool_alloc (task->task_pool, nlen);
 					memcpy (temp_word, r, nlen);
-					w->begin = temp_word;
 					w->len = nlen;
 				}
-				else {
-					temp_word = rspamd_mempool_alloc (task->task_pool, w->len);
-					memcpy (temp_word, w->begin, w->len);
-
-					if (IS_PART_UTF (part)) {
-						rspamd_str_lc_utf8 (temp_word, w->len);
-					}
-					else {
-						rspamd_str_lc (temp_word, w->len);
-					}
-
-					w->begin = temp_word;
-				}
-			}
-
-			if (w->len > 0) {
-				/*
-				 * We use static hash seed if we would want to use that in shingles
-				 * computation in future
-				 */
-				h = rspamd_cryptobox_fast_hash_specific (
-						RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT,
-						w->begin, w->len, words_hash_seed);
-				g_array_append_val (part->normalized_hashes, h);
 			}
+#endif
 		}
+
+		/*
+		 * We use static hash seed if we would want to use that in shingles
+		 * computation in future
+		 */
+		h = rspamd_cryptobox_fast_hash_specific (
+				RSPAMD_CRYPTOBOX_HASHFAST_INDEPENDENT,
+				w->begin, w->len, words_hash_seed);
+		g_array_append_val (part->normalized_hashes, h);
 	}
-#ifdef WITH_SNOWBALL
-	if (stem != NULL) {
-		sb_stemmer_delete (stem);
-	}
-#endif
 }
 
 static void
@@ -313,16 +356,20 @@ rspamd_normalize_text_part (struct rspamd_task *task,
 			part->newlines);
 }
 
-#define MIN3(a, b, c) ((a) < (b) ? ((a) < (c) ? (a) : (c)) : ((b) < (c) ? (b) : (c)))
-
+/*
+ * Replacement of a word costs as much as its deletion and insertion, so the
+ * distance is len1 + len2 - 2 * LCS. LCS is computed by the bit-parallel
+ * algorithm with the shorter list of words used as the pattern.
+ */
 static guint
 rspamd_words_levenshtein_distance (struct rspamd_task *task,
 		GArray *w1, GArray *w2)
 {
-	guint s1len, s2len, x, y, lastdiag, olddiag;
-	guint *column, ret;
-	guint64 h1, h2;
-	gint eq;
+	guint s1len, s2len, nwords, ndistinct = 0, lcs = 0, i, k, idx;
+	guint64 *peq, *v, *eq, x, sum, carry, c1, top_mask;
+	GHashTable *positions;
+	gpointer pidx;
+	GArray *t;
 	static const guint max_words = 8192;
 
 	s1len = w1->len;
@@ -334,34 +381,74 @@ rspamd_words_levenshtein_distance (struct rspamd_task *task,
 		return 0;
 	}
 
-	column = g_malloc0 ((s1len + 1) * sizeof (guint));
+	if (s1len > s2len) {
+		t = w1;
+		w1 = w2;
+		w2 = t;
+		s1len = w1->len;
+		s2len = w2->len;
+	}
 
-	for (y = 1; y <= s1len; y++) {
-		column[y] = y;
+	if (s1len == 0) {
+		return s2len;
 	}
 
-	for (x = 1; x <= s2len; x++) {
-		column[0] = x;
+	nwords = (s1len + 63) / 64;
+	positions = g_hash_table_new (g_int64_hash, g_int64_equal);
 
-		for (y = 1, lastdiag = x - 1; y <= s1len; y++) {
-			olddiag = column[y];
-			h1 = g_array_index (w1, guint64, y - 1);
-			h2 = g_array_index (w2, guint64, x - 1);
-			eq = (h1 == h2) ? 1 : 0;
-			/*
-			 * Cost of replacement is twice higher than cost of add/delete
-			 * to calculate percentage properly
-			 */
-			column[y] = MIN3 (column[y] + 1, column[y - 1] + 1,
-					lastdiag + (eq * 2));
-			lastdiag = olddiag;
+	for (i = 0; i < s1len; i++) {
+		if (!g_hash_table_lookup_extended (positions,
+				&g_array_index (w1, guint64, i), NULL, NULL)) {
+			g_hash_table_insert (positions, &g_array_index (w1, guint64, i),
+					GUINT_TO_POINTER (ndistinct));
+			ndistinct ++;
 		}
 	}
 
-	ret = column[s1len];
-	g_free (column);
+	/* Bitmap of positions for each distinct word */
+	peq = g_malloc0 (ndistinct * nwords * sizeof (guint64));
 
-	return ret;
+	for (i = 0; i < s1len; i++) {
+		idx = GPOINTER_TO_UINT (g_hash_table_lookup (positions,
+				&g_array_index (w1, guint64, i)));
+		peq[idx * nwords + i / 64] |= 1ULL << (i % 64);
+	}
+
+	v = g_malloc (nwords * sizeof (guint64));
+	memset (v, 0xff, nwords * sizeof (guint64));
+
+	for (i = 0; i < s2len; i++) {
+		if (!g_hash_table_lookup_extended (positions,
+				&g_array_index (w2, guint64, i), NULL, &pidx)) {
+			/* Word is not in the pattern, nothing changes */
+			continue;
+		}
+
+		eq = &peq[GPOINTER_TO_UINT (pidx) * nwords];
+		carry = 0;
+
+		/* v = (v + (v & eq)) | (v & ~eq) with carry between words */
+		for (k = 0; k < nwords; k++) {
+			x = v[k];
+			sum = x + (x & eq[k]);
+			c1 = sum < x;
+			sum += carry;
+			carry = c1 | (sum < carry);
+			v[k] = sum | (x & ~eq[k]);
+		}
+	}
+
+	top_mask = (s1len % 64) ? (1ULL << (s1len % 64)) - 1 : ~0ULL;
+
+	for (k = 0; k < nwords; k++) {
+		lcs += __builtin_popcountll (~v[k] & (k == nwords - 1 ? top_mask : ~0ULL));
+	}
+
+	g_free (v);
+	g_free (peq);
+	g_hash_table_unref (positions);
+
+	return s1len + s2len - 2 * lcs;
 }
 
 static gboolean
@@ -483,15 +570,24 @@ rspamd_message_process_text_part (struct rspamd_task *task,
 		text_part->mime_part = mime_part;
 
 		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_BALANCED;
+		if (task->cfg) {
+			text_part->html->max_tags = task->cfg->max_html_tags;
+		}
+
 		text_part->content = rspamd_html_process_part_full (
 				task->task_pool,
 				text_part->html,
 				part_content,
 				&text_part->exceptions,
-				task->urls,
-				task->emails);
+				(task->budget_flags & RSPAMD_TASK_BUDGET_URLS) ? NULL : task->urls,
+				(task->budget_flags & RSPAMD_TASK_BUDGET_URLS) ? NULL : task->emails);
 		text_part->utf_raw_content = part_content;
 
+		if (text_part->html->flags & RSPAMD_HTML_FLAG_TOO_MANY_TAGS) {
+			rspamd_task_budget_exceeded (task, RSPAMD_TASK_BUDGET_HTML_TAGS,
+					"html_tags");
+		}
+
 		if (text_part->content->len == 0) {
 			text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_EMPTY;
 		}
@@ -621,6 +717,7 @@ rspamd_message_from_data (struct rspamd_task *task, const guchar *start,
 	part->raw_data.len = len;
 	part->parsed_data.begin = start;
 	part->parsed_data.len = len;
+	part->flags |= RSPAMD_MIME_PART_DECODED;
 
 	/* Generate message ID */
 	mid = rspamd_mime_message_id_generate ("localhost.localdomain");
@@ -741,7 +838,7 @@ rspamd_message_parse (struct rspamd_task *task)
 		gboolean need_recv_correction = FALSE;
 		rspamd_inet_addr_t *raddr;
 
-		recv = g_ptr_array_index (task->received, 0);
+		recv = rspamd_mempool_array_index (task->received, 0);
 		/*
 		 * For the first header we must ensure that
 		 * received is consistent with the IP that we obtain through
@@ -784,30 +881,14 @@ rspamd_message_parse (struct rspamd_task *task)
 				trecv->from_hostname = trecv->real_hostname;
 			}
 
-#ifdef GLIB_VERSION_2_40
-			g_ptr_array_insert (task->received, 0, trecv);
-#else
-			/*
-			 * Unfortunately, before glib 2.40 we cannot insert element into a
-			 * ptr array
-			 */
-			GPtrArray *nar = g_ptr_array_sized_new (task->received->len + 1);
-
-			g_ptr_array_add (nar, trecv);
-			PTR_ARRAY_FOREACH (task->received, i, recv) {
-				g_ptr_array_add (nar, recv);
-			}
-			rspamd_mempool_add_destructor (task->task_pool,
-						rspamd_ptr_array_free_hard, nar);
-			task->received = nar;
-#endif
+			rspamd_mempool_array_insert (task->received, 0, trecv);
 		}
 	}
 
 	/* Extract data from received header if we were not given IP */
 	if (task->received->len > 0 && (task->flags & RSPAMD_TASK_FLAG_NO_IP) &&
 			(task->cfg && !task->cfg->ignore_received)) {
-		recv = g_ptr_array_index (task->received, 0);
+		recv = rspamd_mempool_array_index (task->received, 0);
 		if (recv->real_ip) {
 			if (!rspamd_parse_inet_address (&task->from_addr,
 					recv->real_ip,
@@ -889,7 +970,16 @@ rspamd_message_parse (struct rspamd_task *task)
 		struct rspamd_mime_part *part;
 
 		part = g_ptr_array_index (task->parts, i);
-		rspamd_cryptobox_hash_update (&st, part->digest, sizeof (part->digest));
+
+		if (part->flags & RSPAMD_MIME_PART_DECODED) {
+			rspamd_cryptobox_hash_update (&st, part->digest,
+					sizeof (part->digest));
+		}
+		else {
+			/* Not decoded yet, so use raw content instead */
+			rspamd_cryptobox_hash_update (&st, part->raw_data.begin,
+					part->raw_data.len);
+		}
 	}
 
 	rspamd_cryptobox_hash_final (&st, digest_out);
@@ -912,18 +1002,14 @@ rspamd_message_parse (struct rspamd_task *task)
 }
 
 
-GPtrArray *
-rspamd_message_get_header_from_hash (GHashTable *htb,
-		rspamd_mempool_t *pool,
-		const gchar *field,
-		gboolean strong)
+static GPtrArray *
+rspamd_message_headers_filter (GPtrArray *ar, rspamd_mempool_t *pool,
+		const gchar *field, gboolean strong)
 {
-	GPtrArray *ret, *ar;
+	GPtrArray *ret;
 	struct rspamd_mime_header *cur;
 	guint i;
 
-	ar = g_hash_table_lookup (htb, field);
-
 	if (ar == NULL) {
 		return NULL;
 	}
@@ -950,15 +1036,47 @@ rspamd_message_get_header_from_hash (GHashTable *htb,
 	return ret;
 }
 
+GPtrArray *
+rspamd_message_get_header_from_hash (GHashTable *htb,
+		rspamd_mempool_t *pool,
+		const gchar *field,
+		gboolean strong)
+{
+	return rspamd_message_headers_filter (g_hash_table_lookup (htb, field),
+			pool, field, strong);
+}
+
 GPtrArray *
 rspamd_message_get_header_array (struct rspamd_task *task,
 		const gchar *field,
 		gboolean strong)
 {
+	gint id;
+
+	if (task->known_headers != NULL) {
+		id = rspamd_mime_header_known_id (field, strlen (field));
+
+		if (id >= 0) {
+			return rspamd_message_headers_filter (task->known_headers[id],
+					task->task_pool, field, strong);
+		}
+	}
+
 	return rspamd_message_get_header_from_hash (task->raw_headers,
 			task->task_pool, field, strong);
 }
 
+GPtrArray *
+rspamd_message_get_header_array_by_id (struct rspamd_task *task,
+		enum rspamd_mime_header_known id,
+		gboolean strong)
+{
+	g_assert (id < RSPAMD_HEADER_KNOWN_MAX);
+
+	return rspamd_message_headers_filter (task->known_headers[id],
+			task->task_pool, rspamd_mime_header_known_name (id), strong);
+}
+
 GPtrArray *
 rspamd_message_get_mime_header_array (struct rspamd_task *task,
 		const gchar *field,
@@ -25,7 +25,10 @@ enum rspamd_mime_part_flags {
 	RSPAMD_MIME_PART_IMAGE = (1 << 2),
 	RSPAMD_MIME_PART_ARCHIVE = (1 << 3),
 	RSPAMD_MIME_PART_BAD_CTE = (1 << 4),
-	RSPAMD_MIME_PART_MISSING_CTE = (1 << 5)
+	RSPAMD_MIME_PART_MISSING_CTE = (1 << 5),
+	RSPAMD_MIME_PART_DECODED = (1 << 6),
+	/* Parsed data references raw message and must be copied before changes */
+	RSPAMD_MIME_PART_BORROWED = (1 << 7)
 };
 
 enum rspamd_cte {
@@ -63,6 +66,7 @@ struct rspamd_mime_part {
 
 	enum rspamd_mime_part_flags flags;
 	guchar digest[rspamd_cryptobox_HASHBYTES];
+	rspamd_mempool_t *pool; /* Used for lazy decoding */
 };
 
 #define RSPAMD_MIME_TEXT_PART_FLAG_UTF (1 << 0)
@@ -141,6 +145,17 @@ gboolean rspamd_message_parse (struct rspamd_task *task);
 GPtrArray *rspamd_message_get_header_array (struct rspamd_task *task,
 		const gchar *field,
 		gboolean strong);
+
+/**
+ * Get an array of values of a known header without hashing its name
+ * @param task worker task structure
+ * @param id header's id
+ * @param strong if this flag is TRUE header's name must match the canonical name
+ * @return An array of header's values or NULL. It is NOT permitted to free array or values.
+ */
+GPtrArray *rspamd_message_get_header_array_by_id (struct rspamd_task *task,
+		enum rspamd_mime_header_known id,
+		gboolean strong);
 /**
  * Get an array of mime parts header's values with specified header's name using raw headers
  * @param task worker task structure
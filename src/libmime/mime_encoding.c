@@ -176,6 +176,26 @@ rspamd_mime_detect_charset (const rspamd_ftok_t *in, rspamd_mempool_t *pool)
 	return ucnv_getStandardName (ret, "IANA", &uc_err);
 }
 
+/*
+ * Converts input to utf8 directly into `out` using a small pivot buffer
+ * instead of an intermediate UTF-16 copy of the whole input
+ */
+static gint32
+rspamd_mime_convert_to_utf8 (UConverter *conv, gchar *out, gint32 outlen,
+		const gchar *in, gsize inlen, UErrorCode *uc_err)
+{
+	UChar pivot[1024], *pivot_src = pivot, *pivot_dst = pivot;
+	gchar *target = out;
+	const gchar *source = in;
+
+	ucnv_convertEx (utf8_converter, conv, &target, out + outlen,
+			&source, in + inlen,
+			pivot, &pivot_src, &pivot_dst, pivot + G_N_ELEMENTS (pivot),
+			TRUE, TRUE, uc_err);
+
+	return target - out;
+}
+
 gchar *
 rspamd_mime_text_to_utf8 (rspamd_mempool_t *pool,
 		gchar *input, gsize len, const gchar *in_enc,
@@ -183,8 +203,6 @@ rspamd_mime_text_to_utf8 (rspamd_mempool_t *pool,
 {
 	gchar *d;
 	gint32 r, clen, dlen;
-	UChar *tmp_buf;
-
 	UErrorCode uc_err = U_ZERO_ERROR;
 	UConverter *conv;
 
@@ -217,37 +235,23 @@ rspamd_mime_text_to_utf8 (rspamd_mempool_t *pool,
 		return NULL;
 	}
 
-	tmp_buf = g_new (UChar, len + 1);
-	uc_err = U_ZERO_ERROR;
-	r = ucnv_toUChars (conv, tmp_buf, len + 1, input, len, &uc_err);
-
-	if (uc_err != U_ZERO_ERROR) {
-		g_set_error (err, rspamd_iconv_error_quark (), EINVAL,
-					"cannot convert data to unicode from %s: %s",
-					in_enc, u_errorName (uc_err));
-		g_free (tmp_buf);
-
-		return NULL;
-	}
-
-	/* Now, convert to utf8 */
+	/* Each input byte produces at most one UTF-16 character */
 	clen = ucnv_getMaxCharSize (utf8_converter);
-	dlen = UCNV_GET_MAX_BYTES_FOR_STRING (r, clen);
+	dlen = UCNV_GET_MAX_BYTES_FOR_STRING (len + 1, clen);
 	d = rspamd_mempool_alloc (pool, dlen);
-	r = ucnv_fromUChars (utf8_converter, d, dlen, tmp_buf, r, &uc_err);
+	uc_err = U_ZERO_ERROR;
+	r = rspamd_mime_convert_to_utf8 (conv, d, dlen, input, len, &uc_err);
 
-	if (uc_err != U_ZERO_ERROR) {
+	if (U_FAILURE (uc_err)) {
 		g_set_error (err, rspamd_iconv_error_quark (), EINVAL,
-				"cannot convert data from unicode from %s: %s",
+				"cannot convert data from %s to utf8: %s",
 				in_enc, u_errorName (uc_err));
-		g_free (tmp_buf);
 
 		return NULL;
 	}
 
 	msg_info_pool ("converted from %s to UTF-8 inlen: %z, outlen: %d",
 			in_enc, len, r);
-	g_free (tmp_buf);
 
 	if (olen) {
 		*olen = r;
@@ -262,7 +266,6 @@ rspamd_mime_to_utf8_byte_array (GByteArray *in,
 		const gchar *enc)
 {
 	gint32 r, clen, dlen;
-	UChar *tmp_buf;
 	UErrorCode uc_err = U_ZERO_ERROR;
 	UConverter *conv;
 	rspamd_ftok_t charset_tok;
@@ -301,29 +304,17 @@ rspamd_mime_to_utf8_byte_array (GByteArray *in,
 		return FALSE;
 	}
 
-	tmp_buf = g_new (UChar, in->len + 1);
-	uc_err = U_ZERO_ERROR;
-	r = ucnv_toUChars (conv, tmp_buf, in->len + 1, in->data, in->len, &uc_err);
-
-	if (uc_err != U_ZERO_ERROR) {
-		g_free (tmp_buf);
-
-		return FALSE;
-	}
-
-	/* Now, convert to utf8 */
 	clen = ucnv_getMaxCharSize (utf8_converter);
-	dlen = UCNV_GET_MAX_BYTES_FOR_STRING (r, clen);
+	dlen = UCNV_GET_MAX_BYTES_FOR_STRING (in->len + 1, clen);
 	g_byte_array_set_size (out, dlen);
-	r = ucnv_fromUChars (utf8_converter, out->data, dlen, tmp_buf, r, &uc_err);
-
-	if (uc_err != U_ZERO_ERROR) {
-		g_free (tmp_buf);
+	uc_err = U_ZERO_ERROR;
+	r = rspamd_mime_convert_to_utf8 (conv, out->data, dlen, in->data, in->len,
+			&uc_err);
 
+	if (U_FAILURE (uc_err)) {
 		return FALSE;
 	}
 
-	g_free (tmp_buf);
 	out->len = r;
 
 	return TRUE;
@@ -338,7 +329,7 @@ rspamd_mime_charset_utf_enforce (gchar *in, gsize len)
 	/* Now we validate input and replace bad characters with '?' symbol */
 	p = in;
 
-	while (remain > 0 && !g_utf8_validate (p, remain, &end)) {
+	while (remain > 0 && !rspamd_fast_utf8_validate (p, remain, &end)) {
 		gchar *valid;
 
 		valid = g_utf8_find_next_char (end, in + len);
@@ -373,16 +364,10 @@ rspamd_mime_charset_find_by_content (gchar *in, gsize inlen)
 	}
 
 	/* If text is ascii, then we can treat it as utf8 data */
-	for (i = 0; i < inlen; i++) {
-		if ((((guchar)in[i]) & 0x80) != 0) {
-			goto detect;
-		}
+	if (rspamd_str_is_ascii (in, inlen)) {
+		return UTF8_CHARSET;
 	}
 
-	return UTF8_CHARSET;
-
-detect:
-
 	ucsdet_setText (csd, in, inlen, &uc_err);
 	csm = ucsdet_detectAll(csd, &matches, &uc_err);
 
@@ -448,6 +433,54 @@ rspamd_mime_charset_utf_check (rspamd_ftok_t *charset,
 	return FALSE;
 }
 
+/*
+ * Charsets where 7bit text is not the same as ASCII
+ */
+static gboolean
+rspamd_mime_charset_ascii_compatible (const rspamd_ftok_t *charset)
+{
+	static const gchar *incompatible[] = {
+		"utf-7", "utf7", "utf-16", "utf16", "utf-32", "utf32", "ucs",
+		"unicode", "iso-2022", "iso2022", "hz",
+	};
+	guint i;
+	gsize len;
+
+	for (i = 0; i < G_N_ELEMENTS (incompatible); i ++) {
+		len = strlen (incompatible[i]);
+
+		if (charset->len >= len &&
+				rspamd_lc_cmp (charset->begin, incompatible[i], len) == 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Copies borrowed content of a part before it is fixed in place
+ */
+static void
+rspamd_mime_text_part_own_content (struct rspamd_task *task,
+		struct rspamd_mime_text_part *text_part,
+		GByteArray *part_content)
+{
+	struct rspamd_mime_part *part = text_part->mime_part;
+	guint8 *copy;
+
+	if (!(part->flags & RSPAMD_MIME_PART_BORROWED)) {
+		return;
+	}
+
+	copy = rspamd_mempool_alloc (task->task_pool, part_content->len);
+	memcpy (copy, part_content->data, part_content->len);
+	part_content->data = copy;
+	text_part->parsed.begin = copy;
+	part->parsed_data.begin = copy;
+	part->flags &= ~RSPAMD_MIME_PART_BORROWED;
+}
+
 GByteArray *
 rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 		struct rspamd_mime_text_part *text_part)
@@ -470,6 +503,20 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 		return part_content;
 	}
 
+	if (rspamd_mime_charset_ascii_compatible (&part->ct->charset) &&
+			rspamd_str_is_ascii (part_content->data, part_content->len)) {
+		/* 7bit text is already valid utf8, no detection or conversion needed */
+		if (memchr (part_content->data, '\0', part_content->len) != NULL) {
+			rspamd_mime_text_part_own_content (task, text_part, part_content);
+			rspamd_mime_charset_utf_enforce (part_content->data,
+					part_content->len);
+		}
+
+		SET_PART_UTF (text_part);
+
+		return part_content;
+	}
+
 	if (part->ct->charset.len == 0) {
 		charset = rspamd_mime_charset_find_by_content (part_content->data,
 				MIN (RSPAMD_CHARSET_MAX_CONTENT, part_content->len));
@@ -501,6 +548,13 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 
 	RSPAMD_FTOK_FROM_STR (&charset_tok, charset);
 
+	if ((part->flags & RSPAMD_MIME_PART_BORROWED) &&
+			!rspamd_fast_utf8_validate (part_content->data, part_content->len,
+					NULL)) {
+		/* Utf check might replace invalid characters */
+		rspamd_mime_text_part_own_content (task, text_part, part_content);
+	}
+
 	if (rspamd_mime_charset_utf_check (&charset_tok, part_content->data,
 			part_content->len, !checked)) {
 		SET_PART_UTF (text_part);
@@ -18,6 +18,7 @@
 #include "cfg_file.h"
 #include "rspamd.h"
 #include "message.h"
+#include "mime_parser.h"
 #include "mime_expressions.h"
 #include "html.h"
 #include "lua/lua_common.h"
@@ -1383,7 +1384,7 @@ rspamd_raw_header_exists (struct rspamd_task *task, GArray * args, void *unused)
 		return FALSE;
 	}
 
-	return g_hash_table_lookup (task->raw_headers, arg->data) != NULL;
+	return rspamd_message_get_header_array (task, arg->data, FALSE) != NULL;
 }
 
 static gboolean
@@ -1800,6 +1801,8 @@ compare_len (struct rspamd_mime_part *part, guint min, guint max)
 		return TRUE;
 	}
 
+	rspamd_mime_part_decode (part);
+
 	if (min == 0) {
 		return part->parsed_data.len <= max;
 	}
@@ -18,6 +18,301 @@
 #include "smtp_parsers.h"
 #include "mime_encoding.h"
 
+/*
+ * Perfect hash of known header names: FNV-1a of a lowercased name selects a
+ * displacement that is mixed with the same hash to get a collision free slot.
+ * Tables are generated offline for the exact list of names below.
+ */
+static const struct rspamd_mime_header_known_elt {
+	const gchar *name;
+	guint len;
+	gint id;
+} known_headers_slots[128] = {
+	{"X-Spamd-Result", 14, RSPAMD_HEADER_X_SPAMD_RESULT},
+	{"Expires", 7, RSPAMD_HEADER_EXPIRES},
+	{NULL, 0, -1},
+	{NULL, 0, -1},
+	{"Thread-Topic", 12, RSPAMD_HEADER_THREAD_TOPIC},
+	{"Autocrypt", 9, RSPAMD_HEADER_AUTOCRYPT},
+	{NULL, 0, -1},
+	{"Organization", 12, RSPAMD_HEADER_ORGANIZATION},
+	{"X-Originating-IP", 16, RSPAMD_HEADER_X_ORIGINATING_IP},
+	{NULL, 0, -1},
+	{"Openpgp", 7, RSPAMD_HEADER_OPENPGP},
+	{"X-SES-Outgoing", 14, RSPAMD_HEADER_X_SES_OUTGOING},
+	{"X-Report-Abuse", 14, RSPAMD_HEADER_X_REPORT_ABUSE},
+	{"X-MS-Has-Attach", 15, RSPAMD_HEADER_X_MS_HAS_ATTACH},
+	{"In-Reply-To", 11, RSPAMD_HEADER_IN_REPLY_TO},
+	{"Thread-Index", 12, RSPAMD_HEADER_THREAD_INDEX},
+	{"Received-SPF", 12, RSPAMD_HEADER_RECEIVED_SPF},
+	{"List-Subscribe", 14, RSPAMD_HEADER_LIST_SUBSCRIBE},
+	{"List-Owner", 10, RSPAMD_HEADER_LIST_OWNER},
+	{"X-Source-IP", 11, RSPAMD_HEADER_X_SOURCE_IP},
+	{"Resent-From", 11, RSPAMD_HEADER_RESENT_FROM},
+	{"X-Rspamd-Server", 15, RSPAMD_HEADER_X_RSPAMD_SERVER},
+	{"X-Spam-Level", 12, RSPAMD_HEADER_X_SPAM_LEVEL},
+	{"Sensitivity", 11, RSPAMD_HEADER_SENSITIVITY},
+	{"Bcc", 3, RSPAMD_HEADER_BCC},
+	{"References", 10, RSPAMD_HEADER_REFERENCES},
+	{"X-Source", 8, RSPAMD_HEADER_X_SOURCE},
+	{"Importance", 10, RSPAMD_HEADER_IMPORTANCE},
+	{"X-Feedback-ID", 13, RSPAMD_HEADER_X_FEEDBACK_ID},
+	{"List-Unsubscribe", 16, RSPAMD_HEADER_LIST_UNSUBSCRIBE},
+	{"ARC-Authentication-Results", 26, RSPAMD_HEADER_ARC_AUTHENTICATION_RESULTS},
+	{NULL, 0, -1},
+	{"Comments", 8, RSPAMD_HEADER_COMMENTS},
+	{"List-Post", 9, RSPAMD_HEADER_LIST_POST},
+	{"X-Google-DKIM-Signature", 23, RSPAMD_HEADER_X_GOOGLE_DKIM_SIGNATURE},
+	{"Content-Description", 19, RSPAMD_HEADER_CONTENT_DESCRIPTION},
+	{NULL, 0, -1},
+	{"Resent-Message-ID", 17, RSPAMD_HEADER_RESENT_MESSAGE_ID},
+	{"X-Auth-ID", 9, RSPAMD_HEADER_X_AUTH_ID},
+	{"X-Microsoft-Antispam", 20, RSPAMD_HEADER_X_MICROSOFT_ANTISPAM},
+	{"User-Agent", 10, RSPAMD_HEADER_USER_AGENT},
+	{"X-Loop", 6, RSPAMD_HEADER_X_LOOP},
+	{"X-Auto-Response-Suppress", 24, RSPAMD_HEADER_X_AUTO_RESPONSE_SUPPRESS},
+	{NULL, 0, -1},
+	{"Feedback-ID", 11, RSPAMD_HEADER_FEEDBACK_ID},
+	{"Subject", 7, RSPAMD_HEADER_SUBJECT},
+	{"X-Spam", 6, RSPAMD_HEADER_X_SPAM},
+	{"Content-ID", 10, RSPAMD_HEADER_CONTENT_ID},
+	{NULL, 0, -1},
+	{"TLS-Required", 12, RSPAMD_HEADER_TLS_REQUIRED},
+	{NULL, 0, -1},
+	{"X-Spam-Score", 12, RSPAMD_HEADER_X_SPAM_SCORE},
+	{"X-Virus-Scanned", 15, RSPAMD_HEADER_X_VIRUS_SCANNED},
+	{"X-Received", 10, RSPAMD_HEADER_X_RECEIVED},
+	{"MIME-Version", 12, RSPAMD_HEADER_MIME_VERSION},
+	{"X-MSMail-Priority", 17, RSPAMD_HEADER_X_MSMAIL_PRIORITY},
+	{"DKIM-Signature", 14, RSPAMD_HEADER_DKIM_SIGNATURE},
+	{"From", 4, RSPAMD_HEADER_FROM},
+	{"X-AntiAbuse", 11, RSPAMD_HEADER_X_ANTIABUSE},
+	{"X-Mailer", 8, RSPAMD_HEADER_X_MAILER},
+	{"X-Original-To", 13, RSPAMD_HEADER_X_ORIGINAL_TO},
+	{"Content-Transfer-Encoding", 25, RSPAMD_HEADER_CONTENT_TRANSFER_ENCODING},
+	{"Resent-Date", 11, RSPAMD_HEADER_RESENT_DATE},
+	{"X-Virus-Status", 14, RSPAMD_HEADER_X_VIRUS_STATUS},
+	{"ARC-Seal", 8, RSPAMD_HEADER_ARC_SEAL},
+	{NULL, 0, -1},
+	{"Date", 4, RSPAMD_HEADER_DATE},
+	{NULL, 0, -1},
+	{"Content-Disposition", 19, RSPAMD_HEADER_CONTENT_DISPOSITION},
+	{"X-Campaign", 10, RSPAMD_HEADER_X_CAMPAIGN},
+	{"X-Gm-Message-State", 18, RSPAMD_HEADER_X_GM_MESSAGE_STATE},
+	{"Envelope-To", 11, RSPAMD_HEADER_ENVELOPE_TO},
+	{"Reply-To", 8, RSPAMD_HEADER_REPLY_TO},
+	{"X-Original-From", 15, RSPAMD_HEADER_X_ORIGINAL_FROM},
+	{"Content-Length", 14, RSPAMD_HEADER_CONTENT_LENGTH},
+	{"Keywords", 8, RSPAMD_HEADER_KEYWORDS},
+	{"X-MS-Exchange-Organization-SCL", 30, RSPAMD_HEADER_X_MS_EXCHANGE_ORGANIZATION_SCL},
+	{"Disposition-Notification-To", 27, RSPAMD_HEADER_DISPOSITION_NOTIFICATION_TO},
+	{"List-Help", 9, RSPAMD_HEADER_LIST_HELP},
+	{"X-Google-Smtp-Source", 20, RSPAMD_HEADER_X_GOOGLE_SMTP_SOURCE},
+	{"X-Priority", 10, RSPAMD_HEADER_X_PRIORITY},
+	{"Sender", 6, RSPAMD_HEADER_SENDER},
+	{"Content-Language", 16, RSPAMD_HEADER_CONTENT_LANGUAGE},
+	{"Resent-To", 9, RSPAMD_HEADER_RESENT_TO},
+	{"X-Envelope-From", 15, RSPAMD_HEADER_X_ENVELOPE_FROM},
+	{"Errors-To", 9, RSPAMD_HEADER_ERRORS_TO},
+	{"X-Sender", 8, RSPAMD_HEADER_X_SENDER},
+	{"List-Archive", 12, RSPAMD_HEADER_LIST_ARCHIVE},
+	{"X-MS-TNEF-Correlator", 20, RSPAMD_HEADER_X_MS_TNEF_CORRELATOR},
+	{NULL, 0, -1},
+	{"Content-Type", 12, RSPAMD_HEADER_CONTENT_TYPE},
+	{"X-CSA-Complaints", 16, RSPAMD_HEADER_X_CSA_COMPLAINTS},
+	{"Authentication-Results", 22, RSPAMD_HEADER_AUTHENTICATION_RESULTS},
+	{"X-Autoreply", 11, RSPAMD_HEADER_X_AUTOREPLY},
+	{"X-Mailgun-Sid", 13, RSPAMD_HEADER_X_MAILGUN_SID},
+	{"DomainKey-Signature", 19, RSPAMD_HEADER_DOMAINKEY_SIGNATURE},
+	{"Encrypted", 9, RSPAMD_HEADER_ENCRYPTED},
+	{"List-Id", 7, RSPAMD_HEADER_LIST_ID},
+	{"X-Spam-Flag", 11, RSPAMD_HEADER_X_SPAM_FLAG},
+	{"To", 2, RSPAMD_HEADER_TO},
+	{"Delivered-To", 12, RSPAMD_HEADER_DELIVERED_TO},
+	{"X-Complaints-To", 15, RSPAMD_HEADER_X_COMPLAINTS_TO},
+	{"X-Spam-Checker-Version", 22, RSPAMD_HEADER_X_SPAM_CHECKER_VERSION},
+	{"Auto-Submitted", 14, RSPAMD_HEADER_AUTO_SUBMITTED},
+	{"Priority", 8, RSPAMD_HEADER_PRIORITY},
+	{NULL, 0, -1},
+	{"Content-MD5", 11, RSPAMD_HEADER_CONTENT_MD5},
+	{"Content-Location", 16, RSPAMD_HEADER_CONTENT_LOCATION},
+	{"Message-ID", 10, RSPAMD_HEADER_MESSAGE_ID},
+	{"List-Unsubscribe-Post", 21, RSPAMD_HEADER_LIST_UNSUBSCRIBE_POST},
+	{"Precedence", 10, RSPAMD_HEADER_PRECEDENCE},
+	{"X-Mailer-Version", 16, RSPAMD_HEADER_X_MAILER_VERSION},
+	{"X-Authenticated-Sender", 22, RSPAMD_HEADER_X_AUTHENTICATED_SENDER},
+	{"X-Rspamd-Queue-Id", 17, RSPAMD_HEADER_X_RSPAMD_QUEUE_ID},
+	{NULL, 0, -1},
+	{"Cc", 2, RSPAMD_HEADER_CC},
+	{"Return-Path", 11, RSPAMD_HEADER_RETURN_PATH},
+	{"X-Forefront-Antispam-Report", 27, RSPAMD_HEADER_X_FOREFRONT_ANTISPAM_REPORT},
+	{"X-Abuse", 7, RSPAMD_HEADER_X_ABUSE},
+	{"X-Envelope-To", 13, RSPAMD_HEADER_X_ENVELOPE_TO},
+	{"Received", 8, RSPAMD_HEADER_RECEIVED},
+	{"Return-Receipt-To", 17, RSPAMD_HEADER_RETURN_RECEIPT_TO},
+	{NULL, 0, -1},
+	{"ARC-Message-Signature", 21, RSPAMD_HEADER_ARC_MESSAGE_SIGNATURE},
+	{"X-SG-EID", 8, RSPAMD_HEADER_X_SG_EID},
+	{NULL, 0, -1},
+	{"X-Spam-Status", 13, RSPAMD_HEADER_X_SPAM_STATUS},
+	{NULL, 0, -1},
+};
+
+static const guint32 known_headers_displacements[32] = {
+	2, 3, 30, 2, 1, 24, 5, 8,
+	2, 49, 18, 33, 7, 20, 7, 8,
+	4, 1, 23, 2, 1, 4, 28, 19,
+	128, 27, 4, 4, 5, 1, 1, 178,
+};
+
+static const gchar *known_headers_names[RSPAMD_HEADER_KNOWN_MAX] = {
+	"Received",
+	"From",
+	"To",
+	"Cc",
+	"Bcc",
+	"Subject",
+	"Date",
+	"Message-ID",
+	"Reply-To",
+	"Sender",
+	"Return-Path",
+	"Delivered-To",
+	"In-Reply-To",
+	"References",
+	"MIME-Version",
+	"Content-Type",
+	"Content-Transfer-Encoding",
+	"Content-Disposition",
+	"Content-ID",
+	"Content-Description",
+	"Content-Language",
+	"Content-Length",
+	"Content-Location",
+	"Content-MD5",
+	"DKIM-Signature",
+	"DomainKey-Signature",
+	"ARC-Seal",
+	"ARC-Message-Signature",
+	"ARC-Authentication-Results",
+	"Authentication-Results",
+	"Received-SPF",
+	"X-Mailer",
+	"User-Agent",
+	"X-Priority",
+	"X-MSMail-Priority",
+	"Importance",
+	"Priority",
+	"X-Originating-IP",
+	"X-Spam",
+	"X-Spam-Status",
+	"X-Spam-Flag",
+	"X-Spam-Score",
+	"X-Spam-Level",
+	"X-Spam-Checker-Version",
+	"X-Spamd-Result",
+	"X-Rspamd-Server",
+	"X-Rspamd-Queue-Id",
+	"X-Virus-Scanned",
+	"X-Virus-Status",
+	"List-Unsubscribe",
+	"List-Id",
+	"List-Help",
+	"List-Subscribe",
+	"List-Post",
+	"List-Owner",
+	"List-Archive",
+	"List-Unsubscribe-Post",
+	"Precedence",
+	"Organization",
+	"Disposition-Notification-To",
+	"Return-Receipt-To",
+	"Errors-To",
+	"Thread-Index",
+	"Thread-Topic",
+	"X-MS-Has-Attach",
+	"X-MS-TNEF-Correlator",
+	"X-MS-Exchange-Organization-SCL",
+	"X-Forefront-Antispam-Report",
+	"X-Microsoft-Antispam",
+	"X-Original-To",
+	"X-Original-From",
+	"X-Envelope-From",
+	"X-Envelope-To",
+	"Envelope-To",
+	"X-Sender",
+	"X-Google-DKIM-Signature",
+	"X-Gm-Message-State",
+	"X-Google-Smtp-Source",
+	"X-Received",
+	"X-Authenticated-Sender",
+	"X-Auth-ID",
+	"X-Campaign",
+	"X-Mailer-Version",
+	"X-Report-Abuse",
+	"X-Abuse",
+	"X-Complaints-To",
+	"X-Feedback-ID",
+	"Feedback-ID",
+	"X-CSA-Complaints",
+	"X-Mailgun-Sid",
+	"X-SG-EID",
+	"X-SES-Outgoing",
+	"Auto-Submitted",
+	"X-Auto-Response-Suppress",
+	"X-Autoreply",
+	"X-Loop",
+	"Resent-From",
+	"Resent-To",
+	"Resent-Date",
+	"Resent-Message-ID",
+	"Keywords",
+	"Comments",
+	"Encrypted",
+	"Sensitivity",
+	"Expires",
+	"X-Source",
+	"X-Source-IP",
+	"X-AntiAbuse",
+	"Openpgp",
+	"Autocrypt",
+	"TLS-Required",
+};
+
+gint
+rspamd_mime_header_known_id (const gchar *name, gsize len)
+{
+	const struct rspamd_mime_header_known_elt *elt;
+	guint32 h = 0x811c9dc5U, x;
+	gsize i;
+
+	for (i = 0; i < len; i ++) {
+		h ^= lc_map[(guchar)name[i]];
+		h *= 0x01000193U;
+	}
+
+	x = h ^ (known_headers_displacements[h %
+			G_N_ELEMENTS (known_headers_displacements)] * 0x9e3779b9U);
+	x *= 0x85ebca6bU;
+	x ^= x >> 13;
+	elt = &known_headers_slots[x % G_N_ELEMENTS (known_headers_slots)];
+
+	if (elt->name != NULL && elt->len == len &&
+			rspamd_lc_cmp (elt->name, name, len) == 0) {
+		return elt->id;
+	}
+
+	return -1;
+}
+
+const gchar *
+rspamd_mime_header_known_name (enum rspamd_mime_header_known id)
+{
+	g_assert (id < RSPAMD_HEADER_KNOWN_MAX);
+
+	return known_headers_names[id];
+}
+
 static void
 rspamd_mime_header_check_special (struct rspamd_task *task,
 		struct rspamd_mime_header *rh)
@@ -34,8 +329,9 @@ rspamd_mime_header_check_special (struct rspamd_task *task,
 		recv = rspamd_mempool_alloc0 (task->task_pool,
 				sizeof (struct received_header));
 		recv->hdr = rh;
-		rspamd_smtp_recieved_parse (task, rh->decoded,
-				strlen (rh->decoded), recv);
+		/* Received headers are not rfc2047 encoded, so avoid decoding them */
+		rspamd_smtp_recieved_parse (task, rh->value,
+				strlen (rh->value), recv);
 		/* Set flags */
 		if (recv->type == RSPAMD_RECEIVED_ESMTPA ||
 				recv->type == RSPAMD_RECEIVED_ESMTPSA) {
@@ -46,7 +342,7 @@ rspamd_mime_header_check_special (struct rspamd_task *task,
 			recv->flags |= RSPAMD_RECEIVED_FLAG_SSL;
 		}
 
-		g_ptr_array_add (task->received, recv);
+		rspamd_mempool_array_add (task->received, recv);
 		break;
 	case 0x76F31A09F4352521ULL:	/* to */
 		task->rcpt_mime = rspamd_email_address_from_mime (task->task_pool,
@@ -66,7 +362,7 @@ rspamd_mime_header_check_special (struct rspamd_task *task,
 		break;
 	case 0x43A558FC7C240226ULL:	/* message-id */ {
 
-		p = rh->decoded;
+		p = rspamd_mime_header_get_decoded (rh);
 		end = p + strlen (p);
 
 		if (*p == '<') {
@@ -102,18 +398,19 @@ rspamd_mime_header_check_special (struct rspamd_task *task,
 	}
 	case 0xB91D3910358E8212ULL:	/* subject */
 		if (task->subject == NULL) {
-			task->subject = rh->decoded;
+			task->subject = rspamd_mime_header_get_decoded (rh);
 		}
 		break;
 	case 0xEE4AA2EAAC61D6F4ULL:	/* return-path */
 		if (task->from_envelope == NULL) {
-			task->from_envelope = rspamd_email_address_from_smtp (rh->decoded,
-					strlen (rh->decoded));
+			p = rspamd_mime_header_get_decoded (rh);
+			task->from_envelope = rspamd_email_address_from_smtp (p,
+					strlen (p));
 		}
 		break;
 	case 0xB9EEFAD2E93C2161ULL:	/* delivered-to */
 		if (task->deliver_to == NULL) {
-			task->deliver_to = rh->decoded;
+			task->deliver_to = rspamd_mime_header_get_decoded (rh);
 		}
 		break;
 	}
@@ -126,6 +423,7 @@ rspamd_mime_header_add (struct rspamd_task *task,
 		gboolean check_special)
 {
 	GPtrArray *ar;
+	gint id;
 
 	if ((ar = g_hash_table_lookup (target, rh->name)) != NULL) {
 		g_ptr_array_add (ar, rh);
@@ -136,6 +434,14 @@ rspamd_mime_header_add (struct rspamd_task *task,
 		g_ptr_array_add (ar, rh);
 		g_hash_table_insert (target, rh->name, ar);
 		msg_debug_task ("add new raw header %s: %s", rh->name, rh->value);
+
+		if (target == task->raw_headers && task->known_headers != NULL) {
+			id = rspamd_mime_header_known_id (rh->name, strlen (rh->name));
+
+			if (id >= 0) {
+				task->known_headers[id] = ar;
+			}
+		}
 	}
 
 	g_queue_push_tail (order, rh);
@@ -330,15 +636,8 @@ rspamd_mime_headers_process (struct rspamd_task *task, GHashTable *target,
 			}
 
 			nh->value = tmp;
-			nh->decoded = rspamd_mime_header_decode (task->task_pool,
-					nh->value, strlen (tmp));
-
-			if (nh->decoded == NULL) {
-				nh->decoded = "";
-			}
-
-			/* We also validate utf8 and replace all non-valid utf8 chars */
-			rspamd_mime_charset_utf_enforce (nh->decoded, strlen (nh->decoded));
+			/* Decoding is performed on the first access */
+			nh->pool = task->task_pool;
 			rspamd_mime_header_add (task, target, order, nh, check_newlines);
 			nh->order = norder ++;
 			state = 0;
@@ -347,6 +646,7 @@ rspamd_mime_headers_process (struct rspamd_task *task, GHashTable *target,
 			/* Header has only name, no value */
 			nh->value = "";
 			nh->decoded = "";
+			nh->flags |= RSPAMD_MIME_HEADER_DECODED;
 			rspamd_mime_header_add (task, target, order, nh, check_newlines);
 			nh->order = norder ++;
 			state = 0;
@@ -453,6 +753,38 @@ rspamd_mime_header_maybe_save_token (rspamd_mempool_t *pool, GString *out,
 	memcpy (old_charset, new_charset, sizeof (*old_charset));
 }
 
+gchar *
+rspamd_mime_header_get_decoded (struct rspamd_mime_header *rh)
+{
+	gsize len;
+
+	if (rh->flags & RSPAMD_MIME_HEADER_DECODED) {
+		return rh->decoded;
+	}
+
+	rh->flags |= RSPAMD_MIME_HEADER_DECODED;
+	len = strlen (rh->value);
+
+	if (rspamd_substring_search (rh->value, len, "=?", 2) == -1 &&
+			rspamd_fast_utf8_validate (rh->value, len, NULL)) {
+		/* Nothing to decode, so the value could be used as is */
+		rh->decoded = rh->value;
+
+		return rh->decoded;
+	}
+
+	rh->decoded = rspamd_mime_header_decode (rh->pool, rh->value, len);
+
+	if (rh->decoded == NULL) {
+		rh->decoded = "";
+	}
+
+	/* We also validate utf8 and replace all non-valid utf8 chars */
+	rspamd_mime_charset_utf_enforce (rh->decoded, strlen (rh->decoded));
+
+	return rh->decoded;
+}
+
 gchar *
 rspamd_mime_header_decode (rspamd_mempool_t *pool, const gchar *in,
 		gsize inlen)
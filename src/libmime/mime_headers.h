@@ -26,6 +26,129 @@ enum rspamd_rfc2047_encoding {
 	RSPAMD_RFC2047_BASE64,
 };
 
+/*
+ * Common headers that are indexed in a task, so they are looked up without
+ * hashing of the header name
+ */
+enum rspamd_mime_header_known {
+	RSPAMD_HEADER_RECEIVED = 0,
+	RSPAMD_HEADER_FROM,
+	RSPAMD_HEADER_TO,
+	RSPAMD_HEADER_CC,
+	RSPAMD_HEADER_BCC,
+	RSPAMD_HEADER_SUBJECT,
+	RSPAMD_HEADER_DATE,
+	RSPAMD_HEADER_MESSAGE_ID,
+	RSPAMD_HEADER_REPLY_TO,
+	RSPAMD_HEADER_SENDER,
+	RSPAMD_HEADER_RETURN_PATH,
+	RSPAMD_HEADER_DELIVERED_TO,
+	RSPAMD_HEADER_IN_REPLY_TO,
+	RSPAMD_HEADER_REFERENCES,
+	RSPAMD_HEADER_MIME_VERSION,
+	RSPAMD_HEADER_CONTENT_TYPE,
+	RSPAMD_HEADER_CONTENT_TRANSFER_ENCODING,
+	RSPAMD_HEADER_CONTENT_DISPOSITION,
+	RSPAMD_HEADER_CONTENT_ID,
+	RSPAMD_HEADER_CONTENT_DESCRIPTION,
+	RSPAMD_HEADER_CONTENT_LANGUAGE,
+	RSPAMD_HEADER_CONTENT_LENGTH,
+	RSPAMD_HEADER_CONTENT_LOCATION,
+	RSPAMD_HEADER_CONTENT_MD5,
+	RSPAMD_HEADER_DKIM_SIGNATURE,
+	RSPAMD_HEADER_DOMAINKEY_SIGNATURE,
+	RSPAMD_HEADER_ARC_SEAL,
+	RSPAMD_HEADER_ARC_MESSAGE_SIGNATURE,
+	RSPAMD_HEADER_ARC_AUTHENTICATION_RESULTS,
+	RSPAMD_HEADER_AUTHENTICATION_RESULTS,
+	RSPAMD_HEADER_RECEIVED_SPF,
+	RSPAMD_HEADER_X_MAILER,
+	RSPAMD_HEADER_USER_AGENT,
+	RSPAMD_HEADER_X_PRIORITY,
+	RSPAMD_HEADER_X_MSMAIL_PRIORITY,
+	RSPAMD_HEADER_IMPORTANCE,
+	RSPAMD_HEADER_PRIORITY,
+	RSPAMD_HEADER_X_ORIGINATING_IP,
+	RSPAMD_HEADER_X_SPAM,
+	RSPAMD_HEADER_X_SPAM_STATUS,
+	RSPAMD_HEADER_X_SPAM_FLAG,
+	RSPAMD_HEADER_X_SPAM_SCORE,
+	RSPAMD_HEADER_X_SPAM_LEVEL,
+	RSPAMD_HEADER_X_SPAM_CHECKER_VERSION,
+	RSPAMD_HEADER_X_SPAMD_RESULT,
+	RSPAMD_HEADER_X_RSPAMD_SERVER,
+	RSPAMD_HEADER_X_RSPAMD_QUEUE_ID,
+	RSPAMD_HEADER_X_VIRUS_SCANNED,
+	RSPAMD_HEADER_X_VIRUS_STATUS,
+	RSPAMD_HEADER_LIST_UNSUBSCRIBE,
+	RSPAMD_HEADER_LIST_ID,
+	RSPAMD_HEADER_LIST_HELP,
+	RSPAMD_HEADER_LIST_SUBSCRIBE,
+	RSPAMD_HEADER_LIST_POST,
+	RSPAMD_HEADER_LIST_OWNER,
+	RSPAMD_HEADER_LIST_ARCHIVE,
+	RSPAMD_HEADER_LIST_UNSUBSCRIBE_POST,
+	RSPAMD_HEADER_PRECEDENCE,
+	RSPAMD_HEADER_ORGANIZATION,
+	RSPAMD_HEADER_DISPOSITION_NOTIFICATION_TO,
+	RSPAMD_HEADER_RETURN_RECEIPT_TO,
+	RSPAMD_HEADER_ERRORS_TO,
+	RSPAMD_HEADER_THREAD_INDEX,
+	RSPAMD_HEADER_THREAD_TOPIC,
+	RSPAMD_HEADER_X_MS_HAS_ATTACH,
+	RSPAMD_HEADER_X_MS_TNEF_CORRELATOR,
+	RSPAMD_HEADER_X_MS_EXCHANGE_ORGANIZATION_SCL,
+	RSPAMD_HEADER_X_FOREFRONT_ANTISPAM_REPORT,
+	RSPAMD_HEADER_X_MICROSOFT_ANTISPAM,
+	RSPAMD_HEADER_X_ORIGINAL_TO,
+	RSPAMD_HEADER_X_ORIGINAL_FROM,
+	RSPAMD_HEADER_X_ENVELOPE_FROM,
+	RSPAMD_HEADER_X_ENVELOPE_TO,
+	RSPAMD_HEADER_ENVELOPE_TO,
+	RSPAMD_HEADER_X_SENDER,
+	RSPAMD_HEADER_X_GOOGLE_DKIM_SIGNATURE,
+	RSPAMD_HEADER_X_GM_MESSAGE_STATE,
+	RSPAMD_HEADER_X_GOOGLE_SMTP_SOURCE,
+	RSPAMD_HEADER_X_RECEIVED,
+	RSPAMD_HEADER_X_AUTHENTICATED_SENDER,
+	RSPAMD_HEADER_X_AUTH_ID,
+	RSPAMD_HEADER_X_CAMPAIGN,
+	RSPAMD_HEADER_X_MAILER_VERSION,
+	RSPAMD_HEADER_X_REPORT_ABUSE,
+	RSPAMD_HEADER_X_ABUSE,
+	RSPAMD_HEADER_X_COMPLAINTS_TO,
+	RSPAMD_HEADER_X_FEEDBACK_ID,
+	RSPAMD_HEADER_FEEDBACK_ID,
+	RSPAMD_HEADER_X_CSA_COMPLAINTS,
+	RSPAMD_HEADER_X_MAILGUN_SID,
+	RSPAMD_HEADER_X_SG_EID,
+	RSPAMD_HEADER_X_SES_OUTGOING,
+	RSPAMD_HEADER_AUTO_SUBMITTED,
+	RSPAMD_HEADER_X_AUTO_RESPONSE_SUPPRESS,
+	RSPAMD_HEADER_X_AUTOREPLY,
+	RSPAMD_HEADER_X_LOOP,
+	RSPAMD_HEADER_RESENT_FROM,
+	RSPAMD_HEADER_RESENT_TO,
+	RSPAMD_HEADER_RESENT_DATE,
+	RSPAMD_HEADER_RESENT_MESSAGE_ID,
+	RSPAMD_HEADER_KEYWORDS,
+	RSPAMD_HEADER_COMMENTS,
+	RSPAMD_HEADER_ENCRYPTED,
+	RSPAMD_HEADER_SENSITIVITY,
+	RSPAMD_HEADER_EXPIRES,
+	RSPAMD_HEADER_X_SOURCE,
+	RSPAMD_HEADER_X_SOURCE_IP,
+	RSPAMD_HEADER_X_ANTIABUSE,
+	RSPAMD_HEADER_OPENPGP,
+	RSPAMD_HEADER_AUTOCRYPT,
+	RSPAMD_HEADER_TLS_REQUIRED,
+	RSPAMD_HEADER_KNOWN_MAX
+};
+
+enum rspamd_mime_header_flags {
+	RSPAMD_MIME_HEADER_DECODED = (1 << 0),
+};
+
 struct rspamd_mime_header {
 	gchar *name;
 	gchar *value;
@@ -35,7 +158,9 @@ struct rspamd_mime_header {
 	gboolean empty_separator;
 	guint order;
 	gchar *separator;
-	gchar *decoded;
+	gchar *decoded; /* Use rspamd_mime_header_get_decoded to access it */
+	rspamd_mempool_t *pool;
+	enum rspamd_mime_header_flags flags;
 };
 
 /**
@@ -51,6 +176,26 @@ void rspamd_mime_headers_process (struct rspamd_task *task, GHashTable *target,
 		const gchar *in, gsize len,
 		gboolean check_newlines);
 
+/**
+ * Returns id of a known header (case insensitive) or -1 if header is unknown
+ * @param name header name
+ * @param len length of name
+ * @return enum rspamd_mime_header_known value or -1
+ */
+gint rspamd_mime_header_known_id (const gchar *name, gsize len);
+
+/**
+ * Returns canonical name of a known header
+ */
+const gchar * rspamd_mime_header_known_name (enum rspamd_mime_header_known id);
+
+/**
+ * Returns rfc2047 decoded value of a header decoding it on the first access
+ * @param rh header
+ * @return decoded and utf8 valid value
+ */
+gchar * rspamd_mime_header_get_decoded (struct rspamd_mime_header *rh);
+
 /**
  * Perform rfc2047 decoding of a header
  * @param pool
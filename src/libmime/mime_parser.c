@@ -19,11 +19,14 @@
 #include "mime_parser.h"
 #include "mime_headers.h"
 #include "message.h"
-#include "multipattern.h"
+#include "cryptobox.h"
 #include "contrib/libottery/ottery.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 struct rspamd_mime_parser_lib_ctx {
-	struct rspamd_multipattern *mp_boundary;
 	guchar hkey[rspamd_cryptobox_SIPKEYBYTES]; /* Key for hashing */
 	guint key_usages;
 } *lib_ctx = NULL;
@@ -53,6 +56,7 @@ struct rspamd_mime_parser_ctx {
 	const gchar *start;
 	const gchar *pos;
 	const gchar *end;
+	GPtrArray *digests; /* Decoded parts waiting for their digests */
 };
 
 static gboolean
@@ -131,11 +135,6 @@ static void
 rspamd_mime_parser_init_lib (void)
 {
 	lib_ctx = g_malloc0 (sizeof (*lib_ctx));
-	lib_ctx->mp_boundary = rspamd_multipattern_create (RSPAMD_MULTIPATTERN_DEFAULT);
-	g_assert (lib_ctx->mp_boundary != NULL);
-	rspamd_multipattern_add_pattern (lib_ctx->mp_boundary, "\r--", 0);
-	rspamd_multipattern_add_pattern (lib_ctx->mp_boundary, "\n--", 0);
-	g_assert (rspamd_multipattern_compile (lib_ctx->mp_boundary, NULL));
 	ottery_rand_bytes (lib_ctx->hkey, sizeof (lib_ctx->hkey));
 }
 
@@ -362,72 +361,101 @@ rspamd_mime_part_get_cd (struct rspamd_task *task, struct rspamd_mime_part *part
 	part->cd = cd;
 }
 
+/* Blake2b applied to string 'rspamd' */
+static const guchar rspamd_mime_digest_key[] = {
+		0xef,0x43,0xae,0x80,0xcc,0x8d,0xc3,0x4c,
+		0x6f,0x1b,0xd6,0x18,0x1b,0xae,0x87,0x74,
+		0x0c,0xca,0xf7,0x8e,0x5f,0x2e,0x54,0x32,
+		0xf6,0x79,0xb9,0x27,0x26,0x96,0x20,0x92,
+		0x70,0x07,0x85,0xeb,0x83,0xf7,0x89,0xe0,
+		0xd7,0x32,0x2a,0xd2,0x1a,0x64,0x41,0xef,
+		0x49,0xff,0xc3,0x8c,0x54,0xf9,0x67,0x74,
+		0x30,0x1e,0x70,0x2e,0xb7,0x12,0x09,0xfe,
+};
+
 static void
 rspamd_mime_parser_calc_digest (struct rspamd_mime_part *part)
 {
-	/* Blake2b applied to string 'rspamd' */
-	static const guchar hash_key[] = {
-			0xef,0x43,0xae,0x80,0xcc,0x8d,0xc3,0x4c,
-			0x6f,0x1b,0xd6,0x18,0x1b,0xae,0x87,0x74,
-			0x0c,0xca,0xf7,0x8e,0x5f,0x2e,0x54,0x32,
-			0xf6,0x79,0xb9,0x27,0x26,0x96,0x20,0x92,
-			0x70,0x07,0x85,0xeb,0x83,0xf7,0x89,0xe0,
-			0xd7,0x32,0x2a,0xd2,0x1a,0x64,0x41,0xef,
-			0x49,0xff,0xc3,0x8c,0x54,0xf9,0x67,0x74,
-			0x30,0x1e,0x70,0x2e,0xb7,0x12,0x09,0xfe,
-	};
-
 	if (part->parsed_data.len > 0) {
 		rspamd_cryptobox_hash (part->digest,
 				part->parsed_data.begin, part->parsed_data.len,
-				hash_key, sizeof (hash_key));
+				rspamd_mime_digest_key, sizeof (rspamd_mime_digest_key));
 	}
 }
 
+/*
+ * Calculates digests of several parts at once, so multi-buffer hashing
+ * could be used for messages with many parts
+ */
+static void
+rspamd_mime_parser_calc_digests (GPtrArray *parts)
+{
+	struct rspamd_mime_part *part;
+	guchar **out;
+	const guchar **data;
+	gsize *len;
+	guint i, n = 0;
+
+	if (parts->len == 0) {
+		return;
+	}
+
+	if (parts->len == 1) {
+		rspamd_mime_parser_calc_digest (g_ptr_array_index (parts, 0));
+		return;
+	}
+
+	out = g_malloc (parts->len * sizeof (*out));
+	data = g_malloc (parts->len * sizeof (*data));
+	len = g_malloc (parts->len * sizeof (*len));
+
+	for (i = 0; i < parts->len; i ++) {
+		part = g_ptr_array_index (parts, i);
+
+		if (part->parsed_data.len > 0) {
+			out[n] = part->digest;
+			data[n] = part->parsed_data.begin;
+			len[n] = part->parsed_data.len;
+			n ++;
+		}
+	}
+
+	rspamd_cryptobox_hash_multi (out, data, len, n,
+			rspamd_mime_digest_key, sizeof (rspamd_mime_digest_key));
+
+	g_free (out);
+	g_free (data);
+	g_free (len);
+}
+
+/* Decodes part's content, returns TRUE if it has been decoded by this call */
 static gboolean
-rspamd_mime_parse_normal_part (struct rspamd_task *task,
-		struct rspamd_mime_part *part,
-		struct rspamd_mime_parser_ctx *st,
-		GError **err)
+rspamd_mime_part_decode_data (struct rspamd_mime_part *part)
 {
+	rspamd_mempool_t *pool = part->pool;
 	rspamd_fstring_t *parsed;
 	gssize r;
 
-	g_assert (part != NULL);
+	if ((part->flags & RSPAMD_MIME_PART_DECODED) || pool == NULL) {
+		/* Already decoded or not a leaf part (e.g. multipart) */
+		return FALSE;
+	}
 
-	rspamd_mime_part_get_cte (task, part);
-	rspamd_mime_part_get_cd (task, part);
+	part->flags |= RSPAMD_MIME_PART_DECODED;
 
 	switch (part->cte) {
 	case RSPAMD_CTE_7BIT:
 	case RSPAMD_CTE_8BIT:
 	case RSPAMD_CTE_UNKNOWN:
-		if (part->ct->flags & RSPAMD_CONTENT_TYPE_MISSING) {
-			if (part->cte != RSPAMD_CTE_7BIT) {
-				/* We have something that has a missing content-type,
-				 * but it has non-7bit characters.
-				 *
-				 * In theory, it is very unsafe to process it as a text part
-				 * as we unlikely get some sane result
-				 */
-				part->ct->flags &= ~RSPAMD_CONTENT_TYPE_TEXT;
-				part->ct->flags |= RSPAMD_CONTENT_TYPE_BROKEN;
-			}
-		}
+		/*
+		 * Raw data is referenced as is: text charset fixups copy it on demand
+		 * (see RSPAMD_MIME_PART_BORROWED), so a mapped message is never copied
+		 */
+		part->parsed_data.begin = part->raw_data.begin;
+		part->parsed_data.len = part->raw_data.len;
 
 		if (IS_CT_TEXT (part->ct)) {
-			/* Need to copy text as we have couple of in-place change functions */
-			parsed = rspamd_fstring_sized_new (part->raw_data.len);
-			parsed->len = part->raw_data.len;
-			memcpy (parsed->str, part->raw_data.begin, parsed->len);
-			part->parsed_data.begin = parsed->str;
-			part->parsed_data.len = parsed->len;
-			rspamd_mempool_add_destructor (task->task_pool,
-					(rspamd_mempool_destruct_t)rspamd_fstring_free, parsed);
-		}
-		else {
-			part->parsed_data.begin = part->raw_data.begin;
-			part->parsed_data.len = part->raw_data.len;
+			part->flags |= RSPAMD_MIME_PART_BORROWED;
 		}
 		break;
 	case RSPAMD_CTE_QP:
@@ -438,18 +466,18 @@ rspamd_mime_parse_normal_part (struct rspamd_task *task,
 			parsed->len = r;
 			part->parsed_data.begin = parsed->str;
 			part->parsed_data.len = parsed->len;
-			rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_mempool_add_destructor (pool,
 					(rspamd_mempool_destruct_t)rspamd_fstring_free, parsed);
 		}
 		else {
-			msg_err_task ("invalid quoted-printable encoded part, assume 8bit");
+			msg_err_pool ("invalid quoted-printable encoded part, assume 8bit");
 			part->ct->flags |= RSPAMD_CONTENT_TYPE_BROKEN;
 			part->cte = RSPAMD_CTE_8BIT;
 			memcpy (parsed->str, part->raw_data.begin, part->raw_data.len);
 			parsed->len = part->raw_data.len;
 			part->parsed_data.begin = parsed->str;
 			part->parsed_data.len = parsed->len;
-			rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_mempool_add_destructor (pool,
 					(rspamd_mempool_destruct_t)rspamd_fstring_free, parsed);
 		}
 		break;
@@ -460,18 +488,291 @@ rspamd_mime_parse_normal_part (struct rspamd_task *task,
 				parsed->str, &parsed->len);
 		part->parsed_data.begin = parsed->str;
 		part->parsed_data.len = parsed->len;
-		rspamd_mempool_add_destructor (task->task_pool,
+		rspamd_mempool_add_destructor (pool,
 				(rspamd_mempool_destruct_t)rspamd_fstring_free, parsed);
 		break;
 	default:
 		g_assert_not_reached ();
 	}
 
+	return TRUE;
+}
+
+void
+rspamd_mime_part_decode (struct rspamd_mime_part *part)
+{
+	if (rspamd_mime_part_decode_data (part)) {
+		rspamd_mime_parser_calc_digest (part);
+	}
+}
+
+gsize
+rspamd_mime_part_peek (struct rspamd_mime_part *part, guchar *out, gsize outlen)
+{
+	gchar encoded[RSPAMD_MIME_PEEK_MAX / 3 * 4];
+	guchar decoded[RSPAMD_MIME_PEEK_MAX * 3];
+	const gchar *p, *end;
+	gsize nenc = 0, olen;
+	gssize r;
+
+	if (!(part->flags & RSPAMD_MIME_PART_DECODED) &&
+			outlen <= RSPAMD_MIME_PEEK_MAX) {
+		p = part->raw_data.begin;
+		end = p + part->raw_data.len;
+
+		switch (part->cte) {
+		case RSPAMD_CTE_B64:
+			/* Collect enough non-space characters to decode `outlen` bytes */
+			while (p < end && nenc < (outlen + 2) / 3 * 4) {
+				if (!g_ascii_isspace (*p)) {
+					encoded[nenc++] = *p;
+				}
+
+				p ++;
+			}
+
+			olen = sizeof (decoded);
+
+			if (rspamd_cryptobox_base64_decode (encoded, nenc - nenc % 4,
+					decoded, &olen)) {
+				olen = MIN (olen, outlen);
+				memcpy (out, decoded, olen);
+
+				return olen;
+			}
+			break;
+		case RSPAMD_CTE_QP:
+			/* Encoded data is at most three times longer than decoded */
+			r = rspamd_decode_qp_buf (part->raw_data.begin,
+					MIN (part->raw_data.len, outlen * 3),
+					(gchar *)decoded, sizeof (decoded));
+
+			if (r != -1) {
+				olen = MIN ((gsize)r, outlen);
+				memcpy (out, decoded, olen);
+
+				return olen;
+			}
+			break;
+		default:
+			olen = MIN (outlen, part->raw_data.len);
+			memcpy (out, part->raw_data.begin, olen);
+
+			return olen;
+		}
+	}
+
+	/* Fall back to decoding of the whole part */
+	rspamd_mime_part_decode (part);
+	olen = MIN (outlen, part->parsed_data.len);
+	memcpy (out, part->parsed_data.begin, olen);
+
+	return olen;
+}
+
+/* Number of base64 characters between index checkpoints */
+#define RSPAMD_MIME_READER_CHECKPOINT 4096
+
+struct rspamd_mime_part_reader {
+	const gchar *raw;
+	gsize raw_len;
+	/* Decoded data for parts that are not indexed */
+	const guchar *data;
+	gsize len;
+	/* Offsets in raw data of every RSPAMD_MIME_READER_CHECKPOINT characters */
+	GArray *index;
+};
+
+#define RSPAMD_MIME_B64_CHAR(c) (g_ascii_isalnum (c) || (c) == '+' || (c) == '/')
+
+struct rspamd_mime_part_reader *
+rspamd_mime_part_reader_new (struct rspamd_mime_part *part)
+{
+	struct rspamd_mime_part_reader *r;
+	gsize i, nchars = 0;
+	guint64 off;
+
+	r = rspamd_mempool_alloc0 (part->pool, sizeof (*r));
+
+	if (!(part->flags & RSPAMD_MIME_PART_DECODED) &&
+			part->cte == RSPAMD_CTE_B64) {
+		r->raw = part->raw_data.begin;
+		r->raw_len = part->raw_data.len;
+		r->index = g_array_sized_new (FALSE, FALSE, sizeof (guint64),
+				r->raw_len / RSPAMD_MIME_READER_CHECKPOINT + 1);
+		rspamd_mempool_add_destructor (part->pool,
+				rspamd_array_free_hard, r->index);
+
+		for (i = 0; i < r->raw_len; i ++) {
+			if (RSPAMD_MIME_B64_CHAR (r->raw[i])) {
+				if (nchars % RSPAMD_MIME_READER_CHECKPOINT == 0) {
+					off = i;
+					g_array_append_val (r->index, off);
+				}
+
+				nchars ++;
+			}
+		}
+
+		/* Padding is not counted, so partial quads give partial bytes */
+		r->len = nchars / 4 * 3 + (nchars % 4 > 1 ? nchars % 4 - 1 : 0);
+	}
+	else if (!(part->flags & RSPAMD_MIME_PART_DECODED) &&
+			part->cte != RSPAMD_CTE_QP) {
+		/* Raw data is the same as decoded one */
+		r->data = part->raw_data.begin;
+		r->len = part->raw_data.len;
+	}
+	else {
+		rspamd_mime_part_decode (part);
+		r->data = part->parsed_data.begin;
+		r->len = part->parsed_data.len;
+	}
+
+	return r;
+}
+
+gsize
+rspamd_mime_part_reader_size (struct rspamd_mime_part_reader *r)
+{
+	return r->len;
+}
+
+gsize
+rspamd_mime_part_reader_read (struct rspamd_mime_part_reader *r,
+		gsize offset, guchar *out, gsize len)
+{
+	gchar encoded[RSPAMD_MIME_READER_CHECKPOINT];
+	guchar decoded[RSPAMD_MIME_READER_CHECKPOINT / 4 * 3];
+	gsize pos, skip, nenc, olen, copied = 0, dec_off, want;
+	guint64 ckpt;
+
+	if (offset >= r->len) {
+		return 0;
+	}
+
+	len = MIN (len, r->len - offset);
+
+	if (r->index == NULL) {
+		memcpy (out, r->data + offset, len);
+
+		return len;
+	}
+
+	/* Start from the quad that contains the first requested byte */
+	ckpt = offset / 3 * 4 / RSPAMD_MIME_READER_CHECKPOINT;
+	pos = g_array_index (r->index, guint64, ckpt);
+	skip = offset / 3 * 4 - ckpt * RSPAMD_MIME_READER_CHECKPOINT;
+	dec_off = offset % 3;
+
+	while (pos < r->raw_len && skip > 0) {
+		if (RSPAMD_MIME_B64_CHAR (r->raw[pos])) {
+			skip --;
+		}
+
+		pos ++;
+	}
+
+	while (copied < len) {
+		/* Number of characters needed for the rest of the range */
+		want = (dec_off + len - copied + 2) / 3 * 4;
+		want = MIN (want, sizeof (encoded));
+		nenc = 0;
+
+		while (pos < r->raw_len && nenc < want) {
+			if (RSPAMD_MIME_B64_CHAR (r->raw[pos])) {
+				encoded[nenc++] = r->raw[pos];
+			}
+
+			pos ++;
+		}
+
+		if (nenc == 0) {
+			break;
+		}
+
+		olen = sizeof (decoded);
+		rspamd_cryptobox_base64_decode (encoded, nenc, decoded, &olen);
+
+		if (olen <= dec_off) {
+			break;
+		}
+
+		olen = MIN (olen - dec_off, len - copied);
+		memcpy (out + copied, decoded + dec_off, olen);
+		copied += olen;
+		dec_off = 0;
+	}
+
+	return copied;
+}
+
+#undef RSPAMD_MIME_B64_CHAR
+
+static gboolean
+rspamd_mime_parse_normal_part (struct rspamd_task *task,
+		struct rspamd_mime_part *part,
+		struct rspamd_mime_parser_ctx *st,
+		GError **err)
+{
+	rspamd_ftok_t srch;
+
+	g_assert (part != NULL);
+
+	rspamd_mime_part_get_cte (task, part);
+	rspamd_mime_part_get_cd (task, part);
+	part->pool = task->task_pool;
+
+	if (part->cte == RSPAMD_CTE_QP || part->cte == RSPAMD_CTE_B64) {
+		task->decoded_bytes += part->raw_data.len;
+
+		if (task->cfg && task->cfg->max_decoded_size > 0 &&
+				task->decoded_bytes > task->cfg->max_decoded_size) {
+			/* Leave part undecoded, it is treated as an empty one */
+			rspamd_task_budget_exceeded (task, RSPAMD_TASK_BUDGET_DECODED,
+					"decoded_size");
+			part->flags |= RSPAMD_MIME_PART_DECODED;
+			part->parsed_data.begin = part->raw_data.begin;
+			part->parsed_data.len = 0;
+		}
+	}
+
+	if ((part->cte == RSPAMD_CTE_8BIT || part->cte == RSPAMD_CTE_UNKNOWN) &&
+			(part->ct->flags & RSPAMD_CONTENT_TYPE_MISSING)) {
+		/* We have something that has a missing content-type,
+		 * but it has non-7bit characters.
+		 *
+		 * In theory, it is very unsafe to process it as a text part
+		 * as we unlikely get some sane result
+		 */
+		part->ct->flags &= ~RSPAMD_CONTENT_TYPE_TEXT;
+		part->ct->flags |= RSPAMD_CONTENT_TYPE_BROKEN;
+	}
+
 	g_ptr_array_add (task->parts, part);
-	msg_debug_mime ("parsed data part %T/%T of length %z (%z orig), %s cte",
-			&part->ct->type, &part->ct->subtype, part->parsed_data.len,
-			part->raw_data.len, rspamd_cte_to_string (part->cte));
-	rspamd_mime_parser_calc_digest (part);
+	RSPAMD_FTOK_ASSIGN (&srch, "image");
+
+	/*
+	 * Text, images and nested messages are always processed, other parts
+	 * are decoded on the first access via `rspamd_mime_part_decode`
+	 */
+	if (IS_CT_TEXT (part->ct) || IS_CT_MESSAGE (part->ct) ||
+			rspamd_ftok_cmp (&part->ct->type, &srch) == 0) {
+		/* Digests are calculated for all parts when parsing is finished */
+		if (rspamd_mime_part_decode_data (part)) {
+			g_ptr_array_add (st->digests, part);
+		}
+
+		msg_debug_mime ("parsed data part %T/%T of length %z (%z orig), %s cte",
+				&part->ct->type, &part->ct->subtype, part->parsed_data.len,
+				part->raw_data.len, rspamd_cte_to_string (part->cte));
+	}
+	else {
+		msg_debug_mime ("deferred decoding of data part %T/%T of length %z, "
+				"%s cte",
+				&part->ct->type, &part->ct->subtype,
+				part->raw_data.len, rspamd_cte_to_string (part->cte));
+	}
 
 	return TRUE;
 }
@@ -614,6 +915,14 @@ rspamd_mime_parse_multipart_cb (struct rspamd_task *task,
 			/* We should have seen some boundary */
 			g_assert (cb->cur_boundary != NULL);
 
+			if (task->cfg && task->cfg->max_mime_parts > 0 &&
+					task->parts->len >= task->cfg->max_mime_parts) {
+				/* Ignore the rest of parts */
+				rspamd_task_budget_exceeded (task, RSPAMD_TASK_BUDGET_PARTS,
+						"mime_parts");
+
+				return TRUE;
+			}
 
 			if (!rspamd_mime_process_multipart_node (task, cb->st,
 					cb->multipart, cb->part_start, pos, cb->err)) {
@@ -782,21 +1091,20 @@ rspamd_mime_parse_multipart_part (struct rspamd_task *task,
 }
 
 /* Process boundary like structures in a message */
-static gint
-rspamd_mime_preprocess_cb (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
+/*
+ * Handles a line starting with `--`, `pos` points just after the dashes
+ */
+static void
+rspamd_mime_preprocess_boundary (struct rspamd_mime_parser_ctx *st,
 		const gchar *text,
 		gsize len,
-		void *context)
+		gsize pos)
 {
-	const gchar *end = text + len, *p = text + match_pos, *bend;
+	const gchar *end = text + len, *p = text + pos, *bend;
 	gchar *lc_copy;
 	gsize blen;
 	gboolean closing = FALSE;
 	struct rspamd_mime_boundary b;
-	struct rspamd_mime_parser_ctx *st = context;
 
 	if (G_LIKELY (p < end)) {
 		blen = rspamd_memcspn (p, "\r\n", end - p);
@@ -866,8 +1174,53 @@ rspamd_mime_preprocess_cb (struct rspamd_multipattern *mp,
 			g_array_append_val (st->boundaries, b);
 		}
 	}
+}
+
+/*
+ * Boundaries can only start after a line break, so we look for `\r--` and
+ * `\n--` only: with SSE2 we test 16 candidate positions per iteration
+ * and visit nothing but real matches
+ */
+static void
+rspamd_mime_scan_boundaries (struct rspamd_mime_parser_ctx *st,
+		const gchar *text,
+		gsize len)
+{
+	gsize i = 0;
+
+#ifdef __SSE2__
+	const __m128i lf = _mm_set1_epi8 ('\n'), cr = _mm_set1_epi8 ('\r'),
+			dash = _mm_set1_epi8 ('-');
+	__m128i v0, v1, v2, m;
+	guint mask;
+
+	while (i + 18 <= len) {
+		v0 = _mm_loadu_si128 ((const __m128i *)(text + i));
+		v1 = _mm_loadu_si128 ((const __m128i *)(text + i + 1));
+		v2 = _mm_loadu_si128 ((const __m128i *)(text + i + 2));
+		m = _mm_or_si128 (_mm_cmpeq_epi8 (v0, lf), _mm_cmpeq_epi8 (v0, cr));
+		m = _mm_and_si128 (m, _mm_and_si128 (_mm_cmpeq_epi8 (v1, dash),
+				_mm_cmpeq_epi8 (v2, dash)));
+		mask = _mm_movemask_epi8 (m);
+
+		while (mask) {
+			rspamd_mime_preprocess_boundary (st, text, len,
+					i + __builtin_ctz (mask) + 3);
+			mask &= mask - 1;
+		}
+
+		i += 16;
+	}
+#endif
 
-	return 0;
+	while (i + 3 <= len) {
+		if ((text[i] == '\n' || text[i] == '\r') &&
+				text[i + 1] == '-' && text[i + 2] == '-') {
+			rspamd_mime_preprocess_boundary (st, text, len, i + 3);
+		}
+
+		i ++;
+	}
 }
 
 static goffset
@@ -943,16 +1296,11 @@ rspamd_mime_preprocess_message (struct rspamd_task *task,
 {
 
 	if (top->raw_data.begin >= st->pos) {
-		rspamd_multipattern_lookup (lib_ctx->mp_boundary,
-				top->raw_data.begin - 1,
-				top->raw_data.len + 1,
-				rspamd_mime_preprocess_cb, st, NULL);
+		rspamd_mime_scan_boundaries (st, top->raw_data.begin - 1,
+				top->raw_data.len + 1);
 	}
 	else {
-		rspamd_multipattern_lookup (lib_ctx->mp_boundary,
-				st->pos,
-				st->end - st->pos,
-				rspamd_mime_preprocess_cb, st, NULL);
+		rspamd_mime_scan_boundaries (st, st->pos, st->end - st->pos);
 	}
 }
 
@@ -1175,6 +1523,7 @@ rspamd_mime_parse_stack_free (struct rspamd_mime_parser_ctx *st)
 	if (st) {
 		g_ptr_array_free (st->stack, TRUE);
 		g_array_free (st->boundaries, TRUE);
+		g_ptr_array_free (st->digests, TRUE);
 		g_slice_free1 (sizeof (*st), st);
 	}
 }
@@ -1201,6 +1550,7 @@ rspamd_mime_parse_task (struct rspamd_task *task, GError **err)
 	st->end = task->msg.begin + task->msg.len;
 	st->boundaries = g_array_sized_new (FALSE, FALSE,
 			sizeof (struct rspamd_mime_boundary), 8);
+	st->digests = g_ptr_array_new ();
 
 	if (st->pos == NULL) {
 		st->pos = task->msg.begin;
@@ -1208,6 +1558,7 @@ rspamd_mime_parse_task (struct rspamd_task *task, GError **err)
 
 	st->start = task->msg.begin;
 	ret = rspamd_mime_parse_message (task, NULL, st, err);
+	rspamd_mime_parser_calc_digests (st->digests);
 	rspamd_mime_parse_stack_free (st);
 
 	return ret;
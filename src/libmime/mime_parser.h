@@ -19,7 +19,53 @@
 #include "config.h"
 
 struct rspamd_task;
+struct rspamd_mime_part;
+
+/* Maximum number of bytes that could be peeked without full decoding */
+#define RSPAMD_MIME_PEEK_MAX 48
 
 gboolean rspamd_mime_parse_task (struct rspamd_task *task, GError **err);
 
+/**
+ * Decodes content transfer encoding of the part if it has not been done yet
+ * and calculates its digest
+ * @param part
+ */
+void rspamd_mime_part_decode (struct rspamd_mime_part *part);
+
+/**
+ * Copies up to `outlen` first decoded bytes of the part to `out` trying to
+ * avoid decoding of the whole part
+ * @param part
+ * @param out
+ * @param outlen
+ * @return number of bytes copied
+ */
+gsize rspamd_mime_part_peek (struct rspamd_mime_part *part, guchar *out,
+		gsize outlen);
+
+/*
+ * Random access to decoded content of a part: base64 parts are indexed
+ * without decoding, so only the requested ranges are decoded
+ */
+struct rspamd_mime_part_reader;
+
+/**
+ * Create reader for a part, it is allocated in the part's pool
+ */
+struct rspamd_mime_part_reader *rspamd_mime_part_reader_new (
+		struct rspamd_mime_part *part);
+
+/**
+ * Returns length of decoded content
+ */
+gsize rspamd_mime_part_reader_size (struct rspamd_mime_part_reader *r);
+
+/**
+ * Copies up to `len` decoded bytes starting from `offset` to `out`
+ * @return number of bytes copied
+ */
+gsize rspamd_mime_part_reader_read (struct rspamd_mime_part_reader *r,
+		gsize offset, guchar *out, gsize len);
+
 #endif /* SRC_LIBMIME_MIME_PARSER_H_ */
@@ -33,6 +33,8 @@ struct worker_s;
 struct rspamd_external_libs_ctx;
 struct rspamd_cryptobox_pubkey;
 struct rspamd_dns_resolver;
+struct rspamd_shared_cache;
+struct rspamd_result_cache;
 
 enum { VAL_UNDEF=0, VAL_TRUE, VAL_FALSE };
 
@@ -182,6 +184,9 @@ struct rspamd_worker_lua_script {
 /**
  * Config params for rspamd worker
  */
+/* Keep the inherited priority unless it is defined for the worker */
+#define RSPAMD_WORKER_NICE_UNSET G_MAXINT
+
 struct rspamd_worker_conf {
 	struct worker_s *worker;                        /**< pointer to worker type								*/
 	GQuark type;                                    /**< type of worker										*/
@@ -190,6 +195,9 @@ struct rspamd_worker_conf {
 	GList *listen_socks;                            /**< listening sockets desctiptors						*/
 	guint32 rlimit_nofile;                          /**< max files limit									*/
 	guint32 rlimit_maxcore;                         /**< maximum core file size								*/
+	gchar *cpu_affinity;                            /**< cpus or numa nodes to bind workers to				*/
+	gint nice;                                      /**< scheduling priority of workers					*/
+	gchar *io_priority;                             /**< io scheduling class and level of workers			*/
 	GHashTable *params;                             /**< params for worker									*/
 	GQueue *active_workers;                         /**< linked list of spawned workers						*/
 	gboolean has_socket;                            /**< whether we should make listening socket in main process */
@@ -284,6 +292,7 @@ struct rspamd_config {
 	gchar *rspamd_group;                            /**< group to run as									*/
 	rspamd_mempool_t *cfg_pool;                     /**< memory pool for config								*/
 	gchar *cfg_name;                                /**< name of config file								*/
+	gchar *cfg_snapshot;                            /**< cached parsed config file							*/
 	gchar *pid_file;                                /**< name of pid file									*/
 	gchar *temp_dir;                                /**< dir for temp files									*/
 	gchar *control_socket_path;                     /**< path to the control socket							*/
@@ -298,9 +307,19 @@ struct rspamd_config {
 	gboolean convert_config;                        /**< convert config to XML format						*/
 	gboolean strict_protocol_headers;               /**< strictly check protocol headers					*/
 	gboolean check_all_filters;                     /**< check all filters									*/
+	gboolean reload_wait_ready;                     /**< stop old workers when new ones are ready		*/
+	gdouble reload_ready_timeout;                   /**< maximum time to wait for new workers			*/
+	gboolean fork_preload;                          /**< load read-only data before forking workers		*/
+	gboolean startup_profile;                       /**< log time spent to init each module				*/
+	GArray *init_timings;                           /**< time spent to init modules						*/
+	gboolean early_verdict;                         /**< skip async rules that cannot change action			*/
+	gboolean envelope_prefilters;                   /**< start envelope prefilters before parsing			*/
 	gboolean allow_raw_input;                       /**< scan messages with invalid mime					*/
 	gboolean disable_hyperscan;                     /**< disable hyperscan usage							*/
 	gboolean vectorized_hyperscan;                  /**< use vectorized hyperscan matching					*/
+	gboolean vectorized_hyperscan_body;             /**< use vectorized hyperscan matching for body classes	*/
+	gboolean mmap_hyperscan;                        /**< share mapped hyperscan databases between workers	*/
+	gboolean huge_pages;                            /**< advise huge pages for large allocations			*/
 	gboolean enable_shutdown_workaround;            /**< enable workaround for legacy SA clients (exim)		*/
 	gboolean ignore_received;                       /**< Ignore data from the first received header			*/
 	gboolean check_local;				/** Don't disable any checks for local networks */
@@ -313,6 +332,11 @@ struct rspamd_config {
 	gsize max_message;                              /**< maximum size for messages							*/
 	gsize max_pic_size;                             /**< maximum size for a picture to process				*/
 	gsize images_cache_size;                        /**< size of LRU cache for DCT data from images			*/
+	guint images_shared_cache_size;					/**< size of DCT cache for all workers					*/
+	struct rspamd_shared_cache *images_shared_cache; /**< DCT cache for all workers				*/
+	guint stat_shared_tokens_size;					/**< number of messages in shared tokens cache			*/
+	guint stat_shared_tokens_ttl;					/**< time to keep tokens of a message					*/
+	struct rspamd_shared_cache *stat_shared_tokens; /**< tokens cache for all workers				*/
 	gint default_max_shots;                         /**< default maximum count of symbols hits permitted (-1 for unlimited) */
 
 	enum rspamd_log_type log_type;                  /**< log type											*/
@@ -321,6 +345,7 @@ struct rspamd_config {
 	gchar *log_file;                                /**< path to logfile in case of file logging			*/
 	gboolean log_buffered;                          /**< whether logging is buffered						*/
 	guint32 log_buf_size;                           /**< length of log buffer								*/
+	guint32 log_ring_size;                          /**< size of per worker log ring (0 to disable)			*/
 	const ucl_object_t *debug_ip_map;               /**< turn on debugging for specified ip addresses       */
 	gboolean log_urls;                              /**< whether we should log URLs                         */
 	GList *debug_symbols;                           /**< symbols to debug									*/
@@ -358,6 +383,7 @@ struct rspamd_config {
 	GHashTable * metrics_symbols;                   /**< hash table of metrics indexed by symbol			*/
 	GHashTable * c_modules;                         /**< hash of c modules indexed by module name			*/
 	GHashTable * composite_symbols;                 /**< hash of composite symbols indexed by its name		*/
+	struct rspamd_composites_index *composites_index; /**< composites indexed by referenced symbols	*/
 	GList *classifiers;                             /**< list of all classifiers defined                    */
 	GList *statfiles;                               /**< list of all statfiles in config file order         */
 	GHashTable *classifiers_symbols;                /**< hashtable indexed by symbol name of classifiers    */
@@ -376,11 +402,13 @@ struct rspamd_config {
 	struct symbols_cache *cache;                    /**< symbols cache object								*/
 	gchar *cache_filename;                          /**< filename of cache file								*/
 	gdouble cache_reload_time;                      /**< how often cache reload should be performed			*/
+	guint symbols_profile_sample;                   /**< profile symbols for 1 of N tasks (0 to disable)	*/
 	struct rspamd_metric *default_metric;           /**< default metric										*/
 
 	gchar * checksum;                               /**< real checksum of config file						*/
 	gchar * dump_checksum;                          /**< dump checksum of config file						*/
 	gpointer lua_state;                             /**< pointer to lua state								*/
+	gpointer lua_thread_pool;                       /**< pool of lua coroutines								*/
 
 	gchar * rrd_file;                               /**< rrd file to store statistics						*/
 	gchar * history_file;                           /**< file to save rolling history						*/
@@ -396,16 +424,30 @@ struct rspamd_config {
 	const ucl_object_t *nameservers;                /**< list of nameservers or NULL to parse resolv.conf	*/
 	guint32 dns_max_requests;                       /**< limit of DNS requests per task 					*/
 	gboolean enable_dnssec;                         /**< enable dnssec stub resolver						*/
+	guint32 dns_cache_size;                         /**< number of cached DNS replies per worker			*/
+	gdouble dns_cache_max_ttl;                      /**< maximum time to cache DNS replies					*/
+	gdouble dns_cache_negative_ttl;                 /**< time to cache negative DNS replies					*/
+
+	guint result_cache_size;						/**< number of scan results cached by each worker		*/
+	gdouble result_cache_ttl;						/**< time to keep cached scan results					*/
+	const ucl_object_t *result_cache_redis;			/**< redis servers for the shared results cache			*/
+	struct rspamd_result_cache *result_cache;		/**< results cache of the current process				*/
 
 	guint upstream_max_errors;						/**< upstream max errors before shutting off			*/
 	gdouble upstream_error_time;					/**< rate of upstream errors							*/
 	gdouble upstream_revive_time;					/**< revive timeout for upstreams						*/
+	guint upstream_virtual_nodes;					/**< points per upstream in hash ring					*/
 	struct upstream_ctx *ups_ctx;					/**< upstream context									*/
 	struct rspamd_dns_resolver *dns_resolver;		/**< dns resolver if loaded								*/
 
 	guint min_word_len;								/**< minimum length of the word to be considered		*/
 	guint max_word_len;								/**< maximum length of the word to be considered		*/
 	guint words_decay;								/**< limit for words for starting adaptive ignoring		*/
+	guint max_mime_parts;							/**< maximum number of mime parts per task (0 - unlimited)	*/
+	gsize max_decoded_size;							/**< maximum size of encoded parts to decode per task	*/
+	guint max_html_tags;							/**< maximum number of html tags parsed per part		*/
+	guint max_urls;									/**< maximum number of urls extracted per task			*/
+	gsize max_re_scan;								/**< maximum bytes scanned by regexps of one class		*/
 	guint history_rows;								/**< number of history rows stored						*/
 
 	GList *classify_headers;						/**< list of headers using for statistics				*/
@@ -422,6 +464,8 @@ struct rspamd_config {
 	struct rspamd_re_cache *re_cache;				/**< static regexp cache								*/
 
 	GHashTable *trusted_keys;						/**< list of trusted public keys						*/
+	guint keypair_shared_cache_size;				/**< size of shared secrets cache for all workers		*/
+	struct rspamd_shared_cache *keypair_shared_cache; /**< shared secrets cache for all workers	*/
 
 	struct rspamd_config_post_load_script *on_load;	/**< list of scripts executed on config load			*/
 
@@ -580,6 +624,15 @@ void rspamd_ucl_add_conf_variables (struct ucl_parser *parser, GHashTable *vars)
  */
 gboolean rspamd_init_filters (struct rspamd_config *cfg, bool reconfig);
 
+/**
+ * Adds time spent to initialize the specified module to the startup profile
+ * @param cfg
+ * @param name module name
+ * @param elapsed time in seconds
+ */
+void rspamd_config_add_init_timing (struct rspamd_config *cfg,
+		const gchar *name, gdouble elapsed);
+
 /**
  * Add new symbol to the metric
  * @param cfg
@@ -1769,6 +1769,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, log_buf_size),
 			RSPAMD_CL_FLAG_INT_32,
 			"Size of log buffer in bytes (for file logging)");
+	rspamd_rcl_add_default_handler (sub,
+			"log_ring",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, log_ring_size),
+			RSPAMD_CL_FLAG_INT_32,
+			"Size of per worker shared ring for log lines that are written "
+			"by the main process (for file logging, 0 to disable)");
 	rspamd_rcl_add_default_handler (sub,
 			"log_urls",
 			rspamd_rcl_parse_struct_boolean,
@@ -1872,6 +1879,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, cache_reload_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"How often cache reload should be performed");
+	rspamd_rcl_add_default_handler (sub,
+			"symbols_profile_sample",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, symbols_profile_sample),
+			RSPAMD_CL_FLAG_UINT,
+			"Profile symbols callbacks for 1 of N tasks (0 to disable)");
 	/* Old DNS configuration */
 	rspamd_rcl_add_default_handler (sub,
 			"dns_nameserver",
@@ -2029,12 +2042,55 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, check_all_filters),
 			0,
 			"Always check all filters");
+	rspamd_rcl_add_default_handler (sub,
+			"reload_wait_ready",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, reload_wait_ready),
+			0,
+			"On reload, keep old normal workers until new ones are ready");
+	rspamd_rcl_add_default_handler (sub,
+			"reload_ready_timeout",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, reload_ready_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Maximum time to wait for new workers to get ready (30 seconds by default)");
+	rspamd_rcl_add_default_handler (sub,
+			"fork_preload",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, fork_preload),
+			0,
+			"Load file maps and hyperscan databases in the main process, "
+			"so workers share them after fork (true by default)");
+	rspamd_rcl_add_default_handler (sub,
+			"startup_profile",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, startup_profile),
+			0,
+			"Log time spent to initialize each module on startup and reload");
 	rspamd_rcl_add_default_handler (sub,
 			"all_filters",
 			rspamd_rcl_parse_struct_boolean,
 			G_STRUCT_OFFSET (struct rspamd_config, check_all_filters),
 			0,
 			"Always check all filters");
+	rspamd_rcl_add_default_handler (sub,
+			"early_verdict",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, early_verdict),
+			0,
+			"Skip asynchronous rules when they cannot change the action");
+	rspamd_rcl_add_default_handler (sub,
+			"envelope_prefilters",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, envelope_prefilters),
+			0,
+			"Start prefilters that need envelope only before parsing a message");
+	rspamd_rcl_add_default_handler (sub,
+			"keypair_shared_cache_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, keypair_shared_cache_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Size of encryption shared secrets cache shared by all workers (0 to disable)");
 	rspamd_rcl_add_default_handler (sub,
 			"min_word_len",
 			rspamd_rcl_parse_struct_integer,
@@ -2053,6 +2109,54 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, words_decay),
 			RSPAMD_CL_FLAG_UINT,
 			"Start skipping words at this amount");
+	rspamd_rcl_add_default_handler (sub,
+			"max_mime_parts",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, max_mime_parts),
+			RSPAMD_CL_FLAG_UINT,
+			"Maximum number of MIME parts processed in a message, 0 to disable (1024 by default)");
+	rspamd_rcl_add_default_handler (sub,
+			"max_decoded_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, max_decoded_size),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Maximum total size of encoded parts decoded in a message, 0 to disable (100Mb by default)");
+	rspamd_rcl_add_default_handler (sub,
+			"max_html_tags",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, max_html_tags),
+			RSPAMD_CL_FLAG_UINT,
+			"Maximum number of HTML tags parsed in a part, 0 to disable (100000 by default)");
+	rspamd_rcl_add_default_handler (sub,
+			"max_urls",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, max_urls),
+			RSPAMD_CL_FLAG_UINT,
+			"Maximum number of URLs extracted from a message, 0 to disable (10000 by default)");
+	rspamd_rcl_add_default_handler (sub,
+			"result_cache_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, result_cache_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of results of content symbols cached by each worker for identical messages, 0 to disable (disabled by default)");
+	rspamd_rcl_add_default_handler (sub,
+			"result_cache_ttl",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, result_cache_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to keep cached results of content symbols (10 minutes by default)");
+	rspamd_rcl_add_default_handler (sub,
+			"result_cache_redis",
+			rspamd_rcl_parse_struct_ucl,
+			G_STRUCT_OFFSET (struct rspamd_config, result_cache_redis),
+			0,
+			"Redis servers used as a shared tier of the results cache");
+	rspamd_rcl_add_default_handler (sub,
+			"max_re_scan",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, max_re_scan),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Maximum bytes scanned by regexps of one class per message, 0 to disable (128Mb by default)");
 	rspamd_rcl_add_default_handler (sub,
 			"url_tld",
 			rspamd_rcl_parse_struct_string,
@@ -2083,12 +2187,31 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, disable_hyperscan),
 			0,
 			"Disable hyperscan optimizations for regular expressions");
+	rspamd_rcl_add_default_handler (sub,
+			"huge_pages",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, huge_pages),
+			0,
+			"Use transparent huge pages for large shared memory chunks and "
+			"hyperscan databases");
 	rspamd_rcl_add_default_handler (sub,
 			"vectorized_hyperscan",
 			rspamd_rcl_parse_struct_boolean,
 			G_STRUCT_OFFSET (struct rspamd_config, vectorized_hyperscan),
 			0,
 			"Use hyperscan in vectorized mode (experimental)");
+	rspamd_rcl_add_default_handler (sub,
+			"vectorized_hyperscan_body",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, vectorized_hyperscan_body),
+			0,
+			"Scan all text parts by a single hyperscan call for body classes");
+	rspamd_rcl_add_default_handler (sub,
+			"mmap_hyperscan",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, mmap_hyperscan),
+			0,
+			"Map precompiled hyperscan databases to share them between workers");
 	rspamd_rcl_add_default_handler (sub,
 			"cores_dir",
 			rspamd_rcl_parse_struct_string,
@@ -2170,9 +2293,28 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 	rspamd_rcl_add_default_handler (sub,
 			"images_cache",
 			rspamd_rcl_parse_struct_integer,
-			G_STRUCT_OFFSET (struct rspamd_config, max_pic_size),
+			G_STRUCT_OFFSET (struct rspamd_config, images_cache_size),
 			RSPAMD_CL_FLAG_INT_SIZE,
 			"Size of DCT data cache for images (256 elements by default)");
+	rspamd_rcl_add_default_handler (sub,
+			"images_shared_cache",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, images_shared_cache_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Size of DCT data cache for images shared by all workers (0 to disable)");
+	rspamd_rcl_add_default_handler (sub,
+			"stat_tokens_shared_cache",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, stat_shared_tokens_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of tokenized messages shared by all workers, so learning "
+			"after scan does not tokenize a message again (0 to disable)");
+	rspamd_rcl_add_default_handler (sub,
+			"stat_tokens_shared_ttl",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, stat_shared_tokens_ttl),
+			RSPAMD_CL_FLAG_UINT,
+			"Time in seconds to keep tokens in the shared cache (60 by default)");
 	rspamd_rcl_add_default_handler (sub,
 			"zstd_input_dictionary",
 			rspamd_rcl_parse_struct_string,
@@ -2252,6 +2394,24 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, enable_dnssec),
 			0,
 			"Enable DNSSEC support in Rspamd");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_size),
+			RSPAMD_CL_FLAG_INT_32,
+			"Number of DNS replies cached by each worker (0 to disable)");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_max_ttl",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_max_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Maximum time to cache DNS replies (lower TTLs are respected)");
+	rspamd_rcl_add_default_handler (ssub,
+			"cache_negative_ttl",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, dns_cache_negative_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Time to cache NXDOMAIN and empty DNS replies");
 
 
 	/* New upstreams configuration */
@@ -2277,6 +2437,13 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, upstream_revive_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Time before attempting to recover upstream after an error");
+	rspamd_rcl_add_default_handler (ssub,
+			"virtual_nodes",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, upstream_virtual_nodes),
+			RSPAMD_CL_FLAG_UINT,
+			"Use hash ring with this number of points per upstream weight unit "
+			"for hashed rotation (0 to use jump hash over alive upstreams)");
 
 	/**
 	 * Metric section
@@ -2398,6 +2565,27 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_worker_conf, rlimit_maxcore),
 			RSPAMD_CL_FLAG_INT_32,
 			"Max size of core file in bytes");
+	rspamd_rcl_add_default_handler (sub,
+			"cpu_affinity",
+			rspamd_rcl_parse_struct_string,
+			G_STRUCT_OFFSET (struct rspamd_worker_conf, cpu_affinity),
+			0,
+			"Bind workers to cpus: `true` for one core per worker, a list of "
+			"cores (`0-3,8`), `nodeN` for all cores of a numa node or `numa` "
+			"to spread workers over numa nodes");
+	rspamd_rcl_add_default_handler (sub,
+			"nice",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_worker_conf, nice),
+			0,
+			"Scheduling priority of workers (10 for helper workers by default)");
+	rspamd_rcl_add_default_handler (sub,
+			"io_priority",
+			rspamd_rcl_parse_struct_string,
+			G_STRUCT_OFFSET (struct rspamd_worker_conf, io_priority),
+			0,
+			"IO priority of workers: `idle`, `best-effort[:level]` or "
+			"`realtime[:level]` (`best-effort:7` for helper workers by default)");
 
 	/**
 	 * Modules handler
@@ -3524,20 +3712,436 @@ rspamd_rcl_section_free (gpointer p)
 	}
 }
 
-gboolean
-rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
-	const gchar *convert_to, rspamd_rcl_section_fin_t logger_fin,
-	gpointer logger_ud, GHashTable *vars)
+/*
+ * Config snapshot stores the parsed UCL tree in a binary form, so it could be
+ * loaded without parsing of all included files. It is keyed by the names,
+ * sizes and mtimes of all files in the config directory and by ucl variables
+ */
+#define RSPAMD_RCL_SNAPSHOT_MAGIC "rscs"
+#define RSPAMD_RCL_SNAPSHOT_VERSION 1
+#define RSPAMD_RCL_SNAPSHOT_MAX_DEPTH 64
+
+struct rspamd_rcl_snapshot_hdr {
+	gchar magic[4];
+	guint32 version;
+	guchar key[rspamd_cryptobox_HASHBYTES];
+};
+
+struct rspamd_rcl_snapshot_elt {
+	guint8 type;
+	guint8 flags;
+	guint16 priority;
+	guint32 keylen;
+	guint64 len; /* length of string or number of children */
+};
+
+static gint
+rspamd_rcl_snapshot_cmp_names (gconstpointer a, gconstpointer b)
+{
+	return strcmp (*(const gchar **)a, *(const gchar **)b);
+}
+
+static void
+rspamd_rcl_snapshot_hash_dir (struct rspamd_config *cfg,
+		rspamd_cryptobox_hash_state_t *hs, const gchar *dir, guint depth)
+{
+	GDir *d;
+	GPtrArray *names;
+	const gchar *name;
+	gchar *path;
+	struct stat st;
+	gint64 tmp;
+	guint i;
+
+	if (depth > RSPAMD_RCL_SNAPSHOT_MAX_DEPTH ||
+			(d = g_dir_open (dir, 0, NULL)) == NULL) {
+		return;
+	}
+
+	names = g_ptr_array_new_full (32, g_free);
+
+	while ((name = g_dir_read_name (d)) != NULL) {
+		g_ptr_array_add (names, g_strdup (name));
+	}
+
+	g_dir_close (d);
+	/* Order of entries is not defined */
+	g_ptr_array_sort (names, rspamd_rcl_snapshot_cmp_names);
+
+	PTR_ARRAY_FOREACH (names, i, name) {
+		path = g_build_filename (dir, name, NULL);
+
+		if (strcmp (path, cfg->cfg_snapshot) != 0 && stat (path, &st) != -1) {
+			if (S_ISDIR (st.st_mode)) {
+				rspamd_rcl_snapshot_hash_dir (cfg, hs, path, depth + 1);
+			}
+			else if (S_ISREG (st.st_mode)) {
+				rspamd_cryptobox_hash_update (hs, path, strlen (path) + 1);
+				tmp = st.st_size;
+				rspamd_cryptobox_hash_update (hs, (const guchar *)&tmp,
+						sizeof (tmp));
+				tmp = st.st_mtime;
+				rspamd_cryptobox_hash_update (hs, (const guchar *)&tmp,
+						sizeof (tmp));
+			}
+		}
+
+		g_free (path);
+	}
+
+	g_ptr_array_free (names, TRUE);
+}
+
+static void
+rspamd_rcl_snapshot_key (struct rspamd_config *cfg, const gchar *filename,
+		GHashTable *vars, guchar *key)
+{
+	rspamd_cryptobox_hash_state_t hs;
+	GHashTableIter it;
+	GPtrArray *names;
+	gpointer k, v;
+	const gchar *name, *value;
+	gchar *dir;
+	guint i;
+
+	rspamd_cryptobox_hash_init (&hs, NULL, 0);
+	rspamd_cryptobox_hash_update (&hs, RVERSION, sizeof (RVERSION));
+	rspamd_cryptobox_hash_update (&hs, filename, strlen (filename) + 1);
+
+	if (vars) {
+		names = g_ptr_array_new ();
+		g_hash_table_iter_init (&it, vars);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			g_ptr_array_add (names, k);
+		}
+
+		g_ptr_array_sort (names, rspamd_rcl_snapshot_cmp_names);
+
+		PTR_ARRAY_FOREACH (names, i, name) {
+			value = g_hash_table_lookup (vars, name);
+			rspamd_cryptobox_hash_update (&hs, name, strlen (name) + 1);
+			rspamd_cryptobox_hash_update (&hs, value, strlen (value) + 1);
+		}
+
+		g_ptr_array_free (names, TRUE);
+	}
+
+	dir = g_path_get_dirname (filename);
+	rspamd_rcl_snapshot_hash_dir (cfg, &hs, dir, 0);
+	g_free (dir);
+	rspamd_cryptobox_hash_final (&hs, key);
+}
+
+static void
+rspamd_rcl_snapshot_write_elt (GString *out, const ucl_object_t *obj)
+{
+	struct rspamd_rcl_snapshot_elt elt;
+	const ucl_object_t *cur, *celt;
+	ucl_object_iter_t it = NULL;
+	gint64 iv;
+	gdouble dv;
+	guint8 bv;
+
+	memset (&elt, 0, sizeof (elt));
+	elt.type = ucl_object_type (obj);
+	elt.flags = obj->flags & (UCL_OBJECT_MULTILINE|UCL_OBJECT_BINARY);
+	elt.priority = ucl_object_get_priority (obj);
+	elt.keylen = obj->key ? obj->keylen : 0;
+
+	switch (elt.type) {
+	case UCL_OBJECT:
+		/* Multi-value keys are stored as several elements with the same key */
+		while ((cur = ucl_object_iterate (obj, &it, true)) != NULL) {
+			LL_FOREACH (cur, celt) {
+				elt.len ++;
+			}
+		}
+		break;
+	case UCL_ARRAY:
+		while ((cur = ucl_object_iterate (obj, &it, true)) != NULL) {
+			elt.len ++;
+		}
+		break;
+	case UCL_STRING:
+		elt.len = obj->len;
+		break;
+	case UCL_USERDATA:
+		elt.type = UCL_NULL;
+		break;
+	default:
+		break;
+	}
+
+	g_string_append_len (out, (const gchar *)&elt, sizeof (elt));
+
+	if (elt.keylen > 0) {
+		g_string_append_len (out, obj->key, elt.keylen);
+	}
+
+	switch (elt.type) {
+	case UCL_INT:
+		iv = ucl_object_toint (obj);
+		g_string_append_len (out, (const gchar *)&iv, sizeof (iv));
+		break;
+	case UCL_FLOAT:
+	case UCL_TIME:
+		dv = ucl_object_todouble (obj);
+		g_string_append_len (out, (const gchar *)&dv, sizeof (dv));
+		break;
+	case UCL_BOOLEAN:
+		bv = ucl_object_toboolean (obj);
+		g_string_append_len (out, (const gchar *)&bv, sizeof (bv));
+		break;
+	case UCL_STRING:
+		g_string_append_len (out, obj->value.sv, elt.len);
+		break;
+	case UCL_OBJECT:
+		it = NULL;
+
+		while ((cur = ucl_object_iterate (obj, &it, true)) != NULL) {
+			LL_FOREACH (cur, celt) {
+				rspamd_rcl_snapshot_write_elt (out, celt);
+			}
+		}
+		break;
+	case UCL_ARRAY:
+		it = NULL;
+
+		while ((cur = ucl_object_iterate (obj, &it, true)) != NULL) {
+			rspamd_rcl_snapshot_write_elt (out, cur);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static ucl_object_t *
+rspamd_rcl_snapshot_read_elt (const guchar **pos, const guchar *end,
+		const gchar **pkey, guint32 *pkeylen, guint depth)
+{
+	struct rspamd_rcl_snapshot_elt elt;
+	const guchar *p = *pos;
+	const gchar *ckey;
+	guint32 ckeylen;
+	ucl_object_t *obj, *child;
+	gint64 iv;
+	gdouble dv;
+	guint64 i;
+
+	if (depth > RSPAMD_RCL_SNAPSHOT_MAX_DEPTH || end - p < sizeof (elt)) {
+		return NULL;
+	}
+
+	memcpy (&elt, p, sizeof (elt));
+	p += sizeof (elt);
+
+	if (end - p < elt.keylen) {
+		return NULL;
+	}
+
+	*pkey = (const gchar *)p;
+	*pkeylen = elt.keylen;
+	p += elt.keylen;
+
+	switch (elt.type) {
+	case UCL_INT:
+		if (end - p < sizeof (iv)) {
+			return NULL;
+		}
+
+		memcpy (&iv, p, sizeof (iv));
+		p += sizeof (iv);
+		obj = ucl_object_fromint (iv);
+		break;
+	case UCL_FLOAT:
+	case UCL_TIME:
+		if (end - p < sizeof (dv)) {
+			return NULL;
+		}
+
+		memcpy (&dv, p, sizeof (dv));
+		p += sizeof (dv);
+		obj = ucl_object_fromdouble (dv);
+		obj->type = elt.type;
+		break;
+	case UCL_BOOLEAN:
+		if (end - p < 1) {
+			return NULL;
+		}
+
+		obj = ucl_object_frombool (*p != 0);
+		p ++;
+		break;
+	case UCL_STRING:
+		if ((guint64)(end - p) < elt.len) {
+			return NULL;
+		}
+
+		obj = ucl_object_fromlstring ((const gchar *)p, elt.len);
+		p += elt.len;
+		break;
+	case UCL_NULL:
+		obj = ucl_object_typed_new (UCL_NULL);
+		break;
+	case UCL_OBJECT:
+	case UCL_ARRAY:
+		obj = ucl_object_typed_new (elt.type);
+
+		for (i = 0; i < elt.len; i ++) {
+			child = rspamd_rcl_snapshot_read_elt (&p, end, &ckey, &ckeylen,
+					depth + 1);
+
+			if (child == NULL) {
+				ucl_object_unref (obj);
+
+				return NULL;
+			}
+
+			if (elt.type == UCL_OBJECT) {
+				/* Repeated keys are appended as implicit arrays */
+				ucl_object_insert_key (obj, child, ckey, ckeylen, true);
+			}
+			else {
+				ucl_array_append (obj, child);
+			}
+		}
+		break;
+	default:
+		return NULL;
+	}
+
+	obj->flags |= elt.flags;
+	ucl_object_set_priority (obj, elt.priority);
+	*pos = p;
+
+	return obj;
+}
+
+static gboolean
+rspamd_rcl_snapshot_load (struct rspamd_config *cfg, const guchar *key)
+{
+	struct rspamd_rcl_snapshot_hdr hdr;
+	const guchar *p, *end;
+	const gchar *tkey;
+	guint32 tkeylen;
+	guchar *map;
+	gsize len;
+	ucl_object_t *obj;
+
+	map = rspamd_file_xmap (cfg->cfg_snapshot, PROT_READ, &len);
+
+	if (map == NULL) {
+		msg_info_config ("cannot load config snapshot %s: %s",
+				cfg->cfg_snapshot, strerror (errno));
+		return FALSE;
+	}
+
+	if (len < sizeof (hdr)) {
+		munmap (map, len);
+		return FALSE;
+	}
+
+	memcpy (&hdr, map, sizeof (hdr));
+
+	if (memcmp (hdr.magic, RSPAMD_RCL_SNAPSHOT_MAGIC, sizeof (hdr.magic)) != 0 ||
+			hdr.version != RSPAMD_RCL_SNAPSHOT_VERSION) {
+		msg_warn_config ("invalid config snapshot %s", cfg->cfg_snapshot);
+		munmap (map, len);
+		return FALSE;
+	}
+
+	if (memcmp (hdr.key, key, sizeof (hdr.key)) != 0) {
+		msg_info_config ("config snapshot %s is outdated", cfg->cfg_snapshot);
+		munmap (map, len);
+		return FALSE;
+	}
+
+	p = map + sizeof (hdr);
+	end = map + len;
+	obj = rspamd_rcl_snapshot_read_elt (&p, end, &tkey, &tkeylen, 0);
+	munmap (map, len);
+
+	if (obj == NULL || ucl_object_type (obj) != UCL_OBJECT || p != end) {
+		msg_warn_config ("cannot read config snapshot %s", cfg->cfg_snapshot);
+
+		if (obj) {
+			ucl_object_unref (obj);
+		}
+
+		return FALSE;
+	}
+
+	msg_info_config ("loaded config from snapshot %s", cfg->cfg_snapshot);
+	cfg->rcl_obj = obj;
+
+	return TRUE;
+}
+
+static void
+rspamd_rcl_snapshot_save (struct rspamd_config *cfg, const guchar *key)
+{
+	struct rspamd_rcl_snapshot_hdr hdr;
+	GString *out;
+	gchar tmp_path[PATH_MAX];
+	gint fd;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RSPAMD_RCL_SNAPSHOT_MAGIC, sizeof (hdr.magic));
+	hdr.version = RSPAMD_RCL_SNAPSHOT_VERSION;
+	memcpy (hdr.key, key, sizeof (hdr.key));
+
+	out = g_string_sized_new (BUFSIZ);
+	g_string_append_len (out, (const gchar *)&hdr, sizeof (hdr));
+	rspamd_rcl_snapshot_write_elt (out, cfg->rcl_obj);
+
+	/* Write to a temporary file and rename it to replace snapshot atomically */
+	rspamd_snprintf (tmp_path, sizeof (tmp_path), "%s.new", cfg->cfg_snapshot);
+	(void)unlink (tmp_path);
+	fd = open (tmp_path, O_CREAT | O_TRUNC | O_WRONLY | O_EXCL, 00644);
+
+	if (fd == -1) {
+		msg_info_config ("cannot open config snapshot %s: %s", tmp_path,
+				strerror (errno));
+		g_string_free (out, TRUE);
+
+		return;
+	}
+
+	if (write (fd, out->str, out->len) != (gssize)out->len) {
+		msg_info_config ("cannot write config snapshot %s: %s", tmp_path,
+				strerror (errno));
+		close (fd);
+		(void)unlink (tmp_path);
+		g_string_free (out, TRUE);
+
+		return;
+	}
+
+	close (fd);
+
+	if (rename (tmp_path, cfg->cfg_snapshot) == -1) {
+		msg_info_config ("cannot rename config snapshot %s: %s", tmp_path,
+				strerror (errno));
+		(void)unlink (tmp_path);
+	}
+	else {
+		msg_info_config ("saved config snapshot to %s (%z bytes)",
+				cfg->cfg_snapshot, out->len);
+	}
+
+	g_string_free (out, TRUE);
+}
+
+static gboolean
+rspamd_config_parse_file (struct rspamd_config *cfg, const gchar *filename,
+		GHashTable *vars)
 {
 	struct stat st;
 	gint fd;
 	gchar *data;
-	GError *err = NULL;
-	struct rspamd_rcl_section *top, *logger;
 	struct ucl_parser *parser;
-	rspamd_cryptobox_hash_state_t hs;
-	unsigned char cksumbuf[rspamd_cryptobox_HASHBYTES];
-	struct ucl_emitter_functions f;
 
 	if (stat (filename, &st) == -1) {
 		msg_err_config_forced ("cannot stat %s: %s", filename, strerror (errno));
@@ -3558,7 +4162,6 @@ rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 
 	close (fd);
 
-	rspamd_cryptobox_hash_init (&hs, NULL, 0);
 	parser = ucl_parser_new (UCL_PARSER_SAVE_COMMENTS);
 	rspamd_ucl_add_conf_variables (parser, vars);
 	rspamd_ucl_add_conf_macros (parser, cfg);
@@ -3575,7 +4178,48 @@ rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 	cfg->config_comments = ucl_object_ref (ucl_parser_get_comments (parser));
 	ucl_parser_free (parser);
 
+	return TRUE;
+}
+
+gboolean
+rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
+	const gchar *convert_to, rspamd_rcl_section_fin_t logger_fin,
+	gpointer logger_ud, GHashTable *vars)
+{
+	GError *err = NULL;
+	struct rspamd_rcl_section *top, *logger;
+	rspamd_cryptobox_hash_state_t hs;
+	unsigned char cksumbuf[rspamd_cryptobox_HASHBYTES];
+	guchar snapshot_key[rspamd_cryptobox_HASHBYTES];
+	struct ucl_emitter_functions f;
+	gboolean from_snapshot = FALSE;
+	guint nmaps;
+
+	if (cfg->cfg_snapshot) {
+		rspamd_rcl_snapshot_key (cfg, filename, vars, snapshot_key);
+		from_snapshot = rspamd_rcl_snapshot_load (cfg, snapshot_key);
+	}
+
+	if (!from_snapshot) {
+		nmaps = g_list_length (cfg->maps);
+
+		if (!rspamd_config_parse_file (cfg, filename, vars)) {
+			return FALSE;
+		}
+
+		if (cfg->cfg_snapshot) {
+			if (g_list_length (cfg->maps) != nmaps) {
+				/* Content of included maps is not tracked by the snapshot */
+				msg_info_config ("config includes maps, do not save snapshot");
+			}
+			else {
+				rspamd_rcl_snapshot_save (cfg, snapshot_key);
+			}
+		}
+	}
+
 	/* Calculate checksum */
+	rspamd_cryptobox_hash_init (&hs, NULL, 0);
 	f.ucl_emitter_append_character = rspamd_rcl_emitter_append_c;
 	f.ucl_emitter_append_double = rspamd_rcl_emitter_append_double;
 	f.ucl_emitter_append_int = rspamd_rcl_emitter_append_int;
@@ -20,6 +20,7 @@
 #include "uthash_strcase.h"
 #include "filter.h"
 #include "lua/lua_common.h"
+#include "lua/lua_thread_pool.h"
 #include "map.h"
 #include "map_private.h"
 #include "dynamic_cfg.h"
@@ -27,7 +28,10 @@
 #include "stat_api.h"
 #include "unix-std.h"
 #include "libutil/multipattern.h"
+#include "libcryptobox/keypairs_cache.h"
+#include "libmime/images.h"
 #include "monitored.h"
+#include "result_cache.h"
 #include "ref.h"
 #include <math.h>
 
@@ -42,6 +46,11 @@
 #define DEFAULT_MAX_MESSAGE (50 * 1024 * 1024)
 #define DEFAULT_MAX_PIC (1 * 1024 * 1024)
 #define DEFAULT_MAX_SHOTS 100
+#define DEFAULT_MAX_MIME_PARTS 1024
+#define DEFAULT_MAX_DECODED (100 * 1024 * 1024)
+#define DEFAULT_MAX_HTML_TAGS 100000
+#define DEFAULT_MAX_URLS 10000
+#define DEFAULT_MAX_RE_SCAN (128 * 1024 * 1024)
 
 struct rspamd_ucl_map_cbdata {
 	struct rspamd_config *cfg;
@@ -116,6 +125,14 @@ rspamd_config_new (void)
 	cfg->dns_throttling_time = 10000;
 	/* 16 sockets per DNS server */
 	cfg->dns_io_per_server = 16;
+	/* Cache DNS replies for 5 minutes at most */
+	cfg->dns_cache_size = 8192;
+	cfg->dns_cache_max_ttl = 300.0;
+	cfg->dns_cache_negative_ttl = 30.0;
+	/* Results cache is disabled by default */
+	cfg->result_cache_size = 0;
+	cfg->result_cache_ttl = 600.0;
+	cfg->stat_shared_tokens_ttl = 60;
 
 	/* 20 Kb */
 	cfg->max_diff = 20480;
@@ -160,8 +177,14 @@ rspamd_config_new (void)
 	cfg->words_decay = DEFAULT_WORDS_DECAY;
 	cfg->min_word_len = DEFAULT_MIN_WORD;
 	cfg->max_word_len = DEFAULT_MAX_WORD;
+	cfg->max_mime_parts = DEFAULT_MAX_MIME_PARTS;
+	cfg->max_decoded_size = DEFAULT_MAX_DECODED;
+	cfg->max_html_tags = DEFAULT_MAX_HTML_TAGS;
+	cfg->max_urls = DEFAULT_MAX_URLS;
+	cfg->max_re_scan = DEFAULT_MAX_RE_SCAN;
 
 	cfg->lua_state = rspamd_lua_init ();
+	cfg->lua_thread_pool = lua_thread_pool_new (cfg->lua_state);
 	cfg->cache = rspamd_symbols_cache_new (cfg);
 	cfg->ups_ctx = rspamd_upstreams_library_init ();
 	cfg->re_cache = rspamd_re_cache_new ();
@@ -175,6 +198,8 @@ rspamd_config_new (void)
 	cfg->max_message = DEFAULT_MAX_MESSAGE;
 	cfg->max_pic_size = DEFAULT_MAX_PIC;
 	cfg->images_cache_size = 256;
+	cfg->reload_ready_timeout = 30.0;
+	cfg->fork_preload = TRUE;
 	cfg->monitored_ctx = rspamd_monitored_ctx_init ();
 	cfg->neighbours = ucl_object_typed_new (UCL_OBJECT);
 #ifdef WITH_HIREDIS
@@ -211,6 +236,7 @@ rspamd_config_free (struct rspamd_config *cfg)
 	g_list_free (cfg->classifiers);
 	g_list_free (cfg->metrics_list);
 	g_list_free (cfg->workers);
+	rspamd_result_cache_destroy (cfg->result_cache);
 	rspamd_symbols_cache_destroy (cfg->cache);
 #ifdef WITH_HIREDIS
 	if (cfg->redis_pool) {
@@ -242,6 +268,7 @@ rspamd_config_free (struct rspamd_config *cfg)
 	rspamd_re_cache_unref (cfg->re_cache);
 	rspamd_upstreams_library_unref (cfg->ups_ctx);
 	rspamd_mempool_delete (cfg->cfg_pool);
+	lua_thread_pool_free (cfg->lua_thread_pool);
 	lua_close (cfg->lua_state);
 	REF_RELEASE (cfg->libs_ctx);
 	g_slice_free1 (sizeof (*cfg), cfg);
@@ -668,6 +695,7 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 		cfg->default_max_shots = 1;
 	}
 
+	rspamd_mempool_set_huge_pages (cfg->huge_pages);
 	rspamd_regexp_library_init ();
 	rspamd_multipattern_library_init (cfg->hs_cache_dir,
 			cfg->libs_ctx->crypto_ctx);
@@ -754,6 +782,23 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 	if (opts & RSPAMD_CONFIG_INIT_LIBS) {
 		/* Config other libraries */
 		rspamd_config_libs (cfg->libs_ctx, cfg);
+
+		if (cfg->keypair_shared_cache_size > 0) {
+			/* Allocated before forking, so all workers share it */
+			cfg->keypair_shared_cache = rspamd_keypair_shared_cache_new (
+					cfg->cfg_pool, cfg->keypair_shared_cache_size);
+		}
+
+		if (cfg->images_shared_cache_size > 0) {
+			cfg->images_shared_cache = rspamd_image_shared_cache_new (
+					cfg->cfg_pool, cfg->images_shared_cache_size);
+		}
+
+		if (cfg->stat_shared_tokens_size > 0) {
+			cfg->stat_shared_tokens = rspamd_stat_shared_tokens_new (
+					cfg->cfg_pool, cfg->stat_shared_tokens_size,
+					cfg->stat_shared_tokens_ttl);
+		}
 	}
 
 	/* Validate cache */
@@ -981,6 +1026,7 @@ rspamd_config_new_worker (struct rspamd_config *cfg,
 #endif
 		c->rlimit_nofile = 0;
 		c->rlimit_maxcore = 0;
+		c->nice = RSPAMD_WORKER_NICE_UNSET;
 
 		REF_INIT_RETAIN (c, rspamd_worker_conf_dtor);
 		rspamd_mempool_add_destructor (cfg->cfg_pool,
@@ -1104,10 +1150,19 @@ static void
 symbols_classifiers_callback (gpointer key, gpointer value, gpointer ud)
 {
 	struct rspamd_config *cfg = ud;
+	struct rspamd_statfile_config *st = value;
+	enum rspamd_symbol_type type = SYMBOL_TYPE_CLASSIFIER;
+
+	/* Per user statistics depend on recipients */
+	if (ucl_object_lookup_any (st->opts, "per_user", "users_enabled", NULL) == NULL &&
+			ucl_object_lookup_any (st->clcf->opts, "per_user",
+					"users_enabled", NULL) == NULL) {
+		type |= SYMBOL_TYPE_CONTENT;
+	}
 
 	/* Actually, statistics should act like any ordinary symbol */
 	rspamd_symbols_cache_add_symbol (cfg->cache, key, 0, NULL, NULL,
-			SYMBOL_TYPE_CLASSIFIER, -1);
+			type, -1);
 }
 
 void
@@ -1322,12 +1377,87 @@ rspamd_check_worker (struct rspamd_config *cfg, worker_t *wrk)
 	return ret;
 }
 
+struct rspamd_init_timing {
+	const gchar *name;
+	gdouble elapsed;
+};
+
+void
+rspamd_config_add_init_timing (struct rspamd_config *cfg,
+		const gchar *name, gdouble elapsed)
+{
+	struct rspamd_init_timing *t, nt;
+	guint i;
+
+	if (cfg->init_timings == NULL) {
+		cfg->init_timings = g_array_new (FALSE, FALSE, sizeof (nt));
+		rspamd_mempool_add_destructor (cfg->cfg_pool, rspamd_array_free_hard,
+				cfg->init_timings);
+	}
+
+	for (i = 0; i < cfg->init_timings->len; i ++) {
+		t = &g_array_index (cfg->init_timings, struct rspamd_init_timing, i);
+
+		/* C modules are timed both on init and on config */
+		if (strcmp (t->name, name) == 0) {
+			t->elapsed += elapsed;
+
+			return;
+		}
+	}
+
+	nt.name = rspamd_mempool_strdup (cfg->cfg_pool, name);
+	nt.elapsed = elapsed;
+	g_array_append_val (cfg->init_timings, nt);
+}
+
+static gint
+rspamd_init_timing_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_init_timing *t1 = a, *t2 = b;
+
+	if (t1->elapsed > t2->elapsed) {
+		return -1;
+	}
+	else if (t1->elapsed < t2->elapsed) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+rspamd_config_log_init_timings (struct rspamd_config *cfg, gdouble total)
+{
+	struct rspamd_init_timing *t;
+	guint i;
+
+	if (cfg->init_timings == NULL) {
+		return;
+	}
+
+	g_array_sort (cfg->init_timings, rspamd_init_timing_cmp);
+	msg_info_config ("startup profile: %ud modules initialized in %.3f ms",
+			cfg->init_timings->len, total * 1000.0);
+
+	for (i = 0; i < cfg->init_timings->len; i ++) {
+		t = &g_array_index (cfg->init_timings, struct rspamd_init_timing, i);
+		msg_info_config ("startup profile: %s: %.3f ms (%.1f%%)",
+				t->name, t->elapsed * 1000.0,
+				total > 0 ? t->elapsed / total * 100.0 : 0.0);
+	}
+}
+
 gboolean
 rspamd_init_filters (struct rspamd_config *cfg, bool reconfig)
 {
 	GList *cur;
 	module_t *mod, **pmod;
 	struct module_ctx *mod_ctx;
+	gdouble start_ts, ts;
+	gboolean ret;
+
+	start_ts = rspamd_get_ticks ();
 
 	/* Init all compiled modules */
 	if (!reconfig) {
@@ -1336,6 +1466,7 @@ rspamd_init_filters (struct rspamd_config *cfg, bool reconfig)
 
 			if (rspamd_check_module (cfg, mod)) {
 				mod_ctx = g_slice_alloc0 (sizeof (struct module_ctx));
+				ts = rspamd_get_ticks ();
 
 				if (mod->module_init_func (cfg, &mod_ctx) == 0) {
 					g_hash_table_insert (cfg->c_modules,
@@ -1343,6 +1474,9 @@ rspamd_init_filters (struct rspamd_config *cfg, bool reconfig)
 							mod_ctx);
 					mod_ctx->mod = mod;
 				}
+
+				rspamd_config_add_init_timing (cfg, mod->name,
+						rspamd_get_ticks () - ts);
 			}
 		}
 	}
@@ -1358,6 +1492,7 @@ rspamd_init_filters (struct rspamd_config *cfg, bool reconfig)
 		if (mod_ctx) {
 			mod = mod_ctx->mod;
 			mod_ctx->enabled = TRUE;
+			ts = rspamd_get_ticks ();
 
 			if (reconfig) {
 				(void)mod->module_reconfig_func (cfg);
@@ -1366,6 +1501,9 @@ rspamd_init_filters (struct rspamd_config *cfg, bool reconfig)
 			else {
 				(void)mod->module_config_func (cfg);
 			}
+
+			rspamd_config_add_init_timing (cfg, mod->name,
+					rspamd_get_ticks () - ts);
 		}
 
 		if (mod_ctx == NULL) {
@@ -1375,7 +1513,13 @@ rspamd_init_filters (struct rspamd_config *cfg, bool reconfig)
 		cur = g_list_next (cur);
 	}
 
-	return rspamd_init_lua_filters (cfg);
+	ret = rspamd_init_lua_filters (cfg);
+
+	if (cfg->startup_profile) {
+		rspamd_config_log_init_timings (cfg, rspamd_get_ticks () - start_ts);
+	}
+
+	return ret;
 }
 
 static void
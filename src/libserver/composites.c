@@ -27,6 +27,30 @@ struct composites_data {
 	struct rspamd_metric_result *metric_res;
 	GHashTable *symbols_to_remove;
 	guint8 *checked;
+	gboolean dry_run;
+};
+
+/* Parsed atom of a composite expression */
+struct rspamd_composite_atom {
+	gchar *str;
+	gint id; /* symbols cache id, -1 if not found, -2 if not resolved yet */
+};
+
+struct composites_index_elt {
+	const gchar *name;
+	struct rspamd_composite *comp;
+};
+
+/*
+ * Composites indexed by symbols they refer to: a composite is evaluated only
+ * if some of its symbols has fired, except for composites that could be true
+ * without any symbols (e.g. `!A`) or that depend on other composites
+ */
+struct rspamd_composites_index {
+	GHashTable *by_symbol; /* symbol -> GArray of composites_index_elt */
+	GArray *always;
+	guint ncomposites;
+	guint max_id;
 };
 
 enum rspamd_composite_action {
@@ -69,6 +93,7 @@ rspamd_composite_expr_parse (const gchar *line, gsize len,
 {
 	gsize clen;
 	rspamd_expression_atom_t *res;
+	struct rspamd_composite_atom *catom;
 
 	/*
 	 * Composites are just sequences of symbols
@@ -84,21 +109,31 @@ rspamd_composite_expr_parse (const gchar *line, gsize len,
 	res = rspamd_mempool_alloc0 (pool, sizeof (*res));
 	res->len = clen;
 	res->str = line;
-	res->data = rspamd_mempool_alloc (pool, clen + 1);
-	rspamd_strlcpy (res->data, line, clen + 1);
+	catom = rspamd_mempool_alloc (pool, sizeof (*catom));
+	catom->str = rspamd_mempool_alloc (pool, clen + 1);
+	catom->id = -2;
+	rspamd_strlcpy (catom->str, line, clen + 1);
+	res->data = catom;
 
 	return res;
 }
 
 static gint
 rspamd_composite_process_single_symbol (struct composites_data *cd,
-		const gchar *sym, struct rspamd_symbol_result **pms)
+		const gchar *sym, gint id, struct rspamd_symbol_result **pms)
 {
 	struct rspamd_symbol_result *ms = NULL;
 	gint rc = 0;
 	struct rspamd_composite *ncomp;
 
-	if ((ms = g_hash_table_lookup (cd->metric_res->symbols, sym)) == NULL) {
+	if (id >= 0) {
+		ms = rspamd_metric_result_find_symbol_id (cd->metric_res, id);
+	}
+	else {
+		ms = g_hash_table_lookup (cd->metric_res->symbols, sym);
+	}
+
+	if (ms == NULL) {
 		if ((ncomp =
 				g_hash_table_lookup (cd->task->cfg->composite_symbols,
 						sym)) != NULL) {
@@ -106,7 +141,8 @@ rspamd_composite_process_single_symbol (struct composites_data *cd,
 			if (isclr (cd->checked, ncomp->id * 2)) {
 				setbit (cd->checked, cd->composite->id * 2);
 				rc = rspamd_process_expression (ncomp->expr,
-						RSPAMD_EXPRESSION_FLAG_NOOPT, cd);
+						RSPAMD_EXPRESSION_FLAG_NOOPT|RSPAMD_EXPRESSION_FLAG_NOCACHE,
+						cd);
 				clrbit (cd->checked, cd->composite->id * 2);
 
 				if (rc) {
@@ -114,7 +150,13 @@ rspamd_composite_process_single_symbol (struct composites_data *cd,
 				}
 				setbit (cd->checked, ncomp->id * 2);
 
-				ms = g_hash_table_lookup (cd->metric_res->symbols, sym);
+				if (id >= 0) {
+					ms = rspamd_metric_result_find_symbol_id (cd->metric_res,
+							id);
+				}
+				else {
+					ms = g_hash_table_lookup (cd->metric_res->symbols, sym);
+				}
 			}
 			else {
 				/*
@@ -136,7 +178,8 @@ static gint
 rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 {
 	struct composites_data *cd = (struct composites_data *)input;
-	const gchar *beg = atom->data, *sym = NULL;
+	struct rspamd_composite_atom *catom = atom->data;
+	const gchar *beg = catom->str, *sym = NULL;
 	gchar t;
 	struct symbol_remove_data *rd, *nrd;
 	struct rspamd_symbol_result *ms = NULL;
@@ -147,6 +190,11 @@ rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 	gpointer k, v;
 	gint rc = 0;
 
+	if (cd->dry_run) {
+		/* Nothing has fired */
+		return 0;
+	}
+
 	if (isset (cd->checked, cd->composite->id * 2)) {
 		/* We have already checked this composite, so just return its value */
 		rc = isset (cd->checked, cd->composite->id * 2 + 1);
@@ -169,7 +217,8 @@ rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 
 			while (g_hash_table_iter_next (&it, &k, &v)) {
 				sdef = v;
-				rc = rspamd_composite_process_single_symbol (cd, sdef->name, &ms);
+				rc = rspamd_composite_process_single_symbol (cd, sdef->name,
+						-1, &ms);
 
 				if (rc) {
 					break;
@@ -178,7 +227,13 @@ rspamd_composite_expr_process (gpointer input, rspamd_expression_atom_t *atom)
 		}
 	}
 	else {
-		rc = rspamd_composite_process_single_symbol (cd, sym, &ms);
+		if (catom->id == -2) {
+			/* Atoms live as long as config, so resolve them once */
+			catom->id = rspamd_symbols_cache_find_symbol (cd->task->cfg->cache,
+					sym);
+		}
+
+		rc = rspamd_composite_process_single_symbol (cd, sym, catom->id, &ms);
 	}
 
 	if (rc && ms) {
@@ -280,7 +335,8 @@ composites_foreach_callback (gpointer key, gpointer value, void *data)
 		}
 		else {
 			rc = rspamd_process_expression (comp->expr,
-					RSPAMD_EXPRESSION_FLAG_NOOPT, cd);
+					RSPAMD_EXPRESSION_FLAG_NOOPT|RSPAMD_EXPRESSION_FLAG_NOCACHE,
+					cd);
 
 			/* Checked bit */
 			setbit (cd->checked, comp->id * 2);
@@ -298,6 +354,199 @@ composites_foreach_callback (gpointer key, gpointer value, void *data)
 }
 
 
+struct composites_index_cbdata {
+	struct rspamd_config *cfg;
+	struct rspamd_composites_index *idx;
+	struct composites_index_elt elt;
+	GHashTable *seen;
+	gboolean always;
+};
+
+static void
+composites_index_add_symbol (struct composites_index_cbdata *cbd,
+		const gchar *sym)
+{
+	GArray *ar;
+
+	if (g_hash_table_lookup (cbd->seen, sym) != NULL) {
+		return;
+	}
+
+	g_hash_table_insert (cbd->seen, (gpointer)sym, (gpointer)sym);
+	ar = g_hash_table_lookup (cbd->idx->by_symbol, sym);
+
+	if (ar == NULL) {
+		ar = g_array_new (FALSE, FALSE, sizeof (struct composites_index_elt));
+		g_hash_table_insert (cbd->idx->by_symbol, (gpointer)sym, ar);
+	}
+
+	g_array_append_val (ar, cbd->elt);
+}
+
+static void
+composites_index_atom_callback (const rspamd_ftok_t *atom, gpointer ud)
+{
+	struct composites_index_cbdata *cbd = ud;
+	struct rspamd_metric *metric;
+	struct rspamd_symbols_group *gr;
+	struct rspamd_symbol *sdef;
+	GHashTableIter it;
+	gpointer k, v;
+	const gchar *p = atom->begin, *end = atom->begin + atom->len;
+	gchar *sym;
+
+	while (p < end && !g_ascii_isalnum (*p)) {
+		p ++;
+	}
+
+	sym = rspamd_mempool_alloc (cbd->cfg->cfg_pool, end - p + 1);
+	rspamd_strlcpy (sym, p, end - p + 1);
+
+	if (strncmp (sym, "g:", 2) == 0) {
+		metric = g_hash_table_lookup (cbd->cfg->metrics, DEFAULT_METRIC);
+		g_assert (metric != NULL);
+		gr = g_hash_table_lookup (metric->groups, sym + 2);
+
+		if (gr != NULL) {
+			g_hash_table_iter_init (&it, gr->symbols);
+
+			while (g_hash_table_iter_next (&it, &k, &v)) {
+				sdef = v;
+
+				if (g_hash_table_lookup (cbd->cfg->composite_symbols,
+						sdef->name) != NULL) {
+					cbd->always = TRUE;
+				}
+
+				composites_index_add_symbol (cbd, sdef->name);
+			}
+		}
+	}
+	else {
+		if (g_hash_table_lookup (cbd->cfg->composite_symbols, sym) != NULL) {
+			cbd->always = TRUE;
+		}
+
+		composites_index_add_symbol (cbd, sym);
+	}
+}
+
+static void
+composites_index_dtor (gpointer p)
+{
+	struct rspamd_composites_index *idx = p;
+
+	g_hash_table_unref (idx->by_symbol);
+	g_array_free (idx->always, TRUE);
+}
+
+static struct rspamd_composites_index *
+composites_index_build (struct rspamd_config *cfg)
+{
+	struct rspamd_composites_index *idx;
+	struct composites_index_cbdata cbd;
+	struct composites_data cd;
+	GHashTableIter it;
+	gpointer k, v;
+
+	idx = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*idx));
+	idx->by_symbol = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			NULL, (GDestroyNotify)rspamd_array_free_hard);
+	idx->always = g_array_new (FALSE, FALSE,
+			sizeof (struct composites_index_elt));
+	idx->ncomposites = g_hash_table_size (cfg->composite_symbols);
+	rspamd_mempool_add_destructor (cfg->cfg_pool, composites_index_dtor, idx);
+
+	memset (&cd, 0, sizeof (cd));
+	cd.dry_run = TRUE;
+	cbd.cfg = cfg;
+	cbd.idx = idx;
+	cbd.seen = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	g_hash_table_iter_init (&it, cfg->composite_symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		cbd.elt.name = k;
+		cbd.elt.comp = v;
+		cbd.always = FALSE;
+		idx->max_id = MAX (idx->max_id, (guint)cbd.elt.comp->id);
+		g_hash_table_remove_all (cbd.seen);
+
+		rspamd_expression_atom_foreach (cbd.elt.comp->expr,
+				composites_index_atom_callback, &cbd);
+
+		if (!cbd.always) {
+			/* Check what an expression gives when no symbols are found */
+			cd.composite = cbd.elt.comp;
+
+			if (rspamd_process_expression (cbd.elt.comp->expr,
+					RSPAMD_EXPRESSION_FLAG_NOOPT, &cd)) {
+				cbd.always = TRUE;
+			}
+		}
+
+		if (cbd.always) {
+			g_array_append_val (idx->always, cbd.elt);
+		}
+	}
+
+	g_hash_table_unref (cbd.seen);
+	msg_info_config ("indexed %ud composites, %ud of them are checked for "
+			"all messages", idx->ncomposites, idx->always->len);
+
+	return idx;
+}
+
+static void
+composites_index_process (struct composites_data *cd,
+		struct rspamd_composites_index *idx)
+{
+	GHashTableIter it;
+	GPtrArray *candidates;
+	GArray *ar;
+	struct composites_index_elt *elt;
+	guint8 *queued;
+	gpointer k, v;
+	guint i;
+
+	candidates = g_ptr_array_new ();
+	queued = rspamd_mempool_alloc0 (cd->task->task_pool,
+			NBYTES (idx->max_id + 1));
+
+	/* Collect first, as evaluation inserts new symbols to the results */
+	g_hash_table_iter_init (&it, cd->metric_res->symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		ar = g_hash_table_lookup (idx->by_symbol, k);
+
+		if (ar != NULL) {
+			for (i = 0; i < ar->len; i ++) {
+				elt = &g_array_index (ar, struct composites_index_elt, i);
+
+				if (isclr (queued, elt->comp->id)) {
+					setbit (queued, elt->comp->id);
+					g_ptr_array_add (candidates, elt);
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < idx->always->len; i ++) {
+		elt = &g_array_index (idx->always, struct composites_index_elt, i);
+
+		if (isclr (queued, elt->comp->id)) {
+			setbit (queued, elt->comp->id);
+			g_ptr_array_add (candidates, elt);
+		}
+	}
+
+	for (i = 0; i < candidates->len; i ++) {
+		elt = g_ptr_array_index (candidates, i);
+		composites_foreach_callback ((gpointer)elt->name, elt->comp, cd);
+	}
+
+	g_ptr_array_free (candidates, TRUE);
+}
+
 static void
 composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 {
@@ -356,7 +605,7 @@ composites_remove_symbols (gpointer key, gpointer value, gpointer data)
 
 	if (has_valid_op) {
 		if (want_remove_symbol || want_forced) {
-			g_hash_table_remove (cd->metric_res->symbols, key);
+			rspamd_metric_result_remove_symbol (cd->metric_res, rd->ms);
 		}
 		if (want_remove_score || want_forced) {
 			cd->metric_res->score -= rd->ms->score;
@@ -380,10 +629,16 @@ composites_metric_callback (gpointer key, gpointer value, gpointer data)
 		rspamd_mempool_alloc0 (task->task_pool,
 			NBYTES (g_hash_table_size (task->cfg->composite_symbols) * 2));
 
-	/* Process hash table */
-	g_hash_table_foreach (task->cfg->composite_symbols,
-		composites_foreach_callback,
-		cd);
+	cd->dry_run = FALSE;
+
+	if (task->cfg->composites_index == NULL ||
+			task->cfg->composites_index->ncomposites !=
+			g_hash_table_size (task->cfg->composite_symbols)) {
+		task->cfg->composites_index = composites_index_build (task->cfg);
+	}
+
+	/* Process composites that could be matched */
+	composites_index_process (cd, task->cfg->composites_index);
 
 	/* Remove symbols that are in composites */
 	g_hash_table_foreach (cd->symbols_to_remove, composites_remove_symbols, cd);
@@ -394,7 +649,7 @@ composites_metric_callback (gpointer key, gpointer value, gpointer data)
 void
 rspamd_make_composites (struct rspamd_task *task)
 {
-	g_hash_table_foreach (task->results, composites_metric_callback, task);
+	rspamd_mempool_hash_foreach (task->results, composites_metric_callback, task);
 }
 
 
@@ -127,6 +127,7 @@ struct rspamd_dkim_sign_key_s {
 	RSA *key_rsa;
 	BIO *key_bio;
 	EVP_PKEY *key_evp;
+	time_t mtime;
 	ref_entry_t ref;
 };
 
@@ -1530,6 +1531,80 @@ rspamd_dkim_canonize_body (struct rspamd_dkim_common_ctx *ctx,
 	return FALSE;
 }
 
+/*
+ * Body hashes of a message are shared between signatures that use the same
+ * canonicalization, length limit and digest, so a message with several
+ * signatures is canonicalized once per distinct combination
+ */
+#define DKIM_BODY_HASHES_VAR "dkim_body_hashes"
+
+struct rspamd_dkim_body_hash {
+	const gchar *body_start;
+	gint canon_type;
+	gsize len;
+	gint md_type;
+	gboolean sign;
+	EVP_MD_CTX *ck;
+	struct rspamd_dkim_body_hash *next;
+};
+
+/*
+ * Signing and verification canonicalize the same body differently only for
+ * relaxed bodies that have no trailing newline
+ */
+static gboolean
+rspamd_dkim_body_hash_sign_dependent (gint canon_type,
+	const gchar *start,
+	const gchar *end)
+{
+	if (canon_type != DKIM_CANON_RELAXED || start == NULL || end <= start) {
+		return FALSE;
+	}
+
+	return !(end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ');
+}
+
+static EVP_MD_CTX *
+rspamd_dkim_get_body_hash (struct rspamd_dkim_common_ctx *ctx,
+	const gchar *start,
+	const gchar *end,
+	gboolean sign)
+{
+	struct rspamd_dkim_body_hash *bhs, *cur;
+	gint md_type;
+	gboolean sign_dependent;
+
+	md_type = EVP_MD_type (EVP_MD_CTX_md (ctx->body_hash));
+	bhs = rspamd_mempool_get_variable (ctx->pool, DKIM_BODY_HASHES_VAR);
+	sign_dependent = rspamd_dkim_body_hash_sign_dependent (ctx->body_canon_type,
+			start, end);
+
+	LL_FOREACH (bhs, cur) {
+		if (cur->body_start == start && cur->canon_type == ctx->body_canon_type
+				&& cur->len == ctx->len && cur->md_type == md_type
+				&& (cur->sign == sign || !sign_dependent)) {
+			return cur->ck;
+		}
+	}
+
+	if (!rspamd_dkim_canonize_body (ctx, start, end, sign)) {
+		return NULL;
+	}
+
+	/* Body hash context lives in the same pool, so we can just refer to it */
+	cur = rspamd_mempool_alloc (ctx->pool, sizeof (*cur));
+	cur->body_start = start;
+	cur->canon_type = ctx->body_canon_type;
+	cur->len = ctx->len;
+	cur->md_type = md_type;
+	cur->sign = sign;
+	cur->ck = ctx->body_hash;
+	LL_PREPEND (bhs, cur);
+	rspamd_mempool_set_variable (ctx->pool, DKIM_BODY_HASHES_VAR, bhs, NULL);
+
+	return cur->ck;
+}
+
 /* Update hash converting all CR and LF to CRLF */
 static void
 rspamd_dkim_hash_update (EVP_MD_CTX *ck, const gchar *begin, gsize len)
@@ -1787,7 +1862,7 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 {
 	const gchar *body_end, *body_start;
 	guchar raw_digest[EVP_MAX_MD_SIZE];
-	EVP_MD_CTX *cpy_ctx;
+	EVP_MD_CTX *cpy_ctx, *body_hash;
 	gsize dlen;
 	gint res = DKIM_CONTINUE;
 	guint i;
@@ -1806,8 +1881,11 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 		return DKIM_RECORD_ERROR;
 	}
 
-	/* Start canonization of body part */
-	if (!rspamd_dkim_canonize_body (&ctx->common, body_start, body_end, FALSE)) {
+	/* Start canonization of body part or reuse one from another signature */
+	body_hash = rspamd_dkim_get_body_hash (&ctx->common, body_start, body_end,
+			FALSE);
+
+	if (body_hash == NULL) {
 		return DKIM_RECORD_ERROR;
 	}
 	/* Now canonize headers */
@@ -1821,10 +1899,10 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	rspamd_dkim_canonize_header (&ctx->common, task, DKIM_SIGNHEADER, 0,
 			ctx->dkim_header, ctx->domain);
 
-	dlen = EVP_MD_CTX_size (ctx->common.body_hash);
+	dlen = EVP_MD_CTX_size (body_hash);
 	/* Copy md_ctx to deal with broken CRLF at the end */
 	cpy_ctx = EVP_MD_CTX_create ();
-	EVP_MD_CTX_copy (cpy_ctx, ctx->common.body_hash);
+	EVP_MD_CTX_copy (cpy_ctx, body_hash);
 	EVP_DigestFinal_ex (cpy_ctx, raw_digest, NULL);
 
 	/* Check bh field */
@@ -1838,7 +1916,7 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 #else
 		EVP_MD_CTX_reset (cpy_ctx);
 #endif
-		EVP_MD_CTX_copy (cpy_ctx, ctx->common.body_hash);
+		EVP_MD_CTX_copy (cpy_ctx, body_hash);
 		EVP_DigestUpdate (cpy_ctx, "\r\n", 2);
 		EVP_DigestFinal_ex (cpy_ctx, raw_digest, NULL);
 
@@ -1853,7 +1931,7 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	#else
 			EVP_MD_CTX_reset (cpy_ctx);
 	#endif
-			EVP_MD_CTX_copy (cpy_ctx, ctx->common.body_hash);
+			EVP_MD_CTX_copy (cpy_ctx, body_hash);
 			EVP_DigestUpdate (cpy_ctx, "\n", 1);
 			EVP_DigestFinal_ex (cpy_ctx, raw_digest, NULL);
 
@@ -1930,6 +2008,17 @@ rspamd_dkim_sign_key_unref (rspamd_dkim_sign_key_t *k)
 	REF_RELEASE (k);
 }
 
+gboolean
+rspamd_dkim_sign_key_maybe_invalidate (rspamd_dkim_sign_key_t *key,
+		time_t mtime)
+{
+	if (key->type != RSPAMD_DKIM_SIGN_KEY_FILE) {
+		return FALSE;
+	}
+
+	return mtime > key->mtime;
+}
+
 const gchar*
 rspamd_dkim_get_domain (rspamd_dkim_context_t *ctx)
 {
@@ -1968,11 +2057,18 @@ rspamd_dkim_sign_key_load (const gchar *what, gsize len,
 	gpointer map;
 	gsize map_len = 0;
 	rspamd_dkim_sign_key_t *nkey;
+	time_t mtime = 0;
 
 	if (type == RSPAMD_DKIM_SIGN_KEY_FILE) {
 		gchar fpath[PATH_MAX];
+		struct stat st;
 
 		rspamd_snprintf (fpath, sizeof (fpath), "%*s", (gint)len, what);
+
+		if (stat (fpath, &st) != -1) {
+			mtime = st.st_mtime;
+		}
+
 		map = rspamd_file_xmap (fpath, PROT_READ, &map_len);
 
 		if (map == NULL) {
@@ -1986,6 +2082,7 @@ rspamd_dkim_sign_key_load (const gchar *what, gsize len,
 
 	nkey = g_slice_alloc0 (sizeof (*nkey));
 	nkey->type = type;
+	nkey->mtime = mtime;
 
 	switch (type) {
 	case RSPAMD_DKIM_SIGN_KEY_FILE:
@@ -2149,6 +2246,7 @@ rspamd_dkim_sign (struct rspamd_task *task,
 	struct rspamd_dkim_header *dh;
 	const gchar *body_end, *body_start;
 	guchar raw_digest[EVP_MAX_MD_SIZE];
+	EVP_MD_CTX *cpy_ctx, *body_hash;
 	gsize dlen;
 	guint i, j;
 	gchar *b64_data;
@@ -2169,8 +2267,11 @@ rspamd_dkim_sign (struct rspamd_task *task,
 		return NULL;
 	}
 
-	/* Start canonization of body part */
-	if (!rspamd_dkim_canonize_body (&ctx->common, body_start, body_end, TRUE)) {
+	/* Start canonization of body part or reuse one computed for verification */
+	body_hash = rspamd_dkim_get_body_hash (&ctx->common, body_start, body_end,
+			TRUE);
+
+	if (body_hash == NULL) {
 		return NULL;
 	}
 
@@ -2206,8 +2307,17 @@ rspamd_dkim_sign (struct rspamd_task *task,
 	/* Replace the last ':' with ';' */
 	hdr->str[hdr->len - 1] = ';';
 
-	dlen = EVP_MD_CTX_size (ctx->common.body_hash);
-	EVP_DigestFinal_ex (ctx->common.body_hash, raw_digest, NULL);
+	/* Cached body hash could be used by other signatures, so finalize its copy */
+	dlen = EVP_MD_CTX_size (body_hash);
+	cpy_ctx = EVP_MD_CTX_create ();
+	EVP_MD_CTX_copy (cpy_ctx, body_hash);
+	EVP_DigestFinal_ex (cpy_ctx, raw_digest, NULL);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
+	EVP_MD_CTX_cleanup (cpy_ctx);
+#else
+	EVP_MD_CTX_reset (cpy_ctx);
+#endif
+	EVP_MD_CTX_destroy (cpy_ctx);
 
 	b64_data = rspamd_encode_base64 (raw_digest, dlen, 0, NULL);
 	rspamd_printf_gstring (hdr, " bh=%s; b=", b64_data);
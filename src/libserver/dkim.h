@@ -182,6 +182,15 @@ rspamd_dkim_key_t * rspamd_dkim_key_ref (rspamd_dkim_key_t *k);
 void rspamd_dkim_key_unref (rspamd_dkim_key_t *k);
 rspamd_dkim_sign_key_t * rspamd_dkim_sign_key_ref (rspamd_dkim_sign_key_t *k);
 void rspamd_dkim_sign_key_unref (rspamd_dkim_sign_key_t *k);
+
+/**
+ * Checks if a key loaded from file is older than the specified mtime
+ * @param key key to check
+ * @param mtime current modification time of the key file
+ * @return TRUE if the key should be reloaded
+ */
+gboolean rspamd_dkim_sign_key_maybe_invalidate (rspamd_dkim_sign_key_t *key,
+		time_t mtime);
 const gchar* rspamd_dkim_get_domain (rspamd_dkim_context_t *ctx);
 const gchar* rspamd_dkim_get_dns_key (rspamd_dkim_context_t *ctx);
 guint rspamd_dkim_key_get_ttl (rspamd_dkim_key_t *k);
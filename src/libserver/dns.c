@@ -19,6 +19,7 @@
 #include "rspamd.h"
 #include "utlist.h"
 #include "uthash.h"
+#include "ref.h"
 #include "rdns_event.h"
 
 static struct rdns_upstream_elt* rspamd_dns_select_upstream (const char *name,
@@ -41,59 +42,238 @@ static struct rdns_upstream_context rspamd_ups_ctx = {
 		.data = NULL
 };
 
+struct rspamd_dns_pending;
+
+/* Reply shared by all requesters until it expires */
+struct rspamd_dns_cached_reply {
+	struct rdns_request *req;
+	ref_entry_t ref;
+};
+
 struct rspamd_dns_request_ud {
 	struct rspamd_async_session *session;
+	struct rspamd_async_event *async_ev;
 	dns_callback_type cb;
 	gpointer ud;
 	rspamd_mempool_t *pool;
-	struct rdns_request *req;
+	/* Either we wait for a pending request or use a cached reply */
+	struct rspamd_dns_pending *pending;
+	struct rspamd_dns_cached_reply *cached;
+	/* Replies received by the task of this request, may be NULL */
+	GHashTable *registry;
+	struct event ev;
+	struct rspamd_dns_request_ud *prev, *next;
+};
+
+/* Request sent to a server that all identical queries are attached to */
+struct rspamd_dns_pending {
+	gchar *key;
+	struct rspamd_dns_resolver *resolver;
+	struct rspamd_dns_request_ud *waiters;
 };
 
+#define RSPAMD_DNS_KEY_MAX 320
+#define RSPAMD_DNS_TASK_REGISTRY "dns_replies"
+
 static void
-rspamd_dns_fin_cb (gpointer arg)
+rspamd_dns_cached_reply_dtor (struct rspamd_dns_cached_reply *cached)
 {
-	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
+	rdns_request_release (cached->req);
+	g_slice_free1 (sizeof (*cached), cached);
+}
+
+static void
+rspamd_dns_cached_reply_unref (gpointer p)
+{
+	struct rspamd_dns_cached_reply *cached = p;
+
+	REF_RELEASE (cached);
+}
+
+static struct rspamd_dns_cached_reply *
+rspamd_dns_cached_reply_share (struct rspamd_dns_cached_reply *cached,
+		struct rdns_reply *reply)
+{
+	if (cached == NULL) {
+		cached = g_slice_alloc (sizeof (*cached));
+		cached->req = rdns_request_retain (reply->request);
+		REF_INIT_RETAIN (cached, rspamd_dns_cached_reply_dtor);
+	}
+	else {
+		REF_RETAIN (cached);
+	}
+
+	return cached;
+}
 
-	rdns_request_release (reqdata->req);
+/*
+ * All replies received by a task are kept until the task is finished, so
+ * rules querying the same name share one query even when the replies cache
+ * is disabled or the reply is not cacheable
+ */
+static GHashTable *
+rspamd_dns_task_registry (struct rspamd_task *task)
+{
+	GHashTable *registry;
+
+	registry = rspamd_mempool_get_variable (task->task_pool,
+			RSPAMD_DNS_TASK_REGISTRY);
+
+	if (registry == NULL) {
+		registry = g_hash_table_new_full (rspamd_strcase_hash,
+				rspamd_strcase_equal, g_free, rspamd_dns_cached_reply_unref);
+		rspamd_mempool_set_variable (task->task_pool, RSPAMD_DNS_TASK_REGISTRY,
+				registry, (rspamd_mempool_destruct_t)g_hash_table_unref);
+	}
+
+	return registry;
+}
 
+static void
+rspamd_dns_request_ud_free (struct rspamd_dns_request_ud *reqdata)
+{
 	if (reqdata->pool == NULL) {
 		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
 	}
 }
 
 static void
-rspamd_dns_callback (struct rdns_reply *reply, gpointer ud)
+rspamd_dns_fin_cb (gpointer arg)
 {
-	struct rspamd_dns_request_ud *reqdata = ud;
+	struct rspamd_dns_request_ud *reqdata = (struct rspamd_dns_request_ud *)arg;
+
+	if (reqdata->pending) {
+		/* Session is destroyed, other requesters still wait for the reply */
+		DL_DELETE (reqdata->pending->waiters, reqdata);
+		reqdata->pending = NULL;
+	}
 
+	if (reqdata->cached) {
+		event_del (&reqdata->ev);
+		REF_RELEASE (reqdata->cached);
+		reqdata->cached = NULL;
+	}
+
+	rspamd_dns_request_ud_free (reqdata);
+}
+
+static void
+rspamd_dns_deliver (struct rdns_reply *reply,
+		struct rspamd_dns_request_ud *reqdata)
+{
 	reqdata->cb (reply, reqdata->ud);
 
 	if (reqdata->session) {
-		/*
-		 * Ref event to avoid double unref by
-		 * event removing
-		 */
-		rdns_request_retain (reply->request);
-		rspamd_session_remove_event (reqdata->session, rspamd_dns_fin_cb, reqdata);
-	}
-	else if (reqdata->pool == NULL) {
-		g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+		rspamd_session_remove_event_specific (reqdata->session,
+				reqdata->async_ev);
+	}
+	else {
+		rspamd_dns_fin_cb (reqdata);
 	}
 }
 
-gboolean
-make_dns_request (struct rspamd_dns_resolver *resolver,
+static guint
+rspamd_dns_reply_ttl (struct rspamd_dns_resolver *resolver,
+		struct rdns_reply *reply)
+{
+	struct rdns_reply_entry *elt;
+	gdouble ttl = resolver->cache_max_ttl;
+
+	if (reply->code == RDNS_RC_NXDOMAIN ||
+			(reply->code == RDNS_RC_NOERROR && reply->entries == NULL)) {
+		ttl = MIN (ttl, resolver->cache_negative_ttl);
+	}
+	else if (reply->code == RDNS_RC_NOERROR) {
+		LL_FOREACH (reply->entries, elt) {
+			ttl = MIN (ttl, elt->ttl);
+		}
+	}
+	else {
+		/* Errors and timeouts are not cached */
+		ttl = 0;
+	}
+
+	return ttl > 0 ? ttl : 0;
+}
+
+static void
+rspamd_dns_pending_callback (struct rdns_reply *reply, gpointer ud)
+{
+	struct rspamd_dns_pending *pending = ud;
+	struct rspamd_dns_resolver *resolver = pending->resolver;
+	struct rspamd_dns_request_ud *reqdata;
+	struct rspamd_dns_cached_reply *cached = NULL;
+	guint ttl;
+
+	if (pending->key) {
+		g_hash_table_remove (resolver->pending, pending->key);
+
+		DL_FOREACH (pending->waiters, reqdata) {
+			if (reqdata->registry) {
+				cached = rspamd_dns_cached_reply_share (cached, reply);
+				g_hash_table_replace (reqdata->registry,
+						g_strdup (pending->key), cached);
+			}
+		}
+	}
+
+	if (pending->key && resolver->cache && (ttl = rspamd_dns_reply_ttl (resolver, reply)) > 0) {
+		cached = rspamd_dns_cached_reply_share (cached, reply);
+		rspamd_lru_hash_insert (resolver->cache, pending->key, cached,
+				time (NULL), ttl);
+		/* Key is now owned by the cache */
+		pending->key = NULL;
+	}
+
+	/*
+	 * Callbacks can destroy sessions of other waiters, so we detach each
+	 * waiter before calling it
+	 */
+	while ((reqdata = pending->waiters) != NULL) {
+		DL_DELETE (pending->waiters, reqdata);
+		reqdata->pending = NULL;
+		rspamd_dns_deliver (reply, reqdata);
+	}
+
+	g_free (pending->key);
+	g_slice_free1 (sizeof (*pending), pending);
+}
+
+static void
+rspamd_dns_cached_callback (gint fd, short what, gpointer ud)
+{
+	struct rspamd_dns_request_ud *reqdata = ud;
+
+	rspamd_dns_deliver (reqdata->cached->req->reply, reqdata);
+}
+
+/*
+ * Sets `sent` to TRUE if a query has been sent to a server, FALSE when the
+ * request is served from the cache or attached to an in-flight one
+ */
+static gboolean
+rspamd_dns_request_common (struct rspamd_dns_resolver *resolver,
 	struct rspamd_async_session *session,
 	rspamd_mempool_t *pool,
 	dns_callback_type cb,
 	gpointer ud,
 	enum rdns_request_type type,
-	const char *name)
+	const char *name,
+	GHashTable *registry,
+	gdouble timeout,
+	gboolean *sent)
 {
 	struct rdns_request *req;
 	struct rspamd_dns_request_ud *reqdata = NULL;
+	struct rspamd_dns_pending *pending;
+	struct rspamd_dns_cached_reply *cached = NULL;
+	struct timeval tv;
+	gchar key[RSPAMD_DNS_KEY_MAX];
+	gboolean shared;
+	gsize nlen;
 
 	g_assert (resolver != NULL);
+	*sent = FALSE;
 
 	if (resolver->r == NULL) {
 		return FALSE;
@@ -101,58 +281,139 @@ make_dns_request (struct rspamd_dns_resolver *resolver,
 
 	if (pool != NULL) {
 		reqdata =
-			rspamd_mempool_alloc (pool, sizeof (struct rspamd_dns_request_ud));
+			rspamd_mempool_alloc0 (pool, sizeof (struct rspamd_dns_request_ud));
 	}
 	else {
-		reqdata = g_slice_alloc (sizeof (struct rspamd_dns_request_ud));
+		reqdata = g_slice_alloc0 (sizeof (struct rspamd_dns_request_ud));
 	}
 	reqdata->pool = pool;
 	reqdata->session = session;
 	reqdata->cb = cb;
 	reqdata->ud = ud;
+	reqdata->registry = registry;
 
-	req = rdns_make_request_full (resolver->r, rspamd_dns_callback, reqdata,
-			resolver->request_timeout, resolver->max_retransmits, 1, name,
-			type);
-	reqdata->req = req;
+	/*
+	 * Keys are compared case insensitively by both tables, `example.com.`
+	 * and `example.com` are the same name as well
+	 */
+	nlen = strlen (name);
 
-	if (session) {
-		if (req != NULL) {
-			rspamd_session_add_event (session,
-					(event_finalizer_t)rspamd_dns_fin_cb,
-					reqdata,
-					g_quark_from_static_string ("dns resolver"));
+	if (nlen > 1 && name[nlen - 1] == '.') {
+		nlen --;
+	}
+
+	shared = rspamd_snprintf (key, sizeof (key), "%d:%*s", (gint)type,
+			(gint)nlen, name) < (glong)sizeof (key) - 1;
+
+	if (shared && registry) {
+		cached = g_hash_table_lookup (registry, key);
+
+		if (cached) {
+			resolver->stat.shared ++;
+			msg_debug ("reuse reply for %s received by the same task", name);
 		}
 	}
 
-	if (req == NULL) {
-		if (pool == NULL) {
-			g_slice_free1 (sizeof (struct rspamd_dns_request_ud), reqdata);
+	if (cached == NULL && shared && resolver->cache) {
+		cached = rspamd_lru_hash_lookup (resolver->cache, key, time (NULL));
+
+		if (cached) {
+			resolver->stat.hits ++;
 		}
-		return FALSE;
+	}
+
+	if (cached) {
+		REF_RETAIN (cached);
+		reqdata->cached = cached;
+		/* Reply is always asynchronous */
+		event_set (&reqdata->ev, -1, EV_TIMEOUT, rspamd_dns_cached_callback,
+				reqdata);
+		event_base_set (resolver->ev_base, &reqdata->ev);
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		event_add (&reqdata->ev, &tv);
+	}
+	else if (shared &&
+			(pending = g_hash_table_lookup (resolver->pending, key)) != NULL) {
+		resolver->stat.coalesced ++;
+		msg_debug ("coalesce request for %s with an in-flight one", name);
+		reqdata->pending = pending;
+		DL_APPEND (pending->waiters, reqdata);
+	}
+	else {
+		pending = g_slice_alloc0 (sizeof (*pending));
+		pending->resolver = resolver;
+		req = rdns_make_request_full (resolver->r, rspamd_dns_pending_callback,
+				pending, timeout > 0 ? timeout : resolver->request_timeout,
+				resolver->max_retransmits, 1, name, type);
+
+		if (req == NULL) {
+			g_slice_free1 (sizeof (*pending), pending);
+			rspamd_dns_request_ud_free (reqdata);
+
+			return FALSE;
+		}
+
+		resolver->stat.misses ++;
+		*sent = TRUE;
+
+		if (shared) {
+			pending->key = g_strdup (key);
+			g_hash_table_insert (resolver->pending, pending->key, pending);
+		}
+
+		reqdata->pending = pending;
+		DL_APPEND (pending->waiters, reqdata);
+	}
+
+	if (session) {
+		reqdata->async_ev = rspamd_session_add_event (session,
+				(event_finalizer_t)rspamd_dns_fin_cb,
+				reqdata,
+				g_quark_from_static_string ("dns resolver"));
 	}
 
 	return TRUE;
 }
 
-static gboolean
-make_dns_request_task_common (struct rspamd_task *task,
+gboolean
+make_dns_request (struct rspamd_dns_resolver *resolver,
+	struct rspamd_async_session *session,
+	rspamd_mempool_t *pool,
+	dns_callback_type cb,
+	gpointer ud,
+	enum rdns_request_type type,
+	const char *name)
+{
+	gboolean sent;
+
+	return rspamd_dns_request_common (resolver, session, pool, cb, ud, type,
+			name, NULL, 0, &sent);
+}
+
+gboolean
+make_dns_request_task_full (struct rspamd_task *task,
 	dns_callback_type cb,
 	gpointer ud,
 	enum rdns_request_type type,
 	const char *name,
-	gboolean forced)
+	gboolean forced,
+	gdouble timeout)
 {
-	gboolean ret;
+	gboolean ret, sent;
 
 	if (!forced && task->dns_requests >= task->cfg->dns_max_requests) {
 		return FALSE;
 	}
 
-	ret = make_dns_request (task->resolver, task->s, task->task_pool, cb, ud,
-			type, name);
+	ret = rspamd_dns_request_common (task->resolver, task->s, task->task_pool,
+			cb, ud, type, name, rspamd_dns_task_registry (task), timeout, &sent);
 
-	if (ret) {
+	/*
+	 * Only queries sent to servers are limited, so a burst of identical
+	 * messages is not cut by replies shared with other tasks
+	 */
+	if (ret && sent) {
 		task->dns_requests ++;
 
 		if (!forced && task->dns_requests >= task->cfg->dns_max_requests) {
@@ -171,7 +432,7 @@ make_dns_request_task (struct rspamd_task *task,
 	enum rdns_request_type type,
 	const char *name)
 {
-	return make_dns_request_task_common (task, cb, ud, type, name, FALSE);
+	return make_dns_request_task_full (task, cb, ud, type, name, FALSE, 0);
 }
 
 gboolean
@@ -181,7 +442,7 @@ make_dns_request_task_forced (struct rspamd_task *task,
 	enum rdns_request_type type,
 	const char *name)
 {
-	return make_dns_request_task_common (task, cb, ud, type, name, TRUE);
+	return make_dns_request_task_full (task, cb, ud, type, name, TRUE, 0);
 }
 
 static void rspamd_rnds_log_bridge (
@@ -243,6 +504,16 @@ dns_resolver_init (rspamd_logger_t *logger,
 		dns_resolver->max_retransmits = 2;
 	}
 
+	dns_resolver->pending = g_hash_table_new (rspamd_strcase_hash,
+			rspamd_strcase_equal);
+
+	if (cfg != NULL && cfg->dns_cache_size > 0 && cfg->dns_cache_max_ttl > 0) {
+		dns_resolver->cache = rspamd_lru_hash_new (cfg->dns_cache_size, g_free,
+				rspamd_dns_cached_reply_unref);
+		dns_resolver->cache_max_ttl = cfg->dns_cache_max_ttl;
+		dns_resolver->cache_negative_ttl = cfg->dns_cache_negative_ttl;
+	}
+
 	dns_resolver->r = rdns_resolver_new ();
 	rdns_bind_libevent (dns_resolver->r, dns_resolver->ev_base);
 
@@ -23,9 +23,17 @@
 #include "logger.h"
 #include "rdns.h"
 #include "upstream.h"
+#include "hash.h"
 
 struct rspamd_config;
 
+struct rspamd_dns_cache_stat {
+	guint64 hits;                /* answered from cache */
+	guint64 misses;              /* sent to a DNS server */
+	guint64 coalesced;           /* attached to an in-flight request */
+	guint64 shared;              /* answered by a reply of the same task */
+};
+
 struct rspamd_dns_resolver {
 	struct rdns_resolver *r;
 	struct event_base *ev_base;
@@ -33,6 +41,13 @@ struct rspamd_dns_resolver {
 	struct rspamd_config *cfg;
 	gdouble request_timeout;
 	guint max_retransmits;
+	/* Replies indexed by type and name, NULL if caching is disabled */
+	rspamd_lru_hash_t *cache;
+	/* In-flight requests indexed by type and name */
+	GHashTable *pending;
+	gdouble cache_max_ttl;
+	gdouble cache_negative_ttl;
+	struct rspamd_dns_cache_stat stat;
 };
 
 /* Rspamd DNS API */
@@ -62,6 +77,11 @@ gboolean make_dns_request (struct rspamd_dns_resolver *resolver,
 	enum rdns_request_type type,
 	const char *name);
 
+/**
+ * Make a DNS request for a task, only requests that are actually sent to
+ * servers (not served from the cache or coalesced with in-flight ones) are
+ * counted against `dns_max_requests`
+ */
 gboolean make_dns_request_task (struct rspamd_task *task,
 	dns_callback_type cb,
 	gpointer ud,
@@ -74,4 +94,17 @@ gboolean make_dns_request_task_forced (struct rspamd_task *task,
 	enum rdns_request_type type,
 	const char *name);
 
+/**
+ * Make a DNS request for a task using a specific timeout for each retransmit
+ * (`dns_timeout` is used if `timeout` is not positive); `forced` requests are
+ * not limited by `dns_max_requests`
+ */
+gboolean make_dns_request_task_full (struct rspamd_task *task,
+	dns_callback_type cb,
+	gpointer ud,
+	enum rdns_request_type type,
+	const char *name,
+	gboolean forced,
+	gdouble timeout);
+
 #endif
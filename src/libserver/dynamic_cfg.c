@@ -215,6 +215,198 @@ json_config_fin_cb (struct map_cb_data *data)
 	jb->cfg->current_dynamic_conf = top;
 }
 
+static GQuark
+rspamd_dynamic_conf_quark (void)
+{
+	return g_quark_from_static_string ("dynamic-conf");
+}
+
+static gboolean
+rspamd_dynamic_conf_symbol_exists (struct rspamd_config *cfg,
+		struct rspamd_metric *metric,
+		const gchar *sym)
+{
+	if (g_hash_table_lookup (metric->symbols, sym) != NULL) {
+		return TRUE;
+	}
+
+	return cfg->cache != NULL &&
+			rspamd_symbols_cache_find_symbol (cfg->cache, sym) >= 0;
+}
+
+/* Checks that all elements of the diff section refer to known symbols */
+static gboolean
+rspamd_dynamic_conf_check_symbols (struct rspamd_config *cfg,
+		struct rspamd_metric *metric,
+		const ucl_object_t *elt,
+		gboolean scores,
+		GError **err)
+{
+	const ucl_object_t *cur;
+	ucl_object_iter_t it = NULL;
+	const gchar *sym;
+	gdouble score;
+
+	if (elt == NULL) {
+		return TRUE;
+	}
+
+	if (ucl_object_type (elt) != (scores ? UCL_OBJECT : UCL_ARRAY)) {
+		g_set_error (err, rspamd_dynamic_conf_quark (), EINVAL,
+				"%s must be %s", ucl_object_key (elt),
+				scores ? "an object" : "an array");
+		return FALSE;
+	}
+
+	while ((cur = ucl_object_iterate (elt, &it, true)) != NULL) {
+		sym = scores ? ucl_object_key (cur) : ucl_object_tostring (cur);
+
+		if (sym == NULL) {
+			g_set_error (err, rspamd_dynamic_conf_quark (), EINVAL,
+					"invalid symbol in %s", ucl_object_key (elt));
+			return FALSE;
+		}
+
+		if (scores && !ucl_object_todouble_safe (cur, &score)) {
+			g_set_error (err, rspamd_dynamic_conf_quark (), EINVAL,
+					"invalid score for symbol %s", sym);
+			return FALSE;
+		}
+
+		if (!rspamd_dynamic_conf_symbol_exists (cfg, metric, sym)) {
+			g_set_error (err, rspamd_dynamic_conf_quark (), ENOENT,
+					"unknown symbol %s", sym);
+			return FALSE;
+		}
+
+		if (!scores && cfg->cache == NULL) {
+			g_set_error (err, rspamd_dynamic_conf_quark (), EINVAL,
+					"cannot enable or disable symbol %s without symbols cache",
+					sym);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+gint
+rspamd_dynamic_conf_apply_diff (struct rspamd_config *cfg,
+		const ucl_object_t *diff,
+		GError **err)
+{
+	const ucl_object_t *elt, *symbols, *actions, *enable, *disable, *cur;
+	ucl_object_iter_t it;
+	struct rspamd_metric *metric;
+	const gchar *metric_name = DEFAULT_METRIC, *name;
+	gint test_act, nchanges = 0;
+	gdouble score;
+	static const guint priority = 3;
+
+	if (diff == NULL || ucl_object_type (diff) != UCL_OBJECT) {
+		g_set_error (err, rspamd_dynamic_conf_quark (), EINVAL,
+				"diff must be an object");
+		return -1;
+	}
+
+	elt = ucl_object_lookup (diff, "metric");
+
+	if (elt) {
+		metric_name = ucl_object_tostring (elt);
+
+		if (metric_name == NULL) {
+			g_set_error (err, rspamd_dynamic_conf_quark (), EINVAL,
+					"metric must be a string");
+			return -1;
+		}
+	}
+
+	metric = g_hash_table_lookup (cfg->metrics, metric_name);
+
+	if (metric == NULL) {
+		g_set_error (err, rspamd_dynamic_conf_quark (), ENOENT,
+				"cannot find metric %s", metric_name);
+		return -1;
+	}
+
+	symbols = ucl_object_lookup (diff, "symbols");
+	actions = ucl_object_lookup (diff, "actions");
+	enable = ucl_object_lookup (diff, "enable");
+	disable = ucl_object_lookup (diff, "disable");
+
+	/* Validate everything first */
+	if (!rspamd_dynamic_conf_check_symbols (cfg, metric, symbols, TRUE, err) ||
+			!rspamd_dynamic_conf_check_symbols (cfg, metric, enable, FALSE, err) ||
+			!rspamd_dynamic_conf_check_symbols (cfg, metric, disable, FALSE, err)) {
+		return -1;
+	}
+
+	if (actions) {
+		if (ucl_object_type (actions) != UCL_OBJECT) {
+			g_set_error (err, rspamd_dynamic_conf_quark (), EINVAL,
+					"actions must be an object");
+			return -1;
+		}
+
+		it = NULL;
+
+		while ((cur = ucl_object_iterate (actions, &it, true)) != NULL) {
+			name = ucl_object_key (cur);
+
+			if (!rspamd_action_from_str (name, &test_act)) {
+				g_set_error (err, rspamd_dynamic_conf_quark (), ENOENT,
+						"unknown action %s", name);
+				return -1;
+			}
+
+			if (!ucl_object_todouble_safe (cur, &score)) {
+				g_set_error (err, rspamd_dynamic_conf_quark (), EINVAL,
+						"invalid score for action %s", name);
+				return -1;
+			}
+		}
+	}
+
+	/* Now apply changes */
+	it = NULL;
+
+	while (symbols && (cur = ucl_object_iterate (symbols, &it, true)) != NULL) {
+		rspamd_config_add_metric_symbol (cfg, metric->name,
+				ucl_object_key (cur), ucl_object_todouble (cur), NULL, NULL,
+				0, priority, cfg->default_max_shots);
+		nchanges ++;
+	}
+
+	it = NULL;
+
+	while (actions && (cur = ucl_object_iterate (actions, &it, true)) != NULL) {
+		rspamd_config_set_action_score (cfg, metric->name,
+				ucl_object_key (cur), ucl_object_todouble (cur), priority);
+		nchanges ++;
+	}
+
+	it = NULL;
+
+	while (enable && (cur = ucl_object_iterate (enable, &it, true)) != NULL) {
+		rspamd_symbols_cache_enable_symbol (cfg->cache,
+				ucl_object_tostring (cur));
+		nchanges ++;
+	}
+
+	it = NULL;
+
+	while (disable && (cur = ucl_object_iterate (disable, &it, true)) != NULL) {
+		rspamd_symbols_cache_disable_symbol (cfg->cache,
+				ucl_object_tostring (cur));
+		nchanges ++;
+	}
+
+	msg_info_config ("applied %d dynamic changes for metric %s", nchanges,
+			metric->name);
+
+	return nchanges;
+}
+
 /**
  * Init dynamic configuration using map logic and specific configuration
  * @param cfg config file
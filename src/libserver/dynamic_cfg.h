@@ -69,4 +69,19 @@ gboolean remove_dynamic_action (struct rspamd_config *cfg,
 		const gchar *metric,
 		guint action);
 
+/**
+ * Applies an incremental update to the running configuration. Diff is an
+ * object with optional fields: `metric` (default metric if missing),
+ * `symbols` and `actions` (objects of name -> score), `enable` and `disable`
+ * (arrays of symbols names). The whole diff is validated before applying,
+ * so either all changes are applied or none of them.
+ * @param cfg config file object
+ * @param diff diff object
+ * @param err error
+ * @return number of changes applied or -1 on error
+ */
+gint rspamd_dynamic_conf_apply_diff (struct rspamd_config *cfg,
+		const ucl_object_t *diff,
+		GError **err);
+
 #endif /* DYNAMIC_CFG_H_ */
@@ -16,7 +16,7 @@
 #include "config.h"
 #include "rspamd.h"
 #include "events.h"
-#include "cryptobox.h"
+#include "utlist.h"
 
 #define RSPAMD_SESSION_FLAG_WATCHING (1 << 0)
 #define RSPAMD_SESSION_FLAG_DESTROYING (1 << 1)
@@ -53,51 +53,23 @@ struct rspamd_async_event {
 	event_finalizer_t fin;
 	void *user_data;
 	struct rspamd_async_watcher *w;
+	struct rspamd_async_event *prev, *next;
 };
 
 struct rspamd_async_session {
 	session_finalizer_t fin;
 	event_finalizer_t restore;
 	event_finalizer_t cleanup;
-	GHashTable *events;
+	/* Pending events and records that could be reused */
+	struct rspamd_async_event *events;
+	struct rspamd_async_event *free_events;
+	guint nevents;
 	void *user_data;
 	rspamd_mempool_t *pool;
 	struct rspamd_async_watcher *cur_watcher;
 	guint flags;
 };
 
-static gboolean
-rspamd_event_equal (gconstpointer a, gconstpointer b)
-{
-	const struct rspamd_async_event *ev1 = a, *ev2 = b;
-
-	if (ev1->fin == ev2->fin) {
-		return ev1->user_data == ev2->user_data;
-	}
-
-	return FALSE;
-}
-
-static guint
-rspamd_event_hash (gconstpointer a)
-{
-	const struct rspamd_async_event *ev = a;
-	rspamd_cryptobox_fast_hash_state_t st;
-	union {
-		event_finalizer_t f;
-		gpointer p;
-	} u;
-
-	u.f = ev->fin;
-
-	rspamd_cryptobox_fast_hash_init (&st, rspamd_hash_seed ());
-	rspamd_cryptobox_fast_hash_update (&st, &ev->user_data, sizeof (gpointer));
-	rspamd_cryptobox_fast_hash_update (&st, &u, sizeof (u));
-
-	return rspamd_cryptobox_fast_hash_final (&st);
-}
-
-
 struct rspamd_async_session *
 rspamd_session_create (rspamd_mempool_t * pool, session_finalizer_t fin,
 	event_finalizer_t restore, event_finalizer_t cleanup, void *user_data)
@@ -110,16 +82,11 @@ rspamd_session_create (rspamd_mempool_t * pool, session_finalizer_t fin,
 	new->restore = restore;
 	new->cleanup = cleanup;
 	new->user_data = user_data;
-	new->events = g_hash_table_new (rspamd_event_hash, rspamd_event_equal);
-
-	rspamd_mempool_add_destructor (pool,
-		(rspamd_mempool_destruct_t) g_hash_table_destroy,
-		new->events);
 
 	return new;
 }
 
-void
+struct rspamd_async_event *
 rspamd_session_add_event (struct rspamd_async_session *session,
 	event_finalizer_t fin,
 	void *user_data,
@@ -129,11 +96,18 @@ rspamd_session_add_event (struct rspamd_async_session *session,
 
 	if (session == NULL) {
 		msg_err ("session is NULL");
-		return;
+		return NULL;
+	}
+
+	if (session->free_events) {
+		new = session->free_events;
+		session->free_events = new->next;
+	}
+	else {
+		new = rspamd_mempool_alloc (session->pool,
+				sizeof (struct rspamd_async_event));
 	}
 
-	new = rspamd_mempool_alloc (session->pool,
-			sizeof (struct rspamd_async_event));
 	new->fin = fin;
 	new->user_data = user_data;
 	new->subsystem = subsystem;
@@ -146,12 +120,15 @@ rspamd_session_add_event (struct rspamd_async_session *session,
 		new->w = NULL;
 	}
 
-	g_hash_table_insert (session->events, new, new);
+	DL_PREPEND (session->events, new);
+	session->nevents ++;
 
 	msg_debug_session ("added event: %p, pending %d events, subsystem: %s",
 		user_data,
-		g_hash_table_size (session->events),
+		session->nevents,
 		g_quark_to_string (subsystem));
+
+	return new;
 }
 
 void
@@ -159,7 +136,7 @@ rspamd_session_remove_event (struct rspamd_async_session *session,
 	event_finalizer_t fin,
 	void *ud)
 {
-	struct rspamd_async_event search_ev, *found_ev;
+	struct rspamd_async_event *found_ev;
 
 	if (session == NULL) {
 		msg_err ("session is NULL");
@@ -167,16 +144,34 @@ rspamd_session_remove_event (struct rspamd_async_session *session,
 	}
 
 	/* Search for event */
-	search_ev.fin = fin;
-	search_ev.user_data = ud;
-	found_ev = g_hash_table_lookup (session->events, &search_ev);
+	DL_FOREACH (session->events, found_ev) {
+		if (found_ev->fin == fin && found_ev->user_data == ud) {
+			break;
+		}
+	}
+
+	g_assert (found_ev != NULL);
+
+	rspamd_session_remove_event_specific (session, found_ev);
+}
+
+void
+rspamd_session_remove_event_specific (struct rspamd_async_session *session,
+	struct rspamd_async_event *found_ev)
+{
+	if (session == NULL) {
+		msg_err ("session is NULL");
+		return;
+	}
+
 	g_assert (found_ev != NULL);
 
-	msg_debug_session ("removed event: %p, subsystem: %s, pending %d events", ud,
+	msg_debug_session ("removed event: %p, subsystem: %s, pending %d events",
+			found_ev->user_data,
 			g_quark_to_string (found_ev->subsystem),
-			g_hash_table_size (session->events));
+			session->nevents);
 	/* Remove event */
-	fin (ud);
+	found_ev->fin (found_ev->user_data);
 
 	/* Call watcher if needed */
 	if (found_ev->w) {
@@ -187,29 +182,18 @@ rspamd_session_remove_event (struct rspamd_async_session *session,
 		}
 	}
 
-	g_hash_table_remove (session->events, found_ev);
-
-	rspamd_session_pending (session);
-}
-
-static gboolean
-rspamd_session_destroy_callback (gpointer k, gpointer v, gpointer d)
-{
-	struct rspamd_async_event *ev = v;
-	struct rspamd_async_session *session = d;
-
-	/* Call event's finalizer */
-	msg_debug_session ("removed event on destroy: %p, subsystem: %s",
-			ev->user_data,
-			g_quark_to_string (ev->subsystem));
-
-	if (ev->fin != NULL) {
-		ev->fin (ev->user_data);
+	/*
+	 * Linked events always have prev set, it is cleared if the session
+	 * has been cleaned up from the callbacks above
+	 */
+	if (found_ev->prev != NULL) {
+		DL_DELETE (session->events, found_ev);
+		session->nevents --;
+		found_ev->next = session->free_events;
+		session->free_events = found_ev;
 	}
 
-	/* We ignore watchers on session destroying */
-
-	return TRUE;
+	rspamd_session_pending (session);
 }
 
 gboolean
@@ -235,14 +219,31 @@ rspamd_session_destroy (struct rspamd_async_session *session)
 void
 rspamd_session_cleanup (struct rspamd_async_session *session)
 {
+	struct rspamd_async_event *ev, *tmp, *events;
+
 	if (session == NULL) {
 		msg_err ("session is NULL");
 		return;
 	}
 
-	g_hash_table_foreach_remove (session->events,
-			rspamd_session_destroy_callback,
-			session);
+	/* Detach the list, so finalizers could not see events being destroyed */
+	events = session->events;
+	session->events = NULL;
+	session->nevents = 0;
+
+	DL_FOREACH_SAFE (events, ev, tmp) {
+		/* Call event's finalizer */
+		msg_debug_session ("removed event on destroy: %p, subsystem: %s",
+				ev->user_data,
+				g_quark_to_string (ev->subsystem));
+
+		if (ev->fin != NULL) {
+			ev->fin (ev->user_data);
+		}
+
+		/* We ignore watchers on session destroying */
+		ev->prev = NULL;
+	}
 }
 
 gboolean
@@ -250,7 +251,7 @@ rspamd_session_pending (struct rspamd_async_session *session)
 {
 	gboolean ret = TRUE;
 
-	if (g_hash_table_size (session->events) == 0) {
+	if (session->nevents == 0) {
 		if (session->fin != NULL) {
 			msg_debug_session ("call fin handler, as no events are pending");
 
@@ -321,7 +322,7 @@ rspamd_session_events_pending (struct rspamd_async_session *session)
 
 	g_assert (session != NULL);
 
-	npending = g_hash_table_size (session->events);
+	npending = session->nevents;
 	msg_debug_session ("pending %d events", npending);
 
 	if (RSPAMD_SESSION_IS_WATCHING (session)) {
@@ -45,9 +45,11 @@ struct rspamd_async_session * rspamd_session_create (rspamd_mempool_t *pool,
  * @param session session object
  * @param fin finalizer callback
  * @param user_data abstract user_data
- * @param forced unused
+ * @param subsystem subsystem of the event
+ * @return event handle that could be passed to rspamd_session_remove_event_specific
  */
-void rspamd_session_add_event (struct rspamd_async_session *session,
+struct rspamd_async_event * rspamd_session_add_event (
+	struct rspamd_async_session *session,
 	event_finalizer_t fin, gpointer user_data, GQuark subsystem);
 
 /**
@@ -60,6 +62,15 @@ void rspamd_session_remove_event (struct rspamd_async_session *session,
 	event_finalizer_t fin,
 	gpointer ud);
 
+/**
+ * Remove event using the handle returned by rspamd_session_add_event,
+ * unlike rspamd_session_remove_event it does not search for the event
+ * @param session session object
+ * @param ev event handle
+ */
+void rspamd_session_remove_event_specific (struct rspamd_async_session *session,
+	struct rspamd_async_event *ev);
+
 /**
  * Must be called at the end of session, it calls fin functions for all non-forced callbacks
  * @return true if the whole session was destroyed and false if there are forced events
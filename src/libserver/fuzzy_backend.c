@@ -17,6 +17,7 @@
 #include "config.h"
 #include "fuzzy_backend.h"
 #include "fuzzy_backend_sqlite.h"
+#include "fuzzy_backend_native.h"
 #include "fuzzy_backend_redis.h"
 #include "cfg_file.h"
 
@@ -25,6 +26,7 @@
 enum rspamd_fuzzy_backend_type {
 	RSPAMD_FUZZY_BACKEND_SQLITE = 0,
 	RSPAMD_FUZZY_BACKEND_REDIS = 1,
+	RSPAMD_FUZZY_BACKEND_NATIVE = 2,
 };
 
 static void* rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
@@ -51,6 +53,30 @@ static void rspamd_fuzzy_backend_expire_sqlite (struct rspamd_fuzzy_backend *bk,
 static void rspamd_fuzzy_backend_close_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
 
+static void* rspamd_fuzzy_backend_init_native (struct rspamd_fuzzy_backend *bk,
+		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err);
+static void rspamd_fuzzy_backend_check_native (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud,
+		void *subr_ud);
+static void rspamd_fuzzy_backend_update_native (struct rspamd_fuzzy_backend *bk,
+		GQueue *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
+		void *subr_ud);
+static void rspamd_fuzzy_backend_count_native (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_count_cb cb, void *ud,
+		void *subr_ud);
+static void rspamd_fuzzy_backend_version_native (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		rspamd_fuzzy_version_cb cb, void *ud,
+		void *subr_ud);
+static const gchar* rspamd_fuzzy_backend_id_native (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud);
+static void rspamd_fuzzy_backend_expire_native (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud);
+static void rspamd_fuzzy_backend_close_native (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud);
+
 struct rspamd_fuzzy_backend_subr {
 	void* (*init) (struct rspamd_fuzzy_backend *bk, const ucl_object_t *obj,
 			struct rspamd_config *cfg,
@@ -96,8 +122,18 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 		.id = rspamd_fuzzy_backend_id_redis,
 		.periodic = rspamd_fuzzy_backend_expire_redis,
 		.close = rspamd_fuzzy_backend_close_redis,
-	}
+	},
 #endif
+	[RSPAMD_FUZZY_BACKEND_NATIVE] = {
+		.init = rspamd_fuzzy_backend_init_native,
+		.check = rspamd_fuzzy_backend_check_native,
+		.update = rspamd_fuzzy_backend_update_native,
+		.count = rspamd_fuzzy_backend_count_native,
+		.version = rspamd_fuzzy_backend_version_native,
+		.id = rspamd_fuzzy_backend_id_native,
+		.periodic = rspamd_fuzzy_backend_expire_native,
+		.close = rspamd_fuzzy_backend_close_native,
+	},
 };
 
 struct rspamd_fuzzy_backend {
@@ -110,8 +146,14 @@ struct rspamd_fuzzy_backend {
 	const struct rspamd_fuzzy_backend_subr *subr;
 	void *subr_ud;
 	struct event periodic_event;
+	/* Continuation of an incremental expire */
+	struct event expire_event;
+	gboolean expire_pending;
 };
 
+/* Time spent expiring hashes before returning to the event loop */
+static const gdouble fuzzy_expire_step_time = 0.01;
+
 static GQuark
 rspamd_fuzzy_backend_quark (void)
 {
@@ -243,13 +285,40 @@ rspamd_fuzzy_backend_id_sqlite (struct rspamd_fuzzy_backend *bk,
 
 	return rspamd_fuzzy_sqlite_backend_id (sq);
 }
+static void rspamd_fuzzy_backend_expire_sqlite (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud);
+
+static void
+rspamd_fuzzy_backend_expire_step_cb (gint fd, short what, void *ud)
+{
+	struct rspamd_fuzzy_backend *bk = ud;
+
+	bk->expire_pending = FALSE;
+	rspamd_fuzzy_backend_expire_sqlite (bk, bk->subr_ud);
+}
+
 static void
 rspamd_fuzzy_backend_expire_sqlite (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud)
 {
 	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+	struct timeval tv;
 
-	rspamd_fuzzy_backend_sqlite_sync (sq, bk->expire, TRUE);
+	if (bk->expire_pending) {
+		return;
+	}
+
+	if (rspamd_fuzzy_backend_sqlite_expire_step (sq, bk->expire,
+			fuzzy_expire_step_time)) {
+		/* Let the event loop process requests before the next step */
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		event_set (&bk->expire_event, -1, EV_TIMEOUT,
+				rspamd_fuzzy_backend_expire_step_cb, bk);
+		event_base_set (bk->ev_base, &bk->expire_event);
+		event_add (&bk->expire_event, &tv);
+		bk->expire_pending = TRUE;
+	}
 }
 
 static void
@@ -258,9 +327,162 @@ rspamd_fuzzy_backend_close_sqlite (struct rspamd_fuzzy_backend *bk,
 {
 	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
 
+	if (bk->expire_pending) {
+		event_del (&bk->expire_event);
+		bk->expire_pending = FALSE;
+	}
+
+	/*
+	 * Shingles are removed by cascade, orphans can only be left by legacy
+	 * databases, so do not scan for them on each sync
+	 */
+	rspamd_fuzzy_backend_sqlite_sync (sq, bk->expire, TRUE);
 	rspamd_fuzzy_backend_sqlite_close (sq);
 }
 
+static void*
+rspamd_fuzzy_backend_init_native (struct rspamd_fuzzy_backend *bk,
+		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_lookup_any (obj, "hashfile", "hash_file", "file",
+			"database", NULL);
+
+	if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+		g_set_error (err, rspamd_fuzzy_backend_quark (),
+				EINVAL, "missing fuzzy log path");
+		return NULL;
+	}
+
+	return rspamd_fuzzy_backend_native_open (ucl_object_tostring (elt), err);
+}
+
+static void
+rspamd_fuzzy_backend_check_native (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_native *nb = subr_ud;
+	struct rspamd_fuzzy_reply rep;
+
+	rep = rspamd_fuzzy_backend_native_check (nb, cmd, bk->expire);
+
+	if (cb) {
+		cb (&rep, ud);
+	}
+}
+
+static void
+rspamd_fuzzy_backend_update_native (struct rspamd_fuzzy_backend *bk,
+		GQueue *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_native *nb = subr_ud;
+	gboolean success = FALSE;
+	GList *cur;
+	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	gpointer ptr;
+	guint nupdates = 0;
+
+	if (rspamd_fuzzy_backend_native_prepare_update (nb, src)) {
+		cur = updates->head;
+
+		while (cur) {
+			io_cmd = cur->data;
+
+			if (io_cmd->is_shingle) {
+				cmd = &io_cmd->cmd.shingle.basic;
+				ptr = &io_cmd->cmd.shingle;
+			}
+			else {
+				cmd = &io_cmd->cmd.normal;
+				ptr = &io_cmd->cmd.normal;
+			}
+
+			if (cmd->cmd == FUZZY_WRITE) {
+				rspamd_fuzzy_backend_native_add (nb, ptr);
+			}
+			else {
+				rspamd_fuzzy_backend_native_del (nb, ptr);
+			}
+
+			nupdates ++;
+			cur = g_list_next (cur);
+		}
+
+		if (rspamd_fuzzy_backend_native_finish_update (nb, src,
+				nupdates > 0)) {
+			success = TRUE;
+		}
+	}
+
+	if (cb) {
+		cb (success, ud);
+	}
+}
+
+static void
+rspamd_fuzzy_backend_count_native (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_count_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_native *nb = subr_ud;
+	guint64 nhashes;
+
+	nhashes = rspamd_fuzzy_backend_native_count (nb);
+
+	if (cb) {
+		cb (nhashes, ud);
+	}
+}
+
+static void
+rspamd_fuzzy_backend_version_native (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		rspamd_fuzzy_version_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_native *nb = subr_ud;
+	guint64 rev;
+
+	rev = rspamd_fuzzy_backend_native_version (nb, src);
+
+	if (cb) {
+		cb (rev, ud);
+	}
+}
+
+static const gchar*
+rspamd_fuzzy_backend_id_native (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_native *nb = subr_ud;
+
+	return rspamd_fuzzy_backend_native_id (nb);
+}
+
+static void
+rspamd_fuzzy_backend_expire_native (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_native *nb = subr_ud;
+
+	rspamd_fuzzy_backend_native_sync (nb, bk->expire, FALSE);
+}
+
+static void
+rspamd_fuzzy_backend_close_native (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_native *nb = subr_ud;
+
+	rspamd_fuzzy_backend_native_close (nb);
+}
+
 
 struct rspamd_fuzzy_backend *
 rspamd_fuzzy_backend_create (struct event_base *ev_base,
@@ -283,6 +505,9 @@ rspamd_fuzzy_backend_create (struct event_base *ev_base,
 			else if (strcmp (ucl_object_tostring (elt), "redis") == 0) {
 				type = RSPAMD_FUZZY_BACKEND_REDIS;
 			}
+			else if (strcmp (ucl_object_tostring (elt), "native") == 0) {
+				type = RSPAMD_FUZZY_BACKEND_NATIVE;
+			}
 			else {
 				g_set_error (err, rspamd_fuzzy_backend_quark (),
 						EINVAL, "invalid backend type: %s",
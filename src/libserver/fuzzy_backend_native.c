@@ -0,0 +1,1278 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend_native.h"
+#include "unix-std.h"
+
+#include <sys/mman.h>
+#include <sqlite3.h>
+
+/*
+ * Log layout: header followed by packed records. Each add record is followed by
+ * `nshingles` 64 bit shingle values. Version records store the source name in
+ * the digest field and the version in the value field.
+ *
+ * Only one process (the first fuzzy worker) appends to the log, all other
+ * processes just replay the tail of the log to their in-memory indexes.
+ * Compaction writes a new log and renames it over the old one, readers detect
+ * that by inode change and reload the log completely.
+ */
+#define RSPAMD_FUZZY_NATIVE_MAGIC "rsfzlog1"
+#define RSPAMD_FUZZY_NATIVE_LOG_VERSION 1
+#define RSPAMD_FUZZY_NATIVE_DELETED G_MAXUINT64
+#define RSPAMD_FUZZY_NATIVE_INITIAL_SIZE 1024
+#define RSPAMD_FUZZY_NATIVE_REFRESH_INTERVAL 1
+#define RSPAMD_FUZZY_NATIVE_WRITE_BUF (1024 * 1024)
+
+enum rspamd_fuzzy_native_op {
+	RSPAMD_FUZZY_NATIVE_ADD = 1,
+	RSPAMD_FUZZY_NATIVE_DEL = 2,
+	RSPAMD_FUZZY_NATIVE_VERSION = 3,
+};
+
+RSPAMD_PACKED(rspamd_fuzzy_native_hdr) {
+	gchar magic[8];
+	guint32 version;
+	guint32 reserved;
+};
+
+RSPAMD_PACKED(rspamd_fuzzy_native_rec) {
+	guint8 op;
+	guint8 nshingles;
+	guint16 reserved;
+	guint32 flag;
+	gint64 value;
+	gint64 time;
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+};
+
+/* Digest index element, `off` points to the record with digest and shingles */
+struct rspamd_fuzzy_native_elt {
+	guint64 off;
+	gint64 time;
+	gint64 value;
+	guint32 flag;
+};
+
+struct rspamd_fuzzy_native_digests {
+	struct rspamd_fuzzy_native_elt *elts;
+	gsize size;
+	gsize nelts;
+	gsize ndeleted;
+};
+
+/* Shingles index element, stale elements are filtered by digests index */
+struct rspamd_fuzzy_native_shingle {
+	guint64 value;
+	guint64 off;
+};
+
+struct rspamd_fuzzy_native_shingles {
+	struct rspamd_fuzzy_native_shingle *elts;
+	gsize size;
+	gsize nelts;
+};
+
+struct rspamd_fuzzy_backend_native {
+	gchar *path;
+	gint fd;
+	ino_t ino;
+	guchar *map;
+	gsize map_len;
+	gsize consumed;
+	gsize garbage;
+	time_t last_refresh;
+	struct rspamd_fuzzy_native_digests digests;
+	struct rspamd_fuzzy_native_shingles shingles[RSPAMD_SHINGLE_SIZE];
+	GHashTable *versions;
+	GByteArray *pending;
+	gchar id[MEMPOOL_UID_LEN];
+	rspamd_mempool_t *pool;
+};
+
+#define msg_err_fuzzy_backend(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_warn_fuzzy_backend(...)   rspamd_default_log_function (G_LOG_LEVEL_WARNING, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_fuzzy_backend(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_debug_fuzzy_backend(...)  rspamd_default_log_function (G_LOG_LEVEL_DEBUG, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+static GQuark
+rspamd_fuzzy_backend_native_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-backend-native");
+}
+
+static inline gsize
+rspamd_fuzzy_native_rec_size (guint nshingles)
+{
+	return sizeof (struct rspamd_fuzzy_native_rec) + nshingles * sizeof (guint64);
+}
+
+static inline const guchar *
+rspamd_fuzzy_native_rec_digest (struct rspamd_fuzzy_backend_native *backend,
+		guint64 off)
+{
+	return backend->map + off +
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_native_rec, digest);
+}
+
+static inline guint64
+rspamd_fuzzy_native_digest_hash (const guchar *digest)
+{
+	guint64 h;
+
+	/* Digests are cryptographic hashes, so any part of them is good enough */
+	memcpy (&h, digest, sizeof (h));
+
+	return h;
+}
+
+static struct rspamd_fuzzy_native_elt *
+rspamd_fuzzy_native_find (struct rspamd_fuzzy_backend_native *backend,
+		const guchar *digest)
+{
+	struct rspamd_fuzzy_native_digests *tbl = &backend->digests;
+	struct rspamd_fuzzy_native_elt *elt;
+	gsize i, mask;
+
+	if (tbl->size == 0) {
+		return NULL;
+	}
+
+	mask = tbl->size - 1;
+	i = rspamd_fuzzy_native_digest_hash (digest) & mask;
+
+	for (;;) {
+		elt = &tbl->elts[i];
+
+		if (elt->off == 0) {
+			return NULL;
+		}
+
+		if (elt->off != RSPAMD_FUZZY_NATIVE_DELETED &&
+				memcmp (rspamd_fuzzy_native_rec_digest (backend, elt->off),
+						digest, rspamd_cryptobox_HASHBYTES) == 0) {
+			return elt;
+		}
+
+		i = (i + 1) & mask;
+	}
+}
+
+static void
+rspamd_fuzzy_native_digests_resize (struct rspamd_fuzzy_backend_native *backend,
+		gsize nsize)
+{
+	struct rspamd_fuzzy_native_digests *tbl = &backend->digests;
+	struct rspamd_fuzzy_native_elt *old = tbl->elts, *elt;
+	gsize osize = tbl->size, i, j, mask;
+
+	tbl->elts = g_malloc0 (nsize * sizeof (*tbl->elts));
+	tbl->size = nsize;
+	tbl->ndeleted = 0;
+	mask = nsize - 1;
+
+	for (i = 0; i < osize; i ++) {
+		elt = &old[i];
+
+		if (elt->off == 0 || elt->off == RSPAMD_FUZZY_NATIVE_DELETED) {
+			continue;
+		}
+
+		j = rspamd_fuzzy_native_digest_hash (
+				rspamd_fuzzy_native_rec_digest (backend, elt->off)) & mask;
+
+		while (tbl->elts[j].off != 0) {
+			j = (j + 1) & mask;
+		}
+
+		tbl->elts[j] = *elt;
+	}
+
+	g_free (old);
+}
+
+/* Digest must not be in the index */
+static struct rspamd_fuzzy_native_elt *
+rspamd_fuzzy_native_insert (struct rspamd_fuzzy_backend_native *backend,
+		const guchar *digest, guint64 off)
+{
+	struct rspamd_fuzzy_native_digests *tbl = &backend->digests;
+	gsize i, mask, nsize;
+
+	if ((tbl->nelts + tbl->ndeleted + 1) * 4 > tbl->size * 3) {
+		nsize = MAX (tbl->size, RSPAMD_FUZZY_NATIVE_INITIAL_SIZE);
+
+		while ((tbl->nelts + 1) * 2 > nsize) {
+			nsize *= 2;
+		}
+
+		rspamd_fuzzy_native_digests_resize (backend, nsize);
+	}
+
+	mask = tbl->size - 1;
+	i = rspamd_fuzzy_native_digest_hash (digest) & mask;
+
+	while (tbl->elts[i].off != 0 &&
+			tbl->elts[i].off != RSPAMD_FUZZY_NATIVE_DELETED) {
+		i = (i + 1) & mask;
+	}
+
+	if (tbl->elts[i].off == RSPAMD_FUZZY_NATIVE_DELETED) {
+		tbl->ndeleted --;
+	}
+
+	tbl->elts[i].off = off;
+	tbl->nelts ++;
+
+	return &tbl->elts[i];
+}
+
+static void
+rspamd_fuzzy_native_remove (struct rspamd_fuzzy_backend_native *backend,
+		struct rspamd_fuzzy_native_elt *elt)
+{
+	elt->off = RSPAMD_FUZZY_NATIVE_DELETED;
+	backend->digests.nelts --;
+	backend->digests.ndeleted ++;
+}
+
+static void
+rspamd_fuzzy_native_shingles_resize (struct rspamd_fuzzy_native_shingles *tbl,
+		gsize nsize)
+{
+	struct rspamd_fuzzy_native_shingle *old = tbl->elts;
+	gsize osize = tbl->size, i, j, mask;
+
+	tbl->elts = g_malloc0 (nsize * sizeof (*tbl->elts));
+	tbl->size = nsize;
+	mask = nsize - 1;
+
+	for (i = 0; i < osize; i ++) {
+		if (old[i].off == 0) {
+			continue;
+		}
+
+		j = old[i].value & mask;
+
+		while (tbl->elts[j].off != 0) {
+			j = (j + 1) & mask;
+		}
+
+		tbl->elts[j] = old[i];
+	}
+
+	g_free (old);
+}
+
+static void
+rspamd_fuzzy_native_shingle_insert (struct rspamd_fuzzy_native_shingles *tbl,
+		guint64 value, guint64 off)
+{
+	gsize i, mask;
+
+	if ((tbl->nelts + 1) * 4 > tbl->size * 3) {
+		rspamd_fuzzy_native_shingles_resize (tbl,
+				tbl->size ? tbl->size * 2 : RSPAMD_FUZZY_NATIVE_INITIAL_SIZE);
+	}
+
+	mask = tbl->size - 1;
+	i = value & mask;
+
+	while (tbl->elts[i].off != 0) {
+		if (tbl->elts[i].value == value) {
+			/* Like `INSERT OR REPLACE` in sqlite backend */
+			tbl->elts[i].off = off;
+
+			return;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	tbl->elts[i].value = value;
+	tbl->elts[i].off = off;
+	tbl->nelts ++;
+}
+
+static guint64
+rspamd_fuzzy_native_shingle_lookup (struct rspamd_fuzzy_native_shingles *tbl,
+		guint64 value)
+{
+	gsize i, mask;
+
+	if (tbl->size == 0) {
+		return 0;
+	}
+
+	mask = tbl->size - 1;
+	i = value & mask;
+
+	while (tbl->elts[i].off != 0) {
+		if (tbl->elts[i].value == value) {
+			return tbl->elts[i].off;
+		}
+
+		i = (i + 1) & mask;
+	}
+
+	return 0;
+}
+
+static void
+rspamd_fuzzy_native_apply (struct rspamd_fuzzy_backend_native *backend,
+		const struct rspamd_fuzzy_native_rec *rec, guint64 off)
+{
+	struct rspamd_fuzzy_native_elt *elt;
+	struct rspamd_fuzzy_native_rec old;
+	gsize rlen = rspamd_fuzzy_native_rec_size (rec->nshingles);
+	guint64 shingle;
+	gchar *name;
+	gint64 version;
+	guint i;
+
+	switch (rec->op) {
+	case RSPAMD_FUZZY_NATIVE_ADD:
+		elt = rspamd_fuzzy_native_find (backend, rec->digest);
+
+		if (elt) {
+			if (elt->flag == rec->flag) {
+				elt->value += rec->value;
+			}
+			else {
+				elt->value = rec->value;
+				elt->flag = rec->flag;
+			}
+
+			elt->time = rec->time;
+			backend->garbage += rlen;
+		}
+		else {
+			elt = rspamd_fuzzy_native_insert (backend, rec->digest, off);
+			elt->value = rec->value;
+			elt->flag = rec->flag;
+			elt->time = rec->time;
+
+			for (i = 0; i < rec->nshingles; i ++) {
+				memcpy (&shingle, backend->map + off + sizeof (*rec) +
+						i * sizeof (shingle), sizeof (shingle));
+				rspamd_fuzzy_native_shingle_insert (&backend->shingles[i],
+						shingle, off);
+			}
+		}
+		break;
+	case RSPAMD_FUZZY_NATIVE_DEL:
+		elt = rspamd_fuzzy_native_find (backend, rec->digest);
+
+		if (elt) {
+			memcpy (&old, backend->map + elt->off, sizeof (old));
+			backend->garbage += rspamd_fuzzy_native_rec_size (old.nshingles);
+			rspamd_fuzzy_native_remove (backend, elt);
+		}
+
+		backend->garbage += rlen;
+		break;
+	case RSPAMD_FUZZY_NATIVE_VERSION:
+		name = g_strndup ((const gchar *)rec->digest, sizeof (rec->digest));
+
+		if (g_hash_table_lookup_extended (backend->versions, name,
+				NULL, NULL)) {
+			backend->garbage += rlen;
+		}
+
+		/* Versions are boxed to keep all 64 bits and to allow version 0 */
+		version = rec->value;
+		g_hash_table_replace (backend->versions, name,
+				g_memdup (&version, sizeof (version)));
+		break;
+	}
+}
+
+static gboolean
+rspamd_fuzzy_native_map (struct rspamd_fuzzy_backend_native *backend,
+		GError **err)
+{
+	struct stat st;
+	gpointer map;
+
+	if (fstat (backend->fd, &st) == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+				errno, "cannot stat %s: %s", backend->path, strerror (errno));
+		return FALSE;
+	}
+
+	if ((gsize)st.st_size == backend->map_len) {
+		return TRUE;
+	}
+
+	if (backend->map) {
+		munmap (backend->map, backend->map_len);
+		backend->map = NULL;
+		backend->map_len = 0;
+	}
+
+	if (st.st_size == 0) {
+		return TRUE;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, backend->fd, 0);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+				errno, "cannot mmap %s: %s", backend->path, strerror (errno));
+		return FALSE;
+	}
+
+	backend->map = map;
+	backend->map_len = st.st_size;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_native_replay (struct rspamd_fuzzy_backend_native *backend)
+{
+	struct rspamd_fuzzy_native_rec rec;
+	gsize rlen;
+
+	while (backend->consumed + sizeof (rec) <= backend->map_len) {
+		memcpy (&rec, backend->map + backend->consumed, sizeof (rec));
+
+		if (rec.op < RSPAMD_FUZZY_NATIVE_ADD ||
+				rec.op > RSPAMD_FUZZY_NATIVE_VERSION ||
+				(rec.nshingles != 0 && rec.nshingles != RSPAMD_SHINGLE_SIZE)) {
+			msg_err_fuzzy_backend ("corrupted record at offset %z of %s",
+					backend->consumed, backend->path);
+
+			return FALSE;
+		}
+
+		rlen = rspamd_fuzzy_native_rec_size (rec.nshingles);
+
+		if (backend->consumed + rlen > backend->map_len) {
+			/* Record is not completely written yet */
+			break;
+		}
+
+		rspamd_fuzzy_native_apply (backend, &rec, backend->consumed);
+		backend->consumed += rlen;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_native_write (gint fd, const guchar *data, gsize len)
+{
+	gssize r;
+
+	while (len > 0) {
+		r = write (fd, data, len);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		data += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_native_sync_fd (gint fd)
+{
+#ifdef HAVE_FDATASYNC
+	fdatasync (fd);
+#else
+	fsync (fd);
+#endif
+}
+
+static void
+rspamd_fuzzy_native_reset (struct rspamd_fuzzy_backend_native *backend)
+{
+	guint i;
+
+	if (backend->map) {
+		munmap (backend->map, backend->map_len);
+		backend->map = NULL;
+		backend->map_len = 0;
+	}
+
+	if (backend->fd != -1) {
+		close (backend->fd);
+		backend->fd = -1;
+	}
+
+	g_free (backend->digests.elts);
+	memset (&backend->digests, 0, sizeof (backend->digests));
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		g_free (backend->shingles[i].elts);
+		memset (&backend->shingles[i], 0, sizeof (backend->shingles[i]));
+	}
+
+	g_hash_table_remove_all (backend->versions);
+	backend->consumed = 0;
+	backend->garbage = 0;
+}
+
+static gboolean
+rspamd_fuzzy_native_load (struct rspamd_fuzzy_backend_native *backend,
+		GError **err)
+{
+	struct rspamd_fuzzy_native_hdr hdr;
+	struct stat st;
+
+	backend->fd = rspamd_file_xopen (backend->path,
+			O_RDWR | O_CREAT | O_APPEND, 00644);
+
+	if (backend->fd == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+				errno, "cannot open %s: %s", backend->path, strerror (errno));
+		return FALSE;
+	}
+
+	/* All workers open the log at the same time, so serialize header creation */
+	rspamd_file_lock (backend->fd, FALSE);
+
+	if (fstat (backend->fd, &st) == -1) {
+		rspamd_file_unlock (backend->fd, FALSE);
+		g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+				errno, "cannot stat %s: %s", backend->path, strerror (errno));
+		return FALSE;
+	}
+
+	backend->ino = st.st_ino;
+
+	if (st.st_size == 0) {
+		memset (&hdr, 0, sizeof (hdr));
+		memcpy (hdr.magic, RSPAMD_FUZZY_NATIVE_MAGIC, sizeof (hdr.magic));
+		hdr.version = RSPAMD_FUZZY_NATIVE_LOG_VERSION;
+
+		if (!rspamd_fuzzy_native_write (backend->fd, (const guchar *)&hdr,
+				sizeof (hdr))) {
+			rspamd_file_unlock (backend->fd, FALSE);
+			g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+					errno, "cannot write %s: %s", backend->path,
+					strerror (errno));
+			return FALSE;
+		}
+	}
+
+	rspamd_file_unlock (backend->fd, FALSE);
+
+	if (!rspamd_fuzzy_native_map (backend, err)) {
+		return FALSE;
+	}
+
+	if (backend->map_len < sizeof (hdr) ||
+			memcmp (backend->map, RSPAMD_FUZZY_NATIVE_MAGIC,
+					sizeof (hdr.magic)) != 0) {
+		g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+				EINVAL, "%s is not a fuzzy log", backend->path);
+		return FALSE;
+	}
+
+	memcpy (&hdr, backend->map, sizeof (hdr));
+
+	if (hdr.version != RSPAMD_FUZZY_NATIVE_LOG_VERSION) {
+		g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+				EINVAL, "unsupported fuzzy log version %d in %s",
+				(gint)hdr.version, backend->path);
+		return FALSE;
+	}
+
+	backend->consumed = sizeof (hdr);
+	backend->last_refresh = time (NULL);
+
+	return rspamd_fuzzy_native_replay (backend);
+}
+
+struct rspamd_fuzzy_backend_native *
+rspamd_fuzzy_backend_native_open (const gchar *path, GError **err)
+{
+	struct rspamd_fuzzy_backend_native *backend;
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash_out[rspamd_cryptobox_HASHBYTES];
+
+	if (path == NULL) {
+		g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+				ENOENT, "Path has not been specified");
+		return NULL;
+	}
+
+	backend = g_slice_alloc0 (sizeof (*backend));
+	backend->path = g_strdup (path);
+	backend->fd = -1;
+	backend->versions = g_hash_table_new_full (rspamd_str_hash,
+			rspamd_str_equal, g_free, g_free);
+	backend->pending = g_byte_array_new ();
+	backend->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"fuzzy_backend");
+
+	/* Set id for the backend */
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, path, strlen (path));
+	rspamd_cryptobox_hash_final (&st, hash_out);
+	rspamd_snprintf (backend->id, sizeof (backend->id), "%xs", hash_out);
+	memcpy (backend->pool->tag.uid, backend->id, sizeof (backend->pool->tag.uid));
+
+	if (!rspamd_fuzzy_native_load (backend, err)) {
+		rspamd_fuzzy_backend_native_close (backend);
+
+		return NULL;
+	}
+
+	msg_info_fuzzy_backend ("loaded %z hashes from %s", backend->digests.nelts,
+			path);
+
+	return backend;
+}
+
+gboolean
+rspamd_fuzzy_backend_native_refresh (struct rspamd_fuzzy_backend_native *backend)
+{
+	struct stat st;
+	GError *err = NULL;
+
+	if (stat (backend->path, &st) != -1 && st.st_ino != backend->ino) {
+		/* Log has been compacted */
+		rspamd_fuzzy_native_reset (backend);
+
+		if (!rspamd_fuzzy_native_load (backend, &err)) {
+			msg_err_fuzzy_backend ("cannot reload fuzzy log: %e", err);
+			g_error_free (err);
+
+			return FALSE;
+		}
+
+		msg_info_fuzzy_backend ("reloaded %z hashes from %s",
+				backend->digests.nelts, backend->path);
+
+		return TRUE;
+	}
+
+	if (!rspamd_fuzzy_native_map (backend, &err)) {
+		msg_err_fuzzy_backend ("cannot refresh fuzzy log: %e", err);
+		g_error_free (err);
+
+		return FALSE;
+	}
+
+	return rspamd_fuzzy_native_replay (backend);
+}
+
+static gint
+rspamd_fuzzy_native_off_cmp (const void *a, const void *b)
+{
+	guint64 ia = *(const guint64 *)a, ib = *(const guint64 *)b;
+
+	if (ia < ib) {
+		return -1;
+	}
+
+	return ia > ib ? 1 : 0;
+}
+
+struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_native_check (struct rspamd_fuzzy_backend_native *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_native_elt *elt;
+	guint64 offs[RSPAMD_SHINGLE_SIZE], cur = 0, sel = 0;
+	guint i, cnt = 0, max_cnt = 0;
+	time_t now;
+
+	if (backend == NULL) {
+		return rep;
+	}
+
+	now = time (NULL);
+
+	if (now - backend->last_refresh >= RSPAMD_FUZZY_NATIVE_REFRESH_INTERVAL) {
+		rspamd_fuzzy_backend_native_refresh (backend);
+		backend->last_refresh = now;
+	}
+
+	elt = rspamd_fuzzy_native_find (backend, cmd->digest);
+
+	if (elt) {
+		if (now - elt->time > expire) {
+			msg_debug_fuzzy_backend ("requested hash has been expired");
+		}
+		else {
+			rep.value = elt->value;
+			rep.prob = 1.0;
+			rep.flag = elt->flag;
+		}
+
+		return rep;
+	}
+
+	if (cmd->shingles_count == 0) {
+		return rep;
+	}
+
+	shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		offs[i] = rspamd_fuzzy_native_shingle_lookup (&backend->shingles[i],
+				shcmd->sgl.hashes[i]);
+
+		if (offs[i] != 0) {
+			/* Skip shingles of deleted digests */
+			elt = rspamd_fuzzy_native_find (backend,
+					rspamd_fuzzy_native_rec_digest (backend, offs[i]));
+
+			if (elt == NULL || elt->off != offs[i]) {
+				offs[i] = 0;
+			}
+		}
+	}
+
+	qsort (offs, RSPAMD_SHINGLE_SIZE, sizeof (offs[0]),
+			rspamd_fuzzy_native_off_cmp);
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		if (offs[i] == 0) {
+			continue;
+		}
+
+		if (offs[i] == cur) {
+			cnt ++;
+		}
+		else {
+			cur = offs[i];
+			cnt = 1;
+		}
+
+		if (cnt > max_cnt) {
+			max_cnt = cnt;
+			sel = cur;
+		}
+	}
+
+	if (sel != 0) {
+		rep.prob = (gdouble)max_cnt / (gdouble)RSPAMD_SHINGLE_SIZE;
+
+		if (rep.prob > 0.5) {
+			elt = rspamd_fuzzy_native_find (backend,
+					rspamd_fuzzy_native_rec_digest (backend, sel));
+
+			if (now - elt->time > expire) {
+				msg_debug_fuzzy_backend ("requested hash has been expired");
+				rep.prob = 0.0;
+			}
+			else {
+				rep.value = elt->value;
+				rep.flag = elt->flag;
+			}
+		}
+	}
+
+	return rep;
+}
+
+gboolean
+rspamd_fuzzy_backend_native_prepare_update (
+		struct rspamd_fuzzy_backend_native *backend,
+		const gchar *source)
+{
+	GError *err = NULL;
+
+	if (backend == NULL || !rspamd_fuzzy_backend_native_refresh (backend)) {
+		return FALSE;
+	}
+
+	if (backend->map_len > backend->consumed) {
+		/* Partial record left after crash of the previous writer */
+		msg_warn_fuzzy_backend ("truncate %z bytes of incomplete data in %s",
+				backend->map_len - backend->consumed, backend->path);
+
+		if (ftruncate (backend->fd, backend->consumed) == -1) {
+			msg_err_fuzzy_backend ("cannot truncate %s: %s", backend->path,
+					strerror (errno));
+
+			return FALSE;
+		}
+
+		if (!rspamd_fuzzy_native_map (backend, &err)) {
+			msg_err_fuzzy_backend ("cannot remap fuzzy log: %e", err);
+			g_error_free (err);
+
+			return FALSE;
+		}
+	}
+
+	g_byte_array_set_size (backend->pending, 0);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_backend_native_add (struct rspamd_fuzzy_backend_native *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct rspamd_fuzzy_native_rec rec;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	memset (&rec, 0, sizeof (rec));
+	rec.op = RSPAMD_FUZZY_NATIVE_ADD;
+	rec.flag = cmd->flag;
+	rec.value = cmd->value;
+	rec.time = time (NULL);
+	memcpy (rec.digest, cmd->digest, sizeof (rec.digest));
+
+	if (cmd->shingles_count > 0) {
+		rec.nshingles = RSPAMD_SHINGLE_SIZE;
+	}
+
+	g_byte_array_append (backend->pending, (const guint8 *)&rec, sizeof (rec));
+
+	if (rec.nshingles > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+		g_byte_array_append (backend->pending,
+				(const guint8 *)shcmd->sgl.hashes, sizeof (shcmd->sgl.hashes));
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_backend_native_del (struct rspamd_fuzzy_backend_native *backend,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	struct rspamd_fuzzy_native_rec rec;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	memset (&rec, 0, sizeof (rec));
+	rec.op = RSPAMD_FUZZY_NATIVE_DEL;
+	rec.time = time (NULL);
+	memcpy (rec.digest, cmd->digest, sizeof (rec.digest));
+	g_byte_array_append (backend->pending, (const guint8 *)&rec, sizeof (rec));
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_native_append_version (GByteArray *buf, const gchar *source,
+		gint64 version)
+{
+	struct rspamd_fuzzy_native_rec rec;
+
+	memset (&rec, 0, sizeof (rec));
+	rec.op = RSPAMD_FUZZY_NATIVE_VERSION;
+	rec.value = version;
+	rec.time = time (NULL);
+	rspamd_strlcpy ((gchar *)rec.digest, source, sizeof (rec.digest));
+	g_byte_array_append (buf, (const guint8 *)&rec, sizeof (rec));
+}
+
+gboolean
+rspamd_fuzzy_backend_native_finish_update (
+		struct rspamd_fuzzy_backend_native *backend,
+		const gchar *source, gboolean version_bump)
+{
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	if (version_bump) {
+		rspamd_fuzzy_native_append_version (backend->pending, source,
+				rspamd_fuzzy_backend_native_version (backend, source) + 1);
+	}
+
+	if (backend->pending->len > 0) {
+		if (!rspamd_fuzzy_native_write (backend->fd, backend->pending->data,
+				backend->pending->len)) {
+			msg_err_fuzzy_backend ("cannot append updates to %s: %s",
+					backend->path, strerror (errno));
+			g_byte_array_set_size (backend->pending, 0);
+
+			/* Do not leave partial records for readers */
+			if (ftruncate (backend->fd, backend->map_len) == -1) {
+				msg_err_fuzzy_backend ("cannot truncate %s: %s", backend->path,
+						strerror (errno));
+			}
+
+			return FALSE;
+		}
+
+		rspamd_fuzzy_native_sync_fd (backend->fd);
+		g_byte_array_set_size (backend->pending, 0);
+	}
+
+	return rspamd_fuzzy_backend_native_refresh (backend);
+}
+
+static gboolean
+rspamd_fuzzy_native_compact (struct rspamd_fuzzy_backend_native *backend,
+		gint64 expire)
+{
+	struct rspamd_fuzzy_native_hdr hdr;
+	struct rspamd_fuzzy_native_rec rec;
+	struct rspamd_fuzzy_native_elt *elt;
+	GByteArray *buf;
+	GHashTableIter it;
+	gpointer k, v;
+	gchar *tmp;
+	gsize i, nhashes = 0, old_len = backend->map_len;
+	gboolean ret = FALSE;
+	time_t now = time (NULL);
+	gint fd;
+	GError *err = NULL;
+
+	tmp = g_strconcat (backend->path, ".new", NULL);
+	fd = rspamd_file_xopen (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		msg_err_fuzzy_backend ("cannot open %s: %s", tmp, strerror (errno));
+		g_free (tmp);
+
+		return FALSE;
+	}
+
+	buf = g_byte_array_sized_new (RSPAMD_FUZZY_NATIVE_WRITE_BUF);
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RSPAMD_FUZZY_NATIVE_MAGIC, sizeof (hdr.magic));
+	hdr.version = RSPAMD_FUZZY_NATIVE_LOG_VERSION;
+	g_byte_array_append (buf, (const guint8 *)&hdr, sizeof (hdr));
+
+	g_hash_table_iter_init (&it, backend->versions);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rspamd_fuzzy_native_append_version (buf, k, *(gint64 *)v);
+	}
+
+	for (i = 0; i < backend->digests.size; i ++) {
+		elt = &backend->digests.elts[i];
+
+		if (elt->off == 0 || elt->off == RSPAMD_FUZZY_NATIVE_DELETED ||
+				now - elt->time > expire) {
+			continue;
+		}
+
+		memcpy (&rec, backend->map + elt->off, sizeof (rec));
+		rec.op = RSPAMD_FUZZY_NATIVE_ADD;
+		rec.value = elt->value;
+		rec.flag = elt->flag;
+		rec.time = elt->time;
+		g_byte_array_append (buf, (const guint8 *)&rec, sizeof (rec));
+		g_byte_array_append (buf, backend->map + elt->off + sizeof (rec),
+				rec.nshingles * sizeof (guint64));
+		nhashes ++;
+
+		if (buf->len >= RSPAMD_FUZZY_NATIVE_WRITE_BUF) {
+			if (!rspamd_fuzzy_native_write (fd, buf->data, buf->len)) {
+				goto end;
+			}
+
+			g_byte_array_set_size (buf, 0);
+		}
+	}
+
+	if (!rspamd_fuzzy_native_write (fd, buf->data, buf->len)) {
+		goto end;
+	}
+
+	rspamd_fuzzy_native_sync_fd (fd);
+
+	if (rename (tmp, backend->path) == -1) {
+		goto end;
+	}
+
+	ret = TRUE;
+
+end:
+	if (!ret) {
+		msg_err_fuzzy_backend ("cannot compact %s: %s", backend->path,
+				strerror (errno));
+		unlink (tmp);
+	}
+
+	close (fd);
+	g_byte_array_free (buf, TRUE);
+	g_free (tmp);
+
+	if (ret) {
+		rspamd_fuzzy_native_reset (backend);
+
+		if (!rspamd_fuzzy_native_load (backend, &err)) {
+			msg_err_fuzzy_backend ("cannot reload compacted log: %e", err);
+			g_error_free (err);
+
+			return FALSE;
+		}
+
+		msg_info_fuzzy_backend ("compacted %s from %z to %z bytes, %z hashes left",
+				backend->path, old_len, backend->map_len, nhashes);
+	}
+
+	return ret;
+}
+
+gboolean
+rspamd_fuzzy_backend_native_sync (struct rspamd_fuzzy_backend_native *backend,
+		gint64 expire,
+		gboolean forced)
+{
+	struct rspamd_fuzzy_native_elt *elt;
+	struct rspamd_fuzzy_native_rec rec;
+	gsize i, expired = 0;
+	time_t now = time (NULL);
+
+	if (backend == NULL || !rspamd_fuzzy_backend_native_refresh (backend)) {
+		return FALSE;
+	}
+
+	for (i = 0; i < backend->digests.size; i ++) {
+		elt = &backend->digests.elts[i];
+
+		if (elt->off != 0 && elt->off != RSPAMD_FUZZY_NATIVE_DELETED &&
+				now - elt->time > expire) {
+			memcpy (&rec, backend->map + elt->off, sizeof (rec));
+			expired += rspamd_fuzzy_native_rec_size (rec.nshingles);
+		}
+	}
+
+	/* Rewrite log when at least half of it is useless */
+	if (!forced && (backend->garbage + expired) * 2 < backend->map_len) {
+		return TRUE;
+	}
+
+	return rspamd_fuzzy_native_compact (backend, expire);
+}
+
+struct rspamd_fuzzy_native_import_elt {
+	struct rspamd_fuzzy_native_rec rec;
+	guint64 shingles[RSPAMD_SHINGLE_SIZE];
+	guint nshingles;
+};
+
+gint64
+rspamd_fuzzy_backend_native_import_sqlite (
+		struct rspamd_fuzzy_backend_native *backend,
+		const gchar *sqlite_path,
+		gint64 expire,
+		GError **err)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	GHashTable *digests;
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_fuzzy_native_import_elt *ielt;
+	const guchar *digest;
+	gint64 id, number, nimported = 0;
+	time_t now = time (NULL);
+
+	if (sqlite3_open_v2 (sqlite_path, &db, SQLITE_OPEN_READONLY, NULL)
+			!= SQLITE_OK) {
+		g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+				EINVAL, "cannot open %s: %s", sqlite_path, sqlite3_errmsg (db));
+		sqlite3_close (db);
+
+		return -1;
+	}
+
+	if (!rspamd_fuzzy_backend_native_prepare_update (backend, NULL)) {
+		g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+				EINVAL, "cannot prepare %s for updates", backend->path);
+		sqlite3_close (db);
+
+		return -1;
+	}
+
+	digests = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+			g_free, g_free);
+
+	if (sqlite3_prepare_v2 (db, "SELECT id, flag, digest, value, time "
+			"FROM digests", -1, &stmt, NULL) != SQLITE_OK) {
+		goto err;
+	}
+
+	while (sqlite3_step (stmt) == SQLITE_ROW) {
+		digest = sqlite3_column_blob (stmt, 2);
+
+		if (digest == NULL ||
+				sqlite3_column_bytes (stmt, 2) != rspamd_cryptobox_HASHBYTES) {
+			continue;
+		}
+
+		if (expire > 0 && now - sqlite3_column_int64 (stmt, 4) > expire) {
+			continue;
+		}
+
+		ielt = g_malloc0 (sizeof (*ielt));
+		ielt->rec.op = RSPAMD_FUZZY_NATIVE_ADD;
+		ielt->rec.flag = sqlite3_column_int64 (stmt, 1);
+		ielt->rec.value = sqlite3_column_int64 (stmt, 3);
+		ielt->rec.time = sqlite3_column_int64 (stmt, 4);
+		memcpy (ielt->rec.digest, digest, sizeof (ielt->rec.digest));
+		id = sqlite3_column_int64 (stmt, 0);
+		g_hash_table_insert (digests, g_memdup (&id, sizeof (id)), ielt);
+	}
+
+	sqlite3_finalize (stmt);
+
+	if (sqlite3_prepare_v2 (db, "SELECT value, number, digest_id "
+			"FROM shingles", -1, &stmt, NULL) != SQLITE_OK) {
+		goto err;
+	}
+
+	while (sqlite3_step (stmt) == SQLITE_ROW) {
+		id = sqlite3_column_int64 (stmt, 2);
+		number = sqlite3_column_int64 (stmt, 1);
+		ielt = g_hash_table_lookup (digests, &id);
+
+		if (ielt && number >= 0 && number < RSPAMD_SHINGLE_SIZE) {
+			ielt->shingles[number] = sqlite3_column_int64 (stmt, 0);
+			ielt->nshingles ++;
+		}
+	}
+
+	sqlite3_finalize (stmt);
+
+	g_hash_table_iter_init (&it, digests);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		ielt = v;
+
+		/* Incomplete shingles sets are useless for voting */
+		if (ielt->nshingles == RSPAMD_SHINGLE_SIZE) {
+			ielt->rec.nshingles = RSPAMD_SHINGLE_SIZE;
+		}
+
+		g_byte_array_append (backend->pending, (const guint8 *)&ielt->rec,
+				sizeof (ielt->rec));
+		g_byte_array_append (backend->pending, (const guint8 *)ielt->shingles,
+				ielt->rec.nshingles * sizeof (guint64));
+		nimported ++;
+	}
+
+	if (sqlite3_prepare_v2 (db, "SELECT name, version FROM sources",
+			-1, &stmt, NULL) != SQLITE_OK) {
+		goto err;
+	}
+
+	while (sqlite3_step (stmt) == SQLITE_ROW) {
+		if (sqlite3_column_text (stmt, 0) != NULL) {
+			rspamd_fuzzy_native_append_version (backend->pending,
+					(const gchar *)sqlite3_column_text (stmt, 0),
+					sqlite3_column_int64 (stmt, 1));
+		}
+	}
+
+	sqlite3_finalize (stmt);
+	g_hash_table_unref (digests);
+	sqlite3_close (db);
+
+	if (!rspamd_fuzzy_backend_native_finish_update (backend, NULL, FALSE)) {
+		g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+				EIO, "cannot write hashes to %s", backend->path);
+
+		return -1;
+	}
+
+	return nimported;
+
+err:
+	g_set_error (err, rspamd_fuzzy_backend_native_quark (),
+			EINVAL, "cannot read %s: %s", sqlite_path, sqlite3_errmsg (db));
+	g_byte_array_set_size (backend->pending, 0);
+	g_hash_table_unref (digests);
+	sqlite3_close (db);
+
+	return -1;
+}
+
+void
+rspamd_fuzzy_backend_native_close (struct rspamd_fuzzy_backend_native *backend)
+{
+	if (backend != NULL) {
+		rspamd_fuzzy_native_reset (backend);
+		g_hash_table_unref (backend->versions);
+		g_byte_array_free (backend->pending, TRUE);
+		g_free (backend->path);
+
+		if (backend->pool) {
+			rspamd_mempool_delete (backend->pool);
+		}
+
+		g_slice_free1 (sizeof (*backend), backend);
+	}
+}
+
+gsize
+rspamd_fuzzy_backend_native_count (struct rspamd_fuzzy_backend_native *backend)
+{
+	if (backend) {
+		return backend->digests.nelts;
+	}
+
+	return 0;
+}
+
+gint64
+rspamd_fuzzy_backend_native_version (struct rspamd_fuzzy_backend_native *backend,
+		const gchar *source)
+{
+	gint64 *version;
+
+	if (backend && source) {
+		version = g_hash_table_lookup (backend->versions, source);
+
+		if (version) {
+			return *version;
+		}
+	}
+
+	return 0;
+}
+
+const gchar *
+rspamd_fuzzy_backend_native_id (struct rspamd_fuzzy_backend_native *backend)
+{
+	return backend != NULL ? backend->id : NULL;
+}
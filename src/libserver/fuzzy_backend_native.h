@@ -0,0 +1,124 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_FUZZY_BACKEND_NATIVE_H_
+#define SRC_LIBSERVER_FUZZY_BACKEND_NATIVE_H_
+
+#include "config.h"
+#include "fuzzy_wire.h"
+
+/*
+ * Native fuzzy storage: an append-only log of updates that is mmapped by
+ * every worker and indexed in memory by digest and by each shingle position
+ */
+struct rspamd_fuzzy_backend_native;
+
+/**
+ * Open (or create) native fuzzy log
+ * @param path log file
+ * @param err error pointer
+ * @return backend structure or NULL
+ */
+struct rspamd_fuzzy_backend_native *rspamd_fuzzy_backend_native_open (
+		const gchar *path,
+		GError **err);
+
+/**
+ * Check specified fuzzy in the backend
+ * @param backend
+ * @param cmd
+ * @return reply with probability and weight
+ */
+struct rspamd_fuzzy_reply rspamd_fuzzy_backend_native_check (
+		struct rspamd_fuzzy_backend_native *backend,
+		const struct rspamd_fuzzy_cmd *cmd,
+		gint64 expire);
+
+/**
+ * Prepare storage for updates, must be called by the writer process only
+ */
+gboolean rspamd_fuzzy_backend_native_prepare_update (
+		struct rspamd_fuzzy_backend_native *backend,
+		const gchar *source);
+
+/**
+ * Queue digest addition
+ */
+gboolean rspamd_fuzzy_backend_native_add (
+		struct rspamd_fuzzy_backend_native *backend,
+		const struct rspamd_fuzzy_cmd *cmd);
+
+/**
+ * Queue digest removal
+ */
+gboolean rspamd_fuzzy_backend_native_del (
+		struct rspamd_fuzzy_backend_native *backend,
+		const struct rspamd_fuzzy_cmd *cmd);
+
+/**
+ * Append all queued updates to the log with a single write
+ */
+gboolean rspamd_fuzzy_backend_native_finish_update (
+		struct rspamd_fuzzy_backend_native *backend,
+		const gchar *source, gboolean version_bump);
+
+/**
+ * Read records appended by other processes (or reload a compacted log)
+ */
+gboolean rspamd_fuzzy_backend_native_refresh (
+		struct rspamd_fuzzy_backend_native *backend);
+
+/**
+ * Rewrite log without stale and expired records if it is worth it
+ * @param backend
+ * @param expire
+ * @param forced compact even if there is not much garbage
+ * @return
+ */
+gboolean rspamd_fuzzy_backend_native_sync (
+		struct rspamd_fuzzy_backend_native *backend,
+		gint64 expire,
+		gboolean forced);
+
+/**
+ * Import all digests, shingles and sources versions from sqlite database
+ * @param backend
+ * @param sqlite_path
+ * @param expire skip hashes older than this number of seconds (0 to import all)
+ * @param err
+ * @return number of imported hashes or -1 in case of error
+ */
+gint64 rspamd_fuzzy_backend_native_import_sqlite (
+		struct rspamd_fuzzy_backend_native *backend,
+		const gchar *sqlite_path,
+		gint64 expire,
+		GError **err);
+
+/**
+ * Close storage
+ * @param backend
+ */
+void rspamd_fuzzy_backend_native_close (
+		struct rspamd_fuzzy_backend_native *backend);
+
+gsize rspamd_fuzzy_backend_native_count (
+		struct rspamd_fuzzy_backend_native *backend);
+gint64 rspamd_fuzzy_backend_native_version (
+		struct rspamd_fuzzy_backend_native *backend,
+		const gchar *source);
+const gchar * rspamd_fuzzy_backend_native_id (
+		struct rspamd_fuzzy_backend_native *backend);
+
+#endif /* SRC_LIBSERVER_FUZZY_BACKEND_NATIVE_H_ */
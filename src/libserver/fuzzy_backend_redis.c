@@ -28,6 +28,31 @@
 #define REDIS_DEFAULT_PORT 6379
 #define REDIS_DEFAULT_OBJECT "fuzzy"
 #define REDIS_DEFAULT_TIMEOUT 2.0
+#define REDIS_CHECK_SCRIPT_NAME "fuzzy_check"
+
+/*
+ * Resolves digest and falls back to shingles voting in a single call
+ * KEYS: digest key and optional shingles keys, ARGV[1]: prefix
+ * Returns {value, flag, number of matched shingles} or an empty array
+ */
+static const gchar *fuzzy_check_script =
+		"local res = redis.call('HMGET', KEYS[1], 'V', 'F')\n"
+		"if res[1] and res[2] then return {res[1], res[2], 32} end\n"
+		"if #KEYS < 33 then return {} end\n"
+		"local digests = redis.call('MGET', unpack(KEYS, 2, 33))\n"
+		"local counts, max, sel = {}, 0, nil\n"
+		"for i = 1, 32 do\n"
+		"  local d = digests[i]\n"
+		"  if d then\n"
+		"    counts[d] = (counts[d] or 0) + 1\n"
+		"    if counts[d] > max then max = counts[d]; sel = d end\n"
+		"  end\n"
+		"end\n"
+		"if max > 16 then\n"
+		"  res = redis.call('HMGET', ARGV[1] .. sel, 'V', 'F')\n"
+		"  if res[1] and res[2] then return {res[1], res[2], max} end\n"
+		"end\n"
+		"return {}\n";
 
 #define msg_err_redis_session(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "fuzzy_redis", session->backend->id, \
@@ -55,9 +80,20 @@ struct rspamd_fuzzy_backend_redis {
 	gchar *id;
 	struct rspamd_redis_pool *pool;
 	gdouble timeout;
+	gboolean use_script;
+	gboolean cluster;
 	ref_entry_t ref;
 };
 
+struct _rspamd_fuzzy_shingles_helper;
+struct rspamd_fuzzy_redis_session;
+
+/* Single shingle lookup when shingle keys belong to different cluster slots */
+struct rspamd_fuzzy_redis_shingle_req {
+	struct rspamd_fuzzy_redis_session *session;
+	guint idx;
+};
+
 struct rspamd_fuzzy_redis_session {
 	struct rspamd_fuzzy_backend_redis *backend;
 	redisAsyncContext *ctx;
@@ -66,6 +102,12 @@ struct rspamd_fuzzy_redis_session {
 	struct event_base *ev_base;
 	float prob;
 	gboolean shingles_checked;
+	gboolean redirected;
+	gboolean cluster_failed;
+	guint npending;
+	GPtrArray *cluster_conns;
+	struct _rspamd_fuzzy_shingles_helper *shingles;
+	struct rspamd_fuzzy_redis_shingle_req *shingle_reqs;
 
 	enum {
 		RSPAMD_FUZZY_REDIS_COMMAND_COUNT,
@@ -107,7 +149,7 @@ rspamd_fuzzy_redis_session_dtor (struct rspamd_fuzzy_redis_session *session,
 		gboolean is_fatal)
 {
 	redisAsyncContext *ac;
-
+	guint i;
 
 	if (session->ctx) {
 		ac = session->ctx;
@@ -120,6 +162,17 @@ rspamd_fuzzy_redis_session_dtor (struct rspamd_fuzzy_redis_session *session,
 		event_del (&session->timeout);
 	}
 
+	if (session->cluster_conns) {
+		for (i = 0; i < session->cluster_conns->len; i ++) {
+			rspamd_redis_pool_release_connection (session->backend->pool,
+					g_ptr_array_index (session->cluster_conns, i), is_fatal);
+		}
+
+		g_ptr_array_free (session->cluster_conns, TRUE);
+	}
+
+	g_free (session->shingles);
+	g_free (session->shingle_reqs);
 	rspamd_fuzzy_redis_session_free_args (session);
 
 	REF_RELEASE (session->backend);
@@ -201,6 +254,28 @@ rspamd_fuzzy_backend_redis_try_ucl (struct rspamd_fuzzy_backend_redis *backend,
 		backend->dbname = NULL;
 	}
 
+	elt = ucl_object_lookup (obj, "use_script");
+	if (elt) {
+		backend->use_script = ucl_object_toboolean (elt);
+	}
+	else {
+		backend->use_script = FALSE;
+	}
+
+	elt = ucl_object_lookup (obj, "cluster");
+	if (elt) {
+		backend->cluster = ucl_object_toboolean (elt);
+	}
+	else {
+		backend->cluster = FALSE;
+	}
+
+	if (backend->cluster && backend->use_script) {
+		/* Script uses keys from different slots */
+		msg_warn_config ("check script cannot be used with redis cluster");
+		backend->use_script = FALSE;
+	}
+
 	return TRUE;
 }
 
@@ -324,6 +399,222 @@ rspamd_fuzzy_backend_redis_shingles_cmp (const void *a, const void *b)
 	return memcmp (sha->digest, shb->digest, sizeof (sha->digest));
 }
 
+static redisAsyncContext *
+rspamd_fuzzy_redis_session_connect (struct rspamd_fuzzy_redis_session *session,
+		const gchar *key, gsize keylen)
+{
+	struct rspamd_fuzzy_backend_redis *backend = session->backend;
+	rspamd_inet_addr_t *addr;
+	gchar seed[PATH_MAX];
+	const gchar *ip;
+	gint port;
+
+	addr = rspamd_upstream_addr (session->up);
+	g_assert (addr != NULL);
+	rspamd_strlcpy (seed, rspamd_inet_address_to_string (addr), sizeof (seed));
+	ip = seed;
+	port = rspamd_inet_address_get_port (addr);
+
+	if (backend->cluster && key != NULL) {
+		rspamd_redis_pool_cluster_node (backend->pool,
+				backend->dbname, backend->password,
+				seed, port, key, keylen, &ip, &port);
+	}
+
+	return rspamd_redis_pool_connect (backend->pool,
+			backend->dbname, backend->password, ip, port);
+}
+
+static void
+rspamd_fuzzy_redis_maybe_update_slots (struct rspamd_fuzzy_redis_session *session,
+		const gchar *err)
+{
+	struct rspamd_fuzzy_backend_redis *backend = session->backend;
+	rspamd_inet_addr_t *addr;
+	gchar seed[PATH_MAX];
+	const gchar *ip;
+	gint port;
+	gboolean ask;
+
+	addr = rspamd_upstream_addr (session->up);
+	rspamd_strlcpy (seed, rspamd_inet_address_to_string (addr), sizeof (seed));
+	rspamd_redis_pool_cluster_redirect (backend->pool,
+			backend->dbname, backend->password,
+			seed, rspamd_inet_address_get_port (addr),
+			err, &ip, &port, &ask);
+}
+
+/*
+ * Resends session command to another cluster node on MOVED or ASK reply,
+ * returns TRUE if the command has been resent
+ */
+static gboolean
+rspamd_fuzzy_redis_maybe_redirect (struct rspamd_fuzzy_redis_session *session,
+		redisReply *reply, redisCallbackFn *fn)
+{
+	struct rspamd_fuzzy_backend_redis *backend = session->backend;
+	rspamd_inet_addr_t *addr;
+	redisAsyncContext *ac;
+	struct timeval tv;
+	gchar seed[PATH_MAX];
+	const gchar *ip;
+	gint port;
+	gboolean ask;
+
+	if (!backend->cluster || session->redirected ||
+			reply->type != REDIS_REPLY_ERROR) {
+		return FALSE;
+	}
+
+	addr = rspamd_upstream_addr (session->up);
+	rspamd_strlcpy (seed, rspamd_inet_address_to_string (addr), sizeof (seed));
+
+	if (!rspamd_redis_pool_cluster_redirect (backend->pool,
+			backend->dbname, backend->password,
+			seed, rspamd_inet_address_get_port (addr),
+			reply->str, &ip, &port, &ask)) {
+		return FALSE;
+	}
+
+	msg_debug_redis_session ("redirected to %s:%d: %s", ip, port, reply->str);
+	session->redirected = TRUE;
+
+	if (session->ctx) {
+		ac = session->ctx;
+		session->ctx = NULL;
+		rspamd_redis_pool_release_connection (backend->pool, ac, FALSE);
+	}
+
+	session->ctx = rspamd_redis_pool_connect (backend->pool,
+			backend->dbname, backend->password, ip, port);
+
+	if (session->ctx == NULL) {
+		return FALSE;
+	}
+
+	if (ask) {
+		redisAsyncCommand (session->ctx, NULL, NULL, "ASKING");
+	}
+
+	if (redisAsyncCommandArgv (session->ctx, fn, session, session->nargs,
+			(const gchar **)session->argv, session->argv_lens) != REDIS_OK) {
+		return FALSE;
+	}
+
+	event_set (&session->timeout, -1, EV_TIMEOUT, rspamd_fuzzy_redis_timeout,
+			session);
+	event_base_set (session->ev_base, &session->timeout);
+	double_to_tv (backend->timeout, &tv);
+	event_add (&session->timeout, &tv);
+
+	return TRUE;
+}
+
+static struct _rspamd_fuzzy_shingles_helper *
+rspamd_fuzzy_redis_shingles_vote (struct _rspamd_fuzzy_shingles_helper *shingles,
+		guint found, guint *pmax_found)
+{
+	struct _rspamd_fuzzy_shingles_helper *prev, *sel = NULL;
+	guint i, max_found = 0, cur_found = 0;
+
+	*pmax_found = 0;
+
+	if (found <= RSPAMD_SHINGLE_SIZE / 2) {
+		return NULL;
+	}
+
+	/* Now sort to find the most frequent element */
+	qsort (shingles, RSPAMD_SHINGLE_SIZE,
+			sizeof (struct _rspamd_fuzzy_shingles_helper),
+			rspamd_fuzzy_backend_redis_shingles_cmp);
+
+	prev = &shingles[0];
+
+	for (i = 1; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		if (!shingles[i].found) {
+			continue;
+		}
+
+		if (memcmp (shingles[i].digest, prev->digest, 64) == 0) {
+			cur_found ++;
+
+			if (cur_found > max_found) {
+				max_found = cur_found;
+				sel = &shingles[i];
+			}
+		}
+		else {
+			cur_found = 1;
+			prev = &shingles[i];
+		}
+	}
+
+	if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
+		g_assert (sel != NULL);
+		*pmax_found = max_found;
+
+		return sel;
+	}
+
+	return NULL;
+}
+
+/* Fetches value and flag of the digest selected by shingles */
+static void
+rspamd_fuzzy_redis_check_selected (struct rspamd_fuzzy_redis_session *session,
+		struct _rspamd_fuzzy_shingles_helper *sel)
+{
+	struct rspamd_fuzzy_reply rep;
+	struct timeval tv;
+	GString *key;
+
+	/* Prepare new check command */
+	rspamd_fuzzy_redis_session_free_args (session);
+	session->nargs = 4;
+	session->argv = g_malloc (sizeof (gchar *) * session->nargs);
+	session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
+
+	key = g_string_new (session->backend->redis_object);
+	g_string_append_len (key, sel->digest, sizeof (sel->digest));
+	session->argv[0] = g_strdup ("HMGET");
+	session->argv_lens[0] = 5;
+	session->argv[1] = key->str;
+	session->argv_lens[1] = key->len;
+	session->argv[2] = g_strdup ("V");
+	session->argv_lens[2] = 1;
+	session->argv[3] = g_strdup ("F");
+	session->argv_lens[3] = 1;
+	g_string_free (key, FALSE); /* Do not free underlying array */
+
+	if (session->ctx == NULL) {
+		session->ctx = rspamd_fuzzy_redis_session_connect (session,
+				session->argv[1], session->argv_lens[1]);
+	}
+
+	if (session->ctx == NULL || redisAsyncCommandArgv (session->ctx,
+			rspamd_fuzzy_redis_check_callback,
+			session, session->nargs,
+			(const gchar **)session->argv,
+			session->argv_lens) != REDIS_OK) {
+
+		if (session->callback.cb_check) {
+			memset (&rep, 0, sizeof (rep));
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+
+		rspamd_fuzzy_redis_session_dtor (session, TRUE);
+	}
+	else {
+		/* Add timeout */
+		event_set (&session->timeout, -1, EV_TIMEOUT,
+				rspamd_fuzzy_redis_timeout,
+				session);
+		event_base_set (session->ev_base, &session->timeout);
+		double_to_tv (session->backend->timeout, &tv);
+		event_add (&session->timeout, &tv);
+	}
+}
+
 static void
 rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 		gpointer priv)
@@ -331,10 +622,8 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 	struct rspamd_fuzzy_redis_session *session = priv;
 	redisReply *reply = r, *cur;
 	struct rspamd_fuzzy_reply rep;
-	struct timeval tv;
-	GString *key;
-	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
-	guint i, found = 0, max_found = 0, cur_found = 0;
+	struct _rspamd_fuzzy_shingles_helper *shingles, *sel;
+	guint i, found = 0, max_found;
 
 	event_del (&session->timeout);
 	memset (&rep, 0, sizeof (rep));
@@ -361,83 +650,14 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 				}
 			}
 
-			if (found > RSPAMD_SHINGLE_SIZE / 2) {
-				/* Now sort to find the most frequent element */
-				qsort (shingles, RSPAMD_SHINGLE_SIZE,
-						sizeof (struct _rspamd_fuzzy_shingles_helper),
-						rspamd_fuzzy_backend_redis_shingles_cmp);
-
-				prev = &shingles[0];
-
-				for (i = 1; i < RSPAMD_SHINGLE_SIZE; i ++) {
-					if (!shingles[i].found) {
-						continue;
-					}
-
-					if (memcmp (shingles[i].digest, prev->digest, 64) == 0) {
-						cur_found ++;
-
-						if (cur_found > max_found) {
-							max_found = cur_found;
-							sel = &shingles[i];
-						}
-					}
-					else {
-						cur_found = 1;
-						prev = &shingles[i];
-					}
-				}
+			sel = rspamd_fuzzy_redis_shingles_vote (shingles, found, &max_found);
 
-				if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
-					session->prob = ((float)max_found) / RSPAMD_SHINGLE_SIZE;
-					rep.prob = session->prob;
-
-					g_assert (sel != NULL);
-
-					/* Prepare new check command */
-					rspamd_fuzzy_redis_session_free_args (session);
-					session->nargs = 4;
-					session->argv = g_malloc (sizeof (gchar *) * session->nargs);
-					session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
-
-					key = g_string_new (session->backend->redis_object);
-					g_string_append_len (key, sel->digest, sizeof (sel->digest));
-					session->argv[0] = g_strdup ("HMGET");
-					session->argv_lens[0] = 5;
-					session->argv[1] = key->str;
-					session->argv_lens[1] = key->len;
-					session->argv[2] = g_strdup ("V");
-					session->argv_lens[2] = 1;
-					session->argv[3] = g_strdup ("F");
-					session->argv_lens[3] = 1;
-					g_string_free (key, FALSE); /* Do not free underlying array */
-
-					g_assert (session->ctx != NULL);
-					if (redisAsyncCommandArgv (session->ctx,
-							rspamd_fuzzy_redis_check_callback,
-							session, session->nargs,
-							(const gchar **)session->argv,
-							session->argv_lens) != REDIS_OK) {
-
-						if (session->callback.cb_check) {
-							memset (&rep, 0, sizeof (rep));
-							session->callback.cb_check (&rep, session->cbdata);
-						}
-
-						rspamd_fuzzy_redis_session_dtor (session, TRUE);
-					}
-					else {
-						/* Add timeout */
-						event_set (&session->timeout, -1, EV_TIMEOUT,
-								rspamd_fuzzy_redis_timeout,
-								session);
-						event_base_set (session->ev_base, &session->timeout);
-						double_to_tv (session->backend->timeout, &tv);
-						event_add (&session->timeout, &tv);
-					}
-
-					return;
-				}
+			if (sel) {
+				session->prob = ((float)max_found) / RSPAMD_SHINGLE_SIZE;
+				g_assert (session->ctx != NULL);
+				rspamd_fuzzy_redis_check_selected (session, sel);
+
+				return;
 			}
 		}
 
@@ -460,6 +680,207 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 	rspamd_fuzzy_redis_session_dtor (session, FALSE);
 }
 
+static void
+rspamd_fuzzy_redis_cluster_shingles_fin (struct rspamd_fuzzy_redis_session *session)
+{
+	struct rspamd_fuzzy_reply rep;
+	struct _rspamd_fuzzy_shingles_helper *sel;
+	guint i, found = 0, max_found;
+
+	event_del (&session->timeout);
+
+	for (i = 0; i < session->cluster_conns->len; i ++) {
+		rspamd_redis_pool_release_connection (session->backend->pool,
+				g_ptr_array_index (session->cluster_conns, i), FALSE);
+	}
+
+	g_ptr_array_set_size (session->cluster_conns, 0);
+
+	if (!session->cluster_failed) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			found += session->shingles[i].found;
+		}
+
+		sel = rspamd_fuzzy_redis_shingles_vote (session->shingles, found,
+				&max_found);
+
+		if (sel) {
+			session->prob = ((float)max_found) / RSPAMD_SHINGLE_SIZE;
+			rspamd_fuzzy_redis_check_selected (session, sel);
+
+			return;
+		}
+	}
+
+	if (session->callback.cb_check) {
+		memset (&rep, 0, sizeof (rep));
+		session->callback.cb_check (&rep, session->cbdata);
+	}
+
+	rspamd_fuzzy_redis_session_dtor (session, FALSE);
+}
+
+static void
+rspamd_fuzzy_redis_cluster_shingle_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_shingle_req *req = priv;
+	struct rspamd_fuzzy_redis_session *session = req->session;
+	redisReply *reply = r;
+
+	if (c->err == 0 && reply != NULL) {
+		if (reply->type == REDIS_REPLY_STRING) {
+			session->shingles[req->idx].found = 1;
+			memcpy (session->shingles[req->idx].digest, reply->str,
+					MIN (64, reply->len));
+		}
+		else if (reply->type == REDIS_REPLY_ERROR) {
+			/* Just update slots map, this shingle is treated as missing */
+			rspamd_fuzzy_redis_maybe_update_slots (session, reply->str);
+		}
+	}
+	else {
+		session->cluster_failed = TRUE;
+	}
+
+	if (--session->npending == 0) {
+		if (session->cluster_failed) {
+			rspamd_upstream_fail (session->up);
+		}
+		else {
+			rspamd_upstream_ok (session->up);
+		}
+
+		rspamd_fuzzy_redis_cluster_shingles_fin (session);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_cluster_timeout (gint fd, short what, gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+	GPtrArray *conns;
+	redisAsyncContext *ac;
+	static char errstr[128];
+	guint i;
+
+	/* Callbacks are called on release and the last one finishes session */
+	session->cluster_failed = TRUE;
+	conns = session->cluster_conns;
+	session->cluster_conns = g_ptr_array_new ();
+	rspamd_snprintf (errstr, sizeof (errstr), "%s", strerror (ETIMEDOUT));
+
+	for (i = 0; i < conns->len; i ++) {
+		ac = g_ptr_array_index (conns, i);
+		ac->err = REDIS_ERR_IO;
+		ac->errstr = errstr;
+		rspamd_redis_pool_release_connection (session->backend->pool, ac, TRUE);
+	}
+
+	g_ptr_array_free (conns, TRUE);
+}
+
+/* Shingles keys are spread over cluster, so ask each key separately */
+static void
+rspamd_fuzzy_backend_check_shingles_cluster (
+		struct rspamd_fuzzy_redis_session *session)
+{
+	struct timeval tv;
+	struct rspamd_fuzzy_reply rep;
+	struct rspamd_fuzzy_redis_shingle_req *req;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	redisAsyncContext *ac;
+	GString *key;
+	guint i, j;
+	const gchar *ip;
+	gchar *node;
+	gint port;
+	GPtrArray *addrs;
+	rspamd_inet_addr_t *addr;
+	gchar seed[PATH_MAX];
+
+	shcmd = (const struct rspamd_fuzzy_shingle_cmd *)session->cmd;
+	session->shingles_checked = TRUE;
+	session->shingles = g_malloc0 (sizeof (*session->shingles) *
+			RSPAMD_SHINGLE_SIZE);
+	session->shingle_reqs = g_malloc0 (sizeof (*session->shingle_reqs) *
+			RSPAMD_SHINGLE_SIZE);
+	session->cluster_conns = g_ptr_array_new ();
+	/* Node addresses of cluster connections, one connection per node */
+	addrs = g_ptr_array_new_with_free_func (g_free);
+
+	if (session->ctx) {
+		ac = session->ctx;
+		session->ctx = NULL;
+		rspamd_redis_pool_release_connection (session->backend->pool, ac, FALSE);
+	}
+
+	addr = rspamd_upstream_addr (session->up);
+	rspamd_strlcpy (seed, rspamd_inet_address_to_string (addr), sizeof (seed));
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		key = g_string_new (session->backend->redis_object);
+		rspamd_printf_gstring (key, "_%d_%uL", i, shcmd->sgl.hashes[i]);
+		req = &session->shingle_reqs[i];
+		req->session = session;
+		req->idx = i;
+
+		rspamd_redis_pool_cluster_node (session->backend->pool,
+				session->backend->dbname, session->backend->password,
+				seed, rspamd_inet_address_get_port (addr),
+				key->str, key->len, &ip, &port);
+		node = g_strdup_printf ("%s:%d", ip, port);
+		ac = NULL;
+
+		for (j = 0; j < addrs->len; j ++) {
+			if (strcmp (g_ptr_array_index (addrs, j), node) == 0) {
+				ac = g_ptr_array_index (session->cluster_conns, j);
+				break;
+			}
+		}
+
+		if (ac == NULL) {
+			ac = rspamd_redis_pool_connect (session->backend->pool,
+					session->backend->dbname, session->backend->password,
+					ip, port);
+
+			if (ac != NULL) {
+				g_ptr_array_add (session->cluster_conns, ac);
+				g_ptr_array_add (addrs, node);
+				node = NULL;
+			}
+		}
+
+		g_free (node);
+
+		if (ac != NULL && redisAsyncCommand (ac,
+				rspamd_fuzzy_redis_cluster_shingle_callback, req,
+				"GET %b", key->str, key->len) == REDIS_OK) {
+			session->npending ++;
+		}
+
+		g_string_free (key, TRUE);
+	}
+
+	g_ptr_array_free (addrs, TRUE);
+
+	if (session->npending == 0) {
+		if (session->callback.cb_check) {
+			memset (&rep, 0, sizeof (rep));
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+
+		rspamd_fuzzy_redis_session_dtor (session, TRUE);
+	}
+	else {
+		event_set (&session->timeout, -1, EV_TIMEOUT,
+				rspamd_fuzzy_redis_cluster_timeout, session);
+		event_base_set (session->ev_base, &session->timeout);
+		double_to_tv (session->backend->timeout, &tv);
+		event_add (&session->timeout, &tv);
+	}
+}
+
 static void
 rspamd_fuzzy_backend_check_shingles (struct rspamd_fuzzy_redis_session *session)
 {
@@ -529,6 +950,11 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 	if (c->err == 0) {
 		rspamd_upstream_ok (session->up);
 
+		if (rspamd_fuzzy_redis_maybe_redirect (session, reply,
+				rspamd_fuzzy_redis_check_callback)) {
+			return;
+		}
+
 		if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2) {
 			cur = reply->element[0];
 
@@ -554,7 +980,12 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 		if (found_elts != 2) {
 			if (session->cmd->shingles_count > 0 && !session->shingles_checked) {
 				/* We also need to check all shingles here */
-				rspamd_fuzzy_backend_check_shingles (session);
+				if (session->backend->cluster) {
+					rspamd_fuzzy_backend_check_shingles_cluster (session);
+				}
+				else {
+					rspamd_fuzzy_backend_check_shingles (session);
+				}
 				/* Do not free session */
 				return;
 			}
@@ -585,6 +1016,174 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 	rspamd_fuzzy_redis_session_dtor (session, FALSE);
 }
 
+static void rspamd_fuzzy_backend_check_script (
+		struct rspamd_fuzzy_redis_session *session);
+
+static void
+rspamd_fuzzy_redis_script_load_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_redis_pool *pool = priv;
+	redisReply *reply = r;
+
+	if (c->err == 0 && reply != NULL && reply->type == REDIS_REPLY_STRING) {
+		rspamd_redis_pool_set_script (pool, c, REDIS_CHECK_SCRIPT_NAME,
+				reply->str);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_script_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+	redisReply *reply = r, *cur;
+	struct rspamd_fuzzy_reply rep;
+
+	event_del (&session->timeout);
+	memset (&rep, 0, sizeof (rep));
+
+	if (c->err == 0) {
+		rspamd_upstream_ok (session->up);
+
+		if (reply->type == REDIS_REPLY_ERROR &&
+				strncmp (reply->str, "NOSCRIPT", sizeof ("NOSCRIPT") - 1) == 0) {
+			/* Scripts cache has been flushed, load script once again */
+			rspamd_redis_pool_set_script (session->backend->pool, c,
+					REDIS_CHECK_SCRIPT_NAME, NULL);
+			rspamd_fuzzy_backend_check_script (session);
+			/* Do not free session */
+			return;
+		}
+
+		if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 3) {
+			cur = reply->element[0];
+
+			if (cur->type == REDIS_REPLY_STRING) {
+				rep.value = strtoul (cur->str, NULL, 10);
+			}
+
+			cur = reply->element[1];
+
+			if (cur->type == REDIS_REPLY_STRING) {
+				rep.flag = strtoul (cur->str, NULL, 10);
+			}
+
+			cur = reply->element[2];
+
+			if (cur->type == REDIS_REPLY_INTEGER) {
+				rep.prob = ((float)cur->integer) / RSPAMD_SHINGLE_SIZE;
+			}
+		}
+		else if (reply->type == REDIS_REPLY_ERROR) {
+			msg_err_redis_session ("error executing check script: %s",
+					reply->str);
+		}
+
+		if (session->callback.cb_check) {
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+	}
+	else {
+		if (session->callback.cb_check) {
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+
+		if (c->errstr) {
+			msg_err_redis_session ("error getting hashes: %s", c->errstr);
+		}
+
+		rspamd_upstream_fail (session->up);
+	}
+
+	rspamd_fuzzy_redis_session_dtor (session, FALSE);
+}
+
+static void
+rspamd_fuzzy_backend_check_script (struct rspamd_fuzzy_redis_session *session)
+{
+	struct timeval tv;
+	struct rspamd_fuzzy_reply rep;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	const gchar *sha;
+	GString *key;
+	guint i, nkeys;
+
+	g_assert (session->ctx != NULL);
+
+	rspamd_fuzzy_redis_session_free_args (session);
+	nkeys = session->cmd->shingles_count > 0 ? RSPAMD_SHINGLE_SIZE + 1 : 1;
+	/* EVALSHA, sha, numkeys, keys and prefix */
+	session->nargs = nkeys + 4;
+	session->argv = g_malloc (sizeof (gchar *) * session->nargs);
+	session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
+
+	sha = rspamd_redis_pool_get_script (session->backend->pool, session->ctx,
+			REDIS_CHECK_SCRIPT_NAME);
+
+	if (sha) {
+		session->argv[0] = g_strdup ("EVALSHA");
+		session->argv[1] = g_strdup (sha);
+	}
+	else {
+		/* Load script for further requests within the same round trip */
+		redisAsyncCommand (session->ctx,
+				rspamd_fuzzy_redis_script_load_callback,
+				session->backend->pool,
+				"SCRIPT LOAD %s", fuzzy_check_script);
+		session->argv[0] = g_strdup ("EVAL");
+		session->argv[1] = g_strdup (fuzzy_check_script);
+	}
+
+	session->argv_lens[0] = strlen (session->argv[0]);
+	session->argv_lens[1] = strlen (session->argv[1]);
+	session->argv[2] = g_strdup_printf ("%u", nkeys);
+	session->argv_lens[2] = strlen (session->argv[2]);
+
+	key = g_string_new (session->backend->redis_object);
+	g_string_append_len (key, session->cmd->digest,
+			sizeof (session->cmd->digest));
+	session->argv[3] = key->str;
+	session->argv_lens[3] = key->len;
+	g_string_free (key, FALSE); /* Do not free underlying array */
+
+	if (nkeys > 1) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)session->cmd;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			key = g_string_new (session->backend->redis_object);
+			rspamd_printf_gstring (key, "_%d_%uL", i, shcmd->sgl.hashes[i]);
+			session->argv[i + 4] = key->str;
+			session->argv_lens[i + 4] = key->len;
+			g_string_free (key, FALSE); /* Do not free underlying array */
+		}
+	}
+
+	session->argv[nkeys + 3] = g_strdup (session->backend->redis_object);
+	session->argv_lens[nkeys + 3] = strlen (session->backend->redis_object);
+
+	if (redisAsyncCommandArgv (session->ctx, rspamd_fuzzy_redis_script_callback,
+			session, session->nargs,
+			(const gchar **)session->argv, session->argv_lens) != REDIS_OK) {
+		msg_err ("cannot execute redis command: %s", session->ctx->errstr);
+
+		if (session->callback.cb_check) {
+			memset (&rep, 0, sizeof (rep));
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+
+		rspamd_fuzzy_redis_session_dtor (session, TRUE);
+	}
+	else {
+		/* Add timeout */
+		event_set (&session->timeout, -1, EV_TIMEOUT, rspamd_fuzzy_redis_timeout,
+				session);
+		event_base_set (session->ev_base, &session->timeout);
+		double_to_tv (session->backend->timeout, &tv);
+		event_add (&session->timeout, &tv);
+	}
+}
+
 void
 rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 		const struct rspamd_fuzzy_cmd *cmd,
@@ -595,7 +1194,6 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 	struct rspamd_fuzzy_redis_session *session;
 	struct upstream *up;
 	struct timeval tv;
-	rspamd_inet_addr_t *addr;
 	struct rspamd_fuzzy_reply rep;
 	GString *key;
 
@@ -635,12 +1233,8 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 			0);
 
 	session->up = up;
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	session->ctx = rspamd_redis_pool_connect (backend->pool,
-			backend->dbname, backend->password,
-			rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
+	session->ctx = rspamd_fuzzy_redis_session_connect (session,
+			session->argv[1], session->argv_lens[1]);
 
 	if (session->ctx == NULL) {
 		rspamd_fuzzy_redis_session_dtor (session, TRUE);
@@ -650,6 +1244,9 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 			cb (&rep, ud);
 		}
 	}
+	else if (backend->use_script) {
+		rspamd_fuzzy_backend_check_script (session);
+	}
 	else {
 		if (redisAsyncCommandArgv (session->ctx, rspamd_fuzzy_redis_check_callback,
 				session, session->nargs,
@@ -685,6 +1282,11 @@ rspamd_fuzzy_redis_count_callback (redisAsyncContext *c, gpointer r,
 	if (c->err == 0) {
 		rspamd_upstream_ok (session->up);
 
+		if (rspamd_fuzzy_redis_maybe_redirect (session, reply,
+				rspamd_fuzzy_redis_count_callback)) {
+			return;
+		}
+
 		if (reply->type == REDIS_REPLY_INTEGER) {
 			if (session->callback.cb_count) {
 				session->callback.cb_count (reply->integer, session->cbdata);
@@ -727,7 +1329,6 @@ rspamd_fuzzy_backend_count_redis (struct rspamd_fuzzy_backend *bk,
 	struct rspamd_fuzzy_redis_session *session;
 	struct upstream *up;
 	struct timeval tv;
-	rspamd_inet_addr_t *addr;
 	GString *key;
 
 	g_assert (backend != NULL);
@@ -758,12 +1359,8 @@ rspamd_fuzzy_backend_count_redis (struct rspamd_fuzzy_backend *bk,
 			0);
 
 	session->up = up;
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	session->ctx = rspamd_redis_pool_connect (backend->pool,
-			backend->dbname, backend->password,
-			rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
+	session->ctx = rspamd_fuzzy_redis_session_connect (session,
+			session->argv[1], session->argv_lens[1]);
 
 	if (session->ctx == NULL) {
 		rspamd_fuzzy_redis_session_dtor (session, TRUE);
@@ -806,6 +1403,11 @@ rspamd_fuzzy_redis_version_callback (redisAsyncContext *c, gpointer r,
 	if (c->err == 0) {
 		rspamd_upstream_ok (session->up);
 
+		if (rspamd_fuzzy_redis_maybe_redirect (session, reply,
+				rspamd_fuzzy_redis_version_callback)) {
+			return;
+		}
+
 		if (reply->type == REDIS_REPLY_INTEGER) {
 			if (session->callback.cb_version) {
 				session->callback.cb_version (reply->integer, session->cbdata);
@@ -849,7 +1451,6 @@ rspamd_fuzzy_backend_version_redis (struct rspamd_fuzzy_backend *bk,
 	struct rspamd_fuzzy_redis_session *session;
 	struct upstream *up;
 	struct timeval tv;
-	rspamd_inet_addr_t *addr;
 	GString *key;
 
 	g_assert (backend != NULL);
@@ -880,12 +1481,8 @@ rspamd_fuzzy_backend_version_redis (struct rspamd_fuzzy_backend *bk,
 			0);
 
 	session->up = up;
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	session->ctx = rspamd_redis_pool_connect (backend->pool,
-			backend->dbname, backend->password,
-			rspamd_inet_address_to_string (addr),
-			rspamd_inet_address_get_port (addr));
+	session->ctx = rspamd_fuzzy_redis_session_connect (session,
+			session->argv[1], session->argv_lens[1]);
 
 	if (session->ctx == NULL) {
 		rspamd_fuzzy_redis_session_dtor (session, TRUE);
@@ -835,6 +835,83 @@ rspamd_fuzzy_backend_sqlite_del (struct rspamd_fuzzy_backend_sqlite *backend,
 	return (rc == SQLITE_OK);
 }
 
+gboolean
+rspamd_fuzzy_backend_sqlite_expire_step (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		gint64 expire,
+		gdouble max_time)
+{
+	/* Keep transactions short to avoid blocking readers */
+	const guint64 max_changes = 500;
+	gint64 expire_lim, expired, total = 0;
+	gdouble start;
+	gint rc;
+	gboolean more = FALSE;
+
+	if (backend == NULL || expire <= 0) {
+		return FALSE;
+	}
+
+	expire_lim = time (NULL) - expire;
+
+	if (expire_lim <= 0) {
+		return FALSE;
+	}
+
+	start = rspamd_get_ticks ();
+
+	do {
+		more = FALSE;
+		expired = 0;
+		rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+				RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
+
+		if (rc != SQLITE_OK) {
+			msg_warn_fuzzy_backend ("cannot expire db: %s",
+					sqlite3_errmsg (backend->db));
+			break;
+		}
+
+		/* Uses index on time, so no scan is needed to find expired rows */
+		rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
+				RSPAMD_FUZZY_BACKEND_EXPIRE, expire_lim, max_changes);
+
+		if (rc == SQLITE_OK) {
+			expired = sqlite3_changes (backend->db);
+			total += expired;
+			more = (expired >= (gint64)max_changes);
+		}
+		else {
+			msg_warn_fuzzy_backend (
+					"cannot execute expired statement: %s",
+					sqlite3_errmsg (backend->db));
+		}
+
+		rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend,
+				RSPAMD_FUZZY_BACKEND_EXPIRE);
+
+		rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+				RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
+
+		if (rc != SQLITE_OK) {
+			msg_warn_fuzzy_backend ("cannot expire db: %s",
+					sqlite3_errmsg (backend->db));
+			rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+					RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK);
+			total -= expired;
+			more = FALSE;
+			break;
+		}
+	} while (more && rspamd_get_ticks () - start < max_time);
+
+	if (total > 0) {
+		backend->expired += total;
+		msg_info_fuzzy_backend ("expired %L hashes", total);
+	}
+
+	return more;
+}
+
 gboolean
 rspamd_fuzzy_backend_sqlite_sync (struct rspamd_fuzzy_backend_sqlite *backend,
 		gint64 expire,
@@ -848,7 +925,6 @@ rspamd_fuzzy_backend_sqlite_sync (struct rspamd_fuzzy_backend_sqlite *backend,
 	/* Do not do more than 5k ops per step */
 	const guint64 max_changes = 5000;
 	gboolean ret = FALSE;
-	gint64 expire_lim, expired;
 	gint rc, i, orphaned_cnt = 0;
 	GError *err = NULL;
 	static const gchar orphaned_shingles[] = "SELECT shingles.value,shingles.number "
@@ -866,49 +942,7 @@ rspamd_fuzzy_backend_sqlite_sync (struct rspamd_fuzzy_backend_sqlite *backend,
 	}
 
 	/* Perform expire */
-	if (expire > 0) {
-		expire_lim = time (NULL) - expire;
-
-		if (expire_lim > 0) {
-			ret = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
-					RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
-
-			if (ret == SQLITE_OK) {
-
-				rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
-						RSPAMD_FUZZY_BACKEND_EXPIRE, expire_lim, max_changes);
-
-				if (rc == SQLITE_OK) {
-					expired = sqlite3_changes (backend->db);
-
-					if (expired > 0) {
-						backend->expired += expired;
-						msg_info_fuzzy_backend ("expired %L hashes", expired);
-					}
-				}
-				else {
-					msg_warn_fuzzy_backend (
-							"cannot execute expired statement: %s",
-							sqlite3_errmsg (backend->db));
-				}
-
-				rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend,
-						RSPAMD_FUZZY_BACKEND_EXPIRE);
-
-				ret = rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
-						RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
-
-				if (ret != SQLITE_OK) {
-					rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
-							RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK);
-				}
-			}
-			if (ret != SQLITE_OK) {
-				msg_warn_fuzzy_backend ("cannot expire db: %s",
-						sqlite3_errmsg (backend->db));
-			}
-		}
-	}
+	rspamd_fuzzy_backend_sqlite_expire_step (backend, expire, 0);
 
 	/* Cleanup database */
 	if (clean_orphaned) {
@@ -74,6 +74,16 @@ gboolean rspamd_fuzzy_backend_sqlite_del (
 gboolean rspamd_fuzzy_backend_sqlite_finish_update (struct rspamd_fuzzy_backend_sqlite *backend,
 		const gchar *source, gboolean version_bump);
 
+/**
+ * Expire old hashes in short transactions until either all expired hashes are
+ * removed or `max_time` seconds have passed
+ * @return TRUE if more expired hashes might be left
+ */
+gboolean rspamd_fuzzy_backend_sqlite_expire_step (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		gint64 expire,
+		gdouble max_time);
+
 /**
  * Sync storage
  * @param backend
@@ -8,6 +8,9 @@
 
 #define RSPAMD_FUZZY_VERSION 3
 #define RSPAMD_FUZZY_KEYLEN 8
+#define RSPAMD_FUZZY_BATCH_VERSION 1
+/* Maximum number of commands packed into a single batch datagram */
+#define RSPAMD_FUZZY_BATCH_MAX 8
 
 /* Commands for fuzzy storage */
 #define FUZZY_CHECK 0
@@ -77,7 +80,24 @@ RSPAMD_PACKED(rspamd_fuzzy_encrypted_reply) {
 	struct rspamd_fuzzy_reply rep;
 };
 
+/*
+ * Batched request: this header followed by `ncmds` normal or shingle commands
+ * (distinguished by `shingles_count`). Encrypted batches are prefixed by
+ * `rspamd_fuzzy_encrypted_req_hdr` with `fuzzy_encrypted_batch_magic` and
+ * have the batch header and all commands encrypted as a single payload.
+ * Replies use the same header followed by `ncmds` replies in the same order,
+ * prefixed by `rspamd_fuzzy_encrypted_rep_hdr` for encrypted batches.
+ */
+RSPAMD_PACKED(rspamd_fuzzy_batch_hdr) {
+	guchar magic[4];
+	guint8 version;
+	guint8 ncmds;
+	guint16 reserved;
+};
+
 static const guchar fuzzy_encrypted_magic[4] = {'r', 's', 'f', 'e'};
+static const guchar fuzzy_batch_magic[4] = {'r', 's', 'f', 'b'};
+static const guchar fuzzy_encrypted_batch_magic[4] = {'r', 's', 'f', 'B'};
 
 struct rspamd_fuzzy_stat_entry {
 	const gchar *name;
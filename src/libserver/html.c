@@ -21,6 +21,7 @@
 #include "html_tags.h"
 #include "html_colors.h"
 #include "url.h"
+#include "multipattern.h"
 #include <unicode/uversion.h>
 #if U_ICU_VERSION_MAJOR_NUM >= 46
 #include <unicode/uidna.h>
@@ -448,6 +449,16 @@ static entity entities_defs[] = {
 };
 
 static GHashTable *html_colors_hash = NULL;
+/* Named entities in entities_defs order followed by the numeric prefix */
+static struct rspamd_multipattern *html_entities_mp = NULL;
+static gboolean html_entities_mp_failed = FALSE;
+static GArray *html_entities_matches = NULL;
+
+struct rspamd_html_entity_match {
+	goffset start;
+	goffset end;
+	gint idx; /* index in entities_defs or -1 for numeric entities */
+};
 
 static entity entities_defs_num[ (G_N_ELEMENTS (entities_defs)) ];
 static struct html_tag_def tag_defs_num[ (G_N_ELEMENTS (tag_defs)) ];
@@ -521,6 +532,36 @@ entity_cmp_num (const void *m1, const void *m2)
 	return p1->code - p2->code;
 }
 
+static void
+rspamd_html_entities_mp_init (void)
+{
+	GError *err = NULL;
+	gchar patbuf[64];
+	guint i;
+
+	html_entities_mp = rspamd_multipattern_create (RSPAMD_MULTIPATTERN_DEFAULT);
+
+	for (i = 0; i < G_N_ELEMENTS (entities_defs); i ++) {
+		rspamd_snprintf (patbuf, sizeof (patbuf), "&%s;", entities_defs[i].name);
+		rspamd_multipattern_add_pattern (html_entities_mp, patbuf, 0);
+	}
+
+	rspamd_multipattern_add_pattern (html_entities_mp, "&#", 0);
+
+	if (!rspamd_multipattern_compile (html_entities_mp, &err)) {
+		msg_err ("cannot compile html entities matcher: %e", err);
+		g_error_free (err);
+		rspamd_multipattern_destroy (html_entities_mp);
+		html_entities_mp = NULL;
+		/* Use simple decoder */
+		html_entities_mp_failed = TRUE;
+	}
+	else {
+		html_entities_matches = g_array_sized_new (FALSE, FALSE,
+				sizeof (struct rspamd_html_entity_match), 64);
+	}
+}
+
 static void
 rspamd_html_library_init (void)
 {
@@ -542,6 +583,10 @@ rspamd_html_library_init (void)
 		entities_sorted = 1;
 	}
 
+	if (html_entities_mp == NULL && !html_entities_mp_failed) {
+		rspamd_html_entities_mp_init ();
+	}
+
 	if (html_colors_hash == NULL) {
 		guint i;
 
@@ -568,21 +613,17 @@ rspamd_html_library_init (void)
 }
 
 static gboolean
-rspamd_html_check_balance (GNode * node, GNode ** cur_level)
+rspamd_html_check_balance (struct html_tag *tag, struct html_tag **cur_level)
 {
-	struct html_tag *arg = node->data, *tmp;
-	GNode *cur;
+	struct html_tag *cur;
 
-	if (arg->flags & FL_CLOSING) {
+	if (tag->flags & FL_CLOSING) {
 		/* First of all check whether this tag is closing tag for parent node */
-		cur = node->parent;
-		while (cur && cur->data) {
-			tmp = cur->data;
-			if (tmp->id == arg->id &&
-				(tmp->flags & FL_CLOSED) == 0) {
-				tmp->flags |= FL_CLOSED;
-				/* Destroy current node as we find corresponding parent node */
-				g_node_destroy (node);
+		cur = *cur_level;
+		while (cur) {
+			if (cur->id == tag->id &&
+				(cur->flags & FL_CLOSED) == 0) {
+				cur->flags |= FL_CLOSED;
 				/* Change level */
 				*cur_level = cur->parent;
 				return TRUE;
@@ -651,21 +692,16 @@ rspamd_html_tag_by_id (gint id)
 	return NULL;
 }
 
-/* Decode HTML entitles in text */
-guint
-rspamd_html_decode_entitles_inplace (gchar *s, guint len)
+/* Decode HTML entitles in text char by char */
+static guint
+rspamd_html_decode_entitles_simple (gchar *s, guint len)
 {
 	guint l, rep_len;
 	gchar *t = s, *h = s, *e = s, *end_ptr;
 	gint state = 0, val, base;
 	entity *found, key;
 
-	if (len == 0) {
-		l = strlen (s);
-	}
-	else {
-		l = len;
-	}
+	l = len;
 
 	while (h - s < (gint)l) {
 		switch (state) {
@@ -764,6 +800,190 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 	return (t - s);
 }
 
+static gint
+rspamd_html_entity_match_cb (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	GArray *matches = context;
+	struct rspamd_html_entity_match m, *prev;
+	const gchar *p, *end;
+
+	if (strnum < G_N_ELEMENTS (entities_defs)) {
+		m.idx = strnum;
+		m.end = match_pos;
+	}
+	else {
+		/* Numeric entity: &#NNN; or &#xHHHH; */
+		m.idx = -1;
+		p = text + match_pos;
+		end = MIN (text + len, p + 10);
+
+		while (p < end && *p != ';' && *p != '&') {
+			p ++;
+		}
+
+		if (p == end || *p != ';') {
+			return 0;
+		}
+
+		m.end = p - text + 1;
+	}
+
+	m.start = match_start;
+
+	if (matches->len > 0) {
+		prev = &g_array_index (matches, struct rspamd_html_entity_match,
+				matches->len - 1);
+
+		if (m.start < prev->end) {
+			return 0;
+		}
+	}
+
+	g_array_append_val (matches, m);
+
+	return 0;
+}
+
+static gboolean
+rspamd_html_parse_numeric_entity (const gchar *p, const gchar *end, gint *res)
+{
+	gint base = 10, digit;
+	guint64 val = 0;
+
+	if (p < end && (*p == 'x' || *p == 'X')) {
+		base = 16;
+		p ++;
+	}
+	else if (p < end && (*p == 'o' || *p == 'O')) {
+		base = 8;
+		p ++;
+	}
+
+	if (p == end) {
+		return FALSE;
+	}
+
+	while (p < end) {
+		digit = g_ascii_xdigit_value (*p);
+
+		if (digit == -1 || digit >= base) {
+			return FALSE;
+		}
+
+		val = val * base + digit;
+		p ++;
+	}
+
+	if (val > G_MAXINT32) {
+		return FALSE;
+	}
+
+	*res = val;
+
+	return TRUE;
+}
+
+/* Decode HTML entitles in text */
+guint
+rspamd_html_decode_entitles_inplace (gchar *s, guint len)
+{
+	struct rspamd_html_entity_match *m;
+	const gchar *h = s, *repl;
+	gchar *t = s;
+	entity *found, key;
+	gint val;
+	guint i, l, rep_len;
+
+	if (len == 0) {
+		l = strlen (s);
+	}
+	else {
+		l = len;
+	}
+
+	rspamd_html_library_init ();
+
+	if (html_entities_mp == NULL) {
+		return rspamd_html_decode_entitles_simple (s, l);
+	}
+
+	if (memchr (s, '&', l) == NULL) {
+		return l;
+	}
+
+	g_array_set_size (html_entities_matches, 0);
+	rspamd_multipattern_lookup (html_entities_mp, s, l,
+			rspamd_html_entity_match_cb, html_entities_matches, NULL);
+
+	for (i = 0; i < html_entities_matches->len; i ++) {
+		m = &g_array_index (html_entities_matches,
+				struct rspamd_html_entity_match, i);
+
+		if (s + m->start > h) {
+			memmove (t, h, s + m->start - h);
+			t += s + m->start - h;
+		}
+
+		h = s + m->end;
+		repl = NULL;
+		rep_len = 0;
+
+		if (m->idx >= 0) {
+			found = &entities_defs[m->idx];
+		}
+		else if (rspamd_html_parse_numeric_entity (s + m->start + 2,
+				s + m->end - 1, &val)) {
+			key.code = val;
+			found = bsearch (&key, entities_defs_num,
+					G_N_ELEMENTS (entities_defs), sizeof (entity),
+					entity_cmp_num);
+
+			if (found == NULL && g_unichar_isgraph (val)) {
+				/* Unicode point */
+				t += g_unichar_to_utf8 (val, t);
+				continue;
+			}
+		}
+		else {
+			found = NULL;
+		}
+
+		if (found) {
+			if (found->replacement) {
+				repl = found->replacement;
+				rep_len = strlen (repl);
+			}
+			else if (m->idx < 0) {
+				/* Numeric entities with no replacement are removed */
+				continue;
+			}
+		}
+
+		if (repl) {
+			memcpy (t, repl, rep_len);
+			t += rep_len;
+		}
+		else {
+			/* Leave undecoded */
+			memmove (t, s + m->start, m->end - m->start);
+			t += m->end - m->start;
+		}
+	}
+
+	if (s + l > h) {
+		memmove (t, h, s + l - h);
+		t += s + l - h;
+	}
+
+	return (t - s);
+}
+
 static gboolean
 rspamd_url_is_subdomain (rspamd_ftok_t *t1, rspamd_ftok_t *t2)
 {
@@ -871,6 +1091,23 @@ rspamd_html_url_is_phished (rspamd_mempool_t *pool,
 		rc = rspamd_url_parse (text_url, url_str, strlen (url_str), pool);
 
 		if (rc == URI_ERRNO_OK) {
+			/*
+			 * Hosts are lowercased on parsing, so the same hosts or the same
+			 * registered domains cannot differ after idna conversion
+			 */
+			if ((text_url->hostlen == href_url->hostlen &&
+					memcmp (text_url->host, href_url->host,
+							href_url->hostlen) == 0) ||
+					(text_url->tldlen > 0 &&
+					text_url->tldlen == href_url->tldlen &&
+					memcmp (text_url->tld, href_url->tld,
+							href_url->tldlen) == 0)) {
+				*ptext_url = text_url;
+				*url_found = TRUE;
+
+				return;
+			}
+
 			disp_tok.len = text_url->hostlen;
 			disp_tok.begin = text_url->host;
 #if U_ICU_VERSION_MAJOR_NUM >= 46
@@ -988,47 +1225,37 @@ rspamd_html_url_is_phished (rspamd_mempool_t *pool,
 
 static gboolean
 rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
-		struct html_tag *tag, GNode **cur_level, gboolean *balanced)
+		struct html_tag *tag, struct html_tag **cur_level, gboolean *balanced,
+		gsize size_hint)
 {
-	GNode *nnode;
 	struct html_tag *parent;
 
 	if (hc->html_tags == NULL) {
-		nnode = g_node_new (NULL);
-		*cur_level = nnode;
-		hc->html_tags = nnode;
-		rspamd_mempool_add_destructor (pool,
-				(rspamd_mempool_destruct_t) g_node_destroy,
-				nnode);
+		/* Assume one block tag per 64 bytes of input */
+		hc->html_tags = g_ptr_array_sized_new (MAX (size_hint / 64, 16));
+		rspamd_mempool_add_destructor (pool, rspamd_ptr_array_free_hard,
+				hc->html_tags);
 	}
 
 	tag->parent = *cur_level;
 
 	if (!(tag->flags & CM_INLINE)) {
 		/* Block tag */
-		nnode = g_node_new (tag);
-
 		if (tag->flags & FL_CLOSING) {
-			if (!*cur_level) {
-				msg_debug_html ("bad parent node");
-				g_node_destroy (nnode);
-				return FALSE;
-			}
-
-			g_node_append (*cur_level, nnode);
-
-			if (!rspamd_html_check_balance (nnode, cur_level)) {
+			if (!rspamd_html_check_balance (tag, cur_level)) {
 				msg_debug_html (
 						"mark part as unbalanced as it has not pairable closing tags");
 				hc->flags |= RSPAMD_HTML_FLAG_UNBALANCED;
 				*balanced = FALSE;
+				/* Keep unpaired closing tags visible for the tags traversal */
+				g_ptr_array_add (hc->html_tags, tag);
 			}
 			else {
 				*balanced = TRUE;
 			}
 		}
 		else {
-			parent = (*cur_level)->data;
+			parent = *cur_level;
 
 			if (parent) {
 				if ((parent->flags & FL_IGNORE)) {
@@ -1038,10 +1265,10 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 				parent->content_length += tag->content_length;
 			}
 
-			g_node_append (*cur_level, nnode);
+			g_ptr_array_add (hc->html_tags, tag);
 
 			if ((tag->flags & FL_CLOSED) == 0) {
-				*cur_level = nnode;
+				*cur_level = tag;
 			}
 
 			if (tag->flags & (CM_HEAD|CM_UNKNOWN|FL_IGNORE)) {
@@ -1054,7 +1281,7 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 	}
 	else {
 		/* Inline tag */
-		parent = (*cur_level)->data;
+		parent = *cur_level;
 
 		if (parent && (parent->flags & (CM_HEAD|CM_UNKNOWN|FL_IGNORE))) {
 			tag->flags |= FL_IGNORE;
@@ -1066,12 +1293,35 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 	return TRUE;
 }
 
+/* Links params list in the pool, so tags need no destructors */
+static inline void
+rspamd_html_tag_add_param (rspamd_mempool_t *pool, struct html_tag *tag,
+		struct html_tag_component *comp)
+{
+	GList *lnk;
+
+	lnk = rspamd_mempool_alloc (pool, sizeof (*lnk));
+	lnk->data = comp;
+	lnk->next = NULL;
+	lnk->prev = tag->params->tail;
+
+	if (tag->params->tail) {
+		tag->params->tail->next = lnk;
+	}
+	else {
+		tag->params->head = lnk;
+	}
+
+	tag->params->tail = lnk;
+	tag->params->length ++;
+}
+
 #define NEW_COMPONENT(comp_type) do {							\
 	comp = rspamd_mempool_alloc (pool, sizeof (*comp));			\
 	comp->type = (comp_type);									\
 	comp->start = NULL;											\
 	comp->len = 0;												\
-	g_queue_push_tail (tag->params, comp);						\
+	rspamd_html_tag_add_param (pool, tag, comp);				\
 	ret = TRUE;													\
 } while(0)
 
@@ -1827,7 +2077,6 @@ rspamd_html_process_block_tag (rspamd_mempool_t *pool, struct html_tag *tag,
 	struct html_block *bl, *bl_parent;
 	rspamd_ftok_t fstr;
 	GList *cur;
-	GNode *parent;
 	struct html_tag *parent_tag;
 
 	cur = tag->params->head;
@@ -1873,10 +2122,9 @@ rspamd_html_process_block_tag (rspamd_mempool_t *pool, struct html_tag *tag,
 
 	if (!bl->background_color.valid) {
 		/* Try to propagate background color from parent nodes */
-		for (parent = tag->parent; parent != NULL; parent = parent->parent) {
-			parent_tag = parent->data;
-
-			if (parent_tag && (parent_tag->flags & FL_BLOCK) && parent_tag->extra) {
+		for (parent_tag = tag->parent; parent_tag != NULL;
+				parent_tag = parent_tag->parent) {
+			if ((parent_tag->flags & FL_BLOCK) && parent_tag->extra) {
 				bl_parent = parent_tag->extra;
 
 				if (bl_parent->background_color.valid) {
@@ -1889,10 +2137,9 @@ rspamd_html_process_block_tag (rspamd_mempool_t *pool, struct html_tag *tag,
 	}
 	if (!bl->font_color.valid) {
 		/* Try to propagate background color from parent nodes */
-		for (parent = tag->parent; parent != NULL; parent = parent->parent) {
-			parent_tag = parent->data;
-
-			if (parent_tag && (parent_tag->flags & FL_BLOCK) && parent_tag->extra) {
+		for (parent_tag = tag->parent; parent_tag != NULL;
+				parent_tag = parent_tag->parent) {
+			if ((parent_tag->flags & FL_BLOCK) && parent_tag->extra) {
 				bl_parent = parent_tag->extra;
 
 				if (bl_parent->font_color.valid) {
@@ -1934,8 +2181,8 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 			balanced, url_text;
 	GByteArray *dest;
 	GHashTable *target_tbl;
-	guint obrace = 0, ebrace = 0;
-	GNode *cur_level = NULL;
+	guint obrace = 0, ebrace = 0, ntags = 0;
+	struct html_tag *cur_level = NULL;
 	gint substate = 0, len, href_offset = -1;
 	struct html_tag *cur_tag = NULL, *content_tag = NULL;
 	struct rspamd_url *url = NULL, *turl;
@@ -2018,13 +2265,19 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 				p ++;
 				break;
 			default:
+				if (hc->max_tags > 0 && ++ntags > hc->max_tags) {
+					/* Truncate the rest of a document */
+					hc->flags |= RSPAMD_HTML_FLAG_TOO_MANY_TAGS;
+					end = p;
+					break;
+				}
+
 				state = tag_content;
 				substate = 0;
 				savep = NULL;
-				cur_tag = rspamd_mempool_alloc0 (pool, sizeof (*cur_tag));
-				cur_tag->params = g_queue_new ();
-				rspamd_mempool_add_destructor (pool,
-						(rspamd_mempool_destruct_t)g_queue_free, cur_tag->params);
+				cur_tag = rspamd_mempool_alloc0 (pool,
+						sizeof (*cur_tag) + sizeof (GQueue));
+				cur_tag->params = (GQueue *)(cur_tag + 1);
 				break;
 			}
 
@@ -2255,7 +2508,7 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 				balanced = TRUE;
 
 				if (rspamd_html_process_tag (pool, hc, cur_tag, &cur_level,
-						&balanced)) {
+						&balanced, in->len)) {
 					state = content_write;
 					need_decode = FALSE;
 				}
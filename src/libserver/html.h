@@ -17,6 +17,7 @@
 #define RSPAMD_HTML_FLAG_UNBALANCED (1 << 3)
 #define RSPAMD_HTML_FLAG_UNKNOWN_ELEMENTS (1 << 4)
 #define RSPAMD_HTML_FLAG_DUPLICATE_ELEMENTS (1 << 5)
+#define RSPAMD_HTML_FLAG_TOO_MANY_TAGS (1 << 6)
 
 /*
  * Image flags
@@ -98,19 +99,20 @@ struct html_tag {
 	struct html_tag_component name;
 	GQueue *params;
 	gpointer extra; /** Additional data associated with tag (e.g. image) */
-	GNode *parent;
+	struct html_tag *parent; /** Enclosing block tag or NULL for top level */
 };
 
 /* Forwarded declaration */
 struct rspamd_task;
 
 struct html_content {
-	GNode *html_tags;
+	GPtrArray *html_tags; /** Block tags in document order */
 	gint flags;
 	struct html_color bgcolor;
 	guchar *tags_seen;
 	GPtrArray *images;
 	GPtrArray *blocks;
+	guint max_tags; /** Stop parsing after this number of tags (0 - unlimited) */
 };
 
 /*
@@ -22,6 +22,12 @@
 
 static const gdouble default_monitoring_interval = 60.0;
 static const guint default_max_errors = 3;
+/* Adaptive timeouts are set to this factor of the 95th latency percentile */
+static const gdouble adaptive_timeout_factor = 3.0;
+static const gdouble adaptive_timeout_min = 0.3;
+static const guint adaptive_timeout_min_samples = 5;
+
+#define RSPAMD_MONITORED_LATENCY_SAMPLES 32
 
 struct rspamd_monitored_methods {
 	void * (*monitored_config) (struct rspamd_monitored *m,
@@ -50,6 +56,8 @@ struct rspamd_monitored {
 	gdouble offline_time;
 	gdouble total_offline_time;
 	gdouble latency;
+	gdouble lat_samples[RSPAMD_MONITORED_LATENCY_SAMPLES];
+	guint nsamples;
 	guint nchecks;
 	guint max_errors;
 	guint cur_errors;
@@ -122,6 +130,13 @@ rspamd_monitored_propagate_success (struct rspamd_monitored *m, gdouble lat)
 	}
 }
 
+static inline void
+rspamd_monitored_add_sample (struct rspamd_monitored *m, gdouble lat)
+{
+	m->lat_samples[m->nsamples % RSPAMD_MONITORED_LATENCY_SAMPLES] = lat;
+	m->nsamples ++;
+}
+
 static void
 rspamd_monitored_periodic (gint fd, short what, gpointer ud)
 {
@@ -234,6 +249,8 @@ rspamd_monitored_dns_cb (struct rdns_reply *reply, void *arg)
 	conf->check_tm = 0;
 	msg_debug_mon ("dns callback for %s in %.2f: %s", m->url, lat,
 			rdns_strerror (reply->code));
+	/* Timeouts are sampled as well, so slow resources get longer timeouts */
+	rspamd_monitored_add_sample (m, lat);
 
 	if (reply->code == RDNS_RC_TIMEOUT) {
 		rspamd_monitored_propagate_error (m, "timeout");
@@ -470,6 +487,55 @@ rspamd_monitored_latency (struct rspamd_monitored *m)
 		return m->latency;
 }
 
+static gint
+rspamd_monitored_cmp_samples (gconstpointer a, gconstpointer b)
+{
+	gdouble d1 = *(const gdouble *)a, d2 = *(const gdouble *)b;
+
+	return d1 < d2 ? -1 : (d1 > d2 ? 1 : 0);
+}
+
+gdouble
+rspamd_monitored_latency_percentile (struct rspamd_monitored *m, gdouble q)
+{
+	gdouble sorted[RSPAMD_MONITORED_LATENCY_SAMPLES];
+	guint n, idx;
+
+	g_assert (m != NULL);
+
+	n = MIN (m->nsamples, RSPAMD_MONITORED_LATENCY_SAMPLES);
+
+	if (n == 0) {
+		return 0;
+	}
+
+	memcpy (sorted, m->lat_samples, n * sizeof (sorted[0]));
+	qsort (sorted, n, sizeof (sorted[0]), rspamd_monitored_cmp_samples);
+	q = CLAMP (q, 0.0, 1.0);
+	idx = MIN ((guint)(q * n), n - 1);
+
+	return sorted[idx];
+}
+
+gdouble
+rspamd_monitored_timeout (struct rspamd_monitored *m)
+{
+	gdouble base, tm;
+
+	g_assert (m != NULL);
+
+	base = m->ctx->cfg ? m->ctx->cfg->dns_timeout : 0;
+
+	if (base <= 0 || m->nsamples < adaptive_timeout_min_samples) {
+		return base;
+	}
+
+	tm = rspamd_monitored_latency_percentile (m, 0.95) *
+			adaptive_timeout_factor;
+
+	return CLAMP (tm, MIN (adaptive_timeout_min, base), base);
+}
+
 void
 rspamd_monitored_stop (struct rspamd_monitored *m)
 {
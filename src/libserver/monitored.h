@@ -93,6 +93,19 @@ gdouble rspamd_monitored_total_offline_time (struct rspamd_monitored *m);
  */
 gdouble rspamd_monitored_latency (struct rspamd_monitored *m);
 
+/**
+ * Returns the specified percentile (0.0 - 1.0) of recent check latencies or 0
+ * if there were no checks
+ */
+gdouble rspamd_monitored_latency_percentile (struct rspamd_monitored *m,
+		gdouble q);
+
+/**
+ * Returns the timeout to use for requests to this resource: it is derived
+ * from recent latencies and it is never larger than `dns_timeout`
+ */
+gdouble rspamd_monitored_timeout (struct rspamd_monitored *m);
+
 /**
  * Explicitly disable monitored object
  * @param m
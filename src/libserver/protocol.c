@@ -19,6 +19,7 @@
 #include "utlist.h"
 #include "http_private.h"
 #include "worker_private.h"
+#include "worker_util.h"
 #include "contrib/zstd/zstd.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
@@ -76,6 +77,7 @@
 #define USER_AGENT_HEADER "User-Agent"
 #define MTA_TAG_HEADER "MTA-Tag"
 #define PROFILE_HEADER "Profile"
+#define ACCEPT_HEADER "Accept"
 
 
 static GQuark
@@ -248,6 +250,21 @@ err:
 	return FALSE;
 }
 
+static void
+rspamd_protocol_set_settings_id (struct rspamd_task *task,
+		const rspamd_ftok_t *id)
+{
+	guint64 h;
+	guint32 *hp;
+
+	h = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			id->begin, id->len, 0xdeadbabe);
+	hp = rspamd_mempool_alloc (task->task_pool, sizeof (*hp));
+	memcpy (hp, &h, sizeof (*hp));
+	rspamd_mempool_set_variable (task->task_pool, "settings_hash",
+			hp, NULL);
+}
+
 #define IF_HEADER(name) \
 	srch.begin = (name); \
 	srch.len = sizeof (name) - 1; \
@@ -271,6 +288,16 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 			hv_tok = rspamd_ftok_map (hv);
 
 			switch (*hn_tok->begin) {
+			case 'a':
+			case 'A':
+				IF_HEADER (ACCEPT_HEADER) {
+					if (rspamd_substring_search_caseless (hv_tok->begin,
+							hv_tok->len, "application/msgpack",
+							sizeof ("application/msgpack") - 1) != -1) {
+						task->flags |= RSPAMD_TASK_FLAG_MSGPACK;
+					}
+				}
+				break;
 			case 'd':
 			case 'D':
 				IF_HEADER (DELIVER_TO_HEADER) {
@@ -391,15 +418,7 @@ rspamd_protocol_handle_headers (struct rspamd_task *task,
 					task->subject = rspamd_mempool_ftokdup (task->task_pool, hv_tok);
 				}
 				IF_HEADER (SETTINGS_ID_HEADER) {
-					guint64 h;
-					guint32 *hp;
-
-					h = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
-							hv_tok->begin, hv_tok->len, 0xdeadbabe);
-					hp = rspamd_mempool_alloc (task->task_pool, sizeof (*hp));
-					memcpy (hp, &h, sizeof (*hp));
-					rspamd_mempool_set_variable (task->task_pool, "settings_hash",
-							hp, NULL);
+					rspamd_protocol_set_settings_id (task, hv_tok);
 				}
 				break;
 			case 'u':
@@ -594,6 +613,7 @@ gboolean
 rspamd_protocol_handle_request (struct rspamd_task *task,
 	struct rspamd_http_message *msg)
 {
+	const rspamd_ftok_t *ctype;
 	gboolean ret = TRUE;
 
 	if (msg->method == HTTP_SYMBOLS) {
@@ -613,6 +633,15 @@ rspamd_protocol_handle_request (struct rspamd_task *task,
 		task->flags &= ~RSPAMD_TASK_FLAG_JSON;
 		task->flags |= RSPAMD_TASK_FLAG_SPAMC;
 	}
+	else {
+		ctype = rspamd_http_message_find_header (msg, "Content-Type");
+
+		if (ctype && ctype->len == sizeof (RSPAMD_PROTOCOL_TLV_CTYPE) - 1 &&
+				rspamd_lc_cmp (ctype->begin, RSPAMD_PROTOCOL_TLV_CTYPE,
+						ctype->len) == 0) {
+			task->flags |= RSPAMD_TASK_FLAG_TLV;
+		}
+	}
 
 	return ret;
 }
@@ -660,33 +689,15 @@ rspamd_protocol_extended_url (struct rspamd_task *task,
 	return obj;
 }
 
-/*
- * Callback for writing urls
- */
 static void
-urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
+rspamd_protocol_log_url (struct rspamd_task *task,
+		const gchar *encoded, gsize enclen)
 {
-	struct tree_cb_data *cb = ud;
-	struct rspamd_url *url = value;
-	ucl_object_t *obj;
-	struct rspamd_task *task = cb->task;
-	const gchar *user_field = "unknown", *encoded;
+	const gchar *user_field = "unknown";
 	gboolean has_user = FALSE;
 	guint len = 0;
-	gsize enclen;
-
-	encoded = rspamd_url_encode (url, &enclen, task->task_pool);
-
-	if (!(task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
-		obj = ucl_object_fromlstring (encoded, enclen);
-	}
-	else {
-		obj = rspamd_protocol_extended_url (task, url, encoded, enclen);
-	}
-
-	ucl_array_append (cb->top, obj);
 
-	if (cb->task->cfg->log_urls) {
+	if (task->cfg->log_urls) {
 		if (task->user) {
 			user_field = task->user;
 			len = strlen (task->user);
@@ -706,6 +717,32 @@ urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
 	}
 }
 
+/*
+ * Callback for writing urls
+ */
+static void
+urls_protocol_cb (gpointer key, gpointer value, gpointer ud)
+{
+	struct tree_cb_data *cb = ud;
+	struct rspamd_url *url = value;
+	ucl_object_t *obj;
+	struct rspamd_task *task = cb->task;
+	const gchar *encoded;
+	gsize enclen;
+
+	encoded = rspamd_url_encode (url, &enclen, task->task_pool);
+
+	if (!(task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
+		obj = ucl_object_fromlstring (encoded, enclen);
+	}
+	else {
+		obj = rspamd_protocol_extended_url (task, url, encoded, enclen);
+	}
+
+	ucl_array_append (cb->top, obj);
+	rspamd_protocol_log_url (task, encoded, enclen);
+}
+
 static ucl_object_t *
 rspamd_urls_tree_ucl (GHashTable *input, struct rspamd_task *task)
 {
@@ -1026,8 +1063,9 @@ rspamd_protocol_output_profiling (struct rspamd_task *task,
 	GHashTable *tbl;
 	GHashTableIter it;
 	gpointer k, v;
-	ucl_object_t *prof;
+	ucl_object_t *prof, *elt;
 	gdouble val;
+	guint i;
 
 	prof = ucl_object_typed_new (UCL_OBJECT);
 	tbl = rspamd_mempool_get_variable (task->task_pool, "profile");
@@ -1043,6 +1081,35 @@ rspamd_protocol_output_profiling (struct rspamd_task *task,
 	}
 
 	ucl_object_insert_key (top, prof, "profile", 0, false);
+
+	if (task->stage_timings) {
+		prof = ucl_object_typed_new (UCL_OBJECT);
+
+		for (i = 0; i < RSPAMD_TASK_STAGES_COUNT; i ++) {
+			if (task->stage_timings[i].start == 0 &&
+					task->stage_timings[i].time == 0) {
+				continue;
+			}
+
+			elt = ucl_object_typed_new (UCL_OBJECT);
+			ucl_object_insert_key (elt,
+					ucl_object_fromdouble (task->stage_timings[i].start),
+					"start", 0, false);
+			ucl_object_insert_key (elt,
+					ucl_object_fromdouble (task->stage_timings[i].time),
+					"time", 0, false);
+			ucl_object_insert_key (prof, elt,
+					rspamd_task_stage_name (1 << i), 0, false);
+		}
+
+		ucl_object_insert_key (top, prof, "profile_stages", 0, false);
+	}
+
+	prof = rspamd_symbols_cache_task_profile (task, task->cfg->cache);
+
+	if (prof) {
+		ucl_object_insert_key (top, prof, "profile_symbols", 0, false);
+	}
 }
 
 struct rspamd_saved_protocol_reply {
@@ -1064,7 +1131,7 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 {
 	struct rspamd_metric_result *metric_res;
 	ucl_object_t *top = NULL, *obj;
-	GHashTableIter hiter;
+	rspamd_mempool_hash_iter_t hiter;
 	GString *dkim_sig;
 	const ucl_object_t *rmilter_reply;
 	struct rspamd_saved_protocol_reply *cached;
@@ -1099,9 +1166,9 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 	}
 
 	if (flags & RSPAMD_PROTOCOL_METRICS) {
-		g_hash_table_iter_init (&hiter, task->results);
+		rspamd_mempool_hash_iter_init (&hiter, task->results);
 		/* Convert results to an ucl object */
-		while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		while (rspamd_mempool_hash_iter_next (&hiter, &h, &v)) {
 			metric_res = (struct rspamd_metric_result *)v;
 			obj = rspamd_metric_result_ucl (task, metric_res);
 			ucl_object_insert_key (top, obj, h, 0, false);
@@ -1187,17 +1254,965 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 	return top;
 }
 
+/*
+ * Streaming reply writer: serializes results directly from task structures
+ * without building an intermediate ucl tree. Output is either compact JSON
+ * or msgpack, in the latter case containers are written with 32 bit length
+ * prefixes that are patched when a container is closed.
+ */
+#define RSPAMD_PROTOCOL_WRITER_DEPTH 16
+
+struct rspamd_protocol_writer {
+	rspamd_fstring_t *out;
+	gboolean msgpack;
+	gboolean got_key;
+	guint level;
+	guint nelts[RSPAMD_PROTOCOL_WRITER_DEPTH];
+	gsize hdr_pos[RSPAMD_PROTOCOL_WRITER_DEPTH];
+};
+
+static void
+rspamd_protocol_writer_elt (struct rspamd_protocol_writer *w)
+{
+	if (w->got_key) {
+		/* Value of an object element */
+		w->got_key = FALSE;
+
+		return;
+	}
+
+	if (w->level > 0) {
+		if (!w->msgpack && w->nelts[w->level - 1] > 0) {
+			w->out = rspamd_fstring_append (w->out, ",", 1);
+		}
+
+		w->nelts[w->level - 1] ++;
+	}
+}
+
+static void
+rspamd_protocol_writer_raw_string (struct rspamd_protocol_writer *w,
+		const gchar *str, gsize len)
+{
+	const gchar *p = str, *c = str, *end = str + len;
+	guchar hdr[5];
+	guint32 blen;
+
+	if (w->msgpack) {
+		if (len < 32) {
+			hdr[0] = 0xa0 | len;
+			w->out = rspamd_fstring_append (w->out, (const gchar *)hdr, 1);
+		}
+		else if (len <= G_MAXUINT8) {
+			hdr[0] = 0xd9;
+			hdr[1] = len;
+			w->out = rspamd_fstring_append (w->out, (const gchar *)hdr, 2);
+		}
+		else if (len <= G_MAXUINT16) {
+			hdr[0] = 0xda;
+			hdr[1] = (len >> 8) & 0xff;
+			hdr[2] = len & 0xff;
+			w->out = rspamd_fstring_append (w->out, (const gchar *)hdr, 3);
+		}
+		else {
+			hdr[0] = 0xdb;
+			blen = GUINT32_TO_BE (len);
+			memcpy (&hdr[1], &blen, sizeof (blen));
+			w->out = rspamd_fstring_append (w->out, (const gchar *)hdr, 5);
+		}
+
+		w->out = rspamd_fstring_append (w->out, str, len);
+
+		return;
+	}
+
+	w->out = rspamd_fstring_append (w->out, "\"", 1);
+
+	while (p < end) {
+		if (*p == '"' || *p == '\\' || (guchar)*p < 0x20) {
+			if (p > c) {
+				w->out = rspamd_fstring_append (w->out, c, p - c);
+			}
+
+			switch (*p) {
+			case '\n':
+				w->out = rspamd_fstring_append (w->out, "\\n", 2);
+				break;
+			case '\r':
+				w->out = rspamd_fstring_append (w->out, "\\r", 2);
+				break;
+			case '\b':
+				w->out = rspamd_fstring_append (w->out, "\\b", 2);
+				break;
+			case '\t':
+				w->out = rspamd_fstring_append (w->out, "\\t", 2);
+				break;
+			case '\f':
+				w->out = rspamd_fstring_append (w->out, "\\f", 2);
+				break;
+			case '\\':
+				w->out = rspamd_fstring_append (w->out, "\\\\", 2);
+				break;
+			case '"':
+				w->out = rspamd_fstring_append (w->out, "\\\"", 2);
+				break;
+			default:
+				w->out = rspamd_fstring_append (w->out, "\\uFFFD", 6);
+				break;
+			}
+
+			c = ++p;
+		}
+		else {
+			p ++;
+		}
+	}
+
+	if (p > c) {
+		w->out = rspamd_fstring_append (w->out, c, p - c);
+	}
+
+	w->out = rspamd_fstring_append (w->out, "\"", 1);
+}
+
+static void
+rspamd_protocol_writer_string (struct rspamd_protocol_writer *w,
+		const gchar *str, gsize len)
+{
+	rspamd_protocol_writer_elt (w);
+	rspamd_protocol_writer_raw_string (w, str, len);
+}
+
+static void
+rspamd_protocol_writer_key (struct rspamd_protocol_writer *w,
+		const gchar *key)
+{
+	rspamd_protocol_writer_elt (w);
+	rspamd_protocol_writer_raw_string (w, key, strlen (key));
+
+	if (!w->msgpack) {
+		w->out = rspamd_fstring_append (w->out, ":", 1);
+	}
+
+	w->got_key = TRUE;
+}
+
+static void
+rspamd_protocol_writer_double (struct rspamd_protocol_writer *w, gdouble val)
+{
+	const gdouble delta = 0.0000001;
+	guchar hdr[9];
+	guint64 bits;
+
+	rspamd_protocol_writer_elt (w);
+
+	if (w->msgpack) {
+		hdr[0] = 0xcb;
+		memcpy (&bits, &val, sizeof (bits));
+		bits = GUINT64_TO_BE (bits);
+		memcpy (&hdr[1], &bits, sizeof (bits));
+		w->out = rspamd_fstring_append (w->out, (const gchar *)hdr, sizeof (hdr));
+	}
+	else if (val == (gdouble)((gint)val)) {
+		rspamd_printf_fstring (&w->out, "%.1f", val);
+	}
+	else if (fabs (val - (gdouble)(gint)val) < delta) {
+		rspamd_printf_fstring (&w->out, "%.*g", DBL_DIG, val);
+	}
+	else {
+		rspamd_printf_fstring (&w->out, "%f", val);
+	}
+}
+
+static void
+rspamd_protocol_writer_bool (struct rspamd_protocol_writer *w, gboolean val)
+{
+	guchar c;
+
+	rspamd_protocol_writer_elt (w);
+
+	if (w->msgpack) {
+		c = val ? 0xc3 : 0xc2;
+		w->out = rspamd_fstring_append (w->out, (const gchar *)&c, 1);
+	}
+	else if (val) {
+		w->out = rspamd_fstring_append (w->out, "true", 4);
+	}
+	else {
+		w->out = rspamd_fstring_append (w->out, "false", 5);
+	}
+}
+
+/* Emits an existing ucl object, e.g. task messages or milter reply */
+static void
+rspamd_protocol_writer_ucl (struct rspamd_protocol_writer *w,
+		const ucl_object_t *obj)
+{
+	rspamd_protocol_writer_elt (w);
+	rspamd_ucl_emit_fstring (obj,
+			w->msgpack ? UCL_EMIT_MSGPACK : UCL_EMIT_JSON_COMPACT, &w->out);
+}
+
+static void
+rspamd_protocol_writer_open (struct rspamd_protocol_writer *w, gboolean map)
+{
+	guchar hdr[5] = {0, 0, 0, 0, 0};
+
+	rspamd_protocol_writer_elt (w);
+	g_assert (w->level < RSPAMD_PROTOCOL_WRITER_DEPTH);
+
+	if (w->msgpack) {
+		hdr[0] = map ? 0xdf : 0xdd;
+		w->hdr_pos[w->level] = w->out->len;
+		w->out = rspamd_fstring_append (w->out, (const gchar *)hdr, sizeof (hdr));
+	}
+	else {
+		w->out = rspamd_fstring_append (w->out, map ? "{" : "[", 1);
+	}
+
+	w->nelts[w->level ++] = 0;
+}
+
+static void
+rspamd_protocol_writer_close (struct rspamd_protocol_writer *w, gboolean map)
+{
+	guint32 n;
+
+	g_assert (w->level > 0);
+	w->level --;
+
+	if (w->msgpack) {
+		n = GUINT32_TO_BE (w->nelts[w->level]);
+		memcpy (w->out->str + w->hdr_pos[w->level] + 1, &n, sizeof (n));
+	}
+	else {
+		w->out = rspamd_fstring_append (w->out, map ? "}" : "]", 1);
+	}
+}
+
+static void
+rspamd_protocol_stream_extended_url (struct rspamd_protocol_writer *w,
+		struct rspamd_task *task,
+		struct rspamd_url *url,
+		const gchar *encoded, gsize enclen)
+{
+	rspamd_protocol_writer_open (w, TRUE);
+	rspamd_protocol_writer_key (w, "url");
+	rspamd_protocol_writer_string (w, encoded, enclen);
+
+	if (url->surbllen > 0) {
+		rspamd_protocol_writer_key (w, "surbl");
+		rspamd_protocol_writer_string (w, url->surbl, url->surbllen);
+	}
+	if (url->hostlen > 0) {
+		rspamd_protocol_writer_key (w, "host");
+		rspamd_protocol_writer_string (w, url->host, url->hostlen);
+	}
+
+	rspamd_protocol_writer_key (w, "phished");
+	rspamd_protocol_writer_bool (w, url->flags & RSPAMD_URL_FLAG_PHISHED);
+	rspamd_protocol_writer_key (w, "redirected");
+	rspamd_protocol_writer_bool (w, url->flags & RSPAMD_URL_FLAG_REDIRECTED);
+
+	if (url->phished_url) {
+		encoded = rspamd_url_encode (url->phished_url, &enclen, task->task_pool);
+		rspamd_protocol_writer_key (w, "orig_url");
+		rspamd_protocol_stream_extended_url (w, task, url->phished_url,
+				encoded, enclen);
+	}
+
+	rspamd_protocol_writer_close (w, TRUE);
+}
+
+static void
+rspamd_protocol_stream_urls (struct rspamd_protocol_writer *w,
+		struct rspamd_task *task)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_url *url;
+	const gchar *encoded;
+	gsize enclen;
+
+	if (g_hash_table_size (task->urls) > 0) {
+		rspamd_protocol_writer_key (w, "urls");
+		rspamd_protocol_writer_open (w, FALSE);
+		g_hash_table_iter_init (&it, task->urls);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			url = v;
+			encoded = rspamd_url_encode (url, &enclen, task->task_pool);
+
+			if (!(task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
+				rspamd_protocol_writer_string (w, encoded, enclen);
+			}
+			else {
+				rspamd_protocol_stream_extended_url (w, task, url, encoded,
+						enclen);
+			}
+
+			rspamd_protocol_log_url (task, encoded, enclen);
+		}
+
+		rspamd_protocol_writer_close (w, FALSE);
+	}
+
+	if (g_hash_table_size (task->emails) > 0) {
+		rspamd_protocol_writer_key (w, "emails");
+		rspamd_protocol_writer_open (w, FALSE);
+		g_hash_table_iter_init (&it, task->emails);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			url = v;
+
+			if (url->userlen > 0 && url->hostlen > 0 &&
+					url->host == url->user + url->userlen + 1) {
+				rspamd_protocol_writer_string (w, url->user,
+						url->userlen + url->hostlen + 1);
+			}
+		}
+
+		rspamd_protocol_writer_close (w, FALSE);
+	}
+}
+
+static void
+rspamd_protocol_stream_metric (struct rspamd_protocol_writer *w,
+		struct rspamd_task *task,
+		struct rspamd_metric_result *mres)
+{
+	GHashTableIter hiter;
+	struct rspamd_symbol_result *sym;
+	struct rspamd_symbol_option *opt;
+	enum rspamd_metric_action action;
+	const gchar *subject, *act;
+	gpointer h, v;
+
+	if (mres->action == METRIC_ACTION_MAX) {
+		mres->action = rspamd_check_action_metric (task, mres);
+	}
+
+	action = mres->action;
+
+	rspamd_protocol_writer_open (w, TRUE);
+	rspamd_protocol_writer_key (w, "is_spam");
+	rspamd_protocol_writer_bool (w, action < METRIC_ACTION_GREYLIST);
+	rspamd_protocol_writer_key (w, "is_skipped");
+	rspamd_protocol_writer_bool (w, RSPAMD_TASK_IS_SKIPPED (task));
+	rspamd_protocol_writer_key (w, "score");
+	rspamd_protocol_writer_double (w, isnan (mres->score) ? 0.0 : mres->score);
+	rspamd_protocol_writer_key (w, "required_score");
+	rspamd_protocol_writer_double (w,
+			rspamd_task_get_required_score (task, mres));
+	rspamd_protocol_writer_key (w, "action");
+	act = rspamd_action_to_str (action);
+	rspamd_protocol_writer_string (w, act, strlen (act));
+
+	if (action == METRIC_ACTION_REWRITE_SUBJECT) {
+		subject = make_rewritten_subject (mres->metric, task);
+
+		if (subject) {
+			rspamd_protocol_writer_key (w, "subject");
+			rspamd_protocol_writer_string (w, subject, strlen (subject));
+		}
+	}
+
+	g_hash_table_iter_init (&hiter, mres->symbols);
+
+	while (g_hash_table_iter_next (&hiter, &h, &v)) {
+		sym = (struct rspamd_symbol_result *)v;
+
+		rspamd_protocol_writer_key (w, h);
+		rspamd_protocol_writer_open (w, TRUE);
+		rspamd_protocol_writer_key (w, "name");
+		rspamd_protocol_writer_string (w, sym->name, strlen (sym->name));
+		rspamd_protocol_writer_key (w, "score");
+		rspamd_protocol_writer_double (w, sym->score);
+
+		if (sym->sym != NULL && sym->sym->description) {
+			rspamd_protocol_writer_key (w, "description");
+			rspamd_protocol_writer_string (w, sym->sym->description,
+					strlen (sym->sym->description));
+		}
+
+		if (sym->options != NULL) {
+			rspamd_protocol_writer_key (w, "options");
+			rspamd_protocol_writer_open (w, FALSE);
+
+			DL_FOREACH (sym->opts_head, opt) {
+				rspamd_protocol_writer_string (w, opt->option,
+						strlen (opt->option));
+			}
+
+			rspamd_protocol_writer_close (w, FALSE);
+		}
+
+		rspamd_protocol_writer_close (w, TRUE);
+	}
+
+	rspamd_protocol_writer_close (w, TRUE);
+}
+
+/*
+ * Writes the same reply as rspamd_protocol_write_ucl would emit but appends it
+ * to `out` directly
+ */
+static void
+rspamd_protocol_stream_reply (struct rspamd_task *task,
+		enum rspamd_protocol_flags flags,
+		gboolean msgpack,
+		rspamd_fstring_t **out)
+{
+	struct rspamd_protocol_writer w;
+	struct rspamd_metric_result *metric_res;
+	rspamd_mempool_hash_iter_t hiter;
+	const ucl_object_t *rmilter_reply, *cur;
+	ucl_object_iter_t it;
+	GString *dkim_sig, *folded_header;
+	gpointer h, v;
+
+	memset (&w, 0, sizeof (w));
+	w.out = *out;
+	w.msgpack = msgpack;
+
+	rspamd_protocol_writer_open (&w, TRUE);
+
+	if (flags & RSPAMD_PROTOCOL_METRICS) {
+		rspamd_mempool_hash_iter_init (&hiter, task->results);
+
+		while (rspamd_mempool_hash_iter_next (&hiter, &h, &v)) {
+			metric_res = (struct rspamd_metric_result *)v;
+			rspamd_protocol_writer_key (&w, h);
+			rspamd_protocol_stream_metric (&w, task, metric_res);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_MESSAGES) {
+		rspamd_protocol_writer_key (&w, "messages");
+
+		if (G_UNLIKELY (task->cfg->compat_messages)) {
+			it = NULL;
+			rspamd_protocol_writer_open (&w, FALSE);
+
+			while ((cur = ucl_object_iterate (task->messages, &it, true)) != NULL) {
+				if (cur->type == UCL_STRING) {
+					rspamd_protocol_writer_ucl (&w, cur);
+				}
+			}
+
+			rspamd_protocol_writer_close (&w, FALSE);
+		}
+		else {
+			rspamd_protocol_writer_ucl (&w, task->messages);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_URLS) {
+		if (task->cfg->log_urls || (task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
+			rspamd_protocol_stream_urls (&w, task);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_EXTRA) {
+		if (G_UNLIKELY (RSPAMD_TASK_IS_PROFILING (task))) {
+			/* Profiling is rare, so reuse the tree builder here */
+			ucl_object_t *prof = ucl_object_typed_new (UCL_OBJECT);
+
+			rspamd_protocol_output_profiling (task, prof);
+			it = NULL;
+
+			while ((cur = ucl_object_iterate (prof, &it, true)) != NULL) {
+				rspamd_protocol_writer_key (&w, ucl_object_key (cur));
+				rspamd_protocol_writer_ucl (&w, cur);
+			}
+
+			ucl_object_unref (prof);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_BASIC) {
+		rspamd_protocol_writer_key (&w, "message-id");
+		rspamd_protocol_writer_string (&w, task->message_id,
+				strlen (task->message_id));
+		rspamd_protocol_writer_key (&w, "time_real");
+		rspamd_protocol_writer_double (&w,
+				task->time_real_finish - task->time_real);
+		rspamd_protocol_writer_key (&w, "time_virtual");
+		rspamd_protocol_writer_double (&w,
+				task->time_virtual_finish - task->time_virtual);
+	}
+
+	if (flags & RSPAMD_PROTOCOL_DKIM) {
+		dkim_sig = rspamd_mempool_get_variable (task->task_pool, "dkim-signature");
+
+		if (dkim_sig) {
+			folded_header = rspamd_header_value_fold ("DKIM-Signature",
+					dkim_sig->str, 80, task->nlines_type);
+			rspamd_protocol_writer_key (&w, "dkim-signature");
+			rspamd_protocol_writer_string (&w, folded_header->str,
+					folded_header->len);
+			g_string_free (folded_header, TRUE);
+		}
+	}
+
+	if (flags & RSPAMD_PROTOCOL_RMILTER) {
+		rmilter_reply = rspamd_mempool_get_variable (task->task_pool,
+				"rmilter-reply");
+
+		if (rmilter_reply) {
+			rspamd_protocol_writer_key (&w, "rmilter");
+			rspamd_protocol_writer_ucl (&w, rmilter_reply);
+		}
+	}
+
+	rspamd_protocol_writer_close (&w, TRUE);
+	*out = w.out;
+}
+
+void
+rspamd_protocol_tlv_append (rspamd_fstring_t **out, guint type,
+		const void *value, gsize len)
+{
+	guchar hdr[5];
+	guint32 nlen;
+
+	hdr[0] = type;
+	nlen = GUINT32_TO_BE (len);
+	memcpy (&hdr[1], &nlen, sizeof (nlen));
+	*out = rspamd_fstring_append (*out, (const gchar *)hdr, sizeof (hdr));
+
+	if (len > 0) {
+		*out = rspamd_fstring_append (*out, value, len);
+	}
+}
+
+gboolean
+rspamd_protocol_tlv_next (const guchar **pos, const guchar *end,
+		guint *type, const guchar **value, gsize *len)
+{
+	const guchar *p = *pos;
+	guint32 nlen;
+
+	if (end - p < 5) {
+		return FALSE;
+	}
+
+	*type = *p;
+	memcpy (&nlen, p + 1, sizeof (nlen));
+	*len = GUINT32_FROM_BE (nlen);
+	p += 5;
+
+	if ((gsize)(end - p) < *len) {
+		return FALSE;
+	}
+
+	*value = p;
+	*pos = p + *len;
+
+	return TRUE;
+}
+
+static void
+rspamd_protocol_tlv_append_double (rspamd_fstring_t **out, guint type,
+		gdouble val, const gchar *str, gsize len)
+{
+	guint64 bits;
+	guchar hdr[5];
+	guint32 nlen;
+
+	hdr[0] = type;
+	nlen = GUINT32_TO_BE (sizeof (bits) + len);
+	memcpy (&hdr[1], &nlen, sizeof (nlen));
+	*out = rspamd_fstring_append (*out, (const gchar *)hdr, sizeof (hdr));
+	memcpy (&bits, &val, sizeof (bits));
+	bits = GUINT64_TO_BE (bits);
+	*out = rspamd_fstring_append (*out, (const gchar *)&bits, sizeof (bits));
+
+	if (len > 0) {
+		*out = rspamd_fstring_append (*out, str, len);
+	}
+}
+
+static gdouble
+rspamd_protocol_tlv_read_double (const guchar *value)
+{
+	guint64 bits;
+	gdouble val;
+
+	memcpy (&bits, value, sizeof (bits));
+	bits = GUINT64_FROM_BE (bits);
+	memcpy (&val, &bits, sizeof (val));
+
+	return val;
+}
+
+gboolean
+rspamd_protocol_handle_tlv (struct rspamd_task *task,
+		const gchar **start, gsize *len)
+{
+	const guchar *p = (const guchar *)*start, *end = p + *len, *value, *sep;
+	struct rspamd_email_address *addr;
+	rspamd_fstring_t *hn, *hv;
+	rspamd_ftok_t tok;
+	guint type;
+	gsize vlen;
+	guint32 flags;
+
+	while (rspamd_protocol_tlv_next (&p, end, &type, &value, &vlen)) {
+		tok.begin = (const gchar *)value;
+		tok.len = vlen;
+
+		switch (type) {
+		case RSPAMD_PROTOCOL_TLV_END:
+			*start = (const gchar *)p;
+			*len = end - p;
+
+			return TRUE;
+		case RSPAMD_PROTOCOL_TLV_IP:
+			if (!rspamd_parse_inet_address (&task->from_addr, tok.begin,
+					tok.len)) {
+				g_set_error (&task->err, rspamd_protocol_quark (), 400,
+						"bad ip field: '%T'", &tok);
+
+				return FALSE;
+			}
+
+			task->flags &= ~RSPAMD_TASK_FLAG_NO_IP;
+			break;
+		case RSPAMD_PROTOCOL_TLV_HELO:
+			task->helo = rspamd_mempool_ftokdup (task->task_pool, &tok);
+			break;
+		case RSPAMD_PROTOCOL_TLV_FROM:
+			task->from_envelope = rspamd_email_address_from_smtp (tok.begin,
+					tok.len);
+
+			if (!task->from_envelope) {
+				msg_err_task ("bad from field: '%T'", &tok);
+				task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
+			}
+			break;
+		case RSPAMD_PROTOCOL_TLV_RCPT:
+			addr = rspamd_email_address_from_smtp (tok.begin, tok.len);
+
+			if (addr) {
+				if (task->rcpt_envelope == NULL) {
+					task->rcpt_envelope = g_ptr_array_sized_new (2);
+				}
+
+				g_ptr_array_add (task->rcpt_envelope, addr);
+			}
+			else {
+				msg_err_task ("bad rcpt field: '%T'", &tok);
+				task->flags |= RSPAMD_TASK_FLAG_BROKEN_HEADERS;
+			}
+			break;
+		case RSPAMD_PROTOCOL_TLV_USER:
+			task->user = rspamd_mempool_ftokdup (task->task_pool, &tok);
+			break;
+		case RSPAMD_PROTOCOL_TLV_QUEUE_ID:
+			task->queue_id = rspamd_mempool_ftokdup (task->task_pool, &tok);
+			break;
+		case RSPAMD_PROTOCOL_TLV_HOSTNAME:
+			task->hostname = rspamd_mempool_ftokdup (task->task_pool, &tok);
+			break;
+		case RSPAMD_PROTOCOL_TLV_DELIVER_TO:
+			if (vlen > 0) {
+				hv = rspamd_fstring_new_init (tok.begin, tok.len);
+				task->deliver_to = rspamd_protocol_escape_braces (task, hv);
+				rspamd_fstring_free (hv);
+			}
+			break;
+		case RSPAMD_PROTOCOL_TLV_SUBJECT:
+			task->subject = rspamd_mempool_ftokdup (task->task_pool, &tok);
+			break;
+		case RSPAMD_PROTOCOL_TLV_SETTINGS_ID:
+			rspamd_protocol_set_settings_id (task, &tok);
+			break;
+		case RSPAMD_PROTOCOL_TLV_MTA_TAG:
+			rspamd_mempool_set_variable (task->task_pool, "MTA-Tag",
+					rspamd_mempool_ftokdup (task->task_pool, &tok), NULL);
+			break;
+		case RSPAMD_PROTOCOL_TLV_FLAGS:
+			if (vlen != sizeof (flags)) {
+				g_set_error (&task->err, rspamd_protocol_quark (), 400,
+						"bad flags field length: %z", vlen);
+
+				return FALSE;
+			}
+
+			memcpy (&flags, value, sizeof (flags));
+			flags = GUINT32_FROM_BE (flags);
+
+			if (flags & RSPAMD_PROTOCOL_TLV_FLAG_PASS_ALL) {
+				task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
+			}
+			if (flags & RSPAMD_PROTOCOL_TLV_FLAG_NO_LOG) {
+				task->flags |= RSPAMD_TASK_FLAG_NO_LOG;
+			}
+			if (flags & RSPAMD_PROTOCOL_TLV_FLAG_EXT_URLS) {
+				task->flags |= RSPAMD_TASK_FLAG_EXT_URLS;
+			}
+			if (flags & RSPAMD_PROTOCOL_TLV_FLAG_PROFILE) {
+				task->flags |= RSPAMD_TASK_FLAG_PROFILE;
+			}
+			break;
+		case RSPAMD_PROTOCOL_TLV_HEADER:
+			sep = memchr (value, '\0', vlen);
+
+			if (sep == NULL || sep == value) {
+				g_set_error (&task->err, rspamd_protocol_quark (), 400,
+						"bad header field");
+
+				return FALSE;
+			}
+
+			/* Headers table owns both strings */
+			hn = rspamd_fstring_new_init (tok.begin, sep - value);
+			hv = rspamd_fstring_new_init ((const gchar *)sep + 1,
+					vlen - (sep - value) - 1);
+			rspamd_task_add_request_header (task, rspamd_ftok_map (hn),
+					rspamd_ftok_map (hv));
+			break;
+		default:
+			debug_task ("unknown binary field %ud", type);
+			break;
+		}
+	}
+
+	g_set_error (&task->err, rspamd_protocol_quark (), 400,
+			"truncated binary envelope");
+
+	return FALSE;
+}
+
+void
+rspamd_protocol_tlv_reply (struct rspamd_task *task, rspamd_fstring_t **out)
+{
+	struct rspamd_metric_result *mres;
+	struct rspamd_symbol_result *sym;
+	struct rspamd_symbol_option *opt;
+	const ucl_object_t *rmilter_reply;
+	GHashTableIter it;
+	GString *dkim_sig, *folded_header;
+	rspamd_fstring_t *json;
+	const gchar *str;
+	gpointer k, v;
+
+	mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
+
+	if (RSPAMD_TASK_IS_SKIPPED (task)) {
+		rspamd_protocol_tlv_append (out, RSPAMD_PROTOCOL_TLV_REPLY_SKIPPED,
+				NULL, 0);
+	}
+
+	if (mres) {
+		str = rspamd_action_to_str (mres->action);
+		rspamd_protocol_tlv_append (out, RSPAMD_PROTOCOL_TLV_REPLY_ACTION,
+				str, strlen (str));
+		rspamd_protocol_tlv_append_double (out,
+				RSPAMD_PROTOCOL_TLV_REPLY_SCORE,
+				isnan (mres->score) ? 0.0 : mres->score, NULL, 0);
+		rspamd_protocol_tlv_append_double (out,
+				RSPAMD_PROTOCOL_TLV_REPLY_REQUIRED_SCORE,
+				rspamd_task_get_required_score (task, mres), NULL, 0);
+
+		if (mres->action == METRIC_ACTION_REWRITE_SUBJECT) {
+			str = make_rewritten_subject (mres->metric, task);
+
+			if (str) {
+				rspamd_protocol_tlv_append (out,
+						RSPAMD_PROTOCOL_TLV_REPLY_SUBJECT, str, strlen (str));
+			}
+		}
+
+		g_hash_table_iter_init (&it, mres->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			sym = v;
+			rspamd_protocol_tlv_append_double (out,
+					RSPAMD_PROTOCOL_TLV_REPLY_SYMBOL, sym->score,
+					k, strlen (k));
+
+			if (sym->options) {
+				DL_FOREACH (sym->opts_head, opt) {
+					rspamd_protocol_tlv_append (out,
+							RSPAMD_PROTOCOL_TLV_REPLY_OPTION,
+							opt->option, strlen (opt->option));
+				}
+			}
+		}
+	}
+
+	rspamd_protocol_tlv_append (out, RSPAMD_PROTOCOL_TLV_REPLY_MESSAGE_ID,
+			task->message_id, strlen (task->message_id));
+
+	dkim_sig = rspamd_mempool_get_variable (task->task_pool, "dkim-signature");
+
+	if (dkim_sig) {
+		folded_header = rspamd_header_value_fold ("DKIM-Signature",
+				dkim_sig->str, 80, task->nlines_type);
+		rspamd_protocol_tlv_append (out,
+				RSPAMD_PROTOCOL_TLV_REPLY_DKIM_SIGNATURE,
+				folded_header->str, folded_header->len);
+		g_string_free (folded_header, TRUE);
+	}
+
+	rmilter_reply = rspamd_mempool_get_variable (task->task_pool,
+			"rmilter-reply");
+
+	if (rmilter_reply) {
+		json = rspamd_fstring_sized_new (256);
+		rspamd_ucl_emit_fstring (rmilter_reply, UCL_EMIT_JSON_COMPACT, &json);
+		rspamd_protocol_tlv_append (out, RSPAMD_PROTOCOL_TLV_REPLY_MILTER,
+				json->str, json->len);
+		rspamd_fstring_free (json);
+	}
+
+	if (task->messages && task->messages->len > 0) {
+		json = rspamd_fstring_sized_new (256);
+		rspamd_ucl_emit_fstring (task->messages, UCL_EMIT_JSON_COMPACT, &json);
+		rspamd_protocol_tlv_append (out, RSPAMD_PROTOCOL_TLV_REPLY_MESSAGES,
+				json->str, json->len);
+		rspamd_fstring_free (json);
+	}
+}
+
+static ucl_object_t *
+rspamd_protocol_tlv_parse_json (const guchar *value, gsize len)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *obj = NULL;
+
+	parser = ucl_parser_new (0);
+
+	if (ucl_parser_add_chunk (parser, value, len)) {
+		obj = ucl_parser_get_object (parser);
+	}
+
+	ucl_parser_free (parser);
+
+	return obj;
+}
+
+ucl_object_t *
+rspamd_protocol_tlv_reply_to_ucl (const guchar *in, gsize len, GError **err)
+{
+	const guchar *p = in, *end = in + len, *value;
+	ucl_object_t *top, *metric, *sym = NULL, *opts, *obj;
+	gint action = METRIC_ACTION_NOACTION;
+	gboolean skipped = FALSE;
+	guint type;
+	gsize vlen;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	metric = ucl_object_typed_new (UCL_OBJECT);
+
+	while (p < end) {
+		if (!rspamd_protocol_tlv_next (&p, end, &type, &value, &vlen)) {
+			g_set_error (err, rspamd_protocol_quark (), 500,
+					"truncated binary reply");
+			ucl_object_unref (metric);
+			ucl_object_unref (top);
+
+			return NULL;
+		}
+
+		switch (type) {
+		case RSPAMD_PROTOCOL_TLV_REPLY_ACTION:
+			obj = ucl_object_fromlstring ((const gchar *)value, vlen);
+			rspamd_action_from_str (ucl_object_tostring (obj), &action);
+			ucl_object_insert_key (metric, obj, "action", 0, false);
+			break;
+		case RSPAMD_PROTOCOL_TLV_REPLY_SCORE:
+		case RSPAMD_PROTOCOL_TLV_REPLY_REQUIRED_SCORE:
+			if (vlen == sizeof (gdouble)) {
+				ucl_object_insert_key (metric,
+						ucl_object_fromdouble (
+								rspamd_protocol_tlv_read_double (value)),
+						type == RSPAMD_PROTOCOL_TLV_REPLY_SCORE ?
+								"score" : "required_score", 0, false);
+			}
+			break;
+		case RSPAMD_PROTOCOL_TLV_REPLY_SYMBOL:
+			if (vlen > sizeof (gdouble)) {
+				sym = ucl_object_typed_new (UCL_OBJECT);
+				ucl_object_insert_key (sym,
+						ucl_object_fromlstring ((const gchar *)value + sizeof (gdouble),
+								vlen - sizeof (gdouble)),
+						"name", 0, false);
+				ucl_object_insert_key (sym,
+						ucl_object_fromdouble (
+								rspamd_protocol_tlv_read_double (value)),
+						"score", 0, false);
+				ucl_object_insert_key (metric, sym,
+						(const gchar *)value + sizeof (gdouble),
+						vlen - sizeof (gdouble), true);
+			}
+			break;
+		case RSPAMD_PROTOCOL_TLV_REPLY_OPTION:
+			if (sym) {
+				opts = (ucl_object_t *)ucl_object_lookup (sym, "options");
+
+				if (opts == NULL) {
+					opts = ucl_object_typed_new (UCL_ARRAY);
+					ucl_object_insert_key (sym, opts, "options", 0, false);
+				}
+
+				ucl_array_append (opts, ucl_object_fromlstring ((const gchar *)value, vlen));
+			}
+			break;
+		case RSPAMD_PROTOCOL_TLV_REPLY_SUBJECT:
+			ucl_object_insert_key (metric, ucl_object_fromlstring ((const gchar *)value, vlen),
+					"subject", 0, false);
+			break;
+		case RSPAMD_PROTOCOL_TLV_REPLY_MESSAGE_ID:
+			ucl_object_insert_key (top, ucl_object_fromlstring ((const gchar *)value, vlen),
+					"message-id", 0, false);
+			break;
+		case RSPAMD_PROTOCOL_TLV_REPLY_DKIM_SIGNATURE:
+			ucl_object_insert_key (top, ucl_object_fromlstring ((const gchar *)value, vlen),
+					"dkim-signature", 0, false);
+			break;
+		case RSPAMD_PROTOCOL_TLV_REPLY_MILTER:
+		case RSPAMD_PROTOCOL_TLV_REPLY_MESSAGES:
+			obj = rspamd_protocol_tlv_parse_json (value, vlen);
+
+			if (obj) {
+				ucl_object_insert_key (top, obj,
+						type == RSPAMD_PROTOCOL_TLV_REPLY_MILTER ?
+								"rmilter" : "messages", 0, false);
+			}
+			break;
+		case RSPAMD_PROTOCOL_TLV_REPLY_SKIPPED:
+			skipped = TRUE;
+			break;
+		default:
+			break;
+		}
+	}
+
+	ucl_object_insert_key (metric, ucl_object_frombool (
+			action < METRIC_ACTION_GREYLIST), "is_spam", 0, false);
+	ucl_object_insert_key (metric, ucl_object_frombool (skipped),
+			"is_skipped", 0, false);
+	ucl_object_insert_key (top, metric, DEFAULT_METRIC, 0, false);
+
+	return top;
+}
+
 void
 rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	struct rspamd_task *task)
 {
 	struct rspamd_metric_result *metric_res;
 	GHashTableIter hiter;
+	rspamd_mempool_hash_iter_t miter;
 	const struct rspamd_re_cache_stat *restat;
 	gpointer h, v;
 	ucl_object_t *top = NULL;
 	rspamd_fstring_t *reply;
 	gint action, flags = RSPAMD_PROTOCOL_DEFAULT;
+	gboolean stream = FALSE, msgpack = FALSE, tlv = FALSE;
 
 	/* Write custom headers */
 	g_hash_table_iter_init (&hiter, task->reply_headers);
@@ -1211,7 +2226,31 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		flags |= RSPAMD_PROTOCOL_URLS;
 	}
 
-	top = rspamd_protocol_write_ucl (task, flags);
+	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
+		msgpack = !!(task->flags & RSPAMD_TASK_FLAG_MSGPACK);
+		tlv = !!(task->flags & RSPAMD_TASK_FLAG_TLV);
+		/* Serialize directly unless a reply tree has been already built */
+		stream = rspamd_mempool_get_variable (task->task_pool,
+				"cached_reply") == NULL;
+	}
+
+	if (stream) {
+		task->time_real_finish = rspamd_get_ticks ();
+		task->time_virtual_finish = rspamd_get_virtual_ticks ();
+		rspamd_mempool_hash_iter_init (&miter, task->results);
+
+		while (rspamd_mempool_hash_iter_next (&miter, &h, &v)) {
+			metric_res = (struct rspamd_metric_result *)v;
+
+			if (metric_res->action == METRIC_ACTION_MAX) {
+				metric_res->action = rspamd_check_action_metric (task,
+						metric_res);
+			}
+		}
+	}
+	else {
+		top = rspamd_protocol_write_ucl (task, flags);
+	}
 
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_LOG)) {
 		rspamd_roll_history_update (task->worker->srv->history, task);
@@ -1225,19 +2264,28 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 		msg_info_task (
 				"regexp statistics: %ud pcre regexps scanned, %ud regexps matched,"
 				" %ud regexps total, %ud regexps cached,"
+				" %ud regexps skipped by literals,"
 				" %HL bytes scanned using pcre, %HL bytes scanned total",
 				restat->regexp_checked,
 				restat->regexp_matched,
 				restat->regexp_total,
 				restat->regexp_fast_cached,
+				restat->regexp_prefiltered,
 				restat->bytes_scanned_pcre,
 				restat->bytes_scanned);
 	}
 
 	reply = rspamd_fstring_sized_new (1000);
 
-	if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
-		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &reply);
+	if (tlv) {
+		rspamd_protocol_tlv_reply (task, &reply);
+	}
+	else if (stream) {
+		rspamd_protocol_stream_reply (task, flags, msgpack, &reply);
+	}
+	else if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
+		rspamd_ucl_emit_fstring (top,
+				msgpack ? UCL_EMIT_MSGPACK : UCL_EMIT_JSON_COMPACT, &reply);
 	}
 	else {
 		if (RSPAMD_TASK_IS_SPAMC (task)) {
@@ -1311,7 +2359,7 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 end:
 	if (!(task->flags & RSPAMD_TASK_FLAG_NO_STAT)) {
 		/* Update stat for default metric */
-		metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+		metric_res = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 		if (metric_res != NULL) {
 
 			if (metric_res->action != METRIC_ACTION_MAX) {
@@ -1328,22 +2376,13 @@ end:
 			}
 
 			if (action < METRIC_ACTION_MAX) {
-#ifndef HAVE_ATOMIC_BUILTINS
-				task->worker->srv->stat->actions_stat[action]++;
-#else
-				__atomic_add_fetch (&task->worker->srv->stat->actions_stat[action],
-						1, __ATOMIC_RELEASE);
-#endif
+				rspamd_main_counter_add (task->worker->srv,
+						RSPAMD_COUNTER_ACTIONS + action, 1);
 			}
 		}
 
 		/* Increase counters */
-#ifndef HAVE_ATOMIC_BUILTINS
-		task->worker->srv->stat->messages_scanned++;
-#else
-		__atomic_add_fetch (&task->worker->srv->stat->messages_scanned,
-				1, __ATOMIC_RELEASE);
-#endif
+		rspamd_main_counter_add (task->worker->srv, RSPAMD_COUNTER_SCANNED, 1);
 	}
 }
 
@@ -1498,7 +2537,7 @@ rspamd_protocol_write_log_pipe (struct rspamd_worker_ctx *ctx,
 		if (lp->fd != -1) {
 			switch (lp->type) {
 			case RSPAMD_LOG_PIPE_SYMBOLS:
-				mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+				mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 
 				if (mres) {
 					n = g_hash_table_size (mres->symbols);
@@ -1588,6 +2627,10 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 		/* Turn compatibility on */
 		msg->method = HTTP_SYMBOLS;
 	}
+	if (task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) {
+		msg->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+	}
+
 	if (RSPAMD_TASK_IS_SPAMC (task)) {
 		msg->flags |= RSPAMD_HTTP_FLAG_SPAMC;
 	}
@@ -1625,11 +2668,22 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 		case CMD_SKIP:
 			rspamd_protocol_http_reply (msg, task);
 
+			if (msg->method < HTTP_SYMBOLS && !RSPAMD_TASK_IS_SPAMC (task)) {
+				if (task->flags & RSPAMD_TASK_FLAG_TLV) {
+					ctype = RSPAMD_PROTOCOL_TLV_CTYPE;
+				}
+				else if (task->flags & RSPAMD_TASK_FLAG_MSGPACK) {
+					ctype = "application/msgpack";
+				}
+			}
+
 			if (task->worker && task->worker->ctx) {
 				actx = task->worker->ctx;
 
 				if (actx->magic == rspamd_worker_magic) {
 					rspamd_protocol_write_log_pipe (task->worker->ctx, task);
+					rspamd_task_exporter_add (
+							((struct rspamd_worker_ctx *)actx)->exporter, task);
 				}
 			}
 			break;
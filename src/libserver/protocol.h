@@ -68,6 +68,84 @@ gboolean rspamd_protocol_handle_request (struct rspamd_task *task,
 void rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	struct rspamd_task *task);
 
+/*
+ * Binary envelope used instead of HTTP headers when a request has
+ * `Content-Type: application/x-rspamd-tlv`. The body starts with fields
+ * encoded as one byte of type, four bytes of length in network order and
+ * the value. The envelope is terminated by a field of type
+ * RSPAMD_PROTOCOL_TLV_END followed by the message itself. The reply to such
+ * a request is a sequence of fields as well.
+ */
+#define RSPAMD_PROTOCOL_TLV_CTYPE "application/x-rspamd-tlv"
+
+enum rspamd_protocol_tlv_type {
+	RSPAMD_PROTOCOL_TLV_END = 0,
+	RSPAMD_PROTOCOL_TLV_IP,
+	RSPAMD_PROTOCOL_TLV_HELO,
+	RSPAMD_PROTOCOL_TLV_FROM,
+	RSPAMD_PROTOCOL_TLV_RCPT,
+	RSPAMD_PROTOCOL_TLV_USER,
+	RSPAMD_PROTOCOL_TLV_QUEUE_ID,
+	RSPAMD_PROTOCOL_TLV_HOSTNAME,
+	RSPAMD_PROTOCOL_TLV_DELIVER_TO,
+	RSPAMD_PROTOCOL_TLV_SUBJECT,
+	RSPAMD_PROTOCOL_TLV_SETTINGS_ID,
+	RSPAMD_PROTOCOL_TLV_MTA_TAG,
+	RSPAMD_PROTOCOL_TLV_FLAGS, /* 32 bits of RSPAMD_PROTOCOL_TLV_FLAG_* */
+	RSPAMD_PROTOCOL_TLV_HEADER, /* any other header: name, '\0', value */
+};
+
+#define RSPAMD_PROTOCOL_TLV_FLAG_PASS_ALL (1u << 0)
+#define RSPAMD_PROTOCOL_TLV_FLAG_NO_LOG (1u << 1)
+#define RSPAMD_PROTOCOL_TLV_FLAG_EXT_URLS (1u << 2)
+#define RSPAMD_PROTOCOL_TLV_FLAG_PROFILE (1u << 3)
+
+enum rspamd_protocol_tlv_reply_type {
+	RSPAMD_PROTOCOL_TLV_REPLY_ACTION = 1,
+	RSPAMD_PROTOCOL_TLV_REPLY_SCORE, /* double in network order */
+	RSPAMD_PROTOCOL_TLV_REPLY_REQUIRED_SCORE,
+	RSPAMD_PROTOCOL_TLV_REPLY_SYMBOL, /* score followed by name */
+	RSPAMD_PROTOCOL_TLV_REPLY_OPTION, /* option of the previous symbol */
+	RSPAMD_PROTOCOL_TLV_REPLY_SUBJECT,
+	RSPAMD_PROTOCOL_TLV_REPLY_MESSAGE_ID,
+	RSPAMD_PROTOCOL_TLV_REPLY_DKIM_SIGNATURE,
+	RSPAMD_PROTOCOL_TLV_REPLY_MILTER, /* JSON */
+	RSPAMD_PROTOCOL_TLV_REPLY_MESSAGES, /* JSON */
+	RSPAMD_PROTOCOL_TLV_REPLY_SKIPPED, /* empty */
+};
+
+/**
+ * Append a field to the binary envelope or reply
+ */
+void rspamd_protocol_tlv_append (rspamd_fstring_t **out, guint type,
+		const void *value, gsize len);
+
+/**
+ * Reads the next field from `*pos`, returns FALSE if no more fields are
+ * available or if the field is truncated
+ */
+gboolean rspamd_protocol_tlv_next (const guchar **pos, const guchar *end,
+		guint *type, const guchar **value, gsize *len);
+
+/**
+ * Apply binary envelope from the beginning of the message, `start` and `len`
+ * are adjusted to the message itself
+ */
+gboolean rspamd_protocol_handle_tlv (struct rspamd_task *task,
+		const gchar **start, gsize *len);
+
+/**
+ * Append binary reply for a task to `out`
+ */
+void rspamd_protocol_tlv_reply (struct rspamd_task *task,
+		rspamd_fstring_t **out);
+
+/**
+ * Convert binary reply to an object in the same format as the JSON reply
+ */
+ucl_object_t * rspamd_protocol_tlv_reply_to_ucl (const guchar *in, gsize len,
+		GError **err);
+
 enum rspamd_protocol_flags {
 	RSPAMD_PROTOCOL_BASIC = 1 << 0,
 	RSPAMD_PROTOCOL_METRICS = 1 << 1,
@@ -22,11 +22,8 @@
 #include "libserver/cfg_file.h"
 #include "libutil/util.h"
 #include "libutil/regexp.h"
+#include "libutil/multipattern.h"
 #include "lua/lua_common.h"
-#ifdef WITH_HYPERSCAN
-#include "hs.h"
-#include "unix-std.h"
-#include <signal.h>
 
 #ifndef WITH_PCRE2
 #include <pcre.h>
@@ -34,6 +31,11 @@
 #include <pcre2.h>
 #endif
 
+#ifdef WITH_HYPERSCAN
+#include "hs.h"
+#include "unix-std.h"
+#include <signal.h>
+
 #ifdef HAVE_SYS_WAIT_H
 #include <sys/wait.h>
 #endif
@@ -63,8 +65,15 @@
 
 #ifdef WITH_HYPERSCAN
 #define RSPAMD_HS_MAGIC_LEN (sizeof (rspamd_hs_magic))
-static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '1'},
-		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '1'};
+static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '2'},
+		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '2'},
+		rspamd_hs_magic_mapped[] = {'r', 's', 'h', 's', 'm', 'p', '1', '1'};
+/*
+ * Mapped databases are stored as deserialized hyperscan blobs that are
+ * aligned to this boundary at the beginning of file
+ */
+#define RSPAMD_HS_MAPPED_ALIGN 64
+#define RSPAMD_HS_MAPPED_HDR_LEN RSPAMD_HS_MAPPED_ALIGN
 #endif
 
 struct rspamd_re_class {
@@ -75,11 +84,28 @@ struct rspamd_re_class {
 	GHashTable *re;
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 	rspamd_cryptobox_hash_state_t *st;
+	/*
+	 * Literals required by class regexps: case sensitive and caseless ones
+	 * with global cache ids of their regexps
+	 */
+	struct rspamd_multipattern *lit_mp[2];
+	GArray *lit_ids[2];
 #ifdef WITH_HYPERSCAN
 	hs_database_t *hs_db;
 	hs_scratch_t *hs_scratch;
 	gint *hs_ids;
 	guint nhs;
+	/* Checksum of the loaded database */
+	guint64 hs_crc;
+	/*
+	 * Global cache ids of class regexps ordered by position in class:
+	 * hyperscan databases use these positions as ids, so they do not
+	 * depend on regexps from other classes
+	 */
+	GArray *cache_ids;
+	/* If not NULL, then hs_db points to this shared mapping */
+	gpointer hs_map;
+	gsize hs_map_len;
 #endif
 };
 
@@ -92,6 +118,7 @@ enum rspamd_re_cache_elt_match_type {
 struct rspamd_re_cache_elt {
 	rspamd_regexp_t *re;
 	enum rspamd_re_cache_elt_match_type match_type;
+	gboolean has_literal;
 };
 
 struct rspamd_re_cache {
@@ -100,11 +127,17 @@ struct rspamd_re_cache {
 	ref_entry_t ref;
 	guint nre;
 	guint max_re_data;
+	gboolean sample_re_data;
+	gboolean has_literals;
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 #ifdef WITH_HYPERSCAN
 	gboolean hyperscan_loaded;
 	gboolean disable_hyperscan;
 	gboolean vectorized_hyperscan;
+	gboolean vectorized_hyperscan_body;
+	gboolean mmap_hyperscan;
+	/* Some classes might have their databases loaded */
+	gboolean has_partial_hs;
 	hs_platform_info_t plt;
 #endif
 };
@@ -112,8 +145,15 @@ struct rspamd_re_cache {
 struct rspamd_re_runtime {
 	guchar *checked;
 	guchar *results;
+	guchar *lit_checked;
+	guchar *lit_found;
 	struct rspamd_re_cache *cache;
 	struct rspamd_re_cache_stat stat;
+	gsize scanned_by_type[RSPAMD_RE_MAX]; /* Budget accounting */
+	GArray *lit_ids; /* Ids of literals being looked up */
+#ifdef WITH_HYPERSCAN
+	guchar *hs_matched; /* Prefilter matches waiting for pcre */
+#endif
 	gboolean has_hs;
 };
 
@@ -140,6 +180,68 @@ rspamd_re_cache_class_id (enum rspamd_re_type type,
 	return rspamd_cryptobox_fast_hash_final (&st);
 }
 
+#ifdef WITH_HYPERSCAN
+/*
+ * Classes that are split to many parts could be scanned by a single
+ * vectored call even if other classes use block mode
+ */
+static gboolean
+rspamd_re_cache_class_vectored (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class)
+{
+	if (cache->vectorized_hyperscan) {
+		return TRUE;
+	}
+
+	if (cache->vectorized_hyperscan_body) {
+		switch (re_class->type) {
+		case RSPAMD_RE_MIME:
+		case RSPAMD_RE_RAWMIME:
+		case RSPAMD_RE_SABODY:
+		case RSPAMD_RE_SARAWBODY:
+			return TRUE;
+		default:
+			break;
+		}
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_re_cache_free_class_db (struct rspamd_re_class *re_class)
+{
+	if (re_class->hs_map) {
+		/* Database lives in a shared mapping, so it must not be freed */
+		munmap (re_class->hs_map, re_class->hs_map_len);
+		re_class->hs_map = NULL;
+		re_class->hs_map_len = 0;
+	}
+	else if (re_class->hs_db) {
+		hs_free_database (re_class->hs_db);
+	}
+
+	re_class->hs_db = NULL;
+}
+#endif
+
+static void
+rspamd_re_cache_free_class_literals (struct rspamd_re_class *re_class)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (re_class->lit_mp); i ++) {
+		if (re_class->lit_mp[i]) {
+			rspamd_multipattern_destroy (re_class->lit_mp[i]);
+			re_class->lit_mp[i] = NULL;
+		}
+		if (re_class->lit_ids[i]) {
+			g_array_free (re_class->lit_ids[i], TRUE);
+			re_class->lit_ids[i] = NULL;
+		}
+	}
+}
+
 static void
 rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 {
@@ -159,16 +261,20 @@ rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 			g_slice_free1 (re_class->type_len, re_class->type_data);
 		}
 
+		rspamd_re_cache_free_class_literals (re_class);
+
 #ifdef WITH_HYPERSCAN
-		if (re_class->hs_db) {
-			hs_free_database (re_class->hs_db);
-		}
+		rspamd_re_cache_free_class_db (re_class);
+
 		if (re_class->hs_scratch) {
 			hs_free_scratch (re_class->hs_scratch);
 		}
 		if (re_class->hs_ids) {
 			g_free (re_class->hs_ids);
 		}
+		if (re_class->cache_ids) {
+			g_array_free (re_class->cache_ids, TRUE);
+		}
 #endif
 		g_slice_free1 (sizeof (*re_class), re_class);
 	}
@@ -317,10 +423,325 @@ rspamd_re_cache_sort_func (gconstpointer a, gconstpointer b)
 			rspamd_regexp_get_id ((*re2)->re));
 }
 
+/* Shorter literals are found too often to skip any regexp */
+#define RE_LITERAL_MIN_LEN 4
+
+static inline void
+rspamd_re_cache_literal_flush (gchar *cur, gsize *curlen,
+		gchar *best, gsize *bestlen)
+{
+	if (*curlen > *bestlen) {
+		memcpy (best, cur, *curlen);
+		*bestlen = *curlen;
+	}
+
+	*curlen = 0;
+}
+
+/*
+ * Extracts the longest literal that must be present in any text matched by
+ * the regexp. Only the top level concatenation is analysed: groups and
+ * classes are skipped, quantified characters are dropped and top level
+ * alternation or unknown syntax mean that there is no such literal
+ */
+static gchar *
+rspamd_re_cache_extract_literal (rspamd_regexp_t *re, gsize *plen)
+{
+	const gchar *p, *q;
+	gchar *cur, *best;
+	gsize curlen = 0, bestlen = 0;
+	gint depth = 0, pcre_flags;
+
+	p = rspamd_regexp_get_pattern (re);
+	pcre_flags = rspamd_regexp_get_pcre_flags (re);
+
+	if (pcre_flags & PCRE_FLAG(EXTENDED)) {
+		return NULL;
+	}
+#ifndef WITH_PCRE2
+	if ((pcre_flags & PCRE_FLAG(UTF8)) && (pcre_flags & PCRE_FLAG(CASELESS))) {
+#else
+	if ((pcre_flags & PCRE_FLAG(UTF)) && (pcre_flags & PCRE_FLAG(CASELESS))) {
+#endif
+		/* Unicode case folding matches ascii letters with other symbols */
+		return NULL;
+	}
+
+	cur = g_malloc (strlen (p) + 1);
+	best = g_malloc (strlen (p) + 1);
+
+	while (*p) {
+		switch (*p) {
+		case '\\':
+			p ++;
+
+			if (*p == '\0') {
+				goto fail;
+			}
+			else if (strchr ("dDwWsSbBAzZGhHvVRXK", *p) != NULL) {
+				rspamd_re_cache_literal_flush (cur, &curlen, best, &bestlen);
+			}
+			else if (g_ascii_isalnum (*p) || !g_ascii_isgraph (*p)) {
+				/* Numeric, property and other complex escapes */
+				goto fail;
+			}
+			else if (depth == 0) {
+				cur[curlen ++] = *p;
+			}
+
+			p ++;
+			break;
+		case '[':
+			rspamd_re_cache_literal_flush (cur, &curlen, best, &bestlen);
+			p ++;
+
+			if (*p == '^') {
+				p ++;
+			}
+			if (*p == ']') {
+				p ++;
+			}
+
+			while (*p != ']') {
+				if (*p == '\0') {
+					goto fail;
+				}
+				else if (*p == '\\' && p[1] != '\0') {
+					p += 2;
+				}
+				else if (*p == '[' && p[1] == ':') {
+					q = strstr (p + 2, ":]");
+
+					if (q == NULL) {
+						goto fail;
+					}
+
+					p = q + 2;
+				}
+				else {
+					p ++;
+				}
+			}
+
+			p ++;
+			break;
+		case '(':
+			rspamd_re_cache_literal_flush (cur, &curlen, best, &bestlen);
+			p ++;
+
+			if (*p == '?' && strchr (":=!<>P'", p[1]) == NULL) {
+				/* Inline options, comments, recursion and so on */
+				goto fail;
+			}
+			else if (*p == '*') {
+				/* Verbs */
+				goto fail;
+			}
+
+			depth ++;
+			break;
+		case ')':
+			rspamd_re_cache_literal_flush (cur, &curlen, best, &bestlen);
+
+			if (--depth < 0) {
+				goto fail;
+			}
+
+			p ++;
+			break;
+		case '|':
+			if (depth == 0) {
+				goto fail;
+			}
+
+			p ++;
+			break;
+		case '*':
+		case '?':
+			/* Previous character is optional */
+			if (curlen > 0) {
+				curlen --;
+			}
+
+			rspamd_re_cache_literal_flush (cur, &curlen, best, &bestlen);
+			p ++;
+			break;
+		case '+':
+			rspamd_re_cache_literal_flush (cur, &curlen, best, &bestlen);
+			p ++;
+			break;
+		case '{':
+			q = p + 1;
+
+			while (g_ascii_isdigit (*q) || *q == ',') {
+				q ++;
+			}
+
+			if (*q == '}' && q > p + 1 && g_ascii_isdigit (p[1])) {
+				/* Repetition could be zero */
+				if (curlen > 0) {
+					curlen --;
+				}
+
+				p = q;
+			}
+
+			rspamd_re_cache_literal_flush (cur, &curlen, best, &bestlen);
+			p ++;
+			break;
+		case '.':
+		case '^':
+		case '$':
+			rspamd_re_cache_literal_flush (cur, &curlen, best, &bestlen);
+			p ++;
+			break;
+		default:
+			if (depth == 0) {
+				if (g_ascii_isprint (*p)) {
+					cur[curlen ++] = *p;
+				}
+				else {
+					/* Non ascii symbols could be quantified as a whole */
+					rspamd_re_cache_literal_flush (cur, &curlen, best, &bestlen);
+				}
+			}
+
+			p ++;
+			break;
+		}
+	}
+
+	rspamd_re_cache_literal_flush (cur, &curlen, best, &bestlen);
+
+	if (depth != 0 || bestlen < RE_LITERAL_MIN_LEN) {
+		goto fail;
+	}
+
+	g_free (cur);
+	*plen = bestlen;
+
+	return best;
+
+fail:
+	g_free (cur);
+	g_free (best);
+
+	return NULL;
+}
+
+/*
+ * Builds per class multipattern matchers from the literals required by
+ * regexps, so pcre is not called for regexps whose literals are absent
+ */
+static void
+rspamd_re_cache_init_literals (struct rspamd_re_cache *cache)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_cache_elt *elt;
+	GError *err = NULL;
+	gchar *lit;
+	gsize litlen;
+	guint i, j, icase, nlit = 0;
+
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		rspamd_re_cache_free_class_literals (v);
+	}
+
+	for (i = 0; i < cache->re->len; i ++) {
+		elt = g_ptr_array_index (cache->re, i);
+		elt->has_literal = FALSE;
+		lit = rspamd_re_cache_extract_literal (elt->re, &litlen);
+
+		if (lit == NULL) {
+			continue;
+		}
+
+		re_class = rspamd_regexp_get_class (elt->re);
+		icase = (rspamd_regexp_get_pcre_flags (elt->re) &
+				PCRE_FLAG(CASELESS)) ? 1 : 0;
+
+		if (re_class->lit_mp[icase] == NULL) {
+			re_class->lit_mp[icase] = rspamd_multipattern_create (icase ?
+					RSPAMD_MULTIPATTERN_ICASE : RSPAMD_MULTIPATTERN_DEFAULT);
+			re_class->lit_ids[icase] = g_array_new (FALSE, FALSE,
+					sizeof (gint));
+		}
+
+		rspamd_multipattern_add_pattern_len (re_class->lit_mp[icase], lit,
+				litlen, RSPAMD_MULTIPATTERN_DEFAULT);
+		g_array_append_val (re_class->lit_ids[icase], i);
+		elt->has_literal = TRUE;
+		g_free (lit);
+	}
+
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+
+		for (i = 0; i < G_N_ELEMENTS (re_class->lit_mp); i ++) {
+			if (re_class->lit_mp[i] == NULL) {
+				continue;
+			}
+
+			if (!rspamd_multipattern_compile (re_class->lit_mp[i], &err)) {
+				msg_warn_re_cache ("cannot compile literals for class %s: %e",
+						rspamd_re_cache_type_to_string (re_class->type), err);
+				g_error_free (err);
+				err = NULL;
+
+				for (j = 0; j < re_class->lit_ids[i]->len; j ++) {
+					elt = g_ptr_array_index (cache->re,
+							g_array_index (re_class->lit_ids[i], gint, j));
+					elt->has_literal = FALSE;
+				}
+
+				rspamd_multipattern_destroy (re_class->lit_mp[i]);
+				re_class->lit_mp[i] = NULL;
+				g_array_free (re_class->lit_ids[i], TRUE);
+				re_class->lit_ids[i] = NULL;
+			}
+			else {
+				nlit += re_class->lit_ids[i]->len;
+			}
+		}
+	}
+
+	cache->has_literals = nlit > 0;
+	msg_info_re_cache ("extracted required literals for %ud of %ud regexps",
+			nlit, cache->re->len);
+}
+
+#ifdef WITH_HYPERSCAN
+/*
+ * Large hyperscan databases are aligned to huge pages, so the kernel could
+ * back them with huge pages when it is enabled
+ */
+static void *
+rspamd_re_cache_hs_alloc (size_t size)
+{
+	void *p;
+
+	if (size >= RSPAMD_HUGE_PAGE_SIZE && rspamd_mempool_huge_pages ()) {
+		if (posix_memalign (&p, RSPAMD_HUGE_PAGE_SIZE, size) == 0) {
+			rspamd_mempool_advise_huge (p, size);
+
+			return p;
+		}
+	}
+
+	return malloc (size);
+}
+#endif
+
 void
 rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 {
-	guint i, fl;
+	guint i, fl, pos;
 	GHashTableIter it;
 	gpointer k, v;
 	struct rspamd_re_class *re_class;
@@ -335,6 +756,22 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 	/* Resort all regexps */
 	g_ptr_array_sort (cache->re, rspamd_re_cache_sort_func);
 
+#ifdef WITH_HYPERSCAN
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+
+		if (re_class->cache_ids == NULL) {
+			re_class->cache_ids = g_array_sized_new (FALSE, FALSE, sizeof (gint),
+					g_hash_table_size (re_class->re));
+		}
+		else {
+			g_array_set_size (re_class->cache_ids, 0);
+		}
+	}
+#endif
+
 	for (i = 0; i < cache->re->len; i ++) {
 		elt = g_ptr_array_index (cache->re, i);
 		re = elt->re;
@@ -347,6 +784,13 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 			rspamd_cryptobox_hash_init (re_class->st, NULL, 0);
 		}
 
+#ifdef WITH_HYPERSCAN
+		pos = re_class->cache_ids->len;
+		g_array_append_val (re_class->cache_ids, i);
+#else
+		pos = 0;
+#endif
+
 		/* Update hashes */
 		/* Id of re class */
 		rspamd_cryptobox_hash_update (re_class->st, (gpointer) &re_class->id,
@@ -376,9 +820,12 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 				sizeof (fl));
 		rspamd_cryptobox_hash_update (&st_global, (const guchar *) &fl,
 				sizeof (fl));
-		/* Numberic order */
-		rspamd_cryptobox_hash_update (re_class->st, (const guchar *)&i,
-				sizeof (i));
+		/*
+		 * Numeric order: class hash depends merely on the position inside
+		 * class, so changes in other classes do not invalidate it
+		 */
+		rspamd_cryptobox_hash_update (re_class->st, (const guchar *)&pos,
+				sizeof (pos));
 		rspamd_cryptobox_hash_update (&st_global, (const guchar *)&i,
 				sizeof (i));
 	}
@@ -387,6 +834,8 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 	rspamd_snprintf (cache->hash, sizeof (cache->hash), "%*xs",
 			(gint) rspamd_cryptobox_HASHBYTES, hash_out);
 
+	rspamd_re_cache_init_literals (cache);
+
 	/* Now finalize all classes */
 	g_hash_table_iter_init (&it, cache->re_classes);
 
@@ -394,14 +843,6 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 		re_class = v;
 
 		if (re_class->st) {
-			/*
-			 * We finally update all classes with the number of expressions
-			 * in the cache to ensure that if even a single re has been changed
-			 * we won't be broken due to id mismatch
-			 */
-			rspamd_cryptobox_hash_update (re_class->st,
-					(gpointer)&cache->re->len,
-					sizeof (cache->re->len));
 			rspamd_cryptobox_hash_final (re_class->st, hash_out);
 			rspamd_snprintf (re_class->hash, sizeof (re_class->hash), "%*xs",
 					(gint) rspamd_cryptobox_HASHBYTES, hash_out);
@@ -416,6 +857,8 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 
 	cache->disable_hyperscan = cfg->disable_hyperscan;
 	cache->vectorized_hyperscan = cfg->vectorized_hyperscan;
+	cache->vectorized_hyperscan_body = cfg->vectorized_hyperscan_body;
+	cache->mmap_hyperscan = cfg->mmap_hyperscan;
 
 	g_assert (hs_populate_platform (&cache->plt) == HS_SUCCESS);
 
@@ -441,7 +884,8 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 		features = rspamd_fstring_append (features, "AVX2", 4);
 	}
 
-	hs_set_allocator (g_malloc, g_free);
+	/* Not g_free as databases could be aligned using posix_memalign */
+	hs_set_allocator (rspamd_re_cache_hs_alloc, free);
 
 	msg_info_re_cache ("loaded hyperscan engine witch cpu tune '%s' and features '%V'",
 			platform, features);
@@ -462,8 +906,14 @@ rspamd_re_cache_runtime_new (struct rspamd_re_cache *cache)
 	rt->checked = g_slice_alloc0 (NBYTES (cache->nre));
 	rt->results = g_slice_alloc0 (cache->nre);
 	rt->stat.regexp_total = cache->nre;
+
+	if (cache->has_literals) {
+		rt->lit_checked = g_slice_alloc0 (NBYTES (cache->nre));
+		rt->lit_found = g_slice_alloc0 (NBYTES (cache->nre));
+	}
 #ifdef WITH_HYPERSCAN
-	rt->has_hs = cache->hyperscan_loaded;
+	rt->has_hs = cache->has_partial_hs;
+	rt->hs_matched = g_slice_alloc0 (NBYTES (cache->nre));
 #endif
 
 	return rt;
@@ -551,9 +1001,6 @@ rspamd_re_cache_process_pcre (struct rspamd_re_runtime *rt,
 #ifdef WITH_HYPERSCAN
 struct rspamd_re_hyperscan_cbdata {
 	struct rspamd_re_runtime *rt;
-	const guchar **ins;
-	const guint *lens;
-	guint count;
 	rspamd_regexp_t *re;
 	struct rspamd_task *task;
 };
@@ -568,11 +1015,16 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 	struct rspamd_re_hyperscan_cbdata *cbdata = ud;
 	struct rspamd_re_runtime *rt;
 	struct rspamd_re_cache_elt *pcre_elt;
-	guint ret, maxhits, i, processed;
+	struct rspamd_re_class *re_class;
+	guint ret, maxhits;
 	struct rspamd_task *task;
 
 	rt = cbdata->rt;
 	task = cbdata->task;
+	re_class = rspamd_regexp_get_class (cbdata->re);
+	/* Convert position in class to the global id */
+	g_assert (id < re_class->cache_ids->len);
+	id = g_array_index (re_class->cache_ids, gint, id);
 	pcre_elt = g_ptr_array_index (rt->cache->re, id);
 	maxhits = rspamd_regexp_get_maxhits (pcre_elt->re);
 
@@ -587,67 +1039,368 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 		msg_debug_re_task ("found regexp /%s/ using hyperscan only, total hits: %d",
 				rspamd_regexp_get_pattern (pcre_elt->re), rt->results[id]);
 	}
-	else {
-		if (!isset (rt->checked, id)) {
-
-			processed = 0;
-
-			for (i = 0; i < cbdata->count; i ++) {
-				ret = rspamd_re_cache_process_pcre (rt,
-						pcre_elt->re,
-						cbdata->task,
-						cbdata->ins[i],
-						cbdata->lens[i],
-						FALSE);
-				rt->results[id] = ret;
-				setbit (rt->checked, id);
-
-				processed += cbdata->lens[i];
-
-				if (processed >= to) {
-					break;
-				}
-			}
-		}
+	else if (!isset (rt->checked, id)) {
+		/*
+		 * Pcre confirmation is postponed until the regexp is requested, so
+		 * regexps of disabled or skipped rules are never checked by pcre
+		 */
+		setbit (rt->hs_matched, id);
+		msg_debug_re_task ("found regexp /%s/ using hyperscan prefilter",
+				rspamd_regexp_get_pattern (pcre_elt->re));
 	}
 
 	return 0;
 }
 #endif
 
+/*
+ * Truncates data vector to the remaining scan budget of a regexp class type,
+ * returns the number of elements left to scan
+ */
 static guint
-rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
+rspamd_re_cache_apply_budget (struct rspamd_re_runtime *rt,
 		rspamd_regexp_t *re, struct rspamd_task *task,
-		const guchar **in, guint *lens,
-		guint count,
-		gboolean is_raw)
+		guint *lens,
+		guint count)
 {
-
-	guint64 re_id;
-	guint ret = 0;
+	struct rspamd_re_class *re_class = rspamd_regexp_get_class (re);
+	gsize max = task->cfg->max_re_scan, remain;
+	gboolean truncated = FALSE;
+	gchar *what;
 	guint i;
 
-	re_id = rspamd_regexp_get_cache_id (re);
-
-	if (count == 0 || in == NULL) {
-		/* We assume this as absence of the specified data */
-		setbit (rt->checked, re_id);
-		rt->results[re_id] = ret;
-		return ret;
+	if (re_class == NULL) {
+		return count;
 	}
 
-#ifndef WITH_HYPERSCAN
-	for (i = 0; i < count; i++) {
-		ret = rspamd_re_cache_process_pcre (rt,
-				re,
-				task,
-				in[i],
-				lens[i],
-				is_raw);
-		rt->results[re_id] = ret;
-	}
+	remain = rt->scanned_by_type[re_class->type] >= max ? 0 :
+			max - rt->scanned_by_type[re_class->type];
+
+	for (i = 0; i < count; i ++) {
+		if (remain == 0) {
+			truncated = TRUE;
+			break;
+		}
+
+		if (lens[i] > remain) {
+			lens[i] = remain;
+			truncated = TRUE;
+		}
+
+		remain -= lens[i];
+		rt->scanned_by_type[re_class->type] += lens[i];
+	}
+
+	if (truncated && !(task->budget_flags &
+			RSPAMD_TASK_BUDGET_RE_SCAN (re_class->type))) {
+		what = rspamd_mempool_alloc (task->task_pool, 32);
+		rspamd_snprintf (what, 32, "re_%s",
+				rspamd_re_cache_type_to_string (re_class->type));
+		rspamd_task_budget_exceeded (task,
+				RSPAMD_TASK_BUDGET_RE_SCAN (re_class->type), what);
+	}
+
+	return i;
+}
+
+/* Part of the limit given to the head and to the tail windows (in 1/8) */
+#define RE_SAMPLE_EDGE_EIGHTHS 3
+/* Size of a window around url or boundary in the middle of data */
+#define RE_SAMPLE_ANCHOR_WINDOW 512
+
+static gboolean
+rspamd_re_cache_need_sampling (struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re, guint *lens, guint count)
+{
+	struct rspamd_re_class *re_class;
+	guint i;
+
+	if (!rt->cache->sample_re_data || rt->cache->max_re_data == 0) {
+		return FALSE;
+	}
+
+	re_class = rspamd_regexp_get_class (re);
+
+	if (re_class == NULL) {
+		return FALSE;
+	}
+
+	switch (re_class->type) {
+	case RSPAMD_RE_MIME:
+	case RSPAMD_RE_RAWMIME:
+	case RSPAMD_RE_BODY:
+	case RSPAMD_RE_SABODY:
+	case RSPAMD_RE_SARAWBODY:
+		break;
+	default:
+		return FALSE;
+	}
+
+	for (i = 0; i < count; i ++) {
+		if (lens[i] > rt->cache->max_re_data) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static inline void
+rspamd_re_cache_add_window (const guchar *in, guint start, guint end,
+		const guchar **out, guint *outlens, guint first, guint *nout,
+		guint *last_end)
+{
+	if (end <= start) {
+		return;
+	}
+
+	if (*nout > first && start <= *last_end) {
+		/* Merge with the previous window of the same data */
+		if (end > *last_end) {
+			outlens[*nout - 1] += end - *last_end;
+			*last_end = end;
+		}
+	}
+	else {
+		out[*nout] = in + start;
+		outlens[*nout] = end - start;
+		(*nout) ++;
+		*last_end = end;
+	}
+}
+
+/*
+ * Replaces elements longer than the limit with the head and the tail windows
+ * plus small windows around urls and mime boundaries found in the middle,
+ * so the amount of scanned data is still bounded by the limit
+ */
+static guint
+rspamd_re_cache_sample (guint limit, const guchar **in, guint *lens,
+		guint count, const guchar ***pout, guint **poutlens)
+{
+	const guchar **out, *p, *end;
+	guint *outlens, nout = 0, i, edge, anchor_win, max_anchors, nanchors,
+			last_end = 0, pos, first;
+
+	edge = limit / 8 * RE_SAMPLE_EDGE_EIGHTHS;
+	anchor_win = MIN (RE_SAMPLE_ANCHOR_WINDOW, limit - edge * 2);
+	max_anchors = anchor_win > 0 ? (limit - edge * 2) / anchor_win : 0;
+
+	out = g_malloc (sizeof (*out) * count * (max_anchors + 2));
+	outlens = g_malloc (sizeof (*outlens) * count * (max_anchors + 2));
+
+	for (i = 0; i < count; i ++) {
+		if (lens[i] <= limit) {
+			out[nout] = in[i];
+			outlens[nout] = lens[i];
+			nout ++;
+			continue;
+		}
+
+		/* Windows are merged within the same element only */
+		first = nout;
+		rspamd_re_cache_add_window (in[i], 0, edge, out, outlens, first, &nout,
+				&last_end);
+
+		p = in[i] + edge;
+		end = in[i] + lens[i] - edge;
+		nanchors = 0;
+
+		while (nanchors < max_anchors && p + 2 < end) {
+			if ((p[0] == ':' && p[1] == '/' && p[2] == '/') ||
+					(p[0] == '\n' && p[1] == '-' && p[2] == '-')) {
+				pos = p - in[i];
+				rspamd_re_cache_add_window (in[i],
+						MAX (pos, anchor_win / 2) - anchor_win / 2,
+						MIN (pos + anchor_win / 2, lens[i] - edge),
+						out, outlens, first, &nout, &last_end);
+				nanchors ++;
+				p += anchor_win / 2;
+			}
+			else {
+				p ++;
+			}
+		}
+
+		rspamd_re_cache_add_window (in[i], lens[i] - edge, lens[i],
+				out, outlens, first, &nout, &last_end);
+	}
+
+	*pout = out;
+	*poutlens = outlens;
+
+	return nout;
+}
+
+static guint
+rspamd_re_cache_process_pcre_vec (struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re, struct rspamd_task *task,
+		const guchar **in, guint *lens,
+		guint count,
+		gboolean is_raw)
+{
+	guint64 re_id;
+	guint ret = 0, i;
+
+	re_id = rspamd_regexp_get_cache_id (re);
+
+	for (i = 0; i < count; i++) {
+		ret = rspamd_re_cache_process_pcre (rt,
+				re,
+				task,
+				in[i],
+				lens[i],
+				is_raw);
+		rt->results[re_id] = ret;
+	}
 
 	setbit (rt->checked, re_id);
+
+	return ret;
+}
+
+static gint
+rspamd_re_cache_literal_cb (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	struct rspamd_re_runtime *rt = context;
+	GArray *ids = rt->lit_ids;
+
+	setbit (rt->lit_found, g_array_index (ids, gint, strnum));
+
+	return 0;
+}
+
+/*
+ * Returns FALSE if the literal required by a regexp that is going to be
+ * checked by pcre is absent in data. Literals of all class regexps are
+ * looked up at once, so other regexps of the class reuse this scan. Data
+ * must be the same for all class regexps to allow that
+ */
+static gboolean
+rspamd_re_cache_check_literal (struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re, const guchar **in, guint *lens,
+		guint count, gboolean reuse)
+{
+	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_class *re_class;
+	guint64 re_id;
+	guint i, j;
+	gsize len;
+
+	re_id = rspamd_regexp_get_cache_id (re);
+	elt = g_ptr_array_index (rt->cache->re, re_id);
+
+	if (!elt->has_literal) {
+		return TRUE;
+	}
+
+#ifdef WITH_HYPERSCAN
+	if (!rt->cache->disable_hyperscan && elt->match_type != RSPAMD_RE_CACHE_PCRE &&
+			rt->has_hs) {
+		return TRUE;
+	}
+#endif
+
+	if (!isset (rt->lit_checked, re_id)) {
+		if (!reuse) {
+			return TRUE;
+		}
+
+		re_class = rspamd_regexp_get_class (re);
+
+		for (i = 0; i < G_N_ELEMENTS (re_class->lit_mp); i ++) {
+			if (re_class->lit_mp[i] == NULL) {
+				continue;
+			}
+
+			rt->lit_ids = re_class->lit_ids[i];
+
+			for (j = 0; j < count; j ++) {
+				if (in[j] == NULL) {
+					continue;
+				}
+
+				len = lens[j] > 0 ? lens[j] : strlen (in[j]);
+				rspamd_multipattern_lookup (re_class->lit_mp[i],
+						(const gchar *)in[j], len,
+						rspamd_re_cache_literal_cb, rt, NULL);
+			}
+
+			for (j = 0; j < re_class->lit_ids[i]->len; j ++) {
+				setbit (rt->lit_checked,
+						g_array_index (re_class->lit_ids[i], gint, j));
+			}
+		}
+
+		rt->lit_ids = NULL;
+	}
+
+	return isset (rt->lit_found, re_id);
+}
+
+static guint
+rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re, struct rspamd_task *task,
+		const guchar **in, guint *lens,
+		guint count,
+		gboolean is_raw,
+		gboolean reuse_literals)
+{
+
+	guint64 re_id;
+	guint ret = 0;
+	guint i;
+
+	re_id = rspamd_regexp_get_cache_id (re);
+
+	if (count > 0 && in != NULL && rt->lit_found != NULL &&
+			!rspamd_re_cache_check_literal (rt, re, in, lens, count,
+					reuse_literals)) {
+		/* Regexp cannot match without its literal */
+		msg_debug_re_task ("skip regexp /%s/ as its literal is not found",
+				rspamd_regexp_get_pattern (re));
+		rt->stat.regexp_prefiltered ++;
+		setbit (rt->checked, re_id);
+
+		return rt->results[re_id];
+	}
+
+	if (count > 0 && in != NULL &&
+			rspamd_re_cache_need_sampling (rt, re, lens, count)) {
+		const guchar **sampled;
+		guint *sampled_lens, nsampled;
+
+		nsampled = rspamd_re_cache_sample (rt->cache->max_re_data, in, lens,
+				count, &sampled, &sampled_lens);
+		/* All windows fit the limit, so there is no recursion */
+		ret = rspamd_re_cache_process_regexp_data (rt, re, task,
+				sampled, sampled_lens, nsampled, is_raw, reuse_literals);
+		g_free (sampled);
+		g_free (sampled_lens);
+
+		return ret;
+	}
+
+	if (count > 0 && in != NULL && task->cfg && task->cfg->max_re_scan > 0) {
+		count = rspamd_re_cache_apply_budget (rt, re, task, lens, count);
+	}
+
+	if (count == 0 || in == NULL) {
+		/* We assume this as absence of the specified data */
+		setbit (rt->checked, re_id);
+		rt->results[re_id] = ret;
+		return ret;
+	}
+
+#ifndef WITH_HYPERSCAN
+	ret = rspamd_re_cache_process_pcre_vec (rt, re, task, in, lens, count,
+			is_raw);
 #else
 	struct rspamd_re_cache_elt *elt;
 	struct rspamd_re_class *re_class;
@@ -657,18 +1410,10 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 	re_class = rspamd_regexp_get_class (re);
 
 	if (rt->cache->disable_hyperscan || elt->match_type == RSPAMD_RE_CACHE_PCRE ||
-			!rt->has_hs) {
-		for (i = 0; i < count; i++) {
-			ret = rspamd_re_cache_process_pcre (rt,
-					re,
-					task,
-					in[i],
-					lens[i],
-					is_raw);
-			rt->results[re_id] = ret;
-		}
-
-		setbit (rt->checked, re_id);
+			!rt->has_hs || isset (rt->hs_matched, re_id)) {
+		/* Class has been already scanned if prefilter has matched */
+		ret = rspamd_re_cache_process_pcre_vec (rt, re, task, in, lens, count,
+				is_raw);
 	}
 	else {
 		for (i = 0; i < count; i ++) {
@@ -682,13 +1427,10 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 		g_assert (re_class->hs_db != NULL);
 
 		/* Go through hyperscan API */
-		if (!rt->cache->vectorized_hyperscan) {
+		if (!rspamd_re_cache_class_vectored (rt->cache, re_class)) {
 			for (i = 0; i < count; i++) {
-				cbdata.ins = &in[i];
 				cbdata.re = re;
 				cbdata.rt = rt;
-				cbdata.lens = &lens[i];
-				cbdata.count = 1;
 				cbdata.task = task;
 
 				if ((hs_scan (re_class->hs_db, in[i], lens[i], 0,
@@ -702,14 +1444,31 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 			}
 		}
 		else {
-			cbdata.ins = in;
+			const gchar **vec;
+			guint *veclens, nvec = 0;
+
+			/*
+			 * All inputs are scanned by a single call, newlines between them
+			 * prevent most of matches that span several inputs
+			 */
+			vec = g_malloc (sizeof (*vec) * count * 2);
+			veclens = g_malloc (sizeof (*veclens) * count * 2);
+
+			for (i = 0; i < count; i ++) {
+				if (i > 0) {
+					vec[nvec] = "\n";
+					veclens[nvec ++] = 1;
+				}
+
+				vec[nvec] = (const gchar *)in[i];
+				veclens[nvec ++] = lens[i];
+			}
+
 			cbdata.re = re;
 			cbdata.rt = rt;
-			cbdata.lens = lens;
-			cbdata.count = 1;
 			cbdata.task = task;
 
-			if ((hs_scan_vector (re_class->hs_db, (const char **)in, lens, count, 0,
+			if ((hs_scan_vector (re_class->hs_db, vec, veclens, nvec, 0,
 					re_class->hs_scratch,
 					rspamd_re_cache_hyperscan_cb, &cbdata)) != HS_SUCCESS) {
 				ret = 0;
@@ -717,6 +1476,14 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 			else {
 				ret = rt->results[re_id];
 			}
+
+			g_free (vec);
+			g_free (veclens);
+		}
+
+		if (!isset (rt->checked, re_id) && isset (rt->hs_matched, re_id)) {
+			ret = rspamd_re_cache_process_pcre_vec (rt, re, task, in, lens,
+					count, is_raw);
 		}
 	}
 #endif
@@ -736,7 +1503,7 @@ rspamd_re_cache_finish_class (struct rspamd_re_runtime *rt,
 	for (i = 0; i < re_class->nhs; i++) {
 		re_id = re_class->hs_ids[i];
 
-		if (!isset (rt->checked, re_id)) {
+		if (!isset (rt->checked, re_id) && !isset (rt->hs_matched, re_id)) {
 			g_assert (rt->results[re_id] == 0);
 			rt->results[re_id] = 0;
 			setbit (rt->checked, re_id);
@@ -794,7 +1561,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 					lenvec[i] = strlen (rh->value);
 				}
 				else {
-					in = rh->decoded;
+					in = rspamd_mime_header_get_decoded (rh);
 					/* Validate input */
 					if (!in || !g_utf8_validate (in, -1, &end)) {
 						lenvec[i] = 0;
@@ -808,7 +1575,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 			}
 
 			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, headerlist->len, raw);
+					task, scvec, lenvec, headerlist->len, raw, !is_strong);
 			msg_debug_re_task ("checking header %s regexp: %s -> %d",
 					re_class->type_data,
 					rspamd_regexp_get_pattern (re), ret);
@@ -821,7 +1588,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		in = task->raw_headers_content.begin;
 		len = task->raw_headers_content.len;
 		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task, (const guchar **)&in, &len, 1, raw);
+				task, (const guchar **)&in, &len, 1, raw, !is_strong);
 		msg_debug_re_task ("checking allheader regexp: %s -> %d",
 				rspamd_regexp_get_pattern (re), ret);
 		break;
@@ -843,7 +1610,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 					lenvec[i] = strlen (rh->value);
 				}
 				else {
-					in = rh->decoded;
+					in = rspamd_mime_header_get_decoded (rh);
 					/* Validate input */
 					if (!in || !g_utf8_validate (in, -1, &end)) {
 						lenvec[i] = 0;
@@ -857,7 +1624,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 			}
 
 			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, headerlist->len, raw);
+					task, scvec, lenvec, headerlist->len, raw, !is_strong);
 			msg_debug_re_task ("checking mime header %s regexp: %s -> %d",
 					re_class->type_data,
 					rspamd_regexp_get_pattern (re), ret);
@@ -903,7 +1670,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 			}
 
 			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, cnt, raw);
+					task, scvec, lenvec, cnt, raw, !is_strong);
 			msg_debug_re_task ("checking mime regexp: %s -> %d",
 					rspamd_regexp_get_pattern (re), ret);
 			g_free (scvec);
@@ -944,7 +1711,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 			g_assert (i == cnt);
 
 			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, i, raw);
+					task, scvec, lenvec, i, raw, !is_strong);
 			msg_debug_re_task ("checking url regexp: %s -> %d",
 					rspamd_regexp_get_pattern (re), ret);
 			g_free (scvec);
@@ -957,7 +1724,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		len = task->msg.len;
 
 		ret = rspamd_re_cache_process_regexp_data (rt, re, task,
-				(const guchar **)&in, &len, 1, raw);
+				(const guchar **)&in, &len, 1, raw, !is_strong);
 		msg_debug_re_task ("checking rawbody regexp: %s -> %d",
 				rspamd_regexp_get_pattern (re), ret);
 		break;
@@ -984,8 +1751,8 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		if (headerlist && headerlist->len > 0) {
 			rh = g_ptr_array_index (headerlist, 0);
 
-			scvec[0] = (guchar *)rh->decoded;
-			lenvec[0] = strlen (rh->decoded);
+			scvec[0] = (guchar *)rspamd_mime_header_get_decoded (rh);
+			lenvec[0] = strlen ((const gchar *)scvec[0]);
 		}
 		else {
 			scvec[0] = (guchar *)"";
@@ -1005,7 +1772,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		}
 
 		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task, scvec, lenvec, cnt, TRUE);
+				task, scvec, lenvec, cnt, TRUE, !is_strong);
 		msg_debug_re_task ("checking sa body regexp: %s -> %d",
 				rspamd_regexp_get_pattern (re), ret);
 		g_free (scvec);
@@ -1038,7 +1805,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 			}
 
 			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, cnt, TRUE);
+					task, scvec, lenvec, cnt, TRUE, !is_strong);
 			msg_debug_re_task ("checking sa rawbody regexp: %s -> %d",
 					rspamd_regexp_get_pattern (re), ret);
 			g_free (scvec);
@@ -1137,6 +1904,16 @@ rspamd_re_cache_runtime_destroy (struct rspamd_re_runtime *rt)
 
 	g_slice_free1 (NBYTES (rt->cache->nre), rt->checked);
 	g_slice_free1 (rt->cache->nre, rt->results);
+
+	if (rt->lit_found) {
+		g_slice_free1 (NBYTES (rt->cache->nre), rt->lit_checked);
+		g_slice_free1 (NBYTES (rt->cache->nre), rt->lit_found);
+	}
+
+#ifdef WITH_HYPERSCAN
+	g_slice_free1 (NBYTES (rt->cache->nre), rt->hs_matched);
+#endif
+
 	REF_RELEASE (rt->cache);
 	g_slice_free1 (sizeof (*rt), rt);
 }
@@ -1172,6 +1949,19 @@ rspamd_re_cache_set_limit (struct rspamd_re_cache *cache, guint limit)
 	return old;
 }
 
+gboolean
+rspamd_re_cache_set_sampling (struct rspamd_re_cache *cache, gboolean sample)
+{
+	gboolean old;
+
+	g_assert (cache != NULL);
+
+	old = cache->sample_re_data;
+	cache->sample_re_data = sample;
+
+	return old;
+}
+
 const gchar *
 rspamd_re_cache_type_to_string (enum rspamd_re_type type)
 {
@@ -1347,302 +2137,724 @@ rspamd_re_cache_is_finite (struct rspamd_re_cache *cache,
 }
 #endif
 
-gint
-rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
-		const char *cache_dir, gdouble max_time, gboolean silent,
+#ifdef WITH_HYPERSCAN
+/*
+ * Writes deserialized database to a file that could be mapped and used by
+ * workers directly:
+ * Magic - 8 bytes
+ * crc - 8 bytes checksum (the same as in the corresponding .hs file)
+ * padding up to RSPAMD_HS_MAPPED_HDR_LEN
+ * <deserialized hyperscan database>
+ */
+static gboolean
+rspamd_re_cache_save_mapped (struct rspamd_re_cache *cache,
+		const char *cache_dir,
+		struct rspamd_re_class *re_class,
+		const gchar *blob, gsize bloblen, guint64 crc,
 		GError **err)
 {
-	g_assert (cache != NULL);
-	g_assert (cache_dir != NULL);
-
-#ifndef WITH_HYPERSCAN
-	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
-	return -1;
-#else
-	GHashTableIter it, cit;
-	gpointer k, v;
-	struct rspamd_re_class *re_class;
 	gchar path[PATH_MAX], npath[PATH_MAX];
-	hs_database_t *test_db;
-	gint fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
-	rspamd_cryptobox_fast_hash_state_t crc_st;
-	guint64 crc;
-	rspamd_regexp_t *re;
-	hs_compile_error_t *hs_errors;
-	guint *hs_flags = NULL;
-	const gchar **hs_pats = NULL;
-	gchar *hs_serialized;
-	gsize serialized_len, total = 0;
-	struct iovec iov[7];
+	guchar hdr[RSPAMD_HS_MAPPED_HDR_LEN];
+	gpointer db_mem;
+	gsize db_len;
+	struct iovec iov[2];
+	gint fd;
 
-	g_hash_table_iter_init (&it, cache->re_classes);
+	if (hs_serialized_database_size (blob, bloblen, &db_len) != HS_SUCCESS) {
+		g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+				"cannot get deserialized size for %s", re_class->hash);
 
-	while (g_hash_table_iter_next (&it, &k, &v)) {
-		re_class = v;
-		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
-				G_DIR_SEPARATOR, re_class->hash);
+		return FALSE;
+	}
 
-		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE)) {
+	/*
+	 * Hyperscan aligns bytecode relative to the database address, so we
+	 * deserialize to an address with the same alignment as mmap provides
+	 */
+	if (posix_memalign (&db_mem, RSPAMD_HS_MAPPED_ALIGN, db_len) != 0) {
+		g_set_error (err, rspamd_re_cache_quark (), ENOMEM,
+				"cannot allocate %z bytes for %s", db_len, re_class->hash);
 
-			fd = open (path, O_RDONLY, 00600);
+		return FALSE;
+	}
 
-			/* Read number of regexps */
-			g_assert (fd != -1);
-			lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET);
-			read (fd, &n, sizeof (n));
-			close (fd);
+	if (hs_deserialize_database_at (blob, bloblen, db_mem) != HS_SUCCESS) {
+		g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+				"cannot deserialize database for %s", re_class->hash);
+		free (db_mem);
 
-			if (re_class->type_len > 0) {
-				if (!silent) {
-					msg_info_re_cache (
-							"skip already valid class %s(%*s) to cache %6s, %d regexps",
-							rspamd_re_cache_type_to_string (re_class->type),
-							(gint) re_class->type_len - 1,
-							re_class->type_data,
-							re_class->hash,
-							n);
-				}
-			}
-			else {
-				if (!silent) {
-					msg_info_re_cache (
-							"skip already valid class %s to cache %6s, %d regexps",
-							rspamd_re_cache_type_to_string (re_class->type),
-							re_class->hash,
-							n);
-				}
-			}
+		return FALSE;
+	}
 
-			continue;
-		}
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hsmap.new", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+	fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
 
-		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cache_dir,
-						G_DIR_SEPARATOR, re_class->hash);
-		fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
+	if (fd == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
+				"%s: %s", path, strerror (errno));
+		free (db_mem);
 
-		if (fd == -1) {
-			g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
-					"%s: %s", path, strerror (errno));
-			return -1;
-		}
+		return FALSE;
+	}
 
-		g_hash_table_iter_init (&cit, re_class->re);
-		n = g_hash_table_size (re_class->re);
-		hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
-		hs_ids = g_malloc (sizeof (*hs_ids) * n);
-		hs_pats = g_malloc (sizeof (*hs_pats) * n);
-		i = 0;
+	memset (hdr, 0, sizeof (hdr));
+	memcpy (hdr, rspamd_hs_magic_mapped, RSPAMD_HS_MAGIC_LEN);
+	memcpy (hdr + RSPAMD_HS_MAGIC_LEN, &crc, sizeof (crc));
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof (hdr);
+	iov[1].iov_base = db_mem;
+	iov[1].iov_len = db_len;
+
+	if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno,
+				"cannot write mapped database to %s: %s",
+				path, strerror (errno));
+		close (fd);
+		unlink (path);
+		free (db_mem);
 
-		while (g_hash_table_iter_next (&cit, &k, &v)) {
-			re = v;
+		return FALSE;
+	}
 
-			pcre_flags = rspamd_regexp_get_pcre_flags (re);
-			re_flags = rspamd_regexp_get_flags (re);
+	free (db_mem);
+	fsync (fd);
+	close (fd);
 
-			if (re_flags & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
-				/* Do not try to compile bad regexp */
-				msg_info_re_cache (
-						"do not try compile %s to hyperscan as it is PCRE only",
-						rspamd_regexp_get_pattern (re));
-				continue;
-			}
+	rspamd_snprintf (npath, sizeof (npath), "%s%c%s.hsmap", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
 
-			hs_flags[i] = 0;
-#ifndef WITH_PCRE2
-			if (pcre_flags & PCRE_FLAG(UTF8)) {
-				hs_flags[i] |= HS_FLAG_UTF8;
-			}
-#else
-			if (pcre_flags & PCRE_FLAG(UTF)) {
-				hs_flags[i] |= HS_FLAG_UTF8;
-			}
+	if (rename (path, npath) == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno,
+				"cannot rename %s to %s: %s",
+				path, npath, strerror (errno));
+		unlink (path);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Creates mapped database for an existing and valid .hs file if it is absent
+ */
+static gboolean
+rspamd_re_cache_ensure_mapped (struct rspamd_re_cache *cache,
+		const char *cache_dir,
+		struct rspamd_re_class *re_class,
+		GError **err)
+{
+	gchar path[PATH_MAX];
+	guchar *map, *p;
+	gsize len;
+	guint64 crc;
+	gint n;
+	gboolean ret;
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hsmap", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+
+	if (access (path, R_OK) == 0) {
+		return TRUE;
+	}
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+	map = rspamd_file_xmap (path, PROT_READ, &len);
+
+	if (map == NULL) {
+		g_set_error (err, rspamd_re_cache_quark (), errno,
+				"cannot mmap %s: %s", path, strerror (errno));
+
+		return FALSE;
+	}
+
+	/* File has been already validated */
+	p = map + RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt);
+	memcpy (&n, p, sizeof (n));
+	p += sizeof (n) + n * sizeof (gint) * 2;
+	memcpy (&crc, p, sizeof (crc));
+	p += sizeof (crc);
+
+	ret = rspamd_re_cache_save_mapped (cache, cache_dir, re_class,
+			(const gchar *)p, len - (p - map), crc, err);
+	munmap (map, len);
+
+	return ret;
+}
+
+/*
+ * Tries to use mapped database for a class, returns FALSE if it is absent
+ * or does not match the serialized one
+ */
+static gboolean
+rspamd_re_cache_load_mapped (struct rspamd_re_cache *cache,
+		const char *cache_dir,
+		struct rspamd_re_class *re_class,
+		const gchar *blob, gsize bloblen, guint64 crc)
+{
+	gchar path[PATH_MAX];
+	guchar *map;
+	gsize len, db_len;
+	guint64 mapped_crc;
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hsmap", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+
+	if (hs_serialized_database_size (blob, bloblen, &db_len) != HS_SUCCESS) {
+		return FALSE;
+	}
+
+	map = rspamd_file_xmap (path, PROT_READ, &len);
+
+	if (map == NULL) {
+		msg_info_re_cache ("cannot mmap hyperscan database %s: %s",
+				path, strerror (errno));
+
+		return FALSE;
+	}
+
+	if (len != RSPAMD_HS_MAPPED_HDR_LEN + db_len ||
+			memcmp (map, rspamd_hs_magic_mapped, RSPAMD_HS_MAGIC_LEN) != 0) {
+		msg_warn_re_cache ("invalid mapped hyperscan database %s", path);
+		munmap (map, len);
+
+		return FALSE;
+	}
+
+	memcpy (&mapped_crc, map + RSPAMD_HS_MAGIC_LEN, sizeof (mapped_crc));
+
+	if (mapped_crc != crc) {
+		msg_warn_re_cache ("outdated mapped hyperscan database in %s: "
+				"crc read %xL, crc expected %xL", path, mapped_crc, crc);
+		munmap (map, len);
+
+		return FALSE;
+	}
+
+	re_class->hs_db = (hs_database_t *)(map + RSPAMD_HS_MAPPED_HDR_LEN);
+	re_class->hs_map = map;
+	re_class->hs_map_len = len;
+
+	return TRUE;
+}
 #endif
-			if (pcre_flags & PCRE_FLAG(CASELESS)) {
-				hs_flags[i] |= HS_FLAG_CASELESS;
-			}
-			if (pcre_flags & PCRE_FLAG(MULTILINE)) {
-				hs_flags[i] |= HS_FLAG_MULTILINE;
-			}
-			if (pcre_flags & PCRE_FLAG(DOTALL)) {
-				hs_flags[i] |= HS_FLAG_DOTALL;
-			}
-			if (rspamd_regexp_get_maxhits (re) == 1) {
-				hs_flags[i] |= HS_FLAG_SINGLEMATCH;
-			}
 
-			if (hs_compile (rspamd_regexp_get_pattern (re),
-					hs_flags[i],
-					cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
-					&cache->plt,
-					&test_db,
-					&hs_errors) != HS_SUCCESS) {
-				msg_info_re_cache ("cannot compile %s to hyperscan, try prefilter match",
-						rspamd_regexp_get_pattern (re));
-				hs_free_compile_error (hs_errors);
+#ifdef WITH_HYPERSCAN
+/*
+ * Returns number of regexps stored in a valid hyperscan file
+ */
+static gint
+rspamd_re_cache_class_nregexps (struct rspamd_re_cache *cache,
+		const gchar *path)
+{
+	gint fd, n = 0;
 
-				/* The approximation operation might take a significant
-				 * amount of time, so we need to check if it's finite
-				 */
-				if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], max_time)) {
-					hs_flags[i] |= HS_FLAG_PREFILTER;
-					hs_ids[i] = rspamd_regexp_get_cache_id (re);
-					hs_pats[i] = rspamd_regexp_get_pattern (re);
-					i++;
-				}
-			}
-			else {
-				hs_ids[i] = rspamd_regexp_get_cache_id (re);
-				hs_pats[i] = rspamd_regexp_get_pattern (re);
-				i ++;
-				hs_free_database (test_db);
-			}
-		}
-		/* Adjust real re number */
-		n = i;
-
-		if (n > 0) {
-			/* Create the hs tree */
-			if (hs_compile_multi (hs_pats,
-					hs_flags,
-					hs_ids,
-					n,
-					cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
-					&cache->plt,
-					&test_db,
-					&hs_errors) != HS_SUCCESS) {
-
-				g_set_error (err, rspamd_re_cache_quark (), EINVAL,
-						"cannot create tree of regexp when processing '%s': %s",
-						hs_pats[hs_errors->expression], hs_errors->message);
-				g_free (hs_flags);
-				g_free (hs_ids);
-				g_free (hs_pats);
-				close (fd);
-				unlink (path);
-				hs_free_compile_error (hs_errors);
+	fd = open (path, O_RDONLY);
 
-				return -1;
-			}
+	if (fd == -1) {
+		return 0;
+	}
 
-			g_free (hs_pats);
+	if (lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET) == -1 ||
+			read (fd, &n, sizeof (n)) != sizeof (n)) {
+		n = 0;
+	}
 
-			if (hs_serialize_database (test_db, &hs_serialized,
-					&serialized_len) != HS_SUCCESS) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp for %s",
-						re_class->hash);
+	close (fd);
 
-				close (fd);
-				unlink (path);
-				g_free (hs_ids);
-				g_free (hs_flags);
-				hs_free_database (test_db);
+	return n;
+}
 
-				return -1;
-			}
+/*
+ * Compiles database for a single class, returns number of compiled regexps,
+ * 0 if the class already has a valid database and -1 on error
+ */
+static gint
+rspamd_re_cache_compile_class (struct rspamd_re_cache *cache,
+		const char *cache_dir, struct rspamd_re_class *re_class,
+		gdouble max_time, gboolean silent, GError **err)
+{
+	struct rspamd_re_cache_elt *elt;
+	gchar path[PATH_MAX], npath[PATH_MAX];
+	hs_database_t *test_db;
+	gint fd, i, n, pos, *hs_ids = NULL, pcre_flags, re_flags;
+	rspamd_cryptobox_fast_hash_state_t crc_st;
+	guint64 crc;
+	rspamd_regexp_t *re;
+	hs_compile_error_t *hs_errors;
+	guint *hs_flags = NULL;
+	const gchar **hs_pats = NULL;
+	gchar *hs_serialized;
+	gsize serialized_len;
+	struct iovec iov[7];
 
-			hs_free_database (test_db);
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
 
-			/*
-			 * Magic - 8 bytes
-			 * Platform - sizeof (platform)
-			 * n - number of regexps
-			 * n * <regexp ids>
-			 * n * <regexp flags>
-			 * crc - 8 bytes checksum
-			 * <hyperscan blob>
-			 */
-			rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
-			/* IDs -> Flags -> Hs blob */
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_ids, sizeof (*hs_ids) * n);
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_flags, sizeof (*hs_flags) * n);
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_serialized, serialized_len);
-			crc = rspamd_cryptobox_fast_hash_final (&crc_st);
-
-			if (cache->vectorized_hyperscan) {
-				iov[0].iov_base = (void *) rspamd_hs_magic_vector;
-			}
-			else {
-				iov[0].iov_base = (void *) rspamd_hs_magic;
-			}
+	if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE)) {
 
-			iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
-			iov[1].iov_base = &cache->plt;
-			iov[1].iov_len = sizeof (cache->plt);
-			iov[2].iov_base = &n;
-			iov[2].iov_len = sizeof (n);
-			iov[3].iov_base = hs_ids;
-			iov[3].iov_len = sizeof (*hs_ids) * n;
-			iov[4].iov_base = hs_flags;
-			iov[4].iov_len = sizeof (*hs_flags) * n;
-			iov[5].iov_base = &crc;
-			iov[5].iov_len = sizeof (crc);
-			iov[6].iov_base = hs_serialized;
-			iov[6].iov_len = serialized_len;
-
-			if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp to %s: %s",
-						path, strerror (errno));
-				close (fd);
-				unlink (path);
-				g_free (hs_ids);
-				g_free (hs_flags);
-				g_free (hs_serialized);
+		fd = open (path, O_RDONLY, 00600);
 
-				return -1;
-			}
+		/* Read number of regexps */
+		g_assert (fd != -1);
+		lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET);
+		read (fd, &n, sizeof (n));
+		close (fd);
+
+		if (cache->mmap_hyperscan &&
+				!rspamd_re_cache_ensure_mapped (cache, cache_dir, re_class,
+						err)) {
+			return -1;
+		}
 
-			if (re_class->type_len > 0) {
+		if (re_class->type_len > 0) {
+			if (!silent) {
 				msg_info_re_cache (
-						"compiled class %s(%*s) to cache %6s, %d regexps",
+						"skip already valid class %s(%*s) to cache %6s, %d regexps",
 						rspamd_re_cache_type_to_string (re_class->type),
 						(gint) re_class->type_len - 1,
 						re_class->type_data,
 						re_class->hash,
 						n);
 			}
-			else {
+		}
+		else {
+			if (!silent) {
 				msg_info_re_cache (
-						"compiled class %s to cache %6s, %d regexps",
+						"skip already valid class %s to cache %6s, %d regexps",
 						rspamd_re_cache_type_to_string (re_class->type),
 						re_class->hash,
 						n);
 			}
+		}
 
-			total += n;
+		return 0;
+	}
 
-			g_free (hs_serialized);
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cache_dir,
+					G_DIR_SEPARATOR, re_class->hash);
+	fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
+				"%s: %s", path, strerror (errno));
+		return -1;
+	}
+
+	n = re_class->cache_ids->len;
+	hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
+	hs_ids = g_malloc (sizeof (*hs_ids) * n);
+	hs_pats = g_malloc (sizeof (*hs_pats) * n);
+	i = 0;
+
+	for (pos = 0; pos < (gint)re_class->cache_ids->len; pos ++) {
+		elt = g_ptr_array_index (cache->re,
+				g_array_index (re_class->cache_ids, gint, pos));
+		re = elt->re;
+
+		pcre_flags = rspamd_regexp_get_pcre_flags (re);
+		re_flags = rspamd_regexp_get_flags (re);
+
+		if (re_flags & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
+			/* Do not try to compile bad regexp */
+			msg_info_re_cache (
+					"do not try compile %s to hyperscan as it is PCRE only",
+					rspamd_regexp_get_pattern (re));
+			continue;
+		}
+
+		hs_flags[i] = 0;
+#ifndef WITH_PCRE2
+		if (pcre_flags & PCRE_FLAG(UTF8)) {
+			hs_flags[i] |= HS_FLAG_UTF8;
+		}
+#else
+		if (pcre_flags & PCRE_FLAG(UTF)) {
+			hs_flags[i] |= HS_FLAG_UTF8;
+		}
+#endif
+		if (pcre_flags & PCRE_FLAG(CASELESS)) {
+			hs_flags[i] |= HS_FLAG_CASELESS;
+		}
+		if (pcre_flags & PCRE_FLAG(MULTILINE)) {
+			hs_flags[i] |= HS_FLAG_MULTILINE;
+		}
+		if (pcre_flags & PCRE_FLAG(DOTALL)) {
+			hs_flags[i] |= HS_FLAG_DOTALL;
+		}
+		if (rspamd_regexp_get_maxhits (re) == 1) {
+			hs_flags[i] |= HS_FLAG_SINGLEMATCH;
+		}
+
+		if (hs_compile (rspamd_regexp_get_pattern (re),
+				hs_flags[i],
+				rspamd_re_cache_class_vectored (cache, re_class) ?
+						HS_MODE_VECTORED : HS_MODE_BLOCK,
+				&cache->plt,
+				&test_db,
+				&hs_errors) != HS_SUCCESS) {
+			msg_info_re_cache ("cannot compile %s to hyperscan, try prefilter match",
+					rspamd_regexp_get_pattern (re));
+			hs_free_compile_error (hs_errors);
+
+			/* The approximation operation might take a significant
+			 * amount of time, so we need to check if it's finite
+			 */
+			if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], max_time)) {
+				hs_flags[i] |= HS_FLAG_PREFILTER;
+				hs_ids[i] = pos;
+				hs_pats[i] = rspamd_regexp_get_pattern (re);
+				i++;
+			}
+		}
+		else {
+			hs_ids[i] = pos;
+			hs_pats[i] = rspamd_regexp_get_pattern (re);
+			i ++;
+			hs_free_database (test_db);
+		}
+	}
+	/* Adjust real re number */
+	n = i;
+
+	if (n > 0) {
+		/* Create the hs tree */
+		if (hs_compile_multi (hs_pats,
+				hs_flags,
+				hs_ids,
+				n,
+				rspamd_re_cache_class_vectored (cache, re_class) ?
+						HS_MODE_VECTORED : HS_MODE_BLOCK,
+				&cache->plt,
+				&test_db,
+				&hs_errors) != HS_SUCCESS) {
+
+			g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+					"cannot create tree of regexp when processing '%s': %s",
+					hs_pats[hs_errors->expression], hs_errors->message);
+			g_free (hs_flags);
+			g_free (hs_ids);
+			g_free (hs_pats);
+			close (fd);
+			unlink (path);
+			hs_free_compile_error (hs_errors);
+
+			return -1;
+		}
+
+		g_free (hs_pats);
+
+		if (hs_serialize_database (test_db, &hs_serialized,
+				&serialized_len) != HS_SUCCESS) {
+			g_set_error (err,
+					rspamd_re_cache_quark (),
+					errno,
+					"cannot serialize tree of regexp for %s",
+					re_class->hash);
+
+			close (fd);
+			unlink (path);
 			g_free (hs_ids);
 			g_free (hs_flags);
+			hs_free_database (test_db);
+
+			return -1;
 		}
 
-		fsync (fd);
+		hs_free_database (test_db);
 
-		/* Now rename temporary file to the new .hs file */
-		rspamd_snprintf (npath, sizeof (path), "%s%c%s.hs", cache_dir,
-				G_DIR_SEPARATOR, re_class->hash);
+		/*
+		 * Magic - 8 bytes
+		 * Platform - sizeof (platform)
+		 * n - number of regexps
+		 * n * <regexp ids>
+		 * n * <regexp flags>
+		 * crc - 8 bytes checksum
+		 * <hyperscan blob>
+		 */
+		rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
+		/* IDs -> Flags -> Hs blob */
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_ids, sizeof (*hs_ids) * n);
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_flags, sizeof (*hs_flags) * n);
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_serialized, serialized_len);
+		crc = rspamd_cryptobox_fast_hash_final (&crc_st);
+
+		if (rspamd_re_cache_class_vectored (cache, re_class)) {
+			iov[0].iov_base = (void *) rspamd_hs_magic_vector;
+		}
+		else {
+			iov[0].iov_base = (void *) rspamd_hs_magic;
+		}
 
-		if (rename (path, npath) == -1) {
+		iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
+		iov[1].iov_base = &cache->plt;
+		iov[1].iov_len = sizeof (cache->plt);
+		iov[2].iov_base = &n;
+		iov[2].iov_len = sizeof (n);
+		iov[3].iov_base = hs_ids;
+		iov[3].iov_len = sizeof (*hs_ids) * n;
+		iov[4].iov_base = hs_flags;
+		iov[4].iov_len = sizeof (*hs_flags) * n;
+		iov[5].iov_base = &crc;
+		iov[5].iov_len = sizeof (crc);
+		iov[6].iov_base = hs_serialized;
+		iov[6].iov_len = serialized_len;
+
+		if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
 			g_set_error (err,
 					rspamd_re_cache_quark (),
 					errno,
-					"cannot rename %s to %s: %s",
-					path, npath, strerror (errno));
+					"cannot serialize tree of regexp to %s: %s",
+					path, strerror (errno));
+			close (fd);
 			unlink (path);
+			g_free (hs_ids);
+			g_free (hs_flags);
+			g_free (hs_serialized);
+
+			return -1;
+		}
+
+		if (cache->mmap_hyperscan &&
+				!rspamd_re_cache_save_mapped (cache, cache_dir, re_class,
+						hs_serialized, serialized_len, crc, err)) {
 			close (fd);
+			unlink (path);
+			g_free (hs_ids);
+			g_free (hs_flags);
+			g_free (hs_serialized);
 
 			return -1;
 		}
 
+		if (re_class->type_len > 0) {
+			msg_info_re_cache (
+					"compiled class %s(%*s) to cache %6s, %d regexps",
+					rspamd_re_cache_type_to_string (re_class->type),
+					(gint) re_class->type_len - 1,
+					re_class->type_data,
+					re_class->hash,
+					n);
+		}
+		else {
+			msg_info_re_cache (
+					"compiled class %s to cache %6s, %d regexps",
+					rspamd_re_cache_type_to_string (re_class->type),
+					re_class->hash,
+					n);
+		}
+
+		g_free (hs_serialized);
+		g_free (hs_ids);
+		g_free (hs_flags);
+	}
+
+	fsync (fd);
+
+	/* Now rename temporary file to the new .hs file */
+	rspamd_snprintf (npath, sizeof (path), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+
+	if (rename (path, npath) == -1) {
+		g_set_error (err,
+				rspamd_re_cache_quark (),
+				errno,
+				"cannot rename %s to %s: %s",
+				path, npath, strerror (errno));
+		unlink (path);
 		close (fd);
+
+		return -1;
+	}
+
+	close (fd);
+
+	return n;
+}
+#endif
+
+gint
+rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
+		const char *cache_dir, gdouble max_time, gboolean silent,
+		GError **err)
+{
+	g_assert (cache != NULL);
+	g_assert (cache_dir != NULL);
+
+#ifndef WITH_HYPERSCAN
+	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
+	return -1;
+#else
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	gint n;
+	gsize total = 0;
+
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+		n = rspamd_re_cache_compile_class (cache, cache_dir, re_class,
+				max_time, silent, err);
+
+		if (n == -1) {
+			return -1;
+		}
+
+		total += n;
+	}
+
+	return total;
+#endif
+}
+
+gint
+rspamd_re_cache_compile_hyperscan_parallel (struct rspamd_re_cache *cache,
+		const char *cache_dir, gdouble max_time, gboolean silent,
+		guint max_procs, rspamd_re_cache_class_compiled_cb cb, gpointer ud,
+		GError **err)
+{
+	g_assert (cache != NULL);
+	g_assert (cache_dir != NULL);
+
+#ifndef WITH_HYPERSCAN
+	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
+	return -1;
+#else
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	GHashTable *running;
+	GError *cerr;
+	gchar path[PATH_MAX];
+	gboolean exhausted = FALSE;
+	gint n, status, nfailed = 0;
+	gsize total = 0;
+	pid_t cld;
+
+	running = g_hash_table_new (g_direct_hash, g_direct_equal);
+	/* We need to wait for our compilers */
+	signal (SIGCHLD, SIG_DFL);
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	for (;;) {
+		while (!exhausted && g_hash_table_size (running) < MAX (max_procs, 1)) {
+			if (!g_hash_table_iter_next (&it, &k, &v)) {
+				exhausted = TRUE;
+				break;
+			}
+
+			re_class = v;
+			rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+					G_DIR_SEPARATOR, re_class->hash);
+
+			if (max_procs <= 1 ||
+					rspamd_re_cache_is_valid_hyperscan_file (cache, path,
+							TRUE, TRUE)) {
+				/* Nothing to compile or no parallelism, do it in place */
+				cerr = NULL;
+				n = rspamd_re_cache_compile_class (cache, cache_dir, re_class,
+						max_time, silent, &cerr);
+
+				if (n == -1) {
+					msg_err_re_cache ("cannot compile class %s: %e",
+							re_class->hash, cerr);
+					g_error_free (cerr);
+					nfailed ++;
+				}
+				else if (n > 0) {
+					total += n;
+
+					if (cb) {
+						cb (cache, re_class->hash, n, ud);
+					}
+				}
+
+				continue;
+			}
+
+			cld = fork ();
+
+			if (cld == -1) {
+				msg_err_re_cache ("cannot fork compiler for class %s: %s",
+						re_class->hash, strerror (errno));
+				nfailed ++;
+				continue;
+			}
+			else if (cld == 0) {
+				cerr = NULL;
+
+				if (rspamd_re_cache_compile_class (cache, cache_dir, re_class,
+						max_time, silent, &cerr) == -1) {
+					msg_err_re_cache ("cannot compile class %s: %e",
+							re_class->hash, cerr);
+					exit (EXIT_FAILURE);
+				}
+
+				exit (EXIT_SUCCESS);
+			}
+
+			g_hash_table_insert (running, GINT_TO_POINTER (cld), re_class);
+		}
+
+		if (g_hash_table_size (running) == 0) {
+			break;
+		}
+
+		cld = waitpid (-1, &status, 0);
+
+		if (cld == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			msg_err_re_cache ("cannot wait for compilers: %s", strerror (errno));
+			nfailed += g_hash_table_size (running);
+			break;
+		}
+
+		re_class = g_hash_table_lookup (running, GINT_TO_POINTER (cld));
+
+		if (re_class == NULL) {
+			continue;
+		}
+
+		g_hash_table_remove (running, GINT_TO_POINTER (cld));
+
+		if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS) {
+			msg_err_re_cache ("compiler of class %s has failed", re_class->hash);
+			nfailed ++;
+			continue;
+		}
+
+		/* Compiler has written a new database, read its size */
+		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+				G_DIR_SEPARATOR, re_class->hash);
+
+		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, FALSE)) {
+			n = rspamd_re_cache_class_nregexps (cache, path);
+			total += n;
+
+			if (n > 0 && cb) {
+				cb (cache, re_class->hash, n, ud);
+			}
+		}
+	}
+
+	g_hash_table_unref (running);
+	signal (SIGCHLD, SIG_IGN);
+
+	if (nfailed > 0) {
+		g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+				"cannot compile %d classes", nfailed);
+
+		return -1;
 	}
 
 	return total;
@@ -1708,7 +2920,7 @@ rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 				return FALSE;
 			}
 
-			if (cache->vectorized_hyperscan) {
+			if (rspamd_re_cache_class_vectored (cache, re_class)) {
 				mb = rspamd_hs_magic_vector;
 			}
 			else {
@@ -1825,6 +3037,182 @@ rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 }
 
 
+#ifdef WITH_HYPERSCAN
+static void
+rspamd_re_cache_reset_class (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class)
+{
+	struct rspamd_re_cache_elt *elt;
+	guint i;
+
+	/* Fallback to pcre for all regexps in class */
+	for (i = 0; i < re_class->nhs; i ++) {
+		elt = g_ptr_array_index (cache->re, re_class->hs_ids[i]);
+		elt->match_type = RSPAMD_RE_CACHE_PCRE;
+	}
+
+	if (re_class->hs_scratch != NULL) {
+		hs_free_scratch (re_class->hs_scratch);
+	}
+
+	rspamd_re_cache_free_class_db (re_class);
+
+	if (re_class->hs_ids) {
+		g_free (re_class->hs_ids);
+	}
+
+	re_class->hs_ids = NULL;
+	re_class->hs_scratch = NULL;
+	re_class->nhs = 0;
+	re_class->hs_crc = 0;
+}
+
+static gboolean
+rspamd_re_cache_load_class (struct rspamd_re_cache *cache,
+		const char *cache_dir,
+		struct rspamd_re_class *re_class,
+		gint *nloaded)
+{
+	gchar path[PATH_MAX];
+	gint fd, i, n, *hs_ids = NULL, *hs_flags = NULL, ret;
+	guint8 *map, *p, *end;
+	struct rspamd_re_cache_elt *elt;
+	struct stat st;
+	guint64 crc;
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+
+	if (!rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, FALSE)) {
+		msg_info_re_cache ("no valid hyperscan database for class %s, "
+				"use pcre for it", re_class->hash);
+		rspamd_re_cache_reset_class (cache, re_class);
+
+		return FALSE;
+	}
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1 || fstat (fd, &st) == -1) {
+		msg_err_re_cache ("cannot open %s: %s", path, strerror (errno));
+
+		if (fd != -1) {
+			close (fd);
+		}
+
+		return FALSE;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err_re_cache ("cannot mmap %s: %s", path, strerror (errno));
+		close (fd);
+
+		return FALSE;
+	}
+
+	close (fd);
+	end = map + st.st_size;
+	p = map + RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt);
+	n = *(gint *)p;
+
+	if (n <= 0 || 2 * n * sizeof (gint) + /* IDs + flags */
+					sizeof (guint64) + /* crc */
+					RSPAMD_HS_MAGIC_LEN + /* header */
+					sizeof (cache->plt) > (gsize)st.st_size) {
+		/* Some wrong amount of regexps */
+		msg_err_re_cache ("bad number of expressions in %s: %d",
+				path, n);
+		munmap (map, st.st_size);
+
+		return FALSE;
+	}
+
+	p += sizeof (n);
+	memcpy (&crc, p + n * sizeof (gint) * 2, sizeof (crc));
+
+	if (re_class->hs_db != NULL && re_class->hs_crc == crc) {
+		/* Class has not been changed, keep the current database */
+		msg_debug_re_cache ("hyperscan database for '%s' is up to date",
+				re_class->hash);
+		munmap (map, st.st_size);
+		*nloaded = n;
+
+		return TRUE;
+	}
+
+	hs_ids = g_malloc (n * sizeof (*hs_ids));
+	memcpy (hs_ids, p, n * sizeof (*hs_ids));
+	p += n * sizeof (*hs_ids);
+	hs_flags = g_malloc (n * sizeof (*hs_flags));
+	memcpy (hs_flags, p, n * sizeof (*hs_flags));
+	p += n * sizeof (*hs_flags) + sizeof (crc);
+
+	/* Convert positions in class to global ids */
+	for (i = 0; i < n; i ++) {
+		if (hs_ids[i] < 0 || hs_ids[i] >= (gint)re_class->cache_ids->len) {
+			msg_err_re_cache ("bad expression id in %s: %d", path, hs_ids[i]);
+			munmap (map, st.st_size);
+			g_free (hs_ids);
+			g_free (hs_flags);
+
+			return FALSE;
+		}
+
+		hs_ids[i] = g_array_index (re_class->cache_ids, gint, hs_ids[i]);
+	}
+
+	/* Cleanup */
+	rspamd_re_cache_reset_class (cache, re_class);
+
+	if (cache->mmap_hyperscan &&
+			rspamd_re_cache_load_mapped (cache, cache_dir, re_class,
+					(const gchar *)p, end - p, crc)) {
+		msg_debug_re_cache ("use mapped hyperscan database for '%s'",
+				re_class->hash);
+	}
+	else if ((ret = hs_deserialize_database (p, end - p,
+			&re_class->hs_db)) != HS_SUCCESS) {
+		msg_err_re_cache ("bad hs database in %s: %d", path, ret);
+		munmap (map, st.st_size);
+		g_free (hs_ids);
+		g_free (hs_flags);
+
+		return FALSE;
+	}
+
+	munmap (map, st.st_size);
+
+	g_assert (hs_alloc_scratch (re_class->hs_db,
+			&re_class->hs_scratch) == HS_SUCCESS);
+
+	/*
+	 * Now find hyperscan elts that are successfully compiled and
+	 * specify that they should be matched using hyperscan
+	 */
+	for (i = 0; i < n; i ++) {
+		g_assert ((gint)cache->re->len > hs_ids[i] && hs_ids[i] >= 0);
+		elt = g_ptr_array_index (cache->re, hs_ids[i]);
+
+		if (hs_flags[i] & HS_FLAG_PREFILTER) {
+			elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN_PRE;
+		}
+		else {
+			elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN;
+		}
+	}
+
+	re_class->hs_ids = hs_ids;
+	g_free (hs_flags);
+	re_class->nhs = n;
+	re_class->hs_crc = crc;
+	*nloaded = n;
+
+	return TRUE;
+}
+#endif
+
 gboolean
 rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir)
@@ -1835,129 +3223,107 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 #ifndef WITH_HYPERSCAN
 	return FALSE;
 #else
-	gchar path[PATH_MAX];
-	gint fd, i, n, *hs_ids = NULL, *hs_flags = NULL, total = 0, ret;
+	gint total = 0, n;
+	guint nclasses = 0, nfailed = 0;
 	GHashTableIter it;
 	gpointer k, v;
-	guint8 *map, *p, *end;
 	struct rspamd_re_class *re_class;
-	struct rspamd_re_cache_elt *elt;
-	struct stat st;
 
 	g_hash_table_iter_init (&it, cache->re_classes);
 
+	/*
+	 * Each class is loaded independently: classes without valid database
+	 * (e.g. still being compiled) are matched by pcre meanwhile, and
+	 * unchanged classes keep their current database
+	 */
 	while (g_hash_table_iter_next (&it, &k, &v)) {
 		re_class = v;
-		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
-				G_DIR_SEPARATOR, re_class->hash);
+		nclasses ++;
+		n = 0;
 
-		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, FALSE, FALSE)) {
-			msg_debug_re_cache ("load hyperscan database from '%s'",
-					re_class->hash);
-
-			fd = open (path, O_RDONLY);
+		if (rspamd_re_cache_load_class (cache, cache_dir, re_class, &n)) {
+			total += n;
+		}
+		else {
+			nfailed ++;
+		}
+	}
 
-			/* Read number of regexps */
-			g_assert (fd != -1);
-			fstat (fd, &st);
+	if (nfailed > 0) {
+		msg_info_re_cache ("hyperscan database of %d regexps has been "
+				"partially loaded: %ud of %ud classes are missing", total,
+				nfailed, nclasses);
+		cache->hyperscan_loaded = FALSE;
+		/* Still use hs for the loaded classes */
+		cache->has_partial_hs = (nfailed < nclasses);
 
-			map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		return FALSE;
+	}
 
-			if (map == MAP_FAILED) {
-				msg_err_re_cache ("cannot mmap %s: %s", path, strerror (errno));
-				close (fd);
-				return FALSE;
-			}
+	msg_info_re_cache ("hyperscan database of %d regexps has been loaded", total);
+	cache->hyperscan_loaded = TRUE;
+	cache->has_partial_hs = TRUE;
 
-			close (fd);
-			end = map + st.st_size;
-			p = map + RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt);
-			n = *(gint *)p;
-
-			if (n <= 0 || 2 * n * sizeof (gint) + /* IDs + flags */
-							sizeof (guint64) + /* crc */
-							RSPAMD_HS_MAGIC_LEN + /* header */
-							sizeof (cache->plt) > (gsize)st.st_size) {
-				/* Some wrong amount of regexps */
-				msg_err_re_cache ("bad number of expressions in %s: %d",
-						path, n);
-				munmap (map, st.st_size);
-				return FALSE;
-			}
+	return TRUE;
+#endif
+}
 
-			total += n;
-			p += sizeof (n);
-			hs_ids = g_malloc (n * sizeof (*hs_ids));
-			memcpy (hs_ids, p, n * sizeof (*hs_ids));
-			p += n * sizeof (*hs_ids);
-			hs_flags = g_malloc (n * sizeof (*hs_flags));
-			memcpy (hs_flags, p, n * sizeof (*hs_flags));
-
-			/* Skip crc */
-			p += n * sizeof (*hs_ids) + sizeof (guint64);
-
-			/* Cleanup */
-			if (re_class->hs_scratch != NULL) {
-				hs_free_scratch (re_class->hs_scratch);
-			}
+gboolean
+rspamd_re_cache_load_hyperscan_class (struct rspamd_re_cache *cache,
+		const char *cache_dir, const gchar *class_hash)
+{
+	g_assert (cache != NULL);
+	g_assert (cache_dir != NULL);
 
-			if (re_class->hs_db != NULL) {
-				hs_free_database (re_class->hs_db);
-			}
+#ifndef WITH_HYPERSCAN
+	return FALSE;
+#else
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class, *found = NULL;
+	guint nclasses = 0, nloaded = 0;
+	gint n = 0;
+	gboolean ret;
 
-			if (re_class->hs_ids) {
-				g_free (re_class->hs_ids);
-			}
+	g_hash_table_iter_init (&it, cache->re_classes);
 
-			re_class->hs_ids = NULL;
-			re_class->hs_scratch = NULL;
-			re_class->hs_db = NULL;
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
 
-			if ((ret = hs_deserialize_database (p, end - p, &re_class->hs_db))
-					!= HS_SUCCESS) {
-				msg_err_re_cache ("bad hs database in %s: %d", path, ret);
-				munmap (map, st.st_size);
-				g_free (hs_ids);
-				g_free (hs_flags);
+		if (strcmp (re_class->hash, class_hash) == 0) {
+			found = re_class;
+			break;
+		}
+	}
 
-				return FALSE;
-			}
+	if (found == NULL) {
+		/* Class is from a different configuration */
+		msg_debug_re_cache ("unknown class %s", class_hash);
+		return FALSE;
+	}
 
-			munmap (map, st.st_size);
+	ret = rspamd_re_cache_load_class (cache, cache_dir, found, &n);
 
-			g_assert (hs_alloc_scratch (re_class->hs_db,
-					&re_class->hs_scratch) == HS_SUCCESS);
+	if (ret) {
+		msg_info_re_cache ("hyperscan database of %d regexps has been "
+				"loaded for class %s", n, found->hash);
+	}
 
-			/*
-			 * Now find hyperscan elts that are successfully compiled and
-			 * specify that they should be matched using hyperscan
-			 */
-			for (i = 0; i < n; i ++) {
-				g_assert ((gint)cache->re->len > hs_ids[i] && hs_ids[i] >= 0);
-				elt = g_ptr_array_index (cache->re, hs_ids[i]);
+	/* Update state of the whole cache */
+	g_hash_table_iter_init (&it, cache->re_classes);
 
-				if (hs_flags[i] & HS_FLAG_PREFILTER) {
-					elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN_PRE;
-				}
-				else {
-					elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN;
-				}
-			}
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+		nclasses ++;
 
-			re_class->hs_ids = hs_ids;
-			g_free (hs_flags);
-			re_class->nhs = n;
-		}
-		else {
-			msg_err_re_cache ("invalid hyperscan hash file '%s'",
-					path);
-			return FALSE;
+		if (re_class->hs_db != NULL) {
+			nloaded ++;
 		}
 	}
 
-	msg_info_re_cache ("hyperscan database of %d regexps has been loaded", total);
-	cache->hyperscan_loaded = TRUE;
+	cache->hyperscan_loaded = (nloaded == nclasses);
+	cache->has_partial_hs = (nloaded > 0);
 
-	return TRUE;
+	return ret;
 #endif
 }
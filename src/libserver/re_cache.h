@@ -45,6 +45,7 @@ struct rspamd_re_cache_stat {
 	guint regexp_matched;
 	guint regexp_total;
 	guint regexp_fast_cached;
+	guint regexp_prefiltered;
 };
 
 /**
@@ -140,6 +141,13 @@ struct rspamd_re_cache *rspamd_re_cache_ref (struct rspamd_re_cache *cache);
  */
 guint rspamd_re_cache_set_limit (struct rspamd_re_cache *cache, guint limit);
 
+/**
+ * Scan head, tail and windows around urls and boundaries of body data longer
+ * than the limit instead of its prefix, returns previous setting
+ */
+gboolean rspamd_re_cache_set_sampling (struct rspamd_re_cache *cache,
+		gboolean sample);
+
 /**
  * Convert re type to a human readable string (constant one)
  */
@@ -157,6 +165,22 @@ gint rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir, gdouble max_time, gboolean silent,
 		GError **err);
 
+typedef void (*rspamd_re_cache_class_compiled_cb) (
+		struct rspamd_re_cache *cache,
+		const gchar *class_hash,
+		gint nregexps,
+		gpointer ud);
+
+/**
+ * Compile expressions to the hyperscan tree using up to `max_procs` forked
+ * processes, each process compiles a single class. Callback is called
+ * when a new database for some class is stored in the `cache_dir`
+ */
+gint rspamd_re_cache_compile_hyperscan_parallel (struct rspamd_re_cache *cache,
+		const char *cache_dir, gdouble max_time, gboolean silent,
+		guint max_procs, rspamd_re_cache_class_compiled_cb cb, gpointer ud,
+		GError **err);
+
 
 /**
  * Returns TRUE if the specified file is valid hyperscan cache
@@ -165,8 +189,18 @@ gboolean rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 		const char *path, gboolean silent, gboolean try_load);
 
 /**
- * Loads all hyperscan regexps precompiled
+ * Loads all hyperscan regexps precompiled. Each class is loaded independently,
+ * classes that have no valid database are matched by pcre and unchanged
+ * classes keep their current database.
+ * @return TRUE if databases for all classes have been loaded
  */
 gboolean rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir);
+
+/**
+ * Loads precompiled database for a single class
+ * @return TRUE if database for this class has been loaded
+ */
+gboolean rspamd_re_cache_load_hyperscan_class (struct rspamd_re_cache *cache,
+		const char *cache_dir, const gchar *class_hash);
 #endif
@@ -22,6 +22,7 @@
 #include "contrib/hiredis/async.h"
 #include "contrib/hiredis/adapters/libevent.h"
 #include "cryptobox.h"
+#include "str_util.h"
 #include "logger.h"
 
 struct rspamd_redis_pool_elt;
@@ -32,6 +33,12 @@ struct rspamd_redis_pool_connection {
 	GList *entry;
 	struct event timeout;
 	gboolean active;
+	/* Number of users of a shared connection */
+	guint nusers;
+	/* Shared connection cannot be reused after a fatal error of any user */
+	gboolean doomed;
+	struct event batch_ev;
+	GHashTable *scripts;
 	gchar tag[MEMPOOL_UID_LEN];
 	ref_entry_t ref;
 };
@@ -41,6 +48,25 @@ struct rspamd_redis_pool_elt {
 	guint64 key;
 	GQueue *active;
 	GQueue *inactive;
+	/* Connection shared by requests issued in the current event loop tick */
+	struct rspamd_redis_pool_connection *shared;
+};
+
+struct rspamd_redis_cluster_node {
+	gchar *ip;
+	gint port;
+};
+
+/* Slots map of a redis cluster identified by its seed address */
+struct rspamd_redis_cluster {
+	struct rspamd_redis_pool *pool;
+	guint64 key;
+	GPtrArray *nodes;
+	gchar *db;
+	gchar *password;
+	gboolean refreshing;
+	/* Node index + 1, zero means unknown owner */
+	guint16 slots[RSPAMD_REDIS_CLUSTER_SLOTS];
 };
 
 struct rspamd_redis_pool {
@@ -48,6 +74,7 @@ struct rspamd_redis_pool {
 	struct rspamd_config *cfg;
 	GHashTable *elts_by_key;
 	GHashTable *elts_by_ctx;
+	GHashTable *clusters;
 	gdouble timeout;
 	guint max_conns;
 };
@@ -97,6 +124,11 @@ rspamd_redis_pool_get_key (const gchar *db, const gchar *password,
 static void
 rspamd_redis_pool_conn_dtor (struct rspamd_redis_pool_connection *conn)
 {
+	if (conn->elt->shared == conn) {
+		event_del (&conn->batch_ev);
+		conn->elt->shared = NULL;
+	}
+
 	if (conn->active) {
 		msg_debug_rpool ("active connection removed");
 
@@ -143,9 +175,32 @@ rspamd_redis_pool_conn_dtor (struct rspamd_redis_pool_connection *conn)
 		g_list_free (conn->entry);
 	}
 
+	if (conn->scripts) {
+		g_hash_table_unref (conn->scripts);
+	}
+
 	g_slice_free1 (sizeof (*conn), conn);
 }
 
+static void
+rspamd_redis_cluster_dtor (gpointer p)
+{
+	struct rspamd_redis_cluster *cluster = p;
+	struct rspamd_redis_cluster_node *node;
+	guint i;
+
+	for (i = 0; i < cluster->nodes->len; i ++) {
+		node = g_ptr_array_index (cluster->nodes, i);
+		g_free (node->ip);
+		g_slice_free1 (sizeof (*node), node);
+	}
+
+	g_ptr_array_free (cluster->nodes, TRUE);
+	g_free (cluster->db);
+	g_free (cluster->password);
+	g_free (cluster);
+}
+
 static void
 rspamd_redis_pool_elt_dtor (gpointer p)
 {
@@ -204,7 +259,8 @@ rspamd_redis_pool_schedule_timeout (struct rspamd_redis_pool_connection *conn)
 	double_to_tv (real_timeout, &tv);
 	event_set (&conn->timeout, -1, EV_TIMEOUT, rspamd_redis_conn_timeout, conn);
 	event_base_set (conn->elt->pool->ev_base, &conn->timeout);
-	event_add (&conn->timeout, &tv);
+	event_add (&conn->timeout,
+			rspamd_event_common_tv (conn->elt->pool->ev_base, &tv));
 }
 
 static void
@@ -308,6 +364,8 @@ rspamd_redis_pool_init (void)
 	pool->elts_by_key = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL,
 			rspamd_redis_pool_elt_dtor);
 	pool->elts_by_ctx = g_hash_table_new (g_direct_hash, g_direct_equal);
+	pool->clusters = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL,
+			rspamd_redis_cluster_dtor);
 
 	return pool;
 }
@@ -389,6 +447,71 @@ rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
 	return conn->ctx;
 }
 
+static void
+rspamd_redis_pool_batch_end (gint fd, short what, gpointer p)
+{
+	struct rspamd_redis_pool_connection *conn = p;
+
+	if (conn->elt->shared == conn) {
+		msg_debug_rpool ("finished batch of %d requests", conn->nusers);
+		conn->elt->shared = NULL;
+	}
+}
+
+struct redisAsyncContext*
+rspamd_redis_pool_connect_shared (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port)
+{
+	guint64 key;
+	struct rspamd_redis_pool_elt *elt;
+	struct rspamd_redis_pool_connection *conn;
+	struct redisAsyncContext *ctx;
+	struct timeval tv;
+
+	g_assert (pool != NULL);
+	g_assert (ip != NULL);
+
+	key = rspamd_redis_pool_get_key (db, password, ip, port);
+	elt = g_hash_table_lookup (pool->elts_by_key, &key);
+
+	if (elt && elt->shared) {
+		conn = elt->shared;
+
+		if (conn->ctx && conn->ctx->err == REDIS_OK && !conn->doomed) {
+			conn->nusers ++;
+			REF_RETAIN (conn);
+			msg_debug_rpool ("added request to batch to %s:%d", ip, port);
+
+			return conn->ctx;
+		}
+
+		event_del (&conn->batch_ev);
+		elt->shared = NULL;
+	}
+
+	ctx = rspamd_redis_pool_connect (pool, db, password, ip, port);
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	conn = g_hash_table_lookup (pool->elts_by_ctx, ctx);
+	g_assert (conn != NULL);
+	conn->nusers = 1;
+	conn->elt->shared = conn;
+
+	/* Commands issued before the next loop iteration share this connection */
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	event_set (&conn->batch_ev, -1, EV_TIMEOUT, rspamd_redis_pool_batch_end,
+			conn);
+	event_base_set (pool->ev_base, &conn->batch_ev);
+	event_add (&conn->batch_ev, &tv);
+
+	return ctx;
+}
+
 
 void
 rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
@@ -403,6 +526,32 @@ rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
 	if (conn != NULL) {
 		g_assert (conn->active);
 
+		if (conn->nusers > 1) {
+			/* Connection is still used by other requests of its batch */
+			conn->nusers --;
+
+			if (is_fatal || ctx->err != REDIS_OK) {
+				conn->doomed = TRUE;
+			}
+
+			REF_RELEASE (conn);
+
+			return;
+		}
+
+		if (conn->nusers > 0) {
+			conn->nusers = 0;
+
+			if (conn->elt->shared == conn) {
+				event_del (&conn->batch_ev);
+				conn->elt->shared = NULL;
+			}
+
+			if (conn->doomed) {
+				is_fatal = TRUE;
+			}
+		}
+
 		if (is_fatal || ctx->err != REDIS_OK) {
 			/* We need to terminate connection forcefully */
 			msg_debug_rpool ("closed connection forcefully");
@@ -431,6 +580,323 @@ rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
 	}
 }
 
+const gchar *
+rspamd_redis_pool_get_script (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx, const gchar *name)
+{
+	struct rspamd_redis_pool_connection *conn;
+
+	g_assert (pool != NULL);
+	g_assert (ctx != NULL);
+
+	conn = g_hash_table_lookup (pool->elts_by_ctx, ctx);
+
+	if (conn != NULL && conn->scripts != NULL) {
+		return g_hash_table_lookup (conn->scripts, name);
+	}
+
+	return NULL;
+}
+
+void
+rspamd_redis_pool_set_script (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx, const gchar *name, const gchar *sha)
+{
+	struct rspamd_redis_pool_connection *conn;
+
+	g_assert (pool != NULL);
+	g_assert (ctx != NULL);
+
+	conn = g_hash_table_lookup (pool->elts_by_ctx, ctx);
+
+	if (conn == NULL) {
+		return;
+	}
+
+	if (sha == NULL) {
+		if (conn->scripts) {
+			g_hash_table_remove (conn->scripts, name);
+		}
+
+		return;
+	}
+
+	if (conn->scripts == NULL) {
+		conn->scripts = g_hash_table_new_full (rspamd_str_hash,
+				rspamd_str_equal, g_free, g_free);
+	}
+
+	msg_debug_rpool ("loaded script %s: %s", name, sha);
+	g_hash_table_replace (conn->scripts, g_strdup (name), g_strdup (sha));
+}
+
+guint16
+rspamd_redis_cluster_key_slot (const gchar *key, gsize keylen)
+{
+	const gchar *start, *end;
+	guint16 crc = 0;
+	gsize i;
+	guint j;
+
+	/* Only the part inside the first non-empty {} is hashed if present */
+	start = memchr (key, '{', keylen);
+
+	if (start != NULL) {
+		end = memchr (start + 1, '}', keylen - (start - key) - 1);
+
+		if (end != NULL && end > start + 1) {
+			keylen = end - start - 1;
+			key = start + 1;
+		}
+	}
+
+	/* CRC16-CCITT (XMODEM) as used by redis cluster */
+	for (i = 0; i < keylen; i ++) {
+		crc ^= ((guint16)(guchar)key[i]) << 8;
+
+		for (j = 0; j < 8; j ++) {
+			if (crc & 0x8000) {
+				crc = (crc << 1) ^ 0x1021;
+			}
+			else {
+				crc <<= 1;
+			}
+		}
+	}
+
+	return crc & (RSPAMD_REDIS_CLUSTER_SLOTS - 1);
+}
+
+static struct rspamd_redis_cluster *
+rspamd_redis_pool_get_cluster (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const gchar *seed_ip, gint seed_port, gboolean create)
+{
+	struct rspamd_redis_cluster *cluster;
+	guint64 key;
+
+	key = rspamd_redis_pool_get_key (db, password, seed_ip, seed_port);
+	cluster = g_hash_table_lookup (pool->clusters, &key);
+
+	if (cluster == NULL && create) {
+		cluster = g_malloc0 (sizeof (*cluster));
+		cluster->pool = pool;
+		cluster->key = key;
+		cluster->nodes = g_ptr_array_new ();
+		cluster->db = g_strdup (db);
+		cluster->password = g_strdup (password);
+		g_hash_table_insert (pool->clusters, &cluster->key, cluster);
+	}
+
+	return cluster;
+}
+
+static guint16
+rspamd_redis_cluster_node_idx (struct rspamd_redis_cluster *cluster,
+		const gchar *ip, gsize iplen, gint port)
+{
+	struct rspamd_redis_cluster_node *node;
+	guint i;
+
+	for (i = 0; i < cluster->nodes->len; i ++) {
+		node = g_ptr_array_index (cluster->nodes, i);
+
+		if (node->port == port && strlen (node->ip) == iplen &&
+				memcmp (node->ip, ip, iplen) == 0) {
+			return i + 1;
+		}
+	}
+
+	node = g_slice_alloc (sizeof (*node));
+	node->ip = g_strndup (ip, iplen);
+	node->port = port;
+	g_ptr_array_add (cluster->nodes, node);
+
+	return cluster->nodes->len;
+}
+
+void
+rspamd_redis_pool_cluster_node (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const gchar *seed_ip, gint seed_port,
+		const gchar *key, gsize keylen,
+		const gchar **ip, gint *port)
+{
+	struct rspamd_redis_cluster *cluster;
+	struct rspamd_redis_cluster_node *node;
+	guint16 idx;
+
+	g_assert (pool != NULL);
+
+	*ip = seed_ip;
+	*port = seed_port;
+	cluster = rspamd_redis_pool_get_cluster (pool, db, password,
+			seed_ip, seed_port, FALSE);
+
+	if (cluster) {
+		idx = cluster->slots[rspamd_redis_cluster_key_slot (key, keylen)];
+
+		if (idx > 0) {
+			node = g_ptr_array_index (cluster->nodes, idx - 1);
+			*ip = node->ip;
+			*port = node->port;
+		}
+	}
+}
+
+static void
+rspamd_redis_cluster_slots_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_redis_cluster *cluster = priv;
+	redisReply *reply = r, *range, *master;
+	guint i, nslots = 0;
+	glong start, end, k;
+	guint16 idx;
+
+	cluster->refreshing = FALSE;
+
+	if (c->err == 0 && reply != NULL && reply->type == REDIS_REPLY_ARRAY) {
+		for (i = 0; i < reply->elements; i ++) {
+			range = reply->element[i];
+
+			if (range->type != REDIS_REPLY_ARRAY || range->elements < 3) {
+				continue;
+			}
+
+			master = range->element[2];
+
+			if (range->element[0]->type != REDIS_REPLY_INTEGER ||
+					range->element[1]->type != REDIS_REPLY_INTEGER ||
+					master->type != REDIS_REPLY_ARRAY ||
+					master->elements < 2 ||
+					master->element[0]->type != REDIS_REPLY_STRING ||
+					master->element[1]->type != REDIS_REPLY_INTEGER) {
+				continue;
+			}
+
+			start = range->element[0]->integer;
+			end = range->element[1]->integer;
+
+			if (start < 0 || end >= RSPAMD_REDIS_CLUSTER_SLOTS || start > end) {
+				continue;
+			}
+
+			idx = rspamd_redis_cluster_node_idx (cluster,
+					master->element[0]->str, master->element[0]->len,
+					master->element[1]->integer);
+
+			for (k = start; k <= end; k ++) {
+				cluster->slots[k] = idx;
+			}
+
+			nslots += end - start + 1;
+		}
+
+		msg_info ("refreshed redis cluster map: %ud slots on %ud nodes",
+				nslots, cluster->nodes->len);
+	}
+
+	if (c->err == 0) {
+		/* Otherwise connection is being freed by hiredis */
+		rspamd_redis_pool_release_connection (cluster->pool, c, FALSE);
+	}
+}
+
+static void
+rspamd_redis_cluster_refresh (struct rspamd_redis_cluster *cluster,
+		const gchar *ip, gint port)
+{
+	struct redisAsyncContext *ctx;
+
+	if (cluster->refreshing) {
+		return;
+	}
+
+	ctx = rspamd_redis_pool_connect (cluster->pool, cluster->db,
+			cluster->password, ip, port);
+
+	if (ctx == NULL) {
+		return;
+	}
+
+	if (redisAsyncCommand (ctx, rspamd_redis_cluster_slots_callback, cluster,
+			"CLUSTER SLOTS") == REDIS_OK) {
+		cluster->refreshing = TRUE;
+	}
+	else {
+		rspamd_redis_pool_release_connection (cluster->pool, ctx, TRUE);
+	}
+}
+
+gboolean
+rspamd_redis_pool_cluster_redirect (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const gchar *seed_ip, gint seed_port,
+		const gchar *err,
+		const gchar **ip, gint *port, gboolean *ask)
+{
+	struct rspamd_redis_cluster *cluster;
+	struct rspamd_redis_cluster_node *node;
+	const gchar *p, *colon;
+	gchar *endptr;
+	gulong slot, nport;
+	guint16 idx;
+
+	g_assert (pool != NULL);
+
+	/* MOVED <slot> <ip>:<port> or ASK <slot> <ip>:<port> */
+	if (err == NULL) {
+		return FALSE;
+	}
+
+	if (strncmp (err, "MOVED ", sizeof ("MOVED ") - 1) == 0) {
+		*ask = FALSE;
+		p = err + sizeof ("MOVED ") - 1;
+	}
+	else if (strncmp (err, "ASK ", sizeof ("ASK ") - 1) == 0) {
+		*ask = TRUE;
+		p = err + sizeof ("ASK ") - 1;
+	}
+	else {
+		return FALSE;
+	}
+
+	slot = strtoul (p, &endptr, 10);
+
+	if (*endptr != ' ' || slot >= RSPAMD_REDIS_CLUSTER_SLOTS) {
+		return FALSE;
+	}
+
+	p = endptr + 1;
+	colon = strrchr (p, ':');
+
+	if (colon == NULL || colon == p) {
+		return FALSE;
+	}
+
+	nport = strtoul (colon + 1, &endptr, 10);
+
+	if (*endptr != '\0' || nport == 0 || nport > G_MAXUINT16) {
+		return FALSE;
+	}
+
+	cluster = rspamd_redis_pool_get_cluster (pool, db, password,
+			seed_ip, seed_port, TRUE);
+	idx = rspamd_redis_cluster_node_idx (cluster, p, colon - p, nport);
+	node = g_ptr_array_index (cluster->nodes, idx - 1);
+
+	if (!*ask) {
+		/* Slots are likely resharded, so fetch the whole map */
+		cluster->slots[slot] = idx;
+		rspamd_redis_cluster_refresh (cluster, node->ip, node->port);
+	}
+
+	*ip = node->ip;
+	*port = node->port;
+
+	return TRUE;
+}
 
 void
 rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool)
@@ -451,6 +917,7 @@ rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool)
 
 	g_hash_table_unref (pool->elts_by_ctx);
 	g_hash_table_unref (pool->elts_by_key);
+	g_hash_table_unref (pool->clusters);
 
 	g_slice_free1 (sizeof (*pool), pool);
 }
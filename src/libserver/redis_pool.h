@@ -23,6 +23,8 @@ struct rspamd_config;
 struct redisAsyncContext;
 struct event_base;
 
+#define RSPAMD_REDIS_CLUSTER_SLOTS 16384
+
 /**
  * Creates new redis pool
  * @return
@@ -53,6 +55,23 @@ struct redisAsyncContext* rspamd_redis_pool_connect (
 		const gchar *db, const gchar *password,
 		const char *ip, int port);
 
+/**
+ * Same as `rspamd_redis_pool_connect` but all callers that connect to the
+ * same server before the next iteration of the event loop get the same
+ * connection, so their commands are written to the server as a single
+ * pipeline. Such connections must not be used for transactions.
+ * @param pool
+ * @param db
+ * @param password
+ * @param ip
+ * @param port
+ * @return
+ */
+struct redisAsyncContext* rspamd_redis_pool_connect_shared (
+		struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const char *ip, int port);
+
 /**
  * Release a connection to the pool
  * @param pool
@@ -61,6 +80,69 @@ struct redisAsyncContext* rspamd_redis_pool_connect (
 void rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
 		struct redisAsyncContext *ctx, gboolean is_fatal);
 
+/**
+ * Returns sha of a script loaded on this connection or NULL
+ * @param pool
+ * @param ctx
+ * @param name
+ * @return
+ */
+const gchar* rspamd_redis_pool_get_script (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx, const gchar *name);
+
+/**
+ * Remembers sha of a script loaded on this connection (NULL to forget it)
+ * @param pool
+ * @param ctx
+ * @param name
+ * @param sha
+ */
+void rspamd_redis_pool_set_script (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx, const gchar *name, const gchar *sha);
+
+/**
+ * Returns redis cluster hash slot for the specified key
+ * @param key
+ * @param keylen
+ * @return
+ */
+guint16 rspamd_redis_cluster_key_slot (const gchar *key, gsize keylen);
+
+/**
+ * Returns address of a cluster node that serves the specified key. If slot
+ * owner is not known yet, then the seed address is returned
+ * @param pool
+ * @param seed_ip address of cluster as configured
+ * @param seed_port
+ * @param key
+ * @param keylen
+ * @param ip node address, owned by pool
+ * @param port node port
+ */
+void rspamd_redis_pool_cluster_node (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const gchar *seed_ip, gint seed_port,
+		const gchar *key, gsize keylen,
+		const gchar **ip, gint *port);
+
+/**
+ * Checks if an error reply is `MOVED` or `ASK` redirect. For `MOVED` the slots
+ * map of the cluster is updated (and refreshed asynchronously)
+ * @param pool
+ * @param seed_ip
+ * @param seed_port
+ * @param err error string of a reply
+ * @param ip redirect target, owned by pool
+ * @param port redirect target port
+ * @param ask set to TRUE if `ASKING` should be sent before the command
+ * @return TRUE if this is a redirect
+ */
+gboolean rspamd_redis_pool_cluster_redirect (struct rspamd_redis_pool *pool,
+		const gchar *db, const gchar *password,
+		const gchar *seed_ip, gint seed_port,
+		const gchar *err,
+		const gchar **ip, gint *port, gboolean *ask);
+
 /**
  * Stops redis pool and destroys it
  * @param pool
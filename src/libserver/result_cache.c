@@ -0,0 +1,870 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "result_cache.h"
+#include "task.h"
+#include "filter.h"
+#include "cfg_file.h"
+#include "symbols_cache.h"
+#include "mime_headers.h"
+#include "hash.h"
+#include "cryptobox.h"
+#include "str_util.h"
+#include "upstream.h"
+#include "utlist.h"
+#ifdef WITH_HIREDIS
+#include "redis_pool.h"
+#include "contrib/hiredis/hiredis.h"
+#include "contrib/hiredis/async.h"
+#endif
+
+#define RESULT_CACHE_KEY_LEN 16
+#define REDIS_DEFAULT_PORT 6379
+#define REDIS_DEFAULT_PREFIX "rc_"
+#define REDIS_DEFAULT_TIMEOUT 1.0
+
+struct rspamd_result_cache {
+	rspamd_lru_hash_t *lru;
+	guint ttl;
+	/* All classifiers symbols are content only */
+	gboolean classifiers_content;
+	struct upstream_list *read_servers;
+	struct upstream_list *write_servers;
+	const gchar *prefix;
+	const gchar *dbname;
+	const gchar *password;
+	gdouble timeout;
+};
+
+struct rspamd_result_cache_runtime {
+	struct rspamd_task *task;
+	struct rspamd_result_cache *cache;
+	guchar key[RESULT_CACHE_KEY_LEN];
+	/* Array of cached results if they have been found */
+	ucl_object_t *cached;
+	gboolean applied;
+	gboolean stored;
+#ifdef WITH_HIREDIS
+	redisAsyncContext *redis;
+	struct upstream *up;
+	struct event timeout_ev;
+	gboolean has_event;
+#endif
+};
+
+/* Headers that differ between copies of the same message, not hashed */
+static const enum rspamd_mime_header_known volatile_headers[] = {
+	RSPAMD_HEADER_RECEIVED,
+	RSPAMD_HEADER_X_RECEIVED,
+	RSPAMD_HEADER_TO,
+	RSPAMD_HEADER_CC,
+	RSPAMD_HEADER_BCC,
+	RSPAMD_HEADER_DATE,
+	RSPAMD_HEADER_MESSAGE_ID,
+	RSPAMD_HEADER_RETURN_PATH,
+	RSPAMD_HEADER_DELIVERED_TO,
+	RSPAMD_HEADER_X_ORIGINAL_TO,
+	RSPAMD_HEADER_X_ENVELOPE_TO,
+	RSPAMD_HEADER_ENVELOPE_TO,
+	RSPAMD_HEADER_DKIM_SIGNATURE,
+	RSPAMD_HEADER_ARC_SEAL,
+	RSPAMD_HEADER_ARC_MESSAGE_SIGNATURE,
+	RSPAMD_HEADER_ARC_AUTHENTICATION_RESULTS,
+	RSPAMD_HEADER_AUTHENTICATION_RESULTS,
+	RSPAMD_HEADER_RECEIVED_SPF,
+	RSPAMD_HEADER_X_RSPAMD_QUEUE_ID,
+};
+
+/* Mime expression functions that use SMTP envelope */
+static const gchar *envelope_functions[] = {
+	"check_smtp_data",
+	"compare_recipients_distance",
+	"is_recipients_sorted",
+};
+
+static guint
+rspamd_result_cache_key_hash (gconstpointer k)
+{
+	guint h;
+
+	/* Key is a cryptographic hash itself */
+	memcpy (&h, k, sizeof (h));
+
+	return h;
+}
+
+static gboolean
+rspamd_result_cache_key_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, RESULT_CACHE_KEY_LEN) == 0;
+}
+
+static gboolean
+rspamd_result_cache_header_is_volatile (const gchar *name, gsize len)
+{
+	gint id;
+	guint i;
+
+	id = rspamd_mime_header_known_id (name, len);
+
+	if (id < 0) {
+		return FALSE;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (volatile_headers); i ++) {
+		if (volatile_headers[i] == (enum rspamd_mime_header_known)id) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Skips regexp atom that starts at `p`, returns FALSE if it is matched against
+ * data that includes trace headers
+ */
+static gboolean
+rspamd_result_cache_regexp_is_content (const gchar **pp)
+{
+	const gchar *p = *pp + 1, *start;
+	gboolean ret = TRUE;
+	gsize len;
+
+	while (*p && (*p != '/' || *(p - 1) == '\\')) {
+		p ++;
+	}
+
+	if (*p == '\0') {
+		*pp = p;
+
+		return TRUE;
+	}
+
+	p ++;
+
+	while (g_ascii_isalpha (*p)) {
+		/* Raw message with all headers */
+		if (*p == 'M') {
+			ret = FALSE;
+		}
+
+		p ++;
+	}
+
+	if (*p == '{') {
+		start = ++p;
+
+		while (*p && *p != '}') {
+			p ++;
+		}
+
+		len = p - start;
+
+		if ((len == sizeof ("body") - 1 &&
+				rspamd_lc_cmp (start, "body", len) == 0) ||
+				(len == sizeof ("all_header") - 1 &&
+				rspamd_lc_cmp (start, "all_header", len) == 0)) {
+			ret = FALSE;
+		}
+
+		if (*p == '}') {
+			p ++;
+		}
+	}
+
+	*pp = p;
+
+	return ret;
+}
+
+gboolean
+rspamd_result_cache_expression_is_content (const gchar *line)
+{
+	const gchar *p = line, *start;
+	gsize len;
+	guint i;
+
+	while (*p) {
+		if (*p == '/') {
+			if (!rspamd_result_cache_regexp_is_content (&p)) {
+				return FALSE;
+			}
+
+			continue;
+		}
+
+		if (!g_ascii_isalnum (*p) && *p != '_' && *p != '-') {
+			p ++;
+			continue;
+		}
+
+		start = p;
+
+		while (*p && (g_ascii_isalnum (*p) || *p == '_' || *p == '-')) {
+			p ++;
+		}
+
+		len = p - start;
+
+		if (rspamd_result_cache_header_is_volatile (start, len)) {
+			return FALSE;
+		}
+
+		for (i = 0; i < G_N_ELEMENTS (envelope_functions); i ++) {
+			if (strlen (envelope_functions[i]) == len &&
+					memcmp (envelope_functions[i], start, len) == 0) {
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+#ifdef WITH_HIREDIS
+static gboolean
+rspamd_result_cache_redis_config (struct rspamd_result_cache *cache,
+		struct rspamd_config *cfg, const ucl_object_t *obj)
+{
+	const ucl_object_t *elt, *relt;
+
+	relt = ucl_object_lookup_any (obj, "read_servers", "servers", NULL);
+
+	if (relt == NULL) {
+		msg_err_config ("no servers defined for the results cache");
+		return FALSE;
+	}
+
+	cache->read_servers = rspamd_upstreams_create (cfg->ups_ctx);
+
+	if (!rspamd_upstreams_from_ucl (cache->read_servers, relt,
+			REDIS_DEFAULT_PORT, NULL)) {
+		msg_err_config ("cannot get read servers configuration");
+		rspamd_upstreams_destroy (cache->read_servers);
+		cache->read_servers = NULL;
+
+		return FALSE;
+	}
+
+	elt = ucl_object_lookup (obj, "write_servers");
+	cache->write_servers = rspamd_upstreams_create (cfg->ups_ctx);
+
+	if (!rspamd_upstreams_from_ucl (cache->write_servers, elt ? elt : relt,
+			REDIS_DEFAULT_PORT, NULL)) {
+		msg_err_config ("cannot get write servers configuration");
+		rspamd_upstreams_destroy (cache->write_servers);
+		cache->write_servers = NULL;
+	}
+
+	elt = ucl_object_lookup (obj, "prefix");
+	if (elt && ucl_object_type (elt) == UCL_STRING) {
+		cache->prefix = ucl_object_tostring (elt);
+	}
+	else {
+		cache->prefix = REDIS_DEFAULT_PREFIX;
+	}
+
+	elt = ucl_object_lookup (obj, "timeout");
+	if (elt) {
+		cache->timeout = ucl_object_todouble (elt);
+	}
+	else {
+		cache->timeout = REDIS_DEFAULT_TIMEOUT;
+	}
+
+	elt = ucl_object_lookup (obj, "password");
+	if (elt) {
+		cache->password = ucl_object_tostring (elt);
+	}
+
+	elt = ucl_object_lookup_any (obj, "db", "database", "dbname", NULL);
+	if (elt) {
+		cache->dbname = ucl_object_tostring (elt);
+	}
+
+	return TRUE;
+}
+#endif
+
+struct rspamd_result_cache *
+rspamd_result_cache_new (struct rspamd_config *cfg)
+{
+	struct rspamd_result_cache *cache;
+	GHashTableIter it;
+	gpointer k, v;
+	gint id;
+
+	cache = g_malloc0 (sizeof (*cache));
+	cache->ttl = cfg->result_cache_ttl;
+
+	if (cfg->result_cache_size > 0) {
+		cache->lru = rspamd_lru_hash_new_full (cfg->result_cache_size,
+				g_free, (GDestroyNotify)ucl_object_unref,
+				rspamd_result_cache_key_hash, rspamd_result_cache_key_equal);
+	}
+
+	if (cfg->result_cache_redis) {
+#ifdef WITH_HIREDIS
+		rspamd_result_cache_redis_config (cache, cfg, cfg->result_cache_redis);
+#else
+		msg_warn_config ("redis support is not compiled in, "
+				"results cache uses local storage only");
+#endif
+	}
+
+	/* Classification is skipped on hits only if all classifiers are cached */
+	cache->classifiers_content = TRUE;
+	g_hash_table_iter_init (&it, cfg->classifiers_symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		id = rspamd_symbols_cache_find_symbol (cfg->cache, k);
+
+		if (id < 0 || !rspamd_symbols_cache_is_content_symbol (cfg->cache, id)) {
+			cache->classifiers_content = FALSE;
+			break;
+		}
+	}
+
+	return cache;
+}
+
+void
+rspamd_result_cache_destroy (struct rspamd_result_cache *cache)
+{
+	if (cache) {
+		if (cache->lru) {
+			rspamd_lru_hash_destroy (cache->lru);
+		}
+		if (cache->read_servers) {
+			rspamd_upstreams_destroy (cache->read_servers);
+		}
+		if (cache->write_servers) {
+			rspamd_upstreams_destroy (cache->write_servers);
+		}
+
+		g_free (cache);
+	}
+}
+
+static void
+rspamd_result_cache_calc_key (struct rspamd_task *task, guchar *out)
+{
+	rspamd_cryptobox_hash_state_t st;
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	struct rspamd_mime_header *hdr;
+	rspamd_fstring_t *settings;
+	GList *cur;
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, task->digest, sizeof (task->digest));
+
+	if (task->headers_order) {
+		for (cur = task->headers_order->head; cur != NULL; cur = g_list_next (cur)) {
+			hdr = cur->data;
+
+			if (hdr->name == NULL || rspamd_result_cache_header_is_volatile (
+					hdr->name, strlen (hdr->name))) {
+				continue;
+			}
+
+			rspamd_cryptobox_hash_update (&st, hdr->name, strlen (hdr->name) + 1);
+
+			if (hdr->raw_value) {
+				rspamd_cryptobox_hash_update (&st, hdr->raw_value, hdr->raw_len);
+			}
+
+			rspamd_cryptobox_hash_update (&st, "\n", 1);
+		}
+	}
+
+	/* Per user settings and statistics */
+	if (task->user) {
+		rspamd_cryptobox_hash_update (&st, task->user, strlen (task->user) + 1);
+	}
+
+	if (task->settings) {
+		settings = rspamd_fstring_new ();
+		rspamd_ucl_emit_fstring (task->settings, UCL_EMIT_JSON_COMPACT, &settings);
+		rspamd_cryptobox_hash_update (&st, settings->str, settings->len);
+		rspamd_fstring_free (settings);
+	}
+
+	rspamd_cryptobox_hash_final (&st, digest);
+	memcpy (out, digest, RESULT_CACHE_KEY_LEN);
+}
+
+static void
+rspamd_result_cache_set_cached (struct rspamd_result_cache_runtime *rt,
+		ucl_object_t *obj)
+{
+	rt->cached = obj;
+	rspamd_mempool_add_destructor (rt->task->task_pool,
+			(rspamd_mempool_destruct_t)ucl_object_unref, obj);
+}
+
+#ifdef WITH_HIREDIS
+static GQuark
+rspamd_result_cache_quark (void)
+{
+	return g_quark_from_static_string ("result_cache");
+}
+
+static void
+rspamd_result_cache_redis_fin (gpointer ud)
+{
+	struct rspamd_result_cache_runtime *rt = ud;
+	redisAsyncContext *ac;
+
+	rt->has_event = FALSE;
+
+	if (event_get_base (&rt->timeout_ev)) {
+		event_del (&rt->timeout_ev);
+	}
+
+	if (rt->redis) {
+		ac = rt->redis;
+		rt->redis = NULL;
+		/* Pending callbacks are called with no reply */
+		rspamd_redis_pool_release_connection (rt->task->cfg->redis_pool,
+				ac, TRUE);
+	}
+}
+
+static void
+rspamd_result_cache_redis_done (struct rspamd_result_cache_runtime *rt,
+		gboolean is_fatal)
+{
+	redisAsyncContext *ac;
+
+	if (rt->redis) {
+		ac = rt->redis;
+		rt->redis = NULL;
+		rspamd_redis_pool_release_connection (rt->task->cfg->redis_pool,
+				ac, is_fatal);
+	}
+
+	if (rt->has_event) {
+		rspamd_session_remove_event (rt->task->s, rspamd_result_cache_redis_fin,
+				rt);
+	}
+}
+
+static void
+rspamd_result_cache_redis_timeout (gint fd, short what, gpointer d)
+{
+	struct rspamd_result_cache_runtime *rt = d;
+	struct rspamd_task *task = rt->task;
+
+	msg_info_task ("connection to results cache redis %s timed out",
+			rspamd_upstream_name (rt->up));
+	rspamd_upstream_fail (rt->up);
+	rspamd_result_cache_redis_done (rt, TRUE);
+}
+
+static void
+rspamd_result_cache_get_cb (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_result_cache_runtime *rt = priv;
+	struct rspamd_task *task = rt->task;
+	redisReply *reply = r;
+	struct ucl_parser *parser;
+	ucl_object_t *obj;
+	guchar *key;
+
+	if (c->err == 0 && reply != NULL) {
+		rspamd_upstream_ok (rt->up);
+
+		if (reply->type == REDIS_REPLY_STRING) {
+			parser = ucl_parser_new (0);
+
+			if (ucl_parser_add_chunk (parser, (const guchar *)reply->str,
+					reply->len)) {
+				obj = ucl_parser_get_object (parser);
+
+				if (ucl_object_type (obj) == UCL_ARRAY) {
+					rspamd_result_cache_set_cached (rt, obj);
+					msg_debug_task ("found %ud cached results in redis",
+							obj->len);
+
+					if (rt->cache->lru) {
+						key = g_malloc (RESULT_CACHE_KEY_LEN);
+						memcpy (key, rt->key, RESULT_CACHE_KEY_LEN);
+						rspamd_lru_hash_insert (rt->cache->lru, key,
+								ucl_object_ref (obj), task->tv.tv_sec,
+								rt->cache->ttl);
+					}
+				}
+				else {
+					ucl_object_unref (obj);
+				}
+			}
+			else {
+				msg_info_task ("cannot parse cached results: %s",
+						ucl_parser_get_error (parser));
+			}
+
+			ucl_parser_free (parser);
+		}
+
+		rspamd_result_cache_redis_done (rt, FALSE);
+	}
+	else {
+		if (c->err) {
+			msg_info_task ("cannot get cached results from %s: %s",
+					rspamd_upstream_name (rt->up), c->errstr);
+			rspamd_upstream_fail (rt->up);
+		}
+
+		rspamd_result_cache_redis_done (rt, TRUE);
+	}
+}
+
+static void
+rspamd_result_cache_set_cb (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_result_cache_runtime *rt = priv;
+	struct rspamd_task *task = rt->task;
+
+	if (c->err == 0 && r != NULL) {
+		rspamd_upstream_ok (rt->up);
+		rspamd_result_cache_redis_done (rt, FALSE);
+	}
+	else {
+		if (c->err) {
+			msg_info_task ("cannot store cached results to %s: %s",
+					rspamd_upstream_name (rt->up), c->errstr);
+			rspamd_upstream_fail (rt->up);
+		}
+
+		rspamd_result_cache_redis_done (rt, TRUE);
+	}
+}
+
+static gboolean
+rspamd_result_cache_redis_send (struct rspamd_result_cache_runtime *rt,
+		struct upstream_list *ups, redisCallbackFn *cb,
+		gint argc, const gchar **argv, const gsize *argvlen)
+{
+	struct rspamd_task *task = rt->task;
+	struct rspamd_result_cache *cache = rt->cache;
+	rspamd_inet_addr_t *addr;
+	struct timeval tv;
+
+	if (rt->redis != NULL) {
+		/* Previous request is still pending */
+		return FALSE;
+	}
+
+	rt->up = rspamd_upstream_get (ups, RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+
+	if (rt->up == NULL) {
+		return FALSE;
+	}
+
+	addr = rspamd_upstream_addr (rt->up);
+	rt->redis = rspamd_redis_pool_connect (task->cfg->redis_pool,
+			cache->dbname, cache->password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (rt->redis == NULL) {
+		msg_info_task ("cannot connect to results cache redis %s",
+				rspamd_upstream_name (rt->up));
+		rspamd_upstream_fail (rt->up);
+
+		return FALSE;
+	}
+
+	if (redisAsyncCommandArgv (rt->redis, cb, rt, argc, argv,
+			argvlen) != REDIS_OK) {
+		rspamd_redis_pool_release_connection (task->cfg->redis_pool,
+				rt->redis, TRUE);
+		rt->redis = NULL;
+
+		return FALSE;
+	}
+
+	rspamd_session_add_event (task->s, rspamd_result_cache_redis_fin, rt,
+			rspamd_result_cache_quark ());
+	rt->has_event = TRUE;
+
+	event_set (&rt->timeout_ev, -1, EV_TIMEOUT,
+			rspamd_result_cache_redis_timeout, rt);
+	event_base_set (task->ev_base, &rt->timeout_ev);
+	double_to_tv (cache->timeout, &tv);
+	event_add (&rt->timeout_ev, &tv);
+
+	return TRUE;
+}
+
+static gchar *
+rspamd_result_cache_redis_key (struct rspamd_result_cache_runtime *rt)
+{
+	gchar hexbuf[RESULT_CACHE_KEY_LEN * 2 + 1];
+
+	rspamd_encode_hex_buf (rt->key, sizeof (rt->key), hexbuf, sizeof (hexbuf));
+	hexbuf[sizeof (hexbuf) - 1] = '\0';
+
+	return rspamd_mempool_strconcat (rt->task->task_pool, rt->cache->prefix,
+			hexbuf, NULL);
+}
+#endif
+
+void
+rspamd_result_cache_lookup (struct rspamd_task *task)
+{
+	struct rspamd_config *cfg = task->cfg;
+	struct rspamd_result_cache_runtime *rt;
+	ucl_object_t *obj;
+
+	if ((cfg->result_cache_size == 0 && cfg->result_cache_redis == NULL) ||
+			RSPAMD_TASK_IS_EMPTY (task) || RSPAMD_TASK_IS_SKIPPED (task) ||
+			(task->flags & (RSPAMD_TASK_FLAG_LEARN_SPAM|RSPAMD_TASK_FLAG_LEARN_HAM))) {
+		return;
+	}
+
+	if (cfg->result_cache == NULL) {
+		/* Created on the first use, so each worker has its own storage */
+		cfg->result_cache = rspamd_result_cache_new (cfg);
+	}
+
+	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+	rt->task = task;
+	rt->cache = cfg->result_cache;
+	rspamd_result_cache_calc_key (task, rt->key);
+	task->result_cache = rt;
+
+	if (rt->cache->lru) {
+		obj = rspamd_lru_hash_lookup (rt->cache->lru, rt->key, task->tv.tv_sec);
+
+		if (obj) {
+			rspamd_result_cache_set_cached (rt, ucl_object_ref (obj));
+			msg_debug_task ("found %ud cached results", obj->len);
+
+			return;
+		}
+	}
+
+#ifdef WITH_HIREDIS
+	if (rt->cache->read_servers) {
+		const gchar *argv[2];
+		gsize argvlen[2];
+
+		argv[0] = "GET";
+		argvlen[0] = 3;
+		argv[1] = rspamd_result_cache_redis_key (rt);
+		argvlen[1] = strlen (argv[1]);
+
+		rspamd_result_cache_redis_send (rt, rt->cache->read_servers,
+				rspamd_result_cache_get_cb, 2, argv, argvlen);
+	}
+#endif
+}
+
+/* Effective weight of a symbol as it is computed when a result is inserted */
+static gdouble
+rspamd_result_cache_symbol_weight (struct rspamd_task *task,
+		struct rspamd_metric *metric, const gchar *symbol)
+{
+	struct rspamd_symbol *sdef;
+	const ucl_object_t *sobj;
+	gdouble w = 0.0, corr;
+
+	sdef = g_hash_table_lookup (metric->symbols, symbol);
+
+	if (sdef) {
+		w = *sdef->weight_ptr;
+	}
+
+	if (task->settings) {
+		sobj = ucl_object_lookup (task->settings, symbol);
+
+		if (sobj != NULL && ucl_object_todouble_safe (sobj, &corr)) {
+			w = corr;
+		}
+	}
+
+	return w;
+}
+
+gboolean
+rspamd_result_cache_apply (struct rspamd_task *task)
+{
+	struct rspamd_result_cache_runtime *rt = task->result_cache;
+	struct rspamd_symbol_result *s;
+	const ucl_object_t *cur, *elt, *opts, *opt;
+	ucl_object_iter_t it = NULL, oit;
+	const gchar *name;
+	guint nres = 0;
+
+	if (rt == NULL || rt->cached == NULL) {
+		return FALSE;
+	}
+
+	if (rt->applied) {
+		return TRUE;
+	}
+
+	rt->applied = TRUE;
+
+	while ((cur = ucl_object_iterate (rt->cached, &it, true)) != NULL) {
+		elt = ucl_object_lookup (cur, "name");
+
+		if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+			continue;
+		}
+
+		name = ucl_object_tostring (elt);
+		elt = ucl_object_lookup (cur, "flag");
+		opts = ucl_object_lookup (cur, "options");
+		oit = NULL;
+		opt = opts ? ucl_object_iterate (opts, &oit, true) : NULL;
+
+		s = rspamd_task_insert_result_single (task, name,
+				elt ? ucl_object_todouble (elt) : 1.0,
+				opt ? ucl_object_tostring (opt) : NULL);
+
+		if (s && opt) {
+			while ((opt = ucl_object_iterate (opts, &oit, true)) != NULL) {
+				rspamd_task_add_result_option (task, s,
+						ucl_object_tostring (opt));
+			}
+		}
+
+		nres ++;
+	}
+
+	msg_info_task ("content symbols are served from the results cache, "
+			"%ud symbols inserted", nres);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_result_cache_is_applied (struct rspamd_task *task)
+{
+	struct rspamd_result_cache_runtime *rt = task->result_cache;
+
+	return rt != NULL && rt->applied;
+}
+
+gboolean
+rspamd_result_cache_skip_classifiers (struct rspamd_task *task)
+{
+	struct rspamd_result_cache_runtime *rt = task->result_cache;
+
+	return rt != NULL && rt->applied && rt->cache->classifiers_content;
+}
+
+void
+rspamd_result_cache_store (struct rspamd_task *task)
+{
+	struct rspamd_result_cache_runtime *rt = task->result_cache;
+	struct rspamd_metric_result *mres;
+	struct rspamd_symbol_result *s;
+	struct rspamd_symbol_option *opt;
+	ucl_object_t *top, *elt, *opts;
+	GHashTableIter it;
+	gpointer k, v;
+	gdouble w;
+	guchar *key;
+
+	if (rt == NULL || rt->applied || rt->stored) {
+		return;
+	}
+
+	rt->stored = TRUE;
+
+	if (task->err || RSPAMD_TASK_IS_SKIPPED (task) ||
+			!rspamd_symbols_cache_content_finished (task, task->cfg->cache)) {
+		/* Results are incomplete */
+		return;
+	}
+
+	mres = rspamd_create_metric_result (task, DEFAULT_METRIC);
+
+	if (mres == NULL) {
+		return;
+	}
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+	g_hash_table_iter_init (&it, mres->symbols);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		s = v;
+
+		if (s->id < 0 ||
+				!rspamd_symbols_cache_is_content_symbol (task->cfg->cache, s->id)) {
+			continue;
+		}
+
+		w = rspamd_result_cache_symbol_weight (task, mres->metric, s->name);
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt, ucl_object_fromstring (s->name),
+				"name", 0, false);
+		ucl_object_insert_key (elt,
+				ucl_object_fromdouble (w != 0 ? s->score / w : 1.0),
+				"flag", 0, false);
+
+		if (s->opts_head) {
+			opts = ucl_object_typed_new (UCL_ARRAY);
+
+			DL_FOREACH (s->opts_head, opt) {
+				ucl_array_append (opts, ucl_object_fromstring (opt->option));
+			}
+
+			ucl_object_insert_key (elt, opts, "options", 0, false);
+		}
+
+		ucl_array_append (top, elt);
+	}
+
+	if (rt->cache->lru) {
+		key = g_malloc (RESULT_CACHE_KEY_LEN);
+		memcpy (key, rt->key, RESULT_CACHE_KEY_LEN);
+		rspamd_lru_hash_insert (rt->cache->lru, key, ucl_object_ref (top),
+				task->tv.tv_sec, rt->cache->ttl);
+	}
+
+#ifdef WITH_HIREDIS
+	if (rt->cache->write_servers) {
+		rspamd_fstring_t *value;
+		const gchar *argv[4];
+		gsize argvlen[4];
+
+		value = rspamd_fstring_new ();
+		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &value);
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)rspamd_fstring_free, value);
+
+		argv[0] = "SETEX";
+		argvlen[0] = 5;
+		argv[1] = rspamd_result_cache_redis_key (rt);
+		argvlen[1] = strlen (argv[1]);
+		argv[2] = rspamd_mempool_alloc (task->task_pool, 16);
+		rspamd_snprintf ((gchar *)argv[2], 16, "%ud", MAX (rt->cache->ttl, 1));
+		argvlen[2] = strlen (argv[2]);
+		argv[3] = value->str;
+		argvlen[3] = value->len;
+
+		rspamd_result_cache_redis_send (rt, rt->cache->write_servers,
+				rspamd_result_cache_set_cb, 4, argv, argvlen);
+	}
+#endif
+
+	ucl_object_unref (top);
+}
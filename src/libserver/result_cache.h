@@ -0,0 +1,78 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_RESULT_CACHE_H_
+#define SRC_LIBSERVER_RESULT_CACHE_H_
+
+#include "config.h"
+
+/*
+ * Cache of the results of content only symbols (SYMBOL_TYPE_CONTENT), keyed
+ * by the digest of message parts and of all headers except trace and
+ * recipient ones. Each worker keeps its own LRU, redis could be used as a
+ * shared tier.
+ */
+
+struct rspamd_result_cache;
+struct rspamd_config;
+struct rspamd_task;
+
+/**
+ * Creates results cache for the specified config
+ */
+struct rspamd_result_cache *rspamd_result_cache_new (struct rspamd_config *cfg);
+
+/**
+ * Destroys results cache
+ */
+void rspamd_result_cache_destroy (struct rspamd_result_cache *cache);
+
+/**
+ * Looks up task's content in the cache, should be called after message
+ * parsing. Redis lookups are registered as session events, so they are
+ * finished before the filters stage
+ */
+void rspamd_result_cache_lookup (struct rspamd_task *task);
+
+/**
+ * Inserts cached results to the task if they have been found
+ * @return TRUE if content symbols should not be checked
+ */
+gboolean rspamd_result_cache_apply (struct rspamd_task *task);
+
+/**
+ * Returns TRUE if task has been served from the cache
+ */
+gboolean rspamd_result_cache_is_applied (struct rspamd_task *task);
+
+/**
+ * Returns TRUE if classifiers results have been served from the cache
+ */
+gboolean rspamd_result_cache_skip_classifiers (struct rspamd_task *task);
+
+/**
+ * Saves results of content symbols, should be called when filters and
+ * classifiers are finished
+ */
+void rspamd_result_cache_store (struct rspamd_task *task);
+
+/**
+ * Returns FALSE if mime expression refers to envelope, to headers that are
+ * excluded from the cache key or to the whole message (`/M`, `{body}` and
+ * `{all_header}` regexps)
+ */
+gboolean rspamd_result_cache_expression_is_content (const gchar *line);
+
+#endif /* SRC_LIBSERVER_RESULT_CACHE_H_ */
@@ -84,6 +84,36 @@ roll_history_symbols_callback (gpointer key, gpointer value, void *user_data)
 	}
 }
 
+static inline guint64
+roll_history_seq_get (guint64 *seq)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	return __atomic_load_n (seq, __ATOMIC_ACQUIRE);
+#else
+	return *seq;
+#endif
+}
+
+static inline guint64
+roll_history_seq_next (guint64 *seq)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	return __atomic_add_fetch (seq, 1, __ATOMIC_ACQ_REL);
+#else
+	return ++(*seq);
+#endif
+}
+
+static inline void
+roll_history_seq_set (guint64 *seq, guint64 val)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	__atomic_store_n (seq, val, __ATOMIC_RELEASE);
+#else
+	*seq = val;
+#endif
+}
+
 /**
  * Update roll history with data from task
  * @param history roll history object
@@ -93,7 +123,8 @@ void
 rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task)
 {
-	guint row_num;
+	guint64 id;
+	guint version;
 	struct roll_history_row *row;
 	struct rspamd_metric_result *metric_res;
 	struct history_metric_callback_data cbdata;
@@ -102,24 +133,21 @@ rspamd_roll_history_update (struct roll_history *history,
 		return;
 	}
 
-	/* First of all obtain check and obtain row number */
-	g_atomic_int_compare_and_exchange (&history->cur_row, history->nrows, 0);
-#if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION > 30))
-	row_num = g_atomic_int_add (&history->cur_row, 1);
-#else
-	row_num = g_atomic_int_exchange_and_add (&history->cur_row, 1);
-#endif
+	id = roll_history_seq_next (&history->seq);
+	row = &history->rows[(id - 1) % history->nrows];
+	version = g_atomic_int_get (&row->version);
 
-	if (row_num < history->nrows) {
-		row = &history->rows[row_num];
-		g_atomic_int_set (&row->completed, FALSE);
-	}
-	else {
-		/* Race condition */
-		history->cur_row = 0;
+	/*
+	 * Another writer has wrapped around the whole history and still fills
+	 * this row, so we just lose this entry
+	 */
+	if ((version & 1) || !g_atomic_int_compare_and_exchange (&row->version,
+			version, version + 1)) {
 		return;
 	}
 
+	row->id = id;
+
 	/* Add information from task to roll history */
 	if (task->from_addr) {
 		rspamd_strlcpy (row->from_addr,
@@ -143,7 +171,7 @@ rspamd_roll_history_update (struct roll_history *history,
 	}
 
 	/* Get default metric */
-	metric_res = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+	metric_res = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 	if (metric_res == NULL) {
 		row->symbols[0] = '\0';
 		row->action = METRIC_ACTION_NOACTION;
@@ -167,7 +195,53 @@ rspamd_roll_history_update (struct roll_history *history,
 
 	row->scan_time = task->time_real_finish - task->time_real;
 	row->len = task->msg.len;
-	g_atomic_int_set (&row->completed, TRUE);
+	/* Make row visible for readers */
+	g_atomic_int_inc (&row->version);
+}
+
+guint64
+rspamd_roll_history_last_id (struct roll_history *history)
+{
+	return roll_history_seq_get (&history->seq);
+}
+
+gboolean
+rspamd_roll_history_get_row (struct roll_history *history,
+	guint64 id, struct roll_history_row *out)
+{
+	struct roll_history_row *row;
+	guint version;
+
+	if (history->disabled || id == 0 ||
+			id <= roll_history_seq_get (&history->reset_seq) ||
+			id > roll_history_seq_get (&history->seq)) {
+		return FALSE;
+	}
+
+	row = &history->rows[(id - 1) % history->nrows];
+	version = g_atomic_int_get (&row->version);
+
+	if (version & 1) {
+		return FALSE;
+	}
+
+	memcpy (out, row, sizeof (*out));
+
+	/* Row has been rewritten while we were copying it */
+	if (g_atomic_int_get (&row->version) != version || out->id != id) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_roll_history_reset (struct roll_history *history)
+{
+	if (!history->disabled) {
+		roll_history_seq_set (&history->reset_seq,
+				roll_history_seq_get (&history->seq));
+	}
 }
 
 /**
@@ -331,13 +405,13 @@ rspamd_roll_history_load (struct roll_history *history, const gchar *filename)
 				row->action = ucl_object_toint (elt);
 			}
 
-			row->completed = TRUE;
+			row->id = i + 1;
 		}
 	}
 
 	ucl_object_unref (top);
 
-	history->cur_row = n;
+	history->seq = n;
 
 	return TRUE;
 }
@@ -353,8 +427,8 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 {
 	gint fd;
 	ucl_object_t *obj, *elt;
-	guint i;
-	struct roll_history_row *row;
+	guint64 id, last;
+	struct roll_history_row rowbuf, *row = &rowbuf;
 	struct ucl_emitter_functions *emitter_func;
 
 	g_assert (history != NULL);
@@ -370,10 +444,12 @@ rspamd_roll_history_save (struct roll_history *history, const gchar *filename)
 
 	obj = ucl_object_typed_new (UCL_ARRAY);
 
-	for (i = 0; i < history->nrows; i ++) {
-		row = &history->rows[i];
+	last = rspamd_roll_history_last_id (history);
+	id = last > history->nrows ? last - history->nrows + 1 : 1;
 
-		if (!row->completed) {
+	/* Save from the oldest row, so that ids are restored in the same order */
+	for (; id <= last; id ++) {
+		if (!rspamd_roll_history_get_row (history, id, row)) {
 			continue;
 		}
 
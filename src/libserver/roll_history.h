@@ -33,6 +33,8 @@ struct rspamd_task;
 struct rspamd_config;
 
 struct roll_history_row {
+	guint64 id;									/**< sequence number of a row, 0 if empty	*/
+	guint version;								/**< odd while the row is being written		*/
 	struct timeval tv;
 	gchar message_id[HISTORY_MAX_ID];
 	gchar symbols[HISTORY_MAX_SYMBOLS];
@@ -43,14 +45,19 @@ struct roll_history_row {
 	gdouble score;
 	gdouble required_score;
 	gint action;
-	guint completed;
 };
 
+/*
+ * Writers reserve rows by incrementing `seq` atomically and protect each
+ * row with a sequence lock, so readers never block scanning and simply drop
+ * rows that have been modified while they were copied
+ */
 struct roll_history {
 	struct roll_history_row *rows;
 	gboolean disabled;
 	guint nrows;
-	guint cur_row;
+	guint64 seq;								/**< id of the last reserved row			*/
+	guint64 reset_seq;							/**< rows up to this id are hidden			*/
 };
 
 /**
@@ -69,6 +76,26 @@ struct roll_history * rspamd_roll_history_new (rspamd_mempool_t *pool,
 void rspamd_roll_history_update (struct roll_history *history,
 	struct rspamd_task *task);
 
+/**
+ * Returns id of the most recently reserved row
+ */
+guint64 rspamd_roll_history_last_id (struct roll_history *history);
+
+/**
+ * Copy consistent snapshot of a row with the specified id
+ * @param history roll history object
+ * @param id sequence number of a row
+ * @param out destination row
+ * @return TRUE if row is complete and has not been overwritten
+ */
+gboolean rspamd_roll_history_get_row (struct roll_history *history,
+	guint64 id, struct roll_history_row *out);
+
+/**
+ * Hide all rows that are currently stored in history
+ */
+void rspamd_roll_history_reset (struct roll_history *history);
+
 /**
  * Load previously saved history from file
  * @param history roll history object
@@ -18,12 +18,19 @@
 #include "rspamd_control.h"
 #include "libutil/http.h"
 #include "libutil/http_private.h"
+#include "libutil/map.h"
+#include "libserver/worker_util.h"
+#include "libutil/shm_counters.h"
+#include "libserver/dynamic_cfg.h"
 #include "unix-std.h"
 #include "utlist.h"
 
 #ifdef HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
 #endif
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 
 static struct timeval io_timeout = {
 		.tv_sec = 30,
@@ -42,6 +49,7 @@ struct rspamd_control_reply_elt {
 	struct rspamd_worker *wrk;
 	gpointer ud;
 	gint attached_fd;
+	gboolean replied;
 	struct rspamd_control_reply_elt *prev, *next;
 };
 
@@ -101,6 +109,27 @@ static const struct rspamd_control_cmd_match {
 				},
 				.type = RSPAMD_CONTROL_FUZZY_SYNC
 		},
+		{
+				.name = {
+						.begin = "/profile",
+						.len = sizeof ("/profile") - 1
+				},
+				.type = RSPAMD_CONTROL_PROFILE
+		},
+		{
+				.name = {
+						.begin = "/counters",
+						.len = sizeof ("/counters") - 1
+				},
+				.type = RSPAMD_CONTROL_COUNTERS
+		},
+		{
+				.name = {
+						.begin = "/dynamic_update",
+						.len = sizeof ("/dynamic_update") - 1
+				},
+				.type = RSPAMD_CONTROL_DYNAMIC_UPDATE
+		},
 };
 
 void
@@ -182,7 +211,7 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 	gchar tmpbuf[64];
 	gdouble total_utime = 0, total_systime = 0;
 	struct ucl_parser *parser;
-	guint total_conns = 0;
+	guint total_conns = 0, total_missing = 0;
 
 	rep = ucl_object_typed_new (UCL_OBJECT);
 	workers = ucl_object_typed_new (UCL_OBJECT);
@@ -195,12 +224,27 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 			continue;
 		}
 
+		/* Only workers that run symbols send their profile */
+		if (session->cmd.type == RSPAMD_CONTROL_PROFILE &&
+				elt->attached_fd == -1) {
+			continue;
+		}
+
 		rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "%P", elt->wrk->pid);
 		cur = ucl_object_typed_new (UCL_OBJECT);
 
 		ucl_object_insert_key (cur, ucl_object_fromstring (g_quark_to_string (
 				elt->wrk->type)), "type", 0, false);
 
+		if (!elt->replied) {
+			/* Do not report zeroes for workers that have not replied in time */
+			ucl_object_insert_key (cur, ucl_object_fromstring ("no reply"),
+					"error", 0, false);
+			ucl_object_insert_key (workers, cur, tmpbuf, 0, true);
+			total_missing ++;
+			continue;
+		}
+
 		switch (session->cmd.type) {
 		case RSPAMD_CONTROL_STAT:
 			ucl_object_insert_key (cur, ucl_object_fromint (
@@ -282,6 +326,28 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 			ucl_object_insert_key (cur, ucl_object_fromint (
 					elt->reply.reply.fuzzy_sync.status), "status", 0, false);
 			break;
+		case RSPAMD_CONTROL_PROFILE:
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.profile.status), "status", 0, false);
+			parser = ucl_parser_new (0);
+
+			if (ucl_parser_add_fd (parser, elt->attached_fd)) {
+				ucl_object_insert_key (cur, ucl_parser_get_object (parser),
+						"data", 0, false);
+			}
+			else {
+				ucl_object_insert_key (cur, ucl_object_fromstring (
+						ucl_parser_get_error (parser)), "error", 0, false);
+			}
+
+			ucl_parser_free (parser);
+			break;
+		case RSPAMD_CONTROL_DYNAMIC_UPDATE:
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.dynamic_update.status), "status", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.dynamic_update.applied), "applied", 0, false);
+			break;
 		default:
 			break;
 		}
@@ -309,6 +375,11 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 		ucl_object_insert_key (rep, cur, "total", 0, false);
 	}
 
+	if (total_missing > 0) {
+		ucl_object_insert_key (rep, ucl_object_fromint (total_missing),
+				"missing_replies", 0, false);
+	}
+
 	rspamd_control_send_ucl (session, rep);
 	ucl_object_unref (rep);
 }
@@ -345,6 +416,8 @@ rspamd_control_wrk_io (gint fd, short what, gpointer ud)
 			if (msg.msg_controllen >= CMSG_LEN (sizeof (int))) {
 				elt->attached_fd = *(int *) CMSG_DATA(CMSG_FIRSTHDR (&msg));
 			}
+
+			elt->replied = TRUE;
 		}
 	}
 	else {
@@ -376,6 +449,180 @@ rspamd_control_error_handler (struct rspamd_http_connection *conn, GError *err)
 	}
 }
 
+/*
+ * Replies with the shared memory counters, so it does not depend on workers
+ * responsiveness
+ */
+static void
+rspamd_control_write_counters (struct rspamd_control_session *session)
+{
+	ucl_object_t *rep, *sub, *cur;
+	struct rspamd_main *rspamd_main = session->rspamd_main;
+	struct rspamd_stat stat;
+	struct rspamd_worker *wrk;
+	GHashTableIter it;
+	gpointer k, v;
+	gchar tmpbuf[64];
+	gint i;
+
+	rspamd_main_stat_copy (rspamd_main, &stat);
+	rep = ucl_object_typed_new (UCL_OBJECT);
+
+	ucl_object_insert_key (rep, ucl_object_fromint (stat.messages_scanned),
+			"scanned", 0, false);
+	ucl_object_insert_key (rep, ucl_object_fromint (stat.messages_learned),
+			"learned", 0, false);
+	sub = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i++) {
+		ucl_object_insert_key (sub, ucl_object_fromint (stat.actions_stat[i]),
+				rspamd_action_to_str (i), 0, false);
+	}
+
+	ucl_object_insert_key (rep, sub, "actions", 0, false);
+	ucl_object_insert_key (rep, ucl_object_fromint (stat.connections_count),
+			"connections", 0, false);
+	ucl_object_insert_key (rep,
+			ucl_object_fromint (stat.control_connections_count),
+			"control_connections", 0, false);
+	ucl_object_insert_key (rep, ucl_object_fromint (stat.lua_heap_size),
+			"lua_heap_size", 0, false);
+	ucl_object_insert_key (rep, ucl_object_fromint (stat.lua_gc_pauses_usec),
+			"lua_gc_pauses_usec", 0, false);
+
+	if (rspamd_main->counters) {
+		sub = ucl_object_typed_new (UCL_OBJECT);
+
+		for (i = 0; i < (gint)rspamd_shm_counters_count (rspamd_main->counters);
+				i ++) {
+			ucl_object_insert_key (sub, ucl_object_fromint (
+					rspamd_shm_counters_get (rspamd_main->counters, i)),
+					rspamd_shm_counters_name (rspamd_main->counters, i),
+					0, true);
+		}
+
+		ucl_object_insert_key (rep, sub, "counters", 0, false);
+	}
+
+	/* Workers are listed from the main process state */
+	sub = ucl_object_typed_new (UCL_OBJECT);
+	g_hash_table_iter_init (&it, rspamd_main->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		wrk = v;
+		rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "%P", wrk->pid);
+		cur = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (cur, ucl_object_fromstring (g_quark_to_string (
+				wrk->type)), "type", 0, false);
+		ucl_object_insert_key (cur, ucl_object_fromdouble (
+				rspamd_get_calendar_ticks () - wrk->start_time),
+				"uptime", 0, false);
+		ucl_object_insert_key (cur, ucl_object_fromint (wrk->generation),
+				"generation", 0, false);
+		ucl_object_insert_key (cur, ucl_object_frombool (wrk->ready),
+				"ready", 0, false);
+		ucl_object_insert_key (sub, cur, tmpbuf, 0, true);
+	}
+
+	ucl_object_insert_key (rep, sub, "workers", 0, false);
+
+	rspamd_control_send_ucl (session, rep);
+	ucl_object_unref (rep);
+}
+
+/*
+ * Drops replies that have arrived after their commands had been timed out,
+ * otherwise they would be taken as replies to the next command
+ */
+static void
+rspamd_control_drain_stale (struct rspamd_worker *wrk)
+{
+	struct rspamd_control_reply rep;
+	guchar fdspace[CMSG_SPACE(sizeof (int))];
+	struct iovec iov;
+	struct msghdr msg;
+
+	for (;;) {
+		iov.iov_base = &rep;
+		iov.iov_len = sizeof (rep);
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_control = fdspace;
+		msg.msg_controllen = sizeof (fdspace);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		if (recvmsg (wrk->control_pipe[0], &msg, MSG_DONTWAIT) <= 0) {
+			break;
+		}
+
+		if (msg.msg_controllen >= CMSG_LEN (sizeof (int))) {
+			close (*(int *) CMSG_DATA(CMSG_FIRSTHDR (&msg)));
+		}
+
+		msg_info ("discarded stale control reply from %P (%s)",
+				wrk->pid, g_quark_to_string (wrk->type));
+	}
+}
+
+static gint rspamd_control_ucl_to_fd (struct rspamd_config *cfg,
+		const ucl_object_t *obj);
+
+/*
+ * Applies dynamic update to the main process config, so workers spawned later
+ * get it as well, and returns fd with the update to be sent to workers
+ */
+static gint
+rspamd_control_prepare_dynamic_update (struct rspamd_control_session *session,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_config *cfg = session->rspamd_main->cfg;
+	struct ucl_parser *parser;
+	ucl_object_t *diff;
+	const gchar *body;
+	gsize body_len;
+	GError *err = NULL;
+	gint fd;
+
+	body = rspamd_http_message_get_body (msg, &body_len);
+
+	if (body == NULL || body_len == 0) {
+		rspamd_control_send_error (session, 400, "Empty dynamic update");
+
+		return -1;
+	}
+
+	parser = ucl_parser_new (0);
+
+	if (!ucl_parser_add_chunk (parser, body, body_len)) {
+		rspamd_control_send_error (session, 400, "Cannot parse update: %s",
+				ucl_parser_get_error (parser));
+		ucl_parser_free (parser);
+
+		return -1;
+	}
+
+	diff = ucl_parser_get_object (parser);
+	ucl_parser_free (parser);
+
+	if (rspamd_dynamic_conf_apply_diff (cfg, diff, &err) == -1) {
+		rspamd_control_send_error (session, 400, "Invalid update: %e", err);
+		g_error_free (err);
+		ucl_object_unref (diff);
+
+		return -1;
+	}
+
+	fd = rspamd_control_ucl_to_fd (cfg, diff);
+	ucl_object_unref (diff);
+
+	if (fd == -1) {
+		rspamd_control_send_error (session, 500, "Cannot save update: %s",
+				strerror (errno));
+	}
+
+	return fd;
+}
+
 static struct rspamd_control_reply_elt *
 rspamd_control_broadcast_cmd (struct rspamd_main *rspamd_main,
 		struct rspamd_control_command *cmd,
@@ -397,6 +644,7 @@ rspamd_control_broadcast_cmd (struct rspamd_main *rspamd_main,
 	while (g_hash_table_iter_next (&it, &k, &v)) {
 		wrk = v;
 
+		rspamd_control_drain_stale (wrk);
 		memset (&msg, 0, sizeof (msg));
 
 		/* Attach fd to the message */
@@ -450,6 +698,7 @@ rspamd_control_finish_handler (struct rspamd_http_connection *conn,
 	guint i;
 	gboolean found = FALSE;
 	struct rspamd_control_reply_elt *cur;
+	gint attached_fd = -1;
 
 
 	if (!session->is_reply) {
@@ -475,15 +724,32 @@ rspamd_control_finish_handler (struct rspamd_http_connection *conn,
 		if (!found) {
 			rspamd_control_send_error (session, 404, "Command not defined");
 		}
+		else if (session->cmd.type == RSPAMD_CONTROL_COUNTERS) {
+			rspamd_control_write_counters (session);
+		}
+		else if (session->cmd.type == RSPAMD_CONTROL_DYNAMIC_UPDATE &&
+				(attached_fd = rspamd_control_prepare_dynamic_update (session,
+						msg)) == -1) {
+			/* Error has been already sent */
+		}
 		else {
+			if (session->cmd.type == RSPAMD_CONTROL_PROFILE &&
+					rspamd_http_message_find_header (msg, "Reset")) {
+				session->cmd.cmd.profile.reset = TRUE;
+			}
+
 			/* Send command to all workers */
 			session->replies = rspamd_control_broadcast_cmd (
-					session->rspamd_main, &session->cmd, -1,
+					session->rspamd_main, &session->cmd, attached_fd,
 					rspamd_control_wrk_io, session);
 
 			DL_FOREACH (session->replies, cur) {
 				session->replies_remain ++;
 			}
+
+			if (attached_fd != -1) {
+				close (attached_fd);
+			}
 		}
 	}
 	else {
@@ -525,6 +791,34 @@ struct rspamd_worker_control_data {
 	} handlers[RSPAMD_CONTROL_MAX];
 };
 
+/* Returns unlinked file with the emitted object opened for reading */
+static gint
+rspamd_control_ucl_to_fd (struct rspamd_config *cfg, const ucl_object_t *obj)
+{
+	struct ucl_emitter_functions *emit_subr;
+	gchar tmppath[PATH_MAX];
+	gint outfd;
+
+	rspamd_snprintf (tmppath, sizeof (tmppath), "%s%c%s-XXXXXXXXXX",
+			cfg->temp_dir, G_DIR_SEPARATOR, "control");
+
+	if ((outfd = mkstemp (tmppath)) == -1) {
+		msg_info_config ("cannot make temporary file for control reply: %s",
+				strerror (errno));
+
+		return -1;
+	}
+
+	emit_subr = ucl_object_emit_fd_funcs (outfd);
+	ucl_object_emit_full (obj, UCL_EMIT_JSON_COMPACT, emit_subr, NULL);
+	ucl_object_emit_funcs_free (emit_subr);
+	close (outfd);
+	outfd = open (tmppath, O_RDONLY);
+	unlink (tmppath);
+
+	return outfd;
+}
+
 static void
 rspamd_control_default_cmd_handler (gint fd,
 		gint attached_fd,
@@ -535,6 +829,12 @@ rspamd_control_default_cmd_handler (gint fd,
 	gssize r;
 	struct rusage rusg;
 	struct rspamd_config *cfg;
+	ucl_object_t *obj;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	guchar fdspace[CMSG_SPACE(sizeof (int))];
+	gint outfd = -1;
 
 	memset (&rep, 0, sizeof (rep));
 	rep.type = cmd->type;
@@ -560,6 +860,56 @@ rspamd_control_default_cmd_handler (gint fd,
 	case RSPAMD_CONTROL_FUZZY_STAT:
 	case RSPAMD_CONTROL_FUZZY_SYNC:
 	case RSPAMD_CONTROL_LOG_PIPE:
+	case RSPAMD_CONTROL_COUNTERS:
+		break;
+	case RSPAMD_CONTROL_MAP_LOADED:
+		rep.reply.map_loaded.status = rspamd_map_load_shared (
+				cd->worker->srv->cfg,
+				cmd->cmd.map_loaded.map_id,
+				cmd->cmd.map_loaded.path) ? 0 : EINVAL;
+		break;
+	case RSPAMD_CONTROL_PROFILE:
+		cfg = cd->worker->srv->cfg;
+
+		if (cfg && cfg->cache && rspamd_worker_is_normal (cd->worker)) {
+			obj = rspamd_symbols_cache_profile (cfg->cache,
+					cmd->cmd.profile.reset);
+			outfd = rspamd_control_ucl_to_fd (cfg, obj);
+			ucl_object_unref (obj);
+			rep.reply.profile.status = outfd == -1 ? errno : 0;
+		}
+		break;
+	case RSPAMD_CONTROL_DYNAMIC_UPDATE:
+		cfg = cd->worker->srv->cfg;
+		rep.reply.dynamic_update.applied = -1;
+
+		if (cfg && attached_fd != -1) {
+			struct ucl_parser *parser = ucl_parser_new (0);
+			GError *err = NULL;
+
+			if (ucl_parser_add_fd (parser, attached_fd)) {
+				obj = ucl_parser_get_object (parser);
+				rep.reply.dynamic_update.applied =
+						rspamd_dynamic_conf_apply_diff (cfg, obj, &err);
+				ucl_object_unref (obj);
+
+				if (err) {
+					msg_err_config ("cannot apply dynamic update: %e", err);
+					rep.reply.dynamic_update.status = err->code;
+					g_error_free (err);
+				}
+			}
+			else {
+				msg_err_config ("cannot parse dynamic update: %s",
+						ucl_parser_get_error (parser));
+				rep.reply.dynamic_update.status = EINVAL;
+			}
+
+			ucl_parser_free (parser);
+		}
+		else {
+			rep.reply.dynamic_update.status = EINVAL;
+		}
 		break;
 	case RSPAMD_CONTROL_RERESOLVE:
 		if (cd->worker->srv->cfg) {
@@ -582,13 +932,34 @@ rspamd_control_default_cmd_handler (gint fd,
 		break;
 	}
 
-	r = write (fd, &rep, sizeof (rep));
+	memset (&msg, 0, sizeof (msg));
+
+	if (outfd != -1) {
+		memset (fdspace, 0, sizeof (fdspace));
+		msg.msg_control = fdspace;
+		msg.msg_controllen = sizeof (fdspace);
+		cmsg = CMSG_FIRSTHDR (&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+		memcpy (CMSG_DATA (cmsg), &outfd, sizeof (int));
+	}
+
+	iov.iov_base = &rep;
+	iov.iov_len = sizeof (rep);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	r = sendmsg (fd, &msg, 0);
 
 	if (r != sizeof (rep)) {
 		msg_err ("cannot write reply to the control socket: %s",
 				strerror (errno));
 	}
 
+	if (outfd != -1) {
+		close (outfd);
+	}
+
 	if (attached_fd != -1) {
 		close (attached_fd);
 	}
@@ -724,6 +1095,18 @@ rspamd_control_log_pipe_io_handler (gint fd, short what, gpointer ud)
 	g_slice_free1 (sizeof (*elt), elt);
 }
 
+static void
+rspamd_control_map_io_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_control_reply_elt *elt = ud;
+	struct rspamd_control_reply rep;
+
+	/* At this point we just ignore replies from the workers */
+	(void) read (fd, &rep, sizeof (rep));
+	event_del (&elt->io_ev);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
 static void
 rspamd_srv_handler (gint fd, short what, gpointer ud)
 {
@@ -814,6 +1197,9 @@ rspamd_srv_handler (gint fd, short what, gpointer ud)
 				rspamd_strlcpy (wcmd.cmd.hs_loaded.cache_dir,
 						cmd.cmd.hs_loaded.cache_dir,
 						sizeof (wcmd.cmd.hs_loaded.cache_dir));
+				rspamd_strlcpy (wcmd.cmd.hs_loaded.re_class,
+						cmd.cmd.hs_loaded.re_class,
+						sizeof (wcmd.cmd.hs_loaded.re_class));
 				wcmd.cmd.hs_loaded.forced = cmd.cmd.hs_loaded.forced;
 				rspamd_control_broadcast_cmd (srv, &wcmd, rfd,
 						rspamd_control_hs_io_handler, NULL);
@@ -825,6 +1211,25 @@ rspamd_srv_handler (gint fd, short what, gpointer ud)
 				rspamd_control_broadcast_cmd (srv, &wcmd, rfd,
 						rspamd_control_log_pipe_io_handler, NULL);
 				break;
+			case RSPAMD_SRV_WORKER_READY:
+				worker->ready = TRUE;
+				msg_info ("%s process %P is ready",
+						g_quark_to_string (worker->type), worker->pid);
+				rspamd_control_stop_old_workers (srv, FALSE);
+				rdata->rep.reply.worker_ready.status = 0;
+				break;
+			case RSPAMD_SRV_MAP_LOADED:
+				/* Let all workers swap their copy of a shared map */
+				memset (&wcmd, 0, sizeof (wcmd));
+				wcmd.type = RSPAMD_CONTROL_MAP_LOADED;
+				wcmd.cmd.map_loaded.map_id = cmd.cmd.map_loaded.map_id;
+				rspamd_strlcpy (wcmd.cmd.map_loaded.path,
+						cmd.cmd.map_loaded.path,
+						sizeof (wcmd.cmd.map_loaded.path));
+				rspamd_control_broadcast_cmd (srv, &wcmd, rfd,
+						rspamd_control_map_io_handler, NULL);
+				rdata->rep.reply.map_loaded.status = 0;
+				break;
 			default:
 				msg_err ("unknown command type: %d", cmd.type);
 				break;
@@ -887,6 +1292,53 @@ rspamd_srv_handler (gint fd, short what, gpointer ud)
 	}
 }
 
+void
+rspamd_control_stop_old_workers (struct rspamd_main *srv, gboolean force)
+{
+	GHashTableIter it;
+	struct rspamd_worker *wrk;
+	gpointer k, v;
+	GQuark normal_quark;
+
+	if (srv->generation == 0) {
+		/* Graceful reload has never been started */
+		return;
+	}
+
+	if (!force) {
+		normal_quark = g_quark_try_string ("normal");
+		g_hash_table_iter_init (&it, srv->workers);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			wrk = v;
+
+			if (wrk->generation == srv->generation && !wrk->ready &&
+					wrk->type == normal_quark) {
+				/* Still waiting for this one */
+				return;
+			}
+		}
+	}
+
+	if (event_get_base (&srv->reload_ev) && evtimer_pending (&srv->reload_ev,
+			NULL)) {
+		evtimer_del (&srv->reload_ev);
+	}
+
+	g_hash_table_iter_init (&it, srv->workers);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		wrk = v;
+
+		if (wrk->generation < srv->generation && !wrk->wanna_die) {
+			wrk->wanna_die = TRUE;
+			kill (wrk->pid, SIGUSR2);
+			msg_info ("send signal to worker %P of the previous generation",
+					wrk->pid);
+		}
+	}
+}
+
 void
 rspamd_srv_start_watching (struct rspamd_worker *worker,
 		struct event_base *ev_base)
@@ -1020,3 +1472,46 @@ rspamd_srv_send_command (struct rspamd_worker *worker,
 	event_base_set (ev_base, &rd->io_ev);
 	event_add (&rd->io_ev, NULL);
 }
+
+gboolean
+rspamd_srv_send_command_sync (struct rspamd_worker *worker,
+		struct rspamd_srv_command *cmd,
+		struct rspamd_srv_reply *rep,
+		gint timeout)
+{
+	gint fd;
+	gssize r;
+
+	g_assert (cmd != NULL);
+	g_assert (worker != NULL);
+
+	fd = worker->srv_pipe[1];
+
+	if (rspamd_socket_poll (fd, timeout, POLLOUT) <= 0) {
+		msg_err ("cannot write to server pipe: timeout");
+		return FALSE;
+	}
+
+	r = write (fd, cmd, sizeof (*cmd));
+
+	if (r != sizeof (*cmd)) {
+		msg_err ("cannot write to server pipe: %s",
+				r == -1 ? strerror (errno) : "partial write");
+		return FALSE;
+	}
+
+	if (rspamd_socket_poll (fd, timeout, POLLIN) <= 0) {
+		msg_err ("cannot read from server pipe: timeout");
+		return FALSE;
+	}
+
+	r = read (fd, rep, sizeof (*rep));
+
+	if (r != sizeof (*rep)) {
+		msg_err ("cannot read from server pipe: %s",
+				r == -1 ? strerror (errno) : "invalid length");
+		return FALSE;
+	}
+
+	return TRUE;
+}
@@ -32,6 +32,10 @@ enum rspamd_control_type {
 	RSPAMD_CONTROL_LOG_PIPE,
 	RSPAMD_CONTROL_FUZZY_STAT,
 	RSPAMD_CONTROL_FUZZY_SYNC,
+	RSPAMD_CONTROL_MAP_LOADED,
+	RSPAMD_CONTROL_PROFILE,
+	RSPAMD_CONTROL_COUNTERS, /* replied by main process without workers */
+	RSPAMD_CONTROL_DYNAMIC_UPDATE,
 	RSPAMD_CONTROL_MAX
 };
 
@@ -39,12 +43,15 @@ enum rspamd_srv_type {
 	RSPAMD_SRV_SOCKETPAIR = 0,
 	RSPAMD_SRV_HYPERSCAN_LOADED,
 	RSPAMD_SRV_LOG_PIPE,
+	RSPAMD_SRV_MAP_LOADED,
+	RSPAMD_SRV_WORKER_READY,
 };
 
 enum rspamd_log_pipe_type {
 	RSPAMD_LOG_PIPE_SYMBOLS = 0,
 };
 #define CONTROL_PATHLEN 400
+#define CONTROL_RE_CLASS_LEN 72
 struct rspamd_control_command {
 	enum rspamd_control_type type;
 	union {
@@ -62,6 +69,7 @@ struct rspamd_control_command {
 		} recompile;
 		struct {
 			gchar cache_dir[CONTROL_PATHLEN];
+			gchar re_class[CONTROL_RE_CLASS_LEN]; /* empty for all classes */
 			gboolean forced;
 		} hs_loaded;
 		struct {
@@ -73,6 +81,16 @@ struct rspamd_control_command {
 		struct {
 			guint unused;
 		} fuzzy_sync;
+		struct {
+			guint32 map_id;
+			gchar path[CONTROL_PATHLEN];
+		} map_loaded;
+		struct {
+			gboolean reset;
+		} profile;
+		struct {
+			guint unused;
+		} dynamic_update;
 	} cmd;
 };
 
@@ -108,6 +126,16 @@ struct rspamd_control_reply {
 		struct {
 			guint status;
 		} fuzzy_sync;
+		struct {
+			guint status;
+		} map_loaded;
+		struct {
+			guint status;
+		} profile;
+		struct {
+			guint status;
+			gint applied;
+		} dynamic_update;
 	} reply;
 };
 
@@ -124,11 +152,19 @@ struct rspamd_srv_command {
 		} spair;
 		struct {
 			gchar cache_dir[CONTROL_PATHLEN];
+			gchar re_class[CONTROL_RE_CLASS_LEN]; /* empty for all classes */
 			gboolean forced;
 		} hs_loaded;
 		struct {
 			enum rspamd_log_pipe_type type;
 		} log_pipe;
+		struct {
+			guint32 map_id;
+			gchar path[CONTROL_PATHLEN];
+		} map_loaded;
+		struct {
+			guint unused;
+		} worker_ready;
 	} cmd;
 };
 
@@ -145,6 +181,12 @@ struct rspamd_srv_reply {
 		struct {
 			enum rspamd_log_pipe_type type;
 		} log_pipe;
+		struct {
+			gint status;
+		} map_loaded;
+		struct {
+			gint status;
+		} worker_ready;
 	} reply;
 };
 
@@ -196,4 +238,23 @@ void rspamd_srv_send_command (struct rspamd_worker *worker,
 		gint attached_fd,
 		rspamd_srv_reply_handler handler,
 		gpointer ud);
+
+/**
+ * Send command to srv pipe and wait for reply synchronously, could be used
+ * by workers that are blocked outside of the event loop. Commands with
+ * attached descriptors are not supported.
+ * @param timeout timeout in milliseconds
+ * @return TRUE if reply has been received
+ */
+gboolean rspamd_srv_send_command_sync (struct rspamd_worker *worker,
+		struct rspamd_srv_command *cmd,
+		struct rspamd_srv_reply *rep,
+		gint timeout);
+
+/**
+ * Terminates workers spawned before the last reload
+ * @param force if FALSE, old workers are kept until all new normal workers
+ * have reported that they are ready
+ */
+void rspamd_control_stop_old_workers (struct rspamd_main *srv, gboolean force);
 #endif
@@ -19,6 +19,7 @@
 #include "rspamd.h"
 #include "message.h"
 #include "utlist.h"
+#include "cryptobox.h"
 
 #define SPF_VER1_STR "v=spf1"
 #define SPF_VER2_STR "spf2."
@@ -270,11 +271,214 @@ rspamd_flatten_record_dtor (struct spf_resolved *r)
 		g_free (addr->spf_string);
 	}
 
+	if (r->index) {
+		g_hash_table_unref (r->index->prefixes);
+		g_slice_free1 (sizeof (*r->index), r->index);
+	}
+
 	g_free (r->domain);
 	g_array_free (r->elts, TRUE);
 	g_slice_free1 (sizeof (*r), r);
 }
 
+/*
+ * Index of a flattened record: every network is stored under its masked
+ * address, so a lookup costs one hash probe per distinct mask length instead
+ * of a scan over all elements. Values are positions of the first element
+ * with such a network, the minimum position among all matching networks is
+ * the element that a linear scan would find.
+ */
+struct spf_addr_prefix {
+	guchar addr[sizeof (struct in6_addr)];
+	guint16 mask;
+	guint16 af;
+};
+
+struct spf_addr_index {
+	GHashTable *prefixes;
+	gint any; /* first wide policy or -1 */
+	guint nmasks4;
+	guint nmasks6;
+	guint8 masks4[sizeof (struct in_addr) * CHAR_BIT + 1];
+	guint8 masks6[sizeof (struct in6_addr) * CHAR_BIT + 1];
+};
+
+static guint
+spf_addr_prefix_hash (gconstpointer p)
+{
+	return rspamd_cryptobox_fast_hash (p, sizeof (struct spf_addr_prefix),
+			rspamd_hash_seed ());
+}
+
+static gboolean
+spf_addr_prefix_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, sizeof (struct spf_addr_prefix)) == 0;
+}
+
+static void
+spf_addr_prefix_fill (struct spf_addr_prefix *pfx, const guchar *addr,
+		guint addrlen, guint mask, guint af)
+{
+	guint bmask = mask / CHAR_BIT;
+
+	memset (pfx, 0, sizeof (*pfx));
+	memcpy (pfx->addr, addr, bmask);
+
+	if (bmask * CHAR_BIT < mask) {
+		pfx->addr[bmask] = addr[bmask] &
+				((0xff << (CHAR_BIT - (mask - bmask * CHAR_BIT))) & 0xff);
+	}
+
+	pfx->mask = mask;
+	pfx->af = af;
+}
+
+static void
+spf_addr_index_add (struct spf_addr_index *idx, const guchar *addr,
+		guint addrlen, guint mask, guint af, guint pos)
+{
+	struct spf_addr_prefix *pfx;
+	guint8 *masks;
+	guint *nmasks, i;
+
+	if (mask > addrlen * CHAR_BIT) {
+		/* Bad mask, such an element never matches */
+		return;
+	}
+
+	pfx = g_malloc (sizeof (*pfx));
+	spf_addr_prefix_fill (pfx, addr, addrlen, mask, af);
+
+	if (g_hash_table_lookup (idx->prefixes, pfx) != NULL) {
+		/* Keep the first element */
+		g_free (pfx);
+		return;
+	}
+
+	g_hash_table_insert (idx->prefixes, pfx, GUINT_TO_POINTER (pos + 1));
+
+	if (af == AF_INET) {
+		masks = idx->masks4;
+		nmasks = &idx->nmasks4;
+	}
+	else {
+		masks = idx->masks6;
+		nmasks = &idx->nmasks6;
+	}
+
+	for (i = 0; i < *nmasks; i ++) {
+		if (masks[i] == mask) {
+			return;
+		}
+	}
+
+	masks[(*nmasks)++] = mask;
+}
+
+static struct spf_addr_index *
+spf_addr_index_build (struct spf_resolved *rec)
+{
+	struct spf_addr_index *idx;
+	struct spf_addr *addr;
+	guint i;
+
+	idx = g_slice_alloc0 (sizeof (*idx));
+	idx->prefixes = g_hash_table_new_full (spf_addr_prefix_hash,
+			spf_addr_prefix_equal, g_free, NULL);
+	idx->any = -1;
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+
+		if (addr->flags & RSPAMD_SPF_FLAG_TEMPFAIL) {
+			continue;
+		}
+
+		if (addr->flags & RSPAMD_SPF_FLAG_ANY) {
+			/* Matches everything, nothing after it is reachable */
+			idx->any = i;
+			break;
+		}
+
+		if (addr->flags & RSPAMD_SPF_FLAG_IPV4) {
+			spf_addr_index_add (idx, addr->addr4, sizeof (addr->addr4),
+					addr->m.dual.mask_v4, AF_INET, i);
+		}
+		if (addr->flags & RSPAMD_SPF_FLAG_IPV6) {
+			spf_addr_index_add (idx, addr->addr6, sizeof (addr->addr6),
+					addr->m.dual.mask_v6, AF_INET6, i);
+		}
+	}
+
+	return idx;
+}
+
+struct spf_addr *
+rspamd_spf_resolved_match (struct spf_resolved *rec,
+		const rspamd_inet_addr_t *addr)
+{
+	struct spf_addr_index *idx;
+	struct spf_addr_prefix pfx;
+	const guchar *d;
+	const guint8 *masks;
+	guint addrlen, nmasks, i, best = G_MAXUINT;
+	gint af;
+	gpointer pos;
+
+	if (addr == NULL || rec->elts->len == 0) {
+		return NULL;
+	}
+
+	if (rec->index == NULL) {
+		rec->index = spf_addr_index_build (rec);
+	}
+
+	idx = rec->index;
+
+	if (idx->any != -1) {
+		best = idx->any;
+	}
+
+	af = rspamd_inet_address_get_af (addr);
+
+	if (af == AF_INET) {
+		masks = idx->masks4;
+		nmasks = idx->nmasks4;
+	}
+	else if (af == AF_INET6) {
+		masks = idx->masks6;
+		nmasks = idx->nmasks6;
+	}
+	else {
+		nmasks = 0;
+		masks = NULL;
+	}
+
+	if (nmasks > 0) {
+		d = rspamd_inet_address_get_hash_key (addr, &addrlen);
+
+		for (i = 0; i < nmasks; i ++) {
+			if (masks[i] > addrlen * CHAR_BIT) {
+				continue;
+			}
+
+			spf_addr_prefix_fill (&pfx, d, addrlen, masks[i], af);
+			pos = g_hash_table_lookup (idx->prefixes, &pfx);
+
+			if (pos != NULL && GPOINTER_TO_UINT (pos) - 1 < best) {
+				best = GPOINTER_TO_UINT (pos) - 1;
+			}
+		}
+	}
+
+	if (best == G_MAXUINT) {
+		return NULL;
+	}
+
+	return &g_array_index (rec->elts, struct spf_addr, best);
+}
+
 static void
 rspamd_spf_process_reference (struct spf_resolved *target,
 		struct spf_addr *addr, struct spf_record *rec, gboolean top)
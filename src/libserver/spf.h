@@ -7,6 +7,7 @@
 
 struct rspamd_task;
 struct spf_resolved;
+struct spf_addr_index;
 
 typedef void (*spf_cb_t)(struct spf_resolved *record,
 		struct rspamd_task *task, gpointer cbdata);
@@ -65,6 +66,7 @@ struct spf_resolved {
 	gboolean na;
 	gboolean perm_failed;
 	GArray *elts; /* Flat list of struct spf_addr */
+	struct spf_addr_index *index; /* Built on the first match */
 	ref_entry_t ref; /* Refcounting */
 };
 
@@ -75,6 +77,14 @@ struct spf_resolved {
 gboolean rspamd_spf_resolve (struct rspamd_task *task, spf_cb_t callback,
 		gpointer cbdata);
 
+/*
+ * Find the first element of a flattened record that covers the address
+ * (the same element as a linear scan would find), returns NULL if nothing
+ * matches
+ */
+struct spf_addr * rspamd_spf_resolved_match (struct spf_resolved *rec,
+		const rspamd_inet_addr_t *addr);
+
 /*
  * Get a domain for spf for specified task
  */
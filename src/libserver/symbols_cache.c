@@ -19,10 +19,14 @@
 #include "message.h"
 #include "symbols_cache.h"
 #include "cfg_file.h"
+#include "result_cache.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
 #include "contrib/t1ha/t1ha.h"
 #include "libserver/worker_util.h"
+#include "histogram.h"
+#include "lua/lua_thread_pool.h"
+#include "ottery.h"
 #include <math.h>
 
 #define msg_err_cache(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
@@ -78,8 +82,19 @@ struct symbols_cache {
 	rspamd_mempool_mutex_t *mtx;
 	gdouble reload_time;
 	gint peak_cb;
+	GPtrArray *free_checkpoints;
+	/* Sums of positive and negative scores of all items */
+	gdouble max_pos;
+	gdouble max_neg;
+	/* Tasks selected by the sampling profiler in this process */
+	guint64 profiled_tasks;
 };
 
+/* Maximum number of idle checkpoints kept for reuse */
+#define SYMBOLS_CACHE_MAX_FREE_CHECKPOINTS 64
+/* Imported profile is ignored for symbols with this number of local runs */
+#define SYMBOLS_CACHE_PROFILE_MIN_RUNS 1000
+
 struct counter_data {
 	gdouble mean;
 	gdouble stddev;
@@ -95,6 +110,11 @@ struct item_stat {
 	struct counter_data frequency_counter;
 	gdouble avg_frequency;
 	gdouble stddev_frequency;
+	/* Number of executions and executions that have registered async events */
+	guint runs;
+	guint async_runs;
+	/* Latency of callbacks measured by all workers */
+	struct rspamd_histogram latency;
 };
 
 struct cache_item {
@@ -122,10 +142,22 @@ struct cache_item {
 	gint priority;
 	gint id;
 	gint frequency_peaks;
+	/* Length of the async chain that is blocked by this item */
+	gint crit_path;
+	/* Scores that could be added by this item and its virtual symbols */
+	gdouble max_pos;
+	gdouble max_neg;
 
 	/* Dependencies */
 	GPtrArray *deps;
 	GPtrArray *rdeps;
+
+	/* Per process times of sampled executions */
+	struct {
+		guint64 samples;
+		gdouble c_time;
+		gdouble lua_time;
+	} prof;
 };
 
 struct cache_dependency {
@@ -156,14 +188,34 @@ enum rspamd_cache_savepoint_stage {
 	RSPAMD_CACHE_PASS_DONE,
 };
 
+/*
+ * Per task state of the cache: bitsets indexed by item id, checkpoints are
+ * returned to the cache on task destruction and reused by the next tasks
+ */
 struct cache_savepoint {
-	guchar *processed_bits;
+	guchar *started; /* check has been started (or disabled) */
+	guchar *finished; /* check has been finished (or disabled) */
+	guchar *waiting; /* item is queued to `waitq` */
+	guint nbytes; /* size of each bitset */
 	enum rspamd_cache_savepoint_stage pass;
 	guint version;
 	struct rspamd_metric_result *rs;
 	gdouble lim;
+	/* Scores that could be still added by items that are not finished */
+	gdouble remain_pos;
+	gdouble remain_neg;
 	GPtrArray *waitq;
 	struct symbols_cache_order *order;
+	/* Indexed by item id, allocated in a task pool for profiled tasks */
+	struct cache_item_timing *timings;
+	/* Task is selected by the sampling profiler */
+	gboolean sampled;
+};
+
+struct cache_item_timing {
+	gdouble start;
+	gdouble cpu;
+	gdouble wait;
 };
 
 struct rspamd_cache_refresh_cbdata {
@@ -181,6 +233,9 @@ struct rspamd_cache_refresh_cbdata {
 #define SCORE_FUN(w, f, t) (((w) > 0 ? (w) : WEIGHT_ALPHA) \
 		* ((f) > 0 ? (f) : FREQ_ALPHA) \
 		/ (t > TIME_ALPHA ? t : TIME_ALPHA))
+/* Symbols that register async events in more than this share of runs */
+#define ASYNC_RATIO (0.5)
+#define ASYNC_MIN_RUNS (10)
 
 static gboolean rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 		struct symbols_cache *cache,
@@ -193,6 +248,8 @@ static gboolean rspamd_symbols_cache_check_deps (struct rspamd_task *task,
 		struct cache_savepoint *checkpoint,
 		guint recursion,
 		gboolean check_only);
+static void rspamd_symbols_cache_checkpoint_dtor (
+		struct cache_savepoint *checkpoint);
 static void rspamd_symbols_cache_disable_symbol_checkpoint (struct rspamd_task *task,
 		struct symbols_cache *cache, const gchar *symbol);
 static void rspamd_symbols_cache_enable_symbol_checkpoint (struct rspamd_task *task,
@@ -285,7 +342,15 @@ cache_logic_cmp (const void *p1, const void *p2, gpointer ud)
 	double weight1, weight2;
 	double f1 = 0, f2 = 0, t1, t2, avg_freq, avg_weight;
 
-	if (i1->deps->len != 0 || i2->deps->len != 0) {
+	if (i1->priority == i2->priority && i1->crit_path != i2->crit_path) {
+		/*
+		 * Items that start (or unblock) network requests are moved before
+		 * the CPU bound ones, the longest async chain goes first
+		 */
+		w1 = i1->crit_path;
+		w2 = i2->crit_path;
+	}
+	else if (i1->deps->len != 0 || i2->deps->len != 0) {
 		/* TODO: handle complex dependencies */
 		w1 = 1.0;
 		w2 = 1.0;
@@ -346,6 +411,113 @@ rspamd_set_counter (struct counter_data *cd, gdouble value)
 	return cd->mean;
 }
 
+static inline gboolean
+rspamd_symbols_cache_item_is_async (struct cache_item *it)
+{
+	if (it->st->runs < ASYNC_MIN_RUNS) {
+		return FALSE;
+	}
+
+	return ((gdouble)it->st->async_runs / it->st->runs) > ASYNC_RATIO;
+}
+
+/*
+ * Critical path length for an item is the number of async items in the
+ * longest chain of items that depend on this one (including itself)
+ */
+static gint
+rspamd_symbols_cache_calculate_crit_path (struct symbols_cache *cache,
+		struct cache_item *it, guint recursion)
+{
+	struct cache_dependency *rdep;
+	guint i;
+	gint cur, max = 0;
+	static const guint max_recursion = 20;
+
+	if (it->crit_path >= 0) {
+		return it->crit_path;
+	}
+
+	if (recursion > max_recursion) {
+		msg_err_cache ("cyclic dependencies: maximum check level %ud exceed when "
+				"calculating critical path for %s", max_recursion, it->symbol);
+
+		return 0;
+	}
+
+	PTR_ARRAY_FOREACH (it->rdeps, i, rdep) {
+		if (rdep->item) {
+			cur = rspamd_symbols_cache_calculate_crit_path (cache, rdep->item,
+					recursion + 1);
+
+			if (cur > max) {
+				max = cur;
+			}
+		}
+	}
+
+	if (rspamd_symbols_cache_item_is_async (it)) {
+		max ++;
+	}
+
+	it->crit_path = max;
+
+	return max;
+}
+
+/*
+ * Calculate maximum positive and negative scores that each item could add,
+ * scores of virtual symbols are accounted in their parents
+ */
+static void
+rspamd_symbols_cache_calculate_bounds (struct symbols_cache *cache)
+{
+	struct cache_item *it, *target;
+	struct rspamd_symbol *sdef;
+	gdouble w;
+	guint i;
+
+	cache->max_pos = 0;
+	cache->max_neg = 0;
+
+	for (i = 0; i < cache->used_items; i ++) {
+		it = g_ptr_array_index (cache->items_by_id, i);
+		it->max_pos = 0;
+		it->max_neg = 0;
+	}
+
+	for (i = 0; i < cache->used_items; i ++) {
+		it = g_ptr_array_index (cache->items_by_id, i);
+
+		if (it->symbol == NULL || (it->type & SYMBOL_TYPE_SKIPPED)) {
+			continue;
+		}
+
+		sdef = NULL;
+
+		if (cache->cfg->default_metric) {
+			sdef = g_hash_table_lookup (cache->cfg->default_metric->symbols,
+					it->symbol);
+		}
+
+		w = sdef ? *sdef->weight_ptr : it->st->weight;
+		target = it;
+
+		if ((it->type & SYMBOL_TYPE_VIRTUAL) && it->parent != -1) {
+			target = g_ptr_array_index (cache->items_by_id, it->parent);
+		}
+
+		if (w > 0) {
+			target->max_pos += w;
+			cache->max_pos += w;
+		}
+		else {
+			target->max_neg += w;
+			cache->max_neg += w;
+		}
+	}
+}
+
 static void
 rspamd_symbols_cache_resort (struct symbols_cache *cache)
 {
@@ -355,10 +527,17 @@ rspamd_symbols_cache_resort (struct symbols_cache *cache)
 	struct cache_item *it;
 
 	ord = rspamd_symbols_cache_order_new (cache->used_items);
+	rspamd_symbols_cache_calculate_bounds (cache);
+
+	for (i = 0; i < cache->used_items; i ++) {
+		it = g_ptr_array_index (cache->items_by_id, i);
+		it->crit_path = -1;
+	}
 
 	for (i = 0; i < cache->used_items; i ++) {
 		it = g_ptr_array_index (cache->items_by_id, i);
 		total_hits += it->st->total_hits;
+		rspamd_symbols_cache_calculate_crit_path (cache, it, 0);
 
 		if (!(it->type & (SYMBOL_TYPE_PREFILTER|SYMBOL_TYPE_POSTFILTER|SYMBOL_TYPE_COMPOSITE))) {
 			g_ptr_array_add (ord->d, it);
@@ -387,8 +566,6 @@ rspamd_symbols_cache_post_init (struct symbols_cache *cache)
 	guint i, j;
 	gint id;
 
-	rspamd_symbols_cache_resort (cache);
-
 	cur = cache->delayed_deps;
 	while (cur) {
 		ddep = cur->data;
@@ -466,6 +643,8 @@ rspamd_symbols_cache_post_init (struct symbols_cache *cache)
 		}
 	}
 
+	/* Resort after dependencies are resolved to get critical paths */
+	rspamd_symbols_cache_resort (cache);
 	g_ptr_array_sort_with_data (cache->prefilters, prefilters_cmp, cache);
 	g_ptr_array_sort_with_data (cache->postfilters, postfilters_cmp, cache);
 }
@@ -591,6 +770,16 @@ rspamd_symbols_cache_load_items (struct symbols_cache *cache, const gchar *name)
 				item->last_count = item->st->total_hits;
 			}
 
+			elt = ucl_object_lookup (cur, "async");
+			if (elt) {
+				item->st->async_runs = ucl_object_toint (elt);
+			}
+
+			elt = ucl_object_lookup (cur, "runs");
+			if (elt) {
+				item->st->runs = ucl_object_toint (elt);
+			}
+
 			elt = ucl_object_lookup (cur, "frequency");
 			if (elt && ucl_object_type (elt) == UCL_OBJECT) {
 				const ucl_object_t *cur;
@@ -633,15 +822,133 @@ rspamd_symbols_cache_load_items (struct symbols_cache *cache, const gchar *name)
 	return TRUE;
 }
 
-static gboolean
-rspamd_symbols_cache_save_items (struct symbols_cache *cache, const gchar *name)
+ucl_object_t *
+rspamd_symbols_cache_get_profile (struct symbols_cache *cache)
 {
-	struct rspamd_symbols_cache_header hdr;
 	ucl_object_t *top, *elt, *freq;
 	GHashTableIter it;
 	struct cache_item *item;
-	struct ucl_emitter_functions *efunc;
 	gpointer k, v;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	g_hash_table_iter_init (&it, cache->items_by_symbol);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		item = v;
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (item->st->weight),
+				"weight", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (item->st->time_counter.mean),
+				"time", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (item->st->total_hits),
+				"count", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (item->st->runs),
+				"runs", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (item->st->async_runs),
+				"async", 0, false);
+
+		freq = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (freq, ucl_object_fromdouble (item->st->frequency_counter.mean),
+				"avg", 0, false);
+		ucl_object_insert_key (freq, ucl_object_fromdouble (item->st->frequency_counter.stddev),
+				"stddev", 0, false);
+		ucl_object_insert_key (elt, freq, "frequency", 0, false);
+
+		ucl_object_insert_key (top, elt, k, 0, false);
+	}
+
+	return top;
+}
+
+guint
+rspamd_symbols_cache_import_profile (struct symbols_cache *cache,
+		const ucl_object_t *profile)
+{
+	const ucl_object_t *cur, *elt, *freq;
+	ucl_object_iter_t it = NULL;
+	struct cache_item *item;
+	gdouble tm;
+	gint64 runs, async_runs;
+	guint nimported = 0;
+
+	g_assert (cache != NULL);
+
+	if (profile == NULL || ucl_object_type (profile) != UCL_OBJECT) {
+		return 0;
+	}
+
+	rspamd_mempool_lock_mutex (cache->mtx);
+
+	while ((cur = ucl_object_iterate (profile, &it, true)) != NULL) {
+		item = g_hash_table_lookup (cache->items_by_symbol,
+				ucl_object_key (cur));
+
+		if (item == NULL || item->st->runs >= SYMBOLS_CACHE_PROFILE_MIN_RUNS) {
+			/* Local data is good enough */
+			continue;
+		}
+
+		elt = ucl_object_lookup (cur, "runs");
+		runs = elt ? ucl_object_toint (elt) : 0;
+
+		if (runs <= item->st->runs) {
+			continue;
+		}
+
+		elt = ucl_object_lookup (cur, "async");
+		async_runs = elt ? ucl_object_toint (elt) : 0;
+		item->st->runs = MIN (runs, G_MAXUINT);
+		item->st->async_runs = MIN (async_runs, item->st->runs);
+
+		elt = ucl_object_lookup (cur, "time");
+		tm = elt ? ucl_object_todouble (elt) : 0;
+
+		if (tm > 0) {
+			/* Local measurements are averaged with the imported value */
+			item->st->avg_time = tm;
+			item->st->time_counter.mean = tm;
+			item->st->time_counter.number = 1;
+		}
+
+		freq = ucl_object_lookup (cur, "frequency");
+
+		if (freq && ucl_object_type (freq) == UCL_OBJECT &&
+				item->st->frequency_counter.number == 0) {
+			elt = ucl_object_lookup (freq, "avg");
+
+			if (elt) {
+				item->st->avg_frequency = ucl_object_todouble (elt);
+				item->st->frequency_counter.mean = item->st->avg_frequency;
+				item->st->frequency_counter.number = 1;
+			}
+
+			elt = ucl_object_lookup (freq, "stddev");
+
+			if (elt) {
+				item->st->stddev_frequency = ucl_object_todouble (elt);
+				item->st->frequency_counter.stddev = item->st->stddev_frequency;
+			}
+		}
+
+		nimported ++;
+	}
+
+	rspamd_mempool_unlock_mutex (cache->mtx);
+
+	if (nimported > 0) {
+		msg_info_cache ("imported profile for %ud symbols", nimported);
+		rspamd_symbols_cache_resort (cache);
+	}
+
+	return nimported;
+}
+
+static gboolean
+rspamd_symbols_cache_save_items (struct symbols_cache *cache, const gchar *name)
+{
+	struct rspamd_symbols_cache_header hdr;
+	ucl_object_t *top;
+	struct ucl_emitter_functions *efunc;
 	gint fd;
 	bool ret;
 
@@ -669,29 +976,7 @@ rspamd_symbols_cache_save_items (struct symbols_cache *cache, const gchar *name)
 		return FALSE;
 	}
 
-	top = ucl_object_typed_new (UCL_OBJECT);
-	g_hash_table_iter_init (&it, cache->items_by_symbol);
-
-	while (g_hash_table_iter_next (&it, &k, &v)) {
-		item = v;
-		elt = ucl_object_typed_new (UCL_OBJECT);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (item->st->weight),
-				"weight", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (item->st->time_counter.mean),
-				"time", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (item->st->total_hits),
-				"count", 0, false);
-
-		freq = ucl_object_typed_new (UCL_OBJECT);
-		ucl_object_insert_key (freq, ucl_object_fromdouble (item->st->frequency_counter.mean),
-				"avg", 0, false);
-		ucl_object_insert_key (freq, ucl_object_fromdouble (item->st->frequency_counter.stddev),
-				"stddev", 0, false);
-		ucl_object_insert_key (elt, freq, "frequency", 0, false);
-
-		ucl_object_insert_key (top, elt, k, 0, false);
-	}
-
+	top = rspamd_symbols_cache_get_profile (cache);
 	efunc = ucl_object_emit_fd_funcs (fd);
 	ret = ucl_object_emit_full (top, UCL_EMIT_JSON_COMPACT, efunc, NULL);
 	ucl_object_emit_funcs_free (efunc);
@@ -888,6 +1173,7 @@ rspamd_symbols_cache_destroy (struct symbols_cache *cache)
 	GList *cur;
 	struct delayed_cache_dependency *ddep;
 	struct delayed_cache_condition *dcond;
+	guint i;
 
 	if (cache != NULL) {
 		rspamd_symbols_cache_save (cache);
@@ -927,6 +1213,13 @@ rspamd_symbols_cache_destroy (struct symbols_cache *cache)
 		g_ptr_array_free (cache->composites, TRUE);
 		REF_RELEASE (cache->items_by_order);
 
+		for (i = 0; i < cache->free_checkpoints->len; i ++) {
+			rspamd_symbols_cache_checkpoint_dtor (
+					g_ptr_array_index (cache->free_checkpoints, i));
+		}
+
+		g_ptr_array_free (cache->free_checkpoints, TRUE);
+
 		if (cache->peak_cb != -1) {
 			luaL_unref (cache->cfg->lua_state, LUA_REGISTRYINDEX, cache->peak_cb);
 		}
@@ -949,6 +1242,7 @@ rspamd_symbols_cache_new (struct rspamd_config *cfg)
 	cache->prefilters = g_ptr_array_new ();
 	cache->postfilters = g_ptr_array_new ();
 	cache->composites = g_ptr_array_new ();
+	cache->free_checkpoints = g_ptr_array_new ();
 	cache->mtx = rspamd_mempool_get_mutex (cache->static_pool);
 	cache->reload_time = cfg->cache_reload_time;
 	cache->total_hits = 1;
@@ -1174,7 +1468,7 @@ rspamd_symbols_cache_metric_limit (struct rspamd_task *task,
 		 */
 		while (cur) {
 			metric = cur->data;
-			res = g_hash_table_lookup (task->results, metric->name);
+			res = rspamd_mempool_hash_lookup (task->results, metric->name);
 
 			if (res) {
 				ms = rspamd_task_get_required_score (task, res);
@@ -1203,6 +1497,63 @@ rspamd_symbols_cache_metric_limit (struct rspamd_task *task,
 	return FALSE;
 }
 
+/*
+ * Return true if items that are not finished cannot change the action of the
+ * default metric. It assumes that each symbol is inserted once with its
+ * configured score, so this mode is enabled explicitly by `early_verdict`
+ */
+static gboolean
+rspamd_symbols_cache_verdict_is_final (struct rspamd_task *task,
+		struct cache_savepoint *cp)
+{
+	struct rspamd_metric_result *res;
+	gdouble sc, lo, hi;
+	guint i;
+
+	if (!task->cfg->early_verdict || task->settings != NULL ||
+			(task->flags & RSPAMD_TASK_FLAG_PASS_ALL) ||
+			task->pre_result.action != METRIC_ACTION_MAX ||
+			task->cfg->metrics_list == NULL ||
+			task->cfg->metrics_list->next != NULL) {
+		return FALSE;
+	}
+
+	res = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
+
+	if (res == NULL || res->metric->grow_factor > 1.0) {
+		return FALSE;
+	}
+
+	lo = res->score + cp->remain_neg;
+	hi = res->score + cp->remain_pos;
+
+	for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
+		sc = res->actions_limits[i];
+
+		/* Limits that are not positive are never selected */
+		if (isnan (sc) || sc <= 0) {
+			continue;
+		}
+
+		if (lo < sc && hi >= sc) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static inline void
+rspamd_symbols_cache_finish_item (struct cache_savepoint *checkpoint,
+		struct cache_item *item)
+{
+	if (isclr (checkpoint->finished, item->id)) {
+		setbit (checkpoint->finished, item->id);
+		checkpoint->remain_pos -= item->max_pos;
+		checkpoint->remain_neg -= item->max_neg;
+	}
+}
+
 static void
 rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 {
@@ -1215,14 +1566,26 @@ rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 	checkpoint = task->checkpoint;
 	cache = task->cfg->cache;
 
+	if (checkpoint == NULL) {
+		/* Task is being destroyed */
+		return;
+	}
+
 	/* Specify that we are done with this item */
-	setbit (checkpoint->processed_bits, item->id * 2 + 1);
+	rspamd_symbols_cache_finish_item (checkpoint, item);
+
+	if (G_UNLIKELY (checkpoint->timings) &&
+			checkpoint->timings[item->id].start > 0) {
+		checkpoint->timings[item->id].wait = rspamd_get_ticks () -
+				checkpoint->timings[item->id].start -
+				checkpoint->timings[item->id].cpu;
+	}
 
 	if (checkpoint->pass > 0) {
 		for (i = 0; i < (gint)checkpoint->waitq->len; i ++) {
 			it = g_ptr_array_index (checkpoint->waitq, i);
 
-			if (!isset (checkpoint->processed_bits, it->id * 2)) {
+			if (!isset (checkpoint->started, it->id)) {
 				if (!rspamd_symbols_cache_check_deps (task, cache, it,
 						checkpoint, 0, TRUE)) {
 					remain ++;
@@ -1252,7 +1615,7 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 {
 	guint pending_before, pending_after;
 	double t1 = 0, t2 = 0;
-	gdouble diff;
+	gdouble diff, lua_time = 0;
 	struct rspamd_task **ptask;
 	lua_State *L;
 	gboolean check = TRUE;
@@ -1262,12 +1625,17 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 
 		g_assert (item->func != NULL);
 		/* Check has been started */
-		setbit (checkpoint->processed_bits, item->id * 2);
+		setbit (checkpoint->started, item->id);
 
 		if (!item->enabled ||
 				(RSPAMD_TASK_IS_EMPTY (task) && !(item->type & SYMBOL_TYPE_EMPTY))) {
 			check = FALSE;
 		}
+		else if ((item->type & SYMBOL_TYPE_CONTENT) &&
+				rspamd_result_cache_is_applied (task)) {
+			/* Results have been inserted from the results cache */
+			check = FALSE;
+		}
 		else if (item->condition_cb != -1) {
 			/* We also executes condition callback to check if we need this symbol */
 			L = task->cfg->lua_state;
@@ -1295,13 +1663,32 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 					rspamd_symbols_cache_watcher_cb,
 					item);
 			msg_debug_task ("execute %s, %d", item->symbol, item->id);
+
+			if (G_UNLIKELY (checkpoint->sampled)) {
+				lua_time = lua_thread_pool_profile (task->cfg->lua_thread_pool,
+						TRUE);
+			}
+
 			t1 = rspamd_get_ticks ();
 			item->func (task, item->user_data);
 			t2 = rspamd_get_ticks ();
 			diff = (t2 - t1) * 1e6;
 
+			if (G_UNLIKELY (checkpoint->sampled)) {
+				lua_time = lua_thread_pool_profile (task->cfg->lua_thread_pool,
+						FALSE) - lua_time;
+				item->prof.samples ++;
+				item->prof.lua_time += lua_time;
+				item->prof.c_time += MAX (t2 - t1 - lua_time, 0);
+			}
+
 			if (G_UNLIKELY (RSPAMD_TASK_IS_PROFILING (task))) {
 				rspamd_task_profile_set (task, item->symbol, diff);
+
+				if (checkpoint->timings) {
+					checkpoint->timings[item->id].start = t1;
+					checkpoint->timings[item->id].cpu = t2 - t1;
+				}
 			}
 
 			if (total_diff) {
@@ -1315,14 +1702,23 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 
 			if (rspamd_worker_is_normal (task->worker)) {
 				rspamd_set_counter (item->cd, diff);
+				rspamd_histogram_add (&item->st->latency, diff / 1e6);
 			}
 
 			pending_after = rspamd_session_events_pending (task->s);
 			rspamd_session_watch_stop (task->s);
 
+			if (rspamd_worker_is_normal (task->worker)) {
+				g_atomic_int_inc (&item->st->runs);
+
+				if (pending_after > pending_before) {
+					g_atomic_int_inc (&item->st->async_runs);
+				}
+			}
+
 			if (pending_before == pending_after) {
 				/* No new events registered */
-				setbit (checkpoint->processed_bits, item->id * 2 + 1);
+				rspamd_symbols_cache_finish_item (checkpoint, item);
 
 				return TRUE;
 			}
@@ -1332,14 +1728,14 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 		else {
 			msg_debug_task ("skipping check of %s as its start condition is false",
 					item->symbol);
-			setbit (checkpoint->processed_bits, item->id * 2 + 1);
+			rspamd_symbols_cache_finish_item (checkpoint, item);
 
 			return TRUE;
 		}
 	}
 	else {
-		setbit (checkpoint->processed_bits, item->id * 2);
-		setbit (checkpoint->processed_bits, item->id * 2 + 1);
+		setbit (checkpoint->started, item->id);
+		rspamd_symbols_cache_finish_item (checkpoint, item);
 
 		return TRUE;
 	}
@@ -1376,8 +1772,8 @@ rspamd_symbols_cache_check_deps (struct rspamd_task *task,
 				continue;
 			}
 
-			if (!isset (checkpoint->processed_bits, dep->id * 2 + 1)) {
-				if (!isset (checkpoint->processed_bits, dep->id * 2)) {
+			if (!isset (checkpoint->finished, dep->id)) {
+				if (!isset (checkpoint->started, dep->id)) {
 					/* Not started */
 					if (!check_only) {
 						if (!rspamd_symbols_cache_check_deps (task, cache,
@@ -1385,18 +1781,8 @@ rspamd_symbols_cache_check_deps (struct rspamd_task *task,
 								checkpoint,
 								recursion + 1,
 								check_only)) {
-							gboolean found = FALSE;
-							guint j;
-							struct cache_item *tmp_it;
-
-							PTR_ARRAY_FOREACH (checkpoint->waitq, j, tmp_it) {
-								if (item->id == tmp_it->id) {
-									found = TRUE;
-									break;
-								}
-							}
-
-							if (!found) {
+							if (isclr (checkpoint->waiting, item->id)) {
+								setbit (checkpoint->waiting, item->id);
 								g_ptr_array_add (checkpoint->waitq, item);
 							}
 
@@ -1457,6 +1843,34 @@ rspamd_symbols_cache_tm (gint fd, short what, void *data)
 			data);
 }
 
+static void
+rspamd_symbols_cache_checkpoint_dtor (struct cache_savepoint *checkpoint)
+{
+	g_ptr_array_free (checkpoint->waitq, TRUE);
+	g_free (checkpoint->started);
+	g_free (checkpoint);
+}
+
+void
+rspamd_symbols_cache_release_checkpoint (struct rspamd_task *task,
+		struct symbols_cache *cache)
+{
+	struct cache_savepoint *checkpoint = task->checkpoint;
+
+	if (checkpoint == NULL) {
+		return;
+	}
+
+	task->checkpoint = NULL;
+
+	if (cache->free_checkpoints->len < SYMBOLS_CACHE_MAX_FREE_CHECKPOINTS) {
+		g_ptr_array_add (cache->free_checkpoints, checkpoint);
+	}
+	else {
+		rspamd_symbols_cache_checkpoint_dtor (checkpoint);
+	}
+}
+
 static struct cache_savepoint *
 rspamd_symbols_cache_make_checkpoint (struct rspamd_task *task,
 		struct symbols_cache *cache)
@@ -1477,20 +1891,56 @@ rspamd_symbols_cache_make_checkpoint (struct rspamd_task *task,
 		rspamd_symbols_cache_resort (cache);
 	}
 
-	checkpoint = rspamd_mempool_alloc0 (task->task_pool, sizeof (*checkpoint));
-	/* Bit 0: check started, Bit 1: check finished */
-	checkpoint->processed_bits = rspamd_mempool_alloc0 (task->task_pool,
-			NBYTES (cache->used_items) * 2);
-	checkpoint->waitq = g_ptr_array_new ();
+	checkpoint = NULL;
+
+	while (cache->free_checkpoints->len > 0) {
+		checkpoint = g_ptr_array_remove_index_fast (cache->free_checkpoints,
+				cache->free_checkpoints->len - 1);
+
+		if (checkpoint->nbytes == NBYTES (cache->used_items)) {
+			break;
+		}
+
+		/* Number of items has been changed */
+		rspamd_symbols_cache_checkpoint_dtor (checkpoint);
+		checkpoint = NULL;
+	}
+
+	if (checkpoint == NULL) {
+		checkpoint = g_malloc (sizeof (*checkpoint));
+		checkpoint->nbytes = NBYTES (cache->used_items);
+		checkpoint->started = g_malloc (checkpoint->nbytes * 3);
+		checkpoint->finished = checkpoint->started + checkpoint->nbytes;
+		checkpoint->waiting = checkpoint->finished + checkpoint->nbytes;
+		checkpoint->waitq = g_ptr_array_new ();
+	}
+
+	memset (checkpoint->started, 0, checkpoint->nbytes * 3);
+	g_ptr_array_set_size (checkpoint->waitq, 0);
+	checkpoint->rs = NULL;
+	checkpoint->lim = 0;
+	checkpoint->remain_pos = cache->max_pos;
+	checkpoint->remain_neg = cache->max_neg;
 	g_assert (cache->items_by_order != NULL);
 	checkpoint->version = cache->items_by_order->d->len;
 	checkpoint->order = cache->items_by_order;
 	REF_RETAIN (checkpoint->order);
 	rspamd_mempool_add_destructor (task->task_pool,
 			rspamd_symbols_cache_order_unref, checkpoint->order);
-	rspamd_mempool_add_destructor (task->task_pool,
-			rspamd_ptr_array_free_hard, checkpoint->waitq);
 	checkpoint->pass = RSPAMD_CACHE_PASS_INIT;
+	checkpoint->timings = NULL;
+	checkpoint->sampled = cache->cfg->symbols_profile_sample > 0 &&
+			ottery_rand_range (cache->cfg->symbols_profile_sample - 1) == 0;
+
+	if (checkpoint->sampled) {
+		cache->profiled_tasks ++;
+	}
+
+	if (G_UNLIKELY (RSPAMD_TASK_IS_PROFILING (task))) {
+		checkpoint->timings = rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (*checkpoint->timings) * cache->items_by_id->len);
+	}
+
 	task->checkpoint = checkpoint;
 
 	rspamd_create_metric_result (task, DEFAULT_METRIC);
@@ -1622,6 +2072,40 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 	msg_debug_task ("symbols processing stage at pass: %d", checkpoint->pass);
 	start_events_pending = rspamd_session_events_pending (task->s);
 
+	if (stage == RSPAMD_TASK_STAGE_ENVELOPE) {
+		/*
+		 * Start envelope prefilters before the message is parsed, the rest
+		 * of prefilters and waiting for them are done on the prefilters stage
+		 */
+		saved_priority = G_MININT;
+
+		for (i = 0; i < (gint)cache->prefilters->len; i ++) {
+			item = g_ptr_array_index (cache->prefilters, i);
+
+			if (isset (checkpoint->started, item->id)) {
+				continue;
+			}
+
+			if (saved_priority == G_MININT) {
+				saved_priority = item->priority;
+			}
+			else if (item->priority < saved_priority &&
+					rspamd_session_events_pending (task->s) > start_events_pending) {
+				break;
+			}
+
+			if (!(item->type & SYMBOL_TYPE_ENVELOPE)) {
+				/* Prefilters with lower priority must wait for this one */
+				break;
+			}
+
+			rspamd_symbols_cache_check_symbol (task, cache, item,
+					checkpoint, &total_microseconds);
+		}
+
+		return TRUE;
+	}
+
 	switch (checkpoint->pass) {
 	case RSPAMD_CACHE_PASS_INIT:
 	case RSPAMD_CACHE_PASS_PREFILTERS:
@@ -1631,8 +2115,8 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		for (i = 0; i < (gint)cache->prefilters->len; i ++) {
 			item = g_ptr_array_index (cache->prefilters, i);
 
-			if (!isset (checkpoint->processed_bits, item->id * 2) &&
-					!isset (checkpoint->processed_bits, item->id * 2 + 1)) {
+			if (!isset (checkpoint->started, item->id) &&
+					!isset (checkpoint->finished, item->id)) {
 				/* Check priorities */
 				if (saved_priority == G_MININT) {
 					saved_priority = item->priority;
@@ -1663,7 +2147,7 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		for (i = 0; i < (gint)cache->prefilters->len; i ++) {
 			item = g_ptr_array_index (cache->prefilters, i);
 
-			if (!isset (checkpoint->processed_bits, item->id * 2 + 1)) {
+			if (!isset (checkpoint->finished, item->id)) {
 				all_done = FALSE;
 				break;
 			}
@@ -1701,25 +2185,28 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 				}
 			}
 
-			if (!isset (checkpoint->processed_bits, item->id * 2)) {
+			/*
+			 * Pending items are accounted in the remaining scores, so there
+			 * is no need to wait for them
+			 */
+			if (!(item->type & SYMBOL_TYPE_FINE) &&
+					!isset (checkpoint->started, item->id) &&
+					rspamd_symbols_cache_item_is_async (item) &&
+					rspamd_symbols_cache_verdict_is_final (task, checkpoint)) {
+				msg_debug_task ("skip %s as it cannot change the action",
+						item->symbol);
+				continue;
+			}
+
+			if (!isset (checkpoint->started, item->id)) {
 				if (!rspamd_symbols_cache_check_deps (task, cache, item,
 						checkpoint, 0, FALSE)) {
-					gboolean found = FALSE;
-					guint j;
-					struct cache_item *tmp_it;
-
 					msg_debug_task ("blocked execution of %d unless deps are "
 							"resolved",
 							item->id);
 
-					PTR_ARRAY_FOREACH (checkpoint->waitq, j, tmp_it) {
-						if (item->id == tmp_it->id) {
-							found = TRUE;
-							break;
-						}
-					}
-
-					if (!found) {
+					if (isclr (checkpoint->waiting, item->id)) {
+						setbit (checkpoint->waiting, item->id);
 						g_ptr_array_add (checkpoint->waitq, item);
 					}
 
@@ -1766,7 +2253,7 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		for (i = 0; i < (gint)checkpoint->waitq->len; i ++) {
 			item = g_ptr_array_index (checkpoint->waitq, i);
 
-			if (!isset (checkpoint->processed_bits, item->id * 2)) {
+			if (!isset (checkpoint->started, item->id)) {
 				if (!rspamd_symbols_cache_check_deps (task, cache, item,
 						checkpoint, 0, FALSE)) {
 					break;
@@ -1806,8 +2293,8 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		for (i = 0; i < (gint)cache->postfilters->len; i ++) {
 			item = g_ptr_array_index (cache->postfilters, i);
 
-			if (!isset (checkpoint->processed_bits, item->id * 2) &&
-					!isset (checkpoint->processed_bits, item->id * 2 + 1)) {
+			if (!isset (checkpoint->started, item->id) &&
+					!isset (checkpoint->finished, item->id)) {
 				/* Check priorities */
 				if (saved_priority == G_MININT) {
 					saved_priority = item->priority;
@@ -1836,7 +2323,7 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		for (i = 0; i < (gint)cache->postfilters->len; i ++) {
 			item = g_ptr_array_index (cache->postfilters, i);
 
-			if (!isset (checkpoint->processed_bits, item->id * 2 + 1)) {
+			if (!isset (checkpoint->finished, item->id)) {
 				all_done = FALSE;
 				break;
 			}
@@ -2092,6 +2579,19 @@ rspamd_symbols_cache_inc_frequency (struct symbols_cache *cache,
 	}
 }
 
+void
+rspamd_symbols_cache_inc_frequency_id (struct symbols_cache *cache, gint id)
+{
+	struct cache_item *item;
+
+	g_assert (cache != NULL);
+
+	if (id >= 0 && id < (gint)cache->items_by_id->len) {
+		item = g_ptr_array_index (cache->items_by_id, id);
+		g_atomic_int_inc (&item->st->hits);
+	}
+}
+
 void
 rspamd_symbols_cache_add_dependency (struct symbols_cache *cache,
 		gint id_from, const gchar *to)
@@ -2225,6 +2725,122 @@ rspamd_symbols_cache_symbols_count (struct symbols_cache *cache)
 	return cache->items_by_id->len;
 }
 
+static const gchar *
+rspamd_symbols_cache_item_stage (struct cache_item *item)
+{
+	if (item->type & SYMBOL_TYPE_PREFILTER) {
+		return "pre_filters";
+	}
+	else if (item->type & SYMBOL_TYPE_POSTFILTER) {
+		return "post_filters";
+	}
+	else if (item->type & SYMBOL_TYPE_COMPOSITE) {
+		return "composites";
+	}
+
+	return "filters";
+}
+
+ucl_object_t *
+rspamd_symbols_cache_profile (struct symbols_cache *cache, gboolean reset)
+{
+	struct cache_item *item;
+	ucl_object_t *top, *syms, *elt;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	syms = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromint (cache->profiled_tasks),
+			"tasks", 0, false);
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
+		if (item->prof.samples == 0) {
+			continue;
+		}
+
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt,
+				ucl_object_fromstring (rspamd_symbols_cache_item_stage (item)),
+				"stage", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromint (item->prof.samples),
+				"samples", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (item->prof.c_time),
+				"c", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (item->prof.lua_time),
+				"lua", 0, false);
+		ucl_object_insert_key (syms, elt, item->symbol, 0, false);
+
+		if (reset) {
+			memset (&item->prof, 0, sizeof (item->prof));
+		}
+	}
+
+	if (reset) {
+		cache->profiled_tasks = 0;
+	}
+
+	ucl_object_insert_key (top, syms, "symbols", 0, false);
+
+	return top;
+}
+
+ucl_object_t *
+rspamd_symbols_cache_task_profile (struct rspamd_task *task,
+		struct symbols_cache *cache)
+{
+	struct cache_savepoint *checkpoint = task->checkpoint;
+	struct cache_item_timing *tm;
+	struct cache_item *item;
+	ucl_object_t *top, *elt;
+	guint i;
+
+	if (checkpoint == NULL || checkpoint->timings == NULL) {
+		return NULL;
+	}
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		tm = &checkpoint->timings[i];
+
+		if (tm->start == 0) {
+			continue;
+		}
+
+		item = g_ptr_array_index (cache->items_by_id, i);
+		elt = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (elt,
+				ucl_object_fromdouble (tm->start - task->time_real),
+				"start", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (tm->cpu),
+				"cpu", 0, false);
+		ucl_object_insert_key (elt, ucl_object_fromdouble (tm->wait),
+				"wait", 0, false);
+		ucl_object_insert_key (top, elt, item->symbol, 0, false);
+	}
+
+	return top;
+}
+
+const struct rspamd_histogram *
+rspamd_symbols_cache_symbol_latency (struct symbols_cache *cache,
+		gint id)
+{
+	struct cache_item *item;
+
+	g_assert (cache != NULL);
+
+	if (id < 0 || id >= (gint)cache->items_by_id->len) {
+		return NULL;
+	}
+
+	item = g_ptr_array_index (cache->items_by_id, id);
+
+	return &item->st->latency;
+}
+
 static void
 rspamd_symbols_cache_disable_all_symbols (struct rspamd_task *task,
 		struct symbols_cache *cache)
@@ -2240,8 +2856,8 @@ rspamd_symbols_cache_disable_all_symbols (struct rspamd_task *task,
 	}
 
 	/* Set all symbols as started + finished to disable their execution */
-	memset (checkpoint->processed_bits, 0xff,
-			NBYTES (cache->used_items) * 2);
+	memset (checkpoint->started, 0xff, checkpoint->nbytes);
+	memset (checkpoint->finished, 0xff, checkpoint->nbytes);
 }
 
 static void
@@ -2262,12 +2878,12 @@ rspamd_symbols_cache_disable_symbol_checkpoint (struct rspamd_task *task,
 
 	id = rspamd_symbols_cache_find_symbol_parent (cache, symbol);
 
-	if (id > 0) {
+	if (id >= 0) {
 		/* Set executed and finished flags */
 		item = g_ptr_array_index (cache->items_by_id, id);
 
-		setbit (checkpoint->processed_bits, item->id * 2);
-		setbit (checkpoint->processed_bits, item->id * 2 + 1);
+		setbit (checkpoint->started, item->id);
+		setbit (checkpoint->finished, item->id);
 
 		msg_debug_task ("disable execution of %s", symbol);
 	}
@@ -2294,12 +2910,18 @@ rspamd_symbols_cache_enable_symbol_checkpoint (struct rspamd_task *task,
 
 	id = rspamd_symbols_cache_find_symbol_parent (cache, symbol);
 
-	if (id > 0) {
+	if (id >= 0) {
 		/* Set executed and finished flags */
 		item = g_ptr_array_index (cache->items_by_id, id);
 
-		clrbit (checkpoint->processed_bits, item->id * 2);
-		clrbit (checkpoint->processed_bits, item->id * 2 + 1);
+		if (isset (checkpoint->finished, item->id)) {
+			/* Its scores could be added again */
+			checkpoint->remain_pos += item->max_pos;
+			checkpoint->remain_neg += item->max_neg;
+		}
+
+		clrbit (checkpoint->started, item->id);
+		clrbit (checkpoint->finished, item->id);
 
 		msg_debug_task ("enable execution of %s", symbol);
 	}
@@ -2370,7 +2992,7 @@ rspamd_symbols_cache_is_checked (struct rspamd_task *task,
 	checkpoint = task->checkpoint;
 
 	if (checkpoint) {
-		return isset (checkpoint->processed_bits, id * 2);
+		return isset (checkpoint->started, id);
 	}
 
 	return FALSE;
@@ -2445,7 +3067,7 @@ rspamd_symbols_cache_is_symbol_enabled (struct rspamd_task *task,
 	item = g_ptr_array_index (cache->items_by_id, id);
 
 	if (checkpoint) {
-		if (isset (checkpoint->processed_bits, id * 2)) {
+		if (isset (checkpoint->started, id)) {
 			ret = FALSE;
 		}
 		else {
@@ -2472,3 +3094,52 @@ rspamd_symbols_cache_is_symbol_enabled (struct rspamd_task *task,
 
 	return ret;
 }
+
+gboolean
+rspamd_symbols_cache_is_content_symbol (struct symbols_cache *cache,
+		gint id)
+{
+	struct cache_item *item;
+
+	g_assert (cache != NULL);
+
+	if (id < 0 || id >= (gint)cache->items_by_id->len) {
+		return FALSE;
+	}
+
+	item = g_ptr_array_index (cache->items_by_id, id);
+
+	if ((item->type & SYMBOL_TYPE_VIRTUAL) && item->parent >= 0 &&
+			item->parent < (gint)cache->items_by_id->len) {
+		item = g_ptr_array_index (cache->items_by_id, item->parent);
+	}
+
+	return (item->type & SYMBOL_TYPE_CONTENT) != 0;
+}
+
+gboolean
+rspamd_symbols_cache_content_finished (struct rspamd_task *task,
+		struct symbols_cache *cache)
+{
+	struct cache_savepoint *checkpoint = task->checkpoint;
+	struct cache_item *item;
+	guint i;
+
+	g_assert (cache != NULL);
+
+	if (checkpoint == NULL) {
+		return FALSE;
+	}
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
+		if (item->func && (item->type & SYMBOL_TYPE_CONTENT) &&
+				!isset (checkpoint->finished, item->id)) {
+			/* Skipped because of the final verdict or still pending */
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
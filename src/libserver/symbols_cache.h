@@ -21,6 +21,8 @@
 #include <lua.h>
 #include <event.h>
 
+struct rspamd_histogram;
+
 struct rspamd_task;
 struct rspamd_config;
 struct symbols_cache;
@@ -40,6 +42,8 @@ enum rspamd_symbol_type {
 	SYMBOL_TYPE_EMPTY = (1 << 8), /* Allow execution on empty tasks */
 	SYMBOL_TYPE_PREFILTER = (1 << 9),
 	SYMBOL_TYPE_POSTFILTER = (1 << 10),
+	SYMBOL_TYPE_ENVELOPE = (1 << 11), /* Prefilter that needs envelope only */
+	SYMBOL_TYPE_CONTENT = (1 << 12), /* Result depends on message content only */
 };
 
 /**
@@ -68,6 +72,24 @@ void rspamd_symbols_cache_destroy (struct symbols_cache *cache);
  */
 void rspamd_symbols_cache_save (struct symbols_cache *cache);
 
+/**
+ * Returns execution profile of symbols (times, runs and frequencies) in the
+ * same format as it is saved to `cache_file`
+ * @param cache
+ * @return new ucl object
+ */
+ucl_object_t *rspamd_symbols_cache_get_profile (struct symbols_cache *cache);
+
+/**
+ * Imports profile (e.g. aggregated from other nodes) for symbols that have
+ * not enough local statistics and resorts cache
+ * @param cache
+ * @param profile object returned by `rspamd_symbols_cache_get_profile`
+ * @return number of symbols updated
+ */
+guint rspamd_symbols_cache_import_profile (struct symbols_cache *cache,
+		const ucl_object_t *profile);
+
 /**
  * Load symbols cache from file, must be called _after_ init_symbols_cache
  */
@@ -161,6 +183,34 @@ const gchar * rspamd_symbols_cache_symbol_by_id (struct symbols_cache *cache,
  */
 guint rspamd_symbols_cache_symbols_count (struct symbols_cache *cache);
 
+/**
+ * Returns C and Lua times of symbols callbacks sampled by this process
+ * @param cache
+ * @param reset clear collected samples
+ * @return new ucl object
+ */
+ucl_object_t *rspamd_symbols_cache_profile (struct symbols_cache *cache,
+		gboolean reset);
+
+/**
+ * Returns start, cpu and wait times of symbols executed by a profiled task,
+ * wait is the time spent in asynchronous events started by a symbol
+ * @param task
+ * @param cache
+ * @return new ucl object or NULL if a task is not profiled
+ */
+ucl_object_t *rspamd_symbols_cache_task_profile (struct rspamd_task *task,
+		struct symbols_cache *cache);
+
+/**
+ * Returns latency histogram of a symbol shared by all workers
+ * @param cache
+ * @param id
+ * @return histogram or NULL if there is no such symbol
+ */
+const struct rspamd_histogram *rspamd_symbols_cache_symbol_latency (
+		struct symbols_cache *cache, gint id);
+
 /**
  * Call function for cached symbol using saved callback
  * @param task task object
@@ -203,6 +253,19 @@ void rspamd_symbols_cache_start_refresh (struct symbols_cache * cache,
 void rspamd_symbols_cache_inc_frequency (struct symbols_cache *cache,
 		const gchar *symbol);
 
+/**
+ * Return per task state of the cache for reuse, must be called before the
+ * task releases its config
+ */
+void rspamd_symbols_cache_release_checkpoint (struct rspamd_task *task,
+		struct symbols_cache *cache);
+
+/**
+ * Increases counter for a symbol with the specified id
+ */
+void rspamd_symbols_cache_inc_frequency_id (struct symbols_cache *cache,
+		gint id);
+
 /**
  * Add dependency relation between two symbols identified by id (source) and
  * a symbolic name (destination). Destination could be virtual or real symbol.
@@ -292,4 +355,23 @@ guint64 rspamd_symbols_cache_get_cksum (struct symbols_cache *cache);
  */
 gboolean rspamd_symbols_cache_is_symbol_enabled (struct rspamd_task *task,
 		struct symbols_cache *cache, const gchar *symbol);
+
+/**
+ * Checks if a symbol depends on message content only (virtual symbols inherit
+ * this from their parents)
+ * @param cache
+ * @param id
+ * @return
+ */
+gboolean rspamd_symbols_cache_is_content_symbol (struct symbols_cache *cache,
+		gint id);
+
+/**
+ * Checks if all content only symbols have been processed for a task
+ * @param task
+ * @param cache
+ * @return
+ */
+gboolean rspamd_symbols_cache_content_finished (struct rspamd_task *task,
+		struct symbols_cache *cache);
 #endif
@@ -21,7 +21,9 @@
 #include "lua/lua_common.h"
 #include "email_addr.h"
 #include "composites.h"
+#include "result_cache.h"
 #include "stat_api.h"
+#include "worker_util.h"
 #include "unix-std.h"
 #include "utlist.h"
 #include "contrib/zstd/zstd.h"
@@ -55,15 +57,94 @@ rspamd_request_header_dtor (gpointer p)
 	}
 }
 
+/*
+ * Freed tasks keep their pool (rewound to the first page) and containers that
+ * are cleared but not destroyed, so the next task could reuse them
+ */
+#define TASK_FREELIST_MAX 16
+static struct rspamd_task *task_freelist[TASK_FREELIST_MAX];
+static guint task_freelist_len = 0;
+
+static void
+rspamd_task_containers_new (struct rspamd_task *task)
+{
+	task->raw_headers = g_hash_table_new_full (rspamd_strcase_hash,
+			rspamd_strcase_equal, NULL, rspamd_ptr_array_free_hard);
+	task->headers_order = g_queue_new ();
+	task->request_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
+			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
+			rspamd_request_header_dtor);
+	task->reply_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
+			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
+			rspamd_fstring_mapped_ftok_free);
+	task->emails = g_hash_table_new (rspamd_email_hash, rspamd_emails_cmp);
+	task->urls = g_hash_table_new (rspamd_url_hash, rspamd_urls_cmp);
+	task->parts = g_ptr_array_sized_new (4);
+	task->text_parts = g_ptr_array_sized_new (2);
+}
+
+static void
+rspamd_task_containers_restore (struct rspamd_task *task,
+		struct rspamd_task *saved)
+{
+	task->task_pool = saved->task_pool;
+	task->raw_headers = saved->raw_headers;
+	task->headers_order = saved->headers_order;
+	task->request_headers = saved->request_headers;
+	task->reply_headers = saved->reply_headers;
+	task->emails = saved->emails;
+	task->urls = saved->urls;
+	task->parts = saved->parts;
+	task->text_parts = saved->text_parts;
+}
+
+/* Containers are cleaned in the order their pool destructors used to run */
+static void
+rspamd_task_containers_clear (struct rspamd_task *task)
+{
+	g_hash_table_remove_all (task->request_headers);
+	g_hash_table_remove_all (task->reply_headers);
+	g_hash_table_remove_all (task->raw_headers);
+	g_queue_clear (task->headers_order);
+	g_hash_table_remove_all (task->emails);
+	g_hash_table_remove_all (task->urls);
+	g_ptr_array_set_size (task->parts, 0);
+	g_ptr_array_set_size (task->text_parts, 0);
+}
+
+static void
+rspamd_task_containers_free (struct rspamd_task *task)
+{
+	g_hash_table_unref (task->request_headers);
+	g_hash_table_unref (task->reply_headers);
+	g_hash_table_unref (task->raw_headers);
+	g_queue_free (task->headers_order);
+	g_hash_table_unref (task->emails);
+	g_hash_table_unref (task->urls);
+	g_ptr_array_free (task->parts, TRUE);
+	g_ptr_array_free (task->text_parts, TRUE);
+}
+
 /*
  * Create new task
  */
 struct rspamd_task *
 rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg)
 {
-	struct rspamd_task *new_task;
+	struct rspamd_task *new_task, saved;
+	gboolean reused = FALSE;
+
+	if (task_freelist_len > 0) {
+		new_task = task_freelist[--task_freelist_len];
+		memcpy (&saved, new_task, sizeof (saved));
+		memset (new_task, 0, sizeof (*new_task));
+		rspamd_task_containers_restore (new_task, &saved);
+		reused = TRUE;
+	}
+	else {
+		new_task = g_slice_alloc0 (sizeof (struct rspamd_task));
+	}
 
-	new_task = g_slice_alloc0 (sizeof (struct rspamd_task));
 	new_task->worker = worker;
 
 	if (cfg) {
@@ -81,51 +162,19 @@ rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg)
 	new_task->time_real = rspamd_get_ticks ();
 	new_task->time_virtual = rspamd_get_virtual_ticks ();
 
-	new_task->task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "task");
-
-	new_task->results = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->results);
+	if (!reused) {
+		new_task->task_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+				"task");
+		rspamd_task_containers_new (new_task);
+	}
 
-	new_task->raw_headers = g_hash_table_new_full (rspamd_strcase_hash,
-			rspamd_strcase_equal, NULL, rspamd_ptr_array_free_hard);
-	new_task->headers_order = g_queue_new ();
-	new_task->request_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
-			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
-			rspamd_request_header_dtor);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->request_headers);
-	new_task->reply_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
-			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
-			rspamd_fstring_mapped_ftok_free);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->reply_headers);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->raw_headers);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_queue_free,
-			new_task->headers_order);
-	new_task->emails = g_hash_table_new (rspamd_email_hash, rspamd_emails_cmp);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->emails);
-	new_task->urls = g_hash_table_new (rspamd_url_hash, rspamd_urls_cmp);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->urls);
-	new_task->parts = g_ptr_array_sized_new (4);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->parts);
-	new_task->text_parts = g_ptr_array_sized_new (2);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->text_parts);
-	new_task->received = g_ptr_array_sized_new (8);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->received);
+	new_task->results = rspamd_mempool_hash_new (new_task->task_pool, 1,
+			rspamd_str_hash, rspamd_str_equal);
+	new_task->url_hosts = rspamd_mempool_hash_new (new_task->task_pool, 16,
+			rspamd_ftok_icase_hash, rspamd_ftok_icase_equal);
+	new_task->received = rspamd_mempool_array_new (new_task->task_pool, 8);
+	new_task->known_headers = rspamd_mempool_alloc0 (new_task->task_pool,
+			sizeof (GPtrArray *) * RSPAMD_HEADER_KNOWN_MAX);
 
 	new_task->sock = -1;
 	new_task->flags |= (RSPAMD_TASK_FLAG_MIME|RSPAMD_TASK_FLAG_JSON);
@@ -133,7 +182,8 @@ rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg)
 
 	new_task->message_id = new_task->queue_id = "undef";
 	new_task->messages = ucl_object_typed_new (UCL_OBJECT);
-	new_task->lua_cache = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	new_task->lua_cache = rspamd_mempool_hash_new (new_task->task_pool, 8,
+			rspamd_str_hash, rspamd_str_equal);
 
 	return new_task;
 }
@@ -197,7 +247,7 @@ rspamd_task_free (struct rspamd_task *task)
 	struct rspamd_mime_part *p;
 	struct rspamd_mime_text_part *tp;
 	struct rspamd_email_address *addr;
-	GHashTableIter it;
+	rspamd_mempool_hash_iter_t it;
 	gpointer k, v;
 	gint lua_ref;
 	guint i;
@@ -283,22 +333,32 @@ rspamd_task_free (struct rspamd_task *task)
 
 		if (task->cfg) {
 			if (task->lua_cache) {
-				g_hash_table_iter_init (&it, task->lua_cache);
+				rspamd_mempool_hash_iter_init (&it, task->lua_cache);
 
-				while (g_hash_table_iter_next (&it, &k, &v)) {
+				while (rspamd_mempool_hash_iter_next (&it, &k, &v)) {
 					lua_ref = GPOINTER_TO_INT (v);
 					luaL_unref (task->cfg->lua_state,
 							LUA_REGISTRYINDEX, lua_ref);
 				}
+			}
 
-				g_hash_table_unref (task->lua_cache);
+			if (task->cfg->cache) {
+				rspamd_symbols_cache_release_checkpoint (task, task->cfg->cache);
 			}
 
 			REF_RELEASE (task->cfg);
 		}
 
-		rspamd_mempool_delete (task->task_pool);
-		g_slice_free1 (sizeof (struct rspamd_task), task);
+		if (task_freelist_len < TASK_FREELIST_MAX) {
+			rspamd_task_containers_clear (task);
+			rspamd_mempool_reset (task->task_pool);
+			task_freelist[task_freelist_len++] = task;
+		}
+		else {
+			rspamd_task_containers_free (task);
+			rspamd_mempool_delete (task->task_pool);
+			g_slice_free1 (sizeof (struct rspamd_task), task);
+		}
 	}
 }
 
@@ -337,8 +397,16 @@ rspamd_task_load_message (struct rspamd_task *task,
 	ft = "file";
 #endif
 
-	if (msg) {
+	if (msg && !(task->flags & RSPAMD_TASK_FLAG_PROTOCOL_HEADERS)) {
 		rspamd_protocol_handle_headers (task, msg);
+		task->flags |= RSPAMD_TASK_FLAG_PROTOCOL_HEADERS;
+	}
+
+	if (task->flags & RSPAMD_TASK_FLAG_TLV) {
+		/* Binary envelope precedes the message */
+		if (!rspamd_protocol_handle_tlv (task, &start, &len)) {
+			return FALSE;
+		}
 	}
 
 	tok = rspamd_task_get_request_header (task, "shm");
@@ -482,6 +550,12 @@ rspamd_task_load_message (struct rspamd_task *task,
 		}
 
 		close (fd);
+
+		if (st.st_size > 0 &&
+				madvise (map, st.st_size, MADV_SEQUENTIAL) == -1) {
+			msg_info_task ("madvise failed: %s", strerror (errno));
+		}
+
 		task->msg.begin = map;
 		task->msg.len = st.st_size;
 		task->msg.fpath = rspamd_mempool_strdup (task->task_pool, fp);
@@ -574,6 +648,7 @@ rspamd_task_load_message (struct rspamd_task *task,
 					g_set_error (&task->err, rspamd_task_quark(),
 							RSPAMD_PROTOCOL_ERROR,
 							"Decompression error: %s", ZSTD_getErrorName (r));
+					g_free (zout.dst);
 
 					return FALSE;
 				}
@@ -675,11 +750,108 @@ rspamd_task_select_processing_stage (struct rspamd_task *task, guint stages)
 	return RSPAMD_TASK_STAGE_DONE;
 }
 
+const gchar *
+rspamd_task_stage_name (enum rspamd_task_stage stage)
+{
+	const gchar *ret = "unknown";
+
+	switch (stage) {
+	case RSPAMD_TASK_STAGE_CONNECT:
+		ret = "connect";
+		break;
+	case RSPAMD_TASK_STAGE_ENVELOPE:
+		ret = "envelope";
+		break;
+	case RSPAMD_TASK_STAGE_READ_MESSAGE:
+		ret = "read_message";
+		break;
+	case RSPAMD_TASK_STAGE_PRE_FILTERS:
+		ret = "pre_filters";
+		break;
+	case RSPAMD_TASK_STAGE_FILTERS:
+		ret = "filters";
+		break;
+	case RSPAMD_TASK_STAGE_CLASSIFIERS_PRE:
+		ret = "classifiers_pre";
+		break;
+	case RSPAMD_TASK_STAGE_CLASSIFIERS:
+		ret = "classifiers";
+		break;
+	case RSPAMD_TASK_STAGE_CLASSIFIERS_POST:
+		ret = "classifiers_post";
+		break;
+	case RSPAMD_TASK_STAGE_COMPOSITES:
+		ret = "composites";
+		break;
+	case RSPAMD_TASK_STAGE_POST_FILTERS:
+		ret = "post_filters";
+		break;
+	case RSPAMD_TASK_STAGE_LEARN_PRE:
+		ret = "learn_pre";
+		break;
+	case RSPAMD_TASK_STAGE_LEARN:
+		ret = "learn";
+		break;
+	case RSPAMD_TASK_STAGE_LEARN_POST:
+		ret = "learn_post";
+		break;
+	case RSPAMD_TASK_STAGE_DONE:
+		ret = "done";
+		break;
+	case RSPAMD_TASK_STAGE_REPLIED:
+		ret = "replied";
+		break;
+	}
+
+	return ret;
+}
+
+/* Stage might be resumed several times, so its wall time is recorded */
+static void
+rspamd_task_stage_finished (struct rspamd_task *task, gint st)
+{
+	struct rspamd_stat *stat;
+
+	if (task->stage_current != (guint)st) {
+		return;
+	}
+
+	if (G_UNLIKELY (task->stage_timings)) {
+		task->stage_timings[g_bit_nth_lsf (st, -1)].time =
+				rspamd_get_ticks () - task->stage_start;
+	}
+
+	if (task->worker == NULL || !rspamd_worker_is_normal (task->worker)) {
+		return;
+	}
+
+	stat = task->worker->srv->stat;
+	rspamd_histogram_add (&stat->stage_latency[g_bit_nth_lsf (st, -1)],
+			rspamd_get_ticks () - task->stage_start);
+}
+
+static void
+rspamd_task_stage_started (struct rspamd_task *task, gint st)
+{
+	task->stage_current = st;
+	task->stage_start = rspamd_get_ticks ();
+
+	if (G_UNLIKELY (RSPAMD_TASK_IS_PROFILING (task))) {
+		if (task->stage_timings == NULL) {
+			task->stage_timings = rspamd_mempool_alloc0 (task->task_pool,
+					sizeof (*task->stage_timings) * RSPAMD_TASK_STAGES_COUNT);
+		}
+
+		task->stage_timings[g_bit_nth_lsf (st, -1)].start =
+				task->stage_start - task->time_real;
+	}
+}
+
 gboolean
 rspamd_task_process (struct rspamd_task *task, guint stages)
 {
 	gint st;
-	gboolean ret = TRUE;
+	gboolean ret = TRUE, wait_events = TRUE;
 	GError *stat_error = NULL;
 
 	/* Avoid nested calls */
@@ -695,11 +867,31 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 
 	st = rspamd_task_select_processing_stage (task, stages);
 
+	if (task->stage_current != (guint)st) {
+		rspamd_task_stage_started (task, st);
+	}
+
 	switch (st) {
+	case RSPAMD_TASK_STAGE_ENVELOPE:
+		if (task->cfg->envelope_prefilters &&
+				!(task->flags & RSPAMD_TASK_FLAG_SKIP)) {
+			rspamd_symbols_cache_process_symbols (task, task->cfg->cache,
+					RSPAMD_TASK_STAGE_ENVELOPE);
+		}
+		/* Events of envelope prefilters are waited on the prefilters stage */
+		wait_events = FALSE;
+		break;
+
 	case RSPAMD_TASK_STAGE_READ_MESSAGE:
 		if (!rspamd_message_parse (task)) {
 			ret = FALSE;
 		}
+		else {
+			rspamd_result_cache_lookup (task);
+		}
+
+		/* Parsing is synchronous, pending events belong to prefilters */
+		wait_events = FALSE;
 		break;
 
 	case RSPAMD_TASK_STAGE_PRE_FILTERS:
@@ -708,6 +900,7 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		break;
 
 	case RSPAMD_TASK_STAGE_FILTERS:
+		rspamd_result_cache_apply (task);
 		rspamd_symbols_cache_process_symbols (task, task->cfg->cache,
 				RSPAMD_TASK_STAGE_FILTERS);
 		break;
@@ -715,7 +908,8 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 	case RSPAMD_TASK_STAGE_CLASSIFIERS:
 	case RSPAMD_TASK_STAGE_CLASSIFIERS_PRE:
 	case RSPAMD_TASK_STAGE_CLASSIFIERS_POST:
-		if (!RSPAMD_TASK_IS_EMPTY (task)) {
+		if (!RSPAMD_TASK_IS_EMPTY (task) &&
+				!rspamd_result_cache_skip_classifiers (task)) {
 			if (rspamd_stat_classify (task, task->cfg->lua_state, st, &stat_error) ==
 					RSPAMD_STAT_PROCESS_ERROR) {
 				msg_err_task ("classify error: %e", stat_error);
@@ -729,11 +923,14 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		break;
 
 	case RSPAMD_TASK_STAGE_POST_FILTERS:
+		/* Filters and classifiers are finished here */
+		rspamd_result_cache_store (task);
 		rspamd_symbols_cache_process_symbols (task, task->cfg->cache,
 				RSPAMD_TASK_STAGE_POST_FILTERS);
 
 		if ((task->flags & RSPAMD_TASK_FLAG_LEARN_AUTO) &&
 				!RSPAMD_TASK_IS_EMPTY (task) &&
+				!rspamd_result_cache_skip_classifiers (task) &&
 				!(task->flags & (RSPAMD_TASK_FLAG_LEARN_SPAM|RSPAMD_TASK_FLAG_LEARN_HAM))) {
 			rspamd_stat_check_autolearn (task);
 		}
@@ -796,7 +993,7 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		return ret;
 	}
 
-	if (rspamd_session_events_pending (task->s) != 0) {
+	if (wait_events && rspamd_session_events_pending (task->s) != 0) {
 		/* We have events pending, so we consider this stage as incomplete */
 		msg_debug_task ("need more work on stage %d", st);
 	}
@@ -804,6 +1001,7 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		/* Mark the current stage as done and go to the next stage */
 		msg_debug_task ("completed stage %d", st);
 		task->processed_stages |= st;
+		rspamd_task_stage_finished (task, st);
 
 		/* Tail recursion */
 		return rspamd_task_process (task, stages);
@@ -985,7 +1183,7 @@ rspamd_task_log_metric_res (struct rspamd_task *task,
 	GPtrArray *sorted_symbols;
 	guint i, j;
 
-	mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+	mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 
 	if (mres != NULL) {
 		switch (lf->type) {
@@ -1413,7 +1611,7 @@ rspamd_task_get_required_score (struct rspamd_task *task, struct rspamd_metric_r
 	guint i;
 
 	if (m == NULL) {
-		m = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+		m = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 
 		if (m == NULL) {
 			return NAN;
@@ -1531,3 +1729,18 @@ rspamd_task_profile_get (struct rspamd_task *task, const gchar *key)
 
 	return pval;
 }
+
+void
+rspamd_task_budget_exceeded (struct rspamd_task *task, guint32 budget,
+		const gchar *what)
+{
+	if (task->budget_flags & budget) {
+		return;
+	}
+
+	task->budget_flags |= budget;
+	msg_info_task ("<%s>: %s budget is exhausted, processing is truncated",
+			task->message_id, what);
+	rspamd_task_insert_result_single (task, RSPAMD_TASK_BUDGET_SYMBOL, 1.0,
+			what);
+}
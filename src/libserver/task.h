@@ -21,6 +21,7 @@
 #include "events.h"
 #include "util.h"
 #include "mem_pool.h"
+#include "mem_pool_containers.h"
 #include "dns.h"
 #include "re_cache.h"
 
@@ -53,6 +54,14 @@ enum rspamd_task_stage {
 	RSPAMD_TASK_STAGE_REPLIED = (1 << 14)
 };
 
+#define RSPAMD_TASK_STAGES_COUNT 15
+
+/* Times are relative to the task start, in seconds */
+struct rspamd_task_stage_timing {
+	gdouble start;
+	gdouble time;
+};
+
 #define RSPAMD_TASK_PROCESS_ALL (RSPAMD_TASK_STAGE_CONNECT | \
 		RSPAMD_TASK_STAGE_ENVELOPE | \
 		RSPAMD_TASK_STAGE_READ_MESSAGE | \
@@ -105,6 +114,22 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_FLAG_COMPRESSED (1 << 24)
 #define RSPAMD_TASK_FLAG_PROFILE (1 << 25)
 #define RSPAMD_TASK_FLAG_GREYLISTED (1 << 26)
+#define RSPAMD_TASK_FLAG_PROTOCOL_HEADERS (1 << 27)
+#define RSPAMD_TASK_FLAG_KEEPALIVE (1 << 28)
+#define RSPAMD_TASK_FLAG_MSGPACK (1 << 29)
+#define RSPAMD_TASK_FLAG_TLV (1 << 30)
+
+/*
+ * Per task cost budgets: when one is exhausted the corresponding stage is
+ * truncated and RSPAMD_TASK_BUDGET_SYMBOL is inserted
+ */
+#define RSPAMD_TASK_BUDGET_SYMBOL "SCAN_BUDGET_EXCEEDED"
+#define RSPAMD_TASK_BUDGET_PARTS (1u << 0)
+#define RSPAMD_TASK_BUDGET_DECODED (1u << 1)
+#define RSPAMD_TASK_BUDGET_HTML_TAGS (1u << 2)
+#define RSPAMD_TASK_BUDGET_URLS (1u << 3)
+/* One bit per regexp class type */
+#define RSPAMD_TASK_BUDGET_RE_SCAN(type) (1u << (4 + (type)))
 
 #define RSPAMD_TASK_IS_SKIPPED(task) (((task)->flags & RSPAMD_TASK_FLAG_SKIP))
 #define RSPAMD_TASK_IS_JSON(task) (((task)->flags & RSPAMD_TASK_FLAG_JSON))
@@ -115,6 +140,8 @@ enum rspamd_task_stage {
 #define RSPAMD_TASK_IS_PROFILING(task) (((task)->flags & RSPAMD_TASK_FLAG_PROFILE))
 
 struct rspamd_email_address;
+struct rspamd_stat_tokens;
+struct rspamd_result_cache_runtime;
 enum rspamd_newlines_type;
 
 /**
@@ -123,10 +150,15 @@ enum rspamd_newlines_type;
 struct rspamd_task {
 	struct rspamd_worker *worker;					/**< pointer to worker object						*/
 	guint processed_stages;							/**< bits of stages that are processed				*/
+	guint stage_current;							/**< stage that is being processed now				*/
+	gdouble stage_start;							/**< monotonic time when this stage has started		*/
+	struct rspamd_task_stage_timing *stage_timings;	/**< stages timings of a profiled task				*/
 	enum rspamd_command cmd;						/**< command										*/
 	gint sock;										/**< socket descriptor								*/
 	guint32 flags;									/**< Bit flags										*/
 	guint32 dns_requests;							/**< number of DNS requests per this task			*/
+	guint32 budget_flags;							/**< exhausted cost budgets							*/
+	gsize decoded_bytes;							/**< bytes of encoded parts accepted for decoding	*/
 	gulong message_len;								/**< Message length									*/
 	gchar *helo;									/**< helo header value								*/
 	gchar *queue_id;								/**< queue id if specified							*/
@@ -153,15 +185,17 @@ struct rspamd_task {
 		gsize len;
 		const gchar *body_start;
 	} raw_headers_content;				/**< list of raw headers							*/
-	GPtrArray *received;							/**< list of received headers						*/
+	rspamd_mempool_array_t *received;	/**< list of received headers						*/
 	GHashTable *urls;								/**< list of parsed urls							*/
 	GHashTable *emails;								/**< list of parsed emails							*/
+	rspamd_mempool_hash_t *url_hosts;	/**< interned hosts of urls and emails				*/
 	GHashTable *raw_headers;						/**< list of raw headers							*/
 	GQueue *headers_order;							/**< order of raw headers							*/
-	GHashTable *results;							/**< hash table of metric_result indexed by
+	GPtrArray **known_headers;						/**< raw headers indexed by rspamd_mime_header_known	*/
+	rspamd_mempool_hash_t *results;		/**< hash table of metric_result indexed by
 													 *    metric's name									*/
-	GHashTable *lua_cache;							/**< cache of lua objects							*/
-	GPtrArray *tokens;								/**< statistics tokens */
+	rspamd_mempool_hash_t *lua_cache;	/**< cache of lua objects							*/
+	struct rspamd_stat_tokens *tokens;				/**< statistics tokens */
 
 	GPtrArray *rcpt_mime;
 	GPtrArray *rcpt_envelope;						/**< array of rspamd_email_address					*/
@@ -200,6 +234,7 @@ struct rspamd_task {
 
 	const gchar *classifier;						/**< Classifier to learn (if needed)				*/
 	guchar digest[16];
+	struct rspamd_result_cache_runtime *result_cache;	/**< Results cache state or NULL					*/
 };
 
 /**
@@ -241,6 +276,13 @@ gboolean rspamd_task_load_message (struct rspamd_task *task,
  */
 gboolean rspamd_task_process (struct rspamd_task *task, guint stages);
 
+/**
+ * Returns name of a processing stage
+ * @param stage stage bit
+ * @return static string
+ */
+const gchar *rspamd_task_stage_name (enum rspamd_task_stage stage);
+
 /**
  * Return address of sender or NULL
  * @param task
@@ -337,4 +379,14 @@ void rspamd_task_profile_set (struct rspamd_task *task, const gchar *key,
  */
 gdouble* rspamd_task_profile_get (struct rspamd_task *task, const gchar *key);
 
+/**
+ * Marks the specified cost budget as exhausted: logs it and inserts
+ * RSPAMD_TASK_BUDGET_SYMBOL with `what` as option once per budget
+ * @param task
+ * @param budget RSPAMD_TASK_BUDGET_* bit
+ * @param what human readable budget name
+ */
+void rspamd_task_budget_exceeded (struct rspamd_task *task, guint32 budget,
+		const gchar *what);
+
 #endif /* TASK_H_ */
@@ -0,0 +1,361 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "task_export.h"
+#include "libmime/filter.h"
+#include "symbols_cache.h"
+#include "unix-std.h"
+
+#define EXPORT_ALIGN(len) (((len) + 7) & ~7)
+#define EXPORT_MAX_MESSAGE_ID 255
+
+struct rspamd_task_exporter {
+	struct rspamd_config *cfg;
+	gchar *file;
+	gchar *socket_path;
+	gint file_fd;
+	gint sock_fd;
+	guint batch;
+	guint nrecords;
+	gsize used;
+	guint64 cksum;
+	guint64 dropped;
+	struct event flush_ev;
+	struct timeval flush_tv;
+	gboolean has_timer;
+	guchar *buf;
+};
+
+static gboolean
+rspamd_task_exporter_open_socket (struct rspamd_task_exporter *exp)
+{
+	struct sockaddr_un su;
+
+	if (exp->sock_fd == -1 && exp->socket_path) {
+		exp->sock_fd = rspamd_socket_unix (exp->socket_path, &su, SOCK_DGRAM,
+				FALSE, TRUE);
+	}
+
+	return exp->sock_fd != -1;
+}
+
+static void
+rspamd_task_exporter_write (struct rspamd_task_exporter *exp,
+		guchar *data, gsize len)
+{
+	struct rspamd_task_export_header *hdr =
+			(struct rspamd_task_export_header *)data;
+
+	hdr->len = len;
+	hdr->cache_cksum = exp->cksum;
+
+	if (exp->file_fd != -1) {
+		/* Single write of a batch is not interleaved with other workers */
+		if (write (exp->file_fd, data, len) == -1) {
+			msg_info ("cannot write task export to %s: %s",
+					exp->file, strerror (errno));
+		}
+	}
+
+	if (rspamd_task_exporter_open_socket (exp)) {
+		if (send (exp->sock_fd, data, len, 0) == -1) {
+			/* Consumer is slow or has gone, do not block scanning */
+			exp->dropped += hdr->nrecords;
+
+			if (errno != EAGAIN && errno != EINTR && errno != ENOBUFS) {
+				msg_info ("cannot send task export to %s: %s",
+						exp->socket_path, strerror (errno));
+				close (exp->sock_fd);
+				exp->sock_fd = -1;
+			}
+		}
+	}
+	else if (exp->socket_path) {
+		exp->dropped += hdr->nrecords;
+	}
+}
+
+static void
+rspamd_task_exporter_reset (struct rspamd_task_exporter *exp)
+{
+	struct rspamd_task_export_header *hdr =
+			(struct rspamd_task_export_header *)exp->buf;
+
+	memset (hdr, 0, sizeof (*hdr));
+	memcpy (hdr->magic, RSPAMD_TASK_EXPORT_MAGIC, sizeof (hdr->magic));
+	hdr->type = RSPAMD_TASK_EXPORT_RECORDS;
+	hdr->pid = getpid ();
+	exp->used = sizeof (*hdr);
+	exp->nrecords = 0;
+}
+
+/* Write names of all symbols, so ids in records could be resolved */
+static void
+rspamd_task_exporter_write_dictionary (struct rspamd_task_exporter *exp)
+{
+	struct rspamd_task_export_header *hdr =
+			(struct rspamd_task_export_header *)exp->buf;
+	struct rspamd_task_export_name *nm;
+	const gchar *name;
+	guint i, nsyms;
+	gsize nlen, elen;
+
+	nsyms = rspamd_symbols_cache_symbols_count (exp->cfg->cache);
+	rspamd_task_exporter_reset (exp);
+	hdr->type = RSPAMD_TASK_EXPORT_SYMBOLS;
+
+	for (i = 0; i < nsyms; i ++) {
+		name = rspamd_symbols_cache_symbol_by_id (exp->cfg->cache, i);
+
+		if (name == NULL) {
+			continue;
+		}
+
+		nlen = strlen (name);
+		elen = EXPORT_ALIGN (sizeof (*nm) + nlen);
+
+		if (exp->used + elen > RSPAMD_TASK_EXPORT_MAX_BATCH ||
+				hdr->nrecords == G_MAXUINT16) {
+			rspamd_task_exporter_write (exp, exp->buf, exp->used);
+			rspamd_task_exporter_reset (exp);
+			hdr->type = RSPAMD_TASK_EXPORT_SYMBOLS;
+		}
+
+		nm = (struct rspamd_task_export_name *)(exp->buf + exp->used);
+		memset (nm, 0, elen);
+		nm->id = i;
+		nm->len = nlen;
+		memcpy (nm + 1, name, nlen);
+		exp->used += elen;
+		hdr->nrecords ++;
+	}
+
+	if (hdr->nrecords > 0) {
+		rspamd_task_exporter_write (exp, exp->buf, exp->used);
+	}
+
+	rspamd_task_exporter_reset (exp);
+}
+
+static void
+rspamd_task_exporter_timer (gint fd, short what, gpointer ud)
+{
+	struct rspamd_task_exporter *exp = ud;
+
+	rspamd_task_exporter_flush (exp);
+}
+
+struct rspamd_task_exporter *
+rspamd_task_exporter_new (struct rspamd_config *cfg,
+		struct event_base *ev_base,
+		const gchar *file,
+		const gchar *socket_path,
+		guint batch,
+		gdouble flush_interval)
+{
+	struct rspamd_task_exporter *exp;
+
+	g_assert (cfg != NULL);
+
+	if (file == NULL && socket_path == NULL) {
+		return NULL;
+	}
+
+	exp = g_malloc0 (sizeof (*exp));
+	exp->cfg = cfg;
+	/* Records contain doubles, so the buffer must be aligned */
+	exp->buf = g_malloc (RSPAMD_TASK_EXPORT_MAX_BATCH);
+	exp->file_fd = -1;
+	exp->sock_fd = -1;
+	exp->batch = MIN (MAX (batch, 1), G_MAXUINT16);
+	exp->cksum = rspamd_symbols_cache_get_cksum (cfg->cache);
+
+	if (file) {
+		exp->file = g_strdup (file);
+		exp->file_fd = open (file, O_WRONLY | O_CREAT | O_APPEND, 00644);
+
+		if (exp->file_fd == -1) {
+			msg_err ("cannot open task export file %s: %s", file,
+					strerror (errno));
+		}
+	}
+
+	if (socket_path) {
+		exp->socket_path = g_strdup (socket_path);
+
+		if (!rspamd_task_exporter_open_socket (exp)) {
+			msg_info ("cannot connect to task export socket %s: %s, "
+					"will retry on flush", socket_path, strerror (errno));
+		}
+	}
+
+	rspamd_task_exporter_write_dictionary (exp);
+
+	if (ev_base && flush_interval > 0) {
+		double_to_tv (flush_interval, &exp->flush_tv);
+		event_set (&exp->flush_ev, -1, EV_TIMEOUT | EV_PERSIST,
+				rspamd_task_exporter_timer, exp);
+		event_base_set (ev_base, &exp->flush_ev);
+		event_add (&exp->flush_ev, &exp->flush_tv);
+		exp->has_timer = TRUE;
+	}
+
+	return exp;
+}
+
+void
+rspamd_task_exporter_add (struct rspamd_task_exporter *exp,
+		struct rspamd_task *task)
+{
+	struct rspamd_task_export_header *hdr;
+	struct rspamd_task_export_record *rec;
+	struct rspamd_task_export_symbol *es;
+	struct rspamd_metric_result *mres;
+	struct rspamd_symbol_result *sym;
+	GHashTableIter it;
+	gpointer k, v;
+	guint32 *sid;
+	guint nsyms = 0, mid_len = 0, max_syms, i = 0;
+	gsize rlen;
+
+	if (exp == NULL) {
+		return;
+	}
+
+	mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
+
+	if (mres) {
+		nsyms = g_hash_table_size (mres->symbols);
+	}
+
+	if (task->message_id) {
+		mid_len = MIN (strlen (task->message_id), EXPORT_MAX_MESSAGE_ID);
+	}
+
+	max_syms = (RSPAMD_TASK_EXPORT_MAX_BATCH - sizeof (*hdr) - sizeof (*rec) -
+			EXPORT_ALIGN (mid_len)) / sizeof (*es);
+	nsyms = MIN (nsyms, MIN (max_syms, G_MAXUINT16));
+	rlen = EXPORT_ALIGN (sizeof (*rec) + sizeof (*es) * nsyms + mid_len);
+
+	if (exp->used + rlen > RSPAMD_TASK_EXPORT_MAX_BATCH) {
+		rspamd_task_exporter_flush (exp);
+	}
+
+	hdr = (struct rspamd_task_export_header *)exp->buf;
+	rec = (struct rspamd_task_export_record *)(exp->buf + exp->used);
+	memset (rec, 0, rlen);
+	rec->len = rlen;
+	rec->timestamp = rspamd_get_calendar_ticks ();
+	rec->size = task->msg.len;
+	rec->message_id_len = mid_len;
+	rec->action = METRIC_ACTION_NOACTION;
+
+	if (task->time_real_finish > task->time_real) {
+		rec->time_real = (task->time_real_finish - task->time_real) * 1000.0;
+	}
+	if (task->time_virtual_finish > task->time_virtual) {
+		rec->time_virtual =
+				(task->time_virtual_finish - task->time_virtual) * 1000.0;
+	}
+
+	if (task->parts) {
+		rec->nparts = MIN (task->parts->len, G_MAXUINT16);
+	}
+	if (task->urls) {
+		rec->nurls = g_hash_table_size (task->urls);
+	}
+
+	sid = rspamd_mempool_get_variable (task->task_pool, "settings_hash");
+
+	if (sid) {
+		rec->settings_id = *sid;
+	}
+
+	es = (struct rspamd_task_export_symbol *)(rec + 1);
+
+	if (mres) {
+		rec->score = mres->score;
+		rec->required_score = rspamd_task_get_required_score (task, mres);
+		rec->action = rspamd_check_action_metric (task, mres);
+
+		g_hash_table_iter_init (&it, mres->symbols);
+
+		while (i < nsyms && g_hash_table_iter_next (&it, &k, &v)) {
+			sym = v;
+			es[i].id = sym->id;
+			es[i].score = sym->score;
+			i ++;
+		}
+	}
+
+	rec->nsymbols = i;
+
+	if (mid_len > 0) {
+		memcpy (&es[nsyms], task->message_id, mid_len);
+	}
+
+	exp->used += rlen;
+	exp->nrecords ++;
+	hdr->nrecords = exp->nrecords;
+
+	if (exp->nrecords >= exp->batch) {
+		rspamd_task_exporter_flush (exp);
+	}
+}
+
+void
+rspamd_task_exporter_flush (struct rspamd_task_exporter *exp)
+{
+	if (exp == NULL || exp->nrecords == 0) {
+		return;
+	}
+
+	rspamd_task_exporter_write (exp, exp->buf, exp->used);
+	rspamd_task_exporter_reset (exp);
+}
+
+void
+rspamd_task_exporter_destroy (struct rspamd_task_exporter *exp)
+{
+	if (exp == NULL) {
+		return;
+	}
+
+	rspamd_task_exporter_flush (exp);
+
+	if (exp->has_timer) {
+		event_del (&exp->flush_ev);
+	}
+
+	if (exp->dropped > 0) {
+		msg_info ("%L task export records have been dropped",
+				(gint64)exp->dropped);
+	}
+
+	if (exp->file_fd != -1) {
+		close (exp->file_fd);
+	}
+
+	if (exp->sock_fd != -1) {
+		close (exp->sock_fd);
+	}
+
+	g_free (exp->file);
+	g_free (exp->socket_path);
+	g_free (exp->buf);
+	g_free (exp);
+}
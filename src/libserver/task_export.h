@@ -0,0 +1,120 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_TASK_EXPORT_H_
+#define SRC_LIBSERVER_TASK_EXPORT_H_
+
+#include "config.h"
+#include <event.h>
+
+/*
+ * Task export writes compact binary summaries of scanned messages in batches
+ * to a file (appended) or to a unix datagram socket. Each batch starts with
+ * a header followed by records, all in the native byte order. Symbols are
+ * identified by symbols cache ids, a dictionary batch with their names is
+ * written when an exporter starts, and every batch carries the symbols cache
+ * checksum so that consumers can detect configuration changes.
+ */
+
+#define RSPAMD_TASK_EXPORT_MAGIC "rse1"
+#define RSPAMD_TASK_EXPORT_MAX_BATCH 65000
+
+struct rspamd_task;
+struct rspamd_config;
+struct rspamd_task_exporter;
+
+enum rspamd_task_export_batch_type {
+	RSPAMD_TASK_EXPORT_RECORDS = 0,
+	RSPAMD_TASK_EXPORT_SYMBOLS,
+};
+
+struct rspamd_task_export_header {
+	gchar magic[4];
+	guint16 type;
+	guint16 nrecords;
+	guint32 len;								/**< length of batch including header	*/
+	guint32 pid;
+	guint64 cache_cksum;
+};
+
+/*
+ * Record of a task, followed by `nsymbols` of symbol results and by
+ * `message_id_len` bytes of message id, whole record is padded to 8 bytes
+ */
+struct rspamd_task_export_record {
+	guint32 len;								/**< length of record including padding	*/
+	guint32 settings_id;
+	gdouble timestamp;
+	gfloat score;
+	gfloat required_score;
+	gfloat time_real;							/**< milliseconds						*/
+	gfloat time_virtual;						/**< milliseconds						*/
+	guint32 size;
+	guint16 action;
+	guint16 nsymbols;
+	guint16 nparts;
+	guint16 message_id_len;
+	guint32 nurls;
+};
+
+struct rspamd_task_export_symbol {
+	guint32 id;
+	gfloat score;
+};
+
+/*
+ * Entry of a dictionary batch, followed by `len` bytes of symbol name and
+ * padded to 8 bytes
+ */
+struct rspamd_task_export_name {
+	guint32 id;
+	guint32 len;
+};
+
+/**
+ * Create new exporter, at least one of `file` or `socket_path` must be set
+ * @param cfg config
+ * @param ev_base event base for flush timer
+ * @param file path to file where batches are appended
+ * @param socket_path path to unix datagram socket
+ * @param batch number of records in a batch
+ * @param flush_interval interval in seconds to flush incomplete batches
+ * @return new exporter or NULL
+ */
+struct rspamd_task_exporter *rspamd_task_exporter_new (
+		struct rspamd_config *cfg,
+		struct event_base *ev_base,
+		const gchar *file,
+		const gchar *socket_path,
+		guint batch,
+		gdouble flush_interval);
+
+/**
+ * Add summary of a task to the current batch
+ */
+void rspamd_task_exporter_add (struct rspamd_task_exporter *exp,
+		struct rspamd_task *task);
+
+/**
+ * Write the current batch
+ */
+void rspamd_task_exporter_flush (struct rspamd_task_exporter *exp);
+
+/**
+ * Flush pending records and destroy exporter
+ */
+void rspamd_task_exporter_destroy (struct rspamd_task_exporter *exp);
+
+#endif /* SRC_LIBSERVER_TASK_EXPORT_H_ */
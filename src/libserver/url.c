@@ -45,8 +45,13 @@
 #include "rspamd.h"
 #include "message.h"
 #include "multipattern.h"
+#include "tld_trie.h"
 #include "contrib/uthash/utlist.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 typedef struct url_match_s {
 	const gchar *m_begin;
 	gsize m_len;
@@ -213,6 +218,7 @@ struct url_callback_data {
 struct url_match_scanner {
 	GArray *matchers;
 	struct rspamd_multipattern *search_trie;
+	struct rspamd_tld_trie *tld_trie; /* public suffixes lookup for hosts */
 };
 
 struct url_match_scanner *url_scanner = NULL;
@@ -419,6 +425,7 @@ rspamd_url_parse_tld_file (const gchar *fname,
 		}
 
 		flags = URL_FLAG_NOHTML | URL_FLAG_TLD_MATCH;
+		rspamd_tld_trie_add (url_scanner->tld_trie, linebuf, strlen (linebuf));
 
 #ifndef WITH_HYPERSCAN
 		if (linebuf[0] == '*') {
@@ -481,6 +488,7 @@ rspamd_url_init (const gchar *tld_file)
 
 	if (url_scanner == NULL) {
 		url_scanner = g_malloc (sizeof (struct url_match_scanner));
+		url_scanner->tld_trie = rspamd_tld_trie_new ();
 
 		if (tld_file) {
 			/* Reserve larger multipattern */
@@ -502,14 +510,17 @@ rspamd_url_init (const gchar *tld_file)
 			rspamd_url_parse_tld_file (tld_file, url_scanner);
 		}
 
+		rspamd_tld_trie_compile (url_scanner->tld_trie);
+
 		if (!rspamd_multipattern_compile (url_scanner->search_trie, &err)) {
 			msg_err ("cannot compile tld patterns, url matching will be "
 					"broken completely: %e", err);
 			g_error_free (err);
 		}
 
-		msg_debug ("initialized trie of %ud elements",
-				url_scanner->matchers->len);
+		msg_debug ("initialized trie of %ud elements and tld trie of %z nodes",
+				url_scanner->matchers->len,
+				rspamd_tld_trie_size (url_scanner->tld_trie));
 	}
 }
 
@@ -1153,67 +1164,24 @@ rspamd_web_parse (struct http_parser_url *u, const gchar *str, gsize len,
 
 #undef SET_U
 
-static gint
-rspamd_tld_trie_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
+/* Sets registered domain of the url host */
+static void
+rspamd_url_find_host_tld (struct rspamd_url *url)
 {
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct rspamd_url *url = context;
-	gint ndots = 1;
-
-	matcher = &g_array_index (url_scanner->matchers, struct url_matcher,
-			strnum);
-
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = url->host;
-
-	if (*pos != '.' || match_pos != (gint) url->hostlen) {
-		/* Something weird has been found */
-		if (match_pos == (gint) url->hostlen - 1) {
-			pos = url->host + match_pos;
-			if (*pos == '.') {
-				/* This is dot at the end of domain */
-				url->hostlen--;
-			}
-			else {
-				return 0;
-			}
-		}
-		else {
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
+	rspamd_ftok_t tld;
+	gsize hostlen = url->hostlen;
 
-		p--;
+	if (hostlen > 1 && url->host[hostlen - 1] == '.') {
+		/* This is dot at the end of domain */
+		hostlen --;
 	}
 
-	if ((ndots == 0 || p == start - 1) &&
-			url->tldlen < url->host + url->hostlen - pos) {
-		url->tld = (gchar *) pos;
-		url->tldlen = url->host + url->hostlen - pos;
+	if (rspamd_tld_trie_lookup (url_scanner->tld_trie, url->host, hostlen,
+			&tld)) {
+		url->hostlen = hostlen;
+		url->tld = (gchar *)tld.begin;
+		url->tldlen = tld.len;
 	}
-
-	return 0;
 }
 
 static gboolean
@@ -1608,9 +1576,7 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	}
 
 	/* Find TLD part */
-	rspamd_multipattern_lookup (url_scanner->search_trie,
-				uri->host, uri->hostlen,
-				rspamd_tld_trie_callback, uri, NULL);
+	rspamd_url_find_host_tld (uri);
 
 	if (uri->tldlen == 0) {
 		/* Ignore URL's without TLD if it is not a numeric URL */
@@ -1626,90 +1592,16 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	return URI_ERRNO_OK;
 }
 
-struct tld_trie_cbdata {
-	const gchar *begin;
-	gsize len;
-	rspamd_ftok_t *out;
-};
-
-static gint
-rspamd_tld_trie_find_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct tld_trie_cbdata *cbdata = context;
-	gint ndots = 1;
-
-	matcher = &g_array_index (url_scanner->matchers, struct url_matcher,
-			strnum);
-
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = text;
-
-	if (*pos != '.' || match_pos != (gint)cbdata->len) {
-		/* Something weird has been found */
-		if (match_pos != (gint)cbdata->len - 1) {
-			/* Search more */
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-
-		p--;
-	}
-
-	if (ndots == 0 || p == start - 1) {
-		if (cbdata->begin + cbdata->len - pos > cbdata->out->len) {
-			cbdata->out->begin = pos;
-			cbdata->out->len = cbdata->begin + cbdata->len - pos;
-		}
-	}
-
-	return 0;
-}
-
 gboolean
 rspamd_url_find_tld (const gchar *in, gsize inlen, rspamd_ftok_t *out)
 {
-	struct tld_trie_cbdata cbdata;
-
 	g_assert (in != NULL);
 	g_assert (out != NULL);
 	g_assert (url_scanner != NULL);
 
-	cbdata.begin = in;
-	cbdata.len = inlen;
-	cbdata.out = out;
 	out->len = 0;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in, inlen,
-			rspamd_tld_trie_find_callback, &cbdata, NULL);
-
-	if (out->len > 0) {
-		return TRUE;
-	}
-
-	return FALSE;
+	return rspamd_tld_trie_lookup (url_scanner->tld_trie, in, inlen, out);
 }
 
 static const gchar url_braces[] = {
@@ -2260,7 +2152,7 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 		return 0;
 	}
 
-	pos = cb->begin + match_start;
+	pos = text + match_start;
 	m.pattern = matcher->pattern;
 	m.prefix = matcher->prefix;
 	m.add_prefix = FALSE;
@@ -2293,7 +2185,9 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 
 		if (rc == URI_ERRNO_OK && url->hostlen > 0) {
 			if (cb->func) {
-				cb->func (url, cb->start - text, cb->fin - text, cb->funcd);
+				/* Text can be a window of the whole input */
+				cb->func (url, cb->start - cb->begin, cb->fin - cb->begin,
+						cb->funcd);
 			}
 		}
 		else if (rc != URI_ERRNO_OK) {
@@ -2359,6 +2253,15 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	ex->len = end_offset - start_offset;
 	ex->type = RSPAMD_EXCEPTION_URL;
 
+	if (task->cfg && task->cfg->max_urls > 0 && g_hash_table_size (task->urls) +
+			g_hash_table_size (task->emails) >= task->cfg->max_urls) {
+		/* Keep exception but do not collect more urls */
+		rspamd_task_budget_exceeded (task, RSPAMD_TASK_BUDGET_URLS, "urls");
+		cbd->part->exceptions = g_list_prepend (cbd->part->exceptions, ex);
+
+		return;
+	}
+
 	if (url->protocol == PROTOCOL_MAILTO) {
 		if (url->userlen > 0) {
 			if (!g_hash_table_lookup (task->emails, url)) {
@@ -2408,6 +2311,47 @@ rspamd_url_text_part_callback (struct rspamd_url *url, gsize start_offset,
 	}
 }
 
+struct rspamd_url_host *
+rspamd_url_host_intern (struct rspamd_task *task, struct rspamd_url *url)
+{
+	struct rspamd_url_host *h;
+	rspamd_ftok_t srch;
+
+	if (url->host_ref) {
+		return url->host_ref;
+	}
+
+	if (url->hostlen == 0) {
+		return NULL;
+	}
+
+	srch.begin = url->host;
+	srch.len = url->hostlen;
+	h = rspamd_mempool_hash_lookup (task->url_hosts, &srch);
+
+	if (h == NULL) {
+		h = rspamd_mempool_alloc0 (task->task_pool, sizeof (*h));
+		/* Hosts are lowercased when urls are parsed */
+		h->host.begin = url->host;
+		h->host.len = url->hostlen;
+
+		if (url->tldlen > 0) {
+			h->tld.begin = url->tld;
+			h->tld.len = url->tldlen;
+		}
+		else {
+			h->tld = h->host;
+		}
+
+		rspamd_mempool_hash_insert (task->url_hosts, &h->host, h);
+	}
+
+	h->nurls ++;
+	url->host_ref = h;
+
+	return h;
+}
+
 void
 rspamd_url_text_extract (rspamd_mempool_t *pool,
 		struct rspamd_task *task,
@@ -2429,6 +2373,125 @@ rspamd_url_text_extract (rspamd_mempool_t *pool,
 			rspamd_url_text_part_callback, &mcbd);
 }
 
+/* Do not prefilter short texts */
+#define URL_PREFILTER_MIN_LEN 1024
+/* Merge candidate windows that are closer than this */
+#define URL_PREFILTER_GAP 64
+
+/*
+ * Every url pattern contains '.' followed by a tld, '@' or a scheme colon,
+ * so only such bytes can anchor an url
+ */
+static inline gboolean
+rspamd_url_is_anchor (const gchar *p, const gchar *end)
+{
+	guchar n;
+
+	if (*p == '@') {
+		return TRUE;
+	}
+
+	if (p + 1 >= end) {
+		return FALSE;
+	}
+
+	n = p[1];
+
+	if (*p == '.') {
+		/* Tlds start with a letter or with an utf8 sequence */
+		return g_ascii_isalpha (n) || n >= 0x80;
+	}
+	else if (*p == ':') {
+		return n == '/' || n == '\\' || g_ascii_isalpha (n);
+	}
+
+	return FALSE;
+}
+
+static const gchar *
+rspamd_url_next_anchor (const gchar *p, const gchar *limit, const gchar *end)
+{
+#ifdef __SSE2__
+	const __m128i dots = _mm_set1_epi8 ('.'), ats = _mm_set1_epi8 ('@'),
+			colons = _mm_set1_epi8 (':');
+	__m128i v;
+	guint mask, i;
+
+	while (limit - p >= 16) {
+		v = _mm_loadu_si128 ((const __m128i *)p);
+		mask = _mm_movemask_epi8 (_mm_or_si128 (
+				_mm_or_si128 (_mm_cmpeq_epi8 (v, dots), _mm_cmpeq_epi8 (v, ats)),
+				_mm_cmpeq_epi8 (v, colons)));
+
+		while (mask) {
+			i = __builtin_ctz (mask);
+
+			if (rspamd_url_is_anchor (p + i, end)) {
+				return p + i;
+			}
+
+			mask &= mask - 1;
+		}
+
+		p += 16;
+	}
+#endif
+
+	while (p < limit) {
+		if ((*p == '.' || *p == '@' || *p == ':') &&
+				rspamd_url_is_anchor (p, end)) {
+			return p;
+		}
+
+		p ++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Runs patterns over windows of non-space text around anchors only, as
+ * no pattern contains spaces
+ */
+static void
+rspamd_url_lookup_prefiltered (struct url_callback_data *cb,
+		const gchar *in, gsize inlen, rspamd_multipattern_cb_t func)
+{
+	const gchar *p = in, *end = in + inlen, *anchor, *wstart, *wend;
+
+	while ((anchor = rspamd_url_next_anchor (p, end, end)) != NULL) {
+		wstart = anchor;
+
+		while (wstart > p && !g_ascii_isspace (*(wstart - 1))) {
+			wstart --;
+		}
+
+		wend = anchor + 1;
+
+		for (;;) {
+			while (wend < end && !g_ascii_isspace (*wend)) {
+				wend ++;
+			}
+
+			anchor = rspamd_url_next_anchor (wend,
+					MIN (end, wend + URL_PREFILTER_GAP), end);
+
+			if (anchor == NULL) {
+				break;
+			}
+
+			wend = anchor + 1;
+		}
+
+		if (rspamd_multipattern_lookup (url_scanner->search_trie, wstart,
+				wend - wstart, func, cb, NULL) != 0) {
+			break;
+		}
+
+		p = wend;
+	}
+}
+
 void
 rspamd_url_find_multiple (rspamd_mempool_t *pool, const gchar *in,
 		gsize inlen, gboolean is_html, GPtrArray *nlines,
@@ -2452,9 +2515,15 @@ rspamd_url_find_multiple (rspamd_mempool_t *pool, const gchar *in,
 	cb.func = func;
 	cb.newlines = nlines;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in,
-			inlen,
-			rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+	if (inlen >= URL_PREFILTER_MIN_LEN) {
+		rspamd_url_lookup_prefiltered (&cb, in, inlen,
+				rspamd_url_trie_generic_callback_multiple);
+	}
+	else {
+		rspamd_multipattern_lookup (url_scanner->search_trie, in,
+				inlen,
+				rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+	}
 }
 
 void
@@ -24,6 +24,13 @@ struct rspamd_url_tag {
 	struct rspamd_url_tag *prev, *next;
 };
 
+/* Hostname shared by all urls of a task with the same host */
+struct rspamd_url_host {
+	rspamd_ftok_t host;
+	rspamd_ftok_t tld;
+	guint nurls;
+};
+
 struct rspamd_url {
 	gchar *string;
 	gint protocol;
@@ -38,6 +45,7 @@ struct rspamd_url {
 	gchar *tld;
 
 	struct rspamd_url *phished_url;
+	struct rspamd_url_host *host_ref;
 
 	guint protocollen;
 	guint userlen;
@@ -79,6 +87,16 @@ enum rspamd_url_protocol {
  */
 void rspamd_url_init (const gchar *tld_file);
 
+/**
+ * Returns host of the url interned in the task hosts table, all urls with
+ * the same (caseless) hostname get the same structure
+ * @param task
+ * @param url
+ * @return host structure or NULL if url has no host
+ */
+struct rspamd_url_host *rspamd_url_host_intern (struct rspamd_task *task,
+		struct rspamd_url *url);
+
 /*
  * Parse urls inside text
  * @param pool memory pool
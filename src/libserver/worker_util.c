@@ -24,6 +24,7 @@
 #include "libutil/map.h"
 #include "libutil/map_private.h"
 #include "libutil/http_private.h"
+#include "libutil/shm_counters.h"
 
 #ifdef WITH_GPERF_TOOLS
 #include <gperftools/profiler.h>
@@ -42,6 +43,16 @@
 #ifdef HAVE_LIBUTIL_H
 #include <libutil.h>
 #endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* Helpers should not compete with scanning workers for cpu and disks */
+#define RSPAMD_HELPER_NICE 10
+#define RSPAMD_HELPER_IO_PRIORITY "best-effort:7"
 
 static void rspamd_worker_ignore_signal (int signo);
 /**
@@ -306,6 +317,26 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	return ev_base;
 }
 
+void
+rspamd_worker_pause_accept (struct rspamd_worker *worker, gboolean pause)
+{
+	GList *cur;
+	struct event *events;
+
+	for (cur = worker->accept_events; cur != NULL; cur = g_list_next (cur)) {
+		events = cur->data;
+
+		if (pause) {
+			event_del (&events[0]);
+		}
+		else if (!event_get_base (&events[1]) ||
+				!event_pending (&events[1], EV_TIMEOUT, NULL)) {
+			/* Throttled sockets are enabled by their own timer */
+			event_add (&events[0], NULL);
+		}
+	}
+}
+
 void
 rspamd_worker_stop_accept (struct rspamd_worker *worker)
 {
@@ -335,6 +366,7 @@ rspamd_worker_stop_accept (struct rspamd_worker *worker)
 
 	if (worker->accept_events != NULL) {
 		g_list_free (worker->accept_events);
+		worker->accept_events = NULL;
 	}
 
 	g_hash_table_iter_init (&it, worker->signal_events);
@@ -514,6 +546,237 @@ rspamd_worker_set_limits (struct rspamd_main *rspamd_main,
 	}
 }
 
+#ifdef HAVE_SCHED_SETAFFINITY
+static gboolean
+rspamd_worker_parse_cpulist (const gchar *str, cpu_set_t *set)
+{
+	gchar **parts, **cur, *end;
+	gulong lo, hi;
+	gboolean ret = FALSE;
+
+	parts = g_strsplit_set (str, ", \n", -1);
+
+	for (cur = parts; *cur != NULL; cur ++) {
+		if (**cur == '\0') {
+			continue;
+		}
+
+		lo = strtoul (*cur, &end, 10);
+		hi = lo;
+
+		if (*end == '-') {
+			hi = strtoul (end + 1, &end, 10);
+		}
+
+		if (end == *cur || *end != '\0' || hi < lo || hi >= CPU_SETSIZE) {
+			ret = FALSE;
+			break;
+		}
+
+		for (; lo <= hi; lo ++) {
+			CPU_SET (lo, set);
+		}
+
+		ret = TRUE;
+	}
+
+	g_strfreev (parts);
+
+	return ret;
+}
+
+static gboolean
+rspamd_worker_numa_node_cpus (guint node, cpu_set_t *set)
+{
+	gchar path[PATH_MAX], *content = NULL;
+	gboolean ret;
+
+	rspamd_snprintf (path, sizeof (path),
+			"/sys/devices/system/node/node%ud/cpulist", node);
+
+	if (!g_file_get_contents (path, &content, NULL, NULL)) {
+		return FALSE;
+	}
+
+	ret = rspamd_worker_parse_cpulist (g_strstrip (content), set);
+	g_free (content);
+
+	return ret;
+}
+
+static guint
+rspamd_worker_numa_nodes (void)
+{
+	gchar path[PATH_MAX];
+	guint n = 0;
+
+	for (;;) {
+		rspamd_snprintf (path, sizeof (path), "/sys/devices/system/node/node%ud",
+				n);
+
+		if (access (path, F_OK) == -1) {
+			break;
+		}
+
+		n ++;
+	}
+
+	return n;
+}
+#endif
+
+/*
+ * Binds a new worker either to a single core chosen by its index or to all
+ * cores of a numa node, so its memory is allocated from the local node
+ */
+static void
+rspamd_worker_set_affinity (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf, guint index)
+{
+	const gchar *spec = cf->cpu_affinity;
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t avail, set;
+	glong ncpus, i, target;
+	guint nnodes;
+	gboolean ok, single = TRUE;
+#endif
+
+	if (spec == NULL || g_ascii_strcasecmp (spec, "false") == 0 ||
+			g_ascii_strcasecmp (spec, "no") == 0) {
+		return;
+	}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+	CPU_ZERO (&avail);
+	CPU_ZERO (&set);
+
+	if (g_ascii_strcasecmp (spec, "numa") == 0) {
+		nnodes = rspamd_worker_numa_nodes ();
+		ok = nnodes > 0 && rspamd_worker_numa_node_cpus (index % nnodes, &set);
+		single = FALSE;
+	}
+	else if (g_ascii_strncasecmp (spec, "node", 4) == 0 &&
+			g_ascii_isdigit (spec[4])) {
+		ok = rspamd_worker_numa_node_cpus (strtoul (spec + 4, NULL, 10), &set);
+		single = FALSE;
+	}
+	else if (g_ascii_strcasecmp (spec, "true") == 0 ||
+			g_ascii_strcasecmp (spec, "yes") == 0 ||
+			g_ascii_strcasecmp (spec, "auto") == 0) {
+		ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+		ok = ncpus > 0;
+
+		for (i = 0; i < ncpus && i < CPU_SETSIZE; i ++) {
+			CPU_SET (i, &avail);
+		}
+	}
+	else {
+		ok = rspamd_worker_parse_cpulist (spec, &avail);
+	}
+
+	if (!ok) {
+		msg_warn_main ("cannot parse cpu affinity '%s', worker is not bound",
+				spec);
+		return;
+	}
+
+	if (single) {
+		target = index % CPU_COUNT (&avail);
+
+		for (i = 0; i < CPU_SETSIZE; i ++) {
+			if (CPU_ISSET (i, &avail) && target-- == 0) {
+				CPU_SET (i, &set);
+				break;
+			}
+		}
+	}
+
+	if (sched_setaffinity (0, sizeof (set), &set) == -1) {
+		msg_warn_main ("cannot set cpu affinity '%s' for worker %ud: %s",
+				spec, index, strerror (errno));
+	}
+#else
+	msg_warn_main ("cpu affinity is not supported on this platform");
+#endif
+}
+
+static void
+rspamd_worker_set_io_priority (struct rspamd_main *rspamd_main,
+		const gchar *spec)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	/* There is no glibc wrapper, so use values from linux/ioprio.h */
+	const gint ioprio_who_process = 1, ioprio_class_shift = 13;
+	gint cls, level = 4;
+	const gchar *p;
+
+	if (g_ascii_strncasecmp (spec, "idle", 4) == 0) {
+		cls = 3;
+		level = 0;
+	}
+	else if (g_ascii_strncasecmp (spec, "best-effort", 11) == 0 ||
+			g_ascii_strncasecmp (spec, "be", 2) == 0) {
+		cls = 2;
+	}
+	else if (g_ascii_strncasecmp (spec, "realtime", 8) == 0 ||
+			g_ascii_strncasecmp (spec, "rt", 2) == 0) {
+		cls = 1;
+	}
+	else {
+		msg_warn_main ("invalid io priority '%s'", spec);
+		return;
+	}
+
+	p = strchr (spec, ':');
+
+	if (p != NULL && cls != 3) {
+		level = strtol (p + 1, NULL, 10);
+
+		if (level < 0 || level > 7) {
+			msg_warn_main ("invalid io priority level in '%s'", spec);
+			return;
+		}
+	}
+
+	if (syscall (SYS_ioprio_set, ioprio_who_process, 0,
+			(cls << ioprio_class_shift) | level) == -1) {
+		msg_warn_main ("cannot set io priority '%s': %s", spec,
+				strerror (errno));
+	}
+#else
+	msg_warn_main ("io priority is not supported on this platform");
+#endif
+}
+
+static void
+rspamd_worker_set_priority (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf)
+{
+	gint nice_level = cf->nice;
+	const gchar *io_priority = cf->io_priority;
+
+	if (cf->worker->flags & RSPAMD_WORKER_LOW_PRIORITY) {
+		if (nice_level == RSPAMD_WORKER_NICE_UNSET) {
+			nice_level = RSPAMD_HELPER_NICE;
+		}
+
+		if (io_priority == NULL) {
+			io_priority = RSPAMD_HELPER_IO_PRIORITY;
+		}
+	}
+
+	if (nice_level != RSPAMD_WORKER_NICE_UNSET) {
+		if (setpriority (PRIO_PROCESS, 0, nice_level) == -1) {
+			msg_warn_main ("cannot set scheduling priority %d for %s: %s",
+					nice_level, cf->worker->name, strerror (errno));
+		}
+	}
+
+	if (io_priority != NULL) {
+		rspamd_worker_set_io_priority (rspamd_main, io_priority);
+	}
+}
+
 struct rspamd_worker *
 rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		struct rspamd_worker_conf *cf,
@@ -538,6 +801,7 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 	}
 
 	wrk->srv = rspamd_main;
+	wrk->generation = rspamd_main->generation;
 	wrk->type = cf->type;
 	wrk->cf = cf;
 	REF_RETAIN (cf);
@@ -545,6 +809,16 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 	wrk->ctx = cf->ctx;
 	wrk->finish_actions = g_ptr_array_new ();
 
+	if (rspamd_main->counters) {
+		wrk->counters_slot = rspamd_shm_counters_alloc_slot (
+				rspamd_main->counters);
+	}
+
+	if (rspamd_main->cfg->log_ring_size > 0 &&
+			rspamd_main->cfg->log_type != RSPAMD_LOG_SYSLOG) {
+		wrk->log_ring = rspamd_log_ring_new (rspamd_main->cfg->log_ring_size);
+	}
+
 	wrk->pid = fork ();
 
 	switch (wrk->pid) {
@@ -567,11 +841,15 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		/* Remove the inherited event base */
 		event_reinit (rspamd_main->ev_base);
 		event_base_free (rspamd_main->ev_base);
+		rspamd_event_common_tv_reset ();
 
+		/* Raising priorities is allowed for root only */
+		rspamd_worker_set_priority (rspamd_main, cf);
 		/* Drop privilleges */
 		rspamd_worker_drop_priv (rspamd_main);
 		/* Set limits */
 		rspamd_worker_set_limits (rspamd_main, cf);
+		rspamd_worker_set_affinity (rspamd_main, cf, index);
 		/* Re-set stack limit */
 		getrlimit (RLIMIT_STACK, &rlim);
 		rlim.rlim_cur = 100 * 1024 * 1024;
@@ -583,8 +861,14 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		/* Do silent log reopen to avoid collisions */
 		rspamd_log_close (rspamd_main->logger);
 		rspamd_log_open (rspamd_main->logger);
+		rspamd_log_set_ring (rspamd_main->logger, wrk->log_ring);
 		wrk->start_time = rspamd_get_calendar_ticks ();
 
+		if (rspamd_main->counters) {
+			rspamd_shm_counters_set_slot (rspamd_main->counters,
+					wrk->counters_slot);
+		}
+
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
 # if (GLIB_MINOR_VERSION > 20)
 		/* Ugly hack for old glib */
@@ -694,3 +978,92 @@ rspamd_worker_is_normal (struct rspamd_worker *w)
 
 	return FALSE;
 }
+
+static const gchar *builtin_counters[RSPAMD_COUNTER_ACTIONS] = {
+		[RSPAMD_COUNTER_SCANNED] = "scanned",
+		[RSPAMD_COUNTER_LEARNED] = "learned",
+		[RSPAMD_COUNTER_CONNECTIONS] = "connections",
+		[RSPAMD_COUNTER_CONTROL_CONNECTIONS] = "control_connections",
+};
+
+void
+rspamd_main_counters_init (struct rspamd_main *rspamd_main)
+{
+	gchar name[RSPAMD_SHM_COUNTER_NAME_LEN];
+	gint i, id;
+
+	rspamd_main->counters = rspamd_shm_counters_new (rspamd_main->server_pool);
+
+	for (i = 0; i < RSPAMD_COUNTER_BUILTIN_MAX; i ++) {
+		if (i < RSPAMD_COUNTER_ACTIONS) {
+			rspamd_strlcpy (name, builtin_counters[i], sizeof (name));
+		}
+		else {
+			rspamd_snprintf (name, sizeof (name), "action_%s",
+					rspamd_action_to_str_alt (i - RSPAMD_COUNTER_ACTIONS));
+			g_strdelimit (name, " ", '_');
+		}
+
+		id = rspamd_shm_counters_register (rspamd_main->counters, name);
+		g_assert (id == i);
+	}
+}
+
+void
+rspamd_main_counter_add (struct rspamd_main *rspamd_main, guint id,
+		guint64 value)
+{
+	if (rspamd_main && rspamd_main->counters) {
+		rspamd_shm_counters_add (rspamd_main->counters, id, value);
+	}
+}
+
+void
+rspamd_main_stat_copy (struct rspamd_main *rspamd_main,
+		struct rspamd_stat *st)
+{
+	struct rspamd_shm_counters *c = rspamd_main->counters;
+	gint i;
+
+	memcpy (st, rspamd_main->stat, sizeof (*st));
+
+	if (c == NULL) {
+		return;
+	}
+
+	st->messages_scanned = rspamd_shm_counters_get (c, RSPAMD_COUNTER_SCANNED);
+	st->messages_learned = rspamd_shm_counters_get (c, RSPAMD_COUNTER_LEARNED);
+	st->connections_count = rspamd_shm_counters_get (c,
+			RSPAMD_COUNTER_CONNECTIONS);
+	st->control_connections_count = rspamd_shm_counters_get (c,
+			RSPAMD_COUNTER_CONTROL_CONNECTIONS);
+
+	for (i = 0; i < METRIC_ACTION_MAX; i ++) {
+		st->actions_stat[i] = rspamd_shm_counters_get (c,
+				RSPAMD_COUNTER_ACTIONS + i);
+	}
+}
+
+void
+rspamd_main_stat_restore (struct rspamd_main *rspamd_main,
+		const struct rspamd_stat *st)
+{
+	struct rspamd_shm_counters *c = rspamd_main->counters;
+	gint i;
+
+	if (c == NULL) {
+		return;
+	}
+
+	rspamd_shm_counters_set (c, RSPAMD_COUNTER_SCANNED, st->messages_scanned);
+	rspamd_shm_counters_set (c, RSPAMD_COUNTER_LEARNED, st->messages_learned);
+	rspamd_shm_counters_set (c, RSPAMD_COUNTER_CONNECTIONS,
+			st->connections_count);
+	rspamd_shm_counters_set (c, RSPAMD_COUNTER_CONTROL_CONNECTIONS,
+			st->control_connections_count);
+
+	for (i = 0; i < METRIC_ACTION_MAX; i ++) {
+		rspamd_shm_counters_set (c, RSPAMD_COUNTER_ACTIONS + i,
+				st->actions_stat[i]);
+	}
+}
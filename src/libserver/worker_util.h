@@ -57,6 +57,14 @@ void rspamd_worker_set_signal_handler (int signo,
  */
 void rspamd_worker_stop_accept (struct rspamd_worker *worker);
 
+/**
+ * Temporary stop or restart accepting new connections, so other workers
+ * could take them
+ * @param worker
+ * @param pause
+ */
+void rspamd_worker_pause_accept (struct rspamd_worker *worker, gboolean pause);
+
 typedef gint (*rspamd_controller_func_t) (
 	struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg,
@@ -142,6 +150,30 @@ gboolean rspamd_worker_is_normal (struct rspamd_worker *w);
 struct rspamd_worker *rspamd_fork_worker (struct rspamd_main *,
 		struct rspamd_worker_conf *, guint idx, struct event_base *ev_base);
 
+/**
+ * Creates shared counters registry with the builtin counters
+ */
+void rspamd_main_counters_init (struct rspamd_main *rspamd_main);
+
+/**
+ * Adds value to a counter of the shared registry, does nothing if there is
+ * no registry (e.g. in rspamadm)
+ */
+void rspamd_main_counter_add (struct rspamd_main *rspamd_main, guint id,
+		guint64 value);
+
+/**
+ * Copies server statistics and sums builtin counters to it
+ */
+void rspamd_main_stat_copy (struct rspamd_main *rspamd_main,
+		struct rspamd_stat *st);
+
+/**
+ * Sets builtin counters from statistics, used to restore or to reset them
+ */
+void rspamd_main_stat_restore (struct rspamd_main *rspamd_main,
+		const struct rspamd_stat *st);
+
 #define msg_err_main(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         rspamd_main->server_pool->tag.tagname, rspamd_main->server_pool->tag.uid, \
         G_STRFUNC, \
@@ -29,6 +29,7 @@ struct rspamd_stat_ctx;
 struct rspamd_token_result;
 struct rspamd_statfile;
 struct rspamd_task;
+struct rspamd_stat_tokens;
 
 struct rspamd_stat_backend {
 	const char *name;
@@ -36,12 +37,14 @@ struct rspamd_stat_backend {
 			struct rspamd_statfile *st);
 	gpointer (*runtime)(struct rspamd_task *task,
 			struct rspamd_statfile_config *stcf, gboolean learn, gpointer ctx);
-	gboolean (*process_tokens)(struct rspamd_task *task, GPtrArray *tokens,
+	gboolean (*process_tokens)(struct rspamd_task *task,
+			struct rspamd_stat_tokens *tokens,
 			gint id,
 			gpointer ctx);
 	void (*finalize_process)(struct rspamd_task *task,
 			gpointer runtime, gpointer ctx);
-	gboolean (*learn_tokens)(struct rspamd_task *task, GPtrArray *tokens,
+	gboolean (*learn_tokens)(struct rspamd_task *task,
+			struct rspamd_stat_tokens *tokens,
 			gint id,
 			gpointer ctx);
 	gulong (*total_learns)(struct rspamd_task *task,
@@ -66,13 +69,13 @@ struct rspamd_stat_backend {
 				struct rspamd_statfile_config *stcf, \
 				gboolean learn, gpointer ctx); \
 		gboolean rspamd_##name##_process_tokens (struct rspamd_task *task, \
-                GPtrArray *tokens, gint id, \
+                struct rspamd_stat_tokens *tokens, gint id, \
 				gpointer ctx); \
 		void rspamd_##name##_finalize_process (struct rspamd_task *task, \
 				gpointer runtime, \
 				gpointer ctx); \
 		gboolean rspamd_##name##_learn_tokens (struct rspamd_task *task, \
-                GPtrArray *tokens, gint id, \
+                struct rspamd_stat_tokens *tokens, gint id, \
 				gpointer ctx); \
 		void rspamd_##name##_finalize_learn (struct rspamd_task *task, \
 				gpointer runtime, \
@@ -101,4 +104,14 @@ RSPAMD_STAT_BACKEND_DEF(sqlite3);
 RSPAMD_STAT_BACKEND_DEF(redis);
 #endif
 
+/* Read only access to plain mmapped statfiles for offline conversion */
+struct rspamd_mmaped_file_reader;
+struct rspamd_mmaped_file_reader * rspamd_mmaped_file_reader_open (
+		const gchar *filename, GError **err);
+guint64 rspamd_mmaped_file_reader_blocks (struct rspamd_mmaped_file_reader *r);
+guint64 rspamd_mmaped_file_reader_learns (struct rspamd_mmaped_file_reader *r);
+gboolean rspamd_mmaped_file_reader_get (struct rspamd_mmaped_file_reader *r,
+		guint64 idx, guint64 *token, gdouble *value);
+void rspamd_mmaped_file_reader_close (struct rspamd_mmaped_file_reader *r);
+
 #endif /* BACKENDS_H_ */
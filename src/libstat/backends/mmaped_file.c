@@ -21,6 +21,26 @@
 
 /* Section types */
 #define STATFILE_SECTION_COMMON 1
+#define STATFILE_SECTION_COMBINED 2
+
+/* Combined statfiles: slots per bucket and buckets probed per token */
+#define COMBINED_BUCKET_SLOTS 5
+#define COMBINED_PROBE_BUCKETS 4
+/* How many tokens ahead buckets are prefetched */
+#define COMBINED_PREFETCH_DISTANCE 8
+
+/* Online growth: fill ratio to start, blocks copied per learn */
+#define GROW_FILL_RATIO 0.9
+#define GROW_MIGRATE_STEP 65536
+#define GROW_SUFFIX ".new"
+/* Set in padding[0] of a statfile replaced by a grown one */
+#define STATFILE_FLAG_SUPERSEDED 0x1
+
+#ifdef __GNUC__
+#define STAT_PREFETCH(p) __builtin_prefetch ((p), 0, 1)
+#else
+#define STAT_PREFETCH(p) (void)(p)
+#endif
 
 /**
  * Common statfile header
@@ -55,6 +75,32 @@ struct stat_file_block {
 	double value;                           /**< double value                       */
 };
 
+/**
+ * Bucket of a combined statfile, it occupies exactly one cache line and holds
+ * both spam and ham values for several tokens
+ */
+struct stat_file_combined_bucket {
+	guint32 tags[COMBINED_BUCKET_SLOTS];    /**< hash2 of tokens (0 - free slot)	*/
+	gfloat spam[COMBINED_BUCKET_SLOTS];     /**< spam values						*/
+	gfloat ham[COMBINED_BUCKET_SLOTS];      /**< ham values							*/
+	guint32 unused;
+};
+
+G_STATIC_ASSERT (sizeof (struct stat_file_combined_bucket) == 64);
+
+/**
+ * Ham counters of a combined statfile (spam ones are in the common header)
+ */
+struct stat_file_combined_info {
+	guint64 ham_revision;                   /**< revision number of ham class		*/
+	guint64 ham_rev_time;                   /**< revision time of ham class			*/
+};
+
+/* Buckets start at the first cache line boundary after headers */
+#define COMBINED_DATA_OFFSET ((sizeof (struct stat_file_header) + \
+		sizeof (struct stat_file_section) + \
+		sizeof (struct stat_file_combined_info) + 63) & ~63)
+
 /**
  * Statistic file
  */
@@ -67,7 +113,7 @@ struct stat_file {
 /**
  * Common view of statfile object
  */
-typedef struct {
+typedef struct rspamd_mmaped_file_s {
 #ifdef HAVE_PATH_MAX
 	gchar filename[PATH_MAX];               /**< name of file						*/
 #else
@@ -79,11 +125,17 @@ typedef struct {
 	off_t seek_pos;                         /**< current seek position				*/
 	struct stat_file_section cur_section;   /**< current section					*/
 	size_t len;                             /**< length of file(in bytes)			*/
+	gboolean combined;                      /**< spam and ham share buckets			*/
+	gboolean auto_grow;                     /**< grow file when it is almost full	*/
+	gsize max_size;                         /**< limit for growth					*/
+	struct rspamd_mmaped_file_s *grow;      /**< larger file being filled			*/
+	guint64 migrate_pos;                    /**< next block to copy to grow file	*/
 	struct rspamd_statfile_config *cf;
 } rspamd_mmaped_file_t;
 
 
 #define RSPAMD_STATFILE_VERSION {'1', '2'}
+#define RSPAMD_STATFILE_COMBINED_VERSION {'2', '0'}
 #define BACKUP_SUFFIX ".old"
 
 static void rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
@@ -99,6 +151,124 @@ gint rspamd_mmaped_file_create (const gchar *filename, size_t size,
 gint rspamd_mmaped_file_close_file (rspamd_mempool_t *pool,
 		rspamd_mmaped_file_t * file);
 
+static gboolean
+rspamd_mmaped_file_want_grow (struct rspamd_statfile_config *stcf)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_lookup (stcf->opts, "auto_grow");
+
+	return elt != NULL && ucl_object_toboolean (elt);
+}
+
+static gboolean
+rspamd_mmaped_file_want_combined (struct rspamd_statfile_config *stcf)
+{
+	const ucl_object_t *elt;
+
+	elt = ucl_object_lookup (stcf->opts, "combined");
+
+	return elt != NULL && ucl_object_toboolean (elt);
+}
+
+static inline struct stat_file_combined_bucket *
+rspamd_mmaped_file_combined_bucket (rspamd_mmaped_file_t *file, guint64 n)
+{
+	return (struct stat_file_combined_bucket *)((u_char *)file->map +
+			file->seek_pos +
+			(n % file->cur_section.length) *
+			sizeof (struct stat_file_combined_bucket));
+}
+
+static inline guint32
+rspamd_mmaped_file_combined_tag (guint32 h2)
+{
+	/* Zero tag marks free slots */
+	return h2 ? h2 : 1;
+}
+
+/*
+ * Returns value of this statfile class for a token or NULL if it is absent
+ */
+static inline gfloat *
+rspamd_mmaped_file_combined_find (rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2)
+{
+	struct stat_file_combined_bucket *bucket;
+	guint32 tag = rspamd_mmaped_file_combined_tag (h2);
+	guint i, j;
+
+	for (i = 0; i < COMBINED_PROBE_BUCKETS; i ++) {
+		bucket = rspamd_mmaped_file_combined_bucket (file, (guint64)h1 + i);
+
+		for (j = 0; j < COMBINED_BUCKET_SLOTS; j ++) {
+			if (bucket->tags[j] == tag) {
+				return file->cf->is_spam ? &bucket->spam[j] : &bucket->ham[j];
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_mmaped_file_combined_set (rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2, gfloat value)
+{
+	struct stat_file_combined_bucket *bucket, *sel = NULL;
+	struct stat_file_header *header = (struct stat_file_header *)file->map;
+	rspamd_mempool_t *pool = file->pool;
+	guint32 tag = rspamd_mmaped_file_combined_tag (h2);
+	gfloat min = G_MAXFLOAT;
+	guint i, j, sel_slot = 0;
+	gboolean found_free = FALSE;
+
+	for (i = 0; i < COMBINED_PROBE_BUCKETS; i ++) {
+		bucket = rspamd_mmaped_file_combined_bucket (file, (guint64)h1 + i);
+
+		for (j = 0; j < COMBINED_BUCKET_SLOTS; j ++) {
+			if (bucket->tags[j] == tag) {
+				if (file->cf->is_spam) {
+					bucket->spam[j] = value;
+				}
+				else {
+					bucket->ham[j] = value;
+				}
+
+				return;
+			}
+
+			if (found_free) {
+				continue;
+			}
+
+			if (bucket->tags[j] == 0) {
+				found_free = TRUE;
+				sel = bucket;
+				sel_slot = j;
+			}
+			else if (bucket->spam[j] + bucket->ham[j] < min) {
+				/* Expire the least valuable token if there is no space */
+				min = bucket->spam[j] + bucket->ham[j];
+				sel = bucket;
+				sel_slot = j;
+			}
+		}
+	}
+
+	if (found_free) {
+		header->used_blocks ++;
+	}
+	else {
+		msg_debug_pool ("buckets for %ud are full in statfile %s, expire token",
+				h1, file->filename);
+	}
+
+	sel->tags[sel_slot] = tag;
+	sel->spam[sel_slot] = file->cf->is_spam ? value : 0;
+	sel->ham[sel_slot] = file->cf->is_spam ? 0 : value;
+}
+
 double
 rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
 	guint32 h1,
@@ -107,11 +277,18 @@ rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
 	struct stat_file_block *block;
 	guint i, blocknum;
 	u_char *c;
+	gfloat *pval;
 
 	if (!file->map) {
 		return 0;
 	}
 
+	if (file->combined) {
+		pval = rspamd_mmaped_file_combined_find (file, h1, h2);
+
+		return pval ? *pval : 0;
+	}
+
 	blocknum = h1 % file->cur_section.length;
 	c = (u_char *) file->map + file->seek_pos + blocknum *
 		sizeof (struct stat_file_block);
@@ -147,6 +324,11 @@ rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 		return;
 	}
 
+	if (file->combined) {
+		rspamd_mmaped_file_combined_set (file, h1, h2, value);
+		return;
+	}
+
 	blocknum = h1 % file->cur_section.length;
 	header = (struct stat_file_header *)file->map;
 	c = (u_char *) file->map + file->seek_pos + blocknum *
@@ -223,19 +405,44 @@ rspamd_mmaped_file_set_block (rspamd_mempool_t *pool,
 	rspamd_mmaped_file_set_block_common (pool, file, h1, h2, value);
 }
 
+/*
+ * Ham class of a combined statfile keeps its revision after section header
+ */
+static void
+rspamd_mmaped_file_revision_ptrs (rspamd_mmaped_file_t *file,
+		guint64 **prev, guint64 **ptime)
+{
+	struct stat_file_header *header;
+	struct stat_file_combined_info *info;
+
+	header = (struct stat_file_header *)file->map;
+
+	if (file->combined && !file->cf->is_spam) {
+		info = (struct stat_file_combined_info *)((u_char *)file->map +
+				sizeof (struct stat_file_header) +
+				sizeof (struct stat_file_section));
+		*prev = &info->ham_revision;
+		*ptime = &info->ham_rev_time;
+	}
+	else {
+		*prev = &header->revision;
+		*ptime = &header->rev_time;
+	}
+}
+
 gboolean
 rspamd_mmaped_file_set_revision (rspamd_mmaped_file_t *file, guint64 rev, time_t time)
 {
-	struct stat_file_header *header;
+	guint64 *prev, *ptime;
 
 	if (file == NULL || file->map == NULL) {
 		return FALSE;
 	}
 
-	header = (struct stat_file_header *)file->map;
+	rspamd_mmaped_file_revision_ptrs (file, &prev, &ptime);
 
-	header->revision = rev;
-	header->rev_time = time;
+	*prev = rev;
+	*ptime = time;
 
 	return TRUE;
 }
@@ -243,15 +450,15 @@ rspamd_mmaped_file_set_revision (rspamd_mmaped_file_t *file, guint64 rev, time_t
 gboolean
 rspamd_mmaped_file_inc_revision (rspamd_mmaped_file_t *file)
 {
-	struct stat_file_header *header;
+	guint64 *prev, *ptime;
 
 	if (file == NULL || file->map == NULL) {
 		return FALSE;
 	}
 
-	header = (struct stat_file_header *)file->map;
+	rspamd_mmaped_file_revision_ptrs (file, &prev, &ptime);
 
-	header->revision++;
+	(*prev)++;
 
 	return TRUE;
 }
@@ -259,15 +466,15 @@ rspamd_mmaped_file_inc_revision (rspamd_mmaped_file_t *file)
 gboolean
 rspamd_mmaped_file_dec_revision (rspamd_mmaped_file_t *file)
 {
-	struct stat_file_header *header;
+	guint64 *prev, *ptime;
 
 	if (file == NULL || file->map == NULL) {
 		return FALSE;
 	}
 
-	header = (struct stat_file_header *)file->map;
+	rspamd_mmaped_file_revision_ptrs (file, &prev, &ptime);
 
-	header->revision--;
+	(*prev)--;
 
 	return TRUE;
 }
@@ -276,19 +483,19 @@ rspamd_mmaped_file_dec_revision (rspamd_mmaped_file_t *file)
 gboolean
 rspamd_mmaped_file_get_revision (rspamd_mmaped_file_t *file, guint64 *rev, time_t *time)
 {
-	struct stat_file_header *header;
+	guint64 *prev, *ptime;
 
 	if (file == NULL || file->map == NULL) {
 		return FALSE;
 	}
 
-	header = (struct stat_file_header *)file->map;
+	rspamd_mmaped_file_revision_ptrs (file, &prev, &ptime);
 
 	if (rev != NULL) {
-		*rev = header->revision;
+		*rev = *prev;
 	}
 	if (time != NULL) {
-		*time = header->rev_time;
+		*time = *ptime;
 	}
 
 	return TRUE;
@@ -322,6 +529,10 @@ rspamd_mmaped_file_get_total (rspamd_mmaped_file_t *file)
 	/* If total blocks is 0 we have old version of header, so set total blocks correctly */
 	if (header->total_blocks == 0) {
 		header->total_blocks = file->cur_section.length;
+
+		if (file->combined) {
+			header->total_blocks *= COMBINED_BUCKET_SLOTS;
+		}
 	}
 
 	return header->total_blocks;
@@ -334,6 +545,8 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	struct stat_file *f;
 	gchar *c;
 	static gchar valid_version[] = RSPAMD_STATFILE_VERSION;
+	static gchar combined_version[] = RSPAMD_STATFILE_COMBINED_VERSION;
+	gsize elt_size = sizeof (struct stat_file_block);
 
 
 	if (!file || !file->map) {
@@ -360,6 +573,10 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	if (*c == 1 && *(c + 1) == 0) {
 		return -1;
 	}
+	else if (memcmp (c, combined_version, sizeof (combined_version)) == 0) {
+		file->combined = TRUE;
+		elt_size = sizeof (struct stat_file_combined_bucket);
+	}
 	else if (memcmp (c, valid_version, sizeof (valid_version)) != 0) {
 		/* Unknown version */
 		msg_info_pool ("file %s has invalid version %c.%c",
@@ -372,16 +589,29 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	/* Check first section and set new offset */
 	file->cur_section.code = f->section.code;
 	file->cur_section.length = f->section.length;
-	if (file->cur_section.length * sizeof (struct stat_file_block) >
+
+	if (file->combined && (f->section.code != STATFILE_SECTION_COMBINED ||
+			file->cur_section.length == 0)) {
+		msg_info_pool ("file %s has invalid combined section", file->filename);
+		return -1;
+	}
+
+	if (file->cur_section.length * elt_size >
 		file->len) {
 		msg_info_pool ("file %s is truncated: %z, must be %z",
 			file->filename,
 			file->len,
-			file->cur_section.length * sizeof (struct stat_file_block));
+			file->cur_section.length * elt_size);
 		return -1;
 	}
-	file->seek_pos = sizeof (struct stat_file) -
-		sizeof (struct stat_file_block);
+
+	if (file->combined) {
+		file->seek_pos = COMBINED_DATA_OFFSET;
+	}
+	else {
+		file->seek_pos = sizeof (struct stat_file) -
+			sizeof (struct stat_file_block);
+	}
 
 	return 0;
 }
@@ -532,29 +762,13 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 static void
 rspamd_mmaped_file_preload (rspamd_mmaped_file_t *file)
 {
-	guint8 *pos, *end;
-	volatile guint8 t;
-	gsize size;
-
-	pos = (guint8 *)file->map;
-	end = (guint8 *)file->map + file->len;
-
-	if (madvise (pos, end - pos, MADV_SEQUENTIAL) == -1) {
+	/*
+	 * Ask kernel to read pages in background instead of touching each page,
+	 * which blocks the event loop until the whole file is read
+	 */
+	if (madvise (file->map, file->len, MADV_WILLNEED) == -1) {
 		msg_info ("madvise failed: %s", strerror (errno));
 	}
-	else {
-		/* Load pages of file */
-#ifdef HAVE_GETPAGESIZE
-		size = getpagesize ();
-#else
-		size = sysconf (_SC_PAGESIZE);
-#endif
-		while (pos < end) {
-			t = *pos;
-			(void)t;
-			pos += size;
-		}
-	}
 }
 
 rspamd_mmaped_file_t *
@@ -586,11 +800,25 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 		return NULL;
 	}
 
+	if ((gsize)st.st_size > size && rspamd_mmaped_file_want_grow (stcf)) {
+		/* File has been grown online, keep it as is */
+		size = st.st_size;
+	}
+
 	if (labs ((glong)size - st.st_size) > (long)sizeof (struct stat_file) * 2
 		&& size > sizeof (struct stat_file)) {
-		msg_warn_pool ("need to reindex statfile old size: %Hz, new size: %Hz",
-			(size_t)st.st_size, size);
-		return rspamd_mmaped_file_reindex (pool, filename, st.st_size, size, stcf);
+		if (rspamd_mmaped_file_want_combined (stcf)) {
+			/* Both classes share this file, so it cannot be moved by one */
+			msg_warn_pool ("combined statfile %s has size %Hz instead of %Hz, "
+					"resizing is not supported", filename,
+					(size_t)st.st_size, size);
+		}
+		else {
+			msg_warn_pool ("need to reindex statfile old size: %Hz, new size: %Hz",
+				(size_t)st.st_size, size);
+			return rspamd_mmaped_file_reindex (pool, filename, st.st_size, size,
+					stcf);
+		}
 	}
 	else if (size < sizeof (struct stat_file)) {
 		msg_err_pool ("requested to shrink statfile to %Hz but it is too small",
@@ -693,8 +921,11 @@ rspamd_mmaped_file_create (const gchar *filename,
 	};
 	struct stat_file_block block = { 0, 0, 0 };
 	struct rspamd_stat_tokenizer *tokenizer;
+	static const gchar combined_version[] = RSPAMD_STATFILE_COMBINED_VERSION;
+	guchar combined_pad[COMBINED_DATA_OFFSET];
+	gboolean combined;
 	gint fd, lock_fd;
-	guint buflen = 0, nblocks;
+	guint buflen = 0, nblocks, nbuckets = 0;
 	gchar *buf = NULL, *lock;
 	struct stat sb;
 	gpointer tok_conf;
@@ -740,10 +971,25 @@ rspamd_mmaped_file_create (const gchar *filename,
 create:
 
 	msg_debug_pool ("create statfile %s of size %l", filename, (long)size);
-	nblocks =
-		(size - sizeof (struct stat_file_header) -
-		sizeof (struct stat_file_section)) / sizeof (struct stat_file_block);
-	header.total_blocks = nblocks;
+	combined = rspamd_mmaped_file_want_combined (stcf) &&
+			size > COMBINED_DATA_OFFSET;
+
+	if (combined) {
+		/* Buckets are written as zero blocks */
+		nbuckets = (size - COMBINED_DATA_OFFSET) /
+				sizeof (struct stat_file_combined_bucket);
+		nblocks = nbuckets * (sizeof (struct stat_file_combined_bucket) /
+				sizeof (struct stat_file_block));
+		header.total_blocks = nbuckets * COMBINED_BUCKET_SLOTS;
+		memcpy (header.version, combined_version, sizeof (header.version));
+		section.code = STATFILE_SECTION_COMBINED;
+	}
+	else {
+		nblocks =
+			(size - sizeof (struct stat_file_header) -
+			sizeof (struct stat_file_section)) / sizeof (struct stat_file_block);
+		header.total_blocks = nblocks;
+	}
 
 	if ((fd =
 		open (filename, O_RDWR | O_TRUNC | O_CREAT, S_IWUSR | S_IRUSR)) == -1) {
@@ -760,6 +1006,7 @@ create:
 
 	rspamd_fallocate (fd,
 		0,
+		combined ? COMBINED_DATA_OFFSET + sizeof (block) * nblocks :
 		sizeof (header) + sizeof (section) + sizeof (block) * nblocks);
 
 	header.create_time = (guint64) time (NULL);
@@ -785,7 +1032,7 @@ create:
 		return -1;
 	}
 
-	section.length = (guint64) nblocks;
+	section.length = combined ? (guint64) nbuckets : (guint64) nblocks;
 	if (write (fd, &section, sizeof (section)) == -1) {
 		msg_info_pool ("cannot write section header to file %s, error %d, %s",
 			filename,
@@ -799,6 +1046,25 @@ create:
 		return -1;
 	}
 
+	if (combined) {
+		/* Ham revision and padding up to the first bucket */
+		memset (combined_pad, 0, sizeof (combined_pad));
+
+		if (write (fd, combined_pad, COMBINED_DATA_OFFSET - sizeof (header) -
+				sizeof (section)) == -1) {
+			msg_info_pool ("cannot write combined header to file %s, error %d, %s",
+				filename,
+				errno,
+				strerror (errno));
+			close (fd);
+			unlink (lock);
+			close (lock_fd);
+			g_free (lock);
+
+			return -1;
+		}
+	}
+
 	/* Buffer for write 256 blocks at once */
 	if (nblocks > 256) {
 		buflen = sizeof (block) * 256;
@@ -922,9 +1188,184 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx,
 		mf = rspamd_mmaped_file_open (cfg->cfg_pool, filename, size, stf);
 	}
 
+	if (mf != NULL && rspamd_mmaped_file_want_grow (stf)) {
+		if (mf->combined) {
+			msg_warn_config ("statfile %s is combined, it cannot grow",
+					stf->symbol);
+		}
+		else {
+			mf->auto_grow = TRUE;
+			sizeo = ucl_object_lookup (stf->opts, "max_size");
+			mf->max_size = (sizeo && ucl_object_type (sizeo) == UCL_INT) ?
+					ucl_object_toint (sizeo) : size * 4;
+		}
+	}
+
 	return (gpointer)mf;
 }
 
+/*
+ * Moves mapping of `nf` to `mf` keeping the object used by stat runtime
+ */
+static void
+rspamd_mmaped_file_replace (rspamd_mmaped_file_t *mf, rspamd_mmaped_file_t *nf)
+{
+	munmap (mf->map, mf->len);
+	close (mf->fd);
+
+	mf->fd = nf->fd;
+	mf->map = nf->map;
+	mf->len = nf->len;
+	mf->seek_pos = nf->seek_pos;
+	mf->cur_section = nf->cur_section;
+	mf->combined = nf->combined;
+
+	g_slice_free1 (sizeof (*nf), nf);
+}
+
+static void
+rspamd_mmaped_file_reload (rspamd_mmaped_file_t *mf)
+{
+	rspamd_mmaped_file_t *nf;
+	rspamd_mempool_t *pool = mf->pool;
+	struct stat st;
+
+	if (stat (mf->filename, &st) == -1) {
+		return;
+	}
+
+	nf = rspamd_mmaped_file_open (pool, mf->filename, st.st_size, mf->cf);
+
+	if (nf != NULL) {
+		msg_info_pool ("statfile %s has been grown to %Hz, reloaded",
+				mf->filename, nf->len);
+		rspamd_mmaped_file_replace (mf, nf);
+	}
+}
+
+static void
+rspamd_mmaped_file_grow_abort (rspamd_mmaped_file_t *mf)
+{
+	gchar *newname;
+
+	if (mf->grow) {
+		newname = g_strconcat (mf->filename, GROW_SUFFIX, NULL);
+		rspamd_mmaped_file_close_file (mf->pool, mf->grow);
+		unlink (newname);
+		g_free (newname);
+		mf->grow = NULL;
+	}
+}
+
+static void
+rspamd_mmaped_file_grow_start (rspamd_mmaped_file_t *mf)
+{
+	rspamd_mempool_t *pool = mf->pool;
+	gchar *newname;
+	gsize newsize;
+	struct stat st;
+
+	newsize = MIN (mf->len * 2, mf->max_size);
+
+	if (newsize <= mf->len) {
+		return;
+	}
+
+	newname = g_strconcat (mf->filename, GROW_SUFFIX, NULL);
+
+	if (stat (newname, &st) != -1) {
+		/* Another process grows this statfile */
+		msg_info_pool ("%s already exists, do not grow statfile", newname);
+		g_free (newname);
+
+		return;
+	}
+
+	if (rspamd_mmaped_file_create (newname, newsize, mf->cf, pool) != 0) {
+		g_free (newname);
+
+		return;
+	}
+
+	mf->grow = rspamd_mmaped_file_open (pool, newname, newsize, mf->cf);
+
+	if (mf->grow == NULL) {
+		unlink (newname);
+	}
+	else {
+		mf->migrate_pos = 0;
+		msg_info_pool ("statfile %s is almost full, start growing it to %Hz",
+				mf->filename, newsize);
+	}
+
+	g_free (newname);
+}
+
+static void
+rspamd_mmaped_file_grow_finish (rspamd_mmaped_file_t *mf)
+{
+	rspamd_mempool_t *pool = mf->pool;
+	rspamd_mmaped_file_t *nf = mf->grow;
+	struct stat_file_header *header, *nh;
+	gchar *newname;
+
+	header = (struct stat_file_header *)mf->map;
+	nh = (struct stat_file_header *)nf->map;
+	rspamd_mmaped_file_set_revision (nf, header->revision, header->rev_time);
+	memcpy (nh->unused, header->unused, sizeof (header->unused));
+	nh->tokenizer_conf_len = header->tokenizer_conf_len;
+	msync (nf->map, nf->len, MS_SYNC);
+
+	newname = g_strconcat (mf->filename, GROW_SUFFIX, NULL);
+
+	if (rename (newname, mf->filename) == -1) {
+		msg_err_pool ("cannot rename %s to %s: %s", newname, mf->filename,
+				strerror (errno));
+		g_free (newname);
+		rspamd_mmaped_file_grow_abort (mf);
+
+		return;
+	}
+
+	g_free (newname);
+	/* Readers reopen the file once they see this flag */
+	header->padding[0] |= STATFILE_FLAG_SUPERSEDED;
+	msync (mf->map, mf->len, MS_ASYNC);
+
+	mf->grow = NULL;
+	msg_info_pool ("statfile %s has been grown to %Hz", mf->filename, nf->len);
+	rspamd_mmaped_file_replace (mf, nf);
+}
+
+/*
+ * Copies the next portion of blocks to the grown file, learns are
+ * written to both files meanwhile
+ */
+static void
+rspamd_mmaped_file_grow_step (rspamd_mmaped_file_t *mf)
+{
+	struct stat_file_block *block;
+	guint64 i, end;
+
+	end = MIN (mf->migrate_pos + GROW_MIGRATE_STEP, mf->cur_section.length);
+
+	for (i = mf->migrate_pos; i < end; i ++) {
+		block = (struct stat_file_block *)((u_char *)mf->map + mf->seek_pos +
+				i * sizeof (struct stat_file_block));
+
+		if (block->hash1 != 0 && block->value != 0) {
+			rspamd_mmaped_file_set_block_common (mf->pool, mf->grow,
+					block->hash1, block->hash2, block->value);
+		}
+	}
+
+	mf->migrate_pos = end;
+
+	if (end == mf->cur_section.length) {
+		rspamd_mmaped_file_grow_finish (mf);
+	}
+}
+
 void
 rspamd_mmaped_file_close (gpointer p)
 {
@@ -932,6 +1373,7 @@ rspamd_mmaped_file_close (gpointer p)
 
 
 	if (mf) {
+		rspamd_mmaped_file_grow_abort (mf);
 		rspamd_mmaped_file_close_file (mf->pool, mf);
 	}
 
@@ -944,28 +1386,61 @@ rspamd_mmaped_file_runtime (struct rspamd_task *task,
 		gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
+	struct stat_file_header *header;
+
+	if (mf != NULL && mf->map != NULL && mf->grow == NULL) {
+		header = (struct stat_file_header *)mf->map;
+
+		if (header->padding[0] & STATFILE_FLAG_SUPERSEDED) {
+			rspamd_mmaped_file_reload (mf);
+		}
+	}
 
 	return (gpointer)mf;
 }
 
 gboolean
-rspamd_mmaped_file_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_mmaped_file_process_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
 		gint id,
 		gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
 	guint32 h1, h2;
-	rspamd_token_t *tok;
+	gfloat *values, *pval;
 	guint i;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
-	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
-		memcpy (&h1, tok->data, sizeof (h1));
-		memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
-		tok->values[id] = rspamd_mmaped_file_get_block (mf, h1, h2);
+	values = RSPAMD_TOKEN_VALUES (tokens, id);
+
+	if (mf->combined && mf->map) {
+		/* Issue loads of buckets for the next tokens while checking this one */
+		for (i = 0; i < MIN (tokens->len, COMBINED_PREFETCH_DISTANCE); i++) {
+			memcpy (&h1, &tokens->hashes[i], sizeof (h1));
+			STAT_PREFETCH (rspamd_mmaped_file_combined_bucket (mf, h1));
+		}
+
+		for (i = 0; i < tokens->len; i++) {
+			if (i + COMBINED_PREFETCH_DISTANCE < tokens->len) {
+				memcpy (&h1, &tokens->hashes[i + COMBINED_PREFETCH_DISTANCE],
+						sizeof (h1));
+				STAT_PREFETCH (rspamd_mmaped_file_combined_bucket (mf, h1));
+			}
+
+			memcpy (&h1, &tokens->hashes[i], sizeof (h1));
+			memcpy (&h2, (guchar *)&tokens->hashes[i] + sizeof (h1), sizeof (h2));
+			pval = rspamd_mmaped_file_combined_find (mf, h1, h2);
+			values[i] = pval ? *pval : 0;
+		}
+	}
+	else {
+		for (i = 0; i < tokens->len; i++) {
+			memcpy (&h1, &tokens->hashes[i], sizeof (h1));
+			memcpy (&h2, (guchar *)&tokens->hashes[i] + sizeof (h1), sizeof (h2));
+			values[i] = rspamd_mmaped_file_get_block (mf, h1, h2);
+		}
 	}
 
 	if (mf->cf->is_spam) {
@@ -979,24 +1454,31 @@ rspamd_mmaped_file_process_tokens (struct rspamd_task *task, GPtrArray *tokens,
 }
 
 gboolean
-rspamd_mmaped_file_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_mmaped_file_learn_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
 		gint id,
 		gpointer p)
 {
 	rspamd_mmaped_file_t *mf = p;
 	guint32 h1, h2;
-	rspamd_token_t *tok;
+	gfloat *values;
 	guint i;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
+	values = RSPAMD_TOKEN_VALUES (tokens, id);
+
 	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
-		memcpy (&h1, tok->data, sizeof (h1));
-		memcpy (&h2, tok->data + sizeof (h1), sizeof (h2));
+		memcpy (&h1, &tokens->hashes[i], sizeof (h1));
+		memcpy (&h2, (guchar *)&tokens->hashes[i] + sizeof (h1), sizeof (h2));
 		rspamd_mmaped_file_set_block (task->task_pool, mf, h1, h2,
-				tok->values[id]);
+				values[i]);
+
+		if (mf->grow) {
+			rspamd_mmaped_file_set_block (task->task_pool, mf->grow, h1, h2,
+					values[i]);
+		}
 	}
 
 	return TRUE;
@@ -1073,6 +1555,8 @@ rspamd_mmaped_file_get_stat (gpointer runtime,
 				"symbol", 0, false);
 		ucl_object_insert_key (res, ucl_object_fromstring ("mmap"),
 				"type", 0, false);
+		ucl_object_insert_key (res, ucl_object_frombool (mf->combined),
+				"combined", 0, false);
 		ucl_object_insert_key (res, ucl_object_fromint (0),
 				"languages", 0, false);
 		ucl_object_insert_key (res, ucl_object_fromint (0),
@@ -1095,6 +1579,14 @@ rspamd_mmaped_file_finalize_learn (struct rspamd_task *task, gpointer runtime,
 
 	if (mf != NULL) {
 		msync (mf->map, mf->len, MS_INVALIDATE | MS_ASYNC);
+
+		if (mf->grow) {
+			rspamd_mmaped_file_grow_step (mf);
+		}
+		else if (mf->auto_grow && rspamd_mmaped_file_get_used (mf) >
+				rspamd_mmaped_file_get_total (mf) * GROW_FILL_RATIO) {
+			rspamd_mmaped_file_grow_start (mf);
+		}
 	}
 }
 
@@ -1120,3 +1612,135 @@ rspamd_mmaped_file_load_tokenizer_config (gpointer runtime,
 
 	return header->unused;
 }
+
+/* Read only view of a plain statfile used by offline tools */
+struct rspamd_mmaped_file_reader {
+	gpointer map;
+	gsize len;
+	const struct stat_file_block *blocks;
+	guint64 nblocks;
+	guint64 revision;
+};
+
+static GQuark
+rspamd_mmaped_file_quark (void)
+{
+	return g_quark_from_static_string ("mmaped-file");
+}
+
+struct rspamd_mmaped_file_reader *
+rspamd_mmaped_file_reader_open (const gchar *filename, GError **err)
+{
+	struct rspamd_mmaped_file_reader *r;
+	struct stat_file *f;
+	static gchar valid_version[] = RSPAMD_STATFILE_VERSION;
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	fd = open (filename, O_RDONLY);
+
+	if (fd == -1 || fstat (fd, &st) == -1) {
+		g_set_error (err, rspamd_mmaped_file_quark (), errno,
+				"cannot open %s: %s", filename, strerror (errno));
+
+		if (fd != -1) {
+			close (fd);
+		}
+
+		return NULL;
+	}
+
+	if ((gsize)st.st_size < sizeof (struct stat_file)) {
+		g_set_error (err, rspamd_mmaped_file_quark (), EINVAL,
+				"file %s is too short to be stat file", filename);
+		close (fd);
+
+		return NULL;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_mmaped_file_quark (), errno,
+				"cannot mmap %s: %s", filename, strerror (errno));
+
+		return NULL;
+	}
+
+	f = map;
+
+	if (memcmp (f->header.magic, "rsd", sizeof (f->header.magic)) != 0 ||
+			memcmp (f->header.version, valid_version,
+					sizeof (valid_version)) != 0 ||
+			f->section.code != STATFILE_SECTION_COMMON) {
+		/* Combined statfiles do not keep hash1, so tokens cannot be restored */
+		g_set_error (err, rspamd_mmaped_file_quark (), EINVAL,
+				"file %s is not a plain stat file", filename);
+		munmap (map, st.st_size);
+
+		return NULL;
+	}
+
+	if (f->section.length > (st.st_size - (sizeof (struct stat_file) -
+			sizeof (struct stat_file_block))) / sizeof (struct stat_file_block)) {
+		g_set_error (err, rspamd_mmaped_file_quark (), EINVAL,
+				"file %s is truncated", filename);
+		munmap (map, st.st_size);
+
+		return NULL;
+	}
+
+	r = g_malloc0 (sizeof (*r));
+	r->map = map;
+	r->len = st.st_size;
+	r->blocks = f->blocks;
+	r->nblocks = f->section.length;
+	r->revision = f->header.revision;
+
+	return r;
+}
+
+guint64
+rspamd_mmaped_file_reader_blocks (struct rspamd_mmaped_file_reader *r)
+{
+	return r->nblocks;
+}
+
+guint64
+rspamd_mmaped_file_reader_learns (struct rspamd_mmaped_file_reader *r)
+{
+	return r->revision;
+}
+
+gboolean
+rspamd_mmaped_file_reader_get (struct rspamd_mmaped_file_reader *r,
+		guint64 idx, guint64 *token, gdouble *value)
+{
+	const struct stat_file_block *block;
+
+	g_assert (idx < r->nblocks);
+	block = &r->blocks[idx];
+
+	if (block->hash1 == 0 || block->value == 0) {
+		return FALSE;
+	}
+
+	/* The same layout as tokens are split to blocks when learning */
+	memcpy (token, &block->hash1, sizeof (block->hash1));
+	memcpy ((guchar *)token + sizeof (block->hash1), &block->hash2,
+			sizeof (block->hash2));
+	*value = block->value;
+
+	return TRUE;
+}
+
+void
+rspamd_mmaped_file_reader_close (struct rspamd_mmaped_file_reader *r)
+{
+	if (r) {
+		munmap (r->map, r->len);
+		g_free (r);
+	}
+}
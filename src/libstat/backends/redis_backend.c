@@ -17,6 +17,7 @@
 #include "rspamd.h"
 #include "stat_internal.h"
 #include "upstream.h"
+#include "token_cache.h"
 #include "lua/lua_common.h"
 
 #ifdef WITH_HIREDIS
@@ -31,8 +32,23 @@
 #define REDIS_DEFAULT_PORT 6379
 #define REDIS_DEFAULT_OBJECT "%s%l"
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
+/* Hash tag keeps spam and ham deltas of a user on the same cluster node */
+#define REDIS_DEFAULT_USERS_PRIOR_OBJECT "%s%l{%r}"
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
+#define REDIS_DEFAULT_CACHE_TTL 60
+
+/*
+ * Applies all tokens increments and learns counter change in a single call
+ * KEYS[1]: statfile key, ARGV[1]: increment command, ARGV[2]: learns delta,
+ * ARGV[3..]: token and value pairs
+ */
+static const gchar *learn_script =
+		"local key, cmd = KEYS[1], ARGV[1]\n"
+		"for i = 3, #ARGV, 2 do\n"
+		"  redis.call(cmd, key, ARGV[i], ARGV[i + 1])\n"
+		"end\n"
+		"return redis.call('HINCRBY', key, 'learns', ARGV[2])\n";
 
 struct redis_stat_ctx {
 	struct rspamd_statfile_config *stcf;
@@ -44,7 +60,18 @@ struct redis_stat_ctx {
 	const gchar *dbname;
 	gdouble timeout;
 	gboolean enable_users;
+	gboolean users_prior;
+	gboolean cluster;
+	gboolean use_script;
 	gint cbref_user;
+	gchar learn_sha[41];
+	struct rspamd_stat_token_cache *cache;
+	struct rspamd_stat_async_elt *flush_elt;
+	guint cache_size;
+	guint cache_ttl;
+	gdouble flush_interval;
+	struct rspamd_redis_flush_cbdata *flush_inflight;
+	struct event_base *ev_base;
 };
 
 enum rspamd_redis_connection_state {
@@ -64,7 +91,15 @@ struct redis_stat_runtime {
 	struct rspamd_statfile_config *stcf;
 	gchar *redis_object_expanded;
 	redisAsyncContext *redis;
+	struct rspamd_stat_tokens *tokens;
+	guint *missed; /* tokens requested from redis when cache is used */
+	guint nmissed;
+	guint64 cache_object;
 	guint64 learned;
+	struct redis_stat_runtime *prior; /* global statistics for per user deltas */
+	struct redis_stat_runtime *parent;
+	gfloat *values; /* prior values, merged when both tiers are received */
+	guint tiers_pending;
 	gint id;
 	gboolean has_event;
 };
@@ -80,6 +115,26 @@ struct rspamd_redis_stat_elt {
 	struct rspamd_redis_stat_cbdata *cbdata;
 };
 
+/* Increments of a single object kept until the flush is confirmed */
+struct rspamd_redis_flushed_object {
+	gchar *object;
+	GArray *deltas;
+	gint64 learns;
+};
+
+/* Used to write coalesced increments */
+struct rspamd_redis_flush_cbdata {
+	struct redis_stat_ctx *ctx;
+	redisAsyncContext *redis;
+	redisContext *sync; /* used for the final flush on shutdown */
+	struct upstream *selected;
+	struct event timeout_ev;
+	GPtrArray *objects;
+	guint nobjects;
+	guint ncommands;
+	gboolean wanna_die;
+};
+
 struct rspamd_redis_stat_cbdata {
 	struct rspamd_redis_stat_elt *elt;
 	redisAsyncContext *redis;
@@ -335,14 +390,14 @@ rspamd_redis_maybe_auth (struct redis_stat_ctx *ctx, redisAsyncContext *redis)
 }
 
 static rspamd_fstring_t *
-rspamd_redis_tokens_to_query (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_redis_tokens_to_query (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens, const guint *sel, guint nsel,
 		const gchar *arg0, const gchar *arg1, gboolean learn, gint idx,
 		gboolean intvals)
 {
 	rspamd_fstring_t *out;
-	rspamd_token_t *tok;
 	gchar n0[64], n1[64];
-	guint i, l0, l1, larg0, larg1;
+	guint i, k, n, l0, l1, larg0, larg1;
 	guint64 num;
 
 	g_assert (tokens != NULL);
@@ -350,6 +405,8 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task, GPtrArray *tokens,
 	larg0 = strlen (arg0);
 	larg1 = strlen (arg1);
 	out = rspamd_fstring_sized_new (1024);
+	/* Either all tokens or only selected ones */
+	n = sel ? nsel : tokens->len;
 
 	if (!learn) {
 		rspamd_printf_fstring (&out, ""
@@ -358,14 +415,14 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task, GPtrArray *tokens,
 				"%s\r\n"
 				"$%d\r\n"
 				"%s\r\n",
-				(tokens->len + 2),
+				(n + 2),
 				larg0, arg0,
 				larg1, arg1);
 	}
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-		memcpy (&num, tok->data, sizeof (num));
+	for (i = 0; i < n; i ++) {
+		k = sel ? sel[i] : i;
+		num = tokens->hashes[k];
 
 		if (learn) {
 			rspamd_printf_fstring (&out, ""
@@ -381,11 +438,11 @@ rspamd_redis_tokens_to_query (struct rspamd_task *task, GPtrArray *tokens,
 
 			if (intvals) {
 				l1 = rspamd_snprintf (n1, sizeof (n1), "%L",
-						(gint64)tok->values[idx]);
+						(gint64)RSPAMD_TOKEN_VALUES (tokens, idx)[k]);
 			}
 			else {
 				l1 = rspamd_snprintf (n1, sizeof (n1), "%f",
-						tok->values[idx]);
+						RSPAMD_TOKEN_VALUES (tokens, idx)[k]);
 			}
 
 			rspamd_printf_fstring (&out, ""
@@ -683,6 +740,312 @@ rspamd_redis_async_stat_fin (struct rspamd_stat_async_elt *elt, gpointer d)
 	rspamd_redis_async_cbdata_cleanup (redis_elt->cbdata);
 }
 
+static void
+rspamd_redis_flushed_object_free (gpointer p)
+{
+	struct rspamd_redis_flushed_object *fobj = p;
+
+	g_array_free (fobj->deltas, TRUE);
+	g_free (fobj->object);
+	g_slice_free1 (sizeof (*fobj), fobj);
+}
+
+/* If increments have not been written, then they are queued for the next flush */
+static void
+rspamd_redis_flush_cleanup (struct rspamd_redis_flush_cbdata *cbdata,
+		gboolean requeue)
+{
+	struct rspamd_redis_flushed_object *fobj;
+	guint i;
+
+	if (!cbdata->wanna_die) {
+		/* Avoid double frees as pending callbacks are called on free */
+		cbdata->wanna_die = TRUE;
+		event_del (&cbdata->timeout_ev);
+		redisAsyncFree (cbdata->redis);
+
+		if (requeue) {
+			for (i = 0; i < cbdata->objects->len; i ++) {
+				fobj = g_ptr_array_index (cbdata->objects, i);
+				rspamd_stat_token_cache_requeue (cbdata->ctx->cache,
+						fobj->object, fobj->deltas, fobj->learns);
+			}
+		}
+
+		if (cbdata->ctx->flush_inflight == cbdata) {
+			cbdata->ctx->flush_inflight = NULL;
+		}
+
+		g_ptr_array_free (cbdata->objects, TRUE);
+		g_slice_free1 (sizeof (*cbdata), cbdata);
+	}
+}
+
+static void
+rspamd_redis_flush_done (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_flush_cbdata *cbdata = priv;
+
+	if (cbdata->wanna_die) {
+		return;
+	}
+
+	if (c->err == 0 && r != NULL) {
+		msg_debug ("flushed pending tokens of %ud objects for %s",
+				cbdata->nobjects, cbdata->ctx->stcf->symbol);
+		rspamd_upstream_ok (cbdata->selected);
+		rspamd_redis_flush_cleanup (cbdata, FALSE);
+	}
+	else {
+		msg_err ("cannot flush pending tokens for %s: %s",
+				cbdata->ctx->stcf->symbol, c->errstr);
+		rspamd_upstream_fail (cbdata->selected);
+		rspamd_redis_flush_cleanup (cbdata, TRUE);
+	}
+}
+
+static void
+rspamd_redis_flush_timeout (gint fd, short what, gpointer d)
+{
+	struct rspamd_redis_flush_cbdata *cbdata = d;
+
+	msg_err ("timeout while flushing pending tokens for %s to %s",
+			cbdata->ctx->stcf->symbol, rspamd_upstream_name (cbdata->selected));
+	rspamd_upstream_fail (cbdata->selected);
+	rspamd_redis_flush_cleanup (cbdata, TRUE);
+}
+
+/* Pipelines command to either async or sync connection */
+static void
+rspamd_redis_flush_command (struct rspamd_redis_flush_cbdata *cbdata,
+		const gchar *fmt, ...)
+{
+	va_list ap;
+	gchar *cmd;
+	gint len;
+
+	va_start (ap, fmt);
+	len = redisvFormatCommand (&cmd, fmt, ap);
+	va_end (ap);
+
+	if (len < 0) {
+		return;
+	}
+
+	if (cbdata->sync) {
+		redisAppendFormattedCommand (cbdata->sync, cmd, len);
+	}
+	else {
+		redisAsyncFormattedCommand (cbdata->redis, NULL, NULL, cmd, len);
+	}
+
+	redisFreeCommand (cmd);
+	cbdata->ncommands ++;
+}
+
+static void
+rspamd_redis_flush_object (const gchar *object, GArray *deltas, gint64 learns,
+		gpointer ud)
+{
+	struct rspamd_redis_flush_cbdata *cbdata = ud;
+	struct redis_stat_ctx *ctx = cbdata->ctx;
+	struct rspamd_redis_flushed_object *fobj;
+	struct rspamd_stat_token_delta *d;
+	const gchar *redis_cmd;
+	gchar n0[64], n1[64];
+	gboolean intvals;
+	guint i;
+
+	if (cbdata->objects) {
+		fobj = g_slice_alloc (sizeof (*fobj));
+		fobj->object = g_strdup (object);
+		fobj->deltas = g_array_sized_new (FALSE, FALSE, sizeof (*d),
+				deltas->len);
+		g_array_append_vals (fobj->deltas, deltas->data, deltas->len);
+		fobj->learns = learns;
+		g_ptr_array_add (cbdata->objects, fobj);
+	}
+
+	intvals = ctx->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER;
+	redis_cmd = intvals ? "HINCRBY" : "HINCRBYFLOAT";
+	rspamd_redis_flush_command (cbdata, "SADD %s_keys %s",
+			ctx->stcf->symbol, object);
+
+	for (i = 0; i < deltas->len; i ++) {
+		d = &g_array_index (deltas, struct rspamd_stat_token_delta, i);
+		rspamd_snprintf (n0, sizeof (n0), "%uL", d->token);
+
+		if (intvals) {
+			rspamd_snprintf (n1, sizeof (n1), "%L", (gint64)d->delta);
+		}
+		else {
+			rspamd_snprintf (n1, sizeof (n1), "%f", d->delta);
+		}
+
+		rspamd_redis_flush_command (cbdata, "%s %s %s %s",
+				redis_cmd, object, n0, n1);
+	}
+
+	if (learns != 0) {
+		rspamd_snprintf (n1, sizeof (n1), "%L", learns);
+		rspamd_redis_flush_command (cbdata, "HINCRBY %s learns %s",
+				object, n1);
+	}
+
+	cbdata->nobjects ++;
+}
+
+/* Writes increments coalesced since the previous call */
+static void
+rspamd_redis_async_flush_cb (struct rspamd_stat_async_elt *elt, gpointer d)
+{
+	struct redis_stat_ctx *ctx = d;
+	struct rspamd_redis_flush_cbdata *cbdata;
+	rspamd_inet_addr_t *addr;
+	struct timeval tv;
+
+	if (rspamd_stat_token_cache_pending (ctx->cache) == 0 ||
+			ctx->flush_inflight != NULL) {
+		/* Previous flush has not finished yet */
+		return;
+	}
+
+	cbdata = g_slice_alloc0 (sizeof (*cbdata));
+	cbdata->ctx = ctx;
+	cbdata->selected = rspamd_upstream_get (ctx->write_servers,
+			RSPAMD_UPSTREAM_MASTER_SLAVE,
+			NULL,
+			0);
+
+	if (cbdata->selected == NULL) {
+		/* Keep increments until some server is available */
+		g_slice_free1 (sizeof (*cbdata), cbdata);
+
+		return;
+	}
+
+	addr = rspamd_upstream_addr (cbdata->selected);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		cbdata->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		cbdata->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	if (cbdata->redis == NULL) {
+		g_slice_free1 (sizeof (*cbdata), cbdata);
+
+		return;
+	}
+
+	redisLibeventAttach (cbdata->redis, ctx->ev_base);
+	rspamd_redis_maybe_auth (ctx, cbdata->redis);
+
+	cbdata->objects = g_ptr_array_new_with_free_func (
+			rspamd_redis_flushed_object_free);
+	ctx->flush_inflight = cbdata;
+	rspamd_stat_token_cache_flush (ctx->cache, rspamd_redis_flush_object,
+			cbdata);
+	/* Commands are pipelined, so the last reply means that all are done */
+	redisAsyncCommand (cbdata->redis, rspamd_redis_flush_done, cbdata, "PING");
+	event_set (&cbdata->timeout_ev, -1, EV_TIMEOUT, rspamd_redis_flush_timeout,
+			cbdata);
+	event_base_set (ctx->ev_base, &cbdata->timeout_ev);
+	/* The whole batch should be written before the next flush */
+	double_to_tv (ctx->flush_interval, &tv);
+	event_add (&cbdata->timeout_ev, &tv);
+}
+
+/* Writes the remaining increments on shutdown, when event loop is stopped */
+static void
+rspamd_redis_flush_sync (struct redis_stat_ctx *ctx)
+{
+	struct rspamd_redis_flush_cbdata cbdata;
+	rspamd_inet_addr_t *addr;
+	redisReply *reply;
+	struct timeval tv;
+	guint i;
+
+	if (ctx->flush_inflight) {
+		/* Not confirmed, so it is safer to write these increments again */
+		rspamd_redis_flush_cleanup (ctx->flush_inflight, TRUE);
+	}
+
+	if (rspamd_stat_token_cache_pending (ctx->cache) == 0) {
+		return;
+	}
+
+	memset (&cbdata, 0, sizeof (cbdata));
+	cbdata.ctx = ctx;
+	cbdata.selected = rspamd_upstream_get (ctx->write_servers,
+			RSPAMD_UPSTREAM_MASTER_SLAVE,
+			NULL,
+			0);
+
+	if (cbdata.selected == NULL) {
+		msg_err ("no servers to flush pending tokens for %s",
+				ctx->stcf->symbol);
+		return;
+	}
+
+	addr = rspamd_upstream_addr (cbdata.selected);
+	double_to_tv (ctx->timeout, &tv);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		cbdata.sync = redisConnectUnixWithTimeout (
+				rspamd_inet_address_to_string (addr), tv);
+	}
+	else {
+		cbdata.sync = redisConnectWithTimeout (
+				rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr), tv);
+	}
+
+	if (cbdata.sync == NULL || cbdata.sync->err) {
+		msg_err ("cannot connect to %s to flush pending tokens for %s: %s",
+				rspamd_upstream_name (cbdata.selected), ctx->stcf->symbol,
+				cbdata.sync ? cbdata.sync->errstr : "no memory");
+
+		if (cbdata.sync) {
+			redisFree (cbdata.sync);
+		}
+
+		return;
+	}
+
+	redisSetTimeout (cbdata.sync, tv);
+
+	if (ctx->password) {
+		rspamd_redis_flush_command (&cbdata, "AUTH %s", ctx->password);
+	}
+	if (ctx->dbname) {
+		rspamd_redis_flush_command (&cbdata, "SELECT %s", ctx->dbname);
+	}
+
+	rspamd_stat_token_cache_flush (ctx->cache, rspamd_redis_flush_object,
+			&cbdata);
+
+	for (i = 0; i < cbdata.ncommands; i ++) {
+		if (redisGetReply (cbdata.sync, (void **)&reply) != REDIS_OK) {
+			msg_err ("cannot flush pending tokens for %s: %s",
+					ctx->stcf->symbol, cbdata.sync->errstr);
+			break;
+		}
+
+		freeReplyObject (reply);
+	}
+
+	if (i == cbdata.ncommands) {
+		msg_info ("flushed pending tokens of %ud objects for %s on shutdown",
+				cbdata.nobjects, ctx->stcf->symbol);
+	}
+
+	redisFree (cbdata.sync);
+}
+
 /* Called on connection termination */
 static void
 rspamd_redis_fin (gpointer data)
@@ -746,6 +1109,124 @@ rspamd_redis_timeout (gint fd, short what, gpointer d)
 	}
 }
 
+/* Connects to the upstream or to the cluster node serving the statfile key */
+static redisAsyncContext *
+rspamd_redis_stat_connect (struct redis_stat_runtime *rt)
+{
+	struct rspamd_task *task = rt->task;
+	rspamd_inet_addr_t *addr;
+	redisAsyncContext *redis;
+	gchar seed[PATH_MAX];
+	const gchar *ip;
+	gint port;
+
+	addr = rspamd_upstream_addr (rt->selected);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		rspamd_strlcpy (seed, rspamd_inet_address_to_string (addr),
+				sizeof (seed));
+		ip = seed;
+		port = rspamd_inet_address_get_port (addr);
+
+		if (rt->ctx->cluster) {
+			rspamd_redis_pool_cluster_node (task->cfg->redis_pool,
+					rt->ctx->dbname, rt->ctx->password,
+					seed, port,
+					rt->redis_object_expanded,
+					strlen (rt->redis_object_expanded),
+					&ip, &port);
+		}
+
+		redis = redisAsyncConnect (ip, port);
+	}
+
+	if (redis == NULL) {
+		return NULL;
+	}
+
+	redisLibeventAttach (redis, task->ev_base);
+	rspamd_redis_maybe_auth (rt->ctx, redis);
+
+	return redis;
+}
+
+/* Learns slots owners from MOVED errors, so the next request is routed well */
+static void
+rspamd_redis_stat_maybe_moved (struct redis_stat_runtime *rt,
+		redisReply *reply)
+{
+	struct rspamd_task *task = rt->task;
+	rspamd_inet_addr_t *addr;
+	gchar seed[PATH_MAX];
+	const gchar *ip;
+	gint port;
+	gboolean ask;
+
+	if (!rt->ctx->cluster || reply->type != REDIS_REPLY_ERROR) {
+		return;
+	}
+
+	addr = rspamd_upstream_addr (rt->selected);
+	rspamd_strlcpy (seed, rspamd_inet_address_to_string (addr), sizeof (seed));
+
+	if (rspamd_redis_pool_cluster_redirect (task->cfg->redis_pool,
+			rt->ctx->dbname, rt->ctx->password,
+			seed, rspamd_inet_address_get_port (addr),
+			reply->str, &ip, &port, &ask)) {
+		msg_info_task ("redis cluster redirected %s to %s:%d",
+				rt->redis_object_expanded, ip, port);
+	}
+}
+
+/* Prior runtime stores values aside, as they are summed with user deltas */
+static gfloat *
+rspamd_redis_runtime_values (struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens)
+{
+	if (rt->parent) {
+		if (rt->values == NULL) {
+			rt->values = rspamd_mempool_alloc0 (rt->task->task_pool,
+					sizeof (*rt->values) * tokens->len);
+		}
+
+		return rt->values;
+	}
+
+	return RSPAMD_TOKEN_VALUES (tokens, rt->id);
+}
+
+/* Adds the global prior to user deltas once both are received */
+static void
+rspamd_redis_tier_done (struct redis_stat_runtime *rt)
+{
+	struct redis_stat_runtime *top = rt->parent ? rt->parent : rt;
+	struct rspamd_task *task = top->task;
+	gfloat *values;
+	guint i;
+
+	if (top->prior == NULL || top->tiers_pending == 0 ||
+			--top->tiers_pending > 0) {
+		return;
+	}
+
+	if (top->prior->values) {
+		values = RSPAMD_TOKEN_VALUES (task->tokens, top->id);
+
+		for (i = 0; i < task->tokens->len; i ++) {
+			values[i] += top->prior->values[i];
+		}
+	}
+
+	msg_debug_task ("merged %uL learns of %s with %uL learns of %s",
+			top->prior->learned, top->prior->redis_object_expanded,
+			top->learned, top->redis_object_expanded);
+	top->learned += top->prior->learned;
+}
+
 /* Called when we have connected to the redis server and got stats */
 static void
 rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
@@ -766,6 +1247,8 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 				rspamd_strtol (reply->str, reply->len, &val);
 			}
 			else {
+				rspamd_redis_stat_maybe_moved (rt, reply);
+
 				if (reply->type != REDIS_REPLY_NIL) {
 					msg_err_task ("bad learned type for %s: %s, nil expected",
 						rt->stcf->symbol,
@@ -793,6 +1276,11 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 		rspamd_upstream_fail (rt->selected);
 	}
 
+	if (rt->missed && rt->nmissed == 0 && rt->has_event) {
+		/* All tokens have been found in cache, so no HMGET is pending */
+		rspamd_redis_tier_done (rt);
+		rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
+	}
 }
 
 /* Called when we have received tokens values from redis */
@@ -802,41 +1290,51 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
 	redisReply *reply = r, *elt;
 	struct rspamd_task *task;
-	rspamd_token_t *tok;
-	guint i, processed = 0, found = 0;
+	gfloat *values;
+	guint i, k, nexpected, processed = 0, found = 0;
 	gulong val;
 	gdouble float_val;
 
 	task = rt->task;
+	nexpected = rt->missed ? rt->nmissed : task->tokens->len;
 
 	if (c->err == 0) {
 		if (r != NULL) {
 			if (reply->type == REDIS_REPLY_ARRAY) {
 
-				if (reply->elements == task->tokens->len) {
+				if (reply->elements == nexpected) {
+					values = rspamd_redis_runtime_values (rt, task->tokens);
+
 					for (i = 0; i < reply->elements; i ++) {
-						tok = g_ptr_array_index (task->tokens, i);
 						elt = reply->element[i];
+						k = rt->missed ? rt->missed[i] : i;
 
 						if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
-							tok->values[rt->id] = elt->integer;
+							values[k] = elt->integer;
 							found ++;
 						}
 						else if (elt->type == REDIS_REPLY_STRING) {
 							if (rt->stcf->clcf->flags &
 									RSPAMD_FLAG_CLASSIFIER_INTEGER) {
 								rspamd_strtoul (elt->str, elt->len, &val);
-								tok->values[rt->id] = val;
+								values[k] = val;
 							}
 							else {
 								float_val = strtod (elt->str, NULL);
-								tok->values[rt->id] = float_val;
+								values[k] = float_val;
 							}
 
 							found ++;
 						}
 						else {
-							tok->values[rt->id] = 0;
+							values[k] = 0;
+						}
+
+						if (rt->ctx->cache) {
+							/* Missing tokens are cached as well */
+							rspamd_stat_token_cache_insert (rt->ctx->cache,
+									rt->cache_object, task->tokens->hashes[k],
+									values[k], task->tv.tv_sec);
 						}
 
 						processed ++;
@@ -853,10 +1351,11 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 					msg_err_task_check ("got invalid length of reply vector from redis: "
 							"%d, expected: %d",
 							(gint)reply->elements,
-							(gint)task->tokens->len);
+							(gint)nexpected);
 				}
 			}
 			else {
+				rspamd_redis_stat_maybe_moved (rt, reply);
 				msg_err_task_check ("got invalid reply from redis: %s, array expected",
 						rspamd_redis_type_to_string (reply->type));
 			}
@@ -876,20 +1375,45 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 
 	if (rt->has_event) {
+		rspamd_redis_tier_done (rt);
 		rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
 	}
 }
 
 /* Called when we have set tokens during learning */
+static gboolean rspamd_redis_learn_script (struct redis_stat_runtime *rt);
+static void rspamd_redis_cache_learn (struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens);
+
 static void
 rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
+	redisReply *reply = r;
 	struct rspamd_task *task;
 
 	task = rt->task;
 
 	if (c->err == 0) {
+		if (reply != NULL && reply->type == REDIS_REPLY_ERROR) {
+			if (rt->ctx->use_script && rt->ctx->learn_sha[0] != '\0' &&
+					strncmp (reply->str, "NOSCRIPT",
+							sizeof ("NOSCRIPT") - 1) == 0) {
+				/* Scripts cache has been flushed, send script itself */
+				rt->ctx->learn_sha[0] = '\0';
+
+				if (rspamd_redis_learn_script (rt)) {
+					return;
+				}
+			}
+
+			msg_err_task_check ("error learning %s: %s",
+					rt->redis_object_expanded, reply->str);
+		}
+		else if (rt->ctx->cache && rt->tokens) {
+			rspamd_redis_cache_learn (rt, rt->tokens);
+		}
+
 		rspamd_upstream_ok (rt->selected);
 	}
 	else {
@@ -999,6 +1523,17 @@ rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 		else {
 			backend->enable_users = FALSE;
 		}
+
+		elt = ucl_object_lookup (obj, "per_user_prior");
+
+		if (elt && backend->enable_users) {
+			/* Users keys store only deltas over the global statistics */
+			backend->users_prior = ucl_object_toboolean (elt);
+
+			if (backend->users_prior) {
+				backend->redis_object = REDIS_DEFAULT_USERS_PRIOR_OBJECT;
+			}
+		}
 	}
 	else {
 		/* XXX: sanity check */
@@ -1029,6 +1564,46 @@ rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 		backend->dbname = NULL;
 	}
 
+	elt = ucl_object_lookup (obj, "cluster");
+	if (elt) {
+		backend->cluster = ucl_object_toboolean (elt);
+	}
+	else {
+		backend->cluster = FALSE;
+	}
+
+	elt = ucl_object_lookup (obj, "use_script");
+	if (elt) {
+		backend->use_script = ucl_object_toboolean (elt);
+	}
+	else {
+		backend->use_script = FALSE;
+	}
+
+	elt = ucl_object_lookup (obj, "cache_size");
+	if (elt) {
+		backend->cache_size = ucl_object_toint (elt);
+	}
+	else {
+		backend->cache_size = 0;
+	}
+
+	elt = ucl_object_lookup (obj, "cache_ttl");
+	if (elt) {
+		backend->cache_ttl = ucl_object_todouble (elt);
+	}
+	else {
+		backend->cache_ttl = REDIS_DEFAULT_CACHE_TTL;
+	}
+
+	elt = ucl_object_lookup (obj, "flush_interval");
+	if (elt) {
+		backend->flush_interval = ucl_object_todouble (elt);
+	}
+	else {
+		backend->flush_interval = 0;
+	}
+
 	return TRUE;
 }
 
@@ -1099,10 +1674,69 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 			st_elt,
 			REDIS_STAT_TIMEOUT);
 	st_elt->async = backend->stat_elt;
+	backend->ev_base = ctx->ev_base;
+
+	if (backend->cache_size > 0) {
+		backend->cache = rspamd_stat_token_cache_new (backend->cache_size,
+				backend->cache_ttl);
+
+		if (backend->flush_interval > 0 && backend->cluster) {
+			/* Flushes are sent to a single server */
+			msg_warn_config ("flush_interval for %s is not supported in "
+					"cluster mode, learn synchronously", stf->symbol);
+		}
+		else if (backend->flush_interval > 0 && backend->write_servers) {
+			backend->flush_elt = rspamd_stat_ctx_register_async (
+					rspamd_redis_async_flush_cb,
+					NULL,
+					backend,
+					backend->flush_interval);
+		}
+	}
+	else if (backend->flush_interval > 0) {
+		msg_warn_config ("flush_interval for %s requires cache_size to be set, "
+				"learn synchronously", stf->symbol);
+		backend->flush_interval = 0;
+	}
 
 	return (gpointer)backend;
 }
 
+/* Creates runtime that reads global statistics for a user runtime */
+static struct redis_stat_runtime *
+rspamd_redis_prior_runtime (struct redis_stat_runtime *parent,
+		gchar *prior_object)
+{
+	struct rspamd_task *task = parent->task;
+	struct redis_stat_runtime *rt;
+	struct upstream *up;
+
+	up = rspamd_upstream_get (parent->ctx->read_servers,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+
+	if (up == NULL) {
+		return NULL;
+	}
+
+	rt = rspamd_mempool_alloc0 (task->task_pool, sizeof (*rt));
+	rt->redis_object_expanded = prior_object;
+	rt->selected = up;
+	rt->task = task;
+	rt->ctx = parent->ctx;
+	rt->stcf = parent->stcf;
+	rt->parent = parent;
+	rt->redis = rspamd_redis_stat_connect (rt);
+
+	if (rt->redis == NULL) {
+		msg_err_task ("cannot connect redis to read %s", prior_object);
+		return NULL;
+	}
+
+	return rt;
+}
+
 gpointer
 rspamd_redis_runtime (struct rspamd_task *task,
 		struct rspamd_statfile_config *stcf,
@@ -1111,7 +1745,7 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	struct redis_stat_ctx *ctx = REDIS_CTX (c);
 	struct redis_stat_runtime *rt;
 	struct upstream *up;
-	rspamd_inet_addr_t *addr;
+	gchar *prior_object;
 
 	g_assert (ctx != NULL);
 	g_assert (stcf != NULL);
@@ -1147,25 +1781,26 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	rt->ctx = ctx;
 	rt->stcf = stcf;
 
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
+	if (ctx->users_prior) {
+		prior_object = rspamd_mempool_strconcat (task->task_pool,
+				stcf->symbol, stcf->label ? stcf->label : "", NULL);
 
-	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
-		rt->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
-	}
-	else {
-		rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-				rspamd_inet_address_get_port (addr));
+		if (rspamd_mempool_get_variable (task->task_pool, "stat_user") == NULL) {
+			/* No user, so use and learn the global statistics only */
+			rt->redis_object_expanded = prior_object;
+		}
+		else if (!learn) {
+			rt->prior = rspamd_redis_prior_runtime (rt, prior_object);
+		}
 	}
 
+	rt->redis = rspamd_redis_stat_connect (rt);
+
 	if (rt->redis == NULL) {
 		msg_err_task ("cannot connect redis");
 		return NULL;
 	}
 
-	redisLibeventAttach (rt->redis, task->ev_base);
-	rspamd_redis_maybe_auth (ctx, rt->redis);
-
 	return rt;
 }
 
@@ -1174,6 +1809,10 @@ rspamd_redis_close (gpointer p)
 {
 	struct redis_stat_ctx *ctx = REDIS_CTX (p);
 
+	if (ctx->flush_elt) {
+		rspamd_redis_flush_sync (ctx);
+	}
+
 	if (ctx->read_servers) {
 		rspamd_upstreams_destroy (ctx->read_servers);
 	}
@@ -1182,25 +1821,65 @@ rspamd_redis_close (gpointer p)
 		rspamd_upstreams_destroy (ctx->write_servers);
 	}
 
+	rspamd_stat_token_cache_destroy (ctx->cache);
 	g_slice_free1 (sizeof (*ctx), ctx);
 }
 
-gboolean
-rspamd_redis_process_tokens (struct rspamd_task *task,
-		GPtrArray *tokens,
-		gint id, gpointer p)
+/* Fills cached values and remembers tokens that should be requested */
+static void
+rspamd_redis_cache_lookup (struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens)
+{
+	struct rspamd_task *task = rt->task;
+	gfloat *values;
+	guint i;
+
+	values = rspamd_redis_runtime_values (rt, tokens);
+	rt->cache_object = rspamd_stat_token_cache_object (
+			rt->redis_object_expanded);
+	rt->missed = rspamd_mempool_alloc (task->task_pool,
+			sizeof (*rt->missed) * tokens->len);
+	rt->nmissed = 0;
+
+	for (i = 0; i < tokens->len; i ++) {
+		if (!rspamd_stat_token_cache_lookup (rt->ctx->cache, rt->cache_object,
+				tokens->hashes[i], task->tv.tv_sec, &values[i])) {
+			rt->missed[rt->nmissed ++] = i;
+		}
+	}
+
+	if (rt->nmissed == 0) {
+		if (rt->stcf->is_spam) {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+		}
+		else {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+		}
+	}
+
+	msg_debug_task ("found %ud of %ud tokens for %s in cache",
+			tokens->len - rt->nmissed, tokens->len, rt->redis_object_expanded);
+}
+
+static gboolean
+rspamd_redis_process_object (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
+		gint id, struct redis_stat_runtime *rt)
 {
-	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
 	rspamd_fstring_t *query;
 	struct timeval tv;
 	gint ret;
 
-	if (tokens == NULL || tokens->len == 0 || rt->redis == NULL) {
+	if (rt->redis == NULL) {
 		return FALSE;
 	}
 
 	rt->id = id;
 
+	if (rt->ctx->cache) {
+		rspamd_redis_cache_lookup (rt, tokens);
+	}
+
 	if (redisAsyncCommand (rt->redis, rspamd_redis_connected, rt, "HGET %s %s",
 			rt->redis_object_expanded, "learns") == REDIS_OK) {
 
@@ -1216,7 +1895,12 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 		double_to_tv (rt->ctx->timeout, &tv);
 		event_add (&rt->timeout_event, &tv);
 
+		if (rt->missed && rt->nmissed == 0) {
+			return TRUE;
+		}
+
 		query = rspamd_redis_tokens_to_query (task, tokens,
+				rt->missed, rt->nmissed,
 				"HMGET", rt->redis_object_expanded, FALSE, -1,
 				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
 		g_assert (query != NULL);
@@ -1237,6 +1921,31 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 	return FALSE;
 }
 
+gboolean
+rspamd_redis_process_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
+		gint id, gpointer p)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
+
+	if (tokens == NULL || tokens->len == 0) {
+		return FALSE;
+	}
+
+	if (rt->prior) {
+		/* User deltas are useful even if the global statistics is missing */
+		if (rspamd_redis_process_object (task, tokens, id, rt->prior)) {
+			rt->tiers_pending = 2;
+		}
+		else {
+			rspamd_redis_finalize_process (task, rt->prior, rt->ctx);
+			rt->prior = NULL;
+		}
+	}
+
+	return rspamd_redis_process_object (task, tokens, id, rt);
+}
+
 void
 rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 		gpointer ctx)
@@ -1244,6 +1953,10 @@ rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
 	redisAsyncContext *redis;
 
+	if (rt->prior) {
+		rspamd_redis_finalize_process (task, rt->prior, ctx);
+	}
+
 	if (event_get_base (&rt->timeout_event)) {
 		event_del (&rt->timeout_event);
 	}
@@ -1255,19 +1968,165 @@ rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 	}
 }
 
+static void
+rspamd_redis_learn_script_loaded (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct redis_stat_ctx *ctx = REDIS_CTX (priv);
+	redisReply *reply = r;
+
+	if (c->err == 0 && reply != NULL && reply->type == REDIS_REPLY_STRING &&
+			reply->len < sizeof (ctx->learn_sha)) {
+		rspamd_strlcpy (ctx->learn_sha, reply->str, sizeof (ctx->learn_sha));
+	}
+}
+
+static gboolean
+rspamd_redis_learn_script (struct redis_stat_runtime *rt)
+{
+	struct rspamd_task *task = rt->task;
+	rspamd_fstring_t *query;
+	gfloat *values;
+	const gchar *redis_cmd, *eval_cmd, *eval_arg, *delta;
+	gchar n0[64], n1[64];
+	guint i, l0, l1;
+	gboolean intvals;
+
+	intvals = rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER;
+	redis_cmd = intvals ? "HINCRBY" : "HINCRBYFLOAT";
+	values = RSPAMD_TOKEN_VALUES (rt->tokens, rt->id);
+	/* The same learn/unlearn detection as for commands pipeline */
+	delta = values[0] > 0 ? "1" : "-1";
+
+	if (rt->ctx->learn_sha[0] != '\0') {
+		eval_cmd = "EVALSHA";
+		eval_arg = rt->ctx->learn_sha;
+	}
+	else {
+		/* Load script for further learns within the same round trip */
+		redisAsyncCommand (rt->redis, rspamd_redis_learn_script_loaded, rt->ctx,
+				"SCRIPT LOAD %s", learn_script);
+		eval_cmd = "EVAL";
+		eval_arg = learn_script;
+	}
+
+	query = rspamd_fstring_sized_new (1024);
+	rspamd_printf_fstring (&query, ""
+			"*%d\r\n"
+			"$%d\r\n"
+			"%s\r\n"
+			"$%d\r\n"
+			"%s\r\n"
+			"$1\r\n"
+			"1\r\n"
+			"$%d\r\n"
+			"%s\r\n"
+			"$%d\r\n"
+			"%s\r\n"
+			"$%d\r\n"
+			"%s\r\n",
+			(gint)(rt->tokens->len * 2 + 6),
+			(gint)strlen (eval_cmd), eval_cmd,
+			(gint)strlen (eval_arg), eval_arg,
+			(gint)strlen (rt->redis_object_expanded),
+			rt->redis_object_expanded,
+			(gint)strlen (redis_cmd), redis_cmd,
+			(gint)strlen (delta), delta);
+
+	for (i = 0; i < rt->tokens->len; i ++) {
+		l0 = rspamd_snprintf (n0, sizeof (n0), "%uL", rt->tokens->hashes[i]);
+
+		if (intvals) {
+			l1 = rspamd_snprintf (n1, sizeof (n1), "%L",
+					(gint64)values[i]);
+		}
+		else {
+			l1 = rspamd_snprintf (n1, sizeof (n1), "%f",
+					values[i]);
+		}
+
+		rspamd_printf_fstring (&query, ""
+				"$%d\r\n"
+				"%s\r\n"
+				"$%d\r\n"
+				"%s\r\n", l0, n0, l1, n1);
+	}
+
+	rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
+
+	if (redisAsyncFormattedCommand (rt->redis, rspamd_redis_learned, rt,
+			query->str, query->len) != REDIS_OK) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Applies learned increments to the cached tokens values */
+static void
+rspamd_redis_cache_learn (struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens)
+{
+	gfloat *values;
+	guint64 object;
+	guint i;
+
+	values = RSPAMD_TOKEN_VALUES (tokens, rt->id);
+	object = rspamd_stat_token_cache_object (rt->redis_object_expanded);
+
+	for (i = 0; i < tokens->len; i ++) {
+		if (values[i] != 0) {
+			rspamd_stat_token_cache_update (rt->ctx->cache, object,
+					tokens->hashes[i], values[i]);
+		}
+	}
+}
+
+static void
+rspamd_redis_learn_deferred (struct redis_stat_runtime *rt,
+		struct rspamd_stat_tokens *tokens)
+{
+	struct rspamd_task *task = rt->task;
+	gfloat *values;
+	guint i;
+
+	values = RSPAMD_TOKEN_VALUES (tokens, rt->id);
+
+	for (i = 0; i < tokens->len; i ++) {
+		if (values[i] != 0) {
+			rspamd_stat_token_cache_add_pending (rt->ctx->cache,
+					rt->redis_object_expanded, tokens->hashes[i], values[i]);
+		}
+	}
+
+	/* The same learn/unlearn detection as for commands pipeline */
+	rspamd_stat_token_cache_add_learns (rt->ctx->cache,
+			rt->redis_object_expanded, values[0] > 0 ? 1 : -1);
+	msg_debug_task ("queued %ud tokens of %s to be written later",
+			tokens->len, rt->redis_object_expanded);
+}
+
 gboolean
-rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_redis_learn_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
 		gint id, gpointer p)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (p);
 	struct upstream *up;
-	rspamd_inet_addr_t *addr;
 	struct timeval tv;
 	rspamd_fstring_t *query;
 	const gchar *redis_cmd;
-	rspamd_token_t *tok;
 	gint ret;
 
+	if (rt->ctx->flush_elt && (task->flags & RSPAMD_TASK_FLAG_LEARN_AUTO)) {
+		/* Autolearn increments are coalesced and written later */
+		rt->id = id;
+		rspamd_redis_learn_deferred (rt, tokens);
+
+		return TRUE;
+	}
+
 	up = rspamd_upstream_get (rt->ctx->write_servers,
 			RSPAMD_UPSTREAM_MASTER_SLAVE,
 			NULL,
@@ -1279,22 +2138,10 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	}
 
 	rt->selected = up;
-
-	addr = rspamd_upstream_addr (up);
-	g_assert (addr != NULL);
-	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
-		rt->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
-	}
-	else {
-		rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
-				rspamd_inet_address_get_port (addr));
-	}
+	rt->redis = rspamd_redis_stat_connect (rt);
 
 	g_assert (rt->redis != NULL);
 
-	redisLibeventAttach (rt->redis, task->ev_base);
-	rspamd_redis_maybe_auth (rt->ctx, rt->redis);
-
 	/*
 	 * Add the current key to the set of learned keys
 	 */
@@ -1309,53 +2156,60 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	}
 
 	rt->id = id;
-	query = rspamd_redis_tokens_to_query (task, tokens,
-			redis_cmd, rt->redis_object_expanded, TRUE, id,
-			rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
-	g_assert (query != NULL);
-
-	/*
-	 * XXX:
-	 * Dirty hack: we get a token and check if it's value is -1 or 1, so
-	 * we could understand that we are learning or unlearning
-	 */
+	/* Cached values are updated when redis confirms the learn */
+	rt->tokens = tokens;
 
-	tok = g_ptr_array_index (task->tokens, 0);
-
-	if (tok->values[id] > 0) {
-		rspamd_printf_fstring (&query, ""
-				"*4\r\n"
-				"$7\r\n"
-				"HINCRBY\r\n"
-				"$%d\r\n"
-				"%s\r\n"
-				"$6\r\n"
-				"learns\r\n"
-				"$1\r\n"
-				"1\r\n",
-				(gint)strlen (rt->redis_object_expanded),
-				rt->redis_object_expanded);
+	if (rt->ctx->use_script) {
+		/* Tokens and learns counter are updated by a single script call */
+		ret = rspamd_redis_learn_script (rt) ? REDIS_OK : REDIS_ERR;
 	}
 	else {
-		rspamd_printf_fstring (&query, ""
-				"*4\r\n"
-				"$7\r\n"
-				"HINCRBY\r\n"
-				"$%d\r\n"
-				"%s\r\n"
-				"$6\r\n"
-				"learns\r\n"
-				"$2\r\n"
-				"-1\r\n",
-				(gint)strlen (rt->redis_object_expanded),
-				rt->redis_object_expanded);
-	}
+		query = rspamd_redis_tokens_to_query (task, tokens, NULL, 0,
+				redis_cmd, rt->redis_object_expanded, TRUE, id,
+				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
+		g_assert (query != NULL);
 
-	rspamd_mempool_add_destructor (task->task_pool,
-				(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
+		/*
+		 * XXX:
+		 * Dirty hack: we get a token and check if it's value is -1 or 1, so
+		 * we could understand that we are learning or unlearning
+		 */
+
+		if (RSPAMD_TOKEN_VALUES (tokens, id)[0] > 0) {
+			rspamd_printf_fstring (&query, ""
+					"*4\r\n"
+					"$7\r\n"
+					"HINCRBY\r\n"
+					"$%d\r\n"
+					"%s\r\n"
+					"$6\r\n"
+					"learns\r\n"
+					"$1\r\n"
+					"1\r\n",
+					(gint)strlen (rt->redis_object_expanded),
+					rt->redis_object_expanded);
+		}
+		else {
+			rspamd_printf_fstring (&query, ""
+					"*4\r\n"
+					"$7\r\n"
+					"HINCRBY\r\n"
+					"$%d\r\n"
+					"%s\r\n"
+					"$6\r\n"
+					"learns\r\n"
+					"$2\r\n"
+					"-1\r\n",
+					(gint)strlen (rt->redis_object_expanded),
+					rt->redis_object_expanded);
+		}
 
-	ret = redisAsyncFormattedCommand (rt->redis, rspamd_redis_learned, rt,
-			query->str, query->len);
+		rspamd_mempool_add_destructor (task->task_pool,
+					(rspamd_mempool_destruct_t)rspamd_fstring_free, query);
+
+		ret = redisAsyncFormattedCommand (rt->redis, rspamd_redis_learned, rt,
+				query->str, query->len);
+	}
 
 	if (ret == REDIS_OK) {
 		rspamd_session_add_event (task->s, rspamd_redis_fin_learn, rt,
@@ -1444,6 +2298,7 @@ rspamd_redis_get_stat (gpointer runtime,
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
 	struct rspamd_redis_stat_elt *st;
 	redisAsyncContext *redis;
+	ucl_object_t *res;
 
 	if (rt->ctx->stat_elt) {
 		st = rt->ctx->stat_elt->ud;
@@ -1455,6 +2310,13 @@ rspamd_redis_get_stat (gpointer runtime,
 		}
 
 		if (st->stat) {
+			if (rt->ctx->cache) {
+				res = ucl_object_copy (st->stat);
+				rspamd_stat_token_cache_stat (rt->ctx->cache, res);
+
+				return res;
+			}
+
 			return ucl_object_ref (st->stat);
 		}
 	}
@@ -25,6 +25,29 @@
 #define SQLITE3_BACKEND_TYPE "sqlite3"
 #define SQLITE3_SCHEMA_VERSION "1"
 #define SQLITE3_DEFAULT "default"
+#define SQLITE3_QUEUE_SUFFIX ".queue"
+#define SQLITE3_QUEUE_WORK_SUFFIX ".work"
+#define SQLITE3_QUEUE_DEFAULT_BATCH (1024 * 1024)
+#define SQLITE3_QUEUE_DEFAULT_INTERVAL 10.0
+
+enum rspamd_sqlite3_queue_op {
+	RSPAMD_SQLITE3_QUEUE_TOKEN = 0,
+	RSPAMD_SQLITE3_QUEUE_INC_LEARNS,
+	RSPAMD_SQLITE3_QUEUE_DEC_LEARNS,
+};
+
+/*
+ * Learn queue record: tokens carry increments, not absolute values, so
+ * learns queued by different processes could be merged by a single writer
+ */
+struct rspamd_sqlite3_queue_rec {
+	guint64 token;
+	gint64 user_id;
+	gint64 lang_id;
+	gint64 value;
+	guint32 op;
+	guint32 unused;
+};
 
 struct rspamd_stat_sqlite3_db {
 	sqlite3 *sqlite;
@@ -37,6 +60,11 @@ struct rspamd_stat_sqlite3_db {
 	gboolean enable_languages;
 	gint cbref_user;
 	gint cbref_language;
+	gchar *queue_fname;
+	gchar *queue_work_fname;
+	gsize queue_batch;
+	gdouble queue_interval;
+	gdouble last_apply;
 };
 
 struct rspamd_stat_sqlite3_rt {
@@ -45,6 +73,8 @@ struct rspamd_stat_sqlite3_rt {
 	struct rspamd_statfile_config *cf;
 	gint64 user_id;
 	gint64 lang_id;
+	struct rspamd_sqlite3_queue_rec *queued;
+	guint nqueued;
 };
 
 static const char *create_tables_sql =
@@ -84,6 +114,7 @@ enum rspamd_stat_sqlite3_stmt_idx {
 	RSPAMD_STAT_BACKEND_TRANSACTION_ROLLBACK,
 	RSPAMD_STAT_BACKEND_GET_TOKEN,
 	RSPAMD_STAT_BACKEND_SET_TOKEN,
+	RSPAMD_STAT_BACKEND_INC_TOKEN,
 	RSPAMD_STAT_BACKEND_INC_LEARNS,
 	RSPAMD_STAT_BACKEND_DEC_LEARNS,
 	RSPAMD_STAT_BACKEND_GET_LEARNS,
@@ -169,6 +200,16 @@ static struct rspamd_sqlite3_prstmt prepared_stmts[RSPAMD_STAT_BACKEND_MAX] =
 		.flags = 0,
 		.ret = ""
 	},
+	[RSPAMD_STAT_BACKEND_INC_TOKEN] = {
+		.idx = RSPAMD_STAT_BACKEND_INC_TOKEN,
+		.sql = "UPDATE tokens SET value=value + ?4, modified=strftime('%s','now') "
+				"WHERE token=?1 AND user=?2 AND language=?3;",
+		.stmt = NULL,
+		.args = "IIII",
+		.result = SQLITE_DONE,
+		.flags = 0,
+		.ret = ""
+	},
 	[RSPAMD_STAT_BACKEND_INC_LEARNS] = {
 		.idx = RSPAMD_STAT_BACKEND_INC_LEARNS,
 		.sql = "UPDATE languages SET learns=learns + 1 WHERE id=?1;"
@@ -418,6 +459,294 @@ rspamd_sqlite3_get_language (struct rspamd_stat_sqlite3_db *db,
 	return id;
 }
 
+static void
+rspamd_sqlite3_checkpoint (struct rspamd_stat_sqlite3_db *bk,
+		rspamd_mempool_t *pool)
+{
+#ifdef SQLITE_OPEN_WAL
+	gint wal_frames, wal_checkpointed, mode;
+
+#ifdef SQLITE_CHECKPOINT_TRUNCATE
+	mode = SQLITE_CHECKPOINT_TRUNCATE;
+#elif defined(SQLITE_CHECKPOINT_RESTART)
+	mode = SQLITE_CHECKPOINT_RESTART;
+#elif defined(SQLITE_CHECKPOINT_FULL)
+	mode = SQLITE_CHECKPOINT_FULL;
+#endif
+	/* Perform wal checkpoint (might be long) */
+	if (sqlite3_wal_checkpoint_v2 (bk->sqlite,
+			NULL,
+			mode,
+			&wal_frames,
+			&wal_checkpointed) != SQLITE_OK) {
+		msg_warn_pool ("cannot commit checkpoint: %s",
+				sqlite3_errmsg (bk->sqlite));
+	}
+#endif
+}
+
+/*
+ * Appends records to the learn queue and, if the queue is large or old
+ * enough (or `force` is set), moves it aside for the writer. Returns TRUE
+ * if a queue is waiting to be applied
+ */
+static gboolean
+rspamd_sqlite3_queue_push (struct rspamd_stat_sqlite3_db *bk,
+		rspamd_mempool_t *pool,
+		const struct rspamd_sqlite3_queue_rec *recs, guint nrecs,
+		gboolean force)
+{
+	struct stat fst, pst;
+	const guchar *p = (const guchar *)recs;
+	gsize remain = nrecs * sizeof (*recs);
+	gssize r;
+	gint fd, ntries = 0;
+	gboolean need_apply = FALSE;
+
+	for (;;) {
+		fd = open (bk->queue_fname, O_WRONLY | O_CREAT | O_APPEND, 00644);
+
+		if (fd == -1) {
+			msg_err_pool ("cannot open learn queue %s: %s", bk->queue_fname,
+					strerror (errno));
+
+			return FALSE;
+		}
+
+		if (!rspamd_file_lock (fd, FALSE)) {
+			close (fd);
+
+			return FALSE;
+		}
+
+		/* Writer might have moved the queue while we were waiting for lock */
+		if (fstat (fd, &fst) != -1 && stat (bk->queue_fname, &pst) != -1 &&
+				fst.st_ino == pst.st_ino && fst.st_dev == pst.st_dev) {
+			break;
+		}
+
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+
+		if (++ntries > 10) {
+			msg_err_pool ("cannot lock learn queue %s", bk->queue_fname);
+
+			return FALSE;
+		}
+	}
+
+	while (remain > 0) {
+		r = write (fd, p, remain);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			msg_err_pool ("cannot write learn queue %s: %s", bk->queue_fname,
+					strerror (errno));
+			/* Drop partial record, applier ignores incomplete tail anyway */
+			(void)ftruncate (fd, fst.st_size);
+			rspamd_file_unlock (fd, FALSE);
+			close (fd);
+
+			return FALSE;
+		}
+
+		p += r;
+		remain -= r;
+	}
+
+	fst.st_size += nrecs * sizeof (*recs);
+
+	if (fst.st_size > 0 && (force || fst.st_size >= bk->queue_batch ||
+			rspamd_get_calendar_ticks () - bk->last_apply >= bk->queue_interval)) {
+		if (link (bk->queue_fname, bk->queue_work_fname) == 0) {
+			unlink (bk->queue_fname);
+			need_apply = TRUE;
+		}
+		else if (errno == EEXIST) {
+			/* Either another writer is busy or it has died during apply */
+			need_apply = TRUE;
+		}
+		else {
+			msg_err_pool ("cannot rotate learn queue %s: %s", bk->queue_fname,
+					strerror (errno));
+		}
+	}
+
+	rspamd_file_unlock (fd, FALSE);
+	close (fd);
+
+	return need_apply;
+}
+
+static gboolean
+rspamd_sqlite3_queue_apply_rec (struct rspamd_stat_sqlite3_db *bk,
+		rspamd_mempool_t *pool,
+		const struct rspamd_sqlite3_queue_rec *rec)
+{
+	gint rc = SQLITE_OK;
+
+	switch (rec->op) {
+	case RSPAMD_SQLITE3_QUEUE_TOKEN:
+		if (rec->value == 0) {
+			break;
+		}
+
+		rc = rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_INC_TOKEN,
+				(gint64)rec->token, rec->user_id, rec->lang_id, rec->value);
+
+		if (rc == SQLITE_OK && sqlite3_changes (bk->sqlite) == 0 &&
+				rec->value > 0) {
+			rc = rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+					RSPAMD_STAT_BACKEND_SET_TOKEN,
+					(gint64)rec->token, rec->user_id, rec->lang_id, rec->value);
+		}
+		break;
+	case RSPAMD_SQLITE3_QUEUE_INC_LEARNS:
+		rc = rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_INC_LEARNS,
+				rec->lang_id, rec->user_id);
+		break;
+	case RSPAMD_SQLITE3_QUEUE_DEC_LEARNS:
+		rc = rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_DEC_LEARNS,
+				rec->lang_id, rec->user_id);
+		break;
+	default:
+		/* Skip garbage */
+		break;
+	}
+
+	return rc == SQLITE_OK;
+}
+
+/*
+ * Applies the rotated learn queue in a single transaction. Only one process
+ * could hold lock on the work file, so there is a single writer at a time
+ */
+static void
+rspamd_sqlite3_queue_apply (struct rspamd_stat_sqlite3_db *bk,
+		rspamd_mempool_t *pool)
+{
+	struct stat fst, pst;
+	const struct rspamd_sqlite3_queue_rec *recs;
+	gpointer map = NULL;
+	gsize nrecs, i;
+	gint fd, ret, ntries = 0;
+	const gint max_tries = 10;
+	struct timespec sleep_ts = {
+			.tv_sec = 0,
+			.tv_nsec = 1000000
+	};
+
+	fd = open (bk->queue_work_fname, O_RDONLY);
+
+	if (fd == -1) {
+		return;
+	}
+
+	if (!rspamd_file_lock (fd, TRUE)) {
+		/* Another writer is here */
+		close (fd);
+
+		return;
+	}
+
+	/* Check that it has not been applied while we were opening it */
+	if (fstat (fd, &fst) == -1 || stat (bk->queue_work_fname, &pst) == -1 ||
+			fst.st_ino != pst.st_ino || fst.st_dev != pst.st_dev) {
+		rspamd_file_unlock (fd, TRUE);
+		close (fd);
+
+		return;
+	}
+
+	nrecs = fst.st_size / sizeof (*recs);
+
+	if (nrecs > 0) {
+		map = mmap (NULL, fst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (map == MAP_FAILED) {
+			msg_err_pool ("cannot mmap learn queue %s: %s",
+					bk->queue_work_fname, strerror (errno));
+			rspamd_file_unlock (fd, TRUE);
+			close (fd);
+
+			return;
+		}
+
+		if (bk->in_transaction) {
+			rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+					RSPAMD_STAT_BACKEND_TRANSACTION_COMMIT);
+			bk->in_transaction = FALSE;
+		}
+
+		while ((ret = rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_TRANSACTION_START_IM)) == SQLITE_BUSY &&
+				++ntries <= max_tries) {
+			nanosleep (&sleep_ts, NULL);
+		}
+
+		if (ret != SQLITE_OK) {
+			/* Keep the queue for the next attempt */
+			msg_info_pool ("cannot start transaction to apply learn queue: "
+					"%d, %s", ret, sqlite3_errmsg (bk->sqlite));
+			munmap (map, fst.st_size);
+			rspamd_file_unlock (fd, TRUE);
+			close (fd);
+
+			return;
+		}
+
+		recs = map;
+
+		for (i = 0; i < nrecs; i ++) {
+			if (!rspamd_sqlite3_queue_apply_rec (bk, pool, &recs[i])) {
+				msg_err_pool ("cannot apply learn queue %s: %s",
+						bk->queue_work_fname, sqlite3_errmsg (bk->sqlite));
+				rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+						RSPAMD_STAT_BACKEND_TRANSACTION_ROLLBACK);
+				munmap (map, fst.st_size);
+				rspamd_file_unlock (fd, TRUE);
+				close (fd);
+
+				return;
+			}
+		}
+
+		if (rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_TRANSACTION_COMMIT) != SQLITE_OK) {
+			msg_err_pool ("cannot commit learn queue %s: %s",
+					bk->queue_work_fname, sqlite3_errmsg (bk->sqlite));
+			rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
+					RSPAMD_STAT_BACKEND_TRANSACTION_ROLLBACK);
+			munmap (map, fst.st_size);
+			rspamd_file_unlock (fd, TRUE);
+			close (fd);
+
+			return;
+		}
+
+		munmap (map, fst.st_size);
+	}
+
+	/* Unlink before unlocking, so nobody could apply it twice */
+	unlink (bk->queue_work_fname);
+	rspamd_file_unlock (fd, TRUE);
+	close (fd);
+
+	bk->last_apply = rspamd_get_calendar_ticks ();
+
+	if (nrecs > 0) {
+		msg_info_pool ("applied %z queued learn records to %s",
+				nrecs, bk->fname);
+		rspamd_sqlite3_checkpoint (bk, pool);
+	}
+}
+
 static struct rspamd_stat_sqlite3_db *
 rspamd_sqlite3_opendb (rspamd_mempool_t *pool,
 		struct rspamd_statfile_config *stcf,
@@ -520,7 +849,7 @@ rspamd_sqlite3_init (struct rspamd_stat_ctx *ctx,
 {
 	struct rspamd_classifier_config *clf = st->classifier->cfg;
 	struct rspamd_statfile_config *stf = st->stcf;
-	const ucl_object_t *filenameo, *lang_enabled, *users_enabled;
+	const ucl_object_t *filenameo, *lang_enabled, *users_enabled, *elt;
 	const gchar *filename, *lua_script;
 	struct rspamd_stat_sqlite3_db *bk;
 	GError *err = NULL;
@@ -624,6 +953,34 @@ rspamd_sqlite3_init (struct rspamd_stat_ctx *ctx,
 				stf->symbol);
 	}
 
+	elt = ucl_object_lookup (clf->opts, "learn_queue");
+
+	if (elt != NULL && ucl_object_toboolean (elt)) {
+		bk->queue_fname = g_strconcat (filename, SQLITE3_QUEUE_SUFFIX, NULL);
+		bk->queue_work_fname = g_strconcat (bk->queue_fname,
+				SQLITE3_QUEUE_WORK_SUFFIX, NULL);
+		bk->queue_batch = SQLITE3_QUEUE_DEFAULT_BATCH;
+		bk->queue_interval = SQLITE3_QUEUE_DEFAULT_INTERVAL;
+		bk->last_apply = rspamd_get_calendar_ticks ();
+
+		elt = ucl_object_lookup (clf->opts, "learn_queue_batch");
+
+		if (elt != NULL && ucl_object_toint (elt) > 0) {
+			bk->queue_batch = ucl_object_toint (elt);
+		}
+
+		elt = ucl_object_lookup (clf->opts, "learn_queue_interval");
+
+		if (elt != NULL && ucl_object_todouble (elt) >= 0) {
+			bk->queue_interval = ucl_object_todouble (elt);
+		}
+
+		/* Queued records are merged by a writer, so they must be increments */
+		stf->clcf->flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
+		msg_info_config ("enable learn queue %s for %s",
+				bk->queue_fname, stf->symbol);
+	}
+
 
 	return (gpointer) bk;
 }
@@ -637,6 +994,17 @@ rspamd_sqlite3_close (gpointer p)
 		if (bk->in_transaction) {
 			rspamd_sqlite3_run_prstmt (bk->pool, bk->sqlite, bk->prstmt,
 					RSPAMD_STAT_BACKEND_TRANSACTION_COMMIT);
+			bk->in_transaction = FALSE;
+		}
+
+		if (bk->queue_fname) {
+			/* Flush whatever is left in the queue */
+			if (rspamd_sqlite3_queue_push (bk, bk->pool, NULL, 0, TRUE)) {
+				rspamd_sqlite3_queue_apply (bk, bk->pool);
+			}
+
+			g_free (bk->queue_fname);
+			g_free (bk->queue_work_fname);
 		}
 
 		rspamd_sqlite3_close_prstmt (bk->sqlite, bk->prstmt);
@@ -660,6 +1028,8 @@ rspamd_sqlite3_runtime (struct rspamd_task *task,
 		rt->user_id = -1;
 		rt->lang_id = -1;
 		rt->cf = stcf;
+		rt->queued = NULL;
+		rt->nqueued = 0;
 	}
 
 	return rt;
@@ -667,26 +1037,25 @@ rspamd_sqlite3_runtime (struct rspamd_task *task,
 
 gboolean
 rspamd_sqlite3_process_tokens (struct rspamd_task *task,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		gint id, gpointer p)
 {
 	struct rspamd_stat_sqlite3_db *bk;
 	struct rspamd_stat_sqlite3_rt *rt = p;
 	gint64 iv = 0, idx;
 	guint i;
-	rspamd_token_t *tok;
+	gfloat *values;
 
 	g_assert (p != NULL);
 	g_assert (tokens != NULL);
 
 	bk = rt->db;
+	values = RSPAMD_TOKEN_VALUES (tokens, id);
 
 	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-
 		if (bk == NULL) {
 			/* Statfile is does not exist, so all values are zero */
-			tok->values[id] = 0.0;
+			values[i] = 0.0;
 			continue;
 		}
 
@@ -714,15 +1083,15 @@ rspamd_sqlite3_process_tokens (struct rspamd_task *task,
 			}
 		}
 
-		memcpy (&idx, tok->data, sizeof (idx));
+		idx = tokens->hashes[i];
 
 		if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
 				RSPAMD_STAT_BACKEND_GET_TOKEN,
 				idx, rt->user_id, rt->lang_id, &iv) == SQLITE_OK) {
-			tok->values[id] = iv;
+			values[i] = iv;
 		}
 		else {
-			tok->values[id] = 0.0;
+			values[i] = 0.0;
 		}
 
 		if (rt->cf->is_spam) {
@@ -760,22 +1129,23 @@ rspamd_sqlite3_finalize_process (struct rspamd_task *task, gpointer runtime,
 }
 
 gboolean
-rspamd_sqlite3_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
+rspamd_sqlite3_learn_tokens (struct rspamd_task *task,
+		struct rspamd_stat_tokens *tokens,
 		gint id, gpointer p)
 {
 	struct rspamd_stat_sqlite3_db *bk;
 	struct rspamd_stat_sqlite3_rt *rt = p;
 	gint64 iv = 0, idx;
 	guint i;
-	rspamd_token_t *tok;
+	gfloat *values;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
 	bk = rt->db;
+	values = RSPAMD_TOKEN_VALUES (tokens, id);
 
 	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
 		if (bk == NULL) {
 			/* Statfile is does not exist, so all values are zero */
 			return FALSE;
@@ -805,8 +1175,25 @@ rspamd_sqlite3_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 			}
 		}
 
-		iv = tok->values[id];
-		memcpy (&idx, tok->data, sizeof (idx));
+		iv = values[i];
+		idx = tokens->hashes[i];
+
+		if (bk->queue_fname) {
+			if (rt->queued == NULL) {
+				/* One more record for learns counter */
+				rt->queued = rspamd_mempool_alloc0 (task->task_pool,
+						(tokens->len + 1) * sizeof (*rt->queued));
+			}
+
+			rt->queued[rt->nqueued].op = RSPAMD_SQLITE3_QUEUE_TOKEN;
+			rt->queued[rt->nqueued].token = idx;
+			rt->queued[rt->nqueued].user_id = rt->user_id;
+			rt->queued[rt->nqueued].lang_id = rt->lang_id;
+			rt->queued[rt->nqueued].value = iv;
+			rt->nqueued ++;
+
+			continue;
+		}
 
 		if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
 				RSPAMD_STAT_BACKEND_SET_TOKEN,
@@ -828,7 +1215,6 @@ rspamd_sqlite3_finalize_learn (struct rspamd_task *task, gpointer runtime,
 {
 	struct rspamd_stat_sqlite3_rt *rt = runtime;
 	struct rspamd_stat_sqlite3_db *bk;
-	gint wal_frames, wal_checkpointed, mode;
 
 	g_assert (rt != NULL);
 	bk = rt->db;
@@ -839,24 +1225,19 @@ rspamd_sqlite3_finalize_learn (struct rspamd_task *task, gpointer runtime,
 		bk->in_transaction = FALSE;
 	}
 
-#ifdef SQLITE_OPEN_WAL
-#ifdef SQLITE_CHECKPOINT_TRUNCATE
-	mode = SQLITE_CHECKPOINT_TRUNCATE;
-#elif defined(SQLITE_CHECKPOINT_RESTART)
-	mode = SQLITE_CHECKPOINT_RESTART;
-#elif defined(SQLITE_CHECKPOINT_FULL)
-	mode = SQLITE_CHECKPOINT_FULL;
-#endif
-	/* Perform wal checkpoint (might be long) */
-	if (sqlite3_wal_checkpoint_v2 (bk->sqlite,
-			NULL,
-			mode,
-			&wal_frames,
-			&wal_checkpointed) != SQLITE_OK) {
-		msg_warn_task ("cannot commit checkpoint: %s",
-				sqlite3_errmsg (bk->sqlite));
+	if (bk->queue_fname) {
+		if (rspamd_sqlite3_queue_push (bk, task->task_pool, rt->queued,
+				rt->nqueued, FALSE)) {
+			rspamd_sqlite3_queue_apply (bk, task->task_pool);
+		}
+
+		rt->queued = NULL;
+		rt->nqueued = 0;
+
+		return;
 	}
-#endif
+
+	rspamd_sqlite3_checkpoint (bk, task->task_pool);
 }
 
 gulong
@@ -885,9 +1266,18 @@ rspamd_sqlite3_inc_learns (struct rspamd_task *task, gpointer runtime,
 
 	g_assert (rt != NULL);
 	bk = rt->db;
-	rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
-			RSPAMD_STAT_BACKEND_INC_LEARNS,
-			rt->lang_id, rt->user_id);
+
+	if (bk->queue_fname && rt->queued) {
+		rt->queued[rt->nqueued].op = RSPAMD_SQLITE3_QUEUE_INC_LEARNS;
+		rt->queued[rt->nqueued].user_id = rt->user_id;
+		rt->queued[rt->nqueued].lang_id = rt->lang_id;
+		rt->nqueued ++;
+	}
+	else {
+		rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_INC_LEARNS,
+				rt->lang_id, rt->user_id);
+	}
 
 	if (bk->in_transaction) {
 		rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
@@ -911,9 +1301,18 @@ rspamd_sqlite3_dec_learns (struct rspamd_task *task, gpointer runtime,
 
 	g_assert (rt != NULL);
 	bk = rt->db;
-	rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
-			RSPAMD_STAT_BACKEND_DEC_LEARNS,
-			rt->lang_id, rt->user_id);
+
+	if (bk->queue_fname && rt->queued) {
+		rt->queued[rt->nqueued].op = RSPAMD_SQLITE3_QUEUE_DEC_LEARNS;
+		rt->queued[rt->nqueued].user_id = rt->user_id;
+		rt->queued[rt->nqueued].lang_id = rt->lang_id;
+		rt->nqueued ++;
+	}
+	else {
+		rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_DEC_LEARNS,
+				rt->lang_id, rt->user_id);
+	}
 
 	if (bk->in_transaction) {
 		rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
@@ -0,0 +1,306 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "token_cache.h"
+#include "hash.h"
+#include "util.h"
+#include "cryptobox.h"
+
+struct rspamd_token_cache_key {
+	guint64 object;
+	guint64 token;
+};
+
+struct rspamd_token_cache_elt {
+	struct rspamd_token_cache_key key;
+	gfloat value;
+};
+
+/* Increments queued for a single statfile object */
+struct rspamd_token_cache_pending {
+	gchar *object;
+	guint64 object_hash;
+	GHashTable *deltas; /* guint64 token -> struct rspamd_stat_token_delta */
+	gint64 learns;
+};
+
+struct rspamd_stat_token_cache {
+	rspamd_lru_hash_t *values;
+	GHashTable *pending; /* object -> struct rspamd_token_cache_pending */
+	guint ttl;
+	guint64 hits;
+	guint64 misses;
+	guint64 flushed;
+};
+
+static guint
+rspamd_token_cache_hash (gconstpointer p)
+{
+	const struct rspamd_token_cache_key *k = p;
+
+	/* Tokens are already hashes, so just mix them with the object */
+	return (guint)(k->token ^ (k->token >> 32) ^ k->object);
+}
+
+static gboolean
+rspamd_token_cache_equal (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_token_cache_key *k1 = a, *k2 = b;
+
+	return k1->token == k2->token && k1->object == k2->object;
+}
+
+static void
+rspamd_token_cache_pending_dtor (gpointer p)
+{
+	struct rspamd_token_cache_pending *pending = p;
+
+	g_hash_table_unref (pending->deltas);
+	g_free (pending->object);
+	g_slice_free1 (sizeof (*pending), pending);
+}
+
+struct rspamd_stat_token_cache *
+rspamd_stat_token_cache_new (guint max_tokens, guint ttl)
+{
+	struct rspamd_stat_token_cache *cache;
+
+	g_assert (max_tokens > 0);
+
+	cache = g_slice_alloc0 (sizeof (*cache));
+	cache->values = rspamd_lru_hash_new_full (max_tokens, NULL, g_free,
+			rspamd_token_cache_hash, rspamd_token_cache_equal);
+	cache->pending = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+			rspamd_token_cache_pending_dtor);
+	cache->ttl = ttl;
+
+	return cache;
+}
+
+guint64
+rspamd_stat_token_cache_object (const gchar *object)
+{
+	return rspamd_cryptobox_fast_hash (object, strlen (object),
+			rspamd_hash_seed ());
+}
+
+gboolean
+rspamd_stat_token_cache_lookup (struct rspamd_stat_token_cache *cache,
+		guint64 object, guint64 token, time_t now, gfloat *value)
+{
+	struct rspamd_token_cache_key k;
+	struct rspamd_token_cache_elt *elt;
+
+	k.object = object;
+	k.token = token;
+	elt = rspamd_lru_hash_lookup (cache->values, &k, now);
+
+	if (elt) {
+		cache->hits ++;
+		*value = elt->value;
+
+		return TRUE;
+	}
+
+	cache->misses ++;
+
+	return FALSE;
+}
+
+void
+rspamd_stat_token_cache_insert (struct rspamd_stat_token_cache *cache,
+		guint64 object, guint64 token, gfloat value, time_t now)
+{
+	struct rspamd_token_cache_elt *elt;
+
+	elt = g_malloc (sizeof (*elt));
+	elt->key.object = object;
+	elt->key.token = token;
+	elt->value = value;
+	rspamd_lru_hash_insert (cache->values, &elt->key, elt, now, cache->ttl);
+}
+
+void
+rspamd_stat_token_cache_update (struct rspamd_stat_token_cache *cache,
+		guint64 object, guint64 token, gfloat delta)
+{
+	struct rspamd_token_cache_key k;
+	struct rspamd_token_cache_elt *elt;
+	rspamd_lru_element_t *node;
+
+	k.object = object;
+	k.token = token;
+	/* Do not touch usages and expiration on updates */
+	node = g_hash_table_lookup (rspamd_lru_hash_get_htable (cache->values), &k);
+
+	if (node) {
+		elt = node->data;
+		elt->value += delta;
+	}
+}
+
+static struct rspamd_token_cache_pending *
+rspamd_token_cache_get_pending (struct rspamd_stat_token_cache *cache,
+		const gchar *object)
+{
+	struct rspamd_token_cache_pending *pending;
+
+	pending = g_hash_table_lookup (cache->pending, object);
+
+	if (pending == NULL) {
+		pending = g_slice_alloc0 (sizeof (*pending));
+		pending->object = g_strdup (object);
+		pending->object_hash = rspamd_stat_token_cache_object (object);
+		pending->deltas = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+				NULL, g_free);
+		g_hash_table_insert (cache->pending, pending->object, pending);
+	}
+
+	return pending;
+}
+
+void
+rspamd_stat_token_cache_add_pending (struct rspamd_stat_token_cache *cache,
+		const gchar *object, guint64 token, gfloat delta)
+{
+	struct rspamd_token_cache_pending *pending;
+	struct rspamd_stat_token_delta *d;
+
+	pending = rspamd_token_cache_get_pending (cache, object);
+	d = g_hash_table_lookup (pending->deltas, &token);
+
+	if (d == NULL) {
+		d = g_malloc (sizeof (*d));
+		d->token = token;
+		d->delta = 0;
+		g_hash_table_insert (pending->deltas, &d->token, d);
+	}
+
+	d->delta += delta;
+	rspamd_stat_token_cache_update (cache, pending->object_hash, token, delta);
+}
+
+void
+rspamd_stat_token_cache_add_learns (struct rspamd_stat_token_cache *cache,
+		const gchar *object, gint64 delta)
+{
+	struct rspamd_token_cache_pending *pending;
+
+	pending = rspamd_token_cache_get_pending (cache, object);
+	pending->learns += delta;
+}
+
+void
+rspamd_stat_token_cache_requeue (struct rspamd_stat_token_cache *cache,
+		const gchar *object, GArray *deltas, gint64 learns)
+{
+	struct rspamd_token_cache_pending *pending;
+	struct rspamd_stat_token_delta *d, *src;
+	guint i;
+
+	pending = rspamd_token_cache_get_pending (cache, object);
+	pending->learns += learns;
+
+	for (i = 0; i < deltas->len; i ++) {
+		src = &g_array_index (deltas, struct rspamd_stat_token_delta, i);
+		d = g_hash_table_lookup (pending->deltas, &src->token);
+
+		if (d == NULL) {
+			d = g_malloc (sizeof (*d));
+			d->token = src->token;
+			d->delta = 0;
+			g_hash_table_insert (pending->deltas, &d->token, d);
+		}
+
+		d->delta += src->delta;
+	}
+}
+
+guint
+rspamd_stat_token_cache_pending (struct rspamd_stat_token_cache *cache)
+{
+	return g_hash_table_size (cache->pending);
+}
+
+guint
+rspamd_stat_token_cache_flush (struct rspamd_stat_token_cache *cache,
+		rspamd_stat_token_cache_flush_cb cb, gpointer ud)
+{
+	GHashTableIter it, dit;
+	gpointer k, v;
+	struct rspamd_token_cache_pending *pending;
+	struct rspamd_stat_token_delta *d;
+	GArray *deltas;
+	guint nobjects = 0;
+
+	g_hash_table_iter_init (&it, cache->pending);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		pending = v;
+		deltas = g_array_sized_new (FALSE, FALSE, sizeof (*d),
+				g_hash_table_size (pending->deltas));
+		g_hash_table_iter_init (&dit, pending->deltas);
+
+		while (g_hash_table_iter_next (&dit, &k, &v)) {
+			d = v;
+
+			if (d->delta != 0) {
+				g_array_append_val (deltas, *d);
+			}
+		}
+
+		if (deltas->len > 0 || pending->learns != 0) {
+			cb (pending->object, deltas, pending->learns, ud);
+			cache->flushed += deltas->len;
+			nobjects ++;
+		}
+
+		g_array_free (deltas, TRUE);
+	}
+
+	g_hash_table_remove_all (cache->pending);
+
+	return nobjects;
+}
+
+void
+rspamd_stat_token_cache_stat (struct rspamd_stat_token_cache *cache,
+		ucl_object_t *target)
+{
+	ucl_object_t *obj;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (cache->hits),
+			"hits", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (cache->misses),
+			"misses", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (
+			g_hash_table_size (rspamd_lru_hash_get_htable (cache->values))),
+			"size", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (cache->flushed),
+			"flushed", 0, false);
+	ucl_object_insert_key (target, obj, "cache", 0, false);
+}
+
+void
+rspamd_stat_token_cache_destroy (struct rspamd_stat_token_cache *cache)
+{
+	if (cache) {
+		rspamd_lru_hash_destroy (cache->values);
+		g_hash_table_unref (cache->pending);
+		g_slice_free1 (sizeof (*cache), cache);
+	}
+}
@@ -0,0 +1,115 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSTAT_BACKENDS_TOKEN_CACHE_H_
+#define SRC_LIBSTAT_BACKENDS_TOKEN_CACHE_H_
+
+#include "config.h"
+#include "ucl.h"
+
+/*
+ * Per process cache of tokens values keyed by statfile object and token hash,
+ * it also coalesces increments that are written to the backend later
+ */
+struct rspamd_stat_token_cache;
+
+/* Coalesced increment of a single token */
+struct rspamd_stat_token_delta {
+	guint64 token;
+	gfloat delta;
+};
+
+/**
+ * Called for each statfile object with pending increments
+ * @param object statfile object (e.g. redis key)
+ * @param deltas array of struct rspamd_stat_token_delta
+ * @param learns pending change of learns count
+ * @param ud user data
+ */
+typedef void (*rspamd_stat_token_cache_flush_cb) (const gchar *object,
+		GArray *deltas, gint64 learns, gpointer ud);
+
+/**
+ * Create new tokens cache
+ * @param max_tokens maximum number of cached values
+ * @param ttl time to live of a cached value in seconds
+ */
+struct rspamd_stat_token_cache *rspamd_stat_token_cache_new (guint max_tokens,
+		guint ttl);
+
+/**
+ * Returns hash of statfile object used as a cache key
+ */
+guint64 rspamd_stat_token_cache_object (const gchar *object);
+
+/**
+ * Get cached value for a token
+ * @return TRUE if value has been found
+ */
+gboolean rspamd_stat_token_cache_lookup (struct rspamd_stat_token_cache *cache,
+		guint64 object, guint64 token, time_t now, gfloat *value);
+
+/**
+ * Store value of a token received from the backend
+ */
+void rspamd_stat_token_cache_insert (struct rspamd_stat_token_cache *cache,
+		guint64 object, guint64 token, gfloat value, time_t now);
+
+/**
+ * Apply increment to the cached value (if any) of a learned token
+ */
+void rspamd_stat_token_cache_update (struct rspamd_stat_token_cache *cache,
+		guint64 object, guint64 token, gfloat delta);
+
+/**
+ * Queue increment to be written later
+ */
+void rspamd_stat_token_cache_add_pending (struct rspamd_stat_token_cache *cache,
+		const gchar *object, guint64 token, gfloat delta);
+
+/**
+ * Queue change of learns count to be written later
+ */
+void rspamd_stat_token_cache_add_learns (struct rspamd_stat_token_cache *cache,
+		const gchar *object, gint64 delta);
+
+/**
+ * Queue again increments that have not been written by the backend, cached
+ * values are not changed as they already include these increments
+ */
+void rspamd_stat_token_cache_requeue (struct rspamd_stat_token_cache *cache,
+		const gchar *object, GArray *deltas, gint64 learns);
+
+/**
+ * Returns number of statfile objects with pending increments
+ */
+guint rspamd_stat_token_cache_pending (struct rspamd_stat_token_cache *cache);
+
+/**
+ * Passes all pending increments to `cb` and forgets them
+ * @return number of objects flushed
+ */
+guint rspamd_stat_token_cache_flush (struct rspamd_stat_token_cache *cache,
+		rspamd_stat_token_cache_flush_cb cb, gpointer ud);
+
+/**
+ * Add cache counters to the statistics object
+ */
+void rspamd_stat_token_cache_stat (struct rspamd_stat_token_cache *cache,
+		ucl_object_t *target);
+
+void rspamd_stat_token_cache_destroy (struct rspamd_stat_token_cache *cache);
+
+#endif /* SRC_LIBSTAT_BACKENDS_TOKEN_CACHE_H_ */
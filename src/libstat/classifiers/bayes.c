@@ -21,6 +21,10 @@
 #include "stat_internal.h"
 #include "math.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define msg_err_bayes(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "bayes", task->task_pool->tag.uid, \
         G_STRFUNC, \
@@ -93,100 +97,183 @@ struct bayes_task_closure {
 static const double feature_weight[] = { 0, 1, 4, 27, 256, 3125, 46656, 823543 };
 
 #define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
+/* Number of tokens gathered and combined at once */
+#define BAYES_BLOCK_SIZE 256
+
+static inline void
+bayes_token_prob (gdouble spam_count, gdouble ham_count, gdouble fw,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *bayes_spam_prob, gdouble *bayes_ham_prob)
+{
+	gdouble spam_freq, ham_freq, spam_prob, ham_prob, total_count,
+		norm_sum, norm_sub, w;
+
+	total_count = spam_count + ham_count;
+	spam_freq = spam_count / spam_learns;
+	ham_freq = ham_count / ham_learns;
+	spam_prob = spam_freq / (spam_freq + ham_freq);
+	ham_prob = ham_freq / (spam_freq + ham_freq);
+	norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
+	norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
+	/* (ham_freq - spam_freq)^2 is the same, so both classes share weight */
+	w = (norm_sub) / (norm_sum) *
+			(fw * total_count) / (4.0 * (1.0 + fw * total_count));
+	*bayes_spam_prob = PROB_COMBINE (spam_prob, total_count, w, 0.5);
+	*bayes_ham_prob = PROB_COMBINE (ham_prob, total_count, w, 0.5);
+}
+
+void
+bayes_token_probs_ref (const gdouble *spam_counts, const gdouble *ham_counts,
+		const gdouble *weights, guint n,
+		guint64 spam_learns, guint64 ham_learns,
+		gdouble *spam_probs, gdouble *ham_probs)
+{
+	guint i;
+	gdouble sl = MAX (1., (gdouble)spam_learns),
+			hl = MAX (1., (gdouble)ham_learns);
+
+	for (i = 0; i < n; i ++) {
+		bayes_token_prob (spam_counts[i], ham_counts[i], weights[i], sl, hl,
+				&spam_probs[i], &ham_probs[i]);
+	}
+}
+
+/*
+ * Computes combined probabilities for a block of tokens. The results are
+ * meaningful for tokens with non-zero total count only, others are masked
+ * out by the caller. Operations are performed in the same order as in the
+ * scalar version, so both produce identical values.
+ */
+void
+bayes_token_probs (const gdouble *spam_counts, const gdouble *ham_counts,
+		const gdouble *weights, guint n,
+		guint64 spam_learns, guint64 ham_learns,
+		gdouble *spam_probs, gdouble *ham_probs)
+{
+	guint i = 0;
+	gdouble sl = MAX (1., (gdouble)spam_learns),
+			hl = MAX (1., (gdouble)ham_learns);
+#ifdef __SSE2__
+	const __m128d one = _mm_set1_pd (1.0), half = _mm_set1_pd (0.5),
+			four = _mm_set1_pd (4.0), vsl = _mm_set1_pd (sl),
+			vhl = _mm_set1_pd (hl);
+	__m128d sc, hc, fw, total, sf, hf, fsum, sp, hp, d, w, ft;
+
+	for (; i + 2 <= n; i += 2) {
+		sc = _mm_loadu_pd (&spam_counts[i]);
+		hc = _mm_loadu_pd (&ham_counts[i]);
+		fw = _mm_loadu_pd (&weights[i]);
+		total = _mm_add_pd (sc, hc);
+		sf = _mm_div_pd (sc, vsl);
+		hf = _mm_div_pd (hc, vhl);
+		fsum = _mm_add_pd (sf, hf);
+		sp = _mm_div_pd (sf, fsum);
+		hp = _mm_div_pd (hf, fsum);
+		d = _mm_sub_pd (sf, hf);
+		ft = _mm_mul_pd (fw, total);
+		w = _mm_div_pd (_mm_mul_pd (_mm_div_pd (_mm_mul_pd (d, d),
+				_mm_mul_pd (fsum, fsum)), ft),
+				_mm_mul_pd (four, _mm_add_pd (one, ft)));
+		_mm_storeu_pd (&spam_probs[i],
+				_mm_div_pd (_mm_add_pd (_mm_mul_pd (w, half),
+						_mm_mul_pd (total, sp)),
+						_mm_add_pd (w, total)));
+		_mm_storeu_pd (&ham_probs[i],
+				_mm_div_pd (_mm_add_pd (_mm_mul_pd (w, half),
+						_mm_mul_pd (total, hp)),
+						_mm_add_pd (w, total)));
+	}
+#endif
+
+	for (; i < n; i ++) {
+		bayes_token_prob (spam_counts[i], ham_counts[i], weights[i], sl, hl,
+				&spam_probs[i], &ham_probs[i]);
+	}
+}
+
 /*
- * In this callback we calculate local probabilities for tokens
+ * Calculates local probabilities for a block of tokens starting from `start`
  */
 static void
-bayes_classify_token (struct rspamd_classifier *ctx,
-		rspamd_token_t *tok, struct bayes_task_closure *cl)
+bayes_classify_block (struct rspamd_classifier *ctx,
+		struct rspamd_stat_tokens *tokens, guint start, guint n,
+		struct bayes_task_closure *cl)
 {
-	guint i;
+	guint i, k, idx;
 	gint id;
-	guint64 spam_count = 0, ham_count = 0, total_count = 0;
 	struct rspamd_statfile *st;
 	struct rspamd_task *task;
-	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
-		ham_prob, fw, w, norm_sum, norm_sub, val;
+	const gfloat *values;
+	gdouble *target, val, hits = 0;
+	gdouble spam_counts[BAYES_BLOCK_SIZE], ham_counts[BAYES_BLOCK_SIZE],
+		weights[BAYES_BLOCK_SIZE], spam_probs[BAYES_BLOCK_SIZE],
+		ham_probs[BAYES_BLOCK_SIZE];
 
 	task = cl->task;
+	memset (spam_counts, 0, n * sizeof (gdouble));
+	memset (ham_counts, 0, n * sizeof (gdouble));
 
-#if 0
-	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_LUA_META) {
-		/* Ignore lua metatokens for now */
-		return;
-	}
-#endif
-
+	/* Gather counts, negative values are masked to zero */
 	for (i = 0; i < ctx->statfiles_ids->len; i++) {
 		id = g_array_index (ctx->statfiles_ids, gint, i);
 		st = g_ptr_array_index (ctx->ctx->statfiles, id);
 		g_assert (st != NULL);
-		val = tok->values[id];
-
-		if (val > 0) {
-			if (st->stcf->is_spam) {
-				spam_count += val;
-			}
-			else {
-				ham_count += val;
-			}
+		values = RSPAMD_TOKEN_VALUES (tokens, id) + start;
+		target = st->stcf->is_spam ? spam_counts : ham_counts;
 
-			total_count += val;
-			cl->total_hits += val;
+		for (k = 0; k < n; k ++) {
+			val = values[k] > 0 ? values[k] : 0;
+			target[k] += val;
+			hits += val;
 		}
 	}
 
-	/* Probability for this token */
-	if (total_count > 0) {
-		spam_freq = ((double)spam_count / MAX (1., (double) ctx->spam_learns));
-		ham_freq = ((double)ham_count / MAX (1., (double)ctx->ham_learns));
-		spam_prob = spam_freq / (spam_freq + ham_freq);
-		ham_prob = ham_freq / (spam_freq + ham_freq);
-		fw = feature_weight[tok->window_idx % G_N_ELEMENTS (feature_weight)];
-		norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
-		norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
-
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_spam_prob = PROB_COMBINE (spam_prob, total_count, w, 0.5);
-		norm_sub = (ham_freq - spam_freq) * (ham_freq - spam_freq);
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_ham_prob = PROB_COMBINE (ham_prob, total_count, w, 0.5);
-
-		cl->spam_prob += log2 (bayes_spam_prob);
-		cl->ham_prob += log2 (bayes_ham_prob);
+	cl->total_hits += hits;
+
+	for (k = 0; k < n; k ++) {
+		weights[k] = feature_weight[tokens->window_idx[start + k] %
+				G_N_ELEMENTS (feature_weight)];
+	}
+
+	bayes_token_probs (spam_counts, ham_counts, weights, n,
+			ctx->spam_learns, ctx->ham_learns, spam_probs, ham_probs);
+
+	/* Accumulate in tokens order to keep the sums stable */
+	for (k = 0; k < n; k ++) {
+		if (spam_counts[k] + ham_counts[k] <= 0) {
+			continue;
+		}
+
+		idx = start + k;
+		cl->spam_prob += log2 (spam_probs[k]);
+		cl->ham_prob += log2 (ham_probs[k]);
 		cl->processed_tokens ++;
 
-		if (tok->t1 && tok->t2) {
-			msg_debug_bayes ("token <%*s:%*s>: weight: %f, total_count: %L, "
-					"spam_count: %L, ham_count: %L,"
-					"spam_prob: %.3f, ham_prob: %.3f, "
+		if (tokens->t1[idx] && tokens->t2[idx]) {
+			msg_debug_bayes ("token <%*s:%*s>: weight: %f, total_count: %.0f, "
+					"spam_count: %.0f, ham_count: %.0f,"
 					"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
 					"current spam prob: %.3f, current ham prob: %.3f",
-					(int) tok->t1->len, tok->t1->begin,
-					(int) tok->t2->len, tok->t2->begin,
-					fw, total_count, spam_count, ham_count,
-					spam_prob, ham_prob,
-					bayes_spam_prob, bayes_ham_prob,
+					(int) tokens->t1[idx]->len, tokens->t1[idx]->begin,
+					(int) tokens->t2[idx]->len, tokens->t2[idx]->begin,
+					weights[k], spam_counts[k] + ham_counts[k],
+					spam_counts[k], ham_counts[k],
+					spam_probs[k], ham_probs[k],
 					cl->spam_prob, cl->ham_prob);
 		}
 		else {
-			msg_debug_bayes ("token <?:?>: weight: %f, total_count: %L, "
-					"spam_count: %L, ham_count: %L,"
-					"spam_prob: %.3f, ham_prob: %.3f, "
+			msg_debug_bayes ("token <?:?>: weight: %f, total_count: %.0f, "
+					"spam_count: %.0f, ham_count: %.0f,"
 					"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
 					"current spam prob: %.3f, current ham prob: %.3f",
-					fw, total_count, spam_count, ham_count,
-					spam_prob, ham_prob,
-					bayes_spam_prob, bayes_ham_prob,
+					weights[k], spam_counts[k] + ham_counts[k],
+					spam_counts[k], ham_counts[k],
+					spam_probs[k], ham_probs[k],
 					cl->spam_prob, cl->ham_prob);
 		}
 	}
 }
 
-
-
 gboolean
 bayes_init (rspamd_mempool_t *pool, struct rspamd_classifier *cl)
 {
@@ -197,14 +284,13 @@ bayes_init (rspamd_mempool_t *pool, struct rspamd_classifier *cl)
 
 gboolean
 bayes_classify (struct rspamd_classifier * ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task)
 {
 	double final_prob, h, s, *pprob;
 	gchar sumbuf[32];
 	struct rspamd_statfile *st = NULL;
 	struct bayes_task_closure cl;
-	rspamd_token_t *tok;
 	guint i;
 	gint id;
 
@@ -232,10 +318,9 @@ bayes_classify (struct rspamd_classifier * ctx,
 		}
 	}
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-
-		bayes_classify_token (ctx, tok, &cl);
+	for (i = 0; i < tokens->len; i += BAYES_BLOCK_SIZE) {
+		bayes_classify_block (ctx, tokens, i,
+				MIN (BAYES_BLOCK_SIZE, tokens->len - i), &cl);
 	}
 
 	h = 1 - inv_chi_square (task, cl.spam_prob, cl.processed_tokens);
@@ -318,7 +403,7 @@ bayes_classify (struct rspamd_classifier * ctx,
 
 gboolean
 bayes_learn_spam (struct rspamd_classifier * ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task,
 		gboolean is_spam,
 		gboolean unlearn,
@@ -327,7 +412,7 @@ bayes_learn_spam (struct rspamd_classifier * ctx,
 	guint i, j;
 	gint id;
 	struct rspamd_statfile *st;
-	rspamd_token_t *tok;
+	gfloat *values;
 	gboolean incrementing;
 
 	g_assert (ctx != NULL);
@@ -335,33 +420,32 @@ bayes_learn_spam (struct rspamd_classifier * ctx,
 
 	incrementing = ctx->cfg->flags & RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 
-	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
-
-		for (j = 0; j < ctx->statfiles_ids->len; j++) {
-			id = g_array_index (ctx->statfiles_ids, gint, j);
-			st = g_ptr_array_index (ctx->ctx->statfiles, id);
-			g_assert (st != NULL);
+	for (j = 0; j < ctx->statfiles_ids->len; j++) {
+		id = g_array_index (ctx->statfiles_ids, gint, j);
+		st = g_ptr_array_index (ctx->ctx->statfiles, id);
+		g_assert (st != NULL);
+		values = RSPAMD_TOKEN_VALUES (tokens, id);
 
+		for (i = 0; i < tokens->len; i++) {
 			if (!!st->stcf->is_spam == !!is_spam) {
 				if (incrementing) {
-					tok->values[id] = 1;
+					values[i] = 1;
 				}
 				else {
-					tok->values[id]++;
+					values[i]++;
 				}
 			}
-			else if (tok->values[id] > 0 && unlearn) {
+			else if (values[i] > 0 && unlearn) {
 				/* Unlearning */
 				if (incrementing) {
-					tok->values[id] = -1;
+					values[i] = -1;
 				}
 				else {
-					tok->values[id]--;
+					values[i]--;
 				}
 			}
 			else if (incrementing) {
-				tok->values[id] = 0;
+				values[i] = 0;
 			}
 		}
 	}
@@ -12,17 +12,17 @@ struct rspamd_classifier_config;
 struct rspamd_task;
 struct rspamd_classifier;
 
-struct token_node_s;
+struct rspamd_stat_tokens;
 
 struct rspamd_stat_classifier {
 	char *name;
 	gboolean (*init_func)(rspamd_mempool_t *pool,
 			struct rspamd_classifier *cl);
 	gboolean (*classify_func)(struct rspamd_classifier * ctx,
-			GPtrArray *tokens,
+			struct rspamd_stat_tokens *tokens,
 			struct rspamd_task *task);
 	gboolean (*learn_spam_func)(struct rspamd_classifier * ctx,
-			GPtrArray *input,
+			struct rspamd_stat_tokens *tokens,
 			struct rspamd_task *task,
 			gboolean is_spam,
 			gboolean unlearn,
@@ -33,23 +33,34 @@ struct rspamd_stat_classifier {
 gboolean bayes_init (rspamd_mempool_t *pool,
 		struct rspamd_classifier *);
 gboolean bayes_classify (struct rspamd_classifier *ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task);
 gboolean bayes_learn_spam (struct rspamd_classifier *ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task,
 		gboolean is_spam,
 		gboolean unlearn,
 		GError **err);
+/* Combined per token probabilities, vectorized where supported */
+void bayes_token_probs (const gdouble *spam_counts, const gdouble *ham_counts,
+		const gdouble *weights, guint n,
+		guint64 spam_learns, guint64 ham_learns,
+		gdouble *spam_probs, gdouble *ham_probs);
+/* Plain scalar version of the same calculation */
+void bayes_token_probs_ref (const gdouble *spam_counts,
+		const gdouble *ham_counts,
+		const gdouble *weights, guint n,
+		guint64 spam_learns, guint64 ham_learns,
+		gdouble *spam_probs, gdouble *ham_probs);
 
 /* Generic lua classifier */
 gboolean lua_classifier_init (rspamd_mempool_t *pool,
 		struct rspamd_classifier *);
 gboolean lua_classifier_classify (struct rspamd_classifier *ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task);
 gboolean lua_classifier_learn_spam (struct rspamd_classifier *ctx,
-		GPtrArray *tokens,
+		struct rspamd_stat_tokens *tokens,
 		struct rspamd_task *task,
 		gboolean is_spam,
 		gboolean unlearn,
@@ -19,6 +19,7 @@
 #include "stat_api.h"
 #include "stat_internal.h"
 #include "cryptobox.h"
+#include "bloom.h"
 #include "ucl.h"
 #include "hiredis.h"
 #include "adapters/libevent.h"
@@ -27,6 +28,9 @@
 #define REDIS_STAT_TIMEOUT 30
 #define REDIS_DEFAULT_PORT 6379
 #define DEFAULT_REDIS_KEY "learned_ids"
+#define DEFAULT_BLOOM_SIZE 1000000
+#define DEFAULT_BLOOM_REFRESH 60.0
+#define BLOOM_SCAN_COUNT 1000
 
 struct rspamd_redis_cache_ctx {
 	struct rspamd_statfile_config *stcf;
@@ -36,6 +40,23 @@ struct rspamd_redis_cache_ctx {
 	const gchar *dbname;
 	const gchar *redis_object;
 	gdouble timeout;
+	/* Local filter of learned ids, only negative answers are trusted */
+	struct rspamd_bloom_blocked *bloom;
+	struct rspamd_bloom_blocked *bloom_pending;
+	struct rspamd_redis_cache_bloom_cbdata *bloom_cbdata;
+	struct rspamd_stat_async_elt *bloom_elt;
+	struct event_base *ev_base;
+	gsize bloom_size;
+	gsize bloom_nelts;
+};
+
+struct rspamd_redis_cache_bloom_cbdata {
+	struct rspamd_redis_cache_ctx *ctx;
+	struct rspamd_stat_async_elt *elt;
+	struct upstream *selected;
+	redisAsyncContext *redis;
+	gsize nelts;
+	gboolean wanna_die;
 };
 
 struct rspamd_redis_cache_runtime {
@@ -177,12 +198,159 @@ rspamd_stat_cache_redis_set (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 }
 
+static void
+rspamd_redis_cache_bloom_cleanup (struct rspamd_redis_cache_bloom_cbdata *cbdata)
+{
+	struct rspamd_redis_cache_ctx *ctx;
+
+	if (cbdata && !cbdata->wanna_die) {
+		/* Avoid double frees as pending callbacks are called on free */
+		cbdata->wanna_die = TRUE;
+		ctx = cbdata->ctx;
+		redisAsyncFree (cbdata->redis);
+
+		if (ctx->bloom_pending) {
+			/* Scan has not been finished */
+			rspamd_bloom_blocked_unref (ctx->bloom_pending);
+			ctx->bloom_pending = NULL;
+		}
+
+		ctx->bloom_cbdata = NULL;
+		cbdata->elt->enabled = TRUE;
+		g_slice_free1 (sizeof (*cbdata), cbdata);
+	}
+}
+
+/* Called for each chunk of learned ids */
+static void
+rspamd_redis_cache_bloom_scan (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_cache_bloom_cbdata *cbdata = priv;
+	struct rspamd_redis_cache_ctx *ctx;
+	redisReply *reply = r, *cursor, *elts, *elt;
+	guint i;
+
+	if (cbdata->wanna_die) {
+		return;
+	}
+
+	ctx = cbdata->ctx;
+
+	if (c->err != 0 || reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+			reply->elements != 2) {
+		msg_err ("cannot scan learned ids for %s: %s", ctx->stcf->symbol,
+				c->errstr ? c->errstr : "bad reply");
+		rspamd_upstream_fail (cbdata->selected);
+		rspamd_redis_cache_bloom_cleanup (cbdata);
+
+		return;
+	}
+
+	cursor = reply->element[0];
+	elts = reply->element[1];
+
+	if (elts->type == REDIS_REPLY_ARRAY) {
+		/* Keys and values are interleaved */
+		for (i = 0; i < elts->elements; i += 2) {
+			elt = elts->element[i];
+
+			if (elt->type == REDIS_REPLY_STRING) {
+				rspamd_bloom_blocked_add (ctx->bloom_pending, elt->str,
+						elt->len);
+				cbdata->nelts ++;
+			}
+		}
+	}
+
+	if (cursor->type == REDIS_REPLY_STRING &&
+			!(cursor->len == 1 && cursor->str[0] == '0')) {
+		redisAsyncCommand (cbdata->redis, rspamd_redis_cache_bloom_scan,
+				cbdata, "HSCAN %s %b COUNT %d",
+				ctx->redis_object, cursor->str, (size_t)cursor->len,
+				BLOOM_SCAN_COUNT);
+
+		return;
+	}
+
+	/* Scan is finished, so the filter is complete now */
+	if (ctx->bloom) {
+		rspamd_bloom_blocked_unref (ctx->bloom);
+	}
+
+	ctx->bloom = ctx->bloom_pending;
+	ctx->bloom_pending = NULL;
+	ctx->bloom_nelts = cbdata->nelts;
+	msg_debug ("loaded %z learned ids for %s", cbdata->nelts,
+			ctx->stcf->symbol);
+	rspamd_upstream_ok (cbdata->selected);
+	rspamd_redis_cache_bloom_cleanup (cbdata);
+}
+
+static void
+rspamd_redis_cache_bloom_refresh (struct rspamd_stat_async_elt *elt, gpointer d)
+{
+	struct rspamd_redis_cache_ctx *ctx = elt->ud;
+	struct rspamd_redis_cache_bloom_cbdata *cbdata;
+	rspamd_inet_addr_t *addr;
+	struct upstream *up;
+
+	if (ctx->bloom_cbdata) {
+		rspamd_redis_cache_bloom_cleanup (ctx->bloom_cbdata);
+	}
+
+	up = rspamd_upstream_get (ctx->read_servers,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+
+	if (up == NULL) {
+		return;
+	}
+
+	/* Disable further events unless needed */
+	elt->enabled = FALSE;
+
+	cbdata = g_slice_alloc0 (sizeof (*cbdata));
+	cbdata->ctx = ctx;
+	cbdata->elt = elt;
+	cbdata->selected = up;
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		cbdata->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		cbdata->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	g_assert (cbdata->redis != NULL);
+
+	redisLibeventAttach (cbdata->redis, ctx->ev_base);
+	ctx->bloom_cbdata = cbdata;
+	/* Leave space for growth until the next refresh */
+	ctx->bloom_pending = rspamd_bloom_blocked_new (
+			MAX (ctx->bloom_size, ctx->bloom_nelts * 2), 0.01);
+
+	rspamd_redis_cache_maybe_auth (ctx, cbdata->redis);
+	redisAsyncCommand (cbdata->redis, rspamd_redis_cache_bloom_scan, cbdata,
+			"HSCAN %s 0 COUNT %d",
+			ctx->redis_object, BLOOM_SCAN_COUNT);
+}
+
+static void
+rspamd_redis_cache_bloom_fin (struct rspamd_stat_async_elt *elt, gpointer d)
+{
+	struct rspamd_redis_cache_ctx *ctx = elt->ud;
+
+	rspamd_redis_cache_bloom_cleanup (ctx->bloom_cbdata);
+}
+
 static void
 rspamd_stat_cache_redis_generate_id (struct rspamd_task *task)
 {
 	rspamd_cryptobox_hash_state_t st;
-	rspamd_token_t *tok;
-	guint i;
 	guchar out[rspamd_cryptobox_HASHBYTES];
 	gchar *b32out;
 	gchar *user = NULL;
@@ -195,10 +363,9 @@ rspamd_stat_cache_redis_generate_id (struct rspamd_task *task)
 		rspamd_cryptobox_hash_update (&st, user, strlen (user));
 	}
 
-	for (i = 0; i < task->tokens->len; i ++) {
-		tok = g_ptr_array_index (task->tokens, i);
-		rspamd_cryptobox_hash_update (&st, tok->data, tok->datalen);
-	}
+	/* Hashes are contiguous, so the whole array is hashed at once */
+	rspamd_cryptobox_hash_update (&st, (const guchar *)task->tokens->hashes,
+			sizeof (*task->tokens->hashes) * task->tokens->len);
 
 	rspamd_cryptobox_hash_final (&st, out);
 
@@ -298,8 +465,9 @@ rspamd_stat_cache_redis_init (struct rspamd_stat_ctx *ctx,
 {
 	struct rspamd_redis_cache_ctx *cache_ctx;
 	struct rspamd_statfile_config *stf = st->stcf;
-	const ucl_object_t *obj;
+	const ucl_object_t *obj, *elt;
 	gboolean ret = FALSE;
+	gdouble refresh = DEFAULT_BLOOM_REFRESH;
 
 	cache_ctx = g_slice_alloc0 (sizeof (*cache_ctx));
 
@@ -349,6 +517,31 @@ rspamd_stat_cache_redis_init (struct rspamd_stat_ctx *ctx,
 
 	cache_ctx->stcf = stf;
 
+	elt = cf ? ucl_object_lookup (cf, "bloom") : NULL;
+
+	if (elt != NULL && ucl_object_toboolean (elt)) {
+		cache_ctx->bloom_size = DEFAULT_BLOOM_SIZE;
+		cache_ctx->ev_base = ctx->ev_base;
+
+		elt = ucl_object_lookup (cf, "bloom_size");
+
+		if (elt != NULL && ucl_object_toint (elt) > 0) {
+			cache_ctx->bloom_size = ucl_object_toint (elt);
+		}
+
+		elt = ucl_object_lookup (cf, "bloom_refresh");
+
+		if (elt != NULL && ucl_object_todouble (elt) > 0) {
+			refresh = ucl_object_todouble (elt);
+		}
+
+		cache_ctx->bloom_elt = rspamd_stat_ctx_register_async (
+				rspamd_redis_cache_bloom_refresh,
+				rspamd_redis_cache_bloom_fin,
+				cache_ctx,
+				refresh);
+	}
+
 	return (gpointer)cache_ctx;
 }
 
@@ -360,6 +553,7 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	struct rspamd_redis_cache_runtime *rt;
 	struct upstream *up;
 	rspamd_inet_addr_t *addr;
+	gchar *h;
 
 	g_assert (ctx != NULL);
 
@@ -396,6 +590,22 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	rt->task = task;
 	rt->ctx = ctx;
 
+	if (!learn) {
+		rspamd_stat_cache_redis_generate_id (task);
+
+		if (ctx->bloom) {
+			h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
+
+			if (!rspamd_bloom_blocked_check (ctx->bloom, h, strlen (h))) {
+				/* Definitely not learned, no need to ask redis */
+				msg_debug_task ("<%s> is not in learned ids filter",
+						task->message_id);
+
+				return rt;
+			}
+		}
+	}
+
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
 
@@ -416,10 +626,6 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	event_base_set (task->ev_base, &rt->timeout_event);
 	rspamd_redis_cache_maybe_auth (ctx, rt->redis);
 
-	if (!learn) {
-		rspamd_stat_cache_redis_generate_id (task);
-	}
-
 	return rt;
 }
 
@@ -438,6 +644,11 @@ rspamd_stat_cache_redis_check (struct rspamd_task *task,
 		return RSPAMD_LEARN_INGORE;
 	}
 
+	if (rt->redis == NULL) {
+		/* Filtered out by the local filter */
+		return RSPAMD_LEARN_OK;
+	}
+
 	double_to_tv (rt->ctx->timeout, &tv);
 
 	if (redisAsyncCommand (rt->redis, rspamd_stat_cache_redis_get, rt,
@@ -466,6 +677,14 @@ rspamd_stat_cache_redis_learn (struct rspamd_task *task,
 	h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
 	g_assert (h != NULL);
 
+	if (rt->ctx->bloom) {
+		rspamd_bloom_blocked_add (rt->ctx->bloom, h, strlen (h));
+	}
+
+	if (rt->ctx->bloom_pending) {
+		rspamd_bloom_blocked_add (rt->ctx->bloom_pending, h, strlen (h));
+	}
+
 	double_to_tv (rt->ctx->timeout, &tv);
 	flag = (task->flags & RSPAMD_TASK_FLAG_LEARN_SPAM) ? 1 : -1;
 
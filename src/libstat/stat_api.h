@@ -106,4 +106,50 @@ rspamd_stat_result_t rspamd_stat_statistics (struct rspamd_task *task,
 
 void rspamd_stat_unload (void);
 
+/*
+ * Bulk learning: token increments of many messages are merged in memory and
+ * written to each backend with a single update
+ */
+struct rspamd_stat_bulk;
+
+/**
+ * Create new bulk learner
+ * @param classifier NULL to learn all classifiers, name to learn a specific one
+ */
+struct rspamd_stat_bulk *rspamd_stat_bulk_new (const gchar *classifier);
+
+/**
+ * Tokenize parsed task and merge its tokens to the pending increments
+ * @return FALSE if a task has not been accepted (e.g. too few tokens)
+ */
+gboolean rspamd_stat_bulk_add (struct rspamd_stat_bulk *bulk,
+		struct rspamd_task *task, gboolean spam, GError **err);
+
+/**
+ * Returns number of messages pending in a bulk learner
+ */
+guint rspamd_stat_bulk_pending (struct rspamd_stat_bulk *bulk);
+
+/**
+ * Write pending increments to backends, `task` is used as a context for
+ * backends and must have a session if backends are asynchronous
+ */
+rspamd_stat_result_t rspamd_stat_bulk_flush (struct rspamd_stat_bulk *bulk,
+		struct rspamd_task *task, GError **err);
+
+void rspamd_stat_bulk_destroy (struct rspamd_stat_bulk *bulk);
+
+struct rspamd_shared_cache;
+
+/**
+ * Create cache of tokens in shared memory, so a message scanned by one worker
+ * is not tokenized again when it is learned or scanned by another one. It
+ * must be created before forking
+ * @param pool pool to allocate shared memory from
+ * @param max_items number of messages to keep
+ * @param ttl time to keep tokens of a message
+ */
+struct rspamd_shared_cache *rspamd_stat_shared_tokens_new (
+		rspamd_mempool_t *pool, guint max_items, guint ttl);
+
 #endif /* STAT_API_H_ */
@@ -51,17 +51,6 @@ struct rspamd_statfile {
 	gpointer bkcf;
 };
 
-#define RSPAMD_MAX_TOKEN_LEN 8
-typedef struct token_node_s {
-	guchar data[RSPAMD_MAX_TOKEN_LEN];
-	guint window_idx;
-	guint datalen;
-	guint flags;
-	rspamd_stat_token_t *t1;
-	rspamd_stat_token_t *t2;
-	gdouble values[];
-} rspamd_token_t;
-
 struct rspamd_stat_async_elt;
 
 typedef void (*rspamd_stat_async_handler)(struct rspamd_stat_async_elt *elt,
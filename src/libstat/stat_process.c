@@ -20,8 +20,11 @@
 #include "libmime/message.h"
 #include "libmime/images.h"
 #include "libserver/html.h"
+#include "libserver/worker_util.h"
 #include "lua/lua_common.h"
+#include "cryptobox.h"
 #include "utlist.h"
+#include "shared_cache.h"
 #include <math.h>
 
 #define RSPAMD_CLASSIFY_OP 0
@@ -39,7 +42,7 @@ rspamd_stat_tokenize_header (struct rspamd_task *task,
 	guint i;
 	rspamd_stat_token_t str;
 
-	hdrs = g_hash_table_lookup (task->raw_headers, name);
+	hdrs = rspamd_message_get_header_array (task, name, FALSE);
 	str.flags = RSPAMD_STAT_TOKEN_FLAG_META;
 
 	if (hdrs != NULL) {
@@ -50,14 +53,9 @@ rspamd_stat_tokenize_header (struct rspamd_task *task,
 				str.len = strlen (cur->name);
 				g_array_append_val (ar, str);
 			}
-			if (cur->decoded != NULL) {
-				str.begin = cur->decoded;
-				str.len = strlen (cur->decoded);
-				g_array_append_val (ar, str);
-			}
-			else if (cur->value != NULL) {
-				str.begin = cur->value;
-				str.len = strlen (cur->value);
+			if (cur->value != NULL) {
+				str.begin = rspamd_mime_header_get_decoded (cur);
+				str.len = strlen (str.begin);
 				g_array_append_val (ar, str);
 			}
 		}
@@ -238,6 +236,104 @@ rspamd_stat_tokenize_parts_metadata (struct rspamd_stat_ctx *st_ctx,
 			rspamd_array_free_hard, ar);
 }
 
+/* Messages with more tokens are not cached */
+#define RSPAMD_STAT_SHARED_MAX_TOKENS 4096
+/* Hash, window index and flags of a token */
+#define RSPAMD_STAT_SHARED_TOKEN_LEN (sizeof (guint64) + sizeof (guint) * 2)
+
+struct rspamd_shared_cache *
+rspamd_stat_shared_tokens_new (rspamd_mempool_t *pool, guint max_items,
+		guint ttl)
+{
+	return rspamd_shared_cache_new (pool, max_items,
+			RSPAMD_STAT_SHARED_MAX_TOKENS * RSPAMD_STAT_SHARED_TOKEN_LEN, ttl);
+}
+
+/* Tokens depend on parts and on headers (subject and metatokens) */
+static void
+rspamd_stat_shared_tokens_key (struct rspamd_task *task, guchar *key)
+{
+	rspamd_cryptobox_hash_state_t st;
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, task->digest, sizeof (task->digest));
+
+	if (task->raw_headers_content.len > 0) {
+		rspamd_cryptobox_hash_update (&st,
+				(const guchar *)task->raw_headers_content.begin,
+				task->raw_headers_content.len);
+	}
+
+	rspamd_cryptobox_hash_final (&st, key);
+}
+
+/*
+ * Tokens are stored as arrays of hashes, window indexes and flags following
+ * each other
+ */
+static gboolean
+rspamd_stat_shared_tokens_lookup (struct rspamd_shared_cache *sc,
+		struct rspamd_task *task, const guchar *key, guint nvalues)
+{
+	struct rspamd_stat_tokens *tokens;
+	const guint64 *hashes;
+	const guint *window_idx, *flags;
+	gchar *value;
+	gsize vlen;
+	guint i, len;
+
+	/* Too large for the stack */
+	value = g_malloc (rspamd_shared_cache_max_value (sc));
+
+	if (!rspamd_shared_cache_lookup (sc, (const gchar *)key,
+			rspamd_cryptobox_HASHBYTES, value, &vlen, task->tv.tv_sec) ||
+			vlen % RSPAMD_STAT_SHARED_TOKEN_LEN != 0) {
+		g_free (value);
+
+		return FALSE;
+	}
+
+	len = vlen / RSPAMD_STAT_SHARED_TOKEN_LEN;
+	hashes = (const guint64 *)value;
+	window_idx = (const guint *)(hashes + len);
+	flags = window_idx + len;
+	tokens = rspamd_stat_tokens_new (task->task_pool, len, nvalues);
+
+	for (i = 0; i < len; i ++) {
+		rspamd_stat_tokens_add (tokens, hashes[i], window_idx[i], flags[i],
+				NULL, NULL);
+	}
+
+	task->tokens = tokens;
+	g_free (value);
+
+	return TRUE;
+}
+
+static void
+rspamd_stat_shared_tokens_insert (struct rspamd_shared_cache *sc,
+		struct rspamd_task *task, const guchar *key)
+{
+	struct rspamd_stat_tokens *tokens = task->tokens;
+	guint64 *hashes;
+	guint *window_idx, *flags;
+	gsize vlen;
+
+	vlen = tokens->len * RSPAMD_STAT_SHARED_TOKEN_LEN;
+	hashes = g_malloc (MAX (vlen, 1));
+	window_idx = (guint *)(hashes + tokens->len);
+	flags = window_idx + tokens->len;
+	memcpy (hashes, tokens->hashes, sizeof (*tokens->hashes) * tokens->len);
+	memcpy (window_idx, tokens->window_idx,
+			sizeof (*tokens->window_idx) * tokens->len);
+	memcpy (flags, tokens->flags, sizeof (*tokens->flags) * tokens->len);
+
+	rspamd_shared_cache_insert (sc, (const gchar *)key,
+			rspamd_cryptobox_HASHBYTES, (const gchar *)hashes, vlen,
+			task->tv.tv_sec, 0);
+	g_free (hashes);
+}
+
 /*
  * Tokenize task using the tokenizer specified
  */
@@ -246,11 +342,26 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 		struct rspamd_task *task)
 {
 	struct rspamd_mime_text_part *part;
+	struct rspamd_shared_cache *sc = task->cfg->stat_shared_tokens;
 	rspamd_stat_token_t *tok;
 	GArray *words;
 	gchar *sub = NULL;
 	guint i, reserved_len = 0;
 	gdouble *pdiff;
+	guchar key[rspamd_cryptobox_HASHBYTES];
+
+	if (sc != NULL) {
+		rspamd_stat_shared_tokens_key (task, key);
+
+		if (rspamd_stat_shared_tokens_lookup (sc, task, key,
+				st_ctx->statfiles->len)) {
+			msg_debug_task ("reuse %ud tokens of a message tokenized before",
+					task->tokens->len);
+			rspamd_stat_tokens_alloc_values (task->tokens);
+
+			return;
+		}
+	}
 
 	for (i = 0; i < task->text_parts->len; i++) {
 		part = g_ptr_array_index (task->text_parts, i);
@@ -262,9 +373,9 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 		reserved_len += 5;
 	}
 
-	task->tokens = g_ptr_array_sized_new (reserved_len);
-	rspamd_mempool_add_destructor (task->task_pool,
-			rspamd_ptr_array_free_hard, task->tokens);
+	/* OSB produces window_size - 1 tokens per word, 4 by default */
+	task->tokens = rspamd_stat_tokens_new (task->task_pool, reserved_len * 4,
+			st_ctx->statfiles->len);
 	pdiff = rspamd_mempool_get_variable (task->task_pool, "parts_distance");
 
 	for (i = 0; i < task->text_parts->len; i ++) {
@@ -311,6 +422,12 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 	}
 
 	rspamd_stat_tokenize_parts_metadata (st_ctx, task);
+
+	if (sc != NULL && task->tokens->len <= RSPAMD_STAT_SHARED_MAX_TOKENS) {
+		rspamd_stat_shared_tokens_insert (sc, task, key);
+	}
+
+	rspamd_stat_tokens_alloc_values (task->tokens);
 }
 
 static void
@@ -909,7 +1026,7 @@ rspamd_stat_backends_post_learn (struct rspamd_stat_ctx *st_ctx,
 		}
 	}
 
-	g_atomic_int_add (&task->worker->srv->stat->messages_learned, 1);
+	rspamd_main_counter_add (task->worker->srv, RSPAMD_COUNTER_LEARNED, 1);
 
 	return res;
 }
@@ -1035,7 +1152,7 @@ rspamd_stat_check_autolearn (struct rspamd_task *task)
 					 * - We learn spam if action is ACTION_REJECT
 					 * - We learn ham if score is less than zero
 					 */
-					mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+					mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 
 					if (mres) {
 
@@ -1078,7 +1195,7 @@ rspamd_stat_check_autolearn (struct rspamd_task *task)
 						spam_score = t;
 					}
 
-					mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+					mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 
 					if (mres) {
 						if (mres->score >= spam_score) {
@@ -1243,3 +1360,319 @@ rspamd_stat_statistics (struct rspamd_task *task,
 
 	return RSPAMD_STAT_PROCESS_OK;
 }
+
+/* Open addressing table of token hash -> increment */
+struct rspamd_stat_bulk_table {
+	guint64 *hashes;
+	gint32 *deltas;
+	gsize size;
+	gsize nelts;
+	gint32 zero_delta;
+	gboolean has_zero;
+};
+
+struct rspamd_stat_bulk {
+	gchar *classifier;
+	struct rspamd_stat_bulk_table classes[2]; /* ham and spam */
+	guint nmessages[2];
+};
+
+#define STAT_BULK_MIN_SIZE 4096
+
+static void
+rspamd_stat_bulk_table_reset (struct rspamd_stat_bulk_table *tbl)
+{
+	g_free (tbl->hashes);
+	g_free (tbl->deltas);
+	memset (tbl, 0, sizeof (*tbl));
+}
+
+static void rspamd_stat_bulk_table_inc (struct rspamd_stat_bulk_table *tbl,
+		guint64 h, gint32 delta);
+
+static void
+rspamd_stat_bulk_table_grow (struct rspamd_stat_bulk_table *tbl)
+{
+	struct rspamd_stat_bulk_table ntbl;
+	gsize i;
+
+	memset (&ntbl, 0, sizeof (ntbl));
+	ntbl.size = tbl->size ? tbl->size * 2 : STAT_BULK_MIN_SIZE;
+	ntbl.hashes = g_malloc0 (ntbl.size * sizeof (*ntbl.hashes));
+	ntbl.deltas = g_malloc (ntbl.size * sizeof (*ntbl.deltas));
+	ntbl.zero_delta = tbl->zero_delta;
+	ntbl.has_zero = tbl->has_zero;
+
+	for (i = 0; i < tbl->size; i ++) {
+		if (tbl->hashes[i] != 0) {
+			rspamd_stat_bulk_table_inc (&ntbl, tbl->hashes[i], tbl->deltas[i]);
+		}
+	}
+
+	g_free (tbl->hashes);
+	g_free (tbl->deltas);
+	memcpy (tbl, &ntbl, sizeof (*tbl));
+}
+
+static void
+rspamd_stat_bulk_table_inc (struct rspamd_stat_bulk_table *tbl,
+		guint64 h, gint32 delta)
+{
+	gsize i;
+
+	if (h == 0) {
+		/* Zero marks empty slots */
+		tbl->zero_delta += delta;
+		tbl->has_zero = TRUE;
+
+		return;
+	}
+
+	if ((tbl->nelts + 1) * 4 > tbl->size * 3) {
+		rspamd_stat_bulk_table_grow (tbl);
+	}
+
+	/* Token hashes are uniform already */
+	i = h & (tbl->size - 1);
+
+	while (tbl->hashes[i] != 0 && tbl->hashes[i] != h) {
+		i = (i + 1) & (tbl->size - 1);
+	}
+
+	if (tbl->hashes[i] == 0) {
+		tbl->hashes[i] = h;
+		tbl->deltas[i] = delta;
+		tbl->nelts ++;
+	}
+	else {
+		tbl->deltas[i] += delta;
+	}
+}
+
+static gint
+rspamd_stat_bulk_hash_cmp (gconstpointer a, gconstpointer b)
+{
+	guint64 h1 = *(const guint64 *)a, h2 = *(const guint64 *)b;
+
+	return h1 < h2 ? -1 : (h1 > h2 ? 1 : 0);
+}
+
+struct rspamd_stat_bulk *
+rspamd_stat_bulk_new (const gchar *classifier)
+{
+	struct rspamd_stat_bulk *bulk;
+
+	bulk = g_malloc0 (sizeof (*bulk));
+	bulk->classifier = g_strdup (classifier);
+
+	return bulk;
+}
+
+gboolean
+rspamd_stat_bulk_add (struct rspamd_stat_bulk *bulk,
+		struct rspamd_task *task, gboolean spam, GError **err)
+{
+	struct rspamd_stat_ctx *st_ctx;
+	struct rspamd_classifier *cl;
+	struct rspamd_stat_bulk_table *tbl;
+	guint64 *hashes;
+	guint i, ntokens;
+	gboolean accepted = FALSE;
+
+	st_ctx = rspamd_stat_get_ctx ();
+	g_assert (st_ctx != NULL);
+
+	if (task->tokens == NULL) {
+		rspamd_stat_process_tokenize (st_ctx, task);
+	}
+
+	ntokens = task->tokens->len;
+
+	for (i = 0; i < st_ctx->classifiers->len; i ++) {
+		cl = g_ptr_array_index (st_ctx->classifiers, i);
+
+		if (bulk->classifier != NULL && (cl->cfg->name == NULL ||
+				g_ascii_strcasecmp (bulk->classifier, cl->cfg->name) != 0)) {
+			continue;
+		}
+
+		if ((cl->cfg->min_tokens > 0 && ntokens < cl->cfg->min_tokens) ||
+				(cl->cfg->max_tokens > 0 && ntokens > cl->cfg->max_tokens)) {
+			continue;
+		}
+
+		accepted = TRUE;
+	}
+
+	if (!accepted) {
+		g_set_error (err, rspamd_stat_quark (), 400,
+				"<%s> has inappropriate number of tokens: %ud",
+				task->message_id, ntokens);
+
+		return FALSE;
+	}
+
+	/* A message increments each of its tokens once, like a normal learn */
+	hashes = g_memdup (task->tokens->hashes, ntokens * sizeof (*hashes));
+	qsort (hashes, ntokens, sizeof (*hashes), rspamd_stat_bulk_hash_cmp);
+	tbl = &bulk->classes[spam ? 1 : 0];
+
+	for (i = 0; i < ntokens; i ++) {
+		if (i > 0 && hashes[i] == hashes[i - 1]) {
+			continue;
+		}
+
+		rspamd_stat_bulk_table_inc (tbl, hashes[i], 1);
+	}
+
+	g_free (hashes);
+	bulk->nmessages[spam ? 1 : 0] ++;
+
+	return TRUE;
+}
+
+guint
+rspamd_stat_bulk_pending (struct rspamd_stat_bulk *bulk)
+{
+	return bulk->nmessages[0] + bulk->nmessages[1];
+}
+
+static gboolean
+rspamd_stat_bulk_flush_class (struct rspamd_stat_ctx *st_ctx,
+		struct rspamd_stat_bulk *bulk,
+		struct rspamd_task *task,
+		gboolean spam,
+		GError **err)
+{
+	struct rspamd_stat_bulk_table *tbl = &bulk->classes[spam ? 1 : 0];
+	struct rspamd_classifier *cl;
+	struct rspamd_statfile *st;
+	struct rspamd_stat_tokens *tokens;
+	gint32 *deltas;
+	gfloat *values;
+	gpointer bk_run;
+	guint i, j, k, n;
+	gint id;
+
+	tokens = rspamd_stat_tokens_new (task->task_pool, tbl->nelts + 1,
+			st_ctx->statfiles->len);
+	deltas = rspamd_mempool_alloc (task->task_pool,
+			(tbl->nelts + 1) * sizeof (*deltas));
+
+	for (i = 0, n = 0; i < tbl->size; i ++) {
+		if (tbl->hashes[i] != 0) {
+			rspamd_stat_tokens_add (tokens, tbl->hashes[i], 0, 0, NULL, NULL);
+			deltas[n ++] = tbl->deltas[i];
+		}
+	}
+
+	if (tbl->has_zero) {
+		rspamd_stat_tokens_add (tokens, 0, 0, 0, NULL, NULL);
+		deltas[n ++] = tbl->zero_delta;
+	}
+
+	rspamd_stat_tokens_alloc_values (tokens);
+	task->tokens = tokens;
+
+	for (i = 0; i < st_ctx->classifiers->len; i ++) {
+		cl = g_ptr_array_index (st_ctx->classifiers, i);
+
+		if (bulk->classifier != NULL && (cl->cfg->name == NULL ||
+				g_ascii_strcasecmp (bulk->classifier, cl->cfg->name) != 0)) {
+			continue;
+		}
+
+		if (cl->cfg->flags & RSPAMD_FLAG_CLASSIFIER_NO_BACKEND) {
+			continue;
+		}
+
+		for (j = 0; j < cl->statfiles_ids->len; j ++) {
+			id = g_array_index (cl->statfiles_ids, gint, j);
+			st = g_ptr_array_index (st_ctx->statfiles, id);
+
+			if (!!spam != !!st->stcf->is_spam) {
+				continue;
+			}
+
+			bk_run = st->backend->runtime (task, st->stcf, TRUE, st->bkcf);
+
+			if (bk_run == NULL) {
+				g_set_error (err, rspamd_stat_quark (), 500,
+						"cannot init backend %s for statfile %s",
+						st->backend->name, st->stcf->symbol);
+
+				return FALSE;
+			}
+
+			values = RSPAMD_TOKEN_VALUES (tokens, id);
+
+			if (!(cl->cfg->flags & RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND)) {
+				/* We need current values to write absolute ones */
+				st->backend->process_tokens (task, tokens, id, bk_run);
+			}
+
+			for (k = 0; k < n; k ++) {
+				values[k] = MAX (values[k] + deltas[k], 0);
+			}
+
+			if (!st->backend->learn_tokens (task, tokens, id, bk_run)) {
+				g_set_error (err, rspamd_stat_quark (), 500, "Cannot push "
+						"learned results to the backend");
+
+				return FALSE;
+			}
+
+			for (k = 0; k < bulk->nmessages[spam ? 1 : 0]; k ++) {
+				st->backend->inc_learns (task, bk_run, st_ctx);
+			}
+
+			st->backend->finalize_learn (task, bk_run, st_ctx);
+			msg_info_task ("learned %ud messages with %ud tokens as %s to %s",
+					bulk->nmessages[spam ? 1 : 0], n,
+					spam ? "spam" : "ham", st->stcf->symbol);
+		}
+	}
+
+	return TRUE;
+}
+
+rspamd_stat_result_t
+rspamd_stat_bulk_flush (struct rspamd_stat_bulk *bulk,
+		struct rspamd_task *task, GError **err)
+{
+	struct rspamd_stat_ctx *st_ctx;
+	rspamd_stat_result_t ret = RSPAMD_STAT_PROCESS_OK;
+	guint i;
+
+	st_ctx = rspamd_stat_get_ctx ();
+	g_assert (st_ctx != NULL);
+
+	for (i = 0; i < G_N_ELEMENTS (bulk->classes); i ++) {
+		if (bulk->nmessages[i] > 0 && ret == RSPAMD_STAT_PROCESS_OK) {
+			if (!rspamd_stat_bulk_flush_class (st_ctx, bulk, task, i == 1,
+					err)) {
+				ret = RSPAMD_STAT_PROCESS_ERROR;
+			}
+		}
+
+		rspamd_stat_bulk_table_reset (&bulk->classes[i]);
+		bulk->nmessages[i] = 0;
+	}
+
+	return ret;
+}
+
+void
+rspamd_stat_bulk_destroy (struct rspamd_stat_bulk *bulk)
+{
+	guint i;
+
+	if (bulk) {
+		for (i = 0; i < G_N_ELEMENTS (bulk->classes); i ++) {
+			rspamd_stat_bulk_table_reset (&bulk->classes[i]);
+		}
+
+		g_free (bulk->classifier);
+		g_free (bulk);
+	}
+}
@@ -19,6 +19,15 @@
 
 #include "tokenizers.h"
 #include "stat_internal.h"
+#include "cryptobox.h"
+#include "platform_config.h"
+
+#if defined(RSPAMD_HAS_TARGET_ATTR) && defined(HAVE_AVX2)
+#define RSPAMD_OSB_AVX2 1
+#include <immintrin.h>
+#endif
+
+extern unsigned long cpu_config;
 
 /* Size for features pipe */
 #define DEFAULT_FEATURE_WINDOW_SIZE 5
@@ -257,22 +266,77 @@ struct token_pipe_entry {
 	rspamd_stat_token_t *t;
 };
 
+#ifdef RSPAMD_OSB_AVX2
+static void rspamd_osb_combine_avx2 (const struct token_pipe_entry *hashpipe,
+		guint nelts, guint64 *out) __attribute__((__target__("avx2")));
+
+/*
+ * Computes hashpipe[0] * primes[0] + hashpipe[i] * primes[i * 2] for
+ * i in [1, nelts) four combinations per iteration
+ */
+static void
+rspamd_osb_combine_avx2 (const struct token_pipe_entry *hashpipe,
+		guint nelts, guint64 *out)
+{
+	__m256i h0, hv, mv, lo, cross;
+	guint i;
+
+	h0 = _mm256_set1_epi64x (hashpipe[0].h * primes[0]);
+
+	for (i = 1; i + 3 < nelts; i += 4) {
+		hv = _mm256_set_epi64x (hashpipe[i + 3].h, hashpipe[i + 2].h,
+				hashpipe[i + 1].h, hashpipe[i].h);
+		mv = _mm256_set_epi64x (primes[(i + 3) << 1], primes[(i + 2) << 1],
+				primes[(i + 1) << 1], primes[i << 1]);
+		/* There is no 64 bit multiplication, so combine 32 bit halves */
+		lo = _mm256_mul_epu32 (hv, mv);
+		cross = _mm256_add_epi64 (
+				_mm256_mul_epu32 (_mm256_srli_epi64 (hv, 32), mv),
+				_mm256_mul_epu32 (hv, _mm256_srli_epi64 (mv, 32)));
+		lo = _mm256_add_epi64 (lo, _mm256_slli_epi64 (cross, 32));
+		_mm256_storeu_si256 ((__m256i *)&out[i - 1],
+				_mm256_add_epi64 (lo, h0));
+	}
+
+	for (; i < nelts; i ++) {
+		out[i - 1] = hashpipe[0].h * primes[0] + hashpipe[i].h * primes[i << 1];
+	}
+}
+#endif
+
+static inline void
+rspamd_osb_combine (const struct token_pipe_entry *hashpipe,
+		guint nelts, gboolean vectorized, guint64 *out)
+{
+	guint i;
+
+#ifdef RSPAMD_OSB_AVX2
+	if (vectorized) {
+		rspamd_osb_combine_avx2 (hashpipe, nelts, out);
+		return;
+	}
+#endif
+
+	for (i = 1; i < nelts; i ++) {
+		out[i - 1] = hashpipe[0].h * primes[0] + hashpipe[i].h * primes[i << 1];
+	}
+}
+
 gint
 rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		rspamd_mempool_t *pool,
 		GArray *words,
 		gboolean is_utf,
 		const gchar *prefix,
-		GPtrArray *result)
+		struct rspamd_stat_tokens *result)
 {
-	rspamd_token_t *new_tok = NULL;
 	rspamd_stat_token_t *token;
 	struct rspamd_osb_tokenizer_config *osb_cf;
-	guint64 cur, seed;
+	guint64 cur, seed, th, *combined;
 	struct token_pipe_entry *hashpipe;
 	guint32 h1, h2;
-	gsize token_size;
 	guint processed = 0, i, w, window_size, token_flags = 0;
+	gboolean vectorized = FALSE;
 
 	if (words == NULL) {
 		return FALSE;
@@ -291,9 +355,11 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 
 	hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
 	memset (hashpipe, 0xfe, window_size * sizeof (hashpipe[0]));
-	token_size = sizeof (rspamd_token_t) +
-			sizeof (gdouble) * ctx->statfiles->len;
-	g_assert (token_size > 0);
+	combined = g_alloca (window_size * sizeof (combined[0]));
+
+#ifdef RSPAMD_OSB_AVX2
+	vectorized = (cpu_config & CPUID_AVX2) && window_size > 4;
+#endif
 
 	for (w = 0; w < words->len; w ++) {
 		token = &g_array_index (words, rspamd_stat_token_t, w);
@@ -323,25 +389,19 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		}
 
 #define ADD_TOKEN do {\
-    new_tok = rspamd_mempool_alloc0 (pool, token_size); \
-    new_tok->datalen = sizeof (gint64); \
-    new_tok->flags = token_flags; \
-    new_tok->t1 = hashpipe[0].t; \
-    new_tok->t2 = hashpipe[i].t; \
     if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) { \
         h1 = ((guint32)hashpipe[0].h) * primes[0] + \
             ((guint32)hashpipe[i].h) * primes[i << 1]; \
         h2 = ((guint32)hashpipe[0].h) * primes[1] + \
             ((guint32)hashpipe[i].h) * primes[(i << 1) - 1]; \
-        memcpy(new_tok->data, &h1, sizeof (h1)); \
-        memcpy(new_tok->data + sizeof (h1), &h2, sizeof (h2)); \
+        memcpy ((guchar *)&th, &h1, sizeof (h1)); \
+        memcpy ((guchar *)&th + sizeof (h1), &h2, sizeof (h2)); \
     } \
     else { \
-        cur = hashpipe[0].h * primes[0] + hashpipe[i].h * primes[i << 1]; \
-        memcpy (new_tok->data, &cur, sizeof (cur)); \
+        th = combined[i - 1]; \
     } \
-    new_tok->window_idx = i + 1; \
-    g_ptr_array_add (result, new_tok); \
+    rspamd_stat_tokens_add (result, th, i + 1, token_flags, \
+        hashpipe[0].t, hashpipe[i].t); \
   } while(0)
 
 		if (processed < window_size) {
@@ -360,6 +420,11 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 
 			processed++;
 
+			if (osb_cf->ht != RSPAMD_OSB_HASH_COMPAT) {
+				rspamd_osb_combine (hashpipe, window_size, vectorized,
+						combined);
+			}
+
 			for (i = 1; i < window_size; i++) {
 				ADD_TOKEN;
 			}
@@ -370,6 +435,10 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		memmove (hashpipe, &hashpipe[window_size - processed + 1],
 				processed * sizeof (hashpipe[0]));
 
+		if (osb_cf->ht != RSPAMD_OSB_HASH_COMPAT) {
+			rspamd_osb_combine (hashpipe, processed, vectorized, combined);
+		}
+
 		for (i = 1; i < processed; i++) {
 			ADD_TOKEN;
 		}
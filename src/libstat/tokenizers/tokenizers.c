@@ -57,16 +57,75 @@ const gchar t_delimiters[255] = {
 	0, 0, 0, 0, 0
 };
 
-gint
-token_node_compare_func (gconstpointer a, gconstpointer b)
+struct rspamd_stat_tokens *
+rspamd_stat_tokens_new (rspamd_mempool_t *pool, guint reserved, guint nvalues)
 {
-	const rspamd_token_t *aa = a, *bb = b;
+	struct rspamd_stat_tokens *tokens;
+
+	tokens = rspamd_mempool_alloc0 (pool, sizeof (*tokens));
+	tokens->pool = pool;
+	tokens->nvalues = nvalues;
+	tokens->allocated = MAX (reserved, 16);
+	tokens->hashes = rspamd_mempool_alloc (pool,
+			sizeof (*tokens->hashes) * tokens->allocated);
+	tokens->window_idx = rspamd_mempool_alloc (pool,
+			sizeof (*tokens->window_idx) * tokens->allocated);
+	tokens->flags = rspamd_mempool_alloc (pool,
+			sizeof (*tokens->flags) * tokens->allocated);
+	tokens->t1 = rspamd_mempool_alloc (pool,
+			sizeof (*tokens->t1) * tokens->allocated);
+	tokens->t2 = rspamd_mempool_alloc (pool,
+			sizeof (*tokens->t2) * tokens->allocated);
+
+	return tokens;
+}
 
-	if (aa->datalen != bb->datalen) {
-		return aa->datalen - bb->datalen;
+#define TOKENS_GROW(tokens, field, nlen) do { \
+	gpointer _n = rspamd_mempool_alloc ((tokens)->pool, \
+			sizeof (*(tokens)->field) * (nlen)); \
+	memcpy (_n, (tokens)->field, sizeof (*(tokens)->field) * (tokens)->len); \
+	(tokens)->field = _n; \
+} while (0)
+
+void
+rspamd_stat_tokens_add (struct rspamd_stat_tokens *tokens,
+		guint64 hash, guint window_idx, guint flags,
+		rspamd_stat_token_t *t1, rspamd_stat_token_t *t2)
+{
+	guint nlen;
+
+	/* Values columns are laid out using the current capacity */
+	g_assert (tokens->values == NULL);
+
+	if (tokens->len == tokens->allocated) {
+		/* Old arrays are released with the pool */
+		nlen = tokens->allocated * 2;
+		TOKENS_GROW (tokens, hashes, nlen);
+		TOKENS_GROW (tokens, window_idx, nlen);
+		TOKENS_GROW (tokens, flags, nlen);
+		TOKENS_GROW (tokens, t1, nlen);
+		TOKENS_GROW (tokens, t2, nlen);
+		tokens->allocated = nlen;
 	}
 
-	return memcmp (aa->data, bb->data, aa->datalen);
+	tokens->hashes[tokens->len] = hash;
+	tokens->window_idx[tokens->len] = window_idx;
+	tokens->flags[tokens->len] = flags;
+	tokens->t1[tokens->len] = t1;
+	tokens->t2[tokens->len] = t2;
+	tokens->len ++;
+}
+
+#undef TOKENS_GROW
+
+void
+rspamd_stat_tokens_alloc_values (struct rspamd_stat_tokens *tokens)
+{
+	g_assert (tokens->values == NULL);
+
+	tokens->values = rspamd_mempool_alloc0 (tokens->pool,
+			sizeof (*tokens->values) * tokens->allocated *
+			MAX (tokens->nvalues, 1));
 }
 
 /* Get next word from specified f_str_t buf */
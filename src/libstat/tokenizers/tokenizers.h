@@ -12,6 +12,28 @@
 struct rspamd_tokenizer_runtime;
 struct rspamd_stat_ctx;
 
+/*
+ * Statistical tokens stored as a struct of arrays: hashes, positions and
+ * flags are filled by a tokenizer, whilst values are allocated once after
+ * tokenization as a separate column per statfile
+ */
+struct rspamd_stat_tokens {
+	guint64 *hashes;
+	guint *window_idx;
+	guint *flags;
+	rspamd_stat_token_t **t1;
+	rspamd_stat_token_t **t2;
+	gfloat *values;
+	guint len;
+	guint allocated;
+	guint nvalues;
+	rspamd_mempool_t *pool;
+};
+
+/* Column of values for statfile `id` */
+#define RSPAMD_TOKEN_VALUES(tokens, id) \
+	((tokens)->values + (gsize)(id) * (tokens)->allocated)
+
 /* Common tokenizer structure */
 struct rspamd_stat_tokenizer {
 	gchar *name;
@@ -22,11 +44,20 @@ struct rspamd_stat_tokenizer {
 			GArray *words,
 			gboolean is_utf,
 			const gchar *prefix,
-			GPtrArray *result);
+			struct rspamd_stat_tokens *result);
 };
 
-/* Compare two token nodes */
-gint token_node_compare_func (gconstpointer a, gconstpointer b);
+/* Create tokens block with space for `reserved` tokens in the pool */
+struct rspamd_stat_tokens * rspamd_stat_tokens_new (rspamd_mempool_t *pool,
+		guint reserved, guint nvalues);
+
+/* Append token growing arrays if needed */
+void rspamd_stat_tokens_add (struct rspamd_stat_tokens *tokens,
+		guint64 hash, guint window_idx, guint flags,
+		rspamd_stat_token_t *t1, rspamd_stat_token_t *t2);
+
+/* Allocate zeroed values for all statfiles, must be called after tokenization */
+void rspamd_stat_tokens_alloc_values (struct rspamd_stat_tokens *tokens);
 
 
 /* Tokenize text into array of words (rspamd_stat_token_t type) */
@@ -40,7 +71,7 @@ gint rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		GArray *words,
 		gboolean is_utf,
 		const gchar *prefix,
-		GPtrArray *result);
+		struct rspamd_stat_tokens *result);
 
 gpointer rspamd_tokenizer_osb_get_config (rspamd_mempool_t *pool,
 		struct rspamd_tokenizer_config *cf,
@@ -988,6 +988,14 @@ rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 
 	(void)setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof (gint));
 
+#ifdef SO_REUSEPORT
+	if (type == SOCK_DGRAM) {
+		/* Allow workers to bind their own sockets to the same address */
+		(void)setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&on,
+				sizeof (gint));
+	}
+#endif
+
 #ifdef HAVE_IPV6_V6ONLY
 	if (addr->af == AF_INET6) {
 		/* We need to set this flag to avoid errors */
@@ -1041,6 +1049,25 @@ rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 	return fd;
 }
 
+static rspamd_inet_addr_t *
+rspamd_inet_address_from_su (const union sa_union *su, socklen_t slen)
+{
+	rspamd_inet_addr_t *addr;
+
+	addr = rspamd_inet_addr_create (su->sa.sa_family);
+	addr->slen = slen;
+
+	if (addr->af == AF_UNIX) {
+		addr->u.un = g_slice_alloc (sizeof (*addr->u.un));
+		memcpy (&addr->u.un->addr, &su->su, sizeof (struct sockaddr_un));
+	}
+	else {
+		memcpy (&addr->u.in.addr, &su->sa, MIN (slen, sizeof (addr->u.in.addr)));
+	}
+
+	return addr;
+}
+
 gssize
 rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 		rspamd_inet_addr_t **target)
@@ -1048,7 +1075,6 @@ rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 	gssize ret;
 	union sa_union su;
 	socklen_t slen = sizeof (su);
-	rspamd_inet_addr_t *addr = NULL;
 
 	if ((ret = recvfrom (fd, buf, len, fl, &su.sa, &slen)) == -1) {
 		if (target) {
@@ -1059,21 +1085,59 @@ rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 	}
 
 	if (target) {
-		addr = rspamd_inet_addr_create (su.sa.sa_family);
-		addr->slen = slen;
+		*target = rspamd_inet_address_from_su (&su, slen);
+	}
 
-		if (addr->af == AF_UNIX) {
-			addr->u.un = g_slice_alloc (sizeof (*addr->u.un));
-			memcpy (&addr->u.un->addr, &su.su, sizeof (struct sockaddr_un));
-		}
-		else {
-			memcpy (&addr->u.in.addr, &su.sa, MIN (slen, sizeof (addr->u.in.addr)));
+	return (ret);
+}
+
+gint
+rspamd_inet_address_recvmmsg (gint fd, struct iovec *iov, gsize *lens,
+		guint n, gint fl, rspamd_inet_addr_t **targets)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[RSPAMD_INET_ADDRESS_MMSG_MAX];
+	union sa_union su[RSPAMD_INET_ADDRESS_MMSG_MAX];
+	gint ret, i;
+
+	g_assert (n <= RSPAMD_INET_ADDRESS_MMSG_MAX);
+	memset (msgs, 0, sizeof (*msgs) * n);
+
+	for (i = 0; i < (gint)n; i ++) {
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &su[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof (su[i]);
+	}
+
+	if ((ret = recvmmsg (fd, msgs, n, fl, NULL)) == -1) {
+		return -1;
+	}
+
+	for (i = 0; i < ret; i ++) {
+		lens[i] = msgs[i].msg_len;
+		targets[i] = rspamd_inet_address_from_su (&su[i],
+				msgs[i].msg_hdr.msg_namelen);
+	}
+
+	return ret;
+#else
+	gssize r;
+	guint i;
+
+	for (i = 0; i < n; i ++) {
+		r = rspamd_inet_address_recvfrom (fd, iov[i].iov_base, iov[i].iov_len,
+				fl, &targets[i]);
+
+		if (r == -1) {
+			return i > 0 ? (gint)i : -1;
 		}
 
-		*target = addr;
+		lens[i] = r;
 	}
 
-	return (ret);
+	return n;
+#endif
 }
 
 gssize
@@ -1099,6 +1163,46 @@ rspamd_inet_address_sendto (gint fd, const void *buf, gsize len, gint fl,
 	return r;
 }
 
+gint
+rspamd_inet_address_sendmmsg (gint fd, struct iovec *iov,
+		rspamd_inet_addr_t **addrs, guint n, gint fl)
+{
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[RSPAMD_INET_ADDRESS_MMSG_MAX];
+	guint i;
+
+	g_assert (n <= RSPAMD_INET_ADDRESS_MMSG_MAX);
+	memset (msgs, 0, sizeof (*msgs) * n);
+
+	for (i = 0; i < n; i ++) {
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+
+		if (addrs[i]->af == AF_UNIX) {
+			msgs[i].msg_hdr.msg_name = &addrs[i]->u.un->addr;
+		}
+		else {
+			msgs[i].msg_hdr.msg_name = &addrs[i]->u.in.addr.sa;
+		}
+
+		msgs[i].msg_hdr.msg_namelen = addrs[i]->slen;
+	}
+
+	return sendmmsg (fd, msgs, n, fl);
+#else
+	guint i;
+
+	for (i = 0; i < n; i ++) {
+		if (rspamd_inet_address_sendto (fd, iov[i].iov_base, iov[i].iov_len,
+				fl, addrs[i]) == -1) {
+			return i > 0 ? (gint)i : -1;
+		}
+	}
+
+	return n;
+#endif
+}
+
 static gboolean
 rspamd_check_port_priority (const char *line, guint default_port,
 		guint *priority, gchar *out,
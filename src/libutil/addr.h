@@ -159,6 +159,21 @@ guchar * rspamd_inet_address_get_hash_key (const rspamd_inet_addr_t *addr, guint
 gssize rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 		rspamd_inet_addr_t **target);
 
+#define RSPAMD_INET_ADDRESS_MMSG_MAX 64
+
+/**
+ * Receive up to `n` datagrams from an unconnected socket using recvmmsg(2)
+ * if available and a loop of recvfrom(2) otherwise
+ * @param fd
+ * @param iov array of `n` buffers
+ * @param lens output lengths of the received datagrams
+ * @param n number of buffers, at most RSPAMD_INET_ADDRESS_MMSG_MAX
+ * @param targets output source addresses, must be destroyed by caller
+ * @return number of datagrams received or -1 on error
+ */
+gint rspamd_inet_address_recvmmsg (gint fd, struct iovec *iov, gsize *lens,
+		guint n, gint fl, rspamd_inet_addr_t **targets);
+
 /**
  * Send data via unconnected socket using the specified inet_addr structure
  * @param fd
@@ -170,6 +185,17 @@ gssize rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 gssize rspamd_inet_address_sendto (gint fd, const void *buf, gsize len, gint fl,
 		const rspamd_inet_addr_t *addr);
 
+/**
+ * Send `n` datagrams via unconnected socket using sendmmsg(2) if available
+ * @param fd
+ * @param iov array of `n` buffers
+ * @param addrs array of `n` destination addresses
+ * @param n number of datagrams, at most RSPAMD_INET_ADDRESS_MMSG_MAX
+ * @return number of datagrams sent or -1 on error
+ */
+gint rspamd_inet_address_sendmmsg (gint fd, struct iovec *iov,
+		rspamd_inet_addr_t **addrs, guint n, gint fl);
+
 /**
  * Set port for inet address
  */
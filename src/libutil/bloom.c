@@ -16,6 +16,14 @@
 #include "config.h"
 #include "bloom.h"
 #include "cryptobox.h"
+#include "util.h"
+#include "ref.h"
+#include "ottery.h"
+#include <sys/mman.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* 4 bits are used for counting (implementing delete operation) */
 #define SIZE_BIT 4
@@ -156,3 +164,367 @@ rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s)
 
 	return TRUE;
 }
+
+#define RSPAMD_BLOOM_BLOCKED_MAGIC "rbloomb1"
+#define RSPAMD_BLOOM_BLOCKED_BOM 0x01020304U
+#define RSPAMD_BLOOM_BLOCK_SIZE 64
+#define RSPAMD_BLOOM_BLOCK_BITS (RSPAMD_BLOOM_BLOCK_SIZE * NBBY)
+#define RSPAMD_BLOOM_BLOCK_WORDS (RSPAMD_BLOOM_BLOCK_SIZE / sizeof (guint64))
+#define RSPAMD_BLOOM_BLOCKED_MAX_FUNCS 16
+
+/* Header occupies exactly one block so blocks are aligned in mapped files */
+struct rspamd_bloom_blocked_header {
+	guchar magic[8];
+	guint32 bom;
+	guint32 nfuncs;
+	guint64 nblocks;
+	guint64 seed;
+	guint64 nelts;
+	guchar reserved[24];
+};
+
+struct rspamd_bloom_blocked {
+	guchar *data;
+	gsize len;
+	struct rspamd_bloom_blocked_header *hdr;
+	guint64 *blocks;
+	gboolean mapped;
+	ref_entry_t ref;
+};
+
+static GQuark
+rspamd_bloom_blocked_quark (void)
+{
+	return g_quark_from_static_string ("bloom-blocked");
+}
+
+static void
+rspamd_bloom_blocked_dtor (struct rspamd_bloom_blocked *bb)
+{
+	if (bb->data) {
+		if (bb->mapped) {
+			munmap (bb->data, bb->len);
+		}
+		else {
+			free (bb->data);
+		}
+	}
+
+	g_slice_free1 (sizeof (*bb), bb);
+}
+
+static guchar *
+rspamd_bloom_blocked_alloc (gsize len)
+{
+	void *p;
+
+	if (posix_memalign (&p, RSPAMD_BLOOM_BLOCK_SIZE, len) != 0) {
+		g_error ("cannot allocate %" G_GSIZE_FORMAT " bytes for bloom filter",
+				len);
+	}
+
+	return p;
+}
+
+struct rspamd_bloom_blocked *
+rspamd_bloom_blocked_new (gsize nelts, gdouble fp_rate)
+{
+	struct rspamd_bloom_blocked *bb;
+	gdouble nbits;
+	guint64 nblocks;
+	guint nfuncs;
+
+	if (nelts == 0) {
+		nelts = 1;
+	}
+
+	if (fp_rate <= 0 || fp_rate >= 1) {
+		fp_rate = 0.01;
+	}
+
+	/*
+	 * Blocked filters have slightly worse rate than classic ones with the
+	 * same size, so add some space to compensate it
+	 */
+	nbits = -(gdouble)nelts * log (fp_rate) / (M_LN2 * M_LN2) * 1.2;
+	nfuncs = ceil (nbits / nelts * M_LN2 / 1.2);
+	nfuncs = CLAMP (nfuncs, 1, RSPAMD_BLOOM_BLOCKED_MAX_FUNCS);
+	nblocks = ceil (nbits / RSPAMD_BLOOM_BLOCK_BITS);
+
+	if (nblocks == 0) {
+		nblocks = 1;
+	}
+
+	bb = g_slice_alloc0 (sizeof (*bb));
+	bb->len = sizeof (*bb->hdr) + nblocks * RSPAMD_BLOOM_BLOCK_SIZE;
+	bb->data = rspamd_bloom_blocked_alloc (bb->len);
+	memset (bb->data, 0, bb->len);
+	bb->hdr = (struct rspamd_bloom_blocked_header *)bb->data;
+	bb->blocks = (guint64 *)(bb->data + sizeof (*bb->hdr));
+
+	memcpy (bb->hdr->magic, RSPAMD_BLOOM_BLOCKED_MAGIC,
+			sizeof (bb->hdr->magic));
+	bb->hdr->bom = RSPAMD_BLOOM_BLOCKED_BOM;
+	bb->hdr->nfuncs = nfuncs;
+	bb->hdr->nblocks = nblocks;
+	bb->hdr->seed = ottery_rand_uint64 ();
+	REF_INIT_RETAIN (bb, rspamd_bloom_blocked_dtor);
+
+	return bb;
+}
+
+static gboolean
+rspamd_bloom_blocked_load (struct rspamd_bloom_blocked *bb, GError **err)
+{
+	struct rspamd_bloom_blocked_header *hdr;
+
+	if (bb->len < sizeof (*hdr) ||
+			memcmp (bb->data, RSPAMD_BLOOM_BLOCKED_MAGIC,
+					sizeof (hdr->magic)) != 0) {
+		g_set_error (err, rspamd_bloom_blocked_quark (), EINVAL, "bad magic");
+		return FALSE;
+	}
+
+	hdr = (struct rspamd_bloom_blocked_header *)bb->data;
+
+	if (hdr->bom != RSPAMD_BLOOM_BLOCKED_BOM) {
+		g_set_error (err, rspamd_bloom_blocked_quark (), EINVAL,
+				"filter has been written for a different byte order");
+		return FALSE;
+	}
+
+	if (hdr->nfuncs == 0 || hdr->nfuncs > RSPAMD_BLOOM_BLOCKED_MAX_FUNCS ||
+			hdr->nblocks == 0 ||
+			hdr->nblocks > (bb->len - sizeof (*hdr)) / RSPAMD_BLOOM_BLOCK_SIZE) {
+		g_set_error (err, rspamd_bloom_blocked_quark (), EINVAL,
+				"truncated filter");
+		return FALSE;
+	}
+
+	bb->hdr = hdr;
+	bb->blocks = (guint64 *)(bb->data + sizeof (*hdr));
+
+	return TRUE;
+}
+
+struct rspamd_bloom_blocked *
+rspamd_bloom_blocked_open (const gchar *fname, GError **err)
+{
+	struct rspamd_bloom_blocked *bb;
+	gsize len;
+	guchar *data;
+
+	data = rspamd_file_xmap (fname, PROT_READ, &len);
+
+	if (data == NULL) {
+		g_set_error (err, rspamd_bloom_blocked_quark (), errno,
+				"cannot map %s: %s", fname, strerror (errno));
+		return NULL;
+	}
+
+	bb = g_slice_alloc0 (sizeof (*bb));
+	bb->data = data;
+	bb->len = len;
+	bb->mapped = TRUE;
+	REF_INIT_RETAIN (bb, rspamd_bloom_blocked_dtor);
+
+	if (!rspamd_bloom_blocked_load (bb, err)) {
+		REF_RELEASE (bb);
+		return NULL;
+	}
+
+	return bb;
+}
+
+struct rspamd_bloom_blocked *
+rspamd_bloom_blocked_from_memory (const guchar *data, gsize len, GError **err)
+{
+	struct rspamd_bloom_blocked *bb;
+
+	bb = g_slice_alloc0 (sizeof (*bb));
+	/* Copy to have aligned blocks */
+	bb->data = rspamd_bloom_blocked_alloc (MAX (len, 1));
+	memcpy (bb->data, data, len);
+	bb->len = len;
+	REF_INIT_RETAIN (bb, rspamd_bloom_blocked_dtor);
+
+	if (!rspamd_bloom_blocked_load (bb, err)) {
+		REF_RELEASE (bb);
+		return NULL;
+	}
+
+	return bb;
+}
+
+/* Returns block for a key and fills mask of bits within it */
+static inline const guint64 *
+rspamd_bloom_blocked_mask (struct rspamd_bloom_blocked *bb,
+		const void *data, gsize len, guint64 *mask)
+{
+	guint64 h, x, idx;
+	guint i, pos;
+
+	h = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			data, len, bb->hdr->seed);
+	if (G_LIKELY (bb->hdr->nblocks <= G_MAXUINT32)) {
+		/* Map upper half to [0, nblocks) without division */
+		idx = ((h >> 32) * bb->hdr->nblocks) >> 32;
+	}
+	else {
+		idx = h % bb->hdr->nblocks;
+	}
+
+	memset (mask, 0, RSPAMD_BLOOM_BLOCK_SIZE);
+	x = h;
+
+	for (i = 0; i < bb->hdr->nfuncs; i ++) {
+		/* Take top 9 bits of a multiplicative remix for each position */
+		x = (x ^ (x >> 31)) * 0x9E3779B97F4A7C15ULL;
+		pos = x >> (64 - 9);
+		mask[pos / 64] |= 1ULL << (pos % 64);
+	}
+
+	return bb->blocks + idx * RSPAMD_BLOOM_BLOCK_WORDS;
+}
+
+gboolean
+rspamd_bloom_blocked_add (struct rspamd_bloom_blocked *bb,
+		const void *data, gsize len)
+{
+	guint64 mask[RSPAMD_BLOOM_BLOCK_WORDS], *block;
+	guint i;
+
+	if (bb->mapped) {
+		return FALSE;
+	}
+
+	block = (guint64 *)rspamd_bloom_blocked_mask (bb, data, len, mask);
+
+	for (i = 0; i < RSPAMD_BLOOM_BLOCK_WORDS; i ++) {
+		block[i] |= mask[i];
+	}
+
+	bb->hdr->nelts ++;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_bloom_blocked_check (struct rspamd_bloom_blocked *bb,
+		const void *data, gsize len)
+{
+	guint64 mask[RSPAMD_BLOOM_BLOCK_WORDS];
+	const guint64 *block;
+
+	block = rspamd_bloom_blocked_mask (bb, data, len, mask);
+
+#ifdef __SSE2__
+	{
+		__m128i acc = _mm_setzero_si128 (), b, m;
+		guint i;
+
+		for (i = 0; i < RSPAMD_BLOOM_BLOCK_WORDS; i += 2) {
+			b = _mm_load_si128 ((const __m128i *)(block + i));
+			m = _mm_loadu_si128 ((const __m128i *)(mask + i));
+			/* Bits that are in mask but not in block */
+			acc = _mm_or_si128 (acc, _mm_andnot_si128 (b, m));
+		}
+
+		return _mm_movemask_epi8 (_mm_cmpeq_epi8 (acc,
+				_mm_setzero_si128 ())) == 0xFFFF;
+	}
+#else
+	{
+		guint64 acc = 0;
+		guint i;
+
+		for (i = 0; i < RSPAMD_BLOOM_BLOCK_WORDS; i ++) {
+			acc |= mask[i] & ~block[i];
+		}
+
+		return acc == 0;
+	}
+#endif
+}
+
+gboolean
+rspamd_bloom_blocked_write (struct rspamd_bloom_blocked *bb,
+		const gchar *fname, GError **err)
+{
+	gchar *tmp;
+	gint fd;
+	gssize r;
+	gsize written = 0;
+
+	tmp = g_strdup_printf ("%s.new", fname);
+	fd = rspamd_file_xopen (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_bloom_blocked_quark (), errno,
+				"cannot open %s: %s", tmp, strerror (errno));
+		g_free (tmp);
+
+		return FALSE;
+	}
+
+	while (written < bb->len) {
+		r = write (fd, bb->data + written, bb->len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			g_set_error (err, rspamd_bloom_blocked_quark (), errno,
+					"cannot write %s: %s", tmp, strerror (errno));
+			close (fd);
+			unlink (tmp);
+			g_free (tmp);
+
+			return FALSE;
+		}
+
+		written += r;
+	}
+
+	close (fd);
+
+	if (rename (tmp, fname) == -1) {
+		g_set_error (err, rspamd_bloom_blocked_quark (), errno,
+				"cannot rename %s to %s: %s", tmp, fname, strerror (errno));
+		unlink (tmp);
+		g_free (tmp);
+
+		return FALSE;
+	}
+
+	g_free (tmp);
+
+	return TRUE;
+}
+
+guint64
+rspamd_bloom_blocked_count (struct rspamd_bloom_blocked *bb)
+{
+	return bb->hdr->nelts;
+}
+
+gsize
+rspamd_bloom_blocked_size (struct rspamd_bloom_blocked *bb)
+{
+	return bb->len;
+}
+
+struct rspamd_bloom_blocked *
+rspamd_bloom_blocked_ref (struct rspamd_bloom_blocked *bb)
+{
+	REF_RETAIN (bb);
+
+	return bb;
+}
+
+void
+rspamd_bloom_blocked_unref (struct rspamd_bloom_blocked *bb)
+{
+	REF_RELEASE (bb);
+}
@@ -45,4 +45,65 @@ gboolean rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s);
  */
 gboolean rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s);
 
+/*
+ * Blocked bloom filter: all bits of a key are set within a single 64 bytes
+ * block, so a check costs a single cache miss. The image is a flat buffer
+ * that could be written to a file and mapped read-only by many processes.
+ */
+struct rspamd_bloom_blocked;
+
+/**
+ * Create new blocked bloom filter
+ * @param nelts expected number of elements
+ * @param fp_rate desired false positive rate (e.g. 0.01)
+ * @return refcounted filter
+ */
+struct rspamd_bloom_blocked *rspamd_bloom_blocked_new (gsize nelts,
+		gdouble fp_rate);
+
+/**
+ * Map filter written by `rspamd_bloom_blocked_write` read-only
+ */
+struct rspamd_bloom_blocked *rspamd_bloom_blocked_open (const gchar *fname,
+		GError **err);
+
+/**
+ * Load filter from a copy of a memory buffer
+ */
+struct rspamd_bloom_blocked *rspamd_bloom_blocked_from_memory (
+		const guchar *data, gsize len, GError **err);
+
+/**
+ * Add element to a filter
+ * @return FALSE if a filter is mapped read-only
+ */
+gboolean rspamd_bloom_blocked_add (struct rspamd_bloom_blocked *bb,
+		const void *data, gsize len);
+
+/**
+ * Check whether an element might be in a filter
+ */
+gboolean rspamd_bloom_blocked_check (struct rspamd_bloom_blocked *bb,
+		const void *data, gsize len);
+
+/**
+ * Write filter image to a file, the file is replaced atomically
+ */
+gboolean rspamd_bloom_blocked_write (struct rspamd_bloom_blocked *bb,
+		const gchar *fname, GError **err);
+
+/**
+ * Returns number of elements added to a filter
+ */
+guint64 rspamd_bloom_blocked_count (struct rspamd_bloom_blocked *bb);
+
+/**
+ * Returns size of filter image in bytes
+ */
+gsize rspamd_bloom_blocked_size (struct rspamd_bloom_blocked *bb);
+
+struct rspamd_bloom_blocked *rspamd_bloom_blocked_ref (
+		struct rspamd_bloom_blocked *bb);
+void rspamd_bloom_blocked_unref (struct rspamd_bloom_blocked *bb);
+
 #endif
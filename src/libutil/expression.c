@@ -20,12 +20,16 @@
 #include "util.h"
 #include "utlist.h"
 #include "ottery.h"
+#include "cryptobox.h"
 
 #define RSPAMD_EXPR_FLAG_NEGATE (1 << 0)
-#define RSPAMD_EXPR_FLAG_PROCESSED (1 << 1)
 
 #define MIN_RESORT_EVALS 50
 #define MAX_RESORT_EVALS 150
+/* Old statistics is decayed to follow changes of traffic */
+#define MAX_ATOM_EVALS 1024
+#define MAX_TICKS_SAMPLES 8
+#define MIN_RANK_PROB 0.01
 
 enum rspamd_expression_elt_type {
 	ELT_OP = 0,
@@ -44,8 +48,11 @@ struct rspamd_expression_elt {
 		} lim;
 	} p;
 	gint flags;
-	gint value;
 	gint priority;
+	/* Expected evaluation cost, probability of true value and rank */
+	gdouble cost;
+	gdouble prob;
+	gdouble rank;
 };
 
 struct rspamd_expression {
@@ -55,8 +62,13 @@ struct rspamd_expression {
 	GNode *ast;
 	guint next_resort;
 	guint evals;
+	GArray *code; /* struct rspamd_expr_insn */
+	guint nslots;
+	guint max_stack;
 };
 
+static void rspamd_expr_compile (struct rspamd_expression *expr);
+
 static GQuark
 rspamd_expr_quark (void)
 {
@@ -363,6 +375,9 @@ rspamd_expression_destroy (struct rspamd_expression *expr)
 		if (expr->ast) {
 			g_node_destroy (expr->ast);
 		}
+		if (expr->code) {
+			g_array_free (expr->code, TRUE);
+		}
 
 		g_slice_free1 (sizeof (*expr), expr);
 	}
@@ -490,22 +505,16 @@ rspamd_ast_priority_traverse (GNode *node, gpointer d)
 				elt->priority = RSPAMD_EXPRESSION_MAX_PRIORITY -
 						expr->subr->priority (elt->p.atom);
 			}
-			elt->p.atom->hits = 0;
-			elt->p.atom->avg_ticks = 0.0;
 		}
 	}
 
 	return FALSE;
 }
 
-#define ATOM_PRIORITY(a) ((a)->p.atom->hits / ((a)->p.atom->avg_ticks > 0 ?	\
-				(a)->p.atom->avg_ticks * 10000000 : 1.0))
-
 static gint
 rspamd_ast_priority_cmp (GNode *a, GNode *b)
 {
 	struct rspamd_expression_elt *ea = a->data, *eb = b->data;
-	gdouble w1, w2;
 
 	if (ea->type == ELT_LIMIT) {
 		return -1;
@@ -514,42 +523,191 @@ rspamd_ast_priority_cmp (GNode *a, GNode *b)
 		return 1;
 	}
 
-	/* Special logic for atoms */
-	if (ea->type == ELT_ATOM && eb->type == ELT_ATOM &&
-			ea->priority == eb->priority) {
-		w1 = ATOM_PRIORITY (ea);
-		w2 = ATOM_PRIORITY (eb);
+	return ea->priority - eb->priority;
+}
 
-		ea->p.atom->hits = 0;
-		ea->p.atom->avg_ticks = 0.0;
+/* Dynamic order: lower rank first, static priority for equal ranks */
+static gint
+rspamd_ast_rank_cmp (GNode *a, GNode *b)
+{
+	struct rspamd_expression_elt *ea = a->data, *eb = b->data;
 
-		return w1 - w2;
+	if (ea->type == ELT_LIMIT) {
+		return -1;
 	}
-	else {
-		return ea->priority - eb->priority;
+	else if (eb->type == ELT_LIMIT) {
+		return 1;
+	}
+
+	if (ea->rank < eb->rank) {
+		return -1;
+	}
+	else if (ea->rank > eb->rank) {
+		return 1;
 	}
+
+	return ea->priority - eb->priority;
 }
 
-static gboolean
-rspamd_ast_resort_traverse (GNode *node, gpointer unused)
+static void
+rspamd_ast_sort_children (GNode *node,
+		gint (*cmp) (GNode *a, GNode *b))
 {
 	GNode *children, *last;
 
+	children = node->children;
+	last = g_node_last_sibling (children);
+	/* Needed for utlist compatibility */
+	children->prev = last;
+	DL_SORT (node->children, cmp);
+	/* Restore GLIB compatibility */
+	children = node->children;
+	children->prev = NULL;
+}
+
+static gboolean
+rspamd_ast_resort_traverse (GNode *node, gpointer unused)
+{
 	if (node->children) {
+		rspamd_ast_sort_children (node, rspamd_ast_priority_cmp);
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_ast_mean_cost_traverse (GNode *node, gpointer d)
+{
+	struct rspamd_expression_elt *elt = node->data;
+	gdouble *acc = d;
+
+	if (elt->type == ELT_ATOM && elt->p.atom->nticks > 0) {
+		acc[0] += elt->p.atom->avg_ticks;
+		acc[1] += 1.0;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Sorts operands of AND and OR by their expected cost divided by probability
+ * to finish the operation (false for AND, true for OR), so cheap operands
+ * that are likely to short-circuit go first. Atoms that have no time samples
+ * are assumed to have the mean cost of other atoms
+ */
+static gboolean
+rspamd_ast_cost_traverse (GNode *node, gpointer d)
+{
+	struct rspamd_expression_elt *elt = node->data, *celt, *parelt;
+	rspamd_expression_atom_t *atom;
+	gdouble def_cost = *(gdouble *)d, reach = 1.0, cost = 0.0, stop;
+	gboolean sort = TRUE;
+	GNode *cur;
+
+	switch (elt->type) {
+	case ELT_LIMIT:
+		elt->cost = 0.0;
+		elt->prob = 1.0;
+		break;
+	case ELT_ATOM:
+		atom = elt->p.atom;
+		elt->cost = atom->nticks > 0 ? atom->avg_ticks : def_cost;
+		/* Unknown atoms are expected to be true with probability 0.5 */
+		elt->prob = (atom->hits + 1.0) / (atom->evals + 2.0);
+		if (atom->evals > MAX_ATOM_EVALS) {
+			atom->hits /= 2;
+			atom->evals /= 2;
+		}
+
+		atom->nticks = MIN (atom->nticks, MAX_TICKS_SAMPLES);
+		break;
+	case ELT_OP:
+		parelt = node->parent ? node->parent->data : NULL;
+
+		DL_FOREACH (node->children, cur) {
+			celt = cur->data;
+
+			switch (elt->p.op) {
+			case OP_AND:
+			case OP_MULT:
+				stop = 1.0 - celt->prob;
+				break;
+			case OP_OR:
+				stop = celt->prob;
+				break;
+			case OP_PLUS:
+				/* Sum can be finished early when it reaches the limit */
+				if (parelt && (parelt->p.op == OP_GE || parelt->p.op == OP_GT)) {
+					stop = celt->prob;
+				}
+				else {
+					stop = 0.0;
+					sort = FALSE;
+				}
+				break;
+			default:
+				stop = 0.0;
+				sort = FALSE;
+				break;
+			}
+
+			celt->rank = celt->cost / MAX (stop, MIN_RANK_PROB);
+		}
+
+		if (sort) {
+			rspamd_ast_sort_children (node, rspamd_ast_rank_cmp);
+		}
+
+		/* Estimate evaluation of the sorted operands */
+		elt->prob = (elt->p.op == OP_AND || elt->p.op == OP_MULT) ? 1.0 : 0.0;
+
+		DL_FOREACH (node->children, cur) {
+			celt = cur->data;
+
+			if (celt->type == ELT_LIMIT) {
+				continue;
+			}
+
+			cost += reach * celt->cost;
+
+			switch (elt->p.op) {
+			case OP_AND:
+			case OP_MULT:
+				reach *= celt->prob;
+				elt->prob *= celt->prob;
+				break;
+			case OP_OR:
+				reach *= 1.0 - celt->prob;
+				elt->prob = 1.0 - reach;
+				break;
+			case OP_NOT:
+				elt->prob = 1.0 - celt->prob;
+				break;
+			default:
+				elt->prob = 0.5;
+				break;
+			}
+		}
 
-		children = node->children;
-		last = g_node_last_sibling (children);
-		/* Needed for utlist compatibility */
-		children->prev = last;
-		DL_SORT (node->children, rspamd_ast_priority_cmp);
-		/* Restore GLIB compatibility */
-		children = node->children;
-		children->prev = NULL;
+		elt->cost = cost;
+		break;
 	}
 
 	return FALSE;
 }
 
+static void
+rspamd_expr_resort_dynamic (struct rspamd_expression *expr)
+{
+	gdouble acc[2] = {0.0, 0.0}, def_cost;
+
+	g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_LEAVES, -1,
+			rspamd_ast_mean_cost_traverse, acc);
+	def_cost = acc[1] > 0 ? acc[0] / acc[1] : 1.0;
+	g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_ALL, -1,
+			rspamd_ast_cost_traverse, &def_cost);
+}
+
 static struct rspamd_expression_elt *
 rspamd_expr_dup_elt (rspamd_mempool_t *pool, struct rspamd_expression_elt *elt)
 {
@@ -604,6 +762,7 @@ rspamd_parse_expression (const gchar *line, gsize len,
 	e->expression_stack = g_ptr_array_sized_new (32);
 	e->subr = subr;
 	e->evals = 0;
+	e->code = NULL;
 	e->next_resort = ottery_rand_range (MAX_RESORT_EVALS) + MIN_RESORT_EVALS;
 
 	/* Shunting-yard algorithm */
@@ -854,6 +1013,7 @@ rspamd_parse_expression (const gchar *line, gsize len,
 	/* Now set less expensive branches to be evaluated first */
 	g_node_traverse (e->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
 			rspamd_ast_resort_traverse, NULL);
+	rspamd_expr_compile (e);
 
 	if (target) {
 		*target = e;
@@ -981,61 +1141,114 @@ rspamd_ast_do_op (struct rspamd_expression_elt *elt, gint val,
 	return ret;
 }
 
-static gint
-rspamd_ast_process_node (struct rspamd_expression *expr, gint flags, GNode *node,
-		gpointer data, GPtrArray *track)
+/*
+ * Expressions are lowered to a linear postfix program evaluated on a small
+ * value stack: each operation is compiled to its operands, each of them
+ * followed by an accumulation step and a jump to the end of the operation
+ * once its value is known, so short-circuit works as for the tree walk.
+ * Identical atoms share a result slot within one evaluation unless
+ * RSPAMD_EXPRESSION_FLAG_NOCACHE is set.
+ */
+enum rspamd_expr_opcode {
+	EXPR_INSN_ATOM = 0, /* push value of atom */
+	EXPR_INSN_CONST, /* push constant */
+	EXPR_INSN_FIRST, /* apply operation to the first operand */
+	EXPR_INSN_NEXT, /* pop operand and accumulate it to the top */
+	EXPR_INSN_DONE /* skip the rest of operation if its value is known */
+};
+
+struct rspamd_expr_insn {
+	enum rspamd_expr_opcode opcode;
+	gint lim;
+	gint arg; /* atom slot, constant or jump target */
+	struct rspamd_expression_elt *elt;
+	struct rspamd_expression_elt *parelt;
+};
+
+struct rspamd_expr_compile_ctx {
+	struct rspamd_expression *expr;
+	GHashTable *slots;
+	guint depth;
+};
+
+static guint
+rspamd_expr_atom_hash (gconstpointer p)
 {
-	struct rspamd_expression_elt *elt, *celt, *parelt = NULL;
-	GNode *cld;
-	gint acc = G_MININT, lim = G_MININT, val;
-	gdouble t1, t2;
-	gboolean calc_ticks = FALSE;
+	const rspamd_expression_atom_t *atom = p;
 
-	elt = node->data;
+	return rspamd_cryptobox_fast_hash (atom->str, atom->len,
+			rspamd_hash_seed ());
+}
 
-	switch (elt->type) {
-	case ELT_ATOM:
-		if (!(elt->flags & RSPAMD_EXPR_FLAG_PROCESSED)) {
+static gboolean
+rspamd_expr_atom_equal (gconstpointer a, gconstpointer b)
+{
+	const rspamd_expression_atom_t *a1 = a, *a2 = b;
 
-			/*
-			 * Sometimes get ticks for this expression. 'Sometimes' here means
-			 * that we get lowest 5 bits of the counter `evals` and 5 bits
-			 * of some shifted address to provide some sort of jittering for
-			 * ticks evaluation
-			 */
-			if ((expr->evals & 0x1F) == (GPOINTER_TO_UINT (node) >> 4 & 0x1F)) {
-				calc_ticks = TRUE;
-				t1 = rspamd_get_ticks ();
-			}
+	return a1->len == a2->len && memcmp (a1->str, a2->str, a1->len) == 0;
+}
 
-			elt->value = expr->subr->process (data, elt->p.atom);
+static void
+rspamd_expr_emit (struct rspamd_expression *expr,
+		enum rspamd_expr_opcode opcode, struct rspamd_expression_elt *elt,
+		struct rspamd_expression_elt *parelt, gint lim, gint arg)
+{
+	struct rspamd_expr_insn insn;
+
+	insn.opcode = opcode;
+	insn.elt = elt;
+	insn.parelt = parelt;
+	insn.lim = lim;
+	insn.arg = arg;
+	g_array_append_val (expr->code, insn);
+}
 
-			if (elt->value) {
-				elt->p.atom->hits ++;
+static void
+rspamd_expr_compile_push (struct rspamd_expr_compile_ctx *cctx)
+{
+	cctx->depth ++;
 
-				if (track) {
-					g_ptr_array_add (track, elt->p.atom);
-				}
-			}
+	if (cctx->depth > cctx->expr->max_stack) {
+		cctx->expr->max_stack = cctx->depth;
+	}
+}
 
-			if (calc_ticks) {
-				t2 = rspamd_get_ticks ();
-				elt->p.atom->avg_ticks += ((t2 - t1) - elt->p.atom->avg_ticks) /
-						(expr->evals);
-			}
+static void
+rspamd_expr_compile_node (struct rspamd_expr_compile_ctx *cctx, GNode *node)
+{
+	struct rspamd_expression *expr = cctx->expr;
+	struct rspamd_expression_elt *elt, *celt, *parelt = NULL;
+	struct rspamd_expr_insn *insn;
+	GNode *cld;
+	GArray *jumps;
+	gint lim = G_MININT, slot;
+	gboolean first = TRUE;
+	guint i;
+	gpointer found;
+
+	elt = node->data;
 
-			elt->flags |= RSPAMD_EXPR_FLAG_PROCESSED;
+	switch (elt->type) {
+	case ELT_ATOM:
+		if ((found = g_hash_table_lookup (cctx->slots, elt->p.atom)) != NULL) {
+			slot = GPOINTER_TO_INT (found) - 1;
+		}
+		else {
+			slot = expr->nslots ++;
+			g_hash_table_insert (cctx->slots, elt->p.atom,
+					GINT_TO_POINTER (slot + 1));
 		}
 
-		return elt->value;
+		rspamd_expr_emit (expr, EXPR_INSN_ATOM, elt, NULL, 0, slot);
+		rspamd_expr_compile_push (cctx);
 		break;
 	case ELT_LIMIT:
-
-		return elt->p.lim.val;
+		rspamd_expr_emit (expr, EXPR_INSN_CONST, elt, NULL, 0,
+				elt->p.lim.val);
+		rspamd_expr_compile_push (cctx);
 		break;
 	case ELT_OP:
 		g_assert (node->children != NULL);
-		cld = node->children;
 
 		/* Try to find limit at the parent node */
 		if (node->parent) {
@@ -1047,6 +1260,8 @@ rspamd_ast_process_node (struct rspamd_expression *expr, gint flags, GNode *node
 			}
 		}
 
+		jumps = g_array_new (FALSE, FALSE, sizeof (guint));
+
 		DL_FOREACH (node->children, cld) {
 			celt = cld->data;
 
@@ -1056,67 +1271,186 @@ rspamd_ast_process_node (struct rspamd_expression *expr, gint flags, GNode *node
 				continue;
 			}
 
-			val = rspamd_ast_process_node (expr, flags, cld, data, track);
+			rspamd_expr_compile_node (cctx, cld);
 
-			if (acc == G_MININT) {
-				acc = rspamd_ast_do_op (elt, val, 0, lim, TRUE);
+			if (first) {
+				rspamd_expr_emit (expr, EXPR_INSN_FIRST, elt, parelt, lim, 0);
+				first = FALSE;
 			}
 			else {
-				acc = rspamd_ast_do_op (elt, val, acc, lim, FALSE);
+				rspamd_expr_emit (expr, EXPR_INSN_NEXT, elt, parelt, lim, 0);
+				cctx->depth --;
 			}
 
-			if (!(flags & RSPAMD_EXPRESSION_FLAG_NOOPT)) {
-				if (rspamd_ast_node_done (elt, parelt, acc, lim)) {
-					return acc;
-				}
-			}
+			g_array_append_val (jumps, expr->code->len);
+			rspamd_expr_emit (expr, EXPR_INSN_DONE, elt, parelt, lim, 0);
 		}
+
+		if (first) {
+			/* No operands */
+			rspamd_expr_emit (expr, EXPR_INSN_CONST, elt, NULL, 0, G_MININT);
+			rspamd_expr_compile_push (cctx);
+		}
+
+		for (i = 0; i < jumps->len; i ++) {
+			insn = &g_array_index (expr->code, struct rspamd_expr_insn,
+					g_array_index (jumps, guint, i));
+			insn->arg = expr->code->len;
+		}
+
+		g_array_free (jumps, TRUE);
 		break;
 	}
-
-	return acc;
 }
 
-static gboolean
-rspamd_ast_cleanup_traverse (GNode *n, gpointer d)
+static void
+rspamd_expr_compile (struct rspamd_expression *expr)
 {
-	struct rspamd_expression_elt *elt = n->data;
+	struct rspamd_expr_compile_ctx cctx;
 
-	elt->value = 0;
-	elt->flags = 0;
+	if (expr->code) {
+		g_array_free (expr->code, TRUE);
+	}
 
-	return FALSE;
+	expr->code = g_array_new (FALSE, FALSE, sizeof (struct rspamd_expr_insn));
+	expr->nslots = 0;
+	expr->max_stack = 0;
+
+	cctx.expr = expr;
+	cctx.depth = 0;
+	cctx.slots = g_hash_table_new (rspamd_expr_atom_hash,
+			rspamd_expr_atom_equal);
+	rspamd_expr_compile_node (&cctx, expr->ast);
+	g_hash_table_unref (cctx.slots);
 }
 
+#define RSPAMD_EXPR_STACK_ALLOCA 256
+
 gint
 rspamd_process_expression_track (struct rspamd_expression *expr, gint flags,
 		gpointer data, GPtrArray *track)
 {
-	gint ret = 0;
+	struct rspamd_expr_insn *insn;
+	rspamd_expression_atom_t *atom;
+	gint *stack, *values, ret = 0, val;
+	guint8 *done;
+	gsize scratch_len;
+	guint pc = 0, sp = 0;
+	gdouble t1, t2;
+	gboolean calc_ticks, heap_scratch = FALSE;
 
 	g_assert (expr != NULL);
 	/* Ensure that stack is empty at this point */
 	g_assert (expr->expression_stack->len == 0);
 
-	ret = rspamd_ast_process_node (expr, flags, expr->ast, data, track);
+	/* Expressions could be nested (e.g. via composites), so no shared state */
+	scratch_len = (expr->max_stack + expr->nslots) * sizeof (gint) +
+			NBYTES (expr->nslots);
+
+	if (scratch_len <= RSPAMD_EXPR_STACK_ALLOCA) {
+		stack = g_alloca (scratch_len);
+	}
+	else {
+		stack = g_malloc (scratch_len);
+		heap_scratch = TRUE;
+	}
+
+	values = stack + expr->max_stack;
+	done = (guint8 *)(values + expr->nslots);
+	memset (done, 0, NBYTES (expr->nslots));
+
+	while (pc < expr->code->len) {
+		insn = &g_array_index (expr->code, struct rspamd_expr_insn, pc);
+
+		switch (insn->opcode) {
+		case EXPR_INSN_ATOM:
+			if (!(flags & RSPAMD_EXPRESSION_FLAG_NOCACHE) &&
+					isset (done, insn->arg)) {
+				stack[sp++] = values[insn->arg];
+				break;
+			}
+
+			atom = insn->elt->p.atom;
+			calc_ticks = FALSE;
+
+			/*
+			 * Sometimes get ticks for this expression. 'Sometimes' here means
+			 * that we get lowest 5 bits of the counter `evals` and 5 bits
+			 * of some shifted address to provide some sort of jittering for
+			 * ticks evaluation
+			 */
+			if ((expr->evals & 0x1F) == (GPOINTER_TO_UINT (insn->elt) >> 4 & 0x1F)) {
+				calc_ticks = TRUE;
+				t1 = rspamd_get_ticks ();
+			}
+
+			val = expr->subr->process (data, atom);
+			atom->evals ++;
+
+			if (val) {
+				atom->hits ++;
+
+				if (track) {
+					g_ptr_array_add (track, atom);
+				}
+			}
+
+			if (calc_ticks) {
+				t2 = rspamd_get_ticks ();
+				atom->nticks ++;
+				atom->avg_ticks += ((t2 - t1) - atom->avg_ticks) /
+						atom->nticks;
+			}
+
+			values[insn->arg] = val;
+			setbit (done, insn->arg);
+			stack[sp++] = val;
+			break;
+		case EXPR_INSN_CONST:
+			stack[sp++] = insn->arg;
+			break;
+		case EXPR_INSN_FIRST:
+			stack[sp - 1] = rspamd_ast_do_op (insn->elt, stack[sp - 1], 0,
+					insn->lim, TRUE);
+			break;
+		case EXPR_INSN_NEXT:
+			val = stack[--sp];
+			stack[sp - 1] = rspamd_ast_do_op (insn->elt, val, stack[sp - 1],
+					insn->lim, FALSE);
+			break;
+		case EXPR_INSN_DONE:
+			if (!(flags & RSPAMD_EXPRESSION_FLAG_NOOPT) &&
+					rspamd_ast_node_done (insn->elt, insn->parelt,
+							stack[sp - 1], insn->lim)) {
+				pc = insn->arg;
+				continue;
+			}
+			break;
+		}
+
+		pc ++;
+	}
+
+	g_assert (sp == 1);
+	ret = stack[0];
 
-	/* Cleanup */
-	g_node_traverse (expr->ast, G_IN_ORDER, G_TRAVERSE_ALL, -1,
-			rspamd_ast_cleanup_traverse, NULL);
+	if (heap_scratch) {
+		g_free (stack);
+	}
 
 	expr->evals ++;
 
 	/* Check if we need to resort */
 	if (expr->evals == expr->next_resort) {
-		expr->next_resort = ottery_rand_range (MAX_RESORT_EVALS) +
-				MIN_RESORT_EVALS;
-		/* Set priorities for branches */
+		expr->next_resort = expr->evals +
+				ottery_rand_range (MAX_RESORT_EVALS) + MIN_RESORT_EVALS;
+		/* Set static priorities for branches */
 		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_ALL, -1,
 				rspamd_ast_priority_traverse, expr);
 
-		/* Now set less expensive branches to be evaluated first */
-		g_node_traverse (expr->ast, G_POST_ORDER, G_TRAVERSE_NON_LEAVES, -1,
-				rspamd_ast_resort_traverse, NULL);
+		/* Now set branches that are cheap and likely to finish first */
+		rspamd_expr_resort_dynamic (expr);
+		rspamd_expr_compile (expr);
 	}
 
 	return ret;
@@ -23,6 +23,8 @@
 #define RSPAMD_EXPRESSION_MAX_PRIORITY 1024
 
 #define RSPAMD_EXPRESSION_FLAG_NOOPT (1 << 0)
+/* Process each occurrence of an atom even if the same atom has been processed */
+#define RSPAMD_EXPRESSION_FLAG_NOCACHE (1 << 1)
 
 enum rspamd_expression_op {
 	OP_INVALID = 0,
@@ -50,6 +52,10 @@ typedef struct rspamd_expression_atom_s {
 	gsize len;
 	/* Average execution time (in ticks) */
 	gdouble avg_ticks;
+	/* Amount of execution time samples */
+	guint nticks;
+	/* Amount of evaluations */
+	guint evals;
 	/* Amount of positive triggers */
 	guint hits;
 	/* Relative priority */
@@ -173,6 +173,23 @@ rspamd_lru_hash_insert (rspamd_lru_hash_t *hash, gpointer key, gpointer value,
 	rspamd_min_heap_push (hash->heap, &res->helt);
 }
 
+gboolean
+rspamd_lru_hash_remove (rspamd_lru_hash_t *hash, gconstpointer key)
+{
+	rspamd_lru_element_t *res;
+
+	res = g_hash_table_lookup (hash->tbl, key);
+
+	if (res != NULL) {
+		rspamd_min_heap_remove_elt (hash->heap, &res->helt);
+		g_hash_table_remove (hash->tbl, key);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 void
 rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash)
 {
@@ -74,6 +74,15 @@ void rspamd_lru_hash_insert (rspamd_lru_hash_t *hash,
 	time_t now,
 	guint ttl);
 
+/**
+ * Remove item from hash
+ * @param hash hash object
+ * @param key key to remove
+ * @return TRUE if an element has been removed
+ */
+gboolean rspamd_lru_hash_remove (rspamd_lru_hash_t *hash,
+	gconstpointer key);
+
 /**
  * Remove lru hash
  * @param hash hash object
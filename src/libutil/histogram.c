@@ -0,0 +1,160 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "histogram.h"
+#include "printf.h"
+#include "str_util.h"
+
+static const gdouble histogram_bounds[RSPAMD_HISTOGRAM_BUCKETS - 1] = {
+		0.0001, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+		0.05, 0.1, 0.25, 0.5, 1.0, 2.5
+};
+
+void
+rspamd_histogram_add (struct rspamd_histogram *h, gdouble seconds)
+{
+	guint i;
+	guint64 usec;
+
+	for (i = 0; i < G_N_ELEMENTS (histogram_bounds); i ++) {
+		if (seconds <= histogram_bounds[i]) {
+			break;
+		}
+	}
+
+	usec = seconds > 0 ? seconds * 1e6 : 0;
+
+#ifndef HAVE_ATOMIC_BUILTINS
+	h->buckets[i] ++;
+	h->sum_usec += usec;
+#else
+	__atomic_add_fetch (&h->buckets[i], 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch (&h->sum_usec, usec, __ATOMIC_RELEASE);
+#endif
+}
+
+guint64
+rspamd_histogram_count (const struct rspamd_histogram *h)
+{
+	guint64 cnt = 0;
+	guint i;
+
+	for (i = 0; i < RSPAMD_HISTOGRAM_BUCKETS; i ++) {
+		cnt += h->buckets[i];
+	}
+
+	return cnt;
+}
+
+gdouble
+rspamd_histogram_quantile (const struct rspamd_histogram *h, gdouble q)
+{
+	guint64 cnt, rank, cur = 0;
+	guint i;
+
+	cnt = rspamd_histogram_count (h);
+
+	if (cnt == 0) {
+		return 0;
+	}
+
+	rank = q * cnt;
+
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (histogram_bounds); i ++) {
+		cur += h->buckets[i];
+
+		if (cur >= rank) {
+			return histogram_bounds[i];
+		}
+	}
+
+	return histogram_bounds[G_N_ELEMENTS (histogram_bounds) - 1];
+}
+
+void
+rspamd_prometheus_escape_label (rspamd_fstring_t **out, const gchar *value)
+{
+	const gchar *p;
+
+	for (p = value; *p != '\0'; p ++) {
+		if (*p == '"' || *p == '\\') {
+			rspamd_printf_fstring (out, "\\%c", *p);
+		}
+		else if (*p == '\n') {
+			rspamd_printf_fstring (out, "\\n");
+		}
+		else {
+			rspamd_printf_fstring (out, "%c", *p);
+		}
+	}
+}
+
+static void
+rspamd_histogram_write_sample (rspamd_fstring_t **out, const gchar *name,
+		const gchar *suffix, const gchar *label, const gchar *value,
+		const gchar *le)
+{
+	rspamd_printf_fstring (out, "%s%s", name, suffix);
+
+	if (label || le) {
+		rspamd_printf_fstring (out, "{");
+
+		if (label) {
+			rspamd_printf_fstring (out, "%s=\"", label);
+			rspamd_prometheus_escape_label (out, value);
+			rspamd_printf_fstring (out, "\"%s", le ? "," : "");
+		}
+
+		if (le) {
+			rspamd_printf_fstring (out, "le=\"%s\"", le);
+		}
+
+		rspamd_printf_fstring (out, "}");
+	}
+}
+
+void
+rspamd_histogram_write_prometheus (rspamd_fstring_t **out,
+		const gchar *name, const gchar *label, const gchar *value,
+		const struct rspamd_histogram *h)
+{
+	guint64 cumulative = 0;
+	gchar le[32];
+	guint i;
+
+	for (i = 0; i < RSPAMD_HISTOGRAM_BUCKETS; i ++) {
+		cumulative += h->buckets[i];
+
+		if (i < G_N_ELEMENTS (histogram_bounds)) {
+			rspamd_snprintf (le, sizeof (le), "%.4f", histogram_bounds[i]);
+		}
+		else {
+			rspamd_strlcpy (le, "+Inf", sizeof (le));
+		}
+
+		rspamd_histogram_write_sample (out, name, "_bucket", label, value, le);
+		rspamd_printf_fstring (out, " %uL\n", cumulative);
+	}
+
+	rspamd_histogram_write_sample (out, name, "_sum", label, value, NULL);
+	rspamd_printf_fstring (out, " %.6f\n", h->sum_usec / 1e6);
+	rspamd_histogram_write_sample (out, name, "_count", label, value, NULL);
+	rspamd_printf_fstring (out, " %uL\n", cumulative);
+}
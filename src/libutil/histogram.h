@@ -0,0 +1,77 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_HISTOGRAM_H_
+#define SRC_LIBUTIL_HISTOGRAM_H_
+
+#include "config.h"
+#include "fstring.h"
+
+/*
+ * Latency histograms with fixed buckets. Buckets are updated atomically, so
+ * a histogram placed in shared memory could be updated by all workers and
+ * read by a controller
+ */
+
+/* Upper bounds from 100 microseconds to 2.5 seconds and one more bucket */
+#define RSPAMD_HISTOGRAM_BUCKETS 14
+
+struct rspamd_histogram {
+	guint64 buckets[RSPAMD_HISTOGRAM_BUCKETS];
+	guint64 sum_usec;
+};
+
+/**
+ * Add value to a histogram
+ * @param h histogram
+ * @param seconds latency in seconds
+ */
+void rspamd_histogram_add (struct rspamd_histogram *h, gdouble seconds);
+
+/**
+ * Returns number of values in a histogram
+ */
+guint64 rspamd_histogram_count (const struct rspamd_histogram *h);
+
+/**
+ * Returns an upper bound of the bucket where the quantile `q` lies
+ * @param h histogram
+ * @param q quantile in range (0, 1]
+ * @return bound in seconds or 0 if a histogram is empty; the last bucket
+ * has no bound, so the largest finite one is returned for it
+ */
+gdouble rspamd_histogram_quantile (const struct rspamd_histogram *h,
+		gdouble q);
+
+/**
+ * Append samples of a histogram in the Prometheus text format, `# TYPE`
+ * line must be written by a caller
+ * @param out output string
+ * @param name metric name
+ * @param label optional label name
+ * @param value value of the label, it is escaped
+ * @param h histogram
+ */
+void rspamd_histogram_write_prometheus (rspamd_fstring_t **out,
+		const gchar *name, const gchar *label, const gchar *value,
+		const struct rspamd_histogram *h);
+
+/**
+ * Append label value escaped according to the Prometheus text format
+ */
+void rspamd_prometheus_escape_label (rspamd_fstring_t **out,
+		const gchar *value);
+
+#endif /* SRC_LIBUTIL_HISTOGRAM_H_ */
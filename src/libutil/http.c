@@ -27,8 +27,14 @@
 #include "unix-std.h"
 #include "libutil/ssl_util.h"
 #include "libutil/regexp.h"
+#include "libutil/multipattern.h"
 #include "libserver/url.h"
 
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#define HTTP_USE_SENDFILE 1
+#endif
+
 #define ENCRYPTED_VERSION " HTTP/1.0"
 
 struct _rspamd_http_privbuf {
@@ -46,6 +52,9 @@ enum rspamd_http_priv_flags {
 };
 
 #define IS_CONN_ENCRYPTED(c) ((c)->flags & RSPAMD_HTTP_CONN_FLAG_ENCRYPTED)
+/* Encrypted bodies are always accumulated as they are decrypted at once */
+#define IS_BODY_STREAMED(conn, c) (((conn)->opts & RSPAMD_HTTP_BODY_STREAM) && \
+		!IS_CONN_ENCRYPTED (c))
 #define IS_CONN_RESETED(c) ((c)->flags & RSPAMD_HTTP_CONN_FLAG_RESETED)
 
 struct rspamd_http_connection_private {
@@ -66,6 +75,10 @@ struct rspamd_http_connection_private {
 	enum rspamd_http_priv_flags flags;
 	gsize wr_pos;
 	gsize wr_total;
+	gsize streamed;				/* body bytes passed to a streaming handler	*/
+	gint sendfile_fd;			/* body is sent from this fd after iov		*/
+	goffset sendfile_offset;
+	gsize sendfile_len;
 };
 
 enum http_magic_type {
@@ -658,7 +671,8 @@ rspamd_http_on_headers_complete (http_parser * parser)
 			return -1;
 		}
 
-		if (!rspamd_http_message_set_body (msg, NULL, parser->content_length)) {
+		if (!IS_BODY_STREAMED (conn, priv) &&
+				!rspamd_http_message_set_body (msg, NULL, parser->content_length)) {
 			return -1;
 		}
 	}
@@ -671,6 +685,11 @@ rspamd_http_on_headers_complete (http_parser * parser)
 	msg->method = parser->method;
 	msg->code = parser->status_code;
 
+	if (conn->headers_handler && !IS_CONN_ENCRYPTED (priv)) {
+		/* Headers of encrypted messages are not yet available here */
+		return conn->headers_handler (conn, msg);
+	}
+
 	return 0;
 }
 
@@ -697,6 +716,22 @@ rspamd_http_on_body (http_parser * parser, const gchar *at, size_t length)
 	pbuf = priv->buf;
 	p = at;
 
+	if (IS_BODY_STREAMED (conn, priv)) {
+		if (conn->finished) {
+			return 0;
+		}
+
+		if (conn->max_size > 0 && priv->streamed + length > conn->max_size) {
+			priv->flags |= RSPAMD_HTTP_CONN_FLAG_TOO_LARGE;
+			return -1;
+		}
+
+		/* Data is read into the private buffer and is never copied */
+		priv->streamed += length;
+
+		return (conn->body_handler (conn, msg, at, length));
+	}
+
 	if (!(msg->flags & RSPAMD_HTTP_FLAG_HAS_BODY)) {
 		if (!rspamd_http_message_set_body (msg, NULL, parser->content_length)) {
 			return -1;
@@ -941,7 +976,8 @@ rspamd_http_on_message_complete (http_parser * parser)
 			rspamd_http_connection_unref (conn);
 		}
 	}
-	else if ((conn->opts & RSPAMD_HTTP_BODY_PARTIAL) == 0 && conn->body_handler) {
+	else if ((conn->opts & RSPAMD_HTTP_BODY_PARTIAL) == 0 &&
+			!IS_BODY_STREAMED (conn, priv) && conn->body_handler) {
 		g_assert (conn->body_handler != NULL);
 		rspamd_http_connection_ref (conn);
 		ret = conn->body_handler (conn,
@@ -994,25 +1030,17 @@ rspamd_http_simple_client_helper (struct rspamd_http_connection *conn)
 	priv->msg->method = request_method;
 }
 
-static void
-rspamd_http_write_helper (struct rspamd_http_connection *conn)
+static gssize
+rspamd_http_write_iov (struct rspamd_http_connection *conn,
+		struct rspamd_http_connection_private *priv)
 {
-	struct rspamd_http_connection_private *priv;
 	struct iovec *start;
 	guint niov, i;
 	gint flags = 0;
 	gsize remain;
-	gssize r;
-	GError *err;
 	struct iovec *cur_iov;
 	struct msghdr msg;
 
-	priv = conn->priv;
-
-	if (priv->wr_pos == priv->wr_total) {
-		goto call_finish_handler;
-	}
-
 	start = &priv->out[0];
 	niov = priv->outlen;
 	remain = priv->wr_pos;
@@ -1043,11 +1071,41 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 #endif
 
 	if (priv->ssl) {
-		r = rspamd_ssl_writev (priv->ssl, msg.msg_iov, msg.msg_iovlen);
+		return rspamd_ssl_writev (priv->ssl, msg.msg_iov, msg.msg_iovlen);
+	}
+
+	return sendmsg (conn->fd, &msg, flags);
+}
+
+static void
+rspamd_http_write_helper (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv;
+	gssize r;
+	GError *err;
+
+	priv = conn->priv;
+
+	if (priv->wr_pos == priv->wr_total) {
+		goto call_finish_handler;
+	}
+
+#ifdef HTTP_USE_SENDFILE
+	if (priv->sendfile_fd != -1 &&
+			priv->wr_pos >= priv->wr_total - priv->sendfile_len) {
+		/* Headers are written, body goes directly from the file */
+		off_t off = priv->sendfile_offset +
+				(priv->wr_pos - (priv->wr_total - priv->sendfile_len));
+
+		r = sendfile (conn->fd, priv->sendfile_fd, &off,
+				priv->wr_total - priv->wr_pos);
 	}
 	else {
-		r = sendmsg (conn->fd, &msg, flags);
+		r = rspamd_http_write_iov (conn, priv);
 	}
+#else
+	r = rspamd_http_write_iov (conn, priv);
+#endif
 
 	if (r == -1) {
 		if (!priv->ssl) {
@@ -1070,7 +1128,8 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 	else {
 		/* Want to write more */
 		priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_RESETED;
-		event_add (&priv->ev, priv->ptv);
+		event_add (&priv->ev,
+				rspamd_event_common_tv (event_get_base (&priv->ev), priv->ptv));
 	}
 
 	return;
@@ -1314,6 +1373,11 @@ rspamd_http_connection_new (
 		return NULL;
 	}
 
+	if ((opts & RSPAMD_HTTP_BODY_STREAM) && body_handler == NULL) {
+		/* Body would be lost */
+		return NULL;
+	}
+
 	conn = g_slice_alloc0 (sizeof (struct rspamd_http_connection));
 	conn->opts = opts;
 	conn->type = type;
@@ -1327,6 +1391,7 @@ rspamd_http_connection_new (
 
 	/* Init priv */
 	priv = g_slice_alloc0 (sizeof (struct rspamd_http_connection_private));
+	priv->sendfile_fd = -1;
 	conn->priv = priv;
 	priv->ssl_ctx = ssl_ctx;
 
@@ -1377,6 +1442,9 @@ rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 		priv->out = NULL;
 	}
 
+	priv->sendfile_fd = -1;
+	priv->sendfile_len = 0;
+	priv->streamed = 0;
 	priv->flags |= RSPAMD_HTTP_CONN_FLAG_RESETED;
 }
 
@@ -1551,6 +1619,7 @@ rspamd_http_connection_read_message_common (struct rspamd_http_connection *conn,
 	req = rspamd_http_new_message (
 		conn->type == RSPAMD_HTTP_SERVER ? HTTP_REQUEST : HTTP_RESPONSE);
 	priv->msg = req;
+	priv->streamed = 0;
 	req->flags = flags;
 
 	if (flags & RSPAMD_HTTP_FLAG_SHMEM) {
@@ -1587,7 +1656,8 @@ rspamd_http_connection_read_message_common (struct rspamd_http_connection *conn,
 	}
 
 	priv->flags &= ~RSPAMD_HTTP_CONN_FLAG_RESETED;
-	event_add (&priv->ev, priv->ptv);
+	event_add (&priv->ev,
+			rspamd_event_common_tv (event_get_base (&priv->ev), priv->ptv));
 }
 
 void
@@ -1710,6 +1780,44 @@ rspamd_http_connection_encrypt_message (
 	g_free (segments);
 }
 
+/*
+ * Encryption is done in place, so instead of copying a shared body it is
+ * mapped privately: pages are copied on write while the unmodified ones stay
+ * in the page cache
+ */
+static gboolean
+rspamd_http_privatize_shared (struct rspamd_http_message *msg)
+{
+	union _rspamd_storage_u *storage = &msg->body_buf.c;
+	struct stat st;
+	gchar *np;
+	goffset off;
+
+	if (storage->shared.shm_fd == -1 || msg->body_buf.str == MAP_FAILED) {
+		return FALSE;
+	}
+
+	if (fstat (storage->shared.shm_fd, &st) == -1 || st.st_size == 0) {
+		return FALSE;
+	}
+
+	np = mmap (NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+			storage->shared.shm_fd, 0);
+
+	if (np == MAP_FAILED) {
+		return FALSE;
+	}
+
+	off = msg->body_buf.begin - msg->body_buf.str;
+	munmap (msg->body_buf.str, st.st_size);
+	msg->body_buf.str = np;
+	msg->body_buf.begin = np + off;
+	/* Changes are not visible to other processes */
+	msg->flags |= RSPAMD_HTTP_FLAG_SHMEM_IMMUTABLE;
+
+	return TRUE;
+}
+
 static void
 rspamd_http_detach_shared (struct rspamd_http_message *msg)
 {
@@ -1735,6 +1843,11 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 	gchar datebuf[64];
 	gint meth_len = 0;
 	struct tm t, *ptm;
+	const gchar *conn_type = "close";
+
+	if (msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE) {
+		conn_type = "keep-alive";
+	}
 
 	if (conn->type == RSPAMD_HTTP_SERVER) {
 		/* Format reply */
@@ -1779,34 +1892,36 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 				meth_len =
 						rspamd_snprintf (repbuf, replen,
 								"HTTP/1.1 %d %T\r\n"
-								"Connection: close\r\n"
+								"Connection: %s\r\n"
 								"Server: %s\r\n"
 								"Date: %s\r\n"
 								"Content-Length: %z\r\n"
 								"Content-Type: %s", /* NO \r\n at the end ! */
-								msg->code, &status, "rspamd/" RVERSION, datebuf,
+								msg->code, &status, conn_type,
+								"rspamd/" RVERSION, datebuf,
 								bodylen, mime_type);
 				enclen += meth_len;
 				/* External reply */
 				rspamd_printf_fstring (buf,
 						"HTTP/1.1 200 OK\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: rspamd\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: application/octet-stream\r\n",
-						datebuf, enclen);
+						conn_type, datebuf, enclen);
 			}
 			else {
 				meth_len =
 						rspamd_printf_fstring (buf,
 								"HTTP/1.1 %d %T\r\n"
-								"Connection: close\r\n"
+								"Connection: %s\r\n"
 								"Server: %s\r\n"
 								"Date: %s\r\n"
 								"Content-Length: %z\r\n"
 								"Content-Type: %s\r\n",
-								msg->code, &status, "rspamd/" RVERSION, datebuf,
+								msg->code, &status, conn_type,
+								"rspamd/" RVERSION, datebuf,
 								bodylen, mime_type);
 			}
 		}
@@ -1852,45 +1967,50 @@ rspamd_http_message_write_header (const gchar* mime_type, gboolean encrypted,
 							mime_type);
 				}
 			}
+
+			if (msg->flags & RSPAMD_HTTP_FLAG_KEEPALIVE) {
+				/* HTTP/1.0 connections are not persistent by default */
+				rspamd_printf_fstring (buf, "Connection: keep-alive\r\n");
+			}
 		}
 		else {
 			if (encrypted) {
 				if (host != NULL) {
 					rspamd_printf_fstring (buf,
 							"%s %s HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %s\r\n"
 							"Content-Length: %z\r\n"
 							"Content-Type: application/octet-stream\r\n",
-							"POST", "/post", host, enclen);
+							"POST", "/post", conn_type, host, enclen);
 				}
 				else {
 					rspamd_printf_fstring (buf,
 							"%s %s HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %V\r\n"
 							"Content-Length: %z\r\n"
 							"Content-Type: application/octet-stream\r\n",
-							"POST", "/post", msg->host, enclen);
+							"POST", "/post", conn_type, msg->host, enclen);
 				}
 			}
 			else {
 				if (host != NULL) {
 					rspamd_printf_fstring (buf,
-							"%s %V HTTP/1.1\r\nConnection: close\r\n"
+							"%s %V HTTP/1.1\r\nConnection: %s\r\n"
 							"Host: %s\r\n"
 							"Content-Length: %z\r\n",
-							http_method_str (msg->method), msg->url, host,
-							bodylen);
+							http_method_str (msg->method), msg->url, conn_type,
+							host, bodylen);
 				}
 				else {
 					rspamd_printf_fstring (buf,
 							"%s %V HTTP/1.1\r\n"
-							"Connection: close\r\n"
+							"Connection: %s\r\n"
 							"Host: %V\r\n"
 							"Content-Length: %z\r\n",
-							http_method_str (msg->method), msg->url, msg->host,
-							bodylen);
+							http_method_str (msg->method), msg->url, conn_type,
+							msg->host, bodylen);
 				}
 
 				if (bodylen > 0) {
@@ -1984,7 +2104,10 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 			(RSPAMD_HTTP_FLAG_SHMEM_IMMUTABLE|RSPAMD_HTTP_FLAG_SHMEM))) {
 		/* We cannot use immutable body to encrypt message in place */
 		allow_shared = FALSE;
-		rspamd_http_detach_shared (msg);
+
+		if (!rspamd_http_privatize_shared (msg)) {
+			rspamd_http_detach_shared (msg);
+		}
 	}
 
 	if (allow_shared) {
@@ -2117,6 +2240,23 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 
 	peer_key = msg->peer_key;
 
+#ifdef HTTP_USE_SENDFILE
+	if (!encrypted && pbody != NULL && msg->method < HTTP_SYMBOLS &&
+			!(msg->flags & RSPAMD_HTTP_FLAG_SSL) &&
+			(msg->flags & RSPAMD_HTTP_FLAG_SHMEM) &&
+			msg->body_buf.c.shared.shm_fd != -1) {
+		/* File backed body is not copied through user space */
+		priv->sendfile_fd = msg->body_buf.c.shared.shm_fd;
+		priv->sendfile_offset = msg->body_buf.begin - msg->body_buf.str;
+		priv->sendfile_len = bodylen;
+		priv->outlen --;
+	}
+	else {
+		priv->sendfile_fd = -1;
+		priv->sendfile_len = 0;
+	}
+#endif
+
 	priv->wr_total = bodylen + 2;
 
 	hdrcount = 0;
@@ -2215,7 +2355,7 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 			priv->wr_total -= 2;
 		}
 
-		if (pbody != NULL) {
+		if (pbody != NULL && priv->sendfile_fd == -1) {
 			priv->out[i].iov_base = pbody;
 			priv->out[i++].iov_len = bodylen;
 		}
@@ -2270,7 +2410,8 @@ rspamd_http_connection_write_message_common (struct rspamd_http_connection *conn
 			event_base_set (base, &priv->ev);
 		}
 
-		event_add (&priv->ev, priv->ptv);
+		event_add (&priv->ev,
+				rspamd_event_common_tv (event_get_base (&priv->ev), priv->ptv));
 	}
 }
 
@@ -2713,6 +2854,7 @@ rspamd_http_message_storage_cleanup (struct rspamd_http_message *msg)
 
 		if (storage->shared.name != NULL) {
 			REF_RELEASE (storage->shared.name);
+			storage->shared.name = NULL;
 		}
 
 		storage->shared.shm_fd = -1;
@@ -2736,6 +2878,14 @@ rspamd_http_connection_set_max_size (struct rspamd_http_connection *conn,
 	conn->max_size = sz;
 }
 
+void
+rspamd_http_connection_set_headers_handler (
+		struct rspamd_http_connection *conn,
+		rspamd_http_headers_handler_t handler)
+{
+	conn->headers_handler = handler;
+}
+
 void
 rspamd_http_message_free (struct rspamd_http_message *msg)
 {
@@ -3093,6 +3243,83 @@ rspamd_http_router_send_error (GError *err,
 }
 
 
+struct rspamd_http_router_re_cbdata {
+	struct rspamd_http_connection_router *router;
+	rspamd_ftok_t *lookup;
+	guchar *checked;
+	guint best;
+};
+
+/*
+ * Hyperscan is used as a caseless prefilter, so each candidate is confirmed
+ * by its own regexp
+ */
+static gint
+rspamd_http_router_re_cb (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	struct rspamd_http_router_re_cbdata *cbd = context;
+	rspamd_regexp_t *re;
+
+	if (strnum < cbd->best && !cbd->checked[strnum]) {
+		cbd->checked[strnum] = 1;
+		re = g_ptr_array_index (cbd->router->regexps, strnum);
+
+		if (rspamd_regexp_match (re, cbd->lookup->begin, cbd->lookup->len,
+				TRUE)) {
+			cbd->best = strnum;
+
+			if (strnum == 0) {
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void
+rspamd_http_router_compile_regexps (struct rspamd_http_connection_router *router)
+{
+	struct rspamd_multipattern *mp;
+	rspamd_regexp_t *re;
+	GError *err = NULL;
+	guint i;
+
+	/* Without hyperscan RE patterns are not supported by multipattern */
+	if (router->regexps->len < 2 || !rspamd_multipattern_has_hyperscan ()) {
+		router->regexps_mp_failed = TRUE;
+
+		return;
+	}
+
+	mp = rspamd_multipattern_create_sized (router->regexps->len,
+			RSPAMD_MULTIPATTERN_ICASE);
+
+	for (i = 0; i < router->regexps->len; i ++) {
+		re = g_ptr_array_index (router->regexps, i);
+		rspamd_multipattern_add_pattern (mp, rspamd_regexp_get_pattern (re),
+				RSPAMD_MULTIPATTERN_RE);
+	}
+
+	if (!rspamd_multipattern_compile (mp, &err)) {
+		msg_info ("cannot compile router regexps, check them one by one: %e",
+				err);
+		g_error_free (err);
+		rspamd_multipattern_destroy (mp);
+		router->regexps_mp_failed = TRUE;
+
+		return;
+	}
+
+	router->regexps_mp = mp;
+}
+
 static int
 rspamd_http_router_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
@@ -3104,6 +3331,7 @@ rspamd_http_router_finish_handler (struct rspamd_http_connection *conn,
 	GError *err;
 	rspamd_ftok_t lookup;
 	struct http_parser_url u;
+	struct rspamd_http_router_re_cbdata cbd;
 	guint i;
 	rspamd_regexp_t *re;
 	struct rspamd_http_connection_router *router;
@@ -3179,16 +3407,40 @@ rspamd_http_router_finish_handler (struct rspamd_http_connection *conn,
 		}
 		else {
 			/* Try regexps */
-			for (i = 0; i < router->regexps->len; i ++) {
-				re = g_ptr_array_index (router->regexps, i);
-				if (rspamd_regexp_match (re, lookup.begin, lookup.len,
-						TRUE)) {
+			if (router->regexps_mp == NULL && !router->regexps_mp_failed) {
+				rspamd_http_router_compile_regexps (router);
+			}
+
+			if (router->regexps_mp != NULL) {
+				/* Check all regexps in one pass, the first added one wins */
+				cbd.router = router;
+				cbd.lookup = &lookup;
+				cbd.best = G_MAXUINT;
+				cbd.checked = g_malloc0 (router->regexps->len);
+				rspamd_multipattern_lookup (router->regexps_mp, lookup.begin,
+						lookup.len, rspamd_http_router_re_cb, &cbd, NULL);
+				g_free (cbd.checked);
+
+				if (cbd.best != G_MAXUINT) {
+					re = g_ptr_array_index (router->regexps, cbd.best);
 					found = rspamd_regexp_get_ud (re);
 					memcpy (&handler, &found, sizeof (found));
 
 					return handler (entry, msg);
 				}
 			}
+			else {
+				for (i = 0; i < router->regexps->len; i ++) {
+					re = g_ptr_array_index (router->regexps, i);
+					if (rspamd_regexp_match (re, lookup.begin, lookup.len,
+							TRUE)) {
+						found = rspamd_regexp_get_ud (re);
+						memcpy (&handler, &found, sizeof (found));
+
+						return handler (entry, msg);
+					}
+				}
+			}
 
 			/* Now try plain file */
 			if (entry->rt->default_fs_path == NULL || lookup.len == 0 ||
@@ -3336,6 +3588,14 @@ rspamd_http_router_add_regexp (struct rspamd_http_connection_router *router,
 		memcpy (&ptr, &handler, sizeof (ptr));
 		rspamd_regexp_set_ud (re, ptr);
 		g_ptr_array_add (router->regexps, rspamd_regexp_ref (re));
+
+		/* Rebuild prefilter on the next request */
+		if (router->regexps_mp != NULL) {
+			rspamd_multipattern_destroy (router->regexps_mp);
+			router->regexps_mp = NULL;
+		}
+
+		router->regexps_mp_failed = FALSE;
 	}
 }
 
@@ -3396,6 +3656,10 @@ rspamd_http_router_free (struct rspamd_http_connection_router *router)
 			rspamd_regexp_unref (re);
 		}
 
+		if (router->regexps_mp != NULL) {
+			rspamd_multipattern_destroy (router->regexps_mp);
+		}
+
 		g_ptr_array_free (router->regexps, TRUE);
 		g_hash_table_unref (router->paths);
 		g_hash_table_unref (router->response_headers);
@@ -3798,3 +4062,156 @@ rspamd_http_normalize_path_inplace (gchar *path, gsize len, gsize *nlen)
 		*nlen = (o - path);
 	}
 }
+
+gboolean
+rspamd_http_message_is_keepalive (struct rspamd_http_message *msg)
+{
+	const rspamd_ftok_t *hdr;
+	rspamd_ftok_t srch;
+
+	hdr = rspamd_http_message_find_header (msg, "Connection");
+
+	if (hdr) {
+		RSPAMD_FTOK_ASSIGN (&srch, "keep-alive");
+
+		return rspamd_ftok_casecmp (hdr, &srch) == 0;
+	}
+
+	return FALSE;
+}
+
+struct rspamd_http_keepalive_pool {
+	struct event_base *ev_base;
+	GHashTable *elts;
+	gdouble timeout;
+	guint max_conns;
+};
+
+struct rspamd_http_keepalive_conn {
+	struct rspamd_http_keepalive_pool *pool;
+	GQueue *queue;
+	GList *link;
+	struct event ev;
+	gint fd;
+};
+
+static void
+rspamd_http_keepalive_conn_free (struct rspamd_http_keepalive_conn *kc,
+		gboolean close_fd)
+{
+	event_del (&kc->ev);
+	g_queue_delete_link (kc->queue, kc->link);
+
+	if (close_fd) {
+		close (kc->fd);
+	}
+
+	g_slice_free1 (sizeof (*kc), kc);
+}
+
+static void
+rspamd_http_keepalive_queue_dtor (gpointer p)
+{
+	GQueue *queue = p;
+	struct rspamd_http_keepalive_conn *kc;
+
+	while ((kc = g_queue_peek_head (queue)) != NULL) {
+		rspamd_http_keepalive_conn_free (kc, TRUE);
+	}
+
+	g_queue_free (queue);
+}
+
+static void
+rspamd_http_keepalive_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_http_keepalive_conn *kc = ud;
+
+	/* Idle connection is either expired or closed (or broken) by peer */
+	msg_debug ("remove idle keep-alive connection: %s",
+			(what & EV_TIMEOUT) ? "timeout" : "closed");
+	rspamd_http_keepalive_conn_free (kc, TRUE);
+}
+
+struct rspamd_http_keepalive_pool *
+rspamd_http_keepalive_pool_new (struct event_base *ev_base, gdouble timeout,
+		guint max_conns)
+{
+	struct rspamd_http_keepalive_pool *pool;
+
+	pool = g_malloc0 (sizeof (*pool));
+	pool->ev_base = ev_base;
+	pool->timeout = timeout;
+	pool->max_conns = max_conns;
+	pool->elts = g_hash_table_new_full (rspamd_inet_address_hash,
+			rspamd_inet_address_equal,
+			(GDestroyNotify)rspamd_inet_address_destroy,
+			rspamd_http_keepalive_queue_dtor);
+
+	return pool;
+}
+
+gint
+rspamd_http_keepalive_pool_get (struct rspamd_http_keepalive_pool *pool,
+		const rspamd_inet_addr_t *addr)
+{
+	GQueue *queue;
+	struct rspamd_http_keepalive_conn *kc;
+	gint fd;
+
+	queue = g_hash_table_lookup (pool->elts, addr);
+
+	if (queue == NULL || (kc = g_queue_peek_head (queue)) == NULL) {
+		return -1;
+	}
+
+	/* The most recently used connection is the least likely to be expired */
+	fd = kc->fd;
+	rspamd_http_keepalive_conn_free (kc, FALSE);
+
+	return fd;
+}
+
+gboolean
+rspamd_http_keepalive_pool_push (struct rspamd_http_keepalive_pool *pool,
+		const rspamd_inet_addr_t *addr, gint fd)
+{
+	GQueue *queue;
+	struct rspamd_http_keepalive_conn *kc;
+	struct timeval tv;
+
+	queue = g_hash_table_lookup (pool->elts, addr);
+
+	if (queue == NULL) {
+		queue = g_queue_new ();
+		g_hash_table_insert (pool->elts, rspamd_inet_address_copy (addr),
+				queue);
+	}
+	else if (g_queue_get_length (queue) >= pool->max_conns) {
+		return FALSE;
+	}
+
+	kc = g_slice_alloc0 (sizeof (*kc));
+	kc->pool = pool;
+	kc->queue = queue;
+	kc->fd = fd;
+	g_queue_push_head (queue, kc);
+	kc->link = g_queue_peek_head_link (queue);
+
+	double_to_tv (pool->timeout, &tv);
+	event_set (&kc->ev, fd, EV_READ | EV_TIMEOUT,
+			rspamd_http_keepalive_handler, kc);
+	event_base_set (pool->ev_base, &kc->ev);
+	event_add (&kc->ev, rspamd_event_common_tv (pool->ev_base, &tv));
+
+	return TRUE;
+}
+
+void
+rspamd_http_keepalive_pool_destroy (struct rspamd_http_keepalive_pool *pool)
+{
+	if (pool) {
+		g_hash_table_unref (pool->elts);
+		g_free (pool);
+	}
+}
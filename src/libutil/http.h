@@ -29,6 +29,7 @@
 #include "keypairs_cache.h"
 #include "fstring.h"
 #include "ref.h"
+#include "addr.h"
 
 enum rspamd_http_connection_type {
 	RSPAMD_HTTP_SERVER,
@@ -41,6 +42,7 @@ struct rspamd_http_connection_private;
 struct rspamd_http_connection;
 struct rspamd_http_connection_router;
 struct rspamd_http_connection_entry;
+struct rspamd_multipattern;
 
 struct rspamd_storage_shmem {
 	gchar *shm_name;
@@ -71,6 +73,10 @@ struct rspamd_storage_shmem {
  * Do not verify server's certificate
  */
 #define RSPAMD_HTTP_FLAG_SSL_NOVERIFY (1 << 6)
+/**
+ * Ask peer to keep connection alive after this message
+ */
+#define RSPAMD_HTTP_FLAG_KEEPALIVE (1 << 7)
 /**
  * Options for HTTP connection
  */
@@ -79,6 +85,7 @@ enum rspamd_http_options {
 	RSPAMD_HTTP_CLIENT_SIMPLE = 0x2, /**< Read HTTP client reply automatically */      //!< RSPAMD_HTTP_CLIENT_SIMPLE
 	RSPAMD_HTTP_CLIENT_ENCRYPTED = 0x4, /**< Encrypt data for client */                //!< RSPAMD_HTTP_CLIENT_ENCRYPTED
 	RSPAMD_HTTP_CLIENT_SHARED = 0x8, /**< Store reply in shared memory */              //!< RSPAMD_HTTP_CLIENT_SHARED
+	RSPAMD_HTTP_BODY_STREAM = 0x10, /**< Pass body portions to body handler without storing them */ //!< RSPAMD_HTTP_BODY_STREAM
 };
 
 typedef int (*rspamd_http_body_handler_t) (struct rspamd_http_connection *conn,
@@ -92,6 +99,9 @@ typedef void (*rspamd_http_error_handler_t) (struct rspamd_http_connection *conn
 typedef int (*rspamd_http_finish_handler_t) (struct rspamd_http_connection *conn,
 		struct rspamd_http_message *msg);
 
+typedef int (*rspamd_http_headers_handler_t) (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg);
+
 typedef int (*rspamd_http_router_handler_t) (struct rspamd_http_connection_entry
 		*conn_ent,
 		struct rspamd_http_message *msg);
@@ -109,6 +119,7 @@ struct rspamd_http_connection {
 	rspamd_http_body_handler_t body_handler;
 	rspamd_http_error_handler_t error_handler;
 	rspamd_http_finish_handler_t finish_handler;
+	rspamd_http_headers_handler_t headers_handler;
 	struct rspamd_keypair_cache *cache;
 	gpointer ud;
 	gsize max_size;
@@ -132,6 +143,8 @@ struct rspamd_http_connection_router {
 	GHashTable *paths;
 	GHashTable *response_headers;
 	GPtrArray *regexps;
+	struct rspamd_multipattern *regexps_mp; /* prefilter for regexps, built on the first use */
+	gboolean regexps_mp_failed;
 	struct timeval tv;
 	struct timeval *ptv;
 	struct event_base *ev_base;
@@ -144,7 +157,9 @@ struct rspamd_http_connection_router {
 };
 
 /**
- * Create new http connection
+ * Create new http connection. With RSPAMD_HTTP_BODY_STREAM unencrypted bodies
+ * are not stored in a message, so body handler should save them somewhere
+ * (e.g. to a file sized by `Content-Length`)
  * @param handler_t handler_t for body
  * @param opts options
  * @return new connection structure
@@ -428,6 +443,16 @@ void rspamd_http_message_free (struct rspamd_http_message *msg);
 void rspamd_http_connection_set_max_size (struct rspamd_http_connection *conn,
 		gsize sz);
 
+/**
+ * Sets handler that is called when all headers of a plain (not encrypted)
+ * message are read but the body is likely still being received
+ * @param conn
+ * @param handler
+ */
+void rspamd_http_connection_set_headers_handler (
+		struct rspamd_http_connection *conn,
+		rspamd_http_headers_handler_t handler);
+
 /**
  * Increase refcount for shared file (if any) to prevent early memory unlinking
  * @param msg
@@ -555,4 +580,49 @@ glong rspamd_http_date_format (gchar *buf, gsize len, time_t time);
  */
 void rspamd_http_normalize_path_inplace (gchar *path, gsize len, gsize *nlen);
 
+/**
+ * Returns TRUE if a message has `Connection: keep-alive` header
+ * @param msg
+ * @return
+ */
+gboolean rspamd_http_message_is_keepalive (struct rspamd_http_message *msg);
+
+struct rspamd_http_keepalive_pool;
+
+/**
+ * Creates pool of idle persistent connections grouped by peer's address
+ * @param ev_base event base used to watch idle connections
+ * @param timeout time after which an idle connection is closed
+ * @param max_conns maximum number of idle connections per address
+ * @return new pool
+ */
+struct rspamd_http_keepalive_pool *rspamd_http_keepalive_pool_new (
+		struct event_base *ev_base, gdouble timeout, guint max_conns);
+
+/**
+ * Returns an idle connected socket for the specified address
+ * @param pool
+ * @param addr
+ * @return socket or -1 if there are no idle connections
+ */
+gint rspamd_http_keepalive_pool_get (struct rspamd_http_keepalive_pool *pool,
+		const rspamd_inet_addr_t *addr);
+
+/**
+ * Stores socket as an idle connection to the specified address, pool
+ * closes it if the peer closes connection or it expires
+ * @param pool
+ * @param addr
+ * @param fd
+ * @return FALSE if socket has not been stored and should be closed by caller
+ */
+gboolean rspamd_http_keepalive_pool_push (struct rspamd_http_keepalive_pool *pool,
+		const rspamd_inet_addr_t *addr, gint fd);
+
+/**
+ * Closes all idle connections and destroys pool
+ * @param pool
+ */
+void rspamd_http_keepalive_pool_destroy (struct rspamd_http_keepalive_pool *pool);
+
 #endif /* HTTP_H_ */
@@ -49,6 +49,18 @@ struct rspamd_logger_error_log {
 	guint cur_row;
 };
 
+struct rspamd_log_ring {
+	guint size;
+	guint dropped;
+	/* Avoid false cache sharing between producer and consumer */
+	guchar __padding1[64 - sizeof (guint) * 2];
+	guint head; /* written by producer */
+	guchar __padding2[64 - sizeof (guint)];
+	guint tail; /* written by consumer */
+	guchar __padding3[64 - sizeof (guint)];
+	guchar data[];
+};
+
 /**
  * Static structure that store logging parameters
  * It is NOT shared between processes and is created by main process
@@ -65,6 +77,7 @@ struct rspamd_logger_s {
 		u_char *buf;
 	} io_buf;
 	gint fd;
+	struct rspamd_log_ring *ring;
 	gboolean is_buffered;
 	gboolean enabled;
 	gboolean is_debug;
@@ -740,6 +753,48 @@ fill_buffer (rspamd_logger_t *rspamd_log, const struct iovec *iov, gint iovcnt)
 
 }
 
+/*
+ * Copy a line to the ring or drop it if there is no space, never blocks
+ */
+static gboolean
+rspamd_log_ring_write (struct rspamd_log_ring *ring,
+		const struct iovec *iov, guint iovcnt)
+{
+	guint head, tail, off, n, i;
+	gsize len = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	head = ring->head;
+	tail = g_atomic_int_get (&ring->tail);
+
+	if (len > ring->size - (head - tail)) {
+		g_atomic_int_inc (&ring->dropped);
+
+		return FALSE;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		off = head & (ring->size - 1);
+		n = MIN (iov[i].iov_len, ring->size - off);
+		memcpy (ring->data + off, iov[i].iov_base, n);
+
+		if (n < iov[i].iov_len) {
+			memcpy (ring->data, ((const guchar *)iov[i].iov_base) + n,
+					iov[i].iov_len - n);
+		}
+
+		head += iov[i].iov_len;
+	}
+
+	/* Publish line */
+	g_atomic_int_set (&ring->head, head);
+
+	return TRUE;
+}
+
 /*
  * Write message to buffer or to file (using direct_write_log_line function)
  */
@@ -751,7 +806,10 @@ file_log_helper (rspamd_logger_t *rspamd_log,
 	size_t len = 0;
 	guint i;
 
-	if (!rspamd_log->is_buffered) {
+	if (rspamd_log->ring) {
+		rspamd_log_ring_write (rspamd_log->ring, iov, iovcnt);
+	}
+	else if (!rspamd_log->is_buffered) {
 		/* Write string directly */
 		direct_write_log_line (rspamd_log, (void *) iov, iovcnt, TRUE);
 	}
@@ -1262,3 +1320,95 @@ rspamd_log_errorbuf_export (const rspamd_logger_t *logger)
 
 	return top;
 }
+
+struct rspamd_log_ring *
+rspamd_log_ring_new (gsize size)
+{
+	struct rspamd_log_ring *ring;
+	gsize rsize = 4096;
+
+	while (rsize < size && rsize < G_MAXINT) {
+		rsize <<= 1;
+	}
+
+	ring = mmap (NULL, sizeof (*ring) + rsize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANON, -1, 0);
+
+	if (ring == MAP_FAILED) {
+		msg_err ("cannot allocate log ring of %z bytes: %s", rsize,
+				strerror (errno));
+
+		return NULL;
+	}
+
+	memset (ring, 0, sizeof (*ring));
+	ring->size = rsize;
+
+	return ring;
+}
+
+void
+rspamd_log_ring_destroy (struct rspamd_log_ring *ring)
+{
+	if (ring) {
+		munmap (ring, sizeof (*ring) + ring->size);
+	}
+}
+
+void
+rspamd_log_set_ring (rspamd_logger_t *logger, struct rspamd_log_ring *ring)
+{
+	g_assert (logger != NULL);
+
+	if (ring && (logger->type == RSPAMD_LOG_FILE ||
+			logger->type == RSPAMD_LOG_CONSOLE)) {
+		rspamd_log_flush (logger);
+		logger->ring = ring;
+	}
+	else {
+		logger->ring = NULL;
+	}
+}
+
+gsize
+rspamd_log_ring_drain (rspamd_logger_t *logger, struct rspamd_log_ring *ring,
+		pid_t pid)
+{
+	struct iovec iov[2];
+	guint head, tail, off, len, dropped;
+	gint iovcnt = 1;
+
+	g_assert (logger != NULL);
+
+	head = g_atomic_int_get (&ring->head);
+	tail = ring->tail;
+	len = head - tail;
+
+	if (len > 0) {
+		off = tail & (ring->size - 1);
+		iov[0].iov_base = ring->data + off;
+		iov[0].iov_len = MIN (len, ring->size - off);
+
+		if (iov[0].iov_len < len) {
+			iov[1].iov_base = ring->data;
+			iov[1].iov_len = len - iov[0].iov_len;
+			iovcnt = 2;
+		}
+
+		if (logger->enabled) {
+			direct_write_log_line (logger, iov, iovcnt, TRUE);
+		}
+
+		g_atomic_int_set (&ring->tail, head);
+	}
+
+	dropped = g_atomic_int_get (&ring->dropped);
+
+	if (dropped > 0) {
+		g_atomic_int_add (&ring->dropped, -((gint)dropped));
+		msg_warn ("dropped %ud log lines of process %P as log ring is full",
+				dropped, pid);
+	}
+
+	return len;
+}
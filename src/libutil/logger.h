@@ -160,6 +160,40 @@ const guint64* rspamd_log_counters (rspamd_logger_t *logger);
  */
 ucl_object_t * rspamd_log_errorbuf_export (const rspamd_logger_t *logger);
 
+/*
+ * Log ring is a single producer, single consumer ring of log lines in shared
+ * memory: a worker writes lines to it without any locks and the main process
+ * drains it to the log file, lines that do not fit are dropped and counted
+ */
+struct rspamd_log_ring;
+
+/**
+ * Creates new log ring in anonymous shared memory (must be called before fork)
+ * @param size size of the ring (rounded up to a power of two)
+ * @return
+ */
+struct rspamd_log_ring * rspamd_log_ring_new (gsize size);
+
+/**
+ * Destroys log ring
+ */
+void rspamd_log_ring_destroy (struct rspamd_log_ring *ring);
+
+/**
+ * Makes logger to write lines to the ring instead of a file (called by a worker)
+ */
+void rspamd_log_set_ring (rspamd_logger_t *logger, struct rspamd_log_ring *ring);
+
+/**
+ * Writes all lines from the ring to the log file (called by the main process)
+ * @param logger main process logger
+ * @param ring
+ * @param pid pid of the producer
+ * @return number of bytes written
+ */
+gsize rspamd_log_ring_drain (rspamd_logger_t *logger,
+		struct rspamd_log_ring *ring, pid_t pid);
+
 /* Typical functions */
 
 /* Logging in postfix style */
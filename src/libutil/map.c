@@ -19,10 +19,14 @@
 #include "config.h"
 #include "map.h"
 #include "map_private.h"
+#include "map_compiled.h"
 #include "http.h"
 #include "http_private.h"
 #include "rspamd.h"
 #include "contrib/zstd/zstd.h"
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
 
 #ifdef WITH_HYPERSCAN
 #include "hs.h"
@@ -56,6 +60,7 @@ static void free_http_cbdata (struct http_callback_data *cbd);
 static void rspamd_map_periodic_callback (gint fd, short what, void *ud);
 static void rspamd_map_schedule_periodic (struct rspamd_map *map, gboolean locked,
 		gboolean initial, gboolean errored);
+static void hash_remove_helper (gpointer st, const gchar *key);
 
 struct rspamd_http_map_cached_cbdata {
 	struct event timeout;
@@ -63,6 +68,333 @@ struct rspamd_http_map_cached_cbdata {
 	struct rspamd_map *map;
 };
 
+static gboolean
+rspamd_map_http_can_delta (struct http_callback_data *cbd)
+{
+	struct rspamd_map *map = cbd->map;
+
+	return map->remove_callback != NULL && cbd->data->etag != NULL &&
+			*map->user_data != NULL &&
+			!cbd->bk->is_signed && !cbd->bk->is_compressed;
+}
+
+/*
+ * Applies diff to the current data: lines starting with `-` remove keys and
+ * lines starting with `+` are added as usual map lines. Removals are applied
+ * first, so a changed value is sent as a pair of lines
+ */
+static gboolean
+rspamd_map_apply_delta (struct rspamd_map *map, struct map_cb_data *cbdata,
+		const gchar *in, gsize len)
+{
+	const gchar *p = in, *end = in + len, *eol;
+	GString *added;
+	gchar *key;
+	guint nadded = 0, nremoved = 0;
+
+	if (cbdata->prev_data == NULL || map->remove_callback == NULL) {
+		return FALSE;
+	}
+
+	/* Modify data in place, so fin callback must not free it */
+	cbdata->cur_data = cbdata->prev_data;
+	cbdata->prev_data = NULL;
+	added = g_string_sized_new (len);
+
+	while (p < end) {
+		eol = memchr (p, '\n', end - p);
+
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		if (*p == '+') {
+			g_string_append_len (added, p + 1, eol - p - 1);
+			g_string_append_c (added, '\n');
+			nadded ++;
+		}
+		else if (*p == '-') {
+			key = g_strndup (p + 1, eol - p - 1);
+			g_strstrip (key);
+
+			if (*key != '\0') {
+				map->remove_callback (cbdata->cur_data, key);
+				nremoved ++;
+			}
+
+			g_free (key);
+		}
+
+		p = eol + 1;
+	}
+
+	if (added->len > 0) {
+		map->read_callback (added->str, added->len, cbdata, TRUE);
+	}
+
+	msg_info_map ("applied delta: %ud lines added, %ud lines removed",
+			nadded, nremoved);
+	g_string_free (added, TRUE);
+
+	return TRUE;
+}
+
+static void
+rspamd_map_http_save_etag (struct http_callback_data *cbd,
+		struct rspamd_http_message *msg)
+{
+	const rspamd_ftok_t *etag;
+
+	g_free (cbd->etag);
+	cbd->etag = NULL;
+	etag = rspamd_http_message_find_header (msg, "ETag");
+
+	if (etag) {
+		cbd->etag = g_strndup (etag->begin, etag->len);
+	}
+}
+
+static void
+rspamd_map_http_commit_etag (struct http_callback_data *cbd)
+{
+	g_free (cbd->data->etag);
+	cbd->data->etag = cbd->etag;
+	cbd->etag = NULL;
+}
+
+/* Decompress by chunks of this size */
+#define MAP_DECODE_CHUNK (64 * 1024)
+#ifdef WITH_ZLIB
+#define MAP_ACCEPT_ENCODING "zstd, gzip"
+#else
+#define MAP_ACCEPT_ENCODING "zstd"
+#endif
+
+struct rspamd_map_decoder {
+	struct rspamd_map *map;
+	/* If NULL, decoded data is only accumulated in the buffer */
+	struct map_cb_data *cbdata;
+	guchar *buf;
+	gsize len;
+	gsize size;
+	gsize total;
+};
+
+static void
+rspamd_map_decoder_reserve (struct rspamd_map_decoder *dec, gsize need)
+{
+	if (dec->size - dec->len < need) {
+		dec->size = MAX (dec->size * 1.5, dec->len + need);
+		dec->buf = g_realloc (dec->buf, dec->size);
+	}
+}
+
+/*
+ * Passes all complete lines to the read callback, so text maps are parsed
+ * while data is being decompressed and the whole output is never stored.
+ * Compiled maps need the whole image, so they are accumulated
+ */
+static void
+rspamd_map_decoder_flush (struct rspamd_map_decoder *dec)
+{
+	struct rspamd_map *map = dec->map;
+	const guchar *eol;
+	gsize consumed;
+
+	if (dec->cbdata == NULL || map->load_callback != NULL || dec->len == 0) {
+		return;
+	}
+
+	eol = rspamd_memrchr (dec->buf, '\n', dec->len);
+
+	if (eol != NULL) {
+		consumed = eol - dec->buf + 1;
+		map->read_callback ((gchar *)dec->buf, consumed, dec->cbdata, FALSE);
+		memmove (dec->buf, dec->buf + consumed, dec->len - consumed);
+		dec->len -= consumed;
+	}
+}
+
+static gboolean
+rspamd_map_decode_zstd (struct rspamd_map_decoder *dec,
+		const guchar *in, gsize inlen)
+{
+	struct rspamd_map *map = dec->map;
+	ZSTD_DStream *zstream;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	gsize r = 0;
+
+	zstream = ZSTD_createDStream ();
+	ZSTD_initDStream (zstream);
+
+	zin.pos = 0;
+	zin.src = in;
+	zin.size = inlen;
+	zout.pos = 0;
+	zout.size = 0;
+
+	while (zin.pos < zin.size || zout.pos == zout.size) {
+		rspamd_map_decoder_reserve (dec, ZSTD_DStreamOutSize ());
+		zout.dst = dec->buf + dec->len;
+		zout.size = dec->size - dec->len;
+		zout.pos = 0;
+
+		r = ZSTD_decompressStream (zstream, &zout, &zin);
+
+		if (ZSTD_isError (r)) {
+			msg_err_map ("cannot decompress data: %s", ZSTD_getErrorName (r));
+			ZSTD_freeDStream (zstream);
+
+			return FALSE;
+		}
+
+		dec->len += zout.pos;
+		dec->total += zout.pos;
+		rspamd_map_decoder_flush (dec);
+
+		if (zout.pos == 0 && zin.pos == zin.size) {
+			break;
+		}
+	}
+
+	ZSTD_freeDStream (zstream);
+
+	if (r != 0) {
+		msg_err_map ("cannot decompress data: truncated input");
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+#ifdef WITH_ZLIB
+static gboolean
+rspamd_map_decode_gzip (struct rspamd_map_decoder *dec,
+		const guchar *in, gsize inlen)
+{
+	struct rspamd_map *map = dec->map;
+	z_stream strm;
+	gsize produced;
+	gint rc;
+
+	memset (&strm, 0, sizeof (strm));
+
+	/* Detect gzip or zlib header automatically */
+	if (inflateInit2 (&strm, MAX_WBITS + 32) != Z_OK) {
+		msg_err_map ("cannot init inflate: %s", strm.msg);
+
+		return FALSE;
+	}
+
+	strm.next_in = (Bytef *)in;
+	strm.avail_in = inlen;
+
+	do {
+		rspamd_map_decoder_reserve (dec, MAP_DECODE_CHUNK);
+		strm.next_out = dec->buf + dec->len;
+		strm.avail_out = dec->size - dec->len;
+
+		rc = inflate (&strm, Z_NO_FLUSH);
+
+		if (rc != Z_OK && rc != Z_STREAM_END) {
+			msg_err_map ("cannot decompress data: %s",
+					strm.msg ? strm.msg : "truncated input");
+			inflateEnd (&strm);
+
+			return FALSE;
+		}
+
+		produced = (dec->size - dec->len) - strm.avail_out;
+		dec->len += produced;
+		dec->total += produced;
+		rspamd_map_decoder_flush (dec);
+	} while (rc != Z_STREAM_END);
+
+	inflateEnd (&strm);
+
+	return TRUE;
+}
+#endif
+
+static gboolean
+rspamd_map_decode (struct rspamd_map_decoder *dec,
+		enum rspamd_map_encoding encoding, const guchar *in, gsize inlen)
+{
+	struct rspamd_map *map = dec->map;
+
+	switch (encoding) {
+	case RSPAMD_MAP_ENCODING_ZSTD:
+		return rspamd_map_decode_zstd (dec, in, inlen);
+#ifdef WITH_ZLIB
+	case RSPAMD_MAP_ENCODING_GZIP:
+		return rspamd_map_decode_gzip (dec, in, inlen);
+#endif
+	default:
+		msg_err_map ("unsupported content encoding: %d", (gint)encoding);
+		break;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Feeds (possibly compressed) data to the read callback of a map
+ */
+static gboolean
+rspamd_map_read_data (struct rspamd_map *map, struct map_cb_data *cbdata,
+		enum rspamd_map_encoding encoding, guchar *in, gsize inlen,
+		const gchar *src)
+{
+	struct rspamd_map_decoder dec;
+
+	if (encoding == RSPAMD_MAP_ENCODING_NONE) {
+		msg_info_map ("read map data from %s (%z bytes)", src, inlen);
+		map->read_callback ((gchar *)in, inlen, cbdata, TRUE);
+
+		return TRUE;
+	}
+
+	memset (&dec, 0, sizeof (dec));
+	dec.map = map;
+	dec.cbdata = cbdata;
+
+	if (!rspamd_map_decode (&dec, encoding, in, inlen)) {
+		g_free (dec.buf);
+
+		return FALSE;
+	}
+
+	msg_info_map ("read map data from %s (%z bytes compressed, "
+			"%z uncompressed)", src, inlen, dec.total);
+	map->read_callback ((gchar *)dec.buf, dec.len, cbdata, TRUE);
+	g_free (dec.buf);
+
+	return TRUE;
+}
+
+static enum rspamd_map_encoding
+rspamd_map_http_encoding (struct rspamd_http_message *msg)
+{
+	const rspamd_ftok_t *enc;
+
+	enc = rspamd_http_message_find_header (msg, "Content-Encoding");
+
+	if (enc == NULL || rspamd_ftok_cstr_equal (enc, "identity", TRUE)) {
+		return RSPAMD_MAP_ENCODING_NONE;
+	}
+	else if (rspamd_ftok_cstr_equal (enc, "zstd", TRUE)) {
+		return RSPAMD_MAP_ENCODING_ZSTD;
+	}
+	else if (rspamd_ftok_cstr_equal (enc, "gzip", TRUE) ||
+			rspamd_ftok_cstr_equal (enc, "x-gzip", TRUE)) {
+		return RSPAMD_MAP_ENCODING_GZIP;
+	}
+
+	return RSPAMD_MAP_ENCODING_UNKNOWN;
+}
+
 /**
  * Write HTTP request
  */
@@ -102,6 +434,20 @@ write_http_request (struct http_callback_data *cbd)
 						cbd->data->last_checked);
 				rspamd_http_message_add_header (msg, "If-Modified-Since", datebuf);
 			}
+
+			if (!cbd->check && !cbd->bk->is_signed &&
+					!cbd->bk->is_compressed) {
+				/* Signatures are checked over the raw content */
+				rspamd_http_message_add_header (msg, "Accept-Encoding",
+						MAP_ACCEPT_ENCODING);
+			}
+
+			if (!cbd->check && rspamd_map_http_can_delta (cbd)) {
+				/* Ask for a diff against the version we have (RFC 3229) */
+				rspamd_http_message_add_header (msg, "A-IM", "rspamd-diff");
+				rspamd_http_message_add_header (msg, "If-None-Match",
+						cbd->data->etag);
+			}
 		}
 		else if (cbd->stage == map_load_pubkey) {
 			msg->url = rspamd_fstring_append (msg->url,
@@ -258,6 +604,8 @@ free_http_cbdata_common (struct http_callback_data *cbd, gboolean plan_new)
 		rspamd_pubkey_unref (cbd->pk);
 	}
 
+	g_free (cbd->etag);
+
 	if (cbd->conn) {
 		rspamd_http_connection_unref (cbd->conn);
 		cbd->conn = NULL;
@@ -369,6 +717,10 @@ http_map_finish (struct rspamd_http_connection *conn,
 				cbd->data->last_checked = msg->date;
 			}
 
+			rspamd_map_http_save_etag (cbd, msg);
+			cbd->encoding = bk->is_compressed ? RSPAMD_MAP_ENCODING_ZSTD :
+					rspamd_map_http_encoding (msg);
+
 			/* Maybe we need to check signature ? */
 			if (bk->is_signed) {
 
@@ -501,6 +853,7 @@ read_data:
 			rspamd_strlcpy (map->cache->shmem_name, cbd->shmem_data->shm_name,
 					sizeof (map->cache->shmem_name));
 			map->cache->len = cbd->data_len;
+			map->cache->encoding = cbd->encoding;
 			map->cache->last_checked = cbd->data->last_checked;
 			cache_cbd = g_slice_alloc0 (sizeof (*cache_cbd));
 			cache_cbd->shm = cbd->shmem_data;
@@ -514,67 +867,63 @@ read_data:
 		}
 
 
-		if (cbd->bk->is_compressed) {
-			ZSTD_DStream *zstream;
-			ZSTD_inBuffer zin;
-			ZSTD_outBuffer zout;
-			guchar *out;
-			gsize outlen, r;
-
-			zstream = ZSTD_createDStream ();
-			ZSTD_initDStream (zstream);
-
-			zin.pos = 0;
-			zin.src = in;
-			zin.size = dlen;
+		if (!rspamd_map_read_data (map, &cbd->periodic->cbdata,
+				cbd->encoding, in, cbd->data_len, cbd->data->host)) {
+			MAP_RELEASE (cbd->shmem_data, "shmem_data");
+			munmap (in, dlen);
+			goto err;
+		}
 
-			if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-				outlen = ZSTD_DStreamOutSize ();
-			}
+		rspamd_map_http_commit_etag (cbd);
+		MAP_RELEASE (cbd->shmem_data, "shmem_data");
 
-			out = g_malloc (outlen);
+		cbd->periodic->cur_backend ++;
+		munmap (in, dlen);
+		rspamd_map_periodic_callback (-1, EV_TIMEOUT, cbd->periodic);
+	}
+	else if (msg->code == 226 && !cbd->check && cbd->stage == map_load_file) {
+		/* IM Used: body is a diff against our version */
+		struct rspamd_map_decoder dec;
+		enum rspamd_map_encoding encoding;
+		const gchar *body;
+		gsize body_len;
+		gboolean applied = FALSE;
 
-			zout.dst = out;
-			zout.pos = 0;
-			zout.size = outlen;
+		body = rspamd_http_message_get_body (msg, &body_len);
+		encoding = rspamd_map_http_encoding (msg);
+		memset (&dec, 0, sizeof (dec));
+		dec.map = map;
 
-			while (zin.pos < zin.size) {
-				r = ZSTD_decompressStream (zstream, &zout, &zin);
+		if (encoding == RSPAMD_MAP_ENCODING_NONE) {
+			applied = rspamd_map_apply_delta (map, &cbd->periodic->cbdata,
+					body, body_len);
+		}
+		else if (rspamd_map_decode (&dec, encoding, (const guchar *)body,
+				body_len)) {
+			applied = rspamd_map_apply_delta (map, &cbd->periodic->cbdata,
+					(const gchar *)dec.buf, dec.len);
+		}
 
-				if (ZSTD_isError (r)) {
-					msg_err_map ("cannot decompress data: %s",
-							ZSTD_getErrorName (r));
-					ZSTD_freeDStream (zstream);
-					g_free (out);
-					MAP_RELEASE (cbd->shmem_data, "shmem_data");
-					goto err;
-				}
+		g_free (dec.buf);
 
-				if (zout.pos == zout.size) {
-					/* We need to extend output buffer */
-					zout.size = zout.size * 1.5 + 1.0;
-					out = g_realloc (zout.dst, zout.size);
-					zout.dst = out;
-				}
-			}
+		if (!applied) {
+			msg_err_map ("cannot apply delta from %s, request full data",
+					cbd->data->host);
+			g_free (cbd->data->etag);
+			cbd->data->etag = NULL;
+			goto err;
+		}
 
-			ZSTD_freeDStream (zstream);
-			msg_info_map ("read map data from %s (%z bytes compressed, "
-					"%z uncompressed)", cbd->data->host,
-								dlen, zout.pos);
-			map->read_callback (out, zout.pos, &cbd->periodic->cbdata, TRUE);
-			g_free (out);
+		if (msg->last_modified) {
+			cbd->data->last_checked = msg->last_modified;
 		}
 		else {
-			msg_info_map ("read map data from %s (%z bytes)", cbd->data->host,
-					dlen);
-			map->read_callback (in, cbd->data_len, &cbd->periodic->cbdata, TRUE);
+			cbd->data->last_checked = msg->date;
 		}
 
-		MAP_RELEASE (cbd->shmem_data, "shmem_data");
-
+		rspamd_map_http_save_etag (cbd, msg);
+		rspamd_map_http_commit_etag (cbd);
 		cbd->periodic->cur_backend ++;
-		munmap (in, dlen);
 		rspamd_map_periodic_callback (-1, EV_TIMEOUT, cbd->periodic);
 	}
 	else if (msg->code == 304 && (cbd->check && cbd->stage == map_load_file)) {
@@ -635,6 +984,11 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 		return FALSE;
 	}
 
+	if (len > 0) {
+		/* Map is parsed sequentially, so let kernel read ahead */
+		(void)madvise (bytes, len, MADV_SEQUENTIAL);
+	}
+
 	if (bk->is_signed) {
 		if (!rspamd_map_check_file_sig (data->filename, map, bk, bytes, len)) {
 			munmap (bytes, len);
@@ -643,62 +997,24 @@ read_map_file (struct rspamd_map *map, struct file_map_data *data,
 		}
 	}
 
-	if (len > 0) {
-		if (bk->is_compressed) {
-			ZSTD_DStream *zstream;
-			ZSTD_inBuffer zin;
-			ZSTD_outBuffer zout;
-			guchar *out;
-			gsize outlen, r;
-
-			zstream = ZSTD_createDStream ();
-			ZSTD_initDStream (zstream);
-
-			zin.pos = 0;
-			zin.src = bytes;
-			zin.size = len;
-
-			if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-				outlen = ZSTD_DStreamOutSize ();
-			}
-
-			out = g_malloc (outlen);
-
-			zout.dst = out;
-			zout.pos = 0;
-			zout.size = outlen;
+	if (map->load_callback && !bk->is_compressed &&
+			rspamd_map_compiled_is_compiled (bytes, len)) {
+		/* Precompiled maps are used directly from file */
+		munmap (bytes, len);
+		msg_info_map ("load precompiled map from %s (%z bytes)",
+				data->filename, len);
 
-			while (zin.pos < zin.size) {
-				r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-				if (ZSTD_isError (r)) {
-					msg_err_map ("cannot decompress data: %s",
-							ZSTD_getErrorName (r));
-					ZSTD_freeDStream (zstream);
-					g_free (out);
-					munmap (bytes, len);
-					return FALSE;
-				}
+		return map->load_callback (data->filename, &periodic->cbdata);
+	}
 
-				if (zout.pos == zout.size) {
-					/* We need to extend output buffer */
-					zout.size = zout.size * 1.5 + 1.0;
-					out = g_realloc (zout.dst, zout.size);
-					zout.dst = out;
-				}
-			}
+	if (len > 0) {
+		if (!rspamd_map_read_data (map, &periodic->cbdata,
+				bk->is_compressed ?
+				RSPAMD_MAP_ENCODING_ZSTD : RSPAMD_MAP_ENCODING_NONE,
+				bytes, len, data->filename)) {
+			munmap (bytes, len);
 
-			ZSTD_freeDStream (zstream);
-			msg_info_map ("read map data from %s (%z bytes compressed, "
-					"%z uncompressed)", data->filename,
-					len, zout.pos);
-			map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
-			g_free (out);
-		}
-		else {
-			msg_info_map ("read map data from %s (%z bytes)", data->filename,
-					len);
-			map->read_callback (bytes, len, &periodic->cbdata, TRUE);
+			return FALSE;
 		}
 	}
 	else {
@@ -724,6 +1040,10 @@ rspamd_map_periodic_dtor (struct map_periodic_cbdata *periodic)
 
 		if (periodic->cbdata.cur_data) {
 			*periodic->map->user_data = periodic->cbdata.cur_data;
+
+			if (map->publish_callback) {
+				map->publish_callback (map, map->publish_data);
+			}
 		}
 	}
 	else {
@@ -870,61 +1190,12 @@ rspamd_map_read_cached (struct rspamd_map *map, struct rspamd_map_backend *bk,
 		return FALSE;
 	}
 
-	if (bk->is_compressed) {
-		ZSTD_DStream *zstream;
-		ZSTD_inBuffer zin;
-		ZSTD_outBuffer zout;
-		guchar *out;
-		gsize outlen, r;
-
-		zstream = ZSTD_createDStream ();
-		ZSTD_initDStream (zstream);
-
-		zin.pos = 0;
-		zin.src = in;
-		zin.size = len;
-
-		if ((outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
-			outlen = ZSTD_DStreamOutSize ();
-		}
-
-		out = g_malloc (outlen);
-
-		zout.dst = out;
-		zout.pos = 0;
-		zout.size = outlen;
-
-		while (zin.pos < zin.size) {
-			r = ZSTD_decompressStream (zstream, &zout, &zin);
-
-			if (ZSTD_isError (r)) {
-				msg_err_map ("cannot decompress data: %s",
-						ZSTD_getErrorName (r));
-				ZSTD_freeDStream (zstream);
-				g_free (out);
-				munmap (in, len);
-				return FALSE;
-			}
-
-			if (zout.pos == zout.size) {
-				/* We need to extend output buffer */
-				zout.size = zout.size * 1.5 + 1.0;
-				out = g_realloc (zout.dst, zout.size);
-				zout.dst = out;
-			}
-		}
+	if (!rspamd_map_read_data (map, &periodic->cbdata,
+			bk->is_compressed ? RSPAMD_MAP_ENCODING_ZSTD : map->cache->encoding,
+			in, map->cache->len, host)) {
+		munmap (in, len);
 
-		ZSTD_freeDStream (zstream);
-		msg_info_map ("read map data from %s (cached) (%z bytes compressed, "
-				"%z uncompressed)", host,
-				len, zout.pos);
-		map->read_callback (out, zout.pos, &periodic->cbdata, TRUE);
-		g_free (out);
-	}
-	else {
-		msg_info_map ("read map data from %s (cached) (%z bytes)", host,
-				len);
-		map->read_callback (in, len, &periodic->cbdata, TRUE);
+		return FALSE;
 	}
 
 	munmap (in, len);
@@ -1099,6 +1370,127 @@ rspamd_map_file_check_callback (gint fd, short what, void *ud)
 	rspamd_map_periodic_callback (-1, EV_TIMEOUT, periodic);
 }
 
+/*
+ * CDB files are replaced atomically by renaming a new file over the old one,
+ * so we just switch to a new database once inode or mtime are changed
+ */
+static gboolean
+rspamd_map_cdb_reopen (struct rspamd_map *map, struct cdb_map_data *data)
+{
+	struct cdb ncdb;
+	gint fd;
+
+	fd = rspamd_file_xopen (data->filename, O_RDONLY, 0);
+
+	if (fd == -1) {
+		msg_err_map ("cannot open cdb map %s: %s", data->filename,
+				strerror (errno));
+		return FALSE;
+	}
+
+	memset (&ncdb, 0, sizeof (ncdb));
+
+	if (cdb_init (&ncdb, fd) == -1) {
+		msg_err_map ("cannot load cdb map %s: %s", data->filename,
+				strerror (errno));
+		close (fd);
+
+		return FALSE;
+	}
+
+	if (data->opened) {
+		cdb_free (&data->cdb);
+		close (data->cdb.cdb_fd);
+	}
+
+	memcpy (&data->cdb, &ncdb, sizeof (ncdb));
+	data->opened = TRUE;
+	msg_info_map ("opened cdb map %s (%ud bytes)", data->filename,
+			ncdb.cdb_fsize);
+
+	return TRUE;
+}
+
+static void
+rspamd_map_cdb_check_callback (gint fd, short what, void *ud)
+{
+	struct rspamd_map *map;
+	struct map_periodic_cbdata *periodic = ud;
+	struct cdb_map_data *data;
+	struct rspamd_map_backend *bk;
+	struct stat st;
+
+	map = periodic->map;
+
+	bk = g_ptr_array_index (map->backends, periodic->cur_backend);
+	data = bk->data.cd;
+
+	if (stat (data->filename, &st) != -1 &&
+			(st.st_ino != data->st.st_ino || st.st_mtime != data->st.st_mtime ||
+			!data->opened)) {
+		if (rspamd_map_cdb_reopen (map, data)) {
+			memcpy (&data->st, &st, sizeof (struct stat));
+		}
+	}
+
+	/* Switch to the next backend, cdb maps never need to be reread */
+	periodic->cur_backend ++;
+	rspamd_map_periodic_callback (-1, EV_TIMEOUT, periodic);
+}
+
+gboolean
+rspamd_map_cdb_lookup (struct rspamd_map *map, const gchar *key, gsize keylen,
+		const gchar **value, gsize *vlen)
+{
+	struct rspamd_map_backend *bk;
+	struct cdb_map_data *data;
+	gchar lc[256], *k;
+	guint i;
+	gboolean ret = FALSE;
+
+	if (map == NULL || map->backends == NULL) {
+		return FALSE;
+	}
+
+	/* Hash maps are case insensitive, so cdb keys are stored lowercased */
+	if (keylen < sizeof (lc)) {
+		memcpy (lc, key, keylen);
+		k = lc;
+	}
+	else {
+		k = g_malloc (keylen);
+		memcpy (k, key, keylen);
+	}
+
+	rspamd_str_lc (k, keylen);
+
+	PTR_ARRAY_FOREACH (map->backends, i, bk) {
+		if (bk->protocol != MAP_PROTO_CDB || !bk->data.cd->opened) {
+			continue;
+		}
+
+		data = bk->data.cd;
+
+		if (cdb_find (&data->cdb, k, keylen) > 0) {
+			if (value) {
+				*value = cdb_getdata (&data->cdb);
+			}
+			if (vlen) {
+				*vlen = cdb_datalen (&data->cdb);
+			}
+
+			ret = TRUE;
+			break;
+		}
+	}
+
+	if (k != lc) {
+		g_free (k);
+	}
+
+	return ret;
+}
+
 static void
 rspamd_map_file_read_callback (gint fd, short what, void *ud)
 {
@@ -1180,6 +1572,11 @@ rspamd_map_periodic_callback (gint fd, short what, void *ud)
 		if (bk->protocol == MAP_PROTO_HTTP || bk->protocol == MAP_PROTO_HTTPS) {
 			rspamd_map_http_read_callback (fd, what, cbd);
 		}
+		else if (bk->protocol == MAP_PROTO_CDB) {
+			/* Nothing to read, cdb files are reopened when checked */
+			cbd->cur_backend ++;
+			rspamd_map_periodic_callback (-1, EV_TIMEOUT, cbd);
+		}
 		else {
 			rspamd_map_file_read_callback (fd, what, cbd);
 		}
@@ -1189,12 +1586,154 @@ rspamd_map_periodic_callback (gint fd, short what, void *ud)
 		if (bk->protocol == MAP_PROTO_HTTP || bk->protocol == MAP_PROTO_HTTPS) {
 			rspamd_map_http_check_callback (fd, what, cbd);
 		}
+		else if (bk->protocol == MAP_PROTO_CDB) {
+			rspamd_map_cdb_check_callback (fd, what, cbd);
+		}
 		else {
 			rspamd_map_file_check_callback (fd, what, cbd);
 		}
 	}
 }
 
+void
+rspamd_map_set_load_callback (struct rspamd_map *map,
+		map_load_cb_t load_callback)
+{
+	map->load_callback = load_callback;
+}
+
+static gboolean
+rspamd_map_has_helper (struct rspamd_config *cfg)
+{
+	GList *cur;
+	struct rspamd_worker_conf *cf;
+	GQuark type;
+
+	type = g_quark_try_string ("map_helper");
+
+	if (type == 0) {
+		return FALSE;
+	}
+
+	for (cur = cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+		cf = cur->data;
+
+		if (cf->type == type && cf->count > 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean
+rspamd_map_load_image (struct rspamd_map *map, const gchar *path)
+{
+	struct map_cb_data cbdata;
+
+	cbdata.map = map;
+	cbdata.state = 0;
+	cbdata.prev_data = *map->user_data;
+	cbdata.cur_data = NULL;
+
+	if (!map->load_callback (path, &cbdata)) {
+		return FALSE;
+	}
+
+	map->fin_callback (&cbdata);
+	*map->user_data = cbdata.cur_data;
+
+	return TRUE;
+}
+
+/*
+ * Only maps parsed by C code are loaded in the main process, as lua
+ * callbacks expect a worker context
+ */
+static gboolean
+rspamd_map_can_preload (struct rspamd_map *map)
+{
+	struct rspamd_map_backend *bk;
+	guint i;
+
+	if (map->read_callback != rspamd_radix_read &&
+			map->read_callback != rspamd_hosts_read &&
+			map->read_callback != rspamd_kv_list_read &&
+			map->read_callback != rspamd_regexp_list_read) {
+		return FALSE;
+	}
+
+	PTR_ARRAY_FOREACH (map->backends, i, bk) {
+		if (bk->protocol != MAP_PROTO_FILE) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+guint
+rspamd_map_preload (struct rspamd_config *cfg)
+{
+	GList *cur;
+	struct rspamd_map *map;
+	struct rspamd_map_backend *bk;
+	struct map_periodic_cbdata periodic;
+	struct file_map_data *data;
+	struct stat st;
+	gboolean failed;
+	guint i, nloaded = 0;
+
+	for (cur = cfg->maps; cur != NULL; cur = g_list_next (cur)) {
+		map = cur->data;
+
+		if (!rspamd_map_can_preload (map)) {
+			continue;
+		}
+
+		memset (&periodic, 0, sizeof (periodic));
+		periodic.map = map;
+		periodic.cbdata.map = map;
+		periodic.cbdata.state = 0;
+		periodic.cbdata.prev_data = *map->user_data;
+		periodic.cbdata.cur_data = NULL;
+		failed = FALSE;
+
+		PTR_ARRAY_FOREACH (map->backends, i, bk) {
+			data = bk->data.fd;
+
+			if (stat (data->filename, &st) == -1 ||
+					!read_map_file (map, data, bk, &periodic)) {
+				failed = TRUE;
+				break;
+			}
+
+			/* Workers will not reread this file unless it is modified */
+			memcpy (&data->st, &st, sizeof (st));
+		}
+
+		if (failed) {
+			/* Let workers load this map as usual */
+			PTR_ARRAY_FOREACH (map->backends, i, bk) {
+				data = bk->data.fd;
+				data->st.st_mtime = -1;
+			}
+		}
+
+		if (periodic.cbdata.cur_data) {
+			/* Fin callback destroys previous data */
+			map->fin_callback (&periodic.cbdata);
+			*map->user_data = periodic.cbdata.cur_data;
+
+			if (!failed) {
+				nloaded ++;
+			}
+		}
+	}
+
+	return nloaded;
+}
+
 /* Start watching event for all maps */
 void
 rspamd_map_watch (struct rspamd_config *cfg,
@@ -1203,6 +1742,9 @@ rspamd_map_watch (struct rspamd_config *cfg,
 {
 	GList *cur = cfg->maps;
 	struct rspamd_map *map;
+	gboolean has_helper;
+
+	has_helper = rspamd_map_has_helper (cfg);
 
 	/* First of all do synced read of data */
 	while (cur) {
@@ -1210,12 +1752,86 @@ rspamd_map_watch (struct rspamd_config *cfg,
 		map->ev_base = ev_base;
 		map->r = resolver;
 
-		rspamd_map_schedule_periodic (map, FALSE, TRUE, FALSE);
+		if (has_helper && map->load_callback) {
+			/* Map helper loads it for us */
+			if (g_atomic_int_get (&map->cache->compiled_available)) {
+				rspamd_map_load_image (map, map->cache->compiled_name);
+			}
+		}
+		else {
+			rspamd_map_schedule_periodic (map, FALSE, TRUE, FALSE);
+		}
+
+		cur = g_list_next (cur);
+	}
+}
+
+void
+rspamd_map_watch_shared (struct rspamd_config *cfg,
+		struct event_base *ev_base,
+		struct rspamd_dns_resolver *resolver,
+		rspamd_map_publish_cb publish_cb,
+		gpointer ud)
+{
+	GList *cur = cfg->maps;
+	struct rspamd_map *map;
+
+	while (cur) {
+		map = cur->data;
+
+		if (map->load_callback) {
+			map->ev_base = ev_base;
+			map->r = resolver;
+			map->publish_callback = publish_cb;
+			map->publish_data = ud;
+
+			rspamd_map_schedule_periodic (map, FALSE, TRUE, FALSE);
+		}
 
 		cur = g_list_next (cur);
 	}
 }
 
+void
+rspamd_map_set_shared_image (struct rspamd_map *map, const gchar *path)
+{
+	if (!g_atomic_int_get (&map->cache->compiled_available)) {
+		/* Path depends on map id only, so it is written once */
+		rspamd_strlcpy (map->cache->compiled_name, path,
+				sizeof (map->cache->compiled_name));
+		g_atomic_int_set (&map->cache->compiled_available, 1);
+	}
+}
+
+gboolean
+rspamd_map_load_shared (struct rspamd_config *cfg, guint32 id,
+		const gchar *path)
+{
+	GList *cur;
+	struct rspamd_map *map;
+
+	for (cur = cfg->maps; cur != NULL; cur = g_list_next (cur)) {
+		map = cur->data;
+
+		if (map->id == id) {
+			if (map->load_callback == NULL) {
+				return FALSE;
+			}
+
+			if (map->publish_callback) {
+				/* We are map helper and already have this data */
+				return TRUE;
+			}
+
+			msg_info_map ("load shared map from %s", path);
+
+			return rspamd_map_load_image (map, path);
+		}
+	}
+
+	return FALSE;
+}
+
 void
 rspamd_map_remove_all (struct rspamd_config *cfg)
 {
@@ -1318,6 +1934,12 @@ rspamd_map_check_proto (struct rspamd_config *cfg,
 		/* Exclude file:// */
 		bk->uri = g_strdup (pos);
 	}
+	else if (g_ascii_strncasecmp (pos, "cdb://", sizeof ("cdb://") - 1) == 0) {
+		bk->protocol = MAP_PROTO_CDB;
+		pos += sizeof ("cdb://") - 1;
+		/* Exclude cdb:// */
+		bk->uri = g_strdup (pos);
+	}
 	else if (*pos == '/') {
 		/* Trivial file case */
 		bk->uri = g_strdup (pos);
@@ -1348,6 +1970,9 @@ rspamd_map_is_map (const gchar *map_line)
 	else if (g_ascii_strncasecmp (map_line, "file://", sizeof ("file://") - 1) == 0) {
 		ret = TRUE;
 	}
+	else if (g_ascii_strncasecmp (map_line, "cdb://", sizeof ("cdb://") - 1) == 0) {
+		ret = TRUE;
+	}
 	else if (g_ascii_strncasecmp (map_line, "http://", sizeof ("http://") - 1) == 0) {
 		ret = TRUE;
 	}
@@ -1369,10 +1994,22 @@ rspamd_map_backend_dtor (struct rspamd_map_backend *bk)
 			g_slice_free1 (sizeof (*bk->data.fd), bk->data.fd);
 		}
 	}
+	else if (bk->protocol == MAP_PROTO_CDB) {
+		if (bk->data.cd) {
+			if (bk->data.cd->opened) {
+				cdb_free (&bk->data.cd->cdb);
+				close (bk->data.cd->cdb.cdb_fd);
+			}
+
+			g_free (bk->data.cd->filename);
+			g_slice_free1 (sizeof (*bk->data.cd), bk->data.cd);
+		}
+	}
 	else {
 		if (bk->data.hd) {
 			g_free (bk->data.hd->host);
 			g_free (bk->data.hd->path);
+			g_free (bk->data.hd->etag);
 			g_slice_free1 (sizeof (*bk->data.hd), bk->data.hd);
 		}
 	}
@@ -1390,6 +2027,7 @@ rspamd_map_parse_backend (struct rspamd_config *cfg, const gchar *map_line)
 	struct rspamd_map_backend *bk;
 	struct file_map_data *fdata = NULL;
 	struct http_map_data *hdata = NULL;
+	struct cdb_map_data *cdata = NULL;
 	struct http_parser_url up;
 	const gchar *end, *p;
 	rspamd_ftok_t tok;
@@ -1421,16 +2059,34 @@ rspamd_map_parse_backend (struct rspamd_config *cfg, const gchar *map_line)
 		if (access (bk->uri, R_OK) == -1) {
 			if (errno != ENOENT) {
 				msg_err_config ("cannot open file '%s': %s", bk->uri, strerror (errno));
-				return NULL;
-
+				return NULL;
+
+			}
+			msg_info_config (
+					"map '%s' is not found, but it can be loaded automatically later",
+					bk->uri);
+		}
+
+		fdata->filename = g_strdup (bk->uri);
+		bk->data.fd = fdata;
+	}
+	else if (bk->protocol == MAP_PROTO_CDB) {
+		cdata = g_slice_alloc0 (sizeof (struct cdb_map_data));
+		cdata->st.st_mtime = -1;
+
+		if (access (bk->uri, R_OK) == -1) {
+			if (errno != ENOENT) {
+				msg_err_config ("cannot open file '%s': %s", bk->uri, strerror (errno));
+				g_slice_free1 (sizeof (*cdata), cdata);
+				goto err;
 			}
 			msg_info_config (
-					"map '%s' is not found, but it can be loaded automatically later",
+					"cdb map '%s' is not found, but it can be loaded automatically later",
 					bk->uri);
 		}
 
-		fdata->filename = g_strdup (bk->uri);
-		bk->data.fd = fdata;
+		cdata->filename = g_strdup (bk->uri);
+		bk->data.cd = cdata;
 	}
 	else if (bk->protocol == MAP_PROTO_HTTP || bk->protocol == MAP_PROTO_HTTPS) {
 		hdata = g_slice_alloc0 (sizeof (struct http_map_data));
@@ -1529,6 +2185,12 @@ rspamd_map_add (struct rspamd_config *cfg,
 	map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (struct rspamd_map));
 	map->read_callback = read_callback;
 	map->fin_callback = fin_callback;
+
+	if (read_callback == rspamd_hosts_read ||
+			read_callback == rspamd_kv_list_read) {
+		/* Hash maps could be updated in place from deltas */
+		map->remove_callback = hash_remove_helper;
+	}
 	map->user_data = user_data;
 	map->cfg = cfg;
 	map->id = rspamd_random_uint64_fast ();
@@ -1579,6 +2241,12 @@ rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 	map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (struct rspamd_map));
 	map->read_callback = read_callback;
 	map->fin_callback = fin_callback;
+
+	if (read_callback == rspamd_hosts_read ||
+			read_callback == rspamd_kv_list_read) {
+		/* Hash maps could be updated in place from deltas */
+		map->remove_callback = hash_remove_helper;
+	}
 	map->user_data = user_data;
 	map->cfg = cfg;
 	map->id = rspamd_random_uint64_fast ();
@@ -2084,6 +2752,14 @@ hash_insert_helper (gpointer st, gconstpointer key, gconstpointer value)
 	g_hash_table_replace (ht, k, v);
 }
 
+static void
+hash_remove_helper (gpointer st, const gchar *key)
+{
+	GHashTable *ht = st;
+
+	g_hash_table_remove (ht, key);
+}
+
 /* Helpers */
 gchar *
 rspamd_hosts_read (
@@ -2193,6 +2869,155 @@ rspamd_radix_fin (struct map_cb_data *data)
 	}
 }
 
+static void
+compiled_insert_helper (gpointer st, gconstpointer key, gconstpointer value)
+{
+	struct rspamd_map_compiled *cm = st;
+	gchar **strv, **cur;
+
+	if (rspamd_map_compiled_get_type (cm) == RSPAMD_MAP_COMPILED_HASH) {
+		rspamd_map_compiled_add (cm, key, value);
+
+		return;
+	}
+
+	strv = g_strsplit_set (key, ",", 0);
+
+	for (cur = strv; *cur != NULL; cur ++) {
+		if (**cur != '\0' && !rspamd_map_compiled_add (cm, *cur, value)) {
+			msg_warn ("invalid IP address: %s", *cur);
+		}
+	}
+
+	g_strfreev (strv);
+}
+
+static gchar *
+rspamd_compiled_map_read (gchar *chunk, gint len, struct map_cb_data *data,
+		gboolean final, enum rspamd_map_compiled_type type)
+{
+	struct rspamd_map *map = data->map;
+	GError *err = NULL;
+
+	if (data->cur_data == NULL) {
+		if (chunk != NULL &&
+				rspamd_map_compiled_is_compiled ((const guchar *)chunk, len)) {
+			data->cur_data = rspamd_map_compiled_from_memory (
+					(const guchar *)chunk, len, &err);
+
+			if (data->cur_data == NULL) {
+				msg_err_map ("cannot load compiled map: %e", err);
+				g_error_free (err);
+			}
+
+			return NULL;
+		}
+
+		data->cur_data = rspamd_map_compiled_new (type);
+	}
+	else if (rspamd_map_compiled_is_finished (data->cur_data)) {
+		msg_err_map ("cannot mix compiled and text data in a single map");
+
+		return NULL;
+	}
+
+	return rspamd_parse_kv_list (
+			chunk,
+			len,
+			data,
+			compiled_insert_helper,
+			type == RSPAMD_MAP_COMPILED_HASH ? "" : hash_fill,
+			final);
+}
+
+gchar *
+rspamd_compiled_hash_read (
+	gchar * chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final)
+{
+	return rspamd_compiled_map_read (chunk, len, data, final,
+			RSPAMD_MAP_COMPILED_HASH);
+}
+
+gchar *
+rspamd_compiled_radix_read (
+	gchar * chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final)
+{
+	return rspamd_compiled_map_read (chunk, len, data, final,
+			RSPAMD_MAP_COMPILED_RADIX);
+}
+
+static gboolean
+rspamd_compiled_map_load (const gchar *fname, struct map_cb_data *data,
+		enum rspamd_map_compiled_type type)
+{
+	struct rspamd_map *map = data->map;
+	struct rspamd_map_compiled *cm;
+	GError *err = NULL;
+
+	if (data->cur_data != NULL) {
+		msg_err_map ("cannot mix compiled and text data in a single map");
+
+		return FALSE;
+	}
+
+	cm = rspamd_map_compiled_open (fname, &err);
+
+	if (cm == NULL) {
+		msg_err_map ("cannot load compiled map: %e", err);
+		g_error_free (err);
+
+		return FALSE;
+	}
+
+	if (rspamd_map_compiled_get_type (cm) != type) {
+		msg_err_map ("compiled map %s has wrong type", fname);
+		rspamd_map_compiled_unref (cm);
+
+		return FALSE;
+	}
+
+	data->cur_data = cm;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_compiled_hash_load (const gchar *fname, struct map_cb_data *data)
+{
+	return rspamd_compiled_map_load (fname, data, RSPAMD_MAP_COMPILED_HASH);
+}
+
+gboolean
+rspamd_compiled_radix_load (const gchar *fname, struct map_cb_data *data)
+{
+	return rspamd_compiled_map_load (fname, data, RSPAMD_MAP_COMPILED_RADIX);
+}
+
+void
+rspamd_compiled_map_fin (struct map_cb_data *data)
+{
+	struct rspamd_map *map = data->map;
+
+	if (data->cur_data) {
+		if (!rspamd_map_compiled_is_finished (data->cur_data)) {
+			rspamd_map_compiled_finish (data->cur_data);
+		}
+
+		msg_info_map ("read compiled map of %z elements",
+				rspamd_map_compiled_size (data->cur_data));
+	}
+
+	if (data->prev_data) {
+		rspamd_map_compiled_unref (data->prev_data);
+	}
+}
+
 struct rspamd_regexp_map {
 	struct rspamd_map *map;
 	GPtrArray *regexps;
@@ -2204,6 +3029,8 @@ struct rspamd_regexp_map {
 	const gchar **patterns;
 	gint *flags;
 	gint *ids;
+	/* Indexes of regexps checked by pcre after hyperscan */
+	GArray *pcre_only;
 #endif
 };
 
@@ -2255,6 +3082,9 @@ rspamd_regexp_map_destroy (struct rspamd_regexp_map *re_map)
 	if (re_map->ids) {
 		g_free (re_map->ids);
 	}
+	if (re_map->pcre_only) {
+		g_array_free (re_map->pcre_only, TRUE);
+	}
 #endif
 
 	g_slice_free1 (sizeof (*re_map), re_map);
@@ -2298,16 +3128,280 @@ rspamd_re_map_insert_helper (gpointer st, gconstpointer key, gconstpointer value
 	g_ptr_array_add (re_map->values, g_strdup (value));
 }
 
+#ifdef WITH_HYPERSCAN
+static const guchar rspamd_re_map_hs_magic[] = {'r', 's', 'h', 's', 'r', 'm',
+		'0', '1'};
+
+/*
+ * Hyperscan databases of regexp maps are cached in hs_cache_dir:
+ * Magic - 8 bytes
+ * Platform - sizeof (platform)
+ * n - number of regexps compiled to hyperscan
+ * n * <regexp ids>
+ * crc - 8 bytes checksum of ids and blob
+ * <hyperscan blob>
+ * Regexps that are not in ids are matched by PCRE
+ */
+static void
+rspamd_re_map_cache_path (struct rspamd_regexp_map *re_map,
+		hs_platform_info_t *plt, gchar *path, gsize len)
+{
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash_out[rspamd_cryptobox_HASHBYTES];
+	rspamd_regexp_t *re;
+	const gchar *pattern;
+	guint i, re_flags;
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, (const guchar *)hs_version (),
+			strlen (hs_version ()));
+	rspamd_cryptobox_hash_update (&st, (const guchar *)plt, sizeof (*plt));
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		re = g_ptr_array_index (re_map->regexps, i);
+		pattern = rspamd_regexp_get_pattern (re);
+		/* Include terminating zero to separate patterns */
+		rspamd_cryptobox_hash_update (&st, (const guchar *)pattern,
+				strlen (pattern) + 1);
+		rspamd_cryptobox_hash_update (&st, (const guchar *)&re_map->flags[i],
+				sizeof (re_map->flags[i]));
+		re_flags = rspamd_regexp_get_flags (re);
+		rspamd_cryptobox_hash_update (&st, (const guchar *)&re_flags,
+				sizeof (re_flags));
+	}
+
+	rspamd_cryptobox_hash_final (&st, hash_out);
+	rspamd_snprintf (path, len, "%s%c%*xs.hsre",
+			re_map->map->cfg->hs_cache_dir, G_DIR_SEPARATOR,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, hash_out);
+}
+
+static void
+rspamd_re_map_set_pcre_only (struct rspamd_regexp_map *re_map, guint n)
+{
+	guchar *in_hs;
+	guint i;
+
+	in_hs = g_malloc0 (re_map->regexps->len);
+
+	for (i = 0; i < n; i ++) {
+		in_hs[re_map->ids[i]] = 1;
+	}
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		if (!in_hs[i]) {
+			g_array_append_val (re_map->pcre_only, i);
+		}
+	}
+
+	g_free (in_hs);
+}
+
+static gboolean
+rspamd_re_map_cache_load (struct rspamd_regexp_map *re_map,
+		hs_platform_info_t *plt, const gchar *path)
+{
+	struct rspamd_map *map = re_map->map;
+	guchar *data, *p, *end;
+	gsize len;
+	gint n, i;
+	guint64 crc, real_crc;
+	rspamd_cryptobox_fast_hash_state_t crc_st;
+
+	data = rspamd_file_xmap (path, PROT_READ, &len);
+
+	if (data == NULL) {
+		return FALSE;
+	}
+
+	p = data;
+	end = data + len;
+
+	if (len < sizeof (rspamd_re_map_hs_magic) + sizeof (*plt) + sizeof (n) ||
+			memcmp (p, rspamd_re_map_hs_magic,
+					sizeof (rspamd_re_map_hs_magic)) != 0 ||
+			memcmp (p + sizeof (rspamd_re_map_hs_magic), plt,
+					sizeof (*plt)) != 0) {
+		goto err;
+	}
+
+	p += sizeof (rspamd_re_map_hs_magic) + sizeof (*plt);
+	memcpy (&n, p, sizeof (n));
+	p += sizeof (n);
+
+	if (n <= 0 || n > (gint)re_map->regexps->len ||
+			(gsize)(end - p) <= sizeof (gint) * n + sizeof (crc)) {
+		goto err;
+	}
+
+	memcpy (re_map->ids, p, sizeof (gint) * n);
+	p += sizeof (gint) * n;
+	memcpy (&crc, p, sizeof (crc));
+	p += sizeof (crc);
+
+	rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
+	rspamd_cryptobox_fast_hash_update (&crc_st, re_map->ids,
+			sizeof (gint) * n);
+	rspamd_cryptobox_fast_hash_update (&crc_st, p, end - p);
+	real_crc = rspamd_cryptobox_fast_hash_final (&crc_st);
+
+	if (crc != real_crc) {
+		msg_warn_map ("outdated or corrupted hyperscan cache %s", path);
+		goto err;
+	}
+
+	for (i = 0; i < n; i ++) {
+		if (re_map->ids[i] < 0 || re_map->ids[i] >= (gint)re_map->regexps->len) {
+			goto err;
+		}
+	}
+
+	if (hs_deserialize_database (p, end - p, &re_map->hs_db) != HS_SUCCESS) {
+		re_map->hs_db = NULL;
+		goto err;
+	}
+
+	rspamd_re_map_set_pcre_only (re_map, n);
+	munmap (data, len);
+	msg_info_map ("loaded hyperscan database for %d regexps from %s",
+			n, path);
+
+	return TRUE;
+
+err:
+	munmap (data, len);
+
+	return FALSE;
+}
+
+static void
+rspamd_re_map_cache_save (struct rspamd_regexp_map *re_map,
+		hs_platform_info_t *plt, const gchar *path, gint n)
+{
+	struct rspamd_map *map = re_map->map;
+	gchar npath[PATH_MAX], *serialized;
+	gsize serialized_len;
+	guint64 crc;
+	rspamd_cryptobox_fast_hash_state_t crc_st;
+	struct iovec iov[6];
+	gint fd;
+
+	if (hs_serialize_database (re_map->hs_db, &serialized,
+			&serialized_len) != HS_SUCCESS) {
+		msg_err_map ("cannot serialize hyperscan database");
+
+		return;
+	}
+
+	rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
+	rspamd_cryptobox_fast_hash_update (&crc_st, re_map->ids,
+			sizeof (gint) * n);
+	rspamd_cryptobox_fast_hash_update (&crc_st, serialized, serialized_len);
+	crc = rspamd_cryptobox_fast_hash_final (&crc_st);
+
+	/* Several workers could compile the same map concurrently */
+	rspamd_snprintf (npath, sizeof (npath), "%s.%P.new", path, getpid ());
+	fd = open (npath, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
+
+	if (fd == -1) {
+		msg_err_map ("cannot open file %s: %s", npath, strerror (errno));
+		g_free (serialized);
+
+		return;
+	}
+
+	iov[0].iov_base = (void *)rspamd_re_map_hs_magic;
+	iov[0].iov_len = sizeof (rspamd_re_map_hs_magic);
+	iov[1].iov_base = plt;
+	iov[1].iov_len = sizeof (*plt);
+	iov[2].iov_base = &n;
+	iov[2].iov_len = sizeof (n);
+	iov[3].iov_base = re_map->ids;
+	iov[3].iov_len = sizeof (gint) * n;
+	iov[4].iov_base = &crc;
+	iov[4].iov_len = sizeof (crc);
+	iov[5].iov_base = serialized;
+	iov[5].iov_len = serialized_len;
+
+	if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1 ||
+			rename (npath, path) == -1) {
+		msg_err_map ("cannot save hyperscan database to %s: %s", path,
+				strerror (errno));
+		unlink (npath);
+	}
+	else {
+		msg_info_map ("saved hyperscan database for %d regexps to %s",
+				n, path);
+	}
+
+	close (fd);
+	g_free (serialized);
+}
+
+/*
+ * Compiles all suitable regexps to a single database, expressions that
+ * cannot be compiled by hyperscan are left for PCRE
+ */
+static gboolean
+rspamd_re_map_compile_hs (struct rspamd_regexp_map *re_map,
+		hs_platform_info_t *plt, gint *pn)
+{
+	struct rspamd_map *map = re_map->map;
+	hs_compile_error_t *err;
+	gint n = *pn, bad;
+
+	while (n > 0) {
+		if (hs_compile_multi (re_map->patterns,
+				(const guint *)re_map->flags,
+				(const guint *)re_map->ids,
+				n,
+				HS_MODE_BLOCK,
+				plt,
+				&re_map->hs_db,
+				&err) == HS_SUCCESS) {
+			*pn = n;
+
+			return TRUE;
+		}
+
+		re_map->hs_db = NULL;
+
+		if (err->expression < 0) {
+			msg_err_map ("cannot create tree of regexp: %s", err->message);
+			hs_free_compile_error (err);
+
+			return FALSE;
+		}
+
+		bad = err->expression;
+		msg_info_map ("cannot compile '%s' to hyperscan, use pcre: %s",
+				re_map->patterns[bad], err->message);
+		hs_free_compile_error (err);
+
+		n --;
+		memmove (&re_map->patterns[bad], &re_map->patterns[bad + 1],
+				(n - bad) * sizeof (re_map->patterns[0]));
+		memmove (&re_map->flags[bad], &re_map->flags[bad + 1],
+				(n - bad) * sizeof (re_map->flags[0]));
+		memmove (&re_map->ids[bad], &re_map->ids[bad + 1],
+				(n - bad) * sizeof (re_map->ids[0]));
+	}
+
+	return FALSE;
+}
+#endif
+
 static void
 rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 {
 #ifdef WITH_HYPERSCAN
 	guint i;
+	gint n = 0;
 	hs_platform_info_t plt;
-	hs_compile_error_t *err;
 	struct rspamd_map *map;
 	rspamd_regexp_t *re;
 	gint pcre_flags;
+	gchar path[PATH_MAX];
 
 	map = re_map->map;
 
@@ -2322,13 +3416,18 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 		return;
 	}
 
+	if (re_map->regexps->len == 0) {
+		msg_err_map ("regexp map is empty");
+		return;
+	}
+
 	re_map->patterns = g_new (const gchar *, re_map->regexps->len);
 	re_map->flags = g_new (gint, re_map->regexps->len);
 	re_map->ids = g_new (gint, re_map->regexps->len);
+	re_map->pcre_only = g_array_new (FALSE, FALSE, sizeof (guint));
 
 	for (i = 0; i < re_map->regexps->len; i ++) {
 		re = g_ptr_array_index (re_map->regexps, i);
-		re_map->patterns[i] = rspamd_regexp_get_pattern (re);
 		re_map->flags[i] = HS_FLAG_SINGLEMATCH;
 		pcre_flags = rspamd_regexp_get_pcre_flags (re);
 
@@ -2353,38 +3452,52 @@ rspamd_re_map_finalize (struct rspamd_regexp_map *re_map)
 		if (rspamd_regexp_get_maxhits (re) == 1) {
 			re_map->flags[i] |= HS_FLAG_SINGLEMATCH;
 		}
-
-		re_map->ids[i] = i;
 	}
 
-	if (re_map->regexps->len > 0 && re_map->patterns) {
-		if (hs_compile_multi (re_map->patterns,
-				re_map->flags,
-				re_map->ids,
-				re_map->regexps->len,
-				HS_MODE_BLOCK,
-				&plt,
-				&re_map->hs_db,
-				&err) != HS_SUCCESS) {
-
-			msg_err_map ("cannot create tree of regexp when processing '%s': %s",
-					err->expression >= 0 ?
-							re_map->patterns[err->expression] :
-							"unknown regexp", err->message);
-			re_map->hs_db = NULL;
-			hs_free_compile_error (err);
+	if (map->cfg->hs_cache_dir) {
+		/* Hash all patterns including PCRE only ones */
+		rspamd_re_map_cache_path (re_map, &plt, path, sizeof (path));
 
-			return;
+		if (rspamd_re_map_cache_load (re_map, &plt, path)) {
+			goto alloc_scratch;
 		}
+	}
+
+	for (i = 0; i < re_map->regexps->len; i ++) {
+		re = g_ptr_array_index (re_map->regexps, i);
 
-		if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
-			msg_err_map ("cannot allocate scratch space for hyperscan");
-			hs_free_database (re_map->hs_db);
-			re_map->hs_db = NULL;
+		if (rspamd_regexp_get_flags (re) & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
+			continue;
 		}
+
+		re_map->patterns[n] = rspamd_regexp_get_pattern (re);
+		re_map->flags[n] = re_map->flags[i];
+		re_map->ids[n] = i;
+		n ++;
 	}
-	else {
-		msg_err_map ("regexp map is empty");
+
+	if (!rspamd_re_map_compile_hs (re_map, &plt, &n)) {
+		/* Use PCRE for everything */
+		g_array_set_size (re_map->pcre_only, 0);
+
+		return;
+	}
+
+	rspamd_re_map_set_pcre_only (re_map, n);
+
+	if (map->cfg->hs_cache_dir) {
+		rspamd_re_map_cache_save (re_map, &plt, path, n);
+	}
+
+alloc_scratch:
+	if (hs_alloc_scratch (re_map->hs_db, &re_map->hs_scratch) != HS_SUCCESS) {
+		msg_err_map ("cannot allocate scratch space for hyperscan");
+		hs_free_database (re_map->hs_db);
+		re_map->hs_db = NULL;
+	}
+	else if (re_map->pcre_only->len > 0) {
+		msg_info_map ("%ud of %ud regexps are matched by pcre",
+				re_map->pcre_only->len, re_map->regexps->len);
 	}
 #endif
 }
@@ -2476,11 +3589,22 @@ rspamd_match_regexp_map (struct rspamd_regexp_map *map,
 					rspamd_match_hs_single_handler, (void *)&i);
 
 			if (res == HS_SCAN_TERMINATED) {
-				res = 1;
-				ret = g_ptr_array_index (map->values, i);
+				return g_ptr_array_index (map->values, i);
+			}
+
+			/* Expressions that are not supported by hyperscan */
+			for (i = 0; i < map->pcre_only->len; i ++) {
+				re = g_ptr_array_index (map->regexps,
+						g_array_index (map->pcre_only, guint, i));
+
+				if (rspamd_regexp_search (re, in, len, NULL, NULL, FALSE,
+						NULL)) {
+					return g_ptr_array_index (map->values,
+							g_array_index (map->pcre_only, guint, i));
+				}
 			}
 
-			return ret;
+			return NULL;
 		}
 	}
 #endif
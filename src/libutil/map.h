@@ -22,6 +22,8 @@ struct map_cb_data;
 typedef gchar * (*map_cb_t)(gchar *chunk, gint len,
 	struct map_cb_data *data, gboolean final);
 typedef void (*map_fin_cb_t)(struct map_cb_data *data);
+typedef gboolean (*map_load_cb_t)(const gchar *fname, struct map_cb_data *data);
+typedef void (*map_remove_cb_t)(gpointer data, const gchar *key);
 
 /**
  * Common map object
@@ -66,6 +68,21 @@ struct rspamd_map* rspamd_map_add_from_ucl (struct rspamd_config *cfg,
 	map_fin_cb_t fin_callback,
 	void **user_data);
 
+/**
+ * Set callback that loads precompiled map files directly instead of reading
+ * them with `read_callback`
+ */
+void rspamd_map_set_load_callback (struct rspamd_map *map,
+	map_load_cb_t load_callback);
+
+/**
+ * Synchronously reads file maps with builtin parsers, should be called in
+ * the main process before forking workers, so they inherit maps data and
+ * do not reread unmodified files
+ * @return number of maps loaded
+ */
+guint rspamd_map_preload (struct rspamd_config *cfg);
+
 /**
  * Start watching of maps by adding events to libevent event loop
  */
@@ -73,6 +90,38 @@ void rspamd_map_watch (struct rspamd_config *cfg,
 		struct event_base *ev_base,
 		struct rspamd_dns_resolver *resolver);
 
+/**
+ * Maps with a load callback could be loaded once by map helper and shared
+ * with other processes. This callback is called in map helper when such a
+ * map has been reloaded
+ */
+typedef void (*rspamd_map_publish_cb) (struct rspamd_map *map, gpointer ud);
+
+/**
+ * Start watching of shared maps only (used by map helper)
+ */
+void rspamd_map_watch_shared (struct rspamd_config *cfg,
+		struct event_base *ev_base,
+		struct rspamd_dns_resolver *resolver,
+		rspamd_map_publish_cb publish_cb,
+		gpointer ud);
+
+/**
+ * Remember path of a compiled image of a shared map, so processes started
+ * later could load it directly
+ */
+void rspamd_map_set_shared_image (struct rspamd_map *map, const gchar *path);
+
+/**
+ * Swap data of a shared map with the image published by map helper
+ * @param cfg
+ * @param id map id
+ * @param path path to the compiled image
+ * @return TRUE if map has been loaded
+ */
+gboolean rspamd_map_load_shared (struct rspamd_config *cfg, guint32 id,
+		const gchar *path);
+
 /**
  * Remove all maps watched (remove events)
  */
@@ -115,6 +164,26 @@ gchar * rspamd_kv_list_read (
 	gboolean final);
 void rspamd_kv_list_fin (struct map_cb_data *data);
 
+/**
+ * Compiled maps accept both text lists and files produced by
+ * `rspamadm compile_map`, the latter are mapped read-only
+ */
+gchar * rspamd_compiled_hash_read (
+	gchar *chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final);
+gboolean rspamd_compiled_hash_load (const gchar *fname,
+	struct map_cb_data *data);
+gchar * rspamd_compiled_radix_read (
+	gchar *chunk,
+	gint len,
+	struct map_cb_data *data,
+	gboolean final);
+gboolean rspamd_compiled_radix_load (const gchar *fname,
+	struct map_cb_data *data);
+void rspamd_compiled_map_fin (struct map_cb_data *data);
+
 /**
  * Regexp list is a list of regular expressions
  */
@@ -150,4 +219,16 @@ rspamd_parse_kv_list (
 gpointer rspamd_match_regexp_map (struct rspamd_regexp_map *map,
 		const gchar *in, gsize len);
 
+/**
+ * Finds a key in `cdb://` backends of a map, keys are matched lowercased
+ * @param map map object
+ * @param key key to find
+ * @param keylen length of key
+ * @param value output value (points to the mmap'ed database)
+ * @param vlen output length of value
+ * @return TRUE if a key has been found
+ */
+gboolean rspamd_map_cdb_lookup (struct rspamd_map *map, const gchar *key,
+		gsize keylen, const gchar **value, gsize *vlen);
+
 #endif
@@ -0,0 +1,809 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "map_compiled.h"
+#include "str_util.h"
+#include "util.h"
+#include "ref.h"
+#include <sys/mman.h>
+
+#define RSPAMD_MAP_COMPILED_MAGIC "rmapc01"
+#define RSPAMD_MAP_COMPILED_BOM 0x01020304U
+/* Hash of keys must be the same for all processes */
+#define RSPAMD_MAP_COMPILED_SEED 0xdeadbabeULL
+
+struct rspamd_map_compiled_header {
+	guchar magic[8];
+	guint32 bom;
+	guint32 type;
+	guint32 nentries;
+	guint32 reserved;
+	guint64 entries_off;
+	guint64 strings_off;
+	guint64 strings_len;
+};
+
+struct rspamd_map_compiled_kv {
+	guint64 hash;
+	guint32 key_off;
+	guint32 key_len;
+	guint32 value_off;
+	guint32 value_len;
+};
+
+struct rspamd_map_compiled_range {
+	guchar start[16];
+	guchar end[16];
+	guint32 value_off;
+	guint32 value_len;
+};
+
+/* Elements added before map is finished */
+struct rspamd_map_compiled_elt {
+	gchar *key;
+	gchar *value;
+	guint64 hash;
+	guchar start[16];
+	guchar end[16];
+	guint masklen;
+	guint order;
+};
+
+struct rspamd_map_compiled {
+	enum rspamd_map_compiled_type type;
+	guchar *data;
+	gsize len;
+	const struct rspamd_map_compiled_header *hdr;
+	const guchar *entries;
+	const gchar *strings;
+	gboolean mapped;
+	GArray *pending;
+	ref_entry_t ref;
+};
+
+static GQuark
+rspamd_map_compiled_quark (void)
+{
+	return g_quark_from_static_string ("map-compiled");
+}
+
+static gsize
+rspamd_map_compiled_entry_size (enum rspamd_map_compiled_type type)
+{
+	return type == RSPAMD_MAP_COMPILED_HASH ?
+			sizeof (struct rspamd_map_compiled_kv) :
+			sizeof (struct rspamd_map_compiled_range);
+}
+
+static void
+rspamd_map_compiled_free_pending (GArray *pending)
+{
+	struct rspamd_map_compiled_elt *elt;
+	guint i;
+
+	for (i = 0; i < pending->len; i ++) {
+		elt = &g_array_index (pending, struct rspamd_map_compiled_elt, i);
+		g_free (elt->key);
+		g_free (elt->value);
+	}
+
+	g_array_free (pending, TRUE);
+}
+
+static void
+rspamd_map_compiled_dtor (struct rspamd_map_compiled *cm)
+{
+	if (cm->pending) {
+		rspamd_map_compiled_free_pending (cm->pending);
+	}
+
+	if (cm->data) {
+		if (cm->mapped) {
+			munmap (cm->data, cm->len);
+		}
+		else {
+			g_free (cm->data);
+		}
+	}
+
+	g_slice_free1 (sizeof (*cm), cm);
+}
+
+gboolean
+rspamd_map_compiled_is_compiled (const guchar *data, gsize len)
+{
+	return len >= sizeof (struct rspamd_map_compiled_header) &&
+			memcmp (data, RSPAMD_MAP_COMPILED_MAGIC,
+					sizeof (RSPAMD_MAP_COMPILED_MAGIC)) == 0;
+}
+
+static gboolean
+rspamd_map_compiled_check_string (const struct rspamd_map_compiled_header *hdr,
+		const gchar *strings, guint32 off, guint32 len)
+{
+	return (guint64)off + len < hdr->strings_len && strings[off + len] == '\0';
+}
+
+/* Sets pointers inside of image and checks that all offsets are sane */
+static gboolean
+rspamd_map_compiled_load (struct rspamd_map_compiled *cm, GError **err)
+{
+	const struct rspamd_map_compiled_header *hdr;
+	const struct rspamd_map_compiled_kv *kv;
+	const struct rspamd_map_compiled_range *r;
+	gsize esize;
+	guint i;
+
+	if (!rspamd_map_compiled_is_compiled (cm->data, cm->len)) {
+		g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+				"bad magic");
+		return FALSE;
+	}
+
+	hdr = (const struct rspamd_map_compiled_header *)cm->data;
+
+	if (hdr->bom != RSPAMD_MAP_COMPILED_BOM) {
+		g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+				"map has been compiled for a different byte order");
+		return FALSE;
+	}
+
+	if (hdr->type != RSPAMD_MAP_COMPILED_HASH &&
+			hdr->type != RSPAMD_MAP_COMPILED_RADIX) {
+		g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+				"unknown map type: %u", hdr->type);
+		return FALSE;
+	}
+
+	esize = rspamd_map_compiled_entry_size (hdr->type);
+
+	if (hdr->entries_off % sizeof (guint64) != 0 ||
+			hdr->entries_off > cm->len ||
+			(guint64)hdr->nentries * esize > cm->len - hdr->entries_off ||
+			hdr->strings_off > cm->len ||
+			hdr->strings_len > cm->len - hdr->strings_off) {
+		g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+				"truncated map");
+		return FALSE;
+	}
+
+	cm->type = hdr->type;
+	cm->hdr = hdr;
+	cm->entries = cm->data + hdr->entries_off;
+	cm->strings = (const gchar *)cm->data + hdr->strings_off;
+
+	for (i = 0; i < hdr->nentries; i ++) {
+		if (cm->type == RSPAMD_MAP_COMPILED_HASH) {
+			kv = ((const struct rspamd_map_compiled_kv *)cm->entries) + i;
+
+			if (!rspamd_map_compiled_check_string (hdr, cm->strings,
+					kv->key_off, kv->key_len) ||
+					!rspamd_map_compiled_check_string (hdr, cm->strings,
+							kv->value_off, kv->value_len)) {
+				goto bad_entry;
+			}
+		}
+		else {
+			r = ((const struct rspamd_map_compiled_range *)cm->entries) + i;
+
+			if (!rspamd_map_compiled_check_string (hdr, cm->strings,
+					r->value_off, r->value_len)) {
+				goto bad_entry;
+			}
+		}
+	}
+
+	return TRUE;
+
+bad_entry:
+	g_set_error (err, rspamd_map_compiled_quark (), EINVAL,
+			"bad entry %u", i);
+
+	return FALSE;
+}
+
+struct rspamd_map_compiled *
+rspamd_map_compiled_open (const gchar *fname, GError **err)
+{
+	struct rspamd_map_compiled *cm;
+	gsize len;
+	guchar *data;
+
+	data = rspamd_file_xmap (fname, PROT_READ, &len);
+
+	if (data == NULL) {
+		g_set_error (err, rspamd_map_compiled_quark (), errno,
+				"cannot map %s: %s", fname, strerror (errno));
+		return NULL;
+	}
+
+	cm = g_slice_alloc0 (sizeof (*cm));
+	cm->data = data;
+	cm->len = len;
+	cm->mapped = TRUE;
+	REF_INIT_RETAIN (cm, rspamd_map_compiled_dtor);
+
+	if (!rspamd_map_compiled_load (cm, err)) {
+		REF_RELEASE (cm);
+		return NULL;
+	}
+
+	return cm;
+}
+
+struct rspamd_map_compiled *
+rspamd_map_compiled_from_memory (const guchar *data, gsize len, GError **err)
+{
+	struct rspamd_map_compiled *cm;
+
+	cm = g_slice_alloc0 (sizeof (*cm));
+	/* Copy to have aligned image */
+	cm->data = g_malloc (len);
+	memcpy (cm->data, data, len);
+	cm->len = len;
+	REF_INIT_RETAIN (cm, rspamd_map_compiled_dtor);
+
+	if (!rspamd_map_compiled_load (cm, err)) {
+		REF_RELEASE (cm);
+		return NULL;
+	}
+
+	return cm;
+}
+
+struct rspamd_map_compiled *
+rspamd_map_compiled_new (enum rspamd_map_compiled_type type)
+{
+	struct rspamd_map_compiled *cm;
+
+	cm = g_slice_alloc0 (sizeof (*cm));
+	cm->type = type;
+	cm->pending = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_map_compiled_elt));
+	REF_INIT_RETAIN (cm, rspamd_map_compiled_dtor);
+
+	return cm;
+}
+
+static gboolean
+rspamd_map_compiled_parse_net (const gchar *key,
+		struct rspamd_map_compiled_elt *elt)
+{
+	gchar *tmp, *mask, *brace, *err_str;
+	const gchar *ip;
+	struct in_addr ina;
+	struct in6_addr ina6;
+	gulong k = G_MAXULONG;
+	guint i, bits;
+	gboolean ret = TRUE;
+
+	tmp = g_strdup (key);
+	ip = tmp;
+	mask = strchr (tmp, '/');
+
+	if (mask) {
+		*mask++ = '\0';
+		k = strtoul (mask, &err_str, 10);
+
+		if (err_str == mask || *err_str != '\0') {
+			g_free (tmp);
+			return FALSE;
+		}
+	}
+
+	if (ip[0] == '[') {
+		brace = strrchr (tmp, ']');
+
+		if (brace == NULL) {
+			g_free (tmp);
+			return FALSE;
+		}
+
+		*brace = '\0';
+		ip ++;
+	}
+
+	memset (elt->start, 0, sizeof (elt->start));
+
+	if (inet_pton (AF_INET, ip, &ina) == 1) {
+		elt->start[10] = 0xff;
+		elt->start[11] = 0xff;
+		memcpy (&elt->start[12], &ina, sizeof (ina));
+		elt->masklen = 96 + MIN (k, 32);
+	}
+	else if (inet_pton (AF_INET6, ip, &ina6) == 1) {
+		memcpy (elt->start, &ina6, sizeof (ina6));
+		elt->masklen = MIN (k, 128);
+	}
+	else {
+		ret = FALSE;
+	}
+
+	g_free (tmp);
+
+	if (ret) {
+		for (i = 0; i < 16; i ++) {
+			bits = elt->masklen > i * 8 ? MIN (elt->masklen - i * 8, 8) : 0;
+			elt->start[i] &= (guchar)(0xff00 >> bits);
+			elt->end[i] = elt->start[i] | (guchar)~(0xff00 >> bits);
+		}
+	}
+
+	return ret;
+}
+
+gboolean
+rspamd_map_compiled_add (struct rspamd_map_compiled *cm,
+		const gchar *key, const gchar *value)
+{
+	struct rspamd_map_compiled_elt elt;
+	gsize klen;
+
+	g_assert (cm->pending != NULL);
+
+	memset (&elt, 0, sizeof (elt));
+
+	if (cm->type == RSPAMD_MAP_COMPILED_HASH) {
+		klen = strlen (key);
+		elt.key = g_malloc (klen + 1);
+		memcpy (elt.key, key, klen + 1);
+		rspamd_str_lc (elt.key, klen);
+		elt.hash = rspamd_icase_hash (elt.key, klen,
+				RSPAMD_MAP_COMPILED_SEED);
+	}
+	else if (!rspamd_map_compiled_parse_net (key, &elt)) {
+		return FALSE;
+	}
+
+	elt.value = g_strdup (value ? value : "");
+	elt.order = cm->pending->len;
+	g_array_append_val (cm->pending, elt);
+
+	return TRUE;
+}
+
+static gint
+rspamd_map_compiled_kv_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_map_compiled_elt *e1 = a, *e2 = b;
+	gint r;
+
+	if (e1->hash != e2->hash) {
+		return e1->hash < e2->hash ? -1 : 1;
+	}
+
+	r = strcmp (e1->key, e2->key);
+
+	if (r != 0) {
+		return r;
+	}
+
+	return (gint)e1->order - (gint)e2->order;
+}
+
+static gint
+rspamd_map_compiled_net_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_map_compiled_elt *e1 = a, *e2 = b;
+	gint r;
+
+	r = memcmp (e1->start, e2->start, sizeof (e1->start));
+
+	if (r != 0) {
+		return r;
+	}
+
+	/* Enclosing networks go first */
+	if (e1->masklen != e2->masklen) {
+		return (gint)e1->masklen - (gint)e2->masklen;
+	}
+
+	return (gint)e1->order - (gint)e2->order;
+}
+
+static guint32
+rspamd_map_compiled_add_string (GString *strings, const gchar *s)
+{
+	guint32 off = strings->len;
+
+	g_string_append_len (strings, s, strlen (s) + 1);
+
+	return off;
+}
+
+static void
+rspamd_map_compiled_emit_range (GArray *ranges, GString *strings,
+		const guchar *start, const guchar *end, const gchar *value)
+{
+	struct rspamd_map_compiled_range r;
+
+	if (memcmp (start, end, sizeof (r.start)) > 0) {
+		return;
+	}
+
+	memcpy (r.start, start, sizeof (r.start));
+	memcpy (r.end, end, sizeof (r.end));
+	r.value_len = strlen (value);
+	r.value_off = rspamd_map_compiled_add_string (strings, value);
+	g_array_append_val (ranges, r);
+}
+
+/* Returns FALSE on overflow */
+static gboolean
+rspamd_map_compiled_addr_inc (guchar *addr)
+{
+	gint i;
+
+	for (i = 15; i >= 0; i --) {
+		if (++addr[i] != 0) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_map_compiled_addr_dec (guchar *addr)
+{
+	gint i;
+
+	for (i = 15; i >= 0; i --) {
+		if (addr[i]-- != 0) {
+			break;
+		}
+	}
+}
+
+/*
+ * Flattens nested networks to disjoint ranges where the most specific
+ * network wins, networks are sorted so that parents precede children
+ */
+static void
+rspamd_map_compiled_flatten (GArray *pending, GArray *ranges, GString *strings)
+{
+	struct rspamd_map_compiled_elt *elt, *stack[129];
+	guchar cursor[16], prev[16];
+	gboolean exhausted = FALSE;
+	guint i, depth = 0;
+
+	for (i = 0; i < pending->len; i ++) {
+		elt = &g_array_index (pending, struct rspamd_map_compiled_elt, i);
+
+		while (depth > 0 &&
+				memcmp (stack[depth - 1]->end, elt->start, sizeof (cursor)) < 0) {
+			depth --;
+
+			if (!exhausted) {
+				rspamd_map_compiled_emit_range (ranges, strings, cursor,
+						stack[depth]->end, stack[depth]->value);
+			}
+
+			memcpy (cursor, stack[depth]->end, sizeof (cursor));
+			exhausted = !rspamd_map_compiled_addr_inc (cursor);
+		}
+
+		if (depth > 0 && stack[depth - 1]->masklen == elt->masklen &&
+				memcmp (stack[depth - 1]->start, elt->start,
+						sizeof (cursor)) == 0) {
+			/* Duplicate network, the last one wins */
+			stack[depth - 1] = elt;
+			continue;
+		}
+
+		if (depth > 0 && memcmp (cursor, elt->start, sizeof (cursor)) < 0) {
+			memcpy (prev, elt->start, sizeof (prev));
+			rspamd_map_compiled_addr_dec (prev);
+			rspamd_map_compiled_emit_range (ranges, strings, cursor, prev,
+					stack[depth - 1]->value);
+		}
+
+		g_assert (depth < G_N_ELEMENTS (stack));
+		stack[depth++] = elt;
+		memcpy (cursor, elt->start, sizeof (cursor));
+		exhausted = FALSE;
+	}
+
+	while (depth > 0) {
+		depth --;
+
+		if (!exhausted) {
+			rspamd_map_compiled_emit_range (ranges, strings, cursor,
+					stack[depth]->end, stack[depth]->value);
+		}
+
+		memcpy (cursor, stack[depth]->end, sizeof (cursor));
+		exhausted = !rspamd_map_compiled_addr_inc (cursor);
+	}
+}
+
+void
+rspamd_map_compiled_finish (struct rspamd_map_compiled *cm)
+{
+	struct rspamd_map_compiled_header hdr;
+	struct rspamd_map_compiled_elt *elt, *next;
+	struct rspamd_map_compiled_kv kv;
+	GArray *entries;
+	GString *strings;
+	GError *err = NULL;
+	gsize esize;
+	gboolean loaded;
+	guint i;
+
+	g_assert (cm->pending != NULL);
+
+	esize = rspamd_map_compiled_entry_size (cm->type);
+	entries = g_array_sized_new (FALSE, FALSE, esize, cm->pending->len);
+	strings = g_string_sized_new (cm->pending->len * 16);
+
+	if (cm->type == RSPAMD_MAP_COMPILED_HASH) {
+		g_array_sort (cm->pending, rspamd_map_compiled_kv_cmp);
+
+		for (i = 0; i < cm->pending->len; i ++) {
+			elt = &g_array_index (cm->pending, struct rspamd_map_compiled_elt, i);
+
+			if (i + 1 < cm->pending->len) {
+				next = &g_array_index (cm->pending,
+						struct rspamd_map_compiled_elt, i + 1);
+
+				if (next->hash == elt->hash && strcmp (next->key, elt->key) == 0) {
+					/* Duplicate key, the last one wins */
+					continue;
+				}
+			}
+
+			kv.hash = elt->hash;
+			kv.key_len = strlen (elt->key);
+			kv.key_off = rspamd_map_compiled_add_string (strings, elt->key);
+			kv.value_len = strlen (elt->value);
+			kv.value_off = rspamd_map_compiled_add_string (strings, elt->value);
+			g_array_append_val (entries, kv);
+		}
+	}
+	else {
+		g_array_sort (cm->pending, rspamd_map_compiled_net_cmp);
+		rspamd_map_compiled_flatten (cm->pending, entries, strings);
+	}
+
+	g_assert (strings->len < G_MAXUINT32);
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RSPAMD_MAP_COMPILED_MAGIC,
+			sizeof (RSPAMD_MAP_COMPILED_MAGIC));
+	hdr.bom = RSPAMD_MAP_COMPILED_BOM;
+	hdr.type = cm->type;
+	hdr.nentries = entries->len;
+	hdr.entries_off = sizeof (hdr);
+	hdr.strings_off = hdr.entries_off + (guint64)entries->len * esize;
+	hdr.strings_len = strings->len;
+
+	cm->len = hdr.strings_off + hdr.strings_len;
+	cm->data = g_malloc (cm->len);
+	memcpy (cm->data, &hdr, sizeof (hdr));
+	memcpy (cm->data + hdr.entries_off, entries->data, entries->len * esize);
+	memcpy (cm->data + hdr.strings_off, strings->str, strings->len);
+
+	g_array_free (entries, TRUE);
+	g_string_free (strings, TRUE);
+	rspamd_map_compiled_free_pending (cm->pending);
+	cm->pending = NULL;
+
+	/* Image is built by us, so it cannot be invalid */
+	loaded = rspamd_map_compiled_load (cm, &err);
+	g_assert (loaded);
+}
+
+gboolean
+rspamd_map_compiled_is_finished (struct rspamd_map_compiled *cm)
+{
+	return cm->pending == NULL;
+}
+
+gboolean
+rspamd_map_compiled_write (struct rspamd_map_compiled *cm,
+		const gchar *fname, GError **err)
+{
+	gchar *tmp;
+	gint fd;
+	gssize r;
+	gsize written = 0;
+
+	g_assert (cm->pending == NULL);
+
+	tmp = g_strdup_printf ("%s.new", fname);
+	fd = rspamd_file_xopen (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_map_compiled_quark (), errno,
+				"cannot open %s: %s", tmp, strerror (errno));
+		g_free (tmp);
+
+		return FALSE;
+	}
+
+	while (written < cm->len) {
+		r = write (fd, cm->data + written, cm->len - written);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			g_set_error (err, rspamd_map_compiled_quark (), errno,
+					"cannot write %s: %s", tmp, strerror (errno));
+			close (fd);
+			unlink (tmp);
+			g_free (tmp);
+
+			return FALSE;
+		}
+
+		written += r;
+	}
+
+	close (fd);
+
+	if (rename (tmp, fname) == -1) {
+		g_set_error (err, rspamd_map_compiled_quark (), errno,
+				"cannot rename %s to %s: %s", tmp, fname, strerror (errno));
+		unlink (tmp);
+		g_free (tmp);
+
+		return FALSE;
+	}
+
+	g_free (tmp);
+
+	return TRUE;
+}
+
+enum rspamd_map_compiled_type
+rspamd_map_compiled_get_type (struct rspamd_map_compiled *cm)
+{
+	return cm->type;
+}
+
+gsize
+rspamd_map_compiled_size (struct rspamd_map_compiled *cm)
+{
+	if (cm->pending) {
+		return cm->pending->len;
+	}
+
+	return cm->hdr->nentries;
+}
+
+const gchar *
+rspamd_map_compiled_lookup (struct rspamd_map_compiled *cm,
+		const gchar *key, gsize keylen, gsize *vlen)
+{
+	const struct rspamd_map_compiled_kv *kv, *entries;
+	guint64 h;
+	guint lo, hi, mid;
+
+	g_assert (cm->pending == NULL);
+
+	if (cm->type != RSPAMD_MAP_COMPILED_HASH) {
+		return NULL;
+	}
+
+	entries = (const struct rspamd_map_compiled_kv *)cm->entries;
+	h = rspamd_icase_hash (key, keylen, RSPAMD_MAP_COMPILED_SEED);
+	lo = 0;
+	hi = cm->hdr->nentries;
+
+	/* Find the first entry with our hash */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (entries[mid].hash < h) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	for (; lo < cm->hdr->nentries && entries[lo].hash == h; lo ++) {
+		kv = &entries[lo];
+
+		if (kv->key_len == keylen &&
+				g_ascii_strncasecmp (cm->strings + kv->key_off, key,
+						keylen) == 0) {
+			if (vlen) {
+				*vlen = kv->value_len;
+			}
+
+			return cm->strings + kv->value_off;
+		}
+	}
+
+	return NULL;
+}
+
+const gchar *
+rspamd_map_compiled_lookup_addr (struct rspamd_map_compiled *cm,
+		const guchar *addr, gsize addrlen, gsize *vlen)
+{
+	const struct rspamd_map_compiled_range *r, *ranges;
+	guchar key[16];
+	guint lo, hi, mid;
+
+	g_assert (cm->pending == NULL);
+
+	if (cm->type != RSPAMD_MAP_COMPILED_RADIX) {
+		return NULL;
+	}
+
+	if (addrlen == 4) {
+		memset (key, 0, 10);
+		key[10] = 0xff;
+		key[11] = 0xff;
+		memcpy (&key[12], addr, 4);
+	}
+	else if (addrlen == 16) {
+		memcpy (key, addr, 16);
+	}
+	else {
+		return NULL;
+	}
+
+	ranges = (const struct rspamd_map_compiled_range *)cm->entries;
+	lo = 0;
+	hi = cm->hdr->nentries;
+
+	/* Find the first range that starts after our address */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (memcmp (ranges[mid].start, key, sizeof (key)) <= 0) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	if (lo == 0) {
+		return NULL;
+	}
+
+	r = &ranges[lo - 1];
+
+	if (memcmp (key, r->end, sizeof (key)) > 0) {
+		return NULL;
+	}
+
+	if (vlen) {
+		*vlen = r->value_len;
+	}
+
+	return cm->strings + r->value_off;
+}
+
+struct rspamd_map_compiled *
+rspamd_map_compiled_ref (struct rspamd_map_compiled *cm)
+{
+	REF_RETAIN (cm);
+
+	return cm;
+}
+
+void
+rspamd_map_compiled_unref (struct rspamd_map_compiled *cm)
+{
+	REF_RELEASE (cm);
+}
@@ -0,0 +1,116 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_MAP_COMPILED_H_
+#define SRC_LIBUTIL_MAP_COMPILED_H_
+
+#include "config.h"
+
+/*
+ * Precompiled maps: a flat read-only image that could be either built in
+ * memory or mapped from a file produced by `rspamadm compile_map`, so all
+ * processes share the same pages and reload is just a pointer swap.
+ *
+ * Hash maps are stored as a table of entries sorted by the hash of a lower
+ * cased key, radix maps are flattened to sorted disjoint ranges of IPv6
+ * addresses (IPv4 is stored as IPv4-mapped IPv6). Images use the native byte
+ * order and are refused on a mismatch.
+ */
+struct rspamd_map_compiled;
+
+enum rspamd_map_compiled_type {
+	RSPAMD_MAP_COMPILED_HASH = 0,
+	RSPAMD_MAP_COMPILED_RADIX,
+};
+
+/**
+ * Returns TRUE if data starts with a header of a compiled map
+ */
+gboolean rspamd_map_compiled_is_compiled (const guchar *data, gsize len);
+
+/**
+ * Map compiled map file read-only
+ * @param fname path to the file
+ * @param err error pointer
+ * @return refcounted compiled map or NULL
+ */
+struct rspamd_map_compiled *rspamd_map_compiled_open (const gchar *fname,
+		GError **err);
+
+/**
+ * Load compiled map from a copy of a memory buffer (e.g. received via HTTP)
+ */
+struct rspamd_map_compiled *rspamd_map_compiled_from_memory (
+		const guchar *data, gsize len, GError **err);
+
+/**
+ * Create empty map for building
+ */
+struct rspamd_map_compiled *rspamd_map_compiled_new (
+		enum rspamd_map_compiled_type type);
+
+/**
+ * Add element to a map being built, for radix maps `key` is an
+ * `addr[/mask]` element (IPv6 could be braced)
+ * @return FALSE if key is invalid
+ */
+gboolean rspamd_map_compiled_add (struct rspamd_map_compiled *cm,
+		const gchar *key, const gchar *value);
+
+/**
+ * Finish building, no elements can be added after this call
+ */
+void rspamd_map_compiled_finish (struct rspamd_map_compiled *cm);
+
+/**
+ * Returns TRUE if map is ready for lookups
+ */
+gboolean rspamd_map_compiled_is_finished (struct rspamd_map_compiled *cm);
+
+/**
+ * Write finished map to a file, the file is replaced atomically so the old
+ * image stays valid for processes that have it mapped
+ */
+gboolean rspamd_map_compiled_write (struct rspamd_map_compiled *cm,
+		const gchar *fname, GError **err);
+
+enum rspamd_map_compiled_type rspamd_map_compiled_get_type (
+		struct rspamd_map_compiled *cm);
+
+/**
+ * Returns number of entries (ranges for radix maps)
+ */
+gsize rspamd_map_compiled_size (struct rspamd_map_compiled *cm);
+
+/**
+ * Find value for a key in a hash map (case insensitive for ascii)
+ * @return zero terminated value or NULL
+ */
+const gchar *rspamd_map_compiled_lookup (struct rspamd_map_compiled *cm,
+		const gchar *key, gsize keylen, gsize *vlen);
+
+/**
+ * Find value for an address in a radix map
+ * @param addr raw address (4 or 16 bytes in network order)
+ * @return zero terminated value or NULL
+ */
+const gchar *rspamd_map_compiled_lookup_addr (struct rspamd_map_compiled *cm,
+		const guchar *addr, gsize addrlen, gsize *vlen);
+
+struct rspamd_map_compiled *rspamd_map_compiled_ref (
+		struct rspamd_map_compiled *cm);
+void rspamd_map_compiled_unref (struct rspamd_map_compiled *cm);
+
+#endif /* SRC_LIBUTIL_MAP_COMPILED_H_ */
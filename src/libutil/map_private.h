@@ -21,6 +21,7 @@
 #include "keypair.h"
 #include "unix-std.h"
 #include "ref.h"
+#include "cdb.h"
 
 typedef void (*rspamd_map_dtor) (gpointer p);
 
@@ -44,7 +45,16 @@ typedef void (*rspamd_map_dtor) (gpointer p);
 enum fetch_proto {
 	MAP_PROTO_FILE,
 	MAP_PROTO_HTTP,
-	MAP_PROTO_HTTPS
+	MAP_PROTO_HTTPS,
+	MAP_PROTO_CDB
+};
+
+/* Content encoding of map data received via HTTP */
+enum rspamd_map_encoding {
+	RSPAMD_MAP_ENCODING_NONE = 0,
+	RSPAMD_MAP_ENCODING_ZSTD,
+	RSPAMD_MAP_ENCODING_GZIP,
+	RSPAMD_MAP_ENCODING_UNKNOWN,
 };
 
 struct rspamd_map_backend {
@@ -56,6 +66,7 @@ struct rspamd_map_backend {
 	union {
 		struct file_map_data *fd;
 		struct http_map_data *hd;
+		struct cdb_map_data *cd;
 	} data;
 	gchar *uri;
 	ref_entry_t ref;
@@ -65,7 +76,11 @@ struct rspamd_map_cachepoint {
 	gint available;
 	gsize len;
 	time_t last_checked;
+	enum rspamd_map_encoding encoding;
 	gchar shmem_name[256];
+	/* Compiled image published by map helper */
+	gint compiled_available;
+	gchar compiled_name[256];
 };
 
 struct rspamd_map {
@@ -74,6 +89,10 @@ struct rspamd_map {
 	GPtrArray *backends;
 	map_cb_t read_callback;
 	map_fin_cb_t fin_callback;
+	map_load_cb_t load_callback;
+	map_remove_cb_t remove_callback;
+	rspamd_map_publish_cb publish_callback;
+	gpointer publish_data;
 	void **user_data;
 	struct event_base *ev_base;
 	gchar *description;
@@ -99,6 +118,17 @@ struct file_map_data {
 	struct stat st;
 };
 
+/**
+ * Data specific to CDB maps: the file is never parsed, lookups go to the
+ * mmap'ed database which is reopened when the file is replaced
+ */
+struct cdb_map_data {
+	gchar *filename;
+	struct stat st;
+	struct cdb cdb;
+	gboolean opened;
+};
+
 /**
  * Data specific to HTTP maps
  */
@@ -106,6 +136,8 @@ struct http_map_data {
 	gchar *path;
 	gchar *host;
 	gchar *last_signature;
+	/* Version of the data we have, used to request deltas */
+	gchar *etag;
 	time_t last_checked;
 	gboolean request_sent;
 	guint16 port;
@@ -146,6 +178,8 @@ struct http_callback_data {
 	gsize data_len;
 	gsize sig_len;
 	gsize pubkey_len;
+	gchar *etag;
+	enum rspamd_map_encoding encoding;
 
 	enum rspamd_map_http_stage stage;
 	gint fd;
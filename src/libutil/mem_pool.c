@@ -41,11 +41,30 @@
  */
 #undef MEMORY_GREEDY
 
+/*
+ * Freed chains are kept in a per process cache bucketed by size classes (four
+ * classes per power of two from 4Kb to 1Mb), so the next pool could reuse them
+ * without calling allocator
+ */
+#define POOL_CACHE_MIN_SIZE 4096
+#define POOL_CACHE_MAX_SIZE (1024 * 1024)
+#define POOL_CACHE_CLASSES 33
+#define POOL_CACHE_MAX_CHAINS 64
+#define POOL_CACHE_MAX_BYTES (8 * 1024 * 1024)
+
+static struct {
+	struct _pool_chain *chains[POOL_CACHE_CLASSES];
+	guint nchains[POOL_CACHE_CLASSES];
+	gsize bytes;
+} chains_cache;
+
 /* Internal statistic */
 static rspamd_mempool_stat_t *mem_pool_stat = NULL;
 /* Environment variable */
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
+static gboolean debug_peaks = FALSE;
+static gboolean huge_pages = FALSE;
 
 /**
  * Function that return free space in pool page
@@ -60,11 +79,79 @@ pool_chain_free (struct _pool_chain *chain)
 			chain->len - occupied : 0);
 }
 
+/*
+ * Returns size class for the specified size and sets its index or -1 if
+ * the size is too large to be cached
+ */
+static gsize
+rspamd_mempool_size_class (gsize size, gint *idx)
+{
+	gsize base = POOL_CACHE_MIN_SIZE, step, n;
+	gint i = 0;
+
+	if (size > POOL_CACHE_MAX_SIZE) {
+		*idx = -1;
+
+		return size;
+	}
+
+	if (size <= base) {
+		*idx = 0;
+
+		return base;
+	}
+
+	while (base * 2 < size) {
+		base *= 2;
+		i += 4;
+	}
+
+	step = base / 4;
+	n = (size - base + step - 1) / step;
+	*idx = i + n;
+
+	return base + n * step;
+}
+
+static void
+rspamd_mempool_chain_free (struct _pool_chain *chain,
+		enum rspamd_mempool_chain_type pool_type)
+{
+	gsize len = chain->len + sizeof (struct _pool_chain);
+	gint idx;
+
+	g_atomic_int_add (&mem_pool_stat->bytes_allocated, -((gint)chain->len));
+	g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
+
+	if (pool_type == RSPAMD_MEMPOOL_SHARED) {
+		munmap ((void *)chain, len);
+
+		return;
+	}
+
+	if (!always_malloc &&
+			rspamd_mempool_size_class (chain->len, &idx) == chain->len &&
+			idx >= 0 &&
+			chains_cache.nchains[idx] < POOL_CACHE_MAX_CHAINS &&
+			chains_cache.bytes + chain->len <= POOL_CACHE_MAX_BYTES) {
+		/* Free chain's memory is used to link cached chains */
+		*(struct _pool_chain **)chain->begin = chains_cache.chains[idx];
+		chains_cache.chains[idx] = chain;
+		chains_cache.nchains[idx] ++;
+		chains_cache.bytes += chain->len;
+
+		return;
+	}
+
+	g_slice_free1 (len, chain);
+}
+
 static struct _pool_chain *
 rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 {
 	struct _pool_chain *chain;
 	gpointer map;
+	gint idx;
 
 	g_return_val_if_fail (size > 0, NULL);
 
@@ -106,13 +193,27 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 #else
 #error No mmap methods are defined
 #endif
+		rspamd_mempool_advise_huge (map, size + sizeof (struct _pool_chain));
 		g_atomic_int_inc (&mem_pool_stat->shared_chunks_allocated);
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, size);
 	}
 	else {
-		map = g_slice_alloc (sizeof (struct _pool_chain) + size);
-		chain = map;
-		chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
+		size = rspamd_mempool_size_class (size, &idx);
+
+		if (idx >= 0 && chains_cache.chains[idx] != NULL) {
+			chain = chains_cache.chains[idx];
+			chains_cache.chains[idx] = *(struct _pool_chain **)chain->begin;
+			chains_cache.nchains[idx] --;
+			chains_cache.bytes -= size;
+			g_atomic_int_inc (&mem_pool_stat->chunks_reused);
+		}
+		else {
+			map = g_slice_alloc (sizeof (struct _pool_chain) + size);
+			chain = map;
+			chain->begin = ((guint8 *) chain) + sizeof (struct _pool_chain);
+			rspamd_mempool_advise_huge (map, size + sizeof (struct _pool_chain));
+		}
+
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, size);
 		g_atomic_int_inc (&mem_pool_stat->chunks_allocated);
 	}
@@ -186,6 +287,21 @@ rspamd_mempool_append_chain (rspamd_mempool_t * pool,
 	g_ptr_array_add (pool->pools[pool_type], chain);
 }
 
+static void
+rspamd_mempool_generate_uid (rspamd_mempool_t *pool)
+{
+	unsigned char uidbuf[10];
+	const gchar hexdigits[] = "0123456789abcdef";
+	unsigned i;
+
+	ottery_rand_bytes (uidbuf, sizeof (uidbuf));
+	for (i = 0; i < G_N_ELEMENTS (uidbuf); i ++) {
+		pool->tag.uid[i * 2] = hexdigits[(uidbuf[i] >> 4) & 0xf];
+		pool->tag.uid[i * 2 + 1] = hexdigits[uidbuf[i] & 0xf];
+	}
+	pool->tag.uid[19] = '\0';
+}
+
 /**
  * Allocate new memory poll
  * @param size size of pool's page
@@ -196,9 +312,6 @@ rspamd_mempool_new (gsize size, const gchar *tag)
 {
 	rspamd_mempool_t *new;
 	gpointer map;
-	unsigned char uidbuf[10];
-	const gchar hexdigits[] = "0123456789abcdef";
-	unsigned i;
 
 	g_return_val_if_fail (size > 0, NULL);
 	/* Allocate statistic structure if it is not allocated before */
@@ -247,6 +360,9 @@ rspamd_mempool_new (gsize size, const gchar *tag)
 		if (g_slice != NULL) {
 			always_malloc = TRUE;
 		}
+		if (getenv ("RSPAMD_MEMPOOL_DEBUG") != NULL) {
+			debug_peaks = TRUE;
+		}
 		env_checked = TRUE;
 	}
 
@@ -264,13 +380,7 @@ rspamd_mempool_new (gsize size, const gchar *tag)
 		new->tag.tagname[0] = '\0';
 	}
 
-	/* Generate new uid */
-	ottery_rand_bytes (uidbuf, sizeof (uidbuf));
-	for (i = 0; i < G_N_ELEMENTS (uidbuf); i ++) {
-		new->tag.uid[i * 2] = hexdigits[(uidbuf[i] >> 4) & 0xf];
-		new->tag.uid[i * 2 + 1] = hexdigits[uidbuf[i] & 0xf];
-	}
-	new->tag.uid[19] = '\0';
+	rspamd_mempool_generate_uid (new);
 
 	mem_pool_stat->pools_allocated++;
 
@@ -499,18 +609,59 @@ rspamd_mempool_replace_destructor (rspamd_mempool_t * pool,
 	}
 }
 
-void
-rspamd_mempool_delete (rspamd_mempool_t * pool)
+/* Remember the largest amount of memory used by a pool with the same tag */
+static void
+rspamd_mempool_record_peak (rspamd_mempool_t *pool)
 {
+	struct rspamd_mempool_tag_stat *ts;
 	struct _pool_chain *cur;
-	struct _pool_destructors *destructor;
-	gpointer ptr;
-	guint i, j;
-	gsize len;
+	guint i, j, cur_peak;
+	gsize used = 0;
 
-	POOL_MTX_LOCK ();
+	for (i = 0; i < G_N_ELEMENTS (pool->pools); i ++) {
+		if (pool->pools[i]) {
+			for (j = 0; j < pool->pools[i]->len; j++) {
+				cur = g_ptr_array_index (pool->pools[i], j);
+				used += cur->pos - cur->begin;
+			}
+		}
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (mem_pool_stat->tags); i ++) {
+		ts = &mem_pool_stat->tags[i];
+
+		if (!g_atomic_int_get (&ts->used)) {
+			/* Claim an empty slot for this tag */
+			if (!g_atomic_int_compare_and_exchange (&ts->used, 0, 1)) {
+				continue;
+			}
+
+			rspamd_strlcpy (ts->tag, pool->tag.tagname, sizeof (ts->tag));
+			g_atomic_int_set (&ts->used, 2);
+		}
+		else if (g_atomic_int_get (&ts->used) != 2 ||
+				strcmp (ts->tag, pool->tag.tagname) != 0) {
+			continue;
+		}
+
+		g_atomic_int_inc (&ts->pools);
+
+		do {
+			cur_peak = g_atomic_int_get (&ts->peak);
+		} while (used > cur_peak &&
+				!g_atomic_int_compare_and_exchange (&ts->peak, cur_peak,
+						(guint)MIN (used, G_MAXUINT)));
+
+		break;
+	}
+}
+
+static void
+rspamd_mempool_call_destructors (rspamd_mempool_t *pool)
+{
+	struct _pool_destructors *destructor;
+	guint i;
 
-	/* Call all pool destructors */
 	for (i = 0; i < pool->destructors->len; i ++) {
 		destructor = &g_array_index (pool->destructors, struct _pool_destructors, i);
 		/* Avoid calling destructors for NULL pointers */
@@ -518,33 +669,44 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 			destructor->func (destructor->data);
 		}
 	}
+}
 
-	g_array_free (pool->destructors, TRUE);
+/* Free all chains except the first normal one if `keep_first` is TRUE */
+static void
+rspamd_mempool_free_chains (rspamd_mempool_t *pool, gboolean keep_first)
+{
+	struct _pool_chain *cur;
+	gpointer ptr;
+	guint i, j, kept;
 
 	for (i = 0; i < G_N_ELEMENTS (pool->pools); i ++) {
 		if (pool->pools[i]) {
+			kept = 0;
+
 			for (j = 0; j < pool->pools[i]->len; j++) {
 				cur = g_ptr_array_index (pool->pools[i], j);
-				g_atomic_int_add (&mem_pool_stat->bytes_allocated,
-						-((gint)cur->len));
-				g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
-
-				len = cur->len + sizeof (struct _pool_chain);
 
-				if (i == RSPAMD_MEMPOOL_SHARED) {
-					munmap ((void *)cur, len);
+				if (keep_first && i == RSPAMD_MEMPOOL_NORMAL && j == 0) {
+					cur->pos = align_ptr (cur->begin, MEM_ALIGNMENT);
+					kept = 1;
 				}
 				else {
-					g_slice_free1 (len, cur);
+					rspamd_mempool_chain_free (cur, i);
 				}
 			}
 
-			g_ptr_array_free (pool->pools[i], TRUE);
+			if (keep_first) {
+				g_ptr_array_set_size (pool->pools[i], kept);
+			}
+			else {
+				g_ptr_array_free (pool->pools[i], TRUE);
+			}
 		}
 	}
 
 	if (pool->variables) {
 		g_hash_table_destroy (pool->variables);
+		pool->variables = NULL;
 	}
 
 	if (pool->trash_stack) {
@@ -553,32 +715,68 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 			g_free (ptr);
 		}
 
-		g_ptr_array_free (pool->trash_stack, TRUE);
+		if (keep_first) {
+			g_ptr_array_set_size (pool->trash_stack, 0);
+		}
+		else {
+			g_ptr_array_free (pool->trash_stack, TRUE);
+		}
 	}
+}
+
+void
+rspamd_mempool_delete (rspamd_mempool_t * pool)
+{
+	POOL_MTX_LOCK ();
+
+	/* Call all pool destructors */
+	rspamd_mempool_call_destructors (pool);
+	g_array_free (pool->destructors, TRUE);
+
+	if (debug_peaks) {
+		rspamd_mempool_record_peak (pool);
+	}
+
+	rspamd_mempool_free_chains (pool, FALSE);
 
 	g_atomic_int_inc (&mem_pool_stat->pools_freed);
 	POOL_MTX_UNLOCK ();
 	g_slice_free (rspamd_mempool_t, pool);
 }
 
+void
+rspamd_mempool_reset (rspamd_mempool_t *pool)
+{
+	POOL_MTX_LOCK ();
+
+	rspamd_mempool_call_destructors (pool);
+	g_array_set_size (pool->destructors, 0);
+
+	if (debug_peaks) {
+		rspamd_mempool_record_peak (pool);
+	}
+
+	rspamd_mempool_free_chains (pool, TRUE);
+	/* Logs of the next user should not be confused with the previous one */
+	rspamd_mempool_generate_uid (pool);
+
+	g_atomic_int_inc (&mem_pool_stat->pools_freed);
+	g_atomic_int_inc (&mem_pool_stat->pools_allocated);
+	POOL_MTX_UNLOCK ();
+}
+
 void
 rspamd_mempool_cleanup_tmp (rspamd_mempool_t * pool)
 {
 	struct _pool_chain *cur;
 	guint i;
-	gsize len;
 
 	POOL_MTX_LOCK ();
 
 	if (pool->pools[RSPAMD_MEMPOOL_TMP]) {
 		for (i = 0; i < pool->pools[RSPAMD_MEMPOOL_TMP]->len; i++) {
 			cur = g_ptr_array_index (pool->pools[RSPAMD_MEMPOOL_TMP], i);
-			g_atomic_int_add (&mem_pool_stat->bytes_allocated,
-					-((gint)cur->len));
-			g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
-			len = cur->len + sizeof (struct _pool_chain);
-
-			g_slice_free1 (len, cur);
+			rspamd_mempool_chain_free (cur, RSPAMD_MEMPOOL_TMP);
 		}
 
 		g_ptr_array_free (pool->pools[RSPAMD_MEMPOOL_TMP], TRUE);
@@ -601,6 +799,8 @@ rspamd_mempool_stat (rspamd_mempool_stat_t * st)
 		st->shared_chunks_allocated = mem_pool_stat->shared_chunks_allocated;
 		st->chunks_freed = mem_pool_stat->chunks_freed;
 		st->oversized_chunks = mem_pool_stat->oversized_chunks;
+		st->chunks_reused = mem_pool_stat->chunks_reused;
+		memcpy (st->tags, mem_pool_stat->tags, sizeof (st->tags));
 	}
 }
 
@@ -839,6 +1039,38 @@ rspamd_mempool_wunlock_rwlock (rspamd_mempool_rwlock_t * lock)
 }
 #endif
 
+void
+rspamd_mempool_set_huge_pages (gboolean enable)
+{
+	huge_pages = enable;
+}
+
+gboolean
+rspamd_mempool_huge_pages (void)
+{
+	return huge_pages;
+}
+
+void
+rspamd_mempool_advise_huge (gpointer p, gsize len)
+{
+#ifdef MADV_HUGEPAGE
+	guint8 *start, *end;
+
+	if (!huge_pages || len < RSPAMD_HUGE_PAGE_SIZE) {
+		return;
+	}
+
+	/* Only whole huge pages inside of the region can be collapsed */
+	start = align_ptr (p, RSPAMD_HUGE_PAGE_SIZE);
+	end = (guint8 *)(((uintptr_t)p + len) & ~((uintptr_t)RSPAMD_HUGE_PAGE_SIZE - 1));
+
+	if (end > start) {
+		(void)madvise (start, end - start, MADV_HUGEPAGE);
+	}
+#endif
+}
+
 void
 rspamd_mempool_set_variable (rspamd_mempool_t *pool,
 	const gchar *name,
@@ -22,6 +22,7 @@ struct f_str_s;
 #define MEMPOOL_TAG_LEN 20
 #define MEMPOOL_UID_LEN 20
 #define MEM_ALIGNMENT   8
+#define RSPAMD_HUGE_PAGE_SIZE (2 * 1024 * 1024)
 #define align_ptr(p, a)                                                   \
     (guint8 *) (((uintptr_t) (p) + ((uintptr_t) a - 1)) & ~((uintptr_t) a - 1))
 
@@ -99,6 +100,19 @@ typedef struct memory_pool_s {
 	struct rspamd_mempool_tag tag;          /**< memory pool tag						*/
 } rspamd_mempool_t;
 
+#define MEMPOOL_TAG_STATS 32
+
+/**
+ * Peak usage of pools with the same tag, collected if `RSPAMD_MEMPOOL_DEBUG`
+ * environment variable is set
+ */
+struct rspamd_mempool_tag_stat {
+	gint used;								/**< 2 if slot is filled						*/
+	guint pools;							/**< number of deleted pools					*/
+	guint peak;								/**< maximum bytes used by a pool				*/
+	gchar tag[MEMPOOL_TAG_LEN];
+};
+
 /**
  * Statistics structure
  */
@@ -110,6 +124,8 @@ typedef struct memory_pool_stat_s {
 	guint shared_chunks_allocated;      /**< shared chunks allocated							*/
 	guint chunks_freed;                 /**< chunks freed										*/
 	guint oversized_chunks;             /**< oversized chunks									*/
+	guint chunks_reused;                /**< chunks taken from the cache of freed chunks		*/
+	struct rspamd_mempool_tag_stat tags[MEMPOOL_TAG_STATS];
 } rspamd_mempool_stat_t;
 
 
@@ -153,6 +169,13 @@ void * rspamd_mempool_alloc0 (rspamd_mempool_t * pool, gsize size);
  */
 void * rspamd_mempool_alloc0_tmp (rspamd_mempool_t * pool, gsize size);
 
+/**
+ * Call destructors and drop all data of a pool but keep its first page, so
+ * the pool could be reused as a new one
+ * @param pool memory pool object
+ */
+void rspamd_mempool_reset (rspamd_mempool_t *pool);
+
 /**
  * Cleanup temporary data in pool
  */
@@ -294,6 +317,25 @@ void rspamd_mempool_stat_reset (void);
  */
 gsize rspamd_mempool_suggest_size (void);
 
+/**
+ * Enables or disables transparent huge pages for large chunks
+ * @param enable
+ */
+void rspamd_mempool_set_huge_pages (gboolean enable);
+
+/**
+ * Returns TRUE if huge pages are enabled
+ */
+gboolean rspamd_mempool_huge_pages (void);
+
+/**
+ * Advises kernel to back the specified region with huge pages if they are
+ * enabled and the region is large enough, it is a no-op otherwise
+ * @param p start of region
+ * @param len length of region
+ */
+void rspamd_mempool_advise_huge (gpointer p, gsize len);
+
 /**
  * Set memory pool variable
  * @param pool memory pool object
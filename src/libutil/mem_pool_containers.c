@@ -0,0 +1,238 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "mem_pool_containers.h"
+
+#define HASH_MIN_SIZE 8
+
+static inline guint
+rspamd_mempool_hash_round (guint n)
+{
+	guint size = HASH_MIN_SIZE;
+
+	while (size < n) {
+		size <<= 1;
+	}
+
+	return size;
+}
+
+static struct rspamd_mempool_hash_elt *
+rspamd_mempool_hash_find (rspamd_mempool_hash_t *h, gconstpointer key,
+		guint hash)
+{
+	guint mask = h->size - 1, i;
+	struct rspamd_mempool_hash_elt *elt;
+
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		elt = &h->elts[i];
+
+		if (elt->key == NULL ||
+				(elt->hash == hash && h->equal_func (elt->key, key))) {
+			return elt;
+		}
+	}
+}
+
+/* Old storage is left in the pool, so growth costs at most twice memory */
+static void
+rspamd_mempool_hash_grow (rspamd_mempool_hash_t *h)
+{
+	struct rspamd_mempool_hash_elt *old = h->elts, *elt;
+	guint old_size = h->size, i;
+
+	h->size = old_size * 2;
+	h->elts = rspamd_mempool_alloc0 (h->pool, sizeof (*h->elts) * h->size);
+
+	for (i = 0; i < old_size; i ++) {
+		if (old[i].key != NULL) {
+			elt = rspamd_mempool_hash_find (h, old[i].key, old[i].hash);
+			memcpy (elt, &old[i], sizeof (*elt));
+		}
+	}
+}
+
+rspamd_mempool_hash_t *
+rspamd_mempool_hash_new (rspamd_mempool_t *pool, guint size_hint,
+		GHashFunc hash_func, GEqualFunc equal_func)
+{
+	rspamd_mempool_hash_t *h;
+
+	g_assert (pool != NULL);
+	g_assert (hash_func != NULL && equal_func != NULL);
+
+	h = rspamd_mempool_alloc (pool, sizeof (*h));
+	h->pool = pool;
+	h->hash_func = hash_func;
+	h->equal_func = equal_func;
+	h->nelts = 0;
+	/* Keep load factor below 3/4 */
+	h->size = rspamd_mempool_hash_round (size_hint + size_hint / 3 + 1);
+	h->elts = rspamd_mempool_alloc0 (pool, sizeof (*h->elts) * h->size);
+
+	return h;
+}
+
+void
+rspamd_mempool_hash_insert (rspamd_mempool_hash_t *h, gpointer key,
+		gpointer value)
+{
+	struct rspamd_mempool_hash_elt *elt;
+	guint hash;
+
+	g_assert (key != NULL);
+
+	hash = h->hash_func (key);
+	elt = rspamd_mempool_hash_find (h, key, hash);
+
+	if (elt->key != NULL) {
+		elt->value = value;
+
+		return;
+	}
+
+	if ((h->nelts + 1) * 4 > h->size * 3) {
+		rspamd_mempool_hash_grow (h);
+		elt = rspamd_mempool_hash_find (h, key, hash);
+	}
+
+	elt->key = key;
+	elt->value = value;
+	elt->hash = hash;
+	h->nelts ++;
+}
+
+gpointer
+rspamd_mempool_hash_lookup (rspamd_mempool_hash_t *h, gconstpointer key)
+{
+	struct rspamd_mempool_hash_elt *elt;
+
+	if (h == NULL || key == NULL) {
+		return NULL;
+	}
+
+	elt = rspamd_mempool_hash_find (h, key, h->hash_func (key));
+
+	return elt->key != NULL ? elt->value : NULL;
+}
+
+guint
+rspamd_mempool_hash_size (rspamd_mempool_hash_t *h)
+{
+	return h != NULL ? h->nelts : 0;
+}
+
+void
+rspamd_mempool_hash_foreach (rspamd_mempool_hash_t *h, GHFunc func,
+		gpointer ud)
+{
+	guint i;
+
+	for (i = 0; i < h->size; i ++) {
+		if (h->elts[i].key != NULL) {
+			func (h->elts[i].key, h->elts[i].value, ud);
+		}
+	}
+}
+
+void
+rspamd_mempool_hash_iter_init (rspamd_mempool_hash_iter_t *it,
+		rspamd_mempool_hash_t *h)
+{
+	it->h = h;
+	it->idx = 0;
+}
+
+gboolean
+rspamd_mempool_hash_iter_next (rspamd_mempool_hash_iter_t *it,
+		gpointer *key, gpointer *value)
+{
+	rspamd_mempool_hash_t *h = it->h;
+
+	while (it->idx < h->size) {
+		if (h->elts[it->idx].key != NULL) {
+			if (key) {
+				*key = h->elts[it->idx].key;
+			}
+			if (value) {
+				*value = h->elts[it->idx].value;
+			}
+
+			it->idx ++;
+
+			return TRUE;
+		}
+
+		it->idx ++;
+	}
+
+	return FALSE;
+}
+
+rspamd_mempool_array_t *
+rspamd_mempool_array_new (rspamd_mempool_t *pool, guint size_hint)
+{
+	rspamd_mempool_array_t *ar;
+
+	g_assert (pool != NULL);
+
+	ar = rspamd_mempool_alloc (pool, sizeof (*ar));
+	ar->pool = pool;
+	ar->len = 0;
+	ar->allocated = MAX (size_hint, 4);
+	ar->pdata = rspamd_mempool_alloc (pool,
+			sizeof (gpointer) * ar->allocated);
+
+	return ar;
+}
+
+static void
+rspamd_mempool_array_reserve (rspamd_mempool_array_t *ar)
+{
+	gpointer *npdata;
+
+	if (ar->len == ar->allocated) {
+		ar->allocated *= 2;
+		npdata = rspamd_mempool_alloc (ar->pool,
+				sizeof (gpointer) * ar->allocated);
+		memcpy (npdata, ar->pdata, sizeof (gpointer) * ar->len);
+		ar->pdata = npdata;
+	}
+}
+
+void
+rspamd_mempool_array_add (rspamd_mempool_array_t *ar, gpointer data)
+{
+	rspamd_mempool_array_reserve (ar);
+	ar->pdata[ar->len ++] = data;
+}
+
+void
+rspamd_mempool_array_insert (rspamd_mempool_array_t *ar, guint idx,
+		gpointer data)
+{
+	g_assert (idx <= ar->len);
+
+	rspamd_mempool_array_reserve (ar);
+
+	if (idx < ar->len) {
+		memmove (&ar->pdata[idx + 1], &ar->pdata[idx],
+				sizeof (gpointer) * (ar->len - idx));
+	}
+
+	ar->pdata[idx] = data;
+	ar->len ++;
+}
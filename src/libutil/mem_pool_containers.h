@@ -0,0 +1,116 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_MEM_POOL_CONTAINERS_H_
+#define SRC_LIBUTIL_MEM_POOL_CONTAINERS_H_
+
+#include "config.h"
+#include "mem_pool.h"
+
+/*
+ * Hash table and pointers array that allocate their storage from a memory
+ * pool, so they need neither destructors nor individual frees and die with
+ * the pool. Hash table uses open addressing with linear probing and does
+ * not support removal of elements, keys must not be NULL.
+ */
+
+struct rspamd_mempool_hash_elt {
+	gpointer key;
+	gpointer value;
+	guint hash;
+};
+
+typedef struct rspamd_mempool_hash_s {
+	rspamd_mempool_t *pool;
+	struct rspamd_mempool_hash_elt *elts;
+	GHashFunc hash_func;
+	GEqualFunc equal_func;
+	guint size;
+	guint nelts;
+} rspamd_mempool_hash_t;
+
+typedef struct rspamd_mempool_hash_iter_s {
+	rspamd_mempool_hash_t *h;
+	guint idx;
+} rspamd_mempool_hash_iter_t;
+
+typedef struct rspamd_mempool_array_s {
+	rspamd_mempool_t *pool;
+	gpointer *pdata;
+	guint len;
+	guint allocated;
+} rspamd_mempool_array_t;
+
+#define rspamd_mempool_array_index(ar, i) ((ar)->pdata[(i)])
+
+/**
+ * Create new hash table in the pool
+ * @param pool memory pool
+ * @param size_hint expected number of elements
+ * @param hash_func hash function
+ * @param equal_func equality function
+ * @return new hash table
+ */
+rspamd_mempool_hash_t *rspamd_mempool_hash_new (rspamd_mempool_t *pool,
+		guint size_hint, GHashFunc hash_func, GEqualFunc equal_func);
+
+/**
+ * Insert new element or replace value of an existing one (the old key is
+ * preserved)
+ */
+void rspamd_mempool_hash_insert (rspamd_mempool_hash_t *h, gpointer key,
+		gpointer value);
+
+/**
+ * Find value by key
+ * @return value or NULL
+ */
+gpointer rspamd_mempool_hash_lookup (rspamd_mempool_hash_t *h,
+		gconstpointer key);
+
+/**
+ * Returns number of elements in a hash
+ */
+guint rspamd_mempool_hash_size (rspamd_mempool_hash_t *h);
+
+/**
+ * Call `func` for each element of a hash
+ */
+void rspamd_mempool_hash_foreach (rspamd_mempool_hash_t *h, GHFunc func,
+		gpointer ud);
+
+void rspamd_mempool_hash_iter_init (rspamd_mempool_hash_iter_t *it,
+		rspamd_mempool_hash_t *h);
+gboolean rspamd_mempool_hash_iter_next (rspamd_mempool_hash_iter_t *it,
+		gpointer *key, gpointer *value);
+
+/**
+ * Create new pointers array in the pool
+ */
+rspamd_mempool_array_t *rspamd_mempool_array_new (rspamd_mempool_t *pool,
+		guint size_hint);
+
+/**
+ * Append element to an array
+ */
+void rspamd_mempool_array_add (rspamd_mempool_array_t *ar, gpointer data);
+
+/**
+ * Insert element at the specified position, shifting the rest of elements
+ */
+void rspamd_mempool_array_insert (rspamd_mempool_array_t *ar, guint idx,
+		gpointer data);
+
+#endif /* SRC_LIBUTIL_MEM_POOL_CONTAINERS_H_ */
@@ -767,6 +767,16 @@ rspamd_multipattern_get_pattern (struct rspamd_multipattern *mp,
 	return pat.ptr;
 }
 
+gboolean
+rspamd_multipattern_has_hyperscan (void)
+{
+#ifdef WITH_HYPERSCAN
+	return hs_suitable_cpu;
+#else
+	return FALSE;
+#endif
+}
+
 guint
 rspamd_multipattern_get_npatterns (struct rspamd_multipattern *mp)
 {
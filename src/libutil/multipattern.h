@@ -147,6 +147,13 @@ const gchar* rspamd_multipattern_get_pattern (struct rspamd_multipattern *mp,
  */
 guint rspamd_multipattern_get_npatterns (struct rspamd_multipattern *mp);
 
+/**
+ * Returns TRUE if multipattern uses hyperscan, so RSPAMD_MULTIPATTERN_RE
+ * patterns are matched as regular expressions and not as plain strings
+ * @return
+ */
+gboolean rspamd_multipattern_has_hyperscan (void);
+
 /**
  * Destroys multipattern structure
  * @param mp
@@ -40,6 +40,7 @@
 
 #include "printf.h"
 #include "str_util.h"
+#include <math.h>
 
 /**
  * From FreeBSD libutil code
@@ -47,6 +48,22 @@
 static const int maxscale = 6;
 static const gchar _hex[] = "0123456789abcdef";
 static const gchar _HEX[] = "0123456789ABCDEF";
+/* Two decimal digits per lookup, halves the number of divisions */
+static const gchar _digit_pairs[] =
+		"00010203040506070809"
+		"10111213141516171819"
+		"20212223242526272829"
+		"30313233343536373839"
+		"40414243444546474849"
+		"50515253545556575859"
+		"60616263646566676869"
+		"70717273747576777879"
+		"80818283848586878889"
+		"90919293949596979899";
+static const guint64 _pow10[] = {
+		1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+		10000000ULL, 100000000ULL, 1000000000ULL
+};
 
 static gchar *
 rspamd_humanize_number (gchar *buf, gchar *last, gint64 num, gboolean bytes)
@@ -136,14 +153,34 @@ rspamd_sprintf_num (gchar *buf, gchar *last, guint64 ui64, gchar zero,
 
 			ui32 = (guint32) ui64;
 
-			do {
-				*--p = (gchar) (ui32 % 10 + '0');
-			} while (ui32 /= 10);
+			while (ui32 >= 100) {
+				p -= 2;
+				memcpy (p, &_digit_pairs[(ui32 % 100) * 2], 2);
+				ui32 /= 100;
+			}
+
+			if (ui32 >= 10) {
+				p -= 2;
+				memcpy (p, &_digit_pairs[ui32 * 2], 2);
+			}
+			else {
+				*--p = (gchar) (ui32 + '0');
+			}
 
 		} else {
-			do {
-				*--p = (gchar) (ui64 % 10 + '0');
-			} while (ui64 /= 10);
+			while (ui64 >= 100) {
+				p -= 2;
+				memcpy (p, &_digit_pairs[(ui64 % 100) * 2], 2);
+				ui64 /= 100;
+			}
+
+			if (ui64 >= 10) {
+				p -= 2;
+				memcpy (p, &_digit_pairs[ui64 * 2], 2);
+			}
+			else {
+				*--p = (gchar) (ui64 + '0');
+			}
 		}
 
 	} else if (hexadecimal == 1) {
@@ -184,6 +221,64 @@ rspamd_sprintf_num (gchar *buf, gchar *last, guint64 ui64, gchar zero,
 	return ((gchar *)memcpy (buf, p, len)) + len;
 }
 
+/*
+ * Formats `f` as "%.<prec>f" using integer arithmetic. Returns the length
+ * written or 0 if the value cannot be formatted exactly like libc does
+ * (too large, not finite or a rounding tie), so the caller should fall back
+ * to g_ascii_formatd
+ */
+static glong
+rspamd_printf_fixed_double (gchar *buf, gdouble f, guint prec)
+{
+	gdouble scaled, rem;
+	guint64 ip, fp, div;
+	gchar *p = buf, *end;
+	guint i;
+
+	if (prec >= G_N_ELEMENTS (_pow10) || !isfinite (f)) {
+		return 0;
+	}
+
+	if (signbit (f)) {
+		*p++ = '-';
+		f = -f;
+	}
+
+	scaled = f * (gdouble)_pow10[prec];
+
+	/* Below 2^52 every half-integer is representable, so a tie is exact */
+	if (scaled >= 4503599627370496.0) {
+		return 0;
+	}
+
+	ip = (guint64)scaled;
+	rem = scaled - (gdouble)ip;
+
+	if (rem == 0.5) {
+		return 0;
+	}
+	else if (rem > 0.5) {
+		ip ++;
+	}
+
+	div = _pow10[prec];
+	end = rspamd_sprintf_num (p, p + 20, ip / div, '0', 0, 0);
+
+	if (prec > 0) {
+		*end++ = '.';
+		fp = ip % div;
+
+		for (i = prec; i > 0; i --) {
+			end[i - 1] = (gchar)(fp % 10 + '0');
+			fp /= 10;
+		}
+
+		end += prec;
+	}
+
+	return end - buf;
+}
+
 struct rspamd_printf_char_buf {
 	char *begin;
 	char *pos;
@@ -702,6 +797,18 @@ rspamd_vprintf_common (rspamd_printf_append_func func,
 			case 'f':
 			case 'g':
 				f = (gdouble) va_arg (args, double);
+
+				if (*fmt == 'f' && fmt_start[1] == '.' && width == 0) {
+					/* Plain %.Nf, the usual form for scores and timings */
+					slen = rspamd_printf_fixed_double (numbuf, f, frac_width);
+
+					if (slen > 0) {
+						RSPAMD_PRINTF_APPEND (numbuf, slen);
+
+						continue;
+					}
+				}
+
 				rspamd_strlcpy (dtoabuf, fmt_start, MIN (sizeof (dtoabuf),
 						(fmt - fmt_start + 2)));
 				g_ascii_formatd (numbuf, sizeof (numbuf), dtoabuf, (double)f);
@@ -723,7 +830,7 @@ rspamd_vprintf_common (rspamd_printf_append_func func,
 				continue;
 
 			case 'B':
-				bv = (gboolean) va_arg (args, double);
+				bv = (gboolean) va_arg (args, gint);
 				RSPAMD_PRINTF_APPEND (bv ? "true" : "false", bv ? 4 : 5);
 
 				continue;
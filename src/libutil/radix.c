@@ -155,6 +155,85 @@ radix_find_compressed_addr (radix_compressed_t *tree,
 	return RADIX_NO_VALUE;
 }
 
+guint
+radix_find_compressed_batch (radix_compressed_t *tree,
+		const guint8 * const *keys, const gsize *keylens, guint nkeys,
+		uintptr_t *values)
+{
+	guint i, found = 0;
+	gconstpointer ret;
+
+	g_assert (tree != NULL);
+
+	for (i = 0; i < nkeys; i ++) {
+		if (keys[i] == NULL || keylens[i] == 0) {
+			values[i] = RADIX_NO_VALUE;
+			continue;
+		}
+
+		ret = btrie_lookup (tree->tree, keys[i], keylens[i] * NBBY);
+
+		if (ret == NULL) {
+			values[i] = RADIX_NO_VALUE;
+		}
+		else {
+			values[i] = (uintptr_t)ret;
+			found ++;
+		}
+	}
+
+	return found;
+}
+
+guint
+radix_find_compressed_addrs (radix_compressed_t *tree,
+		const rspamd_inet_addr_t * const *addrs, guint naddrs,
+		uintptr_t *values)
+{
+	const guint8 **keys;
+	gsize *keylens;
+	guint i, klen;
+
+	keys = g_alloca (naddrs * sizeof (*keys));
+	keylens = g_alloca (naddrs * sizeof (*keylens));
+
+	for (i = 0; i < naddrs; i ++) {
+		klen = 0;
+		keys[i] = addrs[i] ?
+				rspamd_inet_address_get_hash_key (addrs[i], &klen) : NULL;
+		keylens[i] = klen;
+	}
+
+	return radix_find_compressed_batch (tree, keys, keylens, naddrs, values);
+}
+
+guint
+radix_find_compressed_trees (radix_compressed_t * const *trees, guint ntrees,
+		const rspamd_inet_addr_t *addr, uintptr_t *values)
+{
+	const guchar *key = NULL;
+	guint i, klen = 0, found = 0;
+
+	if (addr) {
+		key = rspamd_inet_address_get_hash_key (addr, &klen);
+	}
+
+	for (i = 0; i < ntrees; i ++) {
+		if (trees[i] == NULL || key == NULL || klen == 0) {
+			values[i] = RADIX_NO_VALUE;
+			continue;
+		}
+
+		values[i] = radix_find_compressed (trees[i], key, klen);
+
+		if (values[i] != RADIX_NO_VALUE) {
+			found ++;
+		}
+	}
+
+	return found;
+}
+
 gint
 rspamd_radix_add_iplist (const gchar *list, const gchar *separators,
 		radix_compressed_t *tree, gconstpointer value, gboolean resolve)
@@ -59,6 +59,39 @@ uintptr_t radix_find_compressed (radix_compressed_t * tree, const guint8 *key,
 uintptr_t radix_find_compressed_addr (radix_compressed_t *tree,
 		const rspamd_inet_addr_t *addr);
 
+/**
+ * Find many keys in a radix trie at once
+ * @param tree radix trie
+ * @param keys array of keys (bitstrings), NULL keys are never found
+ * @param keylens lengths of keys in bytes
+ * @param nkeys number of keys
+ * @param values output array of `nkeys` values, `RADIX_NO_VALUE` is set for
+ * keys that are not found
+ * @return number of keys found
+ */
+guint radix_find_compressed_batch (radix_compressed_t *tree,
+		const guint8 * const *keys, const gsize *keylens, guint nkeys,
+		uintptr_t *values);
+
+/**
+ * Find many addresses in a radix trie at once, @see radix_find_compressed_batch
+ * @return number of addresses found
+ */
+guint radix_find_compressed_addrs (radix_compressed_t *tree,
+		const rspamd_inet_addr_t * const *addrs, guint naddrs,
+		uintptr_t *values);
+
+/**
+ * Find a single address in many radix tries, the key is extracted once
+ * @param trees array of tries, NULL tries are skipped
+ * @param ntrees number of tries
+ * @param addr address to find
+ * @param values output array of `ntrees` values
+ * @return number of tries where the address has been found
+ */
+guint radix_find_compressed_trees (radix_compressed_t * const *trees,
+		guint ntrees, const rspamd_inet_addr_t *addr, uintptr_t *values);
+
 /**
  * Destroy the complete radix trie
  * @param tree
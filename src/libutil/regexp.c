@@ -87,6 +87,28 @@ static gboolean can_jit = FALSE;
 static pcre2_compile_context *pcre2_ctx = NULL;
 #endif
 
+#ifdef HAVE_PCRE_JIT
+/*
+ * JIT stack is used during matching only, so a single stack is shared by all
+ * regexps of a process instead of allocating it for each regexp
+ */
+static PCRE_JIT_T *global_jstack = NULL;
+
+static PCRE_JIT_T *
+rspamd_regexp_jit_stack (void)
+{
+	if (global_jstack == NULL) {
+#ifdef WITH_PCRE2
+		global_jstack = pcre2_jit_stack_create (32 * 1024, 512 * 1024, NULL);
+#else
+		global_jstack = pcre_jit_stack_alloc (32 * 1024, 512 * 1024);
+#endif
+	}
+
+	return global_jstack;
+}
+#endif
+
 static GQuark
 rspamd_regexp_quark (void)
 {
@@ -124,11 +146,6 @@ rspamd_regexp_dtor (rspamd_regexp_t *re)
 			if (re->mcontext) {
 				pcre2_match_context_free (re->mcontext);
 			}
-#endif
-#ifdef HAVE_PCRE_JIT
-			if (re->raw_jstack) {
-				PCRE_JIT_STACK_FREE (re->raw_jstack);
-			}
 #endif
 			PCRE_FREE (re->raw_re);
 		}
@@ -143,11 +160,6 @@ rspamd_regexp_dtor (rspamd_regexp_t *re)
 			if (re->raw_mcontext) {
 				pcre2_match_context_free (re->raw_mcontext);
 			}
-#endif
-#ifdef HAVE_PCRE_JIT
-			if (re->jstack) {
-				PCRE_JIT_STACK_FREE (re->jstack);
-			}
 #endif
 			PCRE_FREE (re->re);
 		}
@@ -184,7 +196,7 @@ rspamd_regexp_post_process (rspamd_regexp_t *r)
 	}
 	else {
 		if (pcre2_pattern_info (r->re, PCRE2_INFO_JITSIZE, &jsz) >= 0 && jsz > 0) {
-			r->jstack = pcre2_jit_stack_create (32 * 1024, 512 * 1024, NULL);
+			r->jstack = rspamd_regexp_jit_stack ();
 		}
 		else {
 			msg_err ("jit compilation of %s is not supported", r->pattern);
@@ -203,7 +215,7 @@ rspamd_regexp_post_process (rspamd_regexp_t *r)
 		}
 
 		if (pcre2_pattern_info (r->raw_re, PCRE2_INFO_JITSIZE, &jsz) >= 0 && jsz > 0) {
-			r->raw_jstack = pcre2_jit_stack_create (32 * 1024, 512 * 1024, NULL);
+			r->raw_jstack = rspamd_regexp_jit_stack ();
 		}
 		else {
 			msg_debug ("jit compilation of raw %s is not supported", r->pattern);
@@ -271,7 +283,7 @@ rspamd_regexp_post_process (rspamd_regexp_t *r)
 				r->flags |= RSPAMD_REGEXP_FLAG_DISABLE_JIT;
 			}
 			else {
-				r->jstack = pcre_jit_stack_alloc (32 * 1024, 512 * 1024);
+				r->jstack = rspamd_regexp_jit_stack ();
 				pcre_assign_jit_stack (r->extra, NULL, r->jstack);
 			}
 		}
@@ -303,7 +315,7 @@ rspamd_regexp_post_process (rspamd_regexp_t *r)
 					r->flags |= RSPAMD_REGEXP_FLAG_DISABLE_JIT;
 				}
 				else {
-					r->raw_jstack = pcre_jit_stack_alloc (32 * 1024, 512 * 1024);
+					r->raw_jstack = rspamd_regexp_jit_stack ();
 					pcre_assign_jit_stack (r->raw_extra, NULL, r->raw_jstack);
 				}
 			}
@@ -1116,6 +1128,13 @@ rspamd_regexp_library_finalize (void)
 		pcre2_compile_context_free (pcre2_ctx);
 #endif
 	}
+
+#ifdef HAVE_PCRE_JIT
+	if (global_jstack != NULL) {
+		PCRE_JIT_STACK_FREE (global_jstack);
+		global_jstack = NULL;
+	}
+#endif
 }
 
 gpointer
@@ -0,0 +1,231 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "shared_cache.h"
+#include "cryptobox.h"
+
+#define RSPAMD_SHARED_CACHE_WAYS 4
+#define RSPAMD_SHARED_CACHE_LOCKS 64
+#define RSPAMD_SHARED_CACHE_KEYLEN 16
+
+struct rspamd_shared_cache_elt {
+	guchar key[RSPAMD_SHARED_CACHE_KEYLEN];
+	guint64 stamp;				/**< last usage within a set, 0 if empty	*/
+	time_t expire;
+	guint vlen;
+	gchar value[];
+};
+
+struct rspamd_shared_cache {
+	guchar *elts;
+	rspamd_mempool_mutex_t *locks[RSPAMD_SHARED_CACHE_LOCKS];
+	gsize elt_size;
+	guint nsets;
+	guint max_value;
+	guint ttl;
+};
+
+#define SHARED_CACHE_ELT(c, i) \
+	((struct rspamd_shared_cache_elt *)((c)->elts + (gsize)(i) * (c)->elt_size))
+
+struct rspamd_shared_cache *
+rspamd_shared_cache_new (rspamd_mempool_t *pool, guint max_items,
+		guint max_value, guint ttl)
+{
+	struct rspamd_shared_cache *c;
+	guint i, nsets = 1;
+
+	g_assert (max_items > 0);
+	g_assert (max_value > 0);
+
+	while (nsets * RSPAMD_SHARED_CACHE_WAYS < max_items) {
+		nsets <<= 1;
+	}
+
+	c = rspamd_mempool_alloc0_shared (pool, sizeof (*c));
+	c->elt_size = sizeof (struct rspamd_shared_cache_elt) + max_value;
+	/* Keep elements aligned */
+	c->elt_size = (c->elt_size + 7) & ~((gsize)7);
+	c->elts = rspamd_mempool_alloc0_shared (pool,
+			c->elt_size * nsets * RSPAMD_SHARED_CACHE_WAYS);
+	c->nsets = nsets;
+	c->max_value = max_value;
+	c->ttl = ttl;
+
+	for (i = 0; i < G_N_ELEMENTS (c->locks); i ++) {
+		c->locks[i] = rspamd_mempool_get_mutex (pool);
+	}
+
+	return c;
+}
+
+static guint
+rspamd_shared_cache_key (const gchar *key, gsize keylen, guchar *digest)
+{
+	guchar out[rspamd_cryptobox_HASHBYTES];
+	guint64 h;
+
+	rspamd_cryptobox_hash (out, key, keylen, NULL, 0);
+	memcpy (digest, out, RSPAMD_SHARED_CACHE_KEYLEN);
+	memcpy (&h, out + RSPAMD_SHARED_CACHE_KEYLEN, sizeof (h));
+
+	return h;
+}
+
+/*
+ * Returns the element of `key` in its set or NULL, `victim` is set to the
+ * element that should be replaced in this set otherwise
+ */
+static struct rspamd_shared_cache_elt *
+rspamd_shared_cache_find (struct rspamd_shared_cache *c, guint nset,
+		const guchar *digest, struct rspamd_shared_cache_elt **victim,
+		guint64 *max_stamp)
+{
+	struct rspamd_shared_cache_elt *elt, *found = NULL;
+	guint i;
+
+	*victim = NULL;
+	*max_stamp = 0;
+
+	for (i = 0; i < RSPAMD_SHARED_CACHE_WAYS; i ++) {
+		elt = SHARED_CACHE_ELT (c, nset * RSPAMD_SHARED_CACHE_WAYS + i);
+
+		if (elt->stamp > *max_stamp) {
+			*max_stamp = elt->stamp;
+		}
+
+		if (elt->stamp != 0 &&
+				memcmp (elt->key, digest, sizeof (elt->key)) == 0) {
+			found = elt;
+		}
+		else if (*victim == NULL || elt->stamp < (*victim)->stamp) {
+			/* Least recently used element in this set */
+			*victim = elt;
+		}
+	}
+
+	return found;
+}
+
+gboolean
+rspamd_shared_cache_lookup (struct rspamd_shared_cache *c,
+		const gchar *key, gsize keylen, gchar *value, gsize *vlen, time_t now)
+{
+	struct rspamd_shared_cache_elt *elt, *victim;
+	rspamd_mempool_mutex_t *lock;
+	guchar digest[RSPAMD_SHARED_CACHE_KEYLEN];
+	guint64 max_stamp;
+	gboolean ret = FALSE;
+	guint nset;
+
+	g_assert (c != NULL);
+
+	nset = rspamd_shared_cache_key (key, keylen, digest) & (c->nsets - 1);
+	lock = c->locks[nset % RSPAMD_SHARED_CACHE_LOCKS];
+
+	rspamd_mempool_lock_mutex (lock);
+	elt = rspamd_shared_cache_find (c, nset, digest, &victim, &max_stamp);
+
+	if (elt) {
+		if (elt->expire >= now) {
+			memcpy (value, elt->value, elt->vlen);
+			*vlen = elt->vlen;
+			elt->stamp = max_stamp + 1;
+			ret = TRUE;
+		}
+		else {
+			/* Expired element is the first to be replaced */
+			elt->stamp = 0;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (lock);
+
+	return ret;
+}
+
+gboolean
+rspamd_shared_cache_insert (struct rspamd_shared_cache *c,
+		const gchar *key, gsize keylen, const gchar *value, gsize vlen,
+		time_t now, guint ttl)
+{
+	struct rspamd_shared_cache_elt *elt, *victim;
+	rspamd_mempool_mutex_t *lock;
+	guchar digest[RSPAMD_SHARED_CACHE_KEYLEN];
+	guint64 max_stamp;
+	guint nset;
+
+	g_assert (c != NULL);
+
+	if (vlen > c->max_value) {
+		return FALSE;
+	}
+
+	nset = rspamd_shared_cache_key (key, keylen, digest) & (c->nsets - 1);
+	lock = c->locks[nset % RSPAMD_SHARED_CACHE_LOCKS];
+
+	rspamd_mempool_lock_mutex (lock);
+	elt = rspamd_shared_cache_find (c, nset, digest, &victim, &max_stamp);
+
+	if (elt == NULL) {
+		elt = victim;
+		memcpy (elt->key, digest, sizeof (elt->key));
+	}
+
+	memcpy (elt->value, value, vlen);
+	elt->vlen = vlen;
+	elt->expire = now + (ttl > 0 ? ttl : c->ttl);
+	elt->stamp = max_stamp + 1;
+
+	rspamd_mempool_unlock_mutex (lock);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_shared_cache_remove (struct rspamd_shared_cache *c,
+		const gchar *key, gsize keylen)
+{
+	struct rspamd_shared_cache_elt *elt, *victim;
+	rspamd_mempool_mutex_t *lock;
+	guchar digest[RSPAMD_SHARED_CACHE_KEYLEN];
+	guint64 max_stamp;
+	guint nset;
+
+	g_assert (c != NULL);
+
+	nset = rspamd_shared_cache_key (key, keylen, digest) & (c->nsets - 1);
+	lock = c->locks[nset % RSPAMD_SHARED_CACHE_LOCKS];
+
+	rspamd_mempool_lock_mutex (lock);
+	elt = rspamd_shared_cache_find (c, nset, digest, &victim, &max_stamp);
+
+	if (elt) {
+		elt->stamp = 0;
+	}
+
+	rspamd_mempool_unlock_mutex (lock);
+
+	return elt != NULL;
+}
+
+guint
+rspamd_shared_cache_max_value (struct rspamd_shared_cache *c)
+{
+	g_assert (c != NULL);
+
+	return c->max_value;
+}
@@ -0,0 +1,69 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_SHARED_CACHE_H_
+#define SRC_LIBUTIL_SHARED_CACHE_H_
+
+#include "config.h"
+#include "mem_pool.h"
+
+/*
+ * Set associative LRU cache of short string values in shared memory, it is
+ * shared by all processes forked after its creation. Keys are stored as
+ * digests, values are copied on lookup.
+ */
+
+struct rspamd_shared_cache;
+
+/**
+ * Creates new cache, must be called before forking
+ * @param pool pool used for shared allocations
+ * @param max_items approximate capacity
+ * @param max_value maximum length of a value
+ * @param ttl default time to live of elements
+ * @return new cache
+ */
+struct rspamd_shared_cache *rspamd_shared_cache_new (rspamd_mempool_t *pool,
+		guint max_items, guint max_value, guint ttl);
+
+/**
+ * Finds a value and copies it to `value` that should have space for
+ * `rspamd_shared_cache_max_value` bytes
+ * @return TRUE if a value has been found
+ */
+gboolean rspamd_shared_cache_lookup (struct rspamd_shared_cache *c,
+		const gchar *key, gsize keylen, gchar *value, gsize *vlen, time_t now);
+
+/**
+ * Inserts or replaces a value, ttl 0 means the default one
+ * @return FALSE if a value is too long
+ */
+gboolean rspamd_shared_cache_insert (struct rspamd_shared_cache *c,
+		const gchar *key, gsize keylen, const gchar *value, gsize vlen,
+		time_t now, guint ttl);
+
+/**
+ * Removes a value
+ * @return TRUE if a value has been removed
+ */
+gboolean rspamd_shared_cache_remove (struct rspamd_shared_cache *c,
+		const gchar *key, gsize keylen);
+
+/**
+ * Returns maximum length of a value
+ */
+guint rspamd_shared_cache_max_value (struct rspamd_shared_cache *c);
+
+#endif /* SRC_LIBUTIL_SHARED_CACHE_H_ */
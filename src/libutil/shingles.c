@@ -112,6 +112,88 @@ rspamd_shingles_get_keys_cached (const guchar key[SHINGLES_KEY_SIZE])
 	return keys;
 }
 
+/*
+ * Derives values for all keys from a single hash of a word, lanes are
+ * independent so compiler could vectorise this loop
+ */
+static inline void
+rspamd_shingles_vector_lanes (guint64 h, const guint64 *seeds, guint64 *out)
+{
+	guint64 x;
+	guint j;
+
+	for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+		x = h ^ seeds[j];
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		out[j] = x;
+	}
+}
+
+static inline void
+rspamd_shingles_vector_window (guint64 lanes[SHINGLES_WINDOW][RSPAMD_SHINGLE_SIZE],
+		gsize first, guint64 **hashes, gsize pos)
+{
+	guint64 val;
+	guint j, k;
+
+	for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+		val = 0;
+
+		/* The oldest word is shifted most as in the other algorithms */
+		for (k = 0; k < SHINGLES_WINDOW; k ++) {
+			val ^= lanes[(first + k) % SHINGLES_WINDOW][j] >>
+					(8 * (SHINGLES_WINDOW - k - 1));
+		}
+
+		hashes[j][pos] = val;
+	}
+}
+
+/*
+ * Each word is hashed once and then values for all keys are derived from
+ * that hash, unlike other algorithms that hash each word for every key
+ */
+static void RSPAMD_OPTIMIZE("unroll-loops")
+rspamd_shingles_vector_from_text (GArray *input, guchar **keys,
+		guint64 **hashes, gsize hlen)
+{
+	guint64 seeds[RSPAMD_SHINGLE_SIZE];
+	/* Ring of lanes for words in the current window */
+	guint64 lanes[SHINGLES_WINDOW][RSPAMD_SHINGLE_SIZE];
+	rspamd_stat_token_t *word;
+	guint64 h;
+	gsize i;
+	guint j;
+
+	for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+		memcpy (&seeds[j], keys[j], sizeof (seeds[j]));
+	}
+
+	memset (lanes, 0, sizeof (lanes));
+
+	for (i = 0; i < input->len; i ++) {
+		word = &g_array_index (input, rspamd_stat_token_t, i);
+		h = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+				word->begin, word->len, seeds[0]);
+		rspamd_shingles_vector_lanes (h, seeds, lanes[i % SHINGLES_WINDOW]);
+
+		if (i + 1 >= SHINGLES_WINDOW) {
+			g_assert (hlen > i + 1 - SHINGLES_WINDOW);
+			rspamd_shingles_vector_window (lanes, i + 1 - SHINGLES_WINDOW,
+					hashes, i + 1 - SHINGLES_WINDOW);
+		}
+	}
+
+	if (input->len < SHINGLES_WINDOW) {
+		/* A single window padded with zeroes */
+		rspamd_shingles_vector_window (lanes, 0, hashes, 0);
+	}
+}
+
 struct rspamd_shingle* RSPAMD_OPTIMIZE("unroll-loops")
 rspamd_shingles_from_text (GArray *input,
 		const guchar key[16],
@@ -172,6 +254,9 @@ rspamd_shingles_from_text (GArray *input,
 			}
 		}
 	}
+	else if (alg == RSPAMD_SHINGLES_VECTOR) {
+		rspamd_shingles_vector_from_text (input, keys, hashes, hlen);
+	}
 	else {
 		guint64 res[SHINGLES_WINDOW * RSPAMD_SHINGLE_SIZE], seed;
 
@@ -29,7 +29,8 @@ enum rspamd_shingle_alg {
 	RSPAMD_SHINGLES_OLD = 0,
 	RSPAMD_SHINGLES_XXHASH,
 	RSPAMD_SHINGLES_MUMHASH,
-	RSPAMD_SHINGLES_FAST
+	RSPAMD_SHINGLES_FAST,
+	RSPAMD_SHINGLES_VECTOR
 };
 
 /**
@@ -0,0 +1,243 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "shm_counters.h"
+#include "str_util.h"
+
+#define CACHE_LINE 64
+
+struct rspamd_shm_counters_slot {
+	guint64 values[RSPAMD_SHM_COUNTERS_MAX];
+};
+
+/* Values are a multiple of cache line, so slots do not share lines */
+G_STATIC_ASSERT (sizeof (struct rspamd_shm_counters_slot) % CACHE_LINE == 0);
+
+struct rspamd_shm_counters {
+	rspamd_mempool_mutex_t *mtx;
+	guint ncounters;
+	gboolean busy[RSPAMD_SHM_COUNTERS_SLOTS];
+	gchar names[RSPAMD_SHM_COUNTERS_MAX][RSPAMD_SHM_COUNTER_NAME_LEN];
+	struct rspamd_shm_counters_slot *slots;
+};
+
+/* Slot of the current process, it is inherited on fork */
+static guint cur_slot = 0;
+
+struct rspamd_shm_counters *
+rspamd_shm_counters_new (rspamd_mempool_t *pool)
+{
+	struct rspamd_shm_counters *c;
+	guchar *p;
+
+	c = rspamd_mempool_alloc0_shared (pool, sizeof (*c));
+	c->mtx = rspamd_mempool_get_mutex (pool);
+	p = rspamd_mempool_alloc0_shared (pool,
+			sizeof (*c->slots) * RSPAMD_SHM_COUNTERS_SLOTS + CACHE_LINE);
+	/* Align the first slot */
+	p += (CACHE_LINE - ((guintptr)p % CACHE_LINE)) % CACHE_LINE;
+	c->slots = (struct rspamd_shm_counters_slot *)p;
+	c->busy[0] = TRUE;
+
+	return c;
+}
+
+gint
+rspamd_shm_counters_find (struct rspamd_shm_counters *c, const gchar *name)
+{
+	guint i, n;
+
+	g_assert (c != NULL);
+	g_assert (name != NULL);
+
+#ifndef HAVE_ATOMIC_BUILTINS
+	n = c->ncounters;
+#else
+	n = __atomic_load_n (&c->ncounters, __ATOMIC_ACQUIRE);
+#endif
+
+	for (i = 0; i < n; i ++) {
+		if (strcmp (c->names[i], name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+gint
+rspamd_shm_counters_register (struct rspamd_shm_counters *c,
+		const gchar *name)
+{
+	gint id;
+
+	g_assert (c != NULL);
+	g_assert (name != NULL);
+
+	rspamd_mempool_lock_mutex (c->mtx);
+	id = rspamd_shm_counters_find (c, name);
+
+	if (id == -1 && c->ncounters < RSPAMD_SHM_COUNTERS_MAX) {
+		id = c->ncounters;
+		rspamd_strlcpy (c->names[id], name, sizeof (c->names[id]));
+#ifndef HAVE_ATOMIC_BUILTINS
+		c->ncounters ++;
+#else
+		__atomic_store_n (&c->ncounters, id + 1, __ATOMIC_RELEASE);
+#endif
+	}
+
+	rspamd_mempool_unlock_mutex (c->mtx);
+
+	return id;
+}
+
+guint
+rspamd_shm_counters_count (struct rspamd_shm_counters *c)
+{
+	g_assert (c != NULL);
+
+	return c->ncounters;
+}
+
+const gchar *
+rspamd_shm_counters_name (struct rspamd_shm_counters *c, guint id)
+{
+	g_assert (c != NULL);
+	g_assert (id < c->ncounters);
+
+	return c->names[id];
+}
+
+guint
+rspamd_shm_counters_alloc_slot (struct rspamd_shm_counters *c)
+{
+	guint i, slot = 0;
+
+	g_assert (c != NULL);
+
+	rspamd_mempool_lock_mutex (c->mtx);
+
+	for (i = 1; i < RSPAMD_SHM_COUNTERS_SLOTS; i ++) {
+		if (!c->busy[i]) {
+			c->busy[i] = TRUE;
+			slot = i;
+			break;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (c->mtx);
+
+	return slot;
+}
+
+void
+rspamd_shm_counters_free_slot (struct rspamd_shm_counters *c, guint slot)
+{
+	guint i;
+	guint64 v;
+
+	if (c == NULL || slot == 0 || slot >= RSPAMD_SHM_COUNTERS_SLOTS) {
+		return;
+	}
+
+	rspamd_mempool_lock_mutex (c->mtx);
+
+	for (i = 0; i < RSPAMD_SHM_COUNTERS_MAX; i ++) {
+		v = c->slots[slot].values[i];
+
+		if (v != 0) {
+#ifndef HAVE_ATOMIC_BUILTINS
+			c->slots[0].values[i] += v;
+#else
+			__atomic_add_fetch (&c->slots[0].values[i], v, __ATOMIC_RELAXED);
+#endif
+			c->slots[slot].values[i] = 0;
+		}
+	}
+
+	c->busy[slot] = FALSE;
+	rspamd_mempool_unlock_mutex (c->mtx);
+}
+
+void
+rspamd_shm_counters_set_slot (struct rspamd_shm_counters *c, guint slot)
+{
+	g_assert (c != NULL);
+	g_assert (slot < RSPAMD_SHM_COUNTERS_SLOTS);
+
+	cur_slot = slot;
+}
+
+void
+rspamd_shm_counters_add (struct rspamd_shm_counters *c, guint id,
+		guint64 value)
+{
+	g_assert (c != NULL);
+	g_assert (id < RSPAMD_SHM_COUNTERS_MAX);
+
+#ifndef HAVE_ATOMIC_BUILTINS
+	c->slots[cur_slot].values[id] += value;
+#else
+	/* Slot is written by one process only, so there is no contention */
+	__atomic_add_fetch (&c->slots[cur_slot].values[id], value,
+			__ATOMIC_RELAXED);
+#endif
+}
+
+guint64
+rspamd_shm_counters_get (struct rspamd_shm_counters *c, guint id)
+{
+	guint64 sum = 0;
+	guint i;
+
+	g_assert (c != NULL);
+	g_assert (id < RSPAMD_SHM_COUNTERS_MAX);
+
+	for (i = 0; i < RSPAMD_SHM_COUNTERS_SLOTS; i ++) {
+#ifndef HAVE_ATOMIC_BUILTINS
+		sum += c->slots[i].values[id];
+#else
+		sum += __atomic_load_n (&c->slots[i].values[id], __ATOMIC_RELAXED);
+#endif
+	}
+
+	return sum;
+}
+
+void
+rspamd_shm_counters_set (struct rspamd_shm_counters *c, guint id,
+		guint64 value)
+{
+	guint i;
+
+	g_assert (c != NULL);
+	g_assert (id < RSPAMD_SHM_COUNTERS_MAX);
+
+	for (i = 1; i < RSPAMD_SHM_COUNTERS_SLOTS; i ++) {
+#ifndef HAVE_ATOMIC_BUILTINS
+		c->slots[i].values[id] = 0;
+#else
+		__atomic_store_n (&c->slots[i].values[id], 0, __ATOMIC_RELAXED);
+#endif
+	}
+
+#ifndef HAVE_ATOMIC_BUILTINS
+	c->slots[0].values[id] = value;
+#else
+	__atomic_store_n (&c->slots[0].values[id], value, __ATOMIC_RELAXED);
+#endif
+}
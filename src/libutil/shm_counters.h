@@ -0,0 +1,100 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_SHM_COUNTERS_H_
+#define SRC_LIBUTIL_SHM_COUNTERS_H_
+
+#include "config.h"
+#include "mem_pool.h"
+
+/*
+ * Registry of named counters in shared memory. Each process writes to its
+ * own cache line aligned slot, so increments do not contend, and readers sum
+ * all slots. Slot 0 keeps values of terminated processes and values restored
+ * or set explicitly.
+ */
+
+#define RSPAMD_SHM_COUNTERS_MAX 256
+#define RSPAMD_SHM_COUNTERS_SLOTS 128
+#define RSPAMD_SHM_COUNTER_NAME_LEN 64
+
+struct rspamd_shm_counters;
+
+/**
+ * Creates counters registry in shared memory of the pool, must be called
+ * before forking
+ */
+struct rspamd_shm_counters *rspamd_shm_counters_new (rspamd_mempool_t *pool);
+
+/**
+ * Registers new counter or returns id of the existing one with the same name
+ * @return counter id or -1 if there are no free counters
+ */
+gint rspamd_shm_counters_register (struct rspamd_shm_counters *c,
+		const gchar *name);
+
+/**
+ * Returns id of a counter or -1 if it is not registered
+ */
+gint rspamd_shm_counters_find (struct rspamd_shm_counters *c,
+		const gchar *name);
+
+/**
+ * Returns number of registered counters
+ */
+guint rspamd_shm_counters_count (struct rspamd_shm_counters *c);
+
+/**
+ * Returns name of a counter
+ */
+const gchar *rspamd_shm_counters_name (struct rspamd_shm_counters *c,
+		guint id);
+
+/**
+ * Reserves a slot for a new process, called by the main process
+ * @return slot number, 0 if all slots are busy (process shares slot 0 then)
+ */
+guint rspamd_shm_counters_alloc_slot (struct rspamd_shm_counters *c);
+
+/**
+ * Moves values of a terminated process to slot 0 and releases its slot
+ */
+void rspamd_shm_counters_free_slot (struct rspamd_shm_counters *c,
+		guint slot);
+
+/**
+ * Sets slot used by the current process for increments
+ */
+void rspamd_shm_counters_set_slot (struct rspamd_shm_counters *c,
+		guint slot);
+
+/**
+ * Adds value to a counter in the slot of the current process
+ */
+void rspamd_shm_counters_add (struct rspamd_shm_counters *c, guint id,
+		guint64 value);
+
+/**
+ * Returns sum of a counter over all slots
+ */
+guint64 rspamd_shm_counters_get (struct rspamd_shm_counters *c, guint id);
+
+/**
+ * Sets counter to the specified value, e.g. to reset or to restore it
+ */
+void rspamd_shm_counters_set (struct rspamd_shm_counters *c, guint id,
+		guint64 value);
+
+#endif /* SRC_LIBUTIL_SHM_COUNTERS_H_ */
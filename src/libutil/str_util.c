@@ -21,6 +21,10 @@
 #include "contrib/t1ha/t1ha.h"
 #include <math.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 const guchar lc_map[256] = {
 		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
 		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
@@ -56,16 +60,49 @@ const guchar lc_map[256] = {
 		0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
 };
 
+/* Size of chunks hashed by rspamd_icase_hash_fast */
+#define ICASE_HASH_CHUNK 64
+
+#ifdef __SSE2__
+/* Lowercase ASCII letters in a block, other bytes are left as is */
+static inline __m128i
+rspamd_lc_sse2 (__m128i v)
+{
+	const __m128i before_a = _mm_set1_epi8 ('A' - 1),
+			after_z = _mm_set1_epi8 ('Z' + 1),
+			lc_bit = _mm_set1_epi8 (0x20);
+	__m128i is_upper;
+
+	/* Bytes >= 0x80 are negative and never match */
+	is_upper = _mm_and_si128 (_mm_cmpgt_epi8 (v, before_a),
+			_mm_cmplt_epi8 (v, after_z));
+
+	return _mm_or_si128 (v, _mm_and_si128 (is_upper, lc_bit));
+}
+#endif
+
 void
 rspamd_str_lc (gchar *str, guint size)
 {
-	guint leftover = size % 4;
+	guint leftover;
 	guint fp, i;
-	const uint8_t* s = (const uint8_t*) str;
-	gchar *dest = str;
+	const uint8_t* s;
+	gchar *dest;
 	guchar c1, c2, c3, c4;
 
+#ifdef __SSE2__
+	while (size >= 16) {
+		_mm_storeu_si128 ((__m128i *)str,
+				rspamd_lc_sse2 (_mm_loadu_si128 ((const __m128i *)str)));
+		str += 16;
+		size -= 16;
+	}
+#endif
+
+	leftover = size % 4;
 	fp = size - leftover;
+	s = (const uint8_t*) str;
+	dest = str;
 
 	for (i = 0; i != fp; i += 4) {
 		c1 = s[i], c2 = s[i + 1], c3 = s[i + 2], c4 = s[i + 3];
@@ -96,9 +133,30 @@ rspamd_lc_cmp (const gchar *s, const gchar *d, gsize l)
 		guchar c[4];
 		guint32 n;
 	} cmp1, cmp2;
-	gsize leftover = l % 4;
+	gsize leftover;
 	gint ret = 0;
+#ifdef __SSE2__
+	__m128i v1, v2;
+	gint mask;
+
+	while (l >= 16) {
+		v1 = rspamd_lc_sse2 (_mm_loadu_si128 ((const __m128i *)s));
+		v2 = rspamd_lc_sse2 (_mm_loadu_si128 ((const __m128i *)d));
+		mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v1, v2));
 
+		if (mask != 0xffff) {
+			i = g_bit_nth_lsf (~mask & 0xffff, -1);
+
+			return (gint)lc_map[(guchar)s[i]] - (gint)lc_map[(guchar)d[i]];
+		}
+
+		s += 16;
+		d += 16;
+		l -= 16;
+	}
+#endif
+
+	leftover = l % 4;
 	fp = l - leftover;
 
 	for (i = 0; i != fp; i += 4) {
@@ -119,6 +177,9 @@ rspamd_lc_cmp (const gchar *s, const gchar *d, gsize l)
 		}
 	}
 
+	s += fp;
+	d += fp;
+
 	while (leftover > 0) {
 		if (g_ascii_tolower (*s) != g_ascii_tolower (*d)) {
 			return (*s) - (*d);
@@ -174,6 +235,144 @@ rspamd_str_lc_utf8 (gchar *str, guint size)
 	}
 }
 
+gboolean
+rspamd_str_is_ascii (const gchar *str, gsize len)
+{
+	const guchar *p = (const guchar *)str, *end = p + len;
+#ifdef __SSE2__
+	__m128i acc;
+
+	while (end - p >= 32) {
+		acc = _mm_or_si128 (_mm_loadu_si128 ((const __m128i *)p),
+				_mm_loadu_si128 ((const __m128i *)(p + 16)));
+
+		if (_mm_movemask_epi8 (acc) != 0) {
+			return FALSE;
+		}
+
+		p += 32;
+	}
+#else
+	guint64 t;
+
+	while (end - p >= (gssize)sizeof (t)) {
+		memcpy (&t, p, sizeof (t));
+
+		if (t & G_GUINT64_CONSTANT (0x8080808080808080)) {
+			return FALSE;
+		}
+
+		p += sizeof (t);
+	}
+#endif
+
+	while (p < end) {
+		if (*p & 0x80) {
+			return FALSE;
+		}
+
+		p ++;
+	}
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fast_utf8_validate (const gchar *str, gsize len, const gchar **end_ptr)
+{
+	const guchar *p = (const guchar *)str, *end = p + len;
+	guint n, i;
+	gunichar cp;
+	guchar c;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128 ();
+	__m128i v;
+	gint mask;
+#endif
+
+	while (p < end) {
+#ifdef __SSE2__
+		/* Skip ASCII blocks without NUL bytes */
+		while (end - p >= 16) {
+			v = _mm_loadu_si128 ((const __m128i *)p);
+			mask = _mm_movemask_epi8 (v) |
+					_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero));
+
+			if (mask != 0) {
+				p += g_bit_nth_lsf (mask, -1);
+				break;
+			}
+
+			p += 16;
+		}
+
+		if (p >= end) {
+			break;
+		}
+#endif
+		c = *p;
+
+		if (c < 0x80) {
+			if (c == 0) {
+				/* NUL is not allowed just like in g_utf8_validate */
+				goto err;
+			}
+
+			p ++;
+			continue;
+		}
+
+		if (c >= 0xc2 && c <= 0xdf) {
+			n = 1;
+			cp = c & 0x1f;
+		}
+		else if ((c & 0xf0) == 0xe0) {
+			n = 2;
+			cp = c & 0x0f;
+		}
+		else if (c >= 0xf0 && c <= 0xf4) {
+			n = 3;
+			cp = c & 0x07;
+		}
+		else {
+			goto err;
+		}
+
+		if ((gsize)(end - p) <= n) {
+			goto err;
+		}
+
+		for (i = 1; i <= n; i ++) {
+			if ((p[i] & 0xc0) != 0x80) {
+				goto err;
+			}
+
+			cp = (cp << 6) | (p[i] & 0x3f);
+		}
+
+		/* Overlong forms, surrogates and out of range characters */
+		if ((n == 2 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) ||
+				(n == 3 && (cp < 0x10000 || cp > 0x10ffff))) {
+			goto err;
+		}
+
+		p += n + 1;
+	}
+
+	if (end_ptr) {
+		*end_ptr = (const gchar *)p;
+	}
+
+	return TRUE;
+
+err:
+	if (end_ptr) {
+		*end_ptr = (const gchar *)p;
+	}
+
+	return FALSE;
+}
+
 gboolean
 rspamd_strcase_equal (gconstpointer v, gconstpointer v2)
 {
@@ -197,10 +396,26 @@ rspamd_icase_hash (const gchar *in, gsize len, guint64 seed)
 		guint64 pp;
 	} u;
 	guint64 h = seed;
+#ifdef __SSE2__
+	union {
+		__m128i v;
+		guint64 pp[2];
+	} blk;
+#endif
 
 	fp = len - leftover;
+	i = 0;
+
+#ifdef __SSE2__
+	/* Same result as the scalar loop below, two 8 bytes words per block */
+	for (; i + 16 <= fp; i += 16) {
+		blk.v = rspamd_lc_sse2 (_mm_loadu_si128 ((const __m128i *)(s + i)));
+		h = t1ha (&blk.pp[0], sizeof (blk.pp[0]), h);
+		h = t1ha (&blk.pp[1], sizeof (blk.pp[1]), h);
+	}
+#endif
 
-	for (i = 0; i != fp; i += 8) {
+	for (; i != fp; i += 8) {
 		u.c.c1 = s[i], u.c.c2 = s[i + 1], u.c.c3 = s[i + 2], u.c.c4 = s[i + 3];
 		u.c.c5 = s[i + 4], u.c.c6 = s[i + 5], u.c.c7 = s[i + 6], u.c.c8 = s[i + 7];
 		u.c.c1 = lc_map[u.c.c1];
@@ -239,15 +454,60 @@ rspamd_icase_hash (const gchar *in, gsize len, guint64 seed)
 	return h;
 }
 
+guint64
+rspamd_icase_hash_fast (const gchar *in, gsize len, guint64 seed)
+{
+	guchar buf[ICASE_HASH_CHUNK];
+	const guchar *p = (const guchar *)in, *end = p + len;
+	guint n;
+	guint64 h = seed;
+
+	/* Lowercase into a buffer and hash it by chunks */
+	while (end - p > ICASE_HASH_CHUNK) {
+#ifdef __SSE2__
+		for (n = 0; n < ICASE_HASH_CHUNK; n += 16) {
+			_mm_storeu_si128 ((__m128i *)(buf + n),
+					rspamd_lc_sse2 (_mm_loadu_si128 ((const __m128i *)(p + n))));
+		}
+#else
+		for (n = 0; n < ICASE_HASH_CHUNK; n ++) {
+			buf[n] = lc_map[p[n]];
+		}
+#endif
+		h = rspamd_cryptobox_fast_hash (buf, ICASE_HASH_CHUNK, h);
+		p += ICASE_HASH_CHUNK;
+	}
+
+	for (n = 0; p < end; n ++, p ++) {
+		buf[n] = lc_map[*p];
+	}
+
+	return rspamd_cryptobox_fast_hash (buf, n, h);
+}
+
 guint
 rspamd_strcase_hash (gconstpointer key)
 {
-	const gchar *p = key;
-	gsize len;
+	guchar buf[ICASE_HASH_CHUNK];
+	const guchar *p = key;
+	guint n = 0;
+	guint64 h = rspamd_hash_seed ();
+
+	/*
+	 * Fused strlen, lowercase and hash, gives the same result as
+	 * rspamd_icase_hash_fast
+	 */
+	while (*p) {
+		if (n == ICASE_HASH_CHUNK) {
+			/* Hash a full chunk only if there is more data after it */
+			h = rspamd_cryptobox_fast_hash (buf, n, h);
+			n = 0;
+		}
 
-	len = strlen (p);
+		buf[n++] = lc_map[*p++];
+	}
 
-	return rspamd_icase_hash (p, len, rspamd_hash_seed ());
+	return rspamd_cryptobox_fast_hash (buf, n, h);
 }
 
 guint
@@ -285,7 +545,7 @@ rspamd_ftok_icase_hash (gconstpointer key)
 {
 	const rspamd_ftok_t *f = key;
 
-	return rspamd_icase_hash (f->begin, f->len, rspamd_hash_seed ());
+	return rspamd_icase_hash_fast (f->begin, f->len, rspamd_hash_seed ());
 }
 
 gboolean
@@ -306,7 +566,7 @@ rspamd_gstring_icase_hash (gconstpointer key)
 {
 	const GString *f = key;
 
-	return rspamd_icase_hash (f->str, f->len, rspamd_hash_seed ());
+	return rspamd_icase_hash_fast (f->str, f->len, rspamd_hash_seed ());
 }
 
 /* https://graphics.stanford.edu/~seander/bithacks.html#ZeroInWord */
@@ -369,6 +629,27 @@ rspamd_strlcpy_tolower (gchar *dst, const gchar *src, gsize siz)
 	gchar *d = dst;
 	const gchar *s = src;
 	gsize n = siz;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128 ();
+	__m128i v;
+
+	/*
+	 * Copy blocks without NUL while there is room for the terminator, do not
+	 * read blocks crossing a page boundary as the string may end before it
+	 */
+	while (n > 16 && ((guintptr)s & 4095) <= 4096 - 16) {
+		v = _mm_loadu_si128 ((const __m128i *)s);
+
+		if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero)) != 0) {
+			break;
+		}
+
+		_mm_storeu_si128 ((__m128i *)d, rspamd_lc_sse2 (v));
+		s += 16;
+		d += 16;
+		n -= 16;
+	}
+#endif
 
 	/* Copy as many bytes as will fit */
 	if (n != 0) {
@@ -900,13 +1181,88 @@ rspamd_encode_base64_fold (const guchar *in, gsize inlen, gint str_len,
 
 #define MIN3(a, b, c) ((a) < (b) ? ((a) < (c) ? (a) : (c)) : ((b) < (c) ? (b) : (c)))
 
+/*
+ * Myers' bit-parallel edit distance (Hyyro's formulation), s1 must be at most
+ * 64 characters long
+ */
+static guint
+rspamd_levenshtein_bitpar (const guchar *s1, gsize s1len,
+		const guchar *s2, gsize s2len)
+{
+	guint64 peq[256], pv, mv, ph, mh, xv, xh, eq, last;
+	guint score = s1len;
+	gsize i;
+
+	memset (peq, 0, sizeof (peq));
+
+	for (i = 0; i < s1len; i ++) {
+		peq[s1[i]] |= 1ULL << i;
+	}
+
+	pv = ~0ULL;
+	mv = 0;
+	last = 1ULL << (s1len - 1);
+
+	for (i = 0; i < s2len; i ++) {
+		eq = peq[s2[i]];
+		xv = eq | mv;
+		xh = (((eq & pv) + pv) ^ pv) | eq;
+		ph = mv | ~(xh | pv);
+		mh = pv & xh;
+
+		if (ph & last) {
+			score ++;
+		}
+		else if (mh & last) {
+			score --;
+		}
+
+		ph = (ph << 1) | 1;
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+	}
+
+	return score;
+}
+
+/*
+ * Bit-parallel longest common subsequence, s1 must be at most 64 characters
+ * long
+ */
+static guint
+rspamd_lcs_bitpar (const guchar *s1, gsize s1len,
+		const guchar *s2, gsize s2len)
+{
+	guint64 peq[256], v, u, mask;
+	gsize i;
+
+	memset (peq, 0, sizeof (peq));
+
+	for (i = 0; i < s1len; i ++) {
+		peq[s1[i]] |= 1ULL << i;
+	}
+
+	v = ~0ULL;
+
+	for (i = 0; i < s2len; i ++) {
+		u = v & peq[s2[i]];
+		v = (v + u) | (v - u);
+	}
+
+	mask = s1len == 64 ? ~0ULL : (1ULL << s1len) - 1;
+
+	return __builtin_popcountll (~v & mask);
+}
+
 gint
-rspamd_strings_levenshtein_distance (const gchar *s1, gsize s1len,
+rspamd_strings_levenshtein_distance_bounded (const gchar *s1, gsize s1len,
 		const gchar *s2, gsize s2len,
-		guint replace_cost)
+		guint replace_cost, guint max_dist)
 {
-	guint x, y, lastdiag, olddiag;
-	gchar c1, c2;
+	guint x, y, lo, hi, lastdiag, olddiag, inf, colmin, v;
+	const gchar *t;
+	gsize tlen;
 	guint *column;
 	gint eq;
 	static const guint max_cmp = 8192;
@@ -927,24 +1283,86 @@ rspamd_strings_levenshtein_distance (const gchar *s1, gsize s1len,
 		return 0;
 	}
 
-	column = g_malloc0 ((s1len + 1) * sizeof (guint));
+	/* Distance cannot be larger than removing s1 and inserting s2 */
+	max_dist = MIN (max_dist, s1len + s2len);
+	inf = max_dist + 1;
 
-	for (y = 1; y <= s1len; y++) {
-		column[y] = y;
+	/* Every character of the length difference needs an insertion */
+	if ((s1len > s2len ? s1len - s2len : s2len - s1len) > max_dist) {
+		return inf;
+	}
+
+	/* Distance is symmetric, so keep the shorter string in s1 */
+	if (s1len > s2len) {
+		t = s1;
+		s1 = s2;
+		s2 = t;
+		tlen = s1len;
+		s1len = s2len;
+		s2len = tlen;
+	}
+
+	if (s1len == 0) {
+		return s2len;
+	}
+
+	if (s1len <= 64) {
+		if (replace_cost == 1) {
+			ret = rspamd_levenshtein_bitpar ((const guchar *)s1, s1len,
+					(const guchar *)s2, s2len);
+
+			return MIN (ret, inf);
+		}
+		else if (replace_cost >= 2) {
+			/* Replacement is never cheaper than insertion plus deletion */
+			ret = s1len + s2len - 2 * rspamd_lcs_bitpar ((const guchar *)s1,
+					s1len, (const guchar *)s2, s2len);
+
+			return MIN (ret, inf);
+		}
+	}
+
+	/* Banded DP, only cells within max_dist of the diagonal can be useful */
+	column = g_malloc ((s1len + 1) * sizeof (guint));
+
+	for (y = 0; y <= s1len; y++) {
+		column[y] = MIN (y, inf);
 	}
 
 	for (x = 1; x <= s2len; x++) {
-		column[0] = x;
+		lo = x > max_dist ? x - max_dist : 1;
+		hi = MIN (s1len, x + max_dist);
+
+		if (lo > hi) {
+			g_free (column);
+
+			return inf;
+		}
+
+		lastdiag = column[lo - 1];
+		column[lo - 1] = lo == 1 ? MIN (x, inf) : inf;
+		colmin = column[lo - 1];
 
-		for (y = 1, lastdiag = x - 1; y <= s1len; y++) {
+		for (y = lo; y <= hi; y++) {
 			olddiag = column[y];
-			c1 = s1[y - 1];
-			c2 = s2[x - 1];
-			eq = (c1 == c2) ? 0 : replace_cost;
-			column[y] = MIN3 (column[y] + 1, column[y - 1] + 1,
+			eq = (s1[y - 1] == s2[x - 1]) ? 0 : replace_cost;
+			v = MIN3 (column[y] + 1, column[y - 1] + 1,
 					lastdiag + (eq));
+			column[y] = MIN (v, inf);
+			colmin = MIN (colmin, column[y]);
 			lastdiag = olddiag;
 		}
+
+		if (hi < s1len) {
+			column[hi + 1] = inf;
+		}
+
+		if (colmin >= inf) {
+			/* All paths here are already too long */
+			g_free (column);
+
+			return inf;
+		}
 	}
 
 	ret = column[s1len];
@@ -953,6 +1371,15 @@ rspamd_strings_levenshtein_distance (const gchar *s1, gsize s1len,
 	return ret;
 }
 
+gint
+rspamd_strings_levenshtein_distance (const gchar *s1, gsize s1len,
+		const gchar *s2, gsize s2len,
+		guint replace_cost)
+{
+	return rspamd_strings_levenshtein_distance_bounded (s1, s1len, s2, s2len,
+			replace_cost, G_MAXINT / 2);
+}
+
 GString *
 rspamd_header_value_fold (const gchar *name,
 		const gchar *value,
@@ -1673,6 +2100,26 @@ rspamd_decode_hex (const gchar *in, gsize inlen)
 	return NULL;
 }
 
+/* Hex digit values, 255 for non hex characters */
+static const guchar qp_hexdigits[256] = {
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	  0,   1,   2,   3,   4,   5,   6,   7,   8,   9, 255, 255, 255, 255, 255, 255,
+	255,  10,  11,  12,  13,  14,  15, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255,  10,  11,  12,  13,  14,  15, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+	255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+};
+
 gssize
 rspamd_decode_qp_buf (const gchar *in, gsize inlen,
 		gchar *out, gsize outlen)
@@ -1702,12 +2149,13 @@ decode:
 			/* Decode character after '=' */
 			c = *p++;
 			remain --;
-			ret = 0;
+			ret = qp_hexdigits[(guchar)c];
 
-			if      (c >= '0' && c <= '9') { ret = c - '0'; }
-			else if (c >= 'A' && c <= 'F') { ret = c - 'A' + 10; }
-			else if (c >= 'a' && c <= 'f') { ret = c - 'a' + 10; }
-			else if (c == '\r' || c == '\n') {
+			if (ret == 255) {
+				ret = 0;
+			}
+
+			if (c == '\r' || c == '\n') {
 				/* Soft line break */
 				while (remain > 0 && (*p == '\r' || *p == '\n')) {
 					remain --;
@@ -1721,9 +2169,9 @@ decode:
 				c = *p++;
 				ret *= 16;
 
-				if      (c >= '0' && c <= '9') ret += c - '0';
-				else if (c >= 'A' && c <= 'F') ret += c - 'A' + 10;
-				else if (c >= 'a' && c <= 'f') ret += c - 'a' + 10;
+				if (qp_hexdigits[(guchar)c] != 255) {
+					ret += qp_hexdigits[(guchar)c];
+				}
 
 				if (end - o > 0) {
 					*o++ = (gchar)ret;
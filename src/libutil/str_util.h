@@ -42,10 +42,28 @@ void rspamd_str_lc (gchar *str, guint size);
  */
 void rspamd_str_lc_utf8 (gchar *str, guint size);
 
+/**
+ * Checks whether a string has no 8bit characters
+ */
+gboolean rspamd_str_is_ascii (const gchar *str, gsize len);
+
+/**
+ * Validates UTF-8 like `g_utf8_validate` but skips ASCII blocks at once
+ * @param end_ptr if not NULL, set to the first invalid byte
+ * @return TRUE if a string is valid UTF-8
+ */
+gboolean rspamd_fast_utf8_validate (const gchar *str, gsize len,
+		const gchar **end_ptr);
+
 /*
  * Hash table utility functions for case insensitive hashing
  */
 guint64 rspamd_icase_hash (const gchar *in, gsize len, guint64 seed);
+/*
+ * Faster variant of the case insensitive hash, its values differ from
+ * rspamd_icase_hash, so it must be used for in memory tables only
+ */
+guint64 rspamd_icase_hash_fast (const gchar *in, gsize len, guint64 seed);
 guint rspamd_strcase_hash (gconstpointer key);
 gboolean rspamd_strcase_equal (gconstpointer v, gconstpointer v2);
 
@@ -252,6 +270,13 @@ gssize rspamd_encode_qp2047_buf (const gchar *in, gsize inlen,
 gint rspamd_strings_levenshtein_distance (const gchar *s1, gsize s1len,
 		const gchar *s2, gsize s2len, guint replace_cost);
 
+/**
+ * Return levenstein distance between two strings if it is not larger than
+ * `max_dist`, otherwise returns `max_dist + 1` and can stop earlier
+ */
+gint rspamd_strings_levenshtein_distance_bounded (const gchar *s1, gsize s1len,
+		const gchar *s2, gsize s2len, guint replace_cost, guint max_dist);
+
 /**
  * Fold header using rfc822 rules, return new GString from the previous one
  * @param name name of header (used just for folding)
@@ -0,0 +1,375 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "tld_trie.h"
+#include "str_util.h"
+
+#define TLD_NODE_TERMINAL (1 << 0)
+/* Any label below this node is a public suffix */
+#define TLD_NODE_WILDCARD (1 << 1)
+/* Separates reversed labels in rules keys, sorts before any label char */
+#define TLD_KEY_SEP '\001'
+
+struct rspamd_tld_node {
+	guint32 label;
+	guint16 label_len;
+	guint16 flags;
+	guint32 children;
+	guint32 nchildren;
+};
+
+struct rspamd_tld_rule {
+	gchar *key; /* reversed labels, e.g. uk\001co */
+	gint flags;
+};
+
+struct rspamd_tld_trie {
+	GArray *nodes;
+	GString *labels;
+	GArray *rules; /* struct rspamd_tld_rule, freed after compilation */
+};
+
+struct rspamd_tld_trie *
+rspamd_tld_trie_new (void)
+{
+	struct rspamd_tld_trie *trie;
+
+	trie = g_slice_alloc0 (sizeof (*trie));
+	trie->nodes = g_array_new (FALSE, TRUE, sizeof (struct rspamd_tld_node));
+	trie->labels = g_string_new (NULL);
+	trie->rules = g_array_new (FALSE, FALSE, sizeof (struct rspamd_tld_rule));
+
+	return trie;
+}
+
+gboolean
+rspamd_tld_trie_add (struct rspamd_tld_trie *trie, const gchar *rule,
+		gsize len)
+{
+	struct rspamd_tld_rule r;
+	const gchar *p, *s, *end;
+	gchar *d;
+
+	g_assert (trie->rules != NULL);
+
+	r.flags = TLD_NODE_TERMINAL;
+
+	if (len > 2 && rule[0] == '*' && rule[1] == '.') {
+		r.flags = TLD_NODE_WILDCARD;
+		rule += 2;
+		len -= 2;
+	}
+
+	if (len == 0 || rule[0] == '.' || rule[len - 1] == '.' ||
+			memchr (rule, '*', len) != NULL || memchr (rule, '!', len) != NULL ||
+			rspamd_substring_search (rule, len, "..", 2) != -1) {
+		return FALSE;
+	}
+
+	r.key = g_malloc (len + 1);
+	d = r.key;
+	end = rule + len;
+
+	/* Write labels in reversed order */
+	while (end > rule) {
+		p = end;
+
+		while (p > rule && *(p - 1) != '.') {
+			p --;
+		}
+
+		if (d != r.key) {
+			*d++ = TLD_KEY_SEP;
+		}
+
+		for (s = p; s < end; s ++) {
+			*d++ = g_ascii_tolower (*s);
+		}
+
+		end = (p > rule) ? p - 1 : rule;
+	}
+
+	*d = '\0';
+	g_array_append_val (trie->rules, r);
+
+	return TRUE;
+}
+
+static gint
+rspamd_tld_rule_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_tld_rule *r1 = a, *r2 = b;
+
+	return strcmp (r1->key, r2->key);
+}
+
+static inline gsize
+rspamd_tld_key_label_len (const gchar *key)
+{
+	const gchar *p = key;
+
+	while (*p && *p != TLD_KEY_SEP) {
+		p ++;
+	}
+
+	return p - key;
+}
+
+/*
+ * Fill node `idx` from rules [lo, hi) that share first `off` bytes of keys
+ */
+static void
+rspamd_tld_trie_build_node (struct rspamd_tld_trie *trie, guint idx,
+		guint lo, guint hi, gsize off)
+{
+	struct rspamd_tld_rule *r;
+	struct rspamd_tld_node *node, *child;
+	guint i, j, nchildren = 0, first;
+	gsize llen, start;
+	gint flags = 0;
+
+	/* Rules that end exactly at this node sort first */
+	for (i = lo; i < hi; i ++) {
+		r = &g_array_index (trie->rules, struct rspamd_tld_rule, i);
+
+		if (r->key[off] != '\0') {
+			break;
+		}
+
+		flags |= r->flags;
+	}
+
+	lo = i;
+	start = (idx == 0) ? off : off + 1;
+
+	/* Count distinct labels */
+	for (i = lo; i < hi; i = j) {
+		r = &g_array_index (trie->rules, struct rspamd_tld_rule, i);
+		llen = rspamd_tld_key_label_len (r->key + start);
+
+		for (j = i + 1; j < hi; j ++) {
+			struct rspamd_tld_rule *nr = &g_array_index (trie->rules,
+					struct rspamd_tld_rule, j);
+
+			if (strncmp (nr->key + start, r->key + start, llen) != 0 ||
+					(nr->key[start + llen] != '\0' &&
+					nr->key[start + llen] != TLD_KEY_SEP)) {
+				break;
+			}
+		}
+
+		nchildren ++;
+	}
+
+	first = trie->nodes->len;
+	g_array_set_size (trie->nodes, first + nchildren);
+	node = &g_array_index (trie->nodes, struct rspamd_tld_node, idx);
+	node->flags |= flags;
+	node->children = first;
+	node->nchildren = nchildren;
+
+	for (i = lo, nchildren = 0; i < hi; i = j, nchildren ++) {
+		r = &g_array_index (trie->rules, struct rspamd_tld_rule, i);
+		llen = rspamd_tld_key_label_len (r->key + start);
+
+		for (j = i + 1; j < hi; j ++) {
+			struct rspamd_tld_rule *nr = &g_array_index (trie->rules,
+					struct rspamd_tld_rule, j);
+
+			if (strncmp (nr->key + start, r->key + start, llen) != 0 ||
+					(nr->key[start + llen] != '\0' &&
+					nr->key[start + llen] != TLD_KEY_SEP)) {
+				break;
+			}
+		}
+
+		child = &g_array_index (trie->nodes, struct rspamd_tld_node,
+				first + nchildren);
+		child->label = trie->labels->len;
+		child->label_len = llen;
+		g_string_append_len (trie->labels, r->key + start, llen);
+
+		rspamd_tld_trie_build_node (trie, first + nchildren, i, j,
+				start + llen);
+	}
+}
+
+void
+rspamd_tld_trie_compile (struct rspamd_tld_trie *trie)
+{
+	guint i;
+
+	g_assert (trie->rules != NULL);
+
+	g_array_sort (trie->rules, rspamd_tld_rule_cmp);
+	/* Root node */
+	g_array_set_size (trie->nodes, 1);
+	rspamd_tld_trie_build_node (trie, 0, 0, trie->rules->len, 0);
+
+	for (i = 0; i < trie->rules->len; i ++) {
+		g_free (g_array_index (trie->rules, struct rspamd_tld_rule, i).key);
+	}
+
+	g_array_free (trie->rules, TRUE);
+	trie->rules = NULL;
+}
+
+static gint
+rspamd_tld_label_cmp (const gchar *s, gsize slen, const gchar *label,
+		gsize llen)
+{
+	gsize i, min = MIN (slen, llen);
+	guchar c1, c2;
+
+	for (i = 0; i < min; i ++) {
+		c1 = g_ascii_tolower (s[i]);
+		c2 = label[i];
+
+		if (c1 != c2) {
+			return c1 < c2 ? -1 : 1;
+		}
+	}
+
+	if (slen == llen) {
+		return 0;
+	}
+
+	return slen < llen ? -1 : 1;
+}
+
+static struct rspamd_tld_node *
+rspamd_tld_trie_find_child (struct rspamd_tld_trie *trie,
+		struct rspamd_tld_node *node, const gchar *s, gsize len)
+{
+	struct rspamd_tld_node *child;
+	guint lo = 0, hi = node->nchildren, mid;
+	gint r;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		child = &g_array_index (trie->nodes, struct rspamd_tld_node,
+				node->children + mid);
+		r = rspamd_tld_label_cmp (s, len, trie->labels->str + child->label,
+				child->label_len);
+
+		if (r == 0) {
+			return child;
+		}
+		else if (r < 0) {
+			hi = mid;
+		}
+		else {
+			lo = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+gboolean
+rspamd_tld_trie_lookup (struct rspamd_tld_trie *trie,
+		const gchar *host, gsize len, rspamd_ftok_t *out)
+{
+	struct rspamd_tld_node *node;
+	const gchar *end = host + len, *lstart, *lend, *suffix = NULL, *p;
+
+	g_assert (trie->rules == NULL);
+
+	if (len == 0 || trie->nodes->len == 0) {
+		return FALSE;
+	}
+
+	node = &g_array_index (trie->nodes, struct rspamd_tld_node, 0);
+	lend = end;
+
+	/* Walk labels from the right and remember the longest proper suffix */
+	while (lend > host) {
+		lstart = lend;
+
+		while (lstart > host && *(lstart - 1) != '.') {
+			lstart --;
+		}
+
+		if (lstart == host) {
+			/* Host itself cannot be a public suffix for itself */
+			break;
+		}
+
+		if (node->flags & TLD_NODE_WILDCARD) {
+			suffix = lstart;
+		}
+
+		node = rspamd_tld_trie_find_child (trie, node, lstart, lend - lstart);
+
+		if (node == NULL) {
+			break;
+		}
+
+		if (node->flags & TLD_NODE_TERMINAL) {
+			suffix = lstart;
+		}
+
+		lend = lstart - 1;
+	}
+
+	if (suffix == NULL) {
+		return FALSE;
+	}
+
+	/* Add one more label */
+	p = suffix - 1;
+
+	while (p > host && *(p - 1) != '.') {
+		p --;
+	}
+
+	if (p == suffix - 1) {
+		/* Empty label */
+		return FALSE;
+	}
+
+	out->begin = p;
+	out->len = end - p;
+
+	return TRUE;
+}
+
+gsize
+rspamd_tld_trie_size (struct rspamd_tld_trie *trie)
+{
+	return trie->nodes->len;
+}
+
+void
+rspamd_tld_trie_destroy (struct rspamd_tld_trie *trie)
+{
+	guint i;
+
+	if (trie) {
+		if (trie->rules) {
+			for (i = 0; i < trie->rules->len; i ++) {
+				g_free (g_array_index (trie->rules,
+						struct rspamd_tld_rule, i).key);
+			}
+
+			g_array_free (trie->rules, TRUE);
+		}
+
+		g_array_free (trie->nodes, TRUE);
+		g_string_free (trie->labels, TRUE);
+		g_slice_free1 (sizeof (*trie), trie);
+	}
+}
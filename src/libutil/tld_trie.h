@@ -0,0 +1,66 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBUTIL_TLD_TRIE_H_
+#define SRC_LIBUTIL_TLD_TRIE_H_
+
+#include "config.h"
+#include "fstring.h"
+
+/*
+ * Trie of public suffixes keyed by reversed domain labels, all nodes are
+ * stored in a single flat array with children of each node kept sorted
+ */
+struct rspamd_tld_trie;
+
+/**
+ * Create empty trie
+ */
+struct rspamd_tld_trie *rspamd_tld_trie_new (void);
+
+/**
+ * Add public suffix rule, e.g. `co.uk` or `*.ck`
+ * @param trie
+ * @param rule
+ * @return FALSE if rule is not supported
+ */
+gboolean rspamd_tld_trie_add (struct rspamd_tld_trie *trie,
+		const gchar *rule, gsize len);
+
+/**
+ * Build lookup structure, no rules could be added after this call
+ * @param trie
+ */
+void rspamd_tld_trie_compile (struct rspamd_tld_trie *trie);
+
+/**
+ * Find registered domain (public suffix plus one label) for a hostname
+ * @param trie
+ * @param host hostname (compared case insensitively for ascii)
+ * @param len length of hostname
+ * @param out registered domain inside of `host`
+ * @return TRUE if a public suffix has been found
+ */
+gboolean rspamd_tld_trie_lookup (struct rspamd_tld_trie *trie,
+		const gchar *host, gsize len, rspamd_ftok_t *out);
+
+/**
+ * Returns number of nodes in the trie
+ */
+gsize rspamd_tld_trie_size (struct rspamd_tld_trie *trie);
+
+void rspamd_tld_trie_destroy (struct rspamd_tld_trie *trie);
+
+#endif /* SRC_LIBUTIL_TLD_TRIE_H_ */
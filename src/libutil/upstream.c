@@ -21,6 +21,7 @@
 #include "rdns.h"
 #include "cryptobox.h"
 #include "utlist.h"
+#include "histogram.h"
 
 struct upstream_inet_addr_entry {
 	rspamd_inet_addr_t *addr;
@@ -55,13 +56,23 @@ struct upstream {
 	struct upstream_inet_addr_entry *new_addrs;
 	rspamd_mutex_t *lock;
 	gpointer data;
+	/* Shared between processes if an upstream is created before fork */
+	struct rspamd_histogram *latency;
+	gboolean own_latency;
+	gdouble ewma_latency;	/* local to a process, 0 if unknown */
 	ref_entry_t ref;
 };
 
+struct upstream_ring_point {
+	guint64 hash;
+	struct upstream *up;
+};
+
 struct upstream_list {
 	struct upstream_ctx *ctx;
 	GPtrArray *ups;
 	GPtrArray *alive;
+	GArray *ring; /* struct upstream_ring_point, built on the first use */
 	rspamd_mutex_t *lock;
 	guint64 hash_seed;
 	guint cur_elt;
@@ -78,6 +89,7 @@ struct upstream_ctx {
 	gdouble error_time;
 	gdouble dns_timeout;
 	guint dns_retransmits;
+	guint virtual_nodes;
 	GQueue *upstreams;
 	gboolean configured;
 	rspamd_mempool_t *pool;
@@ -99,6 +111,8 @@ static gdouble default_revive_jitter = 0.4;
 static gdouble default_error_time = 10;
 static gdouble default_dns_timeout = 1.0;
 static guint default_dns_retransmits = 2;
+/* Weight of the last request in the upstream latency moving average */
+#define UPSTREAM_LATENCY_EWMA_ALPHA 0.2
 
 void
 rspamd_upstreams_library_config (struct rspamd_config *cfg,
@@ -123,6 +137,8 @@ rspamd_upstreams_library_config (struct rspamd_config *cfg,
 	if (cfg->dns_timeout) {
 		ctx->dns_timeout = cfg->dns_timeout;
 	}
+	/* Zero is the default and disables hash ring */
+	ctx->virtual_nodes = cfg->upstream_virtual_nodes;
 
 	ctx->ev_base = ev_base;
 	ctx->res = resolver;
@@ -458,6 +474,81 @@ rspamd_upstream_ok (struct upstream *up)
 	RSPAMD_UPSTREAM_UNLOCK (up->lock);
 }
 
+void
+rspamd_upstream_latency (struct upstream *up, gdouble seconds)
+{
+	if (seconds < 0) {
+		return;
+	}
+
+	if (up->latency) {
+		rspamd_histogram_add (up->latency, seconds);
+	}
+
+	if (up->ewma_latency == 0) {
+		up->ewma_latency = seconds;
+	}
+	else {
+		up->ewma_latency = UPSTREAM_LATENCY_EWMA_ALPHA * seconds +
+				(1.0 - UPSTREAM_LATENCY_EWMA_ALPHA) * up->ewma_latency;
+	}
+}
+
+gdouble
+rspamd_upstream_latency_quantile (struct upstream *up, gdouble q)
+{
+	if (up->latency) {
+		return rspamd_histogram_quantile (up->latency, q);
+	}
+
+	return 0;
+}
+
+void
+rspamd_upstreams_foreach_latency (struct upstream_ctx *ctx,
+		rspamd_upstream_latency_cb cb, gpointer ud)
+{
+	struct upstream *up;
+	GList *cur;
+
+	cur = ctx->upstreams->head;
+
+	while (cur) {
+		up = cur->data;
+
+		if (up->own_latency) {
+			cb (up->name, up->latency, ud);
+		}
+
+		cur = g_list_next (cur);
+	}
+}
+
+static void
+rspamd_upstream_init_latency (struct upstream_ctx *ctx, struct upstream *up)
+{
+	struct upstream *other;
+	GList *cur;
+
+	cur = ctx->upstreams->head;
+
+	while (cur) {
+		other = cur->data;
+
+		if (other->own_latency && strcmp (other->name, up->name) == 0) {
+			up->latency = other->latency;
+
+			return;
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	up->latency = rspamd_mempool_alloc0_shared (ctx->pool,
+			sizeof (*up->latency));
+	up->own_latency = TRUE;
+}
+
 #define SEED_CONSTANT 0xa574de7df64e9b9dULL
 
 struct upstream_list*
@@ -489,6 +580,28 @@ rspamd_upstreams_alive (struct upstream_list *ups)
 	return ups != NULL ? ups->alive->len : 0;
 }
 
+/* Histogram is kept in the pool, so other upstreams can still export it */
+static void
+rspamd_upstream_pass_latency (struct upstream_ctx *ctx, struct upstream *up)
+{
+	struct upstream *other;
+	GList *cur;
+
+	cur = ctx->upstreams->head;
+
+	while (cur) {
+		other = cur->data;
+
+		if (other->latency == up->latency) {
+			other->own_latency = TRUE;
+
+			return;
+		}
+
+		cur = g_list_next (cur);
+	}
+}
+
 static void
 rspamd_upstream_dtor (struct upstream *up)
 {
@@ -510,6 +623,11 @@ rspamd_upstream_dtor (struct upstream *up)
 
 	if (up->ctx) {
 		g_queue_delete_link (up->ctx->upstreams, up->ctx_pos);
+
+		if (up->own_latency) {
+			rspamd_upstream_pass_latency (up->ctx, up);
+		}
+
 		REF_RELEASE (up->ctx);
 	}
 
@@ -573,6 +691,13 @@ rspamd_upstreams_add_upstream (struct upstream_list *ups,
 	}
 
 	g_ptr_array_add (ups->ups, up);
+
+	if (ups->ring) {
+		/* Rebuild ring on the next hashed lookup */
+		g_array_free (ups->ring, TRUE);
+		ups->ring = NULL;
+	}
+
 	up->ud = data;
 	up->cur_weight = up->weight;
 	up->ls = ups;
@@ -580,6 +705,7 @@ rspamd_upstreams_add_upstream (struct upstream_list *ups,
 	up->lock = rspamd_mutex_new ();
 	up->ctx = ups->ctx;
 	REF_RETAIN (ups->ctx);
+	rspamd_upstream_init_latency (ups->ctx, up);
 	g_queue_push_tail (ups->ctx->upstreams, up);
 	up->ctx_pos = g_queue_peek_tail_link (ups->ctx->upstreams);
 	g_ptr_array_sort (up->addrs.addr, rspamd_upstream_addr_sort_func);
@@ -653,6 +779,12 @@ rspamd_upstreams_parse_line (struct upstream_list *ups,
 		ups->rot_alg = RSPAMD_UPSTREAM_SEQUENTIAL;
 		p += sizeof ("sequential:") - 1;
 	}
+	else if (g_ascii_strncasecmp (p,
+			"latency:",
+			sizeof ("latency:") - 1) == 0) {
+		ups->rot_alg = RSPAMD_UPSTREAM_LATENCY;
+		p += sizeof ("latency:") - 1;
+	}
 
 	while (p < end) {
 		len = strcspn (p, separators);
@@ -714,6 +846,11 @@ rspamd_upstreams_destroy (struct upstream_list *ups)
 		}
 
 		g_ptr_array_free (ups->ups, TRUE);
+
+		if (ups->ring) {
+			g_array_free (ups->ring, TRUE);
+		}
+
 		rspamd_mutex_free (ups->lock);
 		g_slice_free1 (sizeof (*ups), ups);
 	}
@@ -746,6 +883,37 @@ rspamd_upstream_get_random (struct upstream_list *ups)
 	return g_ptr_array_index (ups->alive, idx);
 }
 
+/*
+ * Power of two choices: select two random upstreams and use the one with
+ * lower latency, upstreams without latency recorded are preferred to be probed
+ */
+static struct upstream*
+rspamd_upstream_get_latency (struct upstream_list *ups)
+{
+	struct upstream *u1, *u2;
+	guint i1, i2;
+	gdouble l1, l2;
+
+	if (ups->alive->len == 1) {
+		return g_ptr_array_index (ups->alive, 0);
+	}
+
+	i1 = ottery_rand_range (ups->alive->len - 1);
+	i2 = ottery_rand_range (ups->alive->len - 2);
+
+	if (i2 >= i1) {
+		i2 ++;
+	}
+
+	u1 = g_ptr_array_index (ups->alive, i1);
+	u2 = g_ptr_array_index (ups->alive, i2);
+	/* Penalise upstreams with recent errors */
+	l1 = u1->ewma_latency * (u1->errors + 1);
+	l2 = u2->ewma_latency * (u2->errors + 1);
+
+	return l2 < l1 ? u2 : u1;
+}
+
 static struct upstream*
 rspamd_upstream_get_round_robin (struct upstream_list *ups, gboolean use_cur)
 {
@@ -824,9 +992,101 @@ rspamd_consistent_hash (guint64 key, guint32 nbuckets)
 	return b;
 }
 
+static gint
+rspamd_upstream_ring_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct upstream_ring_point *p1 = a, *p2 = b;
+
+	if (p1->hash < p2->hash) {
+		return -1;
+	}
+	else if (p1->hash > p2->hash) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Ketama like ring: each upstream owns `virtual_nodes * weight` points placed
+ * by hashing its name, so only keys of a failed or added upstream move
+ */
+static void
+rspamd_upstream_build_ring (struct upstream_list *ups)
+{
+	struct upstream_ring_point pt;
+	struct upstream *up;
+	gchar buf[256];
+	guint i, j, npoints;
+	gint r;
+
+	ups->ring = g_array_new (FALSE, FALSE, sizeof (pt));
+
+	for (i = 0; i < ups->ups->len; i ++) {
+		up = g_ptr_array_index (ups->ups, i);
+		npoints = ups->ctx->virtual_nodes * MAX (up->weight, 1);
+
+		for (j = 0; j < npoints; j ++) {
+			r = rspamd_snprintf (buf, sizeof (buf), "%s-%ud", up->name, j);
+			pt.hash = rspamd_cryptobox_fast_hash_specific (
+					RSPAMD_CRYPTOBOX_XXHASH64, buf, r, ups->hash_seed);
+			pt.up = up;
+			g_array_append_val (ups->ring, pt);
+		}
+	}
+
+	g_array_sort (ups->ring, rspamd_upstream_ring_cmp);
+}
+
+static struct upstream*
+rspamd_upstream_get_ring (struct upstream_list *ups, guint64 k)
+{
+	struct upstream_ring_point *pt;
+	struct upstream *selected = NULL;
+	guint lo, hi, mid, i;
+
+	if (ups->ring == NULL) {
+		rspamd_upstream_build_ring (ups);
+	}
+
+	if (ups->ring->len == 0) {
+		return NULL;
+	}
+
+	/* Find the first point that is not less than the key */
+	lo = 0;
+	hi = ups->ring->len;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		pt = &g_array_index (ups->ring, struct upstream_ring_point, mid);
+
+		if (pt->hash < k) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	/* Walk clockwise skipping dead upstreams */
+	for (i = 0; i < ups->ring->len; i ++) {
+		pt = &g_array_index (ups->ring, struct upstream_ring_point,
+				(lo + i) % ups->ring->len);
+
+		if (pt->up->active_idx != -1) {
+			selected = pt->up;
+			break;
+		}
+	}
+
+	return selected;
+}
+
 static struct upstream*
 rspamd_upstream_get_hashed (struct upstream_list *ups, const guint8 *key, guint keylen)
 {
+	struct upstream *up;
 	guint64 k;
 	guint32 idx;
 
@@ -835,6 +1095,17 @@ rspamd_upstream_get_hashed (struct upstream_list *ups, const guint8 *key, guint
 			key, keylen, ups->hash_seed);
 
 	RSPAMD_UPSTREAM_LOCK (ups->lock);
+
+	if (ups->ctx->virtual_nodes > 0) {
+		up = rspamd_upstream_get_ring (ups, k);
+
+		if (up != NULL) {
+			RSPAMD_UPSTREAM_UNLOCK (ups->lock);
+
+			return up;
+		}
+	}
+
 	idx = rspamd_consistent_hash (k, ups->alive->len);
 	RSPAMD_UPSTREAM_UNLOCK (ups->lock);
 
@@ -882,6 +1153,9 @@ rspamd_upstream_get_common (struct upstream_list *ups,
 	case RSPAMD_UPSTREAM_MASTER_SLAVE:
 		up = rspamd_upstream_get_round_robin (ups, FALSE);
 		break;
+	case RSPAMD_UPSTREAM_LATENCY:
+		up = rspamd_upstream_get_latency (ups);
+		break;
 	case RSPAMD_UPSTREAM_SEQUENTIAL:
 		if (ups->cur_elt >= ups->alive->len) {
 			ups->cur_elt = 0;
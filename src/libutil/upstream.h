@@ -12,6 +12,7 @@ enum rspamd_upstream_rotation {
 	RSPAMD_UPSTREAM_ROUND_ROBIN,
 	RSPAMD_UPSTREAM_MASTER_SLAVE,
 	RSPAMD_UPSTREAM_SEQUENTIAL,
+	RSPAMD_UPSTREAM_LATENCY,
 	RSPAMD_UPSTREAM_UNDEF
 };
 
@@ -24,6 +25,7 @@ struct rspamd_config;
 struct upstream;
 struct upstream_list;
 struct upstream_ctx;
+struct rspamd_histogram;
 
 /**
  * Init upstreams library
@@ -62,6 +64,33 @@ void rspamd_upstream_fail (struct upstream *up);
  */
 void rspamd_upstream_ok (struct upstream *up);
 
+/**
+ * Record latency of a successful request to an upstream, it is used by
+ * `RSPAMD_UPSTREAM_LATENCY` rotation to prefer faster upstreams
+ * @param up
+ * @param seconds time spent in request
+ */
+void rspamd_upstream_latency (struct upstream *up, gdouble seconds);
+
+/**
+ * Returns the quantile `q` of latencies recorded for an upstream or 0 if
+ * nothing is known yet
+ */
+gdouble rspamd_upstream_latency_quantile (struct upstream *up, gdouble q);
+
+typedef void (*rspamd_upstream_latency_cb) (const gchar *name,
+		const struct rspamd_histogram *h, gpointer ud);
+
+/**
+ * Call function for latency histograms of all upstreams, upstreams with the
+ * same name in different lists share one histogram
+ * @param ctx
+ * @param cb
+ * @param ud
+ */
+void rspamd_upstreams_foreach_latency (struct upstream_ctx *ctx,
+		rspamd_upstream_latency_cb cb, gpointer ud);
+
 /**
  * Create new list of upstreams
  * @return
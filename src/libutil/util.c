@@ -2417,6 +2417,80 @@ event_get_base (struct event *ev)
 }
 #endif
 
+#define RSPAMD_COMMON_TIMEOUTS_MAX 64
+#define RSPAMD_COMMON_TIMEOUT_RESOLUTION 10
+
+static struct event_base *common_timeouts_base = NULL;
+static GHashTable *common_timeouts = NULL;
+
+const struct timeval *
+rspamd_event_common_tv (struct event_base *base, const struct timeval *tv)
+{
+#if defined(LIBEVENT_VERSION_NUMBER) && LIBEVENT_VERSION_NUMBER >= 0x02000000UL
+	const struct timeval *ct;
+	struct timeval rounded;
+	guint64 ms;
+
+	if (base == NULL || tv == NULL) {
+		return tv;
+	}
+
+	if (common_timeouts_base != base) {
+		if (common_timeouts_base != NULL) {
+			/* We do not mix common timeouts of different bases */
+			return tv;
+		}
+
+		common_timeouts_base = base;
+	}
+
+	ms = (guint64)tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+	ms = ((ms + RSPAMD_COMMON_TIMEOUT_RESOLUTION - 1) /
+			RSPAMD_COMMON_TIMEOUT_RESOLUTION) * RSPAMD_COMMON_TIMEOUT_RESOLUTION;
+
+	if (ms == 0) {
+		return tv;
+	}
+
+	if (common_timeouts == NULL) {
+		common_timeouts = g_hash_table_new (g_direct_hash, g_direct_equal);
+	}
+
+	ct = g_hash_table_lookup (common_timeouts, GSIZE_TO_POINTER (ms));
+
+	if (ct == NULL) {
+		if (g_hash_table_size (common_timeouts) >= RSPAMD_COMMON_TIMEOUTS_MAX) {
+			return tv;
+		}
+
+		rounded.tv_sec = ms / 1000;
+		rounded.tv_usec = (ms % 1000) * 1000;
+		ct = event_base_init_common_timeout (base, &rounded);
+
+		if (ct == NULL) {
+			return tv;
+		}
+
+		g_hash_table_insert (common_timeouts, GSIZE_TO_POINTER (ms),
+				(gpointer)ct);
+	}
+
+	return ct;
+#else
+	return tv;
+#endif
+}
+
+void
+rspamd_event_common_tv_reset (void)
+{
+	if (common_timeouts) {
+		g_hash_table_remove_all (common_timeouts);
+	}
+
+	common_timeouts_base = NULL;
+}
+
 int
 rspamd_file_xopen (const char *fname, int oflags, guint mode)
 {
@@ -466,6 +466,25 @@ gboolean rspamd_constant_memcmp (const guchar *a, const guchar *b, gsize len);
 #if !defined(LIBEVENT_VERSION_NUMBER) || LIBEVENT_VERSION_NUMBER < 0x02000000UL
 struct event_base * event_get_base (struct event *ev);
 #endif
+
+/**
+ * Returns timeval suitable to be passed to `event_add` for events in the
+ * specified base. Timeouts are rounded up to 10 milliseconds and registered
+ * as libevent common timeouts, so events with equal durations are kept in
+ * a list with O(1) add and remove instead of the timers heap. If the
+ * timeout cannot be made common, `tv` itself is returned.
+ * @param base event base of the event
+ * @param tv timeout requested
+ * @return timeval to be used in `event_add`
+ */
+const struct timeval * rspamd_event_common_tv (struct event_base *base,
+		const struct timeval *tv);
+
+/**
+ * Forgets all common timeouts registered, must be called when the event base
+ * used is destroyed
+ */
+void rspamd_event_common_tv_reset (void);
 /* CentOS libevent */
 #ifndef evsignal_set
 #define evsignal_set(ev, x, cb, arg)    \
@@ -36,7 +36,7 @@ worker_t log_helper_worker = {
 		"log_helper",                /* Name */
 		init_log_helper,             /* Init function */
 		start_log_helper,            /* Start function */
-		RSPAMD_WORKER_UNIQUE | RSPAMD_WORKER_KILLABLE,
+		RSPAMD_WORKER_UNIQUE | RSPAMD_WORKER_KILLABLE | RSPAMD_WORKER_LOW_PRIORITY,
 		RSPAMD_WORKER_SOCKET_NONE,   /* No socket */
 		RSPAMD_WORKER_VER            /* Version info */
 };
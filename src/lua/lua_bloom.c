@@ -0,0 +1,339 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/***
+ * @module rspamd_bloom
+ * This module provides blocked bloom filters that could be used as a cheap
+ * pre-check in front of large maps or remote lookups. Filters could be saved
+ * to files and mapped read-only by all workers.
+ * @example
+local rspamd_bloom = require "rspamd_bloom"
+local bf = rspamd_bloom.create(100000, 0.01)
+bf:add('example.com')
+bf:save('/var/lib/rspamd/domains.bloom')
+local ro = rspamd_bloom.load('/var/lib/rspamd/domains.bloom')
+if ro:check('example.com') then
+	-- perform the real lookup
+end
+ */
+
+#include "lua_common.h"
+#include "bloom.h"
+
+LUA_FUNCTION_DEF (bloom, create);
+LUA_FUNCTION_DEF (bloom, load);
+LUA_FUNCTION_DEF (bloom, from_string);
+LUA_FUNCTION_DEF (bloom, add);
+LUA_FUNCTION_DEF (bloom, check);
+LUA_FUNCTION_DEF (bloom, save);
+LUA_FUNCTION_DEF (bloom, count);
+LUA_FUNCTION_DEF (bloom, size);
+LUA_FUNCTION_DEF (bloom, gc);
+
+static const struct luaL_reg bloomlib_m[] = {
+	LUA_INTERFACE_DEF (bloom, add),
+	LUA_INTERFACE_DEF (bloom, check),
+	LUA_INTERFACE_DEF (bloom, save),
+	LUA_INTERFACE_DEF (bloom, count),
+	LUA_INTERFACE_DEF (bloom, size),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_bloom_gc},
+	{NULL, NULL}
+};
+static const struct luaL_reg bloomlib_f[] = {
+	LUA_INTERFACE_DEF (bloom, create),
+	LUA_INTERFACE_DEF (bloom, load),
+	LUA_INTERFACE_DEF (bloom, from_string),
+	{NULL, NULL}
+};
+
+static struct rspamd_bloom_blocked *
+lua_check_bloom (lua_State * L)
+{
+	void *ud = rspamd_lua_check_udata (L, 1, "rspamd{bloom}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'bloom' expected");
+	return ud ? *((struct rspamd_bloom_blocked **)ud) : NULL;
+}
+
+static void
+lua_bloom_push (lua_State *L, struct rspamd_bloom_blocked *bb)
+{
+	struct rspamd_bloom_blocked **pbb;
+
+	pbb = lua_newuserdata (L, sizeof (*pbb));
+	rspamd_lua_setclass (L, "rspamd{bloom}", -1);
+	*pbb = bb;
+}
+
+/***
+ * @function rspamd_bloom.create(nelts[, fp_rate])
+ * Creates new empty filter
+ * @param {number} nelts expected number of elements
+ * @param {number} fp_rate desired false positive rate (0.01 by default)
+ * @return {bloom} new filter
+ */
+static gint
+lua_bloom_create (lua_State *L)
+{
+	gsize nelts;
+	gdouble fp_rate = 0.01;
+
+	nelts = luaL_checknumber (L, 1);
+
+	if (lua_isnumber (L, 2)) {
+		fp_rate = lua_tonumber (L, 2);
+	}
+
+	lua_bloom_push (L, rspamd_bloom_blocked_new (nelts, fp_rate));
+
+	return 1;
+}
+
+/***
+ * @function rspamd_bloom.load(path)
+ * Maps filter file read-only, so it is shared by all processes that load it
+ * @param {string} path file written by `bloom:save`
+ * @return {bloom} filter or nil and error message
+ */
+static gint
+lua_bloom_load (lua_State *L)
+{
+	const gchar *path = luaL_checkstring (L, 1);
+	struct rspamd_bloom_blocked *bb;
+	GError *err = NULL;
+
+	bb = rspamd_bloom_blocked_open (path, &err);
+
+	if (bb == NULL) {
+		lua_pushnil (L);
+		lua_pushstring (L, err ? err->message : "unknown error");
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		return 2;
+	}
+
+	lua_bloom_push (L, bb);
+
+	return 1;
+}
+
+/***
+ * @function rspamd_bloom.from_string(data)
+ * Loads filter from a string (e.g. received via HTTP)
+ * @param {string} data filter image
+ * @return {bloom} filter or nil and error message
+ */
+static gint
+lua_bloom_from_string (lua_State *L)
+{
+	struct rspamd_bloom_blocked *bb;
+	const gchar *data;
+	GError *err = NULL;
+	gsize len;
+
+	data = luaL_checklstring (L, 1, &len);
+	bb = rspamd_bloom_blocked_from_memory (data, len, &err);
+
+	if (bb == NULL) {
+		lua_pushnil (L);
+		lua_pushstring (L, err ? err->message : "unknown error");
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		return 2;
+	}
+
+	lua_bloom_push (L, bb);
+
+	return 1;
+}
+
+/***
+ * @method bloom:add(str)
+ * Adds a string or an array of strings to a filter
+ * @param {string|table} str element(s) to add
+ * @return {boolean} false if filter is mapped read-only
+ */
+static gint
+lua_bloom_add (lua_State *L)
+{
+	struct rspamd_bloom_blocked *bb = lua_check_bloom (L);
+	const gchar *data;
+	gboolean ret = TRUE;
+	gsize len;
+
+	if (bb == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_type (L, 2) == LUA_TTABLE) {
+		for (lua_pushnil (L); lua_next (L, 2); lua_pop (L, 1)) {
+			data = lua_tolstring (L, -1, &len);
+
+			if (data) {
+				ret = rspamd_bloom_blocked_add (bb, data, len) && ret;
+			}
+		}
+	}
+	else {
+		data = luaL_checklstring (L, 2, &len);
+		ret = rspamd_bloom_blocked_add (bb, data, len);
+	}
+
+	lua_pushboolean (L, ret);
+
+	return 1;
+}
+
+/***
+ * @method bloom:check(str)
+ * Checks whether a string might be in a filter
+ * @param {string} str element to check
+ * @return {boolean} false if element is definitely not in a filter
+ */
+static gint
+lua_bloom_check (lua_State *L)
+{
+	struct rspamd_bloom_blocked *bb = lua_check_bloom (L);
+	const gchar *data;
+	gsize len;
+
+	data = luaL_checklstring (L, 2, &len);
+
+	if (bb == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushboolean (L, rspamd_bloom_blocked_check (bb, data, len));
+
+	return 1;
+}
+
+/***
+ * @method bloom:save(path)
+ * Writes filter to a file atomically
+ * @param {string} path target file
+ * @return {boolean} true or false and error message
+ */
+static gint
+lua_bloom_save (lua_State *L)
+{
+	struct rspamd_bloom_blocked *bb = lua_check_bloom (L);
+	const gchar *path = luaL_checkstring (L, 2);
+	GError *err = NULL;
+
+	if (bb == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (!rspamd_bloom_blocked_write (bb, path, &err)) {
+		lua_pushboolean (L, FALSE);
+		lua_pushstring (L, err ? err->message : "unknown error");
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		return 2;
+	}
+
+	lua_pushboolean (L, TRUE);
+
+	return 1;
+}
+
+/***
+ * @method bloom:count()
+ * Returns number of elements added to a filter
+ * @return {number} number of elements
+ */
+static gint
+lua_bloom_count (lua_State *L)
+{
+	struct rspamd_bloom_blocked *bb = lua_check_bloom (L);
+
+	if (bb == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushnumber (L, rspamd_bloom_blocked_count (bb));
+
+	return 1;
+}
+
+/***
+ * @method bloom:size()
+ * Returns size of filter in bytes
+ * @return {number} size of filter image
+ */
+static gint
+lua_bloom_size (lua_State *L)
+{
+	struct rspamd_bloom_blocked *bb = lua_check_bloom (L);
+
+	if (bb == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushnumber (L, rspamd_bloom_blocked_size (bb));
+
+	return 1;
+}
+
+static gint
+lua_bloom_gc (lua_State *L)
+{
+	struct rspamd_bloom_blocked *bb = lua_check_bloom (L);
+
+	if (bb) {
+		rspamd_bloom_blocked_unref (bb);
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_bloom (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, bloomlib_f);
+
+	return 1;
+}
+
+void
+luaopen_bloom (lua_State * L)
+{
+	luaL_newmetatable (L, "rspamd{bloom}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{bloom}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, bloomlib_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_bloom", lua_load_bloom);
+}
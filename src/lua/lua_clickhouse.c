@@ -0,0 +1,758 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/***
+ * @module rspamd_clickhouse
+ * This module provides buffers of rows encoded in ClickHouse `RowBinary`
+ * format. Rows are encoded when added, so flushing a buffer produces a ready
+ * to send body of an `INSERT` query, optionally compressed with gzip.
+ * @example
+local rspamd_clickhouse = require "rspamd_clickhouse"
+local block = rspamd_clickhouse.create('rspamd', {
+	{'Date', 'Date'},
+	{'From', 'String'},
+	{'IsBayes', "Enum8('ham' = 0, 'spam' = 1, 'unknown' = 2)"},
+	{'Urls.Tld', 'Array(String)'},
+})
+block:add_row({os.time(), 'example.com', 'spam', {'com', 'net'}})
+local body = block:flush(true) -- gzip compressed
+ */
+
+#include "lua_common.h"
+#include <zlib.h>
+
+enum lua_ch_type_id {
+	LUA_CH_UINT8 = 0,
+	LUA_CH_UINT16,
+	LUA_CH_UINT32,
+	LUA_CH_UINT64,
+	LUA_CH_INT8,
+	LUA_CH_INT16,
+	LUA_CH_INT32,
+	LUA_CH_INT64,
+	LUA_CH_FLOAT32,
+	LUA_CH_FLOAT64,
+	LUA_CH_DATE,
+	LUA_CH_DATETIME,
+	LUA_CH_STRING,
+	LUA_CH_FIXEDSTRING,
+	LUA_CH_ENUM8,
+	LUA_CH_ARRAY,
+};
+
+struct lua_ch_type {
+	enum lua_ch_type_id id;
+	guint len;					/**< length of FixedString				*/
+	GHashTable *enum_values;	/**< names of Enum8 values				*/
+	struct lua_ch_type *nested;	/**< type of Array elements				*/
+};
+
+struct lua_ch_column {
+	gchar *name;
+	struct lua_ch_type *type;
+};
+
+struct lua_ch_block {
+	GPtrArray *columns;
+	gchar *query;
+	GByteArray *buf;
+	guint nrows;
+};
+
+static const struct {
+	const gchar *name;
+	enum lua_ch_type_id id;
+} lua_ch_simple_types[] = {
+	{"UInt8", LUA_CH_UINT8},
+	{"UInt16", LUA_CH_UINT16},
+	{"UInt32", LUA_CH_UINT32},
+	{"UInt64", LUA_CH_UINT64},
+	{"Int8", LUA_CH_INT8},
+	{"Int16", LUA_CH_INT16},
+	{"Int32", LUA_CH_INT32},
+	{"Int64", LUA_CH_INT64},
+	{"Float32", LUA_CH_FLOAT32},
+	{"Float64", LUA_CH_FLOAT64},
+	{"Date", LUA_CH_DATE},
+	{"DateTime", LUA_CH_DATETIME},
+	{"String", LUA_CH_STRING},
+};
+
+LUA_FUNCTION_DEF (clickhouse, create);
+LUA_FUNCTION_DEF (clickhouse, add_row);
+LUA_FUNCTION_DEF (clickhouse, flush);
+LUA_FUNCTION_DEF (clickhouse, rows);
+LUA_FUNCTION_DEF (clickhouse, size);
+LUA_FUNCTION_DEF (clickhouse, gc);
+
+static const struct luaL_reg clickhouselib_m[] = {
+	LUA_INTERFACE_DEF (clickhouse, add_row),
+	LUA_INTERFACE_DEF (clickhouse, flush),
+	LUA_INTERFACE_DEF (clickhouse, rows),
+	LUA_INTERFACE_DEF (clickhouse, size),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_clickhouse_gc},
+	{NULL, NULL}
+};
+static const struct luaL_reg clickhouselib_f[] = {
+	LUA_INTERFACE_DEF (clickhouse, create),
+	{NULL, NULL}
+};
+
+static struct lua_ch_block *
+lua_check_clickhouse (lua_State * L)
+{
+	void *ud = rspamd_lua_check_udata (L, 1, "rspamd{clickhouse}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'clickhouse' expected");
+	return ud ? *((struct lua_ch_block **)ud) : NULL;
+}
+
+static void
+lua_ch_type_free (struct lua_ch_type *t)
+{
+	if (t) {
+		if (t->enum_values) {
+			g_hash_table_unref (t->enum_values);
+		}
+
+		lua_ch_type_free (t->nested);
+		g_free (t);
+	}
+}
+
+static void
+lua_ch_block_free (struct lua_ch_block *block)
+{
+	struct lua_ch_column *col;
+	guint i;
+
+	for (i = 0; i < block->columns->len; i ++) {
+		col = g_ptr_array_index (block->columns, i);
+		g_free (col->name);
+		lua_ch_type_free (col->type);
+		g_free (col);
+	}
+
+	g_ptr_array_free (block->columns, TRUE);
+	g_byte_array_free (block->buf, TRUE);
+	g_free (block->query);
+	g_free (block);
+}
+
+/* Parses `'name' = value, ...` list of Enum8 values */
+static GHashTable *
+lua_ch_parse_enum (const gchar *p, const gchar *end)
+{
+	GHashTable *values;
+	const gchar *c;
+	gchar *name, *err;
+	glong val;
+
+	values = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, NULL);
+
+	while (p < end) {
+		while (p < end && (g_ascii_isspace (*p) || *p == ',')) {
+			p ++;
+		}
+
+		if (p == end) {
+			break;
+		}
+
+		if (*p != '\'') {
+			goto err;
+		}
+
+		c = memchr (p + 1, '\'', end - p - 1);
+
+		if (c == NULL) {
+			goto err;
+		}
+
+		name = g_strndup (p + 1, c - p - 1);
+		p = c + 1;
+
+		while (p < end && g_ascii_isspace (*p)) {
+			p ++;
+		}
+
+		if (p == end || *p != '=') {
+			g_free (name);
+			goto err;
+		}
+
+		val = strtol (p + 1, &err, 10);
+
+		if (err == p + 1 || err > end || val < G_MININT8 || val > G_MAXINT8) {
+			g_free (name);
+			goto err;
+		}
+
+		g_hash_table_insert (values, name, GINT_TO_POINTER (val));
+		p = err;
+	}
+
+	return values;
+
+err:
+	g_hash_table_unref (values);
+
+	return NULL;
+}
+
+static struct lua_ch_type *
+lua_ch_parse_type (const gchar *p, gsize len)
+{
+	struct lua_ch_type *t;
+	const gchar *end = p + len;
+	guint i;
+
+	while (p < end && g_ascii_isspace (*p)) {
+		p ++;
+	}
+	while (end > p && g_ascii_isspace (*(end - 1))) {
+		end --;
+	}
+
+	len = end - p;
+	t = g_malloc0 (sizeof (*t));
+
+	for (i = 0; i < G_N_ELEMENTS (lua_ch_simple_types); i ++) {
+		if (strlen (lua_ch_simple_types[i].name) == len &&
+				memcmp (lua_ch_simple_types[i].name, p, len) == 0) {
+			t->id = lua_ch_simple_types[i].id;
+
+			return t;
+		}
+	}
+
+	if (len < 2 || *(end - 1) != ')') {
+		goto err;
+	}
+
+	if (len > sizeof ("Array()") - 1 &&
+			memcmp (p, "Array(", sizeof ("Array(") - 1) == 0) {
+		t->id = LUA_CH_ARRAY;
+		t->nested = lua_ch_parse_type (p + sizeof ("Array(") - 1,
+				len - sizeof ("Array()") + 1);
+
+		if (t->nested == NULL) {
+			goto err;
+		}
+	}
+	else if (len > sizeof ("FixedString()") - 1 &&
+			memcmp (p, "FixedString(", sizeof ("FixedString(") - 1) == 0) {
+		t->id = LUA_CH_FIXEDSTRING;
+		t->len = strtoul (p + sizeof ("FixedString(") - 1, NULL, 10);
+
+		if (t->len == 0) {
+			goto err;
+		}
+	}
+	else if (len > sizeof ("Enum8()") - 1 &&
+			memcmp (p, "Enum8(", sizeof ("Enum8(") - 1) == 0) {
+		t->id = LUA_CH_ENUM8;
+		t->enum_values = lua_ch_parse_enum (p + sizeof ("Enum8(") - 1,
+				end - 1);
+
+		if (t->enum_values == NULL) {
+			goto err;
+		}
+	}
+	else {
+		goto err;
+	}
+
+	return t;
+
+err:
+	lua_ch_type_free (t);
+
+	return NULL;
+}
+
+static inline void
+lua_ch_append_le (GByteArray *buf, guint64 v, guint bytes)
+{
+	guint8 out[sizeof (guint64)];
+	guint i;
+
+	for (i = 0; i < bytes; i ++) {
+		out[i] = (v >> (i * 8)) & 0xff;
+	}
+
+	g_byte_array_append (buf, out, bytes);
+}
+
+static inline void
+lua_ch_append_varint (GByteArray *buf, guint64 v)
+{
+	guint8 c;
+
+	do {
+		c = v & 0x7f;
+		v >>= 7;
+
+		if (v) {
+			c |= 0x80;
+		}
+
+		g_byte_array_append (buf, &c, 1);
+	} while (v);
+}
+
+static const gchar *
+lua_ch_get_string (lua_State *L, gint pos, gsize *len)
+{
+	struct rspamd_lua_text *t;
+
+	if (lua_type (L, pos) == LUA_TSTRING) {
+		return lua_tolstring (L, pos, len);
+	}
+	else if (lua_type (L, pos) == LUA_TUSERDATA) {
+		t = lua_check_text (L, pos);
+
+		if (t) {
+			*len = t->len;
+
+			return t->start;
+		}
+	}
+	else if (lua_type (L, pos) == LUA_TNIL) {
+		*len = 0;
+
+		return "";
+	}
+
+	return NULL;
+}
+
+/* Encodes value at `pos` to the buffer, returns FALSE if it is invalid */
+static gboolean
+lua_ch_append_value (lua_State *L, gint pos, struct lua_ch_type *t,
+		GByteArray *buf)
+{
+	const gchar *str;
+	gsize slen, i, nelts;
+	gdouble num;
+	gfloat fnum;
+	guint64 bits;
+	guint32 fbits;
+	gpointer val;
+	gboolean ret = TRUE;
+	static const guint8 zeroes[64];
+
+	switch (t->id) {
+	case LUA_CH_STRING:
+		str = lua_ch_get_string (L, pos, &slen);
+
+		if (str == NULL) {
+			return FALSE;
+		}
+
+		lua_ch_append_varint (buf, slen);
+		g_byte_array_append (buf, (const guint8 *)str, slen);
+		break;
+	case LUA_CH_FIXEDSTRING:
+		str = lua_ch_get_string (L, pos, &slen);
+
+		if (str == NULL) {
+			return FALSE;
+		}
+
+		/* Longer strings are truncated, shorter ones are padded by zeroes */
+		slen = MIN (slen, t->len);
+		g_byte_array_append (buf, (const guint8 *)str, slen);
+
+		for (i = slen; i < t->len; i += nelts) {
+			nelts = MIN (t->len - i, sizeof (zeroes));
+			g_byte_array_append (buf, zeroes, nelts);
+		}
+		break;
+	case LUA_CH_ENUM8:
+		if (lua_type (L, pos) == LUA_TNUMBER) {
+			lua_ch_append_le (buf, (gint8)lua_tonumber (L, pos), 1);
+		}
+		else if (lua_type (L, pos) == LUA_TSTRING) {
+			if (!g_hash_table_lookup_extended (t->enum_values,
+					lua_tostring (L, pos), NULL, &val)) {
+				return FALSE;
+			}
+
+			lua_ch_append_le (buf, (gint8)GPOINTER_TO_INT (val), 1);
+		}
+		else {
+			return FALSE;
+		}
+		break;
+	case LUA_CH_ARRAY:
+		if (lua_type (L, pos) != LUA_TTABLE) {
+			return FALSE;
+		}
+
+		nelts = rspamd_lua_table_size (L, pos);
+		lua_ch_append_varint (buf, nelts);
+
+		for (i = 1; i <= nelts && ret; i ++) {
+			lua_rawgeti (L, pos, i);
+			ret = lua_ch_append_value (L, lua_gettop (L), t->nested, buf);
+			lua_pop (L, 1);
+		}
+		break;
+	default:
+		if (lua_type (L, pos) == LUA_TNUMBER) {
+			num = lua_tonumber (L, pos);
+		}
+		else if (lua_type (L, pos) == LUA_TBOOLEAN) {
+			num = lua_toboolean (L, pos);
+		}
+		else if (lua_type (L, pos) == LUA_TNIL) {
+			num = 0;
+		}
+		else {
+			return FALSE;
+		}
+
+		switch (t->id) {
+		case LUA_CH_UINT8:
+		case LUA_CH_INT8:
+			lua_ch_append_le (buf, (gint64)num, 1);
+			break;
+		case LUA_CH_UINT16:
+		case LUA_CH_INT16:
+			lua_ch_append_le (buf, (gint64)num, 2);
+			break;
+		case LUA_CH_UINT32:
+		case LUA_CH_INT32:
+		case LUA_CH_DATETIME:
+			lua_ch_append_le (buf, (gint64)num, 4);
+			break;
+		case LUA_CH_UINT64:
+			lua_ch_append_le (buf, (guint64)num, 8);
+			break;
+		case LUA_CH_INT64:
+			lua_ch_append_le (buf, (gint64)num, 8);
+			break;
+		case LUA_CH_DATE:
+			/* Date is stored as a number of days since epoch */
+			lua_ch_append_le (buf, (guint64)(num / 86400), 2);
+			break;
+		case LUA_CH_FLOAT32:
+			fnum = num;
+			memcpy (&fbits, &fnum, sizeof (fbits));
+			lua_ch_append_le (buf, fbits, sizeof (fbits));
+			break;
+		case LUA_CH_FLOAT64:
+			memcpy (&bits, &num, sizeof (bits));
+			lua_ch_append_le (buf, bits, sizeof (bits));
+			break;
+		default:
+			g_assert_not_reached ();
+		}
+		break;
+	}
+
+	return ret;
+}
+
+/***
+ * @function rspamd_clickhouse.create(table, columns)
+ * Creates new rows buffer for the specified table. Columns are defined as a
+ * list of pairs `{name, type}`, the following types are supported: integers,
+ * `Float32`, `Float64`, `Date`, `DateTime`, `String`, `FixedString(N)`,
+ * `Enum8(...)` and arrays of these types
+ * @param {string} table table name
+ * @param {table} columns list of columns
+ * @return {clickhouse} rows buffer
+ */
+static gint
+lua_clickhouse_create (lua_State *L)
+{
+	const gchar *tname = luaL_checkstring (L, 1), *name, *type;
+	struct lua_ch_block *block, **pblock;
+	struct lua_ch_column *col;
+	struct lua_ch_type *t;
+	GString *query;
+	gsize len = 0, i, ncols;
+
+	if (tname == NULL || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	block = g_malloc0 (sizeof (*block));
+	block->columns = g_ptr_array_new ();
+	block->buf = g_byte_array_new ();
+	query = g_string_new (NULL);
+	rspamd_printf_gstring (query, "INSERT INTO %s (", tname);
+	ncols = rspamd_lua_table_size (L, 2);
+
+	for (i = 1; i <= ncols; i ++) {
+		lua_rawgeti (L, 2, i);
+
+		if (lua_type (L, -1) == LUA_TTABLE) {
+			lua_rawgeti (L, -1, 1);
+			name = lua_tostring (L, -1);
+			lua_rawgeti (L, -2, 2);
+			type = lua_tolstring (L, -1, &len);
+		}
+		else {
+			lua_pushnil (L);
+			lua_pushnil (L);
+			name = NULL;
+			type = NULL;
+		}
+
+		t = (name && type) ? lua_ch_parse_type (type, len) : NULL;
+
+		if (t == NULL) {
+			g_string_free (query, TRUE);
+			lua_ch_block_free (block);
+
+			return luaL_error (L, "invalid column %d: %s", (gint)i,
+					type ? type : "no type");
+		}
+
+		col = g_malloc0 (sizeof (*col));
+		col->name = g_strdup (name);
+		col->type = t;
+		g_ptr_array_add (block->columns, col);
+		rspamd_printf_gstring (query, "%s`%s`", i > 1 ? "," : "", name);
+		lua_pop (L, 3);
+	}
+
+	if (block->columns->len == 0) {
+		g_string_free (query, TRUE);
+		lua_ch_block_free (block);
+
+		return luaL_error (L, "no columns defined");
+	}
+
+	g_string_append (query, ") FORMAT RowBinary\n");
+	block->query = g_string_free (query, FALSE);
+
+	pblock = lua_newuserdata (L, sizeof (*pblock));
+	rspamd_lua_setclass (L, "rspamd{clickhouse}", -1);
+	*pblock = block;
+
+	return 1;
+}
+
+/***
+ * @method clickhouse:add_row(values)
+ * Encodes a row, values are specified as a list in order of columns. Missing
+ * values are encoded as zeroes or empty strings
+ * @param {table} values row values
+ */
+static gint
+lua_clickhouse_add_row (lua_State *L)
+{
+	struct lua_ch_block *block = lua_check_clickhouse (L);
+	struct lua_ch_column *col;
+	guint i, saved_len;
+	gboolean ok;
+
+	if (block == NULL || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	saved_len = block->buf->len;
+
+	for (i = 0; i < block->columns->len; i ++) {
+		col = g_ptr_array_index (block->columns, i);
+		lua_rawgeti (L, 2, i + 1);
+		ok = lua_ch_append_value (L, lua_gettop (L), col->type, block->buf);
+		lua_pop (L, 1);
+
+		if (!ok) {
+			/* Do not leave a partial row in the buffer */
+			g_byte_array_set_size (block->buf, saved_len);
+
+			return luaL_error (L, "invalid value for column %s", col->name);
+		}
+	}
+
+	block->nrows ++;
+
+	return 0;
+}
+
+/***
+ * @method clickhouse:flush([compress])
+ * Returns body of `INSERT` query with all buffered rows and clears buffer
+ * @param {boolean} compress compress body with gzip (`Content-Encoding: gzip`)
+ * @return {rspamd_text} query body or nil if there are no rows
+ */
+static gint
+lua_clickhouse_flush (lua_State *L)
+{
+	struct lua_ch_block *block = lua_check_clickhouse (L);
+	struct rspamd_lua_text *res;
+	gboolean compress = FALSE;
+	gsize qlen, outlen;
+	guchar *out;
+	z_stream strm;
+	gint rc;
+
+	if (block == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (block->nrows == 0) {
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	if (lua_isboolean (L, 2)) {
+		compress = lua_toboolean (L, 2);
+	}
+
+	qlen = strlen (block->query);
+
+	if (compress) {
+		memset (&strm, 0, sizeof (strm));
+
+		if (deflateInit2 (&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				MAX_WBITS + 16, MAX_MEM_LEVEL - 1, Z_DEFAULT_STRATEGY) != Z_OK) {
+			msg_err ("cannot init zlib: %s", strm.msg);
+			lua_pushnil (L);
+
+			return 1;
+		}
+
+		outlen = deflateBound (&strm, qlen + block->buf->len);
+		out = g_malloc (outlen);
+		strm.next_out = out;
+		strm.avail_out = outlen;
+		strm.next_in = (guchar *)block->query;
+		strm.avail_in = qlen;
+		rc = deflate (&strm, Z_NO_FLUSH);
+
+		if (rc == Z_OK) {
+			strm.next_in = block->buf->data;
+			strm.avail_in = block->buf->len;
+			rc = deflate (&strm, Z_FINISH);
+		}
+
+		if (rc != Z_STREAM_END) {
+			msg_err ("cannot compress data: %s", strm.msg);
+			deflateEnd (&strm);
+			g_free (out);
+			lua_pushnil (L);
+
+			return 1;
+		}
+
+		outlen = strm.total_out;
+		deflateEnd (&strm);
+	}
+	else {
+		outlen = qlen + block->buf->len;
+		out = g_malloc (outlen);
+		memcpy (out, block->query, qlen);
+		memcpy (out + qlen, block->buf->data, block->buf->len);
+	}
+
+	res = lua_newuserdata (L, sizeof (*res));
+	res->start = (const gchar *)out;
+	res->len = outlen;
+	res->flags = RSPAMD_TEXT_FLAG_OWN;
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
+
+	g_byte_array_set_size (block->buf, 0);
+	block->nrows = 0;
+
+	return 1;
+}
+
+/***
+ * @method clickhouse:rows()
+ * Returns number of buffered rows
+ * @return {number} number of rows
+ */
+static gint
+lua_clickhouse_rows (lua_State *L)
+{
+	struct lua_ch_block *block = lua_check_clickhouse (L);
+
+	if (block == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushnumber (L, block->nrows);
+
+	return 1;
+}
+
+/***
+ * @method clickhouse:size()
+ * Returns size of buffered rows in bytes
+ * @return {number} size of data
+ */
+static gint
+lua_clickhouse_size (lua_State *L)
+{
+	struct lua_ch_block *block = lua_check_clickhouse (L);
+
+	if (block == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushnumber (L, block->buf->len);
+
+	return 1;
+}
+
+static gint
+lua_clickhouse_gc (lua_State *L)
+{
+	struct lua_ch_block *block = lua_check_clickhouse (L);
+
+	if (block) {
+		lua_ch_block_free (block);
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_clickhouse (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, clickhouselib_f);
+
+	return 1;
+}
+
+void
+luaopen_clickhouse (lua_State * L)
+{
+	luaL_newmetatable (L, "rspamd{clickhouse}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{clickhouse}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, clickhouselib_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_clickhouse", lua_load_clickhouse);
+}
@@ -16,10 +16,14 @@
 #include "lua_common.h"
 #include "lptree.h"
 #include "utlist.h"
+#include "libserver/worker_util.h"
+#include "libutil/shm_counters.h"
 #include <math.h>
 
 /* Lua module init function */
 #define MODULE_INIT_FUNC "module_init"
+/* Registry key of the main thread for lua 5.1 */
+#define RSPAMD_LUA_MAIN_THREAD "rspamd_main_thread"
 
 const luaL_reg null_reg[] = {
 	{"__tostring", rspamd_lua_class_tostring},
@@ -31,12 +35,18 @@ LUA_FUNCTION_DEF (worker, get_name);
 LUA_FUNCTION_DEF (worker, get_stat);
 LUA_FUNCTION_DEF (worker, get_index);
 LUA_FUNCTION_DEF (worker, get_pid);
+LUA_FUNCTION_DEF (worker, register_counter);
+LUA_FUNCTION_DEF (worker, add_counter);
+LUA_FUNCTION_DEF (worker, get_counters);
 
 const luaL_reg worker_reg[] = {
 	LUA_INTERFACE_DEF (worker, get_name),
 	LUA_INTERFACE_DEF (worker, get_stat),
 	LUA_INTERFACE_DEF (worker, get_index),
 	LUA_INTERFACE_DEF (worker, get_pid),
+	LUA_INTERFACE_DEF (worker, register_counter),
+	LUA_INTERFACE_DEF (worker, add_counter),
+	LUA_INTERFACE_DEF (worker, get_counters),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
@@ -284,6 +294,12 @@ rspamd_lua_init ()
 	luaopen_fann (L);
 	luaopen_sqlite3 (L);
 	luaopen_cryptobox (L);
+	luaopen_ratelimit (L);
+	luaopen_bloom (L);
+	luaopen_multimap (L);
+	luaopen_shared_cache (L);
+	luaopen_clickhouse (L);
+	luaopen_meta_rules (L);
 	luaopen_lpeg (L);
 
 	luaL_newmetatable (L, "rspamd{ev_base}");
@@ -305,9 +321,30 @@ rspamd_lua_init ()
 	lua_newtable (L);
 	lua_setglobal (L, "rspamd_plugins");
 
+#if LUA_VERSION_NUM < 502
+	lua_pushthread (L);
+	lua_setfield (L, LUA_REGISTRYINDEX, RSPAMD_LUA_MAIN_THREAD);
+#endif
+
 	return L;
 }
 
+lua_State *
+rspamd_lua_main_state (lua_State *L)
+{
+	lua_State *main_L;
+
+#if LUA_VERSION_NUM >= 502
+	lua_rawgeti (L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+#else
+	lua_getfield (L, LUA_REGISTRYINDEX, RSPAMD_LUA_MAIN_THREAD);
+#endif
+	main_L = lua_tothread (L, -1);
+	lua_pop (L, 1);
+
+	return main_L != NULL ? main_L : L;
+}
+
 /**
  * Initialize new locked lua_State structure
  */
@@ -348,6 +385,7 @@ rspamd_init_lua_filters (struct rspamd_config *cfg)
 	lua_State *L = cfg->lua_state;
 	GString *tb;
 	gint err_idx;
+	gdouble ts;
 
 	rspamd_lua_set_path (L, cfg);
 	cur = g_list_first (cfg->script_modules);
@@ -376,6 +414,7 @@ rspamd_init_lua_filters (struct rspamd_config *cfg)
 			rspamd_lua_setclass (L, "rspamd{config}", -1);
 			*pcfg = cfg;
 			lua_setglobal (L, "rspamd_config");
+			ts = rspamd_get_ticks ();
 
 			if (lua_pcall (L, 0, 0, err_idx) != 0) {
 				tb = lua_touserdata (L, -1);
@@ -388,6 +427,8 @@ rspamd_init_lua_filters (struct rspamd_config *cfg)
 				continue;
 			}
 
+			rspamd_config_add_init_timing (cfg, module->name,
+					rspamd_get_ticks () - ts);
 			msg_info_config ("init lua module %s", module->name);
 
 			lua_pop (L, 1); /* Error function */
@@ -953,7 +994,7 @@ rspamd_lua_parse_table_arguments (lua_State *L, gint pos,
 	return TRUE;
 }
 
-static void
+void
 rspamd_lua_traceback_string (lua_State *L, GString *s)
 {
 	gint i = 1;
@@ -1150,7 +1191,7 @@ lua_worker_get_stat (lua_State *L)
 
 		memset (&mem_st, 0, sizeof (mem_st));
 		rspamd_mempool_stat (&mem_st);
-		memcpy (&stat_copy, w->srv->stat, sizeof (stat_copy));
+		rspamd_main_stat_copy (w->srv, &stat_copy);
 		stat = &stat_copy;
 		top = ucl_object_typed_new (UCL_OBJECT);
 		ucl_object_insert_key (top, ucl_object_fromint (
@@ -1209,6 +1250,9 @@ lua_worker_get_stat (lua_State *L)
 		ucl_object_insert_key (top,
 			ucl_object_fromint (
 				mem_st.oversized_chunks), "chunks_oversized", 0, false);
+		ucl_object_insert_key (top,
+			ucl_object_fromint (
+				mem_st.chunks_reused), "chunks_reused", 0, false);
 
 		ucl_object_push_lua (L, top, true);
 		ucl_object_unref (top);
@@ -1265,6 +1309,91 @@ lua_worker_get_pid (lua_State *L)
 	return 1;
 }
 
+/* Counters are shared between all processes, so ids are the same everywhere */
+static gint
+lua_worker_register_counter (lua_State *L)
+{
+	struct rspamd_worker *w = lua_check_worker (L, 1);
+	const gchar *name = luaL_checkstring (L, 2);
+	gint id;
+
+	if (w && name && w->srv->counters) {
+		id = rspamd_shm_counters_register (w->srv->counters, name);
+
+		if (id == -1) {
+			lua_pushnil (L);
+		}
+		else {
+			lua_pushnumber (L, id);
+		}
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static gint
+lua_worker_add_counter (lua_State *L)
+{
+	struct rspamd_worker *w = lua_check_worker (L, 1);
+	guint64 value = 1;
+	gint id = -1;
+
+	if (w && w->srv->counters) {
+		if (lua_type (L, 2) == LUA_TNUMBER) {
+			id = lua_tonumber (L, 2);
+
+			if (id >= (gint)rspamd_shm_counters_count (w->srv->counters)) {
+				id = -1;
+			}
+		}
+		else if (lua_type (L, 2) == LUA_TSTRING) {
+			id = rspamd_shm_counters_register (w->srv->counters,
+					lua_tostring (L, 2));
+		}
+
+		if (lua_type (L, 3) == LUA_TNUMBER) {
+			value = lua_tonumber (L, 3);
+		}
+
+		if (id < 0) {
+			return luaL_error (L, "invalid counter");
+		}
+
+		rspamd_shm_counters_add (w->srv->counters, id, value);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 0;
+}
+
+static gint
+lua_worker_get_counters (lua_State *L)
+{
+	struct rspamd_worker *w = lua_check_worker (L, 1);
+	guint i, n;
+
+	if (w && w->srv->counters) {
+		n = rspamd_shm_counters_count (w->srv->counters);
+		lua_createtable (L, 0, n);
+
+		for (i = 0; i < n; i ++) {
+			lua_pushstring (L, rspamd_shm_counters_name (w->srv->counters, i));
+			lua_pushnumber (L, rspamd_shm_counters_get (w->srv->counters, i));
+			lua_settable (L, -3);
+		}
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 struct rspamd_lua_ref_cbdata {
 	lua_State *L;
 	gint cbref;
@@ -1287,7 +1416,7 @@ rspamd_lua_add_ref_dtor (lua_State *L, rspamd_mempool_t *pool,
 	if (ref != -1) {
 		cbdata = rspamd_mempool_alloc (pool, sizeof (*cbdata));
 		cbdata->cbref = ref;
-		cbdata->L = L;
+		cbdata->L = rspamd_lua_main_state (L);
 
 		rspamd_mempool_add_destructor (pool, rspamd_lua_ref_dtor, cbdata);
 	}
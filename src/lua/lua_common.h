@@ -93,7 +93,8 @@ enum rspamd_lua_map_type {
 	RSPAMD_LUA_MAP_SET,
 	RSPAMD_LUA_MAP_HASH,
 	RSPAMD_LUA_MAP_REGEXP,
-	RSPAMD_LUA_MAP_CALLBACK
+	RSPAMD_LUA_MAP_CALLBACK,
+	RSPAMD_LUA_MAP_COMPILED
 };
 
 #define RSPAMD_LUA_MAP_FLAG_EMBEDDED (1 << 0)
@@ -108,6 +109,7 @@ struct rspamd_lua_map {
 		GHashTable *hash;
 		struct lua_map_callback_data *cbdata;
 		struct rspamd_regexp_map *re_map;
+		struct rspamd_map_compiled *compiled;
 	} data;
 };
 
@@ -208,6 +210,15 @@ struct rspamd_task *lua_check_task_maybe (lua_State * L, gint pos);
 
 struct rspamd_lua_map *lua_check_map (lua_State * L, gint pos);
 
+/**
+ * Looks up a string key or an address (for radix maps) in a lua map
+ * @param value set to the value found or to NULL for set maps
+ * @return TRUE if a key has been found
+ */
+gboolean rspamd_lua_map_lookup (struct rspamd_lua_map *map,
+		const gchar *key, gsize len, rspamd_inet_addr_t *addr,
+		const gchar **value, gsize *vlen);
+
 /**
  * Push ip address from a string (nil is pushed if a string cannot be converted)
  */
@@ -256,6 +267,12 @@ void luaopen_html (lua_State * L);
 void luaopen_fann (lua_State *L);
 void luaopen_sqlite3 (lua_State *L);
 void luaopen_cryptobox (lua_State *L);
+void luaopen_ratelimit (lua_State *L);
+void luaopen_bloom (lua_State *L);
+void luaopen_multimap (lua_State *L);
+void luaopen_shared_cache (lua_State *L);
+void luaopen_clickhouse (lua_State *L);
+void luaopen_meta_rules (lua_State *L);
 
 void rspamd_lua_dostring (const gchar *line);
 
@@ -307,6 +324,11 @@ gboolean rspamd_lua_parse_table_arguments (lua_State *L, gint pos,
 
 gint rspamd_lua_traceback (lua_State *L);
 
+/**
+ * Append traceback of `L` to the string `s`
+ */
+void rspamd_lua_traceback_string (lua_State *L, GString *s);
+
 /**
  * Returns size of table at position `tbl_pos`
  */
@@ -369,5 +391,39 @@ gboolean rspamd_lua_run_postloads (lua_State *L, struct rspamd_config *cfg,
 void rspamd_lua_add_ref_dtor (lua_State *L, rspamd_mempool_t *pool,
 		gint ref);
 
+/**
+ * Returns the main state for `L`, callbacks that are called from the events
+ * loop must use it as a coroutine that has created them could be suspended
+ * or reused at that moment
+ * @param L
+ * @return
+ */
+lua_State *rspamd_lua_main_state (lua_State *L);
+
+/**
+ * Create suspended DNS request for a task, must be called from a pooled
+ * coroutine as `return lua_dns_task_yield (...)`
+ */
+struct thread_entry;
+gint lua_dns_task_yield (lua_State *L, struct thread_entry *thread,
+		struct rspamd_task *task, gint type, const gchar *name,
+		gboolean forced);
+
+/*
+ * Fast accessors for LuaJIT FFI, they take task or mimepart userdata and
+ * return zero-copy views instead of creating Lua strings and tables, so Lua
+ * code must declare `struct rspamd_lua_text` with the same layout via
+ * `ffi.cdef`. Views are valid while a task is alive
+ */
+int rspamd_task_get_header_ffi (void *ptask, const char *name, int strong,
+		int raw, struct rspamd_lua_text *out);
+int rspamd_task_has_symbol_ffi (void *ptask, const char *symbol);
+unsigned int rspamd_task_get_urls_ffi (void *ptask, int need_emails,
+		struct rspamd_lua_text *out, unsigned int max);
+int rspamd_task_get_from_ffi (void *ptask, int what,
+		struct rspamd_lua_text *out);
+int rspamd_mimepart_get_content_ffi (void *ppart,
+		struct rspamd_lua_text *out);
+
 #endif /* WITH_LUA */
 #endif /* RSPAMD_LUA_H */
@@ -18,6 +18,7 @@
 #include "libutil/expression.h"
 #include "libserver/composites.h"
 #include "lua/lua_map.h"
+#include "lua/lua_thread_pool.h"
 #include "utlist.h"
 #include <math.h>
 
@@ -148,6 +149,8 @@ end
  *   + `radix`: map of IP addresses to strings
  *   + `map`: map of strings to strings
  *   + `regexp`: map of regexps to strings
+ *   + `compiled_hash`: like `map` but could be also loaded from a file made by `rspamadm compile_map`
+ *   + `compiled_radix`: like `radix` but could be also loaded from a file made by `rspamadm compile_map`
  *   + `callback`: map processed by lua callback
  * - `url`: url to load map from
  * - `description`: map's description
@@ -183,6 +186,8 @@ LUA_FUNCTION_DEF (config, get_classifier);
  *     + `nice` if symbol can produce negative score;
  *     + `empty` if symbol can be called for empty messages
  *     + `skip` if symbol should be skipped now
+ *     + `content` if symbol depends on message content only and has no side
+ *       effects on the task, such as adding urls (results cache)
  * - `parent`: id of parent symbol (useful for virtual symbols)
  *
  * @return {number} id of symbol registered
@@ -553,6 +558,7 @@ LUA_FUNCTION_DEF (config, register_finish_script);
  * - `offline`: returns number of seconds of the current offline period (or 0 if alive)
  * - `total_offline`: returns number of seconds of the overall offline
  * - `latency`: returns the current average latency in seconds (or 0 if offline)
+ * - `timeout`: returns the DNS timeout adapted to the recent latencies of the resource
  *
  * @param {string} url resource to monitor
  * @param {string} type type of monitoring
@@ -597,6 +603,24 @@ end)
  */
 LUA_FUNCTION_DEF (config, set_peak_cb);
 
+/***
+ * @method rspamd_config:get_symbols_profile()
+ * Returns execution profile of symbols: a table indexed by symbol names with
+ * elements `time`, `count`, `runs`, `async` and `frequency` (`avg` and `stddev`)
+ * @return {table} profile of symbols
+ */
+LUA_FUNCTION_DEF (config, get_symbols_profile);
+
+/***
+ * @method rspamd_config:import_symbols_profile(profile)
+ * Imports profile in the format of `get_symbols_profile` (e.g. aggregated from
+ * other nodes) for symbols that have not enough local statistics and resorts
+ * symbols
+ * @param {table} profile profile of symbols
+ * @return {number} number of symbols updated
+ */
+LUA_FUNCTION_DEF (config, import_symbols_profile);
+
 static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF (config, get_module_opt),
 	LUA_INTERFACE_DEF (config, get_mempool),
@@ -640,6 +664,8 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF (config, register_monitored),
 	LUA_INTERFACE_DEF (config, add_doc),
 	LUA_INTERFACE_DEF (config, set_peak_cb),
+	LUA_INTERFACE_DEF (config, get_symbols_profile),
+	LUA_INTERFACE_DEF (config, import_symbols_profile),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__newindex", lua_config_newindex},
 	{NULL, NULL}
@@ -649,12 +675,14 @@ LUA_FUNCTION_DEF (monitored, alive);
 LUA_FUNCTION_DEF (monitored, latency);
 LUA_FUNCTION_DEF (monitored, offline);
 LUA_FUNCTION_DEF (monitored, total_offline);
+LUA_FUNCTION_DEF (monitored, timeout);
 
 static const struct luaL_reg monitoredlib_m[] = {
 	LUA_INTERFACE_DEF (monitored, alive),
 	LUA_INTERFACE_DEF (monitored, latency),
 	LUA_INTERFACE_DEF (monitored, offline),
 	LUA_INTERFACE_DEF (monitored, total_offline),
+	LUA_INTERFACE_DEF (monitored, timeout),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
@@ -876,100 +904,110 @@ rspamd_compare_order_func (gconstpointer a, gconstpointer b)
 }
 
 static void
-lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
+lua_metric_symbol_callback_return (struct thread_entry *thread, gint nresults)
 {
-	struct lua_callback_data *cd = ud;
-	struct rspamd_task **ptask;
-	gint level = lua_gettop (cd->L), nresults, err_idx, ret;
-	lua_State *L = cd->L;
-	GString *tb;
+	struct lua_callback_data *cd = thread->cd;
+	struct rspamd_task *task = thread->task;
+	lua_State *L = thread->lua_state;
 	struct rspamd_symbol_result *s;
 
-	lua_pushcfunction (L, &rspamd_lua_traceback);
-	err_idx = lua_gettop (L);
-
-	level ++;
-
-	if (cd->cb_is_ref) {
-		lua_rawgeti (L, LUA_REGISTRYINDEX, cd->callback.ref);
-	}
-	else {
-		lua_getglobal (L, cd->callback.name);
-	}
-
-	ptask = lua_newuserdata (L, sizeof (struct rspamd_task *));
-	rspamd_lua_setclass (L, "rspamd{task}", -1);
-	*ptask = task;
+	if (nresults >= 1) {
+		/* Function returned boolean, so maybe we need to insert result? */
+		gint res = 0;
+		gint i;
+		gdouble flag = 1.0;
 
-	if ((ret = lua_pcall (L, 1, LUA_MULTRET, err_idx)) != 0) {
-		tb = lua_touserdata (L, -1);
-		msg_err_task ("call to (%s) failed (%d): %v", cd->symbol, ret, tb);
-
-		if (tb) {
-			g_string_free (tb, TRUE);
-			lua_pop (L, 1);
+		if (lua_type (L, 1) == LUA_TBOOLEAN) {
+			res = lua_toboolean (L, 1);
+		}
+		else {
+			res = lua_tonumber (L, 1);
 		}
-	}
-	else {
-		nresults = lua_gettop (L) - level;
 
-		if (nresults >= 1) {
-			/* Function returned boolean, so maybe we need to insert result? */
-			gint res = 0;
-			gint i;
-			gdouble flag = 1.0;
+		if (res) {
+			gint first_opt = 2;
 
-			if (lua_type (cd->L, level + 1) == LUA_TBOOLEAN) {
-				res = lua_toboolean (L, level + 1);
+			if (lua_type (L, 2) == LUA_TNUMBER) {
+				flag = lua_tonumber (L, 2);
+				/* Shift opt index */
+				first_opt = 3;
 			}
 			else {
-				res = lua_tonumber (L, level + 1);
+				flag = res;
 			}
 
-			if (res) {
-				gint first_opt = 2;
+			s = rspamd_task_insert_result (task, cd->symbol, flag, NULL);
 
-				if (lua_type (L, level + 2) == LUA_TNUMBER) {
-					flag = lua_tonumber (L, level + 2);
-					/* Shift opt index */
-					first_opt = 3;
-				}
-				else {
-					flag = res;
-				}
+			if (s) {
+				guint last_pos = lua_gettop (L);
 
-				s = rspamd_task_insert_result (task, cd->symbol, flag, NULL);
+				for (i = first_opt; i <= last_pos; i++) {
+					if (lua_type (L, i) == LUA_TSTRING) {
+						const char *opt = lua_tostring (L, i);
 
-				if (s) {
-					guint last_pos = lua_gettop (L);
+						rspamd_task_add_result_option (task, s, opt);
+					}
+					else if (lua_type (L, i) == LUA_TTABLE) {
+						lua_pushvalue (L, i);
 
-					for (i = level + first_opt; i <= last_pos; i++) {
-						if (lua_type (L, i) == LUA_TSTRING) {
-							const char *opt = lua_tostring (L, i);
+						for (lua_pushnil (L); lua_next (L, -2); lua_pop (L, 1)) {
+							const char *opt = lua_tostring (L, -1);
 
 							rspamd_task_add_result_option (task, s, opt);
 						}
-						else if (lua_type (L, i) == LUA_TTABLE) {
-							lua_pushvalue (L, i);
 
-							for (lua_pushnil (L); lua_next (L, -2); lua_pop (L, 1)) {
-								const char *opt = lua_tostring (L, -1);
-
-								rspamd_task_add_result_option (task, s, opt);
-							}
-
-							lua_pop (L, 1);
-						}
+						lua_pop (L, 1);
 					}
 				}
-
 			}
 
-			lua_pop (L, nresults);
 		}
+
+		lua_pop (L, nresults);
 	}
+}
 
-	lua_pop (L, 1); /* Error function */
+static void
+lua_metric_symbol_callback_error (struct thread_entry *thread, gint ret,
+		const gchar *msg)
+{
+	struct lua_callback_data *cd = thread->cd;
+	struct rspamd_task *task = thread->task;
+
+	msg_err_task ("call to (%s) failed (%d): %s", cd->symbol, ret, msg);
+}
+
+/*
+ * Symbols are executed in pooled coroutines, so they could wait for
+ * asynchronous events without callbacks
+ */
+static void
+lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
+{
+	struct lua_callback_data *cd = ud;
+	struct rspamd_task **ptask;
+	struct thread_entry *thread;
+	lua_State *L;
+
+	thread = lua_thread_pool_get_for_task (task->cfg->lua_thread_pool, task);
+	thread->cd = cd;
+	thread->w = rspamd_session_get_watcher (task->s);
+	thread->finish_callback = lua_metric_symbol_callback_return;
+	thread->error_callback = lua_metric_symbol_callback_error;
+	L = thread->lua_state;
+
+	if (cd->cb_is_ref) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, cd->callback.ref);
+	}
+	else {
+		lua_getglobal (L, cd->callback.name);
+	}
+
+	ptask = lua_newuserdata (L, sizeof (struct rspamd_task *));
+	rspamd_lua_setclass (L, "rspamd{task}", -1);
+	*ptask = task;
+
+	lua_thread_call (task->cfg->lua_thread_pool, thread, 1);
 }
 
 static gint
@@ -1194,6 +1232,12 @@ lua_parse_symbol_flags (const gchar *str)
 		if (strstr (str, "skip") != NULL) {
 			ret |= SYMBOL_TYPE_SKIPPED;
 		}
+		if (strstr (str, "envelope") != NULL) {
+			ret |= SYMBOL_TYPE_ENVELOPE;
+		}
+		if (strstr (str, "content") != NULL) {
+			ret |= SYMBOL_TYPE_CONTENT;
+		}
 	}
 
 	return ret;
@@ -1985,6 +2029,45 @@ lua_config_set_peak_cb (lua_State *L)
 	return 0;
 }
 
+static gint
+lua_config_get_symbols_profile (lua_State *L)
+{
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	ucl_object_t *profile;
+
+	if (cfg != NULL) {
+		profile = rspamd_symbols_cache_get_profile (cfg->cache);
+		ucl_object_push_lua (L, profile, true);
+		ucl_object_unref (profile);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+static gint
+lua_config_import_symbols_profile (lua_State *L)
+{
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	ucl_object_t *profile;
+	guint res;
+
+	if (cfg != NULL && lua_type (L, 2) == LUA_TTABLE) {
+		profile = ucl_object_lua_import (L, 2);
+		res = rspamd_symbols_cache_import_profile (cfg->cache, profile);
+		ucl_object_unref (profile);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushnumber (L, res);
+
+	return 1;
+}
+
 static gint
 lua_config_enable_symbol (lua_State *L)
 {
@@ -2551,6 +2634,21 @@ lua_monitored_latency (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_monitored_timeout (lua_State *L)
+{
+	struct rspamd_monitored *m = lua_check_monitored (L, 1);
+
+	if (m) {
+		lua_pushnumber (L, rspamd_monitored_timeout (m));
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 void
 luaopen_config (lua_State * L)
 {
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 #include "lua_common.h"
+#include "lua_thread_pool.h"
 #include "utlist.h"
 
 
@@ -39,6 +40,15 @@ local function symbol_callback(task)
 	task:get_resolver():resolve_a(task:get_session(), task:get_mempool(),
 		host, dns_cb)
 end
+
+-- Symbols callbacks are executed in coroutines, so when no callback is
+-- specified for a task request, the symbol is suspended until a reply
+-- and `results, err, authenticated` are returned
+local function symbol_callback_yield(task)
+	local results, err = task:get_resolver():resolve_a({
+		task = task, name = 'example.com'})
+	return results ~= nil
+end
  */
 struct rspamd_dns_resolver * lua_check_dns_resolver (lua_State * L);
 void luaopen_dns_resolver (lua_State * L);
@@ -51,6 +61,7 @@ LUA_FUNCTION_DEF (dns_resolver, resolve_txt);
 LUA_FUNCTION_DEF (dns_resolver, resolve_mx);
 LUA_FUNCTION_DEF (dns_resolver, resolve_ns);
 LUA_FUNCTION_DEF (dns_resolver, resolve);
+LUA_FUNCTION_DEF (dns_resolver, get_stats);
 
 static const struct luaL_reg dns_resolverlib_f[] = {
 	LUA_INTERFACE_DEF (dns_resolver, init),
@@ -64,6 +75,7 @@ static const struct luaL_reg dns_resolverlib_m[] = {
 	LUA_INTERFACE_DEF (dns_resolver, resolve_mx),
 	LUA_INTERFACE_DEF (dns_resolver, resolve_ns),
 	LUA_INTERFACE_DEF (dns_resolver, resolve),
+	LUA_INTERFACE_DEF (dns_resolver, get_stats),
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
 };
@@ -84,6 +96,7 @@ struct lua_dns_cbdata {
 	const gchar *user_str;
 	struct rspamd_async_watcher *w;
 	struct rspamd_async_session *s;
+	struct thread_entry *thread;
 };
 
 static int
@@ -131,22 +144,14 @@ lua_dns_get_type (lua_State *L, int argno)
 	return type;
 }
 
+/* Pushes results table and error */
 static void
-lua_dns_callback (struct rdns_reply *reply, gpointer arg)
+lua_dns_push_results (lua_State *L, struct rdns_reply *reply)
 {
-	struct lua_dns_cbdata *cd = arg;
 	gint i = 0, naddrs = 0;
-	struct rspamd_dns_resolver **presolver;
 	struct rdns_reply_entry *elt;
 	rspamd_inet_addr_t *addr;
 
-	lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->cbref);
-	presolver = lua_newuserdata (cd->L, sizeof (gpointer));
-	rspamd_lua_setclass (cd->L, "rspamd{resolver}", -1);
-
-	*presolver = cd->resolver;
-	lua_pushstring (cd->L, cd->to_resolve);
-
 	/*
 	 * XXX: rework to handle different request types
 	 */
@@ -155,77 +160,107 @@ lua_dns_callback (struct rdns_reply *reply, gpointer arg)
 			naddrs ++;
 		}
 
-		lua_createtable (cd->L, naddrs, 0);
+		lua_createtable (L, naddrs, 0);
 
 		LL_FOREACH (reply->entries, elt)
 		{
 			switch (elt->type) {
 			case RDNS_REQUEST_A:
 				addr = rspamd_inet_address_new (AF_INET, &elt->content.a.addr);
-				rspamd_lua_ip_push (cd->L, addr);
+				rspamd_lua_ip_push (L, addr);
 				rspamd_inet_address_destroy (addr);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_AAAA:
 				addr = rspamd_inet_address_new (AF_INET6, &elt->content.aaa.addr);
-				rspamd_lua_ip_push (cd->L, addr);
+				rspamd_lua_ip_push (L, addr);
 				rspamd_inet_address_destroy (addr);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_NS:
-				lua_pushstring (cd->L, elt->content.ns.name);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_pushstring (L, elt->content.ns.name);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_PTR:
-				lua_pushstring (cd->L, elt->content.ptr.name);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_pushstring (L, elt->content.ptr.name);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_TXT:
 			case RDNS_REQUEST_SPF:
-				lua_pushstring (cd->L, elt->content.txt.data);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_pushstring (L, elt->content.txt.data);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_MX:
 				/* mx['name'], mx['priority'] */
-				lua_createtable (cd->L, 0, 2);
-				rspamd_lua_table_set (cd->L, "name", elt->content.mx.name);
-				lua_pushstring (cd->L, "priority");
-				lua_pushnumber (cd->L, elt->content.mx.priority);
-				lua_settable (cd->L, -3);
+				lua_createtable (L, 0, 2);
+				rspamd_lua_table_set (L, "name", elt->content.mx.name);
+				lua_pushstring (L, "priority");
+				lua_pushnumber (L, elt->content.mx.priority);
+				lua_settable (L, -3);
 
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_SOA:
-				lua_createtable (cd->L, 0, 7);
-				rspamd_lua_table_set (cd->L, "ns", elt->content.soa.mname);
-				rspamd_lua_table_set (cd->L, "contact", elt->content.soa.admin);
-				lua_pushstring (cd->L, "serial");
-				lua_pushnumber (cd->L, elt->content.soa.serial);
-				lua_settable (cd->L, -3);
-				lua_pushstring (cd->L, "refresh");
-				lua_pushnumber (cd->L, elt->content.soa.refresh);
-				lua_settable (cd->L, -3);
-				lua_pushstring (cd->L, "retry");
-				lua_pushnumber (cd->L, elt->content.soa.retry);
-				lua_settable (cd->L, -3);
-				lua_pushstring (cd->L, "expiry");
-				lua_pushnumber (cd->L, elt->content.soa.expire);
-				lua_settable (cd->L, -3);
+				lua_createtable (L, 0, 7);
+				rspamd_lua_table_set (L, "ns", elt->content.soa.mname);
+				rspamd_lua_table_set (L, "contact", elt->content.soa.admin);
+				lua_pushstring (L, "serial");
+				lua_pushnumber (L, elt->content.soa.serial);
+				lua_settable (L, -3);
+				lua_pushstring (L, "refresh");
+				lua_pushnumber (L, elt->content.soa.refresh);
+				lua_settable (L, -3);
+				lua_pushstring (L, "retry");
+				lua_pushnumber (L, elt->content.soa.retry);
+				lua_settable (L, -3);
+				lua_pushstring (L, "expiry");
+				lua_pushnumber (L, elt->content.soa.expire);
+				lua_settable (L, -3);
 				/* Negative TTL */
-				lua_pushstring (cd->L, "nx");
-				lua_pushnumber (cd->L, elt->content.soa.minimum);
-				lua_settable (cd->L, -3);
+				lua_pushstring (L, "nx");
+				lua_pushnumber (L, elt->content.soa.minimum);
+				lua_settable (L, -3);
 
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			}
 		}
-		lua_pushnil (cd->L);
+		lua_pushnil (L);
 	}
 	else {
-		lua_pushnil (cd->L);
-		lua_pushstring (cd->L, rdns_strerror (reply->code));
+		lua_pushnil (L);
+		lua_pushstring (L, rdns_strerror (reply->code));
 	}
+}
+
+static void
+lua_dns_callback (struct rdns_reply *reply, gpointer arg)
+{
+	struct lua_dns_cbdata *cd = arg;
+	struct rspamd_dns_resolver **presolver;
+	lua_State *L;
+
+	if (cd->thread) {
+		/* Resume coroutine with results, err and authenticated flag */
+		L = cd->thread->lua_state;
+		lua_dns_push_results (L, reply);
+		lua_pushboolean (L, reply->authenticated);
+		lua_thread_resume (cd->thread, 3);
+
+		if (cd->s) {
+			rspamd_session_watcher_pop (cd->s, cd->w);
+		}
+
+		return;
+	}
+
+	lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->cbref);
+	presolver = lua_newuserdata (cd->L, sizeof (gpointer));
+	rspamd_lua_setclass (cd->L, "rspamd{resolver}", -1);
+
+	*presolver = cd->resolver;
+	lua_pushstring (cd->L, cd->to_resolve);
+	lua_dns_push_results (cd->L, reply);
 
 	if (cd->user_str != NULL) {
 		lua_pushstring (cd->L, cd->user_str);
@@ -288,6 +323,110 @@ lua_dns_resolver_init (lua_State *L)
 	return 1;
 }
 
+static gboolean
+lua_dns_make_request (struct lua_dns_cbdata *cbdata,
+		struct rspamd_async_session *session,
+		rspamd_mempool_t *pool,
+		struct rspamd_task *task,
+		enum rdns_request_type type,
+		const gchar *to_resolve,
+		gboolean forced,
+		gdouble timeout)
+{
+	gboolean ret;
+
+	if (task == NULL) {
+		ret = make_dns_request (cbdata->resolver,
+				session,
+				pool,
+				lua_dns_callback,
+				cbdata,
+				type,
+				to_resolve);
+	}
+	else {
+		ret = make_dns_request_task_full (task,
+				lua_dns_callback,
+				cbdata,
+				type,
+				to_resolve,
+				forced,
+				timeout);
+	}
+
+	if (ret && session) {
+		cbdata->s = session;
+
+		if (cbdata->thread) {
+			/* Symbol watcher is not active when a coroutine is resumed */
+			cbdata->w = cbdata->thread->w;
+			rspamd_session_watcher_push_specific (session, cbdata->w);
+		}
+		else {
+			cbdata->w = rspamd_session_get_watcher (session);
+			rspamd_session_watcher_push (session);
+		}
+	}
+
+	return ret;
+}
+
+static const gchar *
+lua_dns_prepare_name (rspamd_mempool_t *pool, enum rdns_request_type type,
+		const gchar *to_resolve)
+{
+	gchar *ptr_str;
+	const gchar *ret;
+
+	if (type != RDNS_REQUEST_PTR) {
+		return rspamd_mempool_strdup (pool, to_resolve);
+	}
+
+	ptr_str = rdns_generate_ptr_from_str (to_resolve);
+
+	if (ptr_str == NULL) {
+		return NULL;
+	}
+
+	ret = rspamd_mempool_strdup (pool, ptr_str);
+	free (ptr_str);
+
+	return ret;
+}
+
+gint
+lua_dns_task_yield (lua_State *L, struct thread_entry *thread,
+		struct rspamd_task *task, gint type, const gchar *name,
+		gboolean forced)
+{
+	struct lua_dns_cbdata *cbdata;
+
+	cbdata = rspamd_mempool_alloc0 (task->task_pool, sizeof (*cbdata));
+	cbdata->L = L;
+	cbdata->resolver = task->resolver;
+	cbdata->cbref = -1;
+	cbdata->thread = thread;
+	cbdata->to_resolve = lua_dns_prepare_name (task->task_pool, type, name);
+
+	if (cbdata->to_resolve == NULL) {
+		msg_err_task ("wrong resolve string to PTR request: %s", name);
+		lua_pushnil (L);
+		lua_pushstring (L, "bad name");
+
+		return 2;
+	}
+
+	if (!lua_dns_make_request (cbdata, task->s, task->task_pool, task,
+			type, cbdata->to_resolve, forced, 0)) {
+		lua_pushnil (L);
+		lua_pushstring (L, "cannot make request");
+
+		return 2;
+	}
+
+	return lua_thread_yield (thread, 0);
+}
+
 static int
 lua_dns_resolver_resolve_common (lua_State *L,
 	struct rspamd_dns_resolver *resolver,
@@ -298,16 +437,19 @@ lua_dns_resolver_resolve_common (lua_State *L,
 	rspamd_mempool_t *pool = NULL;
 	const gchar *to_resolve = NULL, *user_str = NULL;
 	struct lua_dns_cbdata *cbdata;
+	struct thread_entry *thread = NULL;
 	gint cbref = -1, ret;
 	struct rspamd_task *task = NULL;
 	GError *err = NULL;
 	gboolean forced = FALSE;
+	gdouble timeout = 0;
 
 	/* Check arguments */
 	if (!rspamd_lua_parse_table_arguments (L, first, &err,
-			"session=U{session};mempool=U{mempool};*name=S;*callback=F;"
-			"option=S;task=U{task};forced=B",
-			&session, &pool, &to_resolve, &cbref, &user_str, &task, &forced)) {
+			"session=U{session};mempool=U{mempool};*name=S;callback=F;"
+			"option=S;task=U{task};forced=B;timeout=N",
+			&session, &pool, &to_resolve, &cbref, &user_str, &task, &forced,
+			&timeout)) {
 
 		if (err) {
 			ret = luaL_error (L, "invalid arguments: %s", err->message);
@@ -322,85 +464,50 @@ lua_dns_resolver_resolve_common (lua_State *L,
 	if (task) {
 		pool = task->task_pool;
 		session = task->s;
+
+		if (cbref == -1) {
+			/* Request without callback suspends the calling coroutine */
+			thread = lua_thread_pool_get_running_entry (
+					task->cfg->lua_thread_pool, L);
+		}
 	}
 
-	if (pool != NULL && session != NULL && to_resolve != NULL && cbref != -1) {
+	if (pool != NULL && session != NULL && to_resolve != NULL &&
+			(cbref != -1 || thread != NULL)) {
+		if (thread) {
+			return lua_dns_task_yield (L, thread, task, type, to_resolve,
+					forced);
+		}
+
 		cbdata = rspamd_mempool_alloc0 (pool, sizeof (struct lua_dns_cbdata));
-		cbdata->L = L;
+		cbdata->L = rspamd_lua_main_state (L);
 		cbdata->resolver = resolver;
 		cbdata->cbref = cbref;
 		cbdata->user_str = rspamd_mempool_strdup (pool, user_str);
+		cbdata->to_resolve = lua_dns_prepare_name (pool, type, to_resolve);
 
-		if (type != RDNS_REQUEST_PTR) {
-			cbdata->to_resolve = rspamd_mempool_strdup (pool, to_resolve);
-		}
-		else {
-			char *ptr_str;
-
-			ptr_str = rdns_generate_ptr_from_str (to_resolve);
-
-			if (ptr_str == NULL) {
-				msg_err_task_check ("wrong resolve string to PTR request: %s",
-						to_resolve);
-				lua_pushnil (L);
-
-				return 1;
-			}
+		if (cbdata->to_resolve == NULL) {
+			msg_err_task_check ("wrong resolve string to PTR request: %s",
+					to_resolve);
+			luaL_unref (L, LUA_REGISTRYINDEX, cbref);
+			lua_pushnil (L);
 
-			cbdata->to_resolve = rspamd_mempool_strdup (pool, ptr_str);
-			to_resolve = cbdata->to_resolve;
-			free (ptr_str);
+			return 1;
 		}
 
-		if (task == NULL) {
-			if (make_dns_request (resolver,
-					session,
-					pool,
-					lua_dns_callback,
-					cbdata,
-					type,
-					to_resolve)) {
-
-				lua_pushboolean (L, TRUE);
-
-				if (session) {
-					cbdata->s = session;
-					cbdata->w = rspamd_session_get_watcher (session);
-					rspamd_session_watcher_push (session);
-				}
-			}
-			else {
-				lua_pushnil (L);
-			}
+		if (lua_dns_make_request (cbdata, session, pool, task, type,
+				cbdata->to_resolve, forced, timeout)) {
+			lua_pushboolean (L, TRUE);
 		}
 		else {
-			if (forced) {
-				ret = make_dns_request_task_forced (task,
-						lua_dns_callback,
-						cbdata,
-						type,
-						to_resolve);
-			}
-			else {
-				ret = make_dns_request_task (task,
-						lua_dns_callback,
-						cbdata,
-						type,
-						to_resolve);
-			}
-
-			if (ret) {
-				lua_pushboolean (L, TRUE);
-				cbdata->s = session;
-				cbdata->w = rspamd_session_get_watcher (session);
-				rspamd_session_watcher_push (session);
-			}
-			else {
-				lua_pushnil (L);
-			}
+			lua_pushnil (L);
 		}
 	}
 	else {
+		if (cbref != -1) {
+			luaL_unref (L, LUA_REGISTRYINDEX, cbref);
+		}
+
 		return luaL_error (L, "invalid arguments to lua_resolve");
 	}
 
@@ -562,6 +669,38 @@ lua_dns_resolver_resolve (lua_State *L)
 	return 1;
 }
 
+/***
+ * @method resolver:get_stats()
+ * Returns statistics of the replies cache of this process
+ * @return {table} table with `hits`, `misses`, `coalesced` and `shared` requests counts
+ */
+static int
+lua_dns_resolver_get_stats (lua_State *L)
+{
+	struct rspamd_dns_resolver *dns_resolver = lua_check_dns_resolver (L);
+
+	if (dns_resolver) {
+		lua_createtable (L, 0, 4);
+		lua_pushstring (L, "hits");
+		lua_pushnumber (L, dns_resolver->stat.hits);
+		lua_settable (L, -3);
+		lua_pushstring (L, "misses");
+		lua_pushnumber (L, dns_resolver->stat.misses);
+		lua_settable (L, -3);
+		lua_pushstring (L, "coalesced");
+		lua_pushnumber (L, dns_resolver->stat.coalesced);
+		lua_settable (L, -3);
+		lua_pushstring (L, "shared");
+		lua_pushnumber (L, dns_resolver->stat.shared);
+		lua_settable (L, -3);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 static gint
 lua_load_dns (lua_State * L)
 {
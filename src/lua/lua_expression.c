@@ -15,6 +15,7 @@
  */
 #include "lua_common.h"
 #include "expression.h"
+#include "re_cache.h"
 
 /***
  * @module rspamd_expression
@@ -24,7 +25,11 @@
 
 /***
  * @function rspamd_expression.create(line, {parse_func, process_func}, pool)
- * Create expression from the line using atom parsing routines and the specified memory pool
+ * Create expression from the line using atom parsing routines and the specified memory pool.
+ * If `parse_func` is omitted then atoms are split by spaces, braces and operators.
+ * If `process_func` is omitted then atoms are checked as symbols of a task without
+ * calling lua. Atoms registered by `add_symbol_atom` and `add_regexp_atom` (or
+ * listed in `symbols` field of `atom_functions`) are always processed natively.
  * @param {string} line expression line
  * @param {table} atom_functions parse_atom function and process_atom function
  * @param {rspamd_mempool} memory pool to use for this function
@@ -49,6 +54,8 @@ local pool = rspamd_mempool.create()
 local expr,err = rspamd_expression.create('A & B | !C', {parse_func, process_func}, pool)
 -- Expression is destroyed when the corresponding pool is destroyed
 pool:destroy()
+-- Expression of symbols evaluated with no lua callbacks
+local sym_expr = rspamd_expression.create('SYM1 & !SYM2', {}, rspamd_config:get_mempool())
  */
 LUA_FUNCTION_DEF (expr, create);
 
@@ -82,9 +89,31 @@ LUA_FUNCTION_DEF (expr, process_traced);
  */
 LUA_FUNCTION_DEF (expr, atoms);
 
+/***
+ * @method rspamd_expression:add_symbol_atom(name)
+ * Registers atom that is true when a task has the symbol with the same name,
+ * such atoms are processed with no lua callbacks
+ * @param {string} name atom name
+ */
+LUA_FUNCTION_DEF (expr, add_symbol_atom);
+
+/***
+ * @method rspamd_expression:add_regexp_atom(name, re, type, [header], [strong])
+ * Registers atom that is matched natively by the regexp cache. Regexp must be
+ * registered by `rspamd_config:register_regexp` with the same type and header
+ * @param {string} name atom name
+ * @param {regexp} re regexp object
+ * @param {string} type regexp type (e.g. `header`, `mime`, `body`)
+ * @param {string} header header name for header regexps
+ * @param {boolean} strong case sensitive match of header name
+ */
+LUA_FUNCTION_DEF (expr, add_regexp_atom);
+
 static const struct luaL_reg exprlib_m[] = {
 	LUA_INTERFACE_DEF (expr, to_string),
 	LUA_INTERFACE_DEF (expr, atoms),
+	LUA_INTERFACE_DEF (expr, add_symbol_atom),
+	LUA_INTERFACE_DEF (expr, add_regexp_atom),
 	LUA_INTERFACE_DEF (expr, process),
 	LUA_INTERFACE_DEF (expr, process_traced),
 	{"__tostring", lua_expr_to_string},
@@ -107,14 +136,46 @@ static const struct rspamd_atom_subr lua_atom_subr = {
 	.destroy = NULL
 };
 
+enum lua_expr_native_type {
+	LUA_EXPR_NATIVE_SYMBOL = 0,
+	LUA_EXPR_NATIVE_REGEXP,
+};
+
+/* Atom processed without calling lua */
+struct lua_expr_native {
+	enum lua_expr_native_type type;
+	gchar *symbol;
+	rspamd_regexp_t *re;
+	enum rspamd_re_type re_type;
+	gchar *header;
+	gboolean strong;
+};
+
 struct lua_expression {
 	struct rspamd_expression *expr;
 	gint parse_idx;
 	gint process_idx;
 	lua_State *L;
 	rspamd_mempool_t *pool;
+	GHashTable *natives;
+};
+
+struct lua_expr_atom {
+	struct lua_expression *e;
+	struct lua_expr_native *native;
+	gboolean resolved;
 };
 
+/* Passed to atoms as input */
+struct lua_expr_process_cbdata {
+	lua_State *L;
+	gint idx;
+	struct rspamd_task *task;
+};
+
+static struct lua_expr_native * lua_expr_add_native (struct lua_expression *e,
+		const gchar *name, enum lua_expr_native_type type);
+
 static GQuark
 lua_expr_quark (void)
 {
@@ -136,8 +197,32 @@ lua_atom_parse (const gchar *line, gsize len,
 {
 	struct lua_expression *e = (struct lua_expression *)ud;
 	rspamd_expression_atom_t *atom;
+	struct lua_expr_atom *data;
 	gsize rlen;
-	const gchar *tok;
+	const gchar *tok, *p = line, *end = line + len;
+
+	data = rspamd_mempool_alloc0 (e->pool, sizeof (*data));
+	data->e = e;
+
+	if (e->parse_idx == -1) {
+		/* Default parser: atom lasts till the next space or operator */
+		while (p < end && strchr (", \t()><+!|&\n", *p) == NULL) {
+			p ++;
+		}
+
+		if (p == line) {
+			g_set_error (err, lua_expr_quark(), 500, "empty atom");
+			return NULL;
+		}
+
+		atom = rspamd_mempool_alloc0 (e->pool, sizeof (*atom));
+		atom->str = rspamd_mempool_alloc (e->pool, p - line + 1);
+		rspamd_strlcpy ((gchar *)atom->str, line, p - line + 1);
+		atom->len = p - line;
+		atom->data = data;
+
+		return atom;
+	}
 
 	lua_rawgeti (e->L, LUA_REGISTRYINDEX, e->parse_idx);
 	lua_pushlstring (e->L, line, len);
@@ -158,30 +243,76 @@ lua_atom_parse (const gchar *line, gsize len,
 	atom = rspamd_mempool_alloc0 (e->pool, sizeof (*atom));
 	atom->str = rspamd_mempool_strdup (e->pool, tok);
 	atom->len = rlen;
-	atom->data = ud;
+	atom->data = data;
 
 	lua_pop (e->L, 1);
 
 	return atom;
 }
 
+static gint
+lua_atom_process_native (struct rspamd_task *task,
+		struct lua_expr_native *native)
+{
+	struct rspamd_metric_result *mres;
+
+	switch (native->type) {
+	case LUA_EXPR_NATIVE_SYMBOL:
+		mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
+
+		if (mres && g_hash_table_lookup (mres->symbols, native->symbol)) {
+			return 1;
+		}
+		break;
+	case LUA_EXPR_NATIVE_REGEXP:
+		return rspamd_re_cache_process (task, native->re, native->re_type,
+				native->header, native->header ? strlen (native->header) : 0,
+				native->strong);
+	}
+
+	return 0;
+}
+
 static gint
 lua_atom_process (gpointer input, rspamd_expression_atom_t *atom)
 {
-	struct lua_expression *e = (struct lua_expression *)atom->data;
+	struct lua_expr_atom *data = atom->data;
+	struct lua_expression *e = data->e;
+	struct lua_expr_process_cbdata *cbd = input;
+	lua_State *L = cbd->L;
 	gint ret = 0;
 
-	lua_rawgeti (e->L, LUA_REGISTRYINDEX, e->process_idx);
-	lua_pushlstring (e->L, atom->str, atom->len);
-	lua_pushvalue (e->L, GPOINTER_TO_INT (input));
+	if (!data->resolved) {
+		data->native = g_hash_table_lookup (e->natives, atom->str);
 
-	if (lua_pcall (e->L, 2, 1, 0) != 0) {
-		msg_info ("callback call failed: %s", lua_tostring (e->L, -1));
-		lua_pop (e->L, 1);
+		if (data->native == NULL && e->process_idx == -1) {
+			/* No lua callback, so this atom is a symbol */
+			data->native = lua_expr_add_native (e, atom->str,
+					LUA_EXPR_NATIVE_SYMBOL);
+		}
+
+		data->resolved = TRUE;
+	}
+
+	if (data->native && cbd->task) {
+		return lua_atom_process_native (cbd->task, data->native);
+	}
+
+	if (e->process_idx == -1) {
+		return 0;
+	}
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, e->process_idx);
+	lua_pushlstring (L, atom->str, atom->len);
+	lua_pushvalue (L, cbd->idx);
+
+	if (lua_pcall (L, 2, 1, 0) != 0) {
+		msg_info ("callback call failed: %s", lua_tostring (L, -1));
+		lua_pop (L, 1);
 	}
 	else {
-		ret = lua_tonumber (e->L, -1);
-		lua_pop (e->L, 1);
+		ret = lua_tonumber (L, -1);
+		lua_pop (L, 1);
 	}
 
 	return ret;
@@ -191,6 +322,7 @@ static gint
 lua_expr_process (lua_State *L)
 {
 	struct lua_expression *e = rspamd_lua_expression (L, 1);
+	struct lua_expr_process_cbdata cbd;
 	gint res;
 	gint flags = 0;
 
@@ -198,7 +330,10 @@ lua_expr_process (lua_State *L)
 		flags = lua_tonumber (L, 3);
 	}
 
-	res = rspamd_process_expression (e->expr, flags, GINT_TO_POINTER (2));
+	cbd.L = L;
+	cbd.idx = 2;
+	cbd.task = lua_check_task_maybe (L, 2);
+	res = rspamd_process_expression (e->expr, flags, &cbd);
 
 	lua_pushnumber (L, res);
 
@@ -209,6 +344,7 @@ static gint
 lua_expr_process_traced (lua_State *L)
 {
 	struct lua_expression *e = rspamd_lua_expression (L, 1);
+	struct lua_expr_process_cbdata cbd;
 	rspamd_expression_atom_t *atom;
 	gint res;
 	guint i;
@@ -219,9 +355,11 @@ lua_expr_process_traced (lua_State *L)
 		flags = lua_tonumber (L, 3);
 	}
 
+	cbd.L = L;
+	cbd.idx = 2;
+	cbd.task = lua_check_task_maybe (L, 2);
 	trace = g_ptr_array_sized_new (32);
-	res = rspamd_process_expression_track (e->expr, flags, GINT_TO_POINTER (2),
-			trace);
+	res = rspamd_process_expression_track (e->expr, flags, &cbd, trace);
 
 	lua_pushnumber (L, res);
 
@@ -259,12 +397,12 @@ lua_expr_create (lua_State *L)
 		line = lua_tolstring (L, 1, &len);
 		pool = rspamd_lua_check_mempool (L, 3);
 
-		/* Check callbacks */
+		/* Check callbacks, both are optional */
 		lua_pushvalue (L, 2);
 		lua_pushnumber (L, 1);
 		lua_gettable (L, -2);
 
-		if (lua_type (L, -1) != LUA_TFUNCTION) {
+		if (lua_type (L, -1) != LUA_TFUNCTION && !lua_isnil (L, -1)) {
 			lua_pop (L, 2);
 			lua_pushnil (L);
 			lua_pushstring (L, "bad parse callback");
@@ -277,7 +415,7 @@ lua_expr_create (lua_State *L)
 		lua_pushnumber (L, 2);
 		lua_gettable (L, -2);
 
-		if (lua_type (L, -1) != LUA_TFUNCTION) {
+		if (lua_type (L, -1) != LUA_TFUNCTION && !lua_isnil (L, -1)) {
 			lua_pop (L, 2);
 			lua_pushnil (L);
 			lua_pushstring (L, "bad process callback");
@@ -290,17 +428,47 @@ lua_expr_create (lua_State *L)
 		/* Table is still on the top of stack */
 
 		e = rspamd_mempool_alloc (pool, sizeof (*e));
-		e->L = L;
+		e->L = rspamd_lua_main_state (L);
 		e->pool = pool;
+		e->parse_idx = -1;
+		e->process_idx = -1;
+		e->natives = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+		rspamd_mempool_add_destructor (pool,
+				(rspamd_mempool_destruct_t)g_hash_table_unref, e->natives);
 
 		lua_pushnumber (L, 1);
 		lua_gettable (L, -2);
-		e->parse_idx = luaL_ref (L, LUA_REGISTRYINDEX);
+
+		if (lua_type (L, -1) == LUA_TFUNCTION) {
+			e->parse_idx = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+		else {
+			lua_pop (L, 1);
+		}
 
 		lua_pushnumber (L, 2);
 		lua_gettable (L, -2);
-		e->process_idx = luaL_ref (L, LUA_REGISTRYINDEX);
-		lua_pop (L, 1); /* Table */
+
+		if (lua_type (L, -1) == LUA_TFUNCTION) {
+			e->process_idx = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+		else {
+			lua_pop (L, 1);
+		}
+
+		lua_pushstring (L, "symbols");
+		lua_gettable (L, -2);
+
+		if (lua_type (L, -1) == LUA_TTABLE) {
+			for (lua_pushnil (L); lua_next (L, -2); lua_pop (L, 1)) {
+				if (lua_type (L, -1) == LUA_TSTRING) {
+					lua_expr_add_native (e, lua_tostring (L, -1),
+							LUA_EXPR_NATIVE_SYMBOL);
+				}
+			}
+		}
+
+		lua_pop (L, 2); /* Symbols and table */
 
 		if (!rspamd_parse_expression (line, len, &lua_atom_subr, e, pool, &err,
 				&e->expr)) {
@@ -320,6 +488,76 @@ lua_expr_create (lua_State *L)
 	return 2;
 }
 
+static struct lua_expr_native *
+lua_expr_add_native (struct lua_expression *e, const gchar *name,
+		enum lua_expr_native_type type)
+{
+	struct lua_expr_native *native;
+
+	native = rspamd_mempool_alloc0 (e->pool, sizeof (*native));
+	native->type = type;
+
+	if (type == LUA_EXPR_NATIVE_SYMBOL) {
+		native->symbol = rspamd_mempool_strdup (e->pool, name);
+	}
+
+	g_hash_table_insert (e->natives, rspamd_mempool_strdup (e->pool, name),
+			native);
+
+	return native;
+}
+
+static gint
+lua_expr_add_symbol_atom (lua_State *L)
+{
+	struct lua_expression *e = rspamd_lua_expression (L, 1);
+	const gchar *name = luaL_checkstring (L, 2);
+
+	if (e == NULL || name == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_expr_add_native (e, name, LUA_EXPR_NATIVE_SYMBOL);
+
+	return 0;
+}
+
+static gint
+lua_expr_add_regexp_atom (lua_State *L)
+{
+	struct lua_expression *e = rspamd_lua_expression (L, 1);
+	const gchar *name = luaL_checkstring (L, 2), *type = luaL_checkstring (L, 4);
+	struct rspamd_lua_regexp **pre;
+	struct lua_expr_native *native;
+	gint re_type;
+
+	pre = rspamd_lua_check_udata (L, 3, "rspamd{regexp}");
+
+	if (e == NULL || name == NULL || pre == NULL || type == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	re_type = rspamd_re_cache_type_from_string (type);
+
+	if (re_type == RSPAMD_RE_MAX) {
+		return luaL_error (L, "invalid regexp type: %s", type);
+	}
+
+	native = lua_expr_add_native (e, name, LUA_EXPR_NATIVE_REGEXP);
+	native->re = rspamd_regexp_ref ((*pre)->re);
+	rspamd_mempool_add_destructor (e->pool,
+			(rspamd_mempool_destruct_t)rspamd_regexp_unref, native->re);
+	native->re_type = re_type;
+
+	if (lua_type (L, 5) == LUA_TSTRING) {
+		native->header = rspamd_mempool_strdup (e->pool, lua_tostring (L, 5));
+	}
+
+	native->strong = lua_toboolean (L, 6);
+
+	return 0;
+}
+
 static gint
 lua_expr_to_string (lua_State *L)
 {
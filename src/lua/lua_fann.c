@@ -43,6 +43,7 @@ LUA_FUNCTION_DEF (fann, load_data);
 LUA_FUNCTION_DEF (fann, train);
 LUA_FUNCTION_DEF (fann, train_threaded);
 LUA_FUNCTION_DEF (fann, test);
+LUA_FUNCTION_DEF (fann, test_batch);
 LUA_FUNCTION_DEF (fann, save);
 LUA_FUNCTION_DEF (fann, data);
 LUA_FUNCTION_DEF (fann, get_inputs);
@@ -65,6 +66,7 @@ static const struct luaL_reg fannlib_m[] = {
 		LUA_INTERFACE_DEF (fann, train),
 		LUA_INTERFACE_DEF (fann, train_threaded),
 		LUA_INTERFACE_DEF (fann, test),
+		LUA_INTERFACE_DEF (fann, test_batch),
 		LUA_INTERFACE_DEF (fann, save),
 		LUA_INTERFACE_DEF (fann, data),
 		LUA_INTERFACE_DEF (fann, get_inputs),
@@ -585,6 +587,7 @@ struct lua_fann_train_cbdata {
 	struct fann_train_data *train;
 	struct fann *f;
 	gint cbref;
+	gint fref;
 	gdouble desired_mse;
 	guint max_epochs;
 	GThread *t;
@@ -637,6 +640,7 @@ lua_fann_thread_notify (gint fd, short what, gpointer ud)
 
 	fann_destroy_train (cbdata->train);
 	luaL_unref (cbdata->L, LUA_REGISTRYINDEX, cbdata->cbref);
+	luaL_unref (cbdata->L, LUA_REGISTRYINDEX, cbdata->fref);
 	g_slice_free1 (sizeof (*cbdata), cbdata);
 }
 
@@ -702,11 +706,14 @@ lua_fann_train_threaded (lua_State *L)
 		ninputs = fann_get_num_input (f);
 		noutputs = fann_get_num_output (f);
 		cbdata = g_slice_alloc0 (sizeof (*cbdata));
-		cbdata->L = L;
+		cbdata->L = rspamd_lua_main_state (L);
 		cbdata->f = f;
 		cbdata->train = rspamd_fann_create_train (ndata, ninputs, noutputs);
 		lua_pushvalue (L, 4);
 		cbdata->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+		/* Network must not be collected while the thread is training it */
+		lua_pushvalue (L, 1);
+		cbdata->fref = luaL_ref (L, LUA_REGISTRYINDEX);
 
 		if (rspamd_socketpair (cbdata->pair) == -1) {
 			msg_err ("cannot open socketpair: %s", strerror (errno));
@@ -749,8 +756,8 @@ lua_fann_train_threaded (lua_State *L)
 		cbdata->max_epochs = max_epochs_default;
 		cbdata->desired_mse = desired_mse_default;
 
-		if (lua_type (L, 5) == LUA_TTABLE) {
-			rspamd_lua_parse_table_arguments (L, 5, NULL,
+		if (lua_type (L, 6) == LUA_TTABLE) {
+			rspamd_lua_parse_table_arguments (L, 6, NULL,
 					"max_epochs=I;desired_mse=N",
 					&cbdata->max_epochs, &cbdata->desired_mse);
 		}
@@ -791,6 +798,7 @@ err:
 
 	fann_destroy_train (cbdata->train);
 	luaL_unref (L, LUA_REGISTRYINDEX, cbdata->cbref);
+	luaL_unref (L, LUA_REGISTRYINDEX, cbdata->fref);
 	g_slice_free1 (sizeof (*cbdata), cbdata);
 	return luaL_error (L, "invalid arguments");
 #endif
@@ -858,6 +866,74 @@ lua_fann_test (lua_State *L)
 #endif
 }
 
+/**
+ * @method rspamd_fann:test_batch(inputs)
+ * Runs neural network on many samples at once. Samples are copied to a single
+ * contiguous buffer, so the per call overhead is amortized, e.g.:
+ *     {{0, 1, 1}, {1, 0, 0}} -> {{0}, {1}}
+ * @param {table} inputs table of input samples
+ * @return {table} table of outputs values for each sample
+ */
+static gint
+lua_fann_test_batch (lua_State *L)
+{
+#ifndef WITH_FANN
+	return 0;
+#else
+	struct fann *f = rspamd_lua_check_fann (L, 1);
+	guint ninputs, noutputs, nsamples, i, j;
+	fann_type *inputs, *cur_output;
+
+	if (f != NULL && lua_type (L, 2) == LUA_TTABLE) {
+		ninputs = fann_get_num_input (f);
+		noutputs = fann_get_num_output (f);
+		nsamples = rspamd_lua_table_size (L, 2);
+		inputs = g_malloc0 (MAX (nsamples, 1) * ninputs * sizeof (fann_type));
+
+		for (i = 0; i < nsamples; i ++) {
+			lua_rawgeti (L, 2, i + 1);
+
+			if (lua_type (L, -1) != LUA_TTABLE ||
+					rspamd_lua_table_size (L, -1) != ninputs) {
+				g_free (inputs);
+
+				return luaL_error (L, "invalid number of inputs in sample %d: "
+						"%d expected", i + 1, ninputs);
+			}
+
+			for (j = 0; j < ninputs; j ++) {
+				lua_rawgeti (L, -1, j + 1);
+				inputs[i * ninputs + j] = lua_tonumber (L, -1);
+				lua_pop (L, 1);
+			}
+
+			lua_pop (L, 1);
+		}
+
+		lua_createtable (L, nsamples, 0);
+
+		for (i = 0; i < nsamples; i ++) {
+			cur_output = fann_run (f, &inputs[i * ninputs]);
+			lua_createtable (L, noutputs, 0);
+
+			for (j = 0; j < noutputs; j ++) {
+				lua_pushnumber (L, cur_output[j]);
+				lua_rawseti (L, -2, j + 1);
+			}
+
+			lua_rawseti (L, -2, i + 1);
+		}
+
+		g_free (inputs);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+#endif
+}
+
 /***
  * @method rspamd_fann:get_inputs()
  * Returns number of inputs for neural network
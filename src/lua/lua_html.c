@@ -18,7 +18,7 @@
 #include "html.h"
 #include "html_tags.h"
 #include "images.h"
-#include "contrib/mumhash/mum.h"
+#include "cryptobox.h"
 
 /***
  * @module rspamd_html
@@ -403,13 +403,13 @@ struct lua_html_traverse_ud {
 };
 
 static gboolean
-lua_html_node_foreach_cb (GNode *n, gpointer d)
+lua_html_node_foreach_cb (struct html_tag *tag, gpointer d)
 {
 	struct lua_html_traverse_ud *ud = d;
-	struct html_tag *tag = n->data, **ptag;
+	struct html_tag **ptag;
 
 	if (tag && (ud->any || g_hash_table_lookup (ud->tags,
-			GSIZE_TO_POINTER (mum_hash64 (tag->id, 0))))) {
+			GSIZE_TO_POINTER (rspamd_cryptobox_fast_hash_u64 (tag->id, 0))))) {
 
 		lua_rawgeti (ud->L, LUA_REGISTRYINDEX, ud->cbref);
 
@@ -442,6 +442,7 @@ lua_html_foreach_tag (lua_State *L)
 	struct lua_html_traverse_ud ud;
 	const gchar *tagname;
 	gint id;
+	guint i;
 
 	ud.tags = g_hash_table_new (g_direct_hash, g_direct_equal);
 	ud.any = FALSE;
@@ -458,7 +459,7 @@ lua_html_foreach_tag (lua_State *L)
 				g_hash_table_unref (ud.tags);
 				return luaL_error (L, "invalid tagname: %s", tagname);
 			}
-			g_hash_table_insert (ud.tags, GSIZE_TO_POINTER (mum_hash64 (id, 0)),
+			g_hash_table_insert (ud.tags, GSIZE_TO_POINTER (rspamd_cryptobox_fast_hash_u64 (id, 0)),
 					"1");
 		}
 	}
@@ -478,7 +479,7 @@ lua_html_foreach_tag (lua_State *L)
 					return luaL_error (L, "invalid tagname: %s", tagname);
 				}
 				g_hash_table_insert (ud.tags,
-						GSIZE_TO_POINTER (mum_hash64 (id, 0)), "1");
+						GSIZE_TO_POINTER (rspamd_cryptobox_fast_hash_u64 (id, 0)), "1");
 			}
 		}
 
@@ -492,8 +493,13 @@ lua_html_foreach_tag (lua_State *L)
 			ud.cbref = luaL_ref (L, LUA_REGISTRYINDEX);
 			ud.L = L;
 
-			g_node_traverse (hc->html_tags, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
-					lua_html_node_foreach_cb, &ud);
+			/* Tags are stored in document order, i.e. tree pre-order */
+			for (i = 0; i < hc->html_tags->len; i ++) {
+				if (lua_html_node_foreach_cb (
+						g_ptr_array_index (hc->html_tags, i), &ud)) {
+					break;
+				}
+			}
 
 			luaL_unref (L, LUA_REGISTRYINDEX, ud.cbref);
 		}
@@ -535,16 +541,16 @@ static gint
 lua_html_tag_get_parent (lua_State *L)
 {
 	struct html_tag *tag = lua_check_html_tag (L, 1), **ptag;
-	GNode *node;
 
 	if (tag != NULL) {
-		node = tag->parent;
-
-		if (node && node->data) {
+		if (tag->parent) {
 			ptag = lua_newuserdata (L, sizeof (gpointer));
-			*ptag = node->data;
+			*ptag = tag->parent;
 			rspamd_lua_setclass (L, "rspamd{html_tag}", -1);
 		}
+		else {
+			lua_pushnil (L);
+		}
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
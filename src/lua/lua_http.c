@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 #include "lua_common.h"
+#include "lua_thread_pool.h"
 #include "http_private.h"
 #include "unix-std.h"
 
@@ -73,6 +74,7 @@ struct lua_http_cbdata {
 	gint fd;
 	gint cbref;
 	gint bodyref;
+	struct thread_entry *thread;
 };
 
 static const int default_http_timeout = 5000;
@@ -146,6 +148,16 @@ lua_http_maybe_free (struct lua_http_cbdata *cbd)
 static void
 lua_http_push_error (struct lua_http_cbdata *cbd, const char *err)
 {
+	struct thread_entry *thread = cbd->thread;
+
+	if (thread) {
+		cbd->thread = NULL;
+		lua_pushstring (thread->lua_state, err);
+		lua_thread_resume (thread, 1);
+
+		return;
+	}
+
 	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	lua_pushstring (cbd->L, err);
 
@@ -172,44 +184,57 @@ lua_http_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_header *h, *htmp;
 	const gchar *body;
 	gsize body_len;
+	struct thread_entry *thread = cbd->thread;
+	lua_State *L;
+
+	if (thread) {
+		cbd->thread = NULL;
+		L = thread->lua_state;
+	}
+	else {
+		L = cbd->L;
+		lua_rawgeti (L, LUA_REGISTRYINDEX, cbd->cbref);
+	}
 
-	lua_rawgeti (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	/* Error */
-	lua_pushnil (cbd->L);
+	lua_pushnil (L);
 	/* Reply code */
-	lua_pushnumber (cbd->L, msg->code);
+	lua_pushnumber (L, msg->code);
 	/* Body */
 	body = rspamd_http_message_get_body (msg, &body_len);
 
 	if (cbd->flags & RSPAMD_LUA_HTTP_FLAG_TEXT) {
 		struct rspamd_lua_text *t;
 
-		t = lua_newuserdata (cbd->L, sizeof (*t));
-		rspamd_lua_setclass (cbd->L, "rspamd{text}", -1);
+		t = lua_newuserdata (L, sizeof (*t));
+		rspamd_lua_setclass (L, "rspamd{text}", -1);
 		t->start = body;
 		t->len = body_len;
 		t->flags = 0;
 	}
 	else {
 		if (body_len > 0) {
-			lua_pushlstring (cbd->L, body, body_len);
+			lua_pushlstring (L, body, body_len);
 		}
 		else {
-			lua_pushnil (cbd->L);
+			lua_pushnil (L);
 		}
 	}
 	/* Headers */
-	lua_newtable (cbd->L);
+	lua_newtable (L);
 
 	HASH_ITER (hh, msg->headers, h, htmp) {
-		lua_pushlstring (cbd->L, h->name->begin, h->name->len);
-		lua_pushlstring (cbd->L, h->value->begin, h->value->len);
-		lua_settable (cbd->L, -3);
+		lua_pushlstring (L, h->name->begin, h->name->len);
+		lua_pushlstring (L, h->value->begin, h->value->len);
+		lua_settable (L, -3);
 	}
 
-	if (lua_pcall (cbd->L, 4, 0, 0) != 0) {
-		msg_info ("callback call failed: %s", lua_tostring (cbd->L, -1));
-		lua_pop (cbd->L, 1);
+	if (thread) {
+		lua_thread_resume (thread, 4);
+	}
+	else if (lua_pcall (L, 4, 0, 0) != 0) {
+		msg_info ("callback call failed: %s", lua_tostring (L, -1));
+		lua_pop (L, 1);
 	}
 
 	lua_http_maybe_free (cbd);
@@ -340,13 +365,16 @@ lua_http_push_headers (lua_State *L, struct rspamd_http_message *msg)
  * @param {string/text} body full body content, can be opaque `rspamd{text}` to avoid data copying
  * @param {number} timeout floating point request timeout value in seconds (default is 5.0 seconds)
  * @return {boolean} `true` if a request has been successfuly scheduled. If this value is `false` then some error occurred, the callback thus will not be called
+ *
+ * If `callback` is omitted for a request made with `task` from a symbol callback, then the symbol is suspended
+ * until the request is completed and `err_message, code, body, headers` are returned instead
  */
 static gint
 lua_http_request (lua_State *L)
 {
 	const gchar *url, *lua_body;
 	gchar *to_resolve;
-	gint cbref;
+	gint cbref = -1;
 	gsize bodylen;
 	struct event_base *ev_base;
 	struct rspamd_http_message *msg;
@@ -356,6 +384,7 @@ lua_http_request (lua_State *L)
 	struct rspamd_lua_text *t;
 	struct rspamd_task *task = NULL;
 	struct rspamd_config *cfg = NULL;
+	struct thread_entry *thread = NULL;
 	struct rspamd_cryptobox_pubkey *peer_key = NULL;
 	struct rspamd_cryptobox_keypair *local_kp = NULL;
 	gdouble timeout = default_http_timeout;
@@ -407,16 +436,6 @@ lua_http_request (lua_State *L)
 		url = luaL_checkstring (L, -1);
 		lua_pop (L, 1);
 
-		lua_pushstring (L, "callback");
-		lua_gettable (L, 1);
-		if (url == NULL || lua_type (L, -1) != LUA_TFUNCTION) {
-			lua_pop (L, 1);
-			msg_err ("http request has bad params");
-			lua_pushboolean (L, FALSE);
-			return 1;
-		}
-		cbref = luaL_ref (L, LUA_REGISTRYINDEX);
-
 		lua_pushstring (L, "task");
 		lua_gettable (L, 1);
 
@@ -429,6 +448,28 @@ lua_http_request (lua_State *L)
 		}
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "callback");
+		lua_gettable (L, 1);
+
+		if (lua_type (L, -1) == LUA_TFUNCTION) {
+			cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+		else {
+			lua_pop (L, 1);
+
+			/* Request without callback suspends the calling coroutine */
+			if (task) {
+				thread = lua_thread_pool_get_running_entry (
+						task->cfg->lua_thread_pool, L);
+			}
+		}
+
+		if (url == NULL || (cbref == -1 && thread == NULL)) {
+			msg_err ("http request has bad params");
+			lua_pushboolean (L, FALSE);
+			return 1;
+		}
+
 		if (task == NULL) {
 			lua_pushstring (L, "ev_base");
 			lua_gettable (L, 1);
@@ -592,8 +633,9 @@ lua_http_request (lua_State *L)
 	}
 
 	cbd = g_slice_alloc0 (sizeof (*cbd));
-	cbd->L = L;
+	cbd->L = rspamd_lua_main_state (L);
 	cbd->cbref = cbref;
+	cbd->thread = thread;
 	cbd->msg = msg;
 	cbd->ev_base = ev_base;
 	cbd->mime_type = mime_type;
@@ -615,8 +657,16 @@ lua_http_request (lua_State *L)
 				(event_finalizer_t)lua_http_fin,
 				cbd,
 				g_quark_from_static_string ("lua http"));
-		cbd->w = rspamd_session_get_watcher (session);
-		rspamd_session_watcher_push (session);
+
+		if (thread) {
+			/* Symbol watcher is not active when a coroutine is resumed */
+			cbd->w = thread->w;
+			rspamd_session_watcher_push_specific (session, cbd->w);
+		}
+		else {
+			cbd->w = rspamd_session_get_watcher (session);
+			rspamd_session_watcher_push (session);
+		}
 	}
 
 	if (rspamd_parse_inet_address (&cbd->addr, msg->host->str, msg->host->len)) {
@@ -658,6 +708,10 @@ lua_http_request (lua_State *L)
 		}
 	}
 
+	if (thread) {
+		return lua_thread_yield (thread, 0);
+	}
+
 	lua_pushboolean (L, TRUE);
 	return 1;
 }
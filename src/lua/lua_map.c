@@ -17,6 +17,7 @@
 #include "lua_common.h"
 #include "libutil/map.h"
 #include "libutil/map_private.h"
+#include "libutil/map_compiled.h"
 
 /***
  * This module is used to manage rspamd maps and map like objects
@@ -31,12 +32,22 @@
  * - For hash maps it returns boolean and accepts string
  * - For kv maps it returns string (or nil) and accepts string
  * - For radix maps it returns boolean and accepts IP address (as object, string or number)
+ * - For compiled maps it works as for kv or radix maps depending on the map type
  *
  * @param {vary} in input to check
  * @return {bool|string} if a value is found then this function returns string or `True` if not - then it returns `nil` or `False`
  */
 LUA_FUNCTION_DEF (map, get_key);
 
+/***
+ * @method map:get_keys(addrs)
+ * Looks up many IP addresses in a radix map at once, which is cheaper than
+ * calling `get_key` for each address (e.g. for all Received headers IPs)
+ * @param {table} addrs array of IP addresses (as objects or strings)
+ * @return {table} array of values where misses are set to `False`
+ */
+LUA_FUNCTION_DEF (map, get_keys);
+
 
 /***
  * @method map:is_signed()
@@ -86,6 +97,7 @@ LUA_FUNCTION_DEF (map, get_uri);
 
 static const struct luaL_reg maplib_m[] = {
 	LUA_INTERFACE_DEF (map, get_key),
+	LUA_INTERFACE_DEF (map, get_keys),
 	LUA_INTERFACE_DEF (map, is_signed),
 	LUA_INTERFACE_DEF (map, get_proto),
 	LUA_INTERFACE_DEF (map, get_sign_key),
@@ -480,6 +492,28 @@ lua_config_add_map (lua_State *L)
 				return 1;
 			}
 		}
+		else if (strcmp (type, "compiled_hash") == 0 ||
+				strcmp (type, "compiled_radix") == 0) {
+			gboolean is_radix = (type[9] == 'r');
+
+			map = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*map));
+			map->data.compiled = NULL;
+			map->type = RSPAMD_LUA_MAP_COMPILED;
+
+			if ((m = rspamd_map_add_from_ucl (cfg, map_obj, description,
+					is_radix ? rspamd_compiled_radix_read :
+							rspamd_compiled_hash_read,
+					rspamd_compiled_map_fin,
+					(void **)&map->data.compiled)) == NULL) {
+				lua_pushnil (L);
+				ucl_object_unref (map_obj);
+
+				return 1;
+			}
+
+			rspamd_map_set_load_callback (m, is_radix ?
+					rspamd_compiled_radix_load : rspamd_compiled_hash_load);
+		}
 		else {
 			ret = luaL_error (L, "invalid arguments: unknown type '%s'", type);
 			ucl_object_unref (map_obj);
@@ -521,6 +555,104 @@ lua_map_process_string_key (lua_State *L, gint pos, gsize *len)
 	return NULL;
 }
 
+gboolean
+rspamd_lua_map_lookup (struct rspamd_lua_map *map,
+		const gchar *key, gsize len, rspamd_inet_addr_t *addr,
+		const gchar **value, gsize *vlen)
+{
+	const gchar *v = NULL;
+	const guchar *raw;
+	guint klen = 0;
+	guintptr p;
+	gsize vl = 0;
+
+	g_assert (map != NULL);
+
+	switch (map->type) {
+	case RSPAMD_LUA_MAP_RADIX:
+		if (addr && map->data.radix) {
+			p = radix_find_compressed_addr (map->data.radix, addr);
+
+			if (p != RADIX_NO_VALUE) {
+				v = (const gchar *)p;
+				vl = v ? strlen (v) : 0;
+				break;
+			}
+		}
+
+		return FALSE;
+	case RSPAMD_LUA_MAP_SET:
+		if (key && map->data.hash &&
+				g_hash_table_lookup (map->data.hash, key) != NULL) {
+			break;
+		}
+
+		if (key && rspamd_map_cdb_lookup (map->map, key, len, NULL, NULL)) {
+			break;
+		}
+
+		return FALSE;
+	case RSPAMD_LUA_MAP_HASH:
+		if (key && map->data.hash) {
+			v = g_hash_table_lookup (map->data.hash, key);
+		}
+
+		if (v == NULL) {
+			if (key && rspamd_map_cdb_lookup (map->map, key, len, &v, &vl)) {
+				break;
+			}
+
+			return FALSE;
+		}
+
+		vl = strlen (v);
+		break;
+	case RSPAMD_LUA_MAP_REGEXP:
+		if (key && map->data.re_map) {
+			v = rspamd_match_regexp_map (map->data.re_map, key, len);
+		}
+
+		if (v == NULL) {
+			return FALSE;
+		}
+
+		vl = strlen (v);
+		break;
+	case RSPAMD_LUA_MAP_COMPILED:
+		if (map->data.compiled == NULL) {
+			return FALSE;
+		}
+
+		if (rspamd_map_compiled_get_type (map->data.compiled) ==
+				RSPAMD_MAP_COMPILED_RADIX) {
+			if (addr) {
+				raw = rspamd_inet_address_get_hash_key (addr, &klen);
+				v = rspamd_map_compiled_lookup_addr (map->data.compiled,
+						raw, klen, &vl);
+			}
+		}
+		else if (key) {
+			v = rspamd_map_compiled_lookup (map->data.compiled, key, len, &vl);
+		}
+
+		if (v == NULL) {
+			return FALSE;
+		}
+		break;
+	default:
+		return FALSE;
+	}
+
+	if (value) {
+		*value = v;
+	}
+	if (vlen) {
+		*vlen = vl;
+	}
+
+	return TRUE;
+}
+
 /* Radix and hash table functions */
 static gint
 lua_map_get_key (lua_State * L)
@@ -535,8 +667,11 @@ lua_map_get_key (lua_State * L)
 	gboolean ret = FALSE;
 
 	if (map) {
-		if (map->type == RSPAMD_LUA_MAP_RADIX) {
-			radix = map->data.radix;
+		if (map->type == RSPAMD_LUA_MAP_RADIX ||
+				(map->type == RSPAMD_LUA_MAP_COMPILED && map->data.compiled &&
+				rspamd_map_compiled_get_type (map->data.compiled) ==
+						RSPAMD_MAP_COMPILED_RADIX)) {
+			radix = map->type == RSPAMD_LUA_MAP_RADIX ? map->data.radix : NULL;
 
 			if (lua_type (L, 2) == LUA_TSTRING) {
 				const gchar *addr_str;
@@ -593,6 +728,22 @@ lua_map_get_key (lua_State * L)
 
 				value = (const char *)p;
 			}
+			else if (map->type == RSPAMD_LUA_MAP_COMPILED) {
+				const guchar *raw;
+				guint klen = 0;
+
+				if (addr != NULL) {
+					raw = rspamd_inet_address_get_hash_key (addr->addr, &klen);
+					value = rspamd_map_compiled_lookup_addr (map->data.compiled,
+							raw, klen, NULL);
+				}
+				else if (key_num != 0) {
+					value = rspamd_map_compiled_lookup_addr (map->data.compiled,
+							(const guchar *)&key_num, sizeof (key_num), NULL);
+				}
+
+				ret = value != NULL;
+			}
 
 			if (ret) {
 				lua_pushstring (L, value);
@@ -605,6 +756,10 @@ lua_map_get_key (lua_State * L)
 			if (key && map->data.hash) {
 				ret = g_hash_table_lookup (map->data.hash, key) != NULL;
 			}
+
+			if (key && !ret) {
+				ret = rspamd_map_cdb_lookup (map->map, key, len, NULL, NULL);
+			}
 		}
 		else if (map->type == RSPAMD_LUA_MAP_REGEXP) {
 			key = lua_map_process_string_key (L, 2, &len);
@@ -630,6 +785,29 @@ lua_map_get_key (lua_State * L)
 				lua_pushstring (L, value);
 				return 1;
 			}
+			else if (key) {
+				gsize vlen;
+
+				if (rspamd_map_cdb_lookup (map->map, key, len, &value, &vlen)) {
+					lua_pushlstring (L, value, vlen);
+					return 1;
+				}
+			}
+		}
+		else if (map->type == RSPAMD_LUA_MAP_COMPILED) {
+			key = lua_map_process_string_key (L, 2, &len);
+
+			if (key && map->data.compiled) {
+				gsize vlen;
+
+				value = rspamd_map_compiled_lookup (map->data.compiled, key, len,
+						&vlen);
+
+				if (value) {
+					lua_pushlstring (L, value, vlen);
+					return 1;
+				}
+			}
 		}
 		else {
 			/* callback map or unknown type map */
@@ -645,6 +823,100 @@ lua_map_get_key (lua_State * L)
 	return 1;
 }
 
+static int
+lua_map_get_keys (lua_State *L)
+{
+	struct rspamd_lua_map *map = lua_check_map (L, 1);
+	struct rspamd_lua_ip *ip;
+	rspamd_inet_addr_t *tmp;
+	const guint8 **keys;
+	const guchar *raw;
+	const gchar *addr_str;
+	guint8 *storage;
+	gsize *keylens, len;
+	uintptr_t *values;
+	guint i, n, klen;
+	gpointer ud;
+
+	if (map == NULL || map->type != RSPAMD_LUA_MAP_RADIX ||
+			lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	n = rspamd_lua_table_size (L, 2);
+	lua_createtable (L, n, 0);
+
+	if (n == 0 || map->data.radix == NULL) {
+		for (i = 0; i < n; i ++) {
+			lua_pushboolean (L, FALSE);
+			lua_rawseti (L, -2, i + 1);
+		}
+
+		return 1;
+	}
+
+	keys = g_malloc (n * sizeof (*keys));
+	keylens = g_malloc0 (n * sizeof (*keylens));
+	values = g_malloc (n * sizeof (*values));
+	/* Keys parsed from strings are copied here */
+	storage = g_malloc (n * sizeof (struct in6_addr));
+	tmp = g_alloca (rspamd_inet_address_storage_size ());
+
+	for (i = 0; i < n; i ++) {
+		lua_rawgeti (L, 2, i + 1);
+		keys[i] = NULL;
+		raw = NULL;
+		klen = 0;
+
+		if (lua_type (L, -1) == LUA_TSTRING) {
+			addr_str = lua_tolstring (L, -1, &len);
+
+			if (rspamd_parse_inet_address_ip (addr_str, len, tmp)) {
+				raw = rspamd_inet_address_get_hash_key (tmp, &klen);
+			}
+		}
+		else if (lua_type (L, -1) == LUA_TUSERDATA) {
+			ud = rspamd_lua_check_udata (L, -1, "rspamd{ip}");
+
+			if (ud != NULL) {
+				ip = *((struct rspamd_lua_ip **)ud);
+
+				if (ip->addr) {
+					raw = rspamd_inet_address_get_hash_key (ip->addr, &klen);
+				}
+			}
+		}
+
+		if (raw && klen > 0 && klen <= sizeof (struct in6_addr)) {
+			memcpy (storage + i * sizeof (struct in6_addr), raw, klen);
+			keys[i] = storage + i * sizeof (struct in6_addr);
+			keylens[i] = klen;
+		}
+
+		lua_pop (L, 1);
+	}
+
+	radix_find_compressed_batch (map->data.radix, keys, keylens, n, values);
+
+	for (i = 0; i < n; i ++) {
+		if (values[i] != RADIX_NO_VALUE) {
+			lua_pushstring (L, (const gchar *)values[i]);
+		}
+		else {
+			lua_pushboolean (L, FALSE);
+		}
+
+		lua_rawseti (L, -2, i + 1);
+	}
+
+	g_free (keys);
+	g_free (keylens);
+	g_free (values);
+	g_free (storage);
+
+	return 1;
+}
+
 static int
 lua_map_is_signed (lua_State *L)
 {
@@ -700,6 +972,9 @@ lua_map_get_proto (lua_State *L)
 				case MAP_PROTO_HTTPS:
 					ret = "https";
 					break;
+				case MAP_PROTO_CDB:
+					ret = "cdb";
+					break;
 				}
 				lua_pushstring (L, ret);
 			}
@@ -181,7 +181,7 @@ lua_mempool_add_destructor (lua_State *L)
 			lua_pushvalue (L, 2);
 			/* Get a reference */
 			ud->cbref = luaL_ref (L, LUA_REGISTRYINDEX);
-			ud->L = L;
+			ud->L = rspamd_lua_main_state (L);
 			ud->mempool = mempool;
 			rspamd_mempool_add_destructor (mempool,
 				lua_mempool_destructor_func,
@@ -0,0 +1,610 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/***
+ * @module rspamd_meta_rules
+ * This module provides sets of rules that are evaluated natively: regexp
+ * rules are processed by the regexps cache, meta rules are expressions of
+ * other rules and of symbols. Lua functions could also be used as rules, so
+ * only they require lua calls. Atoms that are not rules of a set are treated
+ * as symbols. A meta rule could have the same name as a rule it checks, atoms
+ * are resolved to ordinary rules first and to meta rules then.
+ * @example
+local rspamd_meta_rules = require "rspamd_meta_rules"
+local rules = rspamd_meta_rules.create(rspamd_config)
+-- `re` should be registered with `rspamd_config:register_regexp`
+rules:add_regexp('__SUBJ_TEST', re, 'header', 'Subject')
+rules:add_meta('SUBJ_META', '__SUBJ_TEST && !R_SPF_ALLOW')
+rules:register_symbol('SUBJ_META', 1.0)
+ */
+
+#include "lua_common.h"
+#include "expression.h"
+#include "re_cache.h"
+
+enum lua_meta_rule_type {
+	LUA_META_RULE_REGEXP = 0,
+	LUA_META_RULE_FUNCTION,
+	LUA_META_RULE_META,
+};
+
+struct lua_meta_rules;
+
+struct lua_meta_rule {
+	gchar *name;
+	enum lua_meta_rule_type type;
+	union {
+		struct {
+			rspamd_regexp_t *re;
+			enum rspamd_re_type type;
+			gchar *header;
+			gboolean strong;
+			gboolean negate;
+		} re;
+		gint cbref;
+		struct rspamd_expression *expr;
+	} d;
+	struct lua_meta_rules *rules;
+};
+
+struct lua_meta_rules {
+	struct rspamd_config *cfg;
+	GHashTable *rules;
+	GHashTable *metas;
+	GHashTable *replacements;
+};
+
+/* Data of an atom, its rule is resolved on the first processing */
+struct lua_meta_atom {
+	struct lua_meta_rules *rules;
+	struct lua_meta_rule *rule;
+	const gchar *symbol;
+	gboolean resolved;
+};
+
+LUA_FUNCTION_DEF (meta_rules, create);
+LUA_FUNCTION_DEF (meta_rules, add_regexp);
+LUA_FUNCTION_DEF (meta_rules, add_function);
+LUA_FUNCTION_DEF (meta_rules, add_meta);
+LUA_FUNCTION_DEF (meta_rules, add_replacement);
+LUA_FUNCTION_DEF (meta_rules, has_rule);
+LUA_FUNCTION_DEF (meta_rules, atoms);
+LUA_FUNCTION_DEF (meta_rules, register_symbol);
+
+static const struct luaL_reg meta_ruleslib_m[] = {
+	LUA_INTERFACE_DEF (meta_rules, add_regexp),
+	LUA_INTERFACE_DEF (meta_rules, add_function),
+	LUA_INTERFACE_DEF (meta_rules, add_meta),
+	LUA_INTERFACE_DEF (meta_rules, add_replacement),
+	LUA_INTERFACE_DEF (meta_rules, has_rule),
+	LUA_INTERFACE_DEF (meta_rules, atoms),
+	LUA_INTERFACE_DEF (meta_rules, register_symbol),
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}
+};
+static const struct luaL_reg meta_ruleslib_f[] = {
+	LUA_INTERFACE_DEF (meta_rules, create),
+	{NULL, NULL}
+};
+
+static rspamd_expression_atom_t * lua_meta_atom_parse (const gchar *line,
+		gsize len, rspamd_mempool_t *pool, gpointer ud, GError **err);
+static gint lua_meta_atom_process (gpointer input,
+		rspamd_expression_atom_t *atom);
+
+static const struct rspamd_atom_subr lua_meta_atom_subr = {
+	.parse = lua_meta_atom_parse,
+	.process = lua_meta_atom_process,
+	.priority = NULL,
+	.destroy = NULL
+};
+
+static GQuark
+lua_meta_rules_quark (void)
+{
+	return g_quark_from_static_string ("meta-rules");
+}
+
+static struct lua_meta_rules *
+lua_check_meta_rules (lua_State * L)
+{
+	void *ud = rspamd_lua_check_udata (L, 1, "rspamd{meta_rules}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'meta_rules' expected");
+	return ud ? *((struct lua_meta_rules **)ud) : NULL;
+}
+
+static rspamd_expression_atom_t *
+lua_meta_atom_parse (const gchar *line, gsize len,
+		rspamd_mempool_t *pool, gpointer ud, GError **err)
+{
+	rspamd_expression_atom_t *atom;
+	struct lua_meta_atom *data;
+	const gchar *p = line, *end = line + len;
+
+	while (p < end && strchr (", \t()><+!|&\n", *p) == NULL) {
+		p ++;
+	}
+
+	if (p == line) {
+		g_set_error (err, lua_meta_rules_quark (), 100, "empty atom");
+
+		return NULL;
+	}
+
+	data = rspamd_mempool_alloc0 (pool, sizeof (*data));
+	data->rules = ud;
+	atom = rspamd_mempool_alloc0 (pool, sizeof (*atom));
+	atom->str = rspamd_mempool_alloc (pool, p - line + 1);
+	rspamd_strlcpy ((gchar *)atom->str, line, p - line + 1);
+	atom->len = p - line;
+	atom->data = data;
+
+	return atom;
+}
+
+static gboolean
+lua_meta_task_has_symbol (struct rspamd_task *task, const gchar *symbol)
+{
+	struct rspamd_metric_result *mres;
+
+	mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
+
+	if (mres == NULL) {
+		return FALSE;
+	}
+
+	return g_hash_table_lookup (mres->symbols, symbol) != NULL;
+}
+
+static gint lua_meta_rule_process (struct rspamd_task *task,
+		struct lua_meta_rule *rule);
+
+static gint
+lua_meta_atom_process (gpointer input, rspamd_expression_atom_t *atom)
+{
+	struct lua_meta_atom *data = atom->data;
+	struct rspamd_task *task = input;
+
+	if (!data->resolved) {
+		/* All rules are defined when tasks are processed */
+		data->rule = g_hash_table_lookup (data->rules->rules, atom->str);
+
+		if (data->rule == NULL) {
+			data->rule = g_hash_table_lookup (data->rules->metas, atom->str);
+		}
+
+		if (data->rule == NULL) {
+			data->symbol = g_hash_table_lookup (data->rules->replacements,
+					atom->str);
+
+			if (data->symbol == NULL) {
+				data->symbol = atom->str;
+			}
+		}
+
+		data->resolved = TRUE;
+	}
+
+	if (data->rule) {
+		return lua_meta_rule_process (task, data->rule);
+	}
+
+	return lua_meta_task_has_symbol (task, data->symbol) ? 1 : 0;
+}
+
+static gint
+lua_meta_rule_process (struct rspamd_task *task, struct lua_meta_rule *rule)
+{
+	struct rspamd_task **ptask;
+	struct rspamd_symbol_result *s;
+	rspamd_expression_atom_t *atom;
+	lua_State *L;
+	GPtrArray *trace;
+	gint ret = 0, err_idx;
+	guint i;
+
+	switch (rule->type) {
+	case LUA_META_RULE_REGEXP:
+		ret = rspamd_re_cache_process (task, rule->d.re.re, rule->d.re.type,
+				rule->d.re.header,
+				rule->d.re.header ? strlen (rule->d.re.header) : 0,
+				rule->d.re.strong);
+
+		if (rule->d.re.negate) {
+			ret = ret ? 0 : 1;
+		}
+		break;
+	case LUA_META_RULE_FUNCTION:
+		L = task->cfg->lua_state;
+		lua_pushcfunction (L, &rspamd_lua_traceback);
+		err_idx = lua_gettop (L);
+		lua_rawgeti (L, LUA_REGISTRYINDEX, rule->d.cbref);
+		ptask = lua_newuserdata (L, sizeof (*ptask));
+		rspamd_lua_setclass (L, "rspamd{task}", -1);
+		*ptask = task;
+
+		if (lua_pcall (L, 1, 1, err_idx) != 0) {
+			msg_err_task ("call to %s failed: %s", rule->name,
+					lua_tostring (L, -1));
+		}
+		else if (lua_type (L, -1) == LUA_TNUMBER) {
+			ret = MAX (lua_tonumber (L, -1), 0);
+		}
+		else if (lua_type (L, -1) == LUA_TBOOLEAN) {
+			ret = lua_toboolean (L, -1);
+		}
+
+		lua_settop (L, err_idx - 1);
+		break;
+	case LUA_META_RULE_META:
+		/* Meta rules are one shot, so their results are memoized as symbols */
+		if (lua_meta_task_has_symbol (task, rule->name)) {
+			return 1;
+		}
+
+		trace = g_ptr_array_sized_new (8);
+		ret = rspamd_process_expression_track (rule->d.expr, 0, task, trace);
+
+		if (ret > 0) {
+			s = rspamd_task_insert_result (task, rule->name, ret, NULL);
+
+			if (s) {
+				for (i = 0; i < trace->len; i ++) {
+					atom = g_ptr_array_index (trace, i);
+					rspamd_task_add_result_option (task, s, atom->str);
+				}
+			}
+		}
+
+		g_ptr_array_free (trace, TRUE);
+		break;
+	}
+
+	return ret;
+}
+
+static void
+lua_meta_symbol_callback (struct rspamd_task *task, void *ud)
+{
+	struct lua_meta_rule *rule = ud;
+	gint ret;
+
+	ret = lua_meta_rule_process (task, rule);
+
+	/* Meta rules insert their symbols themselves */
+	if (ret > 0 && rule->type != LUA_META_RULE_META) {
+		rspamd_task_insert_result (task, rule->name, ret, NULL);
+	}
+}
+
+static struct lua_meta_rule *
+lua_meta_rule_new (struct lua_meta_rules *rules, const gchar *name,
+		enum lua_meta_rule_type type)
+{
+	struct lua_meta_rule *rule;
+
+	rule = rspamd_mempool_alloc0 (rules->cfg->cfg_pool, sizeof (*rule));
+	rule->name = rspamd_mempool_strdup (rules->cfg->cfg_pool, name);
+	rule->type = type;
+	rule->rules = rules;
+	g_hash_table_replace (type == LUA_META_RULE_META ?
+			rules->metas : rules->rules, rule->name, rule);
+
+	return rule;
+}
+
+/***
+ * @function rspamd_meta_rules.create(cfg)
+ * Creates new set of rules
+ * @param {rspamd_config} cfg config object
+ * @return {meta_rules} new set of rules
+ */
+static gint
+lua_meta_rules_create (lua_State *L)
+{
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	struct lua_meta_rules *rules, **prules;
+
+	if (cfg == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	rules = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*rules));
+	rules->cfg = cfg;
+	rules->rules = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	rules->metas = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	rules->replacements = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, rules->rules);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, rules->metas);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)g_hash_table_unref, rules->replacements);
+
+	prules = lua_newuserdata (L, sizeof (*prules));
+	rspamd_lua_setclass (L, "rspamd{meta_rules}", -1);
+	*prules = rules;
+
+	return 1;
+}
+
+/***
+ * @method meta_rules:add_regexp(name, re, type, [header], [strong], [negate])
+ * Adds regexp rule, regexp should be registered in the regexps cache
+ * @param {string} name name of the rule
+ * @param {regexp} re regexp
+ * @param {string} type type of regexp, e.g. `header` or `sabody`
+ * @param {string} header name of header for header regexps
+ * @param {boolean} strong case sensitive match of header name
+ * @param {boolean} negate rule matches if regexp does not match
+ */
+static gint
+lua_meta_rules_add_regexp (lua_State *L)
+{
+	struct lua_meta_rules *rules = lua_check_meta_rules (L);
+	const gchar *name = luaL_checkstring (L, 2), *type = luaL_checkstring (L, 4);
+	struct rspamd_lua_regexp **pre;
+	struct lua_meta_rule *rule;
+	gint re_type;
+
+	pre = rspamd_lua_check_udata (L, 3, "rspamd{regexp}");
+
+	if (rules == NULL || name == NULL || pre == NULL || type == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	re_type = rspamd_re_cache_type_from_string (type);
+
+	if (re_type == RSPAMD_RE_MAX) {
+		return luaL_error (L, "invalid regexp type: %s", type);
+	}
+
+	rule = lua_meta_rule_new (rules, name, LUA_META_RULE_REGEXP);
+	rule->d.re.re = rspamd_regexp_ref ((*pre)->re);
+	rspamd_mempool_add_destructor (rules->cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)rspamd_regexp_unref, rule->d.re.re);
+	rule->d.re.type = re_type;
+
+	if (lua_type (L, 5) == LUA_TSTRING) {
+		rule->d.re.header = rspamd_mempool_strdup (rules->cfg->cfg_pool,
+				lua_tostring (L, 5));
+	}
+
+	rule->d.re.strong = lua_toboolean (L, 6);
+	rule->d.re.negate = lua_toboolean (L, 7);
+
+	return 0;
+}
+
+/***
+ * @method meta_rules:add_function(name, func)
+ * Adds rule that is checked by lua function, function is called with task
+ * object and should return a number
+ * @param {string} name name of the rule
+ * @param {function} func rule function
+ */
+static gint
+lua_meta_rules_add_function (lua_State *L)
+{
+	struct lua_meta_rules *rules = lua_check_meta_rules (L);
+	const gchar *name = luaL_checkstring (L, 2);
+	struct lua_meta_rule *rule;
+
+	if (rules == NULL || name == NULL || lua_type (L, 3) != LUA_TFUNCTION) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	rule = lua_meta_rule_new (rules, name, LUA_META_RULE_FUNCTION);
+	lua_pushvalue (L, 3);
+	rule->d.cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	return 0;
+}
+
+/***
+ * @method meta_rules:add_meta(name, expression)
+ * Adds meta rule, a matched meta rule inserts a symbol with its name
+ * @param {string} name name of the rule
+ * @param {string} expression expression of other rules and symbols
+ * @return {boolean,string} true or false and the error message
+ */
+static gint
+lua_meta_rules_add_meta (lua_State *L)
+{
+	struct lua_meta_rules *rules = lua_check_meta_rules (L);
+	const gchar *name = luaL_checkstring (L, 2), *line = luaL_checkstring (L, 3);
+	struct rspamd_expression *expr = NULL;
+	struct lua_meta_rule *rule;
+	GError *err = NULL;
+
+	if (rules == NULL || name == NULL || line == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (!rspamd_parse_expression (line, 0, &lua_meta_atom_subr, rules,
+			rules->cfg->cfg_pool, &err, &expr)) {
+		lua_pushboolean (L, FALSE);
+		lua_pushstring (L, err ? err->message : "unknown error");
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		return 2;
+	}
+
+	rule = lua_meta_rule_new (rules, name, LUA_META_RULE_META);
+	rule->d.expr = expr;
+	lua_pushboolean (L, TRUE);
+
+	return 1;
+}
+
+/***
+ * @method meta_rules:add_replacement(atom, symbol)
+ * Sets symbol that is checked for the specified atom
+ * @param {string} atom atom name
+ * @param {string} symbol symbol name
+ */
+static gint
+lua_meta_rules_add_replacement (lua_State *L)
+{
+	struct lua_meta_rules *rules = lua_check_meta_rules (L);
+	const gchar *atom = luaL_checkstring (L, 2), *sym = luaL_checkstring (L, 3);
+
+	if (rules == NULL || atom == NULL || sym == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	g_hash_table_replace (rules->replacements,
+			rspamd_mempool_strdup (rules->cfg->cfg_pool, atom),
+			rspamd_mempool_strdup (rules->cfg->cfg_pool, sym));
+
+	return 0;
+}
+
+/***
+ * @method meta_rules:has_rule(name)
+ * Checks if a rule is defined
+ * @param {string} name name of the rule
+ * @return {boolean} true if a rule is defined
+ */
+static gint
+lua_meta_rules_has_rule (lua_State *L)
+{
+	struct lua_meta_rules *rules = lua_check_meta_rules (L);
+	const gchar *name = luaL_checkstring (L, 2);
+
+	if (rules == NULL || name == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushboolean (L, g_hash_table_lookup (rules->rules, name) != NULL ||
+			g_hash_table_lookup (rules->metas, name) != NULL);
+
+	return 1;
+}
+
+static void
+lua_meta_rules_atom_cb (const rspamd_ftok_t *atom, gpointer ud)
+{
+	lua_State *L = ud;
+
+	lua_pushlstring (L, atom->begin, atom->len);
+	lua_rawseti (L, -2, rspamd_lua_table_size (L, -1) + 1);
+}
+
+/***
+ * @method meta_rules:atoms(name)
+ * Returns atoms of a meta rule
+ * @param {string} name name of the rule
+ * @return {table} list of atoms or nil if there is no such meta rule
+ */
+static gint
+lua_meta_rules_atoms (lua_State *L)
+{
+	struct lua_meta_rules *rules = lua_check_meta_rules (L);
+	const gchar *name = luaL_checkstring (L, 2);
+	struct lua_meta_rule *rule;
+
+	if (rules == NULL || name == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	rule = g_hash_table_lookup (rules->metas, name);
+
+	if (rule == NULL) {
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	lua_newtable (L);
+	rspamd_expression_atom_foreach (rule->d.expr, lua_meta_rules_atom_cb, L);
+
+	return 1;
+}
+
+/***
+ * @method meta_rules:register_symbol(name, [weight])
+ * Registers symbol that checks the specified rule, meta rules are preferred
+ * @param {string} name name of the rule
+ * @param {number} weight weight of the symbol, negative symbols are checked first
+ * @return {number} id of the symbol
+ */
+static gint
+lua_meta_rules_register_symbol (lua_State *L)
+{
+	struct lua_meta_rules *rules = lua_check_meta_rules (L);
+	const gchar *name = luaL_checkstring (L, 2);
+	struct lua_meta_rule *rule;
+	gdouble weight = 1.0;
+	gint id;
+
+	if (rules == NULL || name == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	rule = g_hash_table_lookup (rules->metas, name);
+
+	if (rule == NULL) {
+		rule = g_hash_table_lookup (rules->rules, name);
+	}
+
+	if (rule == NULL) {
+		return luaL_error (L, "no such rule: %s", name);
+	}
+
+	if (lua_type (L, 3) == LUA_TNUMBER) {
+		weight = lua_tonumber (L, 3);
+	}
+
+	id = rspamd_symbols_cache_add_symbol (rules->cfg->cache, rule->name,
+			weight < 0 ? 1 : 0,
+			lua_meta_symbol_callback, rule,
+			SYMBOL_TYPE_NORMAL, -1);
+	lua_pushnumber (L, id);
+
+	return 1;
+}
+
+static gint
+lua_load_meta_rules (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, meta_ruleslib_f);
+
+	return 1;
+}
+
+void
+luaopen_meta_rules (lua_State * L)
+{
+	luaL_newmetatable (L, "rspamd{meta_rules}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{meta_rules}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, meta_ruleslib_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_meta_rules", lua_load_meta_rules);
+}
@@ -15,6 +15,7 @@
  */
 #include "lua_common.h"
 #include "message.h"
+#include "mime_parser.h"
 
 /* Textpart methods */
 /***
@@ -656,6 +657,7 @@ lua_mimepart_get_content (lua_State * L)
 		return 1;
 	}
 
+	rspamd_mime_part_decode (part);
 	t = lua_newuserdata (L, sizeof (*t));
 	rspamd_lua_setclass (L, "rspamd{text}", -1);
 	t->start = part->parsed_data.begin;
@@ -675,6 +677,7 @@ lua_mimepart_get_length (lua_State * L)
 		return 1;
 	}
 
+	rspamd_mime_part_decode (part);
 	lua_pushnumber (L, part->parsed_data.len);
 
 	return 1;
@@ -905,6 +908,7 @@ lua_mimepart_get_digest (lua_State * L)
 		return luaL_error (L, "invalid arguments");
 	}
 
+	rspamd_mime_part_decode (part);
 	memset (digestbuf, 0, sizeof (digestbuf));
 	rspamd_encode_hex_buf (part->digest, sizeof (part->digest),
 			digestbuf, sizeof (digestbuf));
@@ -927,3 +931,20 @@ luaopen_mimepart (lua_State * L)
 	lua_pop (L, 1);
 }
 
+
+/*
+ * LuaJIT FFI entry point, `ppart` is a userdata of rspamd{mimepart}
+ */
+int
+rspamd_mimepart_get_content_ffi (void *ppart, struct rspamd_lua_text *out)
+{
+	struct rspamd_mime_part **real_part = ppart;
+	struct rspamd_mime_part *part = *real_part;
+
+	rspamd_mime_part_decode (part);
+	out->start = part->parsed_data.begin;
+	out->len = part->parsed_data.len;
+	out->flags = 0;
+
+	return out->start != NULL;
+}
@@ -0,0 +1,466 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/***
+ * @module rspamd_multimap
+ * This module provides native engine for simple multimap rules. Rules are
+ * grouped by their selector, so each selector is extracted from a task once
+ * and then all maps of this selector are probed in a single pass.
+ * @example
+local rspamd_multimap = require "rspamd_multimap"
+local engine = rspamd_multimap.create()
+local id = engine:add_rule('from', map)
+local hdr_id = engine:add_rule('header', other_map, 'Reply-To')
+
+for _,m in ipairs(engine:process(task)) do
+	-- m.rule, m.value, m.result
+end
+ */
+
+#include "lua_common.h"
+#include "libmime/message.h"
+#include "libmime/email_addr.h"
+#include "libserver/url.h"
+
+LUA_FUNCTION_DEF (multimap, create);
+LUA_FUNCTION_DEF (multimap, add_rule);
+LUA_FUNCTION_DEF (multimap, process);
+LUA_FUNCTION_DEF (multimap, gc);
+
+static const struct luaL_reg multimaplib_m[] = {
+	LUA_INTERFACE_DEF (multimap, add_rule),
+	LUA_INTERFACE_DEF (multimap, process),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_multimap_gc},
+	{NULL, NULL}
+};
+static const struct luaL_reg multimaplib_f[] = {
+	LUA_INTERFACE_DEF (multimap, create),
+	{NULL, NULL}
+};
+
+enum lua_multimap_selector {
+	MULTIMAP_SELECTOR_IP = 0,
+	MULTIMAP_SELECTOR_FROM,
+	MULTIMAP_SELECTOR_RCPT,
+	MULTIMAP_SELECTOR_HELO,
+	MULTIMAP_SELECTOR_HOSTNAME,
+	MULTIMAP_SELECTOR_URL,
+	MULTIMAP_SELECTOR_HEADER,
+	MULTIMAP_SELECTOR_ASN,
+	MULTIMAP_SELECTOR_COUNTRY,
+	MULTIMAP_SELECTOR_MEMPOOL,
+	MULTIMAP_SELECTOR_MAX
+};
+
+static const gchar *selector_names[MULTIMAP_SELECTOR_MAX] = {
+	[MULTIMAP_SELECTOR_IP] = "ip",
+	[MULTIMAP_SELECTOR_FROM] = "from",
+	[MULTIMAP_SELECTOR_RCPT] = "rcpt",
+	[MULTIMAP_SELECTOR_HELO] = "helo",
+	[MULTIMAP_SELECTOR_HOSTNAME] = "hostname",
+	[MULTIMAP_SELECTOR_URL] = "url",
+	[MULTIMAP_SELECTOR_HEADER] = "header",
+	[MULTIMAP_SELECTOR_ASN] = "asn",
+	[MULTIMAP_SELECTOR_COUNTRY] = "country",
+	[MULTIMAP_SELECTOR_MEMPOOL] = "mempool",
+};
+
+struct lua_multimap_rule {
+	struct rspamd_lua_map *map;
+	guint id;
+};
+
+/* Rules sharing the same selector and the same parameter (header, variable) */
+struct lua_multimap_group {
+	gchar *param;
+	GArray *rules;
+};
+
+struct lua_multimap {
+	GPtrArray *groups[MULTIMAP_SELECTOR_MAX];
+	guint nrules;
+};
+
+struct lua_multimap_value {
+	const gchar *str;
+	gsize len;
+	rspamd_inet_addr_t *addr;
+};
+
+static struct lua_multimap *
+lua_check_multimap (lua_State * L)
+{
+	void *ud = rspamd_lua_check_udata (L, 1, "rspamd{multimap}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'multimap' expected");
+	return ud ? *((struct lua_multimap **)ud) : NULL;
+}
+
+/***
+ * @function rspamd_multimap.create()
+ * Creates new empty multimap engine
+ * @return {multimap} new engine
+ */
+static gint
+lua_multimap_create (lua_State *L)
+{
+	struct lua_multimap *mm, **pmm;
+	guint i;
+
+	mm = g_malloc0 (sizeof (*mm));
+
+	for (i = 0; i < MULTIMAP_SELECTOR_MAX; i ++) {
+		mm->groups[i] = g_ptr_array_new ();
+	}
+
+	pmm = lua_newuserdata (L, sizeof (*pmm));
+	rspamd_lua_setclass (L, "rspamd{multimap}", -1);
+	*pmm = mm;
+
+	return 1;
+}
+
+/***
+ * @method multimap:add_rule(type, map[, param])
+ * Adds a rule to the engine. `param` is the header name for `header` rules
+ * and the variable name for `mempool` rules.
+ * @param {string} type selector type
+ * @param {map} map map to probe
+ * @param {string} param selector parameter
+ * @return {number} rule id or nil if this selector is not supported natively
+ */
+static gint
+lua_multimap_add_rule (lua_State *L)
+{
+	struct lua_multimap *mm = lua_check_multimap (L);
+	struct lua_multimap_group *gr = NULL, *cur;
+	struct lua_multimap_rule rule;
+	struct rspamd_lua_map *map;
+	const gchar *type, *param = NULL;
+	gint sel = -1, i;
+	guint j;
+
+	type = luaL_checkstring (L, 2);
+	map = lua_check_map (L, 3);
+
+	if (mm == NULL || type == NULL || map == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_type (L, 4) == LUA_TSTRING) {
+		param = lua_tostring (L, 4);
+	}
+
+	for (i = 0; i < MULTIMAP_SELECTOR_MAX; i ++) {
+		if (strcmp (type, selector_names[i]) == 0) {
+			sel = i;
+			break;
+		}
+	}
+
+	if (sel == -1 || map->type == RSPAMD_LUA_MAP_CALLBACK ||
+			((sel == MULTIMAP_SELECTOR_HEADER ||
+			sel == MULTIMAP_SELECTOR_MEMPOOL) && param == NULL)) {
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	for (j = 0; j < mm->groups[sel]->len; j ++) {
+		cur = g_ptr_array_index (mm->groups[sel], j);
+
+		if (cur->param == NULL ? param == NULL :
+				(param != NULL && g_ascii_strcasecmp (cur->param, param) == 0)) {
+			gr = cur;
+			break;
+		}
+	}
+
+	if (gr == NULL) {
+		gr = g_malloc0 (sizeof (*gr));
+		gr->param = g_strdup (param);
+		gr->rules = g_array_new (FALSE, FALSE, sizeof (rule));
+		g_ptr_array_add (mm->groups[sel], gr);
+	}
+
+	rule.map = map;
+	rule.id = ++mm->nrules;
+	g_array_append_val (gr->rules, rule);
+	lua_pushnumber (L, rule.id);
+
+	return 1;
+}
+
+static void
+lua_multimap_add_str (struct rspamd_task *task, GArray *values,
+		const gchar *str, gsize len)
+{
+	struct lua_multimap_value v;
+	gchar *copy;
+
+	if (str == NULL || len == 0) {
+		return;
+	}
+
+	/* Hash maps require zero terminated keys */
+	if (str[len] != '\0') {
+		copy = rspamd_mempool_alloc (task->task_pool, len + 1);
+		memcpy (copy, str, len);
+		copy[len] = '\0';
+		str = copy;
+	}
+
+	v.str = str;
+	v.len = len;
+	v.addr = NULL;
+	g_array_append_val (values, v);
+}
+
+static void
+lua_multimap_add_addrs (struct rspamd_task *task, GArray *values,
+		struct rspamd_email_address **addrs, guint naddrs)
+{
+	guint i;
+
+	/* Keep the same order as multimap plugin: addrs, domains, users */
+	for (i = 0; i < naddrs; i ++) {
+		lua_multimap_add_str (task, values, addrs[i]->addr, addrs[i]->addr_len);
+	}
+	for (i = 0; i < naddrs; i ++) {
+		lua_multimap_add_str (task, values, addrs[i]->domain,
+				addrs[i]->domain_len);
+	}
+	for (i = 0; i < naddrs; i ++) {
+		lua_multimap_add_str (task, values, addrs[i]->user, addrs[i]->user_len);
+	}
+}
+
+static void
+lua_multimap_extract (struct rspamd_task *task, gint sel, const gchar *param,
+		GArray *values)
+{
+	struct lua_multimap_value v;
+	struct rspamd_mime_header *rh;
+	struct rspamd_url *url;
+	GPtrArray *ar;
+	GHashTableIter it;
+	gpointer k, val;
+	const gchar *str;
+	guint i;
+
+	switch (sel) {
+	case MULTIMAP_SELECTOR_IP:
+		if (task->from_addr) {
+			v.str = NULL;
+			v.len = 0;
+			v.addr = task->from_addr;
+			g_array_append_val (values, v);
+		}
+		break;
+	case MULTIMAP_SELECTOR_FROM:
+		if (task->from_envelope) {
+			lua_multimap_add_addrs (task, values, &task->from_envelope, 1);
+		}
+		break;
+	case MULTIMAP_SELECTOR_RCPT:
+		if (task->rcpt_envelope) {
+			lua_multimap_add_addrs (task, values,
+					(struct rspamd_email_address **)task->rcpt_envelope->pdata,
+					task->rcpt_envelope->len);
+		}
+		break;
+	case MULTIMAP_SELECTOR_HELO:
+		if (task->helo) {
+			lua_multimap_add_str (task, values, task->helo, strlen (task->helo));
+		}
+		break;
+	case MULTIMAP_SELECTOR_HOSTNAME:
+		if (task->hostname && strcmp (task->hostname, "unknown") != 0) {
+			lua_multimap_add_str (task, values, task->hostname,
+					strlen (task->hostname));
+		}
+		break;
+	case MULTIMAP_SELECTOR_URL:
+		if (task->urls) {
+			g_hash_table_iter_init (&it, task->urls);
+
+			while (g_hash_table_iter_next (&it, &k, &val)) {
+				url = val;
+				lua_multimap_add_str (task, values, url->host, url->hostlen);
+			}
+		}
+		break;
+	case MULTIMAP_SELECTOR_HEADER:
+		ar = rspamd_message_get_header_array (task, param, FALSE);
+
+		if (ar) {
+			PTR_ARRAY_FOREACH (ar, i, rh) {
+				if (rh->value) {
+					str = rspamd_mime_header_get_decoded (rh);
+
+					if (str) {
+						lua_multimap_add_str (task, values, str, strlen (str));
+					}
+				}
+			}
+		}
+		break;
+	case MULTIMAP_SELECTOR_ASN:
+	case MULTIMAP_SELECTOR_COUNTRY:
+	case MULTIMAP_SELECTOR_MEMPOOL:
+		str = rspamd_mempool_get_variable (task->task_pool,
+				sel == MULTIMAP_SELECTOR_MEMPOOL ? param : selector_names[sel]);
+
+		if (str) {
+			lua_multimap_add_str (task, values, str, strlen (str));
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/***
+ * @method multimap:process(task)
+ * Extracts selectors from a task and probes all maps of the engine
+ * @param {task} task task to check
+ * @return {table} array of matches: {rule = id, value = string, result = string|true}
+ */
+static gint
+lua_multimap_process (lua_State *L)
+{
+	struct lua_multimap *mm = lua_check_multimap (L);
+	struct rspamd_task *task = lua_check_task (L, 2);
+	struct lua_multimap_group *gr;
+	struct lua_multimap_rule *rule;
+	struct lua_multimap_value *v;
+	GArray *values;
+	const gchar *res;
+	gsize rlen;
+	guint i, j, k, nres = 0;
+	gint sel;
+
+	if (mm == NULL || task == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_newtable (L);
+	values = g_array_sized_new (FALSE, FALSE, sizeof (*v), 16);
+
+	for (sel = 0; sel < MULTIMAP_SELECTOR_MAX; sel ++) {
+		PTR_ARRAY_FOREACH (mm->groups[sel], i, gr) {
+			g_array_set_size (values, 0);
+			lua_multimap_extract (task, sel, gr->param, values);
+
+			for (j = 0; j < gr->rules->len; j ++) {
+				rule = &g_array_index (gr->rules, struct lua_multimap_rule, j);
+
+				for (k = 0; k < values->len; k ++) {
+					v = &g_array_index (values, struct lua_multimap_value, k);
+					res = NULL;
+					rlen = 0;
+
+					if (!rspamd_lua_map_lookup (rule->map, v->str, v->len,
+							v->addr, &res, &rlen)) {
+						continue;
+					}
+
+					lua_createtable (L, 0, 3);
+					lua_pushstring (L, "rule");
+					lua_pushnumber (L, rule->id);
+					lua_settable (L, -3);
+					lua_pushstring (L, "value");
+
+					if (v->addr) {
+						lua_pushstring (L, rspamd_inet_address_to_string (v->addr));
+					}
+					else {
+						lua_pushlstring (L, v->str, v->len);
+					}
+
+					lua_settable (L, -3);
+					lua_pushstring (L, "result");
+
+					if (res) {
+						lua_pushlstring (L, res, rlen);
+					}
+					else {
+						lua_pushboolean (L, TRUE);
+					}
+
+					lua_settable (L, -3);
+					lua_rawseti (L, -2, ++nres);
+				}
+			}
+		}
+	}
+
+	g_array_free (values, TRUE);
+
+	return 1;
+}
+
+static gint
+lua_multimap_gc (lua_State *L)
+{
+	struct lua_multimap *mm = lua_check_multimap (L);
+	struct lua_multimap_group *gr;
+	guint i, j;
+
+	if (mm) {
+		for (i = 0; i < MULTIMAP_SELECTOR_MAX; i ++) {
+			PTR_ARRAY_FOREACH (mm->groups[i], j, gr) {
+				g_array_free (gr->rules, TRUE);
+				g_free (gr->param);
+				g_free (gr);
+			}
+
+			g_ptr_array_free (mm->groups[i], TRUE);
+		}
+
+		g_free (mm);
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_multimap (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, multimaplib_f);
+
+	return 1;
+}
+
+void
+luaopen_multimap (lua_State * L)
+{
+	luaL_newmetatable (L, "rspamd{multimap}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{multimap}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, multimaplib_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_multimap", lua_load_multimap);
+}
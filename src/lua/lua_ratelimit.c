@@ -0,0 +1,490 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/***
+ * @module rspamd_ratelimit
+ * This module implements worker local leaky buckets for the ratelimit plugin.
+ * All buckets of a task are checked or updated by a single call, increments
+ * are accumulated locally and drained periodically to be merged with the
+ * shared state in redis.
+ * @example
+local rspamd_ratelimit = require "rspamd_ratelimit"
+local rl = rspamd_ratelimit.create(65536, 86400)
+local buckets = {{'rl:to:user@example.com', 100, 0.1}}
+local levels = rl:check(buckets)
+rl:update(buckets)
+for _,p in ipairs(rl:drain(1000)) do
+	-- p[1] is key, p[2] is delta and p[3] is rate
+	rl:reconcile(p[1], level_from_redis)
+end
+ */
+
+#include "lua_common.h"
+
+#define RATELIMIT_DEFAULT_BUCKETS 65536
+#define RATELIMIT_DEFAULT_MAX_DELAY 86400.0
+
+struct rspamd_lua_ratelimit_bucket {
+	gchar *key;
+	gdouble level;			/**< current level of bucket							*/
+	gdouble rate;			/**< leak rate per second								*/
+	gdouble atime;			/**< last time when level was recalculated				*/
+	gdouble ctime;			/**< time when bucket has been started					*/
+	gdouble pending;		/**< increments that have not been sent to redis yet	*/
+	gdouble inflight;		/**< increments that are being merged in redis now		*/
+	gboolean queued;		/**< bucket is in the dirty queue						*/
+};
+
+struct rspamd_lua_ratelimit {
+	GHashTable *buckets;
+	GQueue *dirty;
+	guint max_buckets;
+	gdouble max_delay;
+};
+
+LUA_FUNCTION_DEF (ratelimit, create);
+LUA_FUNCTION_DEF (ratelimit, check);
+LUA_FUNCTION_DEF (ratelimit, update);
+LUA_FUNCTION_DEF (ratelimit, drain);
+LUA_FUNCTION_DEF (ratelimit, reconcile);
+LUA_FUNCTION_DEF (ratelimit, size);
+LUA_FUNCTION_DEF (ratelimit, gc);
+
+static const struct luaL_reg ratelimitlib_m[] = {
+	LUA_INTERFACE_DEF (ratelimit, check),
+	LUA_INTERFACE_DEF (ratelimit, update),
+	LUA_INTERFACE_DEF (ratelimit, drain),
+	LUA_INTERFACE_DEF (ratelimit, reconcile),
+	LUA_INTERFACE_DEF (ratelimit, size),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_ratelimit_gc},
+	{NULL, NULL}
+};
+static const struct luaL_reg ratelimitlib_f[] = {
+	LUA_INTERFACE_DEF (ratelimit, create),
+	{NULL, NULL}
+};
+
+static struct rspamd_lua_ratelimit *
+lua_check_ratelimit (lua_State * L)
+{
+	void *ud = rspamd_lua_check_udata (L, 1, "rspamd{ratelimit}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'ratelimit' expected");
+	return ud ? *((struct rspamd_lua_ratelimit **)ud) : NULL;
+}
+
+static void
+lua_ratelimit_bucket_free (gpointer p)
+{
+	struct rspamd_lua_ratelimit_bucket *bk = p;
+
+	g_free (bk->key);
+	g_slice_free1 (sizeof (*bk), bk);
+}
+
+static void
+lua_ratelimit_enqueue (struct rspamd_lua_ratelimit *rl,
+		struct rspamd_lua_ratelimit_bucket *bk)
+{
+	if (!bk->queued) {
+		bk->queued = TRUE;
+		g_queue_push_tail (rl->dirty, bk);
+	}
+}
+
+/* Leaks bucket up to the specified time */
+static void
+lua_ratelimit_bucket_leak (struct rspamd_lua_ratelimit *rl,
+		struct rspamd_lua_ratelimit_bucket *bk, gdouble now)
+{
+	if (bk->atime - bk->ctime > rl->max_delay) {
+		/* Limit is too old, start it over */
+		bk->level = 0;
+		bk->ctime = now;
+	}
+	else if (now > bk->atime) {
+		bk->level -= bk->rate * (now - bk->atime);
+
+		if (bk->level < 0) {
+			bk->level = 0;
+		}
+	}
+
+	bk->atime = now;
+}
+
+/* Removes buckets that are fully leaked and have nothing to sync */
+static void
+lua_ratelimit_expire (struct rspamd_lua_ratelimit *rl, gdouble now)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_lua_ratelimit_bucket *bk;
+
+	g_hash_table_iter_init (&it, rl->buckets);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		bk = v;
+
+		if (bk->queued || bk->inflight > 0) {
+			continue;
+		}
+
+		lua_ratelimit_bucket_leak (rl, bk, now);
+
+		if (bk->level <= 0) {
+			g_hash_table_iter_remove (&it);
+		}
+	}
+}
+
+/*
+ * Returns bucket for this key creating it if needed, new buckets are queued
+ * so that their state is fetched from redis on the next sync
+ */
+static struct rspamd_lua_ratelimit_bucket *
+lua_ratelimit_get_bucket (struct rspamd_lua_ratelimit *rl, const gchar *key,
+		gdouble rate, gdouble now)
+{
+	struct rspamd_lua_ratelimit_bucket *bk;
+
+	bk = g_hash_table_lookup (rl->buckets, key);
+
+	if (bk == NULL) {
+		if (g_hash_table_size (rl->buckets) >= rl->max_buckets) {
+			lua_ratelimit_expire (rl, now);
+
+			if (g_hash_table_size (rl->buckets) >= rl->max_buckets) {
+				return NULL;
+			}
+		}
+
+		bk = g_slice_alloc0 (sizeof (*bk));
+		bk->key = g_strdup (key);
+		bk->atime = now;
+		bk->ctime = now;
+		g_hash_table_insert (rl->buckets, bk->key, bk);
+		lua_ratelimit_enqueue (rl, bk);
+	}
+
+	bk->rate = rate;
+	lua_ratelimit_bucket_leak (rl, bk, now);
+
+	return bk;
+}
+
+/*
+ * Reads {key, burst, rate} element from the table on top of the stack
+ */
+static gboolean
+lua_ratelimit_read_elt (lua_State *L, const gchar **key, gdouble *rate)
+{
+	if (lua_type (L, -1) != LUA_TTABLE) {
+		return FALSE;
+	}
+
+	lua_rawgeti (L, -1, 1);
+	*key = lua_tostring (L, -1);
+	lua_pop (L, 1);
+	lua_rawgeti (L, -1, 3);
+	*rate = lua_tonumber (L, -1);
+	lua_pop (L, 1);
+
+	return *key != NULL;
+}
+
+/***
+ * @function rspamd_ratelimit.create([max_buckets[, max_delay]])
+ * Creates local buckets storage
+ * @param {number} max_buckets maximum number of buckets stored (65536 by default)
+ * @param {number} max_delay time in seconds after which a bucket is started over
+ * @return {ratelimit} new buckets storage
+ */
+static gint
+lua_ratelimit_create (lua_State *L)
+{
+	struct rspamd_lua_ratelimit *rl, **prl;
+
+	rl = g_malloc0 (sizeof (*rl));
+	rl->max_buckets = RATELIMIT_DEFAULT_BUCKETS;
+	rl->max_delay = RATELIMIT_DEFAULT_MAX_DELAY;
+
+	if (lua_isnumber (L, 1) && lua_tonumber (L, 1) > 0) {
+		rl->max_buckets = lua_tonumber (L, 1);
+	}
+	if (lua_isnumber (L, 2) && lua_tonumber (L, 2) > 0) {
+		rl->max_delay = lua_tonumber (L, 2);
+	}
+
+	rl->buckets = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			NULL, lua_ratelimit_bucket_free);
+	rl->dirty = g_queue_new ();
+
+	prl = lua_newuserdata (L, sizeof (*prl));
+	rspamd_lua_setclass (L, "rspamd{ratelimit}", -1);
+	*prl = rl;
+
+	return 1;
+}
+
+/***
+ * @method ratelimit:check(buckets[, now])
+ * Computes current levels of all buckets specified
+ * @param {table} buckets array of `{key, burst, rate}` tables
+ * @param {number} now current time (`rspamd_util.get_time()` by default)
+ * @return {table} array of levels in the same order as buckets
+ */
+static gint
+lua_ratelimit_check (lua_State *L)
+{
+	struct rspamd_lua_ratelimit *rl = lua_check_ratelimit (L);
+	struct rspamd_lua_ratelimit_bucket *bk;
+	const gchar *key;
+	gdouble rate, now;
+	guint i, n;
+
+	if (rl == NULL || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	now = lua_isnumber (L, 3) ? lua_tonumber (L, 3) : rspamd_get_calendar_ticks ();
+	n = rspamd_lua_table_size (L, 2);
+	lua_createtable (L, n, 0);
+
+	for (i = 1; i <= n; i ++) {
+		lua_rawgeti (L, 2, i);
+
+		if (lua_ratelimit_read_elt (L, &key, &rate) &&
+				(bk = lua_ratelimit_get_bucket (rl, key, rate, now)) != NULL) {
+			lua_pushnumber (L, bk->level);
+		}
+		else {
+			lua_pushnumber (L, 0);
+		}
+
+		lua_rawseti (L, -3, i);
+		lua_pop (L, 1);
+	}
+
+	return 1;
+}
+
+/***
+ * @method ratelimit:update(buckets[, now])
+ * Adds one element to all buckets specified
+ * @param {table} buckets array of `{key, burst, rate}` tables
+ * @param {number} now current time (`rspamd_util.get_time()` by default)
+ */
+static gint
+lua_ratelimit_update (lua_State *L)
+{
+	struct rspamd_lua_ratelimit *rl = lua_check_ratelimit (L);
+	struct rspamd_lua_ratelimit_bucket *bk;
+	const gchar *key;
+	gdouble rate, now;
+	guint i, n;
+
+	if (rl == NULL || lua_type (L, 2) != LUA_TTABLE) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	now = lua_isnumber (L, 3) ? lua_tonumber (L, 3) : rspamd_get_calendar_ticks ();
+	n = rspamd_lua_table_size (L, 2);
+
+	for (i = 1; i <= n; i ++) {
+		lua_rawgeti (L, 2, i);
+
+		if (lua_ratelimit_read_elt (L, &key, &rate) &&
+				(bk = lua_ratelimit_get_bucket (rl, key, rate, now)) != NULL) {
+			bk->level += 1;
+			bk->pending += 1;
+			lua_ratelimit_enqueue (rl, bk);
+		}
+
+		lua_pop (L, 1);
+	}
+
+	return 0;
+}
+
+/***
+ * @method ratelimit:drain([max[, all]])
+ * Returns buckets that should be synced with redis, their pending increments
+ * are marked as being in flight until `reconcile` is called. Buckets which
+ * sync is still in flight are left queued unless `all` is true, this is
+ * intended for the final flush when no replies are reconciled anymore
+ * @param {number} max maximum number of buckets returned
+ * @param {boolean} all drain buckets with sync in flight as well
+ * @return {table} array of `{key, delta, rate}` tables
+ */
+static gint
+lua_ratelimit_drain (lua_State *L)
+{
+	struct rspamd_lua_ratelimit *rl = lua_check_ratelimit (L);
+	struct rspamd_lua_ratelimit_bucket *bk;
+	GList *cur, *next;
+	guint max = G_MAXUINT, i = 1;
+	gboolean all = FALSE;
+	gdouble delta;
+
+	if (rl == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_isnumber (L, 2) && lua_tonumber (L, 2) > 0) {
+		max = lua_tonumber (L, 2);
+	}
+
+	if (lua_isboolean (L, 3)) {
+		all = lua_toboolean (L, 3);
+	}
+
+	lua_createtable (L, MIN (max, g_queue_get_length (rl->dirty)), 0);
+	cur = rl->dirty->head;
+
+	while (i <= max && cur != NULL) {
+		next = cur->next;
+		bk = cur->data;
+
+		if (bk->inflight > 0 && !all) {
+			/* Wait for the previous reply, it is reconciled for its delta only */
+			cur = next;
+			continue;
+		}
+
+		g_queue_delete_link (rl->dirty, cur);
+		cur = next;
+		bk->queued = FALSE;
+		delta = bk->pending;
+		bk->inflight += delta;
+		bk->pending = 0;
+
+		lua_createtable (L, 3, 0);
+		lua_pushstring (L, bk->key);
+		lua_rawseti (L, -2, 1);
+		lua_pushnumber (L, delta);
+		lua_rawseti (L, -2, 2);
+		lua_pushnumber (L, bk->rate);
+		lua_rawseti (L, -2, 3);
+		lua_rawseti (L, -2, i ++);
+	}
+
+	return 1;
+}
+
+/***
+ * @method ratelimit:reconcile(key, level[, now])
+ * Applies level of bucket received from redis, increments made locally after
+ * `drain` are preserved. If `level` is nil then sync has failed and in flight
+ * increments are queued again
+ * @param {string} key bucket key
+ * @param {number} level bucket level in redis with all drained increments merged
+ * @param {number} now current time (`rspamd_util.get_time()` by default)
+ */
+static gint
+lua_ratelimit_reconcile (lua_State *L)
+{
+	struct rspamd_lua_ratelimit *rl = lua_check_ratelimit (L);
+	struct rspamd_lua_ratelimit_bucket *bk;
+	const gchar *key = luaL_checkstring (L, 2);
+	gdouble now;
+
+	if (rl == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	bk = g_hash_table_lookup (rl->buckets, key);
+
+	if (bk == NULL) {
+		return 0;
+	}
+
+	if (lua_isnumber (L, 3)) {
+		now = lua_isnumber (L, 4) ? lua_tonumber (L, 4) :
+				rspamd_get_calendar_ticks ();
+		lua_ratelimit_bucket_leak (rl, bk, now);
+		bk->level = lua_tonumber (L, 3) + bk->pending;
+	}
+	else {
+		bk->pending += bk->inflight;
+		lua_ratelimit_enqueue (rl, bk);
+	}
+
+	bk->inflight = 0;
+
+	return 0;
+}
+
+/***
+ * @method ratelimit:size()
+ * @return {number,number} number of buckets stored and number of buckets to sync
+ */
+static gint
+lua_ratelimit_size (lua_State *L)
+{
+	struct rspamd_lua_ratelimit *rl = lua_check_ratelimit (L);
+
+	if (rl == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushnumber (L, g_hash_table_size (rl->buckets));
+	lua_pushnumber (L, g_queue_get_length (rl->dirty));
+
+	return 2;
+}
+
+static gint
+lua_ratelimit_gc (lua_State *L)
+{
+	struct rspamd_lua_ratelimit *rl = lua_check_ratelimit (L);
+
+	if (rl) {
+		g_queue_free (rl->dirty);
+		g_hash_table_unref (rl->buckets);
+		g_free (rl);
+	}
+
+	return 0;
+}
+
+static gint
+lua_load_ratelimit (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, ratelimitlib_f);
+
+	return 1;
+}
+
+void
+luaopen_ratelimit (lua_State * L)
+{
+	luaL_newmetatable (L, "rspamd{ratelimit}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{ratelimit}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, ratelimitlib_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_ratelimit", lua_load_ratelimit);
+}
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 #include "lua_common.h"
+#include "lua_thread_pool.h"
 #include "utlist.h"
 
 #include "contrib/hiredis/hiredis.h"
@@ -43,6 +44,28 @@ local function symbol_callback(task)
 	-- rspamd_redis.make_request({task=task, host="127.0.0.1:6379,
 	--	callback=redis_cb, timeout=2.0, cmd='GET', args={redis_key}})
 end
+
+-- Symbols callbacks are executed in coroutines, so they can wait for replies
+-- of commands added without callbacks
+local function symbol_callback_await(task)
+	local conn = rspamd_redis.connect({task=task, host="127.0.0.1:6379"})
+	conn:add_cmd('GET', {'key1'})
+	conn:add_cmd('GET', {'key2'})
+	local ok1, data1, ok2, data2 = conn:await()
+end
+
+-- Array replies of requests with `lazy = true` are not converted to tables,
+-- elements are converted when accessed
+local function lazy_callback(task)
+	local function redis_cb(err, data)
+		if not err then
+			local spam, ham = data:number(1), data:number(2)
+		end
+	end
+
+	rspamd_redis.make_request({task=task, host="127.0.0.1:6379", lazy=true,
+		callback=redis_cb, cmd='HMGET', args={'key', 'S', 'H'}})
+end
  */
 
 LUA_FUNCTION_DEF (redis, make_request);
@@ -51,6 +74,7 @@ LUA_FUNCTION_DEF (redis, connect);
 LUA_FUNCTION_DEF (redis, connect_sync);
 LUA_FUNCTION_DEF (redis, add_cmd);
 LUA_FUNCTION_DEF (redis, exec);
+LUA_FUNCTION_DEF (redis, await);
 LUA_FUNCTION_DEF (redis, gc);
 
 static const struct luaL_reg redislib_f[] = {
@@ -64,6 +88,7 @@ static const struct luaL_reg redislib_f[] = {
 static const struct luaL_reg redislib_m[] = {
 	LUA_INTERFACE_DEF (redis, add_cmd),
 	LUA_INTERFACE_DEF (redis, exec),
+	LUA_INTERFACE_DEF (redis, await),
 	{"__gc", lua_redis_gc},
 	{"__tostring", rspamd_lua_class_tostring},
 	{NULL, NULL}
@@ -109,7 +134,10 @@ struct lua_redis_userdata {
 #define LUA_REDIS_SPECIFIC_FINISHED (1 << 1)
 #define LUA_REDIS_ASYNC (1 << 0)
 #define LUA_REDIS_TEXTDATA (1 << 1)
+#define LUA_REDIS_BATCHED (1 << 2)
+#define LUA_REDIS_LAZY (1 << 3)
 #define IS_ASYNC(ctx) ((ctx)->flags & LUA_REDIS_ASYNC)
+#define IS_BATCHED(ctx) ((ctx)->flags & LUA_REDIS_BATCHED)
 
 struct lua_redis_specific_userdata {
 	gint cbref;
@@ -122,6 +150,7 @@ struct lua_redis_specific_userdata {
 	struct lua_redis_specific_userdata *next;
 	struct event timeout;
 	guint flags;
+	guint idx;									/**< position in await results		*/
 };
 
 struct lua_redis_ctx {
@@ -131,6 +160,11 @@ struct lua_redis_ctx {
 		redisContext *sync;
 	} d;
 	guint cmds_pending;
+	/* Replies of commands without callbacks are stored for `await` */
+	struct thread_entry *thread;
+	gint results_ref;
+	guint nawait;
+	guint nreplied;
 	ref_entry_t ref;
 };
 
@@ -196,6 +230,10 @@ lua_redis_dtor (struct lua_redis_ctx *ctx)
 
 			g_slice_free1 (sizeof (*cur), cur);
 		}
+
+		if (ctx->results_ref != -1) {
+			luaL_unref (ud->L, LUA_REGISTRYINDEX, ctx->results_ref);
+		}
 	}
 	else {
 		if (ctx->d.sync) {
@@ -232,6 +270,104 @@ lua_redis_fin (void *arg)
 	REDIS_RELEASE (ctx);
 }
 
+static void lua_redis_push_reply (lua_State *L, const redisReply *r,
+		guint flags);
+
+/* Moves stored results to the stack of L, returns number of values pushed */
+static gint
+lua_redis_push_results (struct lua_redis_ctx *ctx, lua_State *L)
+{
+	gint i, n = ctx->nawait * 2;
+
+	if (ctx->results_ref == -1 || !lua_checkstack (L, n + 1)) {
+		n = 0;
+	}
+	else {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, ctx->results_ref);
+
+		for (i = 1; i <= n; i ++) {
+			lua_rawgeti (L, -i, i);
+		}
+
+		lua_remove (L, -n - 1);
+	}
+
+	if (ctx->results_ref != -1) {
+		luaL_unref (L, LUA_REGISTRYINDEX, ctx->results_ref);
+		ctx->results_ref = -1;
+	}
+
+	ctx->nawait = 0;
+	ctx->nreplied = 0;
+
+	return n;
+}
+
+/*
+ * Stores reply of a command without callback and resumes coroutine waiting
+ * for it when all replies are received
+ */
+static void
+lua_redis_store_result (struct lua_redis_ctx *ctx,
+		struct lua_redis_specific_userdata *sp_ud,
+		const redisReply *r, const gchar *err)
+{
+	struct lua_redis_userdata *ud = sp_ud->c;
+	struct thread_entry *thread;
+	lua_State *L = ud->L;
+	gint n;
+
+	if (ctx->results_ref == -1) {
+		lua_createtable (L, ctx->nawait * 2, 0);
+		ctx->results_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, ctx->results_ref);
+	lua_pushboolean (L, err == NULL);
+	lua_rawseti (L, -2, sp_ud->idx * 2 + 1);
+
+	if (err) {
+		lua_pushstring (L, err);
+	}
+	else {
+		/* Reply is freed after this call, so it cannot be opaque */
+		lua_redis_push_reply (L, r, ctx->flags & LUA_REDIS_LAZY);
+	}
+
+	lua_rawseti (L, -2, sp_ud->idx * 2 + 2);
+	lua_pop (L, 1);
+	ctx->nreplied ++;
+
+	if (ctx->thread && ctx->nreplied == ctx->nawait) {
+		thread = ctx->thread;
+		ctx->thread = NULL;
+		n = lua_redis_push_results (ctx, thread->lua_state);
+		lua_thread_resume (thread, n);
+	}
+}
+
+/*
+ * Commands issued from a resumed coroutine are tracked by the watcher of its
+ * symbol, as events session is not watching at that moment
+ */
+static void
+lua_redis_push_watcher (lua_State *L, struct lua_redis_userdata *ud,
+		struct lua_redis_specific_userdata *sp_ud)
+{
+	struct thread_entry *thread;
+
+	thread = lua_thread_pool_get_running_entry (ud->cfg->lua_thread_pool, L);
+
+	if (thread && thread->w) {
+		sp_ud->w = thread->w;
+		rspamd_session_watcher_push_specific (ud->s, sp_ud->w);
+	}
+	else {
+		sp_ud->w = rspamd_session_get_watcher (ud->s);
+		rspamd_session_watcher_push (ud->s);
+	}
+}
+
 /**
  * Push error of redis request to lua callback
  * @param code
@@ -260,6 +396,9 @@ lua_redis_push_error (const gchar *err,
 				lua_pop (ud->L, 1);
 			}
 		}
+		else {
+			lua_redis_store_result (ctx, sp_ud, NULL, err);
+		}
 
 		sp_ud->flags |= LUA_REDIS_SPECIFIC_REPLIED;
 
@@ -273,11 +412,73 @@ lua_redis_push_error (const gchar *err,
 	}
 }
 
+/*
+ * Array replies are freed by hiredis when callbacks return, so lazy replies
+ * take elements from them leaving empty arrays to free
+ */
+struct lua_redis_reply_root {
+	redisReply *r;
+	ref_entry_t ref;
+};
+
+struct lua_redis_reply {
+	const redisReply *r;
+	struct lua_redis_reply_root *root;
+};
+
+LUA_FUNCTION_DEF (redis_reply, len);
+LUA_FUNCTION_DEF (redis_reply, index);
+LUA_FUNCTION_DEF (redis_reply, get);
+LUA_FUNCTION_DEF (redis_reply, text);
+LUA_FUNCTION_DEF (redis_reply, number);
+LUA_FUNCTION_DEF (redis_reply, totable);
+LUA_FUNCTION_DEF (redis_reply, gc);
+
+static const struct luaL_reg redis_replylib_m[] = {
+	LUA_INTERFACE_DEF (redis_reply, len),
+	LUA_INTERFACE_DEF (redis_reply, get),
+	LUA_INTERFACE_DEF (redis_reply, text),
+	LUA_INTERFACE_DEF (redis_reply, number),
+	LUA_INTERFACE_DEF (redis_reply, totable),
+	{"__len", lua_redis_reply_len},
+	{"__index", lua_redis_reply_index},
+	{"__gc", lua_redis_reply_gc},
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}
+};
+
+static void
+lua_redis_reply_root_dtor (struct lua_redis_reply_root *root)
+{
+	freeReplyObject (root->r);
+	g_slice_free1 (sizeof (*root), root);
+}
+
+static void
+lua_redis_push_reply_elt (lua_State *L, const redisReply *r,
+		struct lua_redis_reply_root *root)
+{
+	struct lua_redis_reply *rep;
+
+	if (r->type == REDIS_REPLY_ARRAY) {
+		rep = lua_newuserdata (L, sizeof (*rep));
+		rspamd_lua_setclass (L, "rspamd{redis_reply}", -1);
+		rep->r = r;
+		rep->root = root;
+		REF_RETAIN (root);
+	}
+	else {
+		lua_redis_push_reply (L, r, 0);
+	}
+}
+
 static void
-lua_redis_push_reply (lua_State *L, const redisReply *r, gboolean text_data)
+lua_redis_push_reply (lua_State *L, const redisReply *r, guint flags)
 {
 	guint i;
 	struct rspamd_lua_text *t;
+	struct lua_redis_reply_root *root;
+	redisReply *nr;
 
 	switch (r->type) {
 	case REDIS_REPLY_INTEGER:
@@ -289,7 +490,7 @@ lua_redis_push_reply (lua_State *L, const redisReply *r, gboolean text_data)
 		break;
 	case REDIS_REPLY_STRING:
 	case REDIS_REPLY_STATUS:
-		if (text_data) {
+		if (flags & LUA_REDIS_TEXTDATA) {
 			t = lua_newuserdata (L, sizeof (*t));
 			rspamd_lua_setclass (L, "rspamd{text}", -1);
 			t->flags = 0;
@@ -301,9 +502,25 @@ lua_redis_push_reply (lua_State *L, const redisReply *r, gboolean text_data)
 		}
 		break;
 	case REDIS_REPLY_ARRAY:
+		if (flags & LUA_REDIS_LAZY) {
+			/* Hiredis uses malloc for replies */
+			nr = malloc (sizeof (*nr));
+			g_assert (nr != NULL);
+			memcpy (nr, r, sizeof (*nr));
+			((redisReply *)r)->element = NULL;
+			((redisReply *)r)->elements = 0;
+
+			root = g_slice_alloc (sizeof (*root));
+			root->r = nr;
+			REF_INIT_RETAIN (root, lua_redis_reply_root_dtor);
+			lua_redis_push_reply_elt (L, nr, root);
+			REF_RELEASE (root);
+			break;
+		}
+
 		lua_createtable (L, r->elements, 0);
 		for (i = 0; i < r->elements; ++i) {
-			lua_redis_push_reply (L, r->element[i], text_data);
+			lua_redis_push_reply (L, r->element[i], flags);
 			lua_rawseti (L, -2, i + 1); /* Store sub-reply */
 		}
 		break;
@@ -313,6 +530,197 @@ lua_redis_push_reply (lua_State *L, const redisReply *r, gboolean text_data)
 	}
 }
 
+static struct lua_redis_reply *
+lua_check_redis_reply (lua_State *L, gint pos)
+{
+	void *ud = rspamd_lua_check_udata (L, pos, "rspamd{redis_reply}");
+	luaL_argcheck (L, ud != NULL, pos, "'redis_reply' expected");
+	return ud;
+}
+
+static const redisReply *
+lua_redis_reply_get_elt (lua_State *L, struct lua_redis_reply *rep, gint pos)
+{
+	gint idx = luaL_checknumber (L, pos);
+
+	if (idx < 1 || (gsize)idx > rep->r->elements) {
+		return NULL;
+	}
+
+	return rep->r->element[idx - 1];
+}
+
+/***
+ * @method redis_reply:len()
+ * Returns number of elements in a reply, the same as `#reply`
+ * @return {number} number of elements
+ */
+static gint
+lua_redis_reply_len (lua_State *L)
+{
+	struct lua_redis_reply *rep = lua_check_redis_reply (L, 1);
+
+	if (rep == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushnumber (L, rep->r->elements);
+
+	return 1;
+}
+
+static gint
+lua_redis_reply_index (lua_State *L)
+{
+	struct lua_redis_reply *rep = lua_check_redis_reply (L, 1);
+	const redisReply *elt;
+
+	if (rep == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_type (L, 2) == LUA_TNUMBER) {
+		elt = lua_redis_reply_get_elt (L, rep, 2);
+
+		if (elt) {
+			lua_redis_push_reply_elt (L, elt, rep->root);
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		/* Methods */
+		luaL_getmetatable (L, "rspamd{redis_reply}");
+		lua_pushvalue (L, 2);
+		lua_rawget (L, -2);
+		lua_remove (L, -2);
+	}
+
+	return 1;
+}
+
+/***
+ * @method redis_reply:get(idx)
+ * Returns element of a reply, the same as `reply[idx]`. Strings are copied,
+ * nested arrays are returned as lazy replies
+ * @param {number} idx index of element starting from 1
+ * @return {string|number|redis_reply} element or nil
+ */
+static gint
+lua_redis_reply_get (lua_State *L)
+{
+	return lua_redis_reply_index (L);
+}
+
+/***
+ * @method redis_reply:text(idx)
+ * Returns string element of a reply without copying, the text is valid
+ * while the reply object is referenced
+ * @param {number} idx index of element starting from 1
+ * @return {rspamd_text} element or nil
+ */
+static gint
+lua_redis_reply_text (lua_State *L)
+{
+	struct lua_redis_reply *rep = lua_check_redis_reply (L, 1);
+	const redisReply *elt;
+	struct rspamd_lua_text *t;
+
+	if (rep == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	elt = lua_redis_reply_get_elt (L, rep, 2);
+
+	if (elt && (elt->type == REDIS_REPLY_STRING ||
+			elt->type == REDIS_REPLY_STATUS)) {
+		t = lua_newuserdata (L, sizeof (*t));
+		rspamd_lua_setclass (L, "rspamd{text}", -1);
+		t->flags = 0;
+		t->start = elt->str;
+		t->len = elt->len;
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+/***
+ * @method redis_reply:number(idx)
+ * Returns numeric value of an element, strings are parsed
+ * @param {number} idx index of element starting from 1
+ * @return {number} value or nil if an element is not a number
+ */
+static gint
+lua_redis_reply_number (lua_State *L)
+{
+	struct lua_redis_reply *rep = lua_check_redis_reply (L, 1);
+	const redisReply *elt;
+	gchar *end;
+	gdouble val;
+
+	if (rep == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	elt = lua_redis_reply_get_elt (L, rep, 2);
+
+	if (elt && elt->type == REDIS_REPLY_INTEGER) {
+		lua_pushnumber (L, elt->integer);
+	}
+	else if (elt && elt->type == REDIS_REPLY_STRING && elt->len > 0) {
+		/* Hiredis strings are zero terminated */
+		val = g_ascii_strtod (elt->str, &end);
+
+		if (end == elt->str + elt->len) {
+			lua_pushnumber (L, val);
+		}
+		else {
+			lua_pushnil (L);
+		}
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+/***
+ * @method redis_reply:totable()
+ * Converts reply to a table as it is returned for non-lazy requests
+ * @return {table} reply elements
+ */
+static gint
+lua_redis_reply_totable (lua_State *L)
+{
+	struct lua_redis_reply *rep = lua_check_redis_reply (L, 1);
+
+	if (rep == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_redis_push_reply (L, rep->r, 0);
+
+	return 1;
+}
+
+static gint
+lua_redis_reply_gc (lua_State *L)
+{
+	struct lua_redis_reply *rep = lua_check_redis_reply (L, 1);
+
+	if (rep && rep->root) {
+		REF_RELEASE (rep->root);
+		rep->root = NULL;
+	}
+
+	return 0;
+}
+
 /**
  * Push data of redis request to lua callback
  * @param r redis reply data
@@ -331,7 +739,8 @@ lua_redis_push_data (const redisReply *r, struct lua_redis_ctx *ctx,
 			/* Error is nil */
 			lua_pushnil (ud->L);
 			/* Data */
-			lua_redis_push_reply (ud->L, r, ctx->flags & LUA_REDIS_TEXTDATA);
+			lua_redis_push_reply (ud->L, r,
+					ctx->flags & (LUA_REDIS_TEXTDATA|LUA_REDIS_LAZY));
 
 			if (lua_pcall (ud->L, 2, 0, 0) != 0) {
 				msg_info ("call to callback failed: %s", lua_tostring (ud->L, -1));
@@ -339,6 +748,9 @@ lua_redis_push_data (const redisReply *r, struct lua_redis_ctx *ctx,
 			}
 
 		}
+		else {
+			lua_redis_store_result (ctx, sp_ud, r, NULL);
+		}
 
 		sp_ud->flags |= LUA_REDIS_SPECIFIC_REPLIED;
 
@@ -372,6 +784,10 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	if (ud->terminated) {
 		/* We are already at the termination stage, just go out */
+		if (IS_BATCHED (ctx)) {
+			REDIS_RELEASE (ctx);
+		}
+
 		return;
 	}
 
@@ -417,6 +833,11 @@ lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 		}
 	}
 
+	if (IS_BATCHED (ctx)) {
+		/* Reference of the pending callback */
+		REDIS_RELEASE (ctx);
+	}
+
 	REDIS_RELEASE (ctx);
 }
 
@@ -441,11 +862,15 @@ lua_redis_timeout (int fd, short what, gpointer u)
 		ac = sp_ud->c->ctx;
 		/* Set to NULL to avoid double free in dtor */
 		sp_ud->c->ctx = NULL;
-		ac->err = REDIS_ERR_IO;
-		errno = ETIMEDOUT;
+
+		if (!IS_BATCHED (ctx)) {
+			ac->err = REDIS_ERR_IO;
+			errno = ETIMEDOUT;
+		}
 		/*
 		 * This will call all callbacks pending so the entire context
-		 * will be destructed
+		 * will be destructed, shared connections are closed when all
+		 * requests of the batch release them
 		 */
 		rspamd_redis_pool_release_connection (sp_ud->c->pool, ac, TRUE);
 	}
@@ -530,7 +955,8 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 }
 
 static struct lua_redis_ctx *
-rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref)
+rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref,
+		gboolean batched)
 {
 	struct lua_redis_ctx *ctx;
 	rspamd_inet_addr_t *ip = NULL;
@@ -652,6 +1078,22 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref)
 		}
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "lazy");
+		lua_gettable (L, -2);
+		if (!!lua_toboolean (L, -1)) {
+			flags |= LUA_REDIS_LAZY;
+		}
+		lua_pop (L, 1);
+
+		if (batched) {
+			lua_pushstring (L, "batch");
+			lua_gettable (L, -2);
+			if (!!lua_toboolean (L, -1)) {
+				flags |= LUA_REDIS_BATCHED;
+			}
+			lua_pop (L, 1);
+		}
+
 		lua_pop (L, 1); /* table */
 
 
@@ -659,12 +1101,13 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref)
 			ctx = g_slice_alloc0 (sizeof (struct lua_redis_ctx));
 			REF_INIT_RETAIN (ctx, lua_redis_dtor);
 			ctx->flags |= flags | LUA_REDIS_ASYNC;
+			ctx->results_ref = -1;
 			ud = &ctx->d.async;
 			ud->s = session;
 			ud->cfg = cfg;
 			ud->pool = cfg->redis_pool;
 			ud->ev_base = ev_base;
-			ud->L = L;
+			ud->L = rspamd_lua_main_state (L);
 
 			ret = TRUE;
 		}
@@ -680,10 +1123,19 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref)
 
 	if (ret) {
 		ud->terminated = 0;
-		ud->ctx = rspamd_redis_pool_connect (ud->pool,
-				dbname, password,
-				rspamd_inet_address_to_string (addr->addr),
-				rspamd_inet_address_get_port (addr->addr));
+
+		if (IS_BATCHED (ctx)) {
+			ud->ctx = rspamd_redis_pool_connect_shared (ud->pool,
+					dbname, password,
+					rspamd_inet_address_to_string (addr->addr),
+					rspamd_inet_address_get_port (addr->addr));
+		}
+		else {
+			ud->ctx = rspamd_redis_pool_connect (ud->pool,
+					dbname, password,
+					rspamd_inet_address_to_string (addr->addr),
+					rspamd_inet_address_get_port (addr->addr));
+		}
 
 		if (ip) {
 			rspamd_inet_address_destroy (ip);
@@ -725,6 +1177,8 @@ rspamd_lua_redis_prepare_connection (lua_State *L, gint *pcbref)
  * @param {string} cmd command to be sent to redis
  * @param {table} args numeric array of strings used as redis arguments
  * @param {number} timeout timeout in seconds for request (1.0 by default)
+ * @param {boolean} lazy return array replies as `redis_reply` objects converting elements on access
+ * @param {boolean} batch share connection with other requests to the same server issued in the same event loop iteration, so they are sent as a single pipeline (must not be used for transactions)
  * @return {boolean} `true` if a request has been scheduled
  */
 static int
@@ -739,7 +1193,7 @@ lua_redis_make_request (lua_State *L)
 	gint cbref = -1;
 	gboolean ret = FALSE;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, &cbref);
+	ctx = rspamd_lua_redis_prepare_connection (L, &cbref, TRUE);
 
 	if (ctx) {
 		ud = &ctx->d.async;
@@ -748,6 +1202,10 @@ lua_redis_make_request (lua_State *L)
 		sp_ud->c = ud;
 		sp_ud->ctx = ctx;
 
+		if (cbref == -1) {
+			sp_ud->idx = ctx->nawait ++;
+		}
+
 		lua_pushstring (L, "cmd");
 		lua_gettable (L, -2);
 		cmd = lua_tostring (L, -1);
@@ -781,19 +1239,24 @@ lua_redis_make_request (lua_State *L)
 						lua_redis_fin,
 						sp_ud,
 						g_quark_from_static_string ("lua redis"));
-				sp_ud->w = rspamd_session_get_watcher (ud->s);
-				rspamd_session_watcher_push (ud->s);
+				lua_redis_push_watcher (L, ud, sp_ud);
 			}
 			else {
 				sp_ud->w = NULL;
 			}
 
 			REDIS_RETAIN (ctx); /* Cleared by fin event */
+
+			if (IS_BATCHED (ctx)) {
+				/* Cleared when hiredis calls the callback */
+				REDIS_RETAIN (ctx);
+			}
+
 			ctx->cmds_pending ++;
 			double_to_tv (timeout, &tv);
 			event_set (&sp_ud->timeout, -1, EV_TIMEOUT, lua_redis_timeout, sp_ud);
 			event_base_set (ud->ev_base, &sp_ud->timeout);
-			event_add (&sp_ud->timeout, &tv);
+			event_add (&sp_ud->timeout, rspamd_event_common_tv (ud->ev_base, &tv));
 			ret = TRUE;
 		}
 		else {
@@ -889,6 +1352,13 @@ lua_redis_make_request_sync (lua_State *L)
 		}
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "lazy");
+		lua_gettable (L, -2);
+		if (!!lua_toboolean (L, -1)) {
+			flags |= LUA_REDIS_LAZY;
+		}
+		lua_pop (L, 1);
+
 
 		if (cmd) {
 			lua_pushstring (L, "args");
@@ -929,7 +1399,7 @@ lua_redis_make_request_sync (lua_State *L)
 		if (r != NULL) {
 			if (r->type != REDIS_REPLY_ERROR) {
 				lua_pushboolean (L, TRUE);
-				lua_redis_push_reply (L, r, flags & LUA_REDIS_TEXTDATA);
+				lua_redis_push_reply (L, r, flags);
 			}
 			else {
 				lua_pushboolean (L, FALSE);
@@ -975,7 +1445,7 @@ lua_redis_connect (lua_State *L)
 	struct lua_redis_ctx *ctx, **pctx;
 	gdouble timeout = REDIS_DEFAULT_TIMEOUT;
 
-	ctx = rspamd_lua_redis_prepare_connection (L, NULL);
+	ctx = rspamd_lua_redis_prepare_connection (L, NULL, FALSE);
 
 	if (ctx) {
 		ud = &ctx->d.async;
@@ -1055,6 +1525,13 @@ lua_redis_connect_sync (lua_State *L)
 		}
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "lazy");
+		lua_gettable (L, -2);
+		if (!!lua_toboolean (L, -1)) {
+			flags |= LUA_REDIS_LAZY;
+		}
+		lua_pop (L, 1);
+
 		if (addr) {
 			ret = TRUE;
 		}
@@ -1065,6 +1542,7 @@ lua_redis_connect_sync (lua_State *L)
 		ctx = g_slice_alloc0 (sizeof (struct lua_redis_ctx));
 		REF_INIT_RETAIN (ctx, lua_redis_dtor);
 		ctx->flags = flags;
+		ctx->results_ref = -1;
 		ctx->d.sync = redisConnectWithTimeout (
 				rspamd_inet_address_to_string (addr->addr),
 				rspamd_inet_address_get_port (addr->addr), tv);
@@ -1153,6 +1631,10 @@ lua_redis_add_cmd (lua_State *L)
 			sp_ud->c = &ctx->d.async;
 			sp_ud->ctx = ctx;
 
+			if (cbref == -1) {
+				sp_ud->idx = ctx->nawait ++;
+			}
+
 			lua_redis_parse_args (L, args_pos, cmd, &sp_ud->args,
 						&sp_ud->arglens, &sp_ud->nargs);
 
@@ -1171,15 +1653,20 @@ lua_redis_add_cmd (lua_State *L)
 							lua_redis_fin,
 							sp_ud,
 							g_quark_from_static_string ("lua redis"));
-					sp_ud->w = rspamd_session_get_watcher (ud->s);
-					rspamd_session_watcher_push (ud->s);
+					lua_redis_push_watcher (L, ud, sp_ud);
 				}
 
 				double_to_tv (sp_ud->c->timeout, &tv);
 				event_set (&sp_ud->timeout, -1, EV_TIMEOUT, lua_redis_timeout, sp_ud);
 				event_base_set (ud->ev_base, &sp_ud->timeout);
-				event_add (&sp_ud->timeout, &tv);
+				event_add (&sp_ud->timeout,
+						rspamd_event_common_tv (ud->ev_base, &tv));
 				REDIS_RETAIN (ctx);
+
+				if (IS_BATCHED (ctx)) {
+					REDIS_RETAIN (ctx);
+				}
+
 				ctx->cmds_pending ++;
 			}
 			else {
@@ -1272,7 +1759,7 @@ lua_redis_exec (lua_State *L)
 					if (r->type != REDIS_REPLY_ERROR) {
 						lua_pushboolean (L, TRUE);
 						lua_redis_push_reply (L, r,
-								ctx->flags & LUA_REDIS_TEXTDATA);
+								ctx->flags & (LUA_REDIS_TEXTDATA|LUA_REDIS_LAZY));
 					}
 					else {
 						lua_pushboolean (L, FALSE);
@@ -1293,6 +1780,48 @@ lua_redis_exec (lua_State *L)
 
 	return nret;
 }
+
+/***
+ * @method rspamd_redis:await()
+ * Suspends the current symbol until replies for all commands added without
+ * callbacks are received. Blocking connections execute pending commands as `exec`
+ * @return {boolean,result...} pairs of `ok, result` for each command in order of addition
+ */
+static int
+lua_redis_await (lua_State *L)
+{
+	struct lua_redis_ctx *ctx = lua_check_redis (L, 1);
+	struct thread_entry *thread;
+	struct lua_redis_userdata *ud;
+
+	if (ctx == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (!IS_ASYNC (ctx)) {
+		return lua_redis_exec (L);
+	}
+
+	ud = &ctx->d.async;
+	thread = lua_thread_pool_get_running_entry (ud->cfg->lua_thread_pool, L);
+
+	if (thread == NULL) {
+		return luaL_error (L, "await must be called from a symbol callback");
+	}
+
+	if (ctx->thread != NULL) {
+		return luaL_error (L, "connection is already awaited");
+	}
+
+	if (ctx->nreplied == ctx->nawait) {
+		/* All replies are here */
+		return lua_redis_push_results (ctx, L);
+	}
+
+	ctx->thread = thread;
+
+	return lua_thread_yield (thread, 0);
+}
 #else
 static int
 lua_redis_make_request (lua_State *L)
@@ -1349,6 +1878,15 @@ lua_redis_exec (lua_State *L)
 	return 1;
 }
 static int
+lua_redis_await (lua_State *L)
+{
+	msg_warn ("rspamd is compiled with no redis support");
+
+	lua_pushboolean (L, FALSE);
+
+	return 1;
+}
+static int
 lua_redis_gc (lua_State *L)
 {
 	return 0;
@@ -1383,5 +1921,15 @@ luaopen_redis (lua_State * L)
 	luaL_register (L, NULL, redislib_m);
 	lua_pop (L, 1);
 
+#ifdef WITH_HIREDIS
+	luaL_newmetatable (L, "rspamd{redis_reply}");
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{redis_reply}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, redis_replylib_m);
+	lua_pop (L, 1);
+#endif
+
 	rspamd_lua_add_preload (L, "rspamd_redis", lua_load_redis);
 }
@@ -0,0 +1,254 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/***
+ * @module rspamd_shared_cache
+ * This module provides LRU caches of short strings stored in shared memory,
+ * so all workers of a host see the same elements. Caches must be created
+ * at the configuration stage, caches with the same name are shared.
+ * @example
+local rspamd_shared_cache = require "rspamd_shared_cache"
+local cache = rspamd_shared_cache.create(rspamd_config, 'av', {
+	max_items = 8192,
+	max_value = 128,
+	ttl = 3600,
+})
+-- In a task callback
+local res = cache:get(task:get_digest())
+if not res then
+	cache:set(task:get_digest(), 'OK')
+end
+ */
+
+#include "lua_common.h"
+#include "shared_cache.h"
+
+#define LUA_SHARED_CACHES_VAR "lua_shared_caches"
+
+LUA_FUNCTION_DEF (shared_cache, create);
+LUA_FUNCTION_DEF (shared_cache, get);
+LUA_FUNCTION_DEF (shared_cache, set);
+LUA_FUNCTION_DEF (shared_cache, delete);
+
+static const struct luaL_reg shared_cachelib_m[] = {
+	LUA_INTERFACE_DEF (shared_cache, get),
+	LUA_INTERFACE_DEF (shared_cache, set),
+	LUA_INTERFACE_DEF (shared_cache, delete),
+	{"__tostring", rspamd_lua_class_tostring},
+	{NULL, NULL}
+};
+static const struct luaL_reg shared_cachelib_f[] = {
+	LUA_INTERFACE_DEF (shared_cache, create),
+	{NULL, NULL}
+};
+
+static struct rspamd_shared_cache *
+lua_check_shared_cache (lua_State * L)
+{
+	void *ud = rspamd_lua_check_udata (L, 1, "rspamd{shared_cache}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'shared_cache' expected");
+	return ud ? *((struct rspamd_shared_cache **)ud) : NULL;
+}
+
+/***
+ * @function rspamd_shared_cache.create(cfg, name, [opts])
+ * Creates new cache or returns the existing cache with the same name. Options
+ * are `max_items` (8192 by default), `max_value` (maximum length of values,
+ * 64 by default) and `ttl` (default time to live, 3600 seconds by default)
+ * @param {rspamd_config} cfg config object
+ * @param {string} name name of the cache
+ * @param {table} opts options
+ * @return {shared_cache} cache object
+ */
+static gint
+lua_shared_cache_create (lua_State *L)
+{
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	const gchar *name = luaL_checkstring (L, 2);
+	struct rspamd_shared_cache *c, **pc;
+	GHashTable *caches;
+	guint max_items = 8192, max_value = 64, ttl = 3600;
+
+	if (cfg == NULL || name == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_type (L, 3) == LUA_TTABLE) {
+		lua_pushstring (L, "max_items");
+		lua_gettable (L, 3);
+		if (lua_type (L, -1) == LUA_TNUMBER) {
+			max_items = lua_tonumber (L, -1);
+		}
+		lua_pop (L, 1);
+
+		lua_pushstring (L, "max_value");
+		lua_gettable (L, 3);
+		if (lua_type (L, -1) == LUA_TNUMBER) {
+			max_value = lua_tonumber (L, -1);
+		}
+		lua_pop (L, 1);
+
+		lua_pushstring (L, "ttl");
+		lua_gettable (L, 3);
+		if (lua_type (L, -1) == LUA_TNUMBER) {
+			ttl = lua_tonumber (L, -1);
+		}
+		lua_pop (L, 1);
+	}
+
+	if (max_items == 0 || max_value == 0) {
+		return luaL_error (L, "invalid cache size");
+	}
+
+	caches = rspamd_mempool_get_variable (cfg->cfg_pool, LUA_SHARED_CACHES_VAR);
+
+	if (caches == NULL) {
+		caches = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+		rspamd_mempool_set_variable (cfg->cfg_pool, LUA_SHARED_CACHES_VAR,
+				caches, (rspamd_mempool_destruct_t)g_hash_table_unref);
+	}
+
+	c = g_hash_table_lookup (caches, name);
+
+	if (c == NULL) {
+		c = rspamd_shared_cache_new (cfg->cfg_pool, max_items, max_value, ttl);
+		g_hash_table_insert (caches, rspamd_mempool_strdup (cfg->cfg_pool, name),
+				c);
+	}
+
+	pc = lua_newuserdata (L, sizeof (*pc));
+	rspamd_lua_setclass (L, "rspamd{shared_cache}", -1);
+	*pc = c;
+
+	return 1;
+}
+
+/***
+ * @method shared_cache:get(key)
+ * Returns the value stored for the specified key
+ * @param {string} key key to find
+ * @return {string} value or nil
+ */
+static gint
+lua_shared_cache_get (lua_State *L)
+{
+	struct rspamd_shared_cache *c = lua_check_shared_cache (L);
+	const gchar *key;
+	gchar *value;
+	gsize keylen, vlen;
+
+	key = luaL_checklstring (L, 2, &keylen);
+
+	if (c == NULL || key == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	value = g_alloca (rspamd_shared_cache_max_value (c));
+
+	if (rspamd_shared_cache_lookup (c, key, keylen, value, &vlen, time (NULL))) {
+		lua_pushlstring (L, value, vlen);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+/***
+ * @method shared_cache:set(key, value, [ttl])
+ * Stores a value for the specified key
+ * @param {string} key key
+ * @param {string} value value, longer values are not stored
+ * @param {number} ttl time to live, cache's default if not specified
+ * @return {boolean} true if a value has been stored
+ */
+static gint
+lua_shared_cache_set (lua_State *L)
+{
+	struct rspamd_shared_cache *c = lua_check_shared_cache (L);
+	const gchar *key, *value;
+	gsize keylen, vlen;
+	guint ttl = 0;
+
+	key = luaL_checklstring (L, 2, &keylen);
+	value = luaL_checklstring (L, 3, &vlen);
+
+	if (c == NULL || key == NULL || value == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_type (L, 4) == LUA_TNUMBER) {
+		ttl = lua_tonumber (L, 4);
+	}
+
+	lua_pushboolean (L, rspamd_shared_cache_insert (c, key, keylen, value, vlen,
+			time (NULL), ttl));
+
+	return 1;
+}
+
+/***
+ * @method shared_cache:delete(key)
+ * Removes the value stored for the specified key
+ * @param {string} key key
+ * @return {boolean} true if a value has been removed
+ */
+static gint
+lua_shared_cache_delete (lua_State *L)
+{
+	struct rspamd_shared_cache *c = lua_check_shared_cache (L);
+	const gchar *key;
+	gsize keylen;
+
+	key = luaL_checklstring (L, 2, &keylen);
+
+	if (c == NULL || key == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushboolean (L, rspamd_shared_cache_remove (c, key, keylen));
+
+	return 1;
+}
+
+static gint
+lua_load_shared_cache (lua_State *L)
+{
+	lua_newtable (L);
+	luaL_register (L, NULL, shared_cachelib_f);
+
+	return 1;
+}
+
+void
+luaopen_shared_cache (lua_State * L)
+{
+	luaL_newmetatable (L, "rspamd{shared_cache}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{shared_cache}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, shared_cachelib_m);
+	lua_pop (L, 1);
+
+	rspamd_lua_add_preload (L, "rspamd_shared_cache", lua_load_shared_cache);
+}
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 #include "lua_common.h"
+#include "lua_thread_pool.h"
 #include "message.h"
 #include "images.h"
 #include "archives.h"
@@ -141,6 +142,13 @@ local function phishing_cb(task)
 end
  */
 LUA_FUNCTION_DEF (task, get_urls);
+/***
+ * @method task:get_url_hosts()
+ * Get distinct hosts of all URLs and emails found in a message, so that
+ * checks could be done once per host
+ * @return {table} list of tables with fields `host`, `tld` and `urls` (number of urls with this host)
+ */
+LUA_FUNCTION_DEF (task, get_url_hosts);
 /***
  * @method task:has_urls([need_emails])
  * Returns 'true' if a task has urls listed
@@ -263,9 +271,13 @@ LUA_FUNCTION_DEF (task, get_raw_headers);
  * - `proto` - protocol, e.g. ESMTP or ESMTPS
  * - `timestamp` - received timetamp
  * - `for` - for value (unparsed mailbox)
+ * - `raw` - unparsed text of a header
+ * - `flags` - table of booleans: `artificial`, `authenticated` and `ssl`
  *
  * Please note that in some situations rspamd cannot parse all the fields of received headers.
  * In that case you should check all strings for validity.
+ * Received headers are parsed once per message and the same table is returned
+ * to all callers, so it must not be modified.
  * @return {table of tables} list of received headers described above
  */
 LUA_FUNCTION_DEF (task, get_received_headers);
@@ -301,6 +313,24 @@ local function task_cb(task)
 end
  */
 LUA_FUNCTION_DEF (task, get_resolver);
+/***
+ * @method task:yield_dns(type, name[, forced])
+ * Resolve `name` suspending the current symbol until a reply is received, can
+ * be used from symbols callbacks only
+ * @param {string} type request type (`a`, `aaaa`, `txt`, `mx`, `ptr`...)
+ * @param {string} name name to resolve (ip address for `ptr` requests)
+ * @param {boolean} forced make request even if the DNS requests limit is reached
+ * @return {table,string,boolean} results or nil, error and authenticated flag
+ * @example
+local function dns_symbol(task)
+	local results, err = task:yield_dns('a', 'example.com')
+	if results then
+		return true
+	end
+	return false
+end
+ */
+LUA_FUNCTION_DEF (task, yield_dns);
 /***
  * @method task:inc_dns_req()
  * Increment number of DNS requests for the task. Is used just for logging purposes.
@@ -791,6 +821,7 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF (task, append_message),
 	LUA_INTERFACE_DEF (task, has_urls),
 	LUA_INTERFACE_DEF (task, get_urls),
+	LUA_INTERFACE_DEF (task, get_url_hosts),
 	LUA_INTERFACE_DEF (task, get_content),
 	LUA_INTERFACE_DEF (task, get_rawbody),
 	LUA_INTERFACE_DEF (task, get_emails),
@@ -806,6 +837,7 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF (task, get_queue_id),
 	LUA_INTERFACE_DEF (task, get_uid),
 	LUA_INTERFACE_DEF (task, get_resolver),
+	LUA_INTERFACE_DEF (task, yield_dns),
 	LUA_INTERFACE_DEF (task, inc_dns_req),
 	LUA_INTERFACE_DEF (task, get_dns_req),
 	LUA_INTERFACE_DEF (task, has_recipients),
@@ -905,6 +937,9 @@ LUA_FUNCTION_DEF (text, str);
 LUA_FUNCTION_DEF (text, ptr);
 LUA_FUNCTION_DEF (text, save_in_file);
 LUA_FUNCTION_DEF (text, take_ownership);
+LUA_FUNCTION_DEF (text, sub);
+LUA_FUNCTION_DEF (text, find);
+LUA_FUNCTION_DEF (text, search);
 LUA_FUNCTION_DEF (text, gc);
 
 static const struct luaL_reg textlib_m[] = {
@@ -913,6 +948,9 @@ static const struct luaL_reg textlib_m[] = {
 	LUA_INTERFACE_DEF (text, ptr),
 	LUA_INTERFACE_DEF (text, take_ownership),
 	LUA_INTERFACE_DEF (text, save_in_file),
+	LUA_INTERFACE_DEF (text, sub),
+	LUA_INTERFACE_DEF (text, find),
+	LUA_INTERFACE_DEF (text, search),
 	{"__len", lua_text_len},
 	{"__tostring", lua_text_str},
 	{"__gc", lua_text_gc},
@@ -969,7 +1007,7 @@ lua_task_set_cached (lua_State *L, struct rspamd_task *task, const gchar *key,
 
 	lua_pushvalue (L, pos);
 
-	elt = g_hash_table_lookup (task->lua_cache, key);
+	elt = rspamd_mempool_hash_lookup (task->lua_cache, key);
 
 	if (G_UNLIKELY (elt != NULL)) {
 		/* Unref previous value */
@@ -978,7 +1016,8 @@ lua_task_set_cached (lua_State *L, struct rspamd_task *task, const gchar *key,
 	}
 
 	lua_ref = luaL_ref (L, LUA_REGISTRYINDEX);
-	g_hash_table_insert (task->lua_cache, (void *)key, GINT_TO_POINTER (lua_ref));
+	rspamd_mempool_hash_insert (task->lua_cache, (void *)key,
+			GINT_TO_POINTER (lua_ref));
 }
 
 static gboolean
@@ -986,7 +1025,7 @@ lua_task_get_cached (lua_State *L, struct rspamd_task *task, const gchar *key)
 {
 	gpointer elt;
 
-	elt = g_hash_table_lookup (task->lua_cache, key);
+	elt = rspamd_mempool_hash_lookup (task->lua_cache, key);
 
 	if (elt != NULL) {
 		lua_rawgeti (L, LUA_REGISTRYINDEX, GPOINTER_TO_INT (elt));
@@ -1322,6 +1361,52 @@ lua_task_get_urls (lua_State * L)
 	return 1;
 }
 
+static void
+lua_tree_url_host_callback (gpointer key, gpointer value, gpointer ud)
+{
+	struct rspamd_task *task = ud;
+
+	rspamd_url_host_intern (task, value);
+}
+
+static gint
+lua_task_get_url_hosts (lua_State * L)
+{
+	struct rspamd_task *task = lua_check_task (L, 1);
+	struct rspamd_url_host *h;
+	rspamd_mempool_hash_iter_t it;
+	gpointer k, v;
+	gint i = 1;
+
+	if (task) {
+		g_hash_table_foreach (task->urls, lua_tree_url_host_callback, task);
+		g_hash_table_foreach (task->emails, lua_tree_url_host_callback, task);
+
+		lua_createtable (L, rspamd_mempool_hash_size (task->url_hosts), 0);
+		rspamd_mempool_hash_iter_init (&it, task->url_hosts);
+
+		while (rspamd_mempool_hash_iter_next (&it, &k, &v)) {
+			h = v;
+			lua_createtable (L, 0, 3);
+			lua_pushstring (L, "host");
+			lua_pushlstring (L, h->host.begin, h->host.len);
+			lua_settable (L, -3);
+			lua_pushstring (L, "tld");
+			lua_pushlstring (L, h->tld.begin, h->tld.len);
+			lua_settable (L, -3);
+			lua_pushstring (L, "urls");
+			lua_pushnumber (L, h->nurls);
+			lua_settable (L, -3);
+			lua_rawseti (L, -2, i++);
+		}
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 static gint
 lua_task_has_urls (lua_State * L)
 {
@@ -1587,8 +1672,9 @@ rspamd_lua_push_header (lua_State * L,
 				rspamd_lua_table_set (L, "value", rh->value);
 			}
 
-			if (rh->decoded) {
-				rspamd_lua_table_set (L, "decoded", rh->decoded);
+			if (rh->value) {
+				rspamd_lua_table_set (L, "decoded",
+						rspamd_mime_header_get_decoded (rh));
 			}
 
 			lua_pushstring (L, "tab_separated");
@@ -1605,7 +1691,7 @@ rspamd_lua_push_header (lua_State * L,
 		}
 		else {
 			if (!raw) {
-				val = rh->decoded;
+				val = rspamd_mime_header_get_decoded (rh);
 			}
 			else {
 				val = rh->value;
@@ -1702,12 +1788,13 @@ lua_task_get_received_headers (lua_State * L)
 			lua_createtable (L, task->received->len, 0);
 
 			for (i = 0; i < task->received->len; i ++) {
-				rh = g_ptr_array_index (task->received, i);
+				rh = rspamd_mempool_array_index (task->received, i);
 
 				lua_createtable (L, 0, 10);
 
-				if (rh->hdr && rh->hdr->decoded) {
-					rspamd_lua_table_set (L, "raw", rh->hdr->decoded);
+				if (rh->hdr) {
+					/* Received headers are not encoded, so skip decoding */
+					rspamd_lua_table_set (L, "raw", rh->hdr->value);
 				}
 
 				lua_pushstring (L, "flags");
@@ -1863,6 +1950,35 @@ lua_task_get_resolver (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_task_yield_dns (lua_State *L)
+{
+	struct rspamd_task *task = lua_check_task (L, 1);
+	const gchar *type_str = luaL_checkstring (L, 2);
+	const gchar *name = luaL_checkstring (L, 3);
+	struct thread_entry *thread;
+	gint type;
+
+	if (task == NULL || task->resolver == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	thread = lua_thread_pool_get_running_entry (task->cfg->lua_thread_pool, L);
+
+	if (thread == NULL) {
+		return luaL_error (L, "yield_dns must be called from a symbol callback");
+	}
+
+	type = rdns_type_fromstr (type_str);
+
+	if (type == -1) {
+		return luaL_error (L, "bad DNS type: %s", type_str);
+	}
+
+	return lua_dns_task_yield (L, thread, task, type, name,
+			lua_toboolean (L, 4));
+}
+
 static gint
 lua_task_inc_dns_req (lua_State *L)
 {
@@ -2768,7 +2884,7 @@ lua_push_symbol_result (lua_State *L,
 	gint j = 1, e = 4;
 
 	if (!symbol_result) {
-		metric_res = g_hash_table_lookup (task->results, metric->name);
+		metric_res = rspamd_mempool_hash_lookup (task->results, metric->name);
 		if (metric_res) {
 			s = g_hash_table_lookup (metric_res->symbols, symbol);
 		}
@@ -2898,7 +3014,7 @@ lua_task_has_symbol (lua_State *L)
 	symbol = luaL_checkstring (L, 2);
 
 	if (task && symbol) {
-		mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+		mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 
 		if (mres) {
 			found = g_hash_table_lookup (mres->symbols, symbol) != NULL;
@@ -2924,7 +3040,7 @@ lua_task_get_symbols (lua_State *L)
 	struct rspamd_symbol_result *s;
 
 	if (task) {
-		mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+		mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 
 		if (mres) {
 			lua_createtable (L, g_hash_table_size (mres->symbols), 0);
@@ -2965,7 +3081,7 @@ lua_task_get_symbols_all (lua_State *L)
 
 	if (task) {
 		metric = task->cfg->default_metric;
-		mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+		mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 		if (mres) {
 			found = TRUE;
 			lua_createtable (L, g_hash_table_size (mres->symbols), 0);
@@ -3000,7 +3116,7 @@ lua_task_get_symbols_numeric (lua_State *L)
 	struct rspamd_symbol_result *s;
 
 	if (task) {
-		mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+		mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 
 		if (mres) {
 			lua_createtable (L, g_hash_table_size (mres->symbols), 0);
@@ -3119,9 +3235,11 @@ lua_task_get_date (lua_State *L)
 				time_t tt;
 				struct tm t;
 				struct rspamd_mime_header *h;
+				const gchar *date;
 
 				h = g_ptr_array_index (hdrs, 0);
-				tt = rspamd_parse_smtp_date (h->decoded, strlen (h->decoded));
+				date = rspamd_mime_header_get_decoded (h);
+				tt = rspamd_parse_smtp_date (date, strlen (date));
 
 				if (!gmt) {
 					localtime_r (&tt, &t);
@@ -3463,7 +3581,7 @@ lua_task_set_settings (lua_State *L)
 
 		if (act) {
 			/* Adjust desired actions */
-			mres = g_hash_table_lookup (task->results, DEFAULT_METRIC);
+			mres = rspamd_mempool_hash_lookup (task->results, DEFAULT_METRIC);
 
 			if (mres == NULL) {
 				mres = rspamd_create_metric_result (task, DEFAULT_METRIC);
@@ -3765,7 +3883,7 @@ lua_task_get_metric_score (lua_State *L)
 
 	if (task && metric_name) {
 		if ((metric_res =
-			g_hash_table_lookup (task->results, metric_name)) != NULL) {
+			rspamd_mempool_hash_lookup (task->results, metric_name)) != NULL) {
 			lua_createtable (L, 2, 0);
 			lua_pushnumber (L, isnan (metric_res->score) ? 0.0 : metric_res->score);
 			rs = rspamd_task_get_required_score (task, metric_res);
@@ -3800,7 +3918,7 @@ lua_task_get_metric_action (lua_State *L)
 
 	if (task && metric_name) {
 		if ((metric_res =
-			g_hash_table_lookup (task->results, metric_name)) != NULL) {
+			rspamd_mempool_hash_lookup (task->results, metric_name)) != NULL) {
 			action = rspamd_check_action_metric (task, metric_res);
 			lua_pushstring (L, rspamd_action_to_str (action));
 		}
@@ -3832,7 +3950,7 @@ lua_task_set_metric_score (lua_State *L)
 
 	if (task && metric_name) {
 		if ((metric_res =
-			g_hash_table_lookup (task->results, metric_name)) != NULL) {
+			rspamd_mempool_hash_lookup (task->results, metric_name)) != NULL) {
 			msg_debug_task ("set metric score from %.2f to %.2f",
 				metric_res->score, nscore);
 			metric_res->score = nscore;
@@ -3867,7 +3985,7 @@ lua_task_set_metric_action (lua_State *L)
 
 	if (task && metric_name && action_name) {
 		if ((metric_res =
-			g_hash_table_lookup (task->results, metric_name)) != NULL) {
+			rspamd_mempool_hash_lookup (task->results, metric_name)) != NULL) {
 
 			if (rspamd_action_from_str (action_name, &action)) {
 				metric_res->action = action;
@@ -4289,6 +4407,187 @@ lua_text_save_in_file (lua_State *L)
 	return 1;
 }
 
+/*
+ * Texts that own their memory could be collected before their views, so
+ * views of such texts are copied
+ */
+static void
+lua_text_push_view (lua_State *L, struct rspamd_lua_text *parent,
+		const gchar *start, gsize len)
+{
+	struct rspamd_lua_text *t;
+	gchar *dest;
+
+	t = lua_newuserdata (L, sizeof (*t));
+	rspamd_lua_setclass (L, "rspamd{text}", -1);
+	t->len = len;
+
+	if (parent->flags & RSPAMD_TEXT_FLAG_OWN) {
+		dest = g_malloc (len);
+		memcpy (dest, start, len);
+		t->start = dest;
+		t->flags = RSPAMD_TEXT_FLAG_OWN;
+	}
+	else {
+		t->start = start;
+		t->flags = 0;
+	}
+}
+
+/***
+ * @method text:sub(i[, j])
+ * Returns a part of text from `i` to `j` inclusive, indexes have the same
+ * meaning as for `string.sub`. The result refers to the same memory, so
+ * no data is copied
+ * @param {number} i start position
+ * @param {number} j end position, -1 by default
+ * @return {text} part of text
+ */
+static gint
+lua_text_sub (lua_State *L)
+{
+	struct rspamd_lua_text *t = lua_check_text (L, 1);
+	gint64 start, end, len;
+
+	if (t != NULL) {
+		len = t->len;
+		start = luaL_checknumber (L, 2);
+		end = luaL_optnumber (L, 3, -1);
+
+		if (start < 0) {
+			start += len + 1;
+		}
+		if (end < 0) {
+			end += len + 1;
+		}
+		if (start < 1) {
+			start = 1;
+		}
+		if (end > len) {
+			end = len;
+		}
+
+		if (start > end) {
+			lua_text_push_view (L, t, t->start, 0);
+		}
+		else {
+			lua_text_push_view (L, t, t->start + start - 1, end - start + 1);
+		}
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
+/***
+ * @method text:find(pattern[, init])
+ * Finds plain substring `pattern` in text starting from position `init`
+ * @param {string} pattern substring to find
+ * @param {number} init start position, 1 by default
+ * @return {number,number} start and end positions of pattern or nil
+ */
+static gint
+lua_text_find (lua_State *L)
+{
+	struct rspamd_lua_text *t = lua_check_text (L, 1);
+	const gchar *pat;
+	gsize patlen;
+	gint64 init;
+	goffset pos;
+
+	pat = luaL_checklstring (L, 2, &patlen);
+
+	if (t != NULL && pat != NULL) {
+		init = luaL_optnumber (L, 3, 1);
+
+		if (init < 0) {
+			init += (gint64)t->len + 1;
+		}
+		if (init < 1) {
+			init = 1;
+		}
+
+		if (init - 1 + patlen > t->len) {
+			lua_pushnil (L);
+
+			return 1;
+		}
+
+		pos = rspamd_substring_search (t->start + init - 1,
+				t->len - (init - 1), pat, patlen);
+
+		if (pos == -1) {
+			lua_pushnil (L);
+
+			return 1;
+		}
+
+		lua_pushnumber (L, init + pos);
+		lua_pushnumber (L, init + pos + patlen - 1);
+
+		return 2;
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+}
+
+/***
+ * @method text:search(re[, raw])
+ * Searches all matches of regular expression `re` in text. Unlike
+ * `re:search` it returns matches as texts that refer to the same memory
+ * @param {rspamd_regexp} re regular expression
+ * @param {bool} raw match raw regexp instead of utf8 one
+ * @return {table of text} matches or nil
+ */
+static gint
+lua_text_search (lua_State *L)
+{
+	struct rspamd_lua_text *t = lua_check_text (L, 1);
+	struct rspamd_lua_regexp **pre, *re;
+	const gchar *start = NULL, *end = NULL;
+	gboolean raw;
+	gsize len;
+	gint i = 0;
+
+	pre = rspamd_lua_check_udata (L, 2, "rspamd{regexp}");
+
+	if (t != NULL && pre != NULL && *pre != NULL && (*pre)->re != NULL) {
+		re = *pre;
+		raw = lua_toboolean (L, 3);
+		len = t->len;
+
+		if (re->match_limit > 0) {
+			len = MIN (len, re->match_limit);
+		}
+
+		lua_newtable (L);
+
+		while (rspamd_regexp_search (re->re, t->start, len, &start, &end, raw,
+				NULL)) {
+			if (start == end) {
+				/* Empty matches would never advance the search */
+				break;
+			}
+
+			lua_text_push_view (L, t, start, end - start);
+			lua_rawseti (L, -2, ++i);
+		}
+
+		if (i == 0) {
+			lua_pop (L, 1);
+			lua_pushnil (L);
+		}
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 1;
+}
+
 static gint
 lua_text_gc (lua_State *L)
 {
@@ -4361,3 +4660,148 @@ rspamd_lua_task_push (lua_State *L, struct rspamd_task *task)
 	rspamd_lua_setclass (L, "rspamd{task}", -1);
 	*ptask = task;
 }
+
+/*
+ * LuaJIT FFI entry points, `ptask` is a userdata of rspamd{task}. Strings are
+ * returned as views of the task's memory, so they are valid while the task
+ * is alive and must not be modified
+ */
+int
+rspamd_task_get_header_ffi (void *ptask, const char *name, int strong,
+		int raw, struct rspamd_lua_text *out)
+{
+	struct rspamd_task **real_task = ptask;
+	struct rspamd_mime_header *rh;
+	GPtrArray *ar;
+	const gchar *val;
+
+	ar = rspamd_message_get_header_array (*real_task, name, strong);
+
+	if (ar == NULL || ar->len == 0) {
+		return 0;
+	}
+
+	rh = g_ptr_array_index (ar, 0);
+	val = raw ? rh->value : rspamd_mime_header_get_decoded (rh);
+
+	if (val == NULL) {
+		return 0;
+	}
+
+	out->start = val;
+	out->len = strlen (val);
+	out->flags = 0;
+
+	return 1;
+}
+
+int
+rspamd_task_has_symbol_ffi (void *ptask, const char *symbol)
+{
+	struct rspamd_task **real_task = ptask;
+	struct rspamd_metric_result *mres;
+
+	mres = rspamd_mempool_hash_lookup ((*real_task)->results, DEFAULT_METRIC);
+
+	if (mres == NULL) {
+		return 0;
+	}
+
+	return g_hash_table_lookup (mres->symbols, symbol) != NULL;
+}
+
+/*
+ * Fills at most `max` urls and returns the total number of them, so a caller
+ * can repeat the call with a larger buffer
+ */
+unsigned int
+rspamd_task_get_urls_ffi (void *ptask, int need_emails,
+		struct rspamd_lua_text *out, unsigned int max)
+{
+	struct rspamd_task **real_task = ptask;
+	struct rspamd_task *task = *real_task;
+	struct rspamd_url *url;
+	GHashTableIter it;
+	gpointer k, v;
+	guint i = 0, total;
+
+	total = g_hash_table_size (task->urls);
+
+	if (need_emails) {
+		total += g_hash_table_size (task->emails);
+	}
+
+	g_hash_table_iter_init (&it, task->urls);
+
+	while (i < max && g_hash_table_iter_next (&it, &k, &v)) {
+		url = v;
+		out[i].start = url->string;
+		out[i].len = url->urllen;
+		out[i].flags = 0;
+		i ++;
+	}
+
+	if (need_emails) {
+		g_hash_table_iter_init (&it, task->emails);
+
+		while (i < max && g_hash_table_iter_next (&it, &k, &v)) {
+			url = v;
+			out[i].start = url->string;
+			out[i].len = url->urllen;
+			out[i].flags = 0;
+			i ++;
+		}
+	}
+
+	return total;
+}
+
+/*
+ * Fills `out` with address, user and domain of the first sender address
+ */
+int
+rspamd_task_get_from_ffi (void *ptask, int what, struct rspamd_lua_text *out)
+{
+	struct rspamd_task **real_task = ptask;
+	struct rspamd_task *task = *real_task;
+	struct rspamd_email_address *addr = NULL;
+	GPtrArray *addrs = NULL;
+
+	switch (what) {
+	case RSPAMD_ADDRESS_SMTP:
+		addr = task->from_envelope;
+		break;
+	case RSPAMD_ADDRESS_MIME:
+		addrs = task->from_mime;
+		break;
+	case RSPAMD_ADDRESS_ANY:
+	default:
+		if (task->from_envelope) {
+			addr = task->from_envelope;
+		}
+		else {
+			addrs = task->from_mime;
+		}
+		break;
+	}
+
+	if (addrs && addrs->len > 0) {
+		addr = g_ptr_array_index (addrs, 0);
+	}
+
+	if (addr == NULL || addr->addr == NULL) {
+		return 0;
+	}
+
+	out[0].start = addr->addr;
+	out[0].len = addr->addr_len;
+	out[0].flags = 0;
+	out[1].start = addr->user;
+	out[1].len = addr->user_len;
+	out[1].flags = 0;
+	out[2].start = addr->domain;
+	out[2].len = addr->domain_len;
+	out[2].flags = 0;
+
+	return 1;
+}
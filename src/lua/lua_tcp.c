@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 #include "lua_common.h"
+#include "lua_thread_pool.h"
+#include "libutil/http.h"
 #include "utlist.h"
 #include "unix-std.h"
 
@@ -184,6 +186,10 @@ struct lua_tcp_dtor {
 #define LUA_TCP_FLAG_SHUTDOWN (1 << 2)
 #define LUA_TCP_FLAG_CONNECTED (1 << 3)
 #define LUA_TCP_FLAG_FINISHED (1 << 4)
+#define LUA_TCP_FLAG_KEEPALIVE (1 << 5)
+/* The last handler has been completed and no data is expected from peer */
+#define LUA_TCP_FLAG_SYNCED (1 << 6)
+#define LUA_TCP_FLAG_BROKEN (1 << 7)
 
 struct lua_tcp_cbdata {
 	lua_State *L;
@@ -201,6 +207,9 @@ struct lua_tcp_cbdata {
 	struct rspamd_async_watcher *w;
 	struct event ev;
 	struct lua_tcp_dtor *dtors;
+	struct thread_entry *thread;
+	/* Written to new keep-alive connections only, e.g. to start a session */
+	struct lua_tcp_handler *init_hdl;
 	ref_entry_t ref;
 };
 
@@ -214,6 +223,8 @@ static void lua_tcp_plan_handler_event (struct lua_tcp_cbdata *cbd,
 		gboolean can_read, gboolean can_write);
 
 static const int default_tcp_timeout = 5000;
+static const gdouble keepalive_idle_timeout = 10.0;
+static const guint keepalive_max_conns = 16;
 
 static struct rspamd_dns_resolver *
 lua_tcp_global_resolver (struct event_base *ev_base)
@@ -227,18 +238,23 @@ lua_tcp_global_resolver (struct event_base *ev_base)
 	return global_resolver;
 }
 
-static gboolean
-lua_tcp_shift_handler (struct lua_tcp_cbdata *cbd)
+/* Idle connections are shared by all requests of a process */
+static struct rspamd_http_keepalive_pool *
+lua_tcp_keepalive_pool (struct event_base *ev_base)
 {
-	struct lua_tcp_handler *hdl;
-
-	hdl = g_queue_pop_head (cbd->handlers);
+	static struct rspamd_http_keepalive_pool *pool;
 
-	if (hdl == NULL) {
-		/* We are done */
-		return FALSE;
+	if (pool == NULL) {
+		pool = rspamd_http_keepalive_pool_new (ev_base, keepalive_idle_timeout,
+				keepalive_max_conns);
 	}
 
+	return pool;
+}
+
+static void
+lua_tcp_free_handler (struct lua_tcp_cbdata *cbd, struct lua_tcp_handler *hdl)
+{
 	if (hdl->type == LUA_WANT_READ) {
 		if (hdl->h.r.cbref) {
 			luaL_unref (cbd->L, LUA_REGISTRYINDEX, hdl->h.r.cbref);
@@ -259,10 +275,34 @@ lua_tcp_shift_handler (struct lua_tcp_cbdata *cbd)
 	}
 
 	g_slice_free1 (sizeof (*hdl), hdl);
+}
+
+static gboolean
+lua_tcp_shift_handler (struct lua_tcp_cbdata *cbd)
+{
+	struct lua_tcp_handler *hdl;
+
+	hdl = g_queue_pop_head (cbd->handlers);
+
+	if (hdl == NULL) {
+		/* We are done */
+		return FALSE;
+	}
+
+	lua_tcp_free_handler (cbd, hdl);
 
 	return TRUE;
 }
 
+static gboolean
+lua_tcp_can_keepalive (struct lua_tcp_cbdata *cbd)
+{
+	return (cbd->flags & (LUA_TCP_FLAG_KEEPALIVE|LUA_TCP_FLAG_CONNECTED|
+			LUA_TCP_FLAG_SYNCED|LUA_TCP_FLAG_BROKEN)) ==
+			(LUA_TCP_FLAG_KEEPALIVE|LUA_TCP_FLAG_CONNECTED|LUA_TCP_FLAG_SYNCED) &&
+			cbd->in->len == 0 && cbd->addr != NULL;
+}
+
 static void
 lua_tcp_fin (gpointer arg)
 {
@@ -277,7 +317,20 @@ lua_tcp_fin (gpointer arg)
 
 	if (cbd->fd != -1) {
 		event_del (&cbd->ev);
-		close (cbd->fd);
+
+		if (lua_tcp_can_keepalive (cbd) &&
+				rspamd_http_keepalive_pool_push (
+						lua_tcp_keepalive_pool (cbd->ev_base), cbd->addr, cbd->fd)) {
+			msg_debug_tcp ("keep idle connection to %s",
+					rspamd_inet_address_to_string (cbd->addr));
+		}
+		else {
+			close (cbd->fd);
+		}
+	}
+
+	if (cbd->init_hdl) {
+		lua_tcp_free_handler (cbd, cbd->init_hdl);
 	}
 
 	if (cbd->addr) {
@@ -316,6 +369,18 @@ lua_tcp_maybe_free (struct lua_tcp_cbdata *cbd)
 	}
 }
 
+/* Resume coroutine waiting for this request with `err, data` */
+static void
+lua_tcp_resume_thread (struct lua_tcp_cbdata *cbd)
+{
+	struct thread_entry *thread = cbd->thread;
+
+	cbd->thread = NULL;
+	REF_RETAIN (cbd);
+	lua_thread_resume (thread, 2);
+	REF_RELEASE (cbd);
+}
+
 static void
 lua_tcp_push_error (struct lua_tcp_cbdata *cbd, gboolean is_fatal,
 		const char *err, ...)
@@ -325,6 +390,8 @@ lua_tcp_push_error (struct lua_tcp_cbdata *cbd, gboolean is_fatal,
 	struct lua_tcp_handler *hdl;
 	gint cbref;
 
+	/* Connection state is unknown after any error */
+	cbd->flags |= LUA_TCP_FLAG_BROKEN;
 	va_start (ap, err);
 
 	for (;;) {
@@ -370,6 +437,13 @@ lua_tcp_push_error (struct lua_tcp_cbdata *cbd, gboolean is_fatal,
 
 			REF_RELEASE (cbd);
 		}
+		else if (cbd->thread) {
+			va_copy (ap_copy, ap);
+			lua_pushvfstring (cbd->thread->lua_state, err, ap_copy);
+			va_end (ap_copy);
+			lua_pushnil (cbd->thread->lua_state);
+			lua_tcp_resume_thread (cbd);
+		}
 
 		if (!is_fatal) {
 			/* Stop on the first callback found */
@@ -392,6 +466,15 @@ lua_tcp_push_data (struct lua_tcp_cbdata *cbd, const guint8 *str, gsize len)
 
 	g_assert (hdl != NULL);
 
+	/* Replies without stop pattern could be incomplete */
+	if (g_queue_get_length (cbd->handlers) == 1 &&
+			(hdl->type == LUA_WANT_WRITE || hdl->h.r.stop_pattern)) {
+		cbd->flags |= LUA_TCP_FLAG_SYNCED;
+	}
+	else {
+		cbd->flags &= ~LUA_TCP_FLAG_SYNCED;
+	}
+
 	if (hdl->type == LUA_WANT_READ) {
 		cbref = hdl->h.r.cbref;
 	}
@@ -430,6 +513,19 @@ lua_tcp_push_data (struct lua_tcp_cbdata *cbd, const guint8 *str, gsize len)
 
 		REF_RELEASE (cbd);
 	}
+	else if (cbd->thread && g_queue_get_length (cbd->handlers) == 1) {
+		/* Coroutine gets a copy of data as it lives after this call */
+		lua_pushnil (cbd->thread->lua_state);
+
+		if (hdl->type == LUA_WANT_READ) {
+			lua_pushlstring (cbd->thread->lua_state, (const gchar *)str, len);
+		}
+		else {
+			lua_pushnil (cbd->thread->lua_state);
+		}
+
+		lua_tcp_resume_thread (cbd);
+	}
 }
 
 static void
@@ -443,7 +539,7 @@ lua_tcp_plan_read (struct lua_tcp_cbdata *cbd)
 	event_set (&cbd->ev, cbd->fd, EV_READ, lua_tcp_handler, cbd);
 #endif
 	event_base_set (cbd->ev_base, &cbd->ev);
-	event_add (&cbd->ev, &cbd->tv);
+	event_add (&cbd->ev, rspamd_event_common_tv (cbd->ev_base, &cbd->tv));
 }
 
 static void
@@ -516,7 +612,7 @@ lua_tcp_write_helper (struct lua_tcp_cbdata *cbd)
 	}
 	else {
 		/* Want to write more */
-		event_add (&cbd->ev, &cbd->tv);
+		event_add (&cbd->ev, rspamd_event_common_tv (cbd->ev_base, &cbd->tv));
 	}
 
 	return;
@@ -618,6 +714,8 @@ lua_tcp_process_read (struct lua_tcp_cbdata *cbd,
 	}
 	else if (r == 0) {
 		/* EOF */
+		cbd->flags |= LUA_TCP_FLAG_BROKEN;
+
 		if (cbd->in->len > 0) {
 			/* We have some data to process */
 			lua_tcp_process_read_handler (cbd, rh);
@@ -749,7 +847,8 @@ lua_tcp_plan_handler_event (struct lua_tcp_cbdata *cbd, gboolean can_read,
 					/* We need to plan a new event */
 					event_set (&cbd->ev, cbd->fd, EV_READ, lua_tcp_handler, cbd);
 					event_base_set (cbd->ev_base, &cbd->ev);
-					event_add (&cbd->ev, &cbd->tv);
+					event_add (&cbd->ev,
+							rspamd_event_common_tv (cbd->ev_base, &cbd->tv));
 				}
 				else {
 					/* Cannot read more */
@@ -770,7 +869,8 @@ lua_tcp_plan_handler_event (struct lua_tcp_cbdata *cbd, gboolean can_read,
 				if (can_write) {
 					event_set (&cbd->ev, cbd->fd, EV_WRITE, lua_tcp_handler, cbd);
 					event_base_set (cbd->ev_base, &cbd->ev);
-					event_add (&cbd->ev, &cbd->tv);
+					event_add (&cbd->ev,
+							rspamd_event_common_tv (cbd->ev_base, &cbd->tv));
 				}
 				else {
 					/* Cannot write more */
@@ -790,14 +890,33 @@ lua_tcp_plan_handler_event (struct lua_tcp_cbdata *cbd, gboolean can_read,
 static gboolean
 lua_tcp_make_connection (struct lua_tcp_cbdata *cbd)
 {
-	int fd;
+	int fd = -1;
 
 	rspamd_inet_address_set_port (cbd->addr, cbd->port);
-	fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
 
-	if (fd == -1) {
-		msg_info ("cannot connect to %s", rspamd_inet_address_to_string (cbd->addr));
-		return FALSE;
+	if (cbd->flags & LUA_TCP_FLAG_KEEPALIVE) {
+		fd = rspamd_http_keepalive_pool_get (
+				lua_tcp_keepalive_pool (cbd->ev_base), cbd->addr);
+	}
+
+	if (fd != -1) {
+		msg_debug_tcp ("reuse idle connection to %s",
+				rspamd_inet_address_to_string (cbd->addr));
+		cbd->flags |= LUA_TCP_FLAG_CONNECTED;
+	}
+	else {
+		fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+
+		if (fd == -1) {
+			msg_info ("cannot connect to %s",
+					rspamd_inet_address_to_string (cbd->addr));
+			return FALSE;
+		}
+
+		if (cbd->init_hdl) {
+			g_queue_push_head (cbd->handlers, cbd->init_hdl);
+			cbd->init_hdl = NULL;
+		}
 	}
 
 	cbd->fd = fd;
@@ -908,6 +1027,12 @@ lua_tcp_arg_toiovec (lua_State *L, gint pos, struct lua_tcp_cbdata *cbd,
  * - `stop_pattern`: stop reading on finding a certain pattern (e.g. \r\n.\r\n for smtp)
  * - `shutdown`: half-close socket after writing (boolean: default false)
  * - `read`: read response after sending request (boolean: default true)
+ * - `keepalive`: return connection to the pool of idle connections when the last handler is done (boolean: default false), requires `stop_pattern` for replies
+ * - `keepalive_init`: data written to new connections only before `data` (e.g. to start a protocol session)
+ *
+ * If `callback` is omitted for a request made with `task` from a symbol callback,
+ * then the symbol is suspended until the last handler is completed and `err, data`
+ * are returned instead
  * @return {boolean} true if request has been sent
  */
 static gint
@@ -916,18 +1041,22 @@ lua_tcp_request (lua_State *L)
 	const gchar *host;
 	gchar *stop_pattern = NULL;
 	guint port;
-	gint cbref, tp, conn_cbref = -1;
+	gint cbref = -1, tp, conn_cbref = -1;
 	gsize plen = 0;
 	struct event_base *ev_base;
 	struct lua_tcp_cbdata *cbd;
 	struct rspamd_dns_resolver *resolver;
 	struct rspamd_async_session *session;
 	struct rspamd_task *task = NULL;
+	struct thread_entry *thread = NULL;
 	struct iovec *iov = NULL;
 	guint niov = 0, total_out;
 	guint64 h;
 	gdouble timeout = default_tcp_timeout;
-	gboolean partial = FALSE, do_shutdown = FALSE, do_read = TRUE;
+	gboolean partial = FALSE, do_shutdown = FALSE, do_read = TRUE,
+			keepalive = FALSE;
+	struct iovec init_iov;
+	gboolean has_init = FALSE;
 
 	if (lua_type (L, 1) == LUA_TTABLE) {
 		lua_pushstring (L, "host");
@@ -947,18 +1076,6 @@ lua_tcp_request (lua_State *L)
 
 		lua_pop (L, 1);
 
-		lua_pushstring (L, "callback");
-		lua_gettable (L, -2);
-		if (host == NULL || lua_type (L, -1) != LUA_TFUNCTION) {
-			lua_pop (L, 1);
-			msg_err ("tcp request has bad params");
-			lua_pushboolean (L, FALSE);
-			return 1;
-		}
-		cbref = luaL_ref (L, LUA_REGISTRYINDEX);
-
-		cbd = g_slice_alloc0 (sizeof (*cbd));
-
 		lua_pushstring (L, "task");
 		lua_gettable (L, -2);
 		if (lua_type (L, -1) == LUA_TUSERDATA) {
@@ -969,6 +1086,29 @@ lua_tcp_request (lua_State *L)
 		}
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "callback");
+		lua_gettable (L, -2);
+		if (lua_type (L, -1) == LUA_TFUNCTION) {
+			cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+		else {
+			lua_pop (L, 1);
+
+			/* Request without callback suspends the calling coroutine */
+			if (task) {
+				thread = lua_thread_pool_get_running_entry (
+						task->cfg->lua_thread_pool, L);
+			}
+		}
+
+		if (host == NULL || (cbref == -1 && thread == NULL)) {
+			msg_err ("tcp request has bad params");
+			lua_pushboolean (L, FALSE);
+			return 1;
+		}
+
+		cbd = g_slice_alloc0 (sizeof (*cbd));
+
 		if (task == NULL) {
 			lua_pushstring (L, "ev_base");
 			lua_gettable (L, -2);
@@ -1043,6 +1183,22 @@ lua_tcp_request (lua_State *L)
 		}
 		lua_pop (L, 1);
 
+		lua_pushstring (L, "keepalive");
+		lua_gettable (L, -2);
+		if (lua_type (L, -1) == LUA_TBOOLEAN) {
+			keepalive = lua_toboolean (L, -1);
+		}
+		lua_pop (L, 1);
+
+		lua_pushstring (L, "keepalive_init");
+		lua_gettable (L, -2);
+		tp = lua_type (L, -1);
+		if (tp == LUA_TSTRING || tp == LUA_TUSERDATA) {
+			has_init = lua_tcp_arg_toiovec (L, -1, cbd, &init_iov) &&
+					init_iov.iov_len > 0;
+		}
+		lua_pop (L, 1);
+
 		lua_pushstring (L, "on_connect");
 		lua_gettable (L, -2);
 
@@ -1113,7 +1269,7 @@ lua_tcp_request (lua_State *L)
 		return 1;
 	}
 
-	cbd->L = L;
+	cbd->L = rspamd_lua_main_state (L);
 	h = rspamd_random_uint64_fast ();
 	rspamd_snprintf (cbd->tag, sizeof (cbd->tag), "%uxL", h);
 	cbd->handlers = g_queue_new ();
@@ -1163,6 +1319,24 @@ lua_tcp_request (lua_State *L)
 		cbd->flags |= LUA_TCP_FLAG_SHUTDOWN;
 	}
 
+	/* Half closed and streamed connections cannot be reused */
+	if (keepalive && !partial && !do_shutdown) {
+		cbd->flags |= LUA_TCP_FLAG_KEEPALIVE;
+
+		if (has_init) {
+			struct lua_tcp_handler *ih;
+
+			ih = g_slice_alloc0 (sizeof (*ih));
+			ih->type = LUA_WANT_WRITE;
+			ih->h.w.iov = g_malloc (sizeof (init_iov));
+			memcpy (ih->h.w.iov, &init_iov, sizeof (init_iov));
+			ih->h.w.iovlen = 1;
+			ih->h.w.total = init_iov.iov_len;
+			ih->h.w.cbref = -1;
+			cbd->init_hdl = ih;
+		}
+	}
+
 	if (do_read) {
 		struct lua_tcp_handler *rh;
 
@@ -1175,6 +1349,7 @@ lua_tcp_request (lua_State *L)
 	}
 
 	cbd->connect_cb = conn_cbref;
+	cbd->thread = thread;
 	REF_INIT_RETAIN (cbd, lua_tcp_maybe_free);
 
 	if (session) {
@@ -1183,8 +1358,16 @@ lua_tcp_request (lua_State *L)
 				(event_finalizer_t)lua_tcp_fin,
 				cbd,
 				g_quark_from_static_string ("lua tcp"));
-		cbd->w = rspamd_session_get_watcher (session);
-		rspamd_session_watcher_push (session);
+
+		if (thread) {
+			/* Symbol watcher is not active when a coroutine is resumed */
+			cbd->w = thread->w;
+			rspamd_session_watcher_push_specific (session, cbd->w);
+		}
+		else {
+			cbd->w = rspamd_session_get_watcher (session);
+			rspamd_session_watcher_push (session);
+		}
 	}
 
 	if (rspamd_parse_inet_address (&cbd->addr, host, 0)) {
@@ -1208,12 +1391,26 @@ lua_tcp_request (lua_State *L)
 		else {
 			if (!make_dns_request_task (task, lua_tcp_dns_handler, cbd,
 					RDNS_REQUEST_A, host)) {
+				if (thread) {
+					/* Running coroutine cannot be resumed */
+					cbd->thread = NULL;
+					REF_RELEASE (cbd);
+					lua_pushfstring (L, "cannot resolve host: %s", host);
+					lua_pushnil (L);
+
+					return 2;
+				}
+
 				lua_tcp_push_error (cbd, TRUE, "cannot resolve host: %s", host);
 				REF_RELEASE (cbd);
 			}
 		}
 	}
 
+	if (thread) {
+		return lua_thread_yield (thread, 0);
+	}
+
 	lua_pushboolean (L, TRUE);
 	return 1;
 }
@@ -1285,6 +1482,7 @@ lua_tcp_add_read (lua_State *L)
 	msg_debug_tcp ("added read event, cbref: %d", cbref);
 
 	g_queue_push_tail (cbd->handlers, rh);
+	cbd->flags &= ~LUA_TCP_FLAG_SYNCED;
 
 	return 0;
 }
@@ -1367,6 +1565,7 @@ lua_tcp_add_write (lua_State *L)
 	msg_debug_tcp ("added write event, cbref: %d", cbref);
 
 	g_queue_push_tail (cbd->handlers, wh);
+	cbd->flags &= ~LUA_TCP_FLAG_SYNCED;
 	lua_pushboolean (L, TRUE);
 
 	return 1;
@@ -0,0 +1,292 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "lua_common.h"
+#include "lua_thread_pool.h"
+
+#define LUA_THREAD_POOL_MAX 100
+
+#if LUA_VERSION_NUM >= 502
+#define rspamd_lua_resume(L, narg) lua_resume ((L), NULL, (narg))
+#else
+#define rspamd_lua_resume(L, narg) lua_resume ((L), (narg))
+#endif
+
+struct lua_thread_pool {
+	GQueue *available;
+	lua_State *L;
+	guint max_items;
+	struct thread_entry *running_entry;
+	/* Time spent in resumed coroutines while profiling is enabled */
+	gboolean profiling;
+	gdouble lua_time;
+};
+
+/* Allocated in a task pool to find coroutines suspended when a task dies */
+struct lua_thread_task_ref {
+	struct thread_entry *thread;
+};
+
+static struct thread_entry *
+thread_entry_new (struct lua_thread_pool *pool)
+{
+	struct thread_entry *ent;
+
+	ent = g_slice_alloc0 (sizeof (*ent));
+	ent->pool = pool;
+	ent->lua_state = lua_newthread (pool->L);
+	ent->thread_index = luaL_ref (pool->L, LUA_REGISTRYINDEX);
+
+	return ent;
+}
+
+static void
+thread_entry_free (struct thread_entry *ent)
+{
+	luaL_unref (ent->pool->L, LUA_REGISTRYINDEX, ent->thread_index);
+	g_slice_free1 (sizeof (*ent), ent);
+}
+
+static void
+lua_thread_pool_detach (struct lua_thread_pool *pool,
+		struct thread_entry *thread)
+{
+	if (thread->ref) {
+		thread->ref->thread = NULL;
+		thread->ref = NULL;
+	}
+
+	if (pool->running_entry == thread) {
+		pool->running_entry = NULL;
+	}
+}
+
+/* Coroutines that failed or have never been resumed cannot be reused */
+static void
+lua_thread_pool_terminate_entry (struct lua_thread_pool *pool,
+		struct thread_entry *thread)
+{
+	lua_thread_pool_detach (pool, thread);
+	thread_entry_free (thread);
+}
+
+static void
+lua_thread_task_ref_dtor (gpointer p)
+{
+	struct lua_thread_task_ref *ref = p;
+	struct thread_entry *thread = ref->thread;
+
+	if (thread) {
+		msg_debug ("terminate lua thread suspended by a destroyed task");
+		lua_thread_pool_terminate_entry (thread->pool, thread);
+	}
+}
+
+struct lua_thread_pool *
+lua_thread_pool_new (lua_State *L)
+{
+	struct lua_thread_pool *pool;
+
+	pool = g_malloc0 (sizeof (*pool));
+	pool->L = L;
+	pool->available = g_queue_new ();
+	pool->max_items = LUA_THREAD_POOL_MAX;
+
+	return pool;
+}
+
+void
+lua_thread_pool_free (struct lua_thread_pool *pool)
+{
+	struct thread_entry *ent;
+
+	if (pool == NULL) {
+		return;
+	}
+
+	while ((ent = g_queue_pop_head (pool->available)) != NULL) {
+		thread_entry_free (ent);
+	}
+
+	g_queue_free (pool->available);
+	g_free (pool);
+}
+
+struct thread_entry *
+lua_thread_pool_get (struct lua_thread_pool *pool)
+{
+	struct thread_entry *ent;
+
+	ent = g_queue_pop_head (pool->available);
+
+	if (ent == NULL) {
+		ent = thread_entry_new (pool);
+	}
+
+	return ent;
+}
+
+struct thread_entry *
+lua_thread_pool_get_for_task (struct lua_thread_pool *pool,
+		struct rspamd_task *task)
+{
+	struct thread_entry *ent;
+
+	ent = lua_thread_pool_get (pool);
+	ent->task = task;
+
+	return ent;
+}
+
+void
+lua_thread_pool_return (struct lua_thread_pool *pool,
+		struct thread_entry *thread)
+{
+	g_assert (lua_status (thread->lua_state) == 0);
+
+	lua_thread_pool_detach (pool, thread);
+
+	if (g_queue_get_length (pool->available) >= pool->max_items) {
+		thread_entry_free (thread);
+
+		return;
+	}
+
+	lua_settop (thread->lua_state, 0);
+	thread->cd = NULL;
+	thread->task = NULL;
+	thread->w = NULL;
+	thread->finish_callback = NULL;
+	thread->error_callback = NULL;
+	g_queue_push_head (pool->available, thread);
+}
+
+struct thread_entry *
+lua_thread_pool_get_running_entry (struct lua_thread_pool *pool,
+		lua_State *L)
+{
+	struct thread_entry *ent;
+
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	ent = pool->running_entry;
+
+	if (ent != NULL && ent->lua_state == L) {
+		return ent;
+	}
+
+	return NULL;
+}
+
+gdouble
+lua_thread_pool_profile (struct lua_thread_pool *pool, gboolean enable)
+{
+	if (pool == NULL) {
+		return 0;
+	}
+
+	pool->profiling = enable;
+
+	return pool->lua_time;
+}
+
+static void
+lua_thread_resume_full (struct thread_entry *thread, gint narg)
+{
+	struct lua_thread_pool *pool = thread->pool;
+	struct thread_entry *prev = pool->running_entry;
+	lua_State *L = thread->lua_state;
+	GString *tb;
+	gdouble t1;
+	gint ret;
+
+	/* Coroutine could be resumed from a callback of another coroutine */
+	pool->running_entry = thread;
+
+	if (G_UNLIKELY (pool->profiling)) {
+		t1 = rspamd_get_ticks ();
+		ret = rspamd_lua_resume (L, narg);
+		pool->lua_time += rspamd_get_ticks () - t1;
+	}
+	else {
+		ret = rspamd_lua_resume (L, narg);
+	}
+
+	pool->running_entry = prev;
+
+	if (ret == LUA_YIELD) {
+		/* Waiting for some event, task might be destroyed before it */
+		if (thread->task && thread->ref == NULL) {
+			thread->ref = rspamd_mempool_alloc (thread->task->task_pool,
+					sizeof (*thread->ref));
+			thread->ref->thread = thread;
+			rspamd_mempool_add_destructor (thread->task->task_pool,
+					lua_thread_task_ref_dtor, thread->ref);
+		}
+	}
+	else if (ret == 0) {
+		if (thread->finish_callback) {
+			thread->finish_callback (thread, lua_gettop (L));
+		}
+
+		lua_thread_pool_return (pool, thread);
+	}
+	else {
+		tb = g_string_sized_new (100);
+		rspamd_printf_gstring (tb, "%s; trace:", lua_tostring (L, -1));
+		rspamd_lua_traceback_string (L, tb);
+
+		if (thread->error_callback) {
+			thread->error_callback (thread, ret, tb->str);
+		}
+		else {
+			msg_err ("lua thread failed (%d): %v", ret, tb);
+		}
+
+		g_string_free (tb, TRUE);
+		lua_thread_pool_terminate_entry (pool, thread);
+	}
+}
+
+void
+lua_thread_call (struct lua_thread_pool *pool,
+		struct thread_entry *thread, gint narg)
+{
+	g_assert (thread->pool == pool);
+
+	lua_thread_resume_full (thread, narg);
+}
+
+gint
+lua_thread_yield (struct thread_entry *thread, gint nresults)
+{
+	return lua_yield (thread->lua_state, nresults);
+}
+
+void
+lua_thread_resume (struct thread_entry *thread, gint narg)
+{
+	if (lua_status (thread->lua_state) != LUA_YIELD) {
+		msg_err ("cannot resume lua thread that is not suspended");
+		lua_pop (thread->lua_state, narg);
+
+		return;
+	}
+
+	lua_thread_resume_full (thread, narg);
+}
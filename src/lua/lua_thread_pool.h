@@ -0,0 +1,119 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LUA_LUA_THREAD_POOL_H_
+#define SRC_LUA_LUA_THREAD_POOL_H_
+
+#include "config.h"
+#include <lua.h>
+
+/*
+ * Pool of Lua coroutines that are used to run Lua callbacks which can be
+ * suspended while waiting for asynchronous events (DNS, redis, HTTP and TCP
+ * requests). Coroutines are referenced once and reused after they finish, so
+ * no closures or registry references are created per request.
+ */
+
+struct rspamd_task;
+struct rspamd_async_watcher;
+struct thread_entry;
+struct lua_thread_pool;
+
+/*
+ * Called when a coroutine returns, its results are on the coroutine stack
+ */
+typedef void (*lua_thread_finish_t) (struct thread_entry *thread, gint nret);
+/*
+ * Called when a coroutine fails, message is an error with traceback
+ */
+typedef void (*lua_thread_error_t) (struct thread_entry *thread, gint ret,
+		const gchar *msg);
+
+struct lua_thread_task_ref;
+
+struct thread_entry {
+	lua_State *lua_state;
+	struct lua_thread_pool *pool;
+	gint thread_index;							/**< registry reference of a coroutine	*/
+	gpointer cd;
+	struct rspamd_task *task;
+	struct rspamd_async_watcher *w;				/**< watcher of a symbol being executed	*/
+	struct lua_thread_task_ref *ref;
+	lua_thread_finish_t finish_callback;
+	lua_thread_error_t error_callback;
+};
+
+/**
+ * Create new pool for the specified lua state
+ */
+struct lua_thread_pool *lua_thread_pool_new (lua_State *L);
+
+/**
+ * Destroy pool and all coroutines in it
+ */
+void lua_thread_pool_free (struct lua_thread_pool *pool);
+
+/**
+ * Get coroutine from the pool or create new one
+ */
+struct thread_entry *lua_thread_pool_get (struct lua_thread_pool *pool);
+
+/**
+ * Get coroutine bound to a task, it would be terminated if the task is
+ * destroyed while the coroutine is suspended
+ */
+struct thread_entry *lua_thread_pool_get_for_task (struct lua_thread_pool *pool,
+		struct rspamd_task *task);
+
+/**
+ * Return finished coroutine to the pool
+ */
+void lua_thread_pool_return (struct lua_thread_pool *pool,
+		struct thread_entry *thread);
+
+/**
+ * Returns coroutine that is running now or NULL if `L` is not a pooled
+ * coroutine
+ */
+struct thread_entry *lua_thread_pool_get_running_entry (
+		struct lua_thread_pool *pool, lua_State *L);
+
+/**
+ * Enable or disable timing of coroutines resumed from this pool
+ * @return total time in seconds spent in coroutines while timing was enabled
+ */
+gdouble lua_thread_pool_profile (struct lua_thread_pool *pool,
+		gboolean enable);
+
+/**
+ * Run function that is on top of the coroutine stack with `narg`
+ * arguments pushed after it. Finish or error callback is called when the
+ * function returns, after that the coroutine is returned to the pool
+ */
+void lua_thread_call (struct lua_thread_pool *pool,
+		struct thread_entry *thread, gint narg);
+
+/**
+ * Suspend running coroutine, must be used as `return lua_thread_yield (...)`
+ * from a C function called by this coroutine
+ */
+gint lua_thread_yield (struct thread_entry *thread, gint nresults);
+
+/**
+ * Resume suspended coroutine with `narg` values pushed on its stack
+ */
+void lua_thread_resume (struct thread_entry *thread, gint narg);
+
+#endif /* SRC_LUA_LUA_THREAD_POOL_H_ */
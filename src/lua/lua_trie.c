@@ -35,6 +35,10 @@ local function trie_callback(number, pos)
 end
 
 trie:match('some big text', trie_callback)
+
+-- Without callback all matches are collected and returned as a flat array of
+-- pattern indexes and their positions: {idx1, pos1, idx2, pos2, ...}
+local found, matches = trie:match('some big text', {first_only = true})
  */
 
 /* Suffix trie */
@@ -142,6 +146,21 @@ lua_trie_create (lua_State *L)
 	return 1;
 }
 
+struct lua_trie_cbdata {
+	lua_State *L;
+	/* Matches are collected if there is no callback */
+	GArray *matches;
+	/* Patterns are reported once if not NULL */
+	guint8 *seen;
+	guint nseen;
+	guint npatterns;
+};
+
+struct lua_trie_match {
+	guint strnum;
+	gint pos;
+};
+
 static gint
 lua_trie_callback (struct rspamd_multipattern *mp,
 		guint strnum,
@@ -151,9 +170,29 @@ lua_trie_callback (struct rspamd_multipattern *mp,
 		gsize len,
 		void *context)
 {
-	lua_State *L = context;
+	struct lua_trie_cbdata *cbd = context;
+	struct lua_trie_match m;
+	lua_State *L = cbd->L;
 	gint ret;
 
+	if (cbd->seen) {
+		if (strnum >= cbd->npatterns || cbd->seen[strnum]) {
+			return 0;
+		}
+
+		cbd->seen[strnum] = 1;
+		cbd->nseen ++;
+	}
+
+	if (cbd->matches) {
+		m.strnum = strnum;
+		m.pos = textpos;
+		g_array_append_val (cbd->matches, m);
+
+		/* Nothing else could be reported */
+		return cbd->seen && cbd->nseen == cbd->npatterns ? 1 : 0;
+	}
+
 	/* Function */
 	lua_pushvalue (L, 3);
 	lua_pushnumber (L, strnum + 1);
@@ -174,17 +213,90 @@ lua_trie_callback (struct rspamd_multipattern *mp,
 }
 
 /*
- * We assume that callback argument is at pos 3 and icase is in position 4
+ * We assume that callback or table of options is at pos 3
+ */
+static void
+lua_trie_cbdata_init (lua_State *L, struct rspamd_multipattern *trie,
+		struct lua_trie_cbdata *cbd)
+{
+	gboolean first_only = FALSE;
+
+	memset (cbd, 0, sizeof (*cbd));
+	cbd->L = L;
+
+	if (lua_type (L, 3) != LUA_TFUNCTION) {
+		cbd->matches = g_array_sized_new (FALSE, FALSE,
+				sizeof (struct lua_trie_match), 16);
+	}
+
+	if (lua_type (L, 3) == LUA_TTABLE) {
+		lua_pushstring (L, "first_only");
+		lua_gettable (L, 3);
+		first_only = lua_toboolean (L, -1);
+		lua_pop (L, 1);
+	}
+	else if (lua_type (L, 4) == LUA_TTABLE) {
+		lua_pushstring (L, "first_only");
+		lua_gettable (L, 4);
+		first_only = lua_toboolean (L, -1);
+		lua_pop (L, 1);
+	}
+
+	if (first_only) {
+		cbd->npatterns = rspamd_multipattern_get_npatterns (trie);
+		cbd->seen = g_malloc0 (MAX (cbd->npatterns, 1));
+	}
+}
+
+/*
+ * Pushes boolean result and collected matches if there is no callback
  */
+static gint
+lua_trie_cbdata_finish (lua_State *L, struct lua_trie_cbdata *cbd,
+		gboolean found)
+{
+	struct lua_trie_match *m;
+	guint i;
+	gint nret = 1;
+
+	lua_pushboolean (L, found);
+
+	if (cbd->matches) {
+		lua_createtable (L, cbd->matches->len * 2, 0);
+
+		for (i = 0; i < cbd->matches->len; i ++) {
+			m = &g_array_index (cbd->matches, struct lua_trie_match, i);
+			lua_pushnumber (L, m->strnum + 1);
+			lua_rawseti (L, -2, i * 2 + 1);
+			lua_pushnumber (L, m->pos);
+			lua_rawseti (L, -2, i * 2 + 2);
+		}
+
+		g_array_free (cbd->matches, TRUE);
+		nret = 2;
+	}
+
+	if (cbd->seen) {
+		g_free (cbd->seen);
+	}
+
+	return nret;
+}
+
 static gint
 lua_trie_search_str (lua_State *L, struct rspamd_multipattern *trie,
-		const gchar *str, gsize len)
+		const gchar *str, gsize len, struct lua_trie_cbdata *cbd)
 {
 	gint ret;
 	guint nfound = 0;
 
+	if (cbd->seen && cbd->nseen == cbd->npatterns) {
+		/* All patterns have been already found */
+		return 0;
+	}
+
 	if ((ret = rspamd_multipattern_lookup (trie, str, len,
-			lua_trie_callback, L, &nfound)) == 0) {
+			lua_trie_callback, cbd, &nfound)) == 0) {
 		return nfound;
 	}
 
@@ -192,22 +304,28 @@ lua_trie_search_str (lua_State *L, struct rspamd_multipattern *trie,
 }
 
 /***
- * @method trie:match(input, cb[, caseless])
- * Search for patterns in `input` invoking `cb` optionally ignoring case
+ * @method trie:match(input, [cb], [opts])
+ * Search for patterns in `input` invoking `cb` or collecting matches if `cb`
+ * is not specified. Options table could be passed instead of `cb` or after it,
+ * option `first_only` means that only the first match of each pattern is
+ * reported
  * @param {table or string} input one or several (if `input` is an array) strings of input text
  * @param {function} cb callback called on each pattern match in form `function (idx, pos)` where `idx` is a numeric index of pattern (starting from 1) and `pos` is a numeric offset where the pattern ends
- * @param {boolean} caseless if `true` then match ignores symbols case (ASCII only)
- * @return {boolean} `true` if any pattern has been found (`cb` might be called multiple times however)
+ * @param {table} opts options
+ * @return {boolean,table} `true` if any pattern has been found (`cb` might be called multiple times however) and flat array of pattern indexes and positions `{idx1, pos1, ...}` if there is no callback
  */
 static gint
 lua_trie_match (lua_State *L)
 {
 	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
+	struct lua_trie_cbdata cbd;
 	const gchar *text;
 	gsize len;
 	gboolean found = FALSE;
 
 	if (trie) {
+		lua_trie_cbdata_init (L, trie, &cbd);
+
 		if (lua_type (L, 2) == LUA_TTABLE) {
 			lua_pushvalue (L, 2);
 			lua_pushnil (L);
@@ -216,7 +334,7 @@ lua_trie_match (lua_State *L)
 				if (lua_isstring (L, -1)) {
 					text = lua_tolstring (L, -1, &len);
 
-					if (lua_trie_search_str (L, trie, text, len)) {
+					if (lua_trie_search_str (L, trie, text, len, &cbd)) {
 						found = TRUE;
 					}
 				}
@@ -228,10 +346,12 @@ lua_trie_match (lua_State *L)
 		else if (lua_type (L, 2) == LUA_TSTRING) {
 			text = lua_tolstring (L, 2, &len);
 
-			if (lua_trie_search_str (L, trie, text, len)) {
+			if (lua_trie_search_str (L, trie, text, len, &cbd)) {
 				found = TRUE;
 			}
 		}
+
+		return lua_trie_cbdata_finish (L, &cbd, found);
 	}
 
 	lua_pushboolean (L, found);
@@ -239,12 +359,12 @@ lua_trie_match (lua_State *L)
 }
 
 /***
- * @method trie:search_mime(task, cb[, caseless])
+ * @method trie:search_mime(task, [cb], [opts])
  * This is a helper mehthod to search pattern within text parts of a message in rspamd task
  * @param {task} task object
  * @param {function} cb callback called on each pattern match @see trie:match
- * @param {boolean} caseless if `true` then match ignores symbols case (ASCII only)
- * @return {boolean} `true` if any pattern has been found (`cb` might be called multiple times however)
+ * @param {table} opts options @see trie:match
+ * @return {boolean,table} `true` if any pattern has been found and collected matches @see trie:match
  */
 static gint
 lua_trie_search_mime (lua_State *L)
@@ -252,11 +372,14 @@ lua_trie_search_mime (lua_State *L)
 	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
 	struct rspamd_task *task = lua_check_task (L, 2);
 	struct rspamd_mime_text_part *part;
+	struct lua_trie_cbdata cbd;
 	const gchar *text;
 	gsize len, i;
 	gboolean found = FALSE;
 
 	if (trie && task) {
+		lua_trie_cbdata_init (L, trie, &cbd);
+
 		for (i = 0; i < task->text_parts->len; i ++) {
 			part = g_ptr_array_index (task->text_parts, i);
 
@@ -264,11 +387,13 @@ lua_trie_search_mime (lua_State *L)
 				text = part->content->data;
 				len = part->content->len;
 
-				if (lua_trie_search_str (L, trie, text, len) != 0) {
+				if (lua_trie_search_str (L, trie, text, len, &cbd) != 0) {
 					found = TRUE;
 				}
 			}
 		}
+
+		return lua_trie_cbdata_finish (L, &cbd, found);
 	}
 
 	lua_pushboolean (L, found);
@@ -276,29 +401,33 @@ lua_trie_search_mime (lua_State *L)
 }
 
 /***
- * @method trie:search_rawmsg(task, cb[, caseless])
+ * @method trie:search_rawmsg(task, [cb], [opts])
  * This is a helper mehthod to search pattern within the whole undecoded content of rspamd task
  * @param {task} task object
  * @param {function} cb callback called on each pattern match @see trie:match
- * @param {boolean} caseless if `true` then match ignores symbols case (ASCII only)
- * @return {boolean} `true` if any pattern has been found (`cb` might be called multiple times however)
+ * @param {table} opts options @see trie:match
+ * @return {boolean,table} `true` if any pattern has been found and collected matches @see trie:match
  */
 static gint
 lua_trie_search_rawmsg (lua_State *L)
 {
 	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
 	struct rspamd_task *task = lua_check_task (L, 2);
+	struct lua_trie_cbdata cbd;
 	const gchar *text;
 	gsize len;
 	gboolean found = FALSE;
 
 	if (trie && task) {
+		lua_trie_cbdata_init (L, trie, &cbd);
 		text = task->msg.begin;
 		len = task->msg.len;
 
-		if (lua_trie_search_str (L, trie, text, len) != 0) {
+		if (lua_trie_search_str (L, trie, text, len, &cbd) != 0) {
 			found = TRUE;
 		}
+
+		return lua_trie_cbdata_finish (L, &cbd, found);
 	}
 
 	lua_pushboolean (L, found);
@@ -306,23 +435,26 @@ lua_trie_search_rawmsg (lua_State *L)
 }
 
 /***
- * @method trie:search_rawbody(task, cb[, caseless])
+ * @method trie:search_rawbody(task, [cb], [opts])
  * This is a helper mehthod to search pattern within the whole undecoded content of task's body (not including headers)
  * @param {task} task object
  * @param {function} cb callback called on each pattern match @see trie:match
- * @param {boolean} caseless if `true` then match ignores symbols case (ASCII only)
- * @return {boolean} `true` if any pattern has been found (`cb` might be called multiple times however)
+ * @param {table} opts options @see trie:match
+ * @return {boolean,table} `true` if any pattern has been found and collected matches @see trie:match
  */
 static gint
 lua_trie_search_rawbody (lua_State *L)
 {
 	struct rspamd_multipattern *trie = lua_check_trie (L, 1);
 	struct rspamd_task *task = lua_check_task (L, 2);
+	struct lua_trie_cbdata cbd;
 	const gchar *text;
 	gsize len;
 	gboolean found = FALSE;
 
 	if (trie && task) {
+		lua_trie_cbdata_init (L, trie, &cbd);
+
 		if (task->raw_headers_content.len > 0) {
 			text = task->msg.begin + task->raw_headers_content.len;
 			len = task->msg.len - task->raw_headers_content.len;
@@ -333,9 +465,11 @@ lua_trie_search_rawbody (lua_State *L)
 			len = task->msg.len;
 		}
 
-		if (lua_trie_search_str (L, trie, text, len) != 0) {
+		if (lua_trie_search_str (L, trie, text, len, &cbd) != 0) {
 			found = TRUE;
 		}
+
+		return lua_trie_cbdata_finish (L, &cbd, found);
 	}
 
 	lua_pushboolean (L, found);
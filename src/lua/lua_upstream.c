@@ -25,6 +25,7 @@
  * - round-robin: balance upstreams one by one selecting accordingly to their weight
  * - hash: use stable hashing algorithm to distribute values according to some static strings
  * - master-slave: always prefer upstream with higher priority unless it is not available
+ * - latency: select the faster of two random upstreams using latencies passed to `upstream:ok`
  *
  * Here is an example of upstreams manipulations:
  * @example
@@ -131,8 +132,9 @@ lua_upstream_fail (lua_State *L)
 }
 
 /***
- * @method upstream:ok()
+ * @method upstream:ok([latency])
  * Indicates upstream success. Resets errors count for an upstream.
+ * @param {number} latency optional time of the request in seconds
  */
 static gint
 lua_upstream_ok (lua_State *L)
@@ -141,6 +143,10 @@ lua_upstream_ok (lua_State *L)
 
 	if (up) {
 		rspamd_upstream_ok (up);
+
+		if (lua_isnumber (L, 2)) {
+			rspamd_upstream_latency (up, lua_tonumber (L, 2));
+		}
 	}
 
 	return 0;
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 #include "lua_common.h"
+#include "cryptobox.h"
 #include "contrib/uthash/utlist.h"
 
 /***
@@ -61,6 +62,7 @@ LUA_FUNCTION_DEF (url, add_tag);
 LUA_FUNCTION_DEF (url, create);
 LUA_FUNCTION_DEF (url, init);
 LUA_FUNCTION_DEF (url, all);
+LUA_FUNCTION_DEF (url, create_index);
 
 static const struct luaL_reg urllib_m[] = {
 	LUA_INTERFACE_DEF (url, get_length),
@@ -91,9 +93,41 @@ static const struct luaL_reg urllib_f[] = {
 	LUA_INTERFACE_DEF (url, init),
 	LUA_INTERFACE_DEF (url, create),
 	LUA_INTERFACE_DEF (url, all),
+	LUA_INTERFACE_DEF (url, create_index),
 	{NULL, NULL}
 };
 
+/* URL index methods */
+LUA_FUNCTION_DEF (url_index, add);
+LUA_FUNCTION_DEF (url_index, check);
+LUA_FUNCTION_DEF (url_index, count);
+LUA_FUNCTION_DEF (url_index, gc);
+
+static const struct luaL_reg url_indexlib_m[] = {
+	LUA_INTERFACE_DEF (url_index, add),
+	LUA_INTERFACE_DEF (url_index, check),
+	LUA_INTERFACE_DEF (url_index, count),
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_url_index_gc},
+	{NULL, NULL}
+};
+
+/* Urls with the same registered domain (tld) */
+struct lua_url_index_elt {
+	struct rspamd_url *url;
+	gchar **data;
+	gboolean data_table;
+	struct lua_url_index_elt *next;
+};
+
+struct lua_url_index {
+	rspamd_mempool_t *pool;
+	GHashTable *tlds;
+	guint nelts;
+};
+
+#define LUA_URL_INDEX_SEED 0xdeadbabeULL
+
 static struct rspamd_lua_url *
 lua_check_url (lua_State * L, gint pos)
 {
@@ -753,6 +787,263 @@ lua_url_all (lua_State *L)
 }
 
 
+static struct lua_url_index *
+lua_check_url_index (lua_State * L)
+{
+	void *ud = rspamd_lua_check_udata (L, 1, "rspamd{url_index}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'url_index' expected");
+	return ud ? *((struct lua_url_index **)ud) : NULL;
+}
+
+static inline guint64
+lua_url_index_key (struct rspamd_url *u)
+{
+	if (u->tldlen > 0) {
+		return rspamd_cryptobox_fast_hash (u->tld, u->tldlen,
+				LUA_URL_INDEX_SEED);
+	}
+
+	return rspamd_cryptobox_fast_hash (u->host, u->hostlen,
+			LUA_URL_INDEX_SEED);
+}
+
+static void
+lua_url_index_inserter (struct rspamd_url *url, gsize start_offset,
+		gsize end_offset, gpointer ud)
+{
+	struct rspamd_url **pu = ud;
+
+	*pu = url;
+}
+
+/***
+ * @function url.create_index()
+ * Creates an index of urls grouped by their registered domains, it could be
+ * used to store large feeds of urls and to check urls against them
+ * @return {url_index} new index
+ */
+static gint
+lua_url_create_index (lua_State *L)
+{
+	struct lua_url_index *idx, **pidx;
+
+	idx = g_malloc0 (sizeof (*idx));
+	idx->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "url_index");
+	idx->tlds = g_hash_table_new (g_int64_hash, g_int64_equal);
+
+	pidx = lua_newuserdata (L, sizeof (*pidx));
+	rspamd_lua_setclass (L, "rspamd{url_index}", -1);
+	*pidx = idx;
+
+	return 1;
+}
+
+/***
+ * @method url_index:add(text, [data])
+ * Adds an url found in text with the attached data to the index
+ * @param {string} text text that contains url
+ * @param {string|table} data string or list of strings returned by `check`
+ * @return {boolean} true if an url has been added
+ */
+static gint
+lua_url_index_add (lua_State *L)
+{
+	struct lua_url_index *idx = lua_check_url_index (L);
+	struct lua_url_index_elt *elt, *head;
+	struct rspamd_url *u = NULL;
+	const gchar *text;
+	gsize len, i, ndata;
+	guint64 key, *pkey;
+
+	text = luaL_checklstring (L, 2, &len);
+
+	if (idx == NULL || text == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	rspamd_url_find_single (idx->pool, text, len, FALSE,
+			lua_url_index_inserter, &u);
+
+	if (u == NULL || u->hostlen == 0) {
+		lua_pushboolean (L, FALSE);
+
+		return 1;
+	}
+
+	elt = rspamd_mempool_alloc0 (idx->pool, sizeof (*elt));
+	elt->url = u;
+
+	if (lua_type (L, 3) == LUA_TSTRING) {
+		elt->data = rspamd_mempool_alloc0 (idx->pool, sizeof (gchar *) * 2);
+		elt->data[0] = rspamd_mempool_strdup (idx->pool, lua_tostring (L, 3));
+	}
+	else if (lua_type (L, 3) == LUA_TTABLE) {
+		ndata = rspamd_lua_table_size (L, 3);
+		elt->data = rspamd_mempool_alloc0 (idx->pool,
+				sizeof (gchar *) * (ndata + 1));
+		elt->data_table = TRUE;
+
+		for (i = 0; i < ndata; i ++) {
+			lua_rawgeti (L, 3, i + 1);
+			elt->data[i] = rspamd_mempool_strdup (idx->pool,
+					lua_tostring (L, -1));
+			lua_pop (L, 1);
+		}
+	}
+
+	key = lua_url_index_key (u);
+	head = g_hash_table_lookup (idx->tlds, &key);
+
+	if (head) {
+		/* Keep the head element as it owns the key */
+		elt->next = head->next;
+		head->next = elt;
+	}
+	else {
+		pkey = rspamd_mempool_alloc (idx->pool, sizeof (*pkey));
+		*pkey = key;
+		g_hash_table_insert (idx->tlds, pkey, elt);
+	}
+
+	idx->nelts ++;
+	lua_pushboolean (L, TRUE);
+
+	return 1;
+}
+
+static void
+lua_url_index_push_data (lua_State *L, struct lua_url_index_elt *elt)
+{
+	guint i;
+
+	if (elt->data == NULL) {
+		lua_pushnil (L);
+	}
+	else if (elt->data_table) {
+		lua_newtable (L);
+
+		for (i = 0; elt->data[i] != NULL; i ++) {
+			lua_pushstring (L, elt->data[i]);
+			lua_rawseti (L, -2, i + 1);
+		}
+	}
+	else {
+		lua_pushstring (L, elt->data[0]);
+	}
+}
+
+/***
+ * @method url_index:check(url)
+ * Checks url against the index. Returns `query` if url's host, path and query
+ * (or host and path of an element with no query) match, `path` if only host
+ * and path match and `host` if only host matches
+ * @param {url} url url to check
+ * @return {string,data} match type and the data of the matched element or nil
+ */
+static gint
+lua_url_index_check (lua_State *L)
+{
+	struct lua_url_index *idx = lua_check_url_index (L);
+	struct rspamd_lua_url *lu = lua_check_url (L, 2);
+	struct lua_url_index_elt *elt, *found = NULL;
+	struct rspamd_url *u, *cur;
+	gboolean found_host = FALSE, found_query = FALSE;
+	guint64 key;
+
+	if (idx == NULL || lu == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	u = lu->url;
+
+	if (u->hostlen == 0) {
+		lua_pushnil (L);
+
+		return 1;
+	}
+
+	key = lua_url_index_key (u);
+	elt = g_hash_table_lookup (idx->tlds, &key);
+
+	for (; elt != NULL; elt = elt->next) {
+		cur = elt->url;
+
+		if (cur->hostlen != u->hostlen ||
+				memcmp (cur->host, u->host, u->hostlen) != 0) {
+			continue;
+		}
+
+		found_host = TRUE;
+
+		if (u->datalen > 0) {
+			if (cur->datalen == u->datalen &&
+					memcmp (cur->data, u->data, u->datalen) == 0) {
+				found = elt;
+
+				if (cur->querylen == 0 || (u->querylen == cur->querylen &&
+						memcmp (cur->query, u->query, u->querylen) == 0)) {
+					found_query = TRUE;
+				}
+			}
+		}
+		else if (cur->datalen == 0) {
+			found = elt;
+			found_query = TRUE;
+			break;
+		}
+	}
+
+	if (found) {
+		lua_pushstring (L, found_query ? "query" : "path");
+		lua_url_index_push_data (L, found);
+
+		return 2;
+	}
+	else if (found_host) {
+		lua_pushstring (L, "host");
+
+		return 1;
+	}
+
+	lua_pushnil (L);
+
+	return 1;
+}
+
+/***
+ * @method url_index:count()
+ * Returns number of urls in the index
+ * @return {number} number of urls
+ */
+static gint
+lua_url_index_count (lua_State *L)
+{
+	struct lua_url_index *idx = lua_check_url_index (L);
+
+	if (idx == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	lua_pushnumber (L, idx->nelts);
+
+	return 1;
+}
+
+static gint
+lua_url_index_gc (lua_State *L)
+{
+	struct lua_url_index *idx = lua_check_url_index (L);
+
+	if (idx) {
+		g_hash_table_unref (idx->tlds);
+		rspamd_mempool_delete (idx->pool);
+		g_free (idx);
+	}
+
+	return 0;
+}
+
 static gint
 lua_load_url (lua_State * L)
 {
@@ -767,6 +1058,8 @@ luaopen_url (lua_State * L)
 {
 	rspamd_lua_new_class (L, "rspamd{url}", urllib_m);
 	lua_pop (L, 1);
+	rspamd_lua_new_class (L, "rspamd{url_index}", url_indexlib_m);
+	lua_pop (L, 1);
 
 	rspamd_lua_add_preload (L, "rspamd_url", lua_load_url);
 }
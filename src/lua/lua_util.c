@@ -113,10 +113,20 @@ LUA_FUNCTION_DEF (util, tanh);
 LUA_FUNCTION_DEF (util, parse_html);
 
 /***
- * @function util.levenshtein_distance(s1, s2)
+ * @function util.decode_html_entities(input)
+ * Replaces all HTML entities in the input with the according characters
+ * @param {string|text} in input text
+ * @return {rspamd_text} decoded text
+ */
+LUA_FUNCTION_DEF (util, decode_html_entities);
+
+/***
+ * @function util.levenshtein_distance(s1, s2, [replace_cost], [max_dist])
  * Returns levenstein distance between two strings
  * @param {string} s1 the first string
  * @param {string} s2 the second string
+ * @param {number} replace_cost cost of replacement (1 by default)
+ * @param {number} max_dist if distance is larger, `max_dist + 1` is returned
  * @return {number} number of differences in two strings
  */
 LUA_FUNCTION_DEF (util, levenshtein_distance);
@@ -479,6 +489,7 @@ static const struct luaL_reg utillib_f[] = {
 	LUA_INTERFACE_DEF (util, tokenize_text),
 	LUA_INTERFACE_DEF (util, tanh),
 	LUA_INTERFACE_DEF (util, parse_html),
+	LUA_INTERFACE_DEF (util, decode_html_entities),
 	LUA_INTERFACE_DEF (util, levenshtein_distance),
 	LUA_INTERFACE_DEF (util, parse_addr),
 	LUA_INTERFACE_DEF (util, fold_header),
@@ -1048,13 +1059,49 @@ lua_util_parse_html (lua_State *L)
 	return 1;
 }
 
+static gint
+lua_util_decode_html_entities (lua_State *L)
+{
+	struct rspamd_lua_text *t;
+	const gchar *s = NULL;
+	gsize inlen;
+
+	if (lua_type (L, 1) == LUA_TSTRING) {
+		s = luaL_checklstring (L, 1, &inlen);
+	}
+	else if (lua_type (L, 1) == LUA_TUSERDATA) {
+		t = lua_check_text (L, 1);
+
+		if (t != NULL) {
+			s = t->start;
+			inlen = t->len;
+		}
+	}
+
+	if (s != NULL) {
+		t = lua_newuserdata (L, sizeof (*t));
+		rspamd_lua_setclass (L, "rspamd{text}", -1);
+		t->start = g_malloc (inlen + 1);
+		memcpy ((char *)t->start, s, inlen);
+		((char *)t->start)[inlen] = '\0';
+		t->len = inlen > 0 ?
+				rspamd_html_decode_entitles_inplace ((char *)t->start, inlen) : 0;
+		t->flags = RSPAMD_TEXT_FLAG_OWN;
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
 static gint
 lua_util_levenshtein_distance (lua_State *L)
 {
 	const gchar *s1, *s2;
 	gsize s1len, s2len;
 	gint dist = 0;
-	guint replace_cost = 1;
+	guint replace_cost = 1, max_dist = G_MAXINT / 2;
 
 	s1 = luaL_checklstring (L, 1, &s1len);
 	s2 = luaL_checklstring (L, 2, &s2len);
@@ -1063,9 +1110,13 @@ lua_util_levenshtein_distance (lua_State *L)
 		replace_cost = lua_tonumber (L, 3);
 	}
 
+	if (lua_isnumber (L, 4)) {
+		max_dist = lua_tonumber (L, 4);
+	}
+
 	if (s1 && s2) {
-		dist = rspamd_strings_levenshtein_distance (s1, s1len, s2, s2len,
-				replace_cost);
+		dist = rspamd_strings_levenshtein_distance_bounded (s1, s1len,
+				s2, s2len, replace_cost, max_dist);
 	}
 
 	lua_pushnumber (L, dist);
@@ -1096,7 +1147,13 @@ lua_util_parse_addr (lua_State *L)
 			own_pool = TRUE;
 		}
 
-		addrs = rspamd_email_address_from_mime (pool, str, len, NULL);
+		if (own_pool) {
+			addrs = rspamd_email_address_from_mime (pool, str, len, NULL);
+		}
+		else {
+			/* Rules often parse the same headers using the task's pool */
+			addrs = rspamd_email_address_from_mime_cached (pool, str, len);
+		}
 
 		if (addrs == NULL) {
 			lua_pushnil (L);
@@ -1276,7 +1333,13 @@ lua_util_parse_mail_address (lua_State *L)
 			own_pool = TRUE;
 		}
 
-		addrs = rspamd_email_address_from_mime (pool, str, len, NULL);
+		if (own_pool) {
+			addrs = rspamd_email_address_from_mime (pool, str, len, NULL);
+		}
+		else {
+			/* Rules often parse the same headers using the task's pool */
+			addrs = rspamd_email_address_from_mime_cached (pool, str, len);
+		}
 
 		if (addrs == NULL) {
 			lua_pushnil (L);
@@ -0,0 +1,179 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "libutil/util.h"
+#include "libutil/map.h"
+#include "libutil/map_private.h"
+#include "libutil/map_compiled.h"
+#include "libserver/cfg_file.h"
+#include "libserver/cfg_rcl.h"
+#include "libserver/worker_util.h"
+#include "libserver/rspamd_control.h"
+#include "unix-std.h"
+
+#ifdef HAVE_GLOB_H
+#include <glob.h>
+#endif
+
+static gpointer init_map_helper (struct rspamd_config *cfg);
+static void start_map_helper (struct rspamd_worker *worker);
+
+worker_t map_helper_worker = {
+		"map_helper",                /* Name */
+		init_map_helper,             /* Init function */
+		start_map_helper,            /* Start function */
+		RSPAMD_WORKER_UNIQUE | RSPAMD_WORKER_KILLABLE,
+		RSPAMD_WORKER_SOCKET_NONE,   /* No socket */
+		RSPAMD_WORKER_VER            /* Version info */
+};
+
+static const guint64 rspamd_map_helper_magic = 0x4b3bb1b2d0cf0a17ULL;
+
+/*
+ * Map helper loads shared maps (compiled hash and radix maps), writes their
+ * images to the cache dir and asks all workers to map them instead of
+ * fetching and parsing the same data in each process
+ */
+struct map_helper_ctx {
+	guint64 magic;
+	gchar *cache_dir;
+	struct rspamd_config *cfg;
+	struct rspamd_worker *worker;
+	struct event_base *ev_base;
+	struct rspamd_dns_resolver *resolver;
+};
+
+static gpointer
+init_map_helper (struct rspamd_config *cfg)
+{
+	struct map_helper_ctx *ctx;
+	GQuark type;
+
+	type = g_quark_try_string ("map_helper");
+	ctx = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*ctx));
+
+	ctx->magic = rspamd_map_helper_magic;
+	ctx->cfg = cfg;
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"cache_dir",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct map_helper_ctx, cache_dir),
+			0,
+			"Directory where to save compiled maps");
+
+	return ctx;
+}
+
+/* Images are named by map ids, so images from previous runs are useless */
+static void
+rspamd_map_helper_cleanup_dir (struct map_helper_ctx *ctx)
+{
+	glob_t globbuf;
+	gchar *pattern;
+	guint i;
+	gint rc;
+
+	memset (&globbuf, 0, sizeof (globbuf));
+	pattern = g_strdup_printf ("%s%c%s", ctx->cache_dir, G_DIR_SEPARATOR,
+			"*.rmap*");
+
+	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i++) {
+			if (unlink (globbuf.gl_pathv[i]) == -1) {
+				msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
+						strerror (errno));
+			}
+		}
+	}
+	else if (rc != GLOB_NOMATCH) {
+		msg_err ("glob %s failed: %s", pattern, strerror (errno));
+	}
+
+	globfree (&globbuf);
+	g_free (pattern);
+}
+
+static void
+rspamd_map_helper_publish (struct rspamd_map *map, gpointer ud)
+{
+	struct map_helper_ctx *ctx = ud;
+	struct rspamd_map_compiled *cm = *map->user_data;
+	struct rspamd_srv_command srv_cmd;
+	GError *err = NULL;
+	gchar path[CONTROL_PATHLEN];
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%ud.rmap", ctx->cache_dir,
+			G_DIR_SEPARATOR, map->id);
+
+	if (!rspamd_map_compiled_write (cm, path, &err)) {
+		msg_err ("cannot save map %s: %e", map->name, err);
+		g_error_free (err);
+
+		return;
+	}
+
+	rspamd_map_set_shared_image (map, path);
+	msg_info ("saved map %s to %s, notify workers", map->name, path);
+
+	memset (&srv_cmd, 0, sizeof (srv_cmd));
+	srv_cmd.type = RSPAMD_SRV_MAP_LOADED;
+	srv_cmd.cmd.map_loaded.map_id = map->id;
+	rspamd_strlcpy (srv_cmd.cmd.map_loaded.path, path,
+			sizeof (srv_cmd.cmd.map_loaded.path));
+	rspamd_srv_send_command (ctx->worker, ctx->ev_base, &srv_cmd, -1,
+			NULL, NULL);
+}
+
+static void
+start_map_helper (struct rspamd_worker *worker)
+{
+	struct map_helper_ctx *ctx = worker->ctx;
+
+	ctx->cfg = worker->srv->cfg;
+	ctx->worker = worker;
+
+	if (ctx->cache_dir == NULL) {
+		ctx->cache_dir = ctx->cfg->hs_cache_dir;
+	}
+	if (ctx->cache_dir == NULL) {
+		ctx->cache_dir = RSPAMD_DBDIR;
+	}
+
+	ctx->ev_base = rspamd_prepare_worker (worker,
+			"map_helper",
+			NULL,
+			FALSE);
+	ctx->resolver = dns_resolver_init (worker->srv->logger,
+			ctx->ev_base,
+			worker->srv->cfg);
+	rspamd_upstreams_library_config (worker->srv->cfg, ctx->cfg->ups_ctx,
+			ctx->ev_base, ctx->resolver->r);
+
+	rspamd_map_helper_cleanup_dir (ctx);
+	rspamd_map_watch_shared (ctx->cfg, ctx->ev_base, ctx->resolver,
+			rspamd_map_helper_publish, ctx);
+
+	event_base_loop (ctx->ev_base, 0);
+	rspamd_worker_block_signals ();
+
+	rspamd_log_close (worker->srv->logger);
+	REF_RELEASE (ctx->cfg);
+
+	exit (EXIT_SUCCESS);
+}
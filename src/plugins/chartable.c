@@ -35,6 +35,15 @@
 #define DEFAULT_URL_SYMBOL "R_MIXED_CHARSET_URL"
 #define DEFAULT_THRESHOLD 0.1
 
+/*
+ * Classes of the first codepoints are cached: lower bits store unicode block
+ * (all latin blocks are treated as basic latin), upper bits store flags
+ */
+#define CHARTABLE_CACHED_CODEPOINTS 0x3000
+#define CHARTABLE_ALPHA (1u << 14)
+#define CHARTABLE_DIGIT (1u << 15)
+#define CHARTABLE_BLOCK(cls) ((cls) & (CHARTABLE_ALPHA - 1))
+
 #define msg_err_chartable(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "chartable", task->task_pool->tag.uid, \
         G_STRFUNC, \
@@ -77,15 +86,54 @@ struct chartable_ctx {
 };
 
 static struct chartable_ctx *chartable_module_ctx = NULL;
+static guint16 chartable_codepoints[CHARTABLE_CACHED_CODEPOINTS];
 static void chartable_symbol_callback (struct rspamd_task *task, void *unused);
 static void chartable_url_symbol_callback (struct rspamd_task *task, void *unused);
 
+static guint16
+chartable_classify_slow (UChar32 uc)
+{
+	UBlockCode sc;
+
+	if (u_isalpha (uc)) {
+		sc = ublock_getCode (uc);
+
+		if (sc <= UBLOCK_LATIN_EXTENDED_B) {
+			/* Assume all latin characters as basic latin */
+			sc = UBLOCK_BASIC_LATIN;
+		}
+
+		return CHARTABLE_ALPHA | CHARTABLE_BLOCK ((guint16)sc);
+	}
+	else if (u_isdigit (uc)) {
+		return CHARTABLE_DIGIT;
+	}
+
+	return 0;
+}
+
+static inline guint16
+chartable_classify (UChar32 uc)
+{
+	if (uc >= 0 && uc < CHARTABLE_CACHED_CODEPOINTS) {
+		return chartable_codepoints[uc];
+	}
+
+	return chartable_classify_slow (uc);
+}
+
 gint
 chartable_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 {
+	UChar32 uc;
+
 	if (chartable_module_ctx == NULL) {
 		chartable_module_ctx = g_malloc (sizeof (struct chartable_ctx));
 
+		for (uc = 0; uc < CHARTABLE_CACHED_CODEPOINTS; uc ++) {
+			chartable_codepoints[uc] = chartable_classify_slow (uc);
+		}
+
 		chartable_module_ctx->chartable_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
 		chartable_module_ctx->max_word_len = 10;
 	}
@@ -143,14 +191,14 @@ chartable_module_config (struct rspamd_config *cfg)
 			0,
 			chartable_symbol_callback,
 			NULL,
-			SYMBOL_TYPE_NORMAL,
+			SYMBOL_TYPE_NORMAL|SYMBOL_TYPE_CONTENT,
 			-1);
 	rspamd_symbols_cache_add_symbol (cfg->cache,
 			chartable_module_ctx->url_symbol,
 			0,
 			chartable_url_symbol_callback,
 			NULL,
-			SYMBOL_TYPE_NORMAL,
+			SYMBOL_TYPE_NORMAL|SYMBOL_TYPE_CONTENT,
 			-1);
 
 	msg_info_config ("init internal chartable module");
@@ -175,7 +223,7 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 	const gchar *p, *end;
 	gdouble badness = 0.0;
 	UChar32 uc;
-	UBlockCode sc, last_sc;
+	guint16 cls, sc, last_sc;
 	guint same_script_count = 0, nsym = 0, i = 0;
 	enum {
 		start_process = 0,
@@ -188,18 +236,23 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 	end = p + w->len;
 	last_sc = 0;
 
+	/*
+	 * Words that are surely longer than max_word_len and pure ascii words
+	 * have no badness
+	 */
+	if (w->len > chartable_module_ctx->max_word_len * 4 ||
+			rspamd_str_is_ascii (w->begin, w->len)) {
+		return 0.0;
+	}
+
 	/* We assume that w is normalized */
 
 	while (p + i < end) {
 		U8_NEXT_UNSAFE (p, i, uc);
+		cls = chartable_classify (uc);
 
-		if (u_isalpha (uc)) {
-			sc = ublock_getCode (uc);
-
-			if (sc <= UBLOCK_LATIN_EXTENDED_B) {
-				/* Assume all latin characters as basic latin */
-				sc = UBLOCK_BASIC_LATIN;
-			}
+		if (cls & CHARTABLE_ALPHA) {
+			sc = CHARTABLE_BLOCK (cls);
 
 			if (state == got_digit) {
 				/* Penalize digit -> alpha translations */
@@ -230,7 +283,7 @@ rspamd_chartable_process_word_utf (struct rspamd_task *task,
 			state = got_alpha;
 
 		}
-		else if (u_isdigit (uc)) {
+		else if (cls & CHARTABLE_DIGIT) {
 			if (state != got_digit) {
 				prev_state = state;
 			}
@@ -364,6 +417,12 @@ rspamd_chartable_process_part (struct rspamd_task *task,
 		return;
 	}
 
+	if (IS_PART_UTF (part) && part->content &&
+			rspamd_str_is_ascii (part->content->data, part->content->len)) {
+		/* Pure ascii words in utf parts cannot mix scripts */
+		return;
+	}
+
 	for (i = 0; i < part->normalized_words->len; i++) {
 		w = &g_array_index (part->normalized_words, rspamd_stat_token_t, i);
 
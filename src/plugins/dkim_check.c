@@ -546,6 +546,25 @@ dkim_module_config (struct rspamd_config *cfg)
 	return res;
 }
 
+/*
+ * Drops a cached key if its file has been modified since it was loaded
+ */
+static rspamd_dkim_sign_key_t *
+dkim_module_check_file_key (rspamd_dkim_sign_key_t *dkim_key,
+		const gchar *path)
+{
+	struct stat st;
+
+	if (dkim_key && stat (path, &st) != -1 &&
+			rspamd_dkim_sign_key_maybe_invalidate (dkim_key, st.st_mtime)) {
+		rspamd_lru_hash_remove (dkim_module_ctx->dkim_sign_hash, path);
+
+		return NULL;
+	}
+
+	return dkim_key;
+}
+
 gint
 lua_dkim_sign_handler (lua_State *L)
 {
@@ -585,6 +604,7 @@ lua_dkim_sign_handler (lua_State *L)
 	if (key) {
 		dkim_key = rspamd_lru_hash_lookup (dkim_module_ctx->dkim_sign_hash,
 				key, time (NULL));
+		dkim_key = dkim_module_check_file_key (dkim_key, key);
 
 		if (dkim_key == NULL) {
 			dkim_key = rspamd_dkim_sign_key_load (key, strlen (key),
@@ -880,7 +900,8 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 		msg_debug_task ("dkim signature found");
 
 		PTR_ARRAY_FOREACH (hlist, i, rh) {
-			if (rh->decoded == NULL || rh->decoded[0] == '\0') {
+			if (rh->value == NULL ||
+					rspamd_mime_header_get_decoded (rh)[0] == '\0') {
 				msg_info_task ("<%s> cannot load empty DKIM context",
 						task->message_id);
 				continue;
@@ -903,7 +924,8 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 			cur->mult_allow = 1.0;
 			cur->mult_deny = 1.0;
 
-			ctx = rspamd_create_dkim_context (rh->decoded,
+			ctx = rspamd_create_dkim_context (
+					rspamd_mime_header_get_decoded (rh),
 					task->task_pool,
 					dkim_module_ctx->time_jitter,
 					&err);
@@ -1065,6 +1087,7 @@ dkim_sign_callback (struct rspamd_task *task, void *unused)
 					dkim_key = rspamd_lru_hash_lookup (
 							dkim_module_ctx->dkim_sign_hash,
 							key, time (NULL));
+					dkim_key = dkim_module_check_file_key (dkim_key, key);
 					lru_key = key;
 				}
 				else {
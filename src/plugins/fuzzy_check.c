@@ -34,6 +34,7 @@
 #include "libmime/message.h"
 #include "libutil/map.h"
 #include "libmime/images.h"
+#include "libmime/mime_parser.h"
 #include "libserver/worker_util.h"
 #include "fuzzy_wire.h"
 #include "utlist.h"
@@ -51,6 +52,8 @@
 
 #define DEFAULT_IO_TIMEOUT 500
 #define DEFAULT_RETRANSMITS 3
+/* Latency quantile of an upstream to wait before sending a hedged request */
+#define FUZZY_HEDGE_QUANTILE 0.9
 #define DEFAULT_PORT 11335
 
 #define RSPAMD_FUZZY_PLUGIN_VERSION RSPAMD_FUZZY_VERSION
@@ -85,6 +88,7 @@ struct fuzzy_rule {
 	gboolean read_only;
 	gboolean skip_unknown;
 	gboolean fuzzy_images;
+	gboolean batch;
 	gint learn_condition_cb;
 };
 
@@ -102,6 +106,7 @@ struct fuzzy_ctx {
 	guint32 min_width;
 	guint32 io_timeout;
 	guint32 retransmits;
+	gboolean hedged_requests;
 	gboolean enabled;
 };
 
@@ -113,7 +118,11 @@ struct fuzzy_client_session {
 	struct fuzzy_rule *rule;
 	struct event ev;
 	struct event timev;
+	struct event hedgev;
 	struct timeval tv;
+	/* Request to another upstream sharing the same commands */
+	struct fuzzy_client_session *peer;
+	gdouble start;
 	gint state;
 	gint fd;
 	guint retransmits;
@@ -489,6 +498,10 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 		rule->fuzzy_images = ucl_obj_toboolean (value);
 	}
 
+	if ((value = ucl_object_lookup (obj, "batch")) != NULL) {
+		rule->batch = ucl_obj_toboolean (value);
+	}
+
 	if ((value = ucl_object_lookup (obj, "algorithm")) != NULL) {
 		rule->algorithm_str = ucl_object_tostring (value);
 
@@ -507,6 +520,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 					g_ascii_strcasecmp (rule->algorithm_str, "fast") == 0) {
 				rule->alg = RSPAMD_SHINGLES_FAST;
 			}
+			else if (g_ascii_strcasecmp (rule->algorithm_str, "vector") == 0) {
+				rule->alg = RSPAMD_SHINGLES_VECTOR;
+			}
 			else {
 				msg_warn_config ("unknown algorithm: %s, use siphash by default",
 						rule->algorithm_str);
@@ -528,6 +544,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 	case RSPAMD_SHINGLES_FAST:
 		rule->algorithm_str = "fast";
 		break;
+	case RSPAMD_SHINGLES_VECTOR:
+		rule->algorithm_str = "vec";
+		break;
 	}
 
 	if ((value = ucl_object_lookup (obj, "servers")) != NULL) {
@@ -737,6 +756,16 @@ fuzzy_check_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			NULL,
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check",
+			"Send a duplicate request to another server if there is no reply "
+			"within p90 latency of the selected server",
+			"hedged_requests",
+			UCL_BOOLEAN,
+			NULL,
+			0,
+			NULL,
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"fuzzy_check",
 			"Whitelisted IPs map",
@@ -810,6 +839,15 @@ fuzzy_check_module_init (struct rspamd_config *cfg, struct module_ctx **ctx)
 			0,
 			NULL,
 			0);
+	rspamd_rcl_add_doc_by_path (cfg,
+			"fuzzy_check.rule",
+			"If true then send all hashes of a message in a single datagram (requires storage support)",
+			"batch",
+			UCL_BOOLEAN,
+			NULL,
+			0,
+			NULL,
+			0);
 	rspamd_rcl_add_doc_by_path (cfg,
 			"fuzzy_check.rule",
 			"Default symbol for rule (if no flags defined or matched)",
@@ -960,6 +998,16 @@ fuzzy_check_module_config (struct rspamd_config *cfg)
 		fuzzy_module_ctx->retransmits = DEFAULT_RETRANSMITS;
 	}
 
+	if ((value =
+				 rspamd_config_get_module_opt (cfg,
+						 "fuzzy_check",
+						 "hedged_requests")) != NULL) {
+		fuzzy_module_ctx->hedged_requests = ucl_obj_toboolean (value);
+	}
+	else {
+		fuzzy_module_ctx->hedged_requests = FALSE;
+	}
+
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "fuzzy_check",
 		"whitelist")) != NULL) {
@@ -975,7 +1023,7 @@ fuzzy_check_module_config (struct rspamd_config *cfg)
 
 		cb_id = rspamd_symbols_cache_add_symbol (cfg->cache,
 					"FUZZY_CALLBACK", 0, fuzzy_symbol_callback, NULL,
-					SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_FINE,
+					SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_FINE|SYMBOL_TYPE_CONTENT,
 					-1);
 
 		/*
@@ -1078,12 +1126,17 @@ fuzzy_io_fin (void *ud)
 {
 	struct fuzzy_client_session *session = ud;
 
-	if (session->commands) {
+	if (session->peer) {
+		/* Commands are still used by the other request */
+		session->peer->peer = NULL;
+	}
+	else if (session->commands) {
 		g_ptr_array_free (session->commands, TRUE);
 	}
 
 	event_del (&session->ev);
 	event_del (&session->timev);
+	event_del (&session->hedgev);
 	close (session->fd);
 }
 
@@ -1151,7 +1204,7 @@ fuzzy_cmd_stat (struct fuzzy_rule *rule,
 	io->tag = cmd->tag;
 	memcpy (&io->cmd, cmd, sizeof (io->cmd));
 
-	if (rule->peer_key) {
+	if (rule->peer_key && !rule->batch) {
 		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *)cmd, sizeof (*cmd));
 		io->io.iov_base = enccmd;
 		io->io.iov_len = sizeof (*enccmd);
@@ -1208,7 +1261,7 @@ fuzzy_cmd_hash (struct fuzzy_rule *rule,
 
 	memcpy (&io->cmd, cmd, sizeof (io->cmd));
 
-	if (rule->peer_key) {
+	if (rule->peer_key && !rule->batch) {
 		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *)cmd, sizeof (*cmd));
 		io->io.iov_base = enccmd;
 		io->io.iov_len = sizeof (*enccmd);
@@ -1332,7 +1385,7 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 	io->flags = 0;
 	memcpy (&io->cmd, &shcmd->basic, sizeof (io->cmd));
 
-	if (rule->peer_key) {
+	if (rule->peer_key && !rule->batch) {
 		/* Encrypt data */
 		fuzzy_encrypt_cmd (rule, &encshcmd->hdr, (guchar *) shcmd, sizeof (*shcmd));
 		io->io.iov_base = encshcmd;
@@ -1420,7 +1473,7 @@ fuzzy_cmd_from_image_part (struct fuzzy_rule *rule,
 	io->flags = FUZZY_CMD_FLAG_IMAGE;
 	memcpy (&io->cmd, &shcmd->basic, sizeof (io->cmd));
 
-	if (rule->peer_key) {
+	if (rule->peer_key && !rule->batch) {
 		/* Encrypt data */
 		fuzzy_encrypt_cmd (rule, &encshcmd->hdr, (guchar *) shcmd, sizeof (*shcmd));
 		io->io.iov_base = encshcmd;
@@ -1469,7 +1522,7 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 	io->tag = cmd->tag;
 	memcpy (&io->cmd, cmd, sizeof (io->cmd));
 
-	if (rule->peer_key) {
+	if (rule->peer_key && !rule->batch) {
 		g_assert (enccmd != NULL);
 		fuzzy_encrypt_cmd (rule, &enccmd->hdr, (guchar *) cmd, sizeof (*cmd));
 		io->io.iov_base = enccmd;
@@ -1502,12 +1555,62 @@ fuzzy_cmd_to_wire (gint fd, struct iovec *io)
 	return TRUE;
 }
 
+/*
+ * Pack plain commands into a single batch datagram, encrypting the whole
+ * batch at once if needed
+ */
 static gboolean
-fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
+fuzzy_cmd_batch_to_wire (gint fd, struct fuzzy_rule *rule,
+		struct fuzzy_cmd_io **ios, guint nios)
 {
+	guchar buf[sizeof (struct rspamd_fuzzy_encrypted_req_hdr) +
+			sizeof (struct rspamd_fuzzy_batch_hdr) +
+			RSPAMD_FUZZY_BATCH_MAX * sizeof (struct rspamd_fuzzy_shingle_cmd)];
+	struct rspamd_fuzzy_encrypted_req_hdr *hdr = NULL;
+	struct rspamd_fuzzy_batch_hdr *bhdr;
+	struct iovec io;
+	guchar *p, *payload;
 	guint i;
+
+	g_assert (nios > 0 && nios <= RSPAMD_FUZZY_BATCH_MAX);
+	p = buf;
+
+	if (rule->peer_key) {
+		hdr = (struct rspamd_fuzzy_encrypted_req_hdr *)p;
+		p += sizeof (*hdr);
+	}
+
+	payload = p;
+	bhdr = (struct rspamd_fuzzy_batch_hdr *)p;
+	memcpy (bhdr->magic, fuzzy_batch_magic, sizeof (bhdr->magic));
+	bhdr->version = RSPAMD_FUZZY_BATCH_VERSION;
+	bhdr->ncmds = nios;
+	bhdr->reserved = 0;
+	p += sizeof (*bhdr);
+
+	for (i = 0; i < nios; i ++) {
+		g_assert (ios[i]->io.iov_len <= sizeof (struct rspamd_fuzzy_shingle_cmd));
+		memcpy (p, ios[i]->io.iov_base, ios[i]->io.iov_len);
+		p += ios[i]->io.iov_len;
+	}
+
+	if (hdr) {
+		fuzzy_encrypt_cmd (rule, hdr, payload, p - payload);
+		memcpy (hdr->magic, fuzzy_encrypted_batch_magic, sizeof (hdr->magic));
+	}
+
+	io.iov_base = buf;
+	io.iov_len = p - buf;
+
+	return fuzzy_cmd_to_wire (fd, &io);
+}
+
+static gboolean
+fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v, struct fuzzy_rule *rule)
+{
+	guint i, nbatch = 0;
 	gboolean all_sent = TRUE, all_replied = TRUE;
-	struct fuzzy_cmd_io *io;
+	struct fuzzy_cmd_io *io, *batch[RSPAMD_FUZZY_BATCH_MAX];
 	gboolean processed = FALSE;
 
 	/* First try to resend unsent commands */
@@ -1521,7 +1624,18 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
 		all_replied = FALSE;
 
 		if (!(io->flags & FUZZY_CMD_FLAG_SENT)) {
-			if (!fuzzy_cmd_to_wire (fd, &io->io)) {
+			if (rule->batch) {
+				batch[nbatch++] = io;
+
+				if (nbatch == G_N_ELEMENTS (batch)) {
+					if (!fuzzy_cmd_batch_to_wire (fd, rule, batch, nbatch)) {
+						return FALSE;
+					}
+
+					nbatch = 0;
+				}
+			}
+			else if (!fuzzy_cmd_to_wire (fd, &io->io)) {
 				return FALSE;
 			}
 			processed = TRUE;
@@ -1530,6 +1644,12 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
 		}
 	}
 
+	if (nbatch > 0) {
+		if (!fuzzy_cmd_batch_to_wire (fd, rule, batch, nbatch)) {
+			return FALSE;
+		}
+	}
+
 	if (all_sent && !all_replied) {
 		/* Now try to resend each command in the vector */
 		for (i = 0; i < v->len; i++) {
@@ -1540,12 +1660,68 @@ fuzzy_cmd_vector_to_wire (gint fd, GPtrArray *v)
 			}
 		}
 
-		return fuzzy_cmd_vector_to_wire (fd, v);
+		return fuzzy_cmd_vector_to_wire (fd, v, rule);
 	}
 
 	return processed;
 }
 
+/*
+ * Check and decrypt batch reply header leaving plain replies in the buffer
+ */
+static guchar *
+fuzzy_batch_reply_open (struct fuzzy_rule *rule, guchar *buf, gint *r)
+{
+	struct rspamd_fuzzy_encrypted_rep_hdr hdr;
+	struct rspamd_fuzzy_batch_hdr *bhdr;
+	guchar *p = buf;
+	gint remain = *r;
+
+	*r = 0;
+
+	if (rule->peer_key) {
+		if (remain < (gint)sizeof (hdr)) {
+			return NULL;
+		}
+
+		memcpy (&hdr, p, sizeof (hdr));
+		p += sizeof (hdr);
+		remain -= sizeof (hdr);
+
+		rspamd_keypair_cache_process (fuzzy_module_ctx->keypairs_cache,
+				rule->local_key, rule->peer_key);
+
+		if (!rspamd_cryptobox_decrypt_nm_inplace (p,
+				remain,
+				hdr.nonce,
+				rspamd_pubkey_get_nm (rule->peer_key),
+				hdr.mac,
+				rspamd_pubkey_alg (rule->peer_key))) {
+			msg_info ("cannot decrypt reply");
+			return NULL;
+		}
+	}
+
+	if (remain < (gint)sizeof (*bhdr)) {
+		return NULL;
+	}
+
+	bhdr = (struct rspamd_fuzzy_batch_hdr *)p;
+	p += sizeof (*bhdr);
+	remain -= sizeof (*bhdr);
+
+	if (memcmp (bhdr->magic, fuzzy_batch_magic, sizeof (bhdr->magic)) != 0 ||
+			bhdr->version != RSPAMD_FUZZY_BATCH_VERSION ||
+			(gsize)remain != bhdr->ncmds * sizeof (struct rspamd_fuzzy_reply)) {
+		msg_info ("invalid batch reply");
+		return NULL;
+	}
+
+	*r = remain;
+
+	return p;
+}
+
 /*
  * Read replies one-by-one and remove them from req array
  */
@@ -1562,7 +1738,7 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 	struct rspamd_fuzzy_encrypted_reply encrep;
 	gboolean found = FALSE;
 
-	if (rule->peer_key) {
+	if (rule->peer_key && !rule->batch) {
 		required_size = sizeof (encrep);
 	}
 	else {
@@ -1573,7 +1749,7 @@ fuzzy_process_reply (guchar **pos, gint *r, GPtrArray *req,
 		return NULL;
 	}
 
-	if (rule->peer_key) {
+	if (rule->peer_key && !rule->batch) {
 		memcpy (&encrep, p, sizeof (encrep));
 		*pos += required_size;
 		*r -= required_size;
@@ -1729,7 +1905,12 @@ fuzzy_check_try_read (struct fuzzy_client_session *session)
 		}
 	}
 	else {
-		p = buf;
+		if (session->rule->batch) {
+			p = fuzzy_batch_reply_open (session->rule, buf, &r);
+		}
+		else {
+			p = buf;
+		}
 
 		ret = 0;
 
@@ -1782,6 +1963,7 @@ fuzzy_check_try_read (struct fuzzy_client_session *session)
 static gboolean
 fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 {
+	struct fuzzy_client_session *peer;
 	struct fuzzy_cmd_io *io;
 	guint nreplied = 0, i;
 
@@ -1796,8 +1978,16 @@ fuzzy_check_session_is_completed (struct fuzzy_client_session *session)
 	}
 
 	if (nreplied == session->commands->len) {
+		peer = session->peer;
+		rspamd_upstream_latency (session->server,
+				rspamd_get_ticks () - session->start);
 		rspamd_session_remove_event (session->task->s, fuzzy_io_fin, session);
 
+		if (peer) {
+			/* Cancel a slower request */
+			rspamd_session_remove_event (peer->task->s, fuzzy_io_fin, peer);
+		}
+
 		return TRUE;
 	}
 
@@ -1838,7 +2028,8 @@ fuzzy_check_io_callback (gint fd, short what, void *arg)
 		}
 	}
 	else if (what & EV_WRITE) {
-		if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+		if (!fuzzy_cmd_vector_to_wire (fd, session->commands,
+				session->rule)) {
 			ret = return_error;
 		}
 		else {
@@ -1981,7 +2172,13 @@ fuzzy_controller_io_callback (gint fd, short what, void *arg)
 			ret = return_error;
 		}
 		else {
-			p = buf;
+			if (session->rule->batch) {
+				p = fuzzy_batch_reply_open (session->rule, buf, &r);
+			}
+			else {
+				p = buf;
+			}
+
 			ret = return_want_more;
 
 			while ((rep = fuzzy_process_reply (&p, &r,
@@ -2063,7 +2260,8 @@ fuzzy_controller_io_callback (gint fd, short what, void *arg)
 	}
 	else if (what & EV_WRITE) {
 			/* Send commands to storage */
-			if (!fuzzy_cmd_vector_to_wire (fd, session->commands)) {
+			if (!fuzzy_cmd_vector_to_wire (fd, session->commands,
+					session->rule)) {
 				if (*(session->err) == NULL) {
 					g_set_error (session->err,
 						g_quark_from_static_string ("fuzzy check"),
@@ -2351,10 +2549,14 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 		}
 
 		if (G_LIKELY (!(flags & FUZZY_CHECK_FLAG_NOIMAGES))) {
-			if (mime_part->parsed_data.len > 0 &&
+			if (mime_part->raw_data.len > 0 &&
 					fuzzy_check_content_type (rule, mime_part->ct)) {
-				if (fuzzy_module_ctx->min_bytes <= 0 || mime_part->parsed_data.len >=
-						fuzzy_module_ctx->min_bytes) {
+				rspamd_mime_part_decode (mime_part);
+
+				if (mime_part->parsed_data.len > 0 &&
+						(fuzzy_module_ctx->min_bytes <= 0 ||
+						mime_part->parsed_data.len >=
+						fuzzy_module_ctx->min_bytes)) {
 					io = fuzzy_cmd_from_data_part (rule, c, flag, value,
 							task->task_pool,
 							mime_part->digest);
@@ -2384,6 +2586,126 @@ end:
 }
 
 
+static void fuzzy_check_hedge_callback (gint fd, short what, void *arg);
+
+static struct fuzzy_client_session *
+fuzzy_client_session_new (struct rspamd_task *task,
+	struct fuzzy_rule *rule,
+	GPtrArray *commands,
+	struct upstream *selected)
+{
+	struct fuzzy_client_session *session;
+	rspamd_inet_addr_t *addr;
+	gint sock;
+
+	addr = rspamd_upstream_addr (selected);
+
+	if ((sock = rspamd_inet_address_connect (addr, SOCK_DGRAM, TRUE)) == -1) {
+		msg_warn_task ("cannot connect to %s(%s), %d, %s",
+			rspamd_upstream_name (selected),
+			rspamd_inet_address_to_string (addr),
+			errno,
+			strerror (errno));
+		rspamd_upstream_fail (selected);
+
+		return NULL;
+	}
+
+	/* Create session for a socket */
+	session =
+		rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct fuzzy_client_session));
+	msec_to_tv (fuzzy_module_ctx->io_timeout, &session->tv);
+	session->state = 0;
+	session->commands = commands;
+	session->task = task;
+	session->fd = sock;
+	session->server = selected;
+	session->rule = rule;
+	session->addr = addr;
+	session->start = rspamd_get_ticks ();
+
+	event_set (&session->ev, sock, EV_WRITE, fuzzy_check_io_callback,
+			session);
+	event_base_set (session->task->ev_base, &session->ev);
+	event_add (&session->ev, NULL);
+
+	evtimer_set (&session->timev, fuzzy_check_timer_callback,
+			session);
+	event_base_set (session->task->ev_base, &session->timev);
+	event_add (&session->timev, &session->tv);
+
+	evtimer_set (&session->hedgev, fuzzy_check_hedge_callback,
+			session);
+	event_base_set (session->task->ev_base, &session->hedgev);
+
+	rspamd_session_add_event (task->s,
+		fuzzy_io_fin,
+		session,
+		g_quark_from_static_string ("fuzzy check"));
+
+	return session;
+}
+
+/* Sends the same commands to another server if the first one is slow */
+static void
+fuzzy_check_hedge_callback (gint fd, short what, void *arg)
+{
+	struct fuzzy_client_session *session = arg, *hedged;
+	struct rspamd_task *task;
+	struct upstream *selected = NULL;
+	guint i, nalive;
+
+	task = session->task;
+	nalive = rspamd_upstreams_alive (session->rule->servers);
+
+	for (i = 0; i < nalive; i ++) {
+		selected = rspamd_upstream_get (session->rule->servers,
+				RSPAMD_UPSTREAM_ROUND_ROBIN, NULL, 0);
+
+		if (selected != session->server) {
+			break;
+		}
+	}
+
+	if (selected == NULL || selected == session->server) {
+		return;
+	}
+
+	hedged = fuzzy_client_session_new (task, session->rule,
+			session->commands, selected);
+
+	if (hedged) {
+		msg_debug_task ("send hedged request to %s, no reply from %s",
+				rspamd_upstream_name (selected),
+				rspamd_upstream_name (session->server));
+		hedged->peer = session;
+		session->peer = hedged;
+	}
+}
+
+static void
+fuzzy_check_plan_hedge (struct fuzzy_client_session *session)
+{
+	struct timeval tv;
+	gdouble delay;
+
+	if (rspamd_upstreams_alive (session->rule->servers) < 2) {
+		return;
+	}
+
+	delay = rspamd_upstream_latency_quantile (session->server,
+			FUZZY_HEDGE_QUANTILE);
+
+	/* Nothing is known yet or retransmit would be sent earlier */
+	if (delay == 0 || delay * 1000.0 >= fuzzy_module_ctx->io_timeout) {
+		return;
+	}
+
+	double_to_tv (delay, &tv);
+	event_add (&session->hedgev, &tv);
+}
+
 static inline void
 register_fuzzy_client_call (struct rspamd_task *task,
 	struct fuzzy_rule *rule,
@@ -2391,51 +2713,18 @@ register_fuzzy_client_call (struct rspamd_task *task,
 {
 	struct fuzzy_client_session *session;
 	struct upstream *selected;
-	rspamd_inet_addr_t *addr;
-	gint sock;
 
 	/* Get upstream */
 	selected = rspamd_upstream_get (rule->servers, RSPAMD_UPSTREAM_ROUND_ROBIN,
 			NULL, 0);
 	if (selected) {
-		addr = rspamd_upstream_addr (selected);
-		if ((sock = rspamd_inet_address_connect (addr, SOCK_DGRAM, TRUE)) == -1) {
-			msg_warn_task ("cannot connect to %s(%s), %d, %s",
-				rspamd_upstream_name (selected),
-				rspamd_inet_address_to_string (addr),
-				errno,
-				strerror (errno));
-			rspamd_upstream_fail (selected);
+		session = fuzzy_client_session_new (task, rule, commands, selected);
+
+		if (session == NULL) {
 			g_ptr_array_free (commands, TRUE);
 		}
-		else {
-			/* Create session for a socket */
-			session =
-				rspamd_mempool_alloc0 (task->task_pool,
-					sizeof (struct fuzzy_client_session));
-			msec_to_tv (fuzzy_module_ctx->io_timeout, &session->tv);
-			session->state = 0;
-			session->commands = commands;
-			session->task = task;
-			session->fd = sock;
-			session->server = selected;
-			session->rule = rule;
-			session->addr = addr;
-
-			event_set (&session->ev, sock, EV_WRITE, fuzzy_check_io_callback,
-					session);
-			event_base_set (session->task->ev_base, &session->ev);
-			event_add (&session->ev, NULL);
-
-			evtimer_set (&session->timev, fuzzy_check_timer_callback,
-					session);
-			event_base_set (session->task->ev_base, &session->timev);
-			event_add (&session->timev, &session->tv);
-
-			rspamd_session_add_event (task->s,
-				fuzzy_io_fin,
-				session,
-				g_quark_from_static_string ("fuzzy check"));
+		else if (fuzzy_module_ctx->hedged_requests) {
+			fuzzy_check_plan_hedge (session);
 		}
 	}
 }
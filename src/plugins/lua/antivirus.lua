@@ -19,6 +19,7 @@ local rspamd_util = require "rspamd_util"
 local rspamd_regexp = require "rspamd_regexp"
 local tcp = require "rspamd_tcp"
 local upstream_list = require "rspamd_upstream_list"
+local rspamd_shared_cache = require "rspamd_shared_cache"
 local redis_params
 
 local N = "antivirus"
@@ -59,6 +60,7 @@ local function clamav_config(opts)
     timeout = 15.0,
     retransmits = 2,
     cache_expire = 3600, -- expire redis in one hour
+    keepalive = false, -- reuse connections within clamd IDSESSION
   }
 
   for k,v in pairs(opts) do
@@ -224,9 +226,25 @@ end
 local function check_av_cache(task, rule, fn)
   local key = task:get_digest()
 
+  if rule['local_cache'] then
+    -- Shared by all workers, checked before redis
+    local data = rule['local_cache']:get(key)
+    if data then
+      rspamd_logger.debugm(N, task, 'got locally cached result for %s: %s',
+        key, data)
+      if data ~= 'OK' then
+        yield_result(task, rule, data)
+      end
+      return true
+    end
+  end
+
   local function redis_av_cb(err, data)
     if data and type(data) == 'string' then
       -- Cached
+      if rule['local_cache'] then
+        rule['local_cache']:set(task:get_digest(), data)
+      end
       if data ~= 'OK' then
         rspamd_logger.debugm(N, task, 'got cached result for %s: %s', key, data)
         yield_result(task, rule, data)
@@ -263,6 +281,10 @@ end
 local function save_av_cache(task, rule, to_save)
   local key = task:get_digest()
 
+  if rule['local_cache'] then
+    rule['local_cache']:set(key, to_save, rule['cache_expire'])
+  end
+
   local function redis_set_cb(err)
     -- Do nothing
     if err then
@@ -374,6 +396,10 @@ local function clamav_check(task, rule)
     local header = rspamd_util.pack("c9 c1 >I4", "zINSTREAM", "\0",
       task:get_size())
     local footer = rspamd_util.pack(">I4", 0)
+    local session_init
+    if rule['keepalive'] then
+      session_init = 'zIDSESSION\0'
+    end
 
     local function clamav_callback(err, data)
       if err then
@@ -387,7 +413,9 @@ local function clamav_check(task, rule)
               timeout = rule['timeout'],
               callback = clamav_callback,
               data = { header, task:get_content(), footer },
-              stop_pattern = '\0'
+              stop_pattern = '\0',
+              keepalive = rule['keepalive'],
+              keepalive_init = session_init,
             })
           else
             rspamd_logger.errx(task, 'failed to scan, maximum retransmits exceed')
@@ -399,7 +427,8 @@ local function clamav_check(task, rule)
         end
       else
         upstream:ok()
-        data = tostring(data)
+        -- Replies within a session are prefixed with the request id
+        data = string.gsub(tostring(data), '^%d+: ', '')
         local cached
         if data == 'stream: OK' then
           cached = 'OK'
@@ -428,7 +457,9 @@ local function clamav_check(task, rule)
       timeout = rule['timeout'],
       callback = clamav_callback,
       data = { header, task:get_content(), footer },
-      stop_pattern = '\0'
+      stop_pattern = '\0',
+      keepalive = rule['keepalive'],
+      keepalive_init = session_init,
     })
   end
 
@@ -674,6 +705,16 @@ local function add_antivirus_rule(sym, opts)
     rule['whitelist'] = rspamd_config:add_hash_map(opts['whitelist'])
   end
 
+  local local_cache_size = opts['local_cache_size'] or 4096
+  if local_cache_size > 0 then
+    rule['local_cache'] = rspamd_shared_cache.create(rspamd_config,
+      'antivirus_' .. rule['prefix'], {
+        max_items = local_cache_size,
+        max_value = 128,
+        ttl = rule['cache_expire'],
+      })
+  end
+
   return function(task)
     return cfg.check(task, rule)
   end
@@ -100,6 +100,7 @@ if configure_asn_module() then
   local id = rspamd_config:register_symbol({
     name = 'ASN_CHECK',
     type = 'prefilter',
+    flags = 'envelope',
     callback = asn_check,
     priority = 5,
   })
@@ -16,19 +16,22 @@ limitations under the License.
 
 local rspamd_logger = require 'rspamd_logger'
 local rspamd_http = require "rspamd_http"
+local rspamd_clickhouse = require "rspamd_clickhouse"
 
 local E = {}
 
-local rows = {}
-local attachment_rows = {}
-local urls_rows = {}
-local specific_rows = {}
-local asn_rows = {}
-local nrows = 0
+-- Buffers of encoded rows for all tables
+local main_block
+local attachments_block
+local urls_block
+local asn_block
+local specific_blocks = {}
 
 local settings = {
   limit = 1000,
   timeout = 5.0,
+  flush_interval = 5.0,
+  use_gzip = false,
   bayes_spam_symbols = {'BAYES_SPAM'},
   bayes_ham_symbols = {'BAYES_HAM'},
   fann_symbols = {'FANN_SCORE'},
@@ -101,89 +104,78 @@ CREATE TABLE rspamd_asn (
 ) ENGINE = MergeTree(Date, Digest, 8192)
 ]]
 
-local function clickhouse_main_row(tname)
-  local fields = {
-    'Date',
-    'TS',
-    'From',
-    'MimeFrom',
-    'IP',
-    'Score',
-    'NRcpt',
-    'Size',
-    'IsWhitelist',
-    'IsBayes',
-    'IsFuzzy',
-    'IsFann',
-    'IsDkim',
-    'IsDmarc',
-    'NUrls',
-    'Action',
-    'FromUser',
-    'MimeUser',
-    'RcptUser',
-    'RcptDomain',
-    'ListId',
-    'Digest'
-  }
-  local elt = string.format('INSERT INTO %s (%s) VALUES ',
-    tname, table.concat(fields, ','))
+local function enum_type(values)
+  local elts = {}
+  for i,v in ipairs(values) do
+    table.insert(elts, string.format("'%s' = %d", v, i - 1))
+  end
 
-  return elt
+  return string.format('Enum8(%s)', table.concat(elts, ', '))
 end
 
-local function clickhouse_attachments_row(tname)
-  local attachement_fields = {
-    'Date',
-    'Digest',
-    'Attachments.FileName',
-    'Attachments.ContentType',
-    'Attachments.Length',
-    'Attachments.Digest',
-  }
-  local elt = string.format('INSERT INTO %s (%s) VALUES ',
-    tname, table.concat(attachement_fields, ','))
-  return elt
-end
+local main_columns = {
+  {'Date', 'Date'},
+  {'TS', 'DateTime'},
+  {'From', 'String'},
+  {'MimeFrom', 'String'},
+  {'IP', 'String'},
+  {'Score', 'Float64'},
+  {'NRcpt', 'UInt8'},
+  {'Size', 'UInt32'},
+  {'IsWhitelist', enum_type({'blacklist', 'whitelist', 'unknown'})},
+  {'IsBayes', enum_type({'ham', 'spam', 'unknown'})},
+  {'IsFuzzy', enum_type({'whitelist', 'deny', 'unknown'})},
+  {'IsFann', enum_type({'ham', 'spam', 'unknown'})},
+  {'IsDkim', enum_type({'reject', 'allow', 'unknown'})},
+  {'IsDmarc', enum_type({'reject', 'allow', 'unknown'})},
+  {'NUrls', 'Int32'},
+  {'Action', enum_type({'reject', 'rewrite subject', 'add header',
+    'greylist', 'no action'})},
+  {'FromUser', 'String'},
+  {'MimeUser', 'String'},
+  {'RcptUser', 'String'},
+  {'RcptDomain', 'String'},
+  {'ListId', 'String'},
+  {'Digest', 'FixedString(32)'},
+}
 
-local function clickhouse_urls_row(tname)
-  local urls_fields = {
-    'Date',
-    'Digest',
-    'Urls.Tld',
-    'Urls.Url',
-  }
-  local elt = string.format('INSERT INTO %s (%s) VALUES ',
-    tname, table.concat(urls_fields, ','))
-  return elt
-end
+local attachments_columns = {
+  {'Date', 'Date'},
+  {'Digest', 'FixedString(32)'},
+  {'Attachments.FileName', 'Array(String)'},
+  {'Attachments.ContentType', 'Array(String)'},
+  {'Attachments.Length', 'Array(UInt32)'},
+  {'Attachments.Digest', 'Array(FixedString(16))'},
+}
 
-local function clickhouse_asn_row(tname)
-  local asn_fields = {
-    'Date',
-    'Digest',
-    'ASN',
-    'Country',
-    'IPNet',
-  }
-  local elt = string.format('INSERT INTO %s (%s) VALUES ',
-    tname, table.concat(asn_fields, ','))
-  return elt
-end
+local urls_columns = {
+  {'Date', 'Date'},
+  {'Digest', 'FixedString(32)'},
+  {'Urls.Tld', 'Array(String)'},
+  {'Urls.Url', 'Array(String)'},
+}
 
-local function clickhouse_first_row()
-  table.insert(rows, clickhouse_main_row(settings['table']))
+local asn_columns = {
+  {'Date', 'Date'},
+  {'Digest', 'FixedString(32)'},
+  {'ASN', 'String'},
+  {'Country', 'FixedString(2)'},
+  {'IPNet', 'String'},
+}
+
+local function clickhouse_create_blocks()
+  main_block = rspamd_clickhouse.create(settings['table'], main_columns)
   if settings['attachments_table'] then
-    table.insert(attachment_rows,
-      clickhouse_attachments_row(settings['attachments_table']))
+    attachments_block = rspamd_clickhouse.create(settings['attachments_table'],
+      attachments_columns)
   end
   if settings['urls_table'] then
-    table.insert(urls_rows,
-      clickhouse_urls_row(settings['urls_table']))
+    urls_block = rspamd_clickhouse.create(settings['urls_table'],
+      urls_columns)
   end
   if settings['asn_table'] then
-    table.insert(asn_rows,
-      clickhouse_asn_row(settings['asn_table']))
+    asn_block = rspamd_clickhouse.create(settings['asn_table'],
+      asn_columns)
   end
 end
 
@@ -202,94 +194,66 @@ local function clickhouse_check_symbol(task, symbols, need_score)
   return false
 end
 
-local function clickhouse_send_data(task)
-  local function http_cb(err_message, code, _, _)
-    if code ~= 200 or err_message then
-      rspamd_logger.errx(task, "cannot send data to clickhouse server %s: %s:%s",
-        settings['server'], code, err_message)
-    else
-      rspamd_logger.infox(task, "sent %s rows to clickhouse server %s",
-        settings['limit'], settings['server'])
-    end
-  end
+-- Sends all buffered rows, `params` are either {task = task} or
+-- {ev_base = ev_base, config = cfg}
+local function clickhouse_send_data(params)
+  local function send_block(block, what)
+    local nrows = block:rows()
+    local body = block:flush(settings['use_gzip'])
 
-  local body = table.concat(rows, ' ')
-  if not rspamd_http.request({
-      task = task,
-      url = 'http://' .. settings['server'],
-      body = body,
-      callback = http_cb,
-      mime_type = 'text/plain',
-      timeout = settings['timeout'],
-    }) then
-     rspamd_logger.errx(task, "cannot send data to clickhouse server %s: cannot make request",
-        settings['server'])
-  end
+    if not body then return end
 
-  if #attachment_rows > 1 then
-    body = table.concat(attachment_rows, ' ')
-    if not rspamd_http.request({
-      task = task,
-      url = 'http://' .. settings['server'],
-      body = body,
-      callback = http_cb,
-      mime_type = 'text/plain',
-      timeout = settings['timeout'],
-    }) then
-      rspamd_logger.errx(task, "cannot send attachments to clickhouse server %s: cannot make request",
-        settings['server'])
+    local function http_cb(err_message, code, _, _)
+      if code ~= 200 or err_message then
+        rspamd_logger.errx(params.task or params.config,
+          "cannot send %s to clickhouse server %s: %s:%s",
+          what, settings['server'], code, err_message)
+      else
+        rspamd_logger.infox(params.task or params.config,
+          "sent %s rows of %s to clickhouse server %s",
+          nrows, what, settings['server'])
+      end
     end
-  end
-  if #urls_rows > 1 then
-    body = table.concat(urls_rows, ' ')
-    if not rspamd_http.request({
-      task = task,
+
+    local req = {
       url = 'http://' .. settings['server'],
       body = body,
       callback = http_cb,
-      mime_type = 'text/plain',
+      mime_type = 'application/octet-stream',
       timeout = settings['timeout'],
-    }) then
-      rspamd_logger.errx(task, "cannot send urls to clickhouse server %s: cannot make request",
-        settings['server'])
+    }
+    for k,v in pairs(params) do
+      req[k] = v
     end
-  end
-  if #asn_rows > 1 then
-    body = table.concat(asn_rows, ' ')
-    if not rspamd_http.request({
-      task = task,
-      url = 'http://' .. settings['server'],
-      body = body,
-      callback = http_cb,
-      mime_type = 'text/plain',
-      timeout = settings['timeout'],
-    }) then
-      rspamd_logger.errx(task, "cannot send asn info to clickhouse server %s: cannot make request",
-        settings['server'])
+    if settings['use_gzip'] then
+      req['headers'] = {['Content-Encoding'] = 'gzip'}
     end
-  end
 
-  for k,specific in pairs(specific_rows) do
-    if #specific > 1 then
-      body = table.concat(specific, ' ')
-      if not rspamd_http.request({
-        task = task,
-        url = 'http://' .. settings['server'],
-        body = body,
-        callback = http_cb,
-        mime_type = 'text/plain',
-        timeout = settings['timeout'],
-      }) then
-        rspamd_logger.errx(task, "cannot send data for domain %s to clickhouse server %s: cannot make request",
-          k, settings['server'])
-      end
+    if not rspamd_http.request(req) then
+      rspamd_logger.errx(params.task or params.config,
+        "cannot send %s to clickhouse server %s: cannot make request",
+        what, settings['server'])
     end
   end
+
+  send_block(main_block, 'data')
+  if attachments_block then
+    send_block(attachments_block, 'attachments')
+  end
+  if urls_block then
+    send_block(urls_block, 'urls')
+  end
+  if asn_block then
+    send_block(asn_block, 'asn info')
+  end
+  for k,block in pairs(specific_blocks) do
+    send_block(block, 'data for domain ' .. k)
+  end
 end
 
-local function clickhouse_quote(str)
+local function clickhouse_lower(str)
   if str then
-    return str:gsub('[\'\\]', '\\%1'):lower()
+    return str:lower()
   else
     return ''
   end
@@ -432,15 +396,18 @@ local function clickhouse_collect(task)
     gmt = false
   })
 
-  local elt = string.format("(today(),%d,'%s','%s','%s',%.2f,%d,%d,'%s','%s','%s','%s','%s','%s',%d,'%s','%s','%s','%s','%s','%s','%s')",
-        timestamp,
-        clickhouse_quote(from_domain), clickhouse_quote(mime_domain), ip_str, score,
-        nrcpts, task:get_size(), whitelist, bayes, fuzzy, fann,
-        dkim, dmarc, nurls, task:get_metric_action('default'),
-        clickhouse_quote(from_user), clickhouse_quote(mime_user),
-        clickhouse_quote(rcpt_user), clickhouse_quote(rcpt_domain),
-        clickhouse_quote(list_id), task:get_digest())
-  table.insert(rows, elt)
+  local now = os.time()
+  local digest = task:get_digest()
+  local row = {
+    now, timestamp,
+    clickhouse_lower(from_domain), clickhouse_lower(mime_domain), ip_str, score,
+    nrcpts, task:get_size(), whitelist, bayes, fuzzy, fann,
+    dkim, dmarc, nurls, task:get_metric_action('default'),
+    clickhouse_lower(from_user), clickhouse_lower(mime_user),
+    clickhouse_lower(rcpt_user), clickhouse_lower(rcpt_domain),
+    clickhouse_lower(list_id), digest
+  }
+  main_block:add_row(row)
 
   if settings['from_map'] and dkim == 'allow' then
     -- Use dkim
@@ -449,11 +416,11 @@ local function clickhouse_collect(task)
       for _,dkim_domain in ipairs(das[1]['options']) do
         local specific = settings.from_map:get_key(dkim_domain)
         if specific then
-          if not specific_rows[specific] then
-            local first = clickhouse_main_row(specific)
-            specific_rows[specific] = {first}
+          if not specific_blocks[specific] then
+            specific_blocks[specific] = rspamd_clickhouse.create(specific,
+              main_columns)
           end
-          table.insert(specific_rows[specific], elt)
+          specific_blocks[specific]:add_row(row)
         end
       end
     end
@@ -469,23 +436,23 @@ local function clickhouse_collect(task)
     local fname = part:get_filename()
 
     if fname then
-      table.insert(attachments_fnames, string.format("'%s'", clickhouse_quote(fname)))
+      table.insert(attachments_fnames, clickhouse_lower(fname))
       local type, subtype = part:get_type()
-      table.insert(attachments_ctypes, string.format("'%s/%s'",
-        clickhouse_quote(type), clickhouse_quote(subtype)))
-      table.insert(attachments_lengths, string.format("%s", tostring(part:get_length())))
-      table.insert(attachments_digests, string.format("'%s'", string.sub(part:get_digest(), 1, 16)))
+      table.insert(attachments_ctypes, string.format("%s/%s",
+        clickhouse_lower(type), clickhouse_lower(subtype)))
+      table.insert(attachments_lengths, part:get_length())
+      table.insert(attachments_digests, string.sub(part:get_digest(), 1, 16))
     end
   end
 
-  if #attachments_fnames > 0 then
-    elt = string.format("(today(),'%s',[%s],[%s],[%s],[%s])",
-      task:get_digest(),
-      table.concat(attachments_fnames, ','),
-      table.concat(attachments_ctypes, ','),
-      table.concat(attachments_lengths, ','),
-      table.concat(attachments_digests, ','))
-    table.insert(attachment_rows, elt)
+  if attachments_block and #attachments_fnames > 0 then
+    attachments_block:add_row({
+      now, digest,
+      attachments_fnames,
+      attachments_ctypes,
+      attachments_lengths,
+      attachments_digests,
+    })
   end
 
   -- Urls step
@@ -493,27 +460,21 @@ local function clickhouse_collect(task)
   local urls_urls = {}
   if task:has_urls(false) then
     for _,u in ipairs(task:get_urls()) do
-      table.insert(urls_tlds, string.format("'%s'", clickhouse_quote(u:get_tld())))
+      table.insert(urls_tlds, clickhouse_lower(u:get_tld()))
       if settings['full_urls'] then
-        table.insert(urls_urls, string.format("'%s'",
-          clickhouse_quote(u:get_text())))
+        table.insert(urls_urls, clickhouse_lower(u:get_text()))
       else
-        table.insert(urls_urls, string.format("'%s'",
-          clickhouse_quote(u:get_host())))
+        table.insert(urls_urls, clickhouse_lower(u:get_host()))
       end
     end
   end
 
-  if #urls_tlds > 0 then
-    elt = string.format("(today(),'%s',[%s],[%s])",
-      task:get_digest(),
-      table.concat(urls_tlds, ','),
-      table.concat(urls_urls, ','))
-    table.insert(urls_rows, elt)
+  if urls_block and #urls_tlds > 0 then
+    urls_block:add_row({now, digest, urls_tlds, urls_urls})
   end
 
   -- ASN information
-  if settings['asn_table'] then
+  if asn_block then
     local asn, country, ipnet = 'unknown', 'unknown', 'unknown'
     local pool = task:get_mempool()
     ret = pool:get_variable("asn")
@@ -528,23 +489,13 @@ local function clickhouse_collect(task)
     if ret then
       ipnet = ret
     end
-    elt = string.format("(today(),'%s','%s','%s','%s')",
-      task:get_digest(),
-      clickhouse_quote(asn), clickhouse_quote(country), clickhouse_quote(ipnet))
-    table.insert(asn_rows, elt)
+    asn_block:add_row({now, digest, clickhouse_lower(asn),
+      clickhouse_lower(country), clickhouse_lower(ipnet)})
   end
 
-  nrows = nrows + 1
-
-  if nrows > settings['limit'] then
-    clickhouse_send_data(task)
-    nrows = 0
-    rows = {}
-    attachment_rows = {}
-    urls_rows = {}
-    specific_rows = {}
-    asn_rows = {}
-    clickhouse_first_row()
+  -- Rows are normally sent from the periodic timer
+  if main_block:rows() >= settings['limit'] then
+    clickhouse_send_data({task = task})
   end
 end
 
@@ -559,7 +510,7 @@ if opts then
     else
       settings['from_map'] = rspamd_map_add('clickhouse', 'from_tables',
         'regexp', 'clickhouse specific domains')
-      clickhouse_first_row()
+      clickhouse_create_blocks()
       rspamd_config:register_symbol({
         name = 'CLICKHOUSE_COLLECT',
         type = 'postfilter',
@@ -567,9 +518,17 @@ if opts then
         priority = 10
       })
       rspamd_config:register_finish_script(function(task)
-        if nrows > 0 then
-          clickhouse_send_data(task)
-        end
+        clickhouse_send_data({task = task})
       end)
+      if settings['flush_interval'] > 0 then
+        rspamd_config:add_on_load(function(cfg, ev_base, worker)
+          if worker:get_name() ~= 'normal' then return end
+          rspamd_config:add_periodic(ev_base, settings['flush_interval'],
+            function()
+              clickhouse_send_data({ev_base = ev_base, config = cfg})
+              return true
+            end, true)
+        end)
+      end
     end
 end
@@ -38,6 +38,8 @@ local data = {
 local fann_file
 local max_trains = 1000
 local max_epoch = 100
+-- Number of samples trained at once in a background thread
+local train_batch = 64
 local use_settings = false
 
 local function symbols_to_fann_vector(syms, scores)
@@ -197,9 +199,38 @@ local function create_train_fann(n, id)
   data[id].fann_train = rspamd_fann.create(5, n, n, n / 2, n / 4, 1)
   data[id].ntrains = 0
   data[id].epoch = 0
+  data[id].pending_inputs = {}
+  data[id].pending_outputs = {}
 end
 
-local function fann_train_callback(score, required_score, results, cf, id, opts, extra)
+local function train_fann_batch(cf, id, ev_base)
+  local ann = data[id].fann_train
+  local inputs, outputs = data[id].pending_inputs, data[id].pending_outputs
+
+  data[id].pending_inputs = {}
+  data[id].pending_outputs = {}
+  data[id].training = true
+
+  local function batch_trained(errcode, errmsg)
+    data[id].training = false
+
+    if data[id].fann_train ~= ann then
+      -- Network has been recreated meanwhile
+      return
+    end
+
+    if errcode ~= 0 then
+      rspamd_logger.errx(cf, 'cannot train fann %s: %s', id, errmsg)
+    else
+      data[id].ntrains = data[id].ntrains + #inputs
+    end
+  end
+
+  ann:train_threaded(inputs, outputs, batch_trained, ev_base,
+    {max_epochs = 1})
+end
+
+local function fann_train_callback(score, required_score, results, cf, id, opts, extra, ev_base)
   local n = cf:get_symbols_count() + rspamd_count_metatokens()
   local fname = gen_fann_file(id)
 
@@ -213,7 +244,7 @@ local function fann_train_callback(score, required_score, results, cf, id, opts,
     create_train_fann(n, id)
   end
 
-  if data[id].ntrains > max_trains then
+  if data[id].ntrains > max_trains and not data[id].training then
     -- Store fann on disk
     local res = false
 
@@ -255,7 +286,7 @@ local function fann_train_callback(score, required_score, results, cf, id, opts,
     end
   end
 
-  if data[id].epoch > max_epoch then
+  if data[id].epoch > max_epoch and not data[id].training then
     -- Re-create fann
     rspamd_logger.infox(cf, 'create new fann in %s after %s epoches', fname,
       max_epoch)
@@ -282,13 +313,23 @@ local function fann_train_callback(score, required_score, results, cf, id, opts,
     -- Add filtered meta tokens
     fun.each(function(e) table.insert(learn_data, e) end, extra)
 
-    if learn_spam then
-      data[id].fann_train:train(learn_data, {1.0})
+    if ev_base then
+      -- Do not block log helper with training
+      table.insert(data[id].pending_inputs, learn_data)
+      table.insert(data[id].pending_outputs, {learn_spam and 1.0 or -1.0})
+
+      if #data[id].pending_inputs >= train_batch and not data[id].training then
+        train_fann_batch(cf, id, ev_base)
+      end
     else
-      data[id].fann_train:train(learn_data, {-1.0})
-    end
+      if learn_spam then
+        data[id].fann_train:train(learn_data, {1.0})
+      else
+        data[id].fann_train:train(learn_data, {-1.0})
+      end
 
-    data[id].ntrains = data[id].ntrains + 1
+      data[id].ntrains = data[id].ntrains + 1
+    end
   end
 end
 
@@ -343,17 +384,20 @@ else
         if opts['train']['max_epoch'] then
           max_epoch = opts['train']['max_epoch']
         end
+        if opts['train']['batch'] then
+          train_batch = opts['train']['batch']
+        end
         local ret = cfg:register_worker_script("log_helper",
-          function(score, req_score, results, cf, _id, extra)
+          function(score, req_score, results, cf, _id, extra, ev_base)
             -- map (snd x) (filter (fst x == module_id) extra)
             local extra_fann = fun.map(function(e) return e[2] end,
               fun.filter(function(e) return e[1] == module_log_id end, extra))
             if use_settings then
               fann_train_callback(score, req_score, results, cf,
-                tostring(_id), opts['train'], extra_fann)
+                tostring(_id), opts['train'], extra_fann, ev_base)
             else
               fann_train_callback(score, req_score, results, cf, '0',
-                opts['train'], extra_fann)
+                opts['train'], extra_fann, ev_base)
             end
         end)
 
@@ -20,32 +20,14 @@ limitations under the License.
 local E = {}
 local N = 'force_actions'
 
-local fun = require "fun"
 local rspamd_cryptobox_hash = require "rspamd_cryptobox_hash"
 local rspamd_expression = require "rspamd_expression"
 local rspamd_logger = require "rspamd_logger"
 
 local function gen_cb(expr, act, pool, message, subject, raction, honor)
 
-  local function parse_atom(str)
-    local atom = table.concat(fun.totable(fun.take_while(function(c)
-      if string.find(', \t()><+!|&\n', c) then
-        return false
-      end
-      return true
-    end, fun.iter(str))), '')
-    return atom
-  end
-
-  local function process_atom(atom, task)
-    local f_ret = task:has_symbol(atom)
-    if f_ret then
-      return 1
-    end
-    return 0
-  end
-
-  local e, err = rspamd_expression.create(expr, {parse_atom, process_atom}, pool)
+  -- Atoms are symbols checked natively
+  local e, err = rspamd_expression.create(expr, {}, pool)
   if err then
     rspamd_logger.errx(rspamd_config, 'Couldnt create expression [%1]: %2', expr, err)
     return
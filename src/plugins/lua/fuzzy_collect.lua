@@ -25,8 +25,20 @@ local settings = {
   sync_time = 60.0,
   saved_cookie = '',
   timeout = 10.0,
+  max_updates = 0, -- updates per chunk, 0 means all pending updates
 }
 
+local function remaining_updates(hdrs)
+  if not hdrs then return 0 end
+  for k,v in pairs(hdrs) do
+    if k:lower() == 'remaining' then
+      return tonumber(v) or 0
+    end
+  end
+
+  return 0
+end
+
 local function send_data_mirror(m, cfg, ev_base, body)
   local function store_callback(err, _, _, _)
     if err then
@@ -49,13 +61,21 @@ local function send_data_mirror(m, cfg, ev_base, body)
 end
 
 local function collect_fuzzy_hashes(cfg, ev_base)
-  local function data_callback(err, _, body, _)
+  local fetch_cookie
+
+  local function data_callback(err, _, body, hdrs)
     if not body or err then
       rspamd_logger.errx(cfg, 'cannot load data: %s', err)
     else
       -- Here, we actually copy body once for each mirror
       fun.each(function(_, v) send_data_mirror(v, cfg, ev_base, body) end,
         settings.mirrors)
+      local remaining = remaining_updates(hdrs)
+      if remaining > 0 then
+        -- Each chunk is signed with its own cookie
+        rspamd_logger.infox(cfg, 'fetch next chunk, %s updates left', remaining)
+        fetch_cookie()
+      end
     end
   end
 
@@ -72,6 +92,12 @@ local function collect_fuzzy_hashes(cfg, ev_base)
         if not sig then
           rspamd_logger.info(cfg, 'cannot sign cookie')
         else
+          local hdrs = {
+            Signature = sig:hex()
+          }
+          if settings.max_updates > 0 then
+            hdrs.Limit = tostring(settings.max_updates)
+          end
           rspamd_http.request{
             url = string.format('http://%s/data', settings.collect_server),
             resolver = cfg:get_resolver(),
@@ -80,9 +106,7 @@ local function collect_fuzzy_hashes(cfg, ev_base)
             timeout = settings.timeout,
             callback = data_callback,
             peer_key = settings.collect_pubkey,
-            headers = {
-              Signature = sig:hex()
-            },
+            headers = hdrs,
             opaque_body = true,
           }
         end
@@ -91,17 +115,20 @@ local function collect_fuzzy_hashes(cfg, ev_base)
       end
     end
   end
+  fetch_cookie = function()
+    rspamd_http.request{
+      url = string.format('http://%s/cookie', settings.collect_server),
+      resolver = cfg:get_resolver(),
+      config = cfg,
+      ev_base = ev_base,
+      timeout = settings.timeout,
+      callback = cookie_callback,
+      peer_key = settings.collect_pubkey,
+    }
+  end
   rspamd_logger.infox(cfg, 'start fuzzy collection, next sync in %s seconds',
     settings.sync_time)
-  rspamd_http.request{
-    url = string.format('http://%s/cookie', settings.collect_server),
-    resolver = cfg:get_resolver(),
-    config = cfg,
-    ev_base = ev_base,
-    timeout = settings.timeout,
-    callback = cookie_callback,
-    peer_key = settings.collect_pubkey,
-  }
+  fetch_cookie()
 
   return settings.sync_time
 end
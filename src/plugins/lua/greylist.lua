@@ -40,6 +40,7 @@ greylist {
 local redis_params
 local whitelisted_ip
 local whitelist_domains_map = nil
+local local_cache = nil
 local settings = {
   expire = 86400, -- 1 day by default
   timeout = 300, -- 5 minutes by default
@@ -50,12 +51,15 @@ local settings = {
   action = 'soft reject', -- default greylisted action
   ipv4_mask = 19, -- Mask bits for ipv4
   ipv6_mask = 64, -- Mask bits for ipv6
+  local_cache_size = 16384, -- records cached in shared memory of a host (0 to disable)
+  expire_refresh = 3600, -- how often a host refreshes expiration of a passed record
 }
 
 local rspamd_logger = require "rspamd_logger"
 local rspamd_util = require "rspamd_util"
 local fun = require "fun"
 local hash = require "rspamd_cryptobox_hash"
+local rspamd_shared_cache = require "rspamd_shared_cache"
 
 local function data_key(task)
   local cached = task:get_mempool():get_variable("grey_bodyhash")
@@ -143,6 +147,25 @@ local function check_time(task, tm, type)
   end
 end
 
+-- Records known locally hold the same first seen time as redis, so a record
+-- that has already passed the greylisting timeout needs no redis check
+local function check_local_cache(task, body_key, meta_key)
+  if not local_cache then return false end
+
+  local now = rspamd_util.get_time()
+
+  for _,k in ipairs({{body_key, 'body'}, {meta_key, 'meta'}}) do
+    local t = tonumber(local_cache:get(k[1]))
+    if t and now - t >= settings['timeout'] then
+      task:get_mempool():set_variable("grey_whitelisted", k[2])
+
+      return true
+    end
+  end
+
+  return false
+end
+
 local function greylist_check(task)
   local ip = task:get_ip()
 
@@ -162,6 +185,10 @@ local function greylist_check(task)
   local meta_key = envelope_key(task)
   local hash_key = body_key .. meta_key
 
+  if check_local_cache(task, body_key, meta_key) then
+    return
+  end
+
   local function redis_get_cb(err, data)
     local ret_body = false
     local greylisted_body = false
@@ -169,6 +196,13 @@ local function greylist_check(task)
     local greylisted_meta = false
 
     if data then
+      if local_cache then
+        for i,k in ipairs({body_key, meta_key}) do
+          if data[i] and type(data[i]) ~= 'userdata' then
+            local_cache:set(k, data[i])
+          end
+        end
+      end
       if data[1] and type(data[1]) ~= 'userdata' then
         ret_body,greylisted_body = check_time(task, data[1], 'body')
         if greylisted_body then
@@ -293,6 +327,12 @@ local function greylist_set(task)
     if err then
       rspamd_logger.errx(task, 'got error %s when setting greylisting record on server %s',
           err, upstream:get_addr())
+      if local_cache then
+        -- Do not trust records that are not stored in redis
+        local_cache:delete(body_key)
+        local_cache:delete(meta_key)
+        local_cache:delete('e' .. hash_key)
+      end
     end
   end
 
@@ -310,6 +350,11 @@ local function greylist_set(task)
       rspamd_util.time_to_string(rspamd_util.get_time() + settings['expire']))
 
     if not qid then return end
+    if local_cache then
+      -- Expiration of this record has been refreshed recently by this host
+      if local_cache:get('e' .. hash_key) then return end
+      local_cache:set('e' .. hash_key, '1', settings['expire_refresh'])
+    end
     ret,conn,upstream = rspamd_redis_make_request(task,
       redis_params, -- connect params
       hash_key, -- hash key
@@ -335,6 +380,10 @@ local function greylist_set(task)
     if not qid then return end
     task:set_pre_result(settings['action'], settings['message'])
     task:set_flag('greylisted')
+    if local_cache then
+      local_cache:set(body_key, t)
+      local_cache:set(meta_key, t)
+    end
     -- Create new record
     ret,conn,upstream = rspamd_redis_make_request(task,
       redis_params, -- connect params
@@ -403,6 +452,13 @@ if opts then
   if not redis_params then
     rspamd_logger.infox(rspamd_config, 'no servers are specified, disabling module')
   else
+    if settings['local_cache_size'] > 0 then
+      local_cache = rspamd_shared_cache.create(rspamd_config, 'greylist', {
+        max_items = settings['local_cache_size'],
+        max_value = 16,
+        ttl = settings['expire'],
+      })
+    end
     rspamd_config:register_symbol({
       name = 'GREYLIST_SAVE',
       type = 'postfilter',
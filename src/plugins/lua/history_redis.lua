@@ -20,14 +20,18 @@ local settings = {
   key_prefix = 'rs_history', -- default key name
   nrows = 2000, -- default rows limit
   compress = true, -- use zstd compression when storing data in redis
+  batch_size = 10, -- rows collected by a worker before writing them to redis
+  flush_interval = 5.0, -- write collected rows each 5 seconds (0 to disable)
 }
 
 local rspamd_logger = require "rspamd_logger"
 local rspamd_util = require "rspamd_util"
+local rspamd_redis = require "rspamd_redis"
 local fun = require "fun"
 local ucl = require("ucl")
 local E = {}
 local hostname = rspamd_util.get_hostname()
+local pending_rows = {}
 
 local function process_addr(addr)
   if addr then
@@ -73,21 +77,85 @@ local function normalise_results(tbl, task)
   tbl.user = task:get_user() or 'unknown'
 end
 
-local function history_save(task)
-  local function redis_llen_cb(err, _)
+local function history_prefix()
+  local prefix = settings.key_prefix .. hostname
+  if settings.compress then
+    -- Distinguish between compressed and non-compressed options
+    prefix = prefix .. '_zst'
+  end
+
+  return prefix
+end
+
+-- Writes collected rows using a single pipelined request
+-- params are either {task = task} or {ev_base = ev_base, config = cfg}
+local function history_flush(params)
+  if #pending_rows == 0 then
+    return
+  end
+
+  local log_obj = params.task or params.config
+  local rows = pending_rows
+  pending_rows = {}
+  local prefix = history_prefix()
+
+  local addr = redis_params['write_servers']:get_upstream_master_slave()
+  if not addr then
+    rspamd_logger.errx(log_obj, 'cannot select server to write history')
+    return
+  end
+
+  local function redis_lpush_cb(err, _)
     if err then
-      rspamd_logger.errx(task, 'got error %s when writing history row: %s',
-          err)
+      addr:fail()
+      rspamd_logger.errx(log_obj, 'got error %s when writing %s history rows',
+          err, #rows)
+    else
+      addr:ok()
     end
   end
 
+  local args = {prefix}
+  for _,r in ipairs(rows) do
+    table.insert(args, r)
+  end
+
+  local options = {
+    task = params.task,
+    ev_base = params.ev_base,
+    config = params.config,
+    callback = redis_lpush_cb,
+    host = addr:get_addr(),
+    timeout = redis_params['timeout'],
+    cmd = 'LPUSH',
+    args = args
+  }
+
+  if redis_params['password'] then
+    options['password'] = redis_params['password']
+  end
+
+  if redis_params['db'] then
+    options['dbname'] = redis_params['db']
+  end
+
+  local ret, conn = rspamd_redis.make_request(options)
+
+  if ret then
+    conn:add_cmd('LTRIM', {prefix, '0', string.format('%d', settings.nrows-1)})
+    conn:add_cmd('SADD', {settings.key_prefix, prefix})
+  else
+    rspamd_logger.errx(log_obj, 'cannot write %s history rows', #rows)
+  end
+end
+
+local function history_save(task)
   -- We skip saving it to the history
   if task:has_flag('no_log') then
     return
   end
 
   local data = task:get_protocol_reply{'metrics', 'basic'}
-  local prefix = settings.key_prefix .. hostname
 
   if data then
     normalise_results(data, task)
@@ -100,31 +168,17 @@ local function history_save(task)
 
   if settings.compress then
     json = rspamd_util.zstd_compress(json)
-    -- Distinguish between compressed and non-compressed options
-    prefix = prefix .. '_zst'
   end
 
-  local ret, conn, _ = rspamd_redis_make_request(task,
-    redis_params, -- connect params
-    nil, -- hash key
-    true, -- is write
-    redis_llen_cb, --callback
-    'LPUSH', -- command
-    {prefix, json} -- arguments
-  )
+  table.insert(pending_rows, json)
 
-  if ret then
-    conn:add_cmd('LTRIM', {prefix, '0', string.format('%d', settings.nrows-1)})
-    conn:add_cmd('SADD', {settings.key_prefix, prefix})
+  if #pending_rows >= settings.batch_size then
+    history_flush({task = task})
   end
 end
 
 local function handle_history_request(task, conn, from, to, reset)
-  local prefix = settings.key_prefix .. hostname
-  if settings.compress then
-    -- Distinguish between compressed and non-compressed options
-    prefix = prefix .. '_zst'
-  end
+  local prefix = history_prefix()
 
   if reset then
     local function redis_ltrim_cb(err, _)
@@ -197,6 +251,19 @@ if opts then
       callback = history_save,
       priority = 150
     })
+    rspamd_config:register_finish_script(function(task)
+      history_flush({task = task})
+    end)
+    if settings.flush_interval > 0 then
+      rspamd_config:add_on_load(function(cfg, ev_base, worker)
+        if worker:get_name() ~= 'normal' then return end
+        rspamd_config:add_periodic(ev_base, settings.flush_interval,
+          function()
+            history_flush({ev_base = ev_base, config = cfg})
+            return true
+          end, true)
+      end)
+    end
     rspamd_plugins['history'] = {
       handler = handle_history_request
     }
@@ -23,6 +23,7 @@ local util = require "rspamd_util"
 local regexp = require "rspamd_regexp"
 local rspamd_expression = require "rspamd_expression"
 local rspamd_ip = require "rspamd_ip"
+local rspamd_multimap = require "rspamd_multimap"
 local redis_params
 local fun = require "fun"
 local N = 'multimap'
@@ -345,6 +346,100 @@ local multimap_filters = {
 
 local multimap_grammar
 
+-- Parse result in form: <symbol>:<score>|<symbol>|<score>
+local function parse_ret(task, parse_rule, p_ret)
+  if p_ret and type(p_ret) == 'string' then
+    local lpeg = require "lpeg"
+
+    if not multimap_grammar then
+    local number = {}
+
+      local digit = lpeg.R("09")
+      number.integer =
+      (lpeg.S("+-") ^ -1) *
+              (digit   ^  1)
+
+      -- Matches: .6, .899, .9999873
+      number.fractional =
+      (lpeg.P(".")   ) *
+              (digit ^ 1)
+
+      -- Matches: 55.97, -90.8, .9
+      number.decimal =
+      (number.integer *              -- Integer
+              (number.fractional ^ -1)) +    -- Fractional
+              (lpeg.S("+-") * number.fractional)  -- Completely fractional number
+
+      local sym_start = lpeg.R("az", "AZ") + lpeg.S("_")
+      local sym_elt = sym_start + lpeg.R("09")
+      local symbol = sym_start * sym_elt ^0
+      local symbol_cap = lpeg.Cg(symbol, 'symbol')
+      local score_cap = lpeg.Cg(number.decimal, 'score')
+      local symscore_cap = (symbol_cap * lpeg.P(":") * score_cap)
+      local grammar = symscore_cap + symbol_cap + score_cap
+      multimap_grammar = lpeg.Ct(grammar)
+    end
+    local tbl = multimap_grammar:match(p_ret)
+
+    if tbl then
+      local sym
+      local score = 1.0
+
+      if tbl['symbol'] then
+        sym = tbl['symbol']
+      end
+      if tbl['score'] then
+        score = tbl['score']
+      end
+
+      return true,sym,score
+    else
+      if p_ret ~= '' then
+        rspamd_logger.infox(task, '%s: cannot parse string "%s"',
+          parse_rule.symbol, p_ret)
+      end
+
+      return true,nil,1.0
+    end
+  elseif type(p_ret) == 'boolean' then
+    return p_ret,nil,0.0
+  end
+
+  return false,nil,0.0
+end
+
+-- Insert result of a map match, opt is the matched value (if any)
+local function insert_map_result(task, r, opt, result)
+  local _,symbol,score = parse_ret(task, r, result)
+  if symbol and r['symbols_set'] then
+    if not r['symbols_set'][symbol] then
+      rspamd_logger.infox(task, 'symbol %s is not registered for map %s, ' ..
+        'replace it with just %s',
+        symbol, r['symbol'], r['symbol'])
+      symbol = r['symbol']
+    end
+  else
+    symbol = r['symbol']
+  end
+
+  if opt then
+    task:insert_result(symbol, score, opt)
+  else
+    task:insert_result(symbol, score)
+  end
+
+  if r['prefilter'] then
+    if r['message_func'] then
+      r['message'] = r.message_func(task, r['symbol'], opt)
+    end
+    if r['message'] then
+      task:set_pre_result(r['action'], r['message'])
+    else
+      task:set_pre_result(r['action'], 'Matched map: ' .. r['symbol'])
+    end
+  end
+end
+
 local function multimap_callback(task, rule)
   local pre_filter = rule['prefilter']
 
@@ -394,101 +489,12 @@ local function multimap_callback(task, rule)
     return ret
   end
 
-  -- Parse result in form: <symbol>:<score>|<symbol>|<score>
-  local function parse_ret(parse_rule, p_ret)
-    if p_ret and type(p_ret) == 'string' then
-      local lpeg = require "lpeg"
-
-      if not multimap_grammar then
-      local number = {}
-
-        local digit = lpeg.R("09")
-        number.integer =
-        (lpeg.S("+-") ^ -1) *
-                (digit   ^  1)
-
-        -- Matches: .6, .899, .9999873
-        number.fractional =
-        (lpeg.P(".")   ) *
-                (digit ^ 1)
-
-        -- Matches: 55.97, -90.8, .9
-        number.decimal =
-        (number.integer *              -- Integer
-                (number.fractional ^ -1)) +    -- Fractional
-                (lpeg.S("+-") * number.fractional)  -- Completely fractional number
-
-        local sym_start = lpeg.R("az", "AZ") + lpeg.S("_")
-        local sym_elt = sym_start + lpeg.R("09")
-        local symbol = sym_start * sym_elt ^0
-        local symbol_cap = lpeg.Cg(symbol, 'symbol')
-        local score_cap = lpeg.Cg(number.decimal, 'score')
-        local symscore_cap = (symbol_cap * lpeg.P(":") * score_cap)
-        local grammar = symscore_cap + symbol_cap + score_cap
-        multimap_grammar = lpeg.Ct(grammar)
-      end
-      local tbl = multimap_grammar:match(p_ret)
-
-      if tbl then
-        local sym
-        local score = 1.0
-
-        if tbl['symbol'] then
-          sym = tbl['symbol']
-        end
-        if tbl['score'] then
-          score = tbl['score']
-        end
-
-        return true,sym,score
-      else
-        if p_ret ~= '' then
-          rspamd_logger.infox(task, '%s: cannot parse string "%s"',
-            parse_rule.symbol, p_ret)
-        end
-
-        return true,nil,1.0
-      end
-    elseif type(p_ret) == 'boolean' then
-      return p_ret,nil,0.0
-    end
-
-    return false,nil,0.0
-  end
-
   -- Match a single value for against a single rule
   local function match_rule(r, value)
     local function rule_callback(result)
       if result then
-        local _,symbol,score = parse_ret(r, result)
-        if symbol and r['symbols_set'] then
-          if not r['symbols_set'][symbol] then
-            rspamd_logger.infox(task, 'symbol %s is not registered for map %s, ' ..
-              'replace it with just %s',
-              symbol, r['symbol'], r['symbol'])
-            symbol = r['symbol']
-          end
-        else
-          symbol = r['symbol']
-        end
-
-        local opt = value_types[r['type']].get_value(value)
-        if opt then
-          task:insert_result(symbol, score, opt)
-        else
-          task:insert_result(symbol, score)
-        end
-
-        if pre_filter then
-          if r['message_func'] then
-            r['message'] = r.message_func(task, r['symbol'], opt)
-          end
-          if r['message'] then
-            task:set_pre_result(r['action'], r['message'])
-          else
-            task:set_pre_result(r['action'], 'Matched map: ' .. r['symbol'])
-          end
-        end
+        insert_map_result(task, r, value_types[r['type']].get_value(value),
+          result)
       end
     end
 
@@ -743,6 +749,47 @@ local function gen_multimap_callback(rule)
   end
 end
 
+-- Rules that could be checked by the native engine: plain lookups in local
+-- maps with no filters and conditions
+local native_types = {
+  ip = true, from = true, rcpt = true, helo = true, hostname = true,
+  url = true, header = true, asn = true, country = true, mempool = true,
+}
+
+local function add_native_rule(engine, native_rules, rule)
+  if rule['prefilter'] or rule['filter'] or rule['expression'] or
+      not native_types[rule['type']] then
+    return false
+  end
+
+  local map = rule['radix'] or rule['hash']
+  if not map then
+    return false
+  end
+
+  local id = engine:add_rule(rule['type'], map,
+    rule['header'] or rule['variable'])
+  if not id then
+    return false
+  end
+
+  native_rules[id] = rule
+  rule['native'] = true
+
+  return true
+end
+
+local function gen_native_callback(engine, native_rules)
+  return function(task)
+    for _,m in ipairs(engine:process(task)) do
+      local r = native_rules[m.rule]
+      if r then
+        insert_map_result(task, r, m.value, m.result)
+      end
+    end
+  end
+end
+
 local function add_multimap_rule(key, newrule)
   local ret = false
   if newrule['message_func'] then
@@ -915,32 +962,9 @@ local function add_multimap_rule(key, newrule)
 
   if ret then
     if newrule['require_symbols'] and not newrule['prefilter'] then
-      local atoms = {}
-
-      local function parse_atom(str)
-        local atom = table.concat(fun.totable(fun.take_while(function(c)
-          if string.find(', \t()><+!|&\n', c) then
-            return false
-          end
-          return true
-        end, fun.iter(str))), '')
-        table.insert(atoms, atom)
-        return atom
-      end
-
-      local function process_atom(atom, task)
-        local f_ret = task:has_symbol(atom)
-        rspamd_logger.debugm(N, rspamd_config, 'check for symbol %s: %s', atom, f_ret)
-
-        if f_ret then
-          return 1
-        end
-
-        return 0
-      end
-
+      -- Atoms are symbols checked natively
       local expression = rspamd_expression.create(newrule['require_symbols'],
-        {parse_atom, process_atom}, rspamd_config:get_mempool())
+        {}, rspamd_config:get_mempool())
       if expression then
         newrule['expression'] = expression
 
@@ -948,7 +972,7 @@ local function add_multimap_rule(key, newrule)
           rspamd_logger.debugm(N, rspamd_config, 'add dependency %s -> %s',
             newrule['symbol'], v)
           rspamd_config:register_dependency(newrule['symbol'], v)
-        end, atoms)
+        end, expression:atoms())
       end
     end
     return newrule
@@ -971,13 +995,39 @@ if opts and type(opts) == 'table' then
       end
     end
   end
-  -- add fake symbol to check all maps inside a single callback
+  -- simple rules are grouped by selector and checked all together
+  local engine = rspamd_multimap.create()
+  local native_rules = {}
+  local native_id
   fun.each(function(rule)
-    local id = rspamd_config:register_symbol({
-      type = 'normal',
-      name = rule['symbol'],
-      callback = gen_multimap_callback(rule),
+    add_native_rule(engine, native_rules, rule)
+  end, rules)
+
+  if next(native_rules) then
+    native_id = rspamd_config:register_symbol({
+      type = 'callback',
+      name = 'MULTIMAP_NATIVE_CALLBACK',
+      callback = gen_native_callback(engine, native_rules),
     })
+  end
+
+  -- add fake symbol to check all maps inside a single callback
+  fun.each(function(rule)
+    local id
+    if rule['native'] then
+      id = native_id
+      rspamd_config:register_symbol({
+        type = 'virtual',
+        name = rule['symbol'],
+        parent = id,
+      })
+    else
+      id = rspamd_config:register_symbol({
+        type = 'normal',
+        name = rule['symbol'],
+        callback = gen_multimap_callback(rule),
+      })
+    end
     if rule['symbols'] then
       -- Find allowed symbols by this map
       rule['symbols_set'] = {}
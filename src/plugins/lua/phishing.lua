@@ -30,10 +30,12 @@ local phishtank_map = 'http://data.phishtank.com/data/online-valid.json'
 local openphish_premium = false
 local openphish_hash
 local phishtank_hash
-local openphish_data = {}
-local phishtank_data = {}
 local rspamd_logger = require "rspamd_logger"
+local rspamd_url = require "rspamd_url"
 local util = require "rspamd_util"
+-- Feeds are stored in native indexes of urls grouped by registered domains
+local openphish_data = rspamd_url.create_index()
+local phishtank_data = rspamd_url.create_index()
 local opts = rspamd_config:get_all_opt(N)
 if not (opts and type(opts) == 'table') then
   rspamd_logger.infox(rspamd_config, 'Module is unconfigured')
@@ -42,68 +44,25 @@ end
 
 local function phishing_cb(task)
   local function check_phishing_map(map, url, phish_symbol)
-    local host = url:get_host()
-
-    if host then
-      local elt = map[host]
-      local found_path = false
-      local found_query = false
-      local data = nil
-
-      if elt then
-        local path = url:get_path()
-        local query = url:get_query()
-
-        if path then
-          for _,d in ipairs(elt) do
-            if d['path'] == path then
-              found_path = true
-              data = d['data']
-
-              if query and d['query'] and query == d['query'] then
-                found_query = true
-              elseif not d['query'] then
-                found_query = true
-              end
-            end
-          end
-        else
-          for _,d in ipairs(elt) do
-            if not d['path'] then
-              found_path = true
-              found_query = true
-              break
-            end
-          end
-        end
+    local res, data = map:check(url)
 
-        if found_path then
-          local args
-
-          if type(data) == 'table' then
-            args = {
-              data['tld'],
-              data['sector'],
-              data['brand'],
-            }
-          elseif type(data) == 'string' then
-            args = data
-          else
-            args = host
-          end
+    if res then
+      local host = url:get_host()
 
-          if found_query then
-            -- Query + path match
-            task:insert_result(phish_symbol, 1.0, args)
-          else
-            -- Host + path match
-            task:insert_result(phish_symbol, 0.3, args)
-          end
+      if res == 'host' then
+        if url:is_phished() then
+          -- Only host matches
+          task:insert_result(phish_symbol, 0.1, host)
+        end
+      else
+        local args = data or host
+
+        if res == 'query' then
+          -- Query + path match
+          task:insert_result(phish_symbol, 1.0, args)
         else
-          if url:is_phished() then
-            -- Only host matches
-            task:insert_result(phish_symbol, 0.1, host)
-          end
+          -- Host + path match
+          task:insert_result(phish_symbol, 0.3, args)
         end
       end
     end
@@ -247,42 +206,12 @@ local function rspamd_str_split_fun(s, sep, func)
   return p:match(s)
 end
 
-local function insert_url_from_string(pool, tbl, str, data)
-  local rspamd_url = require "rspamd_url"
-
-  local u = rspamd_url.create(pool, str)
-
-  if u then
-    local host = u:get_host()
-    if host then
-      local elt = {
-        data = data,
-        path = u:get_path(),
-        query = u:get_query()
-      }
-
-      if tbl[host] then
-        table.insert(tbl[host], elt)
-      else
-        tbl[host] = {elt}
-      end
-
-      return true
-    end
-  end
-
-  return false
-end
-
 local function openphish_json_cb(string)
   local ucl = require "ucl"
-  local rspamd_mempool = require "rspamd_mempool"
   local nelts = 0
-  local new_json_map = {}
+  local new_json_map = rspamd_url.create_index()
   local valid = true
 
-  local pool = rspamd_mempool.create()
-
   local function openphish_elt_parser(cap)
     if valid then
       local parser = ucl.parser()
@@ -294,7 +223,13 @@ local function openphish_json_cb(string)
         local obj = parser:get_object()
 
         if obj['url'] then
-          if insert_url_from_string(pool, new_json_map, obj['url'], obj) then
+          local args = {}
+          for _,k in ipairs({'tld', 'sector', 'brand'}) do
+            if obj[k] then
+              table.insert(args, tostring(obj[k]))
+            end
+          end
+          if new_json_map:add(obj['url'], args) then
             nelts = nelts + 1
           end
         end
@@ -309,18 +244,14 @@ local function openphish_json_cb(string)
     rspamd_logger.infox(openphish_hash, "parsed %s elements from openphish feed",
       nelts)
   end
-
-  pool:destroy()
 end
 
 local function openphish_plain_cb(string)
   local nelts = 0
-  local new_data = {}
-  local rspamd_mempool = require "rspamd_mempool"
-  local pool = rspamd_mempool.create()
+  local new_data = rspamd_url.create_index()
 
   local function openphish_elt_parser(cap)
-    if insert_url_from_string(pool, new_data, cap, nil) then
+    if new_data:add(cap) then
       nelts = nelts + 1
     end
   end
@@ -330,18 +261,15 @@ local function openphish_plain_cb(string)
   openphish_data = new_data
   rspamd_logger.infox(openphish_hash, "parsed %s elements from openphish feed",
     nelts)
-  pool:destroy()
 end
 
 local function phishtank_json_cb(string)
   local ucl = require "ucl"
   local nelts = 0
-  local new_data = {}
+  local new_data = rspamd_url.create_index()
   local valid = true
   local parser = ucl.parser()
   local res,err = parser:parse_string(string)
-  local rspamd_mempool = require "rspamd_mempool"
-  local pool = rspamd_mempool.create()
 
   if not res then
     valid = false
@@ -351,8 +279,7 @@ local function phishtank_json_cb(string)
 
     for _,elt in ipairs(obj) do
       if elt['url'] then
-        if insert_url_from_string(pool, new_data, elt['url'],
-          elt['phish_detail_url']) then
+        if new_data:add(elt['url'], elt['phish_detail_url']) then
           nelts = nelts + 1
         end
       end
@@ -364,9 +291,6 @@ local function phishtank_json_cb(string)
     rspamd_logger.infox(phishtank_hash, "parsed %s elements from phishtank feed",
       nelts)
   end
-
-
-  pool:destroy()
 end
 
 if opts then
@@ -37,6 +37,11 @@ local rl_prefix = 'rl'
 local ip_score_lower_bound = 10
 local ip_score_ham_multiplier = 1.1
 local ip_score_spam_divisor = 1.1
+-- Worker local buckets that are synced with redis periodically
+local local_buckets
+local sync_interval = 1.0
+local sync_batch = 1000
+local max_buckets = 65536
 
 local message_func = function(_, limit_type)
   return string.format('Ratelimit "%s" exceeded', limit_type)
@@ -212,6 +217,106 @@ local function dynamic_rate_key(task, rtype)
   end
 end
 
+--- Get ip_score values if they should be used to resize buckets
+local function get_ip_scores(task)
+  if not use_ip_score then return nil end
+
+  return {task:get_mempool():get_variable('ip_score',
+    'double,double,double,double,double,double,double,double')}
+end
+
+--- Resize bucket and rate according to the reputation of sender
+local function resize_by_ip_score(scores, rtype, bucket, rate)
+  local asn_score,total_asn,
+    country_score,total_country,
+    ipnet_score,total_ipnet,
+    ip_score, total_ip = scores[1], scores[2], scores[3], scores[4],
+      scores[5], scores[6], scores[7], scores[8]
+  local key_keywords = rspamd_str_split(rtype, '_')
+  local has_asn, has_ip = false, false
+  for _, v in ipairs(key_keywords) do
+    if v == "asn" then has_asn = true end
+    if v == "ip" then has_ip = true end
+    if has_ip and has_asn then break end
+  end
+  if has_asn and not has_ip then
+    bucket = resize_element(asn_score, total_asn, bucket)
+    rate = resize_element(asn_score, total_asn, rate)
+  elseif has_ip then
+    if total_ip and total_ip > ip_score_lower_bound then
+      bucket = resize_element(ip_score, total_ip, bucket)
+      rate = resize_element(ip_score, total_ip, rate)
+    elseif total_ipnet and total_ipnet > ip_score_lower_bound then
+      bucket = resize_element(ipnet_score, total_ipnet, bucket)
+      rate = resize_element(ipnet_score, total_ipnet, rate)
+    elseif total_asn and total_asn > ip_score_lower_bound then
+      bucket = resize_element(asn_score, total_asn, bucket)
+      rate = resize_element(asn_score, total_asn, rate)
+    elseif total_country and total_country > ip_score_lower_bound then
+      bucket = resize_element(country_score, total_country, bucket)
+      rate = resize_element(country_score, total_country, rate)
+    else
+      bucket = resize_element(ip_score, total_ip, bucket)
+      rate = resize_element(ip_score, total_ip, rate)
+    end
+  end
+
+  return bucket, rate
+end
+
+--- Insert symbol or set pre-result if bucket is filled
+local function check_bucket(task, rtype, bucket, threshold)
+  if bucket > 0 then
+    if ratelimit_symbol then
+      local mult = 2 * rspamd_util.tanh(bucket / (threshold * 2))
+
+      if mult > 0.5 then
+        task:insert_result(ratelimit_symbol, mult,
+          rtype .. ':' .. tostring(mult))
+      end
+    else
+      if bucket > threshold then
+        rspamd_logger.infox(task,
+          'ratelimit "%s" exceeded: %s elements with %s limit',
+          rtype, bucket, threshold)
+        task:set_pre_result('soft reject',
+          message_func(task, rtype, bucket, threshold))
+      end
+    end
+  end
+end
+
+--- Convert limits to the {key, burst, rate} buckets of rspamd_ratelimit
+local function local_buckets_args(args)
+  return fun.totable(fun.map(function(a)
+    return {a[2], a[1][1], a[1][2]}
+  end, args))
+end
+
+--- Check limits using worker local buckets
+local function check_limits_local(task, args)
+  local ntime = rspamd_util.get_time()
+  local scores = get_ip_scores(task)
+  local levels = local_buckets:check(local_buckets_args(args), ntime)
+
+  for i, a in ipairs(args) do
+    local bucket = levels[i]
+    local rtype = rspamd_str_split(a[2], ":")[2]
+
+    if scores then
+      -- Rate has been already applied to the local level
+      bucket = resize_by_ip_score(scores, rtype, bucket, a[1][2])
+    end
+
+    check_bucket(task, rtype, bucket, a[1][1])
+  end
+end
+
+--- Update limits using worker local buckets
+local function set_limits_local(_, args)
+  local_buckets:update(local_buckets_args(args), rspamd_util.get_time())
+end
+
 --- Check specific limit inside redis
 local function check_limits(task, args)
 
@@ -224,17 +329,7 @@ local function check_limits(task, args)
     end
     if not data then return end
     local ntime = rspamd_util.get_time()
-    local asn_score,total_asn,
-      country_score,total_country,
-      ipnet_score,total_ipnet,
-      ip_score, total_ip
-    if use_ip_score then
-      asn_score,total_asn,
-        country_score,total_country,
-        ipnet_score,total_ipnet,
-        ip_score, total_ip = task:get_mempool():get_variable('ip_score',
-        'double,double,double,double,double,double,double,double')
-    end
+    local scores = get_ip_scores(task)
 
     fun.each(function(elt, limit, rtype)
       local bucket = elt[2]
@@ -245,35 +340,8 @@ local function check_limits(task, args)
 
       if atime == 0 then return end
 
-      if use_ip_score then
-        local key_keywords = rspamd_str_split(rtype, '_')
-        local has_asn, has_ip = false, false
-        for _, v in ipairs(key_keywords) do
-          if v == "asn" then has_asn = true end
-          if v == "ip" then has_ip = true end
-          if has_ip and has_asn then break end
-        end
-        if has_asn and not has_ip then
-          bucket = resize_element(asn_score, total_asn, bucket)
-          rate = resize_element(asn_score, total_asn, rate)
-        elseif has_ip then
-          if total_ip and total_ip > ip_score_lower_bound then
-            bucket = resize_element(ip_score, total_ip, bucket)
-            rate = resize_element(ip_score, total_ip, rate)
-          elseif total_ipnet and total_ipnet > ip_score_lower_bound then
-            bucket = resize_element(ipnet_score, total_ipnet, bucket)
-            rate = resize_element(ipnet_score, total_ipnet, rate)
-          elseif total_asn and total_asn > ip_score_lower_bound then
-            bucket = resize_element(asn_score, total_asn, bucket)
-            rate = resize_element(asn_score, total_asn, rate)
-          elseif total_country and total_country > ip_score_lower_bound then
-            bucket = resize_element(country_score, total_country, bucket)
-            rate = resize_element(country_score, total_country, rate)
-          else
-            bucket = resize_element(ip_score, total_ip, bucket)
-            rate = resize_element(ip_score, total_ip, rate)
-          end
-        end
+      if scores then
+        bucket, rate = resize_by_ip_score(scores, rtype, bucket, rate)
       end
 
       if atime - ctime > max_delay then
@@ -281,24 +349,7 @@ local function check_limits(task, args)
           atime - ctime)
       else
         bucket = bucket - rate * (ntime - atime);
-        if bucket > 0 then
-          if ratelimit_symbol then
-            local mult = 2 * rspamd_util.tanh(bucket / (threshold * 2))
-
-            if mult > 0.5 then
-              task:insert_result(ratelimit_symbol, mult,
-                rtype .. ':' .. tostring(mult))
-            end
-          else
-            if bucket > threshold then
-              rspamd_logger.infox(task,
-                'ratelimit "%s" exceeded: %s elements with %s limit',
-                rtype, bucket, threshold)
-              task:set_pre_result('soft reject',
-                message_func(task, rtype, bucket, threshold))
-            end
-          end
-        end
+        check_bucket(task, rtype, bucket, threshold)
       end
     end, fun.zip(parse_limits(data), fun.map(function(a) return a[1] end, args),
       fun.map(function(a) return rspamd_str_split(a[2], ":")[2] end, args)))
@@ -463,14 +514,149 @@ end
 
 --- Check limit
 local function rate_test(task)
-  rate_test_set(task, check_limits)
+  if local_buckets then
+    rate_test_set(task, check_limits_local)
+  else
+    rate_test_set(task, check_limits)
+  end
 end
 --- Update limit
 local function rate_set(task)
   local action = task:get_metric_action('default')
 
   if action ~= 'soft reject' then
-    rate_test_set(task, set_limits)
+    if local_buckets then
+      rate_test_set(task, set_limits_local)
+    else
+      rate_test_set(task, set_limits)
+    end
+  end
+end
+
+-- Merges local increments to buckets in redis and returns their new levels
+local redis_sync_script = [[
+local now = tonumber(ARGV[1])
+local ttl = tonumber(ARGV[2])
+local res = {}
+for i, key in ipairs(KEYS) do
+  local delta = tonumber(ARGV[i * 2 + 1])
+  local rate = tonumber(ARGV[i * 2 + 2])
+  local bucket, ctime = 0, now
+  local cur = redis.call('GET', key)
+  if cur then
+    local a, b, c = string.match(cur, '^([^:]+):([^:]+):?([^:]*)')
+    local atime = tonumber(a) or now
+    bucket = tonumber(b) or 0
+    ctime = tonumber(c) or atime
+    if atime - ctime > ttl then
+      bucket = 0
+      ctime = now
+    else
+      bucket = bucket - rate * (now - atime)
+      if bucket < 0 then bucket = 0 end
+    end
+  end
+  if delta > 0 then
+    bucket = bucket + delta
+    redis.call('SETEX', key, ttl, string.format('%.3f:%.3f:%.3f', now, bucket, ctime))
+  end
+  res[i] = string.format('%.3f', bucket)
+end
+return res
+]]
+local redis_sync_sha
+
+--- Redis request that is not bound to any task
+local function redis_make_request_taskless(ev_base, addr, callback, command, args)
+  local rspamd_redis = require "rspamd_redis"
+  local options = {
+    ev_base = ev_base,
+    config = rspamd_config,
+    callback = callback,
+    host = addr:get_addr(),
+    timeout = redis_params['timeout'],
+    cmd = command,
+    args = args
+  }
+
+  if redis_params['password'] then
+    options['password'] = redis_params['password']
+  end
+
+  if redis_params['db'] then
+    options['dbname'] = redis_params['db']
+  end
+
+  return rspamd_redis.make_request(options)
+end
+
+--- Send local increments to redis in one script call per server
+local function sync_local_buckets(ev_base, final)
+  local pending = local_buckets:drain(not final and sync_batch or nil, final)
+  if #pending == 0 then return end
+
+  local groups = {}
+  for _, p in ipairs(pending) do
+    local addr = redis_params['write_servers']:get_upstream_by_hash(p[1])
+    if addr then
+      local ip = addr:get_addr()
+      local id = tostring(ip) .. ':' .. tostring(ip:get_port())
+      if not groups[id] then
+        groups[id] = {addr = addr, elts = {}}
+      end
+      table.insert(groups[id].elts, p)
+    else
+      local_buckets:reconcile(p[1], nil)
+    end
+  end
+
+  local ntime = rspamd_util.get_time()
+  for _, g in pairs(groups) do
+    local elts = g.elts
+    local args = {redis_sync_sha, tostring(#elts)}
+    for _, p in ipairs(elts) do
+      table.insert(args, p[1])
+    end
+    table.insert(args, string.format('%.3f', ntime))
+    table.insert(args, tostring(max_delay))
+    for _, p in ipairs(elts) do
+      table.insert(args, tostring(p[2]))
+      table.insert(args, tostring(p[3]))
+    end
+
+    local function redis_sync_cb(err, data)
+      if err and string.match(err, 'NOSCRIPT') and args[1] == redis_sync_sha then
+        -- Script is not cached on this server, send it as is
+        args[1] = redis_sync_script
+        if redis_make_request_taskless(ev_base, g.addr, redis_sync_cb,
+            'EVAL', args) then
+          return
+        end
+      end
+
+      if err or type(data) ~= 'table' then
+        if err then
+          g.addr:fail()
+          rspamd_logger.infox(rspamd_config,
+            'cannot sync %s ratelimit buckets: %s', #elts, err)
+        end
+        for _, p in ipairs(elts) do
+          local_buckets:reconcile(p[1], nil)
+        end
+      else
+        g.addr:ok()
+        for i, p in ipairs(elts) do
+          local_buckets:reconcile(p[1], tonumber(data[i]) or 0)
+        end
+      end
+    end
+
+    if not redis_make_request_taskless(ev_base, g.addr, redis_sync_cb,
+        'EVALSHA', args) then
+      for _, p in ipairs(elts) do
+        local_buckets:reconcile(p[1], nil)
+      end
+    end
   end
 end
 
@@ -631,6 +817,24 @@ if opts then
     max_rcpt = tonumber(opts['max_delay'])
   end
 
+  if opts['local_buckets'] then
+    local rspamd_ratelimit = require "rspamd_ratelimit"
+    local rspamd_cryptobox_hash = require "rspamd_cryptobox_hash"
+
+    if opts['sync_interval'] then
+      sync_interval = tonumber(opts['sync_interval'])
+    end
+    if opts['sync_batch'] then
+      sync_batch = tonumber(opts['sync_batch'])
+    end
+    if opts['max_buckets'] then
+      max_buckets = tonumber(opts['max_buckets'])
+    end
+    local_buckets = rspamd_ratelimit.create(max_buckets, max_delay)
+    redis_sync_sha = rspamd_cryptobox_hash.create_specific('sha1',
+      redis_sync_script):hex()
+  end
+
   if opts['use_ip_score'] then
     use_ip_score = true
     local ip_score_opts = rspamd_config:get_all_opt('ip_score')
@@ -660,6 +864,7 @@ if opts then
         name = 'RATELIMIT_CHECK',
         callback = rate_test,
         type = 'prefilter',
+        flags = 'envelope',
         priority = 4,
       })
     else
@@ -688,6 +893,19 @@ if opts then
         v['init']()
       end
     end
+    if local_buckets then
+      rspamd_config:add_on_load(function(_, ev_base, worker)
+        if worker:get_name() ~= 'normal' then return end
+        rspamd_config:add_periodic(ev_base, sync_interval, function()
+          sync_local_buckets(ev_base)
+          return true
+        end, true)
+      end)
+      rspamd_config:register_finish_script(function(task)
+        -- Do not lose increments made since the last sync
+        sync_local_buckets(task:get_ev_base(), true)
+      end)
+    end
   end
 end
 
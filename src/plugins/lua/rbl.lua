@@ -397,11 +397,19 @@ local function rbl_cb (task)
 
   local r = task:get_resolver()
   for _,p in pairs(params) do
+    -- Do not wait longer than the slowest of the lists needs
+    local timeout = 0
+    for _,rbl in ipairs(p.rbls) do
+      local tm = rbl.monitored:timeout()
+      if tm > timeout then timeout = tm end
+    end
+
     r:resolve_a({
       task = task,
       name = p.to_resolve,
       callback = p.callback,
-      forced = p.forced
+      forced = p.forced,
+      timeout = timeout
     })
   end
 end
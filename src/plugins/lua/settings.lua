@@ -638,6 +638,7 @@ end
 rspamd_config:register_symbol({
   name = 'SETTINGS_CHECK',
   type = 'prefilter',
+  flags = 'envelope',
   callback = check_settings,
   priority = 10
 })
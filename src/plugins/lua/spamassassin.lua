@@ -22,7 +22,7 @@ local N = 'spamassassin'
 
 local rspamd_logger = require "rspamd_logger"
 local rspamd_regexp = require "rspamd_regexp"
-local rspamd_expression = require "rspamd_expression"
+local rspamd_meta_rules = require "rspamd_meta_rules"
 local rspamd_trie = require "rspamd_trie"
 local util = require "rspamd_util"
 local fun = require "fun"
@@ -85,7 +85,6 @@ local symbols_replacements = {
 
 -- Internal variables
 local rules = {}
-local atoms = {}
 local scores = {}
 local scores_added = {}
 local external_deps = {}
@@ -161,6 +160,14 @@ if type(jit) == 'table' then
         int type,
         const char *type_data,
         int is_strong);
+    struct rspamd_lua_text {
+      const char *start;
+      unsigned int len;
+      unsigned int flags;
+    };
+    int rspamd_task_get_header_ffi (void *ptask, const char *name,
+        int strong, int raw, struct rspamd_lua_text *out);
+    int rspamd_task_has_symbol_ffi (void *ptask, const char *symbol);
 ]]
 end
 
@@ -182,6 +189,16 @@ local function process_regexp_opt(re, task, re_type, header, strong)
   end
 end
 
+local hdr_view = ffi and ffi.new('struct rspamd_lua_text[1]')
+
+local function has_header_opt(task, hdr)
+  if type(jit) == 'table' then
+    return ffi.C.rspamd_task_get_header_ffi(task, hdr, 0, 0, hdr_view) ~= 0
+  else
+    return task:get_header(hdr) ~= nil
+  end
+end
+
 local function is_pcre_only(name)
   if pcre_only_regexps[name] then
     return true
@@ -579,7 +596,7 @@ local function maybe_parse_sa_function(line)
         end
 
         for _,h in ipairs(hdrs_check) do
-          if task:get_header(h) then
+          if has_header_opt(task, h) then
             return 1
           end
         end
@@ -1151,45 +1168,8 @@ local function apply_replacements(str)
   return false,str
 end
 
-local function parse_atom(str)
-  local atom = table.concat(fun.totable(fun.take_while(function(c)
-    if string.find(', \t()><+!|&\n', c) then
-      return false
-    end
-    return true
-  end, fun.iter(str))), '')
-
-  return atom
-end
-
-local function process_atom(atom, task)
-  local atom_cb = atoms[atom]
-
-  if atom_cb then
-    local res = atom_cb(task)
-
-    if not res then
-      rspamd_logger.debugm(N, task, 'atom: %1, NULL result', atom)
-    elseif res > 0 then
-      rspamd_logger.debugm(N, task, 'atom: %1, result: %2', atom, res)
-    end
-    return res
-  else
-    -- This is likely external atom
-    local real_sym = atom
-    if symbols_replacements[atom] then
-      real_sym = symbols_replacements[atom]
-    end
-    if task:has_symbol(real_sym) then
-      rspamd_logger.debugm(N, task, 'external atom: %1, result: 1', real_sym)
-      return 1
-    end
-    rspamd_logger.debugm(N, task, 'external atom: %1, result: 0', real_sym)
-  end
-  return 0
-end
-
 local function post_process()
+  local meta_rules = rspamd_meta_rules.create(rspamd_config)
   -- Replace rule tags
   local ntags = {}
   local function rec_replace_tags(tag, tagv)
@@ -1246,41 +1226,48 @@ local function post_process()
     end
   end, scores)
 
-  -- Header rules
-  fun.each(function(k, r)
-    local f = function(task)
-
-      local raw = false
-      local check = {}
-      -- Cached path for ordinary expressions
-      if r['ordinary'] then
-        local h = r['header'][1]
-        local t = 'header'
+  local function maybe_add_sole_meta(k, r)
+    if r['score'] then
+      local real_score = r['score'] * calculate_score(k, r)
+      if math.abs(real_score) > meta_score_alpha then
+        add_sole_meta(k, r)
+      end
+    end
+  end
 
-        if h['raw'] then
-          t = 'rawheader'
-        end
+  local function check_re(k, r)
+    if not r['re'] then
+      rspamd_logger.errx(rspamd_config, 're is missing for rule %1', k)
+      return false
+    end
 
-        if not r['re'] then
-          rspamd_logger.errx(task, 're is missing for rule %1 (%2 header)', k,
-            h['header'])
-          return 0
-        end
+    return true
+  end
 
-        local ret = process_regexp_opt(r.re, task, t, h.header, h.strong)
+  -- Header rules
+  fun.each(function(k, r)
+    -- Cached path for ordinary expressions
+    if r['ordinary'] then
+      local h = r['header'][1]
+      local t = 'header'
 
-        if r['not'] then
-          if ret ~= 0 then
-            ret = 0
-          else
-            ret = 1
-          end
-        end
+      if h['raw'] then
+        t = 'rawheader'
+      end
 
-        return ret
+      if check_re(k, r) then
+        meta_rules:add_regexp(k, r.re, t, h.header, h.strong, r['not'])
       end
+      maybe_add_sole_meta(k, r)
+
+      return
+    end
+
+    -- Slow path
+    local f = function(task)
+      local raw = false
+      local check = {}
 
-      -- Slow path
       fun.each(function(h)
         local hname = h['header']
 
@@ -1347,13 +1334,8 @@ local function post_process()
 
       return ret
     end
-    if r['score'] then
-      local real_score = r['score'] * calculate_score(k, r)
-      if math.abs(real_score) > meta_score_alpha then
-        add_sole_meta(k, r)
-      end
-    end
-    atoms[k] = f
+    maybe_add_sole_meta(k, r)
+    meta_rules:add_function(k, f)
   end,
   fun.filter(function(_, r)
       return r['type'] == 'header' and r['header']
@@ -1362,20 +1344,8 @@ local function post_process()
 
   -- Custom function rules
   fun.each(function(k, r)
-    local f = function(task)
-      local res = r['function'](task)
-      if res and res > 0 then
-        return res
-      end
-      return 0
-    end
-    if r['score'] then
-      local real_score = r['score'] * calculate_score(k, r)
-      if math.abs(real_score) > meta_score_alpha then
-        add_sole_meta(k, r)
-      end
-    end
-    atoms[k] = f
+    maybe_add_sole_meta(k, r)
+    meta_rules:add_function(k, r['function'])
   end,
     fun.filter(function(_, r)
       return r['type'] == 'function' and r['function']
@@ -1384,24 +1354,13 @@ local function post_process()
 
   -- Parts rules
   fun.each(function(k, r)
-    local f = function(task)
-      if not r['re'] then
-        rspamd_logger.errx(task, 're is missing for rule %1', k)
-        return 0
-      end
+    local t = 'mime'
+    if r['raw'] then t = 'rawmime' end
 
-      local t = 'mime'
-      if r['raw'] then t = 'rawmime' end
-
-      return process_regexp_opt(r.re, task, t)
-    end
-    if r['score'] then
-      local real_score = r['score'] * calculate_score(k, r)
-      if math.abs(real_score) > meta_score_alpha then
-        add_sole_meta(k, r)
-      end
+    if check_re(k, r) then
+      meta_rules:add_regexp(k, r.re, t)
     end
-    atoms[k] = f
+    maybe_add_sole_meta(k, r)
   end,
   fun.filter(function(_, r)
       return r['type'] == 'part'
@@ -1409,24 +1368,10 @@ local function post_process()
 
   -- SA body rules
   fun.each(function(k, r)
-    local f = function(task)
-      if not r['re'] then
-        rspamd_logger.errx(task, 're is missing for rule %1', k)
-        return 0
-      end
-
-      local t = r['type']
-
-      local ret = process_regexp_opt(r.re, task, t)
-      return ret
-    end
-    if r['score'] then
-      local real_score = r['score'] * calculate_score(k, r)
-      if math.abs(real_score) > meta_score_alpha then
-        add_sole_meta(k, r)
-      end
+    if check_re(k, r) then
+      meta_rules:add_regexp(k, r.re, r['type'])
     end
-    atoms[k] = f
+    maybe_add_sole_meta(k, r)
   end,
   fun.filter(function(_, r)
       return r['type'] == 'sabody' or r['type'] == 'message' or r['type'] == 'sarawbody'
@@ -1434,53 +1379,26 @@ local function post_process()
 
   -- URL rules
   fun.each(function(k, r)
-    local f = function(task)
-      if not r['re'] then
-        rspamd_logger.errx(task, 're is missing for rule %1', k)
-        return 0
-      end
-
-      return process_regexp_opt(r.re, task, 'url')
-    end
-    if r['score'] then
-      local real_score = r['score'] * calculate_score(k, r)
-      if math.abs(real_score) > meta_score_alpha then
-        add_sole_meta(k, r)
-      end
+    if check_re(k, r) then
+      meta_rules:add_regexp(k, r.re, 'url')
     end
-    atoms[k] = f
+    maybe_add_sole_meta(k, r)
   end,
     fun.filter(function(_, r)
       return r['type'] == 'uri'
     end,
       rules))
-  -- Meta rules
-  fun.each(function(k, r)
-      local expression = nil
-      -- Meta function callback
-      local meta_cb = function(task)
-        local res = 0
-        local trace = {}
-        -- XXX: need to memoize result for better performance
-        local sym = task:has_symbol(k)
-        if not sym then
-          if expression then
-            res,trace = expression:process_traced(task)
-          end
-          if res > 0 then
-            -- Symbol should be one shot to make it working properly
-            task:insert_result(k, res, trace)
-          end
-        else
-          res = 1
-        end
 
-        return res
-      end
-      expression = rspamd_expression.create(r['meta'],
-        {parse_atom, process_atom}, rspamd_config:get_mempool())
-      if not expression then
-        rspamd_logger.errx(rspamd_config, 'Cannot parse expression ' .. r['meta'])
+  fun.each(function(atom, sym)
+    meta_rules:add_replacement(atom, sym)
+  end, symbols_replacements)
+
+  -- Meta rules are evaluated natively
+  fun.each(function(k, r)
+      local res, err = meta_rules:add_meta(k, r['meta'])
+      if not res then
+        rspamd_logger.errx(rspamd_config, 'Cannot parse expression %1: %2',
+          r['meta'], err)
       else
         if r['score'] then
           rspamd_config:set_metric_symbol({
@@ -1490,15 +1408,8 @@ local function post_process()
             one_shot = true })
           scores_added[k] = 1
         end
-        rspamd_config:register_symbol({
-          name = k,
-          weight = calculate_score(k, r),
-          callback = meta_cb
-        })
-        r['expression'] = expression
-        if not atoms[k] then
-          atoms[k] = meta_cb
-        end
+        meta_rules:register_symbol(k, calculate_score(k, r))
+        r['atoms'] = meta_rules:atoms(k)
       end
     end,
     fun.filter(function(_, r)
@@ -1509,11 +1420,9 @@ local function post_process()
   -- Check meta rules for foreign symbols and register dependencies
   -- First direct dependencies:
   fun.each(function(k, r)
-      if r['expression'] then
-        local expr_atoms = r['expression']:atoms()
-
-        for _,a in ipairs(expr_atoms) do
-          if not atoms[a] then
+      if r['atoms'] then
+        for _,a in ipairs(r['atoms']) do
+          if not meta_rules:has_rule(a) then
             local rspamd_symbol = replace_symbol(a)
             if not external_deps[k] then
               external_deps[k] = {}
@@ -1541,9 +1450,8 @@ local function post_process()
   repeat
   nchanges = 0
     fun.each(function(k, r)
-      if r['expression'] then
-        local expr_atoms = r['expression']:atoms()
-        for _,a in ipairs(expr_atoms) do
+      if r['atoms'] then
+        for _,a in ipairs(r['atoms']) do
           if type(external_deps[a]) == 'table' then
             for dep in pairs(external_deps[a]) do
               if not external_deps[k] then
@@ -0,0 +1,171 @@
+--[[
+Copyright (c) 2017, Vsevolod Stakhov <vsevolod@highsecure.ru>
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+]]--
+
+-- This module shares symbols execution profile (times, async ratio and
+-- frequencies) between nodes via Redis, so freshly started nodes could
+-- order symbols using statistics of the whole cluster
+
+local rspamd_logger = require "rspamd_logger"
+local rspamd_util = require "rspamd_util"
+local ucl = require "ucl"
+local redis_params
+
+local settings = {
+  key = 'rs_symbols_profile', -- hash where profiles of nodes are stored
+  interval = 600.0, -- how often profiles are exchanged
+  expire = 86400, -- expire of profiles of dead nodes
+}
+
+local hostname = rspamd_util.get_hostname()
+
+local function redis_make_request(ev_base, cfg, is_write, callback, command, args)
+  local rspamd_redis = require "rspamd_redis"
+  local addr
+
+  if is_write then
+    addr = redis_params['write_servers']:get_upstream_master_slave(settings.key)
+  else
+    addr = redis_params['read_servers']:get_upstream_round_robin(settings.key)
+  end
+
+  if not addr then
+    rspamd_logger.errx(cfg, 'cannot select server to make redis request')
+    return false
+  end
+
+  local options = {
+    ev_base = ev_base,
+    config = cfg,
+    callback = function(err, data)
+      if err then
+        addr:fail()
+      else
+        addr:ok()
+      end
+      callback(err, data)
+    end,
+    host = addr:get_addr(),
+    timeout = redis_params['timeout'],
+    cmd = command,
+    args = args
+  }
+
+  if redis_params['password'] then
+    options['password'] = redis_params['password']
+  end
+
+  if redis_params['db'] then
+    options['dbname'] = redis_params['db']
+  end
+
+  local ret = rspamd_redis.make_request(options)
+  return ret
+end
+
+-- Sum runs and average times and frequencies over nodes weighted by runs
+local function aggregate_profiles(data)
+  local res = {}
+  local parser = ucl.parser()
+
+  for i = 2,#data,2 do
+    local _,err = parser:parse_string(data[i])
+
+    if err then
+      rspamd_logger.errx(rspamd_config, 'cannot parse profile of %s: %s',
+        data[i - 1], err)
+    else
+      local obj = parser:get_object()
+
+      for sym,elt in pairs(obj) do
+        local runs = tonumber(elt.runs) or 0
+
+        if runs > 0 then
+          local cur = res[sym]
+          if not cur then
+            cur = {time = 0, runs = 0, async = 0, count = 0,
+                   frequency = {avg = 0, stddev = 0}}
+            res[sym] = cur
+          end
+
+          local total = cur.runs + runs
+          local freq = elt.frequency or {}
+          cur.time = (cur.time * cur.runs + (elt.time or 0) * runs) / total
+          cur.frequency.avg = (cur.frequency.avg * cur.runs +
+              (freq.avg or 0) * runs) / total
+          cur.frequency.stddev = (cur.frequency.stddev * cur.runs +
+              (freq.stddev or 0) * runs) / total
+          cur.runs = total
+          cur.async = cur.async + (tonumber(elt.async) or 0)
+          cur.count = cur.count + (tonumber(elt.count) or 0)
+        end
+      end
+    end
+  end
+
+  return res
+end
+
+local function exchange_profile(cfg, ev_base)
+  local function load_cb(err, data)
+    if err then
+      rspamd_logger.errx(cfg, 'cannot load symbols profile from redis: %s', err)
+    elseif type(data) == 'table' then
+      local n = cfg:import_symbols_profile(aggregate_profiles(data))
+      rspamd_logger.infox(cfg, 'loaded symbols profile of %s nodes, %s symbols updated',
+        #data / 2, n)
+    end
+  end
+
+  local function save_cb(err)
+    if err then
+      rspamd_logger.errx(cfg, 'cannot save symbols profile to redis: %s', err)
+    end
+    redis_make_request(ev_base, cfg, false, load_cb, 'HGETALL', {settings.key})
+  end
+
+  local profile = ucl.to_format(cfg:get_symbols_profile(), 'json-compact')
+
+  if redis_make_request(ev_base, cfg, true, save_cb, 'HSET',
+      {settings.key, hostname, profile}) then
+    redis_make_request(ev_base, cfg, true, function() end, 'EXPIRE',
+      {settings.key, string.format('%d', settings.expire)})
+  end
+end
+
+local opts = rspamd_config:get_all_opt('symbols_profile')
+if opts then
+  for k,v in pairs(opts) do
+    settings[k] = v
+  end
+
+  redis_params = rspamd_parse_redis_server('symbols_profile')
+  if not redis_params then
+    rspamd_logger.infox(rspamd_config, 'no servers are specified, disabling module')
+    return
+  end
+
+  rspamd_config:add_on_load(function(_, ev_base, worker)
+    -- Statistics of symbols are shared between workers
+    if not (worker:get_name() == 'normal' and worker:get_index() == 0) then
+      return
+    end
+
+    rspamd_config:add_periodic(ev_base, 0.0, function(cfg, _ev_base)
+      exchange_profile(cfg, _ev_base)
+      return settings.interval
+    end, true)
+  end)
+end
@@ -35,12 +35,14 @@ local body_patterns = {}
 local mime_params = {}
 local raw_params = {}
 local body_params = {}
+-- types of tries that have patterns with `multi` flag
+local multi_types = {}
 
 local function tries_callback(task)
 
   local matched = {}
 
-  local function gen_trie_cb(type)
+  local function process_matches(type, matches)
     local patterns = mime_patterns
     local params = mime_params
     if type == 'rawmessage' then
@@ -51,7 +53,9 @@ local function tries_callback(task)
       params = body_params
     end
 
-    return function (idx, pos)
+    -- matches are pairs of pattern index and position
+    for i = 1, #matches, 2 do
+      local idx, pos = matches[i], matches[i + 1]
       local param = params[idx]
       local pattern = patterns[idx]
       local pattern_idx = pattern .. tostring(idx) .. type
@@ -67,14 +71,22 @@ local function tries_callback(task)
     end
   end
 
+  -- Collect matches in a single call, only the first match of each pattern
+  -- is needed unless there are `multi` patterns
   if mime_trie then
-    mime_trie:search_mime(task, gen_trie_cb('mime'))
+    local _, matches = mime_trie:search_mime(task,
+      {first_only = not multi_types['mime']})
+    process_matches('mime', matches)
   end
   if raw_trie then
-    raw_trie:search_rawmsg(task, gen_trie_cb('rawmessage'))
+    local _, matches = raw_trie:search_rawmsg(task,
+      {first_only = not multi_types['rawmessage']})
+    process_matches('rawmessage', matches)
   end
   if body_trie then
-    body_trie:search_rawbody(task, gen_trie_cb('rawbody'))
+    local _, matches = body_trie:search_rawbody(task,
+      {first_only = not multi_types['rawbody']})
+    process_matches('rawbody', matches)
   end
 end
 
@@ -83,16 +95,23 @@ local function process_single_pattern(pat, symbol, cf)
     local multi = false
     if cf['multi'] then multi = true end
 
+    local type = 'mime'
     if cf['raw'] then
+      type = 'rawmessage'
       table.insert(raw_patterns, pat)
       table.insert(raw_params, {symbol=symbol, multi=multi})
     elseif cf['body'] then
+      type = 'rawbody'
       table.insert(body_patterns, pat)
       table.insert(body_params, {symbol=symbol, multi=multi})
     else
       table.insert(mime_patterns, pat)
       table.insert(mime_params, {symbol=symbol, multi=multi})
     end
+
+    if multi then
+      multi_types[type] = true
+    end
   end
 end
 
@@ -25,18 +25,90 @@ local settings = {
   check_ssl = false, -- check ssl certificates
   max_size = 10 * 1024, -- maximum body to process
   redirectors_only = true, -- follow merely redirectors
+  local_cache_size = 8192, -- resolved urls cached in shared memory of a host (0 to disable)
+  max_host_requests = 8, -- concurrent requests to the same redirector host per worker
 }
 
 local rspamd_logger = require "rspamd_logger"
 local rspamd_http = require "rspamd_http"
+local rspamd_shared_cache = require "rspamd_shared_cache"
 local hash = require "rspamd_cryptobox_hash"
 
+local local_cache -- resolved urls shared by all workers of a host
+local inflight = {} -- key -> tasks waiting for a url resolved by another task
+local host_requests = {} -- host -> number of requests in progress
+local host_queues = {} -- host -> requests waiting for a free slot
+
+-- Returns table with `alive` field that is reset when task is destroyed
+local function track_task(task)
+  local st = {alive = true}
+  task:get_mempool():add_destructor(function() st.alive = false end)
+  return st
+end
+
+local function finish_resolve(key, url, param)
+  if local_cache and url then
+    local_cache:set(key, url)
+  end
+
+  local waiters = inflight[key]
+  inflight[key] = nil
+  rspamd_plugins.surbl.continue_process(url, param)
+
+  if waiters then
+    for _,w in ipairs(waiters) do
+      if w.st.alive then
+        rspamd_plugins.surbl.continue_process(url, w.param)
+      end
+    end
+  end
+end
+
+local function host_request(host, st, f)
+  local n = host_requests[host] or 0
+
+  if n >= settings.max_host_requests then
+    if not host_queues[host] then
+      host_queues[host] = {}
+    end
+    table.insert(host_queues[host], {st = st, f = f})
+
+    return
+  end
+
+  host_requests[host] = n + 1
+  f()
+end
+
+local function host_release(host)
+  host_requests[host] = host_requests[host] - 1
+
+  if host_requests[host] <= 0 then
+    host_requests[host] = nil
+  end
+
+  local q = host_queues[host]
+
+  while q and #q > 0 do
+    local elt = table.remove(q, 1)
+
+    if #q == 0 then
+      host_queues[host] = nil
+    end
+
+    if elt.st.alive then
+      host_request(host, elt.st, elt.f)
+      return
+    end
+  end
+end
+
 local function cache_url(task, orig_url, url, key, param)
   local function redis_set_cb(err, data)
     if err then
       rspamd_logger.errx(task, 'got error while setting redirect keys: %s', err)
     end
-    rspamd_plugins.surbl.continue_process(url, param)
+    finish_resolve(key, url, param)
   end
 
   local ret = rspamd_redis_make_request(task,
@@ -63,7 +135,19 @@ local function resolve_cached(task, orig_url, url, key, param, ntries)
       return
     end
 
+    local host = string.match(url, '^%w+://([^/:?#]+)') or url
+    local released = false
+
+    -- Called either from the callback or when task is destroyed
+    local function release()
+      if not released then
+        released = true
+        host_release(host)
+      end
+    end
+
     local function http_callback(err, code, body, headers)
+      release()
       if err then
         rspamd_logger.infox(task, 'found redirect error from %s to %s, err message: %s',
           orig_url, url, err)
@@ -100,19 +184,27 @@ local function resolve_cached(task, orig_url, url, key, param, ntries)
       end
     end
 
-    rspamd_http.request{
-      headers = {
-        ['User-Agent'] = 'Mozilla/5.0 (Maemo; Linux armv7l; rv:10.0.1) Gecko/20100101 Firefox/10.0.1 Fennec/10.0.1',
-      },
-      url = url,
-      task = task,
-      method = 'head',
-      max_size = settings.max_size,
-      timeout = settings.timeout,
-      opaque_body = true,
-      no_ssl_verify = not settings.check_ssl,
-      callback = http_callback
-    }
+    host_request(host, track_task(task), function()
+      task:get_mempool():add_destructor(release)
+      local ret = rspamd_http.request{
+        headers = {
+          ['User-Agent'] = 'Mozilla/5.0 (Maemo; Linux armv7l; rv:10.0.1) Gecko/20100101 Firefox/10.0.1 Fennec/10.0.1',
+        },
+        url = url,
+        task = task,
+        method = 'head',
+        max_size = settings.max_size,
+        timeout = settings.timeout,
+        opaque_body = true,
+        no_ssl_verify = not settings.check_ssl,
+        callback = http_callback
+      }
+
+      if not ret then
+        release()
+        cache_url(task, orig_url, url, key, param)
+      end
+    end)
   end
   local function redis_get_cb(err, data)
     if not err then
@@ -121,7 +213,7 @@ local function resolve_cached(task, orig_url, url, key, param, ntries)
           -- Got cached result
           rspamd_logger.infox(task, 'found cached redirect from %s to %s',
             url, data)
-          rspamd_plugins.surbl.continue_process(data, param)
+          finish_resolve(key, data, param)
           return
         end
       end
@@ -129,9 +221,13 @@ local function resolve_cached(task, orig_url, url, key, param, ntries)
     local function redis_reserve_cb(nerr, ndata)
       if nerr then
         rspamd_logger.errx(task, 'got error while setting redirect keys: %s', nerr)
+        finish_resolve(key, nil, param)
       elseif ndata == 1 then
         orig_url = url
         resolve_url()
+      else
+        -- Url is being resolved by another worker or host
+        finish_resolve(key, nil, param)
       end
     end
 
@@ -168,6 +264,38 @@ end
 local function url_redirector_handler(task, url, param)
   local url_str = tostring(url)
   local key = settings.key_prefix .. hash.create(url_str):base32()
+
+  if local_cache then
+    local cached = local_cache:get(key)
+
+    if cached then
+      rspamd_logger.infox(task, 'found locally cached redirect from %s to %s',
+        url_str, cached)
+      rspamd_plugins.surbl.continue_process(cached, param)
+      return
+    end
+  end
+
+  if inflight[key] then
+    -- The same url is being resolved by another task of this worker
+    table.insert(inflight[key], {param = param, st = track_task(task)})
+    return
+  end
+
+  local waiters = {}
+  inflight[key] = waiters
+  task:get_mempool():add_destructor(function()
+    if inflight[key] == waiters then
+      -- Task has been destroyed before url is resolved, release waiters
+      inflight[key] = nil
+      for _,w in ipairs(waiters) do
+        if w.st.alive then
+          rspamd_plugins.surbl.continue_process(nil, w.param)
+        end
+      end
+    end
+  end)
+
   resolve_cached(task, url_str, url_str, key, param, 1)
 end
 
@@ -180,6 +308,13 @@ if opts then
   if not redis_params then
     rspamd_logger.infox(rspamd_config, 'no servers are specified, disabling module')
   else
+    if settings.local_cache_size > 0 then
+      local_cache = rspamd_shared_cache.create(rspamd_config, 'url_redirector', {
+        max_items = settings.local_cache_size,
+        max_value = 1024,
+        ttl = settings.expire,
+      })
+    end
     if rspamd_plugins.surbl then
       rspamd_plugins.surbl.register_redirect(url_redirector_handler)
     else
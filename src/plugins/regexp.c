@@ -24,6 +24,7 @@
 #include "mime_expressions.h"
 #include "libutil/map.h"
 #include "lua/lua_common.h"
+#include "libserver/result_cache.h"
 
 static const guint64 rspamd_regexp_cb_magic = 0xca9d9649fc3e2659ULL;
 
@@ -86,6 +87,17 @@ read_regexp_expression (rspamd_mempool_t * pool,
 	return TRUE;
 }
 
+/* Expressions that use neither envelope nor trace headers could be cached */
+static enum rspamd_symbol_type
+regexp_symbol_type (const gchar *line)
+{
+	if (line != NULL && rspamd_result_cache_expression_is_content (line)) {
+		return SYMBOL_TYPE_NORMAL|SYMBOL_TYPE_CONTENT;
+	}
+
+	return SYMBOL_TYPE_NORMAL;
+}
+
 
 /* Init function */
 gint
@@ -147,6 +159,11 @@ regexp_module_config (struct rspamd_config *cfg)
 			regexp_module_ctx->max_size = ucl_obj_toint (value);
 			rspamd_re_cache_set_limit (cfg->re_cache, regexp_module_ctx->max_size);
 		}
+		else if (g_ascii_strncasecmp (ucl_object_key (value), "sample_large",
+			sizeof ("sample_large") - 1) == 0) {
+			rspamd_re_cache_set_sampling (cfg->re_cache,
+					ucl_object_toboolean (value));
+		}
 		else if (g_ascii_strncasecmp (ucl_object_key (value), "max_threads",
 			sizeof ("max_threads") - 1) == 0) {
 			msg_warn_config ("regexp module is now single threaded, max_threads is ignored");
@@ -168,7 +185,7 @@ regexp_module_config (struct rspamd_config *cfg)
 						0,
 						process_regexp_item,
 						cur_item,
-						SYMBOL_TYPE_NORMAL, -1);
+						regexp_symbol_type (ucl_obj_tostring (value)), -1);
 				nre ++;
 			}
 		}
@@ -194,6 +211,7 @@ regexp_module_config (struct rspamd_config *cfg)
 			gdouble score = 0.0;
 			guint flags = 0, priority = 0;
 			gboolean is_lua = FALSE, valid_expression = TRUE;
+			const gchar *expr_line = NULL;
 
 			/* We have some lua table, extract its arguments */
 			elt = ucl_object_lookup (value, "callback");
@@ -204,6 +222,7 @@ regexp_module_config (struct rspamd_config *cfg)
 				elt = ucl_object_lookup_any (value, "regexp", "re", NULL);
 
 				if (elt != NULL && ucl_object_type (elt) == UCL_STRING) {
+					expr_line = ucl_obj_tostring (elt);
 					cur_item = rspamd_mempool_alloc0 (regexp_module_ctx->regexp_pool,
 							sizeof (struct regexp_module_item));
 					cur_item->symbol = ucl_object_key (value);
@@ -242,7 +261,9 @@ regexp_module_config (struct rspamd_config *cfg)
 						0,
 						process_regexp_item,
 						cur_item,
-						SYMBOL_TYPE_NORMAL, -1);
+						(is_lua || ucl_object_lookup (value, "condition")) ?
+								SYMBOL_TYPE_NORMAL : regexp_symbol_type (expr_line),
+						-1);
 
 				elt = ucl_object_lookup (value, "condition");
 
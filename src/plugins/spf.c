@@ -478,14 +478,12 @@ spf_check_element (struct spf_resolved *rec, struct spf_addr *addr,
 static void
 spf_check_list (struct spf_resolved *rec, struct rspamd_task *task)
 {
-	guint i;
 	struct spf_addr *addr;
 
-	for (i = 0; i < rec->elts->len; i ++) {
-		addr = &g_array_index (rec->elts, struct spf_addr, i);
-		if (spf_check_element (rec, addr, task)) {
-			break;
-		}
+	addr = rspamd_spf_resolved_match (rec, task->from_addr);
+
+	if (addr != NULL) {
+		spf_check_element (rec, addr, task);
 	}
 }
 
@@ -527,7 +525,9 @@ spf_plugin_callback (struct spf_resolved *record, struct rspamd_task *task,
 
 			l = spf_record_ref (record);
 
-			if (!record->temp_failed && !record->perm_failed && !record->na) {
+			/* Zero ttl would mean that an element never expires */
+			if (!record->temp_failed && !record->perm_failed && !record->na &&
+					record->ttl > 0) {
 				rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
 						record->domain, l,
 						task->tv.tv_sec, record->ttl);
@@ -1166,9 +1166,10 @@ make_surbl_requests (struct rspamd_url *url, struct rspamd_task *task,
 			rspamd_mempool_strdup (task->task_pool, surbl_req);
 		msg_debug_surbl ("send surbl dns request %s", surbl_req);
 
-		if (make_dns_request_task (task,
+		if (make_dns_request_task_full (task,
 				surbl_dns_callback,
-				(void *) param, RDNS_REQUEST_A, surbl_req)) {
+				(void *) param, RDNS_REQUEST_A, surbl_req, FALSE,
+				rspamd_monitored_timeout (suffix->m))) {
 			param->w = rspamd_session_get_watcher (task->s);
 			rspamd_session_watcher_push (task->s);
 		}
@@ -1310,9 +1311,10 @@ surbl_dns_ip_callback (struct rdns_reply *reply, gpointer arg)
 						param->host_resolve,
 						to_resolve);
 
-				if (make_dns_request_task (task,
+				if (make_dns_request_task_full (task,
 						surbl_dns_callback,
-						param, RDNS_REQUEST_A, to_resolve->str)) {
+						param, RDNS_REQUEST_A, to_resolve->str, FALSE,
+						rspamd_monitored_timeout (param->suffix->m))) {
 					rspamd_session_watcher_push_specific (task->s, param->w);
 				}
 
@@ -1591,7 +1593,8 @@ static void
 surbl_tree_url_callback (gpointer key, gpointer value, void *data)
 {
 	struct redirector_param *param = data;
-	struct rspamd_url *url = value;
+	struct rspamd_url *url = value, *prev;
+	struct rspamd_url_host *host;
 	struct rspamd_task *task;
 
 	if (url->hostlen <= 0) {
@@ -1605,6 +1608,19 @@ surbl_tree_url_callback (gpointer key, gpointer value, void *data)
 		return;
 	}
 
+	/* Request depends on hostname only, so check each host once */
+	host = rspamd_url_host_intern (task, url);
+	prev = g_hash_table_lookup (param->hosts, host);
+
+	if (prev != NULL) {
+		url->surbl = prev->surbl;
+		url->surbllen = prev->surbllen;
+		msg_debug_surbl ("host %T is already checked", &host->host);
+
+		return;
+	}
+
+	g_hash_table_insert (param->hosts, host, url);
 	make_surbl_requests (url, param->task, param->suffix, FALSE,
 			param->tree);
 }
@@ -1632,6 +1648,10 @@ surbl_test_url (struct rspamd_task *task, void *user_data)
 	rspamd_mempool_add_destructor (task->task_pool,
 		(rspamd_mempool_destruct_t)g_hash_table_unref,
 		param->tree);
+	param->hosts = g_hash_table_new (g_direct_hash, g_direct_equal);
+	rspamd_mempool_add_destructor (task->task_pool,
+		(rspamd_mempool_destruct_t)g_hash_table_unref,
+		param->hosts);
 	g_hash_table_foreach (task->urls, surbl_tree_url_callback, param);
 
 	/* We also need to check and process img URLs */
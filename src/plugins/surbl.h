@@ -64,6 +64,7 @@ struct redirector_param {
 	struct upstream *redirector;
 	struct rspamd_http_connection *conn;
 	GHashTable *tree;
+	GHashTable *hosts; /* interned hosts that are already checked */
 	struct suffix_item *suffix;
 	struct rspamd_async_watcher *w;
 	gint sock;
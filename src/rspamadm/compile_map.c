@@ -0,0 +1,160 @@
+/*-
+ * Copyright 2016 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "printf.h"
+#include "map.h"
+#include "map_private.h"
+#include "map_compiled.h"
+
+static gchar *map_type = NULL;
+static gchar *output = NULL;
+static gboolean quiet = FALSE;
+
+static void rspamadm_compile_map (gint argc, gchar **argv);
+static const char *rspamadm_compile_map_help (gboolean full_help);
+
+struct rspamadm_command compile_map_command = {
+		.name = "compile_map",
+		.flags = 0,
+		.help = rspamadm_compile_map_help,
+		.run = rspamadm_compile_map
+};
+
+static GOptionEntry entries[] = {
+		{"type", 't', 0, G_OPTION_ARG_STRING, &map_type,
+				"Map type: hash or radix (hash by default)", NULL},
+		{"output", 'o', 0, G_OPTION_ARG_STRING, &output,
+				"Write compiled map to the specified file", NULL},
+		{"quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet,
+				"Suppress output", NULL},
+		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const char *
+rspamadm_compile_map_help (gboolean full_help)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Compile text map to the binary format that is mapped "
+				"by rspamd processes directly\n\n"
+				"Usage: rspamadm compile_map [-t hash|radix] -o output input\n"
+				"Where options are:\n\n"
+				"-t: map type: `hash` for kv and hosts maps, `radix` for IP maps\n"
+				"-o: output file (replaced atomically)\n"
+				"-q: suppress output\n"
+				"--help: shows available options and commands";
+	}
+	else {
+		help_str = "Compile map to the binary format";
+	}
+
+	return help_str;
+}
+
+static void
+rspamadm_compile_map (gint argc, gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_map fake_map;
+	struct map_cb_data cbdata;
+	gchar *content;
+	gsize len;
+	gboolean is_radix = FALSE;
+
+	context = g_option_context_new (
+			"compile_map - compile map to the binary format");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (argc < 2 || output == NULL) {
+		rspamd_fprintf (stderr, "%s\n", rspamadm_compile_map_help (TRUE));
+		exit (EXIT_FAILURE);
+	}
+
+	if (map_type != NULL) {
+		if (strcmp (map_type, "radix") == 0) {
+			is_radix = TRUE;
+		}
+		else if (strcmp (map_type, "hash") != 0) {
+			rspamd_fprintf (stderr, "unknown map type: %s\n", map_type);
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	if (!g_file_get_contents (argv[1], &content, &len, &error)) {
+		rspamd_fprintf (stderr, "cannot read %s: %e\n", argv[1], error);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	memset (&fake_map, 0, sizeof (fake_map));
+	rspamd_strlcpy (fake_map.tag, "rspamadm", sizeof (fake_map.tag));
+	memset (&cbdata, 0, sizeof (cbdata));
+	cbdata.map = &fake_map;
+
+	if (is_radix) {
+		rspamd_compiled_radix_read (content, len, &cbdata, TRUE);
+	}
+	else {
+		rspamd_compiled_hash_read (content, len, &cbdata, TRUE);
+	}
+
+	g_free (content);
+
+	if (cbdata.cur_data == NULL) {
+		rspamd_fprintf (stderr, "cannot parse %s\n", argv[1]);
+		exit (EXIT_FAILURE);
+	}
+
+	if (!rspamd_map_compiled_is_finished (cbdata.cur_data)) {
+		rspamd_map_compiled_finish (cbdata.cur_data);
+	}
+
+	if (rspamd_map_compiled_get_type (cbdata.cur_data) !=
+			(is_radix ? RSPAMD_MAP_COMPILED_RADIX : RSPAMD_MAP_COMPILED_HASH)) {
+		rspamd_fprintf (stderr, "%s is a compiled map of another type\n",
+				argv[1]);
+		exit (EXIT_FAILURE);
+	}
+
+	if (!rspamd_map_compiled_write (cbdata.cur_data, output, &error)) {
+		rspamd_fprintf (stderr, "cannot write map: %e\n", error);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	if (!quiet) {
+		rspamd_printf ("compiled %z %s to %s\n",
+				rspamd_map_compiled_size (cbdata.cur_data),
+				is_radix ? "ranges" : "entries", output);
+	}
+
+	rspamd_map_compiled_unref (cbdata.cur_data);
+	g_option_context_free (context);
+}
@@ -23,6 +23,7 @@
 static gboolean quiet = FALSE;
 static gchar *config = NULL;
 static gboolean strict = FALSE;
+static gchar *config_cache = NULL;
 extern struct rspamd_main *rspamd_main;
 /* Defined in modules.c */
 extern module_t *modules[];
@@ -45,6 +46,8 @@ static GOptionEntry entries[] = {
 				"Config file to test",     NULL},
 		{"strict", 's', 0, G_OPTION_ARG_NONE, &strict,
 				"Stop on any error in config", NULL},
+		{"config-cache", 0, 0, G_OPTION_ARG_STRING, &config_cache,
+				"Use the specified file to cache parsed config", NULL},
 		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
 };
 
@@ -59,6 +62,7 @@ rspamadm_configtest_help (gboolean full_help)
 				"Where options are:\n\n"
 				"-q: quiet output\n"
 				"-c: config file to test\n"
+				"--config-cache: file to cache parsed config\n"
 				"--help: shows available options and commands";
 	}
 	else {
@@ -137,6 +141,7 @@ rspamadm_configtest (gint argc, gchar **argv)
 	cfg->compiled_modules = modules;
 	cfg->compiled_workers = workers;
 	cfg->cfg_name = config;
+	cfg->cfg_snapshot = config_cache;
 
 	if (!rspamd_config_read (cfg, cfg->cfg_name, NULL,
 			config_logger, rspamd_main, ucl_vars)) {
@@ -80,8 +80,13 @@ rspamadm_control_help (gboolean full_help)
 				"--help: shows available options and commands\n\n"
 				"Supported commands:\n"
 				"stat - show statistics\n"
+				"counters - show shared counters without querying workers\n"
 				"reload - reload workers dynamic data\n"
-				"reresolve - resolve upstreams addresses\n";
+				"reresolve - resolve upstreams addresses\n"
+				"profile [reset] - show sampled symbols profile in the folded "
+				"stacks format for flamegraphs\n"
+				"dynamic_update <file> - apply scores, actions and enabled "
+				"symbols from json file to running workers without reload\n";
 	}
 	else {
 		help_str = "Manage rspamd main control interface";
@@ -97,6 +102,40 @@ rspamd_control_error_handler (struct rspamd_http_connection *conn, GError *err)
 	rspamd_http_connection_unref (conn);
 }
 
+/* Writes symbols profile of all workers as folded stacks in microseconds */
+static void
+rspamadm_control_print_profile (const ucl_object_t *obj)
+{
+	const ucl_object_t *workers, *wrk, *type, *syms, *sym, *elt, *stage;
+	ucl_object_iter_t it = NULL, sit;
+	static const gchar *parts[] = {"c", "lua"};
+	guint i;
+
+	workers = ucl_object_lookup (obj, "workers");
+
+	while ((wrk = ucl_object_iterate (workers, &it, true)) != NULL) {
+		type = ucl_object_lookup (wrk, "type");
+		syms = ucl_object_lookup_path (wrk, "data.symbols");
+		sit = NULL;
+
+		while ((sym = ucl_object_iterate (syms, &sit, true)) != NULL) {
+			stage = ucl_object_lookup (sym, "stage");
+
+			for (i = 0; i < G_N_ELEMENTS (parts); i ++) {
+				elt = ucl_object_lookup (sym, parts[i]);
+
+				if (elt && ucl_object_todouble (elt) > 0) {
+					rspamd_fprintf (stdout, "%s;%s;%s;%s %L\n",
+							type ? ucl_object_tostring (type) : "worker",
+							stage ? ucl_object_tostring (stage) : "filters",
+							ucl_object_key (sym), parts[i],
+							(gint64)(ucl_object_todouble (elt) * 1e6));
+				}
+			}
+		}
+	}
+}
+
 static gint
 rspamd_control_finish_handler (struct rspamd_http_connection *conn,
 		struct rspamd_http_message *msg)
@@ -139,6 +178,9 @@ rspamd_control_finish_handler (struct rspamd_http_connection *conn,
 				ucl_parser_free (parser);
 				return 0;
 			}
+			else if (strcmp (cbdata->path, "/profile") == 0) {
+				rspamadm_control_print_profile (obj);
+			}
 			else {
 				rspamd_ucl_emit_fstring (obj, UCL_EMIT_CONFIG, &out);
 			}
@@ -167,6 +209,8 @@ rspamadm_control (gint argc, gchar **argv)
 	struct timeval tv;
 	static struct rspamadm_control_cbdata cbdata;
 	lua_State *L;
+	gchar *update = NULL;
+	gsize update_len = 0;
 	gint sock;
 
 	context = g_option_context_new (
@@ -195,6 +239,9 @@ rspamadm_control (gint argc, gchar **argv)
 	if (g_ascii_strcasecmp (cmd, "stat") == 0) {
 		path = "/stat";
 	}
+	else if (g_ascii_strcasecmp (cmd, "counters") == 0) {
+		path = "/counters";
+	}
 	else if (g_ascii_strcasecmp (cmd, "reload") == 0) {
 		path = "/reload";
 	}
@@ -208,10 +255,28 @@ rspamadm_control (gint argc, gchar **argv)
 			g_ascii_strcasecmp (cmd, "fuzzy_stat") == 0) {
 		path = "/fuzzystat";
 	}
+	else if (g_ascii_strcasecmp (cmd, "profile") == 0) {
+		path = "/profile";
+	}
 	else if (g_ascii_strcasecmp (cmd, "fuzzysync") == 0 ||
 			g_ascii_strcasecmp (cmd, "fuzzy_sync") == 0) {
 		path = "/fuzzysync";
 	}
+	else if (g_ascii_strcasecmp (cmd, "dynamic_update") == 0) {
+		path = "/dynamic_update";
+
+		if (argc <= 2) {
+			rspamd_fprintf (stderr, "file with update is required\n");
+			exit (1);
+		}
+
+		if (!g_file_get_contents (argv[2], &update, &update_len, &error)) {
+			rspamd_fprintf (stderr, "cannot read %s: %s\n", argv[2],
+					error->message);
+			g_error_free (error);
+			exit (1);
+		}
+	}
 	else {
 		rspamd_fprintf (stderr, "unknown command: %s\n", cmd);
 		exit (1);
@@ -244,6 +309,16 @@ rspamadm_control (gint argc, gchar **argv)
 	msg->url = rspamd_fstring_new_init (path, strlen (path));
 	double_to_tv (timeout, &tv);
 
+	if (strcmp (path, "/profile") == 0 && argc > 2 &&
+			g_ascii_strcasecmp (argv[2], "reset") == 0) {
+		rspamd_http_message_add_header (msg, "Reset", "yes");
+	}
+
+	if (update) {
+		rspamd_http_message_set_body (msg, update, update_len);
+		g_free (update);
+	}
+
 	cbdata.L = L;
 	cbdata.argc = argc;
 	cbdata.argv = argv;
@@ -17,12 +17,14 @@
 #include "config.h"
 #include "rspamadm.h"
 #include "lua/lua_common.h"
+#include "fuzzy_backend_native.h"
 #include "fuzzy_convert.lua.h"
 
 static gchar *source_db = NULL;
 static gchar *redis_host = NULL;
 static gchar *redis_db = NULL;
 static gchar *redis_password = NULL;
+static gchar *native_log = NULL;
 static int64_t fuzzy_expiry = 0;
 
 static void rspamadm_fuzzyconvert (gint argc, gchar **argv);
@@ -46,6 +48,8 @@ static GOptionEntry entries[] = {
 				"Database in redis (should be numeric)", NULL},
 		{"password", 'p', 0, G_OPTION_ARG_STRING, &redis_password,
 				"Password to connect to redis", NULL},
+		{"native", 'n', 0, G_OPTION_ARG_FILENAME, &native_log,
+				"Output native fuzzy log (instead of redis)", NULL},
 		{NULL,     0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
 };
 
@@ -56,13 +60,16 @@ rspamadm_fuzzyconvert_help (gboolean full_help)
 	const char *help_str;
 
 	if (full_help) {
-		help_str = "Convert fuzzy hashes from sqlite3 to redis\n\n"
+		help_str = "Convert fuzzy hashes from sqlite3 to redis or native log\n\n"
 				"Usage: rspamadm fuzzyconvert -d <sqlite_db> -h <redis_ip>\n"
+				"       rspamadm fuzzyconvert -d <sqlite_db> -n <native_log>\n"
 				"Where options are:\n\n"
 				"-d: input sqlite\n"
+				"-e: expire hashes older than this number of seconds\n"
 				"-h: output redis ip (in format ip:port)\n"
 				"-D: output redis database\n"
-				"-p: redis password\n";
+				"-p: redis password\n"
+				"-n: output native fuzzy log\n";
 	}
 	else {
 		help_str = "Convert fuzzy hashes from sqlite3 to redis";
@@ -71,6 +78,36 @@ rspamadm_fuzzyconvert_help (gboolean full_help)
 	return help_str;
 }
 
+static void
+rspamadm_fuzzyconvert_native (void)
+{
+	struct rspamd_fuzzy_backend_native *bk;
+	GError *error = NULL;
+	gint64 nhashes;
+
+	bk = rspamd_fuzzy_backend_native_open (native_log, &error);
+
+	if (bk == NULL) {
+		rspamd_fprintf (stderr, "cannot open native log: %e\n", error);
+		g_error_free (error);
+		exit (1);
+	}
+
+	nhashes = rspamd_fuzzy_backend_native_import_sqlite (bk, source_db,
+			fuzzy_expiry, &error);
+
+	if (nhashes == -1) {
+		rspamd_fprintf (stderr, "cannot import hashes: %e\n", error);
+		g_error_free (error);
+		rspamd_fuzzy_backend_native_close (bk);
+		exit (1);
+	}
+
+	rspamd_printf ("imported %L hashes from %s to %s\n", nhashes,
+			source_db, native_log);
+	rspamd_fuzzy_backend_native_close (bk);
+}
+
 static void
 rspamadm_fuzzyconvert (gint argc, gchar **argv)
 {
@@ -99,6 +136,10 @@ rspamadm_fuzzyconvert (gint argc, gchar **argv)
 		rspamd_fprintf (stderr, "source db is missing\n");
 		exit (1);
 	}
+	if (native_log) {
+		rspamadm_fuzzyconvert_native ();
+		return;
+	}
 	if (!redis_host) {
 		rspamd_fprintf (stderr, "redis host is missing\n");
 		exit (1);
@@ -59,10 +59,11 @@ static const gchar *create_tables_sql =
 				"CREATE INDEX IF NOT EXISTS t ON digests(time);"
 				"CREATE UNIQUE INDEX IF NOT EXISTS s ON shingles(value, number);"
 				"COMMIT;";
+/* Sorted by the unique index, so sources can be merged as sorted runs */
 static const gchar *select_digests_sql =
-				"SELECT * FROM digests;";
+				"SELECT id, flag, digest, value, time FROM digests ORDER BY digest;";
 static const gchar *select_shingles_sql =
-				"SELECT * FROM shingles;";
+				"SELECT value, number, digest_id FROM shingles;";
 
 enum statement_idx {
 	TRANSACTION_START = 0,
@@ -71,8 +72,6 @@ enum statement_idx {
 	INSERT,
 	UPDATE,
 	INSERT_SHINGLE,
-	CHECK,
-	CHECK_DIGEST_ID,
 	COUNT,
 	STMAX
 };
@@ -129,22 +128,6 @@ static struct rspamd_sqlite3_prstmt prepared_stmts[STMAX] = {
 				.result = SQLITE_DONE,
 				.ret = ""
 		},
-		[CHECK] = {
-				.idx = CHECK,
-				.sql = "SELECT value, time, flag FROM digests WHERE digest==?1;",
-				.args = "B",
-				.stmt = NULL,
-				.result = SQLITE_ROW,
-				.ret = "III"
-		},
-		[CHECK_DIGEST_ID] = {
-				.idx = CHECK_DIGEST_ID,
-				.sql = "SELECT id FROM digests WHERE digest==?1",
-				.args = "B",
-				.stmt = NULL,
-				.result = SQLITE_ROW,
-				.ret = "I"
-		},
 		[COUNT] = {
 				.idx = COUNT,
 				.sql = "SELECT COUNT(*) FROM digests;",
@@ -193,27 +176,50 @@ struct fuzzy_merge_op {
 		struct {
 			guint number;
 			gint64 value;
+			/* Insert op of the digest, its id is known after insertion */
+			struct fuzzy_merge_op *dgst_op;
 		} shgl;
 	} data;
 };
 
-static guint
-rspamadm_op_hash (gconstpointer p)
+struct fuzzy_merge_source {
+	const gchar *name;
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	gboolean has_row;
+	/* Digests to be inserted indexed by id in this source */
+	GHashTable *digests_id;
+	guint64 nsrc_ops;
+	guint64 ndup_dst;
+	guint64 ndup_other;
+	guint64 nupdated;
+	guint64 nsrc_shingles;
+};
+
+static gint
+rspamadm_fuzzy_merge_digest_cmp (sqlite3_stmt *stmt, const guchar *digest,
+		gsize dlen)
 {
-	const struct fuzzy_merge_op *op = p;
-	guint res;
+	const guchar *cur;
+	gsize clen;
+	gint r;
+
+	/* id, flag, digest, value, time */
+	cur = sqlite3_column_blob (stmt, 2);
+	clen = sqlite3_column_bytes (stmt, 2);
+	r = memcmp (cur, digest, MIN (clen, dlen));
+
+	if (r == 0) {
+		r = (gint)clen - (gint)dlen;
+	}
 
-	/* Uniformly distributed */
-	memcpy (&res, op->digest, sizeof (res));
-	return res;
+	return r;
 }
 
 static gboolean
-rspamadm_op_equal (gconstpointer a, gconstpointer b)
+rspamadm_fuzzy_merge_step (sqlite3_stmt *stmt)
 {
-	const struct fuzzy_merge_op *op1 = a, *op2 = b;
-
-	return memcmp (op1->digest, op2->digest, sizeof (op1->digest)) == 0;
+	return sqlite3_step (stmt) == SQLITE_ROW;
 }
 
 static void
@@ -222,17 +228,18 @@ rspamadm_fuzzy_merge (gint argc, gchar **argv)
 	GOptionContext *context;
 	GError *error = NULL;
 	sqlite3 *dest_db;
-	GPtrArray *source_dbs;
 	GArray *prstmt;
-	GPtrArray *ops;
-	GHashTable *unique_ops, *digests_id;
+	GPtrArray *ops, *shingle_ops;
 	rspamd_mempool_t *pool;
 	guint i, nsrc;
 	guint64 old_count, inserted = 0, updated = 0, shingles_inserted = 0;
-	gint64 value, flag, tm, dig_id, src_value, src_flag;
-	sqlite3 *src;
-	sqlite3_stmt *stmt, *shgl_stmt;
+	gint64 value = 0, flag = 0, src_value, src_flag;
+	sqlite3_stmt *dst_stmt, *shgl_stmt;
 	struct fuzzy_merge_op *nop, *op;
+	struct fuzzy_merge_source *msrcs, *msrc, *cur, *best;
+	guchar digest[64];
+	gsize dlen;
+	gboolean dst_has_row, in_dst;
 
 	context = g_option_context_new (
 			"fuzzy_merge - merge fuzzy databases");
@@ -276,180 +283,210 @@ rspamadm_fuzzy_merge (gint argc, gchar **argv)
 	rspamd_sqlite3_run_prstmt (pool, dest_db, prstmt, COUNT, &old_count);
 
 	nsrc = g_strv_length (sources);
-	source_dbs = g_ptr_array_sized_new (nsrc);
+	msrcs = g_malloc0 (sizeof (*msrcs) * nsrc);
 	ops = g_ptr_array_new ();
-	unique_ops = g_hash_table_new (rspamadm_op_hash, rspamadm_op_equal);
+	shingle_ops = g_ptr_array_new ();
 
 	for (i = 0; i < nsrc; i++) {
-		src = rspamd_sqlite3_open_or_create (pool, sources[i], NULL, 0, &error);
+		msrc = &msrcs[i];
+		msrc->name = sources[i];
+		msrc->db = rspamd_sqlite3_open_or_create (pool, sources[i], NULL, 0,
+				&error);
 
-		if (src == NULL) {
+		if (msrc->db == NULL) {
 			rspamd_fprintf(stderr, "cannot open source %s: %s\n", sources[i],
 					error->message);
 			g_error_free (error);
 			exit (1);
 		}
 
-		g_ptr_array_add (source_dbs, src);
+		if (sqlite3_prepare_v2 (msrc->db, select_digests_sql, -1,
+				&msrc->stmt, NULL) != SQLITE_OK) {
+			rspamd_fprintf(stderr, "cannot prepare statement %s: %s\n",
+					select_digests_sql, sqlite3_errmsg (msrc->db));
+			exit (1);
+		}
+
+		msrc->digests_id = g_hash_table_new (g_int64_hash, g_int64_equal);
+		msrc->has_row = rspamadm_fuzzy_merge_step (msrc->stmt);
 	}
 
-	for (i = 0; i < nsrc; i++) {
-		const guchar *digest;
-		guint64 nsrc_ops = 0, ndup_dst = 0, ndup_other = 0, nupdated = 0,
-				nsrc_shingles = 0;
+	if (sqlite3_prepare_v2 (dest_db, select_digests_sql, -1, &dst_stmt, NULL) !=
+			SQLITE_OK) {
+		rspamd_fprintf(stderr, "cannot prepare statement %s: %s\n",
+				select_digests_sql, sqlite3_errmsg (dest_db));
+		exit (1);
+	}
 
-		src = g_ptr_array_index (source_dbs, i);
+	dst_has_row = rspamadm_fuzzy_merge_step (dst_stmt);
 
-		if (!quiet) {
-			rspamd_printf ("reading data from %s\n", sources[i]);
+	if (!quiet) {
+		rspamd_printf ("merging digests from %ud sources\n", nsrc);
+	}
+
+	/*
+	 * All sources and the destination are read in digest order, so equal
+	 * digests are processed together without lookups in the destination
+	 */
+	for (;;) {
+		msrc = NULL;
+
+		for (i = 0; i < nsrc; i++) {
+			if (msrcs[i].has_row && (msrc == NULL ||
+					rspamadm_fuzzy_merge_digest_cmp (msrcs[i].stmt,
+							sqlite3_column_blob (msrc->stmt, 2),
+							sqlite3_column_bytes (msrc->stmt, 2)) < 0)) {
+				msrc = &msrcs[i];
+			}
 		}
 
-		if (sqlite3_prepare_v2 (src, select_digests_sql, -1, &stmt, NULL) !=
-					SQLITE_OK) {
-			rspamd_fprintf(stderr, "cannot prepare statement %s: %s\n",
-					select_digests_sql, sqlite3_errmsg (src));
-			exit (1);
+		if (msrc == NULL) {
+			break;
 		}
 
-		/* Temporary index for inserted IDs */
-		digests_id = g_hash_table_new (g_int64_hash, g_int64_equal);
+		memset (digest, 0, sizeof (digest));
+		dlen = MIN (sqlite3_column_bytes (msrc->stmt, 2), sizeof (digest));
+		memcpy (digest, sqlite3_column_blob (msrc->stmt, 2), dlen);
+
+		while (dst_has_row && rspamadm_fuzzy_merge_digest_cmp (dst_stmt,
+				digest, dlen) < 0) {
+			dst_has_row = rspamadm_fuzzy_merge_step (dst_stmt);
+		}
+
+		in_dst = dst_has_row &&
+				rspamadm_fuzzy_merge_digest_cmp (dst_stmt, digest, dlen) == 0;
+
+		if (in_dst) {
+			value = sqlite3_column_int64 (dst_stmt, 3);
+			flag = sqlite3_column_int64 (dst_stmt, 1);
+		}
+
+		nop = NULL;
+		best = NULL;
+
+		for (i = 0; i < nsrc; i++) {
+			cur = &msrcs[i];
+
+			if (!cur->has_row || rspamadm_fuzzy_merge_digest_cmp (cur->stmt,
+					digest, dlen) != 0) {
+				continue;
+			}
 
-		while (sqlite3_step (stmt) == SQLITE_ROW) {
 			/* id, flag, digest, value, time */
-			digest = sqlite3_column_text (stmt, 2);
-			src_value = sqlite3_column_int64 (stmt, 3);
-			src_flag = sqlite3_column_int64 (stmt, 1);
+			src_value = sqlite3_column_int64 (cur->stmt, 3);
+			src_flag = sqlite3_column_int64 (cur->stmt, 1);
 
-			/* Now search for this digest in the destination */
-			if (rspamd_sqlite3_run_prstmt (pool,
-					dest_db,
-					prstmt,
-					CHECK,
-					(gint64)sqlite3_column_bytes (stmt, 2), digest,
-					&value, &tm, &flag) == SQLITE_OK) {
+			if (in_dst && (src_value <= value || src_flag != flag)) {
 				/*
 				 * We compare values and if src value is bigger than
 				 * local one then we replace dest value with the src value
 				 */
-				if (src_value > value && src_flag == flag) {
+				cur->ndup_dst ++;
+			}
+			else if (nop == NULL || nop->data.dgst.value < src_value) {
+				if (nop == NULL) {
 					nop = g_slice_alloc (sizeof (*nop));
-					nop->op = OP_UPDATE;
-					memcpy (nop->digest, digest,
-							sizeof (nop->digest));
-					nop->data.dgst.flag = flag;
-					/* Update time as well */
-					nop->data.dgst.tm = sqlite3_column_int64 (stmt, 4);
-					nop->data.dgst.id = sqlite3_column_int64 (stmt, 0);
-
-					if ((op = g_hash_table_lookup (unique_ops, nop)) == NULL) {
-						g_ptr_array_add (ops, nop);
-						g_hash_table_insert (unique_ops, nop, nop);
-						nupdated ++;
-					}
-					else {
-						if (op->data.dgst.value < nop->data.dgst.value) {
-							op->data.dgst.value = nop->data.dgst.value;
-							op->data.dgst.tm = nop->data.dgst.tm;
-							nupdated ++;
-						}
-						else {
-							ndup_other ++;
-						}
-						g_slice_free1 (sizeof (*nop), nop);
-					}
+					nop->op = in_dst ? OP_UPDATE : OP_INSERT;
+					memcpy (nop->digest, digest, sizeof (nop->digest));
 				}
 				else {
-					ndup_dst ++;
+					best->ndup_other ++;
 				}
-			}
-			else {
-				/* Digest has not been found, but maybe we have the same in other
-				 * sources ?
-				 */
-				nop = g_slice_alloc (sizeof (*nop));
-				nop->op = OP_INSERT;
-				memcpy (nop->digest, digest,
-						sizeof (nop->digest));
+
 				nop->data.dgst.flag = src_flag;
 				nop->data.dgst.value = src_value;
 				/* Update time as well */
-				nop->data.dgst.tm = sqlite3_column_int64 (stmt, 4);
-				nop->data.dgst.id = sqlite3_column_int64 (stmt, 0);
-
-				if ((op = g_hash_table_lookup (unique_ops, nop)) == NULL) {
-					g_ptr_array_add (ops, nop);
-					g_hash_table_insert (unique_ops, nop, nop);
-					g_hash_table_insert (digests_id, &nop->data.dgst.id,
-							nop);
-					nsrc_ops ++;
-				}
-				else {
-					if (op->data.dgst.value < nop->data.dgst.value) {
-						op->data.dgst.value = nop->data.dgst.value;
-						op->data.dgst.tm = nop->data.dgst.tm;
-						op->data.dgst.tm = nop->data.dgst.tm;
-						nupdated++;
-					}
-					else {
-						ndup_other++;
-					}
-					g_slice_free1 (sizeof (*nop), nop);
-				}
+				nop->data.dgst.tm = sqlite3_column_int64 (cur->stmt, 4);
+				nop->data.dgst.id = sqlite3_column_int64 (cur->stmt, 0);
+				best = cur;
+			}
+			else {
+				cur->ndup_other ++;
+			}
+
+			cur->has_row = rspamadm_fuzzy_merge_step (cur->stmt);
+		}
+
+		if (nop) {
+			g_ptr_array_add (ops, nop);
+
+			if (nop->op == OP_INSERT) {
+				g_hash_table_insert (best->digests_id, &nop->data.dgst.id, nop);
+				best->nsrc_ops ++;
+			}
+			else {
+				best->nupdated ++;
 			}
 		}
+	}
+
+	sqlite3_finalize (dst_stmt);
+
+	for (i = 0; i < nsrc; i++) {
+		msrc = &msrcs[i];
+		sqlite3_finalize (msrc->stmt);
 
 		/* We also need to scan all shingles and select those that
 		 * are to be inserted
 		 */
-		if (sqlite3_prepare_v2 (src,
-				select_shingles_sql,
-				-1,
-				&shgl_stmt,
-				NULL) == SQLITE_OK) {
-			sqlite3_bind_int64 (shgl_stmt,
-					sqlite3_column_int64 (stmt, 0), 1);
-
-			while (sqlite3_step (shgl_stmt) == SQLITE_ROW) {
-				gint64 id = sqlite3_column_int64 (shgl_stmt, 2);
-
-				if ((op = g_hash_table_lookup (digests_id, &id)) != NULL) {
-					/* value, number, digest_id */
-					nop = g_slice_alloc (sizeof (*nop));
-					nop->op = OP_INSERT_SHINGLE;
-					memcpy (nop->digest, op->digest, sizeof (nop->digest));
-					nop->data.shgl.number = sqlite3_column_int64 (shgl_stmt, 1);
-					nop->data.shgl.value = sqlite3_column_int64 (shgl_stmt,
-							0);
-					g_ptr_array_add (ops, nop);
-					nsrc_shingles ++;
+		if (g_hash_table_size (msrc->digests_id) > 0) {
+			if (sqlite3_prepare_v2 (msrc->db,
+					select_shingles_sql,
+					-1,
+					&shgl_stmt,
+					NULL) == SQLITE_OK) {
+
+				while (sqlite3_step (shgl_stmt) == SQLITE_ROW) {
+					gint64 id = sqlite3_column_int64 (shgl_stmt, 2);
+
+					if ((op = g_hash_table_lookup (msrc->digests_id, &id)) != NULL) {
+						/* value, number, digest_id */
+						nop = g_slice_alloc (sizeof (*nop));
+						nop->op = OP_INSERT_SHINGLE;
+						memcpy (nop->digest, op->digest, sizeof (nop->digest));
+						nop->data.shgl.number = sqlite3_column_int64 (shgl_stmt, 1);
+						nop->data.shgl.value = sqlite3_column_int64 (shgl_stmt,
+								0);
+						nop->data.shgl.dgst_op = op;
+						g_ptr_array_add (shingle_ops, nop);
+						msrc->nsrc_shingles ++;
+					}
 				}
-			}
 
-			sqlite3_finalize (shgl_stmt);
-		}
-		else {
-			rspamd_fprintf (stderr, "cannot prepare statement %s: %s\n",
-					select_shingles_sql, sqlite3_errmsg (src));
-			exit (1);
+				sqlite3_finalize (shgl_stmt);
+			}
+			else {
+				rspamd_fprintf (stderr, "cannot prepare statement %s: %s\n",
+						select_shingles_sql, sqlite3_errmsg (msrc->db));
+				exit (1);
+			}
 		}
 
 		if (!quiet) {
 			rspamd_printf ("processed %s: %L new hashes, %L duplicate hashes (other sources), "
 							"%L duplicate hashes (destination), %L hashes to update, "
 							"%L shingles to insert\n\n",
-					sources[i],
-					nsrc_ops,
-					ndup_other,
-					ndup_dst,
-					nupdated,
-					nsrc_shingles);
+					msrc->name,
+					msrc->nsrc_ops,
+					msrc->ndup_other,
+					msrc->ndup_dst,
+					msrc->nupdated,
+					msrc->nsrc_shingles);
 		}
 		/* Cleanup */
-		g_hash_table_unref (digests_id);
-		sqlite3_finalize (stmt);
-		sqlite3_close (src);
+		g_hash_table_unref (msrc->digests_id);
+		sqlite3_close (msrc->db);
 	}
 
+	g_free (msrcs);
+
+	/* Shingles are inserted after all digests */
+	for (i = 0; i < shingle_ops->len; i ++) {
+		g_ptr_array_add (ops, g_ptr_array_index (shingle_ops, i));
+	}
+
+	g_ptr_array_free (shingle_ops, TRUE);
+
 	if (!quiet) {
 		rspamd_printf ("start writing to %s, %ud ops pending\n", target, ops->len);
 	}
@@ -484,6 +521,8 @@ rspamadm_fuzzy_merge (gint argc, gchar **argv)
 				goto err;
 			}
 
+			/* Shingles refer to the new id in the destination */
+			op->data.dgst.id = sqlite3_last_insert_rowid (dest_db);
 			inserted ++;
 			break;
 		case OP_UPDATE:
@@ -503,32 +542,19 @@ rspamadm_fuzzy_merge (gint argc, gchar **argv)
 			updated ++;
 			break;
 		case OP_INSERT_SHINGLE:
-			/* First select the appropriate digest */
 			if (rspamd_sqlite3_run_prstmt (pool,
 					dest_db,
 					prstmt,
-					CHECK_DIGEST_ID,
-					(gint64) sizeof (op->digest),
-					op->digest,
-					&dig_id) == SQLITE_OK) {
-				if (rspamd_sqlite3_run_prstmt (pool,
-						dest_db,
-						prstmt,
-						INSERT_SHINGLE,
-						(gint64)op->data.shgl.value,
-						(gint64)op->data.shgl.number,
-						dig_id) != SQLITE_OK) {
-					rspamd_fprintf(stderr, "cannot insert shingle: %s\n",
-							sqlite3_errmsg (dest_db));
-					goto err;
-				}
-
-				shingles_inserted ++;
-			}
-			else {
-				msg_warn_pool ("cannot find digest id for shingle");
+					INSERT_SHINGLE,
+					(gint64)op->data.shgl.value,
+					(gint64)op->data.shgl.number,
+					op->data.shgl.dgst_op->data.dgst.id) != SQLITE_OK) {
+				rspamd_fprintf(stderr, "cannot insert shingle: %s\n",
+						sqlite3_errmsg (dest_db));
+				goto err;
 			}
 
+			shingles_inserted ++;
 			break;
 		}
 	}
@@ -16,8 +16,17 @@
  */
 #include "config.h"
 #include "rspamadm.h"
-#include "lua/lua_common.h"
-#include "grep.lua.h"
+#include "rspamd.h"
+#include "multipattern.h"
+#include "regexp.h"
+#include "cryptobox.h"
+#include "unix-std.h"
+
+#define GREP_INDEX_SUFFIX ".idx"
+#define GREP_INDEX_MAGIC "rsgidx1"
+/* Multipattern offsets are signed integers */
+#define GREP_MAX_PIECE (1024 * 1024 * 1024)
+#define GREP_TASK_END "; task; rspamd_protocol_http_reply:"
 
 static gchar *string = NULL;
 static gchar *pattern = NULL;
@@ -25,6 +34,8 @@ static gchar **inputs = NULL;
 static gboolean sensitive = FALSE;
 static gboolean orphans = FALSE;
 static gboolean partial = FALSE;
+static gboolean use_index = FALSE;
+static gint nthreads = 0;
 
 static void rspamadm_grep (gint argc, gchar **argv);
 static const char *rspamadm_grep_help (gboolean full_help);
@@ -49,9 +60,66 @@ static GOptionEntry entries[] = {
 				"Print orphaned logs", NULL},
 		{"partial", 'P', 0, G_OPTION_ARG_NONE, &partial,
 				"Print partial logs", NULL},
+		{"index", 'I', 0, G_OPTION_ARG_NONE, &use_index,
+				"Use (and build if needed) index of tasks for input files", NULL},
+		{"threads", 'j', 0, G_OPTION_ARG_INT, &nthreads,
+				"Number of threads (number of CPUs by default)", NULL},
 		{NULL,     0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
 };
 
+struct rspamadm_grep_index_hdr {
+	gchar magic[8];
+	guint64 size;
+	guint64 mtime;
+	guint64 nrecs;
+};
+
+/* Line of a task in the log, sorted by hash then offset */
+struct rspamadm_grep_index_rec {
+	guint64 hash;
+	guint64 offset;
+};
+
+struct rspamadm_grep_task {
+	guint64 first_match;
+	GArray *lines; /* offsets of task lines */
+};
+
+struct rspamadm_grep_input {
+	const gchar *name;
+	const gchar *data;
+	gsize len;
+	gsize maplen;
+	GByteArray *buf; /* for inputs that cannot be mapped */
+	GHashTable *tasks;
+	const struct rspamadm_grep_index_rec *index;
+	guint64 nindex;
+	gpointer index_map;
+	gsize index_len;
+};
+
+struct rspamadm_grep_worker {
+	struct rspamadm_grep_input *in;
+	gsize begin;
+	gsize end;
+	struct rspamd_multipattern *mp;
+	rspamd_regexp_t *re;
+	const gchar *skip_until;
+	GArray *matches;  /* offsets of matched lines */
+	GArray *index;    /* index records when index is built */
+	GArray *lines;    /* pairs of task and offset for matched tasks */
+};
+
+struct rspamadm_grep_task_line {
+	struct rspamadm_grep_task *task;
+	guint64 offset;
+};
+
+/* Print event: either an orphan line or a completed task */
+struct rspamadm_grep_event {
+	guint64 offset;
+	struct rspamadm_grep_task *task;
+};
 
 static const char *
 rspamadm_grep_help (gboolean full_help)
@@ -60,14 +128,19 @@ rspamadm_grep_help (gboolean full_help)
 
 	if (full_help) {
 		help_str = "Search for patterns in rspamd logs\n\n"
-				"Usage: rspamadm grep <-s string | -p pattern> [-i input1 -i input2 -S -o -P]\n"
+				"Usage: rspamadm grep <-s string | -p pattern> [-i input1 -i input2 -S -o -P -I -j threads]\n"
 				"Where options are:\n\n"
 				"-s: Plain string to search (case-insensitive)\n"
 				"-p: Pattern to search for (regex)\n"
 				"-i: Process specified inputs (stdin if unspecified)\n"
 				"-S: Enable case-sensitivity in string search\n"
 				"-o: Print orphaned logs\n"
-				"-P: Print partial logs\n";
+				"-P: Print partial logs\n"
+				"-I: Use index of tasks stored near input files as <input>.idx,\n"
+				"    it is built on the first search\n"
+				"-j: Number of threads (number of CPUs by default)\n\n"
+				"Plain files are mapped to memory, compressed inputs and stdin\n"
+				"are read to memory as a whole before searching.\n";
 	}
 	else {
 		help_str = "Search for patterns in rspamd logs";
@@ -76,14 +149,743 @@ rspamadm_grep_help (gboolean full_help)
 	return help_str;
 }
 
+static inline const gchar *
+rspamadm_grep_line_end (const gchar *p, const gchar *end)
+{
+	const gchar *nl = memchr (p, '\n', end - p);
+
+	return nl ? nl : end;
+}
+
+/* Returns the first <hex> identifier in a line */
+static const gchar *
+rspamadm_grep_task_id (const gchar *line, const gchar *end, gsize *len)
+{
+	const gchar *p = line, *s;
+
+	while (p < end && (p = memchr (p, '<', end - p)) != NULL) {
+		s = ++p;
+
+		while (p < end && g_ascii_isxdigit (*p)) {
+			p ++;
+		}
+
+		if (p > s && p < end && *p == '>') {
+			*len = p - s;
+
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+static inline guint64
+rspamadm_grep_id_hash (const gchar *id, gsize len)
+{
+	return rspamd_cryptobox_fast_hash (id, len, rspamd_hash_seed ());
+}
+
+static gboolean
+rspamadm_grep_is_end (const gchar *line, const gchar *end)
+{
+	const gchar *id;
+	gsize idlen;
+
+	id = rspamadm_grep_task_id (line, end, &idlen);
+
+	return id && (gsize)(end - (id + idlen + 1)) >= sizeof (GREP_TASK_END) - 1 &&
+			memcmp (id + idlen + 1, GREP_TASK_END,
+					sizeof (GREP_TASK_END) - 1) == 0;
+}
+
+static gint
+rspamadm_grep_mp_cb (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	struct rspamadm_grep_worker *w = context;
+	const gchar *p = text + match_start, *ls;
+	guint64 off;
+
+	if (p < w->skip_until) {
+		/* Line is already matched */
+		return 0;
+	}
+
+	ls = p;
+
+	while (ls > w->in->data + w->begin && *(ls - 1) != '\n') {
+		ls --;
+	}
+
+	off = ls - w->in->data;
+	g_array_append_val (w->matches, off);
+	w->skip_until = rspamadm_grep_line_end (p, w->in->data + w->end);
+
+	return 0;
+}
+
+/* Finds matched lines and optionally collects index records */
+static gpointer
+rspamadm_grep_search_thread (gpointer ud)
+{
+	struct rspamadm_grep_worker *w = ud;
+	const gchar *base = w->in->data, *p, *le, *id, *piece_end;
+	struct rspamadm_grep_index_rec rec;
+	guint64 off;
+	gsize idlen;
+
+	if (w->mp) {
+		p = base + w->begin;
+
+		while (p < base + w->end) {
+			piece_end = base + w->end;
+
+			if (piece_end - p > GREP_MAX_PIECE) {
+				piece_end = rspamadm_grep_line_end (p + GREP_MAX_PIECE,
+						base + w->end);
+			}
+
+			rspamd_multipattern_lookup (w->mp, p, piece_end - p,
+					rspamadm_grep_mp_cb, w, NULL);
+			p = piece_end;
+		}
+	}
+
+	if (w->re || w->index) {
+		for (p = base + w->begin; p < base + w->end; p = le + 1) {
+			le = rspamadm_grep_line_end (p, base + w->end);
+			off = p - base;
+
+			if (w->re && rspamd_regexp_search (w->re, p, le - p, NULL, NULL,
+					TRUE, NULL)) {
+				g_array_append_val (w->matches, off);
+			}
+
+			if (w->index && (id = rspamadm_grep_task_id (p, le, &idlen))) {
+				rec.hash = rspamadm_grep_id_hash (id, idlen);
+				rec.offset = off;
+				g_array_append_val (w->index, rec);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Collects lines of tasks that have matched lines */
+static gpointer
+rspamadm_grep_collect_thread (gpointer ud)
+{
+	struct rspamadm_grep_worker *w = ud;
+	const gchar *base = w->in->data, *p, *le, *id;
+	struct rspamadm_grep_task_line tl;
+	gsize idlen;
+	gchar idbuf[64];
+
+	for (p = base + w->begin; p < base + w->end; p = le + 1) {
+		le = rspamadm_grep_line_end (p, base + w->end);
+		id = rspamadm_grep_task_id (p, le, &idlen);
+
+		if (id == NULL || idlen >= sizeof (idbuf)) {
+			continue;
+		}
+
+		memcpy (idbuf, id, idlen);
+		idbuf[idlen] = '\0';
+		/* Tasks table is not modified while threads are running */
+		tl.task = g_hash_table_lookup (w->in->tasks, idbuf);
+
+		if (tl.task) {
+			tl.offset = p - base;
+			g_array_append_val (w->lines, tl);
+		}
+	}
+
+	return NULL;
+}
+
+static gint
+rspamadm_grep_index_cmp (const void *a, const void *b)
+{
+	const struct rspamadm_grep_index_rec *r1 = a, *r2 = b;
+
+	if (r1->hash != r2->hash) {
+		return r1->hash < r2->hash ? -1 : 1;
+	}
+
+	if (r1->offset != r2->offset) {
+		return r1->offset < r2->offset ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static gint
+rspamadm_grep_event_cmp (const void *a, const void *b)
+{
+	const struct rspamadm_grep_event *e1 = a, *e2 = b;
+
+	if (e1->offset != e2->offset) {
+		return e1->offset < e2->offset ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static void
+rspamadm_grep_task_dtor (gpointer p)
+{
+	struct rspamadm_grep_task *task = p;
+
+	g_array_free (task->lines, TRUE);
+	g_free (task);
+}
+
+static gboolean
+rspamadm_grep_open_input (struct rspamadm_grep_input *in, gboolean *seekable)
+{
+	struct stat st;
+	FILE *f = NULL;
+	gchar *cmd = NULL, buf[BUFSIZ];
+	gsize r;
+	gint fd;
+
+	*seekable = FALSE;
+
+	if (strcmp (in->name, "stdin") == 0) {
+		f = stdin;
+	}
+	else if (g_str_has_suffix (in->name, ".xz")) {
+		cmd = g_strdup_printf ("xzcat '%s'", in->name);
+	}
+	else if (g_str_has_suffix (in->name, ".bz2")) {
+		cmd = g_strdup_printf ("bzcat '%s'", in->name);
+	}
+	else if (g_str_has_suffix (in->name, ".gz")) {
+		cmd = g_strdup_printf ("zcat '%s'", in->name);
+	}
+	else {
+		fd = open (in->name, O_RDONLY);
+
+		if (fd == -1 || fstat (fd, &st) == -1) {
+			rspamd_fprintf (stderr, "Couldn't open file (%s): %s\n", in->name,
+					strerror (errno));
+
+			if (fd != -1) {
+				close (fd);
+			}
+
+			return FALSE;
+		}
+
+		in->len = st.st_size;
+
+		if (in->len > 0) {
+			in->data = mmap (NULL, in->len, PROT_READ, MAP_SHARED, fd, 0);
+
+			if (in->data == MAP_FAILED) {
+				rspamd_fprintf (stderr, "Couldn't map file (%s): %s\n",
+						in->name, strerror (errno));
+				close (fd);
+
+				return FALSE;
+			}
+
+			in->maplen = in->len;
+			madvise ((gpointer)in->data, in->len, MADV_SEQUENTIAL);
+		}
+
+		close (fd);
+		*seekable = TRUE;
+
+		return TRUE;
+	}
+
+	if (cmd) {
+		f = popen (cmd, "r");
+		g_free (cmd);
+
+		if (f == NULL) {
+			rspamd_fprintf (stderr, "Couldn't open file (%s): %s\n", in->name,
+					strerror (errno));
+
+			return FALSE;
+		}
+	}
+
+	in->buf = g_byte_array_new ();
+
+	while ((r = fread (buf, 1, sizeof (buf), f)) > 0) {
+		g_byte_array_append (in->buf, buf, r);
+	}
+
+	if (f != stdin) {
+		pclose (f);
+	}
+
+	in->data = (const gchar *)in->buf->data;
+	in->len = in->buf->len;
+
+	return TRUE;
+}
+
+static void
+rspamadm_grep_close_input (struct rspamadm_grep_input *in)
+{
+	if (in->maplen) {
+		munmap ((gpointer)in->data, in->maplen);
+	}
+
+	if (in->buf) {
+		g_byte_array_free (in->buf, TRUE);
+	}
+
+	if (in->index_map) {
+		munmap (in->index_map, in->index_len);
+	}
+
+	if (in->tasks) {
+		g_hash_table_unref (in->tasks);
+	}
+}
+
+/* Maps index if it has been built for the current contents of input */
+static gboolean
+rspamadm_grep_load_index (struct rspamadm_grep_input *in, const gchar *path)
+{
+	struct rspamadm_grep_index_hdr *hdr;
+	struct stat st, ist;
+	gint fd;
+
+	if (stat (in->name, &st) == -1) {
+		return FALSE;
+	}
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		return FALSE;
+	}
+
+	if (fstat (fd, &ist) == -1 || (gsize)ist.st_size < sizeof (*hdr)) {
+		close (fd);
+
+		return FALSE;
+	}
+
+	in->index_map = mmap (NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (in->index_map == MAP_FAILED) {
+		in->index_map = NULL;
+
+		return FALSE;
+	}
+
+	in->index_len = ist.st_size;
+	hdr = in->index_map;
+
+	if (memcmp (hdr->magic, GREP_INDEX_MAGIC, sizeof (hdr->magic)) != 0 ||
+			hdr->size != (guint64)st.st_size ||
+			hdr->mtime != (guint64)st.st_mtime ||
+			hdr->nrecs != (ist.st_size - sizeof (*hdr)) /
+					sizeof (struct rspamadm_grep_index_rec)) {
+		munmap (in->index_map, in->index_len);
+		in->index_map = NULL;
+
+		return FALSE;
+	}
+
+	in->index = (const struct rspamadm_grep_index_rec *)(hdr + 1);
+	in->nindex = hdr->nrecs;
+
+	return TRUE;
+}
+
+static void
+rspamadm_grep_write_index (struct rspamadm_grep_input *in, const gchar *path,
+		struct rspamadm_grep_worker *workers, guint nworkers)
+{
+	struct rspamadm_grep_index_hdr hdr;
+	struct stat st;
+	GArray *all;
+	gchar *tmp;
+	guint i;
+	gint fd;
+
+	if (stat (in->name, &st) == -1) {
+		return;
+	}
+
+	all = g_array_new (FALSE, FALSE, sizeof (struct rspamadm_grep_index_rec));
+
+	for (i = 0; i < nworkers; i ++) {
+		g_array_append_vals (all, workers[i].index->data, workers[i].index->len);
+	}
+
+	qsort (all->data, all->len, sizeof (struct rspamadm_grep_index_rec),
+			rspamadm_grep_index_cmp);
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, GREP_INDEX_MAGIC, sizeof (hdr.magic));
+	hdr.size = st.st_size;
+	hdr.mtime = st.st_mtime;
+	hdr.nrecs = all->len;
+
+	tmp = g_strconcat (path, ".tmp", NULL);
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1 ||
+			write (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+			write (fd, all->data, all->len * sizeof (struct rspamadm_grep_index_rec)) !=
+					(gssize)(all->len * sizeof (struct rspamadm_grep_index_rec)) ||
+			rename (tmp, path) == -1) {
+		rspamd_fprintf (stderr, "Couldn't write index %s: %s\n", path,
+				strerror (errno));
+		unlink (tmp);
+	}
+
+	if (fd != -1) {
+		close (fd);
+	}
+
+	g_free (tmp);
+	g_array_free (all, TRUE);
+}
+
+/* Appends lines of tasks using a sorted index instead of scanning input */
+static void
+rspamadm_grep_collect_index (struct rspamadm_grep_input *in)
+{
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamadm_grep_task *task;
+	const gchar *line, *le, *id;
+	guint64 h, lo, hi, mid;
+	gsize idlen, klen;
+
+	g_hash_table_iter_init (&it, in->tasks);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		task = v;
+		klen = strlen (k);
+		h = rspamadm_grep_id_hash (k, klen);
+		lo = 0;
+		hi = in->nindex;
+
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+
+			if (in->index[mid].hash < h) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+
+		for (; lo < in->nindex && in->index[lo].hash == h; lo ++) {
+			line = in->data + in->index[lo].offset;
+			le = rspamadm_grep_line_end (line, in->data + in->len);
+			id = rspamadm_grep_task_id (line, le, &idlen);
+
+			/* Skip hash collisions */
+			if (id && idlen == klen && memcmp (id, k, klen) == 0) {
+				g_array_append_val (task->lines, in->index[lo].offset);
+			}
+		}
+	}
+}
+
+static void
+rspamadm_grep_print_line (struct rspamadm_grep_input *in, guint64 off)
+{
+	const gchar *line = in->data + off, *le;
+
+	le = rspamadm_grep_line_end (line, in->data + in->len);
+	fwrite (line, 1, le - line, stdout);
+	fputc ('\n', stdout);
+}
+
+/*
+ * Prints task lines from the last end of the same task before the match up
+ * to the first end after it, returns offset of the end line or G_MAXUINT64
+ */
+static guint64
+rspamadm_grep_print_task (struct rspamadm_grep_input *in,
+		struct rspamadm_grep_task *task, gboolean print)
+{
+	guint64 off, start = 0, end = G_MAXUINT64;
+	const gchar *line;
+	guint i;
+
+	for (i = 0; i < task->lines->len; i ++) {
+		off = g_array_index (task->lines, guint64, i);
+		line = in->data + off;
+
+		if (rspamadm_grep_is_end (line,
+				rspamadm_grep_line_end (line, in->data + in->len))) {
+			if (off < task->first_match) {
+				start = i + 1;
+			}
+			else {
+				end = off;
+				break;
+			}
+		}
+	}
+
+	if (print) {
+		for (i = start; i < task->lines->len; i ++) {
+			off = g_array_index (task->lines, guint64, i);
+			rspamadm_grep_print_line (in, off);
+
+			if (off == end) {
+				break;
+			}
+		}
+
+		fputc ('\n', stdout);
+	}
+
+	return end;
+}
+
+static void
+rspamadm_grep_process (struct rspamadm_grep_input *in, gboolean seekable)
+{
+	struct rspamadm_grep_worker *workers;
+	struct rspamadm_grep_task *task;
+	struct rspamadm_grep_task_line *tl;
+	struct rspamadm_grep_event ev;
+	GThread **threads;
+	GArray *events;
+	GError *err = NULL;
+	gchar *index_path = NULL, *idstr;
+	const gchar *line, *le, *id;
+	guint i, j, nworkers;
+	guint64 off, end;
+	gsize pos, idlen;
+	gboolean build_index = FALSE, have_index = FALSE;
+
+	if (in->len == 0) {
+		return;
+	}
+
+	if (use_index && seekable) {
+		index_path = g_strconcat (in->name, GREP_INDEX_SUFFIX, NULL);
+		have_index = rspamadm_grep_load_index (in, index_path);
+		build_index = !have_index;
+	}
+
+	nworkers = MAX (1, MIN ((gsize)nthreads, in->len / (64 * 1024) + 1));
+	workers = g_malloc0 (sizeof (*workers) * nworkers);
+	threads = g_malloc0 (sizeof (*threads) * nworkers);
+
+	/* Split input to ranges at lines boundaries */
+	for (i = 0, pos = 0; i < nworkers; i ++) {
+		workers[i].in = in;
+		workers[i].begin = pos;
+
+		if (i == nworkers - 1) {
+			pos = in->len;
+		}
+		else {
+			pos = MAX (pos, (in->len / nworkers) * (i + 1));
+
+			if (pos < in->len) {
+				pos = rspamadm_grep_line_end (in->data + pos,
+						in->data + in->len) - in->data;
+				pos = MIN (pos + 1, in->len);
+			}
+		}
+
+		workers[i].end = pos;
+		workers[i].matches = g_array_new (FALSE, FALSE, sizeof (guint64));
+		workers[i].lines = g_array_new (FALSE, FALSE,
+				sizeof (struct rspamadm_grep_task_line));
+
+		if (build_index) {
+			workers[i].index = g_array_new (FALSE, FALSE,
+					sizeof (struct rspamadm_grep_index_rec));
+		}
+
+		/* Matchers are not shared as they keep scratch space inside */
+		if (pattern) {
+			workers[i].re = rspamd_regexp_new (pattern, NULL, &err);
+			g_assert (workers[i].re != NULL);
+		}
+		else {
+			workers[i].mp = rspamd_multipattern_create (sensitive ?
+					RSPAMD_MULTIPATTERN_DEFAULT : RSPAMD_MULTIPATTERN_ICASE);
+			rspamd_multipattern_add_pattern (workers[i].mp, string, 0);
+
+			if (!rspamd_multipattern_compile (workers[i].mp, &err)) {
+				rspamd_fprintf (stderr, "Couldn't compile pattern: %e\n", err);
+				exit (1);
+			}
+		}
+
+		threads[i] = rspamd_create_thread ("grep",
+				rspamadm_grep_search_thread, &workers[i], &err);
+		g_assert (threads[i] != NULL);
+	}
+
+	for (i = 0; i < nworkers; i ++) {
+		g_thread_join (threads[i]);
+	}
+
+	if (build_index) {
+		rspamadm_grep_write_index (in, index_path, workers, nworkers);
+	}
+
+	/* Matches are merged in the order of input */
+	in->tasks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+			rspamadm_grep_task_dtor);
+	events = g_array_new (FALSE, FALSE, sizeof (struct rspamadm_grep_event));
+
+	for (i = 0; i < nworkers; i ++) {
+		for (j = 0; j < workers[i].matches->len; j ++) {
+			off = g_array_index (workers[i].matches, guint64, j);
+			line = in->data + off;
+			le = rspamadm_grep_line_end (line, in->data + in->len);
+			id = rspamadm_grep_task_id (line, le, &idlen);
+
+			if (id == NULL) {
+				if (orphans) {
+					ev.offset = off;
+					ev.task = NULL;
+					g_array_append_val (events, ev);
+				}
+			}
+			else {
+				idstr = g_strndup (id, idlen);
+
+				if (g_hash_table_lookup (in->tasks, idstr) == NULL) {
+					task = g_malloc0 (sizeof (*task));
+					task->first_match = off;
+					task->lines = g_array_new (FALSE, FALSE, sizeof (guint64));
+					g_hash_table_insert (in->tasks, idstr, task);
+				}
+				else {
+					g_free (idstr);
+				}
+			}
+		}
+	}
+
+	if (g_hash_table_size (in->tasks) > 0) {
+		if (have_index) {
+			rspamadm_grep_collect_index (in);
+		}
+		else {
+			for (i = 0; i < nworkers; i ++) {
+				threads[i] = rspamd_create_thread ("grep",
+						rspamadm_grep_collect_thread, &workers[i], &err);
+				g_assert (threads[i] != NULL);
+			}
+
+			for (i = 0; i < nworkers; i ++) {
+				g_thread_join (threads[i]);
+
+				for (j = 0; j < workers[i].lines->len; j ++) {
+					tl = &g_array_index (workers[i].lines,
+							struct rspamadm_grep_task_line, j);
+					g_array_append_val (tl->task->lines, tl->offset);
+				}
+			}
+		}
+	}
+
+	/* Tasks are printed when their last line is met, as a sequential scan does */
+	{
+		GHashTableIter it;
+		gpointer k, v;
+		GPtrArray *incomplete = g_ptr_array_new ();
+
+		g_hash_table_iter_init (&it, in->tasks);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			task = v;
+			end = rspamadm_grep_print_task (in, task, FALSE);
+
+			if (end == G_MAXUINT64) {
+				g_ptr_array_add (incomplete, task);
+			}
+			else {
+				ev.offset = end;
+				ev.task = task;
+				g_array_append_val (events, ev);
+			}
+		}
+
+		qsort (events->data, events->len, sizeof (struct rspamadm_grep_event),
+				rspamadm_grep_event_cmp);
+
+		for (i = 0; i < events->len; i ++) {
+			ev = g_array_index (events, struct rspamadm_grep_event, i);
+
+			if (ev.task) {
+				rspamadm_grep_print_task (in, ev.task, TRUE);
+			}
+			else {
+				rspamd_printf ("*** orphaned ***\n");
+				rspamadm_grep_print_line (in, ev.offset);
+				fputc ('\n', stdout);
+			}
+		}
+
+		if (partial) {
+			for (i = 0; i < incomplete->len; i ++) {
+				rspamd_printf ("*** partial ***\n");
+				rspamadm_grep_print_task (in, g_ptr_array_index (incomplete, i),
+						TRUE);
+			}
+		}
+
+		g_ptr_array_free (incomplete, TRUE);
+	}
+
+	fflush (stdout);
+
+	for (i = 0; i < nworkers; i ++) {
+		g_array_free (workers[i].matches, TRUE);
+		g_array_free (workers[i].lines, TRUE);
+
+		if (workers[i].index) {
+			g_array_free (workers[i].index, TRUE);
+		}
+
+		if (workers[i].re) {
+			rspamd_regexp_unref (workers[i].re);
+		}
+
+		if (workers[i].mp) {
+			rspamd_multipattern_destroy (workers[i].mp);
+		}
+	}
+
+	g_array_free (events, TRUE);
+	g_free (workers);
+	g_free (threads);
+	g_free (index_path);
+}
+
 static void
 rspamadm_grep (gint argc, gchar **argv)
 {
 	GOptionContext *context;
 	GError *error = NULL;
-	lua_State *L;
-	ucl_object_t *obj, *nobj;
-	gchar **elt;
+	struct rspamadm_grep_input in;
+	rspamd_regexp_t *re;
+	gchar **elt, *stdin_inputs[] = {"stdin", NULL};
+	gboolean seekable;
 
 	context = g_option_context_new (
 			"grep - search for patterns in rspamd logs");
@@ -110,40 +912,29 @@ rspamadm_grep (gint argc, gchar **argv)
 		exit (1);
 	}
 
-	L = rspamd_lua_init ();
+	if (pattern) {
+		re = rspamd_regexp_new (pattern, NULL, &error);
 
-	obj = ucl_object_typed_new (UCL_OBJECT);
-	if (string) {
-		ucl_object_insert_key (obj, ucl_object_fromstring (string),
-				"string", 0, false);
+		if (re == NULL) {
+			rspamd_fprintf (stderr, "Couldn't compile regex: %s: %e\n",
+					pattern, error);
+			exit (1);
+		}
+
+		rspamd_regexp_unref (re);
 	}
-	if (pattern) {
-		ucl_object_insert_key (obj, ucl_object_fromstring (pattern),
-				"pattern", 0, false);
+
+	if (nthreads <= 0) {
+		nthreads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
 	}
-	nobj = ucl_object_typed_new (UCL_ARRAY);
-	if (!inputs) {
-		ucl_array_append (nobj, ucl_object_fromstring ("stdin"));
+
+	for (elt = inputs ? inputs : stdin_inputs; *elt != NULL; elt ++) {
+		memset (&in, 0, sizeof (in));
+		in.name = *elt;
+
+		if (rspamadm_grep_open_input (&in, &seekable)) {
+			rspamadm_grep_process (&in, seekable);
+			rspamadm_grep_close_input (&in);
+		}
 	}
-	else {
-		for (elt = inputs; *elt != NULL; elt ++) {
-			ucl_array_append (nobj, ucl_object_fromstring (*elt));
-		}
-	}
-	ucl_object_insert_key (obj, nobj, "inputs", 0, false);
-	ucl_object_insert_key (obj, ucl_object_frombool (sensitive),
-			"sensitive", 0, false);
-	ucl_object_insert_key (obj, ucl_object_frombool (orphans),
-			"orphans", 0, false);
-	ucl_object_insert_key (obj, ucl_object_frombool (partial),
-			"partial", 0, false);
-
-	rspamadm_execute_lua_ucl_subr (L,
-			argc,
-			argv,
-			obj,
-			rspamadm_script_grep);
-
-	lua_close (L);
-	ucl_object_unref (obj);
 }
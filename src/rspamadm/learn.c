@@ -0,0 +1,444 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "cfg_file.h"
+#include "cfg_rcl.h"
+#include "rspamd.h"
+#include "task.h"
+#include "libmime/message.h"
+#include "libstat/stat_api.h"
+#include "lua/lua_common.h"
+#include "unix-std.h"
+#include <sys/wait.h>
+
+static gchar *config = NULL;
+static gchar *classifier = NULL;
+static gboolean learn_spam = FALSE;
+static gboolean learn_ham = FALSE;
+static gint jobs = 1;
+static gint batch = 10000;
+extern struct rspamd_main *rspamd_main;
+/* Defined in modules.c */
+extern module_t *modules[];
+extern worker_t *workers[];
+
+static void rspamadm_learn (gint argc, gchar **argv);
+static const char *rspamadm_learn_help (gboolean full_help);
+
+struct rspamadm_command learn_command = {
+		.name = "learn",
+		.flags = 0,
+		.help = rspamadm_learn_help,
+		.run = rspamadm_learn
+};
+
+static GOptionEntry entries[] = {
+		{"config", 'c', 0, G_OPTION_ARG_STRING, &config,
+				"Config file to use",     NULL},
+		{"spam", 's', 0, G_OPTION_ARG_NONE, &learn_spam,
+				"Learn messages as spam", NULL},
+		{"ham", 'H', 0, G_OPTION_ARG_NONE, &learn_ham,
+				"Learn messages as ham", NULL},
+		{"classifier", 'C', 0, G_OPTION_ARG_STRING, &classifier,
+				"Learn only the specified classifier", NULL},
+		{"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+				"Number of parallel processes", NULL},
+		{"batch", 'b', 0, G_OPTION_ARG_INT, &batch,
+				"Number of messages merged before writing to backends", NULL},
+		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+struct rspamadm_learn_ctx {
+	struct rspamd_config *cfg;
+	struct event_base *ev_base;
+	struct rspamd_stat_bulk *bulk;
+	guint64 seen;
+	guint64 learned;
+	guint64 skipped;
+	guint64 failed;
+	gint job;
+};
+
+static const char *
+rspamadm_learn_help (gboolean full_help)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Learn many messages at once bypassing the controller\n\n"
+				"Usage: rspamadm learn -s|-H [-c <config_name>] [-j <jobs>] "
+				"<path> [<path> ...]\n"
+				"Where options are:\n\n"
+				"-s: learn messages as spam\n"
+				"-H: learn messages as ham\n"
+				"-c: config file to use\n"
+				"-C: learn only the specified classifier\n"
+				"-j: number of parallel processes\n"
+				"-b: number of messages merged before writing to backends\n"
+				"--help: shows available options and commands\n\n"
+				"Paths could be message files, mbox files, maildirs or "
+				"plain directories of messages.\n"
+				"Learn cache and learn conditions are not checked.";
+	}
+	else {
+		help_str = "Learn many messages at once bypassing the controller";
+	}
+
+	return help_str;
+}
+
+static void
+config_logger (rspamd_mempool_t *pool, gpointer ud)
+{
+	struct rspamd_main *rm = ud;
+	GQuark learn_quark = g_quark_from_static_string ("learn");
+
+	rm->cfg->log_type = RSPAMD_LOG_CONSOLE;
+	rm->cfg->log_level = G_LOG_LEVEL_WARNING;
+
+	rspamd_set_logger (rm->cfg, learn_quark, &rm->logger,
+			rm->server_pool);
+	if (rspamd_log_open_priv (rm->logger, rm->workers_uid, rm->workers_gid) ==
+			-1) {
+		fprintf (stderr, "Fatal error, cannot open logfile, exiting\n");
+		exit (EXIT_FAILURE);
+	}
+}
+
+static gboolean
+rspamadm_learn_session_fin (gpointer ud)
+{
+	return TRUE;
+}
+
+static void
+rspamadm_learn_flush (struct rspamadm_learn_ctx *ctx)
+{
+	struct rspamd_task *task;
+	GError *err = NULL;
+
+	if (rspamd_stat_bulk_pending (ctx->bulk) == 0) {
+		return;
+	}
+
+	task = rspamd_task_new (NULL, ctx->cfg);
+	task->ev_base = ctx->ev_base;
+	task->s = rspamd_session_create (task->task_pool,
+			rspamadm_learn_session_fin, NULL, NULL, task);
+
+	if (rspamd_stat_bulk_flush (ctx->bulk, task, &err) !=
+			RSPAMD_STAT_PROCESS_OK) {
+		rspamd_fprintf (stderr, "cannot write learned tokens: %e\n", err);
+		g_error_free (err);
+		exit (EXIT_FAILURE);
+	}
+
+	/* Wait for asynchronous backends to finish */
+	while (rspamd_session_events_pending (task->s) > 0) {
+		event_base_loop (ctx->ev_base, EVLOOP_ONCE);
+	}
+
+	rspamd_session_destroy (task->s);
+	rspamd_task_free (task);
+}
+
+static void
+rspamadm_learn_message (struct rspamadm_learn_ctx *ctx, const gchar *path,
+		const gchar *data, gsize len)
+{
+	struct rspamd_task *task;
+	GError *err = NULL;
+
+	/* Messages are spread between jobs by their ordinal */
+	if (ctx->seen ++ % jobs != (guint64)ctx->job) {
+		return;
+	}
+
+	task = rspamd_task_new (NULL, ctx->cfg);
+	task->ev_base = ctx->ev_base;
+
+	if (!rspamd_task_load_message (task, NULL, data, len) ||
+			!rspamd_message_parse (task)) {
+		rspamd_fprintf (stderr, "cannot parse message from %s\n", path);
+		ctx->failed ++;
+	}
+	else if (!rspamd_stat_bulk_add (ctx->bulk, task, learn_spam, &err)) {
+		ctx->skipped ++;
+
+		if (err) {
+			g_error_free (err);
+		}
+	}
+	else {
+		ctx->learned ++;
+	}
+
+	rspamd_task_free (task);
+
+	if (rspamd_stat_bulk_pending (ctx->bulk) >= (guint)batch) {
+		rspamadm_learn_flush (ctx);
+	}
+}
+
+static void
+rspamadm_learn_mbox (struct rspamadm_learn_ctx *ctx, const gchar *path,
+		const gchar *data, gsize len)
+{
+	const gchar *p = data, *end = data + len, *eol;
+	goffset next;
+
+	while (p < end) {
+		/* Skip the `From ` separator line */
+		eol = memchr (p, '\n', end - p);
+
+		if (eol == NULL) {
+			break;
+		}
+
+		p = eol + 1;
+		next = rspamd_substring_search (p, end - p, "\nFrom ", 6);
+
+		if (next == -1) {
+			rspamadm_learn_message (ctx, path, p, end - p);
+			break;
+		}
+
+		rspamadm_learn_message (ctx, path, p, next + 1);
+		p += next + 1;
+	}
+}
+
+static void rspamadm_learn_path (struct rspamadm_learn_ctx *ctx,
+		const gchar *path, gboolean recursive);
+
+static void
+rspamadm_learn_dir (struct rspamadm_learn_ctx *ctx, const gchar *path,
+		gboolean recursive)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *fpath;
+	GError *err = NULL;
+
+	dir = g_dir_open (path, 0, &err);
+
+	if (dir == NULL) {
+		rspamd_fprintf (stderr, "cannot open %s: %e\n", path, err);
+		g_error_free (err);
+		ctx->failed ++;
+
+		return;
+	}
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		fpath = g_build_filename (path, name, NULL);
+
+		if (recursive ||
+				!g_file_test (fpath, G_FILE_TEST_IS_DIR)) {
+			rspamadm_learn_path (ctx, fpath, FALSE);
+		}
+
+		g_free (fpath);
+	}
+
+	g_dir_close (dir);
+}
+
+static void
+rspamadm_learn_path (struct rspamadm_learn_ctx *ctx, const gchar *path,
+		gboolean recursive)
+{
+	gchar *sub;
+	gpointer map;
+	gsize len;
+
+	if (g_file_test (path, G_FILE_TEST_IS_DIR)) {
+		sub = g_build_filename (path, "cur", NULL);
+
+		if (g_file_test (sub, G_FILE_TEST_IS_DIR)) {
+			/* Maildir */
+			rspamadm_learn_dir (ctx, sub, FALSE);
+			g_free (sub);
+			sub = g_build_filename (path, "new", NULL);
+			rspamadm_learn_dir (ctx, sub, FALSE);
+		}
+		else if (recursive) {
+			rspamadm_learn_dir (ctx, path, FALSE);
+		}
+
+		g_free (sub);
+
+		return;
+	}
+
+	map = rspamd_file_xmap (path, PROT_READ, &len);
+
+	if (map == NULL) {
+		rspamd_fprintf (stderr, "cannot open %s: %s\n", path, strerror (errno));
+		ctx->failed ++;
+
+		return;
+	}
+
+	if (len > 5 && memcmp (map, "From ", 5) == 0) {
+		rspamadm_learn_mbox (ctx, path, map, len);
+	}
+	else if (len > 0) {
+		rspamadm_learn_message (ctx, path, map, len);
+	}
+
+	munmap (map, len);
+}
+
+static gint
+rspamadm_learn_job (struct rspamd_config *cfg, gint job, gint argc,
+		gchar **argv)
+{
+	struct rspamadm_learn_ctx ctx;
+	gint i;
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.cfg = cfg;
+	ctx.job = job;
+	/* Backends are opened after fork, as sqlite handles cannot be shared */
+	ctx.ev_base = event_init ();
+	rspamd_stat_init (cfg, ctx.ev_base);
+	ctx.bulk = rspamd_stat_bulk_new (classifier);
+
+	for (i = 1; i < argc; i ++) {
+		rspamadm_learn_path (&ctx, argv[i], TRUE);
+	}
+
+	rspamadm_learn_flush (&ctx);
+	rspamd_stat_bulk_destroy (ctx.bulk);
+	rspamd_stat_close ();
+
+	rspamd_printf ("job %d: learned %L, skipped %L, failed %L messages as %s\n",
+			job, (gint64)ctx.learned, (gint64)ctx.skipped,
+			(gint64)ctx.failed, learn_spam ? "spam" : "ham");
+
+	return ctx.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void
+rspamadm_learn (gint argc, gchar **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	const gchar *confdir;
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	worker_t **pworker;
+	gint i, status, ret = EXIT_SUCCESS;
+	pid_t pid;
+
+	context = g_option_context_new (
+			"learn - learn many messages at once");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (learn_spam == learn_ham) {
+		fprintf (stderr, "exactly one of --spam or --ham must be specified\n");
+		exit (1);
+	}
+
+	if (argc < 2) {
+		fprintf (stderr, "no messages to learn\n");
+		exit (1);
+	}
+
+	if (jobs < 1) {
+		jobs = 1;
+	}
+
+	if (batch < 1) {
+		batch = 1;
+	}
+
+	if (config == NULL) {
+		if ((confdir = g_hash_table_lookup (ucl_vars, "CONFDIR")) == NULL) {
+			confdir = RSPAMD_CONFDIR;
+		}
+
+		config = g_strdup_printf ("%s%c%s", confdir, G_DIR_SEPARATOR,
+				"rspamd.conf");
+	}
+
+	pworker = &workers[0];
+	while (*pworker) {
+		/* Init string quarks */
+		(void) g_quark_from_static_string ((*pworker)->name);
+		pworker++;
+	}
+	cfg->cache = rspamd_symbols_cache_new (cfg);
+	cfg->compiled_modules = modules;
+	cfg->compiled_workers = workers;
+	cfg->cfg_name = config;
+
+	if (!rspamd_config_read (cfg, cfg->cfg_name, NULL,
+			config_logger, rspamd_main, ucl_vars)) {
+		fprintf (stderr, "cannot load config %s\n", config);
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_lua_post_load_config (cfg);
+
+	if (!rspamd_config_post_load (cfg, RSPAMD_CONFIG_INIT_URL |
+			RSPAMD_CONFIG_INIT_LIBS)) {
+		fprintf (stderr, "cannot init config %s\n", config);
+		exit (EXIT_FAILURE);
+	}
+
+	if (jobs == 1) {
+		exit (rspamadm_learn_job (cfg, 0, argc, argv));
+	}
+
+	for (i = 0; i < jobs; i ++) {
+		pid = fork ();
+
+		if (pid == 0) {
+			exit (rspamadm_learn_job (cfg, i, argc, argv));
+		}
+		else if (pid == -1) {
+			fprintf (stderr, "cannot fork: %s\n", strerror (errno));
+			jobs = i;
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	for (i = 0; i < jobs; i ++) {
+		if (wait (&status) == -1) {
+			break;
+		}
+
+		if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS) {
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	exit (ret);
+}
@@ -15,16 +15,29 @@
  */
 #include "config.h"
 #include "rspamadm.h"
-#include "lua/lua_common.h"
-#include "stat_convert.lua.h"
+#include "rspamd.h"
+#include "libstat/backends/backends.h"
+#include "unix-std.h"
+#include <sqlite3.h>
+#include <sys/wait.h>
+#ifdef WITH_HIREDIS
+#include "hiredis.h"
+#endif
+
+#define STATCONVERT_CHECKPOINT_MAGIC "rscvt01"
+#define STATCONVERT_TIMEOUT 5.0
 
 static gchar *source_db = NULL;
+static gchar *source_mmap = NULL;
 static gchar *redis_host = NULL;
 static gchar *symbol = NULL;
 static gchar *cache_db = NULL;
 static gchar *redis_db = NULL;
 static gchar *redis_password = NULL;
+static gchar *checkpoint = NULL;
 static gboolean reset_previous = FALSE;
+static gint jobs = 1;
+static gint batch = 10000;
 
 static void rspamadm_statconvert (gint argc, gchar **argv);
 static const char *rspamadm_statconvert_help (gboolean full_help);
@@ -39,6 +52,8 @@ struct rspamadm_command statconvert_command = {
 static GOptionEntry entries[] = {
 		{"database", 'd', 0, G_OPTION_ARG_FILENAME, &source_db,
 				"Input sqlite",      NULL},
+		{"mmap", 'm', 0, G_OPTION_ARG_FILENAME, &source_mmap,
+				"Input mmapped statfile",      NULL},
 		{"cache", 'c', 0, G_OPTION_ARG_FILENAME, &cache_db,
 				"Input learn cache",      NULL},
 		{"host", 'h', 0, G_OPTION_ARG_STRING, &redis_host,
@@ -51,9 +66,39 @@ static GOptionEntry entries[] = {
 				"Password to connect to redis", NULL},
 		{"reset", 'r', 0, G_OPTION_ARG_NONE, &reset_previous,
 				"Reset previous data instead of appending values", NULL},
+		{"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+				"Number of parallel connections to redis", NULL},
+		{"batch", 'b', 0, G_OPTION_ARG_INT, &batch,
+				"Number of tokens sent in a single pipeline", NULL},
+		{"checkpoint", 'C', 0, G_OPTION_ARG_FILENAME, &checkpoint,
+				"File to save progress to and resume from", NULL},
 		{NULL,     0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
 };
 
+/* Redis key and learns of an sqlite user */
+struct rspamadm_statconvert_user {
+	gchar *key;
+	gint64 learns;
+};
+
+struct rspamadm_statconvert_ckpt_hdr {
+	gchar magic[8];
+	guint64 nchunks;
+	guint64 batch;
+};
+
+struct rspamadm_statconvert_ctx {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	struct rspamd_mmaped_file_reader *mf;
+	GHashTable *users;
+	gchar *global_key;
+	gint64 global_learns;
+	gint64 min_rowid;
+	guint64 nchunks;
+	guchar *done; /* chunks converted by previous runs, the last is learns */
+	gint ckpt_fd;
+};
 
 static const char *
 rspamadm_statconvert_help (gboolean full_help)
@@ -61,31 +106,563 @@ rspamadm_statconvert_help (gboolean full_help)
 	const char *help_str;
 
 	if (full_help) {
-		help_str = "Convert statistics from sqlite3 to redis\n\n"
-				"Usage: rspamadm statconvert -d <sqlite_db> -h <redis_ip> -s <symbol>\n"
+		help_str = "Convert statistics from sqlite3 or mmap to redis\n\n"
+				"Usage: rspamadm statconvert -d <sqlite_db>|-m <statfile> "
+				"-h <redis_ip> -s <symbol>\n"
 				"Where options are:\n\n"
 				"-d: input sqlite\n"
+				"-m: input mmapped statfile\n"
 				"-h: output redis ip (in format ip:port)\n"
 				"-s: symbol in redis (e.g. BAYES_SPAM)\n"
 				"-c: also convert data from the learn cache\n"
 				"-D: output redis database\n"
 				"-p: redis password\n"
-				"-r: reset previous data instead of increasing values\n";
+				"-r: reset previous data instead of increasing values\n"
+				"-j: number of parallel connections to redis\n"
+				"-b: number of tokens sent in a single pipeline\n"
+				"-C: file to save progress to; the same command resumes "
+				"an interrupted conversion\n\n"
+				"A batch interrupted in flight is written again on resume.";
 	}
 	else {
-		help_str = "Convert statistics from sqlite3 to redis";
+		help_str = "Convert statistics from sqlite3 or mmap to redis";
 	}
 
 	return help_str;
 }
 
+#ifdef WITH_HIREDIS
+static redisContext *
+rspamadm_statconvert_connect (void)
+{
+	redisContext *c;
+	redisReply *reply;
+	struct timeval tv;
+	gchar *host, *p;
+	gulong port = 6379;
+
+	double_to_tv (STATCONVERT_TIMEOUT, &tv);
+
+	if (redis_host[0] == '/') {
+		c = redisConnectUnixWithTimeout (redis_host, tv);
+	}
+	else {
+		host = g_strdup (redis_host);
+		p = strrchr (host, ':');
+
+		if (p && strchr (host, ':') == p) {
+			*p++ = '\0';
+			rspamd_strtoul (p, strlen (p), &port);
+		}
+		else if (host[0] == '[' && (p = strstr (host, "]:")) != NULL) {
+			*p = '\0';
+			p += 2;
+			rspamd_strtoul (p, strlen (p), &port);
+			memmove (host, host + 1, strlen (host));
+		}
+
+		c = redisConnectWithTimeout (host, port, tv);
+		g_free (host);
+	}
+
+	if (c == NULL || c->err) {
+		rspamd_fprintf (stderr, "cannot connect to %s: %s\n", redis_host,
+				c ? c->errstr : "no memory");
+
+		if (c) {
+			redisFree (c);
+		}
+
+		return NULL;
+	}
+
+	redisSetTimeout (c, tv);
+
+	if (redis_password) {
+		reply = redisCommand (c, "AUTH %s", redis_password);
+
+		if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+			rspamd_fprintf (stderr, "cannot auth to %s: %s\n", redis_host,
+					reply ? reply->str : c->errstr);
+			goto err;
+		}
+
+		freeReplyObject (reply);
+	}
+
+	if (redis_db) {
+		reply = redisCommand (c, "SELECT %s", redis_db);
+
+		if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+			rspamd_fprintf (stderr, "cannot select db %s: %s\n", redis_db,
+					reply ? reply->str : c->errstr);
+			goto err;
+		}
+
+		freeReplyObject (reply);
+	}
+
+	return c;
+
+err:
+	if (reply) {
+		freeReplyObject (reply);
+	}
+
+	redisFree (c);
+
+	return NULL;
+}
+
+/* Reads replies for all pipelined commands */
+static gboolean
+rspamadm_statconvert_wait (redisContext *c, guint ncmds)
+{
+	redisReply *reply;
+	gboolean ret = TRUE;
+	guint i;
+
+	for (i = 0; i < ncmds; i ++) {
+		if (redisGetReply (c, (void **)&reply) != REDIS_OK) {
+			rspamd_fprintf (stderr, "cannot get reply from %s: %s\n",
+					redis_host, c->errstr);
+
+			return FALSE;
+		}
+
+		if (reply->type == REDIS_REPLY_ERROR) {
+			if (ret) {
+				rspamd_fprintf (stderr, "redis error: %s\n", reply->str);
+			}
+
+			ret = FALSE;
+		}
+
+		freeReplyObject (reply);
+	}
+
+	return ret;
+}
+
+static void
+rspamadm_statconvert_append_token (redisContext *c, const gchar *key,
+		guint64 token, gdouble value)
+{
+	gchar n0[64], n1[64];
+
+	rspamd_snprintf (n0, sizeof (n0), "%uL", token);
+
+	if (value == (gint64)value) {
+		rspamd_snprintf (n1, sizeof (n1), "%L", (gint64)value);
+		redisAppendCommand (c, "HINCRBY %s %s %s", key, n0, n1);
+	}
+	else {
+		rspamd_snprintf (n1, sizeof (n1), "%f", value);
+		redisAppendCommand (c, "HINCRBYFLOAT %s %s %s", key, n0, n1);
+	}
+}
+
+/* Appends tokens of a chunk, returns number of appended commands or -1 */
+static gint64
+rspamadm_statconvert_read_chunk (struct rspamadm_statconvert_ctx *ctx,
+		redisContext *c, guint64 chunk)
+{
+	struct rspamadm_statconvert_user *user;
+	guint64 i, end, token;
+	gdouble value;
+	gint64 n = 0, uid;
+	gint rc;
+
+	if (ctx->mf) {
+		end = MIN ((chunk + 1) * batch, rspamd_mmaped_file_reader_blocks (ctx->mf));
+
+		for (i = chunk * batch; i < end; i ++) {
+			if (rspamd_mmaped_file_reader_get (ctx->mf, i, &token, &value)) {
+				rspamadm_statconvert_append_token (c, ctx->global_key,
+						token, value);
+				n ++;
+			}
+		}
+
+		return n;
+	}
+
+	sqlite3_reset (ctx->stmt);
+	sqlite3_bind_int64 (ctx->stmt, 1, ctx->min_rowid + chunk * batch);
+	sqlite3_bind_int64 (ctx->stmt, 2, ctx->min_rowid + (chunk + 1) * batch);
+
+	while ((rc = sqlite3_step (ctx->stmt)) == SQLITE_ROW) {
+		token = sqlite3_column_int64 (ctx->stmt, 0);
+		value = sqlite3_column_double (ctx->stmt, 1);
+		uid = sqlite3_column_int64 (ctx->stmt, 2);
+		user = g_hash_table_lookup (ctx->users, &uid);
+
+		if (value != 0) {
+			rspamadm_statconvert_append_token (c,
+					user ? user->key : ctx->global_key, token, value);
+			n ++;
+		}
+	}
+
+	if (rc != SQLITE_DONE) {
+		rspamd_fprintf (stderr, "cannot read tokens: %s\n",
+				sqlite3_errmsg (ctx->db));
+
+		return -1;
+	}
+
+	return n;
+}
+
+static void
+rspamadm_statconvert_mark (struct rspamadm_statconvert_ctx *ctx, guint64 idx)
+{
+	guchar done = 1;
+
+	ctx->done[idx] = 1;
+
+	if (ctx->ckpt_fd != -1) {
+		/* Each chunk owns its byte, so jobs do not need any locking */
+		if (pwrite (ctx->ckpt_fd, &done, 1,
+				sizeof (struct rspamadm_statconvert_ckpt_hdr) + idx) != 1) {
+			rspamd_fprintf (stderr, "cannot write checkpoint: %s\n",
+					strerror (errno));
+		}
+	}
+}
+
+static gint
+rspamadm_statconvert_job (struct rspamadm_statconvert_ctx *ctx, gint job)
+{
+	redisContext *c;
+	guint64 chunk, ntokens = 0;
+	gint64 n;
+	gint ret = EXIT_SUCCESS;
+
+	if (source_db) {
+		/* sqlite handles cannot be shared between processes */
+		if (sqlite3_open_v2 (source_db, &ctx->db, SQLITE_OPEN_READONLY,
+				NULL) != SQLITE_OK ||
+				sqlite3_prepare_v2 (ctx->db, "SELECT token,value,user FROM "
+				"tokens WHERE rowid >= ?1 AND rowid < ?2;", -1, &ctx->stmt,
+				NULL) != SQLITE_OK) {
+			rspamd_fprintf (stderr, "cannot read source db %s: %s\n",
+					source_db, sqlite3_errmsg (ctx->db));
+
+			return EXIT_FAILURE;
+		}
+	}
+
+	c = rspamadm_statconvert_connect ();
+
+	if (c == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	for (chunk = job; chunk < ctx->nchunks; chunk += jobs) {
+		if (ctx->done[chunk]) {
+			continue;
+		}
+
+		n = rspamadm_statconvert_read_chunk (ctx, c, chunk);
+
+		if (n == -1 || !rspamadm_statconvert_wait (c, n)) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		ntokens += n;
+		rspamadm_statconvert_mark (ctx, chunk);
+	}
+
+	redisFree (c);
+
+	if (ctx->stmt) {
+		sqlite3_finalize (ctx->stmt);
+		ctx->stmt = NULL;
+	}
+
+	if (ctx->db) {
+		sqlite3_close (ctx->db);
+		ctx->db = NULL;
+	}
+
+	if (jobs > 1) {
+		rspamd_printf ("job %d: migrated %uL tokens\n", job, ntokens);
+	}
+
+	return ret;
+}
+
+static gboolean
+rspamadm_statconvert_learned (redisContext *c)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	const guchar *digest;
+	gchar *b32;
+	guint64 converted = 0;
+	guint ncmds = 0;
+	gint rc;
+	gboolean ret;
+
+	if (sqlite3_open_v2 (cache_db, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+			sqlite3_prepare_v2 (db, "SELECT digest,flag FROM learns;", -1,
+					&stmt, NULL) != SQLITE_OK) {
+		rspamd_fprintf (stderr, "cannot open cache database %s: %s\n",
+				cache_db, sqlite3_errmsg (db));
+		sqlite3_close (db);
+
+		return FALSE;
+	}
+
+	while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+		digest = sqlite3_column_blob (stmt, 0);
+
+		if (digest == NULL) {
+			continue;
+		}
+
+		b32 = rspamd_encode_base32 (digest, sqlite3_column_bytes (stmt, 0));
+		redisAppendCommand (c, "HSET learned_ids %s %s", b32,
+				sqlite3_column_int (stmt, 1) == 0 ? "-1" : "1");
+		g_free (b32);
+		converted ++;
+
+		if (++ncmds >= (guint)batch) {
+			if (!rspamadm_statconvert_wait (c, ncmds)) {
+				break;
+			}
+
+			ncmds = 0;
+		}
+	}
+
+	ret = rc == SQLITE_DONE && rspamadm_statconvert_wait (c, ncmds);
+	sqlite3_finalize (stmt);
+	sqlite3_close (db);
+
+	if (ret) {
+		rspamd_printf ("Converted %uL cached items from sqlite3 learned cache "
+				"to redis\n", converted);
+	}
+
+	return ret;
+}
+
+/* Loads users and learns and splits source to chunks */
+static gboolean
+rspamadm_statconvert_prepare (struct rspamadm_statconvert_ctx *ctx)
+{
+	struct rspamadm_statconvert_user *user;
+	sqlite3_stmt *stmt;
+	gint64 *pid, max_rowid;
+	GError *err = NULL;
+
+	ctx->global_key = g_strdup (symbol);
+	ctx->users = g_hash_table_new (g_int64_hash, g_int64_equal);
+
+	if (source_mmap) {
+		ctx->mf = rspamd_mmaped_file_reader_open (source_mmap, &err);
+
+		if (ctx->mf == NULL) {
+			rspamd_fprintf (stderr, "%e\n", err);
+			g_error_free (err);
+
+			return FALSE;
+		}
+
+		ctx->global_learns = rspamd_mmaped_file_reader_learns (ctx->mf);
+		ctx->nchunks = (rspamd_mmaped_file_reader_blocks (ctx->mf) + batch - 1) /
+				batch;
+
+		return TRUE;
+	}
+
+	if (sqlite3_open_v2 (source_db, &ctx->db, SQLITE_OPEN_READONLY, NULL) !=
+			SQLITE_OK) {
+		rspamd_fprintf (stderr, "cannot open source db %s: %s\n", source_db,
+				sqlite3_errmsg (ctx->db));
+
+		return FALSE;
+	}
+
+	if (sqlite3_prepare_v2 (ctx->db, "SELECT id,name,learns FROM users;", -1,
+			&stmt, NULL) == SQLITE_OK) {
+		while (sqlite3_step (stmt) == SQLITE_ROW) {
+			if (sqlite3_column_int64 (stmt, 0) == 0) {
+				ctx->global_learns += sqlite3_column_int64 (stmt, 2);
+				continue;
+			}
+
+			user = g_malloc0 (sizeof (*user));
+			pid = g_malloc (sizeof (*pid));
+			*pid = sqlite3_column_int64 (stmt, 0);
+			user->key = g_strconcat (symbol,
+					(const gchar *)sqlite3_column_text (stmt, 1), NULL);
+			user->learns = sqlite3_column_int64 (stmt, 2);
+			g_hash_table_insert (ctx->users, pid, user);
+		}
+
+		sqlite3_finalize (stmt);
+	}
+
+	/* Workaround for old databases */
+	if (sqlite3_prepare_v2 (ctx->db, "SELECT learns FROM languages;", -1,
+			&stmt, NULL) == SQLITE_OK) {
+		while (sqlite3_step (stmt) == SQLITE_ROW) {
+			ctx->global_learns += sqlite3_column_int64 (stmt, 0);
+		}
+
+		sqlite3_finalize (stmt);
+	}
+
+	if (sqlite3_prepare_v2 (ctx->db, "SELECT MIN(rowid),MAX(rowid) FROM tokens;",
+			-1, &stmt, NULL) != SQLITE_OK ||
+			sqlite3_step (stmt) != SQLITE_ROW) {
+		rspamd_fprintf (stderr, "cannot read tokens from %s: %s\n", source_db,
+				sqlite3_errmsg (ctx->db));
+		sqlite3_close (ctx->db);
+		ctx->db = NULL;
+
+		return FALSE;
+	}
+
+	if (sqlite3_column_type (stmt, 0) != SQLITE_NULL) {
+		ctx->min_rowid = sqlite3_column_int64 (stmt, 0);
+		max_rowid = sqlite3_column_int64 (stmt, 1);
+		ctx->nchunks = (max_rowid - ctx->min_rowid) / batch + 1;
+	}
+
+	sqlite3_finalize (stmt);
+	sqlite3_close (ctx->db);
+	ctx->db = NULL;
+
+	return TRUE;
+}
+
+/* Opens checkpoint, returns FALSE if it belongs to a different conversion */
+static gboolean
+rspamadm_statconvert_open_checkpoint (struct rspamadm_statconvert_ctx *ctx,
+		gboolean *resumed)
+{
+	struct rspamadm_statconvert_ckpt_hdr hdr;
+	gsize len = ctx->nchunks + 1;
+	gssize r;
+
+	ctx->done = g_malloc0 (len);
+	ctx->ckpt_fd = -1;
+	*resumed = FALSE;
+
+	if (checkpoint == NULL) {
+		return TRUE;
+	}
+
+	ctx->ckpt_fd = open (checkpoint, O_RDWR | O_CREAT, 00644);
+
+	if (ctx->ckpt_fd == -1) {
+		rspamd_fprintf (stderr, "cannot open checkpoint %s: %s\n", checkpoint,
+				strerror (errno));
+
+		return FALSE;
+	}
+
+	r = read (ctx->ckpt_fd, &hdr, sizeof (hdr));
+
+	if (r == sizeof (hdr)) {
+		if (memcmp (hdr.magic, STATCONVERT_CHECKPOINT_MAGIC,
+				sizeof (hdr.magic)) != 0 ||
+				hdr.nchunks != ctx->nchunks || hdr.batch != (guint64)batch) {
+			rspamd_fprintf (stderr, "checkpoint %s does not match the source "
+					"or batch size\n", checkpoint);
+
+			return FALSE;
+		}
+
+		/* Missing tail means that these chunks are not converted yet */
+		if (read (ctx->ckpt_fd, ctx->done, len) == -1) {
+			rspamd_fprintf (stderr, "cannot read checkpoint %s: %s\n",
+					checkpoint, strerror (errno));
+
+			return FALSE;
+		}
+
+		*resumed = TRUE;
+
+		return TRUE;
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, STATCONVERT_CHECKPOINT_MAGIC, sizeof (hdr.magic));
+	hdr.nchunks = ctx->nchunks;
+	hdr.batch = batch;
+
+	if (ftruncate (ctx->ckpt_fd, 0) == -1 ||
+			pwrite (ctx->ckpt_fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)) {
+		rspamd_fprintf (stderr, "cannot write checkpoint %s: %s\n", checkpoint,
+				strerror (errno));
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Writes learns and keys set once all tokens are converted */
+static gboolean
+rspamadm_statconvert_finish (struct rspamadm_statconvert_ctx *ctx,
+		redisContext *c, gboolean reset)
+{
+	GHashTableIter it;
+	struct rspamadm_statconvert_user *user;
+	gpointer k, v;
+	guint ncmds = 0;
+	gchar n1[64];
+
+	if (reset) {
+		redisAppendCommand (c, "DEL %s", ctx->global_key);
+		ncmds ++;
+		g_hash_table_iter_init (&it, ctx->users);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			user = v;
+			redisAppendCommand (c, "DEL %s", user->key);
+			ncmds ++;
+		}
+
+		return rspamadm_statconvert_wait (c, ncmds);
+	}
+
+	rspamd_snprintf (n1, sizeof (n1), "%L", ctx->global_learns);
+	redisAppendCommand (c, "HINCRBY %s learns %s", ctx->global_key, n1);
+	redisAppendCommand (c, "SADD %s_keys %s", symbol, ctx->global_key);
+	ncmds += 2;
+	g_hash_table_iter_init (&it, ctx->users);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		user = v;
+		rspamd_snprintf (n1, sizeof (n1), "%L", user->learns);
+		redisAppendCommand (c, "HINCRBY %s learns %s", user->key, n1);
+		redisAppendCommand (c, "SADD %s_keys %s", symbol, user->key);
+		ncmds += 2;
+	}
+
+	return rspamadm_statconvert_wait (c, ncmds);
+}
+#endif
+
 static void
 rspamadm_statconvert (gint argc, gchar **argv)
 {
 	GOptionContext *context;
 	GError *error = NULL;
-	lua_State *L;
-	ucl_object_t *obj;
+#ifdef WITH_HIREDIS
+	struct rspamadm_statconvert_ctx ctx;
+	redisContext *c;
+	gboolean resumed;
+	gint i, status, ret = EXIT_SUCCESS;
+	pid_t pid;
+#endif
 
 	context = g_option_context_new (
 			"statconvert - converts statistics from sqlite3 to redis");
@@ -103,10 +680,14 @@ rspamadm_statconvert (gint argc, gchar **argv)
 		exit (1);
 	}
 
-	if (!source_db) {
+	if (!source_db && !source_mmap) {
 		rspamd_fprintf (stderr, "source db is missing\n");
 		exit (1);
 	}
+	if (source_db && source_mmap) {
+		rspamd_fprintf (stderr, "only one source could be converted at once\n");
+		exit (1);
+	}
 	if (!redis_host) {
 		rspamd_fprintf (stderr, "redis host is missing\n");
 		exit (1);
@@ -115,40 +696,106 @@ rspamadm_statconvert (gint argc, gchar **argv)
 		rspamd_fprintf (stderr, "symbol is missing\n");
 		exit (1);
 	}
+	if (jobs < 1 || batch < 1) {
+		rspamd_fprintf (stderr, "jobs and batch should be positive\n");
+		exit (1);
+	}
 
-	L = rspamd_lua_init ();
+#ifndef WITH_HIREDIS
+	rspamd_fprintf (stderr, "rspamd is built without redis support\n");
+	exit (1);
+#else
+	memset (&ctx, 0, sizeof (ctx));
 
-	obj = ucl_object_typed_new (UCL_OBJECT);
-	ucl_object_insert_key (obj, ucl_object_fromstring (source_db),
-			"source_db", 0, false);
-	ucl_object_insert_key (obj, ucl_object_fromstring (redis_host),
-			"redis_host", 0, false);
-	ucl_object_insert_key (obj, ucl_object_fromstring (symbol),
-			"symbol", 0, false);
-	ucl_object_insert_key (obj, ucl_object_frombool (reset_previous),
-			"reset_previous", 0, false);
+	if (!rspamadm_statconvert_prepare (&ctx) ||
+			!rspamadm_statconvert_open_checkpoint (&ctx, &resumed)) {
+		exit (1);
+	}
 
-	if (cache_db != NULL) {
-		ucl_object_insert_key (obj, ucl_object_fromstring (cache_db),
-				"cache_db", 0, false);
+	if (resumed) {
+		rspamd_printf ("Resuming conversion from %s\n", checkpoint);
 	}
 
-	if (redis_password) {
-		ucl_object_insert_key (obj, ucl_object_fromstring (redis_password),
-				"redis_password", 0, false);
+	c = rspamadm_statconvert_connect ();
+
+	if (c == NULL) {
+		exit (1);
 	}
 
-	if (redis_db) {
-		ucl_object_insert_key (obj, ucl_object_fromstring (redis_db),
-				"redis_db", 0, false);
+	if (cache_db != NULL && !rspamadm_statconvert_learned (c)) {
+		rspamd_fprintf (stderr, "Cannot convert learned cache to redis\n");
+		exit (1);
 	}
 
-	rspamadm_execute_lua_ucl_subr (L,
-			argc,
-			argv,
-			obj,
-			rspamadm_script_stat_convert);
+	/* Previous data is removed once, so all jobs can just increment values */
+	if (reset_previous && !resumed && !rspamadm_statconvert_finish (&ctx, c,
+			TRUE)) {
+		if (checkpoint) {
+			/* Nothing is converted, so the next run should reset data again */
+			unlink (checkpoint);
+		}
+
+		exit (1);
+	}
+
+	redisFree (c);
+
+	if (jobs == 1) {
+		ret = rspamadm_statconvert_job (&ctx, 0);
+	}
+	else {
+		for (i = 0; i < jobs; i ++) {
+			pid = fork ();
+
+			if (pid == 0) {
+				exit (rspamadm_statconvert_job (&ctx, i));
+			}
+			else if (pid == -1) {
+				rspamd_fprintf (stderr, "cannot fork: %s\n", strerror (errno));
+				jobs = i;
+				ret = EXIT_FAILURE;
+				break;
+			}
+		}
+
+		for (i = 0; i < jobs; i ++) {
+			if (wait (&status) == -1) {
+				break;
+			}
+
+			if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS) {
+				ret = EXIT_FAILURE;
+			}
+		}
+	}
+
+	if (ret != EXIT_SUCCESS) {
+		rspamd_fprintf (stderr, "Cannot send tokens to the redis server%s\n",
+				checkpoint ? ", run the same command to resume" : "");
+		exit (ret);
+	}
+
+	if (!ctx.done[ctx.nchunks]) {
+		c = rspamadm_statconvert_connect ();
+
+		if (c == NULL || !rspamadm_statconvert_finish (&ctx, c, FALSE)) {
+			rspamd_fprintf (stderr, "Error occurred during sending learns "
+					"to redis\n");
+			exit (1);
+		}
+
+		redisFree (c);
+		rspamadm_statconvert_mark (&ctx, ctx.nchunks);
+	}
+
+	if (ctx.ckpt_fd != -1) {
+		fsync (ctx.ckpt_fd);
+		close (ctx.ckpt_fd);
+	}
 
-	lua_close (L);
-	ucl_object_unref (obj);
+	rspamd_printf ("Migrated statistics for %ud users for symbol %s\n",
+			g_hash_table_size (ctx.users) + 1, symbol);
+	rspamd_mmaped_file_reader_close (ctx.mf);
+	exit (EXIT_SUCCESS);
+#endif
 }
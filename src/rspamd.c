@@ -19,6 +19,7 @@
 #include "lua/lua_common.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
+#include "libutil/shm_counters.h"
 #include "ottery.h"
 #include "cryptobox.h"
 #include "utlist.h"
@@ -84,6 +85,7 @@ static gchar *privkey = NULL;
 static gchar *rspamd_user = NULL;
 static gchar *rspamd_group = NULL;
 static gchar *rspamd_pidfile = NULL;
+static gchar *config_cache = NULL;
 static gboolean dump_cache = FALSE;
 static gboolean is_debug = FALSE;
 static gboolean is_insecure = FALSE;
@@ -112,6 +114,9 @@ static GOptionEntry entries[] =
 	  "Do not daemonize main process", NULL },
 	{ "config", 'c', 0, G_OPTION_ARG_FILENAME_ARRAY, &cfg_names,
 	  "Specify config file(s)", NULL },
+	{ "config-cache", 0, 0, G_OPTION_ARG_FILENAME, &config_cache,
+	  "Store parsed config in the specified file and load it if config "
+	  "files have not been changed", NULL },
 	{ "user", 'u', 0, G_OPTION_ARG_STRING, &rspamd_user,
 	  "User to run rspamd as", NULL },
 	{ "group", 'g', 0, G_OPTION_ARG_STRING, &rspamd_group,
@@ -536,6 +541,15 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 	worker_t **cw, *wrk;
 	guint i;
 
+	/*
+	 * Collect all garbage left by configuration scripts before forking:
+	 * otherwise each worker sweeps the same objects on its own and breaks
+	 * copy-on-write sharing of the (read-only) config and Lua heap
+	 */
+	if (rspamd_main->cfg->lua_state) {
+		lua_gc (rspamd_main->cfg->lua_state, LUA_GCCOLLECT, 0);
+	}
+
 	/* Special hack for hs_helper if it's not defined in a config */
 	seen_mandatory_workers = g_ptr_array_new ();
 	cur = rspamd_main->cfg->workers;
@@ -668,6 +682,27 @@ kill_old_workers (gpointer key, gpointer value, gpointer unused)
 	}
 }
 
+static void
+drain_log_ring (gpointer key, gpointer value, gpointer unused)
+{
+	struct rspamd_worker *w = value;
+
+	if (w->log_ring) {
+		rspamd_log_ring_drain (w->srv->logger, w->log_ring, w->pid);
+	}
+}
+
+/* Write lines left by a terminated worker */
+static void
+free_log_ring (struct rspamd_worker *w)
+{
+	if (w->log_ring) {
+		rspamd_log_ring_drain (w->srv->logger, w->log_ring, w->pid);
+		rspamd_log_ring_destroy (w->log_ring);
+		w->log_ring = NULL;
+	}
+}
+
 static gboolean
 wait_for_workers (gpointer key, gpointer value, gpointer unused)
 {
@@ -710,6 +745,8 @@ wait_for_workers (gpointer key, gpointer value, gpointer unused)
 			g_quark_to_string (w->type), w->pid,
 			WTERMSIG (res) == SIGKILL ? "hardly" : "softly");
 	event_del (&w->srv_ev);
+	free_log_ring (w);
+	rspamd_shm_counters_free_slot (w->srv->counters, w->counters_slot);
 	g_ptr_array_free (w->finish_actions, TRUE);
 	REF_RELEASE (w->cf);
 	g_free (w);
@@ -742,6 +779,34 @@ rspamd_check_core_cb (const gchar *path, const struct stat *st,
 
 #endif
 
+/*
+ * Loads read-only data in the main process, so workers inherit it on fork
+ * and share its pages instead of loading it in each process
+ */
+static void
+rspamd_main_preload (struct rspamd_main *rspamd_main)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	guint nmaps;
+
+	if (!cfg->fork_preload) {
+		return;
+	}
+
+	nmaps = rspamd_map_preload (cfg);
+
+	if (nmaps > 0) {
+		msg_info_main ("preloaded %ud maps before forking workers", nmaps);
+	}
+
+#ifdef WITH_HYPERSCAN
+	if (cfg->hs_cache_dir && !cfg->disable_hyperscan) {
+		/* Workers keep classes which crc has not been changed */
+		rspamd_re_cache_load_hyperscan (cfg->re_cache, cfg->hs_cache_dir);
+	}
+#endif
+}
+
 static void
 rspamd_check_core_limits (struct rspamd_main *rspamd_main)
 {
@@ -829,6 +894,7 @@ load_rspamd_config (struct rspamd_main *rspamd_main,
 {
 	cfg->compiled_modules = modules;
 	cfg->compiled_workers = workers;
+	cfg->cfg_snapshot = config_cache;
 
 	if (!rspamd_config_read (cfg, cfg->cfg_name, NULL,
 		config_logger, rspamd_main, ucl_vars)) {
@@ -908,22 +974,73 @@ rspamd_usr1_handler (gint signo, short what, gpointer arg)
 			NULL);
 }
 
+static void
+kill_old_service_workers (gpointer key, gpointer value, gpointer unused)
+{
+	struct rspamd_worker *w = value;
+
+	/* Normal workers are kept until the new ones are ready */
+	if (w->type != g_quark_try_string ("normal")) {
+		kill_old_workers (key, value, unused);
+	}
+}
+
+static void
+rspamd_reload_timeout_handler (gint fd, short what, gpointer arg)
+{
+	struct rspamd_main *rspamd_main = arg;
+
+	msg_warn_main ("new workers are not ready after %.1f seconds, "
+			"terminating old workers anyway",
+			rspamd_main->cfg->reload_ready_timeout);
+	rspamd_control_stop_old_workers (rspamd_main, TRUE);
+}
+
 static void
 rspamd_hup_handler (gint signo, short what, gpointer arg)
 {
 	struct rspamd_main *rspamd_main = arg;
+	gboolean wait_ready;
+	struct timeval tv;
 
 	msg_info_main ("rspamd "
 			RVERSION
 			" is restarting");
-	g_hash_table_foreach (rspamd_main->workers, kill_old_workers, NULL);
+	wait_ready = rspamd_main->cfg->reload_wait_ready;
+
+	if (wait_ready) {
+		/* Workers spawned from now on belong to the new generation */
+		rspamd_main->generation ++;
+		g_hash_table_foreach (rspamd_main->workers, kill_old_service_workers,
+				NULL);
+	}
+	else {
+		g_hash_table_foreach (rspamd_main->workers, kill_old_workers, NULL);
+	}
+
 	rspamd_map_remove_all (rspamd_main->cfg);
 	rspamd_log_close_priv (rspamd_main->logger,
 				rspamd_main->workers_uid,
 				rspamd_main->workers_gid);
 	reread_config (rspamd_main);
 	rspamd_check_core_limits (rspamd_main);
+	rspamd_main_preload (rspamd_main);
 	spawn_workers (rspamd_main, rspamd_main->ev_base);
+
+	if (wait_ready) {
+		if (event_get_base (&rspamd_main->reload_ev) &&
+				evtimer_pending (&rspamd_main->reload_ev, NULL)) {
+			evtimer_del (&rspamd_main->reload_ev);
+		}
+
+		evtimer_set (&rspamd_main->reload_ev, rspamd_reload_timeout_handler,
+				rspamd_main);
+		event_base_set (rspamd_main->ev_base, &rspamd_main->reload_ev);
+		double_to_tv (rspamd_main->cfg->reload_ready_timeout, &tv);
+		evtimer_add (&rspamd_main->reload_ev, &tv);
+		/* There might be no normal workers at all */
+		rspamd_control_stop_old_workers (rspamd_main, FALSE);
+	}
 }
 
 static void
@@ -1013,6 +1130,9 @@ rspamd_cld_handler (gint signo, short what, gpointer arg)
 			}
 
 			event_del (&cur->srv_ev);
+			free_log_ring (cur);
+			rspamd_shm_counters_free_slot (rspamd_main->counters,
+					cur->counters_slot);
 			/* We also need to clean descriptors left */
 			close (cur->control_pipe[0]);
 			close (cur->srv_pipe[0]);
@@ -1033,6 +1153,14 @@ rspamd_cld_handler (gint signo, short what, gpointer arg)
 	rspamd_log_lock (rspamd_main->logger);
 }
 
+static void
+rspamd_log_ring_handler (gint fd, short what, gpointer arg)
+{
+	struct rspamd_main *rspamd_main = arg;
+
+	g_hash_table_foreach (rspamd_main->workers, drain_log_ring, NULL);
+}
+
 static void
 rspamd_final_term_handler (gint signo, short what, gpointer arg)
 {
@@ -1112,8 +1240,9 @@ main (gint argc, gchar **argv, gchar **env)
 	GQuark type;
 	rspamd_inet_addr_t *control_addr = NULL;
 	struct event_base *ev_base;
-	struct event term_ev, int_ev, cld_ev, hup_ev, usr1_ev, control_ev;
-	struct timeval term_tv;
+	struct event term_ev, int_ev, cld_ev, hup_ev, usr1_ev, control_ev,
+			log_ring_ev;
+	struct timeval term_tv, log_ring_tv;
 	struct rspamd_main *rspamd_main;
 
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
@@ -1125,6 +1254,7 @@ main (gint argc, gchar **argv, gchar **env)
 			"main");
 	rspamd_main->stat = rspamd_mempool_alloc0_shared (rspamd_main->server_pool,
 			sizeof (struct rspamd_stat));
+	rspamd_main_counters_init (rspamd_main);
 	rspamd_main->cfg = rspamd_config_new ();
 	rspamd_main->spairs = g_hash_table_new_full (rspamd_spair_hash,
 			rspamd_spair_equal, g_free, rspamd_spair_close);
@@ -1371,7 +1501,16 @@ main (gint argc, gchar **argv, gchar **env)
 	event_base_set (ev_base, &usr1_ev);
 	event_add (&usr1_ev, NULL);
 
+	/* Drain log rings of workers, they are enabled by `log_ring` option */
+	log_ring_tv.tv_sec = 0;
+	log_ring_tv.tv_usec = 100000;
+	event_set (&log_ring_ev, -1, EV_TIMEOUT|EV_PERSIST,
+			rspamd_log_ring_handler, rspamd_main);
+	event_base_set (ev_base, &log_ring_ev);
+	event_add (&log_ring_ev, &log_ring_tv);
+
 	rspamd_check_core_limits (rspamd_main);
+	rspamd_main_preload (rspamd_main);
 	rspamd_mempool_lock_mutex (rspamd_main->start_mtx);
 	spawn_workers (rspamd_main, ev_base);
 	rspamd_mempool_unlock_mutex (rspamd_main->start_mtx);
@@ -1422,6 +1561,7 @@ main (gint argc, gchar **argv, gchar **env)
 
 	event_base_loop (ev_base, 0);
 	event_del (&term_ev);
+	event_del (&log_ring_ev);
 
 	/* Maybe save roll history */
 	if (rspamd_main->cfg->history_file) {
@@ -14,6 +14,7 @@
 #include "libutil/http.h"
 #include "libutil/upstream.h"
 #include "libutil/radix.h"
+#include "libutil/histogram.h"
 #include "libserver/url.h"
 #include "libserver/protocol.h"
 #include "libserver/events.h"
@@ -63,6 +64,10 @@ struct rspamd_worker {
 	struct event srv_ev;            /**< used by main for read workers' requests		*/
 	gpointer control_data;          /**< used by control protocol to handle commands	*/
 	GPtrArray *finish_actions;      /**< called when worker is terminated				*/
+	struct rspamd_log_ring *log_ring; /**< log lines written by worker and drained by main */
+	guint generation;               /**< reload number when worker has been spawned	*/
+	gboolean ready;                 /**< worker has finished its initialization		*/
+	guint counters_slot;            /**< slot in the shared counters registry			*/
 };
 
 struct rspamd_abstract_worker_ctx {
@@ -166,6 +171,7 @@ enum rspamd_worker_flags {
 	RSPAMD_WORKER_THREADED = (1 << 2),
 	RSPAMD_WORKER_KILLABLE = (1 << 3),
 	RSPAMD_WORKER_ALWAYS_START = (1 << 4),
+	RSPAMD_WORKER_LOW_PRIORITY = (1 << 5),
 };
 
 enum rspamd_worker_socket_type {
@@ -217,8 +223,31 @@ struct rspamd_dns_resolver;
 struct rspamd_task;
 struct rspamd_cryptobox_library_ctx;
 
+/*
+ * Buckets of explicit Lua GC steps durations, upper bounds are in
+ * milliseconds, the last bucket is for longer steps
+ */
+#define RSPAMD_LUA_GC_PAUSE_BUCKETS 8
+#define RSPAMD_LUA_GC_PAUSE_BOUNDS {0.1, 0.5, 1.0, 2.0, 5.0, 10.0, 50.0}
+
+/**
+ * Builtin counters in the shared counters registry, they are registered in
+ * this order before any other counter
+ */
+enum rspamd_main_counter {
+	RSPAMD_COUNTER_SCANNED = 0,
+	RSPAMD_COUNTER_LEARNED,
+	RSPAMD_COUNTER_CONNECTIONS,
+	RSPAMD_COUNTER_CONTROL_CONNECTIONS,
+	RSPAMD_COUNTER_ACTIONS, /* one counter per action */
+	RSPAMD_COUNTER_BUILTIN_MAX = RSPAMD_COUNTER_ACTIONS + METRIC_ACTION_MAX
+};
+
+struct rspamd_shm_counters;
+
 /**
- * Server statistics
+ * Server statistics, messages and connections counters are kept in the
+ * counters registry and are filled by rspamd_main_stat_copy
  */
 struct rspamd_stat {
 	guint messages_scanned;                             /**< total number of messages scanned				*/
@@ -226,6 +255,10 @@ struct rspamd_stat {
 	guint connections_count;                            /**< total connections count						*/
 	guint control_connections_count;                    /**< connections count to control interface			*/
 	guint messages_learned;                             /**< messages learned								*/
+	guint lua_gc_pauses[RSPAMD_LUA_GC_PAUSE_BUCKETS];   /**< histogram of Lua GC steps in scanners			*/
+	guint64 lua_gc_pauses_usec;                         /**< total time of Lua GC steps						*/
+	guint64 lua_heap_size;                              /**< total size of scanners Lua heaps				*/
+	struct rspamd_histogram stage_latency[RSPAMD_TASK_STAGES_COUNT]; /**< time spent in task stages		*/
 };
 
 /**
@@ -238,6 +271,7 @@ struct rspamd_main {
 	rspamd_pidfh_t *pfh;                                        /**< struct pidfh for pidfile						*/
 	GQuark type;                                                /**< process type									*/
 	struct rspamd_stat *stat;                                   /**< pointer to statistics							*/
+	struct rspamd_shm_counters *counters;                       /**< shared counters registry						*/
 
 	rspamd_mempool_t *server_pool;                              /**< server's memory pool							*/
 	rspamd_mempool_mutex_t *start_mtx;                          /**< server is starting up							*/
@@ -250,6 +284,8 @@ struct rspamd_main {
 	gboolean cores_throttling;                                  /**< turn off cores when limits are exceeded		*/
 	struct roll_history *history;                               /**< rolling history								*/
 	struct event_base *ev_base;
+	guint generation;                                           /**< number of graceful reloads						*/
+	struct event reload_ev;                                     /**< timeout for new workers to get ready			*/
 };
 
 enum rspamd_exception_type {
@@ -30,10 +30,14 @@
 #include "keypairs_cache.h"
 #include "ottery.h"
 #include "unix-std.h"
+#include "contrib/zstd/zstd.h"
+#include <math.h>
 
 /* Rotate keys each minute by default */
 #define DEFAULT_ROTATION_TIME 60.0
 #define DEFAULT_RETRIES 5
+#define DEFAULT_KEEPALIVE_TIMEOUT 30.0
+#define DEFAULT_KEEPALIVE_CONNS 16
 
 #define msg_err_session(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         session->pool->tag.tagname, session->pool->tag.uid, \
@@ -73,6 +77,7 @@ struct rspamd_http_upstream {
 	gint parser_from_ref;
 	gint parser_to_ref;
 	gboolean local;
+	gboolean compress;
 };
 
 struct rspamd_http_mirror {
@@ -86,6 +91,8 @@ struct rspamd_http_mirror {
 	gint parser_from_ref;
 	gint parser_to_ref;
 	gboolean local;
+	gboolean merge;
+	gboolean compress;
 };
 
 static const guint64 rspamd_rspamd_proxy_magic = 0xcdeb4fd1fc351980ULL;
@@ -118,12 +125,28 @@ struct rspamd_proxy_ctx {
 	GArray *cmp_refs;
 	/* Maximum count for retries */
 	guint max_retries;
+	/* Use persistent connections to backends */
+	gboolean keepalive;
+	gdouble keepalive_timeout;
+	guint keepalive_conns;
+	struct rspamd_http_keepalive_pool *keepalive_pool;
+	/* Deadline and quorum for merging mirrors */
+	gdouble gather_timeout;
+	struct timeval gather_tv;
+	guint gather_quorum;
+	/* Compression of requests to remote backends */
+	ZSTD_CCtx *zctx;
+	ZSTD_DStream *zstream;
 };
 
 enum rspamd_backend_flags {
 	RSPAMD_BACKEND_REPLIED = 1 << 0,
 	RSPAMD_BACKEND_CLOSED = 1 << 1,
 	RSPAMD_BACKEND_PARSED = 1 << 2,
+	RSPAMD_BACKEND_REUSED = 1 << 3,
+	RSPAMD_BACKEND_KEEPALIVE = 1 << 4,
+	RSPAMD_BACKEND_MERGE = 1 << 5,
+	RSPAMD_BACKEND_COMPRESSED = 1 << 6,
 };
 
 struct rspamd_proxy_session;
@@ -133,11 +156,13 @@ struct rspamd_proxy_backend_connection {
 	struct rspamd_cryptobox_keypair *local_key;
 	struct rspamd_cryptobox_pubkey *remote_key;
 	struct upstream *up;
+	rspamd_inet_addr_t *addr;
 	struct rspamd_http_connection *backend_conn;
 	ucl_object_t *results;
 	const gchar *err;
 	struct rspamd_proxy_session *s;
 	struct timeval *io_tv;
+	gdouble start_time;
 	gint backend_sock;
 	enum rspamd_backend_flags flags;
 	gint parser_from_ref;
@@ -159,6 +184,16 @@ struct rspamd_proxy_session {
 	gint client_sock;
 	gboolean is_spamc;
 	gint retries;
+	/* Master reply waiting for merging mirrors */
+	struct rspamd_http_message *master_reply;
+	const gchar *master_mime_type;
+	gboolean master_mergeable;
+	guint merge_pending;
+	guint merge_done;
+	struct event gather_ev;
+	gboolean gather_armed;
+	gboolean gather_timed_out;
+	gboolean replied;
 	ref_entry_t ref;
 };
 
@@ -353,6 +388,11 @@ rspamd_proxy_parse_upstream (rspamd_mempool_t *pool,
 		ucl_object_todouble_safe (elt, &up->timeout);
 	}
 
+	elt = ucl_object_lookup (obj, "compress");
+	if (elt && ucl_object_toboolean (elt)) {
+		up->compress = TRUE;
+	}
+
 	/*
 	 * Accept lua function here in form
 	 * fun :: String -> UCL
@@ -469,6 +509,17 @@ rspamd_proxy_parse_mirror (rspamd_mempool_t *pool,
 		ucl_object_todouble_safe (elt, &up->timeout);
 	}
 
+	/* Merged mirrors are always used and their symbols go to the reply */
+	elt = ucl_object_lookup (obj, "merge");
+	if (elt && ucl_object_toboolean (elt)) {
+		up->merge = TRUE;
+	}
+
+	elt = ucl_object_lookup (obj, "compress");
+	if (elt && ucl_object_toboolean (elt)) {
+		up->compress = TRUE;
+	}
+
 	/*
 	 * Accept lua function here in form
 	 * fun :: String -> UCL
@@ -618,6 +669,12 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
 			(rspamd_mempool_destruct_t)rspamd_array_free_hard, ctx->cmp_refs);
 	ctx->max_retries = DEFAULT_RETRIES;
+	ctx->keepalive = FALSE;
+	ctx->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+	ctx->keepalive_conns = DEFAULT_KEEPALIVE_CONNS;
+	ctx->keepalive_pool = NULL;
+	ctx->gather_timeout = 0.0;
+	ctx->gather_quorum = 0;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -680,6 +737,46 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, max_retries),
 			RSPAMD_CL_FLAG_UINT,
 			"Maximum number of retries for master connection");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, keepalive),
+			0,
+			"Reuse connections to backends that support keep-alive");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, keepalive_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Close idle backend connections after this timeout");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"keepalive_conns",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, keepalive_conns),
+			RSPAMD_CL_FLAG_UINT,
+			"Maximum number of idle connections per backend address");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"gather_timeout",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, gather_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Reply without merging mirrors that are not ready after this timeout");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"gather_quorum",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_proxy_ctx, gather_quorum),
+			RSPAMD_CL_FLAG_UINT,
+			"Reply when this number of merging mirrors has replied (all by default)");
 
 	return ctx;
 }
@@ -687,32 +784,250 @@ init_rspamd_proxy (struct rspamd_config *cfg)
 static void
 proxy_backend_close_connection (struct rspamd_proxy_backend_connection *conn)
 {
+	struct rspamd_http_keepalive_pool *pool;
+
 	if (conn && !(conn->flags & RSPAMD_BACKEND_CLOSED)) {
 		if (conn->backend_conn) {
 			rspamd_http_connection_reset (conn->backend_conn);
 			rspamd_http_connection_unref (conn->backend_conn);
-			close (conn->backend_sock);
+			pool = conn->s->ctx->keepalive_pool;
+
+			if (!(conn->flags & RSPAMD_BACKEND_KEEPALIVE) ||
+					!rspamd_http_keepalive_pool_push (pool, conn->addr,
+							conn->backend_sock)) {
+				close (conn->backend_sock);
+			}
 		}
 
 		conn->flags |= RSPAMD_BACKEND_CLOSED;
 	}
 }
 
+/*
+ * Connects to the selected upstream, reusing an idle connection if possible
+ */
+static gint
+proxy_backend_connect (struct rspamd_proxy_session *session,
+		struct rspamd_proxy_backend_connection *conn)
+{
+	gint fd;
+
+	conn->addr = rspamd_upstream_addr (conn->up);
+	conn->flags &= ~(RSPAMD_BACKEND_REUSED|RSPAMD_BACKEND_KEEPALIVE);
+
+	if (session->ctx->keepalive_pool) {
+		fd = rspamd_http_keepalive_pool_get (session->ctx->keepalive_pool,
+				conn->addr);
+
+		if (fd != -1) {
+			conn->flags |= RSPAMD_BACKEND_REUSED;
+
+			return fd;
+		}
+	}
+
+	return rspamd_inet_address_connect (conn->addr, SOCK_STREAM, TRUE);
+}
+
+static void
+proxy_backend_check_keepalive (struct rspamd_proxy_backend_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	if (conn->s->ctx->keepalive_pool && rspamd_http_message_is_keepalive (msg)) {
+		conn->flags |= RSPAMD_BACKEND_KEEPALIVE;
+	}
+
+	rspamd_http_message_remove_header (msg, "Connection");
+}
+
+/*
+ * Compresses body sent to a remote backend, it is decompressed by worker
+ * using the same `zstd_input_dictionary`
+ */
+static gboolean
+proxy_backend_compress_message (struct rspamd_proxy_session *session,
+		struct rspamd_http_message *msg)
+{
+	struct zstd_dictionary *dict = session->ctx->cfg->libs_ctx->in_dict;
+	const rspamd_ftok_t *ctype;
+	const gchar *in;
+	gsize inlen, r;
+	rspamd_fstring_t *body;
+	gchar dict_str[32];
+
+	in = rspamd_http_message_get_body (msg, &inlen);
+	ctype = rspamd_http_message_find_header (msg, "Content-Type");
+
+	if (in == NULL || session->ctx->zctx == NULL ||
+			rspamd_http_message_find_header (msg, "Compression")) {
+		return FALSE;
+	}
+
+	if (ctype && ctype->len == sizeof (RSPAMD_PROTOCOL_TLV_CTYPE) - 1 &&
+			rspamd_lc_cmp (ctype->begin, RSPAMD_PROTOCOL_TLV_CTYPE,
+					ctype->len) == 0) {
+		/* Envelope must be readable before the message */
+		return FALSE;
+	}
+
+	body = rspamd_fstring_sized_new (ZSTD_compressBound (inlen));
+	r = ZSTD_compress_usingDict (session->ctx->zctx, body->str, body->allocated,
+			in, inlen,
+			dict ? dict->dict : NULL, dict ? dict->size : 0,
+			1);
+
+	if (ZSTD_isError (r)) {
+		msg_warn_session ("cannot compress message: %s", ZSTD_getErrorName (r));
+		rspamd_fstring_free (body);
+
+		return FALSE;
+	}
+
+	body->len = r;
+	msg_debug_session ("compressed message: %z bytes before, %z bytes after",
+			inlen, r);
+	rspamd_http_message_set_body_from_fstring_steal (msg, body);
+	rspamd_http_message_add_header (msg, "Compression", "zstd");
+
+	if (dict) {
+		rspamd_snprintf (dict_str, sizeof (dict_str), "%ud", dict->id);
+		rspamd_http_message_add_header (msg, "Dictionary", dict_str);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Decompresses reply to a compressed request, worker uses its
+ * `zstd_output_dictionary` for it
+ */
+static gboolean
+proxy_backend_decompress_reply (struct rspamd_proxy_session *session,
+		struct rspamd_http_message *msg)
+{
+	struct zstd_dictionary *dict = session->ctx->cfg->libs_ctx->out_dict;
+	ZSTD_DStream *zstream = session->ctx->zstream;
+	const rspamd_ftok_t *tok;
+	rspamd_ftok_t srch;
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout;
+	rspamd_fstring_t *body;
+	gulong dict_id;
+	gsize outlen, r;
+
+	tok = rspamd_http_message_find_header (msg, "Compression");
+
+	if (tok == NULL) {
+		return TRUE;
+	}
+
+	RSPAMD_FTOK_ASSIGN (&srch, "zstd");
+
+	if (rspamd_ftok_casecmp (tok, &srch) != 0 || zstream == NULL) {
+		msg_err_session ("invalid compression method: %T", tok);
+
+		return FALSE;
+	}
+
+	tok = rspamd_http_message_find_header (msg, "Dictionary");
+
+	if (tok != NULL) {
+		if (!rspamd_strtoul (tok->begin, tok->len, &dict_id) || dict == NULL ||
+				dict->id != dict_id) {
+			msg_err_session ("unknown dictionary in reply: %T", tok);
+
+			return FALSE;
+		}
+
+		r = ZSTD_initDStream_usingDict (zstream, dict->dict, dict->size);
+	}
+	else {
+		r = ZSTD_initDStream (zstream);
+	}
+
+	if (ZSTD_isError (r)) {
+		msg_err_session ("cannot init decompression: %s", ZSTD_getErrorName (r));
+
+		return FALSE;
+	}
+
+	zin.src = rspamd_http_message_get_body (msg, &zin.size);
+	zin.pos = 0;
+
+	if (zin.src == NULL ||
+			(outlen = ZSTD_getDecompressedSize (zin.src, zin.size)) == 0) {
+		outlen = ZSTD_DStreamOutSize ();
+	}
+
+	body = rspamd_fstring_sized_new (outlen);
+
+	for (;;) {
+		zout.dst = body->str;
+		zout.size = body->allocated;
+		zout.pos = body->len;
+		r = ZSTD_decompressStream (zstream, &zout, &zin);
+		body->len = zout.pos;
+
+		if (ZSTD_isError (r)) {
+			msg_err_session ("decompression error: %s", ZSTD_getErrorName (r));
+			rspamd_fstring_free (body);
+
+			return FALSE;
+		}
+
+		if (r == 0 || (zin.pos == zin.size && zout.pos < zout.size)) {
+			break;
+		}
+
+		if (zout.pos == zout.size) {
+			body = rspamd_fstring_grow (body, ZSTD_DStreamOutSize ());
+		}
+	}
+
+	msg_debug_session ("decompressed reply: %z bytes before, %z bytes after",
+			zin.size, body->len);
+	rspamd_http_message_set_body_from_fstring_steal (msg, body);
+	rspamd_http_message_remove_header (msg, "Compression");
+	rspamd_http_message_remove_header (msg, "Dictionary");
+
+	return TRUE;
+}
+
 static gboolean
 proxy_backend_parse_results (struct rspamd_proxy_session *session,
 		struct rspamd_proxy_backend_connection *conn,
 		lua_State *L, gint parser_ref,
-		const gchar *in, gsize inlen)
+		struct rspamd_http_message *msg)
 {
 	struct ucl_parser *parser;
+	const rspamd_ftok_t *ctype;
+	const gchar *in = msg->body_buf.begin;
+	gsize inlen = msg->body_buf.len;
 	GString *tb = NULL;
+	GError *err = NULL;
 	gint err_idx;
 
 	if (inlen == 0 || in == NULL) {
 		return FALSE;
 	}
 
-	if (parser_ref != -1) {
+	ctype = rspamd_http_message_find_header (msg, "Content-Type");
+
+	if (ctype && ctype->len == sizeof (RSPAMD_PROTOCOL_TLV_CTYPE) - 1 &&
+			rspamd_lc_cmp (ctype->begin, RSPAMD_PROTOCOL_TLV_CTYPE,
+					ctype->len) == 0) {
+		/* Binary reply to a binary request, the client reads it as is */
+		conn->results = rspamd_protocol_tlv_reply_to_ucl ((const guchar *)in,
+				inlen, &err);
+
+		if (conn->results == NULL) {
+			msg_err_session ("cannot parse binary input: %e", err);
+			g_error_free (err);
+
+			return FALSE;
+		}
+	}
+	else if (parser_ref != -1) {
 		/* Call parser function */
 		lua_pushcfunction (L, &rspamd_lua_traceback);
 		err_idx = lua_gettop (L);
@@ -819,6 +1134,14 @@ proxy_session_dtor (struct rspamd_proxy_session *session)
 		proxy_call_cmp_script (session, cbref);
 	}
 
+	if (session->gather_armed) {
+		event_del (&session->gather_ev);
+	}
+
+	if (session->master_reply) {
+		rspamd_http_message_unref (session->master_reply);
+	}
+
 	if (session->master_conn) {
 		proxy_backend_close_connection (session->master_conn);
 	}
@@ -946,6 +1269,212 @@ proxy_check_file (struct rspamd_http_message *msg,
 	return TRUE;
 }
 
+/*
+ * Content type is passed separately when writing a message, so it is removed
+ * from the forwarded headers to avoid sending it twice
+ */
+static const gchar *
+proxy_steal_content_type (struct rspamd_proxy_session *session,
+		struct rspamd_http_message *msg)
+{
+	const rspamd_ftok_t *ctype;
+	const gchar *mime_type = NULL;
+
+	ctype = rspamd_http_message_find_header (msg, "Content-Type");
+
+	if (ctype) {
+		mime_type = rspamd_mempool_ftokdup (session->pool, ctype);
+		rspamd_http_message_remove_header (msg, "Content-Type");
+	}
+
+	return mime_type;
+}
+
+/*
+ * Adds symbols found by merging mirrors and missing in the master reply,
+ * then recalculates score and action. Returns number of merged replies
+ */
+static guint
+proxy_merge_results (struct rspamd_proxy_session *session)
+{
+	struct rspamd_proxy_backend_connection *conn;
+	struct rspamd_metric *metric = session->ctx->cfg->default_metric;
+	ucl_object_t *mres;
+	const ucl_object_t *bres, *cur, *elt;
+	ucl_object_iter_t it;
+	gdouble score, limit, best = NAN;
+	gint action = METRIC_ACTION_NOACTION, master_action;
+	guint i, nmerged = 0;
+
+	mres = (ucl_object_t *)ucl_object_lookup (session->master_conn->results,
+			DEFAULT_METRIC);
+
+	if (mres == NULL || ucl_object_type (mres) != UCL_OBJECT) {
+		return 0;
+	}
+
+	score = ucl_object_todouble (ucl_object_lookup (mres, "score"));
+
+	for (i = 0; i < session->mirror_conns->len; i ++) {
+		conn = g_ptr_array_index (session->mirror_conns, i);
+
+		if (!(conn->flags & RSPAMD_BACKEND_MERGE) || conn->results == NULL) {
+			continue;
+		}
+
+		bres = ucl_object_lookup (conn->results, DEFAULT_METRIC);
+
+		if (bres == NULL || ucl_object_type (bres) != UCL_OBJECT) {
+			continue;
+		}
+
+		it = NULL;
+
+		while ((cur = ucl_object_iterate (bres, &it, true)) != NULL) {
+			/* Symbols are objects, other keys are metric attributes */
+			if (ucl_object_type (cur) != UCL_OBJECT ||
+					ucl_object_lookup (mres, ucl_object_key (cur)) != NULL) {
+				continue;
+			}
+
+			elt = ucl_object_lookup (cur, "score");
+
+			if (elt) {
+				score += ucl_object_todouble (elt);
+			}
+
+			ucl_object_insert_key (mres, ucl_object_copy (cur),
+					ucl_object_key (cur), 0, true);
+		}
+
+		nmerged ++;
+	}
+
+	if (nmerged == 0) {
+		return 0;
+	}
+
+	if (metric) {
+		for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_NOACTION; i ++) {
+			limit = metric->actions[i].score;
+
+			if (!isnan (limit) && score >= limit &&
+					(isnan (best) || limit > best)) {
+				best = limit;
+				action = i;
+			}
+		}
+	}
+
+	/* Do not downgrade action set by master, e.g. by a prefilter */
+	elt = ucl_object_lookup (mres, "action");
+
+	if (elt && ucl_object_type (elt) == UCL_STRING &&
+			rspamd_action_from_str (ucl_object_tostring (elt), &master_action) &&
+			master_action < action) {
+		action = master_action;
+	}
+
+	ucl_object_replace_key (mres, ucl_object_fromdouble (score),
+			"score", 0, false);
+	ucl_object_replace_key (mres,
+			ucl_object_fromstring (rspamd_action_to_str (action)),
+			"action", 0, false);
+	ucl_object_replace_key (mres,
+			ucl_object_frombool (action < METRIC_ACTION_GREYLIST),
+			"is_spam", 0, false);
+
+	return nmerged;
+}
+
+static void
+proxy_gather_write_reply (struct rspamd_proxy_session *session)
+{
+	struct rspamd_proxy_backend_connection *bk_conn = session->master_conn;
+	struct rspamd_http_message *msg = session->master_reply;
+	rspamd_fstring_t *reply;
+	guint nmerged = 0;
+
+	session->master_reply = NULL;
+	session->replied = TRUE;
+
+	if (session->gather_armed) {
+		event_del (&session->gather_ev);
+		session->gather_armed = FALSE;
+	}
+
+	if (session->master_mergeable) {
+		nmerged = proxy_merge_results (session);
+
+		if (nmerged > 0) {
+			msg_info_session ("merged results from %ud mirrors, %ud pending",
+					nmerged, session->merge_pending);
+		}
+	}
+
+	if (session->is_spamc) {
+		/* We need to reformat ucl to fit with legacy spamc protocol */
+		if (bk_conn->results) {
+			reply = rspamd_fstring_new ();
+			rspamd_ucl_torspamc_output (bk_conn->results, &reply);
+			rspamd_http_message_set_body_from_fstring_steal (msg, reply);
+			msg->method = HTTP_SYMBOLS;
+		}
+		else {
+			msg_warn_session ("cannot parse results from the master backend, "
+					"return them as is");
+		}
+	}
+	else if (nmerged > 0) {
+		reply = rspamd_fstring_new ();
+		rspamd_ucl_emit_fstring (bk_conn->results, UCL_EMIT_JSON_COMPACT,
+				&reply);
+		rspamd_http_message_set_body_from_fstring_steal (msg, reply);
+	}
+
+	rspamd_http_connection_write_message (session->client_conn,
+			msg, NULL, session->master_mime_type, session,
+			session->client_sock,
+			bk_conn->io_tv, session->ctx->ev_base);
+}
+
+/*
+ * Writes the master reply once all merging mirrors have replied, the quorum
+ * is reached or the gather deadline is passed
+ */
+static void
+proxy_gather_maybe_reply (struct rspamd_proxy_session *session)
+{
+	guint quorum = session->ctx->gather_quorum;
+
+	if (session->replied || session->master_reply == NULL) {
+		return;
+	}
+
+	if (session->merge_pending > 0 && !session->gather_timed_out &&
+			(quorum == 0 || session->merge_done < quorum)) {
+		return;
+	}
+
+	proxy_gather_write_reply (session);
+}
+
+static void
+proxy_gather_timer_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_proxy_session *session = ud;
+
+	session->gather_armed = FALSE;
+	session->gather_timed_out = TRUE;
+
+	if (session->master_reply) {
+		msg_info_session ("gather timeout, %ud merging mirrors are pending",
+				session->merge_pending);
+	}
+
+	proxy_gather_maybe_reply (session);
+}
+
 static void
 proxy_backend_mirror_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
@@ -963,9 +1492,18 @@ proxy_backend_mirror_error_handler (struct rspamd_http_connection *conn, GError
 		bk_conn->err = rspamd_mempool_strdup (session->pool, err->message);
 	}
 
-	rspamd_upstream_fail (bk_conn->up);
+	if (!(bk_conn->flags & RSPAMD_BACKEND_REUSED)) {
+		/* Idle connection might be closed by backend meanwhile */
+		rspamd_upstream_fail (bk_conn->up);
+	}
 
 	proxy_backend_close_connection (bk_conn);
+
+	if (bk_conn->flags & RSPAMD_BACKEND_MERGE) {
+		session->merge_pending --;
+		proxy_gather_maybe_reply (session);
+	}
+
 	REF_RELEASE (bk_conn->s);
 }
 
@@ -978,8 +1516,12 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 
 	session = bk_conn->s;
 
-	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
-			bk_conn->parser_from_ref, msg->body_buf.begin, msg->body_buf.len)) {
+	if ((bk_conn->flags & RSPAMD_BACKEND_COMPRESSED) &&
+			!proxy_backend_decompress_reply (session, msg)) {
+		bk_conn->err = "cannot decompress reply";
+	}
+	else if (!proxy_backend_parse_results (session, bk_conn,
+			session->ctx->lua_state, bk_conn->parser_from_ref, msg)) {
 		msg_warn_session ("cannot parse results from the mirror backend %s:%s",
 				bk_conn->name,
 				rspamd_inet_address_to_string (rspamd_upstream_addr (bk_conn->up)));
@@ -988,13 +1530,65 @@ proxy_backend_mirror_finish_handler (struct rspamd_http_connection *conn,
 
 	msg_info_session ("finished mirror connection to %s", bk_conn->name);
 	rspamd_upstream_ok (bk_conn->up);
+	rspamd_upstream_latency (bk_conn->up,
+			rspamd_get_ticks () - bk_conn->start_time);
+	proxy_backend_check_keepalive (bk_conn, msg);
 
 	proxy_backend_close_connection (bk_conn);
+
+	if (bk_conn->flags & RSPAMD_BACKEND_MERGE) {
+		session->merge_pending --;
+
+		if (bk_conn->results) {
+			session->merge_done ++;
+		}
+
+		proxy_gather_maybe_reply (session);
+	}
+
 	REF_RELEASE (bk_conn->s);
 
 	return 0;
 }
 
+/*
+ * Maps a file requested by client as a message body, so remote backends
+ * and mirrors share the same pages instead of copying the whole file
+ */
+static gboolean
+proxy_set_file_body (struct rspamd_proxy_session *session,
+		struct rspamd_http_message *msg)
+{
+	gint fd;
+	gboolean ret = FALSE;
+
+	fd = rspamd_file_xopen (session->fname, O_RDONLY, 0);
+
+	if (fd != -1) {
+		ret = rspamd_http_message_set_body_from_fd (msg, fd);
+		close (fd);
+
+		if (!ret) {
+			/* Failed mapping leaves the body in the shared memory state */
+			if (msg->body_buf.c.shared.shm_fd != -1) {
+				close (msg->body_buf.c.shared.shm_fd);
+			}
+
+			msg->flags &= ~(RSPAMD_HTTP_FLAG_SHMEM|
+					RSPAMD_HTTP_FLAG_SHMEM_IMMUTABLE);
+			memset (&msg->body_buf, 0, sizeof (msg->body_buf));
+		}
+	}
+
+	if (!ret) {
+		msg_debug_session ("cannot map %s, copy it: %s", session->fname,
+				strerror (errno));
+		ret = rspamd_http_message_set_body (msg, session->map, session->map_len);
+	}
+
+	return ret;
+}
+
 static void
 proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 {
@@ -1009,7 +1603,7 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 	for (i = 0; i < session->ctx->mirrors->len; i ++) {
 		m = g_ptr_array_index (session->ctx->mirrors, i);
 
-		if (m->prob < coin) {
+		if (!m->merge && m->prob < coin) {
 			/* No luck */
 			continue;
 		}
@@ -1025,14 +1619,16 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 		bk_conn->parser_from_ref = m->parser_from_ref;
 		bk_conn->parser_to_ref = m->parser_to_ref;
 
+		if (m->merge) {
+			bk_conn->flags |= RSPAMD_BACKEND_MERGE;
+		}
+
 		if (bk_conn->up == NULL) {
 			msg_err_session ("cannot select upstream for %s", m->name);
 			continue;
 		}
 
-		bk_conn->backend_sock = rspamd_inet_address_connect (
-				rspamd_upstream_addr (bk_conn->up),
-				SOCK_STREAM, TRUE);
+		bk_conn->backend_sock = proxy_backend_connect (session, bk_conn);
 
 		if (bk_conn->backend_sock == -1) {
 			msg_err_session ("cannot connect upstream for %s", m->name);
@@ -1059,6 +1655,10 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			rspamd_http_message_add_header (msg, "Settings-ID", m->settings_id);
 		}
 
+		if (session->ctx->keepalive_pool) {
+			msg->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+		}
+
 		bk_conn->backend_conn = rspamd_http_connection_new (NULL,
 				proxy_backend_mirror_error_handler,
 				proxy_backend_mirror_finish_handler,
@@ -1066,6 +1666,7 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 				RSPAMD_HTTP_CLIENT,
 				session->ctx->keys_cache,
 				NULL);
+		bk_conn->start_time = rspamd_get_ticks ();
 
 		if (m->key) {
 			rspamd_http_connection_set_key (bk_conn->backend_conn,
@@ -1082,17 +1683,21 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 			}
 
 			rspamd_http_connection_write_message_shared (bk_conn->backend_conn,
-					msg, NULL, NULL, bk_conn,
+					msg, NULL, proxy_steal_content_type (session, msg), bk_conn,
 					bk_conn->backend_sock,
 					bk_conn->io_tv, session->ctx->ev_base);
 		}
 		else {
 			if (session->fname) {
-				rspamd_http_message_set_body (msg, session->map, session->map_len);
+				proxy_set_file_body (session, msg);
+			}
+
+			if (m->compress && proxy_backend_compress_message (session, msg)) {
+				bk_conn->flags |= RSPAMD_BACKEND_COMPRESSED;
 			}
 
 			rspamd_http_connection_write_message (bk_conn->backend_conn,
-					msg, NULL, NULL, bk_conn,
+					msg, NULL, proxy_steal_content_type (session, msg), bk_conn,
 					bk_conn->backend_sock,
 					bk_conn->io_tv, session->ctx->ev_base);
 		}
@@ -1100,6 +1705,20 @@ proxy_open_mirror_connections (struct rspamd_proxy_session *session)
 		g_ptr_array_add (session->mirror_conns, bk_conn);
 		REF_RETAIN (session);
 		msg_info_session ("send request to %s", m->name);
+
+		if (m->merge) {
+			session->merge_pending ++;
+		}
+	}
+
+	if (session->merge_pending > 0 && session->ctx->gather_timeout > 0) {
+		event_set (&session->gather_ev, -1, EV_TIMEOUT, proxy_gather_timer_cb,
+				session);
+		event_base_set (session->ctx->ev_base, &session->gather_ev);
+		event_add (&session->gather_ev,
+				rspamd_event_common_tv (session->ctx->ev_base,
+						&session->ctx->gather_tv));
+		session->gather_armed = TRUE;
 	}
 }
 
@@ -1130,7 +1749,12 @@ proxy_backend_master_error_handler (struct rspamd_http_connection *conn, GError
 		err->message,
 		session->ctx->max_retries - session->retries);
 	session->retries ++;
-	rspamd_upstream_fail (bk_conn->up);
+
+	if (!(bk_conn->flags & RSPAMD_BACKEND_REUSED)) {
+		/* Idle connection might be closed by backend meanwhile */
+		rspamd_upstream_fail (bk_conn->up);
+	}
+
 	proxy_backend_close_connection (session->master_conn);
 
 	if (session->ctx->max_retries &&
@@ -1159,40 +1783,44 @@ proxy_backend_master_finish_handler (struct rspamd_http_connection *conn,
 {
 	struct rspamd_proxy_backend_connection *bk_conn = conn->ud;
 	struct rspamd_proxy_session *session;
-	rspamd_fstring_t *reply;
 
 	session = bk_conn->s;
 	rspamd_http_connection_steal_msg (session->master_conn->backend_conn);
 
 	rspamd_http_message_remove_header (msg, "Content-Length");
 	rspamd_http_message_remove_header (msg, "Key");
+	proxy_backend_check_keepalive (bk_conn, msg);
 	rspamd_http_connection_reset (session->master_conn->backend_conn);
 
+	if ((bk_conn->flags & RSPAMD_BACKEND_COMPRESSED) &&
+			!proxy_backend_decompress_reply (session, msg)) {
+		/* Client has not asked for compression, so it cannot read reply */
+		rspamd_http_message_unref (msg);
+		proxy_client_write_error (session, 502, "Cannot decompress reply");
+
+		return 0;
+	}
+
 	if (!proxy_backend_parse_results (session, bk_conn, session->ctx->lua_state,
-			bk_conn->parser_from_ref, msg->body_buf.begin, msg->body_buf.len)) {
+			bk_conn->parser_from_ref, msg)) {
 		msg_warn_session ("cannot parse results from the master backend");
 	}
 
-
-	if (session->is_spamc) {
-		/* We need to reformat ucl to fit with legacy spamc protocol */
-		if (bk_conn->results) {
-			reply = rspamd_fstring_new ();
-			rspamd_ucl_torspamc_output (bk_conn->results, &reply);
-			rspamd_http_message_set_body_from_fstring_steal (msg, reply);
-			msg->method = HTTP_SYMBOLS;
-		}
-		else {
-			msg_warn_session ("cannot parse results from the master backend, "
-					"return them as is");
-		}
-	}
+	/* Pass the backend content type, e.g. for binary replies */
+	session->master_mime_type = proxy_steal_content_type (session, msg);
+	session->master_reply = msg;
+	/* Binary and lua parsed replies are passed to client as is */
+	session->master_mergeable = bk_conn->results != NULL &&
+			bk_conn->parser_from_ref == -1 &&
+			!(session->master_mime_type &&
+					g_ascii_strcasecmp (session->master_mime_type,
+							RSPAMD_PROTOCOL_TLV_CTYPE) == 0);
 
 	rspamd_upstream_ok (bk_conn->up);
+	rspamd_upstream_latency (bk_conn->up,
+			rspamd_get_ticks () - bk_conn->start_time);
 
-	rspamd_http_connection_write_message (session->client_conn,
-			msg, NULL, NULL, session, session->client_sock,
-			bk_conn->io_tv, session->ctx->ev_base);
+	proxy_gather_maybe_reply (session);
 
 	return 0;
 }
@@ -1243,9 +1871,8 @@ retry:
 			goto err;
 		}
 
-		session->master_conn->backend_sock = rspamd_inet_address_connect (
-				rspamd_upstream_addr (session->master_conn->up),
-				SOCK_STREAM, TRUE);
+		session->master_conn->backend_sock = proxy_backend_connect (session,
+				session->master_conn);
 
 		if (session->master_conn->backend_sock == -1) {
 			msg_err_session ("cannot connect upstream: %s(%s)",
@@ -1265,12 +1892,18 @@ retry:
 				RSPAMD_HTTP_CLIENT,
 				session->ctx->keys_cache,
 				NULL);
-		session->master_conn->flags &= ~RSPAMD_BACKEND_CLOSED;
+		session->master_conn->start_time = rspamd_get_ticks ();
+		session->master_conn->flags &= ~(RSPAMD_BACKEND_CLOSED|
+				RSPAMD_BACKEND_COMPRESSED);
 		session->master_conn->parser_from_ref = backend->parser_from_ref;
 		session->master_conn->parser_to_ref = backend->parser_to_ref;
 
 		msg = rspamd_http_connection_copy_msg (session->client_message);
 
+		if (session->ctx->keepalive_pool) {
+			msg->flags |= RSPAMD_HTTP_FLAG_KEEPALIVE;
+		}
+
 		if (backend->key) {
 			msg->peer_key = rspamd_pubkey_ref (backend->key);
 			rspamd_http_connection_set_key (session->master_conn->backend_conn,
@@ -1287,18 +1920,25 @@ retry:
 
 			rspamd_http_connection_write_message_shared (
 					session->master_conn->backend_conn,
-					msg, NULL, NULL, session->master_conn,
+					msg, NULL, proxy_steal_content_type (session, msg),
+					session->master_conn,
 					session->master_conn->backend_sock,
 					session->master_conn->io_tv, session->ctx->ev_base);
 		}
 		else {
 			if (session->fname) {
-				rspamd_http_message_set_body (msg, session->map, session->map_len);
+				proxy_set_file_body (session, msg);
+			}
+
+			if (backend->compress &&
+					proxy_backend_compress_message (session, msg)) {
+				session->master_conn->flags |= RSPAMD_BACKEND_COMPRESSED;
 			}
 
 			rspamd_http_connection_write_message (
 					session->master_conn->backend_conn,
-					msg, NULL, NULL, session->master_conn,
+					msg, NULL, proxy_steal_content_type (session, msg),
+					session->master_conn,
 					session->master_conn->backend_sock,
 					session->master_conn->io_tv, session->ctx->ev_base);
 		}
@@ -1322,6 +1962,7 @@ proxy_client_error_handler (struct rspamd_http_connection *conn, GError *err)
 	msg_info_session ("abnormally closing connection from: %s, error: %s",
 		rspamd_inet_address_to_string (session->client_addr), err->message);
 	/* Terminate session immediately */
+	session->replied = TRUE;
 	proxy_backend_close_connection (session->master_conn);
 	REF_RELEASE (session);
 }
@@ -1358,6 +1999,7 @@ proxy_client_finish_handler (struct rspamd_http_connection *conn,
 		session->shmem_ref = rspamd_http_message_shmem_ref (session->client_message);
 		rspamd_http_message_remove_header (msg, "Content-Length");
 		rspamd_http_message_remove_header (msg, "Key");
+		rspamd_http_message_remove_header (msg, "Connection");
 
 		proxy_open_mirror_connections (session);
 		rspamd_http_connection_reset (session->client_conn);
@@ -1467,6 +2109,7 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 			ctx->ev_base,
 			worker->srv->cfg);
 	double_to_tv (ctx->timeout, &ctx->io_tv);
+	double_to_tv (ctx->gather_timeout, &ctx->gather_tv);
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base, ctx->resolver);
 
 	rspamd_upstreams_library_config (worker->srv->cfg, ctx->cfg->ups_ctx,
@@ -1474,6 +2117,8 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 
 	/* XXX: stupid default */
 	ctx->keys_cache = rspamd_keypair_cache_new (256);
+	rspamd_keypair_cache_set_shared (ctx->keys_cache,
+			worker->srv->cfg->keypair_shared_cache);
 	ctx->local_key = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
 			RSPAMD_CRYPTOBOX_MODE_25519);
 
@@ -1483,11 +2128,22 @@ start_rspamd_proxy (struct rspamd_worker *worker)
 	event_base_set (ctx->ev_base, &ctx->rotate_ev);
 	event_add (&ctx->rotate_ev, &rot_tv);
 
+	if (ctx->keepalive) {
+		ctx->keepalive_pool = rspamd_http_keepalive_pool_new (ctx->ev_base,
+				ctx->keepalive_timeout, ctx->keepalive_conns);
+	}
+
+	ctx->zctx = ZSTD_createCCtx ();
+	ctx->zstream = ZSTD_createDStream ();
+
 	event_base_loop (ctx->ev_base, 0);
 	rspamd_worker_block_signals ();
 
 	rspamd_log_close (worker->srv->logger);
 
+	rspamd_http_keepalive_pool_destroy (ctx->keepalive_pool);
+	ZSTD_freeCCtx (ctx->zctx);
+	ZSTD_freeDStream (ctx->zstream);
 	rspamd_keypair_cache_destroy (ctx->keys_cache);
 	REF_RELEASE (ctx->cfg);
 
@@ -44,6 +44,20 @@
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
 /* Timeout for task processing */
 #define DEFAULT_TASK_TIMEOUT 8.0
+/* Messages per export batch and flush interval */
+#define DEFAULT_EXPORT_BATCH 256
+#define DEFAULT_EXPORT_INTERVAL 1.0
+/* Lua heap growth allowed per task, interval of idle GC steps and their size */
+#define DEFAULT_LUA_GC_BUDGET (4 * 1024 * 1024)
+#define DEFAULT_LUA_GC_INTERVAL 0.1
+#define DEFAULT_LUA_GC_STEP 256
+/* Automatic collections are left only as a safety net */
+#define LUA_GC_BACKSTOP_PAUSE 400
+/* Interval of per IP rate buckets and number of tracked addresses */
+#define DEFAULT_PRESCAN_IP_INTERVAL 60.0
+#define PRESCAN_MAX_BUCKETS 65536
+/* How often events loop lag is measured */
+#define LOOP_LAG_INTERVAL 0.1
 
 gpointer init_worker (struct rspamd_config *cfg);
 void start_worker (struct rspamd_worker *worker);
@@ -126,6 +140,246 @@ rspamd_worker_call_finish_handlers (struct rspamd_worker *worker)
 	return FALSE;
 }
 
+static const gdouble lua_gc_pause_bounds[RSPAMD_LUA_GC_PAUSE_BUCKETS - 1] =
+		RSPAMD_LUA_GC_PAUSE_BOUNDS;
+
+static gsize
+rspamd_worker_lua_heap (lua_State *L)
+{
+	return (gsize)lua_gc (L, LUA_GCCOUNT, 0) * 1024 +
+			lua_gc (L, LUA_GCCOUNTB, 0);
+}
+
+/* Stat is shared between all workers, so heap size is updated by deltas */
+static void
+rspamd_worker_lua_heap_report (struct rspamd_worker *worker, gsize heap)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	struct rspamd_stat *stat = worker->srv->stat;
+
+#ifndef HAVE_ATOMIC_BUILTINS
+	stat->lua_heap_size += heap;
+	stat->lua_heap_size -= ctx->lua_heap_reported;
+#else
+	if (heap > ctx->lua_heap_reported) {
+		__atomic_add_fetch (&stat->lua_heap_size,
+				heap - ctx->lua_heap_reported, __ATOMIC_RELEASE);
+	}
+	else {
+		__atomic_sub_fetch (&stat->lua_heap_size,
+				ctx->lua_heap_reported - heap, __ATOMIC_RELEASE);
+	}
+#endif
+
+	ctx->lua_heap_reported = heap;
+}
+
+static void
+rspamd_worker_lua_gc_step (struct rspamd_worker *worker, gint kbytes)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	lua_State *L = ctx->cfg->lua_state;
+	struct rspamd_stat *stat = worker->srv->stat;
+	gdouble t1, pause;
+	guint i;
+
+	t1 = rspamd_get_ticks ();
+	ctx->lua_gc_finished = lua_gc (L, LUA_GCSTEP, kbytes);
+	pause = (rspamd_get_ticks () - t1) * 1000.0;
+
+	for (i = 0; i < G_N_ELEMENTS (lua_gc_pause_bounds); i ++) {
+		if (pause < lua_gc_pause_bounds[i]) {
+			break;
+		}
+	}
+
+#ifndef HAVE_ATOMIC_BUILTINS
+	stat->lua_gc_pauses[i] ++;
+	stat->lua_gc_pauses_usec += pause * 1000.0;
+#else
+	__atomic_add_fetch (&stat->lua_gc_pauses[i], 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch (&stat->lua_gc_pauses_usec, (guint64)(pause * 1000.0),
+			__ATOMIC_RELEASE);
+#endif
+
+	ctx->lua_gc_last_heap = rspamd_worker_lua_heap (L);
+	rspamd_worker_lua_heap_report (worker, ctx->lua_gc_last_heap);
+}
+
+/*
+ * Called when a task is finished, a task that has grown Lua heap over its
+ * budget pays for the collection of its garbage immediately
+ */
+static void
+rspamd_worker_lua_gc_check_budget (struct rspamd_worker *worker)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	gsize heap;
+
+	if (ctx->lua_gc_interval <= 0 || ctx->lua_gc_budget == 0) {
+		return;
+	}
+
+	heap = rspamd_worker_lua_heap (ctx->cfg->lua_state);
+
+	if (heap > ctx->lua_gc_last_heap + ctx->lua_gc_budget) {
+		rspamd_worker_lua_gc_step (worker,
+				(heap - ctx->lua_gc_last_heap) / 1024);
+	}
+}
+
+/*
+ * Steps are scaled by idleness of the events loop, which is estimated by the
+ * delay of this timer and by the number of tasks in flight
+ */
+static void
+rspamd_worker_lua_gc_timer (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker *worker = ud;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	gdouble now, lag, idle;
+	gsize heap;
+	gint step;
+
+	now = rspamd_get_ticks ();
+	lag = now - ctx->lua_gc_last_run - ctx->lua_gc_interval;
+	ctx->lua_gc_last_run = now;
+
+	if (lag < 0) {
+		lag = 0;
+	}
+
+	idle = ctx->lua_gc_interval / (ctx->lua_gc_interval + lag);
+	idle /= worker->nconns + 1;
+	step = ctx->lua_gc_step * idle;
+	heap = rspamd_worker_lua_heap (ctx->cfg->lua_state);
+
+	/* Do not start new cycles if nothing has been allocated since the last one */
+	if (step > 0 && !(ctx->lua_gc_finished && heap <= ctx->lua_gc_last_heap)) {
+		rspamd_worker_lua_gc_step (worker, step);
+	}
+	else {
+		rspamd_worker_lua_heap_report (worker, heap);
+	}
+}
+
+static void
+rspamd_worker_lua_gc_start (struct rspamd_worker *worker)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	lua_State *L = ctx->cfg->lua_state;
+
+	if (ctx->lua_gc_interval <= 0) {
+		return;
+	}
+
+	lua_gc (L, LUA_GCSETPAUSE, LUA_GC_BACKSTOP_PAUSE);
+	ctx->lua_gc_last_heap = rspamd_worker_lua_heap (L);
+	rspamd_worker_lua_heap_report (worker, ctx->lua_gc_last_heap);
+	ctx->lua_gc_last_run = rspamd_get_ticks ();
+
+	double_to_tv (ctx->lua_gc_interval, &ctx->lua_gc_tv);
+	event_set (&ctx->lua_gc_ev, -1, EV_TIMEOUT | EV_PERSIST,
+			rspamd_worker_lua_gc_timer, worker);
+	event_base_set (ctx->ev_base, &ctx->lua_gc_ev);
+	event_add (&ctx->lua_gc_ev, &ctx->lua_gc_tv);
+}
+
+static void
+rspamd_worker_lua_gc_stop (struct rspamd_worker *worker)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+
+	if (ctx->lua_gc_interval <= 0) {
+		return;
+	}
+
+	event_del (&ctx->lua_gc_ev);
+	rspamd_worker_lua_heap_report (worker, 0);
+}
+
+static gboolean
+rspamd_worker_is_overloaded (struct rspamd_worker *worker)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+
+	if (ctx->max_tasks != 0 && worker->nconns >= ctx->max_tasks) {
+		return TRUE;
+	}
+
+	if (ctx->max_loop_lag > 0 && ctx->loop_lag > ctx->max_loop_lag) {
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Overloaded worker leaves new connections in the shared listen queue, so
+ * other workers take them instead of waiting behind its tasks
+ */
+static void
+rspamd_worker_check_accept (struct rspamd_worker *worker)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	gboolean overloaded;
+
+	if (worker->wanna_die) {
+		return;
+	}
+
+	overloaded = rspamd_worker_is_overloaded (worker);
+
+	if (overloaded && !ctx->accept_paused) {
+		msg_debug_ctx ("stop accepting: %ud tasks in flight, loop lag: %.3f",
+				worker->nconns, ctx->loop_lag);
+		rspamd_worker_pause_accept (worker, TRUE);
+		ctx->accept_paused = TRUE;
+	}
+	else if (!overloaded && ctx->accept_paused) {
+		msg_debug_ctx ("start accepting: %ud tasks in flight, loop lag: %.3f",
+				worker->nconns, ctx->loop_lag);
+		rspamd_worker_pause_accept (worker, FALSE);
+		ctx->accept_paused = FALSE;
+	}
+}
+
+static void
+rspamd_worker_loop_lag_timer (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker *worker = ud;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+	gdouble now;
+
+	now = rspamd_get_ticks ();
+	ctx->loop_lag = now - ctx->loop_lag_last_run - ctx->loop_lag_interval;
+	ctx->loop_lag_last_run = now;
+
+	if (ctx->loop_lag < 0) {
+		ctx->loop_lag = 0;
+	}
+
+	rspamd_worker_check_accept (worker);
+}
+
+static void
+rspamd_worker_loop_lag_start (struct rspamd_worker *worker)
+{
+	struct rspamd_worker_ctx *ctx = worker->ctx;
+
+	if (ctx->max_loop_lag <= 0) {
+		return;
+	}
+
+	ctx->loop_lag_interval = MIN (LOOP_LAG_INTERVAL, ctx->max_loop_lag);
+	ctx->loop_lag_last_run = rspamd_get_ticks ();
+	double_to_tv (ctx->loop_lag_interval, &ctx->loop_lag_tv);
+	event_set (&ctx->loop_lag_ev, -1, EV_TIMEOUT | EV_PERSIST,
+			rspamd_worker_loop_lag_timer, worker);
+	event_base_set (ctx->ev_base, &ctx->loop_lag_ev);
+	event_add (&ctx->loop_lag_ev, &ctx->loop_lag_tv);
+}
+
 /*
  * Reduce number of tasks proceeded
  */
@@ -133,8 +387,14 @@ static void
 reduce_tasks_count (gpointer arg)
 {
 	struct rspamd_worker *worker = arg;
+	struct rspamd_worker_ctx *ctx = worker->ctx;
 
 	worker->nconns --;
+	rspamd_worker_lua_gc_check_budget (worker);
+
+	if (ctx->accept_paused) {
+		rspamd_worker_check_accept (worker);
+	}
 
 	if (worker->wanna_die && worker->nconns == 0) {
 		msg_info ("performing finishing actions");
@@ -231,6 +491,10 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 
 	ctx = task->worker->ctx;
 
+	if (rspamd_http_message_is_keepalive (msg)) {
+		task->flags |= RSPAMD_TASK_FLAG_KEEPALIVE;
+	}
+
 	if (!rspamd_protocol_handle_request (task, msg)) {
 		msg_err_task ("cannot handle request: %e", task->err);
 		task->flags |= RSPAMD_TASK_FLAG_SKIP;
@@ -239,7 +503,7 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		if (task->cmd == CMD_PING) {
 			task->flags |= RSPAMD_TASK_FLAG_SKIP;
 		}
-		else {
+		else if (!rspamd_worker_prescan (ctx, task)) {
 			if (!rspamd_task_load_message (task, msg, chunk, len)) {
 				msg_err_task ("cannot load message: %e", task->err);
 				task->flags |= RSPAMD_TASK_FLAG_SKIP;
@@ -253,7 +517,8 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 				task);
 		event_base_set (ctx->ev_base, &task->timeout_ev);
 		double_to_tv (ctx->task_timeout, &task_tv);
-		event_add (&task->timeout_ev, &task_tv);
+		event_add (&task->timeout_ev,
+				rspamd_event_common_tv (ctx->ev_base, &task_tv));
 	}
 
 	/* Set socket guard */
@@ -274,6 +539,184 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	return 0;
 }
 
+struct rspamd_worker_prescan_bucket {
+	gdouble level;
+	gdouble last;
+};
+
+static void
+rspamd_worker_prescan_verdict (struct rspamd_task *task,
+		enum rspamd_metric_action action, const gchar *symbol,
+		const gchar *message)
+{
+	struct rspamd_metric_result *mres;
+
+	mres = rspamd_create_metric_result (task, DEFAULT_METRIC);
+
+	if (mres != NULL) {
+		mres->score = rspamd_task_get_required_score (task, mres);
+		mres->action = action;
+	}
+
+	task->pre_result.action = action;
+	task->pre_result.str = message;
+	ucl_object_insert_key (task->messages, ucl_object_fromstring (message),
+			"smtp_message", 0, false);
+	rspamd_task_insert_result (task, symbol, 1.0, NULL);
+	/* Nothing else is done for this task, it is replied as is */
+	task->processed_stages |= RSPAMD_TASK_STAGE_DONE;
+	msg_info_task ("<%s> prescan verdict %s: %s", task->message_id,
+			rspamd_action_to_str (action), message);
+}
+
+/*
+ * Leaky bucket per sender IP that is drained with the configured rate,
+ * buckets of idle addresses are expired by the lru
+ */
+static gboolean
+rspamd_worker_prescan_ratelimit (struct rspamd_worker_ctx *ctx,
+		struct rspamd_task *task)
+{
+	struct rspamd_worker_prescan_bucket *bk;
+	gdouble now, drain;
+	time_t tnow;
+
+	now = rspamd_get_ticks ();
+	tnow = now;
+
+	if (ctx->prescan_buckets == NULL) {
+		ctx->prescan_buckets = rspamd_lru_hash_new_full (PRESCAN_MAX_BUCKETS,
+				(GDestroyNotify)rspamd_inet_address_destroy, g_free,
+				rspamd_inet_address_hash, rspamd_inet_address_equal);
+	}
+
+	bk = rspamd_lru_hash_lookup (ctx->prescan_buckets, task->from_addr, tnow);
+
+	if (bk == NULL) {
+		bk = g_malloc0 (sizeof (*bk));
+		bk->last = now;
+		rspamd_lru_hash_insert (ctx->prescan_buckets,
+				rspamd_inet_address_copy (task->from_addr), bk, tnow,
+				ctx->prescan_ip_interval * 2);
+	}
+
+	drain = (now - bk->last) * ctx->prescan_ip_rate / ctx->prescan_ip_interval;
+	bk->level = MAX (bk->level - drain, 0);
+	bk->last = now;
+
+	if (bk->level + 1 > ctx->prescan_ip_rate) {
+		return TRUE;
+	}
+
+	bk->level += 1;
+
+	return FALSE;
+}
+
+/*
+ * Checks that could be done before message is parsed
+ * @return TRUE if task has got its final result
+ */
+static gboolean
+rspamd_worker_prescan (struct rspamd_worker_ctx *ctx, struct rspamd_task *task)
+{
+	gdouble delay;
+
+	if (task->flags & (RSPAMD_TASK_FLAG_LEARN_SPAM|RSPAMD_TASK_FLAG_LEARN_HAM)) {
+		return FALSE;
+	}
+
+	/* Load shedding: reply at once instead of making all tasks late */
+	if (ctx->shed_tasks > 0 || ctx->shed_delay > 0) {
+		delay = rspamd_get_ticks () - task->time_real;
+
+		if ((ctx->shed_tasks > 0 && task->worker->nconns > ctx->shed_tasks) ||
+				(ctx->shed_delay > 0 && delay > ctx->shed_delay)) {
+			msg_info_task ("shed task: %ud tasks in flight, waited %.3f",
+					task->worker->nconns, delay);
+			rspamd_worker_prescan_verdict (task, ctx->shed_action_id,
+					"WORKER_OVERLOADED", "Try again later");
+
+			return TRUE;
+		}
+	}
+
+	if (task->from_addr == NULL) {
+		return FALSE;
+	}
+
+	if (ctx->prescan_reject_map &&
+			radix_find_compressed_addr (ctx->prescan_reject_map,
+					task->from_addr) != RADIX_NO_VALUE) {
+		rspamd_worker_prescan_verdict (task, METRIC_ACTION_REJECT,
+				"PRESCAN_REJECT_IP", "IP address is blacklisted");
+
+		return TRUE;
+	}
+
+	if (ctx->prescan_ip_rate > 0 && ctx->prescan_ip_interval > 0 &&
+			rspamd_worker_prescan_ratelimit (ctx, task)) {
+		rspamd_worker_prescan_verdict (task, METRIC_ACTION_SOFT_REJECT,
+				"PRESCAN_RATELIMIT", "Ratelimit exceeded for IP address");
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_worker_prefetch_dns_cb (struct rdns_reply *reply, gpointer ud)
+{
+	/* We are interested merely in warming the recursive resolver */
+}
+
+static void
+rspamd_worker_prefetch_domain (struct rspamd_task *task, const gchar *domain,
+		gsize len)
+{
+	gchar *name;
+
+	if (len == 0 || task->resolver == NULL) {
+		return;
+	}
+
+	name = rspamd_mempool_alloc (task->task_pool, len + 1);
+	rspamd_strlcpy (name, domain, len + 1);
+
+	/* SPF records are fetched before everything else */
+	if (make_dns_request (task->resolver, NULL, NULL,
+			rspamd_worker_prefetch_dns_cb, NULL, RDNS_REQUEST_TXT, name)) {
+		msg_debug_task ("prefetch TXT records for %s", name);
+	}
+}
+
+/*
+ * Called when HTTP headers are read but the message itself is likely still
+ * being transferred, so we can start network requests that depend merely
+ * on the envelope data
+ */
+static gint
+rspamd_worker_headers_handler (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+
+	rspamd_protocol_handle_headers (task, msg);
+	task->flags |= RSPAMD_TASK_FLAG_PROTOCOL_HEADERS;
+
+	if (task->from_envelope) {
+		rspamd_worker_prefetch_domain (task, task->from_envelope->domain,
+				task->from_envelope->domain_len);
+	}
+
+	if (task->helo) {
+		rspamd_worker_prefetch_domain (task, task->helo, strlen (task->helo));
+	}
+
+	return 0;
+}
+
 static void
 rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
@@ -283,6 +726,7 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 
 	msg_info_task ("abnormally closing connection from: %s, error: %e",
 		rspamd_inet_address_to_string (task->client_addr), err);
+	task->flags &= ~RSPAMD_TASK_FLAG_KEEPALIVE;
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
 		/* Terminate session immediately */
 		rspamd_session_destroy (task->s);
@@ -319,17 +763,47 @@ rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 	}
 }
 
+static void rspamd_worker_accept_task (struct rspamd_worker *worker, gint nfd,
+		rspamd_inet_addr_t *addr);
+
 static gint
 rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_worker *worker;
+	rspamd_inet_addr_t *addr = NULL;
+	gint nfd = -1;
 
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
 		/* We are done here */
-		msg_debug_task ("normally closing connection from: %s",
-			rspamd_inet_address_to_string (task->client_addr));
+		worker = task->worker;
+
+		if ((task->flags & RSPAMD_TASK_FLAG_KEEPALIVE) && !worker->wanna_die) {
+			/* Detach socket from the task to wait for the next request */
+			msg_debug_task ("keep connection from: %s",
+					rspamd_inet_address_to_string (task->client_addr));
+			nfd = task->sock;
+			task->sock = -1;
+			addr = rspamd_inet_address_copy (task->client_addr);
+
+			if (task->guard_ev) {
+				event_del (task->guard_ev);
+				task->guard_ev = NULL;
+			}
+
+			rspamd_http_connection_reset (conn);
+		}
+		else {
+			msg_debug_task ("normally closing connection from: %s",
+				rspamd_inet_address_to_string (task->client_addr));
+		}
+
 		rspamd_session_destroy (task->s);
+
+		if (nfd != -1) {
+			rspamd_worker_accept_task (worker, nfd, addr);
+		}
 	}
 	else if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
 		rspamd_session_pending (task->s);
@@ -346,16 +820,14 @@ accept_socket (gint fd, short what, void *arg)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *) arg;
 	struct rspamd_worker_ctx *ctx;
-	struct rspamd_task *task;
 	rspamd_inet_addr_t *addr;
 	gint nfd;
 
 	ctx = worker->ctx;
 
-	if (ctx->max_tasks != 0 && worker->nconns > ctx->max_tasks) {
-		msg_info_ctx ("current tasks is now: %uD while maximum is: %uD",
-				worker->nconns,
-			ctx->max_tasks);
+	if (rspamd_worker_is_overloaded (worker)) {
+		/* Level triggered event would fire again until we stop listening */
+		rspamd_worker_check_accept (worker);
 		return;
 	}
 
@@ -369,6 +841,20 @@ accept_socket (gint fd, short what, void *arg)
 		return;
 	}
 
+	rspamd_worker_accept_task (worker, nfd, addr);
+}
+
+/*
+ * Construct task for a connected socket
+ */
+static void
+rspamd_worker_accept_task (struct rspamd_worker *worker, gint nfd,
+		rspamd_inet_addr_t *addr)
+{
+	struct rspamd_worker_ctx *ctx;
+	struct rspamd_task *task;
+
+	ctx = worker->ctx;
 	task = rspamd_task_new (worker, ctx->cfg);
 
 	msg_info_task ("accepted connection from %s port %d, task ptr: %p",
@@ -387,7 +873,7 @@ accept_socket (gint fd, short what, void *arg)
 	task->sock = nfd;
 	task->client_addr = addr;
 
-	worker->srv->stat->connections_count++;
+	rspamd_main_counter_add (worker->srv, RSPAMD_COUNTER_CONNECTIONS, 1);
 	task->resolver = ctx->resolver;
 	/* TODO: allow to disable autolearn in protocol */
 	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
@@ -400,10 +886,17 @@ accept_socket (gint fd, short what, void *arg)
 			ctx->keys_cache,
 			NULL);
 	rspamd_http_connection_set_max_size (task->http_conn, task->cfg->max_message);
+
+	if (ctx->prefetch_envelope) {
+		rspamd_http_connection_set_headers_handler (task->http_conn,
+				rspamd_worker_headers_handler);
+	}
+
 	task->ev_base = ctx->ev_base;
 	worker->nconns++;
 	rspamd_mempool_add_destructor (task->task_pool,
 		(rspamd_mempool_destruct_t)reduce_tasks_count, worker);
+	rspamd_worker_check_accept (worker);
 
 	/* Set up async session */
 	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
@@ -434,7 +927,13 @@ rspamd_worker_hyperscan_ready (struct rspamd_main *rspamd_main,
 	memset (&rep, 0, sizeof (rep));
 	rep.type = RSPAMD_CONTROL_HYPERSCAN_LOADED;
 
-	if (!rspamd_re_cache_is_hs_loaded (cache) || cmd->cmd.hs_loaded.forced) {
+	if (cmd->cmd.hs_loaded.re_class[0] != '\0') {
+		/* A single class has been compiled */
+		rep.reply.hs_loaded.status = rspamd_re_cache_load_hyperscan_class (
+				cache, cmd->cmd.hs_loaded.cache_dir,
+				cmd->cmd.hs_loaded.re_class);
+	}
+	else if (!rspamd_re_cache_is_hs_loaded (cache) || cmd->cmd.hs_loaded.forced) {
 		msg_info ("loading hyperscan expressions after receiving compilation "
 				"notice: %s",
 				(!rspamd_re_cache_is_hs_loaded (cache)) ?
@@ -503,6 +1002,13 @@ init_worker (struct rspamd_config *cfg)
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->cfg = cfg;
 	ctx->task_timeout = DEFAULT_TASK_TIMEOUT;
+	ctx->export_batch = DEFAULT_EXPORT_BATCH;
+	ctx->export_interval = DEFAULT_EXPORT_INTERVAL;
+	ctx->lua_gc_budget = DEFAULT_LUA_GC_BUDGET;
+	ctx->lua_gc_interval = DEFAULT_LUA_GC_INTERVAL;
+	ctx->lua_gc_step = DEFAULT_LUA_GC_STEP;
+	ctx->prescan_ip_interval = DEFAULT_PRESCAN_IP_INTERVAL;
+	ctx->shed_action_id = METRIC_ACTION_SOFT_REJECT;
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -570,7 +1076,27 @@ init_worker (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
 						max_tasks),
 			RSPAMD_CL_FLAG_INT_32,
-			"Maximum count of parallel tasks processed by a single worker process");
+			"Maximum count of parallel tasks processed by a single worker process, "
+			"new connections are left to other workers when it is reached");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"max_loop_lag",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, max_loop_lag),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Stop accepting new connections while events loop is late for more "
+			"than this time (0 to disable)");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"prefetch_envelope",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, prefetch_envelope),
+			0,
+			"Start DNS requests for envelope data while message body is being received");
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -582,6 +1108,137 @@ init_worker (struct rspamd_config *cfg)
 			0,
 			"Encryption keypair");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"export_file",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, export_file),
+			0,
+			"Append binary summaries of scanned messages to this file");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"export_socket",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, export_socket),
+			0,
+			"Send binary summaries of scanned messages to this unix datagram socket");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"export_batch",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, export_batch),
+			RSPAMD_CL_FLAG_INT_32,
+			"Number of messages in an export batch, default: "
+					G_STRINGIFY(DEFAULT_EXPORT_BATCH));
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"export_interval",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, export_interval),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Flush incomplete export batches after this interval, default: "
+					G_STRINGIFY(DEFAULT_EXPORT_INTERVAL)
+					" seconds");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"lua_gc_budget",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, lua_gc_budget),
+			RSPAMD_CL_FLAG_INT_SIZE,
+			"Collect Lua garbage when a task grows Lua heap by more than this "
+			"size, default: 4Mb");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"lua_gc_interval",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, lua_gc_interval),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Interval of incremental Lua GC steps, 0 to use automatic "
+			"collections, default: "
+					G_STRINGIFY(DEFAULT_LUA_GC_INTERVAL)
+					" seconds");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"lua_gc_step",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, lua_gc_step),
+			RSPAMD_CL_FLAG_INT_32,
+			"Size of Lua GC step in kilobytes when worker is idle, default: "
+					G_STRINGIFY(DEFAULT_LUA_GC_STEP));
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"prescan_reject_ip",
+			rspamd_rcl_parse_struct_ucl,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, prescan_reject_ip),
+			0,
+			"Reject messages from these IP addresses without parsing them");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"prescan_ip_rate",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, prescan_ip_rate),
+			RSPAMD_CL_FLAG_INT_32,
+			"Soft reject messages without parsing them when an IP address "
+			"sends more than this number of messages per prescan_ip_interval "
+			"to this worker, 0 to disable");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"prescan_ip_interval",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, prescan_ip_interval),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Interval for prescan_ip_rate, default: "
+					G_STRINGIFY(DEFAULT_PRESCAN_IP_INTERVAL)
+					" seconds");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"shed_tasks",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, shed_tasks),
+			RSPAMD_CL_FLAG_INT_32,
+			"Reply with shed_action without scanning when more tasks are in "
+			"flight, 0 to disable");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"shed_delay",
+			rspamd_rcl_parse_struct_time,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, shed_delay),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Reply with shed_action without scanning when a task waited longer "
+			"since its connection was accepted, 0 to disable");
+
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"shed_action",
+			rspamd_rcl_parse_struct_string,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, shed_action),
+			0,
+			"Action for shed tasks, default: soft reject");
+
 	return ctx;
 }
 
@@ -606,6 +1263,7 @@ start_worker (struct rspamd_worker *worker)
 {
 	struct rspamd_worker_ctx *ctx = worker->ctx;
 	struct rspamd_worker_log_pipe *lp, *ltmp;
+	struct rspamd_srv_command srv_cmd;
 
 	ctx->cfg = worker->srv->cfg;
 	ctx->ev_base = rspamd_prepare_worker (worker, "normal", accept_socket, TRUE);
@@ -623,13 +1281,37 @@ start_worker (struct rspamd_worker *worker)
 	rspamd_monitored_ctx_config (worker->srv->cfg->monitored_ctx,
 			worker->srv->cfg, ctx->ev_base, ctx->resolver->r);
 
+	if (ctx->prescan_reject_ip != NULL) {
+		rspamd_config_radix_from_ucl (ctx->cfg, ctx->prescan_reject_ip,
+				"Reject messages from these addresses before parsing",
+				&ctx->prescan_reject_map, NULL);
+	}
+
+	if (ctx->shed_action != NULL &&
+			!rspamd_action_from_str (ctx->shed_action, &ctx->shed_action_id)) {
+		msg_err_ctx ("invalid shed_action: %s, use soft reject",
+				ctx->shed_action);
+		ctx->shed_action_id = METRIC_ACTION_SOFT_REJECT;
+	}
+
 	/* XXX: stupid default */
 	ctx->keys_cache = rspamd_keypair_cache_new (256);
+	rspamd_keypair_cache_set_shared (ctx->keys_cache,
+			worker->srv->cfg->keypair_shared_cache);
 	rspamd_stat_init (worker->srv->cfg, ctx->ev_base);
 	g_ptr_array_add (worker->finish_actions,
 			(gpointer) rspamd_worker_on_terminate);
 
 #ifdef WITH_HYPERSCAN
+	if (worker->srv->cfg->hs_cache_dir && !worker->srv->cfg->disable_hyperscan) {
+		/*
+		 * Use databases for unchanged classes while hs_helper compiles
+		 * the rest of them
+		 */
+		rspamd_re_cache_load_hyperscan (worker->srv->cfg->re_cache,
+				worker->srv->cfg->hs_cache_dir);
+	}
+
 	rspamd_control_worker_add_cmd_handler (worker,
 			RSPAMD_CONTROL_HYPERSCAN_LOADED,
 			rspamd_worker_hyperscan_ready,
@@ -640,14 +1322,35 @@ start_worker (struct rspamd_worker *worker)
 			RSPAMD_CONTROL_LOG_PIPE,
 			rspamd_worker_log_pipe_handler,
 			ctx);
+	ctx->exporter = rspamd_task_exporter_new (ctx->cfg, ctx->ev_base,
+			ctx->export_file, ctx->export_socket, ctx->export_batch,
+			ctx->export_interval);
+	rspamd_worker_lua_gc_start (worker);
+	rspamd_worker_loop_lag_start (worker);
+
+	/* Configuration is loaded, so main process can stop old workers */
+	memset (&srv_cmd, 0, sizeof (srv_cmd));
+	srv_cmd.type = RSPAMD_SRV_WORKER_READY;
+	rspamd_srv_send_command (worker, ctx->ev_base, &srv_cmd, -1, NULL, NULL);
+
 	event_base_loop (ctx->ev_base, 0);
 	rspamd_worker_block_signals ();
+	rspamd_worker_lua_gc_stop (worker);
+
+	if (ctx->max_loop_lag > 0) {
+		event_del (&ctx->loop_lag_ev);
+	}
+	rspamd_task_exporter_destroy (ctx->exporter);
 
 	rspamd_stat_close ();
 	rspamd_log_close (worker->srv->logger);
 
 	rspamd_keypair_cache_destroy (ctx->keys_cache);
 
+	if (ctx->prescan_buckets) {
+		rspamd_lru_hash_destroy (ctx->prescan_buckets);
+	}
+
 	DL_FOREACH_SAFE (ctx->log_pipes, lp, ltmp) {
 		close (lp->fd);
 		g_slice_free1 (sizeof (*lp), lp);
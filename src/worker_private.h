@@ -22,6 +22,9 @@
 #include "libserver/task.h"
 #include "libserver/cfg_file.h"
 #include "libserver/rspamd_control.h"
+#include "libserver/task_export.h"
+#include "libutil/hash.h"
+#include "libutil/radix.h"
 
 /*
  * Worker's context
@@ -62,6 +65,44 @@ struct rspamd_worker_ctx {
 	struct rspamd_config *cfg;
 	/* Log pipe */
 	struct rspamd_worker_log_pipe *log_pipes;
+	/* Start DNS requests for envelope data while message is being read */
+	gboolean prefetch_envelope;
+	/* Binary export of tasks results */
+	gchar *export_file;
+	gchar *export_socket;
+	guint32 export_batch;
+	gdouble export_interval;
+	struct rspamd_task_exporter *exporter;
+	/* Lua GC driven by the worker */
+	gsize lua_gc_budget;
+	gdouble lua_gc_interval;
+	guint32 lua_gc_step;
+	struct event lua_gc_ev;
+	struct timeval lua_gc_tv;
+	gdouble lua_gc_last_run;
+	gboolean lua_gc_finished;
+	/* Lua heap after the last GC step and the size reported to stat */
+	gsize lua_gc_last_heap;
+	gsize lua_heap_reported;
+	/* Verdicts given from envelope before the message is parsed */
+	const ucl_object_t *prescan_reject_ip;
+	radix_compressed_t *prescan_reject_map;
+	guint32 prescan_ip_rate;
+	gdouble prescan_ip_interval;
+	rspamd_lru_hash_t *prescan_buckets;
+	/* Stop accepting while too many tasks are in flight or the loop is late */
+	gdouble max_loop_lag;
+	gdouble loop_lag;
+	gdouble loop_lag_last_run;
+	gdouble loop_lag_interval;
+	struct event loop_lag_ev;
+	struct timeval loop_lag_tv;
+	gboolean accept_paused;
+	/* Tasks are answered without scanning when worker is overloaded */
+	guint32 shed_tasks;
+	gdouble shed_delay;
+	gchar *shed_action;
+	gint shed_action_id;
 };
 
 #endif
@@ -1,6 +1,7 @@
 import demjson
 import grp
 import ipaddress
+import json
 import os
 import os.path
 import psutil
@@ -9,8 +10,10 @@ import shutil
 import signal
 import socket
 import string
+import subprocess
 import sys
 import tempfile
+import threading
 import time
 
 if sys.version_info > (3,):
@@ -70,6 +73,150 @@ def HTTP(method, host, port, path, data=None, headers={}):
     c.close()
     return [s, t]
 
+def load_corpus(path):
+    if os.path.isdir(path):
+        files = sorted(os.path.join(path, f) for f in os.listdir(path))
+    else:
+        files = [path]
+    corpus = [open(f, 'rb').read() for f in files if os.path.isfile(f)]
+    assert len(corpus) > 0, "No messages in %s" % path
+    return corpus
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    k = int(round(p / 100.0 * (len(values) - 1)))
+    return values[k]
+
+def process_tree_rss(pid):
+    proc = psutil.Process(pid=int(pid))
+    procs = [proc] + proc.children(recursive=True)
+    rss = 0
+    for p in procs:
+        try:
+            rss += p.memory_info().rss
+        except psutil.Error:
+            pass
+    return {'total': rss, 'processes': len(procs)}
+
+def redis_command(addr, port, *args):
+    s = socket.create_connection((addr, int(port)))
+    req = "*%d\r\n" % len(args)
+    for a in args:
+        a = str(a)
+        req += "$%d\r\n%s\r\n" % (len(a), a)
+    s.sendall(req.encode('utf-8'))
+    f = s.makefile('rb')
+    line = f.readline().decode('utf-8').rstrip('\r\n')
+    if line[0] == '$':
+        ln = int(line[1:])
+        reply = f.read(ln + 2)[:-2].decode('utf-8') if ln >= 0 else None
+    else:
+        assert line[0] != '-', "Redis error: %s" % line[1:]
+        reply = line[1:]
+    f.close()
+    s.close()
+    return reply
+
+def redis_command_stats(addr, port):
+    stats = {}
+    for line in redis_command(addr, port, 'INFO', 'commandstats').splitlines():
+        if line.startswith('cmdstat_'):
+            name, values = line[len('cmdstat_'):].split(':', 1)
+            calls = dict(kv.split('=') for kv in values.split(','))['calls']
+            stats[name] = int(calls)
+    return stats
+
+def run_load(addr, port, corpus, conns=16, duration=10.0, path='/checkv2'):
+    """Sends messages from corpus in a loop over `conns` keep-alive
+    connections for `duration` seconds and returns throughput and latency
+    percentiles (in milliseconds) of successful requests"""
+    messages = load_corpus(corpus)
+    conns = int(conns)
+    deadline = time.time() + float(duration)
+    lock = threading.Lock()
+    latencies = []
+    errors = [0]
+
+    def worker(n):
+        c = None
+        i = n
+        lat = []
+        err = 0
+        while time.time() < deadline:
+            msg = messages[i % len(messages)]
+            i += conns
+            try:
+                if c is None:
+                    c = httplib.HTTPConnection(addr, int(port), timeout=60)
+                    c.connect()
+                    c.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                t1 = time.time()
+                c.request('POST', path, msg, {'Connection': 'keep-alive'})
+                r = c.getresponse()
+                r.read()
+                t2 = time.time()
+                if r.status == 200:
+                    lat.append(t2 - t1)
+                else:
+                    err += 1
+                if r.will_close:
+                    c.close()
+                    c = None
+            except Exception:
+                err += 1
+                if c is not None:
+                    c.close()
+                    c = None
+        if c is not None:
+            c.close()
+        with lock:
+            latencies.extend(lat)
+            errors[0] += err
+
+    start = time.time()
+    threads = [threading.Thread(target=worker, args=(n,)) for n in range(conns)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.time() - start
+    latencies.sort()
+    ms = [l * 1000.0 for l in latencies]
+
+    return {
+        'requests': len(ms),
+        'errors': errors[0],
+        'conns': conns,
+        'messages': len(messages),
+        'elapsed': elapsed,
+        'rps': len(ms) / elapsed,
+        'latency': {
+            'mean': sum(ms) / len(ms) if ms else 0.0,
+            'p50': percentile(ms, 50),
+            'p90': percentile(ms, 90),
+            'p99': percentile(ms, 99),
+            'max': ms[-1] if ms else 0.0,
+        },
+    }
+
+def write_load_results(filename, name, results):
+    """Appends results of a load run as a json line tagged with the commit"""
+    try:
+        commit = subprocess.check_output(['git', '-C', get_top_dir(),
+            'rev-parse', '--short', 'HEAD']).decode('utf-8').strip()
+    except Exception:
+        commit = os.environ.get('RSPAMD_COMMIT', 'unknown')
+    record = {
+        'name': name,
+        'commit': commit,
+        'time': int(time.time()),
+        'results': results,
+    }
+    with open(filename, 'a') as f:
+        f.write(json.dumps(record, sort_keys=True) + "\n")
+    return record
+
 def make_temporary_directory():
     return tempfile.mkdtemp()
 
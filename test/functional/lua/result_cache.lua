@@ -0,0 +1,23 @@
+local calls = {
+  content = 0,
+  normal = 0,
+}
+
+rspamd_config:register_symbol({
+  name = 'RC_CONTENT',
+  score = 1.0,
+  flags = 'content',
+  callback = function()
+    calls.content = calls.content + 1
+    return true, tostring(calls.content)
+  end
+})
+
+rspamd_config:register_symbol({
+  name = 'RC_NORMAL',
+  score = 1.0,
+  callback = function()
+    calls.normal = calls.normal + 1
+    return true, tostring(calls.normal)
+  end
+})
@@ -0,0 +1,43 @@
+context("Blocked bloom filter", function()
+  local rspamd_bloom = require "rspamd_bloom"
+
+  test("Add and check", function()
+    local bf = rspamd_bloom.create(1000, 0.01)
+    for i = 1,1000 do
+      assert_true(bf:add('elt' .. tostring(i)))
+    end
+    assert_equal(bf:count(), 1000)
+
+    for i = 1,1000 do
+      assert_true(bf:check('elt' .. tostring(i)))
+    end
+
+    local fp = 0
+    for i = 1,10000 do
+      if bf:check('other' .. tostring(i)) then fp = fp + 1 end
+    end
+    -- Expected rate is 1%, leave space for randomness
+    assert_true(fp < 300, 'too many false positives: ' .. tostring(fp))
+  end)
+
+  test("Save and load", function()
+    local bf = rspamd_bloom.create(100)
+    bf:add({'a', 'b', 'c'})
+    local fname = os.tmpname()
+    assert_true(bf:save(fname))
+
+    local ro = rspamd_bloom.load(fname)
+    os.remove(fname)
+    assert_not_nil(ro)
+    assert_true(ro:check('a'))
+    assert_true(ro:check('c'))
+    assert_equal(ro:count(), 3)
+    assert_equal(ro:size(), bf:size())
+    -- Mapped filters are read only
+    assert_false(ro:add('d'))
+
+    local bad, err = rspamd_bloom.from_string('not a filter')
+    assert_nil(bad)
+    assert_not_nil(err)
+  end)
+end)
@@ -96,6 +96,8 @@ context("Rspamd expressions", function()
        {'(B) & (D) & ((G) | (H) | (I) | (A))', 0},
        {'A & C & (!D || !C || !E)', 1},
        {'A & C & !(D || C || E)', 0},
+       {'A & !A', 0},
+       {'(A + A + C + B) >= 3', 1},
     }
     for _,c in ipairs(cases) do
       local expr,err = rspamd_expression.create(c[1],
@@ -108,6 +110,32 @@ context("Rspamd expressions", function()
         expr:to_string(), c[1], res, c[2]))
     end
 
+    pool:destroy()
+  end)
+  test("Expression dynamic reordering", function()
+    local function process_func(token, input)
+      if input[token] then return 1 end
+      return 0
+    end
+
+    local pool = rspamd_mempool.create()
+    local atoms = {
+      A = true,
+      B = false,
+    }
+    local expr,err = rspamd_expression.create('A & B',
+      {parse_func, process_func}, pool)
+
+    assert_not_nil(expr, "Cannot parse A & B")
+    assert_equal(expr:to_string(), '(A) (B) &')
+
+    for _ = 1,300 do
+      assert_equal(expr:process(atoms), 0)
+    end
+
+    -- B is always false, so it should be checked first
+    assert_equal(expr:to_string(), '(B) (A) &')
+
     pool:destroy()
   end)
 end)
@@ -66,4 +66,21 @@ context("HTML processing", function()
       assert_equal(c[2], tostring(t))
     end
   end)
+
+  test("Decode HTML entities", function()
+    local cases = {
+      {'no entities', 'no entities'},
+      {'&lt;b&gt; &amp; &quot;q&quot;', '<b> & "q"'},
+      {'&#65;&#x42;&#X43;', 'ABC'},
+      {'AT&T &unknown; &#xZZ;', 'AT&T &unknown; &#xZZ;'},
+      {'&amp;amp;', '&amp;'},
+    }
+
+    for _,c in ipairs(cases) do
+      local t = rspamd_util.decode_html_entities(c[1])
+
+      assert_not_nil(t)
+      assert_equal(c[2], tostring(t))
+    end
+  end)
 end)
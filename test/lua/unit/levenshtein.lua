@@ -0,0 +1,135 @@
+-- Test edit distance routines
+
+context("Levenshtein distance", function()
+  local ffi = require("ffi")
+  local util = require("rspamd_util")
+
+  ffi.cdef[[
+    int rspamd_strings_levenshtein_distance_bounded (const char *s1, size_t s1len,
+      const char *s2, size_t s2len, unsigned int replace_cost,
+      unsigned int max_dist);
+  ]]
+
+  -- Plain dynamic programming distance
+  local function reference(s1, s2, replace_cost)
+    local prev, cur = {}, {}
+
+    for j = 0, #s2 do prev[j] = j end
+
+    for i = 1, #s1 do
+      cur[0] = i
+      for j = 1, #s2 do
+        local cost = s1:byte(i) == s2:byte(j) and 0 or replace_cost
+        cur[j] = math.min(prev[j] + 1, cur[j - 1] + 1, prev[j - 1] + cost)
+      end
+      prev, cur = cur, prev
+    end
+
+    return prev[#s2]
+  end
+
+  -- Expected result when the distance is bounded by max_dist
+  local function bounded(dist, max_dist, s1, s2)
+    local limit = math.min(max_dist, #s1 + #s2)
+    if dist > limit then return limit + 1 end
+    return dist
+  end
+
+  -- Deterministic strings over a small alphabet to get many matches
+  local seed = 1
+  local function rand(n)
+    seed = (seed * 1103515245 + 12345) % 2147483648
+    return seed % n
+  end
+
+  local function random_string(len)
+    local t = {}
+    for i = 1, len do t[i] = string.char(97 + rand(4)) end
+    return table.concat(t)
+  end
+
+  local function mutate(s, nedits)
+    for _ = 1, nedits do
+      local pos = rand(#s) + 1
+      local op = rand(3)
+      local c = string.char(97 + rand(5))
+      if op == 0 then
+        s = s:sub(1, pos - 1) .. c .. s:sub(pos + 1)
+      elseif op == 1 then
+        s = s:sub(1, pos - 1) .. c .. s:sub(pos)
+      elseif #s > 1 then
+        s = s:sub(1, pos - 1) .. s:sub(pos + 1)
+      end
+    end
+    return s
+  end
+
+  local function c_distance(s1, s2, replace_cost, max_dist)
+    return ffi.C.rspamd_strings_levenshtein_distance_bounded(s1, #s1, s2, #s2,
+      replace_cost, max_dist)
+  end
+
+  test("Known distances", function()
+    local cases = {
+      {"kitten", "sitting", 1, 3},
+      {"kitten", "sitting", 2, 5},
+      {"flaw", "lawn", 1, 2},
+      {"abc", "abc", 1, 0},
+      {"abc", "xyz", 1, 3},
+      {"abc", "xyz", 2, 6},
+      {"abc", "xyz", 3, 6},
+    }
+
+    for _,c in ipairs(cases) do
+      assert_equal(c_distance(c[1], c[2], c[3], 1000), c[4])
+      assert_equal(util.levenshtein_distance(c[1], c[2], c[3]), c[4])
+    end
+  end)
+
+  test("Strings longer than 64 characters", function()
+    for _,len in ipairs({63, 64, 65, 100, 200, 500}) do
+      for _,replace_cost in ipairs({1, 2, 3}) do
+        local s1 = random_string(len)
+        local s2 = mutate(s1, rand(math.floor(len / 4)) + 1)
+        local dist = reference(s1, s2, replace_cost)
+
+        assert_equal(c_distance(s1, s2, replace_cost, 100500), dist,
+          string.format("len %d, cost %d", len, replace_cost))
+        assert_equal(c_distance(s2, s1, replace_cost, 100500), dist)
+        assert_equal(util.levenshtein_distance(s1, s2, replace_cost), dist)
+        assert_equal(util.levenshtein_distance(s1, s2, replace_cost, 100500),
+          dist)
+      end
+    end
+  end)
+
+  test("Bounded distance", function()
+    for _,len in ipairs({10, 64, 65, 150, 300}) do
+      for _,replace_cost in ipairs({1, 2, 3}) do
+        local s1 = random_string(len)
+        local s2 = mutate(s1, rand(math.floor(len / 3)) + 2)
+        local dist = reference(s1, s2, replace_cost)
+
+        for _,max_dist in ipairs({0, 1, dist - 1, dist, dist + 1, 2 * dist}) do
+          if max_dist >= 0 then
+            local expected = bounded(dist, max_dist, s1, s2)
+            assert_equal(c_distance(s1, s2, replace_cost, max_dist), expected,
+              string.format("len %d, cost %d, max %d", len, replace_cost,
+                max_dist))
+            assert_equal(util.levenshtein_distance(s1, s2, replace_cost,
+              max_dist), expected)
+          end
+        end
+      end
+    end
+  end)
+
+  test("Bound by length difference", function()
+    local s1 = random_string(100)
+    local s2 = s1 .. random_string(30)
+
+    assert_equal(c_distance(s1, s2, 1, 10), 11)
+    assert_equal(util.levenshtein_distance(s1, s2, 2, 29), 30)
+    assert_equal(util.levenshtein_distance(s1, s2, 2, 30), 30)
+  end)
+end)
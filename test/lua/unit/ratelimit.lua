@@ -0,0 +1,67 @@
+context("Ratelimit local buckets", function()
+  local rspamd_ratelimit = require "rspamd_ratelimit"
+
+  test("Leak and update", function()
+    local rl = rspamd_ratelimit.create(16, 86400)
+    local buckets = {{'rl:to:a', 10, 1.0}, {'rl:to:b', 10, 0.5}}
+    local levels = rl:check(buckets, 100)
+    assert_equal(levels[1], 0)
+    assert_equal(levels[2], 0)
+    rl:update(buckets, 100)
+    rl:update(buckets, 100)
+    levels = rl:check(buckets, 101)
+    assert_equal(levels[1], 1)
+    assert_equal(levels[2], 1.5)
+    levels = rl:check(buckets, 110)
+    assert_equal(levels[1], 0)
+    assert_equal(levels[2], 0)
+  end)
+
+  test("Drain and reconcile", function()
+    local rl = rspamd_ratelimit.create(16, 86400)
+    local buckets = {{'rl:ip:1.2.3.4', 10, 0.0}}
+    rl:update(buckets, 100)
+    rl:update(buckets, 100)
+    local pending = rl:drain()
+    assert_equal(#pending, 1)
+    assert_equal(pending[1][1], 'rl:ip:1.2.3.4')
+    assert_equal(pending[1][2], 2)
+    assert_equal(#rl:drain(), 0)
+    -- Increment made while sync is in flight is preserved
+    rl:update(buckets, 100)
+    rl:reconcile('rl:ip:1.2.3.4', 7, 100)
+    assert_equal(rl:check(buckets, 100)[1], 8)
+    -- Failed sync requeues in flight increments
+    pending = rl:drain()
+    assert_equal(pending[1][2], 1)
+    rl:reconcile('rl:ip:1.2.3.4', nil)
+    pending = rl:drain()
+    assert_equal(pending[1][2], 1)
+  end)
+
+  test("Drain while sync is in flight", function()
+    local rl = rspamd_ratelimit.create(16, 86400)
+    local buckets = {{'rl:ip:1.2.3.4', 10, 0.0}, {'rl:ip:5.6.7.8', 10, 0.0}}
+    rl:update(buckets, 100)
+    rl:update(buckets, 100)
+    assert_equal(#rl:drain(), 2)
+    -- Bucket with sync in flight stays queued until its reply is reconciled
+    rl:update({buckets[1]}, 100)
+    assert_equal(#rl:drain(), 0)
+    local _, ndirty = rl:size()
+    assert_equal(ndirty, 1)
+    rl:reconcile('rl:ip:1.2.3.4', 2, 100)
+    rl:reconcile('rl:ip:5.6.7.8', 2, 100)
+    assert_equal(rl:check(buckets, 100)[1], 3)
+    local pending = rl:drain()
+    assert_equal(#pending, 1)
+    assert_equal(pending[1][2], 1)
+    -- Final flush sends only new increments of buckets being synced
+    rl:update({buckets[1]}, 100)
+    pending = rl:drain(nil, true)
+    assert_equal(#pending, 1)
+    assert_equal(pending[1][2], 1)
+    rl:reconcile('rl:ip:1.2.3.4', 4, 100)
+    assert_equal(rl:check(buckets, 100)[1], 4)
+  end)
+end)
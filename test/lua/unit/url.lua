@@ -155,4 +155,20 @@ context("URL check functions", function()
       assert_equal(v[2], res, 'expected ' .. v[2] .. ' but got ' .. res .. ' in path ' .. v[1])
     end
   end)
+
+  test("Get tld", function()
+    local util = require("rspamd_util")
+    local cases = {
+      {"www.google.com", "google.com"},
+      {"test.com", "test.com"},
+      {"Mail.Example.ORG", "Example.ORG"},
+      {"сайт.тест.рф", "тест.рф"},
+      {"com", "com"},
+      {"host.unknown", "host.unknown"},
+    }
+
+    for _,c in ipairs(cases) do
+      assert_equal(c[2], util.get_tld(c[1]))
+    end
+  end)
 end)
@@ -5,6 +5,7 @@ context("UTF8 check functions", function()
   ffi.cdef[[
     void rspamd_str_lc_utf8 (char *str, unsigned int size);
     void rspamd_str_lc (char *str, unsigned int size);
+    int rspamd_lc_cmp (const char *s, const char *d, size_t l);
   ]]
 
   test("UTF lowercase", function()
@@ -26,7 +27,9 @@ context("UTF8 check functions", function()
       {"AbCdEf", "abcdef"},
       {"A", "a"},
       {"AaAa", "aaaa"},
-      {"AaAaAaAa", "aaaaaaaa"}
+      {"AaAaAaAa", "aaaaaaaa"},
+      {"ABCDEFGHIJKLMNOPQRSTUVWXYZ@[`{", "abcdefghijklmnopqrstuvwxyz@[`{"},
+      {"X-Spam-Header-Name-Written-In-CAPS", "x-spam-header-name-written-in-caps"}
     }
     
     for _,c in ipairs(cases) do
@@ -37,4 +40,18 @@ context("UTF8 check functions", function()
       assert_equal(s, c[2])
     end
   end)
-end)
\ No newline at end of file
+  test("ASCII case insensitive compare", function()
+    local cases = {
+      {"Content-Transfer-Encoding", "content-transfer-encoding", true},
+      {"Content-Transfer-Encoding", "content-transfer-encodinG", true},
+      {"Content-Transfer-Encoding", "content-transfer-encodinx", false},
+      {"Content-Transfer-Encodin@", "content-transfer-encodin`", false},
+      {"A", "b", false},
+    }
+
+    for _,c in ipairs(cases) do
+      local res = ffi.C.rspamd_lc_cmp(c[1], c[2], #c[1])
+      assert_equal(res == 0, c[3])
+    end
+  end)
+end)
@@ -152,6 +152,179 @@ create_constrainted_split (struct rspamd_cryptobox_segment *seg, int mseg,
 	return used;
 }
 
+static const gint hash_bench_keys = 100000;
+static const gint hash_bench_rounds = 10;
+
+/* Word-like keys (2-12 letters) or URL-like keys (20-100 bytes) */
+static gchar *
+create_hash_keys (gint nkeys, gboolean urls, gsize *lens)
+{
+	gchar *buf, *p;
+	gsize len, j;
+	gint i;
+
+	buf = g_malloc (nkeys * 100);
+	p = buf;
+
+	for (i = 0; i < nkeys; i ++) {
+		if (urls) {
+			len = 20 + ottery_rand_range (80);
+			memcpy (p, "http://", 7);
+			j = 7;
+		}
+		else {
+			len = 2 + ottery_rand_range (10);
+			j = 0;
+		}
+
+		for (; j < len; j ++) {
+			p[j] = 'a' + ottery_rand_range (25);
+		}
+
+		lens[i] = len;
+		p += len;
+	}
+
+	return buf;
+}
+
+static void
+rspamd_fast_hash_bench_keys (const gchar *name, gboolean urls)
+{
+	static const struct {
+		const gchar *name;
+		enum rspamd_cryptobox_fast_hash_type type;
+	} types[] = {
+		{"xxhash64", RSPAMD_CRYPTOBOX_XXHASH64},
+		{"xxhash32", RSPAMD_CRYPTOBOX_XXHASH32},
+		{"mumhash", RSPAMD_CRYPTOBOX_MUMHASH},
+		{"t1ha", RSPAMD_CRYPTOBOX_T1HA},
+		{"fast", RSPAMD_CRYPTOBOX_HASHFAST},
+	};
+	gsize *lens;
+	gchar *buf, *p;
+	guint64 h = 0;
+	double t1, t2;
+	gint i, j;
+	guint k;
+
+	lens = g_malloc (hash_bench_keys * sizeof (*lens));
+	buf = create_hash_keys (hash_bench_keys, urls, lens);
+
+	for (k = 0; k < G_N_ELEMENTS (types); k ++) {
+		t1 = rspamd_get_ticks ();
+
+		for (j = 0; j < hash_bench_rounds; j ++) {
+			p = buf;
+
+			for (i = 0; i < hash_bench_keys; i ++) {
+				h ^= rspamd_cryptobox_fast_hash_specific (types[k].type, p,
+						lens[i], j);
+				p += lens[i];
+			}
+		}
+
+		t2 = rspamd_get_ticks ();
+		msg_info ("%s hash of %d %s: %.6f", types[k].name,
+				hash_bench_keys * hash_bench_rounds, name, t2 - t1);
+	}
+
+	msg_info ("%s hash value: %uL", name, h);
+	g_free (buf);
+	g_free (lens);
+}
+
+static void
+rspamd_fast_hash_bench (void)
+{
+	guint64 *tokens, h = 0;
+	double t1, t2;
+	gint i, j;
+
+	rspamd_fast_hash_bench_keys ("words", FALSE);
+	rspamd_fast_hash_bench_keys ("urls", TRUE);
+
+	tokens = g_malloc (hash_bench_keys * sizeof (*tokens));
+	ottery_rand_bytes (tokens, hash_bench_keys * sizeof (*tokens));
+
+	t1 = rspamd_get_ticks ();
+
+	for (j = 0; j < hash_bench_rounds; j ++) {
+		for (i = 0; i < hash_bench_keys; i ++) {
+			h ^= rspamd_cryptobox_fast_hash (&tokens[i], sizeof (tokens[i]), j);
+		}
+	}
+
+	t2 = rspamd_get_ticks ();
+	msg_info ("fast hash of %d tokens: %.6f", hash_bench_keys * hash_bench_rounds,
+			t2 - t1);
+
+	t1 = rspamd_get_ticks ();
+
+	for (j = 0; j < hash_bench_rounds; j ++) {
+		for (i = 0; i < hash_bench_keys; i ++) {
+			h ^= rspamd_cryptobox_fast_hash_u64 (tokens[i], j);
+		}
+	}
+
+	t2 = rspamd_get_ticks ();
+	msg_info ("u64 hash of %d tokens: %.6f", hash_bench_keys * hash_bench_rounds,
+			t2 - t1);
+	msg_info ("tokens hash value: %uL", h);
+
+	g_free (tokens);
+}
+
+#define HASH_MULTI_BUFS 13
+
+/* Multi-buffer hashing must produce the same digests as serial hashing */
+static void
+rspamd_hash_multi_check (void)
+{
+	static const gint rounds = 1000;
+	guchar key[rspamd_cryptobox_HASHKEYBYTES];
+	guchar *bufs[HASH_MULTI_BUFS], *out[HASH_MULTI_BUFS], serial[HASH_MULTI_BUFS][rspamd_cryptobox_HASHBYTES];
+	guchar multi[HASH_MULTI_BUFS][rspamd_cryptobox_HASHBYTES];
+	gsize lens[HASH_MULTI_BUFS];
+	double t1, t2, t3;
+	gint i, j;
+
+	ottery_rand_bytes (key, sizeof (key));
+
+	for (i = 0; i < HASH_MULTI_BUFS; i ++) {
+		/* Some empty, some short and some multi-block buffers */
+		lens[i] = i % 4 == 0 ? 0 : ottery_rand_range (4096);
+		bufs[i] = g_malloc (lens[i] + 1);
+		ottery_rand_bytes (bufs[i], lens[i]);
+		out[i] = multi[i];
+	}
+
+	t1 = rspamd_get_ticks ();
+
+	for (j = 0; j < rounds; j ++) {
+		for (i = 0; i < HASH_MULTI_BUFS; i ++) {
+			rspamd_cryptobox_hash (serial[i], bufs[i], lens[i], key, sizeof (key));
+		}
+	}
+
+	t2 = rspamd_get_ticks ();
+
+	for (j = 0; j < rounds; j ++) {
+		rspamd_cryptobox_hash_multi (out, (const guchar **)bufs, lens, HASH_MULTI_BUFS,
+				key, sizeof (key));
+	}
+
+	t3 = rspamd_get_ticks ();
+
+	for (i = 0; i < HASH_MULTI_BUFS; i ++) {
+		g_assert (memcmp (serial[i], multi[i], sizeof (serial[i])) == 0);
+		g_free (bufs[i]);
+	}
+
+	msg_info ("serial hash of %d buffers: %.6f, multi hash: %.6f",
+			HASH_MULTI_BUFS * rounds, t2 - t1, t3 - t2);
+}
+
 void
 rspamd_cryptobox_test_func (void)
 {
@@ -345,4 +518,7 @@ start:
 		mode = RSPAMD_CRYPTOBOX_MODE_NIST;
 		goto start;
 	}
+
+	rspamd_fast_hash_bench ();
+	rspamd_hash_multi_check ();
 }
@@ -1,5 +1,6 @@
 #include "config.h"
 #include "mem_pool.h"
+#include "mem_pool_containers.h"
 #include "tests.h"
 #include "unix-std.h"
 #include <math.h>
@@ -19,6 +20,11 @@ rspamd_mem_pool_test_func ()
 	char *tmp, *tmp2, *tmp3;
 	pid_t pid;
 	int ret;
+	guint reused;
+	gint i;
+	rspamd_mempool_hash_t *h;
+	rspamd_mempool_hash_iter_t it;
+	rspamd_mempool_array_t *ar;
 
 	pool = rspamd_mempool_new (sizeof (TEST_BUF), NULL);
 	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
@@ -35,5 +41,61 @@ rspamd_mem_pool_test_func ()
 	
 	rspamd_mempool_delete (pool);
 	rspamd_mempool_stat (&st);
-	
+
+	/* Chains of a deleted pool are reused by the next one */
+	reused = st.chunks_reused;
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	rspamd_mempool_delete (pool);
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+	tmp = rspamd_mempool_alloc0 (pool, rspamd_mempool_suggest_size ());
+	g_assert (tmp != NULL);
+	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	snprintf (tmp, sizeof (TEST_BUF), "%s", TEST_BUF);
+	g_assert (strncmp (tmp, TEST_BUF, sizeof (TEST_BUF)) == 0);
+	rspamd_mempool_delete (pool);
+	rspamd_mempool_stat (&st);
+
+	if (getenv ("VALGRIND") == NULL) {
+		g_assert (st.chunks_reused > reused);
+	}
+
+	/* Containers allocated from a pool */
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+	h = rspamd_mempool_hash_new (pool, 0, g_str_hash, g_str_equal);
+	ar = rspamd_mempool_array_new (pool, 0);
+
+	for (i = 0; i < 100; i ++) {
+		tmp = rspamd_mempool_alloc (pool, 16);
+		snprintf (tmp, 16, "key%d", i);
+		rspamd_mempool_hash_insert (h, tmp, GINT_TO_POINTER (i + 1));
+		rspamd_mempool_array_insert (ar, 0, GINT_TO_POINTER (i));
+	}
+
+	g_assert (rspamd_mempool_hash_size (h) == 100);
+	g_assert (GPOINTER_TO_INT (rspamd_mempool_hash_lookup (h, "key42")) == 43);
+	g_assert (rspamd_mempool_hash_lookup (h, "key100") == NULL);
+	rspamd_mempool_hash_insert (h, "key42", GINT_TO_POINTER (1000));
+	g_assert (rspamd_mempool_hash_size (h) == 100);
+	g_assert (GPOINTER_TO_INT (rspamd_mempool_hash_lookup (h, "key42")) == 1000);
+
+	rspamd_mempool_hash_iter_init (&it, h);
+	i = 0;
+	while (rspamd_mempool_hash_iter_next (&it, NULL, NULL)) {
+		i ++;
+	}
+	g_assert (i == 100);
+
+	g_assert (ar->len == 100);
+	g_assert (GPOINTER_TO_INT (rspamd_mempool_array_index (ar, 0)) == 99);
+	g_assert (GPOINTER_TO_INT (rspamd_mempool_array_index (ar, 99)) == 0);
+
+	/* Reset pool could be used as a new one */
+	rspamd_mempool_set_variable (pool, "test", tmp, NULL);
+	rspamd_mempool_reset (pool);
+	g_assert (rspamd_mempool_get_variable (pool, "test") == NULL);
+	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
+	snprintf (tmp, sizeof (TEST_BUF), "%s", TEST_BUF);
+	g_assert (strncmp (tmp, TEST_BUF, sizeof (TEST_BUF)) == 0);
+	rspamd_mempool_delete (pool);
 }
@@ -0,0 +1,151 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libmime/message.h"
+#include "libmime/mime_parser.h"
+#include "tests.h"
+
+/* Decoded bytes per reader checkpoint (4096 base64 characters) */
+#define CKPT_BYTES 3072
+
+static struct rspamd_mime_part *
+mime_reader_part (rspamd_mempool_t *pool, const guchar *data, gsize len,
+		gint line_len, gboolean padded)
+{
+	struct rspamd_mime_part *part;
+	gchar *enc;
+	gsize enclen;
+
+	enc = rspamd_encode_base64 (data, len, line_len, &enclen);
+	rspamd_mempool_add_destructor (pool, g_free, enc);
+
+	if (!padded) {
+		while (enclen > 0 && (enc[enclen - 1] == '=' ||
+				g_ascii_isspace (enc[enclen - 1]))) {
+			enclen --;
+		}
+	}
+
+	part = rspamd_mempool_alloc0 (pool, sizeof (*part));
+	part->pool = pool;
+	part->cte = RSPAMD_CTE_B64;
+	part->raw_data.begin = enc;
+	part->raw_data.len = enclen;
+
+	return part;
+}
+
+static void
+mime_reader_check_range (struct rspamd_mime_part_reader *r,
+		const guchar *data, gsize len, gsize offset, gsize rlen)
+{
+	guchar *out;
+	gsize expected, got;
+
+	expected = offset < len ? MIN (rlen, len - offset) : 0;
+	out = g_malloc (rlen + 1);
+	got = rspamd_mime_part_reader_read (r, offset, out, rlen);
+
+	if (got != expected || memcmp (out, data + offset, got) != 0) {
+		msg_err ("bad read of %z bytes at %z from %z: got %z bytes",
+				rlen, offset, len, got);
+		g_assert_not_reached ();
+	}
+
+	g_free (out);
+}
+
+static void
+mime_reader_check (rspamd_mempool_t *pool, const guchar *data, gsize len,
+		gint line_len, gboolean padded)
+{
+	struct rspamd_mime_part *part;
+	struct rspamd_mime_part_reader *r;
+	gsize i, j, off;
+
+	part = mime_reader_part (pool, data, len, line_len, padded);
+	r = rspamd_mime_part_reader_new (part);
+
+	g_assert (rspamd_mime_part_reader_size (r) == len);
+
+	/* The whole content */
+	mime_reader_check_range (r, data, len, 0, len);
+	mime_reader_check_range (r, data, len, 0, len + 10);
+
+	/* All offsets and short lengths around checkpoints */
+	for (off = CKPT_BYTES; off <= len + CKPT_BYTES; off += CKPT_BYTES) {
+		for (i = off > 4 ? off - 4 : 0; i <= off + 4; i ++) {
+			for (j = 0; j <= 8; j ++) {
+				mime_reader_check_range (r, data, len, i, j);
+			}
+		}
+	}
+
+	/* Unpadded or padded tail */
+	for (i = len > 6 ? len - 6 : 0; i <= len + 1; i ++) {
+		mime_reader_check_range (r, data, len, i, 16);
+	}
+
+	/* Seeks across several checkpoints in both directions */
+	mime_reader_check_range (r, data, len, CKPT_BYTES - 1, CKPT_BYTES * 2 + 2);
+	mime_reader_check_range (r, data, len, len / 2 + 1, len);
+	mime_reader_check_range (r, data, len, 1, CKPT_BYTES);
+	mime_reader_check_range (r, data, len, len > 1 ? len - 1 : 0, 1);
+	mime_reader_check_range (r, data, len, 2, 2);
+
+	/* Encoded content should not be decoded as a whole */
+	g_assert (!(part->flags & RSPAMD_MIME_PART_DECODED));
+}
+
+void
+rspamd_mime_reader_test_func (void)
+{
+	rspamd_mempool_t *pool;
+	const gsize lens[] = {
+		1, 2, 3, 4,
+		CKPT_BYTES - 2, CKPT_BYTES - 1, CKPT_BYTES,
+		CKPT_BYTES + 1, CKPT_BYTES + 2,
+		CKPT_BYTES * 2, CKPT_BYTES * 2 + 1, CKPT_BYTES * 3 + 2,
+		10000
+	};
+	guchar *data;
+	gsize i, j, max_len = 0;
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+
+	for (i = 0; i < G_N_ELEMENTS (lens); i ++) {
+		max_len = MAX (max_len, lens[i]);
+	}
+
+	data = g_malloc (max_len);
+
+	for (j = 0; j < max_len; j ++) {
+		data[j] = (j * 7 + (j >> 8)) & 0xff;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (lens); i ++) {
+		/* Unfolded, folded by 76 characters and folded by a line of odd size */
+		mime_reader_check (pool, data, lens[i], 0, TRUE);
+		mime_reader_check (pool, data, lens[i], 76, TRUE);
+		mime_reader_check (pool, data, lens[i], 0, FALSE);
+		mime_reader_check (pool, data, lens[i], 77, FALSE);
+	}
+
+	g_free (data);
+	rspamd_mempool_delete (pool);
+}
@@ -0,0 +1,294 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "protocol.h"
+#include "filter.h"
+#include "libmime/email_addr.h"
+#include "tests.h"
+
+static const gchar tlv_message[] = "Subject: test\r\n\r\nTest.\r\n";
+
+static rspamd_fstring_t *
+tlv_envelope (void)
+{
+	rspamd_fstring_t *env;
+	guint32 flags;
+	const gchar hdr[] = "X-Test\0value";
+
+	env = rspamd_fstring_new ();
+	rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_IP,
+			"10.0.0.1", sizeof ("10.0.0.1") - 1);
+	rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_HELO,
+			"mx.example.com", sizeof ("mx.example.com") - 1);
+	rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_FROM,
+			"<from@example.com>", sizeof ("<from@example.com>") - 1);
+	rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_RCPT,
+			"<rcpt1@example.com>", sizeof ("<rcpt1@example.com>") - 1);
+	rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_RCPT,
+			"<rcpt2@example.com>", sizeof ("<rcpt2@example.com>") - 1);
+	/* Unknown fields are skipped */
+	rspamd_protocol_tlv_append (&env, 200, "ignored", sizeof ("ignored") - 1);
+	rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_USER,
+			"user", sizeof ("user") - 1);
+	flags = GUINT32_TO_BE (RSPAMD_PROTOCOL_TLV_FLAG_PASS_ALL);
+	rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_FLAGS,
+			&flags, sizeof (flags));
+	rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_HEADER,
+			hdr, sizeof (hdr) - 1);
+
+	return env;
+}
+
+static gboolean
+tlv_handle (const gchar *data, gsize len, struct rspamd_task **ptask,
+		const gchar **msg, gsize *msglen)
+{
+	struct rspamd_task *task;
+	gboolean ret;
+
+	task = rspamd_task_new (NULL, rspamd_main->cfg);
+	*msg = data;
+	*msglen = len;
+	ret = rspamd_protocol_handle_tlv (task, msg, msglen);
+
+	if (ret) {
+		g_assert (task->err == NULL);
+	}
+	else {
+		g_assert (task->err != NULL);
+		msg_info ("envelope is rejected: %e", task->err);
+	}
+
+	*ptask = task;
+
+	return ret;
+}
+
+static void
+rspamd_protocol_tlv_envelope_test (void)
+{
+	struct rspamd_task *task;
+	rspamd_fstring_t *env, *bad;
+	rspamd_ftok_t *hv;
+	const gchar *msg;
+	gsize msglen;
+	guchar oversized[5 + 3];
+	guint32 nlen;
+
+	env = tlv_envelope ();
+	rspamd_protocol_tlv_append (&env, RSPAMD_PROTOCOL_TLV_END, NULL, 0);
+
+	/* Everything but the message should be consumed */
+	bad = rspamd_fstring_new_init (env->str, env->len);
+	bad = rspamd_fstring_append (bad, tlv_message, sizeof (tlv_message) - 1);
+	g_assert (tlv_handle (bad->str, bad->len, &task, &msg, &msglen));
+	g_assert (msglen == sizeof (tlv_message) - 1);
+	g_assert (memcmp (msg, tlv_message, msglen) == 0);
+	g_assert (!(task->flags & RSPAMD_TASK_FLAG_NO_IP));
+	g_assert_cmpstr (rspamd_inet_address_to_string (task->from_addr), ==,
+			"10.0.0.1");
+	g_assert_cmpstr (task->helo, ==, "mx.example.com");
+	g_assert_cmpstr (task->user, ==, "user");
+	g_assert (task->from_envelope != NULL);
+	g_assert (task->rcpt_envelope != NULL && task->rcpt_envelope->len == 2);
+	g_assert (task->flags & RSPAMD_TASK_FLAG_PASS_ALL);
+	hv = rspamd_task_get_request_header (task, "X-Test");
+	g_assert (hv != NULL);
+	g_assert (rspamd_ftok_cstr_equal (hv, "value", FALSE));
+	rspamd_task_free (task);
+	rspamd_fstring_free (bad);
+
+	/* Empty message after the envelope */
+	g_assert (tlv_handle (env->str, env->len, &task, &msg, &msglen));
+	g_assert (msglen == 0);
+	rspamd_task_free (task);
+
+	/* No end of envelope */
+	g_assert (!tlv_handle (env->str, env->len - 5, &task, &msg, &msglen));
+	rspamd_task_free (task);
+
+	/* Truncated in the middle of field header and of field value */
+	g_assert (!tlv_handle (env->str, 3, &task, &msg, &msglen));
+	rspamd_task_free (task);
+	g_assert (!tlv_handle (env->str, 5 + 4, &task, &msg, &msglen));
+	rspamd_task_free (task);
+
+	/* Length is larger than the rest of data */
+	oversized[0] = RSPAMD_PROTOCOL_TLV_HELO;
+	nlen = GUINT32_TO_BE (G_MAXUINT32);
+	memcpy (&oversized[1], &nlen, sizeof (nlen));
+	memcpy (&oversized[5], "abc", 3);
+	g_assert (!tlv_handle ((const gchar *)oversized, sizeof (oversized),
+			&task, &msg, &msglen));
+	rspamd_task_free (task);
+
+	/* Flags must have fixed length */
+	bad = rspamd_fstring_new ();
+	rspamd_protocol_tlv_append (&bad, RSPAMD_PROTOCOL_TLV_FLAGS, "ab", 2);
+	rspamd_protocol_tlv_append (&bad, RSPAMD_PROTOCOL_TLV_END, NULL, 0);
+	g_assert (!tlv_handle (bad->str, bad->len, &task, &msg, &msglen));
+	rspamd_task_free (task);
+	rspamd_fstring_free (bad);
+
+	rspamd_fstring_free (env);
+}
+
+static ucl_object_t *
+tlv_expected_symbol (const gchar *name, gdouble score, const gchar *opt1,
+		const gchar *opt2)
+{
+	ucl_object_t *sym, *opts;
+
+	sym = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (sym, ucl_object_fromstring (name), "name", 0, false);
+	ucl_object_insert_key (sym, ucl_object_fromdouble (score), "score", 0, false);
+
+	if (opt1) {
+		opts = ucl_object_typed_new (UCL_ARRAY);
+		ucl_array_append (opts, ucl_object_fromstring (opt1));
+
+		if (opt2) {
+			ucl_array_append (opts, ucl_object_fromstring (opt2));
+		}
+
+		ucl_object_insert_key (sym, opts, "options", 0, false);
+	}
+
+	return sym;
+}
+
+static void
+rspamd_protocol_tlv_reply_test (void)
+{
+	struct rspamd_task *task;
+	struct rspamd_metric_result *mres;
+	struct rspamd_symbol_result *s;
+	rspamd_fstring_t *reply, *bad;
+	ucl_object_t *obj, *expected, *metric, *again;
+	GError *err = NULL;
+
+	if (g_hash_table_lookup (rspamd_main->cfg->metrics, DEFAULT_METRIC) == NULL) {
+		rspamd_config_new_metric (rspamd_main->cfg, NULL, DEFAULT_METRIC);
+	}
+
+	task = rspamd_task_new (NULL, rspamd_main->cfg);
+	task->message_id = "<test@example.com>";
+	mres = rspamd_create_metric_result (task, DEFAULT_METRIC);
+	g_assert (mres != NULL);
+	mres->action = METRIC_ACTION_ADD_HEADER;
+	mres->score = 7.5;
+	mres->actions_limits[METRIC_ACTION_REJECT] = 15.0;
+
+	s = rspamd_mempool_alloc0 (task->task_pool, sizeof (*s));
+	s->name = "SYM1";
+	s->score = 5.5;
+	s->id = -1;
+	g_hash_table_insert (mres->symbols, (gpointer)s->name, s);
+	rspamd_task_add_result_option (task, s, "opt1");
+	rspamd_task_add_result_option (task, s, "opt2");
+
+	s = rspamd_mempool_alloc0 (task->task_pool, sizeof (*s));
+	s->name = "SYM2";
+	s->score = 2.0;
+	s->id = -1;
+	g_hash_table_insert (mres->symbols, (gpointer)s->name, s);
+
+	ucl_object_insert_key (task->messages,
+			ucl_object_fromstring ("hello"), "smtp_message", 0, false);
+
+	reply = rspamd_fstring_new ();
+	rspamd_protocol_tlv_reply (task, &reply);
+
+	metric = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (metric, ucl_object_fromstring ("add header"),
+			"action", 0, false);
+	ucl_object_insert_key (metric, ucl_object_fromdouble (7.5),
+			"score", 0, false);
+	ucl_object_insert_key (metric, ucl_object_fromdouble (15.0),
+			"required_score", 0, false);
+	ucl_object_insert_key (metric, tlv_expected_symbol ("SYM1", 5.5,
+			"opt1", "opt2"), "SYM1", 0, false);
+	ucl_object_insert_key (metric, tlv_expected_symbol ("SYM2", 2.0,
+			NULL, NULL), "SYM2", 0, false);
+	ucl_object_insert_key (metric, ucl_object_frombool (true),
+			"is_spam", 0, false);
+	ucl_object_insert_key (metric, ucl_object_frombool (false),
+			"is_skipped", 0, false);
+	expected = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (expected, metric, DEFAULT_METRIC, 0, false);
+	ucl_object_insert_key (expected,
+			ucl_object_fromstring ("<test@example.com>"),
+			"message-id", 0, false);
+	ucl_object_insert_key (expected, ucl_object_ref (task->messages),
+			"messages", 0, false);
+
+	obj = rspamd_protocol_tlv_reply_to_ucl ((const guchar *)reply->str,
+			reply->len, &err);
+	g_assert (err == NULL);
+	g_assert (obj != NULL);
+	g_assert (ucl_object_compare (obj, expected) == 0);
+	/* Doubles are compared exactly as ucl_object_compare truncates them */
+	g_assert (ucl_object_todouble (ucl_object_lookup_path (obj,
+			DEFAULT_METRIC ".score")) == 7.5);
+	g_assert (ucl_object_todouble (ucl_object_lookup_path (obj,
+			DEFAULT_METRIC ".SYM1.score")) == 5.5);
+	ucl_object_unref (obj);
+
+	/* Unknown fields do not change the result */
+	bad = rspamd_fstring_new ();
+	rspamd_protocol_tlv_append (&bad, 250, "ignored", sizeof ("ignored") - 1);
+	bad = rspamd_fstring_append (bad, reply->str, reply->len);
+	rspamd_protocol_tlv_append (&bad, 251, NULL, 0);
+	again = rspamd_protocol_tlv_reply_to_ucl ((const guchar *)bad->str,
+			bad->len, &err);
+	g_assert (again != NULL);
+	g_assert (ucl_object_compare (again, expected) == 0);
+	ucl_object_unref (again);
+	rspamd_fstring_free (bad);
+
+	/* Truncated reply */
+	obj = rspamd_protocol_tlv_reply_to_ucl ((const guchar *)reply->str,
+			reply->len - 1, &err);
+	g_assert (obj == NULL);
+	g_assert (err != NULL);
+	g_error_free (err);
+	err = NULL;
+
+	/* Field length that is larger than the reply */
+	bad = rspamd_fstring_new_init (reply->str, reply->len);
+	rspamd_protocol_tlv_append (&bad, RSPAMD_PROTOCOL_TLV_REPLY_SUBJECT,
+			"subject", sizeof ("subject") - 1);
+	bad->str[reply->len + 1] = 0x7f;
+	obj = rspamd_protocol_tlv_reply_to_ucl ((const guchar *)bad->str,
+			bad->len, &err);
+	g_assert (obj == NULL);
+	g_assert (err != NULL);
+	g_error_free (err);
+	rspamd_fstring_free (bad);
+
+	ucl_object_unref (expected);
+	rspamd_fstring_free (reply);
+	rspamd_task_free (task);
+}
+
+void
+rspamd_protocol_test_func (void)
+{
+	rspamd_protocol_tlv_envelope_test ();
+	rspamd_protocol_tlv_reply_test ();
+}
@@ -83,6 +83,9 @@ rspamd_radix_test_vec (void)
 	struct in_addr ina;
 	struct in6_addr in6a;
 	gulong i, val;
+	const guint8 **keys;
+	gsize *keylens, n;
+	uintptr_t *values;
 
 	while (t->ip != NULL) {
 		t->addr = g_malloc (sizeof (in6a));
@@ -134,6 +137,39 @@ rspamd_radix_test_vec (void)
 		t ++;
 	}
 
+	/* Batched lookups must agree with single ones */
+	n = G_N_ELEMENTS (test_vec) - 1;
+	keys = g_malloc (n * 2 * sizeof (*keys));
+	keylens = g_malloc (n * 2 * sizeof (*keylens));
+	values = g_malloc (n * 2 * sizeof (*values));
+
+	for (i = 0; i < n; i ++) {
+		t = &test_vec[i];
+		keys[i * 2] = t->addr;
+		keys[i * 2 + 1] = t->nip ? t->naddr : NULL;
+		keylens[i * 2] = t->len;
+		keylens[i * 2 + 1] = t->len;
+	}
+
+	radix_find_compressed_batch (tree, keys, keylens, n * 2, values);
+
+	for (i = 0; i < n; i ++) {
+		t = &test_vec[i];
+		g_assert (values[i * 2] == i + 1);
+
+		if (t->nip != NULL) {
+			g_assert (values[i * 2 + 1] ==
+					radix_find_compressed (tree, t->naddr, t->len));
+		}
+		else {
+			g_assert (values[i * 2 + 1] == RADIX_NO_VALUE);
+		}
+	}
+
+	g_free (keys);
+	g_free (keylens);
+	g_free (values);
+
 	radix_destroy_compressed (tree);
 }
 
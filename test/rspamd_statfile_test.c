@@ -2,47 +2,51 @@
 #include "rspamd.h"
 #include "tests.h"
 #include "ottery.h"
+#include "classifiers/classifiers.h"
 
-#define TEST_FILENAME "/tmp/rspamd_test.stat"
-#define HASHES_NUM 256
+#define TOKENS_NUM 1031
 
-void 
-rspamd_statfile_test_func ()
+static const gdouble weights[] = { 0, 1, 4, 27, 256, 3125, 46656, 823543 };
+
+static void
+rspamd_statfile_check_probs (guint64 spam_learns, guint64 ham_learns)
 {
-	/*
-	 * XXX: broken, old, need to be rewritten
-	 */
-#if 0
-	statfile_pool_t *pool;
-	rspamd_mempool_t *p;
-	stat_file_t *st;
-	uint32_t random_hashes[HASHES_NUM], i, v;
-	time_t now = time (NULL);
-	
-	p = rspamd_mempool_new (rspamd_mempool_suggest_size ());
-	umask (S_IWGRP | S_IWOTH);
-	pool = statfile_pool_new (p, TRUE);
+	gdouble spam_counts[TOKENS_NUM], ham_counts[TOKENS_NUM], fws[TOKENS_NUM];
+	gdouble sp[TOKENS_NUM], hp[TOKENS_NUM], ref_sp[TOKENS_NUM],
+		ref_hp[TOKENS_NUM];
+	guint i, n;
 
-	for (i = 0; i < HASHES_NUM; i ++) {
-		random_hashes[i] = ottery_rand_uint32 ();
+	for (i = 0; i < TOKENS_NUM; i ++) {
+		/* Leave some tokens unknown to check masking */
+		spam_counts[i] = ottery_rand_range (4) == 0 ? 0 :
+				ottery_rand_range (1000);
+		ham_counts[i] = ottery_rand_range (4) == 0 ? 0 :
+				ottery_rand_range (1000);
+		fws[i] = weights[ottery_rand_range (G_N_ELEMENTS (weights) - 1)];
 	}
 
-	/* Create new file */
-	g_assert (rspamd_mmaped_file_create (pool, TEST_FILENAME, 65535) != -1);
-	g_assert ((st = rspamd_mmaped_file_open (pool, TEST_FILENAME, 65535, FALSE)) != NULL);
-	
-	/* Get and set random blocks */
-	rspamd_mmaped_file_lock_file (pool, st);
-	for (i = 0; i < HASHES_NUM; i ++) {
-		rspamd_mmaped_file_set_block (pool, st, random_hashes[i], random_hashes[i], now, 1.0);
-	}
-	rspamd_mmaped_file_unlock_file (pool, st);
+	/* Check odd and block sized lengths as well */
+	for (n = 1; n <= TOKENS_NUM; n += 255) {
+		bayes_token_probs (spam_counts, ham_counts, fws, n,
+				spam_learns, ham_learns, sp, hp);
+		bayes_token_probs_ref (spam_counts, ham_counts, fws, n,
+				spam_learns, ham_learns, ref_sp, ref_hp);
 
-	for (i = 0; i < HASHES_NUM; i ++) {
-		v = rspamd_mmaped_file_get_block (pool, st, random_hashes[i], random_hashes[i], now);
-		g_assert(v == 1.0);
+		for (i = 0; i < n; i ++) {
+			if (spam_counts[i] + ham_counts[i] > 0) {
+				g_assert (memcmp (&sp[i], &ref_sp[i], sizeof (sp[i])) == 0);
+				g_assert (memcmp (&hp[i], &ref_hp[i], sizeof (hp[i])) == 0);
+				g_assert (sp[i] >= 0 && sp[i] <= 1.0);
+				g_assert (hp[i] >= 0 && hp[i] <= 1.0);
+			}
+		}
 	}
+}
 
-	rspamd_mmaped_file_destroy (pool);
-#endif
+void
+rspamd_statfile_test_func ()
+{
+	rspamd_statfile_check_probs (1000, 1000);
+	rspamd_statfile_check_probs (100, 100000);
+	rspamd_statfile_check_probs (0, 1);
 }
@@ -52,6 +52,8 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/heap", rspamd_heap_test_func);
+	g_test_add_func ("/rspamd/mime_reader", rspamd_mime_reader_test_func);
+	g_test_add_func ("/rspamd/protocol", rspamd_protocol_test_func);
 
 #if 0
 	g_test_add_func ("/rspamd/url", rspamd_url_test_func);
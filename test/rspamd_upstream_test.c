@@ -41,6 +41,18 @@ rspamd_upstream_test_method (struct upstream_list *ls,
 	}
 }
 
+static void
+rspamd_upstream_set_latency_cb (struct upstream *up, void *ud)
+{
+	/* Make kernel.org the slowest upstream */
+	if (strcmp (rspamd_upstream_name (up), "kernel.org") == 0) {
+		rspamd_upstream_latency (up, 1.0);
+	}
+	else {
+		rspamd_upstream_latency (up, 0.01);
+	}
+}
+
 static void
 rspamd_upstream_timeout_handler (int fd, short what, void *arg)
 {
@@ -52,12 +64,14 @@ rspamd_upstream_timeout_handler (int fd, short what, void *arg)
 void
 rspamd_upstream_test_func (void)
 {
-	struct upstream_list *ls, *nls;
-	struct upstream *up, *upn;
+	struct upstream_list *ls, *nls, *rls;
+	struct upstream *up, *upn, *ring_sel[100];
+	guchar ring_keys[100][16];
 	struct event_base *ev_base = event_init ();
 	struct rspamd_dns_resolver *resolver;
 	struct rspamd_config *cfg;
 	gint i, success = 0;
+	guint virtual_nodes;
 	const gint assumptions = 100500;
 	gdouble p;
 	struct event ev;
@@ -157,6 +171,45 @@ rspamd_upstream_test_func (void)
 
 	rspamd_upstreams_destroy (nls);
 
+	/* Test hash ring: keys of alive upstreams do not move on failure */
+	virtual_nodes = cfg->upstream_virtual_nodes;
+	cfg->upstream_virtual_nodes = 64;
+	rspamd_upstreams_library_config (cfg, cfg->ups_ctx, ev_base, resolver->r);
+	rls = rspamd_upstreams_create (cfg->ups_ctx);
+	g_assert (rspamd_upstreams_parse_line (rls, test_upstream_list, 443, NULL));
+
+	for (i = 0; i < (gint)G_N_ELEMENTS (ring_keys); i ++) {
+		ottery_rand_bytes (ring_keys[i], sizeof (ring_keys[i]));
+		ring_sel[i] = rspamd_upstream_get (rls, RSPAMD_UPSTREAM_HASHED,
+				ring_keys[i], sizeof (ring_keys[i]));
+	}
+
+	up = rspamd_upstream_get (rls, RSPAMD_UPSTREAM_MASTER_SLAVE, NULL, 0);
+	for (i = 0; i < 100; i ++) {
+		rspamd_upstream_fail (up);
+	}
+	g_assert (rspamd_upstreams_alive (rls) == 2);
+
+	for (i = 0; i < (gint)G_N_ELEMENTS (ring_keys); i ++) {
+		upn = rspamd_upstream_get (rls, RSPAMD_UPSTREAM_HASHED,
+				ring_keys[i], sizeof (ring_keys[i]));
+		g_assert (upn != up);
+
+		if (ring_sel[i] != up) {
+			g_assert (upn == ring_sel[i]);
+		}
+	}
+
+	rspamd_upstreams_destroy (rls);
+	cfg->upstream_virtual_nodes = virtual_nodes;
+	rspamd_upstreams_library_config (cfg, cfg->ups_ctx, ev_base, resolver->r);
+
+	/* Test latency rotation: the slowest upstream never wins two choices */
+	rspamd_upstreams_foreach (ls, rspamd_upstream_set_latency_cb, NULL);
+	for (i = 0; i < 100; i ++) {
+		up = rspamd_upstream_get_forced (ls, RSPAMD_UPSTREAM_LATENCY, NULL, 0);
+		g_assert (strcmp (rspamd_upstream_name (up), "kernel.org") != 0);
+	}
 
 	/* Upstream fail test */
 	evtimer_set (&ev, rspamd_upstream_timeout_handler, resolver);
@@ -41,4 +41,8 @@ void rspamd_cryptobox_test_func (void);
 
 void rspamd_heap_test_func (void);
 
+void rspamd_mime_reader_test_func (void);
+
+void rspamd_protocol_test_func (void);
+
 #endif
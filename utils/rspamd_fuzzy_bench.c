@@ -0,0 +1,550 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Load generator for fuzzy storage: sends a mix of check, write and delete
+ * commands at a fixed rate and measures reply latencies. Write and delete
+ * commands are accepted only from addresses listed in `allow_update`.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "util.h"
+#include "fuzzy_wire.h"
+#include "cryptobox.h"
+#include "keypair.h"
+#include "keypairs_cache.h"
+#include "ottery.h"
+#include "unix-std.h"
+#include <math.h>
+
+static guint port = 11335;
+static gchar *host = "127.0.0.1";
+static gchar *server_key = NULL;
+static guint rate = 1000;
+static gdouble test_time = 10.0;
+static gdouble timeout = 1.0;
+static guint check_ratio = 90;
+static guint write_ratio = 8;
+static guint del_ratio = 2;
+static guint shingles_ratio = 0;
+static guint nhashes = 10000;
+static guint flag = 1;
+static gboolean json = FALSE;
+
+static GOptionEntry entries[] = {
+		{"host", 'h', 0, G_OPTION_ARG_STRING, &host,
+				"Fuzzy storage host (default: 127.0.0.1)", NULL},
+		{"port", 'p', 0, G_OPTION_ARG_INT, &port,
+				"Fuzzy storage port (default: 11335)", NULL},
+		{"key", 'k', 0, G_OPTION_ARG_STRING, &server_key,
+				"Encrypt requests for the specified key (base32 encoded)", NULL},
+		{"rate", 'r', 0, G_OPTION_ARG_INT, &rate,
+				"Requests per second (default: 1000)", NULL},
+		{"time", 't', 0, G_OPTION_ARG_DOUBLE, &test_time,
+				"Time to run tests (default: 10.0 sec)", NULL},
+		{"timeout", 0, 0, G_OPTION_ARG_DOUBLE, &timeout,
+				"Reply timeout (default: 1.0 sec)", NULL},
+		{"check", 0, 0, G_OPTION_ARG_INT, &check_ratio,
+				"Weight of check commands (default: 90)", NULL},
+		{"write", 0, 0, G_OPTION_ARG_INT, &write_ratio,
+				"Weight of write commands (default: 8)", NULL},
+		{"del", 0, 0, G_OPTION_ARG_INT, &del_ratio,
+				"Weight of delete commands (default: 2)", NULL},
+		{"shingles", 's', 0, G_OPTION_ARG_INT, &shingles_ratio,
+				"Percentage of commands with shingles (default: 0)", NULL},
+		{"hashes", 'H', 0, G_OPTION_ARG_INT, &nhashes,
+				"Number of distinct hashes to use (default: 10000)", NULL},
+		{"flag", 'f', 0, G_OPTION_ARG_INT, &flag,
+				"Fuzzy flag for commands (default: 1)", NULL},
+		{"json", 'j', 0, G_OPTION_ARG_NONE, &json,
+				"Output results in json", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+/* Send timer is fired this many times per second */
+#define FUZZY_BENCH_TICKS 100
+
+static const gchar *cmd_names[] = {"check", "write", "del"};
+
+struct fuzzy_bench_req {
+	gdouble ts;
+	guint cmd;
+};
+
+struct fuzzy_bench_ctx {
+	struct event_base *ev_base;
+	gint fd;
+	struct event io_ev;
+	struct event send_ev;
+	struct event sweep_ev;
+	struct event stop_ev;
+	struct timeval send_tv;
+	struct rspamd_cryptobox_keypair *local_key;
+	struct rspamd_cryptobox_pubkey *peer_key;
+	struct rspamd_keypair_cache *keypairs_cache;
+	GHashTable *pending;
+	guint32 tag;
+	gdouble credit;
+	gdouble start;
+	guint64 sent[3];
+	guint64 replied[3];
+	guint64 found;
+	guint64 timeouts;
+	guint64 errors;
+	GArray *latencies[3];
+};
+
+static void
+fuzzy_bench_encrypt (struct fuzzy_bench_ctx *ctx,
+		struct rspamd_fuzzy_encrypted_req_hdr *hdr,
+		guchar *data, gsize datalen)
+{
+	const guchar *pk;
+	guint pklen;
+
+	memcpy (hdr->magic, fuzzy_encrypted_magic, sizeof (hdr->magic));
+	ottery_rand_bytes (hdr->nonce, sizeof (hdr->nonce));
+	pk = rspamd_keypair_component (ctx->local_key,
+			RSPAMD_KEYPAIR_COMPONENT_PK, &pklen);
+	memcpy (hdr->pubkey, pk, MIN (pklen, sizeof (hdr->pubkey)));
+	pk = rspamd_pubkey_get_pk (ctx->peer_key, &pklen);
+	memcpy (hdr->key_id, pk, MIN (sizeof (hdr->key_id), pklen));
+	rspamd_keypair_cache_process (ctx->keypairs_cache,
+			ctx->local_key, ctx->peer_key);
+	rspamd_cryptobox_encrypt_nm_inplace (data, datalen,
+			hdr->nonce, rspamd_pubkey_get_nm (ctx->peer_key), hdr->mac,
+			rspamd_pubkey_alg (ctx->peer_key));
+}
+
+static guint
+fuzzy_bench_select_cmd (void)
+{
+	guint total = check_ratio + write_ratio + del_ratio, r;
+
+	r = ottery_rand_range (total - 1);
+
+	if (r < check_ratio) {
+		return FUZZY_CHECK;
+	}
+	else if (r < check_ratio + write_ratio) {
+		return FUZZY_WRITE;
+	}
+
+	return FUZZY_DEL;
+}
+
+static void
+fuzzy_bench_send_one (struct fuzzy_bench_ctx *ctx)
+{
+	struct rspamd_fuzzy_encrypted_shingle_cmd req;
+	struct rspamd_fuzzy_cmd *cmd;
+	struct fuzzy_bench_req *preq;
+	guchar *payload;
+	guint32 idx;
+	gsize len;
+	guint i;
+	gboolean shingle;
+
+	memset (&req, 0, sizeof (req));
+	cmd = &req.cmd.basic;
+	shingle = ottery_rand_range (99) < shingles_ratio;
+	idx = ottery_rand_range (MAX (nhashes, 1) - 1);
+
+	cmd->version = RSPAMD_FUZZY_VERSION;
+	cmd->cmd = fuzzy_bench_select_cmd ();
+	cmd->flag = flag;
+	cmd->value = 1;
+	cmd->tag = ++ctx->tag;
+	/* The same set of digests is used, so checks could find written hashes */
+	rspamd_cryptobox_hash (cmd->digest, (const guchar *)&idx, sizeof (idx),
+			NULL, 0);
+
+	if (shingle) {
+		cmd->shingles_count = RSPAMD_SHINGLE_SIZE;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			req.cmd.sgl.hashes[i] = rspamd_cryptobox_fast_hash (&idx,
+					sizeof (idx), i);
+		}
+
+		len = sizeof (req.cmd);
+	}
+	else {
+		len = sizeof (req.cmd.basic);
+	}
+
+	if (ctx->peer_key) {
+		fuzzy_bench_encrypt (ctx, &req.hdr, (guchar *)&req.cmd, len);
+		payload = (guchar *)&req;
+		len += sizeof (req.hdr);
+	}
+	else {
+		payload = (guchar *)&req.cmd;
+	}
+
+	if (send (ctx->fd, payload, len, 0) == -1) {
+		ctx->errors ++;
+
+		return;
+	}
+
+	preq = g_malloc (sizeof (*preq));
+	preq->ts = rspamd_get_ticks ();
+	preq->cmd = cmd->cmd;
+	g_hash_table_insert (ctx->pending, GUINT_TO_POINTER (cmd->tag), preq);
+	ctx->sent[cmd->cmd] ++;
+}
+
+static void
+fuzzy_bench_send (gint fd, short what, gpointer ud)
+{
+	struct fuzzy_bench_ctx *ctx = ud;
+
+	ctx->credit += (gdouble)rate / FUZZY_BENCH_TICKS;
+
+	while (ctx->credit >= 1.0) {
+		fuzzy_bench_send_one (ctx);
+		ctx->credit -= 1.0;
+	}
+}
+
+static void
+fuzzy_bench_read (gint fd, short what, gpointer ud)
+{
+	struct fuzzy_bench_ctx *ctx = ud;
+	struct rspamd_fuzzy_encrypted_reply encrep;
+	struct rspamd_fuzzy_reply *rep;
+	struct fuzzy_bench_req *preq;
+	guchar buf[2048];
+	gdouble lat;
+	gssize r;
+
+	while ((r = recv (fd, buf, sizeof (buf), 0)) > 0) {
+		if (ctx->peer_key) {
+			if (r < (gssize)sizeof (encrep)) {
+				ctx->errors ++;
+				continue;
+			}
+
+			memcpy (&encrep, buf, sizeof (encrep));
+
+			if (!rspamd_cryptobox_decrypt_nm_inplace ((guchar *)&encrep.rep,
+					sizeof (encrep.rep),
+					encrep.hdr.nonce,
+					rspamd_pubkey_get_nm (ctx->peer_key),
+					encrep.hdr.mac,
+					rspamd_pubkey_alg (ctx->peer_key))) {
+				ctx->errors ++;
+				continue;
+			}
+
+			rep = &encrep.rep;
+		}
+		else {
+			if (r < (gssize)sizeof (*rep)) {
+				ctx->errors ++;
+				continue;
+			}
+
+			rep = (struct rspamd_fuzzy_reply *)buf;
+		}
+
+		preq = g_hash_table_lookup (ctx->pending, GUINT_TO_POINTER (rep->tag));
+
+		if (preq == NULL) {
+			/* Late reply for a timed out request */
+			continue;
+		}
+
+		lat = rspamd_get_ticks () - preq->ts;
+		g_array_append_val (ctx->latencies[preq->cmd], lat);
+		ctx->replied[preq->cmd] ++;
+
+		if (preq->cmd == FUZZY_CHECK && rep->prob > 0.5) {
+			ctx->found ++;
+		}
+
+		g_hash_table_remove (ctx->pending, GUINT_TO_POINTER (rep->tag));
+	}
+}
+
+static void
+fuzzy_bench_sweep (gint fd, short what, gpointer ud)
+{
+	struct fuzzy_bench_ctx *ctx = ud;
+	struct fuzzy_bench_req *preq;
+	GHashTableIter it;
+	gpointer k, v;
+	gdouble now = rspamd_get_ticks ();
+
+	g_hash_table_iter_init (&it, ctx->pending);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		preq = v;
+
+		if (now - preq->ts > timeout) {
+			ctx->timeouts ++;
+			g_hash_table_iter_remove (&it);
+		}
+	}
+}
+
+static void
+fuzzy_bench_stop (gint fd, short what, gpointer ud)
+{
+	struct fuzzy_bench_ctx *ctx = ud;
+
+	event_del (&ctx->send_ev);
+	event_del (&ctx->sweep_ev);
+	event_base_loopexit (ctx->ev_base, NULL);
+}
+
+static gint
+fuzzy_bench_cmp (gconstpointer a, gconstpointer b)
+{
+	gdouble d1 = *(const gdouble *)a, d2 = *(const gdouble *)b;
+
+	return d1 < d2 ? -1 : (d1 > d2 ? 1 : 0);
+}
+
+static gdouble
+fuzzy_bench_percentile (GArray *ar, gdouble p)
+{
+	guint idx;
+
+	if (ar->len == 0) {
+		return 0;
+	}
+
+	idx = MIN ((guint)ceil (p * ar->len), ar->len) - 1;
+
+	return g_array_index (ar, gdouble, idx) * 1000.0;
+}
+
+static void
+fuzzy_bench_report (struct fuzzy_bench_ctx *ctx, gdouble elapsed)
+{
+	ucl_object_t *top, *cmds, *obj;
+	rspamd_fstring_t *out;
+	guint64 total_sent = 0, total_replied = 0;
+	GArray *ar;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	cmds = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < G_N_ELEMENTS (cmd_names); i ++) {
+		ar = ctx->latencies[i];
+		g_array_sort (ar, fuzzy_bench_cmp);
+		total_sent += ctx->sent[i];
+		total_replied += ctx->replied[i];
+
+		obj = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (obj, ucl_object_fromint (ctx->sent[i]),
+				"sent", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromint (ctx->replied[i]),
+				"replied", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (fuzzy_bench_percentile (ar, 0.5)),
+				"p50", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (fuzzy_bench_percentile (ar, 0.9)),
+				"p90", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (fuzzy_bench_percentile (ar, 0.99)),
+				"p99", 0, false);
+		ucl_object_insert_key (obj,
+				ucl_object_fromdouble (fuzzy_bench_percentile (ar, 1.0)),
+				"max", 0, false);
+		ucl_object_insert_key (cmds, obj, cmd_names[i], 0, false);
+	}
+
+	ucl_object_insert_key (top, ucl_object_fromint (total_sent),
+			"sent", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (total_replied),
+			"replied", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->found),
+			"found", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->timeouts),
+			"timeouts", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->errors),
+			"errors", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (elapsed),
+			"time", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (elapsed > 0 ? total_replied / elapsed : 0),
+			"replies_per_second", 0, false);
+	ucl_object_insert_key (top, cmds, "latency_ms", 0, false);
+
+	if (json) {
+		out = rspamd_fstring_new ();
+		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON, &out);
+		rspamd_printf ("%V\n", out);
+		rspamd_fstring_free (out);
+	}
+	else {
+		rspamd_printf ("Sent %L requests in %.3fs, %L replies (%.2f rps), "
+				"%L timeouts, %L errors, %L hashes found\n",
+				total_sent, elapsed, total_replied,
+				elapsed > 0 ? total_replied / elapsed : 0.0,
+				ctx->timeouts, ctx->errors, ctx->found);
+		rspamd_printf ("%-8s %10s %10s %10s %10s %10s %10s\n", "command",
+				"sent", "replied", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+		for (i = 0; i < G_N_ELEMENTS (cmd_names); i ++) {
+			if (ctx->sent[i] == 0) {
+				continue;
+			}
+
+			ar = ctx->latencies[i];
+			rspamd_printf ("%-8s %10L %10L %10.3f %10.3f %10.3f %10.3f\n",
+					cmd_names[i], ctx->sent[i], ctx->replied[i],
+					fuzzy_bench_percentile (ar, 0.5),
+					fuzzy_bench_percentile (ar, 0.9),
+					fuzzy_bench_percentile (ar, 0.99),
+					fuzzy_bench_percentile (ar, 1.0));
+		}
+	}
+
+	ucl_object_unref (top);
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct fuzzy_bench_ctx ctx;
+	rspamd_inet_addr_t *addr;
+	struct timeval tv;
+	gdouble elapsed;
+	guint i;
+
+	rspamd_init_libs ();
+
+	context = g_option_context_new (
+			"rspamd-fuzzy-bench - load generator for fuzzy storage");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd fuzzy storage benchmark "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (check_ratio + write_ratio + del_ratio == 0) {
+		rspamd_fprintf (stderr, "at least one command weight must be set\n");
+		exit (1);
+	}
+
+	if (!rspamd_parse_inet_address (&addr, host, 0)) {
+		rspamd_fprintf (stderr, "invalid address: %s\n", host);
+		exit (1);
+	}
+
+	rspamd_inet_address_set_port (addr, port);
+	memset (&ctx, 0, sizeof (ctx));
+
+	if (server_key) {
+		ctx.peer_key = rspamd_pubkey_from_base32 (server_key, 0,
+				RSPAMD_KEYPAIR_KEX, RSPAMD_CRYPTOBOX_MODE_25519);
+
+		if (ctx.peer_key == NULL) {
+			rspamd_fprintf (stderr, "invalid key: %s\n", server_key);
+			exit (1);
+		}
+
+		ctx.local_key = rspamd_keypair_new (RSPAMD_KEYPAIR_KEX,
+				RSPAMD_CRYPTOBOX_MODE_25519);
+		ctx.keypairs_cache = rspamd_keypair_cache_new (10);
+	}
+
+	ctx.fd = rspamd_inet_address_connect (addr, SOCK_DGRAM, TRUE);
+
+	if (ctx.fd == -1) {
+		rspamd_fprintf (stderr, "cannot connect to %s: %s\n",
+				rspamd_inet_address_to_string_pretty (addr), strerror (errno));
+		exit (1);
+	}
+
+	ctx.pending = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			NULL, g_free);
+
+	for (i = 0; i < G_N_ELEMENTS (cmd_names); i ++) {
+		ctx.latencies[i] = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	}
+
+	ctx.ev_base = event_init ();
+	event_set (&ctx.io_ev, ctx.fd, EV_READ | EV_PERSIST, fuzzy_bench_read,
+			&ctx);
+	event_base_set (ctx.ev_base, &ctx.io_ev);
+	event_add (&ctx.io_ev, NULL);
+
+	double_to_tv (1.0 / FUZZY_BENCH_TICKS, &ctx.send_tv);
+	event_set (&ctx.send_ev, -1, EV_TIMEOUT | EV_PERSIST, fuzzy_bench_send,
+			&ctx);
+	event_base_set (ctx.ev_base, &ctx.send_ev);
+	event_add (&ctx.send_ev, &ctx.send_tv);
+
+	double_to_tv (MIN (timeout, 0.1), &tv);
+	event_set (&ctx.sweep_ev, -1, EV_TIMEOUT | EV_PERSIST, fuzzy_bench_sweep,
+			&ctx);
+	event_base_set (ctx.ev_base, &ctx.sweep_ev);
+	event_add (&ctx.sweep_ev, &tv);
+
+	double_to_tv (test_time, &tv);
+	event_set (&ctx.stop_ev, -1, EV_TIMEOUT, fuzzy_bench_stop, &ctx);
+	event_base_set (ctx.ev_base, &ctx.stop_ev);
+	event_add (&ctx.stop_ev, &tv);
+
+	ctx.start = rspamd_get_ticks ();
+	event_base_loop (ctx.ev_base, 0);
+	elapsed = rspamd_get_ticks () - ctx.start;
+
+	/* Requests still in flight are waited for up to the timeout */
+	if (g_hash_table_size (ctx.pending) > 0) {
+		double_to_tv (timeout, &tv);
+		event_base_loopexit (ctx.ev_base, &tv);
+		event_base_loop (ctx.ev_base, 0);
+		ctx.timeouts += g_hash_table_size (ctx.pending);
+	}
+
+	fuzzy_bench_report (&ctx, elapsed);
+
+	event_del (&ctx.io_ev);
+	close (ctx.fd);
+	g_hash_table_unref (ctx.pending);
+
+	for (i = 0; i < G_N_ELEMENTS (cmd_names); i ++) {
+		g_array_free (ctx.latencies[i], TRUE);
+	}
+
+	if (ctx.peer_key) {
+		rspamd_pubkey_unref (ctx.peer_key);
+		rspamd_keypair_unref (ctx.local_key);
+		rspamd_keypair_cache_destroy (ctx.keypairs_cache);
+	}
+
+	rspamd_inet_address_destroy (addr);
+
+	return 0;
+}
@@ -0,0 +1,523 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Fixed input microbenchmarks for the message processing primitives
+ */
+
+#include "config.h"
+#include "printf.h"
+#include "message.h"
+#include "util.h"
+#include "task.h"
+#include "mime_parser.h"
+#include "url.h"
+#include "html.h"
+#include "re_cache.h"
+#include "shingles.h"
+#include "libstat/stat_internal.h"
+#include "libstat/tokenizers/tokenizers.h"
+#include "unix-std.h"
+
+static guint iterations = 1000;
+static gboolean json = FALSE;
+static gchar *message_file = NULL;
+static gchar *filter = NULL;
+
+static GOptionEntry entries[] = {
+		{"iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+				"Iterations per benchmark (default: 1000)", NULL},
+		{"json", 'j', 0, G_OPTION_ARG_NONE, &json,
+				"Output results in json", NULL},
+		{"message", 'm', 0, G_OPTION_ARG_FILENAME, &message_file,
+				"Use message from file instead of the builtin one", NULL},
+		{"filter", 'f', 0, G_OPTION_ARG_STRING, &filter,
+				"Run benchmarks whose name contains this string", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const gchar *bench_words[] = {
+		"lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+		"adipiscing", "elit", "sed", "do", "eiusmod", "tempor",
+		"incididunt", "ut", "labore", "et", "dolore", "magna", "aliqua",
+		"enim", "minim", "veniam", "quis", "nostrud", "exercitation",
+		"ullamco", "laboris", "nisi", "aliquip", "commodo", "consequat"
+};
+
+static const gchar *bench_urls[] = {
+		"http://example.com/path/to/page.html",
+		"https://www.example.org/index.php?id=10&ref=mail",
+		"www.example.net/offer",
+		"http://192.168.1.1/login",
+		"https://sub.domain.example.co.uk/a/b/c?d=e#f",
+		"user@example.com"
+};
+
+static const gchar *bench_regexps[] = {
+		"/viagra/i",
+		"/\\bfree\\s+money\\b/i",
+		"/click\\s+here/i",
+		"/unsubscribe/i",
+		"/[0-9]{3}-[0-9]{3}-[0-9]{4}/",
+		"/https?:\\/\\/[^\\s]+\\.(ru|cn|info)\\b/i",
+		"/\\$[0-9]+(\\.[0-9]{2})?/",
+		"/lorem\\s+ipsum\\s+dolor/",
+		"/(?:urgent|immediately|act now)/i",
+		"/\\bpassword\\b/i"
+};
+
+#define BENCH_PARAGRAPHS 200
+
+struct micro_bench_ctx {
+	struct rspamd_config *cfg;
+	const gchar *msg;
+	gsize msg_len;
+	GByteArray *html;
+	struct rspamd_task *task;
+	struct rspamd_mime_text_part *text_part;
+	GArray *words;
+	struct rspamd_stat_ctx stat_ctx;
+	struct rspamd_re_cache *re_cache;
+	GPtrArray *regexps;
+	rspamd_mempool_t *pool;
+};
+
+struct micro_bench {
+	const gchar *name;
+	/* Returns number of bytes processed */
+	gsize (*func) (struct micro_bench_ctx *ctx);
+};
+
+/* Deterministic multipart message with text and html alternatives */
+static gchar *
+micro_bench_generate_message (gsize *len, GByteArray **html)
+{
+	GString *out, *text, *ht;
+	guint i, j, w = 0;
+	const gchar *url;
+
+	text = g_string_sized_new (BENCH_PARAGRAPHS * 256);
+	ht = g_string_sized_new (BENCH_PARAGRAPHS * 512);
+	g_string_append (ht, "<html><head><title>Lorem ipsum</title>"
+			"<style>p {color: #333333;}</style></head><body>\n");
+
+	for (i = 0; i < BENCH_PARAGRAPHS; i ++) {
+		g_string_append (ht, "<p>");
+
+		for (j = 0; j < 24; j ++) {
+			g_string_append_printf (text, "%s ",
+					bench_words[w % G_N_ELEMENTS (bench_words)]);
+			g_string_append_printf (ht, "%s&nbsp;",
+					bench_words[w % G_N_ELEMENTS (bench_words)]);
+			w += 7;
+		}
+
+		url = bench_urls[i % G_N_ELEMENTS (bench_urls)];
+		g_string_append_printf (text, "%s\r\n\r\n", url);
+		g_string_append_printf (ht, "<a href=\"%s\">%s</a>"
+				"<img src=\"http://img.example.com/%u.png\" width=1 height=1>"
+				"</p>\n", url, url, i);
+	}
+
+	g_string_append (ht, "</body></html>\n");
+
+	out = g_string_sized_new (text->len + ht->len + 1024);
+	g_string_append (out,
+			"From: Sender <sender@example.com>\r\n"
+			"To: Recipient <rcpt@example.org>\r\n"
+			"Subject: Lorem ipsum dolor sit amet\r\n"
+			"Date: Thu, 1 Jun 2017 10:00:00 +0000\r\n"
+			"Message-ID: <bench@example.com>\r\n"
+			"Received: from mail.example.com (mail.example.com [192.0.2.1])\r\n"
+			"\tby mx.example.org with ESMTPS id 1234567890\r\n"
+			"\tfor <rcpt@example.org>; Thu, 1 Jun 2017 10:00:00 +0000\r\n"
+			"MIME-Version: 1.0\r\n"
+			"Content-Type: multipart/alternative; boundary=\"bench\"\r\n"
+			"\r\n"
+			"--bench\r\n"
+			"Content-Type: text/plain; charset=utf-8\r\n"
+			"Content-Transfer-Encoding: 8bit\r\n"
+			"\r\n");
+	g_string_append_len (out, text->str, text->len);
+	g_string_append (out,
+			"\r\n--bench\r\n"
+			"Content-Type: text/html; charset=utf-8\r\n"
+			"Content-Transfer-Encoding: 8bit\r\n"
+			"\r\n");
+	g_string_append_len (out, ht->str, ht->len);
+	g_string_append (out, "\r\n--bench--\r\n");
+
+	*html = g_byte_array_sized_new (ht->len);
+	g_byte_array_append (*html, ht->str, ht->len);
+	*len = out->len;
+	g_string_free (text, TRUE);
+	g_string_free (ht, TRUE);
+
+	return g_string_free (out, FALSE);
+}
+
+static gsize
+micro_bench_mime_parse (struct micro_bench_ctx *ctx)
+{
+	struct rspamd_task *task;
+	GError *err = NULL;
+
+	task = rspamd_task_new (NULL, ctx->cfg);
+	task->msg.begin = ctx->msg;
+	task->msg.len = ctx->msg_len;
+
+	if (!rspamd_mime_parse_task (task, &err)) {
+		g_error_free (err);
+	}
+
+	rspamd_task_free (task);
+
+	return ctx->msg_len;
+}
+
+static gsize
+micro_bench_url_extract (struct micro_bench_ctx *ctx)
+{
+	struct rspamd_mime_text_part *part;
+	gsize processed = 0;
+	guint i;
+
+	for (i = 0; i < ctx->task->text_parts->len; i ++) {
+		part = g_ptr_array_index (ctx->task->text_parts, i);
+
+		if (part->content) {
+			rspamd_url_text_extract (ctx->task->task_pool, ctx->task, part,
+					IS_PART_HTML (part));
+			processed += part->content->len;
+		}
+	}
+
+	return processed;
+}
+
+static gsize
+micro_bench_html (struct micro_bench_ctx *ctx)
+{
+	struct html_content *hc;
+	GByteArray *res;
+
+	hc = rspamd_mempool_alloc0 (ctx->pool, sizeof (*hc));
+	res = rspamd_html_process_part (ctx->pool, hc, ctx->html);
+
+	if (res) {
+		g_byte_array_free (res, TRUE);
+	}
+
+	return ctx->html->len;
+}
+
+static gsize
+micro_bench_tokenize (struct micro_bench_ctx *ctx)
+{
+	GArray *words;
+	GByteArray *content = ctx->text_part->content;
+
+	words = rspamd_tokenize_text ((gchar *)content->data, content->len, TRUE,
+			ctx->cfg, NULL, FALSE, NULL);
+
+	if (words) {
+		g_array_free (words, TRUE);
+	}
+
+	return content->len;
+}
+
+static gsize
+micro_bench_osb (struct micro_bench_ctx *ctx)
+{
+	struct rspamd_stat_tokens *tokens;
+
+	tokens = rspamd_stat_tokens_new (ctx->pool, ctx->words->len * 4, 1);
+	rspamd_tokenizer_osb (&ctx->stat_ctx, ctx->pool, ctx->words, TRUE,
+			NULL, tokens);
+
+	return ctx->text_part->content->len;
+}
+
+static gsize
+micro_bench_shingles (struct micro_bench_ctx *ctx)
+{
+	static const guchar key[16] = "rspamd_benchmark";
+
+	(void)rspamd_shingles_from_text (ctx->words, key, ctx->pool,
+			rspamd_shingles_default_filter, NULL, RSPAMD_SHINGLES_MUMHASH);
+
+	return ctx->text_part->content->len;
+}
+
+static gsize
+micro_bench_re_cache (struct micro_bench_ctx *ctx)
+{
+	struct rspamd_re_runtime *rt, *saved;
+	guint i;
+
+	/* Results are cached per runtime, so each pass needs a new one */
+	rt = rspamd_re_cache_runtime_new (ctx->re_cache);
+	saved = ctx->task->re_rt;
+	ctx->task->re_rt = rt;
+
+	for (i = 0; i < ctx->regexps->len; i ++) {
+		(void)rspamd_re_cache_process (ctx->task,
+				g_ptr_array_index (ctx->regexps, i),
+				i % 2 ? RSPAMD_RE_MIME : RSPAMD_RE_BODY,
+				NULL, 0, FALSE);
+	}
+
+	ctx->task->re_rt = saved;
+	rspamd_re_cache_runtime_destroy (rt);
+
+	return ctx->msg_len;
+}
+
+static const struct micro_bench benches[] = {
+		{"mime_parse", micro_bench_mime_parse},
+		{"url_text_extract", micro_bench_url_extract},
+		{"html_process_part", micro_bench_html},
+		{"tokenize_text", micro_bench_tokenize},
+		{"tokenizer_osb", micro_bench_osb},
+		{"shingles_from_text", micro_bench_shingles},
+		{"re_cache_process", micro_bench_re_cache},
+};
+
+static gboolean
+micro_bench_prepare (struct micro_bench_ctx *ctx)
+{
+	struct rspamd_mime_text_part *part;
+	rspamd_regexp_t *re;
+	GError *err = NULL;
+	gsize tklen;
+	guint i;
+
+	ctx->task = rspamd_task_new (NULL, ctx->cfg);
+	ctx->task->msg.begin = ctx->msg;
+	ctx->task->msg.len = ctx->msg_len;
+
+	if (!rspamd_message_parse (ctx->task)) {
+		rspamd_fprintf (stderr, "cannot parse benchmark message\n");
+
+		return FALSE;
+	}
+
+	for (i = 0; i < ctx->task->text_parts->len; i ++) {
+		part = g_ptr_array_index (ctx->task->text_parts, i);
+
+		if (part->content && part->content->len > 0 &&
+				(ctx->text_part == NULL || !IS_PART_HTML (part))) {
+			ctx->text_part = part;
+		}
+	}
+
+	if (ctx->text_part == NULL) {
+		rspamd_fprintf (stderr, "benchmark message has no text parts\n");
+
+		return FALSE;
+	}
+
+	if (ctx->html == NULL) {
+		ctx->html = g_byte_array_new ();
+		g_byte_array_append (ctx->html, ctx->text_part->content->data,
+				ctx->text_part->content->len);
+	}
+
+	ctx->words = rspamd_tokenize_text ((gchar *)ctx->text_part->content->data,
+			ctx->text_part->content->len, TRUE, ctx->cfg, NULL, FALSE, NULL);
+
+	if (ctx->words == NULL) {
+		ctx->words = g_array_new (FALSE, FALSE, sizeof (rspamd_stat_token_t));
+	}
+
+	ctx->stat_ctx.cfg = ctx->cfg;
+	ctx->stat_ctx.tkcf = rspamd_tokenizer_osb_get_config (ctx->cfg->cfg_pool,
+			NULL, &tklen);
+
+	ctx->re_cache = rspamd_re_cache_new ();
+	ctx->regexps = g_ptr_array_new ();
+
+	for (i = 0; i < G_N_ELEMENTS (bench_regexps); i ++) {
+		re = rspamd_regexp_new (bench_regexps[i], NULL, &err);
+
+		if (re == NULL) {
+			rspamd_fprintf (stderr, "cannot compile %s: %e\n",
+					bench_regexps[i], err);
+			g_error_free (err);
+			err = NULL;
+
+			continue;
+		}
+
+		g_ptr_array_add (ctx->regexps, rspamd_re_cache_add (ctx->re_cache,
+				re, i % 2 ? RSPAMD_RE_MIME : RSPAMD_RE_BODY, NULL, 0));
+		rspamd_regexp_unref (re);
+	}
+
+	rspamd_re_cache_init (ctx->re_cache, ctx->cfg);
+
+	return TRUE;
+}
+
+static ucl_object_t *
+micro_bench_run (const struct micro_bench *bench, struct micro_bench_ctx *ctx)
+{
+	ucl_object_t *res;
+	gdouble t1, t2, elapsed;
+	gsize bytes = 0;
+	guint i, niter = MAX (iterations, 1);
+
+	/* Warm up caches and lazy initialisation */
+	ctx->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "bench");
+	bench->func (ctx);
+	rspamd_mempool_delete (ctx->pool);
+
+	t1 = rspamd_get_virtual_ticks ();
+
+	for (i = 0; i < niter; i ++) {
+		ctx->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+				"bench");
+		bytes += bench->func (ctx);
+		rspamd_mempool_delete (ctx->pool);
+	}
+
+	t2 = rspamd_get_virtual_ticks ();
+	elapsed = t2 - t1;
+	ctx->pool = NULL;
+
+	res = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (res, ucl_object_fromstring (bench->name),
+			"name", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (niter),
+			"iterations", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (bytes / niter),
+			"bytes", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromdouble (elapsed),
+			"time", 0, false);
+	ucl_object_insert_key (res,
+			ucl_object_fromdouble (elapsed * 1e9 / niter),
+			"ns_per_op", 0, false);
+	ucl_object_insert_key (res,
+			ucl_object_fromdouble (elapsed > 0 ?
+					bytes / elapsed / (1024.0 * 1024.0) : 0),
+			"mb_per_sec", 0, false);
+
+	return res;
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_config *cfg;
+	struct micro_bench_ctx ctx;
+	rspamd_logger_t *logger = NULL;
+	ucl_object_t *top, *res;
+	rspamd_fstring_t *out;
+	gchar *data = NULL;
+	gsize len;
+	guint i;
+
+	context = g_option_context_new ("- run microbenchmarks");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	cfg = rspamd_config_new ();
+	cfg->libs_ctx = rspamd_init_libs ();
+	cfg->log_type = RSPAMD_LOG_CONSOLE;
+	cfg->log_level = G_LOG_LEVEL_WARNING;
+	rspamd_set_logger (cfg, g_quark_from_static_string ("bench"), &logger, NULL);
+	(void) rspamd_log_open (logger);
+	g_log_set_default_handler (rspamd_glib_log_function, logger);
+	g_set_printerr_handler (rspamd_glib_printerr_function);
+	rspamd_config_post_load (cfg,
+			RSPAMD_CONFIG_INIT_LIBS|RSPAMD_CONFIG_INIT_URL|RSPAMD_CONFIG_INIT_NO_TLD);
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.cfg = cfg;
+
+	if (message_file) {
+		if (!g_file_get_contents (message_file, &data, &len, &error)) {
+			rspamd_fprintf (stderr, "cannot read %s: %e\n", message_file,
+					error);
+			g_error_free (error);
+			exit (EXIT_FAILURE);
+		}
+	}
+	else {
+		data = micro_bench_generate_message (&len, &ctx.html);
+	}
+
+	ctx.msg = data;
+	ctx.msg_len = len;
+
+	if (!micro_bench_prepare (&ctx)) {
+		exit (EXIT_FAILURE);
+	}
+
+	top = ucl_object_typed_new (UCL_ARRAY);
+
+	if (!json) {
+		rspamd_printf ("%-20s %10s %10s %14s %10s\n", "benchmark",
+				"iterations", "bytes", "ns/op", "MB/s");
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (benches); i ++) {
+		if (filter && strstr (benches[i].name, filter) == NULL) {
+			continue;
+		}
+
+		res = micro_bench_run (&benches[i], &ctx);
+
+		if (!json) {
+			rspamd_printf ("%-20s %10L %10L %14.1f %10.2f\n",
+					benches[i].name,
+					ucl_object_toint (ucl_object_lookup (res, "iterations")),
+					ucl_object_toint (ucl_object_lookup (res, "bytes")),
+					ucl_object_todouble (ucl_object_lookup (res, "ns_per_op")),
+					ucl_object_todouble (ucl_object_lookup (res, "mb_per_sec")));
+		}
+
+		ucl_array_append (top, res);
+	}
+
+	if (json) {
+		out = rspamd_fstring_new ();
+		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT, &out);
+		rspamd_printf ("%V\n", out);
+		rspamd_fstring_free (out);
+	}
+
+	ucl_object_unref (top);
+	g_array_free (ctx.words, TRUE);
+	g_byte_array_free (ctx.html, TRUE);
+	g_ptr_array_free (ctx.regexps, TRUE);
+	rspamd_re_cache_unref (ctx.re_cache);
+	rspamd_task_free (ctx.task);
+	g_free (data);
+
+	rspamd_log_close (logger);
+	REF_RELEASE (cfg);
+
+	return 0;
+}
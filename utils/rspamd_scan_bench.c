@@ -0,0 +1,777 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replays a corpus of messages through the full scan pipeline in process.
+ * DNS and Redis requests are answered by local fake servers, so results
+ * depend merely on the configuration and the corpus.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libserver/dns.h"
+#include "libserver/worker_util.h"
+#include "libstat/stat_api.h"
+#include "lua/lua_common.h"
+#include "unix-std.h"
+#include <math.h>
+
+struct rspamd_main *rspamd_main = NULL;
+extern module_t *modules[];
+extern worker_t *workers[];
+
+static gchar *config = NULL;
+static guint concurrency = 1;
+static guint repeat = 1;
+static gboolean json = FALSE;
+static gboolean no_fake_redis = FALSE;
+
+static GOptionEntry entries[] = {
+		{"config", 'c', 0, G_OPTION_ARG_FILENAME, &config,
+				"Config file to load (default: " RSPAMD_CONFDIR "/rspamd.conf)", NULL},
+		{"concurrency", 'C', 0, G_OPTION_ARG_INT, &concurrency,
+				"Number of messages scanned in parallel (default: 1)", NULL},
+		{"repeat", 'r', 0, G_OPTION_ARG_INT, &repeat,
+				"Number of corpus passes (default: 1)", NULL},
+		{"json", 'j', 0, G_OPTION_ARG_NONE, &json,
+				"Output results in json", NULL},
+		{"no-fake-redis", 0, 0, G_OPTION_ARG_NONE, &no_fake_redis,
+				"Use redis servers from the config", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+#define FAKE_REDIS_NIL "$-1\r\n"
+
+struct scan_bench_msg {
+	gchar *data;
+	gsize len;
+};
+
+struct scan_bench_ctx {
+	struct rspamd_config *cfg;
+	struct rspamd_worker *worker;
+	struct rspamd_dns_resolver *resolver;
+	struct event_base *ev_base;
+	GPtrArray *messages;
+	guint next;
+	guint total;
+	guint pending;
+	guint scanned;
+	guint failed;
+	GArray *latencies;
+	GArray *stages[RSPAMD_TASK_STAGES_COUNT];
+};
+
+struct fake_redis_conn {
+	gint fd;
+	struct event ev;
+	GString *buf;
+};
+
+/* Answers all DNS queries with NXDOMAIN */
+static void
+fake_dns_handler (gint fd, short what, gpointer ud)
+{
+	guchar buf[1024];
+	struct sockaddr_storage sa;
+	socklen_t salen = sizeof (sa);
+	gssize r, pos = 12;
+
+	r = recvfrom (fd, buf, sizeof (buf), 0, (struct sockaddr *)&sa, &salen);
+
+	if (r < 12) {
+		return;
+	}
+
+	/* Keep just the question section */
+	if (buf[4] != 0 || buf[5] != 0) {
+		while (pos < r && buf[pos] != 0) {
+			pos += buf[pos] + 1;
+		}
+
+		pos += 5;
+
+		if (pos > r) {
+			return;
+		}
+	}
+
+	buf[2] |= 0x80;
+	buf[3] = 0x80 | 3;
+	memset (&buf[6], 0, 6);
+
+	if (sendto (fd, buf, pos, 0, (struct sockaddr *)&sa, salen) == -1) {
+		msg_debug ("cannot reply to dns query: %s", strerror (errno));
+	}
+}
+
+/* Returns length of a complete RESP command, 0 if it is incomplete */
+static gsize
+fake_redis_command_len (const gchar *p, gsize len)
+{
+	const gchar *end = p + len, *c = p, *nl;
+	gulong nargs, alen, i;
+
+	nl = memchr (c, '\n', end - c);
+
+	if (nl == NULL) {
+		return 0;
+	}
+
+	if (*c != '*') {
+		/* Inline command */
+		return nl - p + 1;
+	}
+
+	nargs = strtoul (c + 1, NULL, 10);
+	c = nl + 1;
+
+	for (i = 0; i < nargs; i ++) {
+		nl = memchr (c, '\n', end - c);
+
+		if (nl == NULL) {
+			return 0;
+		}
+
+		alen = strtoul (c + 1, NULL, 10);
+		c = nl + 1;
+
+		if ((gsize)(end - c) < alen + 2) {
+			return 0;
+		}
+
+		c += alen + 2;
+	}
+
+	return c - p;
+}
+
+/* Replies nil to every command */
+static void
+fake_redis_read (gint fd, short what, gpointer ud)
+{
+	struct fake_redis_conn *conn = ud;
+	gchar buf[BUFSIZ];
+	gssize r;
+	gsize clen;
+
+	r = read (fd, buf, sizeof (buf));
+
+	if (r <= 0) {
+		if (r == -1 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+
+		event_del (&conn->ev);
+		close (conn->fd);
+		g_string_free (conn->buf, TRUE);
+		g_free (conn);
+
+		return;
+	}
+
+	g_string_append_len (conn->buf, buf, r);
+
+	while (conn->buf->len > 0 &&
+			(clen = fake_redis_command_len (conn->buf->str, conn->buf->len)) > 0) {
+		g_string_erase (conn->buf, 0, clen);
+
+		if (write (fd, FAKE_REDIS_NIL, sizeof (FAKE_REDIS_NIL) - 1) == -1) {
+			msg_debug ("cannot reply to redis command: %s", strerror (errno));
+		}
+	}
+}
+
+static void
+fake_redis_accept (gint fd, short what, gpointer ud)
+{
+	struct event_base *ev_base = ud;
+	struct fake_redis_conn *conn;
+	gint nfd;
+
+	nfd = accept (fd, NULL, NULL);
+
+	if (nfd == -1) {
+		return;
+	}
+
+	conn = g_malloc0 (sizeof (*conn));
+	conn->fd = nfd;
+	conn->buf = g_string_sized_new (BUFSIZ);
+	event_set (&conn->ev, nfd, EV_READ | EV_PERSIST, fake_redis_read, conn);
+	event_base_set (ev_base, &conn->ev);
+	event_add (&conn->ev, NULL);
+}
+
+/* Binds socket on a random local port */
+static gint
+fake_server_listen (gint type, guint16 *port)
+{
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof (sin);
+	gint fd;
+
+	fd = socket (AF_INET, type, 0);
+
+	if (fd == -1) {
+		return -1;
+	}
+
+	memset (&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	if (bind (fd, (struct sockaddr *)&sin, sizeof (sin)) == -1 ||
+			(type == SOCK_STREAM && listen (fd, 128) == -1) ||
+			getsockname (fd, (struct sockaddr *)&sin, &slen) == -1) {
+		close (fd);
+
+		return -1;
+	}
+
+	rspamd_socket_nonblocking (fd);
+	*port = ntohs (sin.sin_port);
+
+	return fd;
+}
+
+static void
+scan_bench_add_message (GPtrArray *messages, const gchar *data, gsize len)
+{
+	struct scan_bench_msg *m;
+
+	if (len == 0) {
+		return;
+	}
+
+	m = g_malloc (sizeof (*m));
+	m->data = g_malloc (len);
+	memcpy (m->data, data, len);
+	m->len = len;
+	g_ptr_array_add (messages, m);
+}
+
+/* Splits mbox on `From ` lines, otherwise a file is a single message */
+static void
+scan_bench_load_file (GPtrArray *messages, const gchar *fname)
+{
+	gchar *data, *p, *end, *start;
+	gsize len;
+	GError *err = NULL;
+
+	if (!g_file_get_contents (fname, &data, &len, &err)) {
+		rspamd_fprintf (stderr, "cannot read %s: %e\n", fname, err);
+		g_error_free (err);
+
+		return;
+	}
+
+	if (len > 5 && memcmp (data, "From ", 5) == 0) {
+		end = data + len;
+		start = NULL;
+		p = data;
+
+		while (p < end) {
+			if (end - p > 5 && memcmp (p, "From ", 5) == 0 &&
+					(p == data || p[-1] == '\n')) {
+				if (start) {
+					scan_bench_add_message (messages, start, p - start);
+				}
+
+				p = memchr (p, '\n', end - p);
+
+				if (p == NULL) {
+					break;
+				}
+
+				start = ++p;
+				continue;
+			}
+
+			p = memchr (p, '\n', end - p);
+
+			if (p == NULL) {
+				break;
+			}
+
+			p ++;
+		}
+
+		if (start) {
+			scan_bench_add_message (messages, start, end - start);
+		}
+	}
+	else {
+		scan_bench_add_message (messages, data, len);
+	}
+
+	g_free (data);
+}
+
+static void
+scan_bench_load_path (GPtrArray *messages, const gchar *path)
+{
+	GDir *dir;
+	const gchar *name;
+	gchar *fpath;
+
+	if (g_file_test (path, G_FILE_TEST_IS_DIR)) {
+		dir = g_dir_open (path, 0, NULL);
+
+		if (dir == NULL) {
+			rspamd_fprintf (stderr, "cannot open directory %s\n", path);
+
+			return;
+		}
+
+		while ((name = g_dir_read_name (dir)) != NULL) {
+			fpath = g_build_filename (path, name, NULL);
+			scan_bench_load_path (messages, fpath);
+			g_free (fpath);
+		}
+
+		g_dir_close (dir);
+	}
+	else if (g_file_test (path, G_FILE_TEST_IS_REGULAR)) {
+		scan_bench_load_file (messages, path);
+	}
+}
+
+static void scan_bench_start_task (struct scan_bench_ctx *ctx);
+
+static struct timeval zero_tv = {0, 0};
+
+static void
+scan_bench_next (struct scan_bench_ctx *ctx)
+{
+	ctx->pending --;
+
+	if (ctx->next < ctx->total) {
+		scan_bench_start_task (ctx);
+	}
+	else if (ctx->pending == 0) {
+		event_base_loopexit (ctx->ev_base, NULL);
+	}
+}
+
+static void
+scan_bench_task_done (gint fd, short what, gpointer ud)
+{
+	struct rspamd_task *task = ud;
+	struct scan_bench_ctx *ctx = task->fin_arg;
+
+	rspamd_session_destroy (task->s);
+	scan_bench_next (ctx);
+}
+
+static gboolean
+scan_bench_task_fin (struct rspamd_task *task, void *ud)
+{
+	struct scan_bench_ctx *ctx = ud;
+	gdouble elapsed;
+	guint i;
+
+	elapsed = rspamd_get_ticks () - task->time_real;
+	g_array_append_val (ctx->latencies, elapsed);
+
+	if (task->stage_timings) {
+		for (i = 0; i < RSPAMD_TASK_STAGES_COUNT; i ++) {
+			if (task->stage_timings[i].time > 0) {
+				g_array_append_val (ctx->stages[i],
+						task->stage_timings[i].time);
+			}
+		}
+	}
+
+	if (task->err) {
+		ctx->failed ++;
+	}
+
+	ctx->scanned ++;
+	/* Task cannot be destroyed from its own finalizer */
+	event_base_once (ctx->ev_base, -1, EV_TIMEOUT, scan_bench_task_done,
+			task, &zero_tv);
+
+	return TRUE;
+}
+
+static void
+scan_bench_start_task (struct scan_bench_ctx *ctx)
+{
+	struct rspamd_task *task;
+	struct scan_bench_msg *m;
+
+	m = g_ptr_array_index (ctx->messages, ctx->next % ctx->messages->len);
+	ctx->next ++;
+	ctx->pending ++;
+
+	task = rspamd_task_new (ctx->worker, ctx->cfg);
+	task->ev_base = ctx->ev_base;
+	task->resolver = ctx->resolver;
+	task->flags |= RSPAMD_TASK_FLAG_PROFILE;
+	task->fin_callback = scan_bench_task_fin;
+	task->fin_arg = ctx;
+	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
+			rspamd_task_restore, (event_finalizer_t)rspamd_task_free, task);
+
+	if (!rspamd_task_load_message (task, NULL, m->data, m->len) ||
+			!rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL)) {
+		ctx->failed ++;
+		event_base_once (ctx->ev_base, -1, EV_TIMEOUT, scan_bench_task_done,
+				task, &zero_tv);
+	}
+}
+
+static gint
+scan_bench_cmp (gconstpointer a, gconstpointer b)
+{
+	gdouble d1 = *(const gdouble *)a, d2 = *(const gdouble *)b;
+
+	return d1 < d2 ? -1 : (d1 > d2 ? 1 : 0);
+}
+
+static gdouble
+scan_bench_percentile (GArray *ar, gdouble p)
+{
+	guint idx;
+
+	if (ar->len == 0) {
+		return 0;
+	}
+
+	idx = MIN ((guint)ceil (p * ar->len), ar->len) - 1;
+
+	return g_array_index (ar, gdouble, idx) * 1000.0;
+}
+
+static ucl_object_t *
+scan_bench_percentiles_ucl (GArray *ar)
+{
+	ucl_object_t *obj;
+
+	g_array_sort (ar, scan_bench_cmp);
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (ar->len),
+			"count", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (scan_bench_percentile (ar, 0.5)),
+			"p50", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (scan_bench_percentile (ar, 0.9)),
+			"p90", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (scan_bench_percentile (ar, 0.99)),
+			"p99", 0, false);
+
+	return obj;
+}
+
+static void
+scan_bench_print_percentiles (const gchar *name, const ucl_object_t *obj)
+{
+	rspamd_printf ("%-20s %8L %10.3f %10.3f %10.3f\n",
+			name,
+			ucl_object_toint (ucl_object_lookup (obj, "count")),
+			ucl_object_todouble (ucl_object_lookup (obj, "p50")),
+			ucl_object_todouble (ucl_object_lookup (obj, "p90")),
+			ucl_object_todouble (ucl_object_lookup (obj, "p99")));
+}
+
+static void
+scan_bench_report (struct scan_bench_ctx *ctx, gdouble elapsed,
+		rspamd_mempool_stat_t *mem_before, rspamd_mempool_stat_t *mem_after)
+{
+	ucl_object_t *top, *stages, *elt, *mem;
+	const ucl_object_t *cur;
+	ucl_object_iter_t it = NULL;
+	rspamd_fstring_t *out;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->scanned),
+			"scanned", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->failed),
+			"failed", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (elapsed),
+			"time", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (elapsed > 0 ? ctx->scanned / elapsed : 0),
+			"msgs_per_second", 0, false);
+	ucl_object_insert_key (top, scan_bench_percentiles_ucl (ctx->latencies),
+			"latency_ms", 0, false);
+
+	stages = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < RSPAMD_TASK_STAGES_COUNT; i ++) {
+		if (ctx->stages[i]->len > 0) {
+			ucl_object_insert_key (stages,
+					scan_bench_percentiles_ucl (ctx->stages[i]),
+					rspamd_task_stage_name (1 << i), 0, false);
+		}
+	}
+
+	ucl_object_insert_key (top, stages, "stages_ms", 0, false);
+
+	mem = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (mem, ucl_object_fromint (
+			mem_after->pools_allocated - mem_before->pools_allocated),
+			"pools", 0, false);
+	ucl_object_insert_key (mem, ucl_object_fromint (
+			mem_after->chunks_allocated - mem_before->chunks_allocated),
+			"chunks", 0, false);
+	ucl_object_insert_key (mem, ucl_object_fromint (
+			mem_after->oversized_chunks - mem_before->oversized_chunks),
+			"oversized_chunks", 0, false);
+	ucl_object_insert_key (mem, ucl_object_fromint (
+			mem_after->bytes_allocated - mem_before->bytes_allocated),
+			"bytes", 0, false);
+	ucl_object_insert_key (top, mem, "allocations", 0, false);
+
+	if (json) {
+		out = rspamd_fstring_new ();
+		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON, &out);
+		rspamd_printf ("%V\n", out);
+		rspamd_fstring_free (out);
+	}
+	else {
+		rspamd_printf ("Scanned %ud messages (%ud failed) in %.3f seconds: "
+				"%.2f msgs/sec\n\n",
+				ctx->scanned, ctx->failed, elapsed,
+				elapsed > 0 ? ctx->scanned / elapsed : 0.0);
+		rspamd_printf ("%-20s %8s %10s %10s %10s\n", "stage (ms)", "count",
+				"p50", "p90", "p99");
+		scan_bench_print_percentiles ("total",
+				ucl_object_lookup (top, "latency_ms"));
+
+		while ((cur = ucl_object_iterate (stages, &it, true)) != NULL) {
+			scan_bench_print_percentiles (ucl_object_key (cur), cur);
+		}
+
+		elt = mem;
+		rspamd_printf ("\nAllocations: %L pools, %L chunks (%L oversized), "
+				"%L bytes\n",
+				ucl_object_toint (ucl_object_lookup (elt, "pools")),
+				ucl_object_toint (ucl_object_lookup (elt, "chunks")),
+				ucl_object_toint (ucl_object_lookup (elt, "oversized_chunks")),
+				ucl_object_toint (ucl_object_lookup (elt, "bytes")));
+	}
+
+	ucl_object_unref (top);
+}
+
+static void
+config_logger (rspamd_mempool_t *pool, gpointer ud)
+{
+	struct rspamd_main *rm = ud;
+
+	rm->cfg->log_type = RSPAMD_LOG_CONSOLE;
+	rm->cfg->log_level = G_LOG_LEVEL_WARNING;
+	rspamd_set_logger (rm->cfg, g_quark_from_static_string ("scan_bench"),
+			&rm->logger, rm->server_pool);
+
+	if (rspamd_log_open (rm->logger) == -1) {
+		fprintf (stderr, "Fatal error, cannot open logfile, exiting\n");
+		exit (EXIT_FAILURE);
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_config *cfg;
+	struct rspamd_worker *worker;
+	struct scan_bench_ctx ctx;
+	struct event dns_ev, redis_ev;
+	rspamd_mempool_stat_t mem_before, mem_after;
+	ucl_object_t *redis;
+	gchar addrbuf[64];
+	guint16 dns_port = 0, redis_port = 0;
+	gint dns_fd, redis_fd = -1, i;
+	gdouble t1, t2;
+
+	context = g_option_context_new ("corpus... - replay messages through "
+			"the scan pipeline");
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	if (argc < 2) {
+		rspamd_fprintf (stderr, "corpus path is required\n");
+		exit (EXIT_FAILURE);
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.messages = g_ptr_array_new ();
+
+	for (i = 1; i < argc; i ++) {
+		scan_bench_load_path (ctx.messages, argv[i]);
+	}
+
+	if (ctx.messages->len == 0) {
+		rspamd_fprintf (stderr, "no messages found\n");
+		exit (EXIT_FAILURE);
+	}
+
+	cfg = rspamd_config_new ();
+	cfg->libs_ctx = rspamd_init_libs ();
+	rspamd_main = g_malloc0 (sizeof (*rspamd_main));
+	rspamd_main->cfg = cfg;
+	rspamd_main->pid = getpid ();
+	rspamd_main->type = g_quark_from_static_string ("main");
+	rspamd_main->server_pool = rspamd_mempool_new (
+			rspamd_mempool_suggest_size (), "scan_bench");
+	rspamd_main->stat = rspamd_mempool_alloc0 (rspamd_main->server_pool,
+			sizeof (*rspamd_main->stat));
+	config_logger (rspamd_main->server_pool, rspamd_main);
+	g_log_set_default_handler (rspamd_glib_log_function, rspamd_main->logger);
+	g_set_printerr_handler (rspamd_glib_printerr_function);
+
+	ctx.ev_base = event_init ();
+	dns_fd = fake_server_listen (SOCK_DGRAM, &dns_port);
+
+	if (dns_fd == -1) {
+		rspamd_fprintf (stderr, "cannot start fake dns server: %s\n",
+				strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	event_set (&dns_ev, dns_fd, EV_READ | EV_PERSIST, fake_dns_handler, NULL);
+	event_base_set (ctx.ev_base, &dns_ev);
+	event_add (&dns_ev, NULL);
+
+	if (!no_fake_redis) {
+		redis_fd = fake_server_listen (SOCK_STREAM, &redis_port);
+
+		if (redis_fd == -1) {
+			rspamd_fprintf (stderr, "cannot start fake redis server: %s\n",
+					strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+
+		event_set (&redis_ev, redis_fd, EV_READ | EV_PERSIST,
+				fake_redis_accept, ctx.ev_base);
+		event_base_set (ctx.ev_base, &redis_ev);
+		event_add (&redis_ev, NULL);
+	}
+
+	for (i = 0; workers[i] != NULL; i ++) {
+		(void)g_quark_from_static_string (workers[i]->name);
+	}
+
+	if (config == NULL) {
+		config = g_strdup_printf ("%s%c%s", RSPAMD_CONFDIR, G_DIR_SEPARATOR,
+				"rspamd.conf");
+	}
+
+	cfg->cache = rspamd_symbols_cache_new (cfg);
+	cfg->compiled_modules = modules;
+	cfg->compiled_workers = workers;
+	cfg->cfg_name = config;
+
+	if (!rspamd_config_read (cfg, cfg->cfg_name, NULL,
+			config_logger, rspamd_main, NULL)) {
+		rspamd_fprintf (stderr, "cannot load config %s\n", config);
+		exit (EXIT_FAILURE);
+	}
+
+	if (!cfg->temp_dir) {
+		cfg->temp_dir = rspamd_mempool_strdup (cfg->cfg_pool, "/tmp");
+	}
+
+	/* Modules read common redis settings when they are initialized */
+	if (redis_fd != -1) {
+		rspamd_snprintf (addrbuf, sizeof (addrbuf), "127.0.0.1:%d",
+				(gint)redis_port);
+		redis = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (redis, ucl_object_fromstring (addrbuf),
+				"servers", 0, false);
+		ucl_object_replace_key (cfg->rcl_obj, redis, "redis", 0, false);
+	}
+
+	rspamd_snprintf (addrbuf, sizeof (addrbuf), "127.0.0.1:%d",
+			(gint)dns_port);
+	cfg->nameservers = ucl_object_fromstring (addrbuf);
+	rspamd_mempool_add_destructor (cfg->cfg_pool,
+			(rspamd_mempool_destruct_t)ucl_object_unref,
+			(gpointer)cfg->nameservers);
+
+	rspamd_lua_post_load_config (cfg);
+
+	if (!rspamd_init_filters (cfg, FALSE) ||
+			!rspamd_config_post_load (cfg, RSPAMD_CONFIG_LOAD_ALL)) {
+		rspamd_fprintf (stderr, "cannot init config %s\n", config);
+		exit (EXIT_FAILURE);
+	}
+
+	/* Tasks are processed as if they were received by a scanner */
+	worker = g_malloc0 (sizeof (*worker));
+	worker->srv = rspamd_main;
+	worker->pid = getpid ();
+	worker->type = g_quark_from_static_string ("normal");
+	worker->start_time = rspamd_get_calendar_ticks ();
+	worker->finish_actions = g_ptr_array_new ();
+	ctx.worker = worker;
+	ctx.cfg = cfg;
+
+	ctx.resolver = dns_resolver_init (rspamd_main->logger, ctx.ev_base, cfg);
+	rspamd_map_watch (cfg, ctx.ev_base, ctx.resolver);
+	rspamd_upstreams_library_config (cfg, cfg->ups_ctx, ctx.ev_base,
+			ctx.resolver->r);
+	rspamd_stat_init (cfg, ctx.ev_base);
+	rspamd_lua_run_postloads (cfg->lua_state, cfg, ctx.ev_base, worker);
+
+	ctx.latencies = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+	for (i = 0; i < RSPAMD_TASK_STAGES_COUNT; i ++) {
+		ctx.stages[i] = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	}
+
+	ctx.total = ctx.messages->len * MAX (repeat, 1);
+	rspamd_mempool_stat (&mem_before);
+	t1 = rspamd_get_ticks ();
+
+	for (i = 0; i < (gint)MAX (concurrency, 1) && ctx.next < ctx.total; i ++) {
+		scan_bench_start_task (&ctx);
+	}
+
+	if (ctx.pending > 0) {
+		event_base_loop (ctx.ev_base, 0);
+	}
+
+	t2 = rspamd_get_ticks ();
+	rspamd_mempool_stat (&mem_after);
+	scan_bench_report (&ctx, t2 - t1, &mem_before, &mem_after);
+
+	rspamd_stat_close ();
+	event_del (&dns_ev);
+	close (dns_fd);
+
+	if (redis_fd != -1) {
+		event_del (&redis_ev);
+		close (redis_fd);
+	}
+
+	rspamd_log_close (rspamd_main->logger);
+	REF_RELEASE (cfg);
+
+	return 0;
+}